@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+
+#include "alloc-stats.h"
+
+static gsize alloc_stats_count [ALLOC_STATS_COUNT];
+static gsize alloc_stats_bytes [ALLOC_STATS_COUNT];
+
+static const gchar *alloc_stats_names [ALLOC_STATS_COUNT] = {
+    [ALLOC_STATS_COMMAND_BUFFERS]  = "command_buffers",
+    [ALLOC_STATS_RESPONSE_BUFFERS] = "response_buffers",
+    [ALLOC_STATS_MESSAGES]         = "messages",
+    [ALLOC_STATS_SESSION_ENTRIES]  = "session_entries",
+    [ALLOC_STATS_HANDLE_ENTRIES]   = "handle_entries",
+    [ALLOC_STATS_GET_CAP]          = "get_cap",
+};
+
+/*
+ * Count one allocation of 'bytes' made by 'kind'.
+ */
+void
+alloc_stats_add (AllocStatsKind kind,
+                 gsize          bytes)
+{
+    g_assert (kind < ALLOC_STATS_COUNT);
+    g_atomic_pointer_add (&alloc_stats_count [kind], 1);
+    if (bytes != 0) {
+        g_atomic_pointer_add (&alloc_stats_bytes [kind], (gssize)bytes);
+    }
+}
+/*
+ * Returns the number of allocations counted for 'kind'.
+ */
+guint64
+alloc_stats_get_count (AllocStatsKind kind)
+{
+    g_assert (kind < ALLOC_STATS_COUNT);
+    return (gsize)g_atomic_pointer_get (&alloc_stats_count [kind]);
+}
+/*
+ * Returns the bytes allocated by 'kind'.
+ */
+guint64
+alloc_stats_get_bytes (AllocStatsKind kind)
+{
+    g_assert (kind < ALLOC_STATS_COUNT);
+    return (gsize)g_atomic_pointer_get (&alloc_stats_bytes [kind]);
+}
+/*
+ * Returns the name used for 'kind' in metrics labels and stats.
+ */
+const gchar*
+alloc_stats_kind_name (AllocStatsKind kind)
+{
+    g_assert (kind < ALLOC_STATS_COUNT);
+    return alloc_stats_names [kind];
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* the subsystems whose allocations are counted */
+typedef enum {
+    ALLOC_STATS_COMMAND_BUFFERS = 0,
+    ALLOC_STATS_RESPONSE_BUFFERS,
+    ALLOC_STATS_MESSAGES,
+    ALLOC_STATS_SESSION_ENTRIES,
+    ALLOC_STATS_HANDLE_ENTRIES,
+    ALLOC_STATS_GET_CAP,
+    ALLOC_STATS_COUNT,
+} AllocStatsKind;
+
+/*
+ * Process-wide running totals of the allocations made by a subsystem and
+ * the bytes they asked for. Nothing is subtracted on free: these catch
+ * allocation rate regressions, mem-account.h tracks what's held. The
+ * counts are updated atomically from any thread.
+ * ALLOC_STATS_ADD is built only when configured with --enable-alloc-stats
+ * and otherwise compiles to nothing, the arguments aren't evaluated.
+ */
+#ifdef ENABLE_ALLOC_STATS
+#define ALLOC_STATS_ADD(kind, bytes) \
+    alloc_stats_add ((kind), (bytes))
+#else
+#define ALLOC_STATS_ADD(kind, bytes) \
+    do { (void)sizeof (kind); (void)sizeof (bytes); } while (0)
+#endif
+
+void         alloc_stats_add        (AllocStatsKind kind,
+                                     gsize          bytes);
+guint64      alloc_stats_get_count  (AllocStatsKind kind);
+guint64      alloc_stats_get_bytes  (AllocStatsKind kind);
+const gchar* alloc_stats_kind_name  (AllocStatsKind kind);
+
+G_END_DECLS
+#endif /* ALLOC_STATS_H */
@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ROUND(size) \
+    (((size) + ARENA_ALIGN - 1) & ~((gsize)ARENA_ALIGN - 1))
+/* the data of a block follows its header */
+#define ARENA_BLOCK_DATA(block) \
+    ((guint8*)(block) + ARENA_ROUND (sizeof (arena_block_t)))
+
+/*
+ * Set up an empty arena, its first block is allocated on first use.
+ */
+void
+arena_init (arena_t *arena,
+            gsize    block_size)
+{
+    arena->blocks = NULL;
+    arena->block_size = ARENA_ROUND (MAX (block_size, ARENA_ALIGN));
+}
+/*
+ * Returns 'size' bytes that stay valid until the arena is reset. Never
+ * returns NULL: like g_malloc this aborts if memory runs out.
+ */
+gpointer
+arena_alloc (arena_t *arena,
+             gsize    size)
+{
+    arena_block_t *block = arena->blocks;
+    gpointer ptr;
+
+    size = ARENA_ROUND (MAX (size, 1));
+    if (block == NULL || block->size - block->used < size) {
+        block = g_malloc (ARENA_ROUND (sizeof (arena_block_t)) +
+                          MAX (size, arena->block_size));
+        block->size = MAX (size, arena->block_size);
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    ptr = ARENA_BLOCK_DATA (block) + block->used;
+    block->used += size;
+    return ptr;
+}
+gpointer
+arena_alloc0 (arena_t *arena,
+              gsize    size)
+{
+    return memset (arena_alloc (arena, size), 0, size);
+}
+/*
+ * Like g_slist_prepend with the link allocated from the arena. A list
+ * built this way must not be freed or have links removed with the
+ * g_slist functions, it's dropped along with the arena's contents.
+ */
+GSList*
+arena_slist_prepend (arena_t  *arena,
+                     GSList   *list,
+                     gpointer  data)
+{
+    GSList *link = arena_alloc (arena, sizeof (GSList));
+
+    link->data = data;
+    link->next = list;
+    return link;
+}
+/*
+ * Free everything allocated from the arena. A lone block is kept as it
+ * is. When more than one was needed they're all freed and the next block
+ * is made big enough for the lot, up to ARENA_BLOCK_SIZE_MAX.
+ */
+void
+arena_reset (arena_t *arena)
+{
+    arena_block_t *block, *next;
+    gsize total = 0;
+
+    if (arena->blocks == NULL) {
+        return;
+    }
+    if (arena->blocks->next == NULL) {
+        arena->blocks->used = 0;
+        return;
+    }
+    for (block = arena->blocks; block != NULL; block = next) {
+        next = block->next;
+        total += block->size;
+        g_free (block);
+    }
+    arena->blocks = NULL;
+    arena->block_size = MIN (MAX (arena->block_size, total),
+                             ARENA_BLOCK_SIZE_MAX);
+}
+/*
+ * Free the arena's blocks, the arena may be used again afterwards.
+ */
+void
+arena_clear (arena_t *arena)
+{
+    arena_block_t *block, *next;
+
+    for (block = arena->blocks; block != NULL; block = next) {
+        next = block->next;
+        g_free (block);
+    }
+    arena->blocks = NULL;
+}
+/*
+ * Returns the number of bytes held in the arena's blocks.
+ */
+gsize
+arena_get_size (arena_t *arena)
+{
+    arena_block_t *block;
+    gsize size = 0;
+
+    for (block = arena->blocks; block != NULL; block = block->next) {
+        size += block->size;
+    }
+    return size;
+}
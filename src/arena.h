@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* allocations are aligned to this many bytes */
+#define ARENA_ALIGN              16
+#define ARENA_BLOCK_SIZE_DEFAULT 4096
+/* the block kept across resets doesn't grow past this */
+#define ARENA_BLOCK_SIZE_MAX     (64 * 1024)
+
+typedef struct _arena_block arena_block_t;
+struct _arena_block {
+    arena_block_t    *next;
+    gsize             size;
+    gsize             used;
+};
+
+/*
+ * A bump allocator for temporaries that all go away at once. Allocations
+ * are carved out of the current block and a new block is chained on when
+ * it runs out. arena_reset frees everything: a single block is kept for
+ * reuse, and after an overflow the next block is sized to hold all of
+ * what was needed. There's no locking, an arena is used by one thread.
+ */
+typedef struct {
+    arena_block_t    *blocks;
+    gsize             block_size;
+} arena_t;
+
+void        arena_init          (arena_t  *arena,
+                                 gsize     block_size);
+gpointer    arena_alloc         (arena_t  *arena,
+                                 gsize     size);
+gpointer    arena_alloc0        (arena_t  *arena,
+                                 gsize     size);
+GSList*     arena_slist_prepend (arena_t  *arena,
+                                 GSList   *list,
+                                 gpointer  data);
+void        arena_reset         (arena_t  *arena);
+void        arena_clear         (arena_t  *arena);
+gsize       arena_get_size      (arena_t  *arena);
+
+G_END_DECLS
+#endif /* ARENA_H */
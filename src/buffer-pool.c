@@ -0,0 +1,239 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <glib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "buffer-pool.h"
+#include "util.h"
+
+G_STATIC_ASSERT (BUFFER_POOL_SMALL == UTIL_BUF_SIZE);
+G_STATIC_ASSERT (BUFFER_POOL_LARGE == UTIL_BUF_MAX);
+
+/*
+ * The slots of one size. 'free' holds the indices of the 'free_count'
+ * free slots, the last one is handed out first so that a busy pool keeps
+ * reusing the same few, already faulted in, slots.
+ */
+typedef struct {
+    GMutex   mutex;
+    guint8  *base;
+    gsize    slot_size;
+    guint    count;
+    guint   *free;
+    guint    free_count;
+} buffer_pool_class_t;
+
+/*
+ * Set up by buffer_pool_init before the daemon starts its threads and
+ * only read afterwards, the free lists are under the mutex of their class.
+ */
+static struct {
+    guint8              *map;
+    gsize                size;
+    buffer_pool_class_t  classes [2];
+} buffer_pool;
+
+static void
+buffer_pool_class_init (buffer_pool_class_t *klass,
+                        guint8              *base,
+                        gsize                slot_size,
+                        guint                count)
+{
+    guint i;
+
+    g_mutex_init (&klass->mutex);
+    klass->base = base;
+    klass->slot_size = slot_size;
+    klass->count = count;
+    klass->free = g_new (guint, MAX (count, 1));
+    /* slot 0 is on top */
+    for (i = 0; i < count; ++i) {
+        klass->free [i] = count - 1 - i;
+    }
+    klass->free_count = count;
+}
+/*
+ * Map and lock 'small_slots' slots of BUFFER_POOL_SMALL bytes and
+ * 'large_slots' of BUFFER_POOL_LARGE. Locking fails once the process
+ * would go over RLIMIT_MEMLOCK.
+ * Returns FALSE if the memory can't be mapped, locked or kept out of core
+ * dumps: buffers then come from the heap.
+ */
+gboolean
+buffer_pool_init (guint small_slots,
+                  guint large_slots)
+{
+    gsize size = (gsize)small_slots * BUFFER_POOL_SMALL +
+        (gsize)large_slots * BUFFER_POOL_LARGE;
+    void *addr;
+
+    g_assert (buffer_pool.map == NULL);
+    if (size == 0) {
+        return FALSE;
+    }
+    addr = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        g_warning ("%s: mmap failed: %s", __func__, strerror (errno));
+        return FALSE;
+    }
+    if (mlock (addr, size) == -1) {
+        g_warning ("%s: failed to lock %zu bytes, message buffers come from "
+                   "the heap: %s", __func__, size, strerror (errno));
+        munmap (addr, size);
+        return FALSE;
+    }
+#ifdef MADV_DONTDUMP
+    if (madvise (addr, size, MADV_DONTDUMP) == -1) {
+        g_warning ("%s: madvise failed, message buffers come from the "
+                   "heap: %s", __func__, strerror (errno));
+        munlock (addr, size);
+        munmap (addr, size);
+        return FALSE;
+    }
+#endif
+    buffer_pool.map = addr;
+    buffer_pool.size = size;
+    buffer_pool_class_init (&buffer_pool.classes [0],
+                            buffer_pool.map,
+                            BUFFER_POOL_SMALL,
+                            small_slots);
+    buffer_pool_class_init (&buffer_pool.classes [1],
+                            buffer_pool.map +
+                                (gsize)small_slots * BUFFER_POOL_SMALL,
+                            BUFFER_POOL_LARGE,
+                            large_slots);
+    g_debug ("%s: %u small and %u large message buffers in %zu locked bytes",
+             __func__, small_slots, large_slots, size);
+    return TRUE;
+}
+/*
+ * Unmap the pool. Every buffer taken from it must have been released.
+ */
+void
+buffer_pool_fini (void)
+{
+    guint i;
+
+    if (buffer_pool.map == NULL) {
+        return;
+    }
+    for (i = 0; i < G_N_ELEMENTS (buffer_pool.classes); ++i) {
+        g_assert (buffer_pool.classes [i].free_count ==
+                  buffer_pool.classes [i].count);
+        g_clear_pointer (&buffer_pool.classes [i].free, g_free);
+        g_mutex_clear (&buffer_pool.classes [i].mutex);
+    }
+    munlock (buffer_pool.map, buffer_pool.size);
+    munmap (buffer_pool.map, buffer_pool.size);
+    memset (&buffer_pool, 0, sizeof (buffer_pool));
+}
+/*
+ * Return the class whose slots 'buf' is in, NULL if it isn't in the pool.
+ */
+static buffer_pool_class_t*
+buffer_pool_class_of (const uint8_t *buf)
+{
+    buffer_pool_class_t *klass;
+    guint i;
+
+    if (buffer_pool.map == NULL || buf < buffer_pool.map ||
+        buf >= buffer_pool.map + buffer_pool.size)
+    {
+        return NULL;
+    }
+    for (i = 0; i < G_N_ELEMENTS (buffer_pool.classes); ++i) {
+        klass = &buffer_pool.classes [i];
+        if (buf >= klass->base &&
+            buf < klass->base + (gsize)klass->count * klass->slot_size)
+        {
+            return klass;
+        }
+    }
+    return NULL;
+}
+gboolean
+buffer_pool_contains (const uint8_t *buf)
+{
+    return buffer_pool_class_of (buf) != NULL;
+}
+/*
+ * Take a free slot of at least 'size' bytes, a large one once the small
+ * ones run out. Returns NULL if there's none.
+ */
+static uint8_t*
+buffer_pool_take (size_t size)
+{
+    buffer_pool_class_t *klass;
+    uint8_t *buf = NULL;
+    guint i;
+
+    if (buffer_pool.map == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < G_N_ELEMENTS (buffer_pool.classes) && buf == NULL; ++i) {
+        klass = &buffer_pool.classes [i];
+        if (size > klass->slot_size) {
+            continue;
+        }
+        g_mutex_lock (&klass->mutex);
+        if (klass->free_count > 0) {
+            buf = klass->base +
+                (gsize)klass->free [--klass->free_count] * klass->slot_size;
+        }
+        g_mutex_unlock (&klass->mutex);
+    }
+    return buf;
+}
+/*
+ * Get a buffer of 'size' bytes. Its contents are undefined: slots are
+ * only cleared up to the length their last user wrote. Release it with
+ * buffer_pool_free.
+ */
+uint8_t*
+buffer_pool_alloc (size_t size)
+{
+    uint8_t *buf = buffer_pool_take (size);
+
+    return buf != NULL ? buf : g_malloc (size);
+}
+/*
+ * Like buffer_pool_alloc, but returns NULL rather than aborting if a
+ * buffer that doesn't come from the pool can't be allocated.
+ */
+uint8_t*
+buffer_pool_try_alloc (size_t size)
+{
+    uint8_t *buf = buffer_pool_take (size);
+
+    return buf != NULL ? buf : g_try_malloc (size);
+}
+/*
+ * Clear the first 'used' bytes of 'buf' and release it: back to the free
+ * list if it's a slot of the pool, to the heap otherwise. Only the bytes
+ * written need clearing, the rest of a slot was cleared when it was last
+ * released.
+ */
+void
+buffer_pool_free (uint8_t *buf,
+                  size_t   used)
+{
+    buffer_pool_class_t *klass;
+
+    if (buf == NULL) {
+        return;
+    }
+    secure_clear (buf, used);
+    klass = buffer_pool_class_of (buf);
+    if (klass == NULL) {
+        g_free (buf);
+        return;
+    }
+    g_assert (used <= klass->slot_size);
+    g_assert ((gsize)(buf - klass->base) % klass->slot_size == 0);
+    g_mutex_lock (&klass->mutex);
+    klass->free [klass->free_count++] =
+        (guint)((gsize)(buf - klass->base) / klass->slot_size);
+    g_mutex_unlock (&klass->mutex);
+}
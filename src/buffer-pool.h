@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <glib.h>
+#include <stdint.h>
+
+G_BEGIN_DECLS
+
+/* slot sizes, UTIL_BUF_SIZE and UTIL_BUF_MAX */
+#define BUFFER_POOL_SMALL       1024
+#define BUFFER_POOL_LARGE       (8 * 1024)
+/* slots the daemon creates: 768KiB of locked memory */
+#define BUFFER_POOL_SMALL_SLOTS 256
+#define BUFFER_POOL_LARGE_SLOTS 64
+
+/*
+ * Process-wide pool of the buffers holding TPM commands and responses,
+ * which carry sensitive areas and authorization values. The pool is one
+ * mapping, locked so it's never written to swap and left out of core
+ * dumps, cut into BUFFER_POOL_SMALL and BUFFER_POOL_LARGE byte slots. A
+ * buffer is cleared when it's released, up to the length that was used,
+ * and its slot goes back on a free list for the next message.
+ * Requests that don't fit a free slot, or that come before
+ * buffer_pool_init or after it failed, are served from the heap and
+ * cleared the same way when they're released. buffer_pool_free takes
+ * buffers from either, as well as any other buffer from g_malloc, so
+ * messages built elsewhere can be released the same way.
+ */
+gboolean    buffer_pool_init      (guint           small_slots,
+                                   guint           large_slots);
+void        buffer_pool_fini      (void);
+uint8_t*    buffer_pool_alloc     (size_t          size);
+uint8_t*    buffer_pool_try_alloc (size_t          size);
+void        buffer_pool_free      (uint8_t        *buf,
+                                   size_t          used);
+gboolean    buffer_pool_contains  (const uint8_t  *buf);
+
+G_END_DECLS
+#endif /* BUFFER_POOL_H */
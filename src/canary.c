@@ -0,0 +1,261 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "canary.h"
+#include "handle-map.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+G_DEFINE_TYPE (Canary, canary, G_TYPE_OBJECT);
+
+/*
+ * Close the probe's end of its connection: the CommandSource sees the
+ * hangup and removes the connection like any other client's.
+ */
+static void
+canary_disconnect (Canary *canary)
+{
+    if (canary->watch_id != 0) {
+        g_source_remove (canary->watch_id);
+        canary->watch_id = 0;
+    }
+    if (canary->client_fd != -1) {
+        close (canary->client_fd);
+        canary->client_fd = -1;
+    }
+    g_clear_object (&canary->connection);
+    canary->sent = 0;
+    canary->response_size = 0;
+}
+static void
+canary_dispose (GObject *obj)
+{
+    Canary *self = CANARY (obj);
+
+    if (self->timeout_id != 0) {
+        g_source_remove (self->timeout_id);
+        self->timeout_id = 0;
+    }
+    canary_disconnect (self);
+    g_clear_object (&self->connection_manager);
+    g_clear_object (&self->metrics);
+    g_clear_object (&self->random);
+    G_OBJECT_CLASS (canary_parent_class)->dispose (obj);
+}
+static void
+canary_init (Canary *self)
+{
+    self->client_fd = -1;
+}
+static void
+canary_class_init (CanaryClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (canary_parent_class == NULL)
+        canary_parent_class = g_type_class_peek_parent (klass);
+    object_class->dispose = canary_dispose;
+}
+/*
+ * Allocate a new Canary probing the TPM with index 'tpm' through the
+ * connections in 'manager', recording in 'metrics'. 'random' provides the
+ * connection IDs. The caller owns the returned reference.
+ */
+Canary*
+canary_new (ConnectionManager *manager,
+            Metrics           *metrics,
+            Random            *random,
+            guint              tpm)
+{
+    Canary *canary;
+
+    g_assert (manager != NULL);
+    g_assert (metrics != NULL);
+    g_assert (random != NULL);
+    canary = CANARY (g_object_new (TYPE_CANARY, NULL));
+    canary->connection_manager = g_object_ref (manager);
+    canary->metrics = g_object_ref (metrics);
+    canary->random = g_object_ref (random);
+    canary->tpm = tpm;
+    return canary;
+}
+/*
+ * Record a finished probe. A probe the TPM answered with an error is a
+ * failure but its latency still counts: the TPM did the work.
+ */
+static void
+canary_answered (Canary *canary)
+{
+    gint64 now = g_get_monotonic_time ();
+    guint64 tpm_usec;
+    TSS2_RC rc;
+
+    tpm_usec = (guint64)(gsize)g_atomic_pointer_get (&canary->connection->tpm_usec);
+    metrics_observe (canary->metrics, METRICS_CANARY_LATENCY,
+                     now - canary->sent);
+    metrics_observe (canary->metrics, METRICS_CANARY_TPM_LATENCY,
+                     (gint64)(tpm_usec - canary->tpm_usec));
+    rc = get_response_code (canary->response);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: ReadClock on TPM %u failed with RC 0x%" PRIx32,
+                   __func__, canary->tpm, rc);
+        metrics_count (canary->metrics, METRICS_CANARY_FAILURE);
+    }
+    canary->sent = 0;
+    canary->response_size = 0;
+}
+/*
+ * GUnixFDSourceFunc for the probe's end of the connection: collect the
+ * response as it arrives. Anything but the response to an outstanding
+ * probe, or the connection closing, is a failure.
+ */
+static gboolean
+canary_on_response (gint         fd,
+                    GIOCondition condition,
+                    gpointer     user_data)
+{
+    Canary *canary = CANARY (user_data);
+    size_t size;
+    ssize_t ret;
+
+    UNUSED_PARAM (condition);
+    ret = read (fd, &canary->response [canary->response_size],
+                sizeof (canary->response) - canary->response_size);
+    if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return G_SOURCE_CONTINUE;
+    }
+    if (ret <= 0 || canary->sent == 0) {
+        g_warning ("%s: connection for TPM %u closed or sent unexpected data",
+                   __func__, canary->tpm);
+        goto fail_out;
+    }
+    canary->response_size += (size_t)ret;
+    if (canary->response_size < TPM_HEADER_SIZE) {
+        return G_SOURCE_CONTINUE;
+    }
+    size = get_response_size (canary->response);
+    if (size < TPM_HEADER_SIZE || size > sizeof (canary->response) ||
+        canary->response_size > size)
+    {
+        g_warning ("%s: bad response from TPM %u", __func__, canary->tpm);
+        goto fail_out;
+    }
+    if (canary->response_size == size) {
+        canary_answered (canary);
+    }
+    return G_SOURCE_CONTINUE;
+fail_out:
+    metrics_count (canary->metrics, METRICS_CANARY_FAILURE);
+    /* returning G_SOURCE_REMOVE removes the source */
+    canary->watch_id = 0;
+    canary_disconnect (canary);
+    return G_SOURCE_REMOVE;
+}
+/*
+ * Create the probe's connection and hand it to the ConnectionManager so
+ * that the CommandSource reads from it. Returns FALSE if the daemon is
+ * at its connection limit.
+ */
+static gboolean
+canary_connect (Canary *canary)
+{
+    HandleMap *map;
+    GIOStream *iostream;
+    guint64 id;
+
+    if (connection_manager_is_full (canary->connection_manager)) {
+        return FALSE;
+    }
+    do {
+        id = random_get_uint64 (canary->random);
+    } while (connection_manager_contains_id (canary->connection_manager, id));
+    map = handle_map_new (TPM2_HT_TRANSIENT, 0);
+    iostream = create_connection_iostream (&canary->client_fd);
+    canary->connection = connection_new (iostream, id, map);
+    g_object_unref (iostream);
+    g_object_unref (map);
+    connection_set_tpm (canary->connection, canary->tpm);
+    if (connection_manager_insert (canary->connection_manager,
+                                   canary->connection) != 0)
+    {
+        canary_disconnect (canary);
+        return FALSE;
+    }
+    canary->watch_id = g_unix_fd_add (canary->client_fd,
+                                      G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                      canary_on_response,
+                                      canary);
+    g_debug ("%s: probing TPM %u on connection 0x%" PRIx64,
+             __func__, canary->tpm, id);
+    return TRUE;
+}
+/*
+ * Send a ReadClock: it has no handles or authorizations and none of the
+ * ResourceManager's caches answer it, so it always goes to the TPM. A
+ * probe still unanswered from the last time is counted as a failure and
+ * no new one is sent until it's in.
+ * Returns FALSE if no probe was sent.
+ */
+gboolean
+canary_probe (Canary *canary)
+{
+    guint8 command [TPM_HEADER_SIZE];
+    ssize_t ret;
+
+    g_assert (canary != NULL);
+    if (canary->sent != 0) {
+        g_warning ("%s: ReadClock on TPM %u unanswered after %" PRId64 " ms",
+                   __func__, canary->tpm,
+                   (g_get_monotonic_time () - canary->sent) / 1000);
+        metrics_count (canary->metrics, METRICS_CANARY_FAILURE);
+        return FALSE;
+    }
+    if (canary->connection == NULL && !canary_connect (canary)) {
+        return FALSE;
+    }
+    tpm2_header_init (command,
+                      sizeof (command),
+                      TPM2_ST_NO_SESSIONS,
+                      sizeof (command),
+                      TPM2_CC_ReadClock);
+    canary->tpm_usec =
+        (guint64)(gsize)g_atomic_pointer_get (&canary->connection->tpm_usec);
+    canary->response_size = 0;
+    canary->sent = g_get_monotonic_time ();
+    ret = write (canary->client_fd, command, sizeof (command));
+    if (ret != (ssize_t)sizeof (command)) {
+        g_warning ("%s: failed to send ReadClock to TPM %u", __func__,
+                   canary->tpm);
+        metrics_count (canary->metrics, METRICS_CANARY_FAILURE);
+        canary_disconnect (canary);
+        return FALSE;
+    }
+    return TRUE;
+}
+static gboolean
+canary_timeout (gpointer user_data)
+{
+    canary_probe (CANARY (user_data));
+    return G_SOURCE_CONTINUE;
+}
+/*
+ * Send a probe every 'interval' seconds from the default GMainContext.
+ */
+void
+canary_start (Canary *canary,
+              guint   interval)
+{
+    g_assert (canary != NULL);
+    g_assert (interval > 0);
+    g_assert (canary->timeout_id == 0);
+    canary->timeout_id = g_timeout_add_seconds (interval,
+                                                canary_timeout,
+                                                canary);
+}
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef CANARY_H
+#define CANARY_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "connection.h"
+#include "connection-manager.h"
+#include "metrics.h"
+#include "random.h"
+
+G_BEGIN_DECLS
+
+/*
+ * An internal client that sends a ReadClock through the daemon's own
+ * pipeline every 'interval' seconds, over a connection of its own like
+ * any other client's. The time to the response and the time the TPM took
+ * are recorded in the Metrics, a probe that fails or is still unanswered
+ * when the next one is due is counted as a failure. Everything runs from
+ * the default GMainContext.
+ */
+/* ReadClock response: header and TPMS_TIME_INFO */
+#define CANARY_RESPONSE_MAX 64
+
+typedef struct _CanaryClass {
+    GObjectClass       parent;
+} CanaryClass;
+
+typedef struct _Canary {
+    GObject            parent_instance;
+    ConnectionManager *connection_manager;
+    Metrics           *metrics;
+    Random            *random;
+    guint              tpm;
+    guint              timeout_id;
+    /* the probe's connection, NULL until the first probe or after a failure */
+    Connection        *connection;
+    gint               client_fd;
+    guint              watch_id;
+    /* monotonic time the outstanding probe was sent, 0 if none is */
+    gint64             sent;
+    /* TPM time of the connection when the probe was sent */
+    guint64            tpm_usec;
+    guint8             response [CANARY_RESPONSE_MAX];
+    size_t             response_size;
+} Canary;
+
+#define TYPE_CANARY              (canary_get_type   ())
+#define CANARY(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_CANARY, Canary))
+#define CANARY_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_CANARY, CanaryClass))
+#define IS_CANARY(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_CANARY))
+#define IS_CANARY_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_CANARY))
+#define CANARY_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_CANARY, CanaryClass))
+
+GType        canary_get_type    (void);
+Canary*      canary_new         (ConnectionManager *manager,
+                                 Metrics           *metrics,
+                                 Random            *random,
+                                 guint              tpm);
+void         canary_start       (Canary            *canary,
+                                 guint              interval);
+gboolean     canary_probe       (Canary            *canary);
+
+G_END_DECLS
+#endif /* CANARY_H */
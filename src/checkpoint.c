@@ -0,0 +1,501 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "connection.h"
+#include "fd-store.h"
+#include "handle-map.h"
+#include "util.h"
+
+typedef struct {
+    GVariantBuilder  *builder;
+    guint             count;
+} checkpoint_save_data_t;
+/*
+ * GHFunc adding the saved context of a transient object to the
+ * GVariantBuilder of the connection's transients. Objects without one are
+ * left out: the ResourceManager couldn't save them.
+ */
+static void
+checkpoint_save_transient (gpointer key,
+                           gpointer value,
+                           gpointer user_data)
+{
+    HandleMapEntry *entry = HANDLE_MAP_ENTRY (value);
+    GVariantBuilder *builder = (GVariantBuilder*)user_data;
+    GBytes *context;
+
+    context = handle_map_entry_get_context (entry);
+    if (context == NULL) {
+        return;
+    }
+    g_variant_builder_add (builder,
+                           "(u@ay)",
+                           (guint32)GPOINTER_TO_UINT (key),
+                           g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING,
+                                                     context,
+                                                     TRUE));
+}
+/*
+ * GFunc handing a connection to the file descriptor store and adding it
+ * to the checkpoint. Connections in the middle of a command, using the
+ * shared memory transport or with channels open can't be picked up by the
+ * next instance and are left to be closed.
+ */
+static void
+checkpoint_save_connection (gpointer data,
+                            gpointer user_data)
+{
+    Connection *connection = CONNECTION (data);
+    checkpoint_save_data_t *save = (checkpoint_save_data_t*)user_data;
+    GVariantBuilder transients;
+    HandleMap *handle_map;
+    gchar *name;
+    gint fd = connection_get_fd (connection);
+
+    if (fd == -1 ||
+        connection_get_shm (connection) != NULL ||
+        connection_get_channel_count (connection) != 0 ||
+        g_atomic_int_get (&connection->pending) != 0 ||
+        connection_get_in_flight (connection) != 0 ||
+        connection_get_read_buffer (connection)->len != 0)
+    {
+        g_info ("%s: connection 0x%" PRIx64 " is busy, closing it",
+                __func__, connection->id);
+        return;
+    }
+    name = g_strdup_printf (FD_STORE_CONNECTION_PREFIX "%016" PRIx64,
+                            connection->id);
+    if (!fd_store_add (name, fd)) {
+        g_free (name);
+        return;
+    }
+    g_free (name);
+    g_variant_builder_init (&transients, G_VARIANT_TYPE ("a(uay)"));
+    handle_map = connection_get_trans_map (connection);
+    handle_map_foreach (handle_map, checkpoint_save_transient, &transients);
+    g_object_unref (handle_map);
+    g_variant_builder_add (save->builder,
+                           CHECKPOINT_CONNECTION_TYPE,
+                           connection->id,
+                           connection_get_uid (connection),
+                           (guint32)connection_get_tpm (connection),
+                           connection_get_locality (connection),
+                           connection_get_tagged (connection),
+                           connection_get_seqpacket (connection),
+                           &transients);
+    ++save->count;
+}
+/*
+ * Write the 'size' bytes at 'data' to CHECKPOINT_FILE in 'dir', through a
+ * temporary file created 0600 and renamed over it, so the saved contexts
+ * and UIDs in it are never readable by anyone else and a checkpoint is
+ * never seen half written.
+ */
+static gboolean
+checkpoint_write_file (const gchar   *dir,
+                       const guint8  *data,
+                       gsize          size)
+{
+    gchar *path, *tmp_path;
+    gsize done = 0;
+    ssize_t ret;
+    gint fd;
+
+    tmp_path = g_build_filename (dir, CHECKPOINT_FILE "-XXXXXX", NULL);
+    fd = g_mkstemp_full (tmp_path, O_WRONLY | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        g_warning ("%s: failed to create %s: %s",
+                   __func__, tmp_path, strerror (errno));
+        g_free (tmp_path);
+        return FALSE;
+    }
+    while (done < size) {
+        ret = write (fd, data + done, size - done);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret == -1) {
+            g_warning ("%s: failed to write %s: %s",
+                       __func__, tmp_path, strerror (errno));
+            goto fail_out;
+        }
+        done += (gsize)ret;
+    }
+    if (fsync (fd) == -1) {
+        g_warning ("%s: failed to sync %s: %s",
+                   __func__, tmp_path, strerror (errno));
+        goto fail_out;
+    }
+    close (fd);
+    path = g_build_filename (dir, CHECKPOINT_FILE, NULL);
+    if (g_rename (tmp_path, path) == -1) {
+        g_warning ("%s: failed to rename %s to %s: %s",
+                   __func__, tmp_path, path, strerror (errno));
+        g_unlink (tmp_path);
+        g_free (path);
+        g_free (tmp_path);
+        return FALSE;
+    }
+    g_free (path);
+    g_free (tmp_path);
+    return TRUE;
+fail_out:
+    close (fd);
+    g_unlink (tmp_path);
+    g_free (tmp_path);
+    return FALSE;
+}
+/*
+ * Write the checkpoint to CHECKPOINT_FILE in 'dir'. The threads of the
+ * pipeline must have stopped. Connections are only kept if the daemon
+ * runs under a service manager that will hand them back.
+ */
+gboolean
+checkpoint_save (const gchar        *dir,
+                 ConnectionManager  *manager,
+                 ResourceManager    *resmgrs[],
+                 guint               tpm_count)
+{
+    GVariantBuilder tpms, connections;
+    checkpoint_save_data_t save = {
+        .builder = &connections,
+        .count = 0,
+    };
+    GVariant *checkpoint, *state;
+    gboolean ret;
+    guint i;
+
+    g_variant_builder_init (&tpms,
+        G_VARIANT_TYPE ("a(u" RESOURCE_MANAGER_STATE_TYPE ")"));
+    for (i = 0; i < tpm_count; ++i) {
+        if (resmgrs [i] == NULL) {
+            continue;
+        }
+        state = resource_manager_save_state (resmgrs [i]);
+        if (state == NULL) {
+            g_warning ("%s: failed to save the state of TPM %u", __func__, i);
+            continue;
+        }
+        g_variant_builder_add (&tpms,
+                               "(u@" RESOURCE_MANAGER_STATE_TYPE ")",
+                               (guint32)i,
+                               state);
+    }
+    g_variant_builder_init (&connections,
+                            G_VARIANT_TYPE ("a" CHECKPOINT_CONNECTION_TYPE));
+    if (fd_store_available ()) {
+        connection_manager_foreach (manager, checkpoint_save_connection, &save);
+    } else {
+        g_info ("%s: no file descriptor store, connections are closed",
+                __func__);
+    }
+    checkpoint = g_variant_ref_sink (g_variant_new (CHECKPOINT_TYPE,
+                                                    (guint32)CHECKPOINT_VERSION,
+                                                    &tpms,
+                                                    &connections));
+    ret = checkpoint_write_file (dir,
+                                 g_variant_get_data (checkpoint),
+                                 g_variant_get_size (checkpoint));
+    if (ret) {
+        g_info ("%s: saved %u connections to %s", __func__, save.count, dir);
+    }
+    g_variant_unref (checkpoint);
+    return ret;
+}
+/*
+ * Read the whole of the checkpoint open on 'fd' into 'contents'. The
+ * connections in it are trusted with the UIDs it gives them, so it's only
+ * read if it's a regular file owned by the daemon's user that no one else
+ * may read or write, the way checkpoint_write_file creates it.
+ * Returns FALSE if it can't be read or used.
+ */
+static gboolean
+checkpoint_read_fd (gint          fd,
+                    const gchar  *path,
+                    gchar       **contents,
+                    gsize        *size)
+{
+    struct stat st;
+    gsize done = 0;
+    ssize_t ret;
+
+    if (fstat (fd, &st) == -1) {
+        g_warning ("%s: failed to stat %s: %s",
+                   __func__, path, strerror (errno));
+        return FALSE;
+    }
+    if (!S_ISREG (st.st_mode) || st.st_uid != geteuid () ||
+        (st.st_mode & 07777) != 0600)
+    {
+        g_warning ("%s: ignoring %s: not a file owned by UID %u with mode "
+                   "0600", __func__, path, (guint)geteuid ());
+        return FALSE;
+    }
+    *size = (gsize)st.st_size;
+    *contents = g_malloc (MAX (*size, 1));
+    while (done < *size) {
+        ret = read (fd, *contents + done, *size - done);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            g_warning ("%s: failed to read %s: %s", __func__, path,
+                       ret == 0 ? "short read" : strerror (errno));
+            g_clear_pointer (contents, g_free);
+            return FALSE;
+        }
+        done += (gsize)ret;
+    }
+    return TRUE;
+}
+/*
+ * Read the checkpoint left in 'dir' by the previous instance and remove
+ * it. Returns NULL if there's none or it can't be used.
+ */
+GVariant*
+checkpoint_load (const gchar *dir)
+{
+    GVariant *checkpoint;
+    gchar *path, *contents = NULL;
+    gsize size = 0;
+    guint32 version;
+    gboolean ret;
+    gint fd;
+
+    path = g_build_filename (dir, CHECKPOINT_FILE, NULL);
+    fd = open (path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            g_warning ("%s: failed to open %s: %s",
+                       __func__, path, strerror (errno));
+        }
+        g_free (path);
+        return NULL;
+    }
+    ret = checkpoint_read_fd (fd, path, &contents, &size);
+    close (fd);
+    if (unlink (path) == -1) {
+        g_warning ("%s: failed to remove %s: %s",
+                   __func__, path, strerror (errno));
+    }
+    g_free (path);
+    if (!ret) {
+        return NULL;
+    }
+    checkpoint = g_variant_ref_sink (
+        g_variant_new_from_data (G_VARIANT_TYPE (CHECKPOINT_TYPE),
+                                 contents,
+                                 size,
+                                 FALSE,
+                                 g_free,
+                                 contents));
+    if (!g_variant_is_normal_form (checkpoint)) {
+        g_warning ("%s: checkpoint is malformed", __func__);
+        g_variant_unref (checkpoint);
+        return NULL;
+    }
+    g_variant_get_child (checkpoint, 0, "u", &version);
+    if (version != CHECKPOINT_VERSION) {
+        g_warning ("%s: checkpoint version %" PRIu32 " isn't supported",
+                   __func__, version);
+        g_variant_unref (checkpoint);
+        return NULL;
+    }
+    return checkpoint;
+}
+/*
+ * Rebuild a connection from the checkpoint around 'fd'. The Connection
+ * owns 'fd' once this returns, even if it fails.
+ */
+static gboolean
+checkpoint_restore_connection (GVariant          *value,
+                               gint               fd,
+                               ConnectionManager *manager,
+                               guint              max_transients)
+{
+    GVariantIter *transients;
+    GVariant *variant;
+    GIOStream *iostream;
+    HandleMap *handle_map;
+    HandleMapEntry *entry;
+    Connection *connection;
+    GBytes *context;
+    guint64 id;
+    guint32 uid, tpm, vhandle;
+    guint8 locality;
+    gboolean tagged, seqpacket, ret;
+
+    g_variant_get (value,
+                   "(tuuybba(uay))",
+                   &id,
+                   &uid,
+                   &tpm,
+                   &locality,
+                   &tagged,
+                   &seqpacket,
+                   &transients);
+    if (fcntl (fd, F_SETFD, FD_CLOEXEC) == -1) {
+        g_warning ("%s: failed to set FD_CLOEXEC: %s",
+                   __func__, strerror (errno));
+    }
+    iostream = create_connection_iostream_fd (fd);
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, max_transients);
+    connection = connection_new (iostream, id, handle_map);
+    g_object_unref (iostream);
+    connection_set_uid (connection, uid);
+    connection_set_tpm (connection, tpm);
+    connection_set_tagged (connection, tagged);
+    connection_set_seqpacket (connection, seqpacket);
+    connection_set_locality (connection, locality);
+    while (g_variant_iter_next (transients, "(u@ay)", &vhandle, &variant)) {
+        context = context_blob_from_variant (variant);
+        if (context != NULL) {
+            entry = handle_map_entry_new (0, vhandle);
+            handle_map_entry_set_context (entry, context);
+            g_bytes_unref (context);
+            if (!handle_map_restore (handle_map, vhandle, entry)) {
+                g_warning ("%s: failed to restore transient 0x%08" PRIx32
+                           " of connection 0x%" PRIx64, __func__, vhandle, id);
+            }
+            g_object_unref (entry);
+        }
+        g_variant_unref (variant);
+    }
+    g_variant_iter_free (transients);
+    g_object_unref (handle_map);
+    ret = connection_manager_insert (manager, connection) == 0;
+    g_object_unref (connection);
+    return ret;
+}
+/*
+ * Look for the connection stored under 'name' in the array of connections
+ * from the checkpoint. Returns a reference to it or NULL.
+ */
+static GVariant*
+checkpoint_find_connection (GVariant    *connections,
+                            const gchar *name)
+{
+    GVariant *value;
+    gchar *value_name;
+    guint64 id;
+    gsize i, count = g_variant_n_children (connections);
+
+    for (i = 0; i < count; ++i) {
+        value = g_variant_get_child_value (connections, i);
+        g_variant_get_child (value, 0, "t", &id);
+        value_name = g_strdup_printf (FD_STORE_CONNECTION_PREFIX "%016" PRIx64,
+                                      id);
+        if (g_strcmp0 (name, value_name) == 0) {
+            g_free (value_name);
+            return value;
+        }
+        g_free (value_name);
+        g_variant_unref (value);
+    }
+    return NULL;
+}
+/*
+ * Restore the connections from 'checkpoint' for the fds the service
+ * manager passed back from the store. Stored connections that aren't in
+ * the checkpoint, or all of them if 'checkpoint' is NULL, are closed and
+ * dropped from the store. This must be done before the IpcFrontend hands
+ * out new connection IDs.
+ * Returns the number of connections restored.
+ */
+guint
+checkpoint_restore_connections (GVariant          *checkpoint,
+                                ConnectionManager *manager,
+                                guint              max_transients,
+                                guint              tpm_count)
+{
+    GVariant *connections = NULL, *value;
+    gchar **names = NULL;
+    guint fds, i, tpm, count = 0;
+    gint fd;
+
+    fds = fd_store_listen_fds (&names);
+    if (checkpoint != NULL) {
+        connections = g_variant_get_child_value (checkpoint, 2);
+    }
+    for (i = 0; i < fds; ++i) {
+        if (!g_str_has_prefix (names [i], FD_STORE_CONNECTION_PREFIX)) {
+            continue;
+        }
+        fd = SD_LISTEN_FDS_START + (gint)i;
+        fd_store_remove (names [i]);
+        value = connections != NULL ?
+            checkpoint_find_connection (connections, names [i]) : NULL;
+        if (value == NULL) {
+            g_debug ("%s: closing stale %s", __func__, names [i]);
+            close (fd);
+            continue;
+        }
+        g_variant_get_child (value, 2, "u", &tpm);
+        if (tpm >= tpm_count) {
+            g_warning ("%s: %s is for TPM %u, closing it",
+                       __func__, names [i], tpm);
+            close (fd);
+        } else if (checkpoint_restore_connection (value,
+                                                  fd,
+                                                  manager,
+                                                  max_transients))
+        {
+            ++count;
+        }
+        g_variant_unref (value);
+    }
+    if (connections != NULL) {
+        g_variant_unref (connections);
+    }
+    g_strfreev (names);
+    if (count > 0) {
+        g_info ("%s: restored %u connections", __func__, count);
+    }
+    return count;
+}
+/*
+ * Restore the state of the ResourceManager for TPM 'tpm' from
+ * 'checkpoint'. The connections must have been restored first.
+ * Returns FALSE if there's no usable state for the TPM: it must then be
+ * initialized as though there were no checkpoint.
+ */
+gboolean
+checkpoint_restore_tpm (GVariant          *checkpoint,
+                        guint              tpm,
+                        ResourceManager   *resmgr,
+                        ConnectionManager *manager)
+{
+    GVariantIter iter;
+    GVariant *tpms, *state;
+    guint32 index;
+    gboolean ret = FALSE;
+
+    if (checkpoint == NULL) {
+        return FALSE;
+    }
+    tpms = g_variant_get_child_value (checkpoint, 1);
+    g_variant_iter_init (&iter, tpms);
+    while (g_variant_iter_next (&iter,
+                                "(u@" RESOURCE_MANAGER_STATE_TYPE ")",
+                                &index,
+                                &state))
+    {
+        if (index == tpm) {
+            ret = resource_manager_restore_state (resmgr, state, manager);
+        }
+        g_variant_unref (state);
+        if (index == tpm) {
+            break;
+        }
+    }
+    g_variant_unref (tpms);
+    return ret;
+}
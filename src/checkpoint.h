@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <glib.h>
+
+#include "connection-manager.h"
+#include "resource-manager.h"
+
+G_BEGIN_DECLS
+
+/*
+ * State kept across a restart of the daemon with --state-dir. On the way
+ * down the client connections are handed to the systemd file descriptor
+ * store, see fd-store.h, and the ResourceManager state of each TPM is
+ * written to CHECKPOINT_FILE in the state directory along with what's
+ * needed to rebuild the connections: ID, UID, TPM, locality, transport and
+ * the saved contexts of their transient objects. The next instance picks
+ * the connections up before it accepts new ones and the ResourceManager
+ * state before its threads start. The file is removed once read so a
+ * checkpoint is only ever used once. It holds the contexts and UIDs of
+ * every client, so it's created mode 0600 and only loaded if it's still
+ * owned by the daemon's user with that mode.
+ */
+#define CHECKPOINT_FILE    "checkpoint"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_CONNECTION_TYPE "(tuuybba(uay))"
+#define CHECKPOINT_TYPE \
+    "(ua(u" RESOURCE_MANAGER_STATE_TYPE ")a" CHECKPOINT_CONNECTION_TYPE ")"
+
+gboolean   checkpoint_save                (const gchar        *dir,
+                                           ConnectionManager  *manager,
+                                           ResourceManager    *resmgrs[],
+                                           guint               tpm_count);
+GVariant*  checkpoint_load                (const gchar        *dir);
+guint      checkpoint_restore_connections (GVariant           *checkpoint,
+                                           ConnectionManager  *manager,
+                                           guint               max_transients,
+                                           guint               tpm_count);
+gboolean   checkpoint_restore_tpm         (GVariant           *checkpoint,
+                                           guint               tpm,
+                                           ResourceManager    *resmgr,
+                                           ConnectionManager  *manager);
+
+G_END_DECLS
+#endif /* CHECKPOINT_H */
@@ -30,6 +30,7 @@ command_attrs_finalize (GObject *obj)
 
     g_debug (__func__);
     g_clear_pointer (&attrs->command_attrs, g_free);
+    g_clear_pointer (&attrs->sorted, g_free);
     G_OBJECT_CLASS (command_attrs_parent_class)->finalize (obj);
 }
 
@@ -55,6 +56,58 @@ command_attrs_new (void)
 {
     return COMMAND_ATTRS (g_object_new (TYPE_COMMAND_ATTRS, NULL));
 }
+/* TPM2_CC is in the lower 15 bits of the TPMA_CC */
+#define TPM2_CC_FROM_TPMA_CC(attrs) (attrs & 0x7fff)
+#define TPM2_CC_IN_TABLE(cc) \
+    (cc >= TPM2_CC_FIRST && cc < TPM2_CC_FIRST + COMMAND_ATTRS_TABLE_SIZE)
+/*
+ * GCompareFunc to order TPMA_CCs by command code.
+ */
+static gint
+command_attrs_compare (gconstpointer a,
+                       gconstpointer b)
+{
+    TPM2_CC cc_a = TPM2_CC_FROM_TPMA_CC (*(TPMA_CC*)a);
+    TPM2_CC cc_b = TPM2_CC_FROM_TPMA_CC (*(TPMA_CC*)b);
+
+    if (cc_a < cc_b) {
+        return -1;
+    } else if (cc_a > cc_b) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+/*
+ * Build the lookup structures from the TPMA_CCs reported by the TPM:
+ * command codes from the spec go into the direct-mapped table, everything
+ * else into an array sorted by command code.
+ */
+static void
+command_attrs_build_index (CommandAttrs *attrs)
+{
+    TPM2_CC cc;
+    UINT32 i;
+
+    memset (attrs->table, 0, sizeof (attrs->table));
+    g_clear_pointer (&attrs->sorted, g_free);
+    attrs->sorted_count = 0;
+    attrs->sorted = g_new0 (TPMA_CC, attrs->count);
+    for (i = 0; i < attrs->count; ++i) {
+        cc = TPM2_CC_FROM_TPMA_CC (attrs->command_attrs [i]);
+        if (TPM2_CC_IN_TABLE (cc)) {
+            if (attrs->table [cc - TPM2_CC_FIRST] == 0) {
+                attrs->table [cc - TPM2_CC_FIRST] = attrs->command_attrs [i];
+            }
+        } else {
+            attrs->sorted [attrs->sorted_count++] = attrs->command_attrs [i];
+        }
+    }
+    qsort (attrs->sorted,
+           attrs->sorted_count,
+           sizeof (TPMA_CC),
+           command_attrs_compare);
+}
 /*
  */
 gint
@@ -69,20 +122,51 @@ command_attrs_init_tpm (CommandAttrs *attrs,
     if (rc != TSS2_RC_SUCCESS) {
         return -1;
     }
+    command_attrs_build_index (attrs);
 
     return 0;
 }
-
-/* TPM2_CC is in the lower 15 bits of the TPMA_CC */
-#define TPM2_CC_FROM_TPMA_CC(attrs) (attrs & 0x7fff)
+/*
+ * Initialize the CommandAttrs from 'count' TPMA_CCs previously read from
+ * the TPM, e.g. from the startup cache.
+ */
+void
+command_attrs_init_cached (CommandAttrs  *attrs,
+                           UINT32         count,
+                           TPMA_CC const *command_attrs)
+{
+    g_clear_pointer (&attrs->command_attrs, g_free);
+    attrs->count = count;
+    attrs->command_attrs = g_new0 (TPMA_CC, count);
+    memcpy (attrs->command_attrs, command_attrs, count * sizeof (TPMA_CC));
+    command_attrs_build_index (attrs);
+}
+/*
+ * Look up the TPMA_CC for the provided command code. This is a single
+ * table access for command codes defined by the spec and a binary search
+ * for vendor specific commands. If the TPM doesn't support the command
+ * then a TPMA_CC of 0 is returned.
+ */
 TPMA_CC
 command_attrs_from_cc (CommandAttrs *attrs,
                        TPM2_CC        command_code)
 {
-    unsigned int i;
+    TPMA_CC key = command_code, *found;
 
-    for (i = 0; i < attrs->count; ++i)
-        if (TPM2_CC_FROM_TPMA_CC (attrs->command_attrs[i]) == command_code)
-            return attrs->command_attrs[i];
+    if (TPM2_CC_IN_TABLE (command_code)) {
+        return attrs->table [command_code - TPM2_CC_FIRST];
+    }
+    if (attrs->sorted == NULL || command_code != TPM2_CC_FROM_TPMA_CC (key)) {
+        return (TPMA_CC) { 0 };
+    }
+    found = bsearch (&key,
+                     attrs->sorted,
+                     attrs->sorted_count,
+                     sizeof (TPMA_CC),
+                     command_attrs_compare);
+    if (found == NULL) {
+        return (TPMA_CC) { 0 };
+    }
 
-    return (TPMA_CC) { 0 };}
+    return *found;
+}
@@ -19,10 +19,21 @@ typedef struct _CommandAttrsClass {
     GObjectClass    parent;
 } CommandAttrsClass;
 
+/*
+ * Number of command codes, starting at TPM2_CC_FIRST, that are looked up in
+ * the direct-mapped table. This covers every command code defined by the
+ * TPM2 spec with room to spare. Other codes (vendor commands) are found by
+ * binary search.
+ */
+#define COMMAND_ATTRS_TABLE_SIZE 0x100
+
 typedef struct _CommandAttrs {
     GObject                parent_instance;
     TPMA_CC               *command_attrs;
     UINT32                 count;
+    TPMA_CC                table [COMMAND_ATTRS_TABLE_SIZE];
+    TPMA_CC               *sorted;
+    UINT32                 sorted_count;
 } CommandAttrs;
 
 #include "tpm2.h"
@@ -38,6 +49,9 @@ GType            command_attrs_get_type    (void);
 CommandAttrs*    command_attrs_new         (void);
 gint             command_attrs_init_tpm    (CommandAttrs     *attrs,
                                             Tpm2 *tpm2);
+void             command_attrs_init_cached (CommandAttrs     *attrs,
+                                            UINT32            count,
+                                            TPMA_CC const    *command_attrs);
 TPMA_CC          command_attrs_from_cc     (CommandAttrs     *attrs,
                                             TPM2_CC            command_code);
 
@@ -0,0 +1,214 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+
+#include "command-durations.h"
+
+typedef struct {
+    gint64            estimate;
+    gint64            baseline;
+    guint64           samples;
+} command_duration_t;
+
+G_DEFINE_TYPE (CommandDurations, command_durations, G_TYPE_OBJECT);
+
+static void
+command_durations_finalize (GObject *obj)
+{
+    CommandDurations *self = COMMAND_DURATIONS (obj);
+
+    g_clear_pointer (&self->estimates, g_hash_table_unref);
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (command_durations_parent_class)->finalize (obj);
+}
+static void
+command_durations_init (CommandDurations *self)
+{
+    g_mutex_init (&self->mutex);
+    self->estimates = g_hash_table_new_full (g_direct_hash,
+                                             g_direct_equal,
+                                             NULL,
+                                             g_free);
+    self->slowdown = 1000;
+}
+static void
+command_durations_class_init (CommandDurationsClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (command_durations_parent_class == NULL)
+        command_durations_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = command_durations_finalize;
+}
+/*
+ * Allocate a new CommandDurations object with no samples. The caller owns
+ * the returned reference.
+ */
+CommandDurations*
+command_durations_new (void)
+{
+    return COMMAND_DURATIONS (g_object_new (TYPE_COMMAND_DURATIONS, NULL));
+}
+/*
+ * Move the slowdown toward 'usec' relative to the baseline of 'entry' and
+ * update 'degraded'. The caller must hold the mutex.
+ * Returns TRUE if the TPM entered or left degraded mode.
+ */
+static gboolean
+command_durations_update_slowdown (CommandDurations   *durations,
+                                   command_duration_t *entry,
+                                   gint64              usec)
+{
+    gint64 ratio;
+    gboolean degraded = durations->degraded;
+
+    ratio = usec * 1000 / MAX (entry->baseline, 1);
+    ratio = MIN (ratio, COMMAND_DURATIONS_SLOWDOWN_MAX);
+    durations->slowdown += (ratio - durations->slowdown) /
+        COMMAND_DURATIONS_WEIGHT;
+    if (!degraded &&
+        durations->slowdown >= COMMAND_DURATIONS_DEGRADED_ENTER) {
+        degraded = TRUE;
+    } else if (degraded &&
+               durations->slowdown <= COMMAND_DURATIONS_DEGRADED_LEAVE) {
+        degraded = FALSE;
+    }
+    if (degraded == durations->degraded) {
+        return FALSE;
+    }
+    g_atomic_int_set (&durations->degraded, degraded);
+    return TRUE;
+}
+/*
+ * Record that the TPM took 'usec' to execute a command with the provided
+ * command code. The first sample for a command code becomes its estimate
+ * and its baseline.
+ * Returns TRUE if the sample moved the TPM into or out of degraded mode.
+ */
+gboolean
+command_durations_observe (CommandDurations *durations,
+                           TPM2_CC           command_code,
+                           gint64            usec)
+{
+    command_duration_t *entry;
+    gboolean changed = FALSE;
+
+    if (durations == NULL) {
+        return FALSE;
+    }
+    usec = MAX (usec, 0);
+    g_mutex_lock (&durations->mutex);
+    entry = g_hash_table_lookup (durations->estimates,
+                                 GUINT_TO_POINTER (command_code));
+    if (entry == NULL) {
+        entry = g_new0 (command_duration_t, 1);
+        entry->estimate = usec;
+        entry->baseline = usec;
+        g_hash_table_insert (durations->estimates,
+                             GUINT_TO_POINTER (command_code),
+                             entry);
+    } else {
+        if (entry->samples >= COMMAND_DURATIONS_BASELINE_SAMPLES) {
+            changed = command_durations_update_slowdown (durations,
+                                                         entry,
+                                                         usec);
+        }
+        entry->estimate += (usec - entry->estimate) / COMMAND_DURATIONS_WEIGHT;
+        entry->baseline += (usec - entry->baseline) /
+            (entry->samples < COMMAND_DURATIONS_BASELINE_SAMPLES ?
+             (gint64)entry->samples + 1 : COMMAND_DURATIONS_BASELINE_WEIGHT);
+    }
+    ++entry->samples;
+    g_mutex_unlock (&durations->mutex);
+    return changed;
+}
+/*
+ * Return the expected execution time in usec of a command with the
+ * provided command code, COMMAND_DURATIONS_DEFAULT if there are no samples
+ * for it.
+ */
+gint64
+command_durations_estimate (CommandDurations *durations,
+                            TPM2_CC           command_code)
+{
+    command_duration_t *entry;
+    gint64 value = COMMAND_DURATIONS_DEFAULT;
+
+    g_assert (durations != NULL);
+    g_mutex_lock (&durations->mutex);
+    entry = g_hash_table_lookup (durations->estimates,
+                                 GUINT_TO_POINTER (command_code));
+    if (entry != NULL) {
+        value = entry->estimate;
+    }
+    g_mutex_unlock (&durations->mutex);
+    return value;
+}
+/*
+ * Return the baseline execution time in usec of a command with the
+ * provided command code, COMMAND_DURATIONS_DEFAULT if there are no samples
+ * for it.
+ */
+gint64
+command_durations_baseline (CommandDurations *durations,
+                            TPM2_CC           command_code)
+{
+    command_duration_t *entry;
+    gint64 value = COMMAND_DURATIONS_DEFAULT;
+
+    g_assert (durations != NULL);
+    g_mutex_lock (&durations->mutex);
+    entry = g_hash_table_lookup (durations->estimates,
+                                 GUINT_TO_POINTER (command_code));
+    if (entry != NULL) {
+        value = entry->baseline;
+    }
+    g_mutex_unlock (&durations->mutex);
+    return value;
+}
+/*
+ * Return how much slower than their baselines commands have recently run,
+ * in thousandths: 1000 is on par.
+ */
+gint64
+command_durations_get_slowdown (CommandDurations *durations)
+{
+    gint64 value;
+
+    g_assert (durations != NULL);
+    g_mutex_lock (&durations->mutex);
+    value = durations->slowdown;
+    g_mutex_unlock (&durations->mutex);
+    return value;
+}
+/*
+ * Returns TRUE while the TPM is in degraded mode. It may be called from
+ * any thread.
+ */
+gboolean
+command_durations_is_degraded (CommandDurations *durations)
+{
+    g_assert (durations != NULL);
+    return g_atomic_int_get (&durations->degraded);
+}
+/*
+ * Returns TRUE if a command with the provided command code is bulk work:
+ * its baseline is COMMAND_DURATIONS_BULK usec or more. Command codes with
+ * no samples aren't.
+ */
+gboolean
+command_durations_is_bulk (CommandDurations *durations,
+                           TPM2_CC           command_code)
+{
+    command_duration_t *entry;
+    gboolean bulk = FALSE;
+
+    g_assert (durations != NULL);
+    g_mutex_lock (&durations->mutex);
+    entry = g_hash_table_lookup (durations->estimates,
+                                 GUINT_TO_POINTER (command_code));
+    if (entry != NULL) {
+        bulk = entry->baseline >= COMMAND_DURATIONS_BULK;
+    }
+    g_mutex_unlock (&durations->mutex);
+    return bulk;
+}
@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef COMMAND_DURATIONS_H
+#define COMMAND_DURATIONS_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+G_BEGIN_DECLS
+
+/* usec assumed for a command code that hasn't been executed yet */
+#define COMMAND_DURATIONS_DEFAULT 10000
+/* each new sample moves the estimate 1/COMMAND_DURATIONS_WEIGHT of the way */
+#define COMMAND_DURATIONS_WEIGHT  8
+/*
+ * The baseline of a command code is the average of its first
+ * COMMAND_DURATIONS_BASELINE_SAMPLES samples, later ones move it
+ * 1/COMMAND_DURATIONS_BASELINE_WEIGHT of the way toward them: slow enough
+ * to ride out a TPM that's busy for a while, fast enough to follow a
+ * lasting change. Only samples after the first
+ * COMMAND_DURATIONS_BASELINE_SAMPLES are compared against the baseline.
+ */
+#define COMMAND_DURATIONS_BASELINE_WEIGHT  256
+#define COMMAND_DURATIONS_BASELINE_SAMPLES 16
+/*
+ * The slowdown is a moving average of the samples relative to their
+ * baseline, in thousandths. The TPM is degraded once it reaches
+ * COMMAND_DURATIONS_DEGRADED_ENTER and until it falls back to
+ * COMMAND_DURATIONS_DEGRADED_LEAVE. A single sample counts for at most
+ * COMMAND_DURATIONS_SLOWDOWN_MAX.
+ */
+#define COMMAND_DURATIONS_DEGRADED_ENTER 3000
+#define COMMAND_DURATIONS_DEGRADED_LEAVE 1500
+#define COMMAND_DURATIONS_SLOWDOWN_MAX   100000
+/* commands with a baseline of this many usec or more are bulk work */
+#define COMMAND_DURATIONS_BULK 100000
+
+typedef struct _CommandDurationsClass {
+    GObjectClass      parent;
+} CommandDurationsClass;
+
+/*
+ * A model of how long the TPM takes to execute each command code. The
+ * estimate for a command code is a moving average of the times recorded
+ * by tpm2_send_command. Estimates are read by the FairQueue while the
+ * Tpm2 records new samples, both under 'mutex'.
+ * Each command code also has a slowly moving baseline, and the TPM is
+ * 'degraded' while its commands run well over their baselines: during a
+ * self test, NV wear levelling or dictionary attack handling.
+ */
+typedef struct _CommandDurations {
+    GObject           parent_instance;
+    GMutex            mutex;
+    /* TPM2_CC -> command_duration_t */
+    GHashTable       *estimates;
+    /* thousandths of the baseline, COMMAND_DURATIONS_DEGRADED_* */
+    gint64            slowdown;
+    /* read atomically without the mutex */
+    gint              degraded;
+} CommandDurations;
+
+#define TYPE_COMMAND_DURATIONS              (command_durations_get_type   ())
+#define COMMAND_DURATIONS(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_COMMAND_DURATIONS, CommandDurations))
+#define COMMAND_DURATIONS_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_COMMAND_DURATIONS, CommandDurationsClass))
+#define IS_COMMAND_DURATIONS(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_COMMAND_DURATIONS))
+#define IS_COMMAND_DURATIONS_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_COMMAND_DURATIONS))
+#define COMMAND_DURATIONS_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_COMMAND_DURATIONS, CommandDurationsClass))
+
+GType              command_durations_get_type  (void);
+CommandDurations*  command_durations_new       (void);
+gboolean           command_durations_observe   (CommandDurations *durations,
+                                                TPM2_CC           command_code,
+                                                gint64            usec);
+gint64             command_durations_estimate  (CommandDurations *durations,
+                                                TPM2_CC           command_code);
+gint64             command_durations_baseline  (CommandDurations *durations,
+                                                TPM2_CC           command_code);
+gint64             command_durations_get_slowdown (CommandDurations *durations);
+gboolean           command_durations_is_degraded (CommandDurations *durations);
+gboolean           command_durations_is_bulk   (CommandDurations *durations,
+                                                TPM2_CC           command_code);
+
+G_END_DECLS
+#endif /* COMMAND_DURATIONS_H */
@@ -7,16 +7,28 @@
 #include <fcntl.h>
 #include <glib.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include "buffer-pool.h"
 #include "connection.h"
 #include "connection-manager.h"
+#include "flight-recorder.h"
+#include "slab.h"
 #include "command-source.h"
 #include "source-interface.h"
+#include "tabrmd.h"
+#include "tabrmd-probes.h"
+#include "token-bucket.h"
 #include "tpm2-command.h"
 #include "tpm2-header.h"
+#include "tpm2-response.h"
+#include "tss2-tcti-tabrmd.h"
 #include "util.h"
 
 #ifndef G_SOURCE_FUNC
@@ -28,6 +40,7 @@ enum {
     PROP_COMMAND_ATTRS,
     PROP_CONNECTION_MANAGER,
     PROP_SINK,
+    PROP_REACTOR_COUNT,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
@@ -59,6 +72,15 @@ command_source_source_interface_init (gpointer g_iface)
     SourceInterface *source = (SourceInterface*)g_iface;
     source->add_sink = command_source_add_sink;
 }
+/*
+ * The per-connection structures come from slabs shared by every
+ * CommandSource so connection churn doesn't fragment the heap.
+ */
+static slab_cache_t source_data_cache =
+    SLAB_CACHE_INIT (sizeof (source_data_t), SLAB_OBJECTS_DEFAULT);
+static slab_cache_t reactor_entry_cache =
+    SLAB_CACHE_INIT (sizeof (command_source_reactor_entry_t),
+                     SLAB_OBJECTS_DEFAULT);
 /*
  * This is a callback function used to clean up memory used by the
  * source_data_t structure. It's called by the GHashTable when removing
@@ -68,9 +90,10 @@ static void
 source_data_free (gpointer data)
 {
     source_data_t *source_data = (source_data_t*)data;
+    g_object_unref (source_data->connection);
     g_object_unref (source_data->cancellable);
     g_source_unref (source_data->source);
-    g_free (source_data);
+    slab_cache_free (&source_data_cache, source_data);
 }
 /*
  * Initialize a CommandSource instance.
@@ -94,6 +117,18 @@ command_source_init (CommandSource *source)
                                g_direct_equal,
                                g_object_unref,
                                source_data_free);
+    source->priority_commands = g_hash_table_new (g_direct_hash,
+                                                  g_direct_equal);
+    source->priority_uids = g_hash_table_new (g_direct_hash, g_direct_equal);
+    source->uid_rate_limits = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_mutex_init (&source->rate_mutex);
+    source->rate_buckets = g_hash_table_new_full (g_direct_hash,
+                                                  g_direct_equal,
+                                                  NULL,
+                                                  g_free);
+    source->tpm_sinks = g_ptr_array_new_with_free_func (g_object_unref);
+    source->tpm_command_attrs = g_ptr_array_new_with_free_func (g_object_unref);
+    source->tpm_queues = g_ptr_array_new_with_free_func (g_object_unref);
 }
 
 G_DEFINE_TYPE_WITH_CODE (
@@ -129,6 +164,9 @@ command_source_set_property (GObject       *object,
         self->sink = SINK (g_value_get_object (value));
         g_object_ref (self->sink);
         break;
+    case PROP_REACTOR_COUNT:
+        self->reactor_count = g_value_get_uint (value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -154,71 +192,575 @@ command_source_get_property (GObject      *object,
     case PROP_SINK:
         g_value_set_object (value, self->sink);
         break;
+    case PROP_REACTOR_COUNT:
+        g_value_set_uint (value, self->reactor_count);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
     }
 }
 /*
- * This function is invoked by the GMainLoop thread when a client GSocket has
- * data ready. This is what makes the CommandSource a source (of Tpm2Commands).
- * Here we take the GSocket, extract the command body from the it and
- * transform it to a Tpm2Command. Most of the details are handled by utility
- * functions further down the stack.
+ * Look up the Sink and CommandAttrs for the TPM that serves 'connection'.
+ * TPM 0 uses the 'sink' and 'command-attrs' properties, the others are
+ * added with command_source_add_tpm.
+ * Returns FALSE if there's no such TPM.
+ */
+static gboolean
+command_source_route (CommandSource *self,
+                      Connection    *connection,
+                      Sink         **sink,
+                      CommandAttrs **command_attrs)
+{
+    guint tpm = connection_get_tpm (connection);
+
+    if (tpm == 0) {
+        *sink = self->sink;
+        *command_attrs = self->command_attrs;
+        return TRUE;
+    }
+    if (tpm > self->tpm_sinks->len) {
+        return FALSE;
+    }
+    *sink = SINK (g_ptr_array_index (self->tpm_sinks, tpm - 1));
+    *command_attrs =
+        COMMAND_ATTRS (g_ptr_array_index (self->tpm_command_attrs, tpm - 1));
+    return TRUE;
+}
+/*
+ * Take the next complete command from what the client has sent. With the
+ * shared memory transport the socket only carries the doorbell and the
+ * command is taken from the shared command slot. With the tagged transport
+ * the request tag preceding the command is returned through 'tag'.
+ */
+static uint8_t*
+command_source_take_command (Connection *connection,
+                             guint32    *tag,
+                             size_t     *buf_size,
+                             int        *error)
+{
+    read_buffer_t *rbuf = connection_get_read_buffer (connection);
+    shm_transport_t *shm = connection_get_shm (connection);
+
+    *tag = 0;
+    if (shm != NULL) {
+        return shm_transport_take_command (shm, rbuf, buf_size, error);
+    }
+    if (connection_get_tagged (connection)) {
+        return read_buffer_take_tagged (rbuf, tag, buf_size, error);
+    }
+    return read_buffer_take (rbuf, buf_size, error);
+}
+/*
+ * Answer a command that won't be passed on, and the rest of its batch,
+ * with 'rc'. The responses go through 'sink' so that they're ordered with
+ * the responses to the connection's earlier commands.
+ */
+static void
+command_source_refuse (Sink        *sink,
+                       Connection  *connection,
+                       Tpm2Command *command,
+                       TSS2_RC      rc)
+{
+    GPtrArray *batch = tpm2_command_get_batch (command);
+    Tpm2Response *response;
+    guint i;
+
+    response = tpm2_response_new_rc (connection, rc);
+    tpm2_response_set_request_tag (response,
+                                   tpm2_command_get_request_tag (command));
+    sink_enqueue (sink, G_OBJECT (response));
+    g_object_unref (response);
+    for (i = 0; batch != NULL && i < batch->len; ++i) {
+        response = tpm2_response_new_rc (connection, rc);
+        tpm2_response_set_request_tag (response,
+            tpm2_command_get_request_tag (g_ptr_array_index (batch, i)));
+        sink_enqueue (sink, G_OBJECT (response));
+        g_object_unref (response);
+    }
+}
+/*
+ * Check the framing of a command and of the rest of its batch, see
+ * tpm2_command_check. A batch is passed on as one message so a single
+ * malformed command refuses all of it.
+ * Returns TSS2_RC_SUCCESS or the RC of the first malformed command.
+ */
+static TSS2_RC
+command_source_check (Connection  *connection,
+                      Tpm2Command *command)
+{
+    GPtrArray *batch = tpm2_command_get_batch (command);
+    TSS2_RC rc;
+    guint i;
+
+    rc = tpm2_command_check (command);
+    for (i = 0; rc == TSS2_RC_SUCCESS && batch != NULL && i < batch->len; ++i) {
+        rc = tpm2_command_check (g_ptr_array_index (batch, i));
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        g_debug ("%s: malformed command from connection 0x%" PRIx64
+                 ", RC: 0x%" PRIx32, __func__, connection->id, rc);
+    }
+    return rc;
+}
+/*
+ * Create the Tpm2Command for a command buffer taken from 'connection'.
+ * The command takes ownership of 'buf'.
+ */
+static Tpm2Command*
+command_source_new_command (CommandSource *self,
+                            Connection    *connection,
+                            CommandAttrs  *command_attrs,
+                            uint8_t       *buf,
+                            size_t         buf_size,
+                            guint32        tag)
+{
+    Tpm2Command *command;
+    TPMA_CC attributes;
+    guint32 timeout;
+
+    attributes = command_attrs_from_cc (command_attrs,
+                                        get_command_code (buf));
+    command = tpm2_command_new (connection, buf, buf_size, attributes);
+    if (command == NULL) {
+        return NULL;
+    }
+    TABRMD_PROBE3 (command_receive,
+                   connection->id,
+                   tpm2_command_get_code (command),
+                   buf_size);
+    flight_recorder_record (FLIGHT_EVENT_RECEIVED,
+                            connection->id,
+                            tpm2_command_get_code (command),
+                            0);
+    trace_record (self->trace, TRACE_COMMAND, connection->id, buf, buf_size);
+    tpm2_command_set_request_tag (command, tag);
+    timeout = connection_get_command_timeout (connection);
+    if (timeout != 0) {
+        tpm2_command_set_deadline (command,
+            tpm2_command_get_timestamp (command) + (gint64)timeout * 1000);
+    }
+    tpm2_command_set_trace_context (command,
+                                    connection_get_trace_context (connection));
+    tpm2_command_set_priority (command,
+                               command_source_classify (self, command));
+    return command;
+}
+/*
+ * Split a batch frame, see TABRMD_BATCH_TAG, into its commands. The
+ * first command is returned and carries the others in its batch so that
+ * the whole batch is queued, admitted and scheduled as one message.
+ * 'buf' is freed.
+ * Returns NULL if the batch is malformed or empty.
+ */
+static Tpm2Command*
+command_source_new_batch (CommandSource *self,
+                          Connection    *connection,
+                          CommandAttrs  *command_attrs,
+                          uint8_t       *buf,
+                          size_t         buf_size)
+{
+    read_buffer_t batch = {
+        .data = buf,
+        .start = TPM_HEADER_SIZE,
+        .len = buf_size - TPM_HEADER_SIZE,
+    };
+    Tpm2Command *head = NULL, *command;
+    uint8_t *command_buf;
+    size_t command_size;
+    guint32 tag, flags = get_command_code (buf);
+    int error = 0;
+
+    while ((command_buf = read_buffer_take_tagged (&batch,
+                                                   &tag,
+                                                   &command_size,
+                                                   &error)) != NULL)
+    {
+        command = command_source_new_command (self,
+                                              connection,
+                                              command_attrs,
+                                              command_buf,
+                                              command_size,
+                                              tag);
+        if (command == NULL) {
+            error = EPROTO;
+            break;
+        }
+        if (head == NULL) {
+            head = command;
+            continue;
+        }
+        tpm2_command_batch_append (head, command);
+        g_object_unref (command);
+    }
+    if (error != 0 || batch.len != 0 || head == NULL) {
+        g_warning ("%s: malformed batch from connection 0x%" PRIx64,
+                   __func__, connection->id);
+        g_clear_object (&head);
+    } else {
+        tpm2_command_set_batch_stop (head,
+            (flags & TSS2_TCTI_TABRMD_BATCH_STOP_ON_ERROR) != 0);
+    }
+    /* taking the last command already released a batch read to the end */
+    read_buffer_clear (&batch);
+    return head;
+}
+/*
+ * Return the size of a control frame with 'op', see TABRMD_CONTROL_TAG.
+ */
+static size_t
+command_source_control_size (guint32 op)
+{
+    switch (op) {
+    case TABRMD_CONTROL_SET_TIMEOUT:
+        return TABRMD_CONTROL_TIMEOUT_SIZE;
+    case TABRMD_CONTROL_SET_TRACE_CONTEXT:
+        return TABRMD_CONTROL_TRACE_CONTEXT_SIZE;
+    default:
+        return TABRMD_CONTROL_SIZE;
+    }
+}
+/*
+ * Let 'sink' know that 'connection', a connection or one of its
+ * channels, is gone.
+ */
+static void
+command_source_send_removed (Sink       *sink,
+                             Connection *connection)
+{
+    ControlMessage *msg;
+
+    msg = control_message_new_with_object (CONNECTION_REMOVED,
+                                           G_OBJECT (connection));
+    sink_enqueue (sink, G_OBJECT (msg));
+    g_object_unref (msg);
+}
+/*
+ * Send the commands read from 'connection' after this to channel 'id',
+ * see TABRMD_CONTROL_SET_CHANNEL. A channel that isn't open is
+ * opened with a HandleMap as large as the connection's.
+ * Returns FALSE if the connection may not open the channel.
+ */
+static gboolean
+command_source_set_channel (CommandSource *self,
+                            Connection    *connection,
+                            guint8         id)
+{
+    Connection *channel;
+    HandleMap *map, *channel_map;
+
+    if (id == 0) {
+        connection_set_current (connection, connection);
+        return TRUE;
+    }
+    channel = connection_lookup_channel (connection, id);
+    if (channel != NULL) {
+        connection_set_current (connection, channel);
+        return TRUE;
+    }
+    /* the shared memory transport has a single command slot */
+    if (connection_get_shm (connection) != NULL ||
+        connection_get_channel_count (connection) >= self->max_channels)
+    {
+        g_warning ("%s: connection 0x%" PRIx64 " may not open channel %"
+                   PRIu8, __func__, connection->id, id);
+        return FALSE;
+    }
+    map = connection_get_trans_map (connection);
+    channel_map = handle_map_new (TPM2_HT_TRANSIENT,
+                                  handle_map_get_max_entries (map));
+    g_object_unref (map);
+    channel = connection_new_channel (connection, id, channel_map);
+    g_object_unref (channel_map);
+    connection_add_channel (connection, channel);
+    connection_set_current (connection, channel);
+    g_debug ("%s: connection 0x%" PRIx64 " opened channel %" PRIu8
+             " as 0x%" PRIx64, __func__, connection->id, id, channel->id);
+    g_object_unref (channel);
+    return TRUE;
+}
+/*
+ * Close channel 'id' of 'connection', see
+ * TABRMD_CONTROL_CLOSE_CHANNEL: 'sink' is told it's gone like a
+ * connection the client closed. Closing a channel that isn't open does
+ * nothing.
+ * Returns FALSE if the channel still has commands in flight.
+ */
+static gboolean
+command_source_close_channel (Connection *connection,
+                              Sink       *sink,
+                              guint8      id)
+{
+    Connection *channel;
+
+    if (id == 0) {
+        g_warning ("%s: connection 0x%" PRIx64 " closed channel 0",
+                   __func__, connection->id);
+        return FALSE;
+    }
+    channel = connection_lookup_channel (connection, id);
+    if (channel == NULL) {
+        return TRUE;
+    }
+    if (connection_get_in_flight (channel) != 0) {
+        g_warning ("%s: connection 0x%" PRIx64 " closed channel %" PRIu8
+                   " with commands in flight", __func__, connection->id, id);
+        return FALSE;
+    }
+    g_object_ref (channel);
+    connection_remove_channel (connection, id);
+    command_source_send_removed (sink, channel);
+    g_object_unref (channel);
+    return TRUE;
+}
+/*
+ * Carry out a control frame, see TABRMD_CONTROL_TAG, read from
+ * 'connection'. The frames that select and close channels are for the
+ * connection, the others for 'target', the connection or channel its
+ * commands currently go to. A cancel whose request fails is only logged:
+ * control frames get no response and the commands it was for are
+ * answered either way.
+ * Returns FALSE if the frame is malformed.
+ */
+static gboolean
+command_source_control (CommandSource *self,
+                        Connection    *connection,
+                        Connection    *target,
+                        Sink          *sink,
+                        uint8_t       *buf,
+                        size_t         buf_size)
+{
+    TSS2_RC rc;
+    UINT32 timeout;
+    trace_context_t context;
+
+    if (buf_size != command_source_control_size (get_command_code (buf))) {
+        g_warning ("%s: control frame of %zu bytes from connection 0x%"
+                   PRIx64, __func__, buf_size, connection->id);
+        return FALSE;
+    }
+    switch (get_command_code (buf)) {
+    case TABRMD_CONTROL_SET_LOCALITY:
+        /* no response to refuse it with: the client is dropped instead */
+        if (!connection_locality_permitted (target, buf [TPM_HEADER_SIZE])) {
+            g_warning ("%s: locality %" PRIu8 " not permitted for "
+                       "connection 0x%" PRIx64, __func__,
+                       buf [TPM_HEADER_SIZE], connection->id);
+            return FALSE;
+        }
+        connection_set_locality (target, buf [TPM_HEADER_SIZE]);
+        return TRUE;
+    case TABRMD_CONTROL_CANCEL:
+        if (self->cancel_func == NULL) {
+            return TRUE;
+        }
+        rc = self->cancel_func (target, self->cancel_data);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_info ("%s: cancel for connection 0x%" PRIx64 " failed: 0x%"
+                    PRIx32, __func__, target->id, rc);
+        }
+        return TRUE;
+    case TABRMD_CONTROL_SET_TIMEOUT:
+        memcpy (&timeout, &buf [TPM_HEADER_SIZE], sizeof (timeout));
+        connection_set_command_timeout (target, GUINT32_FROM_BE (timeout));
+        return TRUE;
+    case TABRMD_CONTROL_SET_TRACE_CONTEXT:
+        memcpy (&context.trace_id,
+                &buf [TPM_HEADER_SIZE],
+                TRACE_CONTEXT_TRACE_ID_SIZE);
+        memcpy (&context.parent_id,
+                &buf [TPM_HEADER_SIZE + TRACE_CONTEXT_TRACE_ID_SIZE],
+                TRACE_CONTEXT_SPAN_ID_SIZE);
+        context.flags = buf [TPM_HEADER_SIZE + TRACE_CONTEXT_TRACE_ID_SIZE +
+                             TRACE_CONTEXT_SPAN_ID_SIZE];
+        connection_set_trace_context (target, &context);
+        return TRUE;
+    case TABRMD_CONTROL_SET_CHANNEL:
+        return command_source_set_channel (self,
+                                           connection,
+                                           buf [TPM_HEADER_SIZE]);
+    case TABRMD_CONTROL_CLOSE_CHANNEL:
+        return command_source_close_channel (connection,
+                                             sink,
+                                             buf [TPM_HEADER_SIZE]);
+    default:
+        g_warning ("%s: unknown control op 0x%" PRIx32 " from connection 0x%"
+                   PRIx64, __func__, get_command_code (buf), connection->id);
+        return FALSE;
+    }
+}
+/*
+ * Remove a connection the client closed or that failed from the
+ * ConnectionManager and let 'sink' know it's gone, along with the
+ * channels open on it.
+ */
+static void
+command_source_remove_connection (CommandSource *self,
+                                  Connection    *connection,
+                                  Sink          *sink)
+{
+    GList *channels, *item;
+
+    g_debug ("%s: removing connection from connection_manager", __func__);
+    connection_manager_remove (self->connection_manager,
+                               connection);
+    channels = connection_take_channels (connection);
+    for (item = channels; item != NULL; item = item->next) {
+        command_source_send_removed (sink, CONNECTION (item->data));
+    }
+    g_list_free_full (channels, g_object_unref);
+    command_source_send_removed (sink, connection);
+}
+/*
+ * Read what the client has sent with a single non-blocking read into the
+ * connection's read buffer. Each complete command in the buffer is
+ * transformed to a Tpm2Command and passed to the sink. A partial command
+ * stays in the buffer until the rest of it arrives. Most of the details
+ * are handled by utility functions further down the stack.
  *
- * If an error occurs while getting the command from the GSocket the connection
- * with the client will be closed and removed from the ConnectionManager.
- * Additionally the function will return FALSE and the GSource will no longer
- * monitor the GSocket for the G_IO_IN condition.
+ * If an error occurs while getting the command from the stream the
+ * connection with the client will be closed and removed from the
+ * ConnectionManager. The function then returns FALSE and the caller must
+ * stop monitoring the stream.
+ * A NULL 'istream' skips the read: the caller has already appended the
+ * data to the connection's read buffer.
  */
-gboolean
-command_source_on_input_ready (GInputStream *istream,
-                               gpointer      user_data)
+static gboolean
+command_source_read_command (CommandSource *self,
+                             Connection    *connection,
+                             GInputStream  *istream)
 {
-    source_data_t *data = (source_data_t*)user_data;
-    Connection    *connection;
+    read_buffer_t *rbuf = connection_get_read_buffer (connection);
+    Connection    *target;
     Tpm2Command   *command;
-    TPMA_CC        attributes = { 0 };
-    uint8_t       *buf;
-    size_t         buf_size;
+    GPtrArray     *batch;
+    Sink          *sink = self->sink;
+    CommandAttrs  *command_attrs;
+    uint8_t       *buf = NULL;
+    size_t         buf_size = 0;
+    guint32        tag;
+    TSS2_RC        rc;
+    int            ret;
+    gboolean       taken = FALSE;
+    metrics_span_t span;
 
-    g_debug (__func__);
-    connection =
-        connection_manager_lookup_istream (data->self->connection_manager,
-                                           istream);
-    if (connection == NULL) {
-        g_error ("%s: failed to get connection associated with istream",
-                 __func__);
-    }
-    buf = read_tpm_buffer_alloc (istream, &buf_size);
-    if (buf == NULL) {
+    metrics_span_begin (&span);
+    if (!command_source_route (self, connection, &sink, &command_attrs)) {
+        g_warning ("%s: connection is for TPM %u which doesn't exist",
+                   __func__, connection_get_tpm (connection));
         goto fail_out;
     }
-    attributes = command_attrs_from_cc (data->self->command_attrs,
-                                        get_command_code (buf));
-    command = tpm2_command_new (connection, buf, buf_size, attributes);
-    if (command != NULL) {
-        sink_enqueue (data->self->sink, G_OBJECT (command));
+    if (istream != NULL) {
+        ret = read_buffer_fill (istream, rbuf);
+        if (ret != 0) {
+            goto fail_out;
+        }
+    }
+    while ((buf = command_source_take_command (connection,
+                                               &tag,
+                                               &buf_size,
+                                               &ret)) != NULL)
+    {
+        taken = TRUE;
+        target = connection_get_current (connection);
+        if (get_command_tag (buf) == TABRMD_CONTROL_TAG) {
+            if (!command_source_control (self,
+                                         connection,
+                                         target,
+                                         sink,
+                                         buf,
+                                         buf_size))
+            {
+                goto fail_out;
+            }
+            buffer_pool_free (buf, buf_size);
+            buf = NULL;
+            continue;
+        }
+        if (connection_get_tagged (connection) &&
+            get_command_tag (buf) == TABRMD_BATCH_TAG)
+        {
+            command = command_source_new_batch (self,
+                                                target,
+                                                command_attrs,
+                                                buf,
+                                                buf_size);
+        } else {
+            command = command_source_new_command (self,
+                                                  target,
+                                                  command_attrs,
+                                                  buf,
+                                                  buf_size,
+                                                  tag);
+        }
+        buf = NULL;
+        if (command == NULL) {
+            goto fail_out;
+        }
+        /* every command is answered, refused or not */
+        batch = tpm2_command_get_batch (command);
+        connection_add_in_flight (target,
+                                  1 + (batch != NULL ? batch->len : 0));
+        rc = command_source_check (target, command);
+        if (rc != TSS2_RC_SUCCESS) {
+            command_source_refuse (sink, target, command, rc);
+            g_object_unref (command);
+            continue;
+        }
+        if (!command_source_admit (self, target)) {
+            g_debug ("%s: connection 0x%" PRIx64 " is over its rate limit",
+                     __func__, target->id);
+            command_source_refuse (sink,
+                                   target,
+                                   command,
+                                   TSS2_RESMGR_RC_RETRY);
+            g_object_unref (command);
+            continue;
+        }
+        sink_enqueue (sink, G_OBJECT (command));
         /* the sink now owns this message */
         g_object_unref (command);
-    } else {
+    }
+    if (ret != 0) {
         goto fail_out;
     }
-    g_object_unref (connection);
-    return G_SOURCE_CONTINUE;
+    /*
+     * Only a complete command counts as activity: a client trickling in a
+     * command that never completes is closed like an idle one.
+     */
+    if (taken) {
+        connection_touch (connection);
+    }
+    /* the rest of a command can't arrive in a later message */
+    if (connection_get_seqpacket (connection) && rbuf->len != 0) {
+        g_warning ("%s: message from connection 0x%" PRIx64 " ends in a "
+                   "partial command", __func__, connection->id);
+        goto fail_out;
+    }
+    metrics_span_end (self->metrics, METRICS_STAGE_READ, &span);
+    return TRUE;
 fail_out:
-    if (buf != NULL) {
-        g_free (buf);
+    buffer_pool_free (buf, buf_size);
+    command_source_remove_connection (self, connection, sink);
+    metrics_span_end (self->metrics, METRICS_STAGE_READ, &span);
+    return FALSE;
+}
+/*
+ * This function is invoked by the GMainLoop thread when a client GSocket has
+ * data ready. This is what makes the CommandSource a source (of Tpm2Commands).
+ * If reading the command fails the function will return FALSE and the
+ * GSource will no longer monitor the GSocket for the G_IO_IN condition.
+ */
+gboolean
+command_source_on_input_ready (GInputStream *istream,
+                               gpointer      user_data)
+{
+    source_data_t *data = (source_data_t*)user_data;
+
+    g_debug (__func__);
+    if (command_source_read_command (data->self, data->connection, istream)) {
+        return G_SOURCE_CONTINUE;
     }
-    g_debug ("%s: removing connection from connection_manager", __func__);
-    connection_manager_remove (data->self->connection_manager,
-                               connection);
-    ControlMessage *msg =
-        control_message_new_with_object (CONNECTION_REMOVED,
-                                         G_OBJECT (connection));
-    sink_enqueue (data->self->sink, G_OBJECT (msg));
-    g_object_unref (msg);
-    g_object_unref (connection);
     /*
      * Remove data from hash table which includes the GCancellable associated
      * with the G_IN_IO condition source. Don't call the cancellable though
@@ -230,21 +772,569 @@ fail_out:
     return G_SOURCE_REMOVE;
 }
 /*
- * This is a callback function invoked by the ConnectionManager when a new
- * Connection object is added to it. It creates and sets up the GIO
- * machinery needed to monitor the Connection for I/O events.
+ * Returns TRUE if a reactor should stop reading 'connection' until the
+ * responses to the commands it has in flight are out.
  */
-gint
-command_source_on_new_connection (ConnectionManager   *connection_manager,
-                                  Connection          *connection,
-                                  CommandSource       *self)
+static gboolean
+command_source_should_pause (CommandSource *self,
+                             Connection    *connection)
+{
+    guint tpm = connection_get_tpm (connection);
+
+    if (connection_get_in_flight (connection) == 0) {
+        return FALSE;
+    }
+    if (self->pause_reads) {
+        return TRUE;
+    }
+    if (self->pause_watermark == 0 || tpm >= self->tpm_queues->len) {
+        return FALSE;
+    }
+    return message_queue_get_length (g_ptr_array_index (self->tpm_queues, tpm))
+        >= self->pause_watermark;
+}
+static void
+command_source_reactor_entry_free (gpointer data)
+{
+    command_source_reactor_entry_t *entry = (command_source_reactor_entry_t*)data;
+
+    g_object_unref (entry->connection);
+    slab_cache_free (&reactor_entry_cache, entry);
+}
+/*
+ * Set up the epoll instance for a reactor. The eventfd used to stop the
+ * reactor is registered with a NULL data pointer to tell it apart from
+ * client connections.
+ */
+static void
+command_source_reactor_init (command_source_reactor_t *reactor,
+                             CommandSource            *source)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+
+    reactor->source = source;
+    reactor->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (reactor->epoll_fd == -1) {
+        g_error ("%s: epoll_create1 failed: %s", __func__, strerror (errno));
+    }
+    reactor->wakeup_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reactor->wakeup_fd == -1) {
+        g_error ("%s: eventfd failed: %s", __func__, strerror (errno));
+    }
+    if (epoll_ctl (reactor->epoll_fd,
+                   EPOLL_CTL_ADD,
+                   reactor->wakeup_fd,
+                   &event) == -1) {
+        g_error ("%s: failed to add eventfd to epoll instance: %s",
+                 __func__, strerror (errno));
+    }
+    g_mutex_init (&reactor->mutex);
+    reactor->entries =
+        g_hash_table_new_full (g_direct_hash,
+                               g_direct_equal,
+                               command_source_reactor_entry_free,
+                               NULL);
+}
+#ifdef HAVE_LIBURING
+/*
+ * Set up the io_uring of a reactor and the ring of receive buffers shared
+ * by its connections. Returns FALSE if the kernel doesn't support it.
+ */
+static gboolean
+command_source_uring_init (command_source_reactor_t *reactor)
+{
+    guint i;
+    gint ret;
+
+    ret = io_uring_queue_init (COMMAND_SOURCE_URING_ENTRIES, &reactor->ring, 0);
+    if (ret < 0) {
+        g_warning ("%s: io_uring_queue_init failed: %s",
+                   __func__, strerror (-ret));
+        return FALSE;
+    }
+    reactor->buf_ring =
+        io_uring_setup_buf_ring (&reactor->ring,
+                                 COMMAND_SOURCE_URING_BUFFERS,
+                                 COMMAND_SOURCE_URING_BUFFER_GROUP,
+                                 0,
+                                 &ret);
+    if (reactor->buf_ring == NULL) {
+        g_warning ("%s: io_uring_setup_buf_ring failed: %s",
+                   __func__, strerror (-ret));
+        io_uring_queue_exit (&reactor->ring);
+        return FALSE;
+    }
+    reactor->bufs = g_malloc (COMMAND_SOURCE_URING_BUFFERS *
+                              COMMAND_SOURCE_URING_BUFFER_SIZE);
+    for (i = 0; i < COMMAND_SOURCE_URING_BUFFERS; ++i) {
+        io_uring_buf_ring_add (reactor->buf_ring,
+                               &reactor->bufs [i * COMMAND_SOURCE_URING_BUFFER_SIZE],
+                               COMMAND_SOURCE_URING_BUFFER_SIZE,
+                               (unsigned short)i,
+                               io_uring_buf_ring_mask (COMMAND_SOURCE_URING_BUFFERS),
+                               (int)i);
+    }
+    io_uring_buf_ring_advance (reactor->buf_ring, COMMAND_SOURCE_URING_BUFFERS);
+    reactor->uring_enabled = TRUE;
+    return TRUE;
+}
+static void
+command_source_uring_clear (command_source_reactor_t *reactor)
+{
+    io_uring_free_buf_ring (&reactor->ring,
+                            reactor->buf_ring,
+                            COMMAND_SOURCE_URING_BUFFERS,
+                            COMMAND_SOURCE_URING_BUFFER_GROUP);
+    io_uring_queue_exit (&reactor->ring);
+    g_clear_pointer (&reactor->bufs, g_free);
+    reactor->uring_enabled = FALSE;
+}
+/*
+ * Get a submission queue entry, making room by submitting what's queued
+ * if need be. The caller holds the reactor mutex.
+ */
+static struct io_uring_sqe*
+command_source_uring_get_sqe (command_source_reactor_t *reactor)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = io_uring_get_sqe (&reactor->ring);
+    if (sqe == NULL) {
+        io_uring_submit (&reactor->ring);
+        sqe = io_uring_get_sqe (&reactor->ring);
+    }
+    if (sqe == NULL) {
+        g_warning ("%s: io_uring submission queue is full", __func__);
+    }
+    return sqe;
+}
+/*
+ * Queue a receive on the connection of 'entry'. The kernel polls the
+ * socket first and only picks a buffer once there's data, so a connection
+ * waiting for input doesn't hold one. On a SOCK_SEQPACKET connection the
+ * full length of the message is returned so one that didn't fit in the
+ * buffer is caught. The caller holds the reactor mutex and submits.
+ */
+static gboolean
+command_source_uring_arm (command_source_reactor_t       *reactor,
+                          command_source_reactor_entry_t *entry)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = command_source_uring_get_sqe (reactor);
+    if (sqe == NULL) {
+        return FALSE;
+    }
+    io_uring_prep_recv (sqe,
+                        entry->fd,
+                        NULL,
+                        0,
+                        connection_get_seqpacket (entry->connection) ?
+                        MSG_TRUNC : 0);
+    sqe->ioprio |= IORING_RECVSEND_POLL_FIRST;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = COMMAND_SOURCE_URING_BUFFER_GROUP;
+    io_uring_sqe_set_data (sqe, entry);
+    return TRUE;
+}
+#endif
+static void
+command_source_reactor_clear (command_source_reactor_t *reactor)
+{
+    command_source_reactor_entry_t *entry;
+    GHashTableIter iter;
+
+    g_hash_table_iter_init (&iter, reactor->entries);
+    while (g_hash_table_iter_next (&iter, (gpointer*)&entry, NULL)) {
+        connection_set_resume_func (entry->connection, NULL, NULL);
+    }
+#ifdef HAVE_LIBURING
+    if (reactor->uring_enabled) {
+        command_source_uring_clear (reactor);
+    }
+#endif
+    g_clear_pointer (&reactor->entries, g_hash_table_unref);
+    g_mutex_clear (&reactor->mutex);
+    close (reactor->wakeup_fd);
+    close (reactor->epoll_fd);
+}
+/*
+ * Stop watching a connection. Only the reactor thread that owns the
+ * connection calls this, so an entry returned by epoll_wait stays valid
+ * until the thread removes it. With io_uring nothing is queued on the
+ * connection anymore by then. The resume function goes first: it may
+ * take the reactor mutex with the connection's pause mutex held.
+ */
+static void
+command_source_reactor_remove (command_source_reactor_t       *reactor,
+                               command_source_reactor_entry_t *entry)
+{
+    connection_set_resume_func (entry->connection, NULL, NULL);
+    g_mutex_lock (&reactor->mutex);
+#ifdef HAVE_LIBURING
+    if (reactor->uring_enabled) {
+        g_hash_table_remove (reactor->entries, entry);
+        g_mutex_unlock (&reactor->mutex);
+        return;
+    }
+#endif
+    if (epoll_ctl (reactor->epoll_fd, EPOLL_CTL_DEL, entry->fd, NULL) == -1) {
+        g_warning ("%s: failed to remove fd %d from epoll instance: %s",
+                   __func__, entry->fd, strerror (errno));
+    }
+    g_hash_table_remove (reactor->entries, entry);
+    g_mutex_unlock (&reactor->mutex);
+}
+/*
+ * Start reading a paused connection again, called by connection_answered
+ * once its last response is out.
+ */
+static void
+command_source_reactor_resume (gpointer data)
+{
+    command_source_reactor_entry_t *entry = (command_source_reactor_entry_t*)data;
+    command_source_reactor_t *reactor = entry->reactor;
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = entry };
+
+#ifdef HAVE_LIBURING
+    if (reactor->uring_enabled) {
+        g_mutex_lock (&reactor->mutex);
+        if (command_source_uring_arm (reactor, entry)) {
+            io_uring_submit (&reactor->ring);
+        } else {
+            g_warning ("%s: failed to resume connection 0x%" PRIx64,
+                       __func__, entry->connection->id);
+        }
+        g_mutex_unlock (&reactor->mutex);
+        return;
+    }
+#endif
+    if (epoll_ctl (reactor->epoll_fd, EPOLL_CTL_MOD, entry->fd, &event) == -1) {
+        g_warning ("%s: failed to watch fd %d for input again: %s",
+                   __func__, entry->fd, strerror (errno));
+    }
+}
+/*
+ * Stop reading the connection of 'entry' until its responses are out.
+ * The fd is left in the epoll instance without events: EPOLLHUP is
+ * reported regardless, so a client that goes away while paused is still
+ * noticed right away.
+ */
+static void
+command_source_reactor_pause (command_source_reactor_t       *reactor,
+                              command_source_reactor_entry_t *entry)
+{
+    struct epoll_event event = { .events = 0, .data.ptr = entry };
+
+    if (epoll_ctl (reactor->epoll_fd, EPOLL_CTL_MOD, entry->fd, &event) == -1) {
+        g_warning ("%s: failed to stop watching fd %d for input: %s",
+                   __func__, entry->fd, strerror (errno));
+        return;
+    }
+    if (!connection_pause (entry->connection)) {
+        event.events = EPOLLIN;
+        if (epoll_ctl (reactor->epoll_fd, EPOLL_CTL_MOD, entry->fd, &event) == -1) {
+            g_warning ("%s: failed to watch fd %d for input again: %s",
+                       __func__, entry->fd, strerror (errno));
+        }
+    }
+}
+/*
+ * Assign a new connection to the next reactor. The resume function is
+ * set before the reactor can see the connection and pause it.
+ */
+static gint
+command_source_reactor_add (CommandSource *self,
+                            Connection    *connection)
+{
+    command_source_reactor_t *reactor;
+    command_source_reactor_entry_t *entry;
+    struct epoll_event event = { .events = EPOLLIN, };
+    GIOStream *iostream;
+    gint fd;
+    guint index;
+
+    fd = connection_get_fd (connection);
+    if (fd < 0) {
+        g_warning ("%s: connection has no fd to watch", __func__);
+        return -1;
+    }
+    index = (guint)g_atomic_int_add (&self->next_reactor, 1) % self->reactor_count;
+    reactor = &self->reactors [index];
+    iostream = connection_get_iostream (connection);
+    entry = slab_cache_alloc0 (&reactor_entry_cache);
+    entry->reactor = reactor;
+    entry->connection = g_object_ref (connection);
+    entry->istream = g_io_stream_get_input_stream (iostream);
+    entry->fd = fd;
+    event.data.ptr = entry;
+
+    g_debug ("%s: adding connection to reactor %u", __func__, index);
+    connection_set_resume_func (connection,
+                                command_source_reactor_resume,
+                                entry);
+    g_mutex_lock (&reactor->mutex);
+    g_hash_table_add (reactor->entries, entry);
+#ifdef HAVE_LIBURING
+    if (reactor->uring_enabled) {
+        if (!command_source_uring_arm (reactor, entry)) {
+            g_hash_table_remove (reactor->entries, entry);
+            g_mutex_unlock (&reactor->mutex);
+            connection_set_resume_func (connection, NULL, NULL);
+            return -1;
+        }
+        io_uring_submit (&reactor->ring);
+        g_mutex_unlock (&reactor->mutex);
+        return 0;
+    }
+#endif
+    if (epoll_ctl (reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        g_warning ("%s: failed to add fd %d to epoll instance: %s",
+                   __func__, fd, strerror (errno));
+        g_hash_table_remove (reactor->entries, entry);
+        g_mutex_unlock (&reactor->mutex);
+        connection_set_resume_func (connection, NULL, NULL);
+        return -1;
+    }
+    g_mutex_unlock (&reactor->mutex);
+    return 0;
+}
+/*
+ * Remove the connection of 'entry' after the client closed it or it
+ * failed outside of command_source_read_command.
+ */
+static void
+command_source_reactor_drop (command_source_reactor_t       *reactor,
+                             command_source_reactor_entry_t *entry)
+{
+    CommandSource *self = reactor->source;
+    CommandAttrs *command_attrs;
+    Sink *sink = self->sink;
+
+    command_source_route (self, entry->connection, &sink, &command_attrs);
+    command_source_remove_connection (self, entry->connection, sink);
+}
+#ifdef HAVE_LIBURING
+/*
+ * Handle a completed receive on the connection of 'entry'. The data is
+ * appended to the connection's read buffer and the commands in it are
+ * passed on, then the receive buffer goes straight back to the kernel.
+ * Returns FALSE once the connection has been removed.
+ */
+static gboolean
+command_source_uring_input (command_source_reactor_t       *reactor,
+                            command_source_reactor_entry_t *entry,
+                            struct io_uring_cqe            *cqe)
+{
+    read_buffer_t *rbuf = connection_get_read_buffer (entry->connection);
+    guint8 *buf;
+    const guint8 *data;
+    size_t size, appended;
+    guint bid;
+    gboolean ret = TRUE;
+
+    if (cqe->res == -ENOBUFS || cqe->res == -EAGAIN || cqe->res == -EINTR) {
+        return TRUE;
+    }
+    if (cqe->res <= 0) {
+        if (cqe->res == 0) {
+            g_debug ("%s: recv produced EOF", __func__);
+        } else {
+            g_warning ("%s: recv on fd %d failed: %s",
+                       __func__, entry->fd, strerror (-cqe->res));
+        }
+        command_source_reactor_drop (reactor, entry);
+        return FALSE;
+    }
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    buf = &reactor->bufs [bid * COMMAND_SOURCE_URING_BUFFER_SIZE];
+    data = buf;
+    size = (size_t)cqe->res;
+    if (size > COMMAND_SOURCE_URING_BUFFER_SIZE) {
+        g_warning ("%s: message of %zu bytes from connection 0x%" PRIx64
+                   " is too large", __func__, size, entry->connection->id);
+        command_source_reactor_drop (reactor, entry);
+        ret = FALSE;
+    }
+    while (ret && size > 0) {
+        appended = read_buffer_append (rbuf, data, size);
+        ret = command_source_read_command (reactor->source,
+                                           entry->connection,
+                                           NULL);
+        if (ret && appended == 0) {
+            g_warning ("%s: read buffer is full without a complete command",
+                       __func__);
+            command_source_reactor_drop (reactor, entry);
+            ret = FALSE;
+        }
+        data += appended;
+        size -= appended;
+    }
+    io_uring_buf_ring_add (reactor->buf_ring,
+                           buf,
+                           COMMAND_SOURCE_URING_BUFFER_SIZE,
+                           (unsigned short)bid,
+                           io_uring_buf_ring_mask (COMMAND_SOURCE_URING_BUFFERS),
+                           0);
+    io_uring_buf_ring_advance (reactor->buf_ring, 1);
+    return ret;
+}
+static gboolean
+command_source_uring_rearm (command_source_reactor_t       *reactor,
+                            command_source_reactor_entry_t *entry)
+{
+    gboolean ret;
+
+    g_mutex_lock (&reactor->mutex);
+    ret = command_source_uring_arm (reactor, entry);
+    g_mutex_unlock (&reactor->mutex);
+    return ret;
+}
+/*
+ * Reactor thread using io_uring: a receive is kept queued on each
+ * connection and re-queued once handled. A poll on the eventfd, with a
+ * NULL user data pointer, stops the thread. Completions are reaped without
+ * the mutex, only the submission queue is shared with other threads.
+ */
+static gpointer
+command_source_uring_thread (command_source_reactor_t *reactor)
+{
+    command_source_reactor_entry_t *entry;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    gboolean done = FALSE;
+    guint64 value;
+    guint head, count;
+    gint ret;
+
+    g_mutex_lock (&reactor->mutex);
+    sqe = command_source_uring_get_sqe (reactor);
+    if (sqe == NULL) {
+        g_error ("%s: no room to poll the eventfd", __func__);
+    }
+    io_uring_prep_poll_add (sqe, reactor->wakeup_fd, POLLIN);
+    io_uring_sqe_set_data (sqe, NULL);
+    io_uring_submit (&reactor->ring);
+    g_mutex_unlock (&reactor->mutex);
+    while (!done) {
+        ret = io_uring_wait_cqe (&reactor->ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        } else if (ret < 0) {
+            g_error ("%s: io_uring_wait_cqe failed: %s",
+                     __func__, strerror (-ret));
+        }
+        count = 0;
+        io_uring_for_each_cqe (&reactor->ring, head, cqe) {
+            ++count;
+            entry = (command_source_reactor_entry_t*)io_uring_cqe_get_data (cqe);
+            if (entry == NULL) {
+                done = TRUE;
+            } else if (!command_source_uring_input (reactor, entry, cqe)) {
+                command_source_reactor_remove (reactor, entry);
+            } else if (command_source_should_pause (reactor->source,
+                                                    entry->connection) &&
+                       connection_pause (entry->connection))
+            {
+                /* command_source_reactor_resume queues the next receive */
+            } else if (!command_source_uring_rearm (reactor, entry)) {
+                command_source_reactor_drop (reactor, entry);
+                command_source_reactor_remove (reactor, entry);
+            }
+        }
+        io_uring_cq_advance (&reactor->ring, count);
+        g_mutex_lock (&reactor->mutex);
+        io_uring_submit (&reactor->ring);
+        g_mutex_unlock (&reactor->mutex);
+    }
+    /* reset the eventfd so the CommandSource can be started again */
+    if (read (reactor->wakeup_fd, &value, sizeof (value)) == -1) {
+        g_debug ("%s: eventfd already reset", __func__);
+    }
+
+    return NULL;
+}
+#endif
+/*
+ * Reactor thread: wait for input from the connections assigned to this
+ * reactor and read commands from them until the eventfd is signaled.
+ */
+static gpointer
+command_source_reactor_thread (gpointer data)
+{
+    command_source_reactor_t *reactor = (command_source_reactor_t*)data;
+    command_source_reactor_entry_t *entry;
+    struct epoll_event events [COMMAND_SOURCE_REACTOR_EVENTS];
+    gboolean done = FALSE;
+    guint64 value;
+    gint count, i;
+
+#ifdef HAVE_LIBURING
+    if (reactor->uring_enabled) {
+        return command_source_uring_thread (reactor);
+    }
+#endif
+    while (!done) {
+        count = epoll_wait (reactor->epoll_fd,
+                            events,
+                            G_N_ELEMENTS (events),
+                            -1);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            g_error ("%s: epoll_wait failed: %s", __func__, strerror (errno));
+        }
+        for (i = 0; i < count; ++i) {
+            entry = (command_source_reactor_entry_t*)events [i].data.ptr;
+            if (entry == NULL) {
+                done = TRUE;
+                continue;
+            }
+            /*
+             * The client is gone: whatever it left in the socket would be
+             * answered to nobody, so the connection is removed without
+             * reading it. That also drops its queued commands.
+             */
+            if (events [i].events & (EPOLLHUP | EPOLLERR)) {
+                g_debug ("%s: connection 0x%" PRIx64 " hung up", __func__,
+                         entry->connection->id);
+                command_source_reactor_drop (reactor, entry);
+                command_source_reactor_remove (reactor, entry);
+                continue;
+            }
+            if (!command_source_read_command (reactor->source,
+                                              entry->connection,
+                                              entry->istream)) {
+                command_source_reactor_remove (reactor, entry);
+            } else if (command_source_should_pause (reactor->source,
+                                                    entry->connection)) {
+                command_source_reactor_pause (reactor, entry);
+            }
+        }
+    }
+    /* reset the eventfd so the CommandSource can be started again */
+    if (read (reactor->wakeup_fd, &value, sizeof (value)) == -1) {
+        g_debug ("%s: eventfd already reset", __func__);
+    }
+
+    return NULL;
+}
+/*
+ * Create and set up the GIO machinery needed to monitor the Connection for
+ * I/O events, or hand it to a reactor.
+ */
+static gint
+command_source_watch_connection (CommandSource *self,
+                                 Connection    *connection)
 {
     GIOStream *iostream;
     GPollableInputStream *istream;
     source_data_t *data;
-    UNUSED_PARAM(connection_manager);
 
-    g_info ("%s: adding new connection", __func__);
+    if (self->reactor_count > 0) {
+        return command_source_reactor_add (self, connection);
+    }
     /*
      * Take reference to socket, will be freed when the source_data_t
      * structure is freed
@@ -252,7 +1342,8 @@ command_source_on_new_connection (ConnectionManager   *connection_manager,
     iostream = connection_get_iostream (connection);
     istream = G_POLLABLE_INPUT_STREAM (g_io_stream_get_input_stream (iostream));
     g_object_ref (istream);
-    data = g_malloc0 (sizeof (source_data_t));
+    data = slab_cache_alloc0 (&source_data_cache);
+    data->connection = g_object_ref (connection);
     data->cancellable = g_cancellable_new ();
     data->source = g_pollable_input_stream_create_source (istream,
                                                           data->cancellable);
@@ -272,6 +1363,26 @@ command_source_on_new_connection (ConnectionManager   *connection_manager,
 
     return 0;
 }
+/*
+ * This is a callback function invoked by the ConnectionManager when a new
+ * Connection object is added to it.
+ */
+gint
+command_source_on_new_connection (ConnectionManager   *connection_manager,
+                                  Connection          *connection,
+                                  CommandSource       *self)
+{
+    gint64 start = g_get_monotonic_time ();
+    gint ret;
+    UNUSED_PARAM(connection_manager);
+
+    g_info ("%s: adding new connection", __func__);
+    ret = command_source_watch_connection (self, connection);
+    metrics_observe (self->metrics,
+                     METRICS_CONNECT_WATCH_LATENCY,
+                     g_get_monotonic_time () - start);
+    return ret;
+}
 /*
  * callback for iterating over objects in the member socket_to_source_data_map
  * GHashMap to kill off the GSource. This requires cancelling it, and then
@@ -302,6 +1413,11 @@ command_source_dispose (GObject *object) {
     g_clear_object (&self->sink);
     g_clear_object (&self->connection_manager);
     g_clear_object (&self->command_attrs);
+    g_clear_pointer (&self->tpm_sinks, g_ptr_array_unref);
+    g_clear_pointer (&self->tpm_command_attrs, g_ptr_array_unref);
+    g_clear_pointer (&self->tpm_queues, g_ptr_array_unref);
+    g_clear_object (&self->trace);
+    g_clear_object (&self->metrics);
     /* cancel all outstanding G_IO_IN condition GSources and destroy them */
     if (self->istream_to_source_data_map != NULL) {
         g_hash_table_foreach (self->istream_to_source_data_map,
@@ -309,6 +1425,18 @@ command_source_dispose (GObject *object) {
                               NULL);
     }
     g_clear_pointer (&self->istream_to_source_data_map, g_hash_table_unref);
+    if (self->reactors != NULL) {
+        guint i;
+
+        for (i = 0; i < self->reactor_count; ++i) {
+            command_source_reactor_clear (&self->reactors [i]);
+        }
+        g_clear_pointer (&self->reactors, g_free);
+    }
+    g_clear_pointer (&self->priority_commands, g_hash_table_unref);
+    g_clear_pointer (&self->priority_uids, g_hash_table_unref);
+    g_clear_pointer (&self->uid_rate_limits, g_hash_table_unref);
+    g_clear_pointer (&self->rate_buckets, g_hash_table_unref);
     if (self->main_loop != NULL && g_main_loop_is_running (self->main_loop)) {
         g_main_loop_quit (self->main_loop);
     }
@@ -324,18 +1452,111 @@ command_source_dispose (GObject *object) {
 static void
 command_source_finalize (GObject  *object)
 {
+    CommandSource *self = COMMAND_SOURCE (object);
+
+    g_mutex_clear (&self->rate_mutex);
     G_OBJECT_CLASS (command_source_parent_class)->finalize (object);
 }
+/*
+ * The reactors are created once the construct-only 'reactor-count'
+ * property has been set.
+ */
+static void
+command_source_constructed (GObject *object)
+{
+    CommandSource *self = COMMAND_SOURCE (object);
+    guint i;
+
+    G_OBJECT_CLASS (command_source_parent_class)->constructed (object);
+    if (self->reactor_count == 0) {
+        return;
+    }
+    self->reactors = g_new0 (command_source_reactor_t, self->reactor_count);
+    for (i = 0; i < self->reactor_count; ++i) {
+        command_source_reactor_init (&self->reactors [i], self);
+    }
+}
+/*
+ * Have the reactor threads use 'engine' to wait for and read client
+ * input. This must be called before the CommandSource thread is started.
+ * Returns FALSE, leaving the reactors on epoll, if there are no reactors
+ * or the engine isn't available.
+ */
+gboolean
+command_source_set_engine (CommandSource      *source,
+                           CommandSourceEngine engine)
+{
+#ifdef HAVE_LIBURING
+    guint i;
+#endif
+
+    if (engine == COMMAND_SOURCE_ENGINE_EPOLL) {
+        return TRUE;
+    }
+    if (source->reactor_count == 0) {
+        g_warning ("%s: io_uring needs reactor threads", __func__);
+        return FALSE;
+    }
+#ifdef HAVE_LIBURING
+    for (i = 0; i < source->reactor_count; ++i) {
+        if (!command_source_uring_init (&source->reactors [i])) {
+            while (i-- > 0) {
+                command_source_uring_clear (&source->reactors [i]);
+            }
+            return FALSE;
+        }
+    }
+    return TRUE;
+#else
+    g_warning ("%s: built without io_uring support", __func__);
+    return FALSE;
+#endif
+}
 /*
  * Cause the GMainLoop to stop monitoring whatever GSources are attached to
- * it and return
+ * it and return. Reactor threads are stopped through their eventfd.
  */
 static void
 command_source_unblock (Thread *self)
 {
     CommandSource *source = COMMAND_SOURCE (self);
+    guint64 value = 1;
+    guint i;
+
+    for (i = 0; i < source->reactor_count; ++i) {
+        if (write (source->reactors [i].wakeup_fd,
+                   &value,
+                   sizeof (value)) == -1) {
+            g_warning ("%s: failed to signal reactor %u: %s",
+                       __func__, i, strerror (errno));
+        }
+    }
     g_main_loop_quit (source->main_loop);
 }
+/*
+ * Run the reactors: this thread runs the first one and starts a thread
+ * for each of the others. Returns once all of them have stopped.
+ */
+static void
+command_source_run_reactors (CommandSource *source)
+{
+    gchar *name;
+    guint i;
+
+    for (i = 1; i < source->reactor_count; ++i) {
+        name = g_strdup_printf ("reactor-%u", i);
+        source->reactors [i].thread =
+            g_thread_new (name,
+                          command_source_reactor_thread,
+                          &source->reactors [i]);
+        g_free (name);
+    }
+    command_source_reactor_thread (&source->reactors [0]);
+    for (i = 1; i < source->reactor_count; ++i) {
+        g_thread_join (source->reactors [i].thread);
+        source->reactors [i].thread = NULL;
+    }
+}
 /*
  * This function creates it's very own GMainLoop thread. This is used to
  * monitor client connections for incoming data (TPM2 command buffers).
@@ -349,6 +1570,10 @@ command_source_thread (void *data)
     source = COMMAND_SOURCE (data);
     g_assert (source->main_loop != NULL);
 
+    if (source->reactor_count > 0) {
+        command_source_run_reactors (source);
+        return NULL;
+    }
     if (!g_main_loop_is_running (source->main_loop)) {
         g_main_loop_run (source->main_loop);
     }
@@ -366,6 +1591,7 @@ command_source_class_init (CommandSourceClass *klass)
     if (command_source_parent_class == NULL)
         command_source_parent_class = g_type_class_peek_parent (klass);
 
+    object_class->constructed  = command_source_constructed;
     object_class->dispose      = command_source_dispose;
     object_class->finalize     = command_source_finalize;
     object_class->get_property = command_source_get_property;
@@ -391,6 +1617,14 @@ command_source_class_init (CommandSourceClass *klass)
                              "Reference to a Sink object.",
                              G_TYPE_OBJECT,
                              G_PARAM_READWRITE);
+    obj_properties [PROP_REACTOR_COUNT] =
+        g_param_spec_uint ("reactor-count",
+                           "number of reactors",
+                           "Number of epoll reactor threads, 0 to use a GMainLoop",
+                           0,
+                           COMMAND_SOURCE_REACTORS_MAX,
+                           0,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
@@ -398,6 +1632,19 @@ command_source_class_init (CommandSourceClass *klass)
 CommandSource*
 command_source_new (ConnectionManager    *connection_manager,
                     CommandAttrs         *command_attrs)
+{
+    return command_source_new_with_reactors (connection_manager,
+                                             command_attrs,
+                                             0);
+}
+/*
+ * Create a CommandSource that reads from client connections with
+ * 'reactor_count' epoll reactor threads instead of a single GMainLoop.
+ */
+CommandSource*
+command_source_new_with_reactors (ConnectionManager    *connection_manager,
+                                  CommandAttrs         *command_attrs,
+                                  guint                 reactor_count)
 {
     CommandSource *source;
 
@@ -407,6 +1654,7 @@ command_source_new (ConnectionManager    *connection_manager,
     source = COMMAND_SOURCE (g_object_new (TYPE_COMMAND_SOURCE,
                                              "command-attrs", command_attrs,
                                              "connection-manager", connection_manager,
+                                             "reactor-count", reactor_count,
                                              NULL));
     g_signal_connect (connection_manager,
                       "new-connection",
@@ -414,3 +1662,220 @@ command_source_new (ConnectionManager    *connection_manager,
                       source);
     return source;
 }
+/*
+ * Commands with the provided command code will be sent to the TPM ahead of
+ * queued commands of normal priority. The policy must be configured before
+ * the CommandSource thread is started.
+ */
+void
+command_source_add_priority_command (CommandSource *source,
+                                     TPM2_CC        command_code)
+{
+    g_hash_table_add (source->priority_commands,
+                      GUINT_TO_POINTER (command_code));
+}
+/*
+ * All commands from clients running as 'uid' will be sent to the TPM ahead
+ * of queued commands of normal priority.
+ */
+void
+command_source_add_priority_uid (CommandSource *source,
+                                 guint32        uid)
+{
+    g_hash_table_add (source->priority_uids, GUINT_TO_POINTER (uid));
+}
+/*
+ * Apply the priority policy to a command read from a client.
+ */
+Tpm2CommandPriority
+command_source_classify (CommandSource *source,
+                         Tpm2Command   *command)
+{
+    TPM2_CC command_code = tpm2_command_get_code (command);
+
+    if (g_hash_table_contains (source->priority_commands,
+                               GUINT_TO_POINTER (command_code))) {
+        return TPM2_COMMAND_PRIORITY_HIGH;
+    }
+    if (command->connection != NULL &&
+        g_hash_table_contains (source->priority_uids,
+                               GUINT_TO_POINTER (connection_get_uid (command->connection)))) {
+        return TPM2_COMMAND_PRIORITY_HIGH;
+    }
+    return TPM2_COMMAND_PRIORITY_NORMAL;
+}
+/*
+ * Limit clients to 'rate' commands per second, with bursts of up to
+ * 'rate' commands. UIDs given their own limit with
+ * command_source_set_uid_rate_limit aren't affected. A 'rate' of 0
+ * removes the limit. Rate limits may be changed while the CommandSource
+ * thread runs: the buckets start over, full, at the new rates.
+ */
+void
+command_source_set_rate_limit (CommandSource *source,
+                               guint          rate)
+{
+    g_mutex_lock (&source->rate_mutex);
+    source->rate_limit = rate;
+    g_hash_table_remove_all (source->rate_buckets);
+    g_mutex_unlock (&source->rate_mutex);
+}
+/*
+ * Limit clients running as 'uid' to 'rate' commands per second. A 'rate'
+ * of 0 exempts them from the limit set with command_source_set_rate_limit.
+ */
+void
+command_source_set_uid_rate_limit (CommandSource *source,
+                                   guint32        uid,
+                                   guint          rate)
+{
+    g_mutex_lock (&source->rate_mutex);
+    g_hash_table_insert (source->uid_rate_limits,
+                         GUINT_TO_POINTER (uid),
+                         GUINT_TO_POINTER (rate));
+    g_hash_table_remove (source->rate_buckets, GUINT_TO_POINTER (uid));
+    g_mutex_unlock (&source->rate_mutex);
+}
+/*
+ * Take a token from the bucket for the UID of the client on 'connection'.
+ * All connections from a UID share its bucket so that a client can't get
+ * around the limit by opening more connections.
+ * Returns FALSE if the command must be refused.
+ */
+gboolean
+command_source_admit (CommandSource *source,
+                      Connection    *connection)
+{
+    guint32 uid = connection_get_uid (connection);
+    gpointer value;
+    guint rate;
+    token_bucket_t *bucket;
+    gint64 now;
+    gboolean admit;
+
+    g_mutex_lock (&source->rate_mutex);
+    rate = source->rate_limit;
+    if (g_hash_table_lookup_extended (source->uid_rate_limits,
+                                      GUINT_TO_POINTER (uid),
+                                      NULL,
+                                      &value)) {
+        rate = GPOINTER_TO_UINT (value);
+    }
+    if (rate == 0) {
+        g_mutex_unlock (&source->rate_mutex);
+        return TRUE;
+    }
+    now = g_get_monotonic_time ();
+    bucket = g_hash_table_lookup (source->rate_buckets, GUINT_TO_POINTER (uid));
+    if (bucket == NULL) {
+        bucket = g_new0 (token_bucket_t, 1);
+        token_bucket_init (bucket, rate, rate, now);
+        g_hash_table_insert (source->rate_buckets,
+                             GUINT_TO_POINTER (uid),
+                             bucket);
+    }
+    admit = token_bucket_take (bucket, now);
+    g_mutex_unlock (&source->rate_mutex);
+    return admit;
+}
+/*
+ * Add the next TPM: commands from connections with a TPM index of 1 go
+ * to the first Sink added, those with an index of 2 to the second and so
+ * on. 'command_attrs' describes the commands supported by this TPM.
+ * All TPMs must be added before the CommandSource thread is started.
+ */
+void
+command_source_add_tpm (CommandSource *source,
+                        Sink          *sink,
+                        CommandAttrs  *command_attrs)
+{
+    g_ptr_array_add (source->tpm_sinks, g_object_ref (sink));
+    g_ptr_array_add (source->tpm_command_attrs, g_object_ref (command_attrs));
+}
+/*
+ * Set the CommandAttrs for the first TPM. This allows the CommandSource to
+ * be created, and connections to be accepted, before the TPM has been
+ * initialized. It must be called before the CommandSource thread is
+ * started.
+ */
+void
+command_source_set_command_attrs (CommandSource *source,
+                                  CommandAttrs  *command_attrs)
+{
+    g_clear_object (&source->command_attrs);
+    source->command_attrs = g_object_ref (command_attrs);
+}
+/*
+ * Pause reading connections with commands in flight, see the
+ * 'pause_reads' field. It must be called before the CommandSource thread
+ * is started.
+ */
+void
+command_source_set_pause (CommandSource *source,
+                          gboolean       pause_reads,
+                          guint          watermark)
+{
+    source->pause_reads = pause_reads;
+    source->pause_watermark = watermark;
+}
+/*
+ * Let each connection open up to 'max_channels' channels besides itself,
+ * see TABRMD_CONTROL_SET_CHANNEL. The default of 0 lets it open none. It
+ * must be called before the CommandSource thread is started.
+ */
+void
+command_source_set_max_channels (CommandSource *source,
+                                 guint          max_channels)
+{
+    source->max_channels = max_channels;
+}
+/*
+ * Have 'func' carry out the TABRMD_CONTROL_CANCEL frames clients send.
+ * Without one they're ignored. It must be called before the
+ * CommandSource thread is started.
+ */
+void
+command_source_set_cancel_func (CommandSource          *source,
+                                CommandSourceCancelFunc func,
+                                gpointer                user_data)
+{
+    source->cancel_func = func;
+    source->cancel_data = user_data;
+}
+/*
+ * Record each command read from a client in 'trace'. It must be called
+ * before the CommandSource thread is started.
+ */
+void
+command_source_set_trace (CommandSource *source,
+                          Trace         *trace)
+{
+    g_clear_object (&source->trace);
+    if (trace != NULL) {
+        source->trace = g_object_ref (trace);
+    }
+}
+/*
+ * Time how long it takes to start watching new connections. It must be
+ * called before the CommandSource thread is started.
+ */
+void
+command_source_set_metrics (CommandSource *source,
+                            Metrics       *metrics)
+{
+    g_clear_object (&source->metrics);
+    if (metrics != NULL) {
+        source->metrics = g_object_ref (metrics);
+    }
+}
+/*
+ * Add the queue the Sink of the next TPM reads commands from, for the
+ * pause watermark. Queues are added in TPM order starting with TPM 0,
+ * before the CommandSource thread is started.
+ */
+void
+command_source_add_queue (CommandSource *source,
+                          MessageQueue  *queue)
+{
+    g_ptr_array_add (source->tpm_queues, g_object_ref (queue));
+}
@@ -9,11 +9,18 @@
 #include <glib.h>
 #include <glib-object.h>
 #include <pthread.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #include "command-attrs.h"
 #include "connection-manager.h"
+#include "message-queue.h"
+#include "metrics.h"
 #include "sink-interface.h"
 #include "thread.h"
+#include "tpm2-command.h"
+#include "trace.h"
 
 G_BEGIN_DECLS
 
@@ -21,6 +28,63 @@ G_BEGIN_DECLS
  * command larger than this size will be closed.
  */
 #define BUF_MAX 4096
+/* upper bound on the number of epoll reactor threads */
+#define COMMAND_SOURCE_REACTORS_MAX 64
+/* epoll events handled by a reactor thread per call to epoll_wait */
+#define COMMAND_SOURCE_REACTOR_EVENTS 32
+/* submission queue entries of each reactor's io_uring */
+#define COMMAND_SOURCE_URING_ENTRIES 256
+/* receive buffers shared by the connections of a reactor, a power of 2 */
+#define COMMAND_SOURCE_URING_BUFFERS 64
+#define COMMAND_SOURCE_URING_BUFFER_SIZE 4096
+#define COMMAND_SOURCE_URING_BUFFER_GROUP 0
+
+/*
+ * Called from the thread reading a connection when its client sends a
+ * TABRMD_CONTROL_CANCEL frame, see command_source_set_cancel_func.
+ */
+typedef TSS2_RC (*CommandSourceCancelFunc) (Connection *connection,
+                                            gpointer    user_data);
+
+/* how the reactor threads wait for and read client input */
+typedef enum {
+    COMMAND_SOURCE_ENGINE_EPOLL,
+    COMMAND_SOURCE_ENGINE_IO_URING,
+} CommandSourceEngine;
+
+/*
+ * A reactor thread monitors a disjoint set of connections with its own
+ * epoll instance. Connections are assigned to reactors round robin. The
+ * 'entries' GHashTable is a set of command_source_reactor_entry_t
+ * structures, one for each connection watched by the reactor, and is
+ * protected by 'mutex'.
+ * With the io_uring engine the reactor keeps a receive posted on each
+ * connection instead. The kernel picks a buffer from 'buf_ring' for the
+ * data, which is copied to the connection's read buffer before the buffer
+ * is handed back. 'mutex' also protects the submission queue since
+ * connections are added from other threads.
+ */
+typedef struct {
+    struct _CommandSource *source;
+    gint               epoll_fd;
+    gint               wakeup_fd;
+    GMutex             mutex;
+    GHashTable        *entries;
+    GThread           *thread;
+#ifdef HAVE_LIBURING
+    gboolean           uring_enabled;
+    struct io_uring    ring;
+    struct io_uring_buf_ring *buf_ring;
+    guint8            *bufs;
+#endif
+} command_source_reactor_t;
+
+typedef struct {
+    command_source_reactor_t *reactor;
+    Connection        *connection;
+    GInputStream      *istream;
+    gint               fd;
+} command_source_reactor_entry_t;
 
 typedef struct _CommandSourceClass {
     ThreadClass       parent;
@@ -34,6 +98,43 @@ typedef struct _CommandSource {
     GMainLoop         *main_loop;
     GHashTable        *istream_to_source_data_map;
     Sink              *sink;
+    /* Sink and CommandAttrs for each TPM after the first */
+    GPtrArray         *tpm_sinks;
+    GPtrArray         *tpm_command_attrs;
+    /* command codes and client UIDs that get TPM2_COMMAND_PRIORITY_HIGH */
+    GHashTable        *priority_commands;
+    GHashTable        *priority_uids;
+    /*
+     * Commands per second allowed from each client UID: 'uid_rate_limits'
+     * maps UIDs to their own limit, the others get 'rate_limit'. 0 means
+     * no limit. 'rate_buckets' maps a UID to its token_bucket_t. All of
+     * them are protected by 'rate_mutex' since reactors read commands
+     * concurrently and the limits may be changed while they do.
+     */
+    guint              rate_limit;
+    GHashTable        *uid_rate_limits;
+    GMutex             rate_mutex;
+    GHashTable        *rate_buckets;
+    /* epoll reactors, used in place of the GMainLoop if reactor_count > 0 */
+    guint              reactor_count;
+    command_source_reactor_t *reactors;
+    gint               next_reactor;
+    /*
+     * A reactor stops reading a connection with commands in flight if
+     * 'pause_reads' is set, or if the queue of its TPM in 'tpm_queues'
+     * holds 'pause_watermark' messages or more. It reads the connection
+     * again once the last response is out. 0 means no watermark.
+     */
+    gboolean           pause_reads;
+    guint              pause_watermark;
+    GPtrArray         *tpm_queues;
+    CommandSourceCancelFunc cancel_func;
+    gpointer           cancel_data;
+    /* channels a connection may open, see command_source_set_max_channels */
+    guint              max_channels;
+    /* records the commands read from clients, NULL unless --trace */
+    Trace             *trace;
+    Metrics           *metrics;
 } CommandSource;
 
 #define TYPE_COMMAND_SOURCE              (command_source_get_type   ())
@@ -46,9 +147,46 @@ typedef struct _CommandSource {
 GType           command_source_get_type          (void);
 CommandSource*  command_source_new               (ConnectionManager  *connection_manager,
                                                   CommandAttrs       *command_attrs);
+CommandSource*  command_source_new_with_reactors (ConnectionManager  *connection_manager,
+                                                  CommandAttrs       *command_attrs,
+                                                  guint               reactor_count);
+gboolean        command_source_set_engine        (CommandSource      *source,
+                                                  CommandSourceEngine engine);
 gint            command_source_on_new_connection (ConnectionManager  *connection_manager,
                                                   Connection         *connection,
                                                   CommandSource      *command_source);
+void            command_source_add_priority_command (CommandSource   *source,
+                                                     TPM2_CC          command_code);
+void            command_source_add_priority_uid  (CommandSource      *source,
+                                                  guint32             uid);
+Tpm2CommandPriority command_source_classify      (CommandSource      *source,
+                                                  Tpm2Command        *command);
+void            command_source_set_rate_limit    (CommandSource      *source,
+                                                  guint               rate);
+void            command_source_set_uid_rate_limit (CommandSource     *source,
+                                                   guint32            uid,
+                                                   guint              rate);
+gboolean        command_source_admit             (CommandSource      *source,
+                                                  Connection         *connection);
+void            command_source_add_tpm           (CommandSource      *source,
+                                                  Sink               *sink,
+                                                  CommandAttrs       *command_attrs);
+void            command_source_set_command_attrs (CommandSource      *source,
+                                                  CommandAttrs       *command_attrs);
+void            command_source_set_pause         (CommandSource      *source,
+                                                  gboolean            pause_reads,
+                                                  guint               watermark);
+void            command_source_add_queue         (CommandSource      *source,
+                                                  MessageQueue       *queue);
+void            command_source_set_max_channels  (CommandSource      *source,
+                                                  guint               max_channels);
+void            command_source_set_cancel_func   (CommandSource      *source,
+                                                  CommandSourceCancelFunc func,
+                                                  gpointer            user_data);
+void            command_source_set_trace         (CommandSource      *source,
+                                                  Trace              *trace);
+void            command_source_set_metrics       (CommandSource      *source,
+                                                  Metrics            *metrics);
 /*
  * The following are private functions. They are exposed here for unit
  * testing. Do not call these from anywhere else.
@@ -69,11 +207,14 @@ gboolean        command_source_on_input_ready    (GInputStream       *socket,
  *   and remove the same structure from the hash table (and free it). This way
  *   when the CommandSource is destroyed we won't have stale GSources hanging
  *   around.
+ * - The structure holds a reference to the Connection so the G_IO_IN
+ *   callback reads from it without looking it up in the ConnectionManager.
  * - When the CommandSource is destroyed all of the GSources registered with
  *   the GMainContext/Loop must be canceled and freed (see dispose function).
  */
 typedef struct {
     CommandSource *self;
+    Connection    *connection;
     GCancellable  *cancellable;
     GSource       *source;
 } source_data_t;
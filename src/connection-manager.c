@@ -10,11 +10,12 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 
 #include "connection-manager.h"
 #include "util.h"
 
-#define MAX_CONNECTIONS 100
+#define MAX_CONNECTIONS CONNECTION_MANAGER_MAX
 #define MAX_CONNECTIONS_DEFAULT 27
 
 G_DEFINE_TYPE (ConnectionManager, connection_manager, G_TYPE_OBJECT);
@@ -91,43 +92,49 @@ connection_manager_new (guint max_connections)
 static void
 connection_manager_init (ConnectionManager *mgr)
 {
-    if (pthread_mutex_init (&mgr->mutex, NULL) != 0)
-        g_error ("Failed to initialize connection _manager mutex: %s",
-                 strerror (errno));
-    /* These two data structures must be kept in sync. When the
-     * connection-manager object is destroyed the Connection objects in these
-     * hash tables will be freed by the g_object_unref function. We only
-     * set this for one of the hash tables because we only want to free
-     * each Connection object once.
-     */
-    mgr->connection_from_istream_table =
-        g_hash_table_new_full (g_direct_hash,
-                               g_direct_equal,
-                               NULL,
-                               NULL);
-    mgr->connection_from_id_table =
-        g_hash_table_new_full (g_int64_hash,
-                               g_int64_equal,
-                               NULL,
-                               (GDestroyNotify)g_object_unref);
+    connection_manager_shard_t *shard;
+    guint i;
+
+    for (i = 0; i < CONNECTION_MANAGER_SHARDS; ++i) {
+        shard = &mgr->shards [i];
+        if (pthread_mutex_init (&shard->mutex, NULL) != 0)
+            g_error ("Failed to initialize connection _manager mutex: %s",
+                     strerror (errno));
+        /* These two data structures must be kept in sync across the
+         * shards. When the connection-manager object is destroyed the
+         * Connection objects in these hash tables will be freed by the
+         * g_object_unref function. We only set this for the ID tables
+         * because we only want to free each Connection object once.
+         */
+        shard->connection_from_istream_table =
+            g_hash_table_new_full (g_direct_hash,
+                                   g_direct_equal,
+                                   NULL,
+                                   NULL);
+        shard->connection_from_id_table =
+            g_hash_table_new_full (g_int64_hash,
+                                   g_int64_equal,
+                                   NULL,
+                                   (GDestroyNotify)g_object_unref);
+    }
 }
 
 static void
 connection_manager_dispose (GObject *obj)
 {
     ConnectionManager *self = CONNECTION_MANAGER (obj);
-    gint ret;
+    connection_manager_shard_t *shard;
+    guint i;
 
-    ret = pthread_mutex_lock (&self->mutex);
-    if (ret != 0)
-        g_warning ("Error locking connection_manager mutex: %s",
-                   strerror (errno));
-    g_hash_table_unref (self->connection_from_istream_table);
-    g_hash_table_unref (self->connection_from_id_table);
-    ret = pthread_mutex_unlock (&self->mutex);
-    if (ret != 0)
-        g_error ("Error unlocking connection_manager mutex: %s",
-                 strerror (errno));
+    for (i = 0; i < CONNECTION_MANAGER_SHARDS; ++i) {
+        shard = &self->shards [i];
+        pthread_mutex_lock (&shard->mutex);
+        g_clear_pointer (&shard->connection_from_istream_table,
+                         g_hash_table_unref);
+        g_clear_pointer (&shard->connection_from_id_table,
+                         g_hash_table_unref);
+        pthread_mutex_unlock (&shard->mutex);
+    }
     G_OBJECT_CLASS (connection_manager_parent_class)->dispose (obj);
 }
 
@@ -135,10 +142,13 @@ static void
 connection_manager_finalize (GObject *obj)
 {
     ConnectionManager *manager = CONNECTION_MANAGER (obj);
+    guint i;
 
-    if (pthread_mutex_destroy (&manager->mutex) != 0)
-        g_error ("Error destroying connection_manager mutex: %s",
-                 strerror (errno));
+    for (i = 0; i < CONNECTION_MANAGER_SHARDS; ++i) {
+        if (pthread_mutex_destroy (&manager->shards [i].mutex) != 0)
+            g_error ("Error destroying connection_manager mutex: %s",
+                     strerror (errno));
+    }
     G_OBJECT_CLASS (connection_manager_parent_class)->finalize (obj);
 }
 /**
@@ -184,38 +194,57 @@ connection_manager_class_init (ConnectionManagerClass *klass)
                                        obj_properties);
 }
 
+/*
+ * The shard holding the Connection for an input stream or an ID.
+ */
+static connection_manager_shard_t*
+connection_manager_shard_istream (ConnectionManager *manager,
+                                  gconstpointer      istream)
+{
+    return &manager->shards [(GPOINTER_TO_SIZE (istream) >> 4) %
+                             CONNECTION_MANAGER_SHARDS];
+}
+static connection_manager_shard_t*
+connection_manager_shard_id (ConnectionManager *manager,
+                             gint64             id)
+{
+    return &manager->shards [g_int64_hash (&id) % CONNECTION_MANAGER_SHARDS];
+}
+
 gint
 connection_manager_insert (ConnectionManager    *manager,
                            Connection        *connection)
 {
+    connection_manager_shard_t *shard;
     gint ret;
 
-    ret = pthread_mutex_lock (&manager->mutex);
-    if (ret != 0)
-        g_error ("Error locking connection_manager mutex: %s",
-                 strerror (errno));
-    if (connection_manager_is_full (manager)) {
+    if (g_atomic_int_add (&manager->size, 1) >= (gint)manager->max_connections) {
+        g_atomic_int_add (&manager->size, -1);
         g_warning ("%s: max_connections of %u exceeded", __func__,
                    manager->max_connections);
-        pthread_mutex_unlock (&manager->mutex);
         return -1;
     }
     /*
      * Increase reference count on Connection object on insert. The
      * corresponding call to g_hash_table_remove will cause the reference
-     * count to be decreased (see g_hash_table_new_full).
+     * count to be decreased (see g_hash_table_new_full). The ID table
+     * goes first so that a Connection found through its istream is always
+     * still referenced.
      */
     g_object_ref (connection);
-    g_hash_table_insert (manager->connection_from_istream_table,
-                         connection_key_istream (connection),
-                         connection);
-    g_hash_table_insert (manager->connection_from_id_table,
+    shard = connection_manager_shard_id (manager, connection->id);
+    pthread_mutex_lock (&shard->mutex);
+    g_hash_table_insert (shard->connection_from_id_table,
                          connection_key_id (connection),
                          connection);
-    ret = pthread_mutex_unlock (&manager->mutex);
-    if (ret != 0)
-        g_error ("Error unlocking connection_manager mutex: %s",
-                 strerror (errno));
+    pthread_mutex_unlock (&shard->mutex);
+    shard = connection_manager_shard_istream (manager,
+                                              connection_key_istream (connection));
+    pthread_mutex_lock (&shard->mutex);
+    g_hash_table_insert (shard->connection_from_istream_table,
+                         connection_key_istream (connection),
+                         connection);
+    pthread_mutex_unlock (&shard->mutex);
     /* not sure what to do about reference count on SEssionData obj */
     g_signal_emit (manager,
                    signals [SIGNAL_NEW_CONNECTION],
@@ -234,17 +263,19 @@ Connection*
 connection_manager_lookup_istream (ConnectionManager *manager,
                                    GInputStream      *istream)
 {
+    connection_manager_shard_t *shard;
     Connection *connection;
 
-    pthread_mutex_lock (&manager->mutex);
-    connection = g_hash_table_lookup (manager->connection_from_istream_table,
+    shard = connection_manager_shard_istream (manager, istream);
+    pthread_mutex_lock (&shard->mutex);
+    connection = g_hash_table_lookup (shard->connection_from_istream_table,
                                       istream);
     if (connection != NULL) {
         g_object_ref (connection);
     } else {
         g_warning ("%s returned NULL connection", __func__);
     }
-    pthread_mutex_unlock (&manager->mutex);
+    pthread_mutex_unlock (&shard->mutex);
 
     return connection;
 }
@@ -258,20 +289,18 @@ Connection*
 connection_manager_lookup_id (ConnectionManager   *manager,
                               gint64               id)
 {
+    connection_manager_shard_t *shard;
     Connection *connection;
 
-    g_debug ("locking manager mutex");
-    pthread_mutex_lock (&manager->mutex);
-    g_debug ("g_hash_table_lookup: connection_from_id_table");
-    connection = g_hash_table_lookup (manager->connection_from_id_table,
-                                      &id);
+    shard = connection_manager_shard_id (manager, id);
+    pthread_mutex_lock (&shard->mutex);
+    connection = g_hash_table_lookup (shard->connection_from_id_table, &id);
     if (connection != NULL) {
         g_object_ref (connection);
     } else {
         g_warning ("connection_manager_lookup_id returned NULL connection");
     }
-    g_debug ("unlocking manager mutex");
-    pthread_mutex_unlock (&manager->mutex);
+    pthread_mutex_unlock (&shard->mutex);
 
     return connection;
 }
@@ -280,26 +309,41 @@ gboolean
 connection_manager_contains_id (ConnectionManager *manager,
                                 gint64             id)
 {
-    return g_hash_table_contains (manager->connection_from_id_table, &id);
+    connection_manager_shard_t *shard;
+    gboolean ret;
+
+    shard = connection_manager_shard_id (manager, id);
+    pthread_mutex_lock (&shard->mutex);
+    ret = g_hash_table_contains (shard->connection_from_id_table, &id);
+    pthread_mutex_unlock (&shard->mutex);
+
+    return ret;
 }
 
 gboolean
 connection_manager_remove (ConnectionManager   *manager,
                            Connection          *connection)
 {
+    connection_manager_shard_t *shard;
     gboolean ret;
 
     g_debug ("%s: removing Connection", __func__);
-    pthread_mutex_lock (&manager->mutex);
-    ret = g_hash_table_remove (manager->connection_from_istream_table,
+    shard = connection_manager_shard_istream (manager,
+                                              connection_key_istream (connection));
+    pthread_mutex_lock (&shard->mutex);
+    ret = g_hash_table_remove (shard->connection_from_istream_table,
                                connection_key_istream (connection));
+    pthread_mutex_unlock (&shard->mutex);
     if (ret != TRUE)
         g_error ("%s: failed to remove Connection", __func__);
-    ret = g_hash_table_remove (manager->connection_from_id_table,
+    shard = connection_manager_shard_id (manager, connection->id);
+    pthread_mutex_lock (&shard->mutex);
+    ret = g_hash_table_remove (shard->connection_from_id_table,
                                connection_key_id (connection));
+    pthread_mutex_unlock (&shard->mutex);
     if (ret != TRUE)
         g_error ("%s: failed to remove Connection", __func__);
-    pthread_mutex_unlock (&manager->mutex);
+    g_atomic_int_add (&manager->size, -1);
 
     return ret;
 }
@@ -307,18 +351,81 @@ connection_manager_remove (ConnectionManager   *manager,
 guint
 connection_manager_size (ConnectionManager   *manager)
 {
-    return g_hash_table_size (manager->connection_from_istream_table);
+    return (guint)g_atomic_int_get (&manager->size);
 }
 
 gboolean
 connection_manager_is_full (ConnectionManager *manager)
 {
-    guint table_size;
-
-    table_size = g_hash_table_size (manager->connection_from_istream_table);
-    if (table_size < manager->max_connections) {
+    if (connection_manager_size (manager) < manager->max_connections) {
         return FALSE;
     } else {
         return TRUE;
     }
 }
+/*
+ * Call 'func' on each connection in no particular order. The shard being
+ * walked is locked: 'func' mustn't insert or remove connections.
+ */
+void
+connection_manager_foreach (ConnectionManager *manager,
+                            GFunc              func,
+                            gpointer           user_data)
+{
+    GHashTableIter iter;
+    gpointer value;
+    guint i;
+
+    for (i = 0; i < CONNECTION_MANAGER_SHARDS; ++i) {
+        pthread_mutex_lock (&manager->shards [i].mutex);
+        g_hash_table_iter_init (&iter, manager->shards [i].connection_from_id_table);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            func (value, user_data);
+        }
+        pthread_mutex_unlock (&manager->shards [i].mutex);
+    }
+}
+/*
+ * Shut down the connections that the client hasn't completed a command on
+ * for at least 'timeout' seconds, including those holding a partial one. The CommandSource then finds the connection
+ * closed and removes it, with its sessions and objects, the same way as
+ * when the client closes it.
+ * Returns the number of connections shut down.
+ */
+guint
+connection_manager_close_idle (ConnectionManager *manager,
+                               guint              timeout)
+{
+    GHashTableIter iter;
+    gpointer value;
+    Connection *connection;
+    guint i, idle, count = 0;
+    gint fd;
+
+    for (i = 0; i < CONNECTION_MANAGER_SHARDS; ++i) {
+        pthread_mutex_lock (&manager->shards [i].mutex);
+        g_hash_table_iter_init (&iter, manager->shards [i].connection_from_id_table);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            connection = CONNECTION (value);
+            idle = connection_get_idle_time (connection);
+            if (idle < timeout) {
+                continue;
+            }
+            fd = connection_get_fd (connection);
+            if (fd == -1) {
+                continue;
+            }
+            if (shutdown (fd, SHUT_RDWR) == -1) {
+                g_warning ("%s: failed to shut down connection 0x%" PRIx64
+                           ": %s", __func__, connection->id, strerror (errno));
+                continue;
+            }
+            g_info ("%s: closing connection 0x%" PRIx64 ", idle for %u "
+                    "seconds", __func__, connection->id, idle);
+            ++count;
+        }
+        pthread_mutex_unlock (&manager->shards [i].mutex);
+    }
+
+    return count;
+}
@@ -8,22 +8,40 @@
 
 #include <glib.h>
 #include <glib-object.h>
+#include <pthread.h>
 
 #include "connection.h"
 
 G_BEGIN_DECLS
 
-#define CONNECTION_MANAGER_MAX 100
+#define CONNECTION_MANAGER_MAX 16384
+/*
+ * Connections are spread over this many shards, each with its own lock,
+ * so that the CommandSource and the frontends looking up different
+ * connections don't wait on each other.
+ */
+#define CONNECTION_MANAGER_SHARDS 16
 
 typedef struct _ConnectionManagerClass {
     GObjectClass      parent;
 } ConnectionManagerClass;
 
-typedef struct _ConnectionManager {
-    GObject           parent_instance;
+/*
+ * A Connection is in the istream table of the shard picked by its
+ * GInputStream and in the ID table of the shard picked by its ID. These
+ * are usually different shards. Only the ID table holds a reference.
+ */
+typedef struct {
     pthread_mutex_t   mutex;
     GHashTable       *connection_from_istream_table;
     GHashTable       *connection_from_id_table;
+} connection_manager_shard_t;
+
+typedef struct _ConnectionManager {
+    GObject           parent_instance;
+    connection_manager_shard_t shards [CONNECTION_MANAGER_SHARDS];
+    /* number of connections inserted, updated atomically */
+    gint              size;
     guint             max_connections;
 } ConnectionManager;
 
@@ -48,6 +66,11 @@ gboolean       connection_manager_contains_id (ConnectionManager  *manager,
                                                gint64              id_in);
 guint          connection_manager_size        (ConnectionManager  *manager);
 gboolean       connection_manager_is_full     (ConnectionManager  *manager);
+guint          connection_manager_close_idle  (ConnectionManager  *manager,
+                                               guint               timeout);
+void           connection_manager_foreach     (ConnectionManager  *manager,
+                                               GFunc               func,
+                                               gpointer            user_data);
 
 G_END_DECLS
 #endif /* CONNECTION_MANAGER_H */
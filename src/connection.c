@@ -4,6 +4,7 @@
  * All rights reserved.
  */
 #include <errno.h>
+#include <gio/gunixoutputstream.h>
 #include <glib.h>
 #include <inttypes.h>
 #include <stdlib.h>
@@ -11,6 +12,8 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <tss2/tss2_tpm2_types.h>
+
 #include "connection.h"
 #include "util.h"
 
@@ -79,13 +82,24 @@ connection_get_property (GObject     *object,
 }
 
 /*
- * G_DEFINE_TYPE requires an instance init even though we don't use it.
+ * The UID of the client is unknown until the IpcFrontend sets it.
  */
 static void
 connection_init (Connection *connection)
 {
-    UNUSED_PARAM(connection);
-    /* noop */
+    connection->uid = CONNECTION_UID_UNKNOWN;
+    g_mutex_init (&connection->pause_mutex);
+    connection_touch (connection);
+}
+
+static void
+connection_finalize (GObject *obj)
+{
+    Connection *connection = CONNECTION (obj);
+
+    g_mutex_clear (&connection->pause_mutex);
+    g_free (connection->cgroup);
+    G_OBJECT_CLASS (connection_parent_class)->finalize (obj);
 }
 
 static void
@@ -95,6 +109,12 @@ connection_dispose (GObject *obj)
 
     g_clear_object (&connection->iostream);
     g_object_unref (connection->transient_handle_map);
+    read_buffer_clear (&connection->read_buffer);
+    g_clear_pointer (&connection->shm, shm_transport_unmap);
+    g_clear_object (&connection->tcti);
+    g_clear_pointer (&connection->channels, g_hash_table_unref);
+    connection->current = NULL;
+    g_clear_object (&connection->parent);
 
     G_OBJECT_CLASS (connection_parent_class)->dispose (obj);
 }
@@ -109,6 +129,7 @@ connection_class_init (ConnectionClass *klass)
         connection_parent_class = g_type_class_peek_parent (klass);
 
     object_class->dispose      = connection_dispose;
+    object_class->finalize     = connection_finalize;
     object_class->get_property = connection_get_property;
     object_class->set_property = connection_set_property;
 
@@ -153,6 +174,36 @@ connection_new (GIOStream  *iostream,
                                      NULL));
 }
 
+/*
+ * Create channel 'channel' of 'parent', see TABRMD_CONTROL_SET_CHANNEL.
+ * It shares the parent's socket, and its client's credentials and
+ * settings, but gets its own id and 'transient_handle_map'. The
+ * CommandSource creates channels: they aren't in the ConnectionManager.
+ */
+Connection*
+connection_new_channel (Connection *parent,
+                        guint8      channel,
+                        HandleMap  *transient_handle_map)
+{
+    Connection *connection;
+
+    connection = connection_new (parent->iostream,
+                                 parent->id ^ ((guint64)channel << 56),
+                                 transient_handle_map);
+    connection->parent = g_object_ref (parent);
+    connection->channel = channel;
+    connection->uid = parent->uid;
+    connection->pid = parent->pid;
+    connection->cgroup = g_strdup (parent->cgroup);
+    connection->tpm = parent->tpm;
+    connection->tagged = parent->tagged;
+    connection->seqpacket = parent->seqpacket;
+    connection->locality = connection_get_locality (parent);
+    connection->command_timeout = parent->command_timeout;
+    connection->trace_context = parent->trace_context;
+    return connection;
+}
+
 gpointer
 connection_key_istream (Connection *connection)
 {
@@ -165,6 +216,38 @@ connection_get_iostream (Connection *connection)
     return connection->iostream;
 }
 
+/*
+ * Get the fd underlying the connection's GIOStream so that it can be
+ * polled directly. Returns -1 if the GIOStream isn't backed by an fd.
+ */
+gint
+connection_get_fd (Connection *connection)
+{
+    GIOStream *iostream = connection->iostream;
+    GOutputStream *ostream;
+    GSocket *socket;
+
+    if (G_IS_SOCKET_CONNECTION (iostream)) {
+        socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (iostream));
+        return g_socket_get_fd (socket);
+    }
+    ostream = g_io_stream_get_output_stream (iostream);
+    if (G_IS_UNIX_OUTPUT_STREAM (ostream)) {
+        return g_unix_output_stream_get_fd (G_UNIX_OUTPUT_STREAM (ostream));
+    }
+    return -1;
+}
+
+/*
+ * The buffer that commands from the client are read into. Only the thread
+ * that reads from the connection may use it.
+ */
+read_buffer_t*
+connection_get_read_buffer (Connection *connection)
+{
+    return &connection->read_buffer;
+}
+
 gpointer
 connection_key_id (Connection *connection)
 {
@@ -182,3 +265,576 @@ connection_get_trans_map (Connection *connection)
     g_object_ref (connection->transient_handle_map);
     return connection->transient_handle_map;
 }
+/*
+ * Accessors for the UID of the client process that owns the connection.
+ */
+guint32
+connection_get_uid (Connection *connection)
+{
+    return connection->uid;
+}
+void
+connection_set_uid (Connection *connection,
+                    guint32     uid)
+{
+    connection->uid = uid;
+}
+/*
+ * Accessors for the PID of the client process that made the connection.
+ * Setting it also looks up the cgroup of the process, which the
+ * connection's TPM time is accounted to, see connection_get_cgroup: it's
+ * set once when the connection is created.
+ */
+guint32
+connection_get_pid (Connection *connection)
+{
+    return connection->pid;
+}
+void
+connection_set_pid (Connection *connection,
+                    guint32     pid)
+{
+    connection->pid = pid;
+    g_free (connection->cgroup);
+    connection->cgroup = cgroup_from_pid (pid);
+}
+/*
+ * Get the cgroup of the client process, like
+ * "/system.slice/foo.service", NULL if it's unknown.
+ */
+const gchar*
+connection_get_cgroup (Connection *connection)
+{
+    return connection->cgroup;
+}
+/*
+ * Accessors for the index of the TPM that serves the connection. The
+ * default of 0 is the TPM from the --tcti option.
+ */
+guint
+connection_get_tpm (Connection *connection)
+{
+    return connection->tpm;
+}
+void
+connection_set_tpm (Connection *connection,
+                    guint       tpm)
+{
+    connection->tpm = tpm;
+}
+/*
+ * Accessors for the number of slots of 'kind' the connection has borrowed
+ * from the QuotaPool on top of its guaranteed transient objects or
+ * sessions.
+ */
+guint
+connection_get_borrowed (Connection    *connection,
+                         QuotaPoolKind  kind)
+{
+    g_assert (kind < QUOTA_POOL_KIND_COUNT);
+    return connection->borrowed [kind];
+}
+void
+connection_set_borrowed (Connection    *connection,
+                         QuotaPoolKind  kind,
+                         guint          count)
+{
+    g_assert (kind < QUOTA_POOL_KIND_COUNT);
+    connection->borrowed [kind] = count;
+}
+/*
+ * Accessors for the Tcti the connection's commands are sent through
+ * instead of the TPM's, NULL for the TPM's. The Connection takes a
+ * reference, setting NULL drops it and closes the Tcti.
+ */
+Tcti*
+connection_get_tcti (Connection *connection)
+{
+    return connection->tcti;
+}
+void
+connection_set_tcti (Connection *connection,
+                     Tcti       *tcti)
+{
+    g_clear_object (&connection->tcti);
+    if (tcti != NULL) {
+        connection->tcti = g_object_ref (tcti);
+    }
+}
+/*
+ * Accessors for the shared memory used by a connection created with
+ * CreateConnectionShm. The Connection takes ownership of the mapping.
+ */
+shm_transport_t*
+connection_get_shm (Connection *connection)
+{
+    return connection->shm;
+}
+void
+connection_set_shm (Connection      *connection,
+                    shm_transport_t *shm)
+{
+    connection->shm = shm;
+}
+/*
+ * Accessors for the flag set on a connection created with
+ * CreateConnectionTagged. See TABRMD_TRANSPORT_TAGGED.
+ */
+gboolean
+connection_get_tagged (Connection *connection)
+{
+    return connection->tagged;
+}
+void
+connection_set_tagged (Connection *connection,
+                       gboolean    tagged)
+{
+    connection->tagged = tagged;
+}
+/*
+ * Accessors for the flag set on a connection created with
+ * CreateConnectionSeqpacket. See TABRMD_TRANSPORT_SEQPACKET.
+ */
+gboolean
+connection_get_seqpacket (Connection *connection)
+{
+    return connection->seqpacket;
+}
+void
+connection_set_seqpacket (Connection *connection,
+                          gboolean    seqpacket)
+{
+    connection->seqpacket = seqpacket;
+}
+/*
+ * Count a command admitted for this connection unless 'max' commands are
+ * already pending. This is called from the threads reading client
+ * commands while the ResourceManager thread releases them.
+ * Returns FALSE if the command must be refused.
+ */
+gboolean
+connection_acquire_pending (Connection *connection,
+                            guint       max)
+{
+    gint pending;
+
+    do {
+        pending = g_atomic_int_get (&connection->pending);
+        if ((guint)pending >= max) {
+            return FALSE;
+        }
+    } while (!g_atomic_int_compare_and_exchange (&connection->pending,
+                                                 pending,
+                                                 pending + 1));
+    return TRUE;
+}
+/*
+ * Release a command counted by connection_acquire_pending once it has
+ * been answered.
+ */
+void
+connection_release_pending (Connection *connection)
+{
+    g_atomic_int_add (&connection->pending, -1);
+}
+/*
+ * Count 'bytes' of 'kind' held for the connection, negative to release
+ * them. This is called from any thread holding commands or responses.
+ */
+void
+connection_charge (Connection     *connection,
+                   MemAccountKind  kind,
+                   gssize          bytes)
+{
+    g_atomic_pointer_add (&connection->bytes, bytes);
+    mem_account_add (kind, bytes);
+}
+/*
+ * Returns the bytes of commands and responses held for the connection.
+ */
+gsize
+connection_get_bytes (Connection *connection)
+{
+    gssize bytes = (gssize)g_atomic_pointer_get (&connection->bytes);
+
+    return bytes > 0 ? (gsize)bytes : 0;
+}
+/*
+ * Count 'count' commands passed on by the CommandSource. This must happen
+ * before they're passed on: each one is answered with a response that
+ * calls connection_answered. The commands of a channel count for the
+ * connection it's on as well since they're read from the same socket.
+ */
+void
+connection_add_in_flight (Connection *connection,
+                          guint       count)
+{
+    g_atomic_int_add (&connection->in_flight, (gint)count);
+    if (connection->parent != NULL) {
+        g_atomic_int_add (&connection->parent->in_flight, (gint)count);
+    }
+}
+/*
+ * Returns the number of commands passed on whose response isn't out yet,
+ * for a connection those of its channels included.
+ */
+gint
+connection_get_in_flight (Connection *connection)
+{
+    return g_atomic_int_get (&connection->in_flight);
+}
+/*
+ * A response for the connection has reached the ResponseSink. Once the
+ * last command in flight is answered a paused connection is resumed.
+ */
+void
+connection_answered (Connection *connection)
+{
+    if (connection->parent != NULL) {
+        g_atomic_int_add (&connection->in_flight, -1);
+        connection = connection->parent;
+    }
+    if (!g_atomic_int_dec_and_test (&connection->in_flight)) {
+        return;
+    }
+    g_mutex_lock (&connection->pause_mutex);
+    if (connection->paused) {
+        connection->paused = FALSE;
+        if (connection->resume_func != NULL) {
+            connection->resume_func (connection->resume_data);
+        }
+    }
+    g_mutex_unlock (&connection->pause_mutex);
+}
+/*
+ * Set the function connection_answered calls to start reading a paused
+ * connection again, NULL to stop calling it. Once this returns the old
+ * function isn't running and won't be called again. 'func' is called with
+ * 'pause_mutex' held: it must not set the resume function itself.
+ */
+void
+connection_set_resume_func (Connection          *connection,
+                            ConnectionResumeFunc func,
+                            gpointer             user_data)
+{
+    g_mutex_lock (&connection->pause_mutex);
+    connection->resume_func = func;
+    connection->resume_data = user_data;
+    g_mutex_unlock (&connection->pause_mutex);
+}
+/*
+ * Mark the connection paused if it has a command in flight. The caller
+ * must have stopped reading the connection already: the resume function
+ * may be called as soon as the mutex is released. Returns FALSE if
+ * nothing is in flight, the caller must start reading again then.
+ */
+gboolean
+connection_pause (Connection *connection)
+{
+    gboolean paused;
+
+    g_mutex_lock (&connection->pause_mutex);
+    paused = g_atomic_int_get (&connection->in_flight) > 0;
+    connection->paused = paused;
+    g_mutex_unlock (&connection->pause_mutex);
+    return paused;
+}
+/*
+ * Record that the client has just completed a command on the connection:
+ * bytes of a command that's still partial don't count. The time
+ * is kept in seconds so that the thread looking for idle connections can
+ * read it atomically.
+ */
+void
+connection_touch (Connection *connection)
+{
+    g_atomic_int_set (&connection->last_active,
+                      (gint)(g_get_monotonic_time () / G_USEC_PER_SEC));
+}
+/*
+ * Returns the number of seconds since the client last completed a command.
+ */
+guint
+connection_get_idle_time (Connection *connection)
+{
+    gint now = (gint)(g_get_monotonic_time () / G_USEC_PER_SEC);
+
+    return (guint)MAX (now - g_atomic_int_get (&connection->last_active), 0);
+}
+/*
+ * The locality the connection's commands are sent to the TPM at, 0 until
+ * the client sets another with SetLocality. It's set by the frontend and
+ * read by the FairQueue and the Tpm2 from other threads.
+ */
+guint8
+connection_get_locality (Connection *connection)
+{
+    return (guint8)g_atomic_int_get (&connection->locality);
+}
+void
+connection_set_locality (Connection *connection,
+                         guint8      locality)
+{
+    g_atomic_int_set (&connection->locality, locality);
+}
+/*
+ * UIDs other than root allowed to set a locality above 0, see
+ * connection_allow_locality_uid. Filled in before the frontends start
+ * and only read afterwards.
+ */
+static GHashTable *locality_uids;
+
+void
+connection_allow_locality_uid (guint32 uid)
+{
+    if (locality_uids == NULL) {
+        locality_uids = g_hash_table_new (g_direct_hash, g_direct_equal);
+    }
+    g_hash_table_add (locality_uids, GUINT_TO_POINTER (uid));
+}
+/*
+ * Whether a client running as 'uid' may have its commands sent at
+ * 'locality'. The localities above 0 guard PCRs and NV indexes meant for
+ * trusted code only, like the DRTM PCRs, so they're left to root and the
+ * UIDs given to connection_allow_locality_uid. Every frontend checks a
+ * locality with this, or connection_locality_permitted, before calling
+ * connection_set_locality.
+ */
+gboolean
+connection_locality_permitted_uid (guint32 uid,
+                                   guint8  locality)
+{
+    if (locality > TPM2_LOC_FOUR) {
+        return FALSE;
+    }
+    if (locality == TPM2_LOC_ZERO || uid == 0) {
+        return TRUE;
+    }
+    return uid != CONNECTION_UID_UNKNOWN &&
+        locality_uids != NULL &&
+        g_hash_table_contains (locality_uids, GUINT_TO_POINTER (uid));
+}
+gboolean
+connection_locality_permitted (Connection *connection,
+                               guint8      locality)
+{
+    return connection_locality_permitted_uid (connection->uid, locality);
+}
+/*
+ * The milliseconds the client gives each of its commands to reach the TPM,
+ * 0 until the client sets a timeout with a control frame. The
+ * CommandSource reads and sets it, it turns it into each command's
+ * deadline.
+ */
+guint32
+connection_get_command_timeout (Connection *connection)
+{
+    return connection->command_timeout;
+}
+void
+connection_set_command_timeout (Connection *connection,
+                                guint32     timeout)
+{
+    connection->command_timeout = timeout;
+}
+/*
+ * The trace context the client's commands are part of, all zero until the
+ * client sets one with a control frame. Like the command timeout, only
+ * the CommandSource reads and sets it: it copies it to each command.
+ */
+const trace_context_t*
+connection_get_trace_context (Connection *connection)
+{
+    return &connection->trace_context;
+}
+void
+connection_set_trace_context (Connection            *connection,
+                              const trace_context_t *context)
+{
+    connection->trace_context = *context;
+}
+/*
+ * Count a command from the connection processed by the ResourceManager.
+ */
+void
+connection_count_command (Connection *connection)
+{
+    g_atomic_pointer_add (&connection->commands, 1);
+}
+/*
+ * Add the time the TPM spent executing a command from the connection.
+ */
+void
+connection_add_tpm_time (Connection *connection,
+                         gint64      usec)
+{
+    g_atomic_pointer_add (&connection->tpm_usec, (gssize)MAX (usec, 0));
+}
+/*
+ * Add the time spent loading, saving and flushing contexts for a command
+ * from the connection.
+ */
+void
+connection_add_context_time (Connection *connection,
+                             gint64      usec)
+{
+    g_atomic_pointer_add (&connection->context_usec, (gssize)MAX (usec, 0));
+}
+/*
+ * Add 'count' to the sessions the connection owns, negative to remove.
+ */
+void
+connection_add_sessions (Connection *connection,
+                         gint        count)
+{
+    g_atomic_int_add (&connection->sessions, count);
+}
+/*
+ * Returns a floating GVariant of type a{sv} with the figures kept for the
+ * connection. It may be called from any thread.
+ */
+GVariant*
+connection_get_stats (Connection *connection)
+{
+    GVariantBuilder builder;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder, "{sv}", "uid",
+                           g_variant_new_uint32 (connection->uid));
+    g_variant_builder_add (&builder, "{sv}", "tpm",
+                           g_variant_new_uint32 (connection->tpm));
+    g_variant_builder_add (&builder, "{sv}", "commands",
+        g_variant_new_uint64 ((guint64)(gsize)g_atomic_pointer_get (&connection->commands)));
+    g_variant_builder_add (&builder, "{sv}", "tpm_time_usec",
+        g_variant_new_uint64 ((guint64)(gsize)g_atomic_pointer_get (&connection->tpm_usec)));
+    g_variant_builder_add (&builder, "{sv}", "context_time_usec",
+        g_variant_new_uint64 ((guint64)(gsize)g_atomic_pointer_get (&connection->context_usec)));
+    if (connection->cgroup != NULL) {
+        g_variant_builder_add (&builder, "{sv}", "cgroup",
+                               g_variant_new_string (connection->cgroup));
+    }
+    g_variant_builder_add (&builder, "{sv}", "bytes_queued",
+                           g_variant_new_uint64 (connection_get_bytes (connection)));
+    g_variant_builder_add (&builder, "{sv}", "in_flight",
+        g_variant_new_uint32 ((guint32)MAX (connection_get_in_flight (connection), 0)));
+    g_variant_builder_add (&builder, "{sv}", "objects",
+        g_variant_new_uint32 (handle_map_get_count (connection->transient_handle_map)));
+    g_variant_builder_add (&builder, "{sv}", "sessions",
+        g_variant_new_uint32 ((guint32)MAX (g_atomic_int_get (&connection->sessions), 0)));
+    return g_variant_builder_end (&builder);
+}
+/*
+ * Returns the connection whose socket 'connection' is read from and
+ * written to: the connection itself or, for a channel, the connection it
+ * was opened on. The returned object isn't referenced.
+ */
+Connection*
+connection_get_io (Connection *connection)
+{
+    return connection->parent != NULL ? connection->parent : connection;
+}
+/*
+ * Returns the id the client gave a channel, 0 for a connection.
+ */
+guint8
+connection_get_channel (Connection *connection)
+{
+    return connection->channel;
+}
+/*
+ * Look up channel 'channel' opened on 'connection'. Returns NULL if it
+ * isn't open. The returned object isn't referenced.
+ */
+Connection*
+connection_lookup_channel (Connection *connection,
+                           guint8      channel)
+{
+    if (connection->channels == NULL) {
+        return NULL;
+    }
+    return g_hash_table_lookup (connection->channels,
+                                GUINT_TO_POINTER (channel));
+}
+/*
+ * Keep 'channel', created with connection_new_channel, with the open
+ * channels of 'connection'. The connection takes a reference.
+ */
+void
+connection_add_channel (Connection *connection,
+                        Connection *channel)
+{
+    if (connection->channels == NULL) {
+        connection->channels = g_hash_table_new_full (g_direct_hash,
+                                                      g_direct_equal,
+                                                      NULL,
+                                                      g_object_unref);
+    }
+    g_hash_table_insert (connection->channels,
+                         GUINT_TO_POINTER (channel->channel),
+                         g_object_ref (channel));
+}
+/*
+ * Drop channel 'channel' from the open channels of 'connection'. If its
+ * commands went to it they go to the connection again.
+ * Returns FALSE if the channel isn't open.
+ */
+gboolean
+connection_remove_channel (Connection *connection,
+                           guint8      channel)
+{
+    if (connection->current != NULL &&
+        connection->current->channel == channel)
+    {
+        connection->current = NULL;
+    }
+    if (connection->channels == NULL) {
+        return FALSE;
+    }
+    return g_hash_table_remove (connection->channels,
+                                GUINT_TO_POINTER (channel));
+}
+/*
+ * Returns the number of channels open on 'connection'.
+ */
+guint
+connection_get_channel_count (Connection *connection)
+{
+    return connection->channels == NULL ?
+        0 : g_hash_table_size (connection->channels);
+}
+/*
+ * Drop all the channels open on 'connection' and return them in a GList.
+ * The caller owns a reference to each. Each channel holds a reference to
+ * its connection so they must be dropped for the connection to go away.
+ */
+GList*
+connection_take_channels (Connection *connection)
+{
+    GList *values, *channels;
+
+    connection->current = NULL;
+    if (connection->channels == NULL) {
+        return NULL;
+    }
+    values = g_hash_table_get_values (connection->channels);
+    channels = g_list_copy_deep (values, (GCopyFunc)g_object_ref, NULL);
+    g_list_free (values);
+    g_hash_table_remove_all (connection->channels);
+    return channels;
+}
+/*
+ * Accessors for the connection or channel the commands read from the
+ * connection's socket go to. 'channel' must be open on 'connection', or
+ * 'connection' itself.
+ */
+Connection*
+connection_get_current (Connection *connection)
+{
+    return connection->current != NULL ? connection->current : connection;
+}
+void
+connection_set_current (Connection *connection,
+                        Connection *channel)
+{
+    connection->current = channel != connection ? channel : NULL;
+}
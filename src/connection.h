@@ -11,9 +11,17 @@
 #include <gio/gio.h>
 
 #include "handle-map.h"
+#include "mem-account.h"
+#include "quota-pool.h"
+#include "shm-transport.h"
+#include "tcti.h"
+#include "util.h"
 
 G_BEGIN_DECLS
 
+/* see connection_set_resume_func */
+typedef void (*ConnectionResumeFunc) (gpointer user_data);
+
 typedef struct _ConnectionClass {
     GObjectClass        parent;
 } ConnectionClass;
@@ -23,8 +31,72 @@ typedef struct _Connection {
     GIOStream          *iostream;
     guint64             id;
     HandleMap          *transient_handle_map;
+    guint32             uid;
+    /* PID of the client process that made the connection, 0 if unknown */
+    guint32             pid;
+    /* index of the TPM the connection's commands are sent to */
+    guint               tpm;
+    /* data read from the client, only touched by the CommandSource */
+    read_buffer_t       read_buffer;
+    /* shared command and response slots, NULL for the socket transport */
+    shm_transport_t    *shm;
+    /* commands and responses on the socket are preceded by a request tag */
+    gboolean            tagged;
+    /* the socket is SOCK_SEQPACKET: each message holds whole commands */
+    gboolean            seqpacket;
+    /* commands admitted by the ResourceManager and not yet answered */
+    gint                pending;
+    /* bytes of the connection's commands and responses, see connection_charge */
+    gssize              bytes;
+    /* commands passed on by the CommandSource whose response isn't out yet */
+    gint                in_flight;
+    /*
+     * TRUE while the CommandSource has stopped reading the connection,
+     * 'resume_func' starts it again. Both are protected by 'pause_mutex'.
+     */
+    GMutex              pause_mutex;
+    gboolean            paused;
+    ConnectionResumeFunc resume_func;
+    gpointer            resume_data;
+    /* monotonic time in seconds the client last completed a command */
+    gint                last_active;
+    /* locality the connection's commands are sent at, see connection_set_locality */
+    gint                locality;
+    /* msec the client waits for a command, see connection_set_command_timeout */
+    guint32             command_timeout;
+    /* trace the client's commands are part of, see connection_set_trace_context */
+    trace_context_t     trace_context;
+    /* figures reported by connection_get_stats */
+    gssize              commands;
+    gssize              tpm_usec;
+    /* time spent loading, saving and flushing contexts for its commands */
+    gssize              context_usec;
+    /* cgroup of the client process, NULL if unknown, see connection_set_pid */
+    gchar              *cgroup;
+    gint                sessions;
+    /* slots borrowed from the QuotaPool, only touched by the ResourceManager */
+    guint               borrowed [QUOTA_POOL_KIND_COUNT];
+    /*
+     * the connection's own kernel resource manager fd, see
+     * resource_manager_set_kernel_rm, only touched by the ResourceManager
+     */
+    Tcti               *tcti;
+    /*
+     * A channel, see TABRMD_CONTROL_SET_CHANNEL, holds a reference to the
+     * connection whose socket it's multiplexed on in 'parent'. The
+     * connection keeps its open channels in 'channels' by id and the one
+     * its commands go to in 'current', NULL for itself. These are only
+     * touched by the CommandSource.
+     */
+    struct _Connection *parent;
+    guint8              channel;
+    GHashTable         *channels;
+    struct _Connection *current;
 } Connection;
 
+/* UID of a client that couldn't be identified */
+#define CONNECTION_UID_UNKNOWN ((guint32)-1)
+
 #define TYPE_CONNECTION              (connection_get_type ())
 #define CONNECTION(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj), TYPE_CONNECTION, Connection))
 #define CONNECTION_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST  ((klass), TYPE_CONNECTION, ConnectionClass))
@@ -36,8 +108,92 @@ GType            connection_get_type     (void);
 Connection*      connection_new          (GIOStream       *iostream,
                                           guint64          id,
                                           HandleMap       *transient_handle_map);
+Connection*      connection_new_channel  (Connection      *parent,
+                                          guint8           channel,
+                                          HandleMap       *transient_handle_map);
 gpointer         connection_key_istream  (Connection      *session);
 gpointer         connection_key_id       (Connection      *session);
 GIOStream*       connection_get_iostream (Connection      *connection);
+gint             connection_get_fd       (Connection      *connection);
+read_buffer_t*   connection_get_read_buffer (Connection   *connection);
 HandleMap*       connection_get_trans_map(Connection      *session);
+guint32          connection_get_uid      (Connection      *connection);
+void             connection_set_uid      (Connection      *connection,
+                                          guint32          uid);
+guint32          connection_get_pid      (Connection      *connection);
+void             connection_set_pid      (Connection      *connection,
+                                          guint32          pid);
+guint            connection_get_tpm      (Connection      *connection);
+void             connection_set_tpm      (Connection      *connection,
+                                          guint            tpm);
+guint            connection_get_borrowed (Connection      *connection,
+                                          QuotaPoolKind    kind);
+void             connection_set_borrowed (Connection      *connection,
+                                          QuotaPoolKind    kind,
+                                          guint            count);
+Tcti*            connection_get_tcti     (Connection      *connection);
+void             connection_set_tcti     (Connection      *connection,
+                                          Tcti            *tcti);
+shm_transport_t* connection_get_shm      (Connection      *connection);
+void             connection_set_shm      (Connection      *connection,
+                                          shm_transport_t *shm);
+gboolean         connection_get_tagged   (Connection      *connection);
+void             connection_set_tagged   (Connection      *connection,
+                                          gboolean         tagged);
+gboolean         connection_get_seqpacket (Connection     *connection);
+void             connection_set_seqpacket (Connection     *connection,
+                                           gboolean        seqpacket);
+gboolean         connection_acquire_pending (Connection   *connection,
+                                             guint         max);
+void             connection_release_pending (Connection   *connection);
+void             connection_charge       (Connection      *connection,
+                                          MemAccountKind   kind,
+                                          gssize           bytes);
+gsize            connection_get_bytes    (Connection      *connection);
+void             connection_add_in_flight (Connection     *connection,
+                                           guint           count);
+gint             connection_get_in_flight (Connection     *connection);
+void             connection_answered     (Connection      *connection);
+void             connection_set_resume_func (Connection   *connection,
+                                             ConnectionResumeFunc func,
+                                             gpointer      user_data);
+gboolean         connection_pause        (Connection      *connection);
+void             connection_touch        (Connection      *connection);
+guint            connection_get_idle_time (Connection     *connection);
+guint8           connection_get_locality (Connection      *connection);
+void             connection_set_locality (Connection      *connection,
+                                          guint8           locality);
+gboolean         connection_locality_permitted (Connection *connection,
+                                                guint8      locality);
+gboolean         connection_locality_permitted_uid (guint32 uid,
+                                                    guint8  locality);
+void             connection_allow_locality_uid (guint32     uid);
+guint32          connection_get_command_timeout (Connection *connection);
+void             connection_set_command_timeout (Connection *connection,
+                                                 guint32     timeout);
+const trace_context_t* connection_get_trace_context (Connection *connection);
+void             connection_set_trace_context (Connection            *connection,
+                                               const trace_context_t *context);
+void             connection_count_command (Connection     *connection);
+void             connection_add_tpm_time (Connection      *connection,
+                                          gint64           usec);
+void             connection_add_context_time (Connection  *connection,
+                                              gint64       usec);
+const gchar*     connection_get_cgroup   (Connection      *connection);
+void             connection_add_sessions (Connection      *connection,
+                                          gint             count);
+GVariant*        connection_get_stats    (Connection      *connection);
+Connection*      connection_get_io       (Connection      *connection);
+guint8           connection_get_channel  (Connection      *connection);
+Connection*      connection_lookup_channel (Connection    *connection,
+                                            guint8         channel);
+void             connection_add_channel  (Connection      *connection,
+                                          Connection      *channel);
+gboolean         connection_remove_channel (Connection    *connection,
+                                            guint8         channel);
+guint            connection_get_channel_count (Connection *connection);
+GList*           connection_take_channels (Connection     *connection);
+Connection*      connection_get_current  (Connection      *connection);
+void             connection_set_current  (Connection      *connection,
+                                          Connection      *channel);
 #endif /* CONNECTION_H */
@@ -0,0 +1,263 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "context-store.h"
+
+G_DEFINE_TYPE (ContextStore, context_store, G_TYPE_OBJECT);
+
+#define CONTEXT_STORE_BLOCKS(size) \
+    (((size) + CONTEXT_STORE_BLOCK_SIZE - 1) / CONTEXT_STORE_BLOCK_SIZE)
+
+static void
+context_store_finalize (GObject *obj)
+{
+    ContextStore *self = CONTEXT_STORE (obj);
+
+    if (self->map != NULL) {
+        munmap (self->map, self->size);
+    }
+    if (self->fd != -1) {
+        close (self->fd);
+    }
+    g_clear_pointer (&self->used, g_free);
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (context_store_parent_class)->finalize (obj);
+}
+static void
+context_store_init (ContextStore *self)
+{
+    g_mutex_init (&self->mutex);
+    self->fd = -1;
+}
+static void
+context_store_class_init (ContextStoreClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (context_store_parent_class == NULL)
+        context_store_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = context_store_finalize;
+}
+/*
+ * Allocate a new ContextStore backed by a file in 'dir' that may grow to
+ * 'size_max' bytes. The file is unlinked right away so nothing is left
+ * behind when the daemon exits. The caller owns the returned reference.
+ * Returns NULL if the file can't be created.
+ */
+ContextStore*
+context_store_new (const gchar *dir,
+                   gsize        size_max)
+{
+    ContextStore *store;
+    gchar *path;
+    gint fd;
+
+    size_max -= size_max % CONTEXT_STORE_PAGE_SIZE;
+    if (dir == NULL || size_max == 0) {
+        g_warning ("%s: no directory or a size below one page", __func__);
+        return NULL;
+    }
+    path = g_build_filename (dir, "tpm2-abrmd-contexts-XXXXXX", NULL);
+    fd = g_mkstemp_full (path, O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        g_warning ("%s: failed to create %s: %s",
+                   __func__, path, strerror (errno));
+        g_free (path);
+        return NULL;
+    }
+    g_unlink (path);
+    g_free (path);
+    store = CONTEXT_STORE (g_object_new (TYPE_CONTEXT_STORE, NULL));
+    store->fd = fd;
+    store->size_max = size_max;
+    return store;
+}
+/*
+ * Extend the file by CONTEXT_STORE_GROW_SIZE and map all of it again.
+ * Nobody holds a pointer into the old mapping: contexts are copied in and
+ * out under the mutex, which the caller holds.
+ */
+static gboolean
+context_store_grow (ContextStore *store)
+{
+    gsize size = MIN (store->size + CONTEXT_STORE_GROW_SIZE, store->size_max);
+    guint8 *map;
+
+    if (size <= store->size) {
+        return FALSE;
+    }
+    if (ftruncate (store->fd, (off_t)size) == -1) {
+        g_warning ("%s: failed to grow to %zu bytes: %s",
+                   __func__, size, strerror (errno));
+        return FALSE;
+    }
+    map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+    if (map == MAP_FAILED) {
+        g_warning ("%s: mmap failed: %s", __func__, strerror (errno));
+        return FALSE;
+    }
+    if (store->map != NULL) {
+        munmap (store->map, store->size);
+    }
+    store->map = map;
+    store->used = g_realloc (store->used, size / CONTEXT_STORE_BLOCK_SIZE);
+    memset (store->used + store->size / CONTEXT_STORE_BLOCK_SIZE,
+            0,
+            (size - store->size) / CONTEXT_STORE_BLOCK_SIZE);
+    store->size = size;
+    return TRUE;
+}
+/*
+ * Find the first run of 'count' free blocks that doesn't straddle a page,
+ * or starts on one if 'count' blocks are larger than a page.
+ */
+static gboolean
+context_store_find (ContextStore *store,
+                    gsize         count,
+                    gsize        *first)
+{
+    gsize blocks = store->size / CONTEXT_STORE_BLOCK_SIZE;
+    gsize start = store->free_hint, page, i;
+
+    while (start + count <= blocks) {
+        page = start / CONTEXT_STORE_PAGE_BLOCKS;
+        if (count > CONTEXT_STORE_PAGE_BLOCKS) {
+            if (start % CONTEXT_STORE_PAGE_BLOCKS != 0) {
+                start = (page + 1) * CONTEXT_STORE_PAGE_BLOCKS;
+                continue;
+            }
+        } else if ((start + count - 1) / CONTEXT_STORE_PAGE_BLOCKS != page) {
+            start = (page + 1) * CONTEXT_STORE_PAGE_BLOCKS;
+            continue;
+        }
+        for (i = 0; i < count && store->used [start + i] == 0; ++i);
+        if (i == count) {
+            *first = start;
+            return TRUE;
+        }
+        start += i + 1;
+    }
+    return FALSE;
+}
+/*
+ * Free the blocks of 'ref'. The caller holds the mutex.
+ */
+static void
+context_store_release (ContextStore        *store,
+                       context_store_ref_t *ref)
+{
+    gsize count = CONTEXT_STORE_BLOCKS (ref->size);
+
+    memset (&store->used [ref->block], 0, count);
+    store->used_blocks -= count;
+    store->free_hint = MIN (store->free_hint, ref->block);
+    ref->size = 0;
+}
+/*
+ * Write 'context' to the store and describe where it went in 'ref'.
+ * Returns FALSE if the store is full, the caller keeps the context then.
+ */
+gboolean
+context_store_put (ContextStore        *store,
+                   GBytes              *context,
+                   context_store_ref_t *ref)
+{
+    gconstpointer data;
+    gsize size, count, first;
+
+    data = g_bytes_get_data (context, &size);
+    if (size == 0 || size > G_MAXUINT32) {
+        return FALSE;
+    }
+    count = CONTEXT_STORE_BLOCKS (size);
+    g_mutex_lock (&store->mutex);
+    while (!context_store_find (store, count, &first)) {
+        if (!context_store_grow (store)) {
+            g_mutex_unlock (&store->mutex);
+            g_debug ("%s: no room for a context of %zu bytes",
+                     __func__, size);
+            return FALSE;
+        }
+    }
+    memcpy (store->map + first * CONTEXT_STORE_BLOCK_SIZE, data, size);
+    memset (&store->used [first], 1, count);
+    store->used_blocks += count;
+    if (first == store->free_hint) {
+        store->free_hint = first + count;
+    }
+    g_mutex_unlock (&store->mutex);
+    ref->block = (guint32)first;
+    ref->size = (guint32)size;
+    return TRUE;
+}
+/*
+ * Read the context described by 'ref' back from the store and free its
+ * blocks. Returns NULL if 'ref' describes nothing.
+ */
+GBytes*
+context_store_take (ContextStore        *store,
+                    context_store_ref_t *ref)
+{
+    GBytes *context;
+
+    if (ref->size == 0) {
+        return NULL;
+    }
+    g_mutex_lock (&store->mutex);
+    context = g_bytes_new (store->map +
+                           (gsize)ref->block * CONTEXT_STORE_BLOCK_SIZE,
+                           ref->size);
+    context_store_release (store, ref);
+    g_mutex_unlock (&store->mutex);
+    return context;
+}
+/*
+ * Free the blocks of a context that won't be needed again.
+ */
+void
+context_store_drop (ContextStore        *store,
+                    context_store_ref_t *ref)
+{
+    if (ref->size == 0) {
+        return;
+    }
+    g_mutex_lock (&store->mutex);
+    context_store_release (store, ref);
+    g_mutex_unlock (&store->mutex);
+}
+/*
+ * Unmap the pages written so far from the daemon. Their contents stay in
+ * the file, the kernel writes them back and reclaims them as it sees fit
+ * and the next take faults the page in again.
+ */
+void
+context_store_trim (ContextStore *store)
+{
+    g_mutex_lock (&store->mutex);
+    if (store->map != NULL &&
+        madvise (store->map, store->size, MADV_DONTNEED) == -1)
+    {
+        g_debug ("%s: madvise failed: %s", __func__, strerror (errno));
+    }
+    g_mutex_unlock (&store->mutex);
+}
+/*
+ * Returns the number of bytes of the store holding contexts, rounded up
+ * to whole blocks.
+ */
+gsize
+context_store_get_used (ContextStore *store)
+{
+    gsize used;
+
+    g_mutex_lock (&store->mutex);
+    used = store->used_blocks * CONTEXT_STORE_BLOCK_SIZE;
+    g_mutex_unlock (&store->mutex);
+    return used;
+}
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef CONTEXT_STORE_H
+#define CONTEXT_STORE_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Saved contexts are packed into blocks of CONTEXT_STORE_BLOCK_SIZE bytes.
+ * A context that fits in a page never straddles two so faulting it back
+ * in touches a single page. Larger contexts start on a page boundary.
+ */
+#define CONTEXT_STORE_BLOCK_SIZE  64
+#define CONTEXT_STORE_PAGE_SIZE   4096
+#define CONTEXT_STORE_PAGE_BLOCKS (CONTEXT_STORE_PAGE_SIZE / CONTEXT_STORE_BLOCK_SIZE)
+/* the file grows by this many bytes at a time */
+#define CONTEXT_STORE_GROW_SIZE   (64 * CONTEXT_STORE_PAGE_SIZE)
+#define CONTEXT_STORE_SIZE_MAX_DEFAULT (64 * 1024 * 1024)
+
+/* where a spilled context lives in the store, 'size' is 0 for nowhere */
+typedef struct {
+    guint32           block;
+    guint32           size;
+} context_store_ref_t;
+
+typedef struct _ContextStoreClass {
+    GObjectClass      parent;
+} ContextStoreClass;
+
+/*
+ * Saved contexts of idle connections, kept in an unlinked file mapped
+ * into the daemon. Once written the pages are given back to the kernel:
+ * they're in the page cache or on disk until a context is faulted back
+ * in. Contexts are put and taken on the ResourceManager thread and may be
+ * dropped from any thread, all under 'mutex'.
+ */
+typedef struct _ContextStore {
+    GObject           parent_instance;
+    GMutex            mutex;
+    gint              fd;
+    guint8           *map;
+    gsize             size;
+    gsize             size_max;
+    /* one byte per block, non-zero while the block holds a context */
+    guint8           *used;
+    gsize             used_blocks;
+    /* no block before this one is free */
+    gsize             free_hint;
+} ContextStore;
+
+#define TYPE_CONTEXT_STORE              (context_store_get_type   ())
+#define CONTEXT_STORE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_CONTEXT_STORE, ContextStore))
+#define CONTEXT_STORE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_CONTEXT_STORE, ContextStoreClass))
+#define IS_CONTEXT_STORE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_CONTEXT_STORE))
+#define IS_CONTEXT_STORE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_CONTEXT_STORE))
+#define CONTEXT_STORE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_CONTEXT_STORE, ContextStoreClass))
+
+GType          context_store_get_type  (void);
+ContextStore*  context_store_new       (const gchar         *dir,
+                                        gsize                size_max);
+gboolean       context_store_put       (ContextStore        *store,
+                                        GBytes              *context,
+                                        context_store_ref_t *ref);
+GBytes*        context_store_take      (ContextStore        *store,
+                                        context_store_ref_t *ref);
+void           context_store_drop      (ContextStore        *store,
+                                        context_store_ref_t *ref);
+void           context_store_trim      (ContextStore        *store);
+gsize          context_store_get_used  (ContextStore        *store);
+
+G_END_DECLS
+#endif /* CONTEXT_STORE_H */
@@ -3,6 +3,7 @@
  * Copyright (c) 2017, Intel Corporation
  * All rights reserved.
  */
+#include "alloc-stats.h"
 #include "util.h"
 #include "control-message.h"
 
@@ -14,7 +15,7 @@ static void
 control_message_init (ControlMessage *obj)
 {
     UNUSED_PARAM(obj);
-    /* noop */
+    ALLOC_STATS_ADD (ALLOC_STATS_MESSAGES, sizeof (*obj));
 }
 /*
  * Dispose of object references and chain up to parent object.
@@ -55,6 +56,7 @@ control_message_new_with_object (ControlCode code,
     msg = CONTROL_MESSAGE (g_object_new (TYPE_CONTROL_MESSAGE, NULL));
     msg->code = code;
     msg->object = obj;
+    msg->timestamp = g_get_monotonic_time ();
 
     return msg;
 }
@@ -79,3 +81,11 @@ control_message_get_object (ControlMessage *msg)
 {
     return msg->object;
 }
+/*
+ * The time the ControlMessage was created, from g_get_monotonic_time.
+ */
+gint64
+control_message_get_timestamp (ControlMessage *msg)
+{
+    return msg->timestamp;
+}
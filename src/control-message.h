@@ -15,6 +15,10 @@ G_BEGIN_DECLS
 typedef enum {
     CHECK_CANCEL    = 1 << 0,
     CONNECTION_REMOVED = 1 << 1,
+    /* the object is the Tunables to apply */
+    TUNE               = 1 << 2,
+    /* wakes the ResourceManager to evict cold contexts, no object */
+    EVICT_IDLE         = 1 << 3,
 } ControlCode;
 
 typedef struct _ControlMessageClass {
@@ -26,6 +30,8 @@ typedef struct _ControlMessage
     GObject          parent_instance;
     ControlCode      code;
     GObject         *object;
+    /* g_get_monotonic_time when the message was created */
+    gint64           timestamp;
 } ControlMessage;
 
 GType control_message_get_type (void);
@@ -42,6 +48,7 @@ ControlMessage*    control_message_new_with_object (ControlCode code,
                                                     GObject *obj);
 ControlCode        control_message_get_code (ControlMessage *msg);
 GObject*           control_message_get_object (ControlMessage* msg);
+gint64             control_message_get_timestamp (ControlMessage *msg);
 
 G_END_DECLS
 #endif /* CONTROL_MESSAGE_H */
@@ -0,0 +1,764 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <inttypes.h>
+
+#include "control-message.h"
+#include "fair-queue.h"
+#include "tpm2-command.h"
+
+G_DEFINE_TYPE (FairQueue, fair_queue, TYPE_MESSAGE_QUEUE);
+
+/*
+ * Commands from a single Connection waiting to be sent to the TPM.
+ * 'deficit' is the number of commands the flow may still send before
+ * giving up its turn. 'link' is the flow's place in 'active_flows' so
+ * that finding it doesn't walk the queue.
+ */
+typedef struct {
+    Connection *connection;
+    GQueue     *commands;
+    guint       deficit;
+    GList      *link;
+} fair_queue_flow_t;
+
+static fair_queue_flow_t*
+fair_queue_flow_new (Connection *connection)
+{
+    fair_queue_flow_t *flow = g_slice_new0 (fair_queue_flow_t);
+
+    flow->connection = g_object_ref (connection);
+    flow->commands = g_queue_new ();
+    return flow;
+}
+static void
+fair_queue_flow_free (gpointer data)
+{
+    fair_queue_flow_t *flow = (fair_queue_flow_t*)data;
+
+    g_queue_free_full (flow->commands, g_object_unref);
+    g_clear_object (&flow->connection);
+    g_slice_free (fair_queue_flow_t, flow);
+}
+static void
+fair_queue_init (FairQueue *self)
+{
+    guint i;
+
+    g_mutex_init (&self->mutex);
+    g_cond_init (&self->cond);
+    self->control_queue = g_queue_new ();
+    for (i = 0; i < TPM2_COMMAND_PRIORITY_COUNT; ++i) {
+        self->active_flows [i] = g_queue_new ();
+        self->flows [i] = g_hash_table_new_full (g_direct_hash,
+                                                 g_direct_equal,
+                                                 NULL,
+                                                 fair_queue_flow_free);
+    }
+    self->uid_weights = g_hash_table_new (g_direct_hash, g_direct_equal);
+    self->locality_burst = FAIR_QUEUE_LOCALITY_BURST_DEFAULT;
+    self->clock = g_get_monotonic_time;
+}
+/*
+ * Release all queued messages. The flows in 'active_flows' are owned by
+ * the 'flows' hash tables.
+ */
+static void
+fair_queue_dispose (GObject *obj)
+{
+    FairQueue *self = FAIR_QUEUE (obj);
+    guint i;
+
+    if (self->control_queue != NULL) {
+        g_queue_free_full (self->control_queue, g_object_unref);
+        self->control_queue = NULL;
+    }
+    for (i = 0; i < TPM2_COMMAND_PRIORITY_COUNT; ++i) {
+        g_clear_pointer (&self->active_flows [i], g_queue_free);
+        g_clear_pointer (&self->flows [i], g_hash_table_unref);
+    }
+    g_clear_pointer (&self->uid_weights, g_hash_table_unref);
+    g_clear_object (&self->durations);
+    g_clear_object (&self->affinity);
+    g_clear_object (&self->lease);
+    G_OBJECT_CLASS (fair_queue_parent_class)->dispose (obj);
+}
+static void
+fair_queue_finalize (GObject *obj)
+{
+    FairQueue *self = FAIR_QUEUE (obj);
+
+    g_mutex_clear (&self->mutex);
+    g_cond_clear (&self->cond);
+    G_OBJECT_CLASS (fair_queue_parent_class)->finalize (obj);
+}
+/*
+ * Look up the weight for a connection. The caller must hold the mutex.
+ */
+static guint
+fair_queue_lookup_weight (FairQueue  *self,
+                          Connection *connection)
+{
+    gpointer weight;
+
+    if (g_hash_table_lookup_extended (self->uid_weights,
+                                      GUINT_TO_POINTER (connection_get_uid (connection)),
+                                      NULL,
+                                      &weight)) {
+        return GPOINTER_TO_UINT (weight);
+    }
+    return FAIR_QUEUE_WEIGHT_DEFAULT;
+}
+/*
+ * Take all commands queued for the connection out of the FairQueue. The
+ * commands are returned in a GList that holds a reference to each. The
+ * caller must hold the mutex.
+ */
+static GList*
+fair_queue_take_connection (FairQueue  *self,
+                            Connection *connection)
+{
+    fair_queue_flow_t *flow;
+    GList *commands = NULL;
+    GObject *obj;
+    guint i;
+
+    for (i = 0; i < TPM2_COMMAND_PRIORITY_COUNT; ++i) {
+        flow = g_hash_table_lookup (self->flows [i], connection);
+        if (flow == NULL) {
+            continue;
+        }
+        g_debug ("%s: removing %u commands for connection 0x%" PRIx64,
+                 __func__, g_queue_get_length (flow->commands),
+                 connection->id);
+        while ((obj = g_queue_pop_head (flow->commands)) != NULL) {
+            commands = g_list_prepend (commands, obj);
+            --self->length;
+        }
+        if (flow->link != NULL) {
+            g_queue_delete_link (self->active_flows [i], flow->link);
+        }
+        g_hash_table_remove (self->flows [i], connection);
+    }
+    return g_list_reverse (commands);
+}
+/*
+ * Return TRUE if a lease is in effect, dropping it once it has run out.
+ * The caller must hold the mutex.
+ */
+static gboolean
+fair_queue_leased (FairQueue *self)
+{
+    if (self->lease == NULL) {
+        return FALSE;
+    }
+    if (self->lease_commands > 0 &&
+        self->clock () < self->lease_expiry) {
+        return TRUE;
+    }
+    g_debug ("%s: lease of connection 0x%" PRIx64 " has run out",
+             __func__, self->lease->id);
+    g_clear_object (&self->lease);
+    return FALSE;
+}
+/*
+ * Tpm2Commands are queued per Connection and priority. Everything else is
+ * queued in the control queue. A CONNECTION_REMOVED message also discards the
+ * commands still queued for that connection and ends its lease.
+ */
+static void
+fair_queue_enqueue (MessageQueue *message_queue,
+                    GObject      *obj)
+{
+    FairQueue *self = FAIR_QUEUE (message_queue);
+    fair_queue_flow_t *flow;
+    Connection *connection;
+    Tpm2CommandPriority priority;
+
+    g_mutex_lock (&self->mutex);
+    if (IS_TPM2_COMMAND (obj)) {
+        connection = TPM2_COMMAND (obj)->connection;
+        priority = tpm2_command_get_priority (TPM2_COMMAND (obj));
+        flow = g_hash_table_lookup (self->flows [priority], connection);
+        if (flow == NULL) {
+            flow = fair_queue_flow_new (connection);
+            g_hash_table_insert (self->flows [priority], connection, flow);
+        }
+        if (g_queue_is_empty (flow->commands)) {
+            flow->deficit = fair_queue_lookup_weight (self, connection);
+            g_queue_push_tail (self->active_flows [priority], flow);
+            flow->link = g_queue_peek_tail_link (self->active_flows [priority]);
+        }
+        g_queue_push_tail (flow->commands, obj);
+    } else {
+        if (IS_CONTROL_MESSAGE (obj) &&
+            control_message_get_code (CONTROL_MESSAGE (obj)) == CONNECTION_REMOVED) {
+            /* nobody will read responses for a removed connection */
+            connection = CONNECTION (control_message_get_object (CONTROL_MESSAGE (obj)));
+            g_list_free_full (fair_queue_take_connection (self, connection),
+                              g_object_unref);
+            if (self->lease == connection) {
+                g_clear_object (&self->lease);
+            }
+        }
+        g_queue_push_tail (self->control_queue, obj);
+    }
+    ++self->length;
+    g_cond_signal (&self->cond);
+    g_mutex_unlock (&self->mutex);
+}
+/*
+ * Select the priority class to serve next: the highest class with queued
+ * commands, unless FAIR_QUEUE_PRIORITY_BURST high priority commands have
+ * been served in a row while lower priority commands were waiting. This
+ * keeps a stream of high priority commands from starving everyone else.
+ * The caller must hold the mutex and there must be a queued command.
+ */
+static guint
+fair_queue_select_priority (FairQueue *self)
+{
+    gint i, highest = -1, lower = -1;
+
+    for (i = TPM2_COMMAND_PRIORITY_COUNT - 1; i >= 0; --i) {
+        if (g_queue_is_empty (self->active_flows [i])) {
+            continue;
+        }
+        if (highest == -1) {
+            highest = i;
+        } else if (lower == -1) {
+            lower = i;
+        }
+    }
+    g_assert (highest != -1);
+    if (lower != -1 && self->priority_streak >= FAIR_QUEUE_PRIORITY_BURST) {
+        self->priority_streak = 0;
+        return (guint)lower;
+    }
+    if (lower != -1) {
+        ++self->priority_streak;
+    } else {
+        self->priority_streak = 0;
+    }
+    return (guint)highest;
+}
+/*
+ * Return TRUE if any priority class has queued commands that may be
+ * served: while a lease is in effect only the lease holder's commands
+ * count. The caller must hold the mutex.
+ */
+static gboolean
+fair_queue_has_commands (FairQueue *self)
+{
+    gboolean leased = fair_queue_leased (self);
+    guint i;
+
+    for (i = 0; i < TPM2_COMMAND_PRIORITY_COUNT; ++i) {
+        if (leased ? g_hash_table_contains (self->flows [i], self->lease) :
+                     !g_queue_is_empty (self->active_flows [i])) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+/*
+ * Serve the lease holder: its highest priority flow is moved to the head
+ * of its class. Other flows keep their place and deficits.
+ * Returns the priority class to serve. The caller must hold the mutex and
+ * the holder must have a queued command.
+ */
+static guint
+fair_queue_select_lease (FairQueue *self)
+{
+    fair_queue_flow_t *flow;
+    GList *link;
+    gint i;
+
+    for (i = TPM2_COMMAND_PRIORITY_COUNT - 1; i > 0; --i) {
+        if (g_hash_table_contains (self->flows [i], self->lease)) {
+            break;
+        }
+    }
+    flow = g_hash_table_lookup (self->flows [i], self->lease);
+    link = flow->link;
+    if (link != self->active_flows [i]->head) {
+        g_queue_unlink (self->active_flows [i], link);
+        g_queue_push_head_link (self->active_flows [i], link);
+    }
+    --self->lease_commands;
+    return (guint)i;
+}
+/*
+ * Returns TRUE if the flow's connection is at the locality of the last
+ * command served.
+ */
+static gboolean
+fair_queue_flow_at_locality (FairQueue         *self,
+                             fair_queue_flow_t *flow)
+{
+    return connection_get_locality (flow->connection) == self->locality;
+}
+/*
+ * Return the link in 'active' for the first flow at the current locality,
+ * or NULL if there is none or the locality has had its burst. The caller
+ * must hold the mutex.
+ */
+static GList*
+fair_queue_select_locality (FairQueue *self,
+                            GQueue    *active)
+{
+    GList *link;
+
+    if (self->locality_streak >= self->locality_burst) {
+        return NULL;
+    }
+    for (link = active->head; link != NULL; link = link->next) {
+        if (fair_queue_flow_at_locality (self, link->data)) {
+            return link;
+        }
+    }
+    return NULL;
+}
+/*
+ * Returns TRUE if a flow in 'active' waits for a switch to another
+ * locality. The caller must hold the mutex.
+ */
+static gboolean
+fair_queue_locality_waiting (FairQueue *self,
+                             GQueue    *active)
+{
+    GList *link;
+
+    for (link = active->head; link != NULL; link = link->next) {
+        if (!fair_queue_flow_at_locality (self, link->data)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+/*
+ * Return the link in 'active' for the flow whose next command has the
+ * lowest expected duration less its aging credit. Ties go to the flow
+ * nearest the head. With 'same_locality' only the flows at the current
+ * locality are considered. The caller must hold the mutex.
+ */
+static GList*
+fair_queue_select_shortest (FairQueue *self,
+                            GQueue    *active,
+                            gboolean   same_locality)
+{
+    fair_queue_flow_t *flow;
+    Tpm2Command *command;
+    GList *link, *best = NULL;
+    gint64 now = self->clock (), score, best_score = 0;
+
+    for (link = active->head; link != NULL; link = link->next) {
+        flow = (fair_queue_flow_t*)link->data;
+        if (same_locality && !fair_queue_flow_at_locality (self, flow)) {
+            continue;
+        }
+        command = TPM2_COMMAND (g_queue_peek_head (flow->commands));
+        score = command_durations_estimate (self->durations,
+                                            tpm2_command_get_code (command)) -
+            (now - tpm2_command_get_timestamp (command)) / FAIR_QUEUE_AGING_DIVISOR;
+        if (best == NULL || score < best_score) {
+            best = link;
+            best_score = score;
+        }
+    }
+    return best;
+}
+/*
+ * Return the link in 'active' for the flow whose next command was read
+ * first. Ties go to the flow nearest the head. The caller must hold the
+ * mutex.
+ */
+static GList*
+fair_queue_select_oldest (GQueue *active)
+{
+    fair_queue_flow_t *flow;
+    GList *link, *best = NULL;
+    gint64 timestamp, best_timestamp = 0;
+
+    for (link = active->head; link != NULL; link = link->next) {
+        flow = (fair_queue_flow_t*)link->data;
+        timestamp = tpm2_command_get_timestamp (
+                        TPM2_COMMAND (g_queue_peek_head (flow->commands)));
+        if (best == NULL || timestamp < best_timestamp) {
+            best = link;
+            best_timestamp = timestamp;
+        }
+    }
+    return best;
+}
+/*
+ * Returns TRUE if the 'durations' given to fair_queue_set_policy report
+ * the TPM degraded.
+ */
+static gboolean
+fair_queue_degraded (FairQueue *self)
+{
+    return self->durations != NULL &&
+        command_durations_is_degraded (self->durations);
+}
+/*
+ * Return the link in 'active' for the flow of the connection set with
+ * fair_queue_set_affinity, or NULL if it has no commands in this priority
+ * class or has used up its burst. The caller must hold the mutex.
+ */
+static GList*
+fair_queue_select_affinity (FairQueue *self,
+                            guint      priority)
+{
+    fair_queue_flow_t *flow;
+
+    if (self->affinity == NULL ||
+        self->affinity_streak >= self->affinity_burst) {
+        return NULL;
+    }
+    flow = g_hash_table_lookup (self->flows [priority], self->affinity);
+    if (flow == NULL) {
+        return NULL;
+    }
+    return flow->link;
+}
+/*
+ * Deliver control messages first. Otherwise pick a priority class and
+ * serve the flow at the head of its 'active_flows' (deficit round robin
+ * with a cost of one per command): a flow sends up to 'weight' commands
+ * before it's moved to the tail. Under FAIR_QUEUE_POLICY_SHORTEST_FIRST
+ * the flow selected by fair_queue_select_shortest is moved to the head
+ * and served instead, the deficits aren't used. The same goes for any
+ * policy while the TPM is degraded: a slow TPM then gets through the
+ * short commands first. Either way the flow of
+ * the connection with affinity goes first while its burst lasts: serving
+ * it needs no context swaps. Otherwise the flows at the locality of the
+ * last command served go first while its burst lasts, so that the TPM
+ * switches locality only when it has to. Under FAIR_QUEUE_POLICY_FIFO
+ * none of this applies: the flow selected by fair_queue_select_oldest is
+ * served.
+ * While a lease is in effect only the holder's commands are served.
+ * Flows with no queued commands are freed.
+ * Returns NULL if nothing may be served. The caller must hold the mutex.
+ */
+static GObject*
+fair_queue_pop (FairQueue *self)
+{
+    fair_queue_flow_t *flow;
+    GQueue *active;
+    GList *link;
+    GObject *obj;
+    guint priority;
+
+    obj = g_queue_pop_head (self->control_queue);
+    if (obj != NULL) {
+        --self->length;
+        return obj;
+    }
+    if (!fair_queue_has_commands (self)) {
+        return NULL;
+    }
+    if (fair_queue_leased (self)) {
+        priority = fair_queue_select_lease (self);
+        active = self->active_flows [priority];
+        flow = g_queue_peek_head (active);
+        goto pop;
+    }
+    priority = fair_queue_select_priority (self);
+    active = self->active_flows [priority];
+    if (self->policy == FAIR_QUEUE_POLICY_FIFO) {
+        link = fair_queue_select_oldest (active);
+    } else {
+        link = fair_queue_select_affinity (self, priority);
+    }
+    if (link == NULL) {
+        link = fair_queue_select_locality (self, active);
+        if (self->policy == FAIR_QUEUE_POLICY_SHORTEST_FIRST ||
+            fair_queue_degraded (self)) {
+            link = fair_queue_select_shortest (self, active, link != NULL);
+        }
+    }
+    if (link != NULL && link != active->head) {
+        g_queue_unlink (active, link);
+        g_queue_push_head_link (active, link);
+    }
+    flow = g_queue_peek_head (active);
+    /* only commands served while others wait count against the burst */
+    if (flow->connection == self->affinity &&
+        g_queue_get_length (active) > 1) {
+        ++self->affinity_streak;
+    } else if (flow->connection != self->affinity) {
+        self->affinity_streak = 0;
+    }
+    if (fair_queue_flow_at_locality (self, flow) &&
+        fair_queue_locality_waiting (self, active)) {
+        ++self->locality_streak;
+    }
+pop:
+    if (!fair_queue_flow_at_locality (self, flow)) {
+        self->locality = connection_get_locality (flow->connection);
+        self->locality_streak = 0;
+    }
+    obj = g_queue_pop_head (flow->commands);
+    --self->length;
+    if (g_queue_is_empty (flow->commands)) {
+        g_queue_pop_head (active);
+        g_hash_table_remove (self->flows [priority], flow->connection);
+    } else if (self->policy == FAIR_QUEUE_POLICY_ROUND_ROBIN &&
+               --flow->deficit == 0) {
+        flow->deficit = fair_queue_lookup_weight (self, flow->connection);
+        g_queue_push_tail_link (active, g_queue_pop_head_link (active));
+    }
+    return obj;
+}
+/*
+ * Block until a message may be served and return it. While a lease is in
+ * effect and the holder has nothing queued, the wait ends when the lease
+ * runs out so that the other flows are served again.
+ */
+static GObject*
+fair_queue_dequeue (MessageQueue *message_queue)
+{
+    FairQueue *self = FAIR_QUEUE (message_queue);
+    GObject *obj;
+
+    g_mutex_lock (&self->mutex);
+    while (g_queue_is_empty (self->control_queue) &&
+           !fair_queue_has_commands (self)) {
+        if (self->lease != NULL) {
+            g_cond_wait_until (&self->cond, &self->mutex, self->lease_expiry);
+        } else {
+            g_cond_wait (&self->cond, &self->mutex);
+        }
+    }
+    obj = fair_queue_pop (self);
+    g_mutex_unlock (&self->mutex);
+    return obj;
+}
+/*
+ * Return the next message, or NULL if nothing is queued.
+ */
+static GObject*
+fair_queue_try_dequeue (MessageQueue *message_queue)
+{
+    FairQueue *self = FAIR_QUEUE (message_queue);
+    GObject *obj;
+
+    g_mutex_lock (&self->mutex);
+    obj = fair_queue_pop (self);
+    g_mutex_unlock (&self->mutex);
+    return obj;
+}
+/*
+ * Return the number of queued messages.
+ */
+static guint
+fair_queue_get_length (MessageQueue *message_queue)
+{
+    FairQueue *self = FAIR_QUEUE (message_queue);
+    guint length;
+
+    g_mutex_lock (&self->mutex);
+    length = self->length;
+    g_mutex_unlock (&self->mutex);
+    return length;
+}
+static void
+fair_queue_class_init (FairQueueClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    MessageQueueClass *queue_class = MESSAGE_QUEUE_CLASS (klass);
+
+    if (fair_queue_parent_class == NULL)
+        fair_queue_parent_class = g_type_class_peek_parent (klass);
+    object_class->dispose  = fair_queue_dispose;
+    object_class->finalize = fair_queue_finalize;
+    queue_class->enqueue   = fair_queue_enqueue;
+    queue_class->dequeue   = fair_queue_dequeue;
+    queue_class->try_dequeue = fair_queue_try_dequeue;
+    queue_class->get_length = fair_queue_get_length;
+}
+/*
+ * Allocate a new FairQueue. The caller owns the returned reference.
+ */
+FairQueue*
+fair_queue_new (void)
+{
+    return FAIR_QUEUE (g_object_new (TYPE_FAIR_QUEUE, NULL));
+}
+/*
+ * Set the number of commands a connection owned by 'uid' may send each
+ * round. Weights take effect the next time a connection's turn starts.
+ */
+void
+fair_queue_set_uid_weight (FairQueue *queue,
+                           guint32    uid,
+                           guint      weight)
+{
+    g_assert (queue != NULL);
+    weight = CLAMP (weight, 1, FAIR_QUEUE_WEIGHT_MAX);
+    g_mutex_lock (&queue->mutex);
+    g_hash_table_insert (queue->uid_weights,
+                         GUINT_TO_POINTER (uid),
+                         GUINT_TO_POINTER (weight));
+    g_mutex_unlock (&queue->mutex);
+}
+/*
+ * Remove all commands queued for the connection, for example because the
+ * client canceled them. The caller owns the returned GList and the
+ * reference to each Tpm2Command in it.
+ */
+GList*
+fair_queue_remove_connection (FairQueue  *queue,
+                              Connection *connection)
+{
+    GList *commands;
+
+    g_mutex_lock (&queue->mutex);
+    commands = fair_queue_take_connection (queue, connection);
+    g_mutex_unlock (&queue->mutex);
+    return commands;
+}
+/*
+ * Return the weight that applies to the provided connection.
+ */
+guint
+fair_queue_get_weight (FairQueue  *queue,
+                       Connection *connection)
+{
+    guint weight;
+
+    g_mutex_lock (&queue->mutex);
+    weight = fair_queue_lookup_weight (queue, connection);
+    g_mutex_unlock (&queue->mutex);
+    return weight;
+}
+/*
+ * Select how flows are served within a priority class.
+ * FAIR_QUEUE_POLICY_SHORTEST_FIRST needs 'durations', the model of the
+ * TPM the queue feeds. With any policy, short commands go first while
+ * 'durations' reports the TPM degraded. The policy may be changed while
+ * the queue is in use, it applies from the next command dequeued.
+ */
+void
+fair_queue_set_policy (FairQueue        *queue,
+                       FairQueuePolicy   policy,
+                       CommandDurations *durations)
+{
+    g_assert (queue != NULL);
+    g_assert (policy != FAIR_QUEUE_POLICY_SHORTEST_FIRST || durations != NULL);
+    g_mutex_lock (&queue->mutex);
+    queue->policy = policy;
+    g_clear_object (&queue->durations);
+    if (durations != NULL) {
+        queue->durations = g_object_ref (durations);
+    }
+    g_mutex_unlock (&queue->mutex);
+}
+/*
+ * Let the connection set with fair_queue_set_affinity have up to 'burst'
+ * commands served ahead of other flows in a row. 0, the default, turns
+ * the preference off.
+ */
+void
+fair_queue_set_affinity_burst (FairQueue *queue,
+                               guint      burst)
+{
+    g_assert (queue != NULL);
+    g_mutex_lock (&queue->mutex);
+    queue->affinity_burst = MIN (burst, FAIR_QUEUE_AFFINITY_BURST_MAX);
+    g_mutex_unlock (&queue->mutex);
+}
+/*
+ * The consumer of the queue tells it which connection's contexts are
+ * loaded in the TPM, NULL if none are.
+ */
+void
+fair_queue_set_affinity (FairQueue  *queue,
+                         Connection *connection)
+{
+    g_assert (queue != NULL);
+    g_mutex_lock (&queue->mutex);
+    if (queue->affinity != connection) {
+        g_clear_object (&queue->affinity);
+        if (connection != NULL) {
+            queue->affinity = g_object_ref (connection);
+        }
+        queue->affinity_streak = 0;
+    }
+    g_mutex_unlock (&queue->mutex);
+}
+/*
+ * Let the flows at the current locality have up to 'burst' commands
+ * served ahead of flows at other localities in a row. 0 turns the
+ * grouping off.
+ */
+void
+fair_queue_set_locality_burst (FairQueue *queue,
+                               guint      burst)
+{
+    g_assert (queue != NULL);
+    g_mutex_lock (&queue->mutex);
+    queue->locality_burst = MIN (burst, FAIR_QUEUE_LOCALITY_BURST_MAX);
+    g_mutex_unlock (&queue->mutex);
+}
+/*
+ * Replace the time source for aging and leases, g_get_monotonic_time by
+ * default. Simulators running in virtual time set their own clock and
+ * the timestamps of the commands they enqueue from it.
+ */
+void
+fair_queue_set_clock (FairQueue      *queue,
+                      FairQueueClock  clock)
+{
+    g_assert (queue != NULL && clock != NULL);
+    g_mutex_lock (&queue->mutex);
+    queue->clock = clock;
+    g_mutex_unlock (&queue->mutex);
+}
+/*
+ * Give 'connection' a lease: only its commands are served for the next
+ * 'commands' commands or 'timeout' microseconds, whichever ends first.
+ * The other flows keep their commands queued. Acquiring the lease again
+ * renews it.
+ * Returns FALSE if another connection holds a lease.
+ */
+gboolean
+fair_queue_acquire_lease (FairQueue  *queue,
+                          Connection *connection,
+                          guint       commands,
+                          gint64      timeout)
+{
+    gboolean ret = TRUE;
+
+    g_assert (queue != NULL && connection != NULL);
+    g_mutex_lock (&queue->mutex);
+    if (fair_queue_leased (queue) && queue->lease != connection) {
+        ret = FALSE;
+        goto out;
+    }
+    if (queue->lease == NULL) {
+        queue->lease = g_object_ref (connection);
+    }
+    queue->lease_commands = CLAMP (commands, 1, FAIR_QUEUE_LEASE_COMMANDS_MAX);
+    queue->lease_expiry = queue->clock () + MAX (timeout, 0);
+    g_debug ("%s: connection 0x%" PRIx64 " leased for %u commands",
+             __func__, connection->id, queue->lease_commands);
+out:
+    g_mutex_unlock (&queue->mutex);
+    return ret;
+}
+/*
+ * End the lease held by 'connection', if any. Waiting flows are served
+ * again right away.
+ */
+void
+fair_queue_release_lease (FairQueue  *queue,
+                          Connection *connection)
+{
+    g_assert (queue != NULL);
+    g_mutex_lock (&queue->mutex);
+    if (queue->lease == connection) {
+        g_clear_object (&queue->lease);
+        g_cond_signal (&queue->cond);
+    }
+    g_mutex_unlock (&queue->mutex);
+}
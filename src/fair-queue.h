@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef FAIR_QUEUE_H
+#define FAIR_QUEUE_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "command-durations.h"
+#include "connection.h"
+#include "message-queue.h"
+#include "tpm2-command.h"
+
+G_BEGIN_DECLS
+
+#define FAIR_QUEUE_WEIGHT_DEFAULT 1
+#define FAIR_QUEUE_WEIGHT_MAX     1000
+/*
+ * Maximum number of consecutive high priority commands served while
+ * commands of lower priority are waiting.
+ */
+#define FAIR_QUEUE_PRIORITY_BURST 8
+/*
+ * With FAIR_QUEUE_POLICY_SHORTEST_FIRST a command's expected duration is
+ * reduced by the time it has waited divided by FAIR_QUEUE_AGING_DIVISOR,
+ * so a long command is served at the latest once it has waited that many
+ * times the difference between its duration and the shorter ones.
+ */
+#define FAIR_QUEUE_AGING_DIVISOR  1
+/* upper bound for fair_queue_set_affinity_burst */
+#define FAIR_QUEUE_AFFINITY_BURST_MAX 64
+/*
+ * Commands are grouped by the locality of their connection: up to
+ * 'locality_burst' commands in a row at the current locality are served
+ * ahead of flows at another one, FAIR_QUEUE_LOCALITY_BURST_DEFAULT unless
+ * set with fair_queue_set_locality_burst.
+ */
+#define FAIR_QUEUE_LOCALITY_BURST_DEFAULT 8
+#define FAIR_QUEUE_LOCALITY_BURST_MAX     64
+/* upper bound for the command count of a lease */
+#define FAIR_QUEUE_LEASE_COMMANDS_MAX 1024
+
+/*
+ * How a flow is picked within a priority class:
+ * - FAIR_QUEUE_POLICY_ROUND_ROBIN: deficit round robin over the flows
+ *   using the UID weights.
+ * - FAIR_QUEUE_POLICY_SHORTEST_FIRST: the flow whose next command has the
+ *   shortest expected duration, after aging.
+ * - FAIR_QUEUE_POLICY_FIFO: the flow whose next command was read first,
+ *   so commands go out in the order they arrived. Affinity, locality and
+ *   a degraded TPM don't change the order: this is the baseline the other
+ *   policies are measured against.
+ */
+typedef enum {
+    FAIR_QUEUE_POLICY_ROUND_ROBIN,
+    FAIR_QUEUE_POLICY_SHORTEST_FIRST,
+    FAIR_QUEUE_POLICY_FIFO,
+} FairQueuePolicy;
+
+/* time in microseconds, see fair_queue_set_clock */
+typedef gint64 (*FairQueueClock) (void);
+
+typedef struct _FairQueueClass {
+    MessageQueueClass parent;
+} FairQueueClass;
+
+typedef struct _FairQueue {
+    MessageQueue      parent_instance;
+    GMutex            mutex;
+    GCond             cond;
+    /* messages that aren't Tpm2Commands, always delivered first */
+    GQueue           *control_queue;
+    /* per priority: flows with queued commands in the order they're served */
+    GQueue           *active_flows [TPM2_COMMAND_PRIORITY_COUNT];
+    /* per priority: Connection* -> fair_queue_flow_t */
+    GHashTable       *flows [TPM2_COMMAND_PRIORITY_COUNT];
+    /* high priority commands served since a lower priority one */
+    guint             priority_streak;
+    /* UID -> weight */
+    GHashTable       *uid_weights;
+    /* number of queued messages, control messages included */
+    guint             length;
+    FairQueuePolicy   policy;
+    /*
+     * expected command durations, needed by FAIR_QUEUE_POLICY_SHORTEST_FIRST
+     * and used by any policy while they report the TPM degraded
+     */
+    CommandDurations *durations;
+    /*
+     * Connection whose objects and sessions are loaded in the TPM. Its
+     * commands may be served out of turn up to 'affinity_burst' times in a
+     * row while other flows wait, 'affinity_streak' counts them.
+     */
+    Connection       *affinity;
+    guint             affinity_burst;
+    guint             affinity_streak;
+    /*
+     * Locality of the last command served, the one the TPM is at. Flows
+     * at that locality go first while 'locality_streak' is below
+     * 'locality_burst': switching locality is a handshake on TIS and CRB
+     * TPMs.
+     */
+    guint8            locality;
+    guint             locality_burst;
+    guint             locality_streak;
+    /*
+     * Connection holding a lease, see fair_queue_acquire_lease. Only its
+     * commands are served until 'lease_commands' of them have been or
+     * 'clock' reaches 'lease_expiry'.
+     */
+    Connection       *lease;
+    guint             lease_commands;
+    gint64            lease_expiry;
+    /* time source for aging and leases */
+    FairQueueClock    clock;
+} FairQueue;
+
+#define TYPE_FAIR_QUEUE              (fair_queue_get_type   ())
+#define FAIR_QUEUE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_FAIR_QUEUE, FairQueue))
+#define FAIR_QUEUE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_FAIR_QUEUE, FairQueueClass))
+#define IS_FAIR_QUEUE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_FAIR_QUEUE))
+#define IS_FAIR_QUEUE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_FAIR_QUEUE))
+#define FAIR_QUEUE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_FAIR_QUEUE, FairQueueClass))
+
+GType        fair_queue_get_type           (void);
+FairQueue*   fair_queue_new                (void);
+void         fair_queue_set_uid_weight     (FairQueue        *queue,
+                                            guint32           uid,
+                                            guint             weight);
+guint        fair_queue_get_weight         (FairQueue        *queue,
+                                            Connection       *connection);
+GList*       fair_queue_remove_connection  (FairQueue        *queue,
+                                            Connection       *connection);
+void         fair_queue_set_policy         (FairQueue        *queue,
+                                            FairQueuePolicy   policy,
+                                            CommandDurations *durations);
+void         fair_queue_set_affinity_burst (FairQueue        *queue,
+                                            guint             burst);
+void         fair_queue_set_affinity       (FairQueue        *queue,
+                                            Connection       *connection);
+void         fair_queue_set_locality_burst (FairQueue        *queue,
+                                            guint             burst);
+void         fair_queue_set_clock          (FairQueue        *queue,
+                                            FairQueueClock    clock);
+gboolean     fair_queue_acquire_lease      (FairQueue        *queue,
+                                            Connection       *connection,
+                                            guint             commands,
+                                            gint64            timeout);
+void         fair_queue_release_lease      (FairQueue        *queue,
+                                            Connection       *connection);
+
+G_END_DECLS
+#endif /* FAIR_QUEUE_H */
@@ -0,0 +1,181 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fd-store.h"
+#include "util.h"
+
+/*
+ * Fill in 'addr' with the address of the service manager's notification
+ * socket from $NOTIFY_SOCKET. A leading '@' is an abstract socket.
+ * Returns the length of the address, 0 if there's no usable socket.
+ */
+static socklen_t
+fd_store_notify_addr (struct sockaddr_un *addr)
+{
+    const gchar *path = g_getenv ("NOTIFY_SOCKET");
+    size_t len;
+
+    if (path == NULL || (path [0] != '/' && path [0] != '@')) {
+        return 0;
+    }
+    len = strlen (path);
+    if (len < 2 || len > sizeof (addr->sun_path)) {
+        return 0;
+    }
+    memset (addr, 0, sizeof (*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy (addr->sun_path, path, len);
+    if (path [0] == '@') {
+        addr->sun_path [0] = '\0';
+    }
+    return (socklen_t)(offsetof (struct sockaddr_un, sun_path) + len);
+}
+/*
+ * Send 'state' to the service manager, with 'fd' attached if it isn't -1.
+ */
+static gboolean
+fd_store_notify (const gchar *state,
+                 gint         fd)
+{
+    struct sockaddr_un addr;
+    struct iovec iov = {
+        .iov_base = (gpointer)state,
+        .iov_len = strlen (state),
+    };
+    struct msghdr msg = {
+        .msg_name = &addr,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    union {
+        struct cmsghdr cmsg;
+        guint8 buf [CMSG_SPACE (sizeof (gint))];
+    } control;
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+    gint sock;
+
+    msg.msg_namelen = fd_store_notify_addr (&addr);
+    if (msg.msg_namelen == 0) {
+        g_debug ("%s: NOTIFY_SOCKET isn't set", __func__);
+        return FALSE;
+    }
+    if (fd != -1) {
+        memset (&control, 0, sizeof (control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof (control.buf);
+        cmsg = CMSG_FIRSTHDR (&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN (sizeof (gint));
+        memcpy (CMSG_DATA (cmsg), &fd, sizeof (gint));
+    }
+    sock = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        g_warning ("%s: failed to create socket: %s",
+                   __func__, strerror (errno));
+        return FALSE;
+    }
+    ret = TABRMD_ERRNO_EINTR_RETRY (sendmsg (sock, &msg, MSG_NOSIGNAL));
+    close (sock);
+    if (ret == -1) {
+        g_warning ("%s: failed to notify the service manager: %s",
+                   __func__, strerror (errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * Returns TRUE if the daemon runs under a service manager it can hand
+ * file descriptors to.
+ */
+gboolean
+fd_store_available (void)
+{
+    struct sockaddr_un addr;
+
+    return fd_store_notify_addr (&addr) != 0;
+}
+/*
+ * Hand 'fd' to the service manager to keep under 'name'. The daemon's
+ * copy of 'fd' is left open.
+ */
+gboolean
+fd_store_add (const gchar *name,
+              gint         fd)
+{
+    gchar *state;
+    gboolean ret;
+
+    if (strlen (name) > FD_STORE_NAME_MAX) {
+        g_warning ("%s: name too long: %s", __func__, name);
+        return FALSE;
+    }
+    state = g_strdup_printf ("FDSTORE=1\nFDNAME=%s", name);
+    ret = fd_store_notify (state, fd);
+    g_free (state);
+    return ret;
+}
+/*
+ * Have the service manager close the file descriptors it keeps under
+ * 'name'.
+ */
+gboolean
+fd_store_remove (const gchar *name)
+{
+    gchar *state;
+    gboolean ret;
+
+    state = g_strdup_printf ("FDSTOREREMOVE=1\nFDNAME=%s", name);
+    ret = fd_store_notify (state, -1);
+    g_free (state);
+    return ret;
+}
+/*
+ * Get the file descriptors passed to the daemon by the service manager:
+ * sockets from socket activation followed by those from the store. The
+ * fds start at SD_LISTEN_FDS_START. Their names are returned through
+ * 'names', NULL terminated, "unknown" for those without one. The caller
+ * frees 'names' with g_strfreev.
+ * Returns the number of fds, 0 if none were passed to this process.
+ */
+guint
+fd_store_listen_fds (gchar ***names)
+{
+    const gchar *pid_str, *fds_str, *names_str;
+    gchar **split = NULL;
+    guint64 pid, fds;
+    guint i, count = 0;
+
+    *names = NULL;
+    pid_str = g_getenv ("LISTEN_PID");
+    fds_str = g_getenv ("LISTEN_FDS");
+    if (pid_str == NULL || fds_str == NULL) {
+        return 0;
+    }
+    pid = g_ascii_strtoull (pid_str, NULL, 10);
+    fds = g_ascii_strtoull (fds_str, NULL, 10);
+    if (pid != (guint64)getpid () || fds == 0 ||
+        fds > G_MAXINT - SD_LISTEN_FDS_START)
+    {
+        return 0;
+    }
+    names_str = g_getenv ("LISTEN_FDNAMES");
+    if (names_str != NULL) {
+        split = g_strsplit (names_str, ":", -1);
+        count = g_strv_length (split);
+    }
+    *names = g_new0 (gchar*, fds + 1);
+    for (i = 0; i < fds; ++i) {
+        (*names) [i] = g_strdup (i < count ? split [i] : "unknown");
+    }
+    g_strfreev (split);
+    return (guint)fds;
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef FD_STORE_H
+#define FD_STORE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * The systemd file descriptor store, see "File Descriptor Store" in
+ * systemd.service(5). File descriptors sent to the service manager with
+ * fd_store_add are passed back to the next instance of the daemon along
+ * with those from socket activation, each under the name it was stored
+ * with. This is done with the sd_notify(3) protocol on $NOTIFY_SOCKET so
+ * there's no dependency on libsystemd.
+ */
+
+/* first fd passed by systemd, see sd_listen_fds(3) */
+#define SD_LISTEN_FDS_START 3
+/* the service manager rejects longer names */
+#define FD_STORE_NAME_MAX 255
+/* prefix of the names client connections are stored under */
+#define FD_STORE_CONNECTION_PREFIX "connection-"
+
+gboolean       fd_store_available  (void);
+gboolean       fd_store_add        (const gchar  *name,
+                                    gint          fd);
+gboolean       fd_store_remove     (const gchar  *name);
+guint          fd_store_listen_fds (gchar      ***names);
+
+G_END_DECLS
+#endif /* FD_STORE_H */
@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "flight-recorder.h"
+
+/* events recorded so far, the slot of an event is its index modulo the size */
+static gint flight_recorder_next;
+static flight_record_t flight_recorder_ring [FLIGHT_RECORDER_SIZE];
+
+static const gchar *flight_event_names [FLIGHT_EVENT_COUNT] = {
+    [FLIGHT_EVENT_RECEIVED] = "received",
+    [FLIGHT_EVENT_DEQUEUED] = "dequeued",
+    [FLIGHT_EVENT_LOAD]     = "load",
+    [FLIGHT_EVENT_TRANSMIT] = "transmit",
+    [FLIGHT_EVENT_RECEIVE]  = "receive",
+    [FLIGHT_EVENT_SAVE]     = "save",
+    [FLIGHT_EVENT_WRITE]    = "write",
+    [FLIGHT_EVENT_ERROR]    = "error",
+};
+
+/*
+ * Record 'event' for the command with 'command_code' from the connection
+ * with 'connection_id', 0 for none. 'rc' is 0 for events without one.
+ * It may be called from any thread.
+ */
+void
+flight_recorder_record (FlightEvent event,
+                        guint64     connection_id,
+                        guint32     command_code,
+                        guint32     rc)
+{
+    guint index;
+    flight_record_t *record;
+
+    index = (guint)g_atomic_int_add (&flight_recorder_next, 1);
+    record = &flight_recorder_ring [index % FLIGHT_RECORDER_SIZE];
+    __atomic_store_n (&record->seq, 0, __ATOMIC_RELAXED);
+    /* readers must see 'seq' cleared before any of the fields change */
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    record->event = event;
+    record->connection_id = connection_id;
+    record->usec = g_get_monotonic_time ();
+    record->command_code = command_code;
+    record->rc = rc;
+    __atomic_store_n (&record->seq, index + 1, __ATOMIC_RELEASE);
+}
+/*
+ * Copy the events in the ring, oldest first, into 'records' which has room
+ * for FLIGHT_RECORDER_SIZE. Slots written while they're copied are left
+ * out.
+ * Returns the number of events copied.
+ */
+guint
+flight_recorder_snapshot (flight_record_t *records)
+{
+    flight_record_t *slot;
+    guint next, index, count = 0;
+    guint seq;
+
+    next = (guint)g_atomic_int_get (&flight_recorder_next);
+    index = next > FLIGHT_RECORDER_SIZE ? next - FLIGHT_RECORDER_SIZE : 0;
+    for (; index != next; ++index) {
+        slot = &flight_recorder_ring [index % FLIGHT_RECORDER_SIZE];
+        seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq != index + 1) {
+            continue;
+        }
+        memcpy (&records [count], slot, sizeof (*slot));
+        /* the copy must be done before 'seq' is read again */
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) == seq) {
+            ++count;
+        }
+    }
+    return count;
+}
+/*
+ * Returns the events in the ring, oldest first, as a floating GVariant of
+ * type a(xstuu): time in usec, event name, connection ID, command code
+ * and RC. This is what the D-Bus DumpFlightRecorder method returns.
+ */
+GVariant*
+flight_recorder_to_variant (void)
+{
+    flight_record_t *records = g_new (flight_record_t, FLIGHT_RECORDER_SIZE);
+    GVariantBuilder builder;
+    guint count, i;
+
+    count = flight_recorder_snapshot (records);
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(xstuu)"));
+    for (i = 0; i < count; ++i) {
+        g_variant_builder_add (&builder, "(xstuu)",
+                               records [i].usec,
+                               flight_event_name (records [i].event),
+                               records [i].connection_id,
+                               records [i].command_code,
+                               records [i].rc);
+    }
+    g_free (records);
+    return g_variant_builder_end (&builder);
+}
+/*
+ * Returns the events in the ring as text, one per line and oldest first,
+ * after a line with the current CLOCK_MONOTONIC time to relate them to.
+ * The caller owns the returned string.
+ */
+gchar*
+flight_recorder_format (void)
+{
+    flight_record_t *records = g_new (flight_record_t, FLIGHT_RECORDER_SIZE);
+    GString *str = g_string_new (NULL);
+    guint count, i;
+
+    count = flight_recorder_snapshot (records);
+    g_string_append_printf (str, "# now %" PRId64 " usec, %u events\n",
+                            g_get_monotonic_time (), count);
+    for (i = 0; i < count; ++i) {
+        g_string_append_printf (str,
+                                "%" PRId64 " %-8s connection=0x%" PRIx64
+                                " cc=0x%08" PRIx32 " rc=0x%08" PRIx32 "\n",
+                                records [i].usec,
+                                flight_event_name (records [i].event),
+                                records [i].connection_id,
+                                records [i].command_code,
+                                records [i].rc);
+    }
+    g_free (records);
+    return g_string_free (str, FALSE);
+}
+/*
+ * Write the events in the ring to the file at 'path' as formatted by
+ * flight_recorder_format, replacing it.
+ * Returns FALSE and sets 'error' if it can't be written.
+ */
+gboolean
+flight_recorder_dump (const gchar  *path,
+                      GError      **error)
+{
+    gchar *text;
+    gboolean ret;
+
+    g_assert (path != NULL);
+    text = flight_recorder_format ();
+    ret = g_file_set_contents (path, text, -1, error);
+    g_free (text);
+    return ret;
+}
+/*
+ * Returns the name of 'event' used in dumps.
+ */
+const gchar*
+flight_event_name (FlightEvent event)
+{
+    g_assert (event < FLIGHT_EVENT_COUNT);
+    return flight_event_names [event];
+}
@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* the pipeline events kept by the flight recorder */
+typedef enum {
+    FLIGHT_EVENT_RECEIVED = 0,
+    FLIGHT_EVENT_DEQUEUED,
+    FLIGHT_EVENT_LOAD,
+    FLIGHT_EVENT_TRANSMIT,
+    FLIGHT_EVENT_RECEIVE,
+    FLIGHT_EVENT_SAVE,
+    FLIGHT_EVENT_WRITE,
+    FLIGHT_EVENT_ERROR,
+    FLIGHT_EVENT_COUNT,
+} FlightEvent;
+
+/*
+ * Process-wide ring of the last FLIGHT_RECORDER_SIZE pipeline events,
+ * always on so the moments before a latency incident can be looked at
+ * after the fact without turning on debug logging, which changes the
+ * timing. Any thread records an event with one atomic increment to claim
+ * a slot and one atomic store to publish it, no lock is taken and a
+ * writer never waits. Readers copy the ring out and skip the slots being
+ * written or overwritten while they copy, see flight_recorder_snapshot.
+ * The event sites are those of the USDT probes in tabrmd-probes.h:
+ * context loads and saves carry no connection, they're done for the
+ * command the ResourceManager dequeued before them.
+ */
+#define FLIGHT_RECORDER_SIZE 4096
+
+typedef struct {
+    /* index of the event + 1 once written, 0 while it's being written */
+    guint    seq;
+    guint32  event;
+    guint64  connection_id;
+    /* CLOCK_MONOTONIC time of the event */
+    gint64   usec;
+    guint32  command_code;
+    guint32  rc;
+} flight_record_t;
+
+void         flight_recorder_record     (FlightEvent      event,
+                                         guint64          connection_id,
+                                         guint32          command_code,
+                                         guint32          rc);
+guint        flight_recorder_snapshot   (flight_record_t *records);
+GVariant*    flight_recorder_to_variant (void);
+gchar*       flight_recorder_format     (void);
+gboolean     flight_recorder_dump       (const gchar     *path,
+                                         GError         **error);
+const gchar* flight_event_name          (FlightEvent      event);
+
+G_END_DECLS
+#endif /* FLIGHT_RECORDER_H */
@@ -4,9 +4,14 @@
  * All rights reserved.
  */
 #include <inttypes.h>
+#include <string.h>
 
+#include <tss2/tss2_mu.h>
+
+#include "alloc-stats.h"
 #include "util.h"
 #include "handle-map-entry.h"
+#include "mem-account.h"
 
 G_DEFINE_TYPE (HandleMapEntry, handle_map_entry, G_TYPE_OBJECT);
 
@@ -18,6 +23,32 @@ enum {
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * Bring the bytes counted for the entry in line with its 'context'. This
+ * is called whenever 'context' changes.
+ */
+static void
+handle_map_entry_account (HandleMapEntry *entry)
+{
+    gsize bytes = entry->context == NULL ? 0 : g_bytes_get_size (entry->context);
+
+    mem_account_add (MEM_ACCOUNT_CONTEXTS,
+                     (gssize)bytes - (gssize)entry->context_bytes);
+    entry->context_bytes = bytes;
+}
+/*
+ * Read a spilled context back from its store.
+ */
+static void
+handle_map_entry_fault (HandleMapEntry *entry)
+{
+    if (entry->store == NULL) {
+        return;
+    }
+    entry->context = context_store_take (entry->store, &entry->spilled);
+    g_clear_object (&entry->store);
+    handle_map_entry_account (entry);
+}
 /*
  * GObject property getter.
  */
@@ -37,7 +68,8 @@ handle_map_entry_get_property (GObject        *object,
         g_value_set_uint (value, (guint)self->vhandle);
         break;
     case PROP_CONTEXT:
-        g_value_set_pointer (value, &self->context);
+        handle_map_entry_fault (self);
+        g_value_set_boxed (value, self->context);
         break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -75,16 +107,24 @@ static void
 handle_map_entry_init (HandleMapEntry *entry)
 {
     UNUSED_PARAM(entry);
-    /* noop */
+    ALLOC_STATS_ADD (ALLOC_STATS_HANDLE_ENTRIES, sizeof (*entry));
 }
 /*
- * Deallocate all associated resources. All are static so we just chain
- * up to the parent like a good GObject.
+ * Deallocate all associated resources.
  */
 static void
 handle_map_entry_finalize (GObject *object)
 {
+    HandleMapEntry *entry = HANDLE_MAP_ENTRY (object);
+
     g_debug ("%s", __func__);
+    g_clear_pointer (&entry->context, g_bytes_unref);
+    g_clear_pointer (&entry->name, g_bytes_unref);
+    handle_map_entry_account (entry);
+    if (entry->store != NULL) {
+        context_store_drop (entry->store, &entry->spilled);
+        g_clear_object (&entry->store);
+    }
     G_OBJECT_CLASS (handle_map_entry_parent_class)->finalize (object);
 }
 /*
@@ -118,10 +158,11 @@ handle_map_entry_class_init (HandleMapEntryClass *klass)
                            0,
                            G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
     obj_properties [PROP_CONTEXT] =
-        g_param_spec_pointer ("context",
-                              "TPMS_CONTEXT",
-                              "Context blob from TPM.",
-                              G_PARAM_READABLE);
+        g_param_spec_boxed ("context",
+                            "TPMS_CONTEXT",
+                            "Marshalled context blob from TPM.",
+                            G_TYPE_BYTES,
+                            G_PARAM_READABLE);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
@@ -144,16 +185,75 @@ handle_map_entry_new (TPM2_HANDLE phandle,
     return entry;
 }
 /*
- * Access the TPMS_CONTEXT member.
- * NOTE: This directly exposes memory from an object instance. The caller
- * must be sure to hold a reference to this object to keep it from being
- * garbage collected while the caller is accessing the context structure.
+ * Return the marshalled TPMS_CONTEXT saved for the object, ready to be
+ * sent in the body of a ContextLoad, or NULL if it hasn't been saved yet.
+ * The caller doesn't own the reference returned.
  * Further this object provides no thread safety ... yet.
  */
-TPMS_CONTEXT*
+GBytes*
 handle_map_entry_get_context (HandleMapEntry *entry)
 {
-    return &entry->context;
+    handle_map_entry_fault (entry);
+    return entry->context;
+}
+/*
+ * Keep 'context', the body of a ContextSave response, as it came from the
+ * TPM: it's only as large as the context blob and is loaded again without
+ * being unmarshalled. A reference is taken on 'context'.
+ */
+void
+handle_map_entry_set_context (HandleMapEntry *entry,
+                              GBytes         *context)
+{
+    g_assert (context != NULL);
+
+    g_clear_pointer (&entry->context, g_bytes_unref);
+    if (entry->store != NULL) {
+        context_store_drop (entry->store, &entry->spilled);
+        g_clear_object (&entry->store);
+    }
+    entry->context = g_bytes_ref (context);
+    handle_map_entry_account (entry);
+    entry->context_reusable =
+        context_blob_saved_handle (context) != HANDLE_MAP_ENTRY_SAVED_SEQUENCE;
+}
+/*
+ * Returns TRUE if the saved context can be loaded again in place of saving
+ * the object each time it's evicted: a transient object's saved context
+ * stays valid for as long as the object is unchanged. That's always the
+ * case except for sequence objects.
+ */
+gboolean
+handle_map_entry_context_reusable (HandleMapEntry *entry)
+{
+    return (entry->context != NULL || entry->store != NULL) &&
+        entry->context_reusable;
+}
+/*
+ * Move the saved context to 'store' until it's needed again. Returns TRUE
+ * if it was spilled.
+ */
+gboolean
+handle_map_entry_spill (HandleMapEntry *entry,
+                        ContextStore   *store)
+{
+    if (entry->context == NULL ||
+        !context_store_put (store, entry->context, &entry->spilled))
+    {
+        return FALSE;
+    }
+    g_clear_pointer (&entry->context, g_bytes_unref);
+    handle_map_entry_account (entry);
+    entry->store = g_object_ref (store);
+    return TRUE;
+}
+/*
+ * Returns the bytes of saved context the entry holds in memory.
+ */
+gsize
+handle_map_entry_get_context_bytes (HandleMapEntry *entry)
+{
+    return entry->context_bytes;
 }
 /*
  * Accessor for the physical handle member.
@@ -177,3 +277,54 @@ handle_map_entry_set_phandle (HandleMapEntry *entry,
 {
     entry->phandle = phandle;
 }
+/*
+ * Accessors for the 'last_use' member. This is a logical timestamp set by
+ * the ResourceManager each time the object is used by a command. It's used
+ * to select the least recently used object for eviction.
+ */
+guint64
+handle_map_entry_get_last_use (HandleMapEntry *entry)
+{
+    return entry->last_use;
+}
+void
+handle_map_entry_set_last_use (HandleMapEntry *entry,
+                               guint64         last_use)
+{
+    entry->last_use = last_use;
+}
+/*
+ * Accessors for the 'residency' member, the tabrmd_residency_t hint the
+ * client gave for the object. The ResourceManager decides what to evict
+ * by it.
+ */
+guint8
+handle_map_entry_get_residency (HandleMapEntry *entry)
+{
+    return entry->residency;
+}
+void
+handle_map_entry_set_residency (HandleMapEntry *entry,
+                                guint8          residency)
+{
+    entry->residency = residency;
+}
+/*
+ * Accessors for the 'name' member, the TPM2B_NAME of the object without
+ * its size. The ResourceManager sets it from the response to the command
+ * that created or loaded the object so that the object can be told apart
+ * from others across connections. The caller of the getter doesn't own
+ * the reference returned; the setter takes a reference on 'name'.
+ */
+GBytes*
+handle_map_entry_get_name (HandleMapEntry *entry)
+{
+    return entry->name;
+}
+void
+handle_map_entry_set_name (HandleMapEntry *entry,
+                           GBytes         *name)
+{
+    g_clear_pointer (&entry->name, g_bytes_unref);
+    entry->name = name == NULL ? NULL : g_bytes_ref (name);
+}
@@ -10,17 +10,44 @@
 #include <glib-object.h>
 #include <tss2/tss2_tpm2_types.h>
 
+#include "context-store.h"
+
 G_BEGIN_DECLS
 
+/*
+ * The 'savedHandle' in the TPMS_CONTEXT of a saved sequence object. The
+ * state of a sequence object changes with each command that uses it so
+ * its saved context can't be loaded again after it's been used.
+ */
+#define HANDLE_MAP_ENTRY_SAVED_SEQUENCE 0x80000002
+
 typedef struct _HandleMapEntryClass {
     GObjectClass      parent;
 } HandleMapEntryClass;
 
+/*
+ * The fields the ResourceManager reads when it scans entries to pick one
+ * to evict come first so that they share the cache line with the GObject
+ * header. The rest are only used once an entry has been picked.
+ */
 typedef struct _HandleMapEntry {
     GObject           parent_instance;
     TPM2_HANDLE        phandle;
     TPM2_HANDLE        vhandle;
-    TPMS_CONTEXT      context;
+    guint64           last_use;
+    /* tabrmd_residency_t the client asked for */
+    guint8            residency;
+    /* the object can't change so 'context' stays valid once saved */
+    gboolean          context_reusable;
+    /* marshalled TPMS_CONTEXT, NULL until the object is first saved */
+    GBytes           *context;
+    /* holds 'context' while it's spilled, NULL otherwise */
+    ContextStore     *store;
+    context_store_ref_t spilled;
+    /* bytes of 'context' counted in MEM_ACCOUNT_CONTEXTS */
+    gsize             context_bytes;
+    /* name of the object from the response that loaded it, NULL if unknown */
+    GBytes           *name;
 } HandleMapEntry;
 
 #define TYPE_HANDLE_MAP_ENTRY              (handle_map_entry_get_type   ())
@@ -35,9 +62,24 @@ HandleMapEntry*  handle_map_entry_new           (TPM2_HANDLE         phandle,
                                                  TPM2_HANDLE         vhandle);
 TPM2_HANDLE       handle_map_entry_get_phandle   (HandleMapEntry    *entry);
 TPM2_HANDLE       handle_map_entry_get_vhandle   (HandleMapEntry    *entry);
-TPMS_CONTEXT*    handle_map_entry_get_context   (HandleMapEntry    *entry);
+GBytes*          handle_map_entry_get_context   (HandleMapEntry    *entry);
+void             handle_map_entry_set_context   (HandleMapEntry    *entry,
+                                                 GBytes            *context);
+gboolean         handle_map_entry_context_reusable (HandleMapEntry *entry);
+gsize            handle_map_entry_get_context_bytes (HandleMapEntry *entry);
+gboolean         handle_map_entry_spill         (HandleMapEntry    *entry,
+                                                 ContextStore      *store);
 void             handle_map_entry_set_phandle   (HandleMapEntry    *entry,
                                                  TPM2_HANDLE         phandle);
+guint64          handle_map_entry_get_last_use  (HandleMapEntry    *entry);
+void             handle_map_entry_set_last_use  (HandleMapEntry    *entry,
+                                                 guint64            last_use);
+guint8           handle_map_entry_get_residency (HandleMapEntry    *entry);
+void             handle_map_entry_set_residency (HandleMapEntry    *entry,
+                                                 guint8             residency);
+GBytes*          handle_map_entry_get_name      (HandleMapEntry    *entry);
+void             handle_map_entry_set_name      (HandleMapEntry    *entry,
+                                                 GBytes            *name);
 
 G_END_DECLS
 #endif /* HANDLE_MAP_ENTRY_H */
@@ -3,11 +3,12 @@
  * Copyright (c) 2017, Intel Corporation
  * All rights reserved.
  */
-#include <errno.h>
-#include <string.h>
 #include <inttypes.h>
+#include <string.h>
 
+#include "alloc-stats.h"
 #include "handle-map.h"
+#include "slab.h"
 #include "util.h"
 
 G_DEFINE_TYPE (HandleMap, handle_map, G_TYPE_OBJECT);
@@ -32,7 +33,7 @@ handle_map_get_property (GObject    *object,
 
     switch (property_id) {
     case PROP_HANDLE_TYPE:
-        g_value_set_uint (value, map->handle_count);
+        g_value_set_uint (value, map->handle_type);
         break;
     case PROP_MAX_ENTRIES:
         g_value_set_uint (value, map->max_entries);
@@ -67,51 +68,45 @@ handle_map_set_property (GObject        *object,
     }
 }
 /*
- * Initialize object. This requires:
- * 1) initializing the mutex that mediate access to the hash tables
- * 2) creating the hash tables
- * 3) initializing the handle_count
- * The handle_count is currently initialized to start allocating handles
- * @ 0xff. This is an arbitrary way we differentiate them from the handles
- * allocated by the TPM.
+ * The generations of every HandleMap that hands out vhandles, from slabs
+ * shared by all of them so connection churn doesn't fragment the heap.
+ */
+static slab_cache_t generations_cache =
+    SLAB_CACHE_INIT (HANDLE_MAP_SLOTS * sizeof (guint16), 16);
+/*
+ * Initialize object. The map starts out with no entries in the inline
+ * arrays, no hash table and every slot free at generation 0. The
+ * generations are only allocated once a vhandle is handed out: most
+ * connections never create an object. The first
+ * generation handed out is 1 so virtual handles are at least 0x100 above
+ * the handle type. This is an arbitrary way we differentiate them from the
+ * handles allocated by the TPM.
  */
 static void
 handle_map_init (HandleMap     *map)
 {
     g_debug ("handle_map_init");
-    pthread_mutex_init (&map->mutex, NULL);
-    map->vhandle_to_entry_table =
-        g_hash_table_new_full (g_direct_hash,
-                               g_direct_equal,
-                               NULL,
-                               (GDestroyNotify)g_object_unref);
-    map->handle_count = 0xff;
 }
 /*
- * GObject dispose function: release all references to GObjects. Currently
- * this is only the GHashTable mapping vhandles to HandleMapEntry objects.
+ * GObject dispose function: release all references to GObjects. These are
+ * the HandleMapEntry objects in the inline arrays or the GHashTable.
  */
 static void
 handle_map_dispose (GObject *object)
 {
     HandleMap *self = HANDLE_MAP (object);
+    guint i;
 
+    for (i = 0; i < self->inline_count; ++i) {
+        g_clear_object (&self->inline_entries [i]);
+    }
+    self->inline_count = 0;
     g_clear_pointer (&self->vhandle_to_entry_table, g_hash_table_unref);
+    g_clear_pointer (&self->sorted_vhandles, g_array_unref);
+    slab_cache_free (&generations_cache, self->generations);
+    self->generations = NULL;
     G_OBJECT_CLASS (handle_map_parent_class)->dispose (object);
 }
-/*
- * GObject finalize function: release all non-GObject resources. Currently
- * this is the mutex used to lock the GHashTable.
- */
-static void
-handle_map_finalize (GObject *object)
-{
-    HandleMap *self = HANDLE_MAP (object);
-
-    g_debug ("handle_map_finalize");
-    pthread_mutex_destroy (&self->mutex);
-    G_OBJECT_CLASS (handle_map_parent_class)->finalize (object);
-}
 /*
  * boiler-plate GObject class init function. Registers function pointers
  * and properties.
@@ -124,7 +119,6 @@ handle_map_class_init (HandleMapClass *klass)
     if (handle_map_parent_class == NULL)
         handle_map_parent_class = g_type_class_peek_parent (klass);
     object_class->dispose      = handle_map_dispose;
-    object_class->finalize     = handle_map_finalize;
     object_class->get_property = handle_map_get_property;
     object_class->set_property = handle_map_set_property;
 
@@ -164,22 +158,130 @@ handle_map_new (TPM2_HT handle_type,
                                      NULL));
 }
 /*
- * Lock the mutex that protects the hash table object.
+ * Return the index of 'vhandle' in the inline arrays, -1 if it's not
+ * there.
+ */
+static gint
+handle_map_inline_find (HandleMap   *map,
+                        TPM2_HANDLE  vhandle)
+{
+    guint i;
+
+    for (i = 0; i < map->inline_count; ++i) {
+        if (map->inline_vhandles [i] == vhandle) {
+            return (gint)i;
+        }
+    }
+    return -1;
+}
+/*
+ * Returns TRUE if 'vhandle' was the last handle handed out for its slot
+ * by handle_map_next_vhandle. Other handles inserted by the caller don't
+ * take up a slot.
+ */
+static gboolean
+handle_map_slot_owned (HandleMap   *map,
+                       TPM2_HANDLE  vhandle)
+{
+    guint slot = vhandle & HANDLE_MAP_SLOT_MASK;
+    guint generation = (vhandle & TPM2_HR_HANDLE_MASK) >> HANDLE_MAP_SLOT_BITS;
+
+    return (vhandle >> TPM2_HR_SHIFT) == map->handle_type &&
+        generation != 0 && map->generations != NULL &&
+        generation == map->generations [slot];
+}
+static void
+handle_map_slot_set (HandleMap   *map,
+                     TPM2_HANDLE  vhandle,
+                     gboolean     used)
+{
+    guint slot = vhandle & HANDLE_MAP_SLOT_MASK;
+
+    if (!handle_map_slot_owned (map, vhandle)) {
+        return;
+    }
+    if (used) {
+        map->slots_used [slot / 32] |= 1U << (slot % 32);
+    } else {
+        map->slots_used [slot / 32] &= ~(1U << (slot % 32));
+    }
+}
+/*
+ * Return the index of the first vhandle in sorted_vhandles that isn't
+ * less than 'vhandle', the length of the array if there is none.
  */
-static inline void
-handle_map_lock (HandleMap *map)
+static guint
+handle_map_sorted_find (HandleMap   *map,
+                        TPM2_HANDLE  vhandle)
 {
-    if (pthread_mutex_lock (&map->mutex) != 0)
-        g_error ("Error locking HandleMap: %s", strerror (errno));
+    guint low = 0, high = 0, mid;
+
+    if (map->sorted_vhandles != NULL) {
+        high = map->sorted_vhandles->len;
+    }
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (g_array_index (map->sorted_vhandles, TPM2_HANDLE, mid) < vhandle) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
 }
 /*
- * Unlock the mutex that protects the hash table object.
+ * Keep sorted_vhandles in step with the entries: called once an entry
+ * for 'vhandle' has been added to or removed from the map.
  */
-static inline void
-handle_map_unlock (HandleMap *map)
+static void
+handle_map_sorted_add (HandleMap   *map,
+                       TPM2_HANDLE  vhandle)
+{
+    if (map->sorted_vhandles == NULL) {
+        map->sorted_vhandles = g_array_sized_new (FALSE,
+                                                  FALSE,
+                                                  sizeof (TPM2_HANDLE),
+                                                  HANDLE_MAP_INLINE_MAX);
+        ALLOC_STATS_ADD (ALLOC_STATS_GET_CAP,
+                         HANDLE_MAP_INLINE_MAX * sizeof (TPM2_HANDLE));
+    }
+    g_array_insert_val (map->sorted_vhandles,
+                        handle_map_sorted_find (map, vhandle),
+                        vhandle);
+}
+static void
+handle_map_sorted_remove (HandleMap   *map,
+                          TPM2_HANDLE  vhandle)
 {
-    if (pthread_mutex_unlock (&map->mutex) != 0)
-        g_error ("Error unlocking HandleMap: %s", strerror (errno));
+    guint i = handle_map_sorted_find (map, vhandle);
+
+    if (map->sorted_vhandles != NULL && i < map->sorted_vhandles->len &&
+        g_array_index (map->sorted_vhandles, TPM2_HANDLE, i) == vhandle)
+    {
+        g_array_remove_index (map->sorted_vhandles, i);
+    }
+}
+/*
+ * Move the entries from the inline arrays to a new hash table. The
+ * references held by the arrays are passed to the table.
+ */
+static void
+handle_map_promote (HandleMap *map)
+{
+    guint i;
+
+    map->vhandle_to_entry_table =
+        g_hash_table_new_full (g_direct_hash,
+                               g_direct_equal,
+                               NULL,
+                               (GDestroyNotify)g_object_unref);
+    for (i = 0; i < map->inline_count; ++i) {
+        g_hash_table_insert (map->vhandle_to_entry_table,
+                             GINT_TO_POINTER (map->inline_vhandles [i]),
+                             map->inline_entries [i]);
+        map->inline_entries [i] = NULL;
+    }
+    map->inline_count = 0;
 }
 /*
  * Return false if the number of entries in the map is greater than or equal
@@ -188,22 +290,48 @@ handle_map_unlock (HandleMap *map)
 gboolean
 handle_map_is_full (HandleMap *map)
 {
-    guint table_size;
-
-    table_size = g_hash_table_size (map->vhandle_to_entry_table);
-    if (table_size < map->max_entries + 1) {
+    if (handle_map_size (map) < map->max_entries + 1) {
         return FALSE;
     } else {
         return TRUE;
     }
 }
 /*
- * Insert GObject into the hash table with the key being the provided handle.
+ * Accessors for the limit handle_map_is_full checks against. It's raised
+ * and lowered as a connection borrows and returns QuotaPool slots.
+ */
+guint
+handle_map_get_max_entries (HandleMap *map)
+{
+    return map->max_entries;
+}
+void
+handle_map_set_max_entries (HandleMap *map,
+                            guint      max_entries)
+{
+    map->max_entries = max_entries;
+}
+/*
+ * Return the number of entries that may still be inserted into the map
+ * before handle_map_is_full returns TRUE.
+ */
+guint
+handle_map_available (HandleMap *map)
+{
+    guint size = handle_map_size (map);
+
+    if (size > map->max_entries) {
+        return 0;
+    }
+    return map->max_entries + 1 - size;
+}
+/*
+ * Insert GObject into the map with the key being the provided handle.
  * We take a reference to the object before we insert the object since when
- * it is removed or if the hash table is destroyed the object will be unref'd.
+ * it is removed or if the map is destroyed the object will be unref'd.
  * If a handle provided is 0 we do not insert the entry in the corresponding
  * map.
- * If there is an entry with the given key already in the table we don't insert
+ * If there is an entry with the given key already in the map we don't insert
  * anything, because it would overwrite the original entry.
  */
 gboolean
@@ -212,122 +340,226 @@ handle_map_insert (HandleMap      *map,
                    HandleMapEntry *entry)
 {
     g_debug ("%s: vhandle: 0x%" PRIx32, __func__, vhandle);
-    handle_map_lock (map);
     if (handle_map_is_full (map)) {
         g_warning ("%s: max_entries of %u exceeded", __func__, map->max_entries);
-        handle_map_unlock (map);
         return FALSE;
     }
-    if (entry && vhandle != 0) {
-        TPM2_HANDLE *orig_key;
-        HandleMapEntry *orig_value;
-
-	/* Check if an entry for the key is already in the table */
-        if (!g_hash_table_lookup_extended (map->vhandle_to_entry_table,
-                                           GINT_TO_POINTER (vhandle),
-                                           (gpointer *) &orig_key,
-					   (gpointer *) &orig_value)) {
-            g_object_ref (entry);
-            g_hash_table_insert (map->vhandle_to_entry_table,
-                                 GINT_TO_POINTER (vhandle),
-                                 entry);
-	}
+    if (entry == NULL || vhandle == 0) {
+        return TRUE;
+    }
+    if (map->vhandle_to_entry_table == NULL) {
+        if (handle_map_inline_find (map, vhandle) != -1) {
+            return TRUE;
+        }
+        if (map->inline_count < HANDLE_MAP_INLINE_MAX) {
+            map->inline_vhandles [map->inline_count] = vhandle;
+            map->inline_entries [map->inline_count] = g_object_ref (entry);
+            ++map->inline_count;
+            handle_map_slot_set (map, vhandle, TRUE);
+            handle_map_sorted_add (map, vhandle);
+            g_atomic_int_inc (&map->count);
+            return TRUE;
+        }
+        handle_map_promote (map);
+    }
+    /* Check if an entry for the key is already in the table */
+    if (!g_hash_table_contains (map->vhandle_to_entry_table,
+                                GINT_TO_POINTER (vhandle)))
+    {
+        g_hash_table_insert (map->vhandle_to_entry_table,
+                             GINT_TO_POINTER (vhandle),
+                             g_object_ref (entry));
+        handle_map_slot_set (map, vhandle, TRUE);
+        handle_map_sorted_add (map, vhandle);
+        g_atomic_int_inc (&map->count);
     }
-    handle_map_unlock (map);
     return TRUE;
 }
 /*
- * Remove the entry from the hash table associated with the provided handle.
+ * Remove the entry from the map associated with the provided handle.
  * Returns TRUE on success, FALSE on failure.
  */
 gboolean
 handle_map_remove (HandleMap *map,
                    TPM2_HANDLE vhandle)
 {
-    gboolean ret;
-
-    handle_map_lock (map);
-    ret = g_hash_table_remove (map->vhandle_to_entry_table,
-                               GINT_TO_POINTER (vhandle));
-    handle_map_unlock (map);
+    gint i;
 
-    return ret;
+    if (map->vhandle_to_entry_table != NULL) {
+        if (!g_hash_table_remove (map->vhandle_to_entry_table,
+                                  GINT_TO_POINTER (vhandle)))
+        {
+            return FALSE;
+        }
+        handle_map_slot_set (map, vhandle, FALSE);
+        handle_map_sorted_remove (map, vhandle);
+        g_atomic_int_add (&map->count, -1);
+        return TRUE;
+    }
+    i = handle_map_inline_find (map, vhandle);
+    if (i == -1) {
+        return FALSE;
+    }
+    handle_map_slot_set (map, vhandle, FALSE);
+    handle_map_sorted_remove (map, vhandle);
+    g_atomic_int_add (&map->count, -1);
+    g_object_unref (map->inline_entries [i]);
+    --map->inline_count;
+    /* keep the arrays packed by moving the last entry into the hole */
+    map->inline_vhandles [i] = map->inline_vhandles [map->inline_count];
+    map->inline_entries [i] = map->inline_entries [map->inline_count];
+    map->inline_entries [map->inline_count] = NULL;
+    return TRUE;
 }
 /*
- * Generic lookup function to find an entry in a GHashTable for the given
- * handle.
+ * Look up the GObject associated with the virtual handle in the map. The
+ * object is not removed from the map. The reference count for the object
+ * is incremented before it is returned to the caller. The caller must
+ * free this reference when they are done with it.
+ * NULL is returned if no entry matches the provided handle.
  */
-static HandleMapEntry*
-handle_map_lookup (HandleMap     *map,
-                   TPM2_HANDLE     handle,
-                   GHashTable    *table)
+HandleMapEntry*
+handle_map_vlookup (HandleMap    *map,
+                    TPM2_HANDLE    vhandle)
 {
     HandleMapEntry *entry;
+    gint i;
 
-    handle_map_lock (map);
-    entry = g_hash_table_lookup (table, GINT_TO_POINTER (handle));
+    if (map->vhandle_to_entry_table != NULL) {
+        entry = g_hash_table_lookup (map->vhandle_to_entry_table,
+                                     GINT_TO_POINTER (vhandle));
+    } else {
+        i = handle_map_inline_find (map, vhandle);
+        entry = (i == -1) ? NULL : map->inline_entries [i];
+    }
     if (entry)
         g_object_ref (entry);
-    handle_map_unlock (map);
 
     return entry;
 }
 /*
- * Look up the GObject associated with the virtual handle in the hash
- * table. The object is not removed from the hash table. The reference
- * count for the object is incremented before it is returned to the caller.
- * The caller must free this reference when they are done with it.
- * NULL is returned if no entry matches the provided handle.
+ * Report the number of entries in the map.
  */
-HandleMapEntry*
-handle_map_vlookup (HandleMap    *map,
-                    TPM2_HANDLE    vhandle)
+guint
+handle_map_size (HandleMap *map)
 {
-    return handle_map_lookup (map, vhandle, map->vhandle_to_entry_table);
+    if (map->vhandle_to_entry_table != NULL) {
+        return g_hash_table_size (map->vhandle_to_entry_table);
+    }
+    return map->inline_count;
 }
 /*
- * Simple wrapper around the function that reports the number of entries in
- * the hash table.
+ * Report the number of entries in the map. Unlike handle_map_size this may
+ * be called from any thread.
  */
 guint
-handle_map_size (HandleMap *map)
+handle_map_get_count (HandleMap *map)
 {
-    guint ret;
-
-    handle_map_lock (map);
-    ret = g_hash_table_size (map->vhandle_to_entry_table);
-    handle_map_unlock (map);
+    return (guint)g_atomic_int_get (&map->count);
+}
+/*
+ * Add up the bytes of saved context the entries hold in memory.
+ */
+static void
+handle_map_context_bytes_cb (gpointer key,
+                             gpointer value,
+                             gpointer user_data)
+{
+    UNUSED_PARAM (key);
+    *(gsize*)user_data +=
+        handle_map_entry_get_context_bytes (HANDLE_MAP_ENTRY (value));
+}
+/*
+ * Returns the bytes of saved context the entries of the map hold in
+ * memory.
+ */
+gsize
+handle_map_get_context_bytes (HandleMap *map)
+{
+    gsize bytes = 0;
 
-    return ret;
+    handle_map_foreach (map, handle_map_context_bytes_cb, &bytes);
+    return bytes;
 }
 /*
- * Combine the handle_type and the handle_count to create a new handle.
- * The handle_count is advanced as part of this. If the handle_count has
- * a bit set in the upper byte (the handle_type bits) then it has rolled
- * over and we return an error.
- * NOTE: recycling handles is something we should be able to do for long
- * lived programs / daemons that may want to use the TPM.
+ * Hand out a virtual handle in the first free slot, advancing the slot's
+ * generation. The slot is taken once the handle is inserted and freed when
+ * it's removed, so a handle that's never inserted only costs a generation.
+ * Returns 0 if every slot holds an entry.
  */
 TPM2_HANDLE
 handle_map_next_vhandle (HandleMap *map)
 {
-    TPM2_HANDLE handle;
+    guint i, slot;
 
-    /* (2 ^ 24) - 1 handles max, return 0 if we roll over*/
-    if (map->handle_count & TPM2_HR_RANGE_MASK)
-        return 0;
-    handle = map->handle_count + (TPM2_HANDLE)(map->handle_type << TPM2_HR_SHIFT);
-    ++map->handle_count;
-    return handle;
+    if (map->generations == NULL) {
+        map->generations = slab_cache_alloc0 (&generations_cache);
+    }
+    for (i = 0; i < G_N_ELEMENTS (map->slots_used); ++i) {
+        if (map->slots_used [i] == G_MAXUINT32) {
+            continue;
+        }
+        slot = i * 32 + (guint)g_bit_nth_lsf ((gulong)~map->slots_used [i], -1);
+        if (map->generations [slot] == HANDLE_MAP_GENERATION_MAX) {
+            map->generations [slot] = 1;
+        } else {
+            ++map->generations [slot];
+        }
+        return (TPM2_HANDLE)map->handle_type << TPM2_HR_SHIFT |
+            (TPM2_HANDLE)map->generations [slot] << HANDLE_MAP_SLOT_BITS |
+            slot;
+    }
+    return 0;
+}
+/*
+ * Insert 'entry' under a vhandle handed out by the HandleMap of a previous
+ * daemon, one restored from a checkpoint. The slot takes the generation of
+ * 'vhandle' so that it's held until the entry is removed.
+ * Returns FALSE if 'vhandle' wasn't handed out by a HandleMap of this type
+ * or its slot is in use.
+ */
+gboolean
+handle_map_restore (HandleMap      *map,
+                    TPM2_HANDLE     vhandle,
+                    HandleMapEntry *entry)
+{
+    guint slot = vhandle & HANDLE_MAP_SLOT_MASK;
+    guint generation = (vhandle & TPM2_HR_HANDLE_MASK) >> HANDLE_MAP_SLOT_BITS;
+
+    if ((vhandle >> TPM2_HR_SHIFT) != map->handle_type || generation == 0 ||
+        map->slots_used [slot / 32] & (1U << (slot % 32)))
+    {
+        g_warning ("%s: can't restore vhandle 0x%" PRIx32, __func__, vhandle);
+        return FALSE;
+    }
+    if (map->generations == NULL) {
+        map->generations = slab_cache_alloc0 (&generations_cache);
+    }
+    map->generations [slot] = (guint16)generation;
+    return handle_map_insert (map, vhandle, entry);
 }
+/*
+ * Invoke 'callback' for each entry in the map with the vhandle as the key
+ * and the HandleMapEntry as the value, in no particular order.
+ */
 void
 handle_map_foreach (HandleMap *map,
                     GHFunc     callback,
                     gpointer   user_data)
 {
-    g_hash_table_foreach (map->vhandle_to_entry_table,
-                          callback,
-                          user_data);
+    guint i;
+
+    if (map->vhandle_to_entry_table != NULL) {
+        g_hash_table_foreach (map->vhandle_to_entry_table,
+                              callback,
+                              user_data);
+        return;
+    }
+    for (i = 0; i < map->inline_count; ++i) {
+        callback (GINT_TO_POINTER (map->inline_vhandles [i]),
+                  map->inline_entries [i],
+                  user_data);
+    }
 }
 /*
  * Get a GList containing all keys from the map. These will be returned in no
@@ -336,5 +568,47 @@ handle_map_foreach (HandleMap *map,
 GList*
 handle_map_get_keys (HandleMap *map)
 {
-    return g_hash_table_get_keys (map->vhandle_to_entry_table);
+    GList *keys = NULL;
+    guint i;
+
+    if (map->vhandle_to_entry_table != NULL) {
+        keys = g_hash_table_get_keys (map->vhandle_to_entry_table);
+        ALLOC_STATS_ADD (ALLOC_STATS_GET_CAP,
+                         g_list_length (keys) * sizeof (GList));
+        return keys;
+    }
+    for (i = map->inline_count; i > 0; --i) {
+        keys = g_list_prepend (keys,
+                               GINT_TO_POINTER (map->inline_vhandles [i - 1]));
+    }
+    ALLOC_STATS_ADD (ALLOC_STATS_GET_CAP, map->inline_count * sizeof (GList));
+    return keys;
+}
+/*
+ * Copy up to 'max_count' vhandles from the map that are numerically no
+ * smaller than 'start' into 'vhandles', in ascending order. 'more_data'
+ * is set to TRUE if the map holds more of them than were copied.
+ * Returns the number of vhandles copied.
+ */
+guint
+handle_map_copy_vhandles (HandleMap   *map,
+                          TPM2_HANDLE  start,
+                          TPM2_HANDLE  vhandles[],
+                          guint        max_count,
+                          gboolean    *more_data)
+{
+    guint first, count;
+
+    first = handle_map_sorted_find (map, start);
+    count = 0;
+    if (map->sorted_vhandles != NULL) {
+        count = MIN (map->sorted_vhandles->len - first, max_count);
+        memcpy (vhandles,
+                &g_array_index (map->sorted_vhandles, TPM2_HANDLE, first),
+                count * sizeof (TPM2_HANDLE));
+        *more_data = first + count < map->sorted_vhandles->len;
+    } else {
+        *more_data = FALSE;
+    }
+    return count;
 }
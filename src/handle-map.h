@@ -8,7 +8,6 @@
 
 #include <glib.h>
 #include <glib-object.h>
-#include <pthread.h>
 #include <tss2/tss2_tpm2_types.h>
 
 #include "handle-map-entry.h"
@@ -17,18 +16,49 @@ G_BEGIN_DECLS
 
 #define MAX_ENTRIES_DEFAULT 27
 #define MAX_ENTRIES_MAX     100
+/*
+ * Number of entries held inline in the HandleMap. A map that grows beyond
+ * this moves its entries to a hash table.
+ */
+#define HANDLE_MAP_INLINE_MAX 4
+/*
+ * Virtual handles are made of the handle type, a 16 bit generation and an
+ * 8 bit slot. Each slot can hold one entry at a time and gets a new
+ * generation every time it's handed out, so a handle that was flushed
+ * isn't valid again until its slot has gone through every generation.
+ */
+#define HANDLE_MAP_SLOT_BITS  8
+#define HANDLE_MAP_SLOTS      (1 << HANDLE_MAP_SLOT_BITS)
+#define HANDLE_MAP_SLOT_MASK  (HANDLE_MAP_SLOTS - 1)
+#define HANDLE_MAP_GENERATION_MAX (TPM2_HR_HANDLE_MASK >> HANDLE_MAP_SLOT_BITS)
 
 typedef struct _HandleMapClass {
     GObjectClass      parent;
 } HandleMapClass;
 
+/*
+ * Map from virtual handles to HandleMapEntry objects. Most connections
+ * hold only a few transient objects, so up to HANDLE_MAP_INLINE_MAX
+ * entries are kept in the inline arrays and found by a linear scan. The
+ * map isn't locked: it's only used by the ResourceManager thread.
+ */
 typedef struct _HandleMap {
     GObject             parent_instance;
-    pthread_mutex_t     mutex;
     TPM2_HT              handle_type;
-    TPM2_HANDLE          handle_count;
+    /* bit set for each slot holding an entry allocated by the map */
+    guint32             slots_used [HANDLE_MAP_SLOTS / 32];
+    /* HANDLE_MAP_SLOTS generations, NULL until the first vhandle is handed out */
+    guint16            *generations;
+    guint               inline_count;
+    TPM2_HANDLE          inline_vhandles [HANDLE_MAP_INLINE_MAX];
+    HandleMapEntry     *inline_entries [HANDLE_MAP_INLINE_MAX];
+    /* NULL until the map outgrows the inline arrays */
     GHashTable         *vhandle_to_entry_table;
+    /* every vhandle in the map in ascending order, NULL until the first insert */
+    GArray             *sorted_vhandles;
     guint               max_entries;
+    /* entries in the map, kept for readers on other threads */
+    gint                count;
 } HandleMap;
 
 #define TYPE_HANDLE_MAP              (handle_map_get_type   ())
@@ -51,12 +81,26 @@ HandleMapEntry*  handle_map_plookup     (HandleMap     *map,
 HandleMapEntry*  handle_map_vlookup     (HandleMap     *map,
                                          TPM2_HANDLE     vhandle);
 guint            handle_map_size        (HandleMap     *map);
+guint            handle_map_get_count   (HandleMap     *map);
+gsize            handle_map_get_context_bytes (HandleMap *map);
 TPM2_HANDLE       handle_map_next_vhandle (HandleMap    *map);
+gboolean         handle_map_restore      (HandleMap      *map,
+                                          TPM2_HANDLE     vhandle,
+                                          HandleMapEntry *entry);
 void             handle_map_foreach      (HandleMap    *map,
                                           GHFunc        callback,
                                           gpointer      user_data);
 gboolean         handle_map_is_full      (HandleMap *map);
+guint            handle_map_available    (HandleMap *map);
+guint            handle_map_get_max_entries (HandleMap *map);
+void             handle_map_set_max_entries (HandleMap *map,
+                                             guint      max_entries);
 GList*           handle_map_get_keys     (HandleMap    *map);
+guint            handle_map_copy_vhandles (HandleMap   *map,
+                                          TPM2_HANDLE  start,
+                                          TPM2_HANDLE  vhandles[],
+                                          guint        max_count,
+                                          gboolean    *more_data);
 
 G_END_DECLS
 #endif /* HANDLE_MAP_H */
@@ -15,6 +15,92 @@ extern "C" {
 TSS2_RC Tss2_Tcti_Tabrmd_Init (TSS2_TCTI_CONTEXT *context,
                                size_t *size,
                                const char *conf);
+/*
+ * Extension API for a context initialized with "transport=tagged". Any
+ * number of commands may be in flight. Each response is returned with the
+ * tag of the command it answers.
+ */
+TSS2_RC Tss2_Tcti_Tabrmd_TransmitTagged (TSS2_TCTI_CONTEXT *context,
+                                         uint32_t tag,
+                                         size_t size,
+                                         const uint8_t *command);
+TSS2_RC Tss2_Tcti_Tabrmd_ReceiveTagged (TSS2_TCTI_CONTEXT *context,
+                                        uint32_t *tag,
+                                        size_t *size,
+                                        uint8_t *response,
+                                        int32_t timeout);
+/*
+ * Send 'count' commands in a single message on a context initialized with
+ * "transport=tagged". The daemon sends them to the TPM one after the
+ * other without serving other clients in between, so objects and
+ * sessions used by the batch stay loaded in the TPM. Each response is
+ * returned by Tss2_Tcti_Tabrmd_ReceiveTagged with the tag of its command.
+ * With TSS2_TCTI_TABRMD_BATCH_STOP_ON_ERROR the commands after the first
+ * one that doesn't succeed are not sent to the TPM and are answered with
+ * TPM2_RC_CANCELED in the resource manager layer.
+ */
+#define TSS2_TCTI_TABRMD_BATCH_STOP_ON_ERROR ((uint32_t)1 << 0)
+
+TSS2_RC Tss2_Tcti_Tabrmd_SubmitBatch (TSS2_TCTI_CONTEXT *context,
+                                      uint32_t flags,
+                                      size_t count,
+                                      const uint32_t *tags,
+                                      const size_t *sizes,
+                                      const uint8_t *const *commands);
+
+/*
+ * Hold the TPM for this connection alone for the next 'commands' commands
+ * or 'timeout' milliseconds. Returns TSS2_RESMGR_RC_RETRY while another
+ * connection holds a lease.
+ */
+TSS2_RC Tss2_Tcti_Tabrmd_AcquireLease (TSS2_TCTI_CONTEXT *context,
+                                       uint32_t commands,
+                                       uint32_t timeout);
+TSS2_RC Tss2_Tcti_Tabrmd_ReleaseLease (TSS2_TCTI_CONTEXT *context);
+
+/*
+ * Give each command sent after this 'timeout' milliseconds from when the
+ * daemon receives it to reach the TPM, typically the timeout the caller
+ * passes to Tss2_Tcti_Receive. Commands still queued then are answered
+ * with TPM2_RC_CANCELED in the resource manager layer without being sent
+ * to the TPM. A 'timeout' of 0 lets commands wait for as long as it
+ * takes. Returns TSS2_TCTI_RC_NOT_IMPLEMENTED if the daemon doesn't
+ * support it.
+ */
+TSS2_RC Tss2_Tcti_Tabrmd_SetCommandTimeout (TSS2_TCTI_CONTEXT *context,
+                                            uint32_t timeout);
+
+/*
+ * Make the commands sent after this part of the trace in 'traceparent', a
+ * W3C traceparent header such as
+ * "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01". If the
+ * sampled flag is set the daemon records spans for them, children of the
+ * caller's span, when it's started with --span-file. NULL ends the trace.
+ * Returns TSS2_TCTI_RC_BAD_VALUE if 'traceparent' is malformed and
+ * TSS2_TCTI_RC_NOT_IMPLEMENTED if the daemon doesn't support it.
+ */
+TSS2_RC Tss2_Tcti_Tabrmd_SetTraceParent (TSS2_TCTI_CONTEXT *context,
+                                         const char *traceparent);
+
+/*
+ * Send the commands after this to channel 'channel' of the connection, a
+ * logical connection of its own with separate transient objects, sessions
+ * and limits that shares the connection's socket. Channel 0 is the
+ * connection itself, the others are opened when first selected, up to
+ * the daemon's --max-channels. With commands in flight on several
+ * channels use Tss2_Tcti_Tabrmd_TransmitTagged to match the responses.
+ * Returns TSS2_TCTI_RC_NOT_IMPLEMENTED if the daemon doesn't support it.
+ */
+TSS2_RC Tss2_Tcti_Tabrmd_SetChannel (TSS2_TCTI_CONTEXT *context,
+                                     uint8_t channel);
+/*
+ * Close channel 'channel', flushing its objects and sessions. Its
+ * commands must all have been answered. Returns TSS2_TCTI_RC_BAD_VALUE
+ * for channel 0 and TSS2_TCTI_RC_NOT_IMPLEMENTED if the daemon doesn't
+ * support channels.
+ */
+TSS2_RC Tss2_Tcti_Tabrmd_CloseChannel (TSS2_TCTI_CONTEXT *context,
+                                       uint8_t channel);
 
 #ifdef __cplusplus
 }
@@ -6,7 +6,11 @@
 
 #include <gio/gunixfdlist.h>
 #include <inttypes.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
+#include "flight-recorder.h"
 #include "ipc-frontend-dbus.h"
 #include "tabrmd-defaults.h"
 #include "tabrmd.h"
@@ -14,12 +18,40 @@
 
 G_DEFINE_TYPE (IpcFrontendDbus, ipc_frontend_dbus, TYPE_IPC_FRONTEND);
 
+static void create_connection_setup (gpointer data, gpointer user_data);
+
+/*
+ * Credentials of a D-Bus peer looked up through the D-Bus daemon. Unique
+ * bus names are never reused so a credential doesn't change while the name
+ * has an owner. Entries are dropped when NameOwnerChanged reports that the
+ * name went away. The cache is shared by the main loop thread and the
+ * connection setup workers under setup_mutex.
+ */
+typedef enum {
+    CREDENTIAL_PID,
+    CREDENTIAL_UID,
+    N_CREDENTIALS,
+} credential_t;
+
+typedef struct {
+    guint32  value [N_CREDENTIALS];
+    gboolean known [N_CREDENTIALS];
+} credential_cache_entry_t;
+
+static const gchar* const credential_methods [N_CREDENTIALS] = {
+    [CREDENTIAL_PID] = "GetConnectionUnixProcessID",
+    [CREDENTIAL_UID] = "GetConnectionUnixUser",
+};
+/* bound on the cache in case a NameOwnerChanged signal is missed */
+#define CREDENTIAL_CACHE_MAX 1024
+
 typedef enum {
     TABRMD_ERROR_INTERNAL         = TSS2_RESMGR_RC_INTERNAL_ERROR,
     TABRMD_ERROR_MAX_CONNECTIONS  = TSS2_RESMGR_RC_GENERAL_FAILURE,
     TABRMD_ERROR_ID_GENERATION    = TSS2_RESMGR_RC_GENERAL_FAILURE,
     TABRMD_ERROR_NOT_IMPLEMENTED  = TSS2_RESMGR_RC_NOT_IMPLEMENTED,
     TABRMD_ERROR_NOT_PERMITTED    = TSS2_RESMGR_RC_NOT_PERMITTED,
+    TABRMD_ERROR_BAD_VALUE        = TSS2_RESMGR_RC_BAD_VALUE,
 } TabrmdErrorEnum;
 
 enum {
@@ -28,7 +60,10 @@ enum {
     PROP_BUS_TYPE,
     PROP_CONNECTION_MANAGER,
     PROP_MAX_TRANS,
+    PROP_METRICS,
     PROP_RANDOM,
+    PROP_TPM_COUNT,
+    PROP_MAX_CHANNELS,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties[N_PROPERTIES] = { NULL };
@@ -56,10 +91,20 @@ ipc_frontend_dbus_set_property (GObject      *object,
     case PROP_MAX_TRANS:
         self->max_transient_objects = g_value_get_uint (value);
         break;
+    case PROP_METRICS:
+        g_clear_object (&self->metrics);
+        self->metrics = g_value_dup_object (value);
+        break;
     case PROP_RANDOM:
         self->random = g_value_get_object (value);
         g_object_ref (self->random);
         break;
+    case PROP_TPM_COUNT:
+        self->tpm_count = g_value_get_uint (value);
+        break;
+    case PROP_MAX_CHANNELS:
+        self->max_channels = g_value_get_uint (value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -86,9 +131,18 @@ ipc_frontend_dbus_get_property (GObject    *object,
     case PROP_MAX_TRANS:
         g_value_set_uint (value, self->max_transient_objects);
         break;
+    case PROP_METRICS:
+        g_value_set_object (value, self->metrics);
+        break;
     case PROP_RANDOM:
         g_value_set_object (value, self->random);
         break;
+    case PROP_TPM_COUNT:
+        g_value_set_uint (value, self->tpm_count);
+        break;
+    case PROP_MAX_CHANNELS:
+        g_value_set_uint (value, self->max_channels);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -98,6 +152,18 @@ static void
 ipc_frontend_dbus_init (IpcFrontendDbus *self)
 {
     self->dbus_name_acquired = FALSE;
+    self->credential_cache = g_hash_table_new_full (g_str_hash,
+                                                    g_str_equal,
+                                                    g_free,
+                                                    g_free);
+    socket_pool_init (&self->socket_pool, SOCKET_POOL_SIZE_DEFAULT);
+    g_mutex_init (&self->setup_mutex);
+    self->setup_queue = g_queue_new ();
+    self->setup_pool = g_thread_pool_new (create_connection_setup,
+                                          self,
+                                          IPC_FRONTEND_DBUS_SETUP_THREADS,
+                                          FALSE,
+                                          NULL);
 }
 /*
  * Dispose method where where we free up references to other objects.
@@ -107,9 +173,24 @@ ipc_frontend_dbus_dispose (GObject *obj)
 {
     IpcFrontendDbus *self = IPC_FRONTEND_DBUS (obj);
 
+    /* each queued setup holds a reference so the workers are idle */
+    if (self->setup_pool != NULL) {
+        g_thread_pool_free (self->setup_pool, FALSE, TRUE);
+        self->setup_pool = NULL;
+    }
     g_clear_object (&self->connection_manager);
+    if (self->dbus_daemon_proxy != NULL) {
+        g_signal_handlers_disconnect_by_data (self->dbus_daemon_proxy, self);
+        g_clear_object (&self->dbus_daemon_proxy);
+    }
     g_clear_object (&self->random);
+    g_clear_object (&self->metrics);
     g_clear_object (&self->skeleton);
+    if (self->socket_pool_source != 0) {
+        g_source_remove (self->socket_pool_source);
+        self->socket_pool_source = 0;
+    }
+    socket_pool_clear (&self->socket_pool);
     G_OBJECT_CLASS (ipc_frontend_dbus_parent_class)->dispose (obj);
 }
 /*
@@ -121,6 +202,9 @@ ipc_frontend_dbus_finalize (GObject *obj)
     IpcFrontendDbus *self = IPC_FRONTEND_DBUS (obj);
 
     g_clear_pointer (&self->bus_name, g_free);
+    g_clear_pointer (&self->credential_cache, g_hash_table_unref);
+    g_queue_free (self->setup_queue);
+    g_mutex_clear (&self->setup_mutex);
     G_OBJECT_CLASS (ipc_frontend_dbus_parent_class)->finalize (obj);
 }
 
@@ -168,12 +252,34 @@ ipc_frontend_dbus_class_init (IpcFrontendDbusClass *klass)
                           TABRMD_TRANSIENT_MAX,
                           TABRMD_TRANSIENT_MAX_DEFAULT,
                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_METRICS] =
+        g_param_spec_object ("metrics",
+                             "Metrics object",
+                             "Counters returned by the GetStats method.",
+                             TYPE_METRICS,
+                             G_PARAM_READWRITE);
     obj_properties [PROP_RANDOM] =
         g_param_spec_object ("random",
                              "Random object",
                              "Source of random numbers.",
                              TYPE_RANDOM,
                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_TPM_COUNT] =
+        g_param_spec_uint ("tpm-count",
+                           "number of TPMs",
+                           "Number of TPMs clients may connect to",
+                           1,
+                           TABRMD_TPMS_MAX,
+                           1,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
+    obj_properties [PROP_MAX_CHANNELS] =
+        g_param_spec_uint ("max-channels",
+                           "maximum channels",
+                           "Channels a client may open on a connection, 0 reports no support for them",
+                           0,
+                           TABRMD_CHANNELS_MAX,
+                           0,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
@@ -199,39 +305,93 @@ ipc_frontend_dbus_new (GBusType           bus_type,
 }
 /* TabrmdSkeleton signal handlers */
 /*
- * Give this function a dbus proxy and invocation object from a method
- * invocation and it will get the PID of the process associated with the
- * invocation. If an error occurs this function returns false.
+ * Give this function an invocation object from a method invocation and it
+ * will return the 'credential' of the process associated with the
+ * invocation through the 'value' out parameter. Credentials are cached by
+ * the caller's unique bus name, on a miss the dbus daemon is asked for it.
+ * If an error occurs this function returns false.
  */
 static gboolean
-get_pid_from_dbus_invocation (GDBusProxy            *proxy,
-                              GDBusMethodInvocation *invocation,
-                              guint32               *pid)
+get_credential_from_dbus_invocation (IpcFrontendDbus       *self,
+                                     GDBusMethodInvocation *invocation,
+                                     credential_t           credential,
+                                     guint32               *value)
 {
+    credential_cache_entry_t *entry;
+    const gchar *method = credential_methods [credential];
     const gchar *name   = NULL;
     GError      *error  = NULL;
     GVariant    *result = NULL;
 
-    if (proxy == NULL || invocation == NULL || pid == NULL)
+    if (self->dbus_daemon_proxy == NULL || invocation == NULL || value == NULL)
         return FALSE;
 
     name = g_dbus_method_invocation_get_sender (invocation);
-    result = g_dbus_proxy_call_sync (G_DBUS_PROXY (proxy),
-                                     "GetConnectionUnixProcessID",
+    if (name == NULL)
+        return FALSE;
+    g_mutex_lock (&self->setup_mutex);
+    entry = g_hash_table_lookup (self->credential_cache, name);
+    if (entry != NULL && entry->known [credential]) {
+        *value = entry->value [credential];
+        g_mutex_unlock (&self->setup_mutex);
+        return TRUE;
+    }
+    g_mutex_unlock (&self->setup_mutex);
+    /* not under the lock, this blocks on the dbus daemon */
+    result = g_dbus_proxy_call_sync (self->dbus_daemon_proxy,
+                                     method,
                                      g_variant_new("(s)", name),
                                      G_DBUS_CALL_FLAGS_NONE,
                                      -1,
                                      NULL,
                                      &error);
     if (error) {
-        g_warning ("Unable to get PID for %s: %s", name, error->message);
+        g_warning ("Unable to %s for %s: %s", method, name, error->message);
         g_error_free (error);
         return FALSE;
-    } else {
-        g_variant_get (result, "(u)", pid);
-        g_variant_unref (result);
-        return TRUE;
     }
+    g_variant_get (result, "(u)", value);
+    g_variant_unref (result);
+    g_mutex_lock (&self->setup_mutex);
+    entry = g_hash_table_lookup (self->credential_cache, name);
+    if (entry == NULL) {
+        if (g_hash_table_size (self->credential_cache) >= CREDENTIAL_CACHE_MAX) {
+            g_debug ("%s: credential cache full, clearing it", __func__);
+            g_hash_table_remove_all (self->credential_cache);
+        }
+        entry = g_new0 (credential_cache_entry_t, 1);
+        g_hash_table_insert (self->credential_cache, g_strdup (name), entry);
+    }
+    entry->value [credential] = *value;
+    entry->known [credential] = TRUE;
+    g_mutex_unlock (&self->setup_mutex);
+    return TRUE;
+}
+/*
+ * Get the PID of the process associated with the invocation.
+ */
+static gboolean
+get_pid_from_dbus_invocation (IpcFrontendDbus       *self,
+                              GDBusMethodInvocation *invocation,
+                              guint32               *pid)
+{
+    return get_credential_from_dbus_invocation (self,
+                                                invocation,
+                                                CREDENTIAL_PID,
+                                                pid);
+}
+/*
+ * Get the UID of the process associated with the invocation.
+ */
+static gboolean
+get_uid_from_dbus_invocation (IpcFrontendDbus       *self,
+                              GDBusMethodInvocation *invocation,
+                              guint32               *uid)
+{
+    return get_credential_from_dbus_invocation (self,
+                                                invocation,
+                                                CREDENTIAL_UID,
+                                                uid);
 }
 /*
  * Generate a random uint64 returned in the id out parameter.
@@ -252,7 +412,7 @@ generate_id_pid_mix_from_invocation (IpcFrontendDbus        *self,
     gboolean pid_ret = FALSE;
     guint32  pid = 0;
 
-    pid_ret = get_pid_from_dbus_invocation (self->dbus_daemon_proxy,
+    pid_ret = get_pid_from_dbus_invocation (self,
                                             invocation,
                                             &pid);
     if (pid_ret == TRUE) {
@@ -275,7 +435,7 @@ generate_id_pid_mix_from_invocation (IpcFrontendDbus        *self,
  * Returns FALSE on error, TRUE otherwise.
  */
 static gboolean
-get_id_pid_mix_from_invocation (GDBusProxy            *proxy,
+get_id_pid_mix_from_invocation (IpcFrontendDbus       *self,
                                 GDBusMethodInvocation *invocation,
                                 guint64                id,
                                 guint64               *id_pid_mix)
@@ -284,7 +444,7 @@ get_id_pid_mix_from_invocation (GDBusProxy            *proxy,
     gboolean pid_ret = FALSE;
 
     g_debug ("get_id_pid_mix_from_invocation");
-    pid_ret = get_pid_from_dbus_invocation (proxy,
+    pid_ret = get_pid_from_dbus_invocation (self,
                                             invocation,
                                             &pid);
     g_debug ("id 0x%" PRIx64 " pid: 0x%" PRIx32, id, pid);
@@ -302,35 +462,436 @@ get_id_pid_mix_from_invocation (GDBusProxy            *proxy,
     return pid_ret;
 }
 /*
- * This is a signal handler for the handle-create-connection signal from
- * the DBus interface. This signal is triggered by a request from a client
- * to create a new connection with the daemon. This requires a few things
- * be done:
+ * Idle callback refilling the socket pool once the D-Bus methods that
+ * took socket pairs from it have been answered.
+ */
+static gboolean
+socket_pool_refill_cb (gpointer user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+
+    g_mutex_lock (&self->setup_mutex);
+    self->socket_pool_source = 0;
+    socket_pool_fill (&self->socket_pool);
+    g_mutex_unlock (&self->setup_mutex);
+    return G_SOURCE_REMOVE;
+}
+/*
+ * Schedule a refill of the socket pool if there isn't one pending. The
+ * caller holds setup_mutex.
+ */
+static void
+socket_pool_schedule_refill (IpcFrontendDbus *self)
+{
+    if (self->socket_pool_source == 0 && self->socket_pool.size != 0) {
+        self->socket_pool_source = g_idle_add (socket_pool_refill_cb, self);
+    }
+}
+/*
+ * Create the server end of a connection over a socket of 'type'. Stream
+ * sockets are taken from the socket pool when it has any left.
+ */
+static GIOStream*
+create_connection_socket (IpcFrontendDbus *self,
+                          gint             type,
+                          gint            *client_fd)
+{
+    gboolean taken;
+    gint server_fd = -1;
+
+    g_mutex_lock (&self->setup_mutex);
+    taken = type == SOCK_STREAM &&
+        socket_pool_take (&self->socket_pool, client_fd, &server_fd);
+    socket_pool_schedule_refill (self);
+    g_mutex_unlock (&self->setup_mutex);
+    if (taken) {
+        return create_connection_iostream_fd (server_fd);
+    }
+    return create_connection_iostream_type (client_fd, type);
+}
+/*
+ * Create the Connection object for a new client connection with id
+ * 'id_pid_mix' over a socket of 'type'. The client side of the connection
+ * is returned through 'client_fd'.
+ */
+static Connection*
+create_connection_object (IpcFrontendDbus *self,
+                          guint64          id_pid_mix,
+                          gint             type,
+                          gint            *client_fd)
+{
+    HandleMap *handle_map;
+    Connection *connection;
+    GIOStream *iostream;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, self->max_transient_objects);
+    if (handle_map == NULL)
+        g_error ("Failed to allocate new HandleMap");
+    iostream = create_connection_socket (self, type, client_fd);
+    connection = connection_new (iostream, id_pid_mix, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    if (connection == NULL)
+        g_error ("Failed to allocate new connection.");
+
+    return connection;
+}
+/*
+ * A CreateConnection call being set up by a worker in setup_pool. The
+ * worker fills in 'connection' and 'fd_list' and then sets 'done'. If the
+ * setup fails the worker returns the error through 'invocation' and
+ * clears it.
+ */
+typedef struct {
+    IpcFrontendDbus       *self;
+    GDBusMethodInvocation *invocation;
+    guint                  tpm;
+    tabrmd_transport_t     transport;
+    gint64                 start;
+    guint64                id;
+    Connection            *connection;
+    GUnixFDList           *fd_list;
+    gint                   done;
+} connection_setup_t;
+
+static void
+connection_setup_free (connection_setup_t *setup)
+{
+    g_clear_object (&setup->connection);
+    g_clear_object (&setup->fd_list);
+    g_clear_object (&setup->self);
+    g_free (setup);
+}
+/*
+ * Take the CreateConnection calls that have been set up off the head of
+ * the setup queue, insert their Connections into the ConnectionManager and
+ * send the responses. Calls are answered in the order they came in: a call
+ * whose setup took longer holds up those behind it. Runs on the main loop
+ * thread.
+ */
+static gboolean
+create_connection_drain_cb (gpointer user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    connection_setup_t *setup;
+    GVariant *response, *response_tuple;
+    gint64 phase;
+    gint ret;
+
+    while ((setup = g_queue_peek_head (self->setup_queue)) != NULL &&
+           g_atomic_int_get (&setup->done))
+    {
+        g_queue_pop_head (self->setup_queue);
+        if (setup->invocation == NULL) {
+            /* error already returned to caller over dbus */
+        } else if (connection_manager_is_full (self->connection_manager)) {
+            g_dbus_method_invocation_return_error (
+                setup->invocation,
+                TABRMD_ERROR,
+                TABRMD_ERROR_MAX_CONNECTIONS,
+                "MAX_COMMANDS exceeded. Try again later.");
+        } else {
+            response = g_variant_new_uint64 (setup->id);
+            response_tuple = g_variant_new_tuple (&response, 1);
+            /*
+             * Issue the callback to notify subscribers that a new
+             * connection has been created.
+             */
+            phase = g_get_monotonic_time ();
+            ret = connection_manager_insert (self->connection_manager,
+                                             setup->connection);
+            metrics_observe (self->metrics,
+                             METRICS_CONNECT_INSERT_LATENCY,
+                             g_get_monotonic_time () - phase);
+            if (ret != 0) {
+                g_warning ("Failed to add new connection to connection_manager.");
+            }
+            /* send response */
+            g_dbus_method_invocation_return_value_with_unix_fd_list (
+                setup->invocation,
+                response_tuple,
+                setup->fd_list);
+            metrics_observe (self->metrics,
+                             METRICS_CONNECT_LATENCY,
+                             g_get_monotonic_time () - setup->start);
+        }
+        connection_setup_free (setup);
+    }
+    return G_SOURCE_REMOVE;
+}
+/*
+ * Set up a new connection with the daemon for a client that called one of
+ * the CreateConnection methods. The connection is served by the TPM with
+ * index 'tpm'. This is run by a worker in setup_pool so that the D-Bus
+ * calls to get the client's credentials and creating the sockets don't
+ * hold up the main loop. This requires a few things be done:
  * - Create a new ID (uint64) for the connection.
  * - Create a new Connection object.
- * - Build up a dbus response to the client with their connection ID and
- *   FD for the client side of the connection.
- * - Send the response message back to the client.
- * - Insert the new Connection object into the ConnectionManager.
+ * - With the shared memory transport, create the shared memory for the
+ *   connection.
+ * - Build up the FD list for the response to the client with the FD for
+ *   the client side of the connection, followed by the FD for the shared
+ *   memory if there is one.
+ * The Connection is inserted into the ConnectionManager and the response
+ * sent by create_connection_drain_cb back on the main loop thread.
+ */
+static void
+create_connection_setup (gpointer data,
+                         gpointer user_data)
+{
+    connection_setup_t *setup = (connection_setup_t*)data;
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    shm_transport_t *shm_transport = NULL;
+    gint client_fd = 0, type = SOCK_STREAM;
+    gint fds [2] = { -1, -1 };
+    guint64 id_pid_mix = 0;
+    guint32 uid = CONNECTION_UID_UNKNOWN, pid = 0;
+    gboolean id_ret = FALSE;
+    gint64 phase;
+
+    phase = g_get_monotonic_time ();
+    id_ret = generate_id_pid_mix_from_invocation (self,
+                                                  setup->invocation,
+                                                  &setup->id,
+                                                  &id_pid_mix);
+    metrics_observe (self->metrics,
+                     METRICS_CONNECT_PID_LATENCY,
+                     g_get_monotonic_time () - phase);
+    /* error already returned to caller over dbus */
+    if (id_ret == FALSE) {
+        setup->invocation = NULL;
+        goto out;
+    }
+    g_debug ("Creating connection with id: 0x%" PRIx64, id_pid_mix);
+    if (connection_manager_contains_id (self->connection_manager,
+                                        id_pid_mix)) {
+        g_warning ("ID collision in ConnectionManager: %" PRIu64, id_pid_mix);
+        g_dbus_method_invocation_return_error (
+            setup->invocation,
+            TABRMD_ERROR,
+            TABRMD_ERROR_ID_GENERATION,
+            "Failed to allocate connection ID. Try again later.");
+        setup->invocation = NULL;
+        goto out;
+    }
+    if (setup->transport == TABRMD_TRANSPORT_SHM) {
+        shm_transport = shm_transport_create (&fds [1]);
+        if (shm_transport == NULL) {
+            g_dbus_method_invocation_return_error (
+                setup->invocation,
+                TABRMD_ERROR,
+                TABRMD_ERROR_NOT_IMPLEMENTED,
+                "Shared memory transport not available.");
+            setup->invocation = NULL;
+            goto out;
+        }
+    }
+    if (setup->transport == TABRMD_TRANSPORT_SEQPACKET) {
+        type = SOCK_SEQPACKET;
+    }
+    setup->connection = create_connection_object (self,
+                                                  id_pid_mix,
+                                                  type,
+                                                  &client_fd);
+    /* the UID is only used for scheduling so failure isn't fatal */
+    if (get_uid_from_dbus_invocation (self,
+                                      setup->invocation,
+                                      &uid)) {
+        connection_set_uid (setup->connection, uid);
+    }
+    /* cached by generate_id_pid_mix_from_invocation */
+    if (get_pid_from_dbus_invocation (self, setup->invocation, &pid)) {
+        connection_set_pid (setup->connection, pid);
+    }
+    connection_set_tpm (setup->connection, setup->tpm);
+    connection_set_shm (setup->connection, shm_transport);
+    connection_set_tagged (setup->connection,
+                           setup->transport == TABRMD_TRANSPORT_TAGGED);
+    connection_set_seqpacket (setup->connection,
+                              setup->transport == TABRMD_TRANSPORT_SEQPACKET);
+    g_debug ("Created connection with client FD: %d and id: 0x%" PRIx64
+             " on TPM %u", client_fd, id_pid_mix, setup->tpm);
+    /* the fd list for the response message takes the fds */
+    fds [0] = client_fd;
+    setup->fd_list = g_unix_fd_list_new_from_array (fds,
+                                                    shm_transport != NULL ? 2 : 1);
+out:
+    g_atomic_int_set (&setup->done, TRUE);
+    g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                     create_connection_drain_cb,
+                     g_object_ref (self),
+                     g_object_unref);
+}
+/*
+ * Create a new connection with the daemon for a client that called one of
+ * the CreateConnection methods. The checks that don't block are done here,
+ * the rest of the setup is handed to a worker in setup_pool, see
+ * create_connection_setup. The call is answered once the worker is done.
+ */
+static gboolean
+create_connection (IpcFrontendDbus       *self,
+                   GDBusMethodInvocation *invocation,
+                   guint                  tpm,
+                   tabrmd_transport_t     transport)
+{
+    connection_setup_t *setup;
+
+    if (tpm >= self->tpm_count) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_PERMITTED,
+                                               "No such TPM.");
+        return TRUE;
+    }
+    if (connection_manager_is_full (self->connection_manager)) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_MAX_CONNECTIONS,
+                                               "MAX_COMMANDS exceeded. Try again later.");
+        return TRUE;
+    }
+    setup = g_new0 (connection_setup_t, 1);
+    /* released by create_connection_drain_cb */
+    setup->self = g_object_ref (self);
+    setup->invocation = invocation;
+    setup->tpm = tpm;
+    setup->transport = transport;
+    setup->start = g_get_monotonic_time ();
+    g_queue_push_tail (self->setup_queue, setup);
+    g_thread_pool_push (self->setup_pool, setup, NULL);
+
+    return TRUE;
+}
+/*
+ * Handler for the CreateConnection method: the connection is served by
+ * the first TPM.
  */
 static gboolean
 on_handle_create_connection (TctiTabrmd            *skeleton,
                              GDBusMethodInvocation *invocation,
                              gpointer               user_data)
 {
-    IpcFrontendDbus *self = NULL;
-    HandleMap   *handle_map = NULL;
-    Connection *connection = NULL;
-    gint client_fd = 0, ret = 0;
-    GIOStream *iostream;
-    GVariant *response, *response_tuple;
-    GUnixFDList *fd_list = NULL;
-    guint64 id = 0, id_pid_mix = 0;
-    gboolean id_ret = FALSE;
     UNUSED_PARAM(skeleton);
 
-    self = IPC_FRONTEND_DBUS (user_data);
-    ipc_frontend_init_guard (IPC_FRONTEND (user_data));
+    return create_connection (IPC_FRONTEND_DBUS (user_data),
+                              invocation,
+                              0,
+                              TABRMD_TRANSPORT_SOCKET);
+}
+/*
+ * Handler for the CreateConnectionOnTpm method: the client picks the TPM
+ * that serves the connection by its index in the daemon's TCTI options.
+ */
+static gboolean
+on_handle_create_connection_on_tpm (TctiTabrmd            *skeleton,
+                                    GDBusMethodInvocation *invocation,
+                                    guint                  tpm,
+                                    gpointer               user_data)
+{
+    UNUSED_PARAM(skeleton);
+
+    return create_connection (IPC_FRONTEND_DBUS (user_data),
+                              invocation,
+                              tpm,
+                              TABRMD_TRANSPORT_SOCKET);
+}
+/*
+ * Handler for the CreateConnectionShm method: like CreateConnectionOnTpm
+ * but commands and responses are exchanged through shared memory.
+ */
+static gboolean
+on_handle_create_connection_shm (TctiTabrmd            *skeleton,
+                                 GDBusMethodInvocation *invocation,
+                                 guint                  tpm,
+                                 gpointer               user_data)
+{
+    UNUSED_PARAM(skeleton);
+
+    return create_connection (IPC_FRONTEND_DBUS (user_data),
+                              invocation,
+                              tpm,
+                              TABRMD_TRANSPORT_SHM);
+}
+/*
+ * Handler for the CreateConnectionTagged method: like CreateConnectionOnTpm
+ * but each command and response is preceded by a request tag so that the
+ * client can have more than one command in flight.
+ */
+static gboolean
+on_handle_create_connection_tagged (TctiTabrmd            *skeleton,
+                                    GDBusMethodInvocation *invocation,
+                                    guint                  tpm,
+                                    gpointer               user_data)
+{
+    UNUSED_PARAM(skeleton);
+
+    return create_connection (IPC_FRONTEND_DBUS (user_data),
+                              invocation,
+                              tpm,
+                              TABRMD_TRANSPORT_TAGGED);
+}
+/*
+ * Handler for the CreateConnectionSeqpacket method: like
+ * CreateConnectionOnTpm over a SOCK_SEQPACKET socket so that each command
+ * and response is read in one go.
+ */
+static gboolean
+on_handle_create_connection_seqpacket (TctiTabrmd            *skeleton,
+                                       GDBusMethodInvocation *invocation,
+                                       guint                  tpm,
+                                       gpointer               user_data)
+{
+    UNUSED_PARAM(skeleton);
+
+    return create_connection (IPC_FRONTEND_DBUS (user_data),
+                              invocation,
+                              tpm,
+                              TABRMD_TRANSPORT_SEQPACKET);
+}
+/*
+ * Handler for the CreateConnections method: create up to 'count'
+ * connections on TPM 'tpm' in one round trip. Clients use this to keep a
+ * pool of idle connections so that initializing a TCTI context doesn't
+ * cost a D-Bus call and the caller's credential lookups each time. Fewer
+ * connections than requested are returned when the ConnectionManager
+ * fills up. The response holds the connection IDs and the FD for each
+ * connection, in the same order.
+ */
+static gboolean
+on_handle_create_connections (TctiTabrmd            *skeleton,
+                              GDBusMethodInvocation *invocation,
+                              guint                  tpm,
+                              guint                  count,
+                              gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    Connection *connection;
+    GVariantBuilder builder;
+    GUnixFDList *fd_list;
+    GError *error = NULL;
+    guint64 id, id_pid_mix;
+    guint32 pid = 0, uid = CONNECTION_UID_UNKNOWN;
+    gboolean have_uid;
+    gint client_fd = 0;
+    guint i, created = 0;
+
+    UNUSED_PARAM(skeleton);
+
+    if (tpm >= self->tpm_count) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_PERMITTED,
+                                               "No such TPM.");
+        return TRUE;
+    }
+    if (count == 0 || count > TABRMD_CREATE_CONNECTIONS_MAX) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_PERMITTED,
+                                               "Connection count must be between 1 and %u.",
+                                               TABRMD_CREATE_CONNECTIONS_MAX);
+        return TRUE;
+    }
     if (connection_manager_is_full (self->connection_manager)) {
         g_dbus_method_invocation_return_error (invocation,
                                                TABRMD_ERROR,
@@ -338,18 +899,64 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
                                                "MAX_COMMANDS exceeded. Try again later.");
         return TRUE;
     }
-    id_ret = generate_id_pid_mix_from_invocation (self,
-                                                  invocation,
-                                                  &id,
-                                                  &id_pid_mix);
-    /* error already returned to caller over dbus */
-    if (id_ret == FALSE) {
+    if (!get_pid_from_dbus_invocation (self,
+                                       invocation,
+                                       &pid)) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_INTERNAL,
+                                               "Failed to get client PID");
         return TRUE;
     }
-    g_debug ("Creating connection with id: 0x%" PRIx64, id_pid_mix);
-    if (connection_manager_contains_id (self->connection_manager,
-                                        id_pid_mix)) {
-        g_warning ("ID collision in ConnectionManager: %" PRIu64, id_pid_mix);
+    have_uid = get_uid_from_dbus_invocation (self,
+                                             invocation,
+                                             &uid);
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("at"));
+    fd_list = g_unix_fd_list_new ();
+    for (i = 0;
+         i < count && !connection_manager_is_full (self->connection_manager);
+         ++i)
+    {
+        id = random_get_uint64 (self->random);
+        id_pid_mix = id ^ pid;
+        if (connection_manager_contains_id (self->connection_manager,
+                                            id_pid_mix)) {
+            g_warning ("ID collision in ConnectionManager: %" PRIu64,
+                       id_pid_mix);
+            continue;
+        }
+        connection = create_connection_object (self,
+                                               id_pid_mix,
+                                               SOCK_STREAM,
+                                               &client_fd);
+        /* the fd list keeps a duplicate of the client FD */
+        if (g_unix_fd_list_append (fd_list, client_fd, &error) == -1) {
+            g_warning ("Failed to add client FD to response: %s",
+                       error->message);
+            g_clear_error (&error);
+            close (client_fd);
+            g_object_unref (connection);
+            break;
+        }
+        close (client_fd);
+        if (have_uid) {
+            connection_set_uid (connection, uid);
+        }
+        connection_set_pid (connection, pid);
+        connection_set_tpm (connection, tpm);
+        g_debug ("Created connection with id: 0x%" PRIx64 " on TPM %u",
+                 id_pid_mix, tpm);
+        if (connection_manager_insert (self->connection_manager,
+                                       connection) != 0) {
+            g_warning ("Failed to add new connection to connection_manager.");
+        }
+        g_object_unref (connection);
+        g_variant_builder_add (&builder, "t", id);
+        ++created;
+    }
+    if (created == 0) {
+        g_variant_builder_clear (&builder);
+        g_object_unref (fd_list);
         g_dbus_method_invocation_return_error (
             invocation,
             TABRMD_ERROR,
@@ -357,36 +964,11 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
             "Failed to allocate connection ID. Try again later.");
         return TRUE;
     }
-    handle_map = handle_map_new (TPM2_HT_TRANSIENT, self->max_transient_objects);
-    if (handle_map == NULL)
-        g_error ("Failed to allocate new HandleMap");
-    iostream = create_connection_iostream (&client_fd);
-    connection = connection_new (iostream, id_pid_mix, handle_map);
-    g_object_unref (handle_map);
-    g_object_unref (iostream);
-    if (connection == NULL)
-        g_error ("Failed to allocate new connection.");
-    g_debug ("Created connection with client FD: %d and id: 0x%" PRIx64,
-             client_fd, id_pid_mix);
-    /* prepare tuple variant for response message */
-    fd_list = g_unix_fd_list_new_from_array (&client_fd, 1);
-    response = g_variant_new_uint64 (id);
-    response_tuple = g_variant_new_tuple (&response, 1);
-    /*
-     * Issue the callback to notify subscribers that a new connection has
-     * been created.
-     */
-    ret = connection_manager_insert (self->connection_manager, connection);
-    if (ret != 0) {
-        g_warning ("Failed to add new connection to connection_manager.");
-    }
-    /* send response */
     g_dbus_method_invocation_return_value_with_unix_fd_list (
         invocation,
-        response_tuple,
+        g_variant_new ("(at)", &builder),
         fd_list);
     g_object_unref (fd_list);
-    g_object_unref (connection);
 
     return TRUE;
 }
@@ -402,8 +984,9 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
  *   removed from the processing queue.
  * - If the connection has a command being processed by the TPM then the
  *   request to cancel the command will be sent down to the TPM.
- * - If the connection has no commands outstanding then an error is
- *   returned.
+ * The work is done by whoever handles the 'cancel' signal from the
+ * IpcFrontend. The TSS2_RC from the handler is returned to the client.
+ * Canceled commands are answered with TPM2_RC_CANCELED.
  */
 static gboolean
 on_handle_cancel (TctiTabrmd            *skeleton,
@@ -415,11 +998,11 @@ on_handle_cancel (TctiTabrmd            *skeleton,
     Connection *connection = NULL;
     guint64   id_pid_mix = 0;
     gboolean mix_ret = FALSE;
-    UNUSED_PARAM(skeleton);
+    TSS2_RC rc;
 
     g_info ("on_handle_cancel for id 0x%" PRIx64, id);
     ipc_frontend_init_guard (IPC_FRONTEND (self));
-    mix_ret = get_id_pid_mix_from_invocation (self->dbus_daemon_proxy,
+    mix_ret = get_id_pid_mix_from_invocation (self,
                                               invocation,
                                               id,
                                               &id_pid_mix);
@@ -440,11 +1023,55 @@ on_handle_cancel (TctiTabrmd            *skeleton,
     }
     g_info ("%s: canceling command for connection with id_pid_mix: 0x%" PRIx64,
             __func__, id_pid_mix);
-    /* cancel any existing commands for the connection */
-    g_dbus_method_invocation_return_error (invocation,
-                                           TABRMD_ERROR,
-                                           TABRMD_ERROR_NOT_IMPLEMENTED,
-                                           "Cancel function not implemented.");
+    rc = ipc_frontend_cancel_invoke (IPC_FRONTEND (self), connection);
+    tcti_tabrmd_complete_cancel (skeleton, invocation, rc);
+    g_object_unref (connection);
+
+    return TRUE;
+}
+/*
+ * Handler for the Lease method: give the connection with 'id' a lease on
+ * its TPM for up to 'commands' commands or 'timeout' milliseconds, or end
+ * its lease if 'commands' is 0. The work is done by whoever handles the
+ * 'lease' signal from the IpcFrontend. The TSS2_RC from the handler is
+ * returned to the client.
+ */
+static gboolean
+on_handle_lease (TctiTabrmd            *skeleton,
+                 GDBusMethodInvocation *invocation,
+                 gint64                 id,
+                 guint                  commands,
+                 guint                  timeout,
+                 gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    Connection *connection = NULL;
+    guint64   id_pid_mix = 0;
+    TSS2_RC rc;
+
+    g_info ("%s: id 0x%" PRIx64 ", %u commands, timeout %u ms",
+            __func__, id, commands, timeout);
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    /* error already sent over dbus */
+    if (!get_id_pid_mix_from_invocation (self, invocation, id, &id_pid_mix)) {
+        return TRUE;
+    }
+    connection = connection_manager_lookup_id (self->connection_manager,
+                                               id_pid_mix);
+    if (connection == NULL) {
+        g_warning ("%s: no active connection for id_pid_mix: 0x%" PRIx64,
+                   __func__, id_pid_mix);
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_PERMITTED,
+                                               "No connection.");
+        return TRUE;
+    }
+    rc = ipc_frontend_lease_invoke (IPC_FRONTEND (self),
+                                    connection,
+                                    commands,
+                                    timeout);
+    tcti_tabrmd_complete_lease (skeleton, invocation, rc);
     g_object_unref (connection);
 
     return TRUE;
@@ -455,6 +1082,7 @@ on_handle_cancel (TctiTabrmd            *skeleton,
  * from a client to set the locality for TPM commands associated with the
  * connection (the 'id' parameter). This requires a few things be done:
  * - Find the Connection object associated with the 'id' parameter.
+ * - Check the client may use the locality.
  * - Set the locality for the Connection object.
  * - Pass result of the operation back to the user.
  */
@@ -469,11 +1097,10 @@ on_handle_set_locality (TctiTabrmd            *skeleton,
     Connection *connection = NULL;
     guint64   id_pid_mix = 0;
     gboolean mix_ret = FALSE;
-    UNUSED_PARAM(skeleton);
 
     g_info ("on_handle_set_locality for id 0x%" PRIx64, id);
     ipc_frontend_init_guard (IPC_FRONTEND (self));
-    mix_ret = get_id_pid_mix_from_invocation (self->dbus_daemon_proxy,
+    mix_ret = get_id_pid_mix_from_invocation (self,
                                               invocation,
                                               id,
                                               &id_pid_mix);
@@ -491,15 +1118,182 @@ on_handle_set_locality (TctiTabrmd            *skeleton,
                                                "No connection.");
         return TRUE;
     }
-    /* set locality for an existing connection */
-    g_dbus_method_invocation_return_error (invocation,
-                                           TABRMD_ERROR,
-                                           TABRMD_ERROR_NOT_IMPLEMENTED,
-                                           "setLocality function not implemented.");
+    if (!connection_locality_permitted (connection, locality)) {
+        g_warning ("%s: locality %" PRIu8 " not permitted for connection "
+                   "0x%" PRIx64, __func__, locality, connection->id);
+        tcti_tabrmd_complete_set_locality (skeleton,
+                                           invocation,
+                                           TSS2_RESMGR_RC_NOT_PERMITTED);
+        g_object_unref (connection);
+        return TRUE;
+    }
+    /* the TCTI is switched when the connection's next command is sent */
+    connection_set_locality (connection, locality);
+    tcti_tabrmd_complete_set_locality (skeleton, invocation, TSS2_RC_SUCCESS);
     g_object_unref (connection);
 
     return TRUE;
 }
+/*
+ * Handler for the Tune method: change parameters of the daemon without a
+ * restart. Only root may call it. The parameters are all checked before
+ * any is applied, the work is done by whoever handles the 'tune' signal
+ * from the IpcFrontend. The TSS2_RC from the handler is returned to the
+ * client.
+ */
+static gboolean
+on_handle_tune (TctiTabrmd            *skeleton,
+                GDBusMethodInvocation *invocation,
+                GVariant              *parameters,
+                gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    Tunables *tunables;
+    GError *error = NULL;
+    guint32 uid;
+    TSS2_RC rc;
+
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    if (!get_uid_from_dbus_invocation (self, invocation, &uid)) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_INTERNAL,
+                                               "Failed to get client UID");
+        return TRUE;
+    }
+    if (uid != 0) {
+        g_warning ("%s: refused for UID %" PRIu32, __func__, uid);
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_PERMITTED,
+                                               "Only root may tune the daemon.");
+        return TRUE;
+    }
+    tunables = tunables_new_from_variant (parameters, &error);
+    if (tunables == NULL) {
+        g_warning ("%s: %s", __func__, error->message);
+        g_dbus_method_invocation_return_error_literal (invocation,
+                                                       TABRMD_ERROR,
+                                                       TABRMD_ERROR_BAD_VALUE,
+                                                       error->message);
+        g_error_free (error);
+        return TRUE;
+    }
+    rc = ipc_frontend_tune_invoke (IPC_FRONTEND (self), tunables);
+    tcti_tabrmd_complete_tune (skeleton, invocation, rc);
+    g_object_unref (tunables);
+    return TRUE;
+}
+/*
+ * Handler for the GetStats method: return the daemon wide counters kept
+ * by the Metrics object.
+ */
+static gboolean
+on_handle_get_stats (TctiTabrmd            *skeleton,
+                     GDBusMethodInvocation *invocation,
+                     gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    if (self->metrics == NULL) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_IMPLEMENTED,
+                                               "No statistics.");
+        return TRUE;
+    }
+    tcti_tabrmd_complete_get_stats (skeleton,
+                                    invocation,
+                                    metrics_get_stats (self->metrics));
+    return TRUE;
+}
+typedef struct {
+    guint32          uid;
+    GVariantBuilder *builder;
+} connection_stats_data_t;
+
+static void
+connection_stats_callback (gpointer data,
+                           gpointer user_data)
+{
+    Connection *connection = CONNECTION (data);
+    connection_stats_data_t *stats_data = (connection_stats_data_t*)user_data;
+
+    if (stats_data->uid != 0 &&
+        stats_data->uid != connection_get_uid (connection))
+    {
+        return;
+    }
+    g_variant_builder_add (stats_data->builder,
+                           "{t@a{sv}}",
+                           connection->id,
+                           connection_get_stats (connection));
+}
+/*
+ * Handler for the GetConnectionStats method: return the figures kept for
+ * each connection keyed by connection ID. Callers other than root only
+ * see the connections made by their own user.
+ */
+static gboolean
+on_handle_get_connection_stats (TctiTabrmd            *skeleton,
+                                GDBusMethodInvocation *invocation,
+                                gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    GVariantBuilder builder;
+    connection_stats_data_t stats_data = { .builder = &builder };
+
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    if (!get_uid_from_dbus_invocation (self, invocation, &stats_data.uid)) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_INTERNAL,
+                                               "Failed to get client UID");
+        return TRUE;
+    }
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{ta{sv}}"));
+    connection_manager_foreach (self->connection_manager,
+                                connection_stats_callback,
+                                &stats_data);
+    tcti_tabrmd_complete_get_connection_stats (skeleton,
+                                               invocation,
+                                               g_variant_builder_end (&builder));
+    return TRUE;
+}
+/*
+ * Handler for the DumpFlightRecorder method: return the last pipeline
+ * events. They hold the connection IDs and command codes of every user,
+ * so only root may get them.
+ */
+static gboolean
+on_handle_dump_flight_recorder (TctiTabrmd            *skeleton,
+                                GDBusMethodInvocation *invocation,
+                                gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    guint32 uid;
+
+    if (!get_uid_from_dbus_invocation (self, invocation, &uid)) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_INTERNAL,
+                                               "Failed to get client UID");
+        return TRUE;
+    }
+    if (uid != 0) {
+        g_warning ("%s: refused for UID %" PRIu32, __func__, uid);
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_PERMITTED,
+                                               "Only root may dump the flight recorder.");
+        return TRUE;
+    }
+    tcti_tabrmd_complete_dump_flight_recorder (skeleton,
+                                               invocation,
+                                               flight_recorder_to_variant ());
+    return TRUE;
+}
 /* D-Bus signal handlers */
 /*
  * This is a signal handler of type GBusAcquiredCallback. It is registered
@@ -521,8 +1315,9 @@ on_bus_acquired (GDBusConnection *connection,
  * 'name' is acquired on the requested bus. It does 3 things:
  * - Obtains a new TctiTabrmd instance and stores a reference in
  *   the 'user_data' parameter (which is a reference to the gmain_data_t.
- * - Register signal handlers for the CreateConnection, Cancel and
- *   SetLocality signals.
+ * - Register signal handlers for the CreateConnection, Cancel, Lease,
+ *   SetLocality, Tune, GetStats, GetConnectionStats and
+ *   DumpFlightRecorder signals.
  * - Export the TctiTabrmd interface (skeleton) on the DBus
  *   connection.
  */
@@ -541,18 +1336,64 @@ on_name_acquired (GDBusConnection *connection,
     self = IPC_FRONTEND_DBUS (user_data);
     if (self->skeleton == NULL)
         self->skeleton = tcti_tabrmd_skeleton_new ();
+    tcti_tabrmd_set_features (self->skeleton,
+                              TABRMD_FEATURE_CONTROL |
+                              TABRMD_FEATURE_TIMEOUT |
+                              TABRMD_FEATURE_TRACE_CONTEXT |
+                              (self->max_channels > 0 ?
+                               TABRMD_FEATURE_CHANNELS : 0));
     g_signal_connect (self->skeleton,
                       "handle-create-connection",
                       G_CALLBACK (on_handle_create_connection),
                       user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-create-connection-on-tpm",
+                      G_CALLBACK (on_handle_create_connection_on_tpm),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-create-connection-shm",
+                      G_CALLBACK (on_handle_create_connection_shm),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-create-connection-tagged",
+                      G_CALLBACK (on_handle_create_connection_tagged),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-create-connection-seqpacket",
+                      G_CALLBACK (on_handle_create_connection_seqpacket),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-create-connections",
+                      G_CALLBACK (on_handle_create_connections),
+                      user_data);
     g_signal_connect (self->skeleton,
                       "handle-cancel",
                       G_CALLBACK (on_handle_cancel),
                       user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-lease",
+                      G_CALLBACK (on_handle_lease),
+                      user_data);
     g_signal_connect (self->skeleton,
                       "handle-set-locality",
                       G_CALLBACK (on_handle_set_locality),
                       user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-tune",
+                      G_CALLBACK (on_handle_tune),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-get-stats",
+                      G_CALLBACK (on_handle_get_stats),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-get-connection-stats",
+                      G_CALLBACK (on_handle_get_connection_stats),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-dump-flight-recorder",
+                      G_CALLBACK (on_handle_dump_flight_recorder),
+                      user_data);
     ret = g_dbus_interface_skeleton_export (
         G_DBUS_INTERFACE_SKELETON (self->skeleton),
         connection,
@@ -589,6 +1430,36 @@ on_name_lost (GDBusConnection *connection,
 
     ipc_frontend_disconnected_invoke (ipc_frontend);
 }
+/*
+ * Handler for signals from the dbus daemon. When NameOwnerChanged reports
+ * that a name has gone away any credentials cached for it are dropped.
+ */
+static void
+on_dbus_daemon_signal (GDBusProxy *proxy,
+                       gchar      *sender_name,
+                       gchar      *signal_name,
+                       GVariant   *parameters,
+                       gpointer    user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    const gchar *name, *old_owner, *new_owner;
+    UNUSED_PARAM(proxy);
+    UNUSED_PARAM(sender_name);
+
+    if (strcmp (signal_name, "NameOwnerChanged") != 0 ||
+        !g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(sss)")))
+    {
+        return;
+    }
+    g_variant_get (parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+    if (new_owner [0] == '\0') {
+        g_mutex_lock (&self->setup_mutex);
+        if (g_hash_table_remove (self->credential_cache, name)) {
+            g_debug ("%s: dropped cached credentials for %s", __func__, name);
+        }
+        g_mutex_unlock (&self->setup_mutex);
+    }
+}
 /*
  * Callback handling the acquisition of a GDBusProxy object for communication
  * with the well known org.freedesktop.DBus object. This is an object exposed
@@ -609,6 +1480,11 @@ on_get_dbus_daemon_proxy (GObject      *source_object,
                    "(org.freedesktop.DBus): %s", error->message);
         g_error_free (error);
         self->dbus_daemon_proxy = NULL;
+    } else {
+        g_signal_connect (self->dbus_daemon_proxy,
+                          "g-signal",
+                          G_CALLBACK (on_dbus_daemon_signal),
+                          self);
     }
     g_debug ("Got proxy object for DBus daemon.");
 
@@ -638,6 +1514,9 @@ ipc_frontend_dbus_connect (IpcFrontendDbus *self,
     g_return_if_fail (IS_IPC_FRONTEND_DBUS (self));
 
     frontend->init_mutex = init_mutex;
+    g_mutex_lock (&self->setup_mutex);
+    socket_pool_schedule_refill (self);
+    g_mutex_unlock (&self->setup_mutex);
     g_dbus_proxy_new_for_bus (self->bus_type,
                               G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
                               NULL,
@@ -10,14 +10,18 @@
 #include <gio/gio.h>
 
 #include "connection-manager.h"
+#include "metrics.h"
 #include "ipc-frontend.h"
 #include "random.h"
+#include "socket-pool.h"
 #include "tabrmd-generated.h"
 
 G_BEGIN_DECLS
 
 #define IPC_FRONTEND_DBUS_NAME_DEFAULT "com.intel.tss2.Tabrmd"
 #define IPC_FRONTEND_DBUS_TYPE_DEFAULT G_BUS_TYPE_SYSTEM
+/* workers setting up CreateConnection calls off the main loop */
+#define IPC_FRONTEND_DBUS_SETUP_THREADS 4
 
 typedef struct _IpcFrontendDbusClass {
    IpcFrontendClass     parent;
@@ -33,10 +37,31 @@ typedef struct _IpcFrontendDbus
     gboolean           dbus_name_acquired;
     guint              dbus_name_owner_id;
     guint              max_transient_objects;
+    guint              tpm_count;
+    /* channels a client may open on a connection, see TABRMD_FEATURE_CHANNELS */
+    guint              max_channels;
     ConnectionManager *connection_manager;
     GDBusProxy        *dbus_daemon_proxy;
+    /* unique bus name -> credential_cache_entry_t */
+    GHashTable        *credential_cache;
     Random            *random;
+    /* counters returned by GetStats, NULL until set */
+    Metrics           *metrics;
     TctiTabrmd        *skeleton;
+    /* stream socket pairs made ahead of CreateConnection calls */
+    socket_pool_t      socket_pool;
+    /* idle source refilling socket_pool, 0 if none */
+    guint              socket_pool_source;
+    /*
+     * CreateConnection calls are set up by the workers in setup_pool.
+     * setup_queue holds the calls in the order they came in, it's only
+     * used from the main loop thread. setup_mutex guards what the
+     * workers share with it: credential_cache, socket_pool and
+     * socket_pool_source.
+     */
+    GThreadPool       *setup_pool;
+    GQueue            *setup_queue;
+    GMutex             setup_mutex;
 } IpcFrontendDbus;
 
 #define TYPE_IPC_FRONTEND_DBUS             (ipc_frontend_dbus_get_type       ())
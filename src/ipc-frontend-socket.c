@@ -0,0 +1,619 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fd-store.h"
+#include "ipc-frontend-socket.h"
+#include "socket-protocol.h"
+#include "tabrmd-defaults.h"
+#include "tabrmd.h"
+#include "util.h"
+
+G_DEFINE_TYPE (IpcFrontendSocket, ipc_frontend_socket, TYPE_IPC_FRONTEND);
+
+enum {
+    PROP_0,
+    PROP_ADDRESS,
+    PROP_CONNECTION_MANAGER,
+    PROP_MAX_TRANS,
+    PROP_RANDOM,
+    PROP_TPM_COUNT,
+    PROP_MAX_CHANNELS,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties[N_PROPERTIES] = { NULL };
+
+/*
+ * A request being read from a newly accepted socket.
+ */
+typedef struct {
+    IpcFrontendSocket         *self;
+    GSocketConnection         *connection;
+    socket_protocol_request_t  request;
+} ipc_frontend_socket_request_t;
+
+static void
+ipc_frontend_socket_set_property (GObject      *object,
+                                  guint         property_id,
+                                  const GValue *value,
+                                  GParamSpec   *pspec)
+{
+    IpcFrontendSocket *self = IPC_FRONTEND_SOCKET (object);
+
+    switch (property_id) {
+    case PROP_ADDRESS:
+        self->address = g_value_dup_string (value);
+        g_debug ("IpcFrontendSocket set address: %s", self->address);
+        break;
+    case PROP_CONNECTION_MANAGER:
+        self->connection_manager = g_value_get_object (value);
+        g_object_ref (self->connection_manager);
+        break;
+    case PROP_MAX_TRANS:
+        self->max_transient_objects = g_value_get_uint (value);
+        break;
+    case PROP_RANDOM:
+        self->random = g_value_get_object (value);
+        g_object_ref (self->random);
+        break;
+    case PROP_TPM_COUNT:
+        self->tpm_count = g_value_get_uint (value);
+        break;
+    case PROP_MAX_CHANNELS:
+        self->max_channels = g_value_get_uint (value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+ipc_frontend_socket_get_property (GObject    *object,
+                                  guint       property_id,
+                                  GValue     *value,
+                                  GParamSpec *pspec)
+{
+    IpcFrontendSocket *self = IPC_FRONTEND_SOCKET (object);
+
+    switch (property_id) {
+    case PROP_ADDRESS:
+        g_value_set_string (value, self->address);
+        break;
+    case PROP_CONNECTION_MANAGER:
+        g_value_set_object (value, self->connection_manager);
+        break;
+    case PROP_MAX_TRANS:
+        g_value_set_uint (value, self->max_transient_objects);
+        break;
+    case PROP_RANDOM:
+        g_value_set_object (value, self->random);
+        break;
+    case PROP_TPM_COUNT:
+        g_value_set_uint (value, self->tpm_count);
+        break;
+    case PROP_MAX_CHANNELS:
+        g_value_set_uint (value, self->max_channels);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+ipc_frontend_socket_init (IpcFrontendSocket *self)
+{
+    UNUSED_PARAM (self);
+}
+/*
+ * Dispose method where where we free up references to other objects.
+ */
+static void
+ipc_frontend_socket_dispose (GObject *obj)
+{
+    IpcFrontendSocket *self = IPC_FRONTEND_SOCKET (obj);
+
+    ipc_frontend_socket_disconnect (self);
+    g_clear_object (&self->connection_manager);
+    g_clear_object (&self->random);
+    G_OBJECT_CLASS (ipc_frontend_socket_parent_class)->dispose (obj);
+}
+/*
+ * Finalize method where we free resources.
+ */
+static void
+ipc_frontend_socket_finalize (GObject *obj)
+{
+    IpcFrontendSocket *self = IPC_FRONTEND_SOCKET (obj);
+
+    g_clear_pointer (&self->address, g_free);
+    G_OBJECT_CLASS (ipc_frontend_socket_parent_class)->finalize (obj);
+}
+
+static void
+ipc_frontend_socket_class_init (IpcFrontendSocketClass *klass)
+{
+    GObjectClass    *object_class      = G_OBJECT_CLASS (klass);
+    IpcFrontendClass *ipc_frontend_class = IPC_FRONTEND_CLASS (klass);
+
+    if (ipc_frontend_socket_parent_class == NULL)
+        ipc_frontend_socket_parent_class = g_type_class_peek_parent (klass);
+    /* GObject functions */
+    object_class->dispose      = ipc_frontend_socket_dispose;
+    object_class->finalize     = ipc_frontend_socket_finalize;
+    object_class->get_property = ipc_frontend_socket_get_property;
+    object_class->set_property = ipc_frontend_socket_set_property;
+    /* IpcFrontend functions */
+    ipc_frontend_class->connect    = (IpcFrontendConnect)ipc_frontend_socket_connect;
+    ipc_frontend_class->disconnect = (IpcFrontendDisconnect)ipc_frontend_socket_disconnect;
+    obj_properties [PROP_ADDRESS] =
+        g_param_spec_string ("address",
+                             "Socket address",
+                             "Path of the UNIX socket, or its name in the abstract namespace prefixed with '@'",
+                             NULL,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_CONNECTION_MANAGER] =
+        g_param_spec_object ("connection-manager",
+                             "ConnectionManager object",
+                             "ConnectionManager object for connection",
+                             TYPE_CONNECTION_MANAGER,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_MAX_TRANS] =
+        g_param_spec_uint ("max-trans",
+                          "maximum transient objects",
+                          "maximum number of transient objects for the handle map",
+                          1,
+                          TABRMD_TRANSIENT_MAX,
+                          TABRMD_TRANSIENT_MAX_DEFAULT,
+                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_RANDOM] =
+        g_param_spec_object ("random",
+                             "Random object",
+                             "Source of random numbers.",
+                             TYPE_RANDOM,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_TPM_COUNT] =
+        g_param_spec_uint ("tpm-count",
+                           "number of TPMs",
+                           "Number of TPMs clients may connect to",
+                           1,
+                           TABRMD_TPMS_MAX,
+                           1,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
+    obj_properties [PROP_MAX_CHANNELS] =
+        g_param_spec_uint ("max-channels",
+                           "maximum channels",
+                           "Channels a client may open on a connection, 0 reports no support for them",
+                           0,
+                           TABRMD_CHANNELS_MAX,
+                           0,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+
+IpcFrontendSocket*
+ipc_frontend_socket_new (gchar const       *address,
+                         ConnectionManager *connection_manager,
+                         guint              max_trans,
+                         Random            *random)
+{
+    GObject *object = NULL;
+
+    object = g_object_new (TYPE_IPC_FRONTEND_SOCKET,
+                           "address",            address,
+                           "connection-manager", connection_manager,
+                           "max-trans",          max_trans,
+                           "random",             random,
+                           NULL);
+    return IPC_FRONTEND_SOCKET (object);
+}
+/*
+ * Create a new connection for the client on 'connection', the accepted
+ * socket becomes the Connection's iostream. The connection isn't inserted
+ * into the ConnectionManager: the caller does that once the client has the
+ * response with the connection ID.
+ * Returns the Connection or NULL with the reason in 'rc'.
+ */
+static Connection*
+ipc_frontend_socket_create_connection (IpcFrontendSocket               *self,
+                                       GSocketConnection               *connection,
+                                       const socket_protocol_request_t *request,
+                                       guint32                          pid,
+                                       guint32                          uid,
+                                       socket_protocol_response_t      *response)
+{
+    HandleMap *handle_map;
+    Connection *client;
+    guint64 id, id_pid_mix;
+
+    if (request->tpm >= self->tpm_count) {
+        g_warning ("%s: no TPM with index %" PRIu32, __func__, request->tpm);
+        response->rc = TSS2_RESMGR_RC_NOT_PERMITTED;
+        return NULL;
+    }
+    if (request->transport != TABRMD_TRANSPORT_SOCKET &&
+        request->transport != TABRMD_TRANSPORT_TAGGED) {
+        g_info ("%s: transport %" PRIu32 " not available on the socket "
+                "frontend", __func__, request->transport);
+        response->rc = TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+        return NULL;
+    }
+    if (connection_manager_is_full (self->connection_manager)) {
+        g_warning ("%s: MAX_COMMANDS exceeded", __func__);
+        response->rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+        return NULL;
+    }
+    id = random_get_uint64 (self->random);
+    id_pid_mix = id ^ pid;
+    if (connection_manager_contains_id (self->connection_manager,
+                                        id_pid_mix)) {
+        g_warning ("ID collision in ConnectionManager: %" PRIu64, id_pid_mix);
+        response->rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+        return NULL;
+    }
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, self->max_transient_objects);
+    if (handle_map == NULL)
+        g_error ("Failed to allocate new HandleMap");
+    client = connection_new (G_IO_STREAM (connection), id_pid_mix, handle_map);
+    g_object_unref (handle_map);
+    if (client == NULL)
+        g_error ("Failed to allocate new connection.");
+    connection_set_uid (client, uid);
+    connection_set_pid (client, pid);
+    connection_set_tpm (client, request->tpm);
+    connection_set_tagged (client,
+                           request->transport == TABRMD_TRANSPORT_TAGGED);
+    g_debug ("Created connection with id: 0x%" PRIx64 " on TPM %" PRIu32,
+             id_pid_mix, request->tpm);
+    response->rc = TSS2_RC_SUCCESS;
+    response->id = id;
+    response->features = TABRMD_FEATURE_CONTROL | TABRMD_FEATURE_TIMEOUT |
+        TABRMD_FEATURE_TRACE_CONTEXT;
+    if (self->max_channels > 0) {
+        response->features |= TABRMD_FEATURE_CHANNELS;
+    }
+
+    return client;
+}
+/*
+ * Look up the connection for a Cancel or SetLocality request. Like with
+ * the D-Bus frontend the client's PID is mixed into the ID so only the
+ * process that created the connection finds it.
+ */
+static Connection*
+ipc_frontend_socket_lookup (IpcFrontendSocket               *self,
+                            const socket_protocol_request_t *request,
+                            guint32                          pid)
+{
+    guint64 id_pid_mix = request->id ^ pid;
+    Connection *connection;
+
+    connection = connection_manager_lookup_id (self->connection_manager,
+                                               id_pid_mix);
+    if (connection == NULL) {
+        g_warning ("no active connection for id_pid_mix: 0x%" PRIx64,
+                   id_pid_mix);
+    }
+    return connection;
+}
+/*
+ * Handle a request once it has been read from the socket. The client is
+ * identified by the peer credentials of the socket (SO_PEERCRED). The
+ * response is written synchronously: it's the first and only thing
+ * written to a new socket so it fits in the socket buffer.
+ */
+static void
+ipc_frontend_socket_handle_request (IpcFrontendSocket               *self,
+                                    GSocketConnection               *connection,
+                                    const socket_protocol_request_t *request)
+{
+    socket_protocol_response_t response = {
+        .rc = TSS2_RESMGR_RC_NOT_IMPLEMENTED,
+    };
+    GSocket *socket = g_socket_connection_get_socket (connection);
+    GCredentials *credentials;
+    GError *error = NULL;
+    Connection *client = NULL;
+    pid_t pid = -1;
+    uid_t uid = (uid_t)-1;
+
+    credentials = g_socket_get_credentials (socket, &error);
+    if (credentials != NULL) {
+        pid = g_credentials_get_unix_pid (credentials, &error);
+        if (pid != -1) {
+            uid = g_credentials_get_unix_user (credentials, &error);
+        }
+        g_object_unref (credentials);
+    }
+    if (pid == -1 || uid == (uid_t)-1) {
+        g_warning ("%s: failed to get client credentials: %s",
+                   __func__, error->message);
+        g_clear_error (&error);
+        response.rc = TSS2_RESMGR_RC_INTERNAL_ERROR;
+        goto out;
+    }
+    if (request->version != SOCKET_PROTOCOL_VERSION) {
+        g_warning ("%s: unsupported protocol version %" PRIu32,
+                   __func__, request->version);
+        goto out;
+    }
+    switch (request->op) {
+    case SOCKET_PROTOCOL_CREATE_CONNECTION:
+        client = ipc_frontend_socket_create_connection (self,
+                                                        connection,
+                                                        request,
+                                                        (guint32)pid,
+                                                        (guint32)uid,
+                                                        &response);
+        break;
+    case SOCKET_PROTOCOL_CANCEL:
+        ipc_frontend_init_guard (IPC_FRONTEND (self));
+        client = ipc_frontend_socket_lookup (self, request, (guint32)pid);
+        if (client == NULL) {
+            response.rc = TSS2_RESMGR_RC_NOT_PERMITTED;
+            break;
+        }
+        g_info ("%s: canceling command for connection with id: 0x%" PRIx64,
+                __func__, request->id);
+        response.rc = ipc_frontend_cancel_invoke (IPC_FRONTEND (self), client);
+        g_clear_object (&client);
+        break;
+    case SOCKET_PROTOCOL_LEASE:
+        ipc_frontend_init_guard (IPC_FRONTEND (self));
+        client = ipc_frontend_socket_lookup (self, request, (guint32)pid);
+        if (client == NULL) {
+            response.rc = TSS2_RESMGR_RC_NOT_PERMITTED;
+            break;
+        }
+        response.rc = ipc_frontend_lease_invoke (IPC_FRONTEND (self),
+                                                 client,
+                                                 request->tpm,
+                                                 request->transport);
+        g_clear_object (&client);
+        break;
+    case SOCKET_PROTOCOL_SET_LOCALITY:
+        ipc_frontend_init_guard (IPC_FRONTEND (self));
+        client = ipc_frontend_socket_lookup (self, request, (guint32)pid);
+        if (client == NULL) {
+            response.rc = TSS2_RESMGR_RC_NOT_PERMITTED;
+            break;
+        }
+        if (!connection_locality_permitted (client, request->locality)) {
+            g_warning ("%s: locality %" PRIu8 " not permitted for uid %"
+                       PRIu32, __func__, request->locality, (guint32)uid);
+            response.rc = TSS2_RESMGR_RC_NOT_PERMITTED;
+        } else {
+            connection_set_locality (client, request->locality);
+            response.rc = TSS2_RC_SUCCESS;
+        }
+        g_clear_object (&client);
+        break;
+    default:
+        g_warning ("%s: unknown request %" PRIu32, __func__, request->op);
+        break;
+    }
+out:
+    if (!g_output_stream_write_all (
+            g_io_stream_get_output_stream (G_IO_STREAM (connection)),
+            &response,
+            sizeof (response),
+            NULL,
+            NULL,
+            &error)) {
+        g_warning ("%s: failed to send response: %s", __func__, error->message);
+        g_clear_error (&error);
+        g_clear_object (&client);
+    }
+    if (client != NULL) {
+        if (connection_manager_insert (self->connection_manager, client) != 0) {
+            g_warning ("Failed to add new connection to connection_manager.");
+        }
+        g_object_unref (client);
+    }
+}
+/*
+ * Callback for the asynchronous read of a request. Clients that hang up
+ * or send a short request get nothing back.
+ */
+static void
+ipc_frontend_socket_on_request (GObject      *source_object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+    ipc_frontend_socket_request_t *data = user_data;
+    GError *error = NULL;
+    gsize size = 0;
+
+    if (!g_input_stream_read_all_finish (G_INPUT_STREAM (source_object),
+                                         result,
+                                         &size,
+                                         &error)) {
+        g_debug ("%s: failed to read request: %s", __func__, error->message);
+        g_clear_error (&error);
+    } else if (size != sizeof (data->request)) {
+        g_debug ("%s: short request of %zu bytes", __func__, size);
+    } else {
+        ipc_frontend_socket_handle_request (data->self,
+                                            data->connection,
+                                            &data->request);
+    }
+    g_object_unref (data->connection);
+    g_object_unref (data->self);
+    g_free (data);
+}
+/*
+ * Handler for the GSocketService 'incoming' signal: start reading the
+ * request from the new socket. The read is asynchronous so that a slow
+ * client doesn't hold up the main loop.
+ */
+static gboolean
+ipc_frontend_socket_on_incoming (GSocketService    *service,
+                                 GSocketConnection *connection,
+                                 GObject           *source_object,
+                                 gpointer           user_data)
+{
+    ipc_frontend_socket_request_t *data;
+    UNUSED_PARAM (service);
+    UNUSED_PARAM (source_object);
+
+    data = g_new0 (ipc_frontend_socket_request_t, 1);
+    data->self = g_object_ref (IPC_FRONTEND_SOCKET (user_data));
+    data->connection = g_object_ref (connection);
+    g_input_stream_read_all_async (
+        g_io_stream_get_input_stream (G_IO_STREAM (connection)),
+        &data->request,
+        sizeof (data->request),
+        G_PRIORITY_DEFAULT,
+        NULL,
+        ipc_frontend_socket_on_request,
+        data);
+    return TRUE;
+}
+/*
+ * Return the listening socket passed by systemd when the daemon is socket
+ * activated, or NULL if it isn't. Only the first socket is used. Client
+ * connections kept in the file descriptor store across a restart are
+ * passed along with it and skipped, see checkpoint.h.
+ */
+static GSocket*
+ipc_frontend_socket_activated (GError **error)
+{
+    GSocket *socket = NULL;
+    gchar **names;
+    guint i, fds, sockets = 0;
+    gint fd = -1;
+
+    fds = fd_store_listen_fds (&names);
+    for (i = 0; i < fds; ++i) {
+        if (g_str_has_prefix (names [i], FD_STORE_CONNECTION_PREFIX)) {
+            continue;
+        }
+        if (fd == -1) {
+            fd = SD_LISTEN_FDS_START + (gint)i;
+        }
+        ++sockets;
+    }
+    g_strfreev (names);
+    if (sockets > 1) {
+        g_warning ("%s: using the first of %u sockets passed by systemd",
+                   __func__, sockets);
+    }
+    if (fd != -1) {
+        fcntl (fd, F_SETFD, FD_CLOEXEC);
+        socket = g_socket_new_from_fd (fd, error);
+    }
+    return socket;
+}
+/*
+ * Bind the socket at self->address. A socket left behind by a previous
+ * instance is removed first, any other kind of file is left alone and the
+ * bind fails.
+ */
+static gboolean
+ipc_frontend_socket_listen (IpcFrontendSocket *self,
+                            GError           **error)
+{
+    GSocketAddress *address;
+    GStatBuf stat_buf;
+    gboolean ret;
+
+    if (self->address [0] != '@' &&
+        g_lstat (self->address, &stat_buf) == 0 &&
+        S_ISSOCK (stat_buf.st_mode)) {
+        g_debug ("%s: removing stale socket %s", __func__, self->address);
+        g_unlink (self->address);
+    }
+    address = socket_protocol_address_new (self->address);
+    ret = g_socket_listener_add_address (G_SOCKET_LISTENER (self->service),
+                                         address,
+                                         G_SOCKET_TYPE_STREAM,
+                                         G_SOCKET_PROTOCOL_DEFAULT,
+                                         NULL,
+                                         NULL,
+                                         error);
+    g_object_unref (address);
+    if (ret && self->address [0] != '@') {
+        self->socket_path = g_strdup (self->address);
+    }
+    return ret;
+}
+/*
+ * This function overrides the ipc_frontend_connect function from the
+ * IpcFrontend base class. It starts accepting clients on the socket passed
+ * by systemd, or on the socket at the address provided in the constructor
+ * if the daemon wasn't socket activated. The accept source is dispatched
+ * by the default GMainContext. If no socket can be had the 'disconnected'
+ * signal is emitted.
+ */
+void
+ipc_frontend_socket_connect (IpcFrontendSocket *self,
+                             GMutex            *init_mutex)
+{
+    IpcFrontend *frontend = IPC_FRONTEND (self);
+    GSocket *socket;
+    GError *error = NULL;
+    gboolean ret;
+
+    g_return_if_fail (IS_IPC_FRONTEND_SOCKET (self));
+    g_return_if_fail (self->service == NULL);
+
+    frontend->init_mutex = init_mutex;
+    self->service = g_socket_service_new ();
+    socket = ipc_frontend_socket_activated (&error);
+    if (socket != NULL) {
+        g_info ("%s: using socket passed by systemd", __func__);
+        ret = g_socket_listener_add_socket (G_SOCKET_LISTENER (self->service),
+                                            socket,
+                                            NULL,
+                                            &error);
+        g_object_unref (socket);
+    } else if (error == NULL && self->address != NULL) {
+        ret = ipc_frontend_socket_listen (self, &error);
+    } else if (error == NULL) {
+        g_set_error_literal (&error,
+                             G_IO_ERROR,
+                             G_IO_ERROR_INVALID_ARGUMENT,
+                             "no socket address and not socket activated");
+        ret = FALSE;
+    } else {
+        ret = FALSE;
+    }
+    if (!ret) {
+        g_critical ("failed to listen on socket %s: %s",
+                    self->address, error->message);
+        g_clear_error (&error);
+        g_clear_object (&self->service);
+        ipc_frontend_disconnected_invoke (frontend);
+        return;
+    }
+    g_signal_connect (self->service,
+                      "incoming",
+                      G_CALLBACK (ipc_frontend_socket_on_incoming),
+                      self);
+    g_socket_service_start (self->service);
+    g_info ("accepting connections on %s", self->address);
+}
+/*
+ * This function overrides the ipc_frontend_disconnect function from the
+ * IpcFrontend base class. Stop accepting clients and remove the socket we
+ * created. Established connections aren't affected.
+ */
+void
+ipc_frontend_socket_disconnect (IpcFrontendSocket *self)
+{
+    if (self->service != NULL) {
+        g_signal_handlers_disconnect_by_data (self->service, self);
+        g_socket_service_stop (self->service);
+        g_socket_listener_close (G_SOCKET_LISTENER (self->service));
+        g_clear_object (&self->service);
+    }
+    if (self->socket_path != NULL) {
+        g_unlink (self->socket_path);
+        g_clear_pointer (&self->socket_path, g_free);
+    }
+    IPC_FRONTEND (self)->init_mutex = NULL;
+}
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef IPC_FRONTEND_SOCKET_H
+#define IPC_FRONTEND_SOCKET_H
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "connection-manager.h"
+#include "ipc-frontend.h"
+#include "random.h"
+
+G_BEGIN_DECLS
+
+typedef struct _IpcFrontendSocketClass {
+   IpcFrontendClass     parent;
+} IpcFrontendSocketClass;
+
+typedef struct _IpcFrontendSocket
+{
+    IpcFrontend        parent_instance;
+    /* data set by GObject properties */
+    gchar             *address;
+    /* private data */
+    guint              max_transient_objects;
+    guint              tpm_count;
+    /* channels a client may open on a connection, see TABRMD_FEATURE_CHANNELS */
+    guint              max_channels;
+    ConnectionManager *connection_manager;
+    Random            *random;
+    GSocketService    *service;
+    /* the socket file we created, removed on disconnect */
+    gchar             *socket_path;
+} IpcFrontendSocket;
+
+#define TYPE_IPC_FRONTEND_SOCKET             (ipc_frontend_socket_get_type       ())
+#define IPC_FRONTEND_SOCKET(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_IPC_FRONTEND_SOCKET, IpcFrontendSocket))
+#define IPC_FRONTEND_SOCKET_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_IPC_FRONTEND_SOCKET, IpcFrontendSocketClass))
+#define IS_IPC_FRONTEND_SOCKET(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_IPC_FRONTEND_SOCKET))
+#define IS_IPC_FRONTEND_SOCKET_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_IPC_FRONTEND_SOCKET))
+#define IPC_FRONTEND_SOCKET_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_IPC_FRONTEND_SOCKET, IpcFrontendSocketClass))
+
+GType              ipc_frontend_socket_get_type   (void);
+IpcFrontendSocket* ipc_frontend_socket_new        (gchar const       *address,
+                                                   ConnectionManager *connection_manager,
+                                                   guint              max_trans,
+                                                   Random            *random);
+void               ipc_frontend_socket_connect    (IpcFrontendSocket *self,
+                                                   GMutex            *init_mutex);
+void               ipc_frontend_socket_disconnect (IpcFrontendSocket *self);
+
+G_END_DECLS
+#endif /* IPC_FRONTEND_SOCKET_H */
@@ -0,0 +1,546 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib-unix.h>
+#include <glib/gstdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "handle-map.h"
+#include "ipc-frontend-vtpm.h"
+#include "socket-protocol.h"
+#include "tabrmd-defaults.h"
+#include "util.h"
+
+G_DEFINE_TYPE (IpcFrontendVtpm, ipc_frontend_vtpm, TYPE_IPC_FRONTEND);
+
+/*
+ * A VM connected to the control channel. 'connection' is its data channel,
+ * NULL until QEMU sends VTPM_CMD_SET_DATAFD.
+ */
+typedef struct {
+    IpcFrontendVtpm   *self;
+    GSocketConnection *control;
+    gint               fd;
+    guint              watch_id;
+    Connection        *connection;
+    guint32            uid;
+    guint32            pid;
+    guint8             locality;
+    guint32            buffer_size;
+    /* the control command read so far, see vtpm_vm_read */
+    guint8             cmd_buf [VTPM_CONTROL_SIZE_MAX];
+    size_t             cmd_len;
+    /* descriptor passed along with it, -1 if there's none */
+    gint               passed_fd;
+} vtpm_vm_t;
+
+static void
+vtpm_vm_free (vtpm_vm_t *vm)
+{
+    if (vm->watch_id != 0) {
+        g_source_remove (vm->watch_id);
+    }
+    if (vm->passed_fd != -1) {
+        close (vm->passed_fd);
+    }
+    g_clear_object (&vm->connection);
+    g_clear_object (&vm->control);
+    g_free (vm);
+}
+static void
+ipc_frontend_vtpm_init (IpcFrontendVtpm *self)
+{
+    UNUSED_PARAM (self);
+}
+static void
+ipc_frontend_vtpm_dispose (GObject *obj)
+{
+    IpcFrontendVtpm *self = IPC_FRONTEND_VTPM (obj);
+
+    ipc_frontend_vtpm_disconnect (self);
+    g_clear_object (&self->connection_manager);
+    g_clear_object (&self->random);
+    G_OBJECT_CLASS (ipc_frontend_vtpm_parent_class)->dispose (obj);
+}
+static void
+ipc_frontend_vtpm_finalize (GObject *obj)
+{
+    IpcFrontendVtpm *self = IPC_FRONTEND_VTPM (obj);
+
+    g_clear_pointer (&self->address, g_free);
+    G_OBJECT_CLASS (ipc_frontend_vtpm_parent_class)->finalize (obj);
+}
+static void
+ipc_frontend_vtpm_class_init (IpcFrontendVtpmClass *klass)
+{
+    GObjectClass    *object_class      = G_OBJECT_CLASS (klass);
+    IpcFrontendClass *ipc_frontend_class = IPC_FRONTEND_CLASS (klass);
+
+    if (ipc_frontend_vtpm_parent_class == NULL)
+        ipc_frontend_vtpm_parent_class = g_type_class_peek_parent (klass);
+    object_class->dispose      = ipc_frontend_vtpm_dispose;
+    object_class->finalize     = ipc_frontend_vtpm_finalize;
+    ipc_frontend_class->connect    = (IpcFrontendConnect)ipc_frontend_vtpm_connect;
+    ipc_frontend_class->disconnect = (IpcFrontendDisconnect)ipc_frontend_vtpm_disconnect;
+}
+/*
+ * Allocate a new IpcFrontendVtpm listening on 'address' once connected,
+ * a path or a name in the abstract namespace prefixed with '@'. The
+ * caller owns the returned reference.
+ */
+IpcFrontendVtpm*
+ipc_frontend_vtpm_new (gchar const       *address,
+                       ConnectionManager *connection_manager,
+                       guint              max_trans,
+                       Random            *random)
+{
+    IpcFrontendVtpm *self;
+
+    g_assert (address != NULL);
+    g_assert (connection_manager != NULL);
+    g_assert (random != NULL);
+    self = IPC_FRONTEND_VTPM (g_object_new (TYPE_IPC_FRONTEND_VTPM, NULL));
+    self->address = g_strdup (address);
+    self->connection_manager = g_object_ref (connection_manager);
+    self->max_transient_objects = max_trans;
+    self->random = g_object_ref (random);
+    return self;
+}
+/*
+ * The size of control command 'cmd' with its request, 0 if it isn't one
+ * we support: there's no telling how long its request is then.
+ */
+static size_t
+vtpm_control_size (guint32 cmd)
+{
+    switch (cmd) {
+    case VTPM_CMD_INIT:
+    case VTPM_CMD_SET_LOCALITY:
+    case VTPM_CMD_RESET_TPMESTABLISHED:
+    case VTPM_CMD_SET_BUFFERSIZE:
+        return 2 * sizeof (guint32);
+    case VTPM_CMD_GET_CAPABILITY:
+    case VTPM_CMD_SHUTDOWN:
+    case VTPM_CMD_GET_TPMESTABLISHED:
+    case VTPM_CMD_CANCEL_TPM_CMD:
+    case VTPM_CMD_STOP:
+    case VTPM_CMD_SET_DATAFD:
+        return sizeof (guint32);
+    default:
+        return 0;
+    }
+}
+/*
+ * Read what the VM has sent of its control command into 'cmd_buf' with a
+ * single read that doesn't block, up to 'size' bytes of command in all so
+ * the next command stays in the socket. A file descriptor passed along is
+ * kept in 'passed_fd' if there isn't one already, closed otherwise.
+ * Returns FALSE if the VM hung up or the read failed.
+ */
+static gboolean
+vtpm_vm_read (vtpm_vm_t *vm,
+              size_t     size)
+{
+    union {
+        struct cmsghdr header;
+        guint8         buf [CMSG_SPACE (sizeof (gint))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg = { 0 };
+    struct iovec iov;
+    ssize_t ret;
+    gint received;
+
+    g_assert (size <= sizeof (vm->cmd_buf) && vm->cmd_len < size);
+    iov.iov_base = &vm->cmd_buf [vm->cmd_len];
+    iov.iov_len = size - vm->cmd_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof (control.buf);
+    ret = recvmsg (vm->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (ret == -1 &&
+        (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return TRUE;
+    }
+    if (ret <= 0) {
+        return FALSE;
+    }
+    for (cmsg = CMSG_FIRSTHDR (&msg);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR (&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN (sizeof (gint)))
+        {
+            continue;
+        }
+        memcpy (&received, CMSG_DATA (cmsg), sizeof (received));
+        if (vm->passed_fd == -1) {
+            vm->passed_fd = received;
+        } else {
+            close (received);
+        }
+    }
+    vm->cmd_len += (size_t)ret;
+    return TRUE;
+}
+/*
+ * Make the data channel QEMU passed in 'fd' the VM's Connection and add
+ * it to the ConnectionManager, which hands it to the CommandSource. The
+ * Connection owns 'fd' from here on, or it's closed.
+ * Returns a TPM_RESULT.
+ */
+static guint32
+vtpm_vm_connect (vtpm_vm_t *vm,
+                 gint       fd)
+{
+    IpcFrontendVtpm *self = vm->self;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    guint64 id;
+
+    if (vm->connection != NULL ||
+        connection_manager_is_full (self->connection_manager) ||
+        fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+        g_warning ("%s: refused data channel of VM with PID %" PRIu32,
+                   __func__, vm->pid);
+        close (fd);
+        return VTPM_RESULT_FAIL;
+    }
+    do {
+        id = random_get_uint64 (self->random) ^ vm->pid;
+    } while (connection_manager_contains_id (self->connection_manager, id));
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, self->max_transient_objects);
+    iostream = create_connection_iostream_fd (fd);
+    vm->connection = connection_new (iostream, id, handle_map);
+    g_object_unref (iostream);
+    g_object_unref (handle_map);
+    connection_set_uid (vm->connection, vm->uid);
+    connection_set_pid (vm->connection, vm->pid);
+    connection_set_locality (vm->connection, vm->locality);
+    if (connection_manager_insert (self->connection_manager,
+                                   vm->connection) != 0)
+    {
+        g_clear_object (&vm->connection);
+        return VTPM_RESULT_FAIL;
+    }
+    g_info ("%s: VM with PID %" PRIu32 " on connection 0x%" PRIx64,
+            __func__, vm->pid, id);
+    return VTPM_RESULT_SUCCESS;
+}
+/*
+ * Answer the control command read whole into the VM's 'cmd_buf'. The TPM
+ * is shared so the commands that act on the TPM itself only act on the
+ * VM's view of it: a stop or shutdown has nothing to do, the TPM
+ * established bit is never set. A locality above 0 is only for VMs whose
+ * QEMU may use it, see connection_locality_permitted_uid.
+ * Returns FALSE if the VM must be dropped.
+ */
+static gboolean
+vtpm_vm_process (vtpm_vm_t *vm)
+{
+    const guint8 *request = &vm->cmd_buf [sizeof (guint32)];
+    guint8 response [4 * sizeof (guint32)] = { 0 };
+    size_t response_size = sizeof (guint32);
+    guint32 cmd, result = VTPM_RESULT_SUCCESS, value;
+    guint64 caps;
+    gint fd = vm->passed_fd;
+
+    vm->passed_fd = -1;
+    memcpy (&cmd, vm->cmd_buf, sizeof (cmd));
+    cmd = GUINT32_FROM_BE (cmd);
+    switch (cmd) {
+    case VTPM_CMD_GET_CAPABILITY:
+        caps = GUINT64_TO_BE (VTPM_CAPABILITIES);
+        memcpy (response, &caps, sizeof (caps));
+        response_size = sizeof (caps);
+        break;
+    case VTPM_CMD_INIT:
+    case VTPM_CMD_SHUTDOWN:
+    case VTPM_CMD_STOP:
+    case VTPM_CMD_RESET_TPMESTABLISHED:
+        break;
+    case VTPM_CMD_GET_TPMESTABLISHED:
+        /* the result then the bit, padded */
+        response_size = 2 * sizeof (guint32);
+        break;
+    case VTPM_CMD_SET_LOCALITY:
+        if (request [0] > TPM2_LOC_FOUR) {
+            result = VTPM_RESULT_BAD_PARAMETER;
+            break;
+        }
+        if (!connection_locality_permitted_uid (vm->uid, request [0])) {
+            g_warning ("%s: locality %" PRIu8 " not permitted for VM with "
+                       "PID %" PRIu32, __func__, request [0], vm->pid);
+            result = VTPM_RESULT_BAD_LOCALITY;
+            break;
+        }
+        vm->locality = request [0];
+        if (vm->connection != NULL) {
+            connection_set_locality (vm->connection, vm->locality);
+        }
+        break;
+    case VTPM_CMD_CANCEL_TPM_CMD:
+        ipc_frontend_init_guard (IPC_FRONTEND (vm->self));
+        if (vm->connection != NULL &&
+            ipc_frontend_cancel_invoke (IPC_FRONTEND (vm->self),
+                                        vm->connection) != TSS2_RC_SUCCESS)
+        {
+            result = VTPM_RESULT_FAIL;
+        }
+        break;
+    case VTPM_CMD_SET_DATAFD:
+        if (fd == -1) {
+            result = VTPM_RESULT_BAD_PARAMETER;
+            break;
+        }
+        result = vtpm_vm_connect (vm, fd);
+        fd = -1;
+        break;
+    case VTPM_CMD_SET_BUFFERSIZE:
+        memcpy (&value, request, sizeof (value));
+        value = GUINT32_FROM_BE (value);
+        if (value != 0) {
+            vm->buffer_size = CLAMP (value, VTPM_BUFFER_SIZE_MIN, UTIL_BUF_MAX);
+        }
+        value = GUINT32_TO_BE (vm->buffer_size);
+        memcpy (&response [sizeof (guint32)], &value, sizeof (value));
+        value = GUINT32_TO_BE (VTPM_BUFFER_SIZE_MIN);
+        memcpy (&response [2 * sizeof (guint32)], &value, sizeof (value));
+        value = GUINT32_TO_BE (UTIL_BUF_MAX);
+        memcpy (&response [3 * sizeof (guint32)], &value, sizeof (value));
+        response_size = sizeof (response);
+        break;
+    default:
+        /* vtpm_on_control drops VMs sending commands we don't know */
+        g_assert_not_reached ();
+    }
+    if (fd != -1) {
+        close (fd);
+    }
+    if (cmd != VTPM_CMD_GET_CAPABILITY) {
+        value = GUINT32_TO_BE (result);
+        memcpy (response, &value, sizeof (value));
+    }
+    /* the socket doesn't block: a VM not reading its responses is dropped */
+    return write_all (G_OUTPUT_STREAM (g_io_stream_get_output_stream (
+                                           G_IO_STREAM (vm->control))),
+                      response,
+                      response_size) == (ssize_t)response_size;
+}
+/*
+ * GUnixFDSourceFunc for a VM's control channel: read what the VM sent
+ * without blocking and answer each control command once it's complete.
+ * A partial command waits in the VM's buffer for the rest of it. A VM
+ * that hangs up, which QEMU does when the VM is gone, or sends a command
+ * we don't know is dropped. Its Connection goes away when QEMU closes the
+ * data channel.
+ */
+static gboolean
+vtpm_on_control (gint         fd,
+                 GIOCondition condition,
+                 gpointer     user_data)
+{
+    vtpm_vm_t *vm = (vtpm_vm_t*)user_data;
+    IpcFrontendVtpm *self = vm->self;
+    size_t size, len;
+    guint32 cmd;
+
+    UNUSED_PARAM (fd);
+    if (condition & (G_IO_HUP | G_IO_ERR)) {
+        goto drop_out;
+    }
+    for (;;) {
+        size = sizeof (cmd);
+        if (vm->cmd_len >= sizeof (cmd)) {
+            memcpy (&cmd, vm->cmd_buf, sizeof (cmd));
+            size = vtpm_control_size (GUINT32_FROM_BE (cmd));
+            if (size == 0) {
+                g_warning ("%s: unsupported control command %" PRIu32
+                           " from VM with PID %" PRIu32, __func__,
+                           GUINT32_FROM_BE (cmd), vm->pid);
+                goto drop_out;
+            }
+        }
+        if (vm->cmd_len == size) {
+            if (!vtpm_vm_process (vm)) {
+                goto drop_out;
+            }
+            vm->cmd_len = 0;
+            continue;
+        }
+        len = vm->cmd_len;
+        if (!vtpm_vm_read (vm, size)) {
+            goto drop_out;
+        }
+        if (vm->cmd_len == len) {
+            return G_SOURCE_CONTINUE;
+        }
+    }
+drop_out:
+    g_debug ("%s: dropping VM with PID %" PRIu32, __func__, vm->pid);
+    /* returning G_SOURCE_REMOVE removes the source */
+    vm->watch_id = 0;
+    self->vms = g_list_remove (self->vms, vm);
+    vtpm_vm_free (vm);
+    return G_SOURCE_REMOVE;
+}
+/*
+ * Answer the control commands of the VM on 'control', whose QEMU runs as
+ * 'uid' with 'pid'.
+ */
+void
+ipc_frontend_vtpm_add_vm (IpcFrontendVtpm   *self,
+                          GSocketConnection *control,
+                          guint32            uid,
+                          guint32            pid)
+{
+    vtpm_vm_t *vm;
+
+    g_assert (self != NULL);
+    g_assert (control != NULL);
+    vm = g_new0 (vtpm_vm_t, 1);
+    vm->self = self;
+    vm->control = g_object_ref (control);
+    vm->fd = g_socket_get_fd (g_socket_connection_get_socket (control));
+    vm->uid = uid;
+    vm->pid = pid;
+    vm->buffer_size = UTIL_BUF_MAX;
+    vm->passed_fd = -1;
+    /* nothing on the control channel may hold up the main loop */
+    g_socket_set_blocking (g_socket_connection_get_socket (control), FALSE);
+    if (fcntl (vm->fd, F_SETFL, fcntl (vm->fd, F_GETFL) | O_NONBLOCK) == -1) {
+        g_warning ("%s: failed to make control channel of VM with PID %"
+                   PRIu32 " non-blocking: %s", __func__, pid,
+                   strerror (errno));
+    }
+    vm->watch_id = g_unix_fd_add (vm->fd,
+                                  G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                  vtpm_on_control,
+                                  vm);
+    self->vms = g_list_prepend (self->vms, vm);
+}
+/*
+ * Handler for the GSocketService 'incoming' signal: a QEMU connecting to
+ * the control channel. It's identified by the peer credentials of the
+ * socket, the UID being the one its commands are scheduled under.
+ */
+static gboolean
+ipc_frontend_vtpm_on_incoming (GSocketService    *service,
+                               GSocketConnection *connection,
+                               GObject           *source_object,
+                               gpointer           user_data)
+{
+    IpcFrontendVtpm *self = IPC_FRONTEND_VTPM (user_data);
+    GCredentials *credentials;
+    GError *error = NULL;
+    pid_t pid = -1;
+    uid_t uid = (uid_t)-1;
+    UNUSED_PARAM (service);
+    UNUSED_PARAM (source_object);
+
+    credentials = g_socket_get_credentials (
+        g_socket_connection_get_socket (connection), &error);
+    if (credentials != NULL) {
+        pid = g_credentials_get_unix_pid (credentials, &error);
+        if (pid != -1) {
+            uid = g_credentials_get_unix_user (credentials, &error);
+        }
+        g_object_unref (credentials);
+    }
+    if (pid == -1 || uid == (uid_t)-1) {
+        g_warning ("%s: failed to get VM credentials: %s",
+                   __func__, error->message);
+        g_clear_error (&error);
+        return TRUE;
+    }
+    ipc_frontend_vtpm_add_vm (self, connection, (guint32)uid, (guint32)pid);
+    return TRUE;
+}
+/*
+ * This function overrides the ipc_frontend_connect function from the
+ * IpcFrontend base class. It starts accepting VMs on the socket at the
+ * address provided in the constructor, a socket left behind by a previous
+ * instance is removed first. If the socket can't be had the
+ * 'disconnected' signal is emitted.
+ */
+void
+ipc_frontend_vtpm_connect (IpcFrontendVtpm *self,
+                           GMutex          *init_mutex)
+{
+    IpcFrontend *frontend = IPC_FRONTEND (self);
+    GSocketAddress *address;
+    GStatBuf stat_buf;
+    GError *error = NULL;
+    gboolean ret;
+
+    g_return_if_fail (IS_IPC_FRONTEND_VTPM (self));
+    g_return_if_fail (self->service == NULL);
+
+    frontend->init_mutex = init_mutex;
+    if (self->address [0] != '@' &&
+        g_lstat (self->address, &stat_buf) == 0 &&
+        S_ISSOCK (stat_buf.st_mode)) {
+        g_debug ("%s: removing stale socket %s", __func__, self->address);
+        g_unlink (self->address);
+    }
+    self->service = g_socket_service_new ();
+    address = socket_protocol_address_new (self->address);
+    ret = g_socket_listener_add_address (G_SOCKET_LISTENER (self->service),
+                                         address,
+                                         G_SOCKET_TYPE_STREAM,
+                                         G_SOCKET_PROTOCOL_DEFAULT,
+                                         NULL,
+                                         NULL,
+                                         &error);
+    g_object_unref (address);
+    if (!ret) {
+        g_critical ("failed to listen on vTPM socket %s: %s",
+                    self->address, error->message);
+        g_clear_error (&error);
+        g_clear_object (&self->service);
+        ipc_frontend_disconnected_invoke (frontend);
+        return;
+    }
+    if (self->address [0] != '@') {
+        self->socket_path = g_strdup (self->address);
+    }
+    g_signal_connect (self->service,
+                      "incoming",
+                      G_CALLBACK (ipc_frontend_vtpm_on_incoming),
+                      self);
+    g_socket_service_start (self->service);
+    g_info ("accepting VMs on %s", self->address);
+}
+/*
+ * This function overrides the ipc_frontend_disconnect function from the
+ * IpcFrontend base class. Stop accepting VMs, drop the control channels
+ * and remove the socket we created. The VMs' Connections aren't affected.
+ */
+void
+ipc_frontend_vtpm_disconnect (IpcFrontendVtpm *self)
+{
+    if (self->service != NULL) {
+        g_signal_handlers_disconnect_by_data (self->service, self);
+        g_socket_service_stop (self->service);
+        g_socket_listener_close (G_SOCKET_LISTENER (self->service));
+        g_clear_object (&self->service);
+    }
+    g_list_free_full (self->vms, (GDestroyNotify)vtpm_vm_free);
+    self->vms = NULL;
+    if (self->socket_path != NULL) {
+        g_unlink (self->socket_path);
+        g_clear_pointer (&self->socket_path, g_free);
+    }
+    IPC_FRONTEND (self)->init_mutex = NULL;
+}
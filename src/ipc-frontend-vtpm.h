@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef IPC_FRONTEND_VTPM_H
+#define IPC_FRONTEND_VTPM_H
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "connection-manager.h"
+#include "ipc-frontend.h"
+#include "random.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Control channel commands of the swtpm socket interface, see swtpm's
+ * tpm_ioctl.h. Each is a big endian uint32 followed by its fixed size
+ * request, the answer is its fixed size response.
+ */
+#define VTPM_CMD_GET_CAPABILITY       1
+#define VTPM_CMD_INIT                 2
+#define VTPM_CMD_SHUTDOWN             3
+#define VTPM_CMD_GET_TPMESTABLISHED   4
+#define VTPM_CMD_SET_LOCALITY         5
+#define VTPM_CMD_CANCEL_TPM_CMD       9
+#define VTPM_CMD_RESET_TPMESTABLISHED 11
+#define VTPM_CMD_STOP                 14
+#define VTPM_CMD_SET_DATAFD           16
+#define VTPM_CMD_SET_BUFFERSIZE       17
+/* PTM_CAP_* bits for the commands above */
+#define VTPM_CAPABILITIES ((guint64)(1 << 0 | 1 << 1 | 1 << 2 | 1 << 3 | \
+                                     1 << 5 | 1 << 7 | 1 << 10 | 1 << 12 | \
+                                     1 << 13))
+/* TPM_RESULT codes of the responses */
+#define VTPM_RESULT_SUCCESS       0
+#define VTPM_RESULT_BAD_PARAMETER 3
+#define VTPM_RESULT_FAIL          9
+#define VTPM_RESULT_BAD_LOCALITY  61
+/* smallest buffer size a VM may set with VTPM_CMD_SET_BUFFERSIZE */
+#define VTPM_BUFFER_SIZE_MIN      1024
+/* longest control command: the command code and a uint32 request */
+#define VTPM_CONTROL_SIZE_MAX     (2 * sizeof (guint32))
+
+typedef struct _IpcFrontendVtpmClass {
+   IpcFrontendClass     parent;
+} IpcFrontendVtpmClass;
+
+/*
+ * A frontend for virtual machines: QEMU's TPM emulator backend connects
+ * to the socket at 'address' as it would to swtpm's control channel,
+ * once for each VM. The data channel QEMU hands over with
+ * VTPM_CMD_SET_DATAFD becomes the VM's Connection, so the guest's TPM
+ * commands get the same virtualization and scheduling as any client's,
+ * without a proxy in between. Control commands are read without blocking
+ * and answered from the default GMainContext, so a VM sending its
+ * commands slowly holds up nobody else.
+ */
+typedef struct _IpcFrontendVtpm
+{
+    IpcFrontend        parent_instance;
+    gchar             *address;
+    guint              max_transient_objects;
+    ConnectionManager *connection_manager;
+    Random            *random;
+    GSocketService    *service;
+    /* the socket file we created, removed on disconnect */
+    gchar             *socket_path;
+    /* vtpm_vm_t for each VM connected to the control channel */
+    GList             *vms;
+} IpcFrontendVtpm;
+
+#define TYPE_IPC_FRONTEND_VTPM             (ipc_frontend_vtpm_get_type       ())
+#define IPC_FRONTEND_VTPM(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_IPC_FRONTEND_VTPM, IpcFrontendVtpm))
+#define IPC_FRONTEND_VTPM_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_IPC_FRONTEND_VTPM, IpcFrontendVtpmClass))
+#define IS_IPC_FRONTEND_VTPM(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_IPC_FRONTEND_VTPM))
+#define IS_IPC_FRONTEND_VTPM_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_IPC_FRONTEND_VTPM))
+#define IPC_FRONTEND_VTPM_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_IPC_FRONTEND_VTPM, IpcFrontendVtpmClass))
+
+GType              ipc_frontend_vtpm_get_type   (void);
+IpcFrontendVtpm*   ipc_frontend_vtpm_new        (gchar const       *address,
+                                                 ConnectionManager *connection_manager,
+                                                 guint              max_trans,
+                                                 Random            *random);
+void               ipc_frontend_vtpm_connect    (IpcFrontendVtpm   *self,
+                                                 GMutex            *init_mutex);
+void               ipc_frontend_vtpm_disconnect (IpcFrontendVtpm   *self);
+void               ipc_frontend_vtpm_add_vm     (IpcFrontendVtpm   *self,
+                                                 GSocketConnection *control,
+                                                 guint32            uid,
+                                                 guint32            pid);
+
+G_END_DECLS
+#endif /* IPC_FRONTEND_VTPM_H */
@@ -8,12 +8,16 @@
 
 #include "util.h"
 #include "ipc-frontend.h"
+#include "tabrmd.h"
 
 G_DEFINE_ABSTRACT_TYPE (IpcFrontend, ipc_frontend, G_TYPE_OBJECT);
 
 enum {
     SIGNAL_0,
     SIGNAL_DISCONNECTED,
+    SIGNAL_CANCEL,
+    SIGNAL_LEASE,
+    SIGNAL_TUNE,
     N_SIGNALS,
 };
 static guint signals [N_SIGNALS] = { 0 };
@@ -44,11 +48,61 @@ ipc_frontend_class_init (IpcFrontendClass *klass)
                       G_TYPE_NONE,
                       0,
                       NULL);
+    /*
+     * Emitted when a client asks for its outstanding commands to be
+     * canceled. Handlers take the Connection and return a TSS2_RC.
+     */
+    signals [SIGNAL_CANCEL] =
+        g_signal_new ("cancel",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      NULL,
+                      NULL,
+                      NULL,
+                      G_TYPE_UINT,
+                      1,
+                      G_TYPE_OBJECT);
+    /*
+     * Emitted when a client asks for a lease on the TPM, or to release it
+     * when the command count is 0. Handlers take the Connection, the
+     * command count and the timeout in milliseconds and return a TSS2_RC.
+     */
+    signals [SIGNAL_LEASE] =
+        g_signal_new ("lease",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      NULL,
+                      NULL,
+                      NULL,
+                      G_TYPE_UINT,
+                      3,
+                      G_TYPE_OBJECT,
+                      G_TYPE_UINT,
+                      G_TYPE_UINT);
+    /*
+     * Emitted when an administrator changes parameters of the daemon.
+     * Handlers take the Tunables and return a TSS2_RC.
+     */
+    signals [SIGNAL_TUNE] =
+        g_signal_new ("tune",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      NULL,
+                      NULL,
+                      NULL,
+                      G_TYPE_UINT,
+                      1,
+                      G_TYPE_OBJECT);
 }
 /*
  * The init_mutex is not meant to be held for any length of time. It's only
- * used as a way for an external entity to prevent the IpcFrontend from accepting
- * new connections until the command processing machinery is setup.
+ * used as a way for an external entity to hold back requests that need the
+ * command processing machinery (Cancel, SetLocality) until it's setup.
+ * New connections are accepted without waiting: commands sent on them stay
+ * in the socket until the CommandSource is started.
  */
 void
 ipc_frontend_init_guard (IpcFrontend *self)
@@ -92,3 +146,79 @@ ipc_frontend_disconnected_invoke (IpcFrontend *ipc_frontend)
                    signals [SIGNAL_DISCONNECTED],
                    0);
 }
+/*
+ * Emit the 'cancel' signal for the provided connection and return the
+ * TSS2_RC from the handler. If nobody is listening for the signal then
+ * cancellation isn't supported.
+ */
+TSS2_RC
+ipc_frontend_cancel_invoke (IpcFrontend *ipc_frontend,
+                            Connection  *connection)
+{
+    guint rc = TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+
+    if (!g_signal_has_handler_pending (ipc_frontend,
+                                       signals [SIGNAL_CANCEL],
+                                       0,
+                                       FALSE)) {
+        return rc;
+    }
+    g_signal_emit (ipc_frontend,
+                   signals [SIGNAL_CANCEL],
+                   0,
+                   connection,
+                   &rc);
+    return rc;
+}
+/*
+ * Emit the 'lease' signal for the provided connection and return the
+ * TSS2_RC from the handler. If nobody is listening for the signal then
+ * leases aren't supported.
+ */
+TSS2_RC
+ipc_frontend_lease_invoke (IpcFrontend *ipc_frontend,
+                           Connection  *connection,
+                           guint        commands,
+                           guint        timeout)
+{
+    guint rc = TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+
+    if (!g_signal_has_handler_pending (ipc_frontend,
+                                       signals [SIGNAL_LEASE],
+                                       0,
+                                       FALSE)) {
+        return rc;
+    }
+    g_signal_emit (ipc_frontend,
+                   signals [SIGNAL_LEASE],
+                   0,
+                   connection,
+                   commands,
+                   timeout,
+                   &rc);
+    return rc;
+}
+/*
+ * Emit the 'tune' signal with the provided Tunables and return the
+ * TSS2_RC from the handler. If nobody is listening for the signal then
+ * the parameters can't be changed.
+ */
+TSS2_RC
+ipc_frontend_tune_invoke (IpcFrontend *ipc_frontend,
+                          Tunables    *tunables)
+{
+    guint rc = TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+
+    if (!g_signal_has_handler_pending (ipc_frontend,
+                                       signals [SIGNAL_TUNE],
+                                       0,
+                                       FALSE)) {
+        return rc;
+    }
+    g_signal_emit (ipc_frontend,
+                   signals [SIGNAL_TUNE],
+                   0,
+                   tunables,
+                   &rc);
+    return rc;
+}
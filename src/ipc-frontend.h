@@ -7,8 +7,10 @@
 #define IPC_FRONTEND_H
 
 #include <glib-object.h>
+#include <tss2/tss2_common.h>
 
 #include "connection.h"
+#include "tunables.h"
 
 G_BEGIN_DECLS
 
@@ -43,6 +45,14 @@ void                ipc_frontend_connect               (IpcFrontend  *self,
 void                ipc_frontend_disconnect            (IpcFrontend  *self);
 void                ipc_frontend_disconnected_invoke   (IpcFrontend  *self);
 void                ipc_frontend_init_guard            (IpcFrontend  *self);
+TSS2_RC             ipc_frontend_cancel_invoke         (IpcFrontend  *self,
+                                                        Connection   *connection);
+TSS2_RC             ipc_frontend_lease_invoke          (IpcFrontend  *self,
+                                                        Connection   *connection,
+                                                        guint         commands,
+                                                        guint         timeout);
+TSS2_RC             ipc_frontend_tune_invoke           (IpcFrontend  *self,
+                                                        Tunables     *tunables);
 
 G_END_DECLS
 #endif /* IPC_FRONTEND_H */
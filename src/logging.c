@@ -3,11 +3,65 @@
  * Copyright (c) 2017, Intel Corporation
  * All rights reserved.
  */
+#include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <syslog.h>
+#include <unistd.h>
+
 #include "util.h"
 #include "logging.h"
 
+typedef void (*LoggingWriteFunc) (logging_record_t const *record);
+
+/* the command the calling thread is processing, see logging_set_command */
+typedef struct {
+    guint64  connection_id;
+    guint32  command_code;
+    guint32  rc;
+    gboolean active;
+} logging_command_t;
+
+static GPrivate logging_command_key = G_PRIVATE_INIT (g_free);
+static logging_ring_t logging_ring;
+static LoggingWriteFunc logging_write_func;
+static GThread *logging_thread;
+/* eventfd the writer sleeps on while 'logging_sleeping' is set */
+static gint logging_wakeup_fd = -1;
+static gint logging_sleeping;
+static gint logging_stop;
+static gint logging_journal_fd = -1;
+
+/*
+ * Map a GLogLevelFlags to the syslog priority also used by the journal.
+ */
+int
+logging_priority (GLogLevelFlags log_level)
+{
+    switch (log_level) {
+    case G_LOG_FLAG_FATAL:
+        return LOG_ALERT;
+    case G_LOG_LEVEL_ERROR:
+        return LOG_ERR;
+    case G_LOG_LEVEL_CRITICAL:
+        return LOG_CRIT;
+    case G_LOG_LEVEL_WARNING:
+        return LOG_WARNING;
+    case G_LOG_LEVEL_MESSAGE:
+        return LOG_NOTICE;
+    case G_LOG_LEVEL_INFO:
+        return LOG_INFO;
+    case G_LOG_LEVEL_DEBUG:
+        return LOG_DEBUG;
+    default:
+        return LOG_INFO;
+    }
+}
 /**
  * This function that implements the GLogFunc prototype. It is intended
  * for use as a log handler function for glib logging.
@@ -21,31 +75,365 @@ syslog_log_handler (const char     *log_domain,
     UNUSED_PARAM(log_domain);
     UNUSED_PARAM(log_config_list);
 
-    switch (log_level) {
-    case G_LOG_FLAG_FATAL:
-        syslog (LOG_ALERT, "%s", message);
-        break;
-    case G_LOG_LEVEL_ERROR:
-        syslog (LOG_ERR, "%s", message);
-        break;
-    case G_LOG_LEVEL_CRITICAL:
-        syslog (LOG_CRIT, "%s", message);
-        break;
-    case G_LOG_LEVEL_WARNING:
-        syslog (LOG_WARNING, "%s", message);
-        break;
-    case G_LOG_LEVEL_MESSAGE:
-        syslog (LOG_NOTICE, "%s", message);
-        break;
-    case G_LOG_LEVEL_INFO:
-        syslog (LOG_INFO, "%s", message);
-        break;
-    case G_LOG_LEVEL_DEBUG:
-        syslog (LOG_DEBUG, "%s", message);
-        break;
-    default:
-        syslog (LOG_INFO, "%s", message);
+    syslog (logging_priority (log_level), "%s", message);
+}
+/*
+ * Count a message against 'limit', see tabrmd_warning_ratelimited.
+ * 'suppressed' is set to the number of messages suppressed in earlier
+ * intervals that haven't been reported yet.
+ * Returns TRUE if the message should be logged.
+ */
+gboolean
+logging_ratelimit_check (logging_ratelimit_t *limit,
+                         guint               *suppressed)
+{
+    gint now, window, count;
+
+    *suppressed = 0;
+    now = (gint)(g_get_monotonic_time () / LOGGING_RATELIMIT_INTERVAL);
+    window = g_atomic_int_get (&limit->window);
+    if (window != now &&
+        g_atomic_int_compare_and_exchange (&limit->window, window, now))
+    {
+        g_atomic_int_set (&limit->count, 0);
+        do {
+            count = g_atomic_int_get (&limit->suppressed);
+        } while (count != 0 &&
+                 !g_atomic_int_compare_and_exchange (&limit->suppressed,
+                                                     count,
+                                                     0));
+        *suppressed = (guint)count;
     }
+    if (g_atomic_int_add (&limit->count, 1) < LOGGING_RATELIMIT_BURST) {
+        return TRUE;
+    }
+    g_atomic_int_inc (&limit->suppressed);
+    return FALSE;
+}
+/*
+ * Record the command the calling thread is processing: the records it
+ * logs until logging_clear_command carry the connection ID, the command
+ * code and, once set with logging_set_rc, the response code as journal
+ * fields.
+ */
+void
+logging_set_command (guint64 connection_id,
+                     guint32 command_code)
+{
+    logging_command_t *command = g_private_get (&logging_command_key);
+
+    if (command == NULL) {
+        command = g_new0 (logging_command_t, 1);
+        g_private_set (&logging_command_key, command);
+    }
+    command->connection_id = connection_id;
+    command->command_code = command_code;
+    command->rc = 0;
+    command->active = TRUE;
+}
+void
+logging_set_rc (guint32 rc)
+{
+    logging_command_t *command = g_private_get (&logging_command_key);
+
+    if (command != NULL) {
+        command->rc = rc;
+    }
+}
+void
+logging_clear_command (void)
+{
+    logging_command_t *command = g_private_get (&logging_command_key);
+
+    if (command != NULL) {
+        command->active = FALSE;
+    }
+}
+/*
+ * Fill in 'record' with a message logged by the calling thread.
+ */
+static void
+logging_record_fill (logging_record_t *record,
+                     GLogLevelFlags    log_level,
+                     const gchar      *log_domain,
+                     const gchar      *message)
+{
+    logging_command_t *command = g_private_get (&logging_command_key);
+
+    record->level = log_level;
+    g_strlcpy (record->domain,
+               log_domain != NULL ? log_domain : "",
+               sizeof (record->domain));
+    g_strlcpy (record->message,
+               message != NULL ? message : "",
+               sizeof (record->message));
+    record->has_command = command != NULL && command->active;
+    if (record->has_command) {
+        record->connection_id = command->connection_id;
+        record->command_code = command->command_code;
+        record->rc = command->rc;
+    }
+}
+/*
+ * Put a record in 'ring'. This never blocks: if the ring is full the
+ * record is dropped and counted.
+ * Returns FALSE if the record was dropped.
+ */
+gboolean
+logging_ring_put (logging_ring_t *ring,
+                  GLogLevelFlags  log_level,
+                  const gchar    *log_domain,
+                  const gchar    *message)
+{
+    logging_record_t *record;
+    guint head, tail;
+
+    do {
+        head = (guint)g_atomic_int_get (&ring->head);
+        tail = (guint)g_atomic_int_get (&ring->tail);
+        if (head - tail >= LOGGING_RING_SIZE) {
+            g_atomic_int_inc (&ring->dropped);
+            return FALSE;
+        }
+    } while (!g_atomic_int_compare_and_exchange (&ring->head,
+                                                 (gint)head,
+                                                 (gint)(head + 1)));
+    record = &ring->records [head % LOGGING_RING_SIZE];
+    logging_record_fill (record, log_level, log_domain, message);
+    g_atomic_int_set (&record->state, LOGGING_SLOT_FULL);
+    return TRUE;
+}
+/*
+ * Take the oldest record from 'ring'. Only one thread may take records.
+ * Returns FALSE if there's no record ready.
+ */
+gboolean
+logging_ring_take (logging_ring_t   *ring,
+                   logging_record_t *record)
+{
+    guint tail = (guint)g_atomic_int_get (&ring->tail);
+    logging_record_t *slot = &ring->records [tail % LOGGING_RING_SIZE];
+
+    if (g_atomic_int_get (&slot->state) != LOGGING_SLOT_FULL) {
+        return FALSE;
+    }
+    memcpy (record, slot, sizeof (*record));
+    g_atomic_int_set (&slot->state, LOGGING_SLOT_EMPTY);
+    g_atomic_int_set (&ring->tail, (gint)(tail + 1));
+    return TRUE;
+}
+/*
+ * Return the number of records dropped since the last call and reset it.
+ */
+guint
+logging_ring_take_dropped (logging_ring_t *ring)
+{
+    gint dropped;
+
+    do {
+        dropped = g_atomic_int_get (&ring->dropped);
+    } while (dropped != 0 &&
+             !g_atomic_int_compare_and_exchange (&ring->dropped, dropped, 0));
+    return (guint)dropped;
+}
+static gboolean
+logging_ring_ready (logging_ring_t *ring)
+{
+    guint tail = (guint)g_atomic_int_get (&ring->tail);
+
+    return g_atomic_int_get (&ring->records [tail % LOGGING_RING_SIZE].state) ==
+        LOGGING_SLOT_FULL;
+}
+static void
+logging_write_syslog (logging_record_t const *record)
+{
+    syslog_log_handler (record->domain, record->level, record->message, NULL);
+}
+/*
+ * Send a record to journald with the native protocol. MESSAGE uses the
+ * binary form, it may hold newlines. Records journald doesn't take go to
+ * syslog.
+ */
+static void
+logging_write_journal (logging_record_t const *record)
+{
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+        .sun_path = LOGGING_JOURNAL_SOCKET,
+    };
+    gchar fields [256];
+    guint64 size = GUINT64_TO_LE (strlen (record->message));
+    struct iovec iov [5];
+    struct msghdr msg = {
+        .msg_name = &addr,
+        .msg_namelen = sizeof (addr),
+        .msg_iov = iov,
+        .msg_iovlen = G_N_ELEMENTS (iov),
+    };
+    gint len;
+
+    len = g_snprintf (fields, sizeof (fields),
+                      "PRIORITY=%d\nSYSLOG_IDENTIFIER=" LOGGING_IDENTIFIER "\n",
+                      logging_priority (record->level));
+    if (record->domain [0] != '\0') {
+        len += g_snprintf (fields + len, sizeof (fields) - len,
+                           "GLIB_DOMAIN=%s\n", record->domain);
+    }
+    if (record->has_command) {
+        len += g_snprintf (fields + len, sizeof (fields) - len,
+                           "TABRMD_CONNECTION=0x%" PRIx64 "\n"
+                           "TABRMD_COMMAND=0x%08" PRIx32 "\n"
+                           "TABRMD_RC=0x%08" PRIx32 "\n",
+                           record->connection_id,
+                           record->command_code,
+                           record->rc);
+    }
+    iov [0].iov_base = fields;
+    iov [0].iov_len = (size_t)len;
+    iov [1].iov_base = (gpointer)"MESSAGE\n";
+    iov [1].iov_len = strlen ("MESSAGE\n");
+    iov [2].iov_base = &size;
+    iov [2].iov_len = sizeof (size);
+    iov [3].iov_base = (gpointer)record->message;
+    iov [3].iov_len = strlen (record->message);
+    iov [4].iov_base = (gpointer)"\n";
+    iov [4].iov_len = 1;
+    if (TABRMD_ERRNO_EINTR_RETRY (sendmsg (logging_journal_fd,
+                                           &msg,
+                                           MSG_NOSIGNAL)) == -1)
+    {
+        logging_write_syslog (record);
+    }
+}
+/*
+ * GThreadFunc writing the records from the ring until logging_shutdown.
+ */
+static gpointer
+logging_thread_func (gpointer user_data)
+{
+    logging_record_t record;
+    guint64 value;
+    guint dropped;
+    UNUSED_PARAM (user_data);
+
+    for (;;) {
+        while (logging_ring_take (&logging_ring, &record)) {
+            logging_write_func (&record);
+        }
+        dropped = logging_ring_take_dropped (&logging_ring);
+        if (dropped > 0) {
+            memset (&record, 0, sizeof (record));
+            record.level = G_LOG_LEVEL_WARNING;
+            g_snprintf (record.message, sizeof (record.message),
+                        "%u log messages dropped", dropped);
+            logging_write_func (&record);
+        }
+        if (g_atomic_int_get (&logging_stop)) {
+            break;
+        }
+        /* a record put after this is seen or wakes us up */
+        g_atomic_int_set (&logging_sleeping, TRUE);
+        if (logging_ring_ready (&logging_ring)) {
+            g_atomic_int_set (&logging_sleeping, FALSE);
+            continue;
+        }
+        if (TABRMD_ERRNO_EINTR_RETRY (read (logging_wakeup_fd,
+                                            &value,
+                                            sizeof (value))) == -1)
+        {
+            g_atomic_int_set (&logging_sleeping, FALSE);
+        }
+    }
+    return NULL;
+}
+static void
+logging_wakeup (void)
+{
+    guint64 value = 1;
+
+    if (g_atomic_int_get (&logging_sleeping) &&
+        g_atomic_int_compare_and_exchange (&logging_sleeping, TRUE, FALSE))
+    {
+        TABRMD_ERRNO_EINTR_RETRY (write (logging_wakeup_fd,
+                                         &value,
+                                         sizeof (value)));
+    }
+}
+/*
+ * GLogFunc handing records to the writer thread.
+ */
+static void
+logging_async_handler (const char     *log_domain,
+                       GLogLevelFlags  log_level,
+                       const char     *message,
+                       gpointer        user_data)
+{
+    logging_record_t record;
+    UNUSED_PARAM (user_data);
+
+    if (log_level & (G_LOG_LEVEL_ERROR | G_LOG_FLAG_FATAL)) {
+        logging_record_fill (&record, log_level, log_domain, message);
+        logging_write_func (&record);
+        return;
+    }
+    logging_ring_put (&logging_ring, log_level, log_domain, message);
+    logging_wakeup ();
+}
+/*
+ * Start the writer thread for 'func' and route messages to it.
+ * Returns FALSE if the thread can't be started.
+ */
+static gboolean
+logging_start (LoggingWriteFunc func)
+{
+    GError *error = NULL;
+
+    if (logging_thread != NULL) {
+        logging_write_func = func;
+        return TRUE;
+    }
+    logging_wakeup_fd = eventfd (0, EFD_CLOEXEC);
+    if (logging_wakeup_fd == -1) {
+        return FALSE;
+    }
+    logging_write_func = func;
+    logging_thread = g_thread_try_new ("tabrmd-log",
+                                       logging_thread_func,
+                                       NULL,
+                                       &error);
+    if (logging_thread == NULL) {
+        g_clear_error (&error);
+        close (logging_wakeup_fd);
+        logging_wakeup_fd = -1;
+        return FALSE;
+    }
+    g_log_set_handler (NULL,
+                       get_enabled_log_levels () | G_LOG_FLAG_FATAL | \
+                       G_LOG_FLAG_RECURSION,
+                       logging_async_handler,
+                       NULL);
+    return TRUE;
+}
+/*
+ * Write out the records still in the ring and stop the writer thread.
+ */
+void
+logging_shutdown (void)
+{
+    guint64 value = 1;
+
+    if (logging_thread == NULL) {
+        return;
+    }
+    g_atomic_int_set (&logging_stop, TRUE);
+    TABRMD_ERRNO_EINTR_RETRY (write (logging_wakeup_fd,
+                                     &value,
+                                     sizeof (value)));
+    g_thread_join (logging_thread);
+    logging_thread = NULL;
+    close (logging_wakeup_fd);
+    logging_wakeup_fd = -1;
+    g_atomic_int_set (&logging_stop, FALSE);
 }
 /*
  * The G_MESSAGES_DEBUG environment variable is a space separated list of
@@ -78,6 +466,9 @@ set_logger (gchar *name)
     int enabled_log_levels = 0;
 
     if (g_strcmp0 (name, "syslog") == 0) {
+        if (logging_start (logging_write_syslog)) {
+            return 0;
+        }
         enabled_log_levels = get_enabled_log_levels ();
         g_log_set_handler (NULL,
                            enabled_log_levels | G_LOG_FLAG_FATAL | \
@@ -85,6 +476,14 @@ set_logger (gchar *name)
                            syslog_log_handler,
                            NULL);
         return 0;
+    } else if (g_strcmp0 (name, "journal") == 0) {
+        if (logging_journal_fd == -1) {
+            logging_journal_fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        }
+        if (logging_journal_fd == -1 || !logging_start (logging_write_journal)) {
+            return -1;
+        }
+        return 0;
     } else if (g_strcmp0 (name, "stdout") == 0) {
         /* stdout is the default for g_log, nothing to do but return 0 */
         g_info ("logging to stdout");
@@ -92,3 +491,34 @@ set_logger (gchar *name)
     }
     return -1;
 }
+/*
+ * Whether debug messages are logged, LOGGING_DEBUG_UNKNOWN until the first
+ * call to logging_debug_check. Only tabrmd_debug_enabled should read this.
+ */
+gint logging_debug_state = LOGGING_DEBUG_UNKNOWN;
+/*
+ * Return TRUE if debug messages are logged. The first call decides from
+ * the G_MESSAGES_DEBUG environment variable, see get_enabled_log_levels.
+ */
+gboolean
+logging_debug_check (void)
+{
+    gint state = g_atomic_int_get (&logging_debug_state);
+
+    if (state == LOGGING_DEBUG_UNKNOWN) {
+        state = (get_enabled_log_levels () & G_LOG_LEVEL_DEBUG) ?
+            LOGGING_DEBUG_ON : LOGGING_DEBUG_OFF;
+        g_atomic_int_set (&logging_debug_state, state);
+    }
+    return state == LOGGING_DEBUG_ON;
+}
+/*
+ * Turn the debug messages logged through tabrmd_debug on or off,
+ * overriding the environment.
+ */
+void
+logging_set_debug_enabled (gboolean enabled)
+{
+    g_atomic_int_set (&logging_debug_state,
+                      enabled ? LOGGING_DEBUG_ON : LOGGING_DEBUG_OFF);
+}
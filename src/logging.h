@@ -8,6 +8,8 @@
 
 #include <glib.h>
 
+#include "util.h"
+
 /* Macro to log "critical" events, then exit indicating failure. */
 #define tabrmd_critical(fmt, ...) \
     do { \
@@ -20,6 +22,112 @@
 #define LOG_LEVEL_ALL     (LOG_LEVEL_DEFAULT | G_LOG_LEVEL_MESSAGE | \
                            G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG)
 
+/* values of logging_debug_state */
+#define LOGGING_DEBUG_UNKNOWN -1
+#define LOGGING_DEBUG_OFF      0
+#define LOGGING_DEBUG_ON       1
+
+/*
+ * Debug logging for hot paths. When debug messages are disabled
+ * tabrmd_debug and tabrmd_debug_bytes cost one well predicted branch:
+ * their arguments aren't evaluated, nothing is formatted and no hex dump
+ * is built. Whether debug messages are enabled is decided the first time
+ * it's checked (see logging_debug_check). Configuring with
+ * --disable-debug-logging compiles them out entirely.
+ */
+extern gint logging_debug_state;
+#ifdef DISABLE_DEBUG_LOGGING
+#define tabrmd_debug_enabled() FALSE
+#else
+#define tabrmd_debug_enabled() \
+    (G_UNLIKELY (logging_debug_state != LOGGING_DEBUG_OFF) && \
+     logging_debug_check ())
+#endif
+#define tabrmd_debug(...) \
+    do { \
+        if (tabrmd_debug_enabled ()) \
+            g_debug (__VA_ARGS__); \
+    } while (0)
+#define tabrmd_debug_bytes(byte_array, array_size, width, indent) \
+    do { \
+        if (tabrmd_debug_enabled ()) \
+            g_debug_bytes (byte_array, array_size, width, indent); \
+    } while (0)
+
+/*
+ * Warnings for paths that can fail over and over, a misbehaving TPM or a
+ * client that went away. Each call site logs at most
+ * LOGGING_RATELIMIT_BURST messages per LOGGING_RATELIMIT_INTERVAL
+ * microseconds and counts the rest. The first message logged in a later
+ * interval is preceded by the number suppressed. Checking the limit takes
+ * no lock.
+ */
+#define LOGGING_RATELIMIT_INTERVAL (5 * G_USEC_PER_SEC)
+#define LOGGING_RATELIMIT_BURST    10
+
+typedef struct {
+    gint window;
+    gint count;
+    gint suppressed;
+} logging_ratelimit_t;
+
+#define tabrmd_warning_ratelimited(...) \
+    do { \
+        static logging_ratelimit_t _ratelimit; \
+        guint _suppressed; \
+        if (logging_ratelimit_check (&_ratelimit, &_suppressed)) { \
+            if (_suppressed > 0) \
+                g_warning ("%s:%d: %u messages suppressed", \
+                           __FILE__, __LINE__, _suppressed); \
+            g_warning (__VA_ARGS__); \
+        } \
+    } while (0)
+
+/*
+ * The syslog and journal loggers don't write from the thread that logs:
+ * that may be the ResourceManager in the middle of a command, and a slow
+ * syslog daemon or journald would hold it up. Records are put in a ring of
+ * LOGGING_RING_SIZE slots without taking a lock and written by a thread
+ * of their own. When the ring is full the record is dropped and counted
+ * instead of waiting for room, the writer then logs how many were
+ * dropped. Errors are written right away since the process is about to
+ * abort. Messages are cut to LOGGING_MESSAGE_MAX bytes.
+ */
+#define LOGGING_RING_SIZE    256
+#define LOGGING_MESSAGE_MAX  1024
+#define LOGGING_DOMAIN_MAX   32
+/* the native protocol socket of journald, see systemd-journald.service(8) */
+#define LOGGING_JOURNAL_SOCKET "/run/systemd/journal/socket"
+#define LOGGING_IDENTIFIER   "tpm2-abrmd"
+
+/* values of logging_record_t 'state' */
+#define LOGGING_SLOT_EMPTY 0
+#define LOGGING_SLOT_FULL  1
+
+typedef struct {
+    gint            state;
+    GLogLevelFlags  level;
+    /* the command being processed on the thread that logged, if any */
+    gboolean        has_command;
+    guint64         connection_id;
+    guint32         command_code;
+    guint32         rc;
+    gchar           domain [LOGGING_DOMAIN_MAX];
+    gchar           message [LOGGING_MESSAGE_MAX];
+} logging_record_t;
+
+/*
+ * Any number of threads put records, a single thread takes them. 'head'
+ * and 'tail' only ever grow, the slot for a record is its index modulo
+ * LOGGING_RING_SIZE.
+ */
+typedef struct {
+    gint              head;
+    gint              tail;
+    gint              dropped;
+    logging_record_t  records [LOGGING_RING_SIZE];
+} logging_ring_t;
+
 void
 syslog_log_handler (const char     *log_domain,
                     GLogLevelFlags  log_level,
@@ -27,4 +135,20 @@ syslog_log_handler (const char     *log_domain,
                     gpointer        log_config_list);
 int get_enabled_log_levels (void);
 gint set_logger (gchar *name);
+gboolean logging_debug_check (void);
+void logging_set_debug_enabled (gboolean enabled);
+int logging_priority (GLogLevelFlags log_level);
+gboolean logging_ratelimit_check (logging_ratelimit_t *limit,
+                                  guint               *suppressed);
+gboolean logging_ring_put (logging_ring_t *ring,
+                           GLogLevelFlags  log_level,
+                           const gchar    *log_domain,
+                           const gchar    *message);
+gboolean logging_ring_take (logging_ring_t   *ring,
+                            logging_record_t *record);
+guint logging_ring_take_dropped (logging_ring_t *ring);
+void logging_set_command (guint64 connection_id, guint32 command_code);
+void logging_set_rc (guint32 rc);
+void logging_clear_command (void);
+void logging_shutdown (void);
 #endif /* LOGGING_H */
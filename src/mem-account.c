@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+
+#include "mem-account.h"
+
+static gssize mem_account_bytes [MEM_ACCOUNT_COUNT];
+
+static const gchar *mem_account_names [MEM_ACCOUNT_COUNT] = {
+    [MEM_ACCOUNT_COMMANDS]  = "commands",
+    [MEM_ACCOUNT_RESPONSES] = "responses",
+    [MEM_ACCOUNT_CONTEXTS]  = "contexts",
+};
+
+/*
+ * Add 'bytes' to the count of 'kind', negative to release them.
+ */
+void
+mem_account_add (MemAccountKind kind,
+                 gssize         bytes)
+{
+    g_assert (kind < MEM_ACCOUNT_COUNT);
+    if (bytes != 0) {
+        g_atomic_pointer_add (&mem_account_bytes [kind], bytes);
+    }
+}
+/*
+ * Returns the bytes currently counted for 'kind'.
+ */
+gsize
+mem_account_get (MemAccountKind kind)
+{
+    gssize bytes;
+
+    g_assert (kind < MEM_ACCOUNT_COUNT);
+    bytes = (gssize)g_atomic_pointer_get (&mem_account_bytes [kind]);
+    return bytes > 0 ? (gsize)bytes : 0;
+}
+/*
+ * Returns the bytes counted for all kinds.
+ */
+gsize
+mem_account_get_total (void)
+{
+    gsize total = 0;
+    guint i;
+
+    for (i = 0; i < MEM_ACCOUNT_COUNT; ++i) {
+        total += mem_account_get ((MemAccountKind)i);
+    }
+    return total;
+}
+/*
+ * Returns the name used for 'kind' in metrics labels.
+ */
+const gchar*
+mem_account_kind_name (MemAccountKind kind)
+{
+    g_assert (kind < MEM_ACCOUNT_COUNT);
+    return mem_account_names [kind];
+}
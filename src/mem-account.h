@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef MEM_ACCOUNT_H
+#define MEM_ACCOUNT_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* what the bytes held on behalf of clients are used for */
+typedef enum {
+    MEM_ACCOUNT_COMMANDS = 0,
+    MEM_ACCOUNT_RESPONSES,
+    MEM_ACCOUNT_CONTEXTS,
+    MEM_ACCOUNT_COUNT,
+} MemAccountKind;
+
+/*
+ * Process-wide byte counts of the client data the daemon holds: command
+ * and response buffers and the saved contexts kept in memory. Spilled
+ * contexts aren't counted, they're in the ContextStore file. The counts
+ * are updated atomically from any thread.
+ */
+void        mem_account_add        (MemAccountKind kind,
+                                    gssize         bytes);
+gsize       mem_account_get        (MemAccountKind kind);
+gsize       mem_account_get_total  (void);
+const gchar* mem_account_kind_name (MemAccountKind kind);
+
+G_END_DECLS
+#endif /* MEM_ACCOUNT_H */
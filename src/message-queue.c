@@ -5,36 +5,204 @@
  */
 #include <errno.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#include <unistd.h>
 
 #include "message-queue.h"
 #include "util.h"
 
 G_DEFINE_TYPE (MessageQueue, message_queue, G_TYPE_OBJECT);
 
-/**
- * The init function is a noop but it's required by the G_DEFINE_TYPE
- * macro.
+/* let the sibling hyperthread run while spinning */
+#if defined(__x86_64__) || defined(__i386__)
+#define MESSAGE_QUEUE_CPU_RELAX() __builtin_ia32_pause ()
+#elif defined(__aarch64__)
+#define MESSAGE_QUEUE_CPU_RELAX() __asm__ __volatile__ ("yield" ::: "memory")
+#else
+#define MESSAGE_QUEUE_CPU_RELAX() do {} while (0)
+#endif
+/* CPU relax hints between two looks at the queue length */
+#define MESSAGE_QUEUE_SPIN_RELAX 16
+
+/*
+ * Create the wakeup fd. Both ends are non-blocking: a producer that finds
+ * a pipe full knows the consumer already has a wakeup pending.
  */
 static void
 message_queue_init (MessageQueue *self)
 {
-    self->queue = g_async_queue_new_full (g_object_unref);
+    GError *error = NULL;
+
+    g_queue_init (&self->local);
+#ifdef HAVE_EVENTFD
+    self->wakeup_fds [0] = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (self->wakeup_fds [0] == -1) {
+        g_error ("%s: failed to create eventfd: %s",
+                 __func__, strerror (errno));
+    }
+    self->wakeup_fds [1] = self->wakeup_fds [0];
+#else
+    if (!g_unix_open_pipe (self->wakeup_fds, FD_CLOEXEC, &error) ||
+        !g_unix_set_fd_nonblocking (self->wakeup_fds [0], TRUE, &error) ||
+        !g_unix_set_fd_nonblocking (self->wakeup_fds [1], TRUE, &error)) {
+        g_error ("%s: failed to create wakeup pipe: %s",
+                 __func__, error->message);
+    }
+#endif
+    UNUSED_PARAM (error);
 }
 /*
- * To finalize the MessageQueue we need only to unref the internal
- * GAsyncQueue object.
+ * Unref the messages still queued. There are no producers left by now.
  */
 static void
 message_queue_dispose (GObject *obj)
 {
     MessageQueue *message_queue = MESSAGE_QUEUE (obj);
 
-    g_clear_pointer (&message_queue->queue, g_async_queue_unref);
+    g_slist_free_full (message_queue->stack, g_object_unref);
+    message_queue->stack = NULL;
+    g_queue_foreach (&message_queue->local, (GFunc)g_object_unref, NULL);
+    g_queue_clear (&message_queue->local);
     G_OBJECT_CLASS (message_queue_parent_class)->dispose (obj);
 }
+static void
+message_queue_finalize (GObject *obj)
+{
+    MessageQueue *message_queue = MESSAGE_QUEUE (obj);
+
+    close (message_queue->wakeup_fds [0]);
+    if (message_queue->wakeup_fds [1] != message_queue->wakeup_fds [0]) {
+        close (message_queue->wakeup_fds [1]);
+    }
+    G_OBJECT_CLASS (message_queue_parent_class)->finalize (obj);
+}
+/*
+ * Make the wakeup fd readable. Producers call this when they push onto an
+ * empty stack, others may call it to wake a consumer waiting in its own
+ * poll without enqueuing a message.
+ */
+void
+message_queue_wakeup (MessageQueue *message_queue)
+{
+#ifdef HAVE_EVENTFD
+    uint64_t value = 1;
+#else
+    guint8 value = 0;
+#endif
+
+    if (write (message_queue->wakeup_fds [1], &value, sizeof (value)) == -1 &&
+        errno != EAGAIN) {
+        g_warning ("%s: failed to signal wakeup: %s",
+                   __func__, strerror (errno));
+    }
+}
+/*
+ * Default 'enqueue' implementation: push the object on the stack. Only
+ * the producer that pushes onto an empty stack signals the wakeup fd: the
+ * consumer takes the whole stack, so the messages pushed after it share
+ * that wakeup.
+ */
+static void
+message_queue_real_enqueue (MessageQueue  *message_queue,
+                            GObject       *object)
+{
+    GSList *node = g_slist_alloc (), *head;
+
+    node->data = object;
+    g_atomic_int_inc (&message_queue->length);
+    do {
+        head = g_atomic_pointer_get (&message_queue->stack);
+        node->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange (&message_queue->stack,
+                                                     head,
+                                                     node));
+    if (head == NULL) {
+        message_queue_wakeup (message_queue);
+    }
+}
+/*
+ * Move everything pushed so far from the stack to the end of 'local',
+ * oldest first. Called by the consumer only.
+ */
+static void
+message_queue_take_stack (MessageQueue *message_queue)
+{
+    GSList *taken, *node;
+
+    do {
+        taken = g_atomic_pointer_get (&message_queue->stack);
+    } while (taken != NULL &&
+             !g_atomic_pointer_compare_and_exchange (&message_queue->stack,
+                                                     taken,
+                                                     NULL));
+    for (taken = g_slist_reverse (taken); taken != NULL; taken = node) {
+        node = taken->next;
+        g_queue_push_tail (&message_queue->local, taken->data);
+        g_slist_free_1 (taken);
+    }
+}
+/*
+ * Default 'try_dequeue' implementation: pop from 'local', refilling it
+ * from the stack once it's empty.
+ */
+static GObject*
+message_queue_real_try_dequeue (MessageQueue *message_queue)
+{
+    GObject *obj;
+
+    if (g_queue_is_empty (&message_queue->local)) {
+        message_queue_take_stack (message_queue);
+    }
+    obj = g_queue_pop_head (&message_queue->local);
+    if (obj != NULL) {
+        g_atomic_int_add (&message_queue->length, -1);
+    }
+    return obj;
+}
+/*
+ * Default 'dequeue' implementation: poll the wakeup fd until a message
+ * arrives. The wakeup is cleared before the stack is checked so that a
+ * push onto the stack emptied by the check signals it again.
+ */
+static GObject*
+message_queue_real_dequeue (MessageQueue *message_queue)
+{
+    struct pollfd pollfd = {
+        .fd = message_queue->wakeup_fds [0],
+        .events = POLLIN,
+    };
+    GObject *obj;
+
+    while ((obj = message_queue_real_try_dequeue (message_queue)) == NULL) {
+        message_queue_clear_wakeup (message_queue);
+        obj = message_queue_real_try_dequeue (message_queue);
+        if (obj != NULL) {
+            break;
+        }
+        if (poll (&pollfd, 1, -1) == -1 && errno != EINTR) {
+            g_error ("%s: poll failed: %s", __func__, strerror (errno));
+        }
+    }
+    return obj;
+}
+/*
+ * Default 'get_length' implementation: the messages pushed and not yet
+ * dequeued.
+ */
+static guint
+message_queue_real_get_length (MessageQueue *message_queue)
+{
+    gint length = g_atomic_int_get (&message_queue->length);
+
+    return length > 0 ? (guint)length : 0;
+}
 /**
  * Boilerplate GObject class init with custom dispose function.
  */
@@ -44,6 +212,11 @@ message_queue_class_init (MessageQueueClass *klass)
     GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
     object_class->dispose = message_queue_dispose;
+    object_class->finalize = message_queue_finalize;
+    klass->enqueue = message_queue_real_enqueue;
+    klass->dequeue = message_queue_real_dequeue;
+    klass->try_dequeue = message_queue_real_try_dequeue;
+    klass->get_length = message_queue_real_get_length;
 }
 /**
  * Allocate a new message_queue_t object.
@@ -68,7 +241,7 @@ message_queue_enqueue (MessageQueue  *message_queue,
     g_assert (message_queue != NULL);
     g_debug ("%s", __func__);
     g_object_ref (object);
-    g_async_queue_push (message_queue->queue, object);
+    MESSAGE_QUEUE_GET_CLASS (message_queue)->enqueue (message_queue, object);
 }
 /**
  * Dequeue a blob from the blob_queue_t.
@@ -78,10 +251,169 @@ message_queue_enqueue (MessageQueue  *message_queue,
 GObject*
 message_queue_dequeue (MessageQueue *message_queue)
 {
-    GObject *obj;
+    MessageQueueClass *klass;
+    GObject *obj = NULL;
 
     g_assert (message_queue != NULL);
     g_debug ("%s", __func__);
-    obj = g_async_queue_pop (message_queue->queue);
+    klass = MESSAGE_QUEUE_GET_CLASS (message_queue);
+    if (message_queue_spin (message_queue)) {
+        obj = klass->try_dequeue (message_queue);
+    }
+    if (obj == NULL) {
+        obj = klass->dequeue (message_queue);
+    }
+    if (message_queue->spin_usec != 0) {
+        message_queue->last_wait =
+            g_get_monotonic_time () - message_queue->wait_start;
+    }
     return obj;
 }
+/**
+ * Dequeue a blob from the blob_queue_t without blocking.
+ * Returns NULL if the queue is empty.
+ */
+GObject*
+message_queue_try_dequeue (MessageQueue *message_queue)
+{
+    g_assert (message_queue != NULL);
+    g_debug ("%s", __func__);
+    return MESSAGE_QUEUE_GET_CLASS (message_queue)->try_dequeue (message_queue);
+}
+/*
+ * Return the number of messages waiting in the queue. The value is only a
+ * snapshot: other threads may change it before the caller looks at it.
+ */
+guint
+message_queue_get_length (MessageQueue *message_queue)
+{
+    g_assert (message_queue != NULL);
+    return MESSAGE_QUEUE_GET_CLASS (message_queue)->get_length (message_queue);
+}
+/*
+ * Bound the number of messages message_queue_try_enqueue will let into the
+ * queue. A 'max_length' of 0 removes the bound. message_queue_enqueue
+ * ignores it.
+ */
+void
+message_queue_set_max_length (MessageQueue *message_queue,
+                              guint         max_length)
+{
+    g_assert (message_queue != NULL);
+    message_queue->max_length = max_length;
+}
+/*
+ * Enqueue 'obj' unless the queue already holds 'max_length' messages.
+ * With several producers the bound may be overshot by one message per
+ * producer since the length is checked before the message is added.
+ * Returns FALSE if the message wasn't enqueued.
+ */
+gboolean
+message_queue_try_enqueue (MessageQueue *message_queue,
+                           GObject      *object)
+{
+    g_assert (message_queue != NULL);
+    if (message_queue->max_length != 0 &&
+        message_queue_get_length (message_queue) >= message_queue->max_length)
+    {
+        g_debug ("%s: queue is full", __func__);
+        return FALSE;
+    }
+    message_queue_enqueue (message_queue, object);
+    return TRUE;
+}
+/*
+ * Dequeue every message waiting in the queue without blocking.
+ * Returns the messages in the order they would have been dequeued one by
+ * one, or NULL if the queue is empty. The caller owns the list and a
+ * reference to each message.
+ */
+GList*
+message_queue_try_dequeue_all (MessageQueue *message_queue)
+{
+    MessageQueueClass *klass;
+    GList *messages = NULL;
+    GObject *obj;
+
+    g_assert (message_queue != NULL);
+    klass = MESSAGE_QUEUE_GET_CLASS (message_queue);
+    while ((obj = klass->try_dequeue (message_queue)) != NULL) {
+        messages = g_list_prepend (messages, obj);
+    }
+    if (message_queue->spin_usec != 0 && messages != NULL) {
+        message_queue->last_wait =
+            g_get_monotonic_time () - message_queue->wait_start;
+    }
+    return g_list_reverse (messages);
+}
+/*
+ * Return the fd that becomes readable when a message is enqueued, for a
+ * consumer that waits in its own poll. Once woken the consumer calls
+ * message_queue_clear_wakeup and then dequeues until the queue is empty.
+ * The fd belongs to the MessageQueue.
+ */
+gint
+message_queue_get_wakeup_fd (MessageQueue *message_queue)
+{
+    g_assert (message_queue != NULL);
+    return message_queue->wakeup_fds [0];
+}
+void
+message_queue_clear_wakeup (MessageQueue *message_queue)
+{
+    guint8 buf [64];
+
+    g_assert (message_queue != NULL);
+    while (read (message_queue->wakeup_fds [0], buf, sizeof (buf)) > 0);
+}
+/*
+ * Let the consumer spin for up to 'spin_usec' microseconds waiting for a
+ * message before it blocks, see message_queue_spin. This trades a CPU
+ * for the cost of sleeping and waking up when messages follow each other
+ * closely. 0, the default, never spins. Only the consumer may call this.
+ */
+void
+message_queue_set_spin (MessageQueue *message_queue,
+                        guint         spin_usec)
+{
+    g_assert (message_queue != NULL);
+    message_queue->spin_usec = MIN (spin_usec, MESSAGE_QUEUE_SPIN_MAX);
+    message_queue->last_wait = 0;
+}
+/*
+ * Called by the consumer before it blocks waiting for a message: busy-wait
+ * for the queue to hold a message for up to the spin budget. Unless the
+ * last message arrived within MESSAGE_QUEUE_SPIN_IDLE_FACTOR budgets of
+ * the consumer starting to wait for it the queue is taken to be idle and
+ * this returns at once, so an idle daemon doesn't burn a CPU. The time
+ * until a message is taken, by message_queue_dequeue or
+ * message_queue_try_dequeue_all, decides whether the next wait spins.
+ * Returns TRUE if a message is waiting, FALSE if the consumer should
+ * block: the queue may have been filled since.
+ */
+gboolean
+message_queue_spin (MessageQueue *message_queue)
+{
+    gint64 deadline;
+    guint i;
+
+    g_assert (message_queue != NULL);
+    if (message_queue->spin_usec == 0) {
+        return FALSE;
+    }
+    message_queue->wait_start = g_get_monotonic_time ();
+    if (message_queue->last_wait >
+        (gint64)message_queue->spin_usec * MESSAGE_QUEUE_SPIN_IDLE_FACTOR) {
+        return FALSE;
+    }
+    deadline = message_queue->wait_start + message_queue->spin_usec;
+    do {
+        if (message_queue_get_length (message_queue) > 0) {
+            return TRUE;
+        }
+        for (i = 0; i < MESSAGE_QUEUE_SPIN_RELAX; ++i) {
+            MESSAGE_QUEUE_CPU_RELAX ();
+        }
+    } while (g_get_monotonic_time () < deadline);
+    return message_queue_get_length (message_queue) > 0;
+}
@@ -11,14 +11,57 @@
 
 G_BEGIN_DECLS
 
+typedef struct _MessageQueue MessageQueue;
+
+/*
+ * Subclasses may override 'enqueue', 'dequeue' and 'try_dequeue' to change
+ * the order in which messages are delivered. The default implementation is
+ * FIFO. Subclasses that don't keep their messages in the FIFO must also
+ * override 'get_length', and their wakeup fd is never signaled.
+ *
+ * The FIFO takes many producers and a single consumer: any thread may
+ * enqueue but only one thread may dequeue. Producers push onto 'stack'
+ * with a compare-and-swap and never take a lock. The consumer takes the
+ * whole stack at once and keeps it in 'local' in the order it was pushed,
+ * so it only touches the shared stack once per batch of messages.
+ */
 typedef struct _MessageQueueClass {
     GObjectClass parent;
+    void       (*enqueue)  (MessageQueue *message_queue,
+                            GObject      *obj);
+    GObject*   (*dequeue)  (MessageQueue *message_queue);
+    GObject*   (*try_dequeue) (MessageQueue *message_queue);
+    guint      (*get_length) (MessageQueue *message_queue);
 } MessageQueueClass;
 
-typedef struct _MessageQueue {
+struct _MessageQueue {
     GObject       parent_instance;
-    GAsyncQueue  *queue;
-} MessageQueue;
+    /* messages pushed by producers, newest first */
+    GSList       *stack;
+    /* messages taken from 'stack' in FIFO order, only used by the consumer */
+    GQueue        local;
+    gint          length;
+    /*
+     * Readable once a message is pushed onto an empty 'stack'. With eventfd
+     * both entries are the same fd, otherwise they are the ends of a pipe.
+     */
+    gint          wakeup_fds [2];
+    /* message_queue_try_enqueue refuses messages past this length, 0: no limit */
+    guint         max_length;
+    /* see message_queue_set_spin, only touched by the consumer */
+    guint         spin_usec;
+    gint64        wait_start;
+    gint64        last_wait;
+};
+
+/* longest spin budget in microseconds */
+#define MESSAGE_QUEUE_SPIN_MAX 1000
+/*
+ * The consumer only spins while the last message it waited for arrived
+ * within this many spin budgets: a queue that waits longer is idle and
+ * the consumer blocks right away.
+ */
+#define MESSAGE_QUEUE_SPIN_IDLE_FACTOR 4
 
 #define TYPE_MESSAGE_QUEUE           (message_queue_get_type             ())
 #define MESSAGE_QUEUE(obj)           (G_TYPE_CHECK_INSTANCE_CAST ((obj), TYPE_MESSAGE_QUEUE, MessageQueue))
@@ -32,6 +75,19 @@ MessageQueue*   message_queue_new          (void);
 void        message_queue_enqueue          (MessageQueue   *message_queue,
                                             GObject        *obj);
 GObject*    message_queue_dequeue          (MessageQueue   *message_queue);
+GObject*    message_queue_try_dequeue      (MessageQueue   *message_queue);
+guint       message_queue_get_length       (MessageQueue   *message_queue);
+void        message_queue_set_max_length   (MessageQueue   *message_queue,
+                                            guint           max_length);
+gboolean    message_queue_try_enqueue      (MessageQueue   *message_queue,
+                                            GObject        *obj);
+GList*      message_queue_try_dequeue_all  (MessageQueue   *message_queue);
+gint        message_queue_get_wakeup_fd    (MessageQueue   *message_queue);
+void        message_queue_clear_wakeup     (MessageQueue   *message_queue);
+void        message_queue_wakeup           (MessageQueue   *message_queue);
+void        message_queue_set_spin         (MessageQueue   *message_queue,
+                                            guint           spin_usec);
+gboolean    message_queue_spin             (MessageQueue   *message_queue);
 
 G_END_DECLS
 #endif /* MESSAGE_QUEUE_H */
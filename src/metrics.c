@@ -0,0 +1,935 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "alloc-stats.h"
+#include "mem-account.h"
+#include "metrics.h"
+#include "util.h"
+
+G_DEFINE_TYPE (Metrics, metrics, G_TYPE_OBJECT);
+
+/* upper bounds of the histogram buckets in usec and as Prometheus labels */
+static const gint64 bucket_bounds [METRICS_BUCKET_COUNT] = {
+    100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000,
+};
+static const gchar *bucket_labels [METRICS_BUCKET_COUNT] = {
+    "0.0001", "0.0005", "0.001", "0.005", "0.01",
+    "0.05", "0.1", "0.5", "1", "5",
+};
+/* 'stats' is the key in the dictionary from metrics_get_stats */
+static const struct {
+    const gchar *name;
+    const gchar *stats;
+    const gchar *help;
+} counter_info [METRICS_COUNTER_COUNT] = {
+    [METRICS_CONTEXT_LOAD] = {
+        "tabrmd_context_loads_total",
+        "context_loads",
+        "Contexts loaded into the TPM.",
+    },
+    [METRICS_CONTEXT_SAVE] = {
+        "tabrmd_context_saves_total",
+        "context_saves",
+        "Contexts saved from the TPM.",
+    },
+    [METRICS_CONTEXT_FLUSH] = {
+        "tabrmd_context_flushes_total",
+        "context_flushes",
+        "Contexts flushed from the TPM.",
+    },
+    [METRICS_CONTEXT_GAP_REGAP] = {
+        "tabrmd_context_gap_regaps_total",
+        "context_gap_regaps",
+        "Session regaps done after TPM2_RC_CONTEXT_GAP.",
+    },
+    [METRICS_CONTEXT_GAP_IDLE_REGAP] = {
+        "tabrmd_context_gap_idle_regaps_total",
+        "context_gap_idle_regaps",
+        "Sessions regapped while idle before reaching the context gap limit.",
+    },
+    [METRICS_TPM_RETRY] = {
+        "tabrmd_tpm_retries_total",
+        "tpm_retries",
+        "Commands resent after TPM2_RC_RETRY, TPM2_RC_YIELDED or TPM2_RC_TESTING.",
+    },
+    [METRICS_COMMAND_REJECTED] = {
+        "tabrmd_commands_rejected_total",
+        "commands_rejected",
+        "Commands refused with TSS2_RESMGR_RC_RETRY because of a queue, in-flight or rate limit.",
+    },
+    [METRICS_LOCALITY_SWITCH] = {
+        "tabrmd_locality_switches_total",
+        "locality_switches",
+        "Times the TCTI was switched to another locality to send a command.",
+    },
+    [METRICS_CACHE_HIT] = {
+        "tabrmd_cache_hits_total",
+        "cache_hits",
+        "Commands answered from a ResourceManager response cache.",
+    },
+    [METRICS_CACHE_MISS] = {
+        "tabrmd_cache_misses_total",
+        "cache_misses",
+        "Cacheable commands that weren't in a ResourceManager response cache.",
+    },
+    [METRICS_CANARY_FAILURE] = {
+        "tabrmd_canary_failures_total",
+        "canary_failures",
+        "Canary probes that failed or went unanswered.",
+    },
+    [METRICS_TPM_DEGRADED] = {
+        "tabrmd_tpm_degraded_total",
+        "tpm_degraded",
+        "Times a TPM entered degraded mode, its commands running well over their baseline durations.",
+    },
+    [METRICS_COMMAND_SHED] = {
+        "tabrmd_commands_shed_total",
+        "commands_shed",
+        "Bulk commands refused with TSS2_RESMGR_RC_RETRY while their TPM was degraded.",
+    },
+    [METRICS_MEMORY_EVICTION] = {
+        "tabrmd_memory_evictions_total",
+        "memory_evictions",
+        "Contexts evicted to retry a command or context load the TPM had no memory for.",
+    },
+    [METRICS_COMMAND_COALESCED] = {
+        "tabrmd_commands_coalesced_total",
+        "commands_coalesced",
+        "Read-only commands answered with the response to an identical command queued with them.",
+    },
+    [METRICS_COMMAND_EXPIRED] = {
+        "tabrmd_commands_expired_total",
+        "commands_expired",
+        "Commands answered with TSS2_RESMGR_RC_CANCELED because they reached their deadline before being sent to the TPM.",
+    },
+    [METRICS_TPM_TIMEOUT] = {
+        "tabrmd_tpm_timeouts_total",
+        "tpm_timeouts",
+        "Commands the TPM didn't answer within --tpm-timeout and that were canceled.",
+    },
+}, histogram_info [METRICS_HISTOGRAM_COUNT] = {
+    [METRICS_TPM_LATENCY] = {
+        "tabrmd_tpm_command_duration_seconds",
+        NULL,
+        "Time spent sending a command to the TPM and receiving the response.",
+    },
+    [METRICS_QUEUE_LATENCY] = {
+        "tabrmd_queue_duration_seconds",
+        NULL,
+        "Time from reading a command to the resource manager picking it up.",
+    },
+    [METRICS_CONNECT_LATENCY] = {
+        "tabrmd_connect_duration_seconds",
+        NULL,
+        "Time the D-Bus frontend spent creating a connection.",
+    },
+    [METRICS_CONNECT_PID_LATENCY] = {
+        "tabrmd_connect_pid_lookup_duration_seconds",
+        NULL,
+        "Time spent looking up the PID of a client creating a connection.",
+    },
+    [METRICS_CONNECT_INSERT_LATENCY] = {
+        "tabrmd_connect_insert_duration_seconds",
+        NULL,
+        "Time spent adding a connection to the ConnectionManager, new-connection handlers included.",
+    },
+    [METRICS_CONNECT_WATCH_LATENCY] = {
+        "tabrmd_connect_watch_duration_seconds",
+        NULL,
+        "Time the CommandSource took to start watching a new connection.",
+    },
+    [METRICS_DISCONNECT_LATENCY] = {
+        "tabrmd_disconnect_duration_seconds",
+        NULL,
+        "Time from a closed connection being removed to its resource manager releasing its objects and sessions.",
+    },
+    [METRICS_CANARY_LATENCY] = {
+        "tabrmd_canary_duration_seconds",
+        NULL,
+        "Time from the canary sending its ReadClock to receiving the response.",
+    },
+    [METRICS_CANARY_TPM_LATENCY] = {
+        "tabrmd_canary_tpm_duration_seconds",
+        NULL,
+        "Time the TPM took to answer the canary's ReadClock.",
+    },
+    [METRICS_REGAP_LATENCY] = {
+        "tabrmd_context_gap_regap_duration_seconds",
+        NULL,
+        "Time spent regapping the saved sessions after TPM2_RC_CONTEXT_GAP.",
+    },
+};
+/* the 'stage' label and the name in the stages from metrics_get_stats */
+static const gchar *stage_names [METRICS_STAGE_COUNT] = {
+    [METRICS_STAGE_READ]       = "command_source",
+    [METRICS_STAGE_VIRTUALIZE] = "resource_manager",
+    [METRICS_STAGE_TPM]        = "tpm",
+    [METRICS_STAGE_CONTEXT]    = "context",
+    [METRICS_STAGE_WRITE]      = "response_sink",
+};
+/* the innermost span running on this thread */
+static GPrivate metrics_span_key;
+
+typedef struct {
+    gchar        *name;
+    guint         tpm;
+    MessageQueue *queue;
+} metrics_queue_t;
+
+static void
+metrics_queue_free (gpointer data)
+{
+    metrics_queue_t *entry = (metrics_queue_t*)data;
+
+    g_free (entry->name);
+    g_object_unref (entry->queue);
+    g_free (entry);
+}
+/*
+ * Stop serving requests and remove the socket, then release references to
+ * the objects we report on.
+ */
+static void
+metrics_dispose (GObject *obj)
+{
+    Metrics *self = METRICS (obj);
+
+    if (self->service != NULL) {
+        g_socket_service_stop (self->service);
+        g_socket_listener_close (G_SOCKET_LISTENER (self->service));
+        g_clear_object (&self->service);
+        g_unlink (self->socket_path);
+    }
+    g_clear_pointer (&self->socket_path, g_free);
+    g_clear_pointer (&self->queues, g_ptr_array_unref);
+    g_clear_object (&self->connection_manager);
+    G_OBJECT_CLASS (metrics_parent_class)->dispose (obj);
+}
+static void
+metrics_finalize (GObject *obj)
+{
+    Metrics *self = METRICS (obj);
+
+    g_clear_pointer (&self->commands, g_hash_table_unref);
+    g_clear_pointer (&self->command_durations, g_hash_table_unref);
+    g_clear_pointer (&self->uid_usage, g_hash_table_unref);
+    g_clear_pointer (&self->cgroup_usage, g_hash_table_unref);
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (metrics_parent_class)->finalize (obj);
+}
+static void
+metrics_init (Metrics *self)
+{
+    g_mutex_init (&self->mutex);
+    self->commands = g_hash_table_new_full (g_direct_hash,
+                                            g_direct_equal,
+                                            NULL,
+                                            g_free);
+    self->command_durations = g_hash_table_new_full (g_direct_hash,
+                                                     g_direct_equal,
+                                                     NULL,
+                                                     g_free);
+    self->queues = g_ptr_array_new_with_free_func (metrics_queue_free);
+    self->uid_usage = g_hash_table_new_full (g_direct_hash,
+                                             g_direct_equal,
+                                             NULL,
+                                             g_free);
+    self->cgroup_usage = g_hash_table_new_full (g_str_hash,
+                                                g_str_equal,
+                                                g_free,
+                                                g_free);
+}
+static void
+metrics_class_init (MetricsClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (metrics_parent_class == NULL)
+        metrics_parent_class = g_type_class_peek_parent (klass);
+    object_class->dispose  = metrics_dispose;
+    object_class->finalize = metrics_finalize;
+}
+/*
+ * Allocate a new Metrics object. The caller owns the returned reference.
+ */
+Metrics*
+metrics_new (void)
+{
+    return METRICS (g_object_new (TYPE_METRICS, NULL));
+}
+/*
+ * The recording functions below accept a NULL Metrics so that objects
+ * created without one don't have to check before every call.
+ */
+void
+metrics_count (Metrics        *metrics,
+               MetricsCounter  counter)
+{
+    if (metrics == NULL) {
+        return;
+    }
+    g_assert (counter < METRICS_COUNTER_COUNT);
+    g_mutex_lock (&metrics->mutex);
+    ++metrics->counters [counter];
+    g_mutex_unlock (&metrics->mutex);
+}
+/*
+ * Count a command processed by the resource manager.
+ */
+void
+metrics_count_command (Metrics *metrics,
+                       TPM2_CC  command_code)
+{
+    guint64 *count;
+
+    if (metrics == NULL) {
+        return;
+    }
+    g_mutex_lock (&metrics->mutex);
+    count = g_hash_table_lookup (metrics->commands,
+                                 GUINT_TO_POINTER (command_code));
+    if (count == NULL) {
+        count = g_new0 (guint64, 1);
+        g_hash_table_insert (metrics->commands,
+                             GUINT_TO_POINTER (command_code),
+                             count);
+    }
+    ++*count;
+    g_mutex_unlock (&metrics->mutex);
+}
+/*
+ * Add a duration in microseconds to 'hist'. Negative durations (the clock
+ * is monotonic so these shouldn't happen) are recorded as 0. The caller
+ * must hold the mutex.
+ */
+static void
+metrics_histogram_add (metrics_histogram_t *hist,
+                       gint64               usec)
+{
+    guint i;
+
+    usec = MAX (usec, 0);
+    for (i = 0; i < METRICS_BUCKET_COUNT; ++i) {
+        if (usec <= bucket_bounds [i]) {
+            ++hist->buckets [i];
+            break;
+        }
+    }
+    ++hist->count;
+    hist->sum_usec += (guint64)usec;
+}
+/*
+ * Add a duration in microseconds to a histogram.
+ */
+void
+metrics_observe (Metrics          *metrics,
+                 MetricsHistogram  histogram,
+                 gint64            usec)
+{
+    if (metrics == NULL) {
+        return;
+    }
+    g_assert (histogram < METRICS_HISTOGRAM_COUNT);
+    g_mutex_lock (&metrics->mutex);
+    metrics_histogram_add (&metrics->histograms [histogram], usec);
+    g_mutex_unlock (&metrics->mutex);
+}
+/*
+ * Add the time the TPM took to execute a command to the histogram for its
+ * command code.
+ */
+void
+metrics_observe_command (Metrics *metrics,
+                         TPM2_CC  command_code,
+                         gint64   usec)
+{
+    metrics_histogram_t *hist;
+
+    if (metrics == NULL) {
+        return;
+    }
+    g_mutex_lock (&metrics->mutex);
+    hist = g_hash_table_lookup (metrics->command_durations,
+                                GUINT_TO_POINTER (command_code));
+    if (hist == NULL) {
+        hist = g_new0 (metrics_histogram_t, 1);
+        g_hash_table_insert (metrics->command_durations,
+                             GUINT_TO_POINTER (command_code),
+                             hist);
+    }
+    metrics_histogram_add (hist, usec);
+    g_mutex_unlock (&metrics->mutex);
+}
+/*
+ * Add a command to the usage of the UID or cgroup 'key' in 'table'. A new
+ * key is inserted as a copy if 'copy_key' is set: it's a string then.
+ */
+static void
+metrics_usage_add (GHashTable  *table,
+                   gpointer     key,
+                   gboolean     copy_key,
+                   gint64       tpm_usec,
+                   gint64       context_usec)
+{
+    metrics_usage_t *usage;
+
+    usage = g_hash_table_lookup (table, key);
+    if (usage == NULL) {
+        usage = g_new0 (metrics_usage_t, 1);
+        g_hash_table_insert (table,
+                             copy_key ? g_strdup (key) : key,
+                             usage);
+    }
+    ++usage->commands;
+    usage->tpm_usec += (guint64)MAX (tpm_usec, 0);
+    usage->context_usec += (guint64)MAX (context_usec, 0);
+}
+/*
+ * Account a command from 'connection' that took 'tpm_usec' in the TPM and
+ * 'context_usec' of context management to the UID and cgroup of the
+ * client. The totals outlive the connection.
+ */
+void
+metrics_account_usage (Metrics    *metrics,
+                       Connection *connection,
+                       gint64      tpm_usec,
+                       gint64      context_usec)
+{
+    const gchar *cgroup;
+
+    if (metrics == NULL) {
+        return;
+    }
+    cgroup = connection_get_cgroup (connection);
+    g_mutex_lock (&metrics->mutex);
+    metrics_usage_add (metrics->uid_usage,
+                       GUINT_TO_POINTER (connection_get_uid (connection)),
+                       FALSE,
+                       tpm_usec,
+                       context_usec);
+    if (cgroup != NULL) {
+        if (g_hash_table_size (metrics->cgroup_usage) >= METRICS_CGROUPS_MAX &&
+            !g_hash_table_contains (metrics->cgroup_usage, cgroup))
+        {
+            cgroup = METRICS_CGROUP_OTHER;
+        }
+        metrics_usage_add (metrics->cgroup_usage,
+                           (gpointer)cgroup,
+                           TRUE,
+                           tpm_usec,
+                           context_usec);
+    }
+    g_mutex_unlock (&metrics->mutex);
+}
+/*
+ * CPU time used by the calling thread in microseconds.
+ */
+static gint64
+metrics_thread_cpu_usec (void)
+{
+    struct timespec ts;
+
+    if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+/*
+ * Start timing a run of a stage on the calling thread. Every span begun
+ * must be ended by metrics_span_end on the same thread, innermost first.
+ */
+void
+metrics_span_begin (metrics_span_t *span)
+{
+    g_assert (span != NULL);
+    span->parent = g_private_get (&metrics_span_key);
+    span->nested_wall = 0;
+    span->nested_cpu = 0;
+    g_private_set (&metrics_span_key, span);
+    span->wall = g_get_monotonic_time ();
+    span->cpu = metrics_thread_cpu_usec ();
+}
+/*
+ * Add the time since metrics_span_begin, less that of the spans nested in
+ * it, to 'stage'. The span is ended even if 'metrics' is NULL.
+ */
+void
+metrics_span_end (Metrics        *metrics,
+                  MetricsStage    stage,
+                  metrics_span_t *span)
+{
+    gint64 wall, cpu;
+
+    g_assert (span != NULL);
+    g_assert (stage < METRICS_STAGE_COUNT);
+    wall = MAX (g_get_monotonic_time () - span->wall, 0);
+    cpu = MAX (metrics_thread_cpu_usec () - span->cpu, 0);
+    if (span->parent != NULL) {
+        span->parent->nested_wall += wall;
+        span->parent->nested_cpu += cpu;
+    }
+    g_private_set (&metrics_span_key, span->parent);
+    if (metrics == NULL) {
+        return;
+    }
+    g_mutex_lock (&metrics->mutex);
+    ++metrics->stages [stage].count;
+    metrics->stages [stage].wall_usec += (guint64)MAX (wall - span->nested_wall, 0);
+    metrics->stages [stage].cpu_usec += (guint64)MAX (cpu - span->nested_cpu, 0);
+    g_mutex_unlock (&metrics->mutex);
+}
+/*
+ * Report the depth of 'queue' as the tabrmd_queue_depth gauge with the
+ * provided queue name and TPM index as labels. The Metrics object takes a
+ * reference to the queue.
+ */
+void
+metrics_add_queue (Metrics      *metrics,
+                   const gchar  *name,
+                   guint         tpm,
+                   MessageQueue *queue)
+{
+    metrics_queue_t *entry;
+
+    g_assert (metrics != NULL);
+    g_assert (name != NULL);
+    g_assert (queue != NULL);
+    entry = g_new0 (metrics_queue_t, 1);
+    entry->name = g_strdup (name);
+    entry->tpm = tpm;
+    entry->queue = MESSAGE_QUEUE (g_object_ref (queue));
+    g_mutex_lock (&metrics->mutex);
+    g_ptr_array_add (metrics->queues, entry);
+    g_mutex_unlock (&metrics->mutex);
+}
+/*
+ * Report the number of connections held by 'manager'.
+ */
+void
+metrics_set_connection_manager (Metrics           *metrics,
+                                ConnectionManager *manager)
+{
+    g_assert (metrics != NULL);
+    g_mutex_lock (&metrics->mutex);
+    g_clear_object (&metrics->connection_manager);
+    if (manager != NULL) {
+        metrics->connection_manager = g_object_ref (manager);
+    }
+    g_mutex_unlock (&metrics->mutex);
+}
+/*
+ * Record a TPM entering ('degraded' TRUE) or leaving degraded mode: the
+ * tabrmd_tpms_degraded gauge counts those in it, entries are counted in
+ * METRICS_TPM_DEGRADED.
+ */
+void
+metrics_set_degraded (Metrics  *metrics,
+                      gboolean  degraded)
+{
+    if (metrics == NULL) {
+        return;
+    }
+    g_atomic_int_add (&metrics->tpms_degraded, degraded ? 1 : -1);
+    if (degraded) {
+        metrics_count (metrics, METRICS_TPM_DEGRADED);
+    }
+}
+/*
+ * Append a duration in microseconds to 'str' in seconds.
+ */
+static void
+metrics_append_seconds (GString *str,
+                        guint64  usec)
+{
+    g_string_append_printf (str, "%" PRIu64 ".%06" PRIu64,
+                            usec / G_USEC_PER_SEC, usec % G_USEC_PER_SEC);
+}
+static void
+metrics_append_header (GString     *str,
+                       const gchar *name,
+                       const gchar *help,
+                       const gchar *type)
+{
+    g_string_append_printf (str, "# HELP %s %s\n# TYPE %s %s\n",
+                            name, help, name, type);
+}
+/*
+ * Append the samples of 'hist'. 'labels' is added to each sample and may
+ * be empty.
+ */
+static void
+metrics_append_histogram (GString             *str,
+                          const gchar         *name,
+                          const gchar         *labels,
+                          metrics_histogram_t *hist)
+{
+    const gchar *sep = labels [0] != '\0' ? "," : "";
+    guint64 cumulative = 0;
+    guint i;
+
+    for (i = 0; i < METRICS_BUCKET_COUNT; ++i) {
+        cumulative += hist->buckets [i];
+        g_string_append_printf (str, "%s_bucket{%s%sle=\"%s\"} %" PRIu64 "\n",
+                                name, labels, sep, bucket_labels [i], cumulative);
+    }
+    g_string_append_printf (str, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n",
+                            name, labels, sep, hist->count);
+    if (labels [0] != '\0') {
+        g_string_append_printf (str, "%s_sum{%s} ", name, labels);
+    } else {
+        g_string_append_printf (str, "%s_sum ", name);
+    }
+    metrics_append_seconds (str, hist->sum_usec);
+    if (labels [0] != '\0') {
+        g_string_append_printf (str, "\n%s_count{%s} %" PRIu64 "\n",
+                                name, labels, hist->count);
+    } else {
+        g_string_append_printf (str, "\n%s_count %" PRIu64 "\n",
+                                name, hist->count);
+    }
+}
+static gint
+command_code_compare (gconstpointer a,
+                      gconstpointer b)
+{
+    guint cc_a = GPOINTER_TO_UINT (a), cc_b = GPOINTER_TO_UINT (b);
+
+    return cc_a < cc_b ? -1 : cc_a > cc_b;
+}
+/*
+ * Return the current metrics in the Prometheus text exposition format
+ * (version 0.0.4). The caller must g_free the returned string.
+ */
+gchar*
+metrics_format (Metrics *metrics)
+{
+    GString *str = g_string_new (NULL);
+    metrics_queue_t *entry;
+    GList *codes, *item;
+    guint i;
+
+    g_assert (metrics != NULL);
+    g_mutex_lock (&metrics->mutex);
+    metrics_append_header (str, "tabrmd_queue_depth",
+                           "Messages waiting in a pipeline queue.", "gauge");
+    for (i = 0; i < metrics->queues->len; ++i) {
+        entry = g_ptr_array_index (metrics->queues, i);
+        g_string_append_printf (str,
+                                "tabrmd_queue_depth{queue=\"%s\",tpm=\"%u\"} %u\n",
+                                entry->name, entry->tpm,
+                                message_queue_get_length (entry->queue));
+    }
+    if (metrics->connection_manager != NULL) {
+        metrics_append_header (str, "tabrmd_connections",
+                               "Active client connections.", "gauge");
+        g_string_append_printf (str, "tabrmd_connections %u\n",
+            connection_manager_size (metrics->connection_manager));
+    }
+    metrics_append_header (str, "tabrmd_tpms_degraded",
+                           "TPMs in degraded mode.", "gauge");
+    g_string_append_printf (str, "tabrmd_tpms_degraded %d\n",
+                            g_atomic_int_get (&metrics->tpms_degraded));
+    metrics_append_header (str, "tabrmd_memory_bytes",
+                           "Bytes held for clients by kind.", "gauge");
+    for (i = 0; i < MEM_ACCOUNT_COUNT; ++i) {
+        g_string_append_printf (str, "tabrmd_memory_bytes{kind=\"%s\"} %zu\n",
+                                mem_account_kind_name ((MemAccountKind)i),
+                                mem_account_get ((MemAccountKind)i));
+    }
+#ifdef ENABLE_ALLOC_STATS
+    metrics_append_header (str, "tabrmd_allocations_total",
+                           "Allocations made by subsystem.", "counter");
+    for (i = 0; i < ALLOC_STATS_COUNT; ++i) {
+        g_string_append_printf (str,
+                                "tabrmd_allocations_total{subsystem=\"%s\"} %" PRIu64 "\n",
+                                alloc_stats_kind_name ((AllocStatsKind)i),
+                                alloc_stats_get_count ((AllocStatsKind)i));
+    }
+    metrics_append_header (str, "tabrmd_allocated_bytes_total",
+                           "Bytes allocated by subsystem.", "counter");
+    for (i = 0; i < ALLOC_STATS_COUNT; ++i) {
+        g_string_append_printf (str,
+                                "tabrmd_allocated_bytes_total{subsystem=\"%s\"} %" PRIu64 "\n",
+                                alloc_stats_kind_name ((AllocStatsKind)i),
+                                alloc_stats_get_bytes ((AllocStatsKind)i));
+    }
+#endif
+    metrics_append_header (str, "tabrmd_commands_total",
+                           "Commands processed by command code.", "counter");
+    codes = g_list_sort (g_hash_table_get_keys (metrics->commands),
+                         command_code_compare);
+    for (item = codes; item != NULL; item = item->next) {
+        g_string_append_printf (str,
+            "tabrmd_commands_total{command_code=\"0x%08" PRIx32 "\"} %" PRIu64 "\n",
+            (guint32)GPOINTER_TO_UINT (item->data),
+            *(guint64*)g_hash_table_lookup (metrics->commands, item->data));
+    }
+    g_list_free (codes);
+    for (i = 0; i < METRICS_COUNTER_COUNT; ++i) {
+        metrics_append_header (str, counter_info [i].name,
+                               counter_info [i].help, "counter");
+        g_string_append_printf (str, "%s %" PRIu64 "\n",
+                                counter_info [i].name, metrics->counters [i]);
+    }
+    for (i = 0; i < METRICS_HISTOGRAM_COUNT; ++i) {
+        metrics_append_header (str, histogram_info [i].name,
+                               histogram_info [i].help, "histogram");
+        metrics_append_histogram (str, histogram_info [i].name, "",
+                                  &metrics->histograms [i]);
+    }
+    metrics_append_header (str, "tabrmd_stage_runs_total",
+                           "Runs of each pipeline stage.", "counter");
+    for (i = 0; i < METRICS_STAGE_COUNT; ++i) {
+        g_string_append_printf (str,
+                                "tabrmd_stage_runs_total{stage=\"%s\"} %" PRIu64 "\n",
+                                stage_names [i], metrics->stages [i].count);
+    }
+    metrics_append_header (str, "tabrmd_stage_cpu_seconds_total",
+                           "Thread CPU time used by each pipeline stage, nested stages excluded.",
+                           "counter");
+    for (i = 0; i < METRICS_STAGE_COUNT; ++i) {
+        g_string_append_printf (str, "tabrmd_stage_cpu_seconds_total{stage=\"%s\"} ",
+                                stage_names [i]);
+        metrics_append_seconds (str, metrics->stages [i].cpu_usec);
+        g_string_append_c (str, '\n');
+    }
+    metrics_append_header (str, "tabrmd_stage_wall_seconds_total",
+                           "Wall time spent in each pipeline stage, nested stages excluded.",
+                           "counter");
+    for (i = 0; i < METRICS_STAGE_COUNT; ++i) {
+        g_string_append_printf (str, "tabrmd_stage_wall_seconds_total{stage=\"%s\"} ",
+                                stage_names [i]);
+        metrics_append_seconds (str, metrics->stages [i].wall_usec);
+        g_string_append_c (str, '\n');
+    }
+    metrics_append_header (str, "tabrmd_command_code_duration_seconds",
+                           "Time spent in the TPM by command code.",
+                           "histogram");
+    codes = g_list_sort (g_hash_table_get_keys (metrics->command_durations),
+                         command_code_compare);
+    for (item = codes; item != NULL; item = item->next) {
+        gchar labels [32];
+
+        g_snprintf (labels, sizeof (labels), "command_code=\"0x%08" PRIx32 "\"",
+                    (guint32)GPOINTER_TO_UINT (item->data));
+        metrics_append_histogram (str, "tabrmd_command_code_duration_seconds",
+                                  labels,
+                                  g_hash_table_lookup (metrics->command_durations,
+                                                       item->data));
+    }
+    g_list_free (codes);
+    g_mutex_unlock (&metrics->mutex);
+    return g_string_free (str, FALSE);
+}
+/*
+ * Return the current counters as a floating GVariant of type a{sv}:
+ * "commands" maps command codes to the number processed, "queues" holds
+ * the name, TPM and depth of each queue, "stages" holds the name, runs,
+ * CPU usec and wall usec of each pipeline stage, "uids" and "cgroups" map
+ * UIDs and cgroup paths to the commands, TPM usec and context management
+ * usec of their clients, see metrics_account_usage, and the counters are
+ * keyed by their 'stats' name. Built with --enable-alloc-stats, "allocations"
+ * holds the subsystem name, allocations and bytes of each subsystem. This is what the D-Bus GetStats method returns.
+ */
+GVariant*
+metrics_get_stats (Metrics *metrics)
+{
+    GVariantBuilder builder, commands, queues, stages, uids, cgroups;
+#ifdef ENABLE_ALLOC_STATS
+    GVariantBuilder allocations;
+#endif
+    GHashTableIter iter;
+    metrics_queue_t *entry;
+    metrics_usage_t *usage;
+    gpointer key, value;
+    guint i;
+
+    g_assert (metrics != NULL);
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_init (&commands, G_VARIANT_TYPE ("a{ut}"));
+    g_variant_builder_init (&queues, G_VARIANT_TYPE ("a(suu)"));
+    g_variant_builder_init (&stages, G_VARIANT_TYPE ("a(sttt)"));
+    g_variant_builder_init (&uids, G_VARIANT_TYPE ("a{u(ttt)}"));
+    g_variant_builder_init (&cgroups, G_VARIANT_TYPE ("a{s(ttt)}"));
+    g_mutex_lock (&metrics->mutex);
+    g_hash_table_iter_init (&iter, metrics->commands);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        g_variant_builder_add (&commands, "{ut}",
+                               (guint32)GPOINTER_TO_UINT (key),
+                               *(guint64*)value);
+    }
+    g_hash_table_iter_init (&iter, metrics->uid_usage);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        usage = (metrics_usage_t*)value;
+        g_variant_builder_add (&uids, "{u(ttt)}",
+                               (guint32)GPOINTER_TO_UINT (key),
+                               usage->commands,
+                               usage->tpm_usec,
+                               usage->context_usec);
+    }
+    g_hash_table_iter_init (&iter, metrics->cgroup_usage);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        usage = (metrics_usage_t*)value;
+        g_variant_builder_add (&cgroups, "{s(ttt)}",
+                               (const gchar*)key,
+                               usage->commands,
+                               usage->tpm_usec,
+                               usage->context_usec);
+    }
+    for (i = 0; i < metrics->queues->len; ++i) {
+        entry = g_ptr_array_index (metrics->queues, i);
+        g_variant_builder_add (&queues, "(suu)",
+                               entry->name,
+                               entry->tpm,
+                               message_queue_get_length (entry->queue));
+    }
+    for (i = 0; i < METRICS_STAGE_COUNT; ++i) {
+        g_variant_builder_add (&stages, "(sttt)",
+                               stage_names [i],
+                               metrics->stages [i].count,
+                               metrics->stages [i].cpu_usec,
+                               metrics->stages [i].wall_usec);
+    }
+    for (i = 0; i < METRICS_COUNTER_COUNT; ++i) {
+        g_variant_builder_add (&builder, "{sv}", counter_info [i].stats,
+                               g_variant_new_uint64 (metrics->counters [i]));
+    }
+    if (metrics->connection_manager != NULL) {
+        g_variant_builder_add (&builder, "{sv}", "connections",
+            g_variant_new_uint32 (connection_manager_size (metrics->connection_manager)));
+    }
+    g_variant_builder_add (&builder, "{sv}", "tpms_degraded",
+        g_variant_new_uint32 ((guint32)g_atomic_int_get (&metrics->tpms_degraded)));
+    g_mutex_unlock (&metrics->mutex);
+    g_variant_builder_add (&builder, "{sv}", "commands",
+                           g_variant_builder_end (&commands));
+    g_variant_builder_add (&builder, "{sv}", "queues",
+                           g_variant_builder_end (&queues));
+    g_variant_builder_add (&builder, "{sv}", "stages",
+                           g_variant_builder_end (&stages));
+    g_variant_builder_add (&builder, "{sv}", "uids",
+                           g_variant_builder_end (&uids));
+    g_variant_builder_add (&builder, "{sv}", "cgroups",
+                           g_variant_builder_end (&cgroups));
+#ifdef ENABLE_ALLOC_STATS
+    g_variant_builder_init (&allocations, G_VARIANT_TYPE ("a(stt)"));
+    for (i = 0; i < ALLOC_STATS_COUNT; ++i) {
+        g_variant_builder_add (&allocations, "(stt)",
+                               alloc_stats_kind_name ((AllocStatsKind)i),
+                               alloc_stats_get_count ((AllocStatsKind)i),
+                               alloc_stats_get_bytes ((AllocStatsKind)i));
+    }
+    g_variant_builder_add (&builder, "{sv}", "allocations",
+                           g_variant_builder_end (&allocations));
+#endif
+    return g_variant_builder_end (&builder);
+}
+/*
+ * Handler for the GThreadedSocketService 'run' signal. This is a minimal
+ * HTTP/1.0 server: whatever the request, once its header has been read (or
+ * the client stops sending) the reply is the current metrics.
+ */
+static gboolean
+metrics_handle_connection (GThreadedSocketService *service,
+                           GSocketConnection      *connection,
+                           GObject                *source_object,
+                           gpointer                user_data)
+{
+    Metrics *self = METRICS (user_data);
+    GInputStream *input;
+    GOutputStream *output;
+    gchar request [METRICS_REQUEST_MAX] = { 0, };
+    gsize size = 0;
+    gssize ret;
+    gchar *body, *reply;
+
+    UNUSED_PARAM (service);
+    UNUSED_PARAM (source_object);
+    g_socket_set_timeout (g_socket_connection_get_socket (connection),
+                          METRICS_TIMEOUT);
+    input = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+    output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+    while (size < sizeof (request) - 1 &&
+           strstr (request, "\r\n\r\n") == NULL &&
+           strstr (request, "\n\n") == NULL)
+    {
+        ret = g_input_stream_read (input,
+                                   &request [size],
+                                   sizeof (request) - 1 - size,
+                                   NULL,
+                                   NULL);
+        if (ret <= 0) {
+            break;
+        }
+        size += (gsize)ret;
+    }
+    body = metrics_format (self);
+    reply = g_strdup_printf ("HTTP/1.0 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\n"
+                             "Connection: close\r\n"
+                             "\r\n"
+                             "%s",
+                             strlen (body), body);
+    if (!g_output_stream_write_all (output, reply, strlen (reply),
+                                    NULL, NULL, NULL))
+    {
+        g_debug ("%s: failed to write metrics to client", __func__);
+    }
+    g_free (reply);
+    g_free (body);
+    return TRUE;
+}
+/*
+ * Serve the metrics on a UNIX socket at 'path'. A socket left behind at
+ * 'path' by a previous instance is removed first; any other kind of file is
+ * left alone and the bind will fail. Requests are handled in threads owned
+ * by the GThreadedSocketService while the accept source is dispatched by
+ * the default GMainContext.
+ */
+gboolean
+metrics_listen (Metrics     *metrics,
+                const gchar *path,
+                GError     **error)
+{
+    GSocketAddress *address;
+    GStatBuf stat_buf;
+    gboolean ret;
+
+    g_assert (metrics != NULL);
+    g_assert (path != NULL);
+    g_assert (metrics->service == NULL);
+    if (g_lstat (path, &stat_buf) == 0 && S_ISSOCK (stat_buf.st_mode)) {
+        g_debug ("%s: removing stale socket %s", __func__, path);
+        g_unlink (path);
+    }
+    metrics->service = g_threaded_socket_service_new (METRICS_THREADS_MAX);
+    address = g_unix_socket_address_new (path);
+    ret = g_socket_listener_add_address (G_SOCKET_LISTENER (metrics->service),
+                                         address,
+                                         G_SOCKET_TYPE_STREAM,
+                                         G_SOCKET_PROTOCOL_DEFAULT,
+                                         NULL,
+                                         NULL,
+                                         error);
+    g_object_unref (address);
+    if (!ret) {
+        g_clear_object (&metrics->service);
+        return FALSE;
+    }
+    metrics->socket_path = g_strdup (path);
+    g_signal_connect (metrics->service,
+                      "run",
+                      G_CALLBACK (metrics_handle_connection),
+                      metrics);
+    g_socket_service_start (metrics->service);
+    g_info ("serving metrics on %s", path);
+    return TRUE;
+}
@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "connection-manager.h"
+#include "message-queue.h"
+
+G_BEGIN_DECLS
+
+/* events counted by the Metrics object */
+typedef enum {
+    METRICS_CONTEXT_LOAD = 0,
+    METRICS_CONTEXT_SAVE,
+    METRICS_CONTEXT_FLUSH,
+    METRICS_CONTEXT_GAP_REGAP,
+    METRICS_CONTEXT_GAP_IDLE_REGAP,
+    METRICS_TPM_RETRY,
+    METRICS_COMMAND_REJECTED,
+    METRICS_LOCALITY_SWITCH,
+    METRICS_CACHE_HIT,
+    METRICS_CACHE_MISS,
+    METRICS_CANARY_FAILURE,
+    METRICS_TPM_DEGRADED,
+    METRICS_COMMAND_SHED,
+    METRICS_MEMORY_EVICTION,
+    METRICS_COMMAND_COALESCED,
+    METRICS_COMMAND_EXPIRED,
+    METRICS_TPM_TIMEOUT,
+    METRICS_COUNTER_COUNT,
+} MetricsCounter;
+
+/* durations observed by the Metrics object */
+typedef enum {
+    METRICS_TPM_LATENCY = 0,
+    METRICS_QUEUE_LATENCY,
+    METRICS_CONNECT_LATENCY,
+    METRICS_CONNECT_PID_LATENCY,
+    METRICS_CONNECT_INSERT_LATENCY,
+    METRICS_CONNECT_WATCH_LATENCY,
+    METRICS_DISCONNECT_LATENCY,
+    METRICS_CANARY_LATENCY,
+    METRICS_CANARY_TPM_LATENCY,
+    METRICS_REGAP_LATENCY,
+    METRICS_HISTOGRAM_COUNT,
+} MetricsHistogram;
+
+/*
+ * Pipeline stages whose CPU and wall time are accounted. The time of a
+ * stage excludes the stages nested in it on the same thread, so the time
+ * spent in the TPM isn't counted again in the virtualization around it.
+ */
+typedef enum {
+    METRICS_STAGE_READ = 0,
+    METRICS_STAGE_VIRTUALIZE,
+    METRICS_STAGE_TPM,
+    METRICS_STAGE_CONTEXT,
+    METRICS_STAGE_WRITE,
+    METRICS_STAGE_COUNT,
+} MetricsStage;
+
+/* number of finite histogram buckets, see metrics.c for their bounds */
+#define METRICS_BUCKET_COUNT 10
+/* threads serving metrics requests */
+#define METRICS_THREADS_MAX 2
+/* seconds a metrics client has to send its request */
+#define METRICS_TIMEOUT 5
+#define METRICS_REQUEST_MAX 4096
+/*
+ * cgroups TPM time is accounted to separately, the time of those past it
+ * goes to METRICS_CGROUP_OTHER
+ */
+#define METRICS_CGROUPS_MAX  1024
+#define METRICS_CGROUP_OTHER "other"
+
+typedef struct {
+    /* observations that fell in each bucket, not cumulative */
+    guint64           buckets [METRICS_BUCKET_COUNT];
+    guint64           count;
+    guint64           sum_usec;
+} metrics_histogram_t;
+
+typedef struct {
+    guint64           count;
+    guint64           cpu_usec;
+    guint64           wall_usec;
+} metrics_stage_t;
+
+/* what the commands of a UID or cgroup cost, see metrics_account_usage */
+typedef struct {
+    guint64           commands;
+    /* time the TPM spent executing the commands */
+    guint64           tpm_usec;
+    /* time spent loading, saving and flushing contexts for them */
+    guint64           context_usec;
+} metrics_usage_t;
+
+/*
+ * One run of a stage, on the stack of the thread running it between
+ * metrics_span_begin and metrics_span_end.
+ */
+typedef struct _metrics_span {
+    gint64            wall;
+    gint64            cpu;
+    /* time taken by the spans nested in this one */
+    gint64            nested_wall;
+    gint64            nested_cpu;
+    struct _metrics_span *parent;
+} metrics_span_t;
+
+typedef struct _MetricsClass {
+    GObjectClass      parent;
+} MetricsClass;
+
+typedef struct _Metrics {
+    GObject           parent_instance;
+    GMutex            mutex;
+    /* TPM2_CC -> guint64 number of commands processed */
+    GHashTable       *commands;
+    /* TPM2_CC -> metrics_histogram_t of the time spent in the TPM */
+    GHashTable       *command_durations;
+    guint64           counters [METRICS_COUNTER_COUNT];
+    metrics_histogram_t histograms [METRICS_HISTOGRAM_COUNT];
+    metrics_stage_t   stages [METRICS_STAGE_COUNT];
+    /* metrics_queue_t, one per MessageQueue with a reported depth */
+    GPtrArray        *queues;
+    /* UID -> metrics_usage_t */
+    GHashTable       *uid_usage;
+    /* cgroup path -> metrics_usage_t, up to METRICS_CGROUPS_MAX */
+    GHashTable       *cgroup_usage;
+    ConnectionManager *connection_manager;
+    /* TPMs in degraded mode, updated atomically */
+    gint              tpms_degraded;
+    GSocketService   *service;
+    gchar            *socket_path;
+} Metrics;
+
+#define TYPE_METRICS              (metrics_get_type   ())
+#define METRICS(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_METRICS, Metrics))
+#define METRICS_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_METRICS, MetricsClass))
+#define IS_METRICS(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_METRICS))
+#define IS_METRICS_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_METRICS))
+#define METRICS_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_METRICS, MetricsClass))
+
+GType        metrics_get_type              (void);
+Metrics*     metrics_new                   (void);
+void         metrics_count                 (Metrics           *metrics,
+                                            MetricsCounter     counter);
+void         metrics_count_command         (Metrics           *metrics,
+                                            TPM2_CC            command_code);
+void         metrics_observe               (Metrics           *metrics,
+                                            MetricsHistogram   histogram,
+                                            gint64             usec);
+void         metrics_observe_command       (Metrics           *metrics,
+                                            TPM2_CC            command_code,
+                                            gint64             usec);
+void         metrics_account_usage         (Metrics           *metrics,
+                                            Connection        *connection,
+                                            gint64             tpm_usec,
+                                            gint64             context_usec);
+void         metrics_span_begin            (metrics_span_t    *span);
+void         metrics_span_end              (Metrics           *metrics,
+                                            MetricsStage       stage,
+                                            metrics_span_t    *span);
+void         metrics_add_queue             (Metrics           *metrics,
+                                            const gchar       *name,
+                                            guint              tpm,
+                                            MessageQueue      *queue);
+void         metrics_set_connection_manager (Metrics          *metrics,
+                                            ConnectionManager *manager);
+void         metrics_set_degraded          (Metrics           *metrics,
+                                            gboolean           degraded);
+gchar*       metrics_format                (Metrics           *metrics);
+GVariant*    metrics_get_stats             (Metrics           *metrics);
+gboolean     metrics_listen                (Metrics           *metrics,
+                                            const gchar       *path,
+                                            GError           **error);
+
+G_END_DECLS
+#endif /* METRICS_H */
@@ -0,0 +1,451 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "pcap-writer.h"
+#include "util.h"
+
+G_DEFINE_TYPE (PcapWriter, pcap_writer, G_TYPE_OBJECT);
+
+#define PCAP_PAD4(size) (((size) + 3) & ~(size_t)3)
+
+static void
+pcap_packet_free (pcap_packet_t *packet)
+{
+    g_free (packet->comment);
+    g_free (packet);
+}
+/*
+ * Write 'size' bytes and 'pad' zero bytes after them unless an earlier
+ * write failed.
+ */
+static void
+pcap_write (PcapWriter    *self,
+            gconstpointer  buf,
+            size_t         size,
+            size_t         pad)
+{
+    static const guint8 zeros [4] = { 0 };
+
+    if (self->failed) {
+        return;
+    }
+    if (fwrite (buf, 1, size, self->file) != size ||
+        fwrite (zeros, 1, pad, self->file) != pad)
+    {
+        g_warning ("%s: failed to write capture, stopping: %s",
+                   __func__, strerror (errno));
+        self->failed = TRUE;
+    }
+}
+static void
+pcap_write_u32 (PcapWriter *self,
+                guint32     value)
+{
+    pcap_write (self, &value, sizeof (value), 0);
+}
+/*
+ * Write a pcapng option. 'value' is padded to a multiple of 4 bytes.
+ */
+static void
+pcap_write_option (PcapWriter    *self,
+                   guint16        code,
+                   gconstpointer  value,
+                   size_t         size)
+{
+    guint16 header [2] = { code, (guint16)size };
+
+    pcap_write (self, header, sizeof (header), 0);
+    pcap_write (self, value, size, PCAP_PAD4 (size) - size);
+}
+/*
+ * Write the section header and an interface description per TPM. Blocks
+ * are in host byte order, as the byte order magic tells readers.
+ */
+static void
+pcap_write_header (PcapWriter *self)
+{
+    gchar name [16];
+    guint32 length;
+    gint64 section_length = -1;
+    guint16 version [2] = { 1, 0 };
+    guint16 linktype [2] = { PCAP_LINKTYPE_IPV4, 0 };
+    size_t name_size;
+    guint i;
+
+    length = 28;
+    pcap_write_u32 (self, PCAP_BLOCK_SHB);
+    pcap_write_u32 (self, length);
+    pcap_write_u32 (self, PCAP_BYTE_ORDER);
+    pcap_write (self, version, sizeof (version), 0);
+    pcap_write (self, &section_length, sizeof (section_length), 0);
+    pcap_write_u32 (self, length);
+    for (i = 0; i < self->interfaces; ++i) {
+        g_snprintf (name, sizeof (name), "tpm%u", i);
+        name_size = strlen (name);
+        length = 20 + 4 + PCAP_PAD4 (name_size) + 4;
+        pcap_write_u32 (self, PCAP_BLOCK_IDB);
+        pcap_write_u32 (self, length);
+        pcap_write (self, linktype, sizeof (linktype), 0);
+        pcap_write_u32 (self, 0);
+        pcap_write_option (self, PCAP_OPT_IF_NAME, name, name_size);
+        pcap_write_option (self, PCAP_OPT_END, NULL, 0);
+        pcap_write_u32 (self, length);
+    }
+}
+/*
+ * Put the IPv4 and TCP headers for 'packet' in 'buf'. The command or
+ * response is a segment of the TCP stream between the client port of the
+ * connection and PCAP_TPM_PORT on the loopback address. The TCP checksum
+ * is left at 0, which Wireshark doesn't check by default.
+ */
+static void
+pcap_fill_headers (PcapWriter    *self,
+                   pcap_packet_t *packet,
+                   guint8        *buf)
+{
+    guint16 client_port = (guint16)(packet->connection_id % PCAP_CLIENT_PORTS);
+    pcap_stream_t *stream = &self->streams [client_port];
+    guint16 total = (guint16)(PCAP_HEADERS_SIZE + packet->size);
+    guint16 src_port, dst_port;
+    guint32 seq, ack, sum = 0;
+    guint i;
+
+    client_port += PCAP_CLIENT_PORT;
+    if (packet->response) {
+        src_port = PCAP_TPM_PORT;
+        dst_port = client_port;
+        seq = stream->tpm_seq;
+        ack = stream->client_seq;
+        stream->tpm_seq += (guint32)packet->size;
+    } else {
+        src_port = client_port;
+        dst_port = PCAP_TPM_PORT;
+        seq = stream->client_seq;
+        ack = stream->tpm_seq;
+        stream->client_seq += (guint32)packet->size;
+    }
+    memset (buf, 0, PCAP_HEADERS_SIZE);
+    /* IPv4: version 4, 5 words of header, don't fragment, TTL 64, TCP */
+    buf [0] = 0x45;
+    buf [2] = total >> 8;
+    buf [3] = total & 0xff;
+    buf [6] = 0x40;
+    buf [8] = 64;
+    buf [9] = 6;
+    buf [12] = 127;
+    buf [15] = 1;
+    buf [16] = 127;
+    buf [19] = 1;
+    for (i = 0; i < 20; i += 2) {
+        sum += (guint32)(buf [i] << 8 | buf [i + 1]);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    buf [10] = (guint8)(~sum >> 8);
+    buf [11] = (guint8)~sum;
+    /* TCP: 5 words of header, PSH and ACK */
+    buf [20] = src_port >> 8;
+    buf [21] = src_port & 0xff;
+    buf [22] = dst_port >> 8;
+    buf [23] = dst_port & 0xff;
+    buf [24] = seq >> 24;
+    buf [25] = (seq >> 16) & 0xff;
+    buf [26] = (seq >> 8) & 0xff;
+    buf [27] = seq & 0xff;
+    buf [28] = ack >> 24;
+    buf [29] = (ack >> 16) & 0xff;
+    buf [30] = (ack >> 8) & 0xff;
+    buf [31] = ack & 0xff;
+    buf [32] = 0x50;
+    buf [33] = 0x18;
+    buf [34] = 0xff;
+    buf [35] = 0xff;
+}
+/*
+ * Write 'packet' as an enhanced packet block, with its comment if it has
+ * one.
+ */
+static void
+pcap_write_packet (PcapWriter    *self,
+                   pcap_packet_t *packet)
+{
+    guint8 headers [PCAP_HEADERS_SIZE];
+    guint32 captured = (guint32)(PCAP_HEADERS_SIZE + packet->size);
+    size_t comment_size = 0;
+    guint32 length;
+
+    pcap_fill_headers (self, packet, headers);
+    length = 28 + PCAP_PAD4 (captured) + 4 + 4;
+    if (packet->comment != NULL) {
+        comment_size = strlen (packet->comment);
+        length += 4 + PCAP_PAD4 (comment_size);
+    }
+    pcap_write_u32 (self, PCAP_BLOCK_EPB);
+    pcap_write_u32 (self, length);
+    pcap_write_u32 (self, packet->interface);
+    pcap_write_u32 (self, (guint32)((guint64)packet->time >> 32));
+    pcap_write_u32 (self, (guint32)packet->time);
+    pcap_write_u32 (self, captured);
+    pcap_write_u32 (self, captured);
+    pcap_write (self, headers, sizeof (headers), 0);
+    pcap_write (self,
+                packet->data,
+                packet->size,
+                PCAP_PAD4 (captured) - captured);
+    if (packet->comment != NULL) {
+        pcap_write_option (self,
+                           PCAP_OPT_COMMENT,
+                           packet->comment,
+                           comment_size);
+    }
+    pcap_write_option (self, PCAP_OPT_END, NULL, 0);
+    pcap_write_u32 (self, length);
+}
+/*
+ * Take the oldest packet from the ring. Only the writer thread takes
+ * packets. Returns NULL if there's none ready.
+ */
+static pcap_packet_t*
+pcap_writer_take (PcapWriter *self)
+{
+    guint tail = (guint)g_atomic_int_get (&self->tail);
+    gpointer *slot = (gpointer*)&self->ring [tail % PCAP_RING_SIZE];
+    pcap_packet_t *packet;
+
+    packet = g_atomic_pointer_get (slot);
+    if (packet == NULL) {
+        return NULL;
+    }
+    g_atomic_pointer_set (slot, NULL);
+    g_atomic_int_set (&self->tail, (gint)(tail + 1));
+    return packet;
+}
+static gboolean
+pcap_writer_ready (PcapWriter *self)
+{
+    guint tail = (guint)g_atomic_int_get (&self->tail);
+
+    return g_atomic_pointer_get (&self->ring [tail % PCAP_RING_SIZE]) != NULL;
+}
+/*
+ * GThreadFunc writing the packets from the ring until the PcapWriter is
+ * disposed. The file is flushed whenever the ring runs empty so that the
+ * capture can be read while the daemon runs.
+ */
+static gpointer
+pcap_writer_thread (gpointer user_data)
+{
+    PcapWriter *self = PCAP_WRITER (user_data);
+    pcap_packet_t *packet;
+    guint64 value;
+    gint dropped;
+
+    for (;;) {
+        while ((packet = pcap_writer_take (self)) != NULL) {
+            pcap_write_packet (self, packet);
+            pcap_packet_free (packet);
+        }
+        do {
+            dropped = g_atomic_int_get (&self->dropped);
+        } while (dropped != 0 &&
+                 !g_atomic_int_compare_and_exchange (&self->dropped,
+                                                     dropped,
+                                                     0));
+        if (dropped > 0) {
+            g_warning ("%d packets dropped from the capture", dropped);
+        }
+        if (!self->failed && fflush (self->file) != 0) {
+            g_warning ("%s: failed to write capture, stopping: %s",
+                       __func__, strerror (errno));
+            self->failed = TRUE;
+        }
+        if (g_atomic_int_get (&self->stop)) {
+            break;
+        }
+        /* a packet put after this is seen or wakes us up */
+        g_atomic_int_set (&self->sleeping, TRUE);
+        if (pcap_writer_ready (self)) {
+            g_atomic_int_set (&self->sleeping, FALSE);
+            continue;
+        }
+        if (TABRMD_ERRNO_EINTR_RETRY (read (self->wakeup_fd,
+                                            &value,
+                                            sizeof (value))) == -1)
+        {
+            g_atomic_int_set (&self->sleeping, FALSE);
+        }
+    }
+    return NULL;
+}
+static void
+pcap_writer_dispose (GObject *obj)
+{
+    PcapWriter *self = PCAP_WRITER (obj);
+    guint64 value = 1;
+
+    if (self->thread != NULL) {
+        g_atomic_int_set (&self->stop, TRUE);
+        TABRMD_ERRNO_EINTR_RETRY (write (self->wakeup_fd,
+                                         &value,
+                                         sizeof (value)));
+        g_thread_join (self->thread);
+        self->thread = NULL;
+    }
+    G_OBJECT_CLASS (pcap_writer_parent_class)->dispose (obj);
+}
+static void
+pcap_writer_finalize (GObject *obj)
+{
+    PcapWriter *self = PCAP_WRITER (obj);
+    guint i;
+
+    for (i = 0; i < PCAP_RING_SIZE; ++i) {
+        g_clear_pointer (&self->ring [i], pcap_packet_free);
+    }
+    if (self->file != NULL && fclose (self->file) != 0) {
+        g_warning ("%s: failed to close capture: %s",
+                   __func__, strerror (errno));
+    }
+    if (self->wakeup_fd != -1) {
+        close (self->wakeup_fd);
+    }
+    g_free (self->streams);
+    G_OBJECT_CLASS (pcap_writer_parent_class)->finalize (obj);
+}
+static void
+pcap_writer_init (PcapWriter *self)
+{
+    self->wakeup_fd = -1;
+}
+static void
+pcap_writer_class_init (PcapWriterClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (pcap_writer_parent_class == NULL)
+        pcap_writer_parent_class = g_type_class_peek_parent (klass);
+    object_class->dispose = pcap_writer_dispose;
+    object_class->finalize = pcap_writer_finalize;
+}
+/*
+ * Start a capture in a new file at 'path' with one interface per TPM,
+ * replacing any file there. Like a trace, the capture holds what clients
+ * send so only the daemon's user may read it. The caller owns the
+ * returned reference.
+ * Returns NULL if the file can't be written or the writer thread started.
+ */
+PcapWriter*
+pcap_writer_new (const gchar *path,
+                 guint        interfaces,
+                 GError     **error)
+{
+    PcapWriter *writer;
+    FILE *file;
+    gint fd;
+
+    g_assert (path != NULL);
+    fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to create %s: %s", path, strerror (errno));
+        return NULL;
+    }
+    file = fdopen (fd, "w");
+    if (file == NULL) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to open %s: %s", path, strerror (errno));
+        close (fd);
+        return NULL;
+    }
+    setvbuf (file, NULL, _IOFBF, PCAP_BUF_SIZE);
+    writer = PCAP_WRITER (g_object_new (TYPE_PCAP_WRITER, NULL));
+    writer->file = file;
+    writer->interfaces = interfaces;
+    writer->streams = g_new0 (pcap_stream_t, PCAP_CLIENT_PORTS);
+    pcap_write_header (writer);
+    if (writer->failed || fflush (file) != 0) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to write %s: %s", path, strerror (errno));
+        g_object_unref (writer);
+        return NULL;
+    }
+    writer->wakeup_fd = eventfd (0, EFD_CLOEXEC);
+    if (writer->wakeup_fd == -1) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to create eventfd: %s", strerror (errno));
+        g_object_unref (writer);
+        return NULL;
+    }
+    writer->thread = g_thread_try_new ("tabrmd-pcap",
+                                       pcap_writer_thread,
+                                       writer,
+                                       error);
+    if (writer->thread == NULL) {
+        g_object_unref (writer);
+        return NULL;
+    }
+    g_info ("capturing TPM traffic to %s", path);
+    return writer;
+}
+/*
+ * Hand a command or response sent over 'interface' for the connection
+ * 'connection_id' to the writer thread, with an optional 'comment' that
+ * the writer takes ownership of. This never blocks: if the ring is full
+ * the packet is dropped and counted. It may be called from any thread and
+ * accepts a NULL PcapWriter so that callers don't have to check.
+ * Returns FALSE if the packet was dropped.
+ */
+gboolean
+pcap_writer_put (PcapWriter   *writer,
+                 guint         interface,
+                 guint64       connection_id,
+                 gboolean      response,
+                 const guint8 *buf,
+                 size_t        size,
+                 gchar        *comment)
+{
+    pcap_packet_t *packet;
+    guint head, tail;
+    guint64 value = 1;
+
+    if (writer == NULL) {
+        g_free (comment);
+        return FALSE;
+    }
+    do {
+        head = (guint)g_atomic_int_get (&writer->head);
+        tail = (guint)g_atomic_int_get (&writer->tail);
+        if (head - tail >= PCAP_RING_SIZE) {
+            g_atomic_int_inc (&writer->dropped);
+            g_free (comment);
+            return FALSE;
+        }
+    } while (!g_atomic_int_compare_and_exchange (&writer->head,
+                                                 (gint)head,
+                                                 (gint)(head + 1)));
+    size = MIN (size, G_MAXUINT16 - PCAP_HEADERS_SIZE);
+    packet = g_malloc (sizeof (*packet) + size);
+    packet->time = g_get_real_time ();
+    packet->connection_id = connection_id;
+    packet->interface = interface;
+    packet->response = response;
+    packet->comment = comment;
+    packet->size = size;
+    memcpy (packet->data, buf, size);
+    g_atomic_pointer_set (&writer->ring [head % PCAP_RING_SIZE], packet);
+    if (g_atomic_int_get (&writer->sleeping) &&
+        g_atomic_int_compare_and_exchange (&writer->sleeping, TRUE, FALSE))
+    {
+        TABRMD_ERRNO_EINTR_RETRY (write (writer->wakeup_fd,
+                                         &value,
+                                         sizeof (value)));
+    }
+    return TRUE;
+}
@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef PCAP_WRITER_H
+#define PCAP_WRITER_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <stdio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Capture of the commands sent to the TPMs and their responses in a
+ * pcapng file for Wireshark. Each TPM is an interface of link type
+ * LINKTYPE_IPV4. Each command and response is a TCP segment between a
+ * port derived from the connection ID and PCAP_TPM_PORT, where Wireshark's
+ * TPM 2.0 dissector looks for it. Packets may carry a comment, used for
+ * the handles as the client sent them.
+ * Callers hand packets to a ring and never wait: a writer thread encodes
+ * them and writes them out through a stdio buffer. Packets that don't fit
+ * in the ring are dropped and counted.
+ */
+#define PCAP_TPM_PORT        2321
+/* connections are mapped onto the dynamic port range */
+#define PCAP_CLIENT_PORT     49152
+#define PCAP_CLIENT_PORTS    16384
+#define PCAP_RING_SIZE       1024
+/* stdio buffer for the capture file */
+#define PCAP_BUF_SIZE        (256 * 1024)
+#define PCAP_LINKTYPE_IPV4   228
+#define PCAP_BLOCK_SHB       0x0a0d0d0a
+#define PCAP_BLOCK_IDB       0x00000001
+#define PCAP_BLOCK_EPB       0x00000006
+#define PCAP_BYTE_ORDER      0x1a2b3c4d
+#define PCAP_OPT_END         0
+#define PCAP_OPT_COMMENT     1
+#define PCAP_OPT_IF_NAME     2
+/* IPv4 and TCP headers in front of each command or response */
+#define PCAP_HEADERS_SIZE    40
+
+typedef struct {
+    gint64      time;
+    guint64     connection_id;
+    guint32     interface;
+    gboolean    response;
+    gchar      *comment;
+    size_t      size;
+    guint8      data [];
+} pcap_packet_t;
+
+/* sequence numbers of the TCP stream for a client port */
+typedef struct {
+    guint32     client_seq;
+    guint32     tpm_seq;
+} pcap_stream_t;
+
+typedef struct _PcapWriterClass {
+    GObjectClass      parent;
+} PcapWriterClass;
+
+typedef struct _PcapWriter {
+    GObject           parent_instance;
+    FILE             *file;
+    guint             interfaces;
+    GThread          *thread;
+    /* packets handed to the writer thread, see pcap_writer_put */
+    pcap_packet_t    *ring [PCAP_RING_SIZE];
+    gint              head;
+    gint              tail;
+    gint              dropped;
+    gint              wakeup_fd;
+    gint              sleeping;
+    gint              stop;
+    /* PCAP_CLIENT_PORTS streams, only used by the writer thread */
+    pcap_stream_t    *streams;
+    /* set once a write failed, packets are discarded from then on */
+    gboolean          failed;
+} PcapWriter;
+
+#define TYPE_PCAP_WRITER              (pcap_writer_get_type   ())
+#define PCAP_WRITER(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_PCAP_WRITER, PcapWriter))
+#define PCAP_WRITER_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_PCAP_WRITER, PcapWriterClass))
+#define IS_PCAP_WRITER(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_PCAP_WRITER))
+#define IS_PCAP_WRITER_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_PCAP_WRITER))
+#define PCAP_WRITER_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_PCAP_WRITER, PcapWriterClass))
+
+GType        pcap_writer_get_type  (void);
+PcapWriter*  pcap_writer_new       (const gchar   *path,
+                                    guint          interfaces,
+                                    GError       **error);
+gboolean     pcap_writer_put       (PcapWriter    *writer,
+                                    guint          interface,
+                                    guint64        connection_id,
+                                    gboolean       response,
+                                    const guint8  *buf,
+                                    size_t         size,
+                                    gchar         *comment);
+
+G_END_DECLS
+#endif /* PCAP_WRITER_H */
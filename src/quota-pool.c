@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+
+#include "quota-pool.h"
+
+G_DEFINE_TYPE (QuotaPool, quota_pool, G_TYPE_OBJECT);
+
+static void
+quota_pool_finalize (GObject *obj)
+{
+    QuotaPool *self = QUOTA_POOL (obj);
+
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (quota_pool_parent_class)->finalize (obj);
+}
+static void
+quota_pool_init (QuotaPool *self)
+{
+    g_mutex_init (&self->mutex);
+}
+static void
+quota_pool_class_init (QuotaPoolClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (quota_pool_parent_class == NULL)
+        quota_pool_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = quota_pool_finalize;
+}
+/*
+ * Allocate a new QuotaPool with headroom for 'transients' transient
+ * objects and 'sessions' sessions. The caller owns the returned reference.
+ */
+QuotaPool*
+quota_pool_new (guint transients,
+                guint sessions)
+{
+    QuotaPool *pool;
+
+    pool = QUOTA_POOL (g_object_new (TYPE_QUOTA_POOL, NULL));
+    pool->headroom [QUOTA_POOL_TRANSIENTS] = transients;
+    pool->headroom [QUOTA_POOL_SESSIONS] = sessions;
+    return pool;
+}
+/*
+ * Lend one slot of 'kind' to a connection that already holds 'held' of
+ * them.
+ * Returns TRUE if the slot was lent, FALSE if the pool is dry or the
+ * connection holds its share of it.
+ */
+gboolean
+quota_pool_borrow (QuotaPool     *pool,
+                   QuotaPoolKind  kind,
+                   guint          held)
+{
+    guint available;
+    gboolean ret = FALSE;
+
+    g_assert (pool != NULL);
+    g_assert (kind < QUOTA_POOL_KIND_COUNT);
+    g_mutex_lock (&pool->mutex);
+    g_assert (held <= pool->borrowed [kind]);
+    /* what's left to this connection once the others' loans are out */
+    available = pool->headroom [kind] - (pool->borrowed [kind] - held);
+    if (pool->borrowed [kind] < pool->headroom [kind] &&
+        held < (available + 1) / 2)
+    {
+        ++pool->borrowed [kind];
+        ret = TRUE;
+    }
+    g_mutex_unlock (&pool->mutex);
+    return ret;
+}
+/*
+ * Give back 'count' slots of 'kind' borrowed with quota_pool_borrow.
+ */
+void
+quota_pool_return (QuotaPool     *pool,
+                   QuotaPoolKind  kind,
+                   guint          count)
+{
+    g_assert (pool != NULL);
+    g_assert (kind < QUOTA_POOL_KIND_COUNT);
+    g_mutex_lock (&pool->mutex);
+    g_assert (count <= pool->borrowed [kind]);
+    pool->borrowed [kind] -= count;
+    g_mutex_unlock (&pool->mutex);
+}
+/*
+ * Return the number of slots of 'kind' lent out.
+ */
+guint
+quota_pool_get_borrowed (QuotaPool     *pool,
+                         QuotaPoolKind  kind)
+{
+    guint count;
+
+    g_assert (pool != NULL);
+    g_assert (kind < QUOTA_POOL_KIND_COUNT);
+    g_mutex_lock (&pool->mutex);
+    count = pool->borrowed [kind];
+    g_mutex_unlock (&pool->mutex);
+    return count;
+}
+/*
+ * Change the headroom for 'kind' to 'headroom'. Slots already lent past a
+ * smaller headroom stay with their connections: no more are lent until
+ * enough of them are given back.
+ */
+void
+quota_pool_set_headroom (QuotaPool     *pool,
+                         QuotaPoolKind  kind,
+                         guint          headroom)
+{
+    g_assert (pool != NULL);
+    g_assert (kind < QUOTA_POOL_KIND_COUNT);
+    g_mutex_lock (&pool->mutex);
+    pool->headroom [kind] = headroom;
+    g_mutex_unlock (&pool->mutex);
+}
@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef QUOTA_POOL_H
+#define QUOTA_POOL_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    QUOTA_POOL_TRANSIENTS = 0,
+    QUOTA_POOL_SESSIONS,
+    QUOTA_POOL_KIND_COUNT,
+} QuotaPoolKind;
+
+typedef struct _QuotaPoolClass {
+    GObjectClass      parent;
+} QuotaPoolClass;
+
+/*
+ * Headroom shared by all connections on top of the transient objects and
+ * sessions each connection is guaranteed. A connection at its guaranteed
+ * number borrows one slot at a time from the pool and gives the slots
+ * back once it holds fewer objects or sessions again, or closes. So that
+ * a single busy client can't drain the pool, a connection may hold at
+ * most half of the headroom the other connections haven't borrowed,
+ * rounded up. The pool is shared by the ResourceManagers of every TPM,
+ * all of it under 'mutex'.
+ */
+typedef struct _QuotaPool {
+    GObject           parent_instance;
+    GMutex            mutex;
+    guint             headroom [QUOTA_POOL_KIND_COUNT];
+    guint             borrowed [QUOTA_POOL_KIND_COUNT];
+} QuotaPool;
+
+#define TYPE_QUOTA_POOL              (quota_pool_get_type   ())
+#define QUOTA_POOL(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_QUOTA_POOL, QuotaPool))
+#define QUOTA_POOL_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_QUOTA_POOL, QuotaPoolClass))
+#define IS_QUOTA_POOL(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_QUOTA_POOL))
+#define IS_QUOTA_POOL_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_QUOTA_POOL))
+#define QUOTA_POOL_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_QUOTA_POOL, QuotaPoolClass))
+
+GType        quota_pool_get_type      (void);
+QuotaPool*   quota_pool_new           (guint          transients,
+                                       guint          sessions);
+gboolean     quota_pool_borrow        (QuotaPool     *pool,
+                                       QuotaPoolKind  kind,
+                                       guint          held);
+void         quota_pool_return        (QuotaPool     *pool,
+                                       QuotaPoolKind  kind,
+                                       guint          count);
+guint        quota_pool_get_borrowed  (QuotaPool     *pool,
+                                       QuotaPoolKind  kind);
+void         quota_pool_set_headroom  (QuotaPool     *pool,
+                                       QuotaPoolKind  kind,
+                                       guint          headroom);
+
+G_END_DECLS
+#endif /* QUOTA_POOL_H */
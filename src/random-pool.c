@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <glib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "random-pool.h"
+#include "util.h"
+
+/*
+ * Keep the pool's memory from reaching a child process: a child gets zeros
+ * with MADV_WIPEONFORK, and nothing mapped with MADV_DONTFORK on kernels
+ * that don't have it. 'wipe_on_fork' is set to tell which one was used.
+ */
+static gboolean
+random_pool_advise (void     *addr,
+                    size_t    size,
+                    gboolean *wipe_on_fork)
+{
+#ifdef MADV_WIPEONFORK
+    if (madvise (addr, size, MADV_WIPEONFORK) == 0) {
+        *wipe_on_fork = TRUE;
+        return TRUE;
+    }
+#endif
+    *wipe_on_fork = FALSE;
+    return madvise (addr, size, MADV_DONTFORK) == 0;
+}
+/*
+ * Create an empty pool of 'size' bytes. The memory is locked so that it's
+ * never swapped, and is either wiped or not mapped at all in a child
+ * after fork.
+ * Returns NULL if the memory can't be mapped or locked.
+ */
+random_pool_t*
+random_pool_new (size_t size)
+{
+    random_pool_t *pool;
+    gboolean wipe_on_fork;
+    void *addr;
+
+    g_assert (size > 0 && size <= RANDOM_POOL_SIZE_MAX);
+    addr = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        g_warning ("%s: mmap failed: %s", __func__, strerror (errno));
+        return NULL;
+    }
+    if (mlock (addr, size) == -1) {
+        g_warning ("%s: mlock failed: %s", __func__, strerror (errno));
+        munmap (addr, size);
+        return NULL;
+    }
+    if (!random_pool_advise (addr, size, &wipe_on_fork)) {
+        g_warning ("%s: madvise failed: %s", __func__, strerror (errno));
+        munlock (addr, size);
+        munmap (addr, size);
+        return NULL;
+    }
+    pool = g_new0 (random_pool_t, 1);
+    pool->data = addr;
+    pool->size = size;
+    pool->pid = getpid ();
+    pool->wipe_on_fork = wipe_on_fork;
+    return pool;
+}
+void
+random_pool_free (random_pool_t *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+    if (pool->data == NULL) {
+        g_free (pool);
+        return;
+    }
+    secure_clear (pool->data, pool->size);
+    munlock (pool->data, pool->size);
+    munmap (pool->data, pool->size);
+    g_free (pool);
+}
+/*
+ * None of the bytes a child inherits from its parent may be handed out:
+ * they're the parent's. The memory is zeroed in the child with
+ * MADV_WIPEONFORK, and isn't mapped at all with MADV_DONTFORK, which
+ * leaves the child without a pool.
+ */
+static void
+random_pool_check_pid (random_pool_t *pool)
+{
+    if (pool->pid == getpid ()) {
+        return;
+    }
+    g_info ("%s: discarding random bytes from the parent process", __func__);
+    pool->pid = getpid ();
+    pool->len = 0;
+    if (!pool->wipe_on_fork) {
+        pool->data = NULL;
+    }
+}
+/*
+ * Discard every byte held by the pool.
+ */
+void
+random_pool_wipe (random_pool_t *pool)
+{
+    g_assert (pool != NULL);
+    random_pool_check_pid (pool);
+    if (pool->data != NULL) {
+        secure_clear (pool->data, pool->len);
+    }
+    pool->len = 0;
+}
+/*
+ * Returns the number of bytes the pool can still take.
+ */
+size_t
+random_pool_space (random_pool_t *pool)
+{
+    g_assert (pool != NULL);
+    random_pool_check_pid (pool);
+    if (pool->data == NULL) {
+        return 0;
+    }
+    return pool->size - pool->len;
+}
+/*
+ * Add up to 'size' bytes from 'buf' to the pool.
+ * Returns the number of bytes added.
+ */
+size_t
+random_pool_fill (random_pool_t *pool,
+                  guint8 const  *buf,
+                  size_t         size)
+{
+    size_t count;
+
+    g_assert (pool != NULL);
+    g_assert (buf != NULL);
+    count = MIN (size, random_pool_space (pool));
+    memcpy (pool->data + pool->len, buf, count);
+    pool->len += count;
+    return count;
+}
+/*
+ * Copy 'size' bytes from the pool to 'buf' and wipe them from the pool so
+ * that they're never handed out again.
+ * Returns FALSE, leaving the pool alone, if it holds fewer than 'size'
+ * bytes.
+ */
+gboolean
+random_pool_take (random_pool_t *pool,
+                  guint8        *buf,
+                  size_t         size)
+{
+    g_assert (pool != NULL);
+    g_assert (buf != NULL);
+    random_pool_check_pid (pool);
+    if (size > pool->len) {
+        return FALSE;
+    }
+    pool->len -= size;
+    memcpy (buf, pool->data + pool->len, size);
+    secure_clear (pool->data + pool->len, size);
+    return TRUE;
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef RANDOM_POOL_H
+#define RANDOM_POOL_H
+
+#include <glib.h>
+#include <sys/types.h>
+
+G_BEGIN_DECLS
+
+/* upper bound on the size of a pool in bytes */
+#define RANDOM_POOL_SIZE_MAX    65536
+/* largest GetRandom request that is answered from the pool */
+#define RANDOM_POOL_REQUEST_MAX 64
+
+/*
+ * Random bytes fetched from the TPM ahead of time. The pool is kept in
+ * locked anonymous memory so that it's never written to swap, and isn't
+ * inherited by a child process. Bytes are handed out once: each take
+ * wipes the bytes it returns from the pool. The pool isn't locked:
+ * callers sharing one must serialize access to it.
+ */
+typedef struct {
+    guint8 *data;
+    size_t  size;
+    /* bytes held, from the start of 'data' */
+    size_t  len;
+    /* process that filled the pool */
+    pid_t   pid;
+    /* FALSE if the memory isn't mapped in a child process */
+    gboolean wipe_on_fork;
+} random_pool_t;
+
+random_pool_t*  random_pool_new    (size_t          size);
+void            random_pool_free   (random_pool_t  *pool);
+size_t          random_pool_space  (random_pool_t  *pool);
+size_t          random_pool_fill   (random_pool_t  *pool,
+                                    guint8 const   *buf,
+                                    size_t          size);
+gboolean        random_pool_take   (random_pool_t  *pool,
+                                    guint8         *buf,
+                                    size_t          size);
+void            random_pool_wipe   (random_pool_t  *pool);
+
+G_END_DECLS
+#endif /* RANDOM_POOL_H */
@@ -17,14 +17,10 @@
 
 G_DEFINE_TYPE (Random, random, G_TYPE_OBJECT);
 
-/*
- * G_DEFINE_TYPE requires an instance init even though we don't need it.
- */
 static void
 random_init (Random *obj)
 {
-    UNUSED_PARAM(obj);
-    /* noop */
+    g_mutex_init (&obj->mutex);
 }
 /*
  * Chain up to parent class finalize.
@@ -33,6 +29,7 @@ static void
 random_finalize (GObject *obj)
 {
     g_debug ("random_finalize");
+    g_mutex_clear (&RANDOM (obj)->mutex);
     G_OBJECT_CLASS (random_parent_class)->finalize (obj);
 }
 
@@ -99,9 +96,11 @@ random_seed_from_file (Random *random,
         ret = -1;
         goto close_out;
     }
+    g_mutex_lock (&random->mutex);
     random->rand_state[0] = 0x330E;
     random->rand_state[1] = rand_seed & 0xffff;
     random->rand_state[2] = (rand_seed >> 16) & 0xffff;
+    g_mutex_unlock (&random->mutex);
 
 close_out:
     if (close (rand_fd) != 0)
@@ -128,10 +127,12 @@ random_get_bytes (Random    *random,
 
     g_assert_nonnull (random);
     assert (random->rand_state);
+    g_mutex_lock (&random->mutex);
     for (i = 0; i < count; ++i) {
         *(&rand[0]) = nrand48 (random->rand_state);
         memcpy (&dest[i], &rand[0], sizeof (uint8_t));
     }
+    g_mutex_unlock (&random->mutex);
     return i;
 }
 /*
@@ -19,6 +19,8 @@ typedef struct _RandomClass {
 
 typedef struct _Random {
     GObject             parent_instance;
+    /* guards rand_state, a Random is shared by the frontends' threads */
+    GMutex              mutex;
     unsigned short      rand_state[3];
 } Random;
 
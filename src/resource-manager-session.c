@@ -24,11 +24,19 @@ load_session (ResourceManager *resmgr,
 {
     Tpm2Command *cmd = NULL;
     Tpm2Response *resp = NULL;
-    size_buf_t *size_buf = NULL;
+    GBytes *context;
+    gsize size;
     TSS2_RC rc = TSS2_RC_SUCCESS;
 
-    size_buf = session_entry_get_context (entry);
-    cmd = tpm2_command_new_context_load (size_buf->buf, size_buf->size);
+    context = session_entry_get_context (entry);
+    if (context == NULL) {
+        g_critical ("%s: SessionEntry has no saved context", __func__);
+        resp = tpm2_response_new_rc (NULL, TSS2_RESMGR_RC_GENERAL_FAILURE);
+        goto out;
+    }
+    cmd = tpm2_command_new_context_load (&resmgr->arena,
+                                         (uint8_t*)g_bytes_get_data (context, &size),
+                                         size);
     if (cmd == NULL) {
         g_critical ("%s: failed to allcoate ContextLoad Tpm2Command",
                     __func__);
@@ -49,6 +57,7 @@ load_session (ResourceManager *resmgr,
         goto out;
     }
     session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+    session_list_mark_loaded (resmgr->session_list, entry);
 out:
     g_clear_object (&cmd);
     return resp;
@@ -101,7 +110,8 @@ save_session (ResourceManager *resmgr,
         resp = tpm2_response_new_rc (NULL, TSS2_RESMGR_RC_GENERAL_FAILURE);
         goto out;
     }
-    cmd = tpm2_command_new_context_save (session_entry_get_handle (entry));
+    cmd = tpm2_command_new_context_save (&resmgr->arena,
+                                         session_entry_get_handle (entry));
     if (cmd == NULL) {
         g_critical ("%s: failed to allocate ContextSave Tpm2Command",
                     __func__);
@@ -125,6 +135,8 @@ save_session (ResourceManager *resmgr,
                                &tpm2_response_get_buffer (resp)[TPM_HEADER_SIZE],
                                tpm2_response_get_size (resp) - TPM_HEADER_SIZE);
     session_entry_set_state (entry, SESSION_ENTRY_SAVED_RM);
+    resmgr->context_counter = MAX (resmgr->context_counter,
+                                   session_entry_get_sequence (entry));
 out:
     g_clear_object (&cmd);
     return resp;
@@ -175,3 +187,71 @@ out:
     g_clear_object (&resp);
     return ret;
 }
+/*
+ * GFunc used to find the saved session with the oldest context.
+ */
+static void
+find_oldest_saved_callback (gpointer data_entry,
+                            gpointer data_user)
+{
+    SessionEntry *entry = SESSION_ENTRY (data_entry);
+    SessionEntry **oldest = (SessionEntry**)data_user;
+    SessionEntryStateEnum state = session_entry_get_state (entry);
+
+    if (state != SESSION_ENTRY_SAVED_CLIENT &&
+        state != SESSION_ENTRY_SAVED_CLIENT_CLOSED &&
+        state != SESSION_ENTRY_SAVED_RM)
+    {
+        return;
+    }
+    if (*oldest == NULL ||
+        session_entry_get_sequence (entry) < session_entry_get_sequence (*oldest))
+    {
+        *oldest = entry;
+    }
+}
+/*
+ * Regap the saved sessions that have fallen far enough behind the TPM's
+ * context counter to risk a TPM2_RC_CONTEXT_GAP, oldest first. This is
+ * called when the ResourceManager is idle so that client commands don't
+ * pay for the regap. It stops as soon as a message is waiting.
+ * Returns the number of sessions regapped.
+ */
+guint
+regap_idle_sessions (ResourceManager *resmgr)
+{
+    SessionEntry *oldest;
+    guint64 threshold;
+    guint count = 0, i, size;
+
+    if (resmgr->context_gap_max == 0) {
+        return 0;
+    }
+    threshold = (guint64)resmgr->context_gap_max *
+                RESOURCE_MANAGER_REGAP_NUMERATOR /
+                RESOURCE_MANAGER_REGAP_DENOMINATOR;
+    size = session_list_size (resmgr->session_list);
+    for (i = 0; i < size; ++i) {
+        if (message_queue_get_length (resmgr->in_queue) > 0) {
+            break;
+        }
+        oldest = NULL;
+        session_list_foreach (resmgr->session_list,
+                              find_oldest_saved_callback,
+                              &oldest);
+        if (oldest == NULL ||
+            resmgr->context_counter - session_entry_get_sequence (oldest) < threshold)
+        {
+            break;
+        }
+        g_debug ("%s: regapping session 0x%08" PRIx32, __func__,
+                 session_entry_get_handle (oldest));
+        g_object_ref (oldest);
+        if (regap_session (resmgr, oldest)) {
+            metrics_count (resmgr->metrics, METRICS_CONTEXT_GAP_IDLE_REGAP);
+            ++count;
+        }
+        g_object_unref (oldest);
+    }
+    return count;
+}
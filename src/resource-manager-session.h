@@ -22,4 +22,6 @@ save_session (ResourceManager *resmgr,
 gboolean
 regap_session (ResourceManager *resmgr,
                SessionEntry *entry);
+guint
+regap_idle_sessions (ResourceManager *resmgr);
 #endif
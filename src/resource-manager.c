@@ -10,10 +10,13 @@
 #include <glib.h>
 
 #include <tss2/tss2_mu.h>
+#include <tss2/tss2_tctildr.h>
 
 #include "connection.h"
 #include "connection-manager.h"
 #include "control-message.h"
+#include "fair-queue.h"
+#include "flight-recorder.h"
 #include "logging.h"
 #include "message-queue.h"
 #include "resource-manager-session.h"
@@ -21,6 +24,7 @@
 #include "sink-interface.h"
 #include "source-interface.h"
 #include "tabrmd.h"
+#include "tabrmd-probes.h"
 #include "tpm2-header.h"
 #include "tpm2-command.h"
 #include "tpm2-response.h"
@@ -66,10 +70,9 @@ resource_manager_virt_to_phys (ResourceManager *resmgr,
                                guint8           handle_number)
 {
     TPM2_HANDLE    phandle = 0;
-    TPMS_CONTEXT *context;
+    GBytes       *context;
     TSS2_RC       rc = TSS2_RC_SUCCESS;
 
-    context = handle_map_entry_get_context (entry);
     if (handle_map_entry_get_phandle(entry)) {
         phandle = handle_map_entry_get_phandle(entry);
         g_debug ("remembered phandle: 0x%" PRIx32, phandle);
@@ -77,6 +80,12 @@ resource_manager_virt_to_phys (ResourceManager *resmgr,
         return TSS2_RC_SUCCESS;
     }
 
+    context = handle_map_entry_get_context (entry);
+    if (context == NULL) {
+        g_warning ("%s: no saved context for vhandle 0x%" PRIx32, __func__,
+                   handle_map_entry_get_vhandle (entry));
+        return TSS2_RESMGR_RC_GENERAL_FAILURE;
+    }
     rc = tpm2_context_load (resmgr->tpm2, context, &phandle);
     g_debug ("loaded phandle: 0x%" PRIx32, phandle);
     if (rc == TSS2_RC_SUCCESS) {
@@ -114,10 +123,17 @@ resource_manager_load_transient (ResourceManager  *resmgr,
         goto out;
     }
     rc = resource_manager_virt_to_phys (resmgr, command, entry, handle_index);
+    while (resource_manager_evict_for_rc (resmgr, rc, *entry_slist, command)) {
+        rc = resource_manager_virt_to_phys (resmgr,
+                                            command,
+                                            entry,
+                                            handle_index);
+    }
     if (rc != TSS2_RC_SUCCESS) {
+        g_object_unref (entry);
         goto out;
     }
-    *entry_slist = g_slist_prepend (*entry_slist, entry);
+    *entry_slist = arena_slist_prepend (&resmgr->arena, *entry_slist, entry);
 out:
     g_object_unref (map);
     return rc;
@@ -149,6 +165,64 @@ regap_session_callback (gpointer data_entry,
                     " SessionEntry", __func__);
     }
 }
+/*
+ * The objects and sessions of a closed connection aren't flushed when the
+ * connection goes away: that would hold up the commands of every other
+ * connection, badly so when many clients exit at once. Their handles are
+ * queued with resource_manager_defer_flush and flushed in one batch when
+ * the TPM is idle or needs the room, whichever comes first.
+ */
+static void
+resource_manager_defer_flush (ResourceManager *resmgr,
+                              TPM2_HANDLE      handle)
+{
+    g_debug ("%s: deferring flush of 0x%08" PRIx32, __func__, handle);
+    g_array_append_val (resmgr->flush_pending, handle);
+}
+/*
+ * Flush the handles queued by resource_manager_defer_flush.
+ * Returns the number of handles that were queued.
+ */
+static guint
+resource_manager_flush_pending (ResourceManager *resmgr)
+{
+    guint count = resmgr->flush_pending->len;
+    size_t done;
+
+    if (count == 0) {
+        return 0;
+    }
+    done = tpm2_context_flush_batch (resmgr->tpm2,
+                                     (TPM2_HANDLE*)resmgr->flush_pending->data,
+                                     count);
+    g_debug ("%s: flushed %zu of %u handles", __func__, done, count);
+    g_array_set_size (resmgr->flush_pending, 0);
+    return count;
+}
+/*
+ * Regap every saved session after TPM2_RC_CONTEXT_GAP. The sweep loads
+ * and saves each of them, holding up the command that got the RC, so its
+ * duration is observed. Returns FALSE if a session failed to regap.
+ */
+static gboolean
+resource_manager_regap_sessions (ResourceManager *resmgr)
+{
+    regap_session_data_t data = {
+        .resmgr = resmgr,
+        .ret = TRUE,
+    };
+    gint64 start = g_get_monotonic_time ();
+
+    metrics_count (resmgr->metrics, METRICS_CONTEXT_GAP_REGAP);
+    /* sessions waiting to be flushed can't be regapped */
+    resource_manager_flush_pending (resmgr);
+    session_list_foreach (resmgr->session_list,
+                          regap_session_callback,
+                          &data);
+    metrics_observe (resmgr->metrics, METRICS_REGAP_LATENCY,
+                     g_get_monotonic_time () - start);
+    return data.ret;
+}
 /*
  * This function is a handler for response codes that we may get from the
  * TPM in response to commands. It may result in addtional commands being
@@ -158,20 +232,13 @@ gboolean
 handle_rc (ResourceManager *resmgr,
            TSS2_RC rc)
 {
-    regap_session_data_t data = {
-        .resmgr = resmgr,
-        .ret = TRUE,
-    };
     gboolean ret;
 
     g_debug ("%s: handling  RC 0x%" PRIx32, __func__, rc);
     switch (rc) {
     case TPM2_RC_CONTEXT_GAP:
         g_debug ("%s: handling TPM2_RC_CONTEXT_GAP", __func__);
-        session_list_foreach (resmgr->session_list,
-                              regap_session_callback,
-                              &data);
-        ret = data.ret;
+        ret = resource_manager_regap_sessions (resmgr);
         break;
     default:
         g_debug ("%s: Unable to recover gracefully from RC 0x%" PRIx32,
@@ -184,19 +251,23 @@ handle_rc (ResourceManager *resmgr,
 }/*
  * This is a somewhat generic function used to load session contexts into
  * the TPM2 device. The ResourceManager uses this function when loading
- * sessions in the handle or auth area of a command. It will refuse to load
- * sessions that:
+ * sessions in the handle or auth area of a command. Sessions that are
+ * still loaded from a previous command are left alone. It will refuse to
+ * load sessions that:
  * - aren't tracked by the ResourceManager (must have SessionEntry in
  *   SessionList)
  * - that were last saved by the client instead of the RM
  * - aren't owned by the Connection object associated with the Tpm2Command
+ * If the TPM has no room for the session, other loaded sessions not used
+ * by the command are saved to make room.
  */
 TSS2_RC
 resource_manager_load_session_from_handle (ResourceManager *resmgr,
-                                           Connection      *command_conn,
+                                           Tpm2Command     *command,
                                            TPM2_HANDLE       handle,
                                            gboolean         will_flush)
 {
+    Connection   *command_conn = NULL;
     Connection   *entry_conn = NULL;
     SessionEntry *session_entry = NULL;
     Tpm2Response *response = NULL;
@@ -212,13 +283,20 @@ resource_manager_load_session_from_handle (ResourceManager *resmgr,
     }
     g_debug ("%s: mapped session handle 0x%08" PRIx32 " to "
              "SessionEntry", __func__, handle);
+    command_conn = tpm2_command_get_connection (command);
     entry_conn = session_entry_get_connection (session_entry);
     if (command_conn != entry_conn) {
         g_warning ("%s: Connection from Tpm2Command and SessionEntry do not "
                    "match. Refusing to load.", __func__);
         goto out;
     }
+    session_entry_set_last_use (session_entry, ++resmgr->use_clock);
     session_entry_state = session_entry_get_state (session_entry);
+    if (session_entry_state == SESSION_ENTRY_LOADED) {
+        g_debug ("%s: session with handle 0x%08" PRIx32 " still loaded",
+                 __func__, handle);
+        goto loaded;
+    }
     if (session_entry_state != SESSION_ENTRY_SAVED_RM) {
         g_warning ("%s: Handle in handle area references SessionEntry "
                    "for session in state \"%s\". Must be in state: "
@@ -228,6 +306,11 @@ resource_manager_load_session_from_handle (ResourceManager *resmgr,
     }
     response = load_session (resmgr, session_entry);
     rc = tpm2_response_get_code (response);
+    while (resource_manager_evict_for_rc (resmgr, rc, NULL, command)) {
+        g_clear_object (&response);
+        response = load_session (resmgr, session_entry);
+        rc = tpm2_response_get_code (response);
+    }
     if (rc != TSS2_RC_SUCCESS) {
         if (handle_rc (resmgr, rc) != TRUE) {
             g_warning ("Failed to load context for session with handle "
@@ -235,6 +318,7 @@ resource_manager_load_session_from_handle (ResourceManager *resmgr,
             flush_session (resmgr, session_entry);
             goto out;
         }
+        g_clear_object (&response);
         response = load_session (resmgr, session_entry);
         rc = tpm2_response_get_code (response);
         if (rc != TSS2_RC_SUCCESS) {
@@ -242,12 +326,14 @@ resource_manager_load_session_from_handle (ResourceManager *resmgr,
             goto out;
         }
     }
+loaded:
     if (will_flush) {
         g_debug ("%s: will_flush: removing SessionEntry from SessionList",
                  __func__);
         session_list_remove (resmgr->session_list, session_entry);
     }
 out:
+    g_clear_object (&command_conn);
     g_clear_object (&entry_conn);
     g_clear_object (&response);
     g_clear_object (&session_entry);
@@ -262,7 +348,6 @@ void
 resource_manager_load_auth_callback (gpointer auth_offset_ptr,
                                      gpointer user_data)
 {
-    Connection *connection = NULL;
     TPM2_HANDLE handle;
     auth_callback_data_t *data = (auth_callback_data_t*)user_data;
     TPMA_SESSION attrs;
@@ -277,9 +362,8 @@ resource_manager_load_auth_callback (gpointer auth_offset_ptr,
         if (attrs & TPMA_SESSION_CONTINUESESSION) {
             will_flush = FALSE;
         }
-        connection = tpm2_command_get_connection (data->command);
         resource_manager_load_session_from_handle (data->resmgr,
-                                                   connection,
+                                                   data->command,
                                                    handle,
                                                    will_flush);
         break;
@@ -288,7 +372,6 @@ resource_manager_load_auth_callback (gpointer auth_offset_ptr,
                  "command auth area: not a session", handle);
         break;
     }
-    g_clear_object (&connection);
 }
 /*
  * This function operates on the provided command. It iterates over each
@@ -300,7 +383,6 @@ resource_manager_load_handles (ResourceManager *resmgr,
                                Tpm2Command     *command,
                                GSList         **loaded_transients)
 {
-    Connection *connection = NULL;
     TSS2_RC       rc = TSS2_RC_SUCCESS;
     TPM2_HANDLE    handles[TPM2_COMMAND_MAX_HANDLES] = { 0, };
     size_t        i, handle_count = TPM2_COMMAND_MAX_HANDLES;
@@ -331,9 +413,8 @@ resource_manager_load_handles (ResourceManager *resmgr,
         case TPM2_HT_POLICY_SESSION:
             g_debug ("processing TPM2_HT_HMAC_SESSION or "
                      "TPM2_HT_POLICY_SESSION: 0x%" PRIx32, handles [i]);
-            connection = tpm2_command_get_connection (command);
             rc = resource_manager_load_session_from_handle (resmgr,
-                                                            connection,
+                                                            command,
                                                             handles [i],
                                                             FALSE);
             break;
@@ -342,7 +423,6 @@ resource_manager_load_handles (ResourceManager *resmgr,
         }
     }
     g_debug ("%s: end", __func__);
-    g_clear_object (&connection);
 
     return rc;
 }
@@ -350,7 +430,8 @@ resource_manager_load_handles (ResourceManager *resmgr,
  * Remove the context associated with the provided HandleMapEntry
  * from the TPM. Only handles in the TRANSIENT range will be flushed.
  * Any entry with a context that's flushed will have the physical handle
- * to 0.
+ * to 0. The context is saved first unless the one saved by an earlier
+ * eviction can be loaded again.
  */
 void
 resource_manager_flushsave_context (gpointer data_entry,
@@ -358,7 +439,7 @@ resource_manager_flushsave_context (gpointer data_entry,
 {
     ResourceManager *resmgr = RESOURCE_MANAGER (data_resmgr);
     HandleMapEntry  *entry  = HANDLE_MAP_ENTRY (data_entry);
-    TPMS_CONTEXT   *context;
+    GBytes          *context = NULL;
     TPM2_HANDLE      phandle;
     TSS2_RC         rc = TSS2_RC_SUCCESS;
 
@@ -374,23 +455,307 @@ resource_manager_flushsave_context (gpointer data_entry,
                 handle_map_entry_get_vhandle (entry));
             break;
         }
-        g_debug ("%s: handle is transient, saving context", __func__);
-        context = handle_map_entry_get_context (entry);
-        rc = tpm2_context_saveflush (resmgr->tpm2,
-                                              phandle,
-                                              context);
+        if (handle_map_entry_context_reusable (entry)) {
+            g_debug ("%s: saved context is current, flushing", __func__);
+            rc = tpm2_context_flush (resmgr->tpm2, phandle);
+        } else {
+            g_debug ("%s: handle is transient, saving context", __func__);
+            rc = tpm2_context_saveflush (resmgr->tpm2,
+                                         phandle,
+                                         &context);
+            if (rc == TSS2_RC_SUCCESS) {
+                handle_map_entry_set_context (entry, context);
+                g_bytes_unref (context);
+            }
+        }
         if (rc == TSS2_RC_SUCCESS) {
             handle_map_entry_set_phandle (entry, 0);
         } else {
-            g_warning ("%s: tpm2_context_saveflush failed for "
-                       "handle: 0x%" PRIx32 " rc: 0x%" PRIx32,
-                       __func__, phandle, rc);
+            tabrmd_warning_ratelimited ("%s: failed to evict handle: 0x%"
+                                        PRIx32 " rc: 0x%" PRIx32,
+                                        __func__, phandle, rc);
         }
         break;
     default:
         break;
     }
 }
+/*
+ * Save and flush the contexts of all of the HandleMapEntry objects in the
+ * 'entries' list with a single call to the Tpm2 (see
+ * resource_manager_flushsave_context for the single entry case). Entries
+ * that aren't loaded transient objects are skipped, those with a reusable
+ * saved context are only flushed.
+ */
+void
+resource_manager_flushsave_contexts (ResourceManager *resmgr,
+                                     GSList          *entries)
+{
+    guint length = g_slist_length (entries), count = 0, i;
+    HandleMapEntry **batch;
+    TPM2_HANDLE *handles;
+    GBytes **contexts;
+    TSS2_RC *rcs;
+    TPM2_HANDLE phandle;
+    GSList *item;
+
+    if (length == 0) {
+        return;
+    }
+    batch = arena_alloc (&resmgr->arena, length * sizeof (HandleMapEntry*));
+    handles = arena_alloc (&resmgr->arena, length * sizeof (TPM2_HANDLE));
+    contexts = arena_alloc (&resmgr->arena, length * sizeof (GBytes*));
+    rcs = arena_alloc (&resmgr->arena, length * sizeof (TSS2_RC));
+    for (item = entries; item != NULL; item = item->next) {
+        phandle = handle_map_entry_get_phandle (HANDLE_MAP_ENTRY (item->data));
+        if (phandle == 0 || (phandle >> TPM2_HR_SHIFT) != TPM2_HT_TRANSIENT) {
+            continue;
+        }
+        if (handle_map_entry_context_reusable (HANDLE_MAP_ENTRY (item->data))) {
+            resource_manager_flushsave_context (item->data, resmgr);
+            continue;
+        }
+        batch [count] = HANDLE_MAP_ENTRY (item->data);
+        handles [count] = phandle;
+        ++count;
+    }
+    g_debug ("%s: saving and flushing %u transient objects", __func__, count);
+    tpm2_context_saveflush_batch (resmgr->tpm2, handles, contexts, rcs, count);
+    for (i = 0; i < count; ++i) {
+        if (rcs [i] == TSS2_RC_SUCCESS) {
+            handle_map_entry_set_context (batch [i], contexts [i]);
+            g_bytes_unref (contexts [i]);
+            handle_map_entry_set_phandle (batch [i], 0);
+        } else {
+            tabrmd_warning_ratelimited ("%s: tpm2_context_saveflush failed "
+                                        "for handle: 0x%" PRIx32 " rc: 0x%"
+                                        PRIx32, __func__, handles [i], rcs [i]);
+        }
+    }
+}
+/*
+ * Drop the resident transient objects in 'evicted', just passed to
+ * resource_manager_flushsave_context(s), from the resident list if they
+ * were flushed. One the TPM failed to save or flush still has its phandle
+ * and stays on the list: off it, nothing would evict it again and it
+ * would hold its TPM slot until its connection closes. The 'evicted' list
+ * holds no references.
+ * Returns the number of objects dropped.
+ */
+static guint
+resource_manager_drop_evicted (ResourceManager *resmgr,
+                               GSList          *evicted)
+{
+    GSList *item, *link;
+    HandleMapEntry *entry;
+    guint count = 0;
+
+    for (item = evicted; item != NULL; item = item->next) {
+        entry = HANDLE_MAP_ENTRY (item->data);
+        if (handle_map_entry_get_phandle (entry) != 0) {
+            continue;
+        }
+        link = g_slist_find (resmgr->resident_transients, entry);
+        if (link == NULL) {
+            continue;
+        }
+        resmgr->resident_transients =
+            g_slist_delete_link (resmgr->resident_transients, link);
+        g_object_unref (entry);
+        ++count;
+    }
+    return count;
+}
+/*
+ * Save and flush the transient objects that were left resident in the TPM
+ * after previous commands. Entries in the 'keep' list are in use by the
+ * command currently being processed and are left loaded, as are those
+ * that fail to be saved. Returns the number of entries evicted.
+ */
+guint
+resource_manager_evict_transients (ResourceManager *resmgr,
+                                   GSList          *keep)
+{
+    GSList *item, *evicted = NULL;
+    guint count;
+
+    for (item = resmgr->resident_transients; item != NULL; item = item->next) {
+        if (g_slist_find (keep, item->data) == NULL) {
+            evicted = g_slist_prepend (evicted, item->data);
+        }
+    }
+    evicted = g_slist_reverse (evicted);
+    resource_manager_flushsave_contexts (resmgr, evicted);
+    count = resource_manager_drop_evicted (resmgr, evicted);
+    g_slist_free (evicted);
+    g_debug ("%s: evicted %u resident transient objects", __func__, count);
+
+    return count;
+}
+/*
+ * Order in which resident transient objects are evicted by the
+ * tabrmd_residency_t their client gave them, lowest first.
+ */
+static guint
+residency_rank (HandleMapEntry *entry)
+{
+    switch (handle_map_entry_get_residency (entry)) {
+    case TABRMD_RESIDENCY_EVICT_FIRST:
+        return 0;
+    case TABRMD_RESIDENCY_HOT:
+        return 2;
+    case TABRMD_RESIDENCY_PINNED:
+        return 3;
+    default:
+        return 1;
+    }
+}
+/*
+ * Returns TRUE if 'entry' stays resident when another connection's
+ * command runs, see TABRMD_CC_RESIDENCY.
+ */
+static gboolean
+residency_kept (HandleMapEntry *entry)
+{
+    return residency_rank (entry) >= 2;
+}
+/*
+ * Return the resident transient objects that stay resident across a
+ * connection switch. The list holds no references.
+ */
+static GSList*
+resource_manager_kept_transients (ResourceManager *resmgr)
+{
+    GSList *item, *kept = NULL;
+
+    for (item = resmgr->resident_transients; item != NULL; item = item->next) {
+        if (residency_kept (HANDLE_MAP_ENTRY (item->data))) {
+            kept = g_slist_prepend (kept, item->data);
+        }
+    }
+    return kept;
+}
+/*
+ * Return the resident transient object to evict first that isn't in the
+ * 'keep' list nor loaded at a handle 'command' references, NULL if there
+ * is none. 'command' may be NULL. Objects are taken by residency_rank,
+ * least recently used first within a rank. Pinned objects are never taken.
+ */
+static HandleMapEntry*
+resource_manager_lru_transient (ResourceManager *resmgr,
+                                GSList          *keep,
+                                Tpm2Command     *command)
+{
+    GSList *item;
+    HandleMapEntry *entry, *lru = NULL;
+
+    for (item = resmgr->resident_transients; item != NULL; item = item->next) {
+        entry = HANDLE_MAP_ENTRY (item->data);
+        if (g_slist_find (keep, entry) != NULL ||
+            handle_map_entry_get_residency (entry) == TABRMD_RESIDENCY_PINNED)
+        {
+            continue;
+        }
+        if (command != NULL &&
+            tpm2_command_references_handle (command,
+                                            handle_map_entry_get_phandle (entry)))
+        {
+            continue;
+        }
+        if (lru == NULL ||
+            residency_rank (entry) < residency_rank (lru) ||
+            (residency_rank (entry) == residency_rank (lru) &&
+             handle_map_entry_get_last_use (entry) <
+             handle_map_entry_get_last_use (lru)))
+        {
+            lru = entry;
+        }
+    }
+    return lru;
+}
+/*
+ * Save and flush 'entry', a resident transient object, and drop it from
+ * the resident list. It stays on the list if it couldn't be saved.
+ * Returns FALSE if it wasn't evicted.
+ */
+static gboolean
+resource_manager_evict_transient (ResourceManager *resmgr,
+                                  HandleMapEntry  *entry)
+{
+    GSList evicted = { .data = entry, .next = NULL };
+
+    g_debug ("%s: evicting vhandle 0x%" PRIx32, __func__,
+             handle_map_entry_get_vhandle (entry));
+    resource_manager_flushsave_context (entry, resmgr);
+    return resource_manager_drop_evicted (resmgr, &evicted) == 1;
+}
+/*
+ * Save and flush the least recently used resident transient object that
+ * isn't in the 'keep' list nor referenced by 'command', which may be
+ * NULL. The handles of closed connections are flushed first if there are
+ * any.
+ * Returns FALSE if no object could be evicted.
+ */
+static gboolean
+resource_manager_evict_lru_transient_keep (ResourceManager *resmgr,
+                                           GSList          *keep,
+                                           Tpm2Command     *command)
+{
+    HandleMapEntry *lru;
+
+    if (resource_manager_flush_pending (resmgr) > 0) {
+        return TRUE;
+    }
+    lru = resource_manager_lru_transient (resmgr, keep, command);
+    if (lru == NULL) {
+        g_debug ("%s: no resident transient object to evict", __func__);
+        return FALSE;
+    }
+    return resource_manager_evict_transient (resmgr, lru);
+}
+/*
+ * Save and flush the least recently used resident transient object that
+ * isn't in the 'keep' list. The handles of closed connections are flushed
+ * first if there are any.
+ * Returns FALSE if no object could be evicted.
+ */
+gboolean
+resource_manager_evict_lru_transient (ResourceManager *resmgr,
+                                      GSList          *keep)
+{
+    return resource_manager_evict_lru_transient_keep (resmgr, keep, NULL);
+}
+/*
+ * Remove the provided HandleMapEntry from the list of resident transient
+ * objects. If 'flush' is TRUE the object is flushed from the TPM as well
+ * (without saving the context).
+ */
+static void
+resource_manager_drop_resident (ResourceManager *resmgr,
+                                HandleMapEntry  *entry,
+                                gboolean         flush)
+{
+    GSList *link;
+    TPM2_HANDLE phandle;
+    TSS2_RC rc;
+
+    link = g_slist_find (resmgr->resident_transients, entry);
+    if (link == NULL) {
+        return;
+    }
+    phandle = handle_map_entry_get_phandle (entry);
+    if (flush && phandle != 0) {
+        rc = tpm2_context_flush (resmgr->tpm2, phandle);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("%s: failed to flush resident transient 0x%" PRIx32
+                       " rc: 0x%" PRIx32, __func__, phandle, rc);
+        }
+        handle_map_entry_set_phandle (entry, 0);
+    }
+    resmgr->resident_transients =
+        g_slist_delete_link (resmgr->resident_transients, link);
+    g_object_unref (entry);
+}
 /*
  * Remove the context associated with the provided SessionEntry from the
  * TPM. Only session objects should be saved by this function.
@@ -413,8 +778,8 @@ save_session_callback (gpointer data_entry,
     rc = tpm2_response_get_code (resp);
     if (rc != TSS2_RC_SUCCESS) {
         if (handle_rc (resmgr, rc) != TRUE) {
-            g_warning ("%s: Failed to save SessionEntry",
-                       __func__);
+            tabrmd_warning_ratelimited ("%s: Failed to save SessionEntry",
+                                        __func__);
             flush_session (resmgr, entry);
             goto out;
 
@@ -430,10 +795,307 @@ out:
     g_clear_object (&resp);
     return;
 }
+/*
+ * This structure is used to pass data to the evict_session_callback
+ * function. The 'command' member may be NULL in which case every loaded
+ * session is saved.
+ */
+typedef struct {
+    ResourceManager *resmgr;
+    Tpm2Command     *command;
+    guint            count;
+} evict_session_data_t;
+/*
+ * GFunc to save a loaded SessionEntry unless it's in use by the command
+ * currently being processed.
+ */
+void
+evict_session_callback (gpointer data_entry,
+                        gpointer data_user)
+{
+    evict_session_data_t *data = (evict_session_data_t*)data_user;
+    SessionEntry *entry = SESSION_ENTRY (data_entry);
+
+    if (session_entry_get_state (entry) != SESSION_ENTRY_LOADED) {
+        return;
+    }
+    if (data->command != NULL &&
+        tpm2_command_references_handle (data->command,
+                                        session_entry_get_handle (entry)))
+    {
+        return;
+    }
+    save_session_callback (entry, data->resmgr);
+    ++data->count;
+}
+/*
+ * Save the sessions that were left loaded in the TPM after previous
+ * commands. Sessions referenced by 'command' are left loaded. Returns the
+ * number of sessions evicted.
+ */
+guint
+resource_manager_evict_sessions (ResourceManager *resmgr,
+                                 Tpm2Command     *command)
+{
+    evict_session_data_t data = {
+        .resmgr  = resmgr,
+        .command = command,
+        .count   = 0,
+    };
+
+    session_list_foreach_loaded (resmgr->session_list,
+                                 evict_session_callback,
+                                 &data);
+    g_debug ("%s: evicted %u loaded sessions", __func__, data.count);
+
+    return data.count;
+}
+/*
+ * This structure is used to find the least recently used session while
+ * iterating over the SessionList.
+ */
+typedef struct {
+    Tpm2Command  *command;
+    SessionEntry *lru;
+} lru_session_data_t;
+/*
+ * GFunc to select a loaded SessionEntry with the oldest 'last_use'
+ * timestamp that isn't referenced by the command being processed.
+ */
+void
+lru_session_callback (gpointer data_entry,
+                      gpointer data_user)
+{
+    lru_session_data_t *data = (lru_session_data_t*)data_user;
+    SessionEntry *entry = SESSION_ENTRY (data_entry);
+
+    if (session_entry_get_state (entry) != SESSION_ENTRY_LOADED) {
+        return;
+    }
+    if (data->command != NULL &&
+        tpm2_command_references_handle (data->command,
+                                        session_entry_get_handle (entry)))
+    {
+        return;
+    }
+    if (data->lru == NULL ||
+        session_entry_get_last_use (entry) <
+        session_entry_get_last_use (data->lru))
+    {
+        data->lru = entry;
+    }
+}
+/*
+ * Save the least recently used loaded session that isn't referenced by
+ * 'command'. The handles of closed connections are flushed first if there
+ * are any.
+ * Returns FALSE if no session could be evicted.
+ */
+gboolean
+resource_manager_evict_lru_session (ResourceManager *resmgr,
+                                    Tpm2Command     *command)
+{
+    lru_session_data_t data = {
+        .command = command,
+        .lru     = NULL,
+    };
+
+    if (resource_manager_flush_pending (resmgr) > 0) {
+        return TRUE;
+    }
+    session_list_foreach_loaded (resmgr->session_list,
+                                 lru_session_callback,
+                                 &data);
+    if (data.lru == NULL) {
+        g_debug ("%s: no loaded session to evict", __func__);
+        return FALSE;
+    }
+    g_debug ("%s: evicting session 0x%08" PRIx32, __func__,
+             session_entry_get_handle (data.lru));
+    g_object_ref (data.lru);
+    save_session_callback (data.lru, resmgr);
+    g_object_unref (data.lru);
+
+    return TRUE;
+}
+/*
+ * Save and flush the least recently used context of either kind: a
+ * resident transient object not in 'keep' or a loaded session, neither
+ * referenced by 'command'. For TPMs that hold objects and sessions in the
+ * same memory. The handles of closed connections are flushed first if
+ * there are any.
+ * Returns FALSE if no context could be evicted.
+ */
+static gboolean
+resource_manager_evict_coldest (ResourceManager *resmgr,
+                                GSList          *keep,
+                                Tpm2Command     *command)
+{
+    HandleMapEntry *transient;
+    lru_session_data_t data = {
+        .command = command,
+        .lru     = NULL,
+    };
+
+    if (resource_manager_flush_pending (resmgr) > 0) {
+        return TRUE;
+    }
+    transient = resource_manager_lru_transient (resmgr, keep, command);
+    session_list_foreach_loaded (resmgr->session_list,
+                                 lru_session_callback,
+                                 &data);
+    if (transient != NULL &&
+        (data.lru == NULL ||
+         handle_map_entry_get_residency (transient) ==
+         TABRMD_RESIDENCY_EVICT_FIRST ||
+         (!residency_kept (transient) &&
+          handle_map_entry_get_last_use (transient) <
+          session_entry_get_last_use (data.lru))))
+    {
+        return resource_manager_evict_transient (resmgr, transient);
+    }
+    if (data.lru == NULL) {
+        g_debug ("%s: no context to evict", __func__);
+        return FALSE;
+    }
+    g_debug ("%s: evicting session 0x%08" PRIx32, __func__,
+             session_entry_get_handle (data.lru));
+    g_object_ref (data.lru);
+    save_session_callback (data.lru, resmgr);
+    g_object_unref (data.lru);
+
+    return TRUE;
+}
+/*
+ * The loaded sessions last used at or before 'mark', with a reference.
+ */
+typedef struct {
+    guint64  mark;
+    GSList  *cold;
+} cold_session_data_t;
+/*
+ * GFunc collecting the cold sessions into a cold_session_data_t.
+ */
+static void
+cold_session_callback (gpointer data_entry,
+                       gpointer data_user)
+{
+    cold_session_data_t *data = (cold_session_data_t*)data_user;
+    SessionEntry *entry = SESSION_ENTRY (data_entry);
+
+    if (session_entry_get_state (entry) == SESSION_ENTRY_LOADED &&
+        session_entry_get_last_use (entry) <= data->mark)
+    {
+        data->cold = g_slist_prepend (data->cold, g_object_ref (entry));
+    }
+}
+/*
+ * Save and flush the resident transient objects and loaded sessions that
+ * weren't used since the last pass, so the next command finds the room it
+ * needs instead of waiting for an eviction. Objects hinted evict-first go
+ * with them whenever they were used, hot and pinned ones stay. A pass is
+ * due once every 'evict_idle' milliseconds: what it evicts has gone unused
+ * for at least that long. It stops as soon as a message is waiting.
+ * Returns the number of contexts evicted.
+ */
+guint
+resource_manager_evict_idle (ResourceManager *resmgr)
+{
+    cold_session_data_t data = { .cold = NULL };
+    GSList *item, *next, *cold = NULL;
+    HandleMapEntry *entry;
+    gint64 now;
+    guint count = 0;
+
+    if (resmgr->evict_idle == 0) {
+        return 0;
+    }
+    now = g_get_monotonic_time ();
+    if (now - resmgr->evict_mark_time <
+        (gint64)resmgr->evict_idle * G_TIME_SPAN_MILLISECOND)
+    {
+        return 0;
+    }
+    data.mark = resmgr->evict_mark;
+    for (item = resmgr->resident_transients; item != NULL; item = next) {
+        next = item->next;
+        entry = HANDLE_MAP_ENTRY (item->data);
+        if (residency_kept (entry) ||
+            (handle_map_entry_get_last_use (entry) > data.mark &&
+             handle_map_entry_get_residency (entry) !=
+             TABRMD_RESIDENCY_EVICT_FIRST))
+        {
+            continue;
+        }
+        cold = g_slist_prepend (cold, entry);
+    }
+    resource_manager_flushsave_contexts (resmgr, cold);
+    count = resource_manager_drop_evicted (resmgr, cold);
+    g_slist_free (cold);
+    session_list_foreach_loaded (resmgr->session_list,
+                                 cold_session_callback,
+                                 &data);
+    for (item = data.cold; item != NULL; item = item->next) {
+        if (message_queue_get_length (resmgr->in_queue) > 0) {
+            break;
+        }
+        save_session_callback (item->data, resmgr);
+        ++count;
+    }
+    g_slist_free_full (data.cold, g_object_unref);
+    resmgr->evict_mark = resmgr->use_clock;
+    resmgr->evict_mark_time = now;
+    if (count > 0) {
+        g_debug ("%s: evicted %u contexts", __func__, count);
+    }
+    return count;
+}
+/*
+ * Make room in the TPM so that a command or context load that failed with
+ * 'rc' may be retried: the least recently used transient object for
+ * TPM2_RC_OBJECT_MEMORY, session for TPM2_RC_SESSION_MEMORY or
+ * TPM2_RC_SESSION_HANDLES, and context of either kind for TPM2_RC_MEMORY.
+ * Objects in 'keep' and the handles of 'command' stay loaded, 'command'
+ * may be NULL.
+ * Returns FALSE if 'rc' isn't one of those or nothing could be evicted:
+ * the failure then goes back to the client.
+ */
+gboolean
+resource_manager_evict_for_rc (ResourceManager *resmgr,
+                               TSS2_RC          rc,
+                               GSList          *keep,
+                               Tpm2Command     *command)
+{
+    gboolean ret;
+
+    switch (rc) {
+    case TPM2_RC_OBJECT_MEMORY:
+        ret = resource_manager_evict_lru_transient_keep (resmgr, keep, command);
+        break;
+    case TPM2_RC_SESSION_MEMORY:
+    case TPM2_RC_SESSION_HANDLES:
+        ret = resource_manager_evict_lru_session (resmgr, command);
+        break;
+    case TPM2_RC_MEMORY:
+        ret = resource_manager_evict_coldest (resmgr, keep, command);
+        break;
+    default:
+        return FALSE;
+    }
+    if (ret) {
+        g_debug ("%s: made room after RC 0x%" PRIx32 ", retrying",
+                 __func__, rc);
+        metrics_count (resmgr->metrics, METRICS_MEMORY_EVICTION);
+    }
+    return ret;
+}
 static void
 dump_command (Tpm2Command *command)
 {
     g_assert (command != NULL);
+    if (!tabrmd_debug_enabled ()) {
+        return;
+    }
     g_debug ("Tpm2Command");
     g_debug_bytes (tpm2_command_get_buffer (command),
                    tpm2_command_get_size (command),
@@ -445,6 +1107,9 @@ static void
 dump_response (Tpm2Response *response)
 {
     g_assert (response != NULL);
+    if (!tabrmd_debug_enabled ()) {
+        return;
+    }
     g_debug ("Tpm2Response");
     g_debug_bytes (tpm2_response_get_buffer (response),
                    tpm2_response_get_size (response),
@@ -470,6 +1135,7 @@ resource_manager_save_context_session (ResourceManager *resmgr,
     SessionEntry *entry = NULL;
     Tpm2Response *response = NULL;
     TPM2_HANDLE handle = 0;
+    TSS2_RC rc;
 
     handle = tpm2_command_get_handle (command, 0);
     g_debug ("save_context for session handle: 0x%" PRIx32, handle);
@@ -485,12 +1151,24 @@ resource_manager_save_context_session (ResourceManager *resmgr,
         g_warning ("%s: session belongs to a different connection", __func__);
         goto out;
     }
+    /* sessions may still be loaded from a previous command */
+    if (session_entry_get_state (entry) == SESSION_ENTRY_LOADED) {
+        response = save_session (resmgr, entry);
+        rc = tpm2_response_get_code (response);
+        g_clear_object (&response);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("%s: failed to save loaded session, rc: 0x%" PRIx32,
+                       __func__, rc);
+            response = tpm2_response_new_rc (conn_cmd, rc);
+            goto out;
+        }
+    }
     session_entry_set_state (entry, SESSION_ENTRY_SAVED_CLIENT);
     response = tpm2_response_new_context_save (conn_cmd, entry);
-    g_debug ("%s: Tpm2Response from TPM2_ContextSave", __func__);
-    g_debug_bytes (tpm2_response_get_buffer (response),
-                   tpm2_response_get_size (response),
-                   16, 4);
+    tabrmd_debug ("%s: Tpm2Response from TPM2_ContextSave", __func__);
+    tabrmd_debug_bytes (tpm2_response_get_buffer (response),
+                        tpm2_response_get_size (response),
+                        16, 4);
 out:
     g_clear_object (&conn_cmd);
     g_clear_object (&conn_entry);
@@ -498,19 +1176,57 @@ out:
     return response;
 }
 /*
- * This function performs the special processing associated with the
- * TPM2_ContextSave command. How much we can "virtualize of this command
+ * Answer a TPM2_ContextSave of a transient object from the context the RM
+ * holds for it.
+ * Returns NULL if there's none that can be handed out, the command is then
+ * sent to the TPM as usual.
+ */
+Tpm2Response*
+resource_manager_save_context_transient (ResourceManager *resmgr,
+                                         Tpm2Command     *command)
+{
+    Connection *connection;
+    HandleMap *map;
+    HandleMapEntry *entry;
+    Tpm2Response *response = NULL;
+    GBytes *context;
+    TPM2_HANDLE handle;
+
+    handle = tpm2_command_get_handle (command, 0);
+    connection = tpm2_command_get_connection (command);
+    map = connection_get_trans_map (connection);
+    entry = handle_map_vlookup (map, handle);
+    if (entry == NULL || !handle_map_entry_context_reusable (entry)) {
+        g_debug ("%s: no saved context for transient handle 0x%" PRIx32,
+                 __func__, handle);
+        goto out;
+    }
+    context = handle_map_entry_get_context (entry);
+    if (context_blob_saved_handle (context) == 0) {
+        goto out;
+    }
+    g_debug ("%s: answering ContextSave for 0x%" PRIx32 " from saved context",
+             __func__, handle);
+    metrics_count (resmgr->metrics, METRICS_CACHE_HIT);
+    response = tpm2_response_new_context_save_transient (connection, context);
+out:
+    g_clear_object (&entry);
+    g_object_unref (map);
+    g_object_unref (connection);
+    return response;
+}
+/*
+ * This function performs the special processing associated with the
+ * TPM2_ContextSave command. How much we can "virtualize of this command
  * depends on the parameters / handle type as well as how much work we
  * actually *want* to do.
  *
- * Transient objects that are tracked by the RM require no special handling.
- * It's possible that the whole of this command could be virtualized: When a
- * command is received all transient objects have been saved and flushed. The
- * saved context held by the RM could very well be returned to the caller
- * with no interaction with the TPM. This would however require that the RM
- * marshal the context object into the response buffer. This is less easy
- * than it should be and so we suffer the inefficiency to keep the RM code
- * more simple. Simple in this case means no special handling.
+ * Transient objects that are tracked by the RM hold the context the RM
+ * saved when it last evicted them. Saving an object doesn't change it so
+ * that context is as good as a new one and we return it to the caller with
+ * no interaction with the TPM. Objects never evicted and sequence objects,
+ * whose state changes with each command, get no special handling: the
+ * object is loaded and the command goes to the TPM.
  *
  * Session objects are handled much in the same way with a specific caveat:
  * A session can be either loaded or saved. Unlike a transient object saving
@@ -529,6 +1245,8 @@ resource_manager_save_context (ResourceManager *resmgr,
 
     g_debug ("%s", __func__);
     switch (handle >> TPM2_HR_SHIFT) {
+    case TPM2_HT_TRANSIENT:
+        return resource_manager_save_context_transient (resmgr, command);
     case TPM2_HT_HMAC_SESSION:
     case TPM2_HT_POLICY_SESSION:
         return resource_manager_save_context_session (resmgr, command);
@@ -633,9 +1351,9 @@ resource_manager_load_context (ResourceManager *resmgr,
  *
  * Transient objects that are tracked by the RM (stored in the transient
  * HandleMap in the Connection object) then we can simply delete the mapping
- * since transient objects are always saved / flushed after each command is
- * processed. So for this handle type we just delete the mapping, create a
- * Tpm2Response object and return it to the caller.
+ * and, if the object is still resident in the TPM from a previous
+ * command, flush it. So for this handle type we just delete the mapping,
+ * create a Tpm2Response object and return it to the caller.
  *
  * Session objects are not so simple. Sessions cannot be flushed after each
  * use. The TPM will only allow us to save the context as it must maintain
@@ -677,6 +1395,7 @@ resource_manager_flush_context (ResourceManager *resmgr,
         map = connection_get_trans_map (connection);
         entry = handle_map_vlookup (map, handle);
         if (entry != NULL) {
+            resource_manager_drop_resident (resmgr, entry, TRUE);
             handle_map_remove (map, handle);
             g_object_unref (entry);
             rc = TSS2_RC_SUCCESS;
@@ -704,10 +1423,115 @@ resource_manager_flush_context (ResourceManager *resmgr,
 out:
     return response;
 }
+/*
+ * Returns TRUE if the bytes held for 'connection', or for all connections,
+ * are past their limit. The connection's saved contexts are only counted
+ * with 'contexts' set, which is only allowed on the ResourceManager thread:
+ * that's where its HandleMap and the SessionList are touched.
+ */
+static gboolean
+resource_manager_over_memory (ResourceManager *resmgr,
+                              Connection      *connection,
+                              gboolean         contexts)
+{
+    HandleMap *handle_map;
+    gsize bytes;
+
+    if (resmgr->bytes_max != 0 && mem_account_get_total () > resmgr->bytes_max) {
+        return TRUE;
+    }
+    if (resmgr->connection_bytes_max == 0) {
+        return FALSE;
+    }
+    bytes = connection_get_bytes (connection);
+    if (contexts) {
+        handle_map = connection_get_trans_map (connection);
+        bytes += handle_map_get_context_bytes (handle_map);
+        bytes += session_list_get_context_bytes (resmgr->session_list,
+                                                 connection);
+        g_object_unref (handle_map);
+    }
+    return bytes > resmgr->connection_bytes_max;
+}
+/*
+ * Borrow a transient object or session slot for 'connection', which is at
+ * its limit, from the QuotaPool.
+ * Returns FALSE if there's no pool or it has no slot for the connection.
+ */
+static gboolean
+resource_manager_quota_borrow (ResourceManager *resmgr,
+                               Connection      *connection,
+                               QuotaPoolKind    kind)
+{
+    HandleMap *map;
+    guint held;
+
+    if (resmgr->quota_pool == NULL) {
+        return FALSE;
+    }
+    held = connection_get_borrowed (connection, kind);
+    if (!quota_pool_borrow (resmgr->quota_pool, kind, held)) {
+        return FALSE;
+    }
+    connection_set_borrowed (connection, kind, held + 1);
+    if (kind == QUOTA_POOL_TRANSIENTS) {
+        map = connection_get_trans_map (connection);
+        handle_map_set_max_entries (map, handle_map_get_max_entries (map) + 1);
+        g_object_unref (map);
+    }
+    g_debug ("%s: connection 0x%" PRIx64 " borrowed %u %s", __func__,
+             connection->id, held + 1,
+             kind == QUOTA_POOL_TRANSIENTS ? "objects" : "sessions");
+    return TRUE;
+}
+/*
+ * Give the QuotaPool back the slots 'connection' borrowed and no longer
+ * needs: its limits come down as far as they can without the connection
+ * being over them. With 'all' every slot goes back, for a connection
+ * that's closing.
+ */
+static void
+resource_manager_quota_settle (ResourceManager *resmgr,
+                               Connection      *connection,
+                               gboolean         all)
+{
+    HandleMap *map;
+    guint borrowed, minimum, count, keep;
+
+    if (resmgr->quota_pool == NULL) {
+        return;
+    }
+    borrowed = connection_get_borrowed (connection, QUOTA_POOL_TRANSIENTS);
+    if (borrowed > 0) {
+        map = connection_get_trans_map (connection);
+        minimum = handle_map_get_max_entries (map) - borrowed;
+        /* the map only counts as full once it holds more than max_entries */
+        count = handle_map_size (map);
+        keep = all || count <= minimum + 1 ?
+            0 : MIN (count - minimum - 1, borrowed);
+        handle_map_set_max_entries (map, minimum + keep);
+        g_object_unref (map);
+        connection_set_borrowed (connection, QUOTA_POOL_TRANSIENTS, keep);
+        quota_pool_return (resmgr->quota_pool, QUOTA_POOL_TRANSIENTS,
+                           borrowed - keep);
+    }
+    borrowed = connection_get_borrowed (connection, QUOTA_POOL_SESSIONS);
+    if (borrowed > 0) {
+        minimum = resmgr->session_list->max_per_connection;
+        /* the list is full once it holds max_per_connection */
+        count = (guint)session_list_connection_count (resmgr->session_list,
+                                                      connection);
+        keep = all || count <= minimum ? 0 : MIN (count - minimum, borrowed);
+        connection_set_borrowed (connection, QUOTA_POOL_SESSIONS, keep);
+        quota_pool_return (resmgr->quota_pool, QUOTA_POOL_SESSIONS,
+                           borrowed - keep);
+    }
+}
 /*
  * Ensure that executing the provided command will not exceed any of the
- * per-connection quotas enforced by the RM. This is currently limited to
- * transient objects and sessions.
+ * per-connection quotas enforced by the RM: transient objects, sessions
+ * and, for commands that load objects or create sessions, bytes held.
+ * A connection at its limit borrows from the QuotaPool if there is one.
  */
 TSS2_RC
 resource_manager_quota_check (ResourceManager *resmgr,
@@ -716,28 +1540,37 @@ resource_manager_quota_check (ResourceManager *resmgr,
     HandleMap   *handle_map = NULL;
     Connection  *connection = NULL;
     TSS2_RC      rc = TSS2_RC_SUCCESS;
+    guint8       flags = tpm2_command_get_flags (command);
 
-    switch (tpm2_command_get_code (command)) {
-    /* These commands load transient objects. */
-    case TPM2_CC_CreatePrimary:
-    case TPM2_CC_Load:
-    case TPM2_CC_LoadExternal:
+    if (flags & TPM2_COMMAND_FLAG_LOADS_OBJECT) {
         connection = tpm2_command_get_connection (command);
         handle_map = connection_get_trans_map (connection);
-        if (handle_map_is_full (handle_map)) {
+        if (handle_map_is_full (handle_map) &&
+            !resource_manager_quota_borrow (resmgr,
+                                            connection,
+                                            QUOTA_POOL_TRANSIENTS))
+        {
             g_info ("%s: Connection has exceeded transient object limit",
                     __func__);
             rc = TSS2_RESMGR_RC_OBJECT_MEMORY;
         }
-        break;
-    /* These commands create sessions. */
-    case TPM2_CC_StartAuthSession:
+    } else if (flags & TPM2_COMMAND_FLAG_CREATES_SESSION) {
         connection = tpm2_command_get_connection (command);
-        if (session_list_is_full (resmgr->session_list, connection)) {
+        if (session_list_is_full (resmgr->session_list, connection) &&
+            !resource_manager_quota_borrow (resmgr,
+                                            connection,
+                                            QUOTA_POOL_SESSIONS))
+        {
             g_info ("%s: Connectionhas exceeded session limit", __func__);
             rc = TSS2_RESMGR_RC_SESSION_MEMORY;
         }
-        break;
+    }
+    /* new objects and sessions end up as saved contexts held for the client */
+    if (rc == TSS2_RC_SUCCESS && connection != NULL &&
+        resource_manager_over_memory (resmgr, connection, TRUE))
+    {
+        g_info ("%s: Connection has exceeded memory limit", __func__);
+        rc = TSS2_RESMGR_RC_OUT_OF_MEMORY;
     }
     g_clear_object (&connection);
     g_clear_object (&handle_map);
@@ -774,7 +1607,9 @@ remove_entry_from_handle_map (gpointer data_entry,
 /*
  * This function handles the required post-processing on the HandleMapEntry
  * objects in the GSList that represent objects loaded into the TPM as part of
- * executing a command.
+ * executing a command. Objects that are still loaded are left resident in
+ * the TPM. They're saved and flushed lazily: when another connection sends
+ * a command, or when the TPM runs out of object memory.
  */
 void
 post_process_loaded_transients (ResourceManager  *resmgr,
@@ -782,90 +1617,45 @@ post_process_loaded_transients (ResourceManager  *resmgr,
                                 Connection       *connection,
                                 TPMA_CC           command_attrs)
 {
-    /* if flushed bit is clear we need to flush & save contexts */
+    GSList *item;
+    HandleMapEntry *entry;
+
+    /* if flushed bit is clear the objects are still loaded, keep them */
     if (!(command_attrs & TPMA_CC_FLUSHED)) {
-        g_debug ("flushsave_context for %" PRIu32 " entries",
+        g_debug ("keeping %" PRIu32 " transient entries resident",
                  g_slist_length (*transient_slist));
-        g_slist_foreach (*transient_slist,
-                        resource_manager_flushsave_context,
-                        resmgr);
+        for (item = *transient_slist; item != NULL; item = item->next) {
+            entry = HANDLE_MAP_ENTRY (item->data);
+            handle_map_entry_set_last_use (entry, ++resmgr->use_clock);
+            if (handle_map_entry_get_phandle (entry) == 0 ||
+                g_slist_find (resmgr->resident_transients, entry) != NULL)
+            {
+                continue;
+            }
+            resmgr->resident_transients =
+                g_slist_prepend (resmgr->resident_transients,
+                                 g_object_ref (entry));
+        }
     } else {
         /*
          * if flushed bit is set the transient object entry has been flushed
          * and so we just remove it
          */
         g_debug ("TPMA_CC flushed bit set");
+        for (item = *transient_slist; item != NULL; item = item->next) {
+            resource_manager_drop_resident (resmgr,
+                                            HANDLE_MAP_ENTRY (item->data),
+                                            FALSE);
+        }
         g_slist_foreach (*transient_slist,
                          remove_entry_from_handle_map,
                          connection);
     }
-    g_slist_free_full (*transient_slist, g_object_unref);
-}
-/*
- * This structure is used to keep state while iterating over a list of
- * TPM2_HANDLES.
- * 'cap_data'    : this parameter is used to collect the list of handles that
- *   we want as well as the number of handles in the structure
- * 'max_count'   : is the maximum number of handles to return
- * 'more_data'   : once max_count handles have been collected this variable
- *   tells the caller whether additional handles would have been returned had
- *   max_count been larger
- * 'start_handle': is the numerically smallest handle that should be collected
- *   into cap_data.
- */
-typedef struct {
-    TPMS_CAPABILITY_DATA *cap_data;
-    size_t                max_count;
-    gboolean              more_data;
-    TPM2_HANDLE            start_handle;
-} vhandle_iterator_state_t;
-/*
- * This callback function is invoked as part of iterating over a list of
- * handles. The first parameter is an entry from the collection being
- * traversed. The second is a reference to a vhandle_iterator_state_t
- * structure.
- * This structure is used to maintain state while iterating over the
- * collection.
- */
-void
-vhandle_iterator_callback (gpointer entry,
-                           gpointer data)
-{
-    TPM2_HANDLE                vhandle  = (uintptr_t)entry;
-    vhandle_iterator_state_t *state    = (vhandle_iterator_state_t*)data;
-    TPMS_CAPABILITY_DATA     *cap_data = state->cap_data;
-
-    /* if vhandle is numerically smaller than the start value just return */
-    if (vhandle < state->start_handle) {
-        return;
-    }
-    g_debug ("vhandle_iterator_callback with max_count: %zu and count: %"
-             PRIu32, state->max_count, cap_data->data.handles.count);
-    /* if we've collected max_count handles set 'more_data' and return */
-    if (!(cap_data->data.handles.count < state->max_count)) {
-        state->more_data = TRUE;
-        return;
-    }
-    cap_data->data.handles.handle [cap_data->data.handles.count] = vhandle;
-    ++cap_data->data.handles.count;
-}
-/*
- * This is a GCompareFunc used to sort a list of TPM2_HANDLES.
- */
-int
-handle_compare (gconstpointer a,
-                gconstpointer b)
-{
-    TPM2_HANDLE handle_a = (uintptr_t)a;
-    TPM2_HANDLE handle_b = (uintptr_t)b;
-
-    if (handle_a < handle_b) {
-        return -1;
-    } else if (handle_a > handle_b) {
-        return 1;
-    } else {
-        return 0;
+    /* the list nodes come from the arena, only the entries are released */
+    for (item = *transient_slist; item != NULL; item = item->next) {
+        g_object_unref (item->data);
     }
+    *transient_slist = NULL;
 }
 /*
  * The get_cap_transient function populates a TPMS_CAPABILITY_DATA structure
@@ -882,29 +1672,251 @@ get_cap_handles (HandleMap            *map,
                  UINT32                count,
                  TPMS_CAPABILITY_DATA *cap_data)
 {
-    GList *vhandle_list;
-    vhandle_iterator_state_t state = {
-        .cap_data     = cap_data,
-        .max_count    = count,
-        .more_data    = FALSE,
-        .start_handle = prop,
-    };
+    gboolean more_data;
 
     cap_data->capability = TPM2_CAP_HANDLES;
-    cap_data->data.handles.count = 0;
+    cap_data->data.handles.count =
+        handle_map_copy_vhandles (map,
+                                  prop,
+                                  cap_data->data.handles.handle,
+                                  MIN (count, TPM2_MAX_CAP_HANDLES),
+                                  &more_data);
+    g_debug ("%s: copied %" PRIu32 " vhandles from 0x%08" PRIx32,
+             __func__, cap_data->data.handles.count, prop);
+
+    return more_data;
+}
+typedef struct {
+    GArray     *handles;
+    gboolean    saved;
+    TPM2_HANDLE first;
+} get_cap_sessions_data_t;
+/*
+ * Sessions the client saved with ContextSave are saved as far as it can
+ * tell, the rest are loaded: the RM loads them when they're used.
+ */
+static void
+get_cap_sessions_collect (gpointer data,
+                          gpointer user_data)
+{
+    SessionEntry *entry = SESSION_ENTRY (data);
+    get_cap_sessions_data_t *collect = (get_cap_sessions_data_t*)user_data;
+    SessionEntryStateEnum state = session_entry_get_state (entry);
+    TPM2_HANDLE handle = session_entry_get_handle (entry);
+    gboolean saved = state == SESSION_ENTRY_SAVED_CLIENT ||
+        state == SESSION_ENTRY_SAVED_CLIENT_CLOSED;
 
-    vhandle_list = handle_map_get_keys (map);
-    vhandle_list = g_list_sort (vhandle_list, handle_compare);
-    g_list_foreach (vhandle_list, vhandle_iterator_callback, &state);
+    if (saved == collect->saved &&
+        (handle & TPM2_HR_HANDLE_MASK) >= collect->first)
+    {
+        g_array_append_val (collect->handles, handle);
+    }
+}
+static gint
+get_cap_sessions_compare (gconstpointer a,
+                          gconstpointer b)
+{
+    TPM2_HANDLE handle_a = *(const TPM2_HANDLE*)a & TPM2_HR_HANDLE_MASK;
+    TPM2_HANDLE handle_b = *(const TPM2_HANDLE*)b & TPM2_HR_HANDLE_MASK;
 
-    g_debug ("iterating over %" PRIu32 " vhandles from g_list_foreach",
-             cap_data->data.handles.count);
-    size_t i;
+    return handle_a < handle_b ? -1 : handle_a > handle_b;
+}
+/*
+ * Populate 'cap_data' with the handles of the sessions owned by
+ * 'connection' for a GetCapability of the TPM2_HT_LOADED_SESSION range,
+ * or of TPM2_HT_SAVED_SESSION if 'saved' is set. Like the TPM we order
+ * them by the handle index, HMAC and policy sessions together, and start
+ * at the index in 'prop'. Sessions of other connections aren't listed.
+ * Returns TRUE when more handles are present.
+ */
+static gboolean
+get_cap_sessions (SessionList          *session_list,
+                  Connection           *connection,
+                  gboolean              saved,
+                  TPM2_HANDLE           prop,
+                  UINT32                count,
+                  TPMS_CAPABILITY_DATA *cap_data)
+{
+    get_cap_sessions_data_t collect = {
+        .handles = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE)),
+        .saved = saved,
+        .first = prop & TPM2_HR_HANDLE_MASK,
+    };
+    gboolean more_data;
+    guint i;
+
+    session_list_foreach_connection (session_list,
+                                     connection,
+                                     get_cap_sessions_collect,
+                                     &collect);
+    g_array_sort (collect.handles, get_cap_sessions_compare);
+    count = MIN (count, TPM2_MAX_CAP_HANDLES);
+    more_data = collect.handles->len > count;
+    cap_data->capability = TPM2_CAP_HANDLES;
+    cap_data->data.handles.count = MIN (collect.handles->len, count);
     for (i = 0; i < cap_data->data.handles.count; ++i) {
-        g_debug ("  vhandle: 0x%" PRIx32, cap_data->data.handles.handle [i]);
+        cap_data->data.handles.handle [i] =
+            g_array_index (collect.handles, TPM2_HANDLE, i);
+    }
+    g_array_free (collect.handles, TRUE);
+    g_debug ("%s: copied %" PRIu32 " session handles from 0x%08" PRIx32,
+             __func__, cap_data->data.handles.count, prop);
+
+    return more_data;
+}
+/*
+ * Returns TRUE if a GetCapability for 'cap' and 'prop' asks for something
+ * that doesn't change while the TPM runs: the algorithms, the commands,
+ * the commands requiring physical presence or TPM properties from the
+ * TPM2_PT_FIXED group. Commands with the TPM2_COMMAND_FLAG_CHANGES_CAPS
+ * flag clear the cache of these.
+ */
+static gboolean
+get_cap_invariant (TPM2_CAP cap,
+                   UINT32   prop)
+{
+    switch (cap) {
+    case TPM2_CAP_ALGS:
+    case TPM2_CAP_COMMANDS:
+    case TPM2_CAP_PP_COMMANDS:
+        return TRUE;
+    case TPM2_CAP_TPM_PROPERTIES:
+        return prop >= TPM2_PT_FIXED && prop < TPM2_PT_VAR;
+    default:
+        return FALSE;
+    }
+}
+/*
+ * A request for fixed properties may be answered with properties from the
+ * TPM2_PT_VAR group that follows. Returns TRUE if every property in the
+ * response is fixed.
+ */
+static gboolean
+get_cap_response_fixed (Tpm2Response *response)
+{
+    TPMS_CAPABILITY_DATA cap_data = { .capability = 0 };
+    size_t offset = TPM_HEADER_SIZE + sizeof (TPMI_YES_NO), i;
+    TSS2_RC rc;
+
+    rc = Tss2_MU_TPMS_CAPABILITY_DATA_Unmarshal (tpm2_response_get_buffer (response),
+                                                 tpm2_response_get_size (response),
+                                                 &offset,
+                                                 &cap_data);
+    if (rc != TSS2_RC_SUCCESS) {
+        return FALSE;
+    }
+    if (cap_data.capability != TPM2_CAP_TPM_PROPERTIES) {
+        return TRUE;
+    }
+    for (i = 0; i < cap_data.data.tpmProperties.count; ++i) {
+        if (cap_data.data.tpmProperties.tpmProperty [i].property >= TPM2_PT_VAR) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+/*
+ * Look 'command' up in 'cache', a table from GBytes of a command buffer to
+ * GBytes of the response the TPM sent for it. Keying by the whole buffer
+ * is only right for commands whose response depends on nothing else.
+ * Returns a copy of the cached response for the connection that sent
+ * 'command', or NULL if it isn't cached.
+ */
+static Tpm2Response*
+response_cache_lookup (GHashTable  *cache,
+                       Tpm2Command *command,
+                       Connection  *connection)
+{
+    GBytes *key, *value;
+    guint8 *buf;
+    gsize size;
+
+    key = g_bytes_new_static (tpm2_command_get_buffer (command),
+                              tpm2_command_get_size (command));
+    value = g_hash_table_lookup (cache, key);
+    g_bytes_unref (key);
+    if (value == NULL) {
+        return NULL;
+    }
+    size = g_bytes_get_size (value);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (value, NULL), size);
+    return tpm2_response_new (connection,
+                              buf,
+                              size,
+                              tpm2_command_get_attributes (command));
+}
+/*
+ * Keep 'response' to 'command' in 'cache' unless it holds 'max' entries.
+ * Returns FALSE if the cache was full.
+ */
+static gboolean
+response_cache_insert (GHashTable   *cache,
+                       guint         max,
+                       Tpm2Command  *command,
+                       Tpm2Response *response)
+{
+    if (g_hash_table_size (cache) >= max) {
+        return FALSE;
+    }
+    g_hash_table_insert (cache,
+                         g_bytes_new (tpm2_command_get_buffer (command),
+                                      tpm2_command_get_size (command)),
+                         g_bytes_new (tpm2_response_get_buffer (response),
+                                      tpm2_response_get_size (response)));
+    return TRUE;
+}
+/*
+ * Publish the cap_cache and query_cache in the response page, if there is
+ * one, after either of them changed. Their responses are the same for
+ * every connection so the TCTI may answer those commands itself.
+ */
+static void
+resource_manager_publish_responses (ResourceManager *resmgr)
+{
+    GHashTable *caches [] = { resmgr->cap_cache, resmgr->query_cache };
+
+    if (resmgr->response_page != NULL) {
+        response_page_publish (resmgr->response_page,
+                               resmgr->response_page_tpm,
+                               caches,
+                               G_N_ELEMENTS (caches));
     }
+}
+/*
+ * Answer 'command' from the cap_cache. The cache is keyed by the whole
+ * command buffer: a GetCapability without auths is just the header and
+ * the capability, property and propertyCount parameters.
+ * Returns NULL if the query isn't cached.
+ */
+static Tpm2Response*
+get_cap_cache_lookup (ResourceManager *resmgr,
+                      Tpm2Command     *command,
+                      Connection      *connection)
+{
+    Tpm2Response *response;
 
-    return state.more_data;
+    response = response_cache_lookup (resmgr->cap_cache, command, connection);
+    metrics_count (resmgr->metrics,
+                   response != NULL ? METRICS_CACHE_HIT : METRICS_CACHE_MISS);
+    if (response != NULL) {
+        g_debug ("%s: answering GetCapability from cache", __func__);
+    }
+    return response;
+}
+static void
+get_cap_cache_insert (ResourceManager *resmgr,
+                      Tpm2Command     *command,
+                      Tpm2Response    *response)
+{
+    if (get_cap_response_fixed (response) &&
+        response_cache_insert (resmgr->cap_cache,
+                               RESOURCE_MANAGER_CAP_CACHE_MAX,
+                               command,
+                               response))
+    {
+        resource_manager_publish_responses (resmgr);
+    }
 }
 /*
  * These macros are used to set fields in a Tpm2Response buffer that we
@@ -967,22 +1979,34 @@ build_cap_handles_response (TPMS_CAPABILITY_DATA *cap_data,
  * In cases where the GetCapability command isn't fully virtualized we may
  * need to perform some 'post processing' of the results returned from the
  * TPM2 device. Specifically, in the case of the TPM2_PT_CONTEXT_GAP_MAX
- * property, we overrite the value in the response body. This function
- * manually unmarshals the response, iterates over the values modifying
- * them if necessary and then marshals them back into the Tpm2Response.
+ * property, we overrite the value in the response body. Properties that
+ * describe resource availability are replaced with what the connection
+ * that sent the command may still use: the TPM's figures describe the
+ * device as a whole and say nothing about the limits we enforce on each
+ * connection. TPM2_PT_ACTIVE_SESSIONS_MAX is the same for every connection
+ * so responses from the TPM2_PT_FIXED group remain cacheable.
+ * This function manually unmarshals the response, iterates over the values
+ * modifying them if necessary and then marshals them back into the
+ * Tpm2Response.
  */
 TSS2_RC
-get_cap_post_process (Tpm2Response *resp)
+get_cap_post_process (ResourceManager *resmgr,
+                      Tpm2Response    *resp)
 {
     g_assert (resp != NULL);
     g_assert (tpm2_response_get_code (resp) == TSS2_RC_SUCCESS);
 
     TPMS_CAPABILITY_DATA cap_data = { .capability = 0 };
+    TPMS_TAGGED_PROPERTY *tagged;
     TSS2_RC rc;
     uint8_t *buf = tpm2_response_get_buffer (resp);
     size_t buf_size = tpm2_response_get_size (resp);
     size_t offset = TPM_HEADER_SIZE + sizeof (TPMI_YES_NO);
     size_t i;
+    Connection *connection;
+    HandleMap *map;
+    size_t session_count;
+    guint session_max;
 
     rc = Tss2_MU_TPMS_CAPABILITY_DATA_Unmarshal (buf,
                                                  buf_size,
@@ -995,18 +2019,36 @@ get_cap_post_process (Tpm2Response *resp)
     g_debug ("%s: capability 0x%" PRIx32, __func__, cap_data.capability);
     switch (cap_data.capability) {
     case TPM2_CAP_TPM_PROPERTIES:
+        session_max = resmgr->session_list->max_per_connection;
         for (i = 0; i < cap_data.data.tpmProperties.count; ++i) {
+            tagged = &cap_data.data.tpmProperties.tpmProperty [i];
             g_debug ("%s: property 0x%" PRIx32 ", value 0x%" PRIx32,
-                     __func__,
-                     cap_data.data.tpmProperties.tpmProperty [i].property,
-                     cap_data.data.tpmProperties.tpmProperty [i].value);
-            switch (cap_data.data.tpmProperties.tpmProperty [i].property) {
+                     __func__, tagged->property, tagged->value);
+            switch (tagged->property) {
             case TPM2_PT_CONTEXT_GAP_MAX:
                 g_debug ("%s: changing TPM2_PT_CONTEXT_GAP_MAX, from 0x%"
                          PRIx32 " to UINT32_MAX: 0x%" PRIx32, __func__,
-                         cap_data.data.tpmProperties.tpmProperty [i].value,
-                         UINT32_MAX);
-                cap_data.data.tpmProperties.tpmProperty [i].value = UINT32_MAX;
+                         tagged->value, UINT32_MAX);
+                tagged->value = UINT32_MAX;
+                break;
+            case TPM2_PT_ACTIVE_SESSIONS_MAX:
+                tagged->value = MIN (tagged->value, session_max);
+                break;
+            case TPM2_PT_HR_TRANSIENT_AVAIL:
+                connection = tpm2_response_get_connection (resp);
+                map = connection_get_trans_map (connection);
+                tagged->value = handle_map_available (map);
+                g_object_unref (map);
+                g_object_unref (connection);
+                break;
+            case TPM2_PT_HR_LOADED_AVAIL:
+                connection = tpm2_response_get_connection (resp);
+                session_count =
+                    session_list_connection_count (resmgr->session_list,
+                                                   connection);
+                tagged->value = session_count < session_max ?
+                    (UINT32)(session_max - session_count) : 0;
+                g_object_unref (connection);
                 break;
             default:
                 break;
@@ -1047,7 +2089,7 @@ get_cap_gen_response (ResourceManager *resmgr,
     Connection *connection = NULL;
     HandleMap *map;
     TPMS_CAPABILITY_DATA cap_data = { .capability = cap };
-    gboolean more_data = FALSE;
+    gboolean more_data = FALSE, invariant = get_cap_invariant (cap, prop);
     uint8_t *resp_buf;
     Tpm2Response *response = NULL;
 
@@ -1070,6 +2112,23 @@ get_cap_gen_response (ResourceManager *resmgr,
                                           CAP_RESP_SIZE (&cap_data),
                                           tpm2_command_get_attributes (command));
             break;
+        case TPM2_HT_LOADED_SESSION:
+        case TPM2_HT_SAVED_SESSION:
+            g_debug ("%s: TPM2_CAP_HANDLES && session handle type 0x%" PRIx32,
+                     __func__, handle_type);
+            connection = tpm2_command_get_connection (command);
+            more_data = get_cap_sessions (resmgr->session_list,
+                                          connection,
+                                          handle_type == TPM2_HT_SAVED_SESSION,
+                                          prop,
+                                          prop_count,
+                                          &cap_data);
+            resp_buf = build_cap_handles_response (&cap_data, more_data);
+            response = tpm2_response_new (connection,
+                                          resp_buf,
+                                          CAP_RESP_SIZE (&cap_data),
+                                          tpm2_command_get_attributes (command));
+            break;
         default:
             g_debug ("%s: TPM2_CAP_HANDLES not virtualized for handle type: "
                      "0x%" PRIx32, __func__, handle_type);
@@ -1077,14 +2136,24 @@ get_cap_gen_response (ResourceManager *resmgr,
         }
         break;
     default:
+        if (invariant) {
+            connection = tpm2_command_get_connection (command);
+            response = get_cap_cache_lookup (resmgr, command, connection);
+            break;
+        }
         g_debug ("%s: cap 0x%" PRIx32 " not handled", __func__, cap);
         break;
     }
 
     if (response == NULL) {
         response = tpm2_send_command (resmgr->tpm2, command, &rc);
-        if (response != NULL && rc == TSS2_RC_SUCCESS) {
-            get_cap_post_process (response);
+        if (response != NULL && rc == TSS2_RC_SUCCESS &&
+            tpm2_response_get_code (response) == TSS2_RC_SUCCESS)
+        {
+            get_cap_post_process (resmgr, response);
+            if (invariant) {
+                get_cap_cache_insert (resmgr, command, response);
+            }
         }
     }
 
@@ -1092,346 +2161,2991 @@ get_cap_gen_response (ResourceManager *resmgr,
     return response;
 }
 /*
- * If the provided command is something that the ResourceManager "virtualizes"
- * then this function will do so and return a Tpm2Response object that will be
- * returned to the same connection. If the command isn't something that we
- * virtualize then we just return NULL.
- *
- * NOTE: Both the ContextSave and ContextLoad commands, when sent by clients,
- * do not result in the command being executed by the TPM. This makes
- * handling the context gap unnecessary for these commands.
+ * Returns TRUE if 'command' is a ReadPublic without sessions for a
+ * persistent object. The response to one of these depends only on the
+ * object, and the object only changes with commands that carry the
+ * TPM2_COMMAND_FLAG_CHANGES_PUBLIC flag.
  */
-Tpm2Response*
-command_special_processing (ResourceManager *resmgr,
-                            Tpm2Command     *command)
+static gboolean
+read_public_cacheable (Tpm2Command *command)
 {
-    Tpm2Response *response   = NULL;
+    return tpm2_command_get_code (command) == TPM2_CC_ReadPublic &&
+        !tpm2_command_has_auths (command) &&
+        tpm2_command_get_handle_count (command) == 1 &&
+        tpm2_command_get_handle (command, 0) >> TPM2_HR_SHIFT ==
+            TPM2_HT_PERSISTENT;
+}
+/*
+ * Answer a ReadPublic command from the read_public_cache.
+ * Returns NULL if the object isn't cached.
+ */
+static Tpm2Response*
+read_public_gen_response (ResourceManager *resmgr,
+                          Tpm2Command     *command)
+{
+    TPM2_HANDLE handle = tpm2_command_get_handle (command, 0);
+    Connection *connection;
+    Tpm2Response *response;
+    GBytes *value;
+    guint8 *buf;
+    gsize size;
 
-    switch (tpm2_command_get_code (command)) {
-    case TPM2_CC_FlushContext:
-        g_debug ("processing TPM2_CC_FlushContext");
-        response = resource_manager_flush_context (resmgr, command);
-        break;
-    case TPM2_CC_ContextSave:
-        g_debug ("processing TPM2_CC_ContextSave");
-        response = resource_manager_save_context (resmgr, command);
-        break;
-    case TPM2_CC_ContextLoad:
-        g_debug ("%s: processing TPM2_CC_ContextLoad", __func__);
-        response = resource_manager_load_context (resmgr, command);
-        break;
-    case TPM2_CC_GetCapability:
-        if (!tpm2_command_has_auths(command)) {
-            g_debug ("processing TPM2_CC_GetCapability");
-            response = get_cap_gen_response (resmgr, command);
-        }
-        break;
-    default:
-        break;
+    value = g_hash_table_lookup (resmgr->read_public_cache,
+                                 GUINT_TO_POINTER (handle));
+    metrics_count (resmgr->metrics,
+                   value != NULL ? METRICS_CACHE_HIT : METRICS_CACHE_MISS);
+    if (value == NULL) {
+        return NULL;
     }
-
+    g_debug ("%s: answering ReadPublic for 0x%" PRIx32 " from cache",
+             __func__, handle);
+    size = g_bytes_get_size (value);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (value, NULL), size);
+    connection = tpm2_command_get_connection (command);
+    response = tpm2_response_new (connection,
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (command));
+    g_object_unref (connection);
     return response;
 }
+static void
+read_public_cache_insert (ResourceManager *resmgr,
+                          Tpm2Command     *command,
+                          Tpm2Response    *response)
+{
+    if (g_hash_table_size (resmgr->read_public_cache) >=
+        RESOURCE_MANAGER_READ_PUBLIC_CACHE_MAX)
+    {
+        return;
+    }
+    g_hash_table_insert (resmgr->read_public_cache,
+                         GUINT_TO_POINTER (tpm2_command_get_handle (command, 0)),
+                         g_bytes_new (tpm2_response_get_buffer (response),
+                                      tpm2_response_get_size (response)));
+}
+typedef struct {
+    Tpm2Command     *command;
+    gboolean         password_only;
+    /* the key being built by primary_key_auth_callback */
+    GByteArray      *key;
+} password_auth_data_t;
 /*
- * This function creates a mapping from the transient physical to a virtual
- * handle in the provided response object. This mapping is then added to
- * the transient HandleMap for the associated connection, as well as the
- * list of currently loaded transient objects.
+ * Clear 'password_only' if the auth at 'auth_offset' isn't a password
+ * session.
  */
-void
-create_context_mapping_transient (ResourceManager  *resmgr,
-                                  Tpm2Response     *response,
-                                  GSList          **loaded_transient_slist)
+static void
+password_auth_callback (gpointer auth_offset_ptr,
+                        gpointer user_data)
 {
-    HandleMap      *handle_map;
-    HandleMapEntry *handle_entry;
-    TPM2_HANDLE      phandle, vhandle;
-    Connection     *connection;
-    UNUSED_PARAM(resmgr);
+    password_auth_data_t *data = (password_auth_data_t*)user_data;
+    size_t auth_offset = *(size_t*)auth_offset_ptr;
 
-    g_debug ("create_context_mapping_transient");
-    phandle = tpm2_response_get_handle (response);
-    g_debug ("  physical handle: 0x%08" PRIx32, phandle);
-    connection = tpm2_response_get_connection (response);
-    handle_map = connection_get_trans_map (connection);
-    g_object_unref (connection);
-    vhandle = handle_map_next_vhandle (handle_map);
-    if (vhandle == 0) {
-        g_error ("vhandle rolled over!");
+    if (tpm2_command_get_auth_handle (data->command, auth_offset) !=
+        TPM2_RS_PW)
+    {
+        data->password_only = FALSE;
     }
-    g_debug ("  vhandle:0x%08" PRIx32, vhandle);
-    handle_entry = handle_map_entry_new (phandle, vhandle);
-    if (handle_entry == NULL) {
-        g_warning ("failed to create new HandleMapEntry for handle 0x%"
-                   PRIx32, phandle);
+}
+/*
+ * Returns TRUE if 'command' has authorizations and all of them are
+ * password sessions. A password session is the same bytes each time it's
+ * sent, so the same command always gets the same response, where HMAC and
+ * policy sessions bind nonces and never repeat.
+ */
+static gboolean
+command_password_only (Tpm2Command *command)
+{
+    password_auth_data_t data = { .command = command, .password_only = TRUE };
+
+    if (tpm2_command_get_auth_count (command) == 0 ||
+        !tpm2_command_foreach_auth (command, password_auth_callback, &data))
+    {
+        return FALSE;
     }
-    *loaded_transient_slist = g_slist_prepend (*loaded_transient_slist,
-                                               handle_entry);
-    handle_map_insert (handle_map, vhandle, handle_entry);
-    g_object_unref (handle_map);
-    tpm2_response_set_handle (response, vhandle);
+    return data.password_only;
 }
 /*
- * This function after a Tpm2Command is sent to the TPM and:
- * - we receive a Tpm2Response object with a handle in the response buffers
- *   handle area
- * - the handle is a session handle
- * Since there's a handle in the response handle area the caller is being
- * returned a new handle after a context was successfully created or loaded.
- * So we know that the response is to one of two possible commands:
- * - a session being loaded by a call to LoadContext
- * - a session was newly created by a call to StartAuthSession
- * We differentiate between these two situations as follows:
- * - A call to 'LoadContext' implies that the session already exists and so
- *   it must already be in the session_list.
- *   - If it's in the session_list *AND NOT* in the abandoned_session_queue
- *     then the caller is just loading a context they already own and so we
- *     set the session state to SAVED_RM and add the session to the list of
- *     loaded sessions.
- *   - If it's *NOT* in the session_list *AND* in the abandoned_session_queue
- *     then the caller is loading a context saved by a different connection
- *     and so we make the current connection the owner of the session, set
- *     the session state to SAVED_RM and add the session to the list of loaded
- *     sessions.
- * - A call to 'StartAuthSession' will return a handle for a session object
- *   that is not in either the session_list or the abandoned_session_queue.
- *   In this case we just create a new SessionEntry and add it to the
- *   session_list and the list of loaded sessions.
- * NOTE: If the response doesn't indicate 'success' then we just ignore it
- * since there's nothing useful that we can do.
+ * NV indexes whose contents can't change without a command that clears
+ * the nv_cache: those that are write locked, and those only the platform
+ * may write. EK certificates are of the second kind.
  */
-void
-create_context_mapping_session (ResourceManager *resmgr,
-                                Tpm2Response    *response,
-                                TPM2_HANDLE      handle)
+static gboolean
+nv_attrs_cacheable (TPMA_NV attrs)
 {
-    SessionEntry *entry = NULL;
-    Connection   *conn_resp = NULL, *conn_entry = NULL;
+    if (!(attrs & TPMA_NV_WRITTEN)) {
+        return FALSE;
+    }
+    return (attrs & TPMA_NV_WRITELOCKED) ||
+        !(attrs & (TPMA_NV_OWNERWRITE | TPMA_NV_AUTHWRITE | TPMA_NV_POLICYWRITE));
+}
+/*
+ * Returns TRUE if the response to 'command' may be kept in the nv_cache:
+ * an NV_ReadPublic without sessions, or an NV_Read of a cacheable index
+ * with only password sessions.
+ * The attributes of an index are known once its NV_ReadPublic has been
+ * seen, which clients send to learn the size of the index before reading.
+ */
+static gboolean
+nv_cacheable (ResourceManager *resmgr,
+              Tpm2Command     *command)
+{
+    gpointer attrs;
 
-    entry = session_list_lookup_handle (resmgr->session_list, handle);
-    conn_resp = tpm2_response_get_connection (response);
-    if (entry != NULL) {
-        g_debug ("%s: got SessionEntry that's in the SessionList", __func__);
-        conn_entry = session_entry_get_connection (entry);
-        if (conn_resp != conn_entry) {
-            g_warning ("%s: connections do not match!", __func__);
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_NV_ReadPublic:
+        return !tpm2_command_has_auths (command) &&
+            tpm2_command_get_handle_count (command) == 1;
+    case TPM2_CC_NV_Read:
+        if (tpm2_command_get_handle_count (command) != 2 ||
+            !command_password_only (command) ||
+            !g_hash_table_lookup_extended (resmgr->nv_attrs,
+                GUINT_TO_POINTER (tpm2_command_get_handle (command, 1)),
+                NULL,
+                &attrs) ||
+            !nv_attrs_cacheable ((TPMA_NV)GPOINTER_TO_UINT (attrs)))
+        {
+            return FALSE;
         }
-    } else {
-        g_debug ("%s: handle is a session, creating entry for SessionList "
-                 "and SessionList", __func__);
-        entry = session_entry_new (conn_resp, handle);
-        session_entry_set_state (entry, SESSION_ENTRY_LOADED);
-        session_list_insert (resmgr->session_list, entry);
+        return TRUE;
+    default:
+        return FALSE;
     }
-    g_clear_object (&conn_resp);
-    g_clear_object (&conn_entry);
-    g_clear_object (&entry);
 }
 /*
- * Each Tpm2Response object can have at most one handle in it.
- * This function assumes that the handle in the parameter Tpm2Response
- * object is the handle assigned by the TPM. Depending on the type of the
- * handle we do to possible things:
- * For TPM2_HT_TRANSIENT handles we create a new virtual handle and
- * allocates a new HandleMapEntry to map the virtual handle to a
- * TPMS_CONTEXT structure when processing future commands associated
- * with the same connection. This HandleMapEntry is inserted into the
- * handle map for the connection. It is also added to the list of loaded
- * transient objects so that it can be saved / flushed by the typical code
- * path.
- * For TPM2_HT_HMAC_SESSION or TPM2_HT_POLICY_SESSION handles we create a
- * new session_entry_t object, populate the connection field with the
- * connection associated with the response object, and set the savedHandle
- * field. We then add this entry to the list of sessions we're tracking
- * (session_slist) and the list of loaded sessions (loaded_session_slist).
+ * Keep a successful response to an NV_ReadPublic or NV_Read in the
+ * nv_cache. The attributes from an NV_ReadPublic response are recorded
+ * for the NV_Read commands that follow.
  */
-void
-resource_manager_create_context_mapping (ResourceManager  *resmgr,
-                                         Tpm2Response     *response,
-                                         GSList          **loaded_transient_slist)
+static void
+nv_cache_insert (ResourceManager *resmgr,
+                 Tpm2Command     *command,
+                 Tpm2Response    *response)
 {
-    TPM2_HANDLE       handle;
+    TPM2B_NV_PUBLIC nv_public = { .size = 0 };
+    size_t offset = TPM_HEADER_SIZE;
+    TSS2_RC rc;
 
-    g_debug ("%s", __func__);
-    if (!tpm2_response_has_handle (response)) {
-        g_debug ("response has no handles");
-        return;
+    if (tpm2_command_get_code (command) == TPM2_CC_NV_ReadPublic) {
+        rc = Tss2_MU_TPM2B_NV_PUBLIC_Unmarshal (tpm2_response_get_buffer (response),
+                                                tpm2_response_get_size (response),
+                                                &offset,
+                                                &nv_public);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_debug ("%s: failed to unmarshal TPM2B_NV_PUBLIC", __func__);
+            return;
+        }
+        g_hash_table_insert (resmgr->nv_attrs,
+                             GUINT_TO_POINTER (nv_public.nvPublic.nvIndex),
+                             GUINT_TO_POINTER (nv_public.nvPublic.attributes));
     }
-    handle = tpm2_response_get_handle (response);
-    switch (handle >> TPM2_HR_SHIFT) {
-    case TPM2_HT_TRANSIENT:
-        create_context_mapping_transient (resmgr, response, loaded_transient_slist);
-        break;
-    case TPM2_HT_HMAC_SESSION:
-    case TPM2_HT_POLICY_SESSION:
-        create_context_mapping_session (resmgr, response, handle);
-        break;
+    response_cache_insert (resmgr->nv_cache,
+                           RESOURCE_MANAGER_NV_CACHE_MAX,
+                           command,
+                           response);
+}
+/*
+ * Answer an NV_ReadPublic or NV_Read command from the nv_cache.
+ * Returns NULL if the command isn't cached.
+ */
+static Tpm2Response*
+nv_gen_response (ResourceManager *resmgr,
+                 Tpm2Command     *command)
+{
+    Connection *connection;
+    Tpm2Response *response;
+
+    connection = tpm2_command_get_connection (command);
+    response = response_cache_lookup (resmgr->nv_cache, command, connection);
+    g_object_unref (connection);
+    metrics_count (resmgr->metrics,
+                   response != NULL ? METRICS_CACHE_HIT : METRICS_CACHE_MISS);
+    if (response != NULL) {
+        g_debug ("%s: answering 0x%" PRIx32 " from cache",
+                 __func__, tpm2_command_get_code (command));
+    }
+    return response;
+}
+/*
+ * Returns TRUE if the response to 'command' may be kept in the
+ * query_cache: a TestParms, ECC_Parameters or GetTestResult without
+ * sessions. What these return depends only on the parameters, the TPM
+ * and its firmware.
+ */
+static gboolean
+query_cacheable (Tpm2Command *command)
+{
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_TestParms:
+    case TPM2_CC_ECC_Parameters:
+    case TPM2_CC_GetTestResult:
+        return !tpm2_command_has_auths (command);
     default:
-        g_debug ("  not creating context for handle: 0x%08" PRIx32, handle);
-        break;
+        return FALSE;
     }
 }
-Tpm2Response*
-send_command_handle_rc (ResourceManager *resmgr,
-                        Tpm2Command *cmd)
+/*
+ * Keep the response to a TestParms, ECC_Parameters or GetTestResult in
+ * the query_cache. Parameters the TPM doesn't support are rejected with a
+ * format one error every time so those are kept too. GetTestResult is
+ * only kept once the self test has passed: before that the result
+ * changes as the tests run.
+ */
+static void
+query_cache_insert (ResourceManager *resmgr,
+                    Tpm2Command     *command,
+                    Tpm2Response    *response)
 {
-    regap_session_data_t data = {
-        .resmgr = resmgr,
-        .ret = TRUE,
-    };
-    Tpm2Response *resp = NULL;
+    TPM2B_MAX_BUFFER out_data = { .size = 0 };
+    UINT32 test_result = TPM2_RC_TESTING;
+    size_t offset = TPM_HEADER_SIZE;
     TSS2_RC rc;
 
-    /* Send command and create response object. */
-    resp = tpm2_send_command (resmgr->tpm2, cmd, &rc);
-    rc = tpm2_response_get_code (resp);
-    if (rc == TPM2_RC_CONTEXT_GAP) {
-        g_debug ("%s: handling TPM2_RC_CONTEXT_GAP", __func__);
-        session_list_foreach (resmgr->session_list,
-                              regap_session_callback,
-                              &data);
-        g_clear_object (&resp);
-        resp = tpm2_send_command (resmgr->tpm2, cmd, &rc);
+    rc = tpm2_response_get_code (response);
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_GetTestResult:
+        if (rc != TSS2_RC_SUCCESS) {
+            return;
+        }
+        rc = Tss2_MU_TPM2B_MAX_BUFFER_Unmarshal (tpm2_response_get_buffer (response),
+                                                 tpm2_response_get_size (response),
+                                                 &offset,
+                                                 &out_data);
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = Tss2_MU_UINT32_Unmarshal (tpm2_response_get_buffer (response),
+                                           tpm2_response_get_size (response),
+                                           &offset,
+                                           &test_result);
+        }
+        if (rc != TSS2_RC_SUCCESS || test_result != TPM2_RC_SUCCESS) {
+            return;
+        }
+        break;
+    default:
+        if (rc != TSS2_RC_SUCCESS &&
+            ((rc & TSS2_RC_LAYER_MASK) != TSS2_TPM_RC_LAYER ||
+             !(rc & TPM2_RC_FMT1)))
+        {
+            return;
+        }
+        break;
+    }
+    if (response_cache_insert (resmgr->query_cache,
+                               RESOURCE_MANAGER_QUERY_CACHE_MAX,
+                               command,
+                               response))
+    {
+        resource_manager_publish_responses (resmgr);
     }
-    return resp;
 }
-/**
- * This function is invoked in response to the receipt of a Tpm2Command.
- * This is the place where we send the command buffer out to the TPM
- * through the Tpm2 which will eventually get it to the TPM for us.
- * The Tpm2 will send us back a Tpm2Response that we send back to
- * the client by way of our Sink object. The flow is roughly:
- * - Receive the Tpm2Command as a parameter
- * - Load all virtualized objects required by the command.
- * - Send the Tpm2Command out through the Tpm2.
- * - Receive the response from the Tpm2.
- * - Virtualize the new objects created by the command & referenced in the
- *   response.
- * - Enqueue the response back out to the processing pipeline through the
- *   Sink object.
- * - Flush all objects loaded for the command or as part of executing the
- *   command..
+/*
+ * Answer a TestParms, ECC_Parameters or GetTestResult command from the
+ * query_cache.
+ * Returns NULL if the command isn't cached.
  */
-void
-resource_manager_process_tpm2_command (ResourceManager   *resmgr,
-                                       Tpm2Command       *command)
+static Tpm2Response*
+query_gen_response (ResourceManager *resmgr,
+                    Tpm2Command     *command)
 {
-    Connection    *connection;
-    Tpm2Response   *response;
-    TSS2_RC         rc = TSS2_RC_SUCCESS;
-    GSList         *transient_slist = NULL;
-    TPMA_CC         command_attrs;
+    Connection *connection;
+    Tpm2Response *response;
 
-    command_attrs = tpm2_command_get_attributes (command);
-    g_debug ("%s", __func__);
-    dump_command (command);
     connection = tpm2_command_get_connection (command);
-    /* If executing the command would exceed a per connection quota */
-    rc = resource_manager_quota_check (resmgr, command);
-    if (rc != TSS2_RC_SUCCESS) {
-        response = tpm2_response_new_rc (connection, rc);
-        goto send_response;
-    }
-    /* Do command-specific processing. */
-    response = command_special_processing (resmgr, command);
+    response = response_cache_lookup (resmgr->query_cache, command, connection);
+    g_object_unref (connection);
+    metrics_count (resmgr->metrics,
+                   response != NULL ? METRICS_CACHE_HIT : METRICS_CACHE_MISS);
     if (response != NULL) {
-        goto send_response;
+        g_debug ("%s: answering 0x%" PRIx32 " from cache",
+                 __func__, tpm2_command_get_code (command));
     }
-    /* Load objects associated with the handles in the command handle area. */
-    if (tpm2_command_get_handle_count (command) > 0) {
-        resource_manager_load_handles (resmgr,
-                                       command,
-                                       &transient_slist);
+    return response;
+}
+/*
+ * Returns the PCRs selected in any bank by the PCR_Read command in 'buf',
+ * one bit per PCR, or all of them if the selection can't be parsed.
+ */
+static guint32
+pcr_read_selected (guint8 const *buf,
+                   size_t        size)
+{
+    TPML_PCR_SELECTION selection = { .count = 0 };
+    size_t offset = TPM_HEADER_SIZE, i, j;
+    guint32 selected = 0;
+
+    if (Tss2_MU_TPML_PCR_SELECTION_Unmarshal (buf,
+                                              size,
+                                              &offset,
+                                              &selection) != TSS2_RC_SUCCESS)
+    {
+        return G_MAXUINT32;
     }
-    /* Load objets associated with the authorizations in the command. */
-    if (tpm2_command_has_auths (command)) {
-        g_info ("%s, Processing auths for command", __func__);
-        auth_callback_data_t auth_callback_data = {
-            .resmgr = resmgr,
-            .command = command,
-        };
-        tpm2_command_foreach_auth (command,
-                                   resource_manager_load_auth_callback,
-                                   &auth_callback_data);
+    for (i = 0; i < selection.count; ++i) {
+        for (j = 0;
+             j < selection.pcrSelections [i].sizeofSelect && j < sizeof (guint32);
+             ++j)
+        {
+            selected |= (guint32)selection.pcrSelections [i].pcrSelect [j] <<
+                (j * 8);
+        }
+    }
+    return selected;
+}
+static gboolean
+pcr_cache_selects (gpointer key,
+                   gpointer value,
+                   gpointer user_data)
+{
+    guint32 pcrs = GPOINTER_TO_UINT (user_data);
+    UNUSED_PARAM (value);
+
+    return (pcr_read_selected (g_bytes_get_data (key, NULL),
+                               g_bytes_get_size (key)) & pcrs) != 0;
+}
+/*
+ * Drop the cached PCR_Read responses that 'command' may make stale: those
+ * that read the PCR in its handle area for commands that change a single
+ * PCR, all of them for the others. A PCR_Extend, PCR_Event or
+ * EventSequenceComplete for TPM2_RH_NULL changes nothing.
+ */
+static void
+pcr_cache_invalidate (ResourceManager *resmgr,
+                      Tpm2Command     *command)
+{
+    TPM2_HANDLE handle;
+
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_PCR_Extend:
+    case TPM2_CC_PCR_Event:
+    case TPM2_CC_PCR_Reset:
+    case TPM2_CC_EventSequenceComplete:
+        if (tpm2_command_get_handle_count (command) == 0) {
+            break;
+        }
+        handle = tpm2_command_get_handle (command, 0);
+        if (handle <= TPM2_PCR_LAST) {
+            g_hash_table_foreach_remove (resmgr->pcr_cache,
+                                         pcr_cache_selects,
+                                         GUINT_TO_POINTER (1U << handle));
+        }
+        return;
+    default:
+        break;
+    }
+    g_hash_table_remove_all (resmgr->pcr_cache);
+}
+/*
+ * Answer a PCR_Read command without sessions from the pcr_cache.
+ * Returns NULL if the selection isn't cached.
+ */
+static Tpm2Response*
+pcr_read_gen_response (ResourceManager *resmgr,
+                       Tpm2Command     *command)
+{
+    Connection *connection;
+    Tpm2Response *response;
+
+    connection = tpm2_command_get_connection (command);
+    response = response_cache_lookup (resmgr->pcr_cache, command, connection);
+    g_object_unref (connection);
+    metrics_count (resmgr->metrics,
+                   response != NULL ? METRICS_CACHE_HIT : METRICS_CACHE_MISS);
+    if (response != NULL) {
+        g_debug ("%s: answering PCR_Read from cache", __func__);
+    }
+    return response;
+}
+/*
+ * A primary object kept in the primary_cache: its saved context and the
+ * response the TPM sent when it was created.
+ */
+typedef struct {
+    /* marshalled TPMS_CONTEXT */
+    GBytes       *context;
+    GBytes       *response;
+} primary_cache_entry_t;
+
+static void
+primary_cache_entry_free (gpointer data)
+{
+    primary_cache_entry_t *entry = (primary_cache_entry_t*)data;
+
+    g_clear_pointer (&entry->context, g_bytes_unref);
+    g_bytes_unref (entry->response);
+    g_free (entry);
+}
+/*
+ * Returns TRUE if the creationPCR parameter of the CreatePrimary in
+ * 'command' selects no PCRs. It follows the inSensitive, inPublic and
+ * outsideInfo TPM2Bs in the parameter area.
+ */
+static gboolean
+create_primary_pcrs_empty (Tpm2Command *command)
+{
+    guint8 *buf = tpm2_command_get_buffer (command);
+    size_t size = tpm2_command_get_size (command);
+    size_t offset = tpm2_command_get_params_offset (command);
+    guint i;
+
+    if (offset == 0) {
+        return FALSE;
+    }
+    for (i = 0; i < 3; ++i) {
+        if (offset + sizeof (UINT16) > size) {
+            return FALSE;
+        }
+        offset += sizeof (UINT16) + be16toh (*(UINT16*)(buf + offset));
+    }
+    if (offset + sizeof (UINT32) > size) {
+        return FALSE;
+    }
+    return be32toh (*(UINT32*)(buf + offset)) == 0;
+}
+/*
+ * Returns TRUE if the primary object created by 'command' may be kept in
+ * the primary_cache. The same CreatePrimary gets the same object, and the
+ * same response, as long as the hierarchy's seed and auth don't change.
+ * That holds when the command has only password sessions and its creation
+ * data doesn't depend on the current PCR values.
+ */
+static gboolean
+primary_cacheable (ResourceManager *resmgr,
+                   Tpm2Command     *command)
+{
+    return resmgr->primary_cache != NULL &&
+        tpm2_command_get_code (command) == TPM2_CC_CreatePrimary &&
+        command_password_only (command) &&
+        create_primary_pcrs_empty (command);
+}
+/*
+ * Append the password of the session at 'auth_offset' to the GByteArray
+ * in 'user_data' as a TPM2B.
+ */
+static void
+primary_key_auth_callback (gpointer auth_offset_ptr,
+                           gpointer user_data)
+{
+    password_auth_data_t *data = (password_auth_data_t*)user_data;
+    size_t auth_offset = *(size_t*)auth_offset_ptr;
+    guint8 *value;
+    UINT16 size = 0, size_be;
+
+    value = tpm2_command_get_auth_value (data->command, auth_offset, &size);
+    if (value == NULL) {
+        data->password_only = FALSE;
+        return;
+    }
+    size_be = htobe16 (size);
+    g_byte_array_append (data->key, (guint8*)&size_be, sizeof (size_be));
+    g_byte_array_append (data->key, value, size);
+}
+/*
+ * Returns the key a CreatePrimary is kept under in the primary_cache: the
+ * hierarchy handle, the locality of the connection, whose creationData
+ * and creation ticket cover it, the password of each session and the
+ * parameters. The
+ * nonce and attributes of a password session don't change the object the
+ * TPM creates, and leaving them out lets clients whose TSS fills them in
+ * differently share the object, as well as the primaries created from
+ * --primary-template. Returns NULL if the command is malformed.
+ */
+static GBytes*
+primary_cache_key (Tpm2Command *command)
+{
+    guint8 *buf = tpm2_command_get_buffer (command);
+    size_t size = tpm2_command_get_size (command);
+    size_t offset = tpm2_command_get_params_offset (command);
+    guint8 locality = TPM2_LOC_ZERO;
+    password_auth_data_t data = {
+        .command = command,
+        .password_only = TRUE,
+        .key = g_byte_array_new (),
+    };
+
+    if (offset == 0 || offset > size ||
+        TPM_HEADER_SIZE + sizeof (TPM2_HANDLE) > size)
+    {
+        g_byte_array_unref (data.key);
+        return NULL;
+    }
+    g_byte_array_append (data.key, buf + TPM_HEADER_SIZE, sizeof (TPM2_HANDLE));
+    if (command->connection != NULL) {
+        locality = connection_get_locality (command->connection);
+    }
+    g_byte_array_append (data.key, &locality, sizeof (locality));
+    if (!tpm2_command_foreach_auth (command, primary_key_auth_callback, &data) ||
+        !data.password_only)
+    {
+        g_byte_array_unref (data.key);
+        return NULL;
+    }
+    g_byte_array_append (data.key, buf + offset, size - offset);
+    return g_byte_array_free_to_bytes (data.key);
+}
+/*
+ * Answer a CreatePrimary from the primary_cache: the saved primary is
+ * loaded in place of creating it again and the response the TPM sent
+ * for it is returned with the new handle. An entry whose context can't be
+ * loaded is dropped.
+ * Returns NULL if the command must go to the TPM.
+ */
+static Tpm2Response*
+primary_cache_gen_response (ResourceManager *resmgr,
+                            Tpm2Command     *command)
+{
+    primary_cache_entry_t *entry;
+    TPM2_HANDLE phandle;
+    Connection *connection;
+    Tpm2Response *response;
+    GBytes *key;
+    guint8 *buf;
+    gsize size;
+    TSS2_RC rc;
+
+    key = primary_cache_key (command);
+    if (key == NULL) {
+        return NULL;
+    }
+    entry = g_hash_table_lookup (resmgr->primary_cache, key);
+    metrics_count (resmgr->metrics,
+                   entry != NULL ? METRICS_CACHE_HIT : METRICS_CACHE_MISS);
+    if (entry == NULL) {
+        g_bytes_unref (key);
+        return NULL;
+    }
+    rc = tpm2_context_load (resmgr->tpm2, entry->context, &phandle);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_debug ("%s: failed to load cached primary, RC: 0x%" PRIx32,
+                 __func__, rc);
+        g_hash_table_remove (resmgr->primary_cache, key);
+        g_bytes_unref (key);
+        return NULL;
+    }
+    g_bytes_unref (key);
+    g_debug ("%s: loaded cached primary as 0x%" PRIx32, __func__, phandle);
+    size = g_bytes_get_size (entry->response);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (entry->response, NULL), size);
+    *(TPM2_HANDLE*)(buf + TPM_HEADER_SIZE) = htobe32 (phandle);
+    connection = tpm2_command_get_connection (command);
+    response = tpm2_response_new (connection,
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (command));
+    g_object_unref (connection);
+    return response;
+}
+/*
+ * Save the primary the TPM created for 'command' and keep it, with the
+ * response, in the primary_cache. The object stays loaded for the client.
+ */
+static void
+primary_cache_insert (ResourceManager *resmgr,
+                      Tpm2Command     *command,
+                      Tpm2Response    *response)
+{
+    primary_cache_entry_t *entry;
+    GBytes *key;
+    TSS2_RC rc;
+
+    if (g_hash_table_size (resmgr->primary_cache) >=
+        RESOURCE_MANAGER_PRIMARY_CACHE_MAX ||
+        !tpm2_response_has_handle (response))
+    {
+        return;
+    }
+    key = primary_cache_key (command);
+    if (key == NULL) {
+        return;
+    }
+    if (g_hash_table_contains (resmgr->primary_cache, key)) {
+        g_bytes_unref (key);
+        return;
+    }
+    entry = g_new0 (primary_cache_entry_t, 1);
+    rc = tpm2_context_save (resmgr->tpm2,
+                            tpm2_response_get_handle (response),
+                            &entry->context);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_debug ("%s: failed to save primary, RC: 0x%" PRIx32, __func__, rc);
+        g_free (entry);
+        g_bytes_unref (key);
+        return;
+    }
+    entry->response = g_bytes_new (tpm2_response_get_buffer (response),
+                                   tpm2_response_get_size (response));
+    g_hash_table_insert (resmgr->primary_cache, key, entry);
+}
+/*
+ * Returns the name of the object created or loaded by the command
+ * 'response' answers: the TPM2B_NAME without its size that follows the
+ * other parameters of a CreatePrimary, Load, LoadExternal or CreateLoaded
+ * response. Returns NULL for other responses or if the name isn't there.
+ */
+static GBytes*
+response_object_name (Tpm2Response *response)
+{
+    guint8 *buf = tpm2_response_get_buffer (response);
+    size_t size = tpm2_response_get_size (response);
+    size_t offset = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE);
+    UINT16 name_size = 0;
+    guint skip, i;
+
+    switch (tpm2_response_get_attributes (response) & TPMA_CC_COMMANDINDEX_MASK) {
+    case TPM2_CC_Load:
+    case TPM2_CC_LoadExternal:
+        skip = 0;
+        break;
+    case TPM2_CC_CreateLoaded:
+        /* outPrivate and outPublic */
+        skip = 2;
+        break;
+    case TPM2_CC_CreatePrimary:
+        /* outPublic, creationData, creationHash and the ticket's digest */
+        skip = 4;
+        break;
+    default:
+        return NULL;
+    }
+    if (tpm2_response_get_tag (response) == TPM2_ST_SESSIONS) {
+        offset += sizeof (UINT32);
+    }
+    for (i = 0; i <= skip; ++i) {
+        if (i == 3) {
+            /* the tag and hierarchy of the TPMT_TK_CREATION */
+            offset += sizeof (TPM2_ST) + sizeof (TPMI_RH_HIERARCHY);
+        }
+        if (offset + sizeof (UINT16) > size) {
+            return NULL;
+        }
+        name_size = be16toh (*(UINT16*)(buf + offset));
+        offset += sizeof (UINT16);
+        if (offset + name_size > size) {
+            return NULL;
+        }
+        offset += name_size;
+    }
+    if (name_size == 0) {
+        return NULL;
+    }
+    return g_bytes_new (buf + offset - name_size, name_size);
+}
+/*
+ * Returns the key a Load is kept under in the load_cache, NULL if the
+ * object it loads may not be kept. That's the case for a Load with only
+ * password sessions, so that the same bytes carry the same authorization
+ * for the parent, under a persistent parent or a transient one whose name
+ * is known. The key is the parent's handle or name followed by the
+ * command after its handle area: the auth area, inPrivate and inPublic.
+ * A persistent handle can't be mistaken for a name, which starts with
+ * a hash algorithm. Commands that change a persistent handle's object
+ * clear the cache.
+ */
+static GBytes*
+load_cache_key (ResourceManager *resmgr,
+                Tpm2Command     *command)
+{
+    guint8 *buf = tpm2_command_get_buffer (command);
+    size_t offset = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE);
+    TPM2_HANDLE parent;
+    HandleMapEntry *entry;
+    Connection *connection;
+    HandleMap *map;
+    GByteArray *key;
+    GBytes *name = NULL;
+
+    if (resmgr->load_cache == NULL ||
+        tpm2_command_get_code (command) != TPM2_CC_Load ||
+        tpm2_command_get_handle_count (command) != 1 ||
+        tpm2_command_get_size (command) <= offset ||
+        !command_password_only (command))
+    {
+        return NULL;
+    }
+    parent = tpm2_command_get_handle (command, 0);
+    switch (parent >> TPM2_HR_SHIFT) {
+    case TPM2_HT_PERSISTENT:
+        break;
+    case TPM2_HT_TRANSIENT:
+        connection = tpm2_command_get_connection (command);
+        map = connection_get_trans_map (connection);
+        entry = handle_map_vlookup (map, parent);
+        if (entry != NULL && handle_map_entry_get_name (entry) != NULL) {
+            name = g_bytes_ref (handle_map_entry_get_name (entry));
+        }
+        g_clear_object (&entry);
+        g_object_unref (map);
+        g_object_unref (connection);
+        if (name == NULL) {
+            return NULL;
+        }
+        break;
+    default:
+        return NULL;
+    }
+    key = g_byte_array_new ();
+    if (name != NULL) {
+        g_byte_array_append (key,
+                             g_bytes_get_data (name, NULL),
+                             g_bytes_get_size (name));
+        g_bytes_unref (name);
+    } else {
+        g_byte_array_append (key, buf + TPM_HEADER_SIZE, sizeof (TPM2_HANDLE));
+    }
+    g_byte_array_append (key,
+                         buf + offset,
+                         tpm2_command_get_size (command) - offset);
+    return g_byte_array_free_to_bytes (key);
+}
+/*
+ * Answer a Load from the load_cache: the object's saved context is loaded
+ * in place of loading the blobs under the parent again, so the parent
+ * needn't be loaded either. The response the TPM sent for the object is
+ * returned with the new handle. An entry whose context can't be loaded is
+ * dropped.
+ * Returns NULL if the command must go to the TPM.
+ */
+static Tpm2Response*
+load_cache_gen_response (ResourceManager *resmgr,
+                         Tpm2Command     *command,
+                         GBytes          *key)
+{
+    primary_cache_entry_t *entry;
+    TPM2_HANDLE phandle = 0;
+    Connection *connection;
+    Tpm2Response *response;
+    guint8 *buf;
+    gsize size;
+    TSS2_RC rc;
+
+    entry = g_hash_table_lookup (resmgr->load_cache, key);
+    metrics_count (resmgr->metrics,
+                   entry != NULL ? METRICS_CACHE_HIT : METRICS_CACHE_MISS);
+    if (entry == NULL) {
+        return NULL;
+    }
+    rc = tpm2_context_load (resmgr->tpm2, entry->context, &phandle);
+    while (resource_manager_evict_for_rc (resmgr, rc, NULL, command)) {
+        rc = tpm2_context_load (resmgr->tpm2, entry->context, &phandle);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        g_debug ("%s: failed to load cached object, RC: 0x%" PRIx32,
+                 __func__, rc);
+        g_hash_table_remove (resmgr->load_cache, key);
+        return NULL;
+    }
+    g_debug ("%s: loaded cached object as 0x%" PRIx32, __func__, phandle);
+    size = g_bytes_get_size (entry->response);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (entry->response, NULL), size);
+    *(TPM2_HANDLE*)(buf + TPM_HEADER_SIZE) = htobe32 (phandle);
+    connection = tpm2_command_get_connection (command);
+    response = tpm2_response_new (connection,
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (command));
+    g_object_unref (connection);
+    return response;
+}
+/*
+ * Save the object the TPM loaded for a Load and keep it, with the
+ * response, in the load_cache under 'key'. The object stays loaded for
+ * the client. Entries are kept like those of the primary_cache.
+ */
+static void
+load_cache_insert (ResourceManager *resmgr,
+                   GBytes          *key,
+                   Tpm2Response    *response)
+{
+    primary_cache_entry_t *entry;
+    TSS2_RC rc;
+
+    if (g_hash_table_size (resmgr->load_cache) >=
+        RESOURCE_MANAGER_LOAD_CACHE_MAX ||
+        !tpm2_response_has_handle (response) ||
+        g_hash_table_contains (resmgr->load_cache, key))
+    {
+        return;
+    }
+    entry = g_new0 (primary_cache_entry_t, 1);
+    rc = tpm2_context_save (resmgr->tpm2,
+                            tpm2_response_get_handle (response),
+                            &entry->context);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_debug ("%s: failed to save object, RC: 0x%" PRIx32, __func__, rc);
+        g_free (entry);
+        return;
+    }
+    entry->response = g_bytes_new (tpm2_response_get_buffer (response),
+                                   tpm2_response_get_size (response));
+    g_hash_table_insert (resmgr->load_cache, g_bytes_ref (key), entry);
+}
+/*
+ * Answer a TPM2_GetRandom command from the random_pool. Only commands
+ * without sessions asking for at most RANDOM_POOL_REQUEST_MAX bytes are
+ * answered: the bytes for larger ones are better spent on small requests.
+ * Returns NULL if the command must go to the TPM.
+ */
+static Tpm2Response*
+get_random_gen_response (ResourceManager *resmgr,
+                         Tpm2Command     *command)
+{
+    guint8 *cmd_buf = tpm2_command_get_buffer (command), *resp_buf;
+    Connection *connection;
+    Tpm2Response *response;
+    size_t resp_size;
+    UINT16 requested;
+
+    if (tpm2_command_get_size (command) != TPM_HEADER_SIZE + sizeof (UINT16)) {
+        return NULL;
+    }
+    requested = be16toh (*(UINT16*)(cmd_buf + TPM_HEADER_SIZE));
+    if (requested > RANDOM_POOL_REQUEST_MAX) {
+        return NULL;
+    }
+    resp_size = TPM_HEADER_SIZE + sizeof (UINT16) + requested;
+    resp_buf = g_malloc0 (resp_size);
+    if (!random_pool_take (resmgr->random_pool,
+                           resp_buf + TPM_HEADER_SIZE + sizeof (UINT16),
+                           requested))
+    {
+        g_debug ("%s: pool holds fewer than %" PRIu16 " bytes",
+                 __func__, requested);
+        g_free (resp_buf);
+        return NULL;
+    }
+    set_response_tag (resp_buf, TPM2_ST_NO_SESSIONS);
+    set_response_size (resp_buf, resp_size);
+    set_response_code (resp_buf, TSS2_RC_SUCCESS);
+    *(UINT16*)(resp_buf + TPM_HEADER_SIZE) = htobe16 (requested);
+    connection = tpm2_command_get_connection (command);
+    response = tpm2_response_new (connection,
+                                  resp_buf,
+                                  resp_size,
+                                  tpm2_command_get_attributes (command));
+    g_object_unref (connection);
+    return response;
+}
+/*
+ * If the provided command is something that the ResourceManager "virtualizes"
+ * then this function will do so and return a Tpm2Response object that will be
+ * returned to the same connection. If the command isn't something that we
+ * virtualize then we just return NULL.
+ *
+ * NOTE: Both the ContextSave and ContextLoad commands, when sent by clients,
+ * do not result in the command being executed by the TPM. This makes
+ * handling the context gap unnecessary for these commands.
+ */
+Tpm2Response*
+command_special_processing (ResourceManager *resmgr,
+                            Tpm2Command     *command)
+{
+    Tpm2Response *response   = NULL;
+
+    if (!(tpm2_command_get_flags (command) & TPM2_COMMAND_FLAG_SPECIAL)) {
+        return NULL;
+    }
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_FlushContext:
+        g_debug ("processing TPM2_CC_FlushContext");
+        response = resource_manager_flush_context (resmgr, command);
+        break;
+    case TPM2_CC_ContextSave:
+        g_debug ("processing TPM2_CC_ContextSave");
+        response = resource_manager_save_context (resmgr, command);
+        break;
+    case TPM2_CC_ContextLoad:
+        g_debug ("%s: processing TPM2_CC_ContextLoad", __func__);
+        response = resource_manager_load_context (resmgr, command);
+        break;
+    case TPM2_CC_GetCapability:
+        if (!tpm2_command_has_auths(command)) {
+            g_debug ("processing TPM2_CC_GetCapability");
+            response = get_cap_gen_response (resmgr, command);
+        }
+        break;
+    case TPM2_CC_ReadPublic:
+        if (read_public_cacheable (command)) {
+            response = read_public_gen_response (resmgr, command);
+        }
+        break;
+    case TPM2_CC_NV_Read:
+    case TPM2_CC_NV_ReadPublic:
+        if (nv_cacheable (resmgr, command)) {
+            response = nv_gen_response (resmgr, command);
+        }
+        break;
+    case TPM2_CC_TestParms:
+    case TPM2_CC_ECC_Parameters:
+    case TPM2_CC_GetTestResult:
+        if (query_cacheable (command)) {
+            response = query_gen_response (resmgr, command);
+        }
+        break;
+    case TPM2_CC_PCR_Read:
+        if (resmgr->pcr_cache != NULL && !tpm2_command_has_auths (command)) {
+            response = pcr_read_gen_response (resmgr, command);
+        }
+        break;
+    case TPM2_CC_GetRandom:
+        if (resmgr->random_pool != NULL && !tpm2_command_has_auths (command)) {
+            response = get_random_gen_response (resmgr, command);
+        }
+        break;
+    case TABRMD_CC_RESIDENCY:
+        response = resource_manager_residency (resmgr, command);
+        break;
+    case TABRMD_CC_NV_READ_LARGE:
+    case TABRMD_CC_NV_WRITE_LARGE:
+        response = resource_manager_nv_large (resmgr, command);
+        break;
+    default:
+        break;
+    }
+
+    return response;
+}
+/*
+ * GHFunc counting the HandleMapEntries other than 'skip' kept resident by
+ * their hint.
+ */
+typedef struct {
+    HandleMapEntry *skip;
+    guint           count;
+} count_kept_data_t;
+static void
+count_kept_callback (gpointer key,
+                     gpointer value,
+                     gpointer user_data)
+{
+    count_kept_data_t *data = (count_kept_data_t*)user_data;
+    HandleMapEntry *entry = HANDLE_MAP_ENTRY (value);
+    UNUSED_PARAM (key);
+
+    if (entry != data->skip && residency_kept (entry)) {
+        ++data->count;
+    }
+}
+/*
+ * Take the residency hint of a TABRMD_CC_RESIDENCY command for one of
+ * the connection's transient objects. An object becomes hot or pinned
+ * only while the connection has fewer than 'pinned_max' of them: each
+ * takes an object slot in the TPM away from the other connections.
+ * Returns the response to the command.
+ */
+Tpm2Response*
+resource_manager_residency (ResourceManager *resmgr,
+                            Tpm2Command     *command)
+{
+    count_kept_data_t data = { .count = 0 };
+    Connection *connection;
+    HandleMap *map;
+    HandleMapEntry *entry;
+    Tpm2Response *response;
+    guint8 *buffer = tpm2_command_get_buffer (command);
+    TPM2_HANDLE vhandle;
+    guint8 residency;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    connection = tpm2_command_get_connection (command);
+    if (tpm2_command_get_size (command) != TABRMD_RESIDENCY_SIZE ||
+        get_command_tag (buffer) != TPM2_ST_NO_SESSIONS)
+    {
+        response = tpm2_response_new_rc (connection,
+                                         RM_RC (TPM2_RC_COMMAND_SIZE));
+        g_object_unref (connection);
+        return response;
+    }
+    memcpy (&vhandle, &buffer [TPM_HEADER_SIZE], sizeof (vhandle));
+    vhandle = be32toh (vhandle);
+    residency = buffer [TPM_HEADER_SIZE + sizeof (vhandle)];
+    map = connection_get_trans_map (connection);
+    entry = handle_map_vlookup (map, vhandle);
+    if (entry == NULL) {
+        rc = RM_RC (TPM2_RC_HANDLE + TPM2_RC_P + TPM2_RC_1);
+    } else if (residency > TABRMD_RESIDENCY_EVICT_FIRST) {
+        rc = RM_RC (TPM2_RC_VALUE + TPM2_RC_P + TPM2_RC_2);
+    } else {
+        data.skip = entry;
+        handle_map_foreach (map, count_kept_callback, &data);
+        if ((residency == TABRMD_RESIDENCY_HOT ||
+             residency == TABRMD_RESIDENCY_PINNED) &&
+            data.count >= resmgr->pinned_max)
+        {
+            g_debug ("%s: connection 0x%" PRIx64 " has %u objects kept "
+                     "resident already", __func__, connection->id, data.count);
+            rc = TSS2_RESMGR_RC_OBJECT_MEMORY;
+        } else {
+            handle_map_entry_set_residency (entry, residency);
+        }
+    }
+    g_clear_object (&entry);
+    g_object_unref (map);
+    response = tpm2_response_new_rc (connection, rc);
+    g_object_unref (connection);
+    return response;
+}
+/*
+ * The most bytes of NV the TPM takes in one NV_Read or NV_Write.
+ */
+static UINT16
+nv_chunk_max (ResourceManager *resmgr)
+{
+    guint32 value;
+
+    if (tpm2_get_fixed_property (resmgr->tpm2,
+                                 TPM2_PT_NV_BUFFER_MAX,
+                                 &value) != TSS2_RC_SUCCESS ||
+        value == 0)
+    {
+        return TPM2_MAX_NV_BUFFER_SIZE;
+    }
+    return (UINT16)MIN (value, TPM2_MAX_NV_BUFFER_SIZE);
+}
+/*
+ * Carry out a TABRMD_CC_NV_READ_LARGE or TABRMD_CC_NV_WRITE_LARGE command
+ * as NV_Read or NV_Write commands of at most nv_chunk_max bytes. They're
+ * sent one after the other from this thread so no other command gets to
+ * the TPM in between.
+ * Returns the response to the command.
+ */
+Tpm2Response*
+resource_manager_nv_large (ResourceManager *resmgr,
+                           Tpm2Command     *command)
+{
+    guint8 *buffer = tpm2_command_get_buffer (command), *resp_buf = NULL;
+    size_t size = tpm2_command_get_size (command);
+    size_t offset = TPM_HEADER_SIZE, resp_size;
+    gboolean write = tpm2_command_get_code (command) == TABRMD_CC_NV_WRITE_LARGE;
+    TPMI_RH_NV_AUTH auth_handle;
+    TPMI_RH_NV_INDEX nv_index;
+    TPM2B_AUTH auth = { .size = 0 };
+    TPM2B_MAX_NV_BUFFER chunk;
+    UINT16 nv_offset, length, done, want, chunk_max;
+    Connection *connection;
+    Tpm2Response *response;
+    TSS2_RC rc;
+
+    connection = tpm2_command_get_connection (command);
+    if (get_command_tag (buffer) != TPM2_ST_NO_SESSIONS ||
+        Tss2_MU_TPM2_HANDLE_Unmarshal (buffer, size, &offset, &auth_handle) ||
+        Tss2_MU_TPM2_HANDLE_Unmarshal (buffer, size, &offset, &nv_index) ||
+        Tss2_MU_TPM2B_AUTH_Unmarshal (buffer, size, &offset, &auth) ||
+        Tss2_MU_UINT16_Unmarshal (buffer, size, &offset, &nv_offset) ||
+        Tss2_MU_UINT16_Unmarshal (buffer, size, &offset, &length) ||
+        offset + (write ? length : 0) != size)
+    {
+        rc = RM_RC (TPM2_RC_COMMAND_SIZE);
+        goto out;
+    }
+    if (length > TABRMD_NV_LARGE_MAX) {
+        rc = RM_RC (TPM2_RC_SIZE + TPM2_RC_P + TPM2_RC_5);
+        goto out;
+    }
+    if ((guint32)nv_offset + length > G_MAXUINT16) {
+        rc = RM_RC (TPM2_RC_VALUE + TPM2_RC_P + TPM2_RC_4);
+        goto out;
+    }
+    resp_size = TPM_HEADER_SIZE + (write ? 0 : sizeof (UINT16) + length);
+    resp_buf = g_malloc0 (resp_size);
+    chunk_max = nv_chunk_max (resmgr);
+    g_debug ("%s: %s 0x%" PRIx16 " bytes of NV index 0x%" PRIx32
+             " in chunks of 0x%" PRIx16, __func__, write ? "writing" : "reading",
+             length, nv_index, chunk_max);
+    rc = TSS2_RC_SUCCESS;
+    for (done = 0; rc == TSS2_RC_SUCCESS && done < length; done += want) {
+        want = MIN (length - done, chunk_max);
+        if (write) {
+            chunk.size = want;
+            memcpy (chunk.buffer, &buffer [offset + done], want);
+            rc = tpm2_nv_write (resmgr->tpm2, auth_handle, nv_index, &auth,
+                                &chunk, nv_offset + done);
+            continue;
+        }
+        rc = tpm2_nv_read (resmgr->tpm2, auth_handle, nv_index, &auth,
+                           want, nv_offset + done, &chunk);
+        if (rc == TSS2_RC_SUCCESS && chunk.size != want) {
+            rc = RM_RC (TPM2_RC_FAILURE);
+        } else if (rc == TSS2_RC_SUCCESS) {
+            memcpy (&resp_buf [TPM_HEADER_SIZE + sizeof (UINT16) + done],
+                    chunk.buffer,
+                    want);
+        }
+    }
+    if (write && done > 0) {
+        g_debug ("%s: clearing NV cache", __func__);
+        g_hash_table_remove_all (resmgr->nv_cache);
+        g_hash_table_remove_all (resmgr->nv_attrs);
+    }
+out:
+    if (rc != TSS2_RC_SUCCESS) {
+        g_free (resp_buf);
+        response = tpm2_response_new_rc (connection, rc);
+        g_object_unref (connection);
+        return response;
+    }
+    set_response_tag (resp_buf, TPM2_ST_NO_SESSIONS);
+    set_response_size (resp_buf, resp_size);
+    set_response_code (resp_buf, TSS2_RC_SUCCESS);
+    if (!write) {
+        *(UINT16*)&resp_buf [TPM_HEADER_SIZE] = htobe16 (length);
+    }
+    response = tpm2_response_new (connection,
+                                  resp_buf,
+                                  resp_size,
+                                  tpm2_command_get_attributes (command));
+    g_object_unref (connection);
+    return response;
+}
+/*
+ * This function creates a mapping from the transient physical to a virtual
+ * handle in the provided response object. This mapping is then added to
+ * the transient HandleMap for the associated connection, as well as the
+ * list of currently loaded transient objects.
+ */
+void
+create_context_mapping_transient (ResourceManager  *resmgr,
+                                  Tpm2Response     *response,
+                                  GSList          **loaded_transient_slist)
+{
+    HandleMap      *handle_map;
+    HandleMapEntry *handle_entry;
+    TPM2_HANDLE      phandle, vhandle;
+    Connection     *connection;
+    GBytes         *name;
+    UNUSED_PARAM(resmgr);
+
+    g_debug ("create_context_mapping_transient");
+    phandle = tpm2_response_get_handle (response);
+    g_debug ("  physical handle: 0x%08" PRIx32, phandle);
+    connection = tpm2_response_get_connection (response);
+    handle_map = connection_get_trans_map (connection);
+    g_object_unref (connection);
+    vhandle = handle_map_next_vhandle (handle_map);
+    if (vhandle == 0) {
+        g_error ("vhandle rolled over!");
+    }
+    g_debug ("  vhandle:0x%08" PRIx32, vhandle);
+    handle_entry = handle_map_entry_new (phandle, vhandle);
+    if (handle_entry == NULL) {
+        g_warning ("failed to create new HandleMapEntry for handle 0x%"
+                   PRIx32, phandle);
+    }
+    name = response_object_name (response);
+    if (name != NULL) {
+        handle_map_entry_set_name (handle_entry, name);
+        g_bytes_unref (name);
+    }
+    *loaded_transient_slist = arena_slist_prepend (&resmgr->arena,
+                                                   *loaded_transient_slist,
+                                                   handle_entry);
+    handle_map_insert (handle_map, vhandle, handle_entry);
+    g_object_unref (handle_map);
+    tpm2_response_set_handle (response, vhandle);
+}
+/*
+ * This function after a Tpm2Command is sent to the TPM and:
+ * - we receive a Tpm2Response object with a handle in the response buffers
+ *   handle area
+ * - the handle is a session handle
+ * Since there's a handle in the response handle area the caller is being
+ * returned a new handle after a context was successfully created or loaded.
+ * So we know that the response is to one of two possible commands:
+ * - a session being loaded by a call to LoadContext
+ * - a session was newly created by a call to StartAuthSession
+ * We differentiate between these two situations as follows:
+ * - A call to 'LoadContext' implies that the session already exists and so
+ *   it must already be in the session_list.
+ *   - If it's in the session_list *AND NOT* in the abandoned_session_queue
+ *     then the caller is just loading a context they already own and so we
+ *     set the session state to SAVED_RM and add the session to the list of
+ *     loaded sessions.
+ *   - If it's *NOT* in the session_list *AND* in the abandoned_session_queue
+ *     then the caller is loading a context saved by a different connection
+ *     and so we make the current connection the owner of the session, set
+ *     the session state to SAVED_RM and add the session to the list of loaded
+ *     sessions.
+ * - A call to 'StartAuthSession' will return a handle for a session object
+ *   that is not in either the session_list or the abandoned_session_queue.
+ *   In this case we just create a new SessionEntry and add it to the
+ *   session_list and the list of loaded sessions.
+ * NOTE: If the response doesn't indicate 'success' then we just ignore it
+ * since there's nothing useful that we can do.
+ */
+void
+create_context_mapping_session (ResourceManager *resmgr,
+                                Tpm2Response    *response,
+                                TPM2_HANDLE      handle)
+{
+    SessionEntry *entry = NULL;
+    Connection   *conn_resp = NULL, *conn_entry = NULL;
+
+    entry = session_list_lookup_handle (resmgr->session_list, handle);
+    conn_resp = tpm2_response_get_connection (response);
+    if (entry != NULL) {
+        g_debug ("%s: got SessionEntry that's in the SessionList", __func__);
+        conn_entry = session_entry_get_connection (entry);
+        if (conn_resp != conn_entry) {
+            g_warning ("%s: connections do not match!", __func__);
+        }
+    } else {
+        g_debug ("%s: handle is a session, creating entry for SessionList "
+                 "and SessionList", __func__);
+        entry = session_entry_new (conn_resp, handle);
+        session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+        session_entry_set_last_use (entry, ++resmgr->use_clock);
+        session_list_insert (resmgr->session_list, entry);
+    }
+    g_clear_object (&conn_resp);
+    g_clear_object (&conn_entry);
+    g_clear_object (&entry);
+}
+/*
+ * Each Tpm2Response object can have at most one handle in it.
+ * This function assumes that the handle in the parameter Tpm2Response
+ * object is the handle assigned by the TPM. Depending on the type of the
+ * handle we do to possible things:
+ * For TPM2_HT_TRANSIENT handles we create a new virtual handle and
+ * allocates a new HandleMapEntry to map the virtual handle to a
+ * TPMS_CONTEXT structure when processing future commands associated
+ * with the same connection. This HandleMapEntry is inserted into the
+ * handle map for the connection. It is also added to the list of loaded
+ * transient objects so that it can be saved / flushed by the typical code
+ * path.
+ * For TPM2_HT_HMAC_SESSION or TPM2_HT_POLICY_SESSION handles we create a
+ * new session_entry_t object, populate the connection field with the
+ * connection associated with the response object, and set the savedHandle
+ * field. We then add this entry to the list of sessions we're tracking
+ * (session_slist) and the list of loaded sessions (loaded_session_slist).
+ */
+void
+resource_manager_create_context_mapping (ResourceManager  *resmgr,
+                                         Tpm2Response     *response,
+                                         GSList          **loaded_transient_slist)
+{
+    TPM2_HANDLE       handle;
+
+    g_debug ("%s", __func__);
+    if (!tpm2_response_has_handle (response)) {
+        g_debug ("response has no handles");
+        return;
+    }
+    handle = tpm2_response_get_handle (response);
+    switch (handle >> TPM2_HR_SHIFT) {
+    case TPM2_HT_TRANSIENT:
+        create_context_mapping_transient (resmgr, response, loaded_transient_slist);
+        break;
+    case TPM2_HT_HMAC_SESSION:
+    case TPM2_HT_POLICY_SESSION:
+        create_context_mapping_session (resmgr, response, handle);
+        break;
+    default:
+        g_debug ("  not creating context for handle: 0x%08" PRIx32, handle);
+        break;
+    }
+}
+/*
+ * TPM2_RC_RETRY, TPM2_RC_YIELDED and TPM2_RC_TESTING tell the caller to
+ * send the same command again later.
+ */
+static gboolean
+is_retry_rc (TSS2_RC rc)
+{
+    return rc == TPM2_RC_RETRY || rc == TPM2_RC_YIELDED ||
+        rc == TPM2_RC_TESTING;
+}
+/*
+ * Send 'cmd' to the TPM. Sessions are regapped and the command resent
+ * once on TPM2_RC_CONTEXT_GAP. Responses asking for the command to be
+ * retried are handled here, with exponential backoff, while the contexts
+ * the command needs are still loaded. A client retrying on its own would
+ * have them saved and loaded again for each attempt.
+ */
+Tpm2Response*
+send_command_handle_rc (ResourceManager *resmgr,
+                        Tpm2Command *cmd)
+{
+    Tpm2Response *resp = NULL;
+    TSS2_RC rc;
+    gulong delay = RESOURCE_MANAGER_RETRY_DELAY_MIN;
+    guint retries;
+
+    /* Send command and create response object. */
+    resp = tpm2_send_command (resmgr->tpm2, cmd, &rc);
+    rc = tpm2_response_get_code (resp);
+    if (rc == TPM2_RC_CONTEXT_GAP) {
+        g_debug ("%s: handling TPM2_RC_CONTEXT_GAP", __func__);
+        resource_manager_regap_sessions (resmgr);
+        g_clear_object (&resp);
+        resp = tpm2_send_command (resmgr->tpm2, cmd, &rc);
+        rc = tpm2_response_get_code (resp);
+    }
+    for (retries = 0;
+         is_retry_rc (rc) && retries < RESOURCE_MANAGER_RETRY_MAX;
+         ++retries)
+    {
+        g_debug ("%s: RC 0x%" PRIx32 ", resending in %lu us",
+                 __func__, rc, delay);
+        metrics_count (resmgr->metrics, METRICS_TPM_RETRY);
+        g_usleep (delay);
+        delay = MIN (delay * 2, RESOURCE_MANAGER_RETRY_DELAY_MAX);
+        g_clear_object (&resp);
+        resp = tpm2_send_command (resmgr->tpm2, cmd, &rc);
+        rc = tpm2_response_get_code (resp);
+    }
+    return resp;
+}
+/*
+ * A client may send a TPM2_SequenceUpdate with a larger buffer than the
+ * TPM takes, up to what fits in a command frame. It's split into updates
+ * the TPM takes, with the sequence object staying loaded, which saves the
+ * client a round trip for each of them. The password for the sequence is
+ * the same in each update while an HMAC covers the whole command, so only
+ * commands with just password sessions are split.
+ * Returns the size of the updates, or 0 if 'command' is sent as it is.
+ */
+static UINT16
+sequence_update_split_size (ResourceManager *resmgr,
+                            Tpm2Command     *command)
+{
+    guint8 *buf = tpm2_command_get_buffer (command);
+    size_t size = tpm2_command_get_size (command);
+    size_t offset = tpm2_command_get_params_offset (command);
+    guint32 max;
+
+    if (tpm2_command_get_code (command) != TPM2_CC_SequenceUpdate ||
+        offset == 0 || offset + sizeof (UINT16) > size ||
+        offset + sizeof (UINT16) + be16toh (*(UINT16*)(buf + offset)) != size ||
+        !command_password_only (command))
+    {
+        return 0;
+    }
+    if (tpm2_get_fixed_property (resmgr->tpm2,
+                                 TPM2_PT_INPUT_BUFFER,
+                                 &max) != TSS2_RC_SUCCESS ||
+        max == 0 || max > G_MAXUINT16)
+    {
+        max = TPM2_MAX_DIGEST_BUFFER;
+    }
+    if (be16toh (*(UINT16*)(buf + offset)) <= max) {
+        return 0;
+    }
+    return (UINT16)max;
+}
+/*
+ * Send the buffer of the TPM2_SequenceUpdate in 'command' to the TPM in
+ * updates of at most 'max' bytes. The handle and auth areas are copied
+ * from 'command': its handle has already been mapped to the loaded
+ * sequence object.
+ * Returns the response to the last update sent. That's the first one
+ * that failed, if any.
+ */
+static Tpm2Response*
+sequence_update_split (ResourceManager *resmgr,
+                       Tpm2Command     *command,
+                       UINT16           max)
+{
+    guint8 *buf = tpm2_command_get_buffer (command), *update_buf;
+    size_t params = tpm2_command_get_params_offset (command);
+    size_t offset = params + sizeof (UINT16);
+    UINT16 left = be16toh (*(UINT16*)(buf + params)), size;
+    UINT32 update_size;
+    Connection *connection;
+    Tpm2Command *update;
+    Tpm2Response *response = NULL;
+
+    g_debug ("%s: splitting %" PRIu16 " bytes into updates of %" PRIu16,
+             __func__, left, max);
+    connection = tpm2_command_get_connection (command);
+    while (left > 0) {
+        size = MIN (left, max);
+        update_size = params + sizeof (UINT16) + size;
+        update_buf = arena_alloc (&resmgr->arena, update_size);
+        memcpy (update_buf, buf, params);
+        tpm2_header_init (update_buf,
+                          update_size,
+                          get_command_tag (buf),
+                          update_size,
+                          TPM2_CC_SequenceUpdate);
+        *(UINT16*)(update_buf + params) = htobe16 (size);
+        memcpy (update_buf + params + sizeof (UINT16), buf + offset, size);
+        update = tpm2_command_new_borrowed (connection,
+                                            update_buf,
+                                            update_size,
+                                            tpm2_command_get_attributes (command));
+        g_clear_object (&response);
+        response = send_command_handle_rc (resmgr, update);
+        g_object_unref (update);
+        if (tpm2_response_get_code (response) != TSS2_RC_SUCCESS) {
+            break;
+        }
+        offset += size;
+        left -= size;
+    }
+    g_object_unref (connection);
+    return response;
+}
+/*
+ * Record the connection whose command is being sent to the TPM so that
+ * resource_manager_cancel can tell when to cancel the command in the TPM.
+ * Only the client command itself is marked, never the ContextLoad /
+ * ContextSave commands the ResourceManager sends on its behalf.
+ */
+static void
+resource_manager_set_in_flight (ResourceManager *resmgr,
+                                Connection      *connection)
+{
+    g_mutex_lock (&resmgr->in_flight_mutex);
+    resmgr->in_flight = connection;
+    g_mutex_unlock (&resmgr->in_flight_mutex);
+}
+/*
+ * Send 'command' through the Tcti of its connection on the kernel
+ * resource manager, opened with its first command, see
+ * resource_manager_set_kernel_rm. The kernel virtualizes the handles, so
+ * the command goes as it is.
+ * Returns the response, TSS2_RESMGR_RC_INTERNAL_ERROR if the Tcti can't be
+ * opened.
+ */
+static Tpm2Response*
+resource_manager_kernel_rm_send (ResourceManager *resmgr,
+                                 Tpm2Command     *command)
+{
+    Connection *connection = tpm2_command_get_connection (command);
+    TSS2_TCTI_CONTEXT *tcti_ctx = NULL;
+    Tpm2Response *response;
+    Tcti *tcti;
+    TSS2_RC rc;
+
+    if (connection_get_tcti (connection) == NULL) {
+        rc = Tss2_TctiLdr_Initialize (resmgr->kernel_rm_conf, &tcti_ctx);
+        if (rc != TSS2_RC_SUCCESS || tcti_ctx == NULL) {
+            g_warning ("%s: failed to open TCTI \"%s\" for connection %"
+                       PRIu64 ", RC: 0x%" PRIx32, __func__,
+                       resmgr->kernel_rm_conf, connection->id, rc);
+            return tpm2_response_new_rc (connection,
+                                         TSS2_RESMGR_RC_INTERNAL_ERROR);
+        }
+        /* the Tcti owns the context */
+        tcti = tcti_new (tcti_ctx);
+        connection_set_tcti (connection, tcti);
+        g_object_unref (tcti);
+    }
+    resource_manager_set_in_flight (resmgr, connection);
+    response = send_command_handle_rc (resmgr, command);
+    resource_manager_set_in_flight (resmgr, NULL);
+    return response;
+}
+/*
+ * Start passing the commands of 'connection' through if it has the TPM to
+ * itself: it's the only connection and nothing of another connection, or
+ * virtualized for this one, is left. The caches are dropped since the
+ * commands that would invalidate them go by unseen.
+ * Returns TRUE if the command of 'connection' is passed through.
+ */
+static gboolean
+resource_manager_passthrough_begin (ResourceManager *resmgr,
+                                    Connection      *connection)
+{
+    HandleMap *map;
+    guint count;
+
+    if (connection_manager_size (resmgr->passthrough_manager) != 1 ||
+        session_list_size (resmgr->session_list) != 0 ||
+        resmgr->resident_transients != NULL)
+    {
+        return FALSE;
+    }
+    map = connection_get_trans_map (connection);
+    count = handle_map_size (map);
+    g_object_unref (map);
+    if (count != 0) {
+        return FALSE;
+    }
+    g_info ("%s: passing commands from connection 0x%" PRIx64 " through",
+            __func__, connection->id);
+    resource_manager_flush_pending (resmgr);
+    g_clear_object (&resmgr->resident_connection);
+    if (IS_FAIR_QUEUE (resmgr->in_queue)) {
+        fair_queue_set_affinity (FAIR_QUEUE (resmgr->in_queue), NULL);
+    }
+    g_hash_table_remove_all (resmgr->cap_cache);
+    g_hash_table_remove_all (resmgr->read_public_cache);
+    g_hash_table_remove_all (resmgr->nv_cache);
+    g_hash_table_remove_all (resmgr->nv_attrs);
+    g_hash_table_remove_all (resmgr->query_cache);
+    resource_manager_publish_responses (resmgr);
+    if (resmgr->pcr_cache != NULL) {
+        g_hash_table_remove_all (resmgr->pcr_cache);
+    }
+    if (resmgr->primary_cache != NULL) {
+        g_hash_table_remove_all (resmgr->primary_cache);
+    }
+    if (resmgr->load_cache != NULL) {
+        g_hash_table_remove_all (resmgr->load_cache);
+    }
+    resmgr->passthrough = g_object_ref (connection);
+    return TRUE;
+}
+/*
+ * Another connection wants the TPM: take over what the passthrough
+ * connection has loaded as if it had been virtualized all along. Each
+ * transient object gets a virtual handle equal to its physical one so the
+ * client's handles keep working, and each loaded session an entry in the
+ * SessionList. They're left resident for the passthrough connection, the
+ * connection switch that follows saves them. Sessions the client saved
+ * itself are picked up when it loads them again.
+ */
+static void
+resource_manager_passthrough_end (ResourceManager *resmgr)
+{
+    Connection *connection = resmgr->passthrough;
+    HandleMap *map = connection_get_trans_map (connection);
+    HandleMapEntry *entry;
+    SessionEntry *session;
+    TPML_HANDLE handles;
+    TPM2_HANDLE handle;
+    guint32 i;
+
+    g_info ("%s: virtualizing connection 0x%" PRIx64 " again",
+            __func__, connection->id);
+    resmgr->passthrough = NULL;
+    tpm2_get_handles (resmgr->tpm2,
+                      TPM2_TRANSIENT_FIRST,
+                      TPM2_TRANSIENT_LAST,
+                      &handles);
+    for (i = 0; i < handles.count; ++i) {
+        handle = handles.handle [i];
+        entry = handle_map_entry_new (handle, handle);
+        if (!handle_map_insert (map, handle, entry)) {
+            resource_manager_defer_flush (resmgr, handle);
+            g_object_unref (entry);
+            continue;
+        }
+        handle_map_entry_set_last_use (entry, ++resmgr->use_clock);
+        resmgr->resident_transients =
+            g_slist_prepend (resmgr->resident_transients, entry);
+    }
+    g_object_unref (map);
+    tpm2_get_handles (resmgr->tpm2,
+                      TPM2_LOADED_SESSION_FIRST,
+                      TPM2_LOADED_SESSION_LAST,
+                      &handles);
+    for (i = 0; i < handles.count; ++i) {
+        session = session_entry_new (connection, handles.handle [i]);
+        session_entry_set_state (session, SESSION_ENTRY_LOADED);
+        session_entry_set_last_use (session, ++resmgr->use_clock);
+        if (!session_list_insert (resmgr->session_list, session)) {
+            resource_manager_defer_flush (resmgr, handles.handle [i]);
+        }
+        g_object_unref (session);
+    }
+    /* the reference held for passthrough moves to resident_connection */
+    resmgr->resident_connection = connection;
+    if (IS_FAIR_QUEUE (resmgr->in_queue)) {
+        fair_queue_set_affinity (FAIR_QUEUE (resmgr->in_queue), connection);
+    }
+}
+/*
+ * Returns TRUE if the response to 'command' can go to any connection that
+ * sends the same bytes: a PCR_Read, a GetCapability for something that
+ * doesn't change while the TPM runs (see get_cap_invariant) or a
+ * ReadPublic of a persistent object, all without sessions and outside a
+ * batch. None of these changes the state of the TPM or of the RM.
+ */
+static gboolean
+coalescible (Tpm2Command *command)
+{
+    if (tpm2_command_has_auths (command) ||
+        tpm2_command_is_batched (command) ||
+        tpm2_command_get_batch (command) != NULL)
+    {
+        return FALSE;
+    }
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_PCR_Read:
+        return TRUE;
+    case TPM2_CC_GetCapability:
+        return get_cap_invariant (tpm2_command_get_cap (command),
+                                  tpm2_command_get_prop (command));
+    case TPM2_CC_ReadPublic:
+        return read_public_cacheable (command);
+    default:
+        return FALSE;
+    }
+}
+/*
+ * Answer the commands queued behind 'command' that are identical to it
+ * with a copy of 'response', the successful response the TPM gave to
+ * 'command'. Up to RESOURCE_MANAGER_COALESCE_MAX messages are moved from
+ * the in_queue to the 'staged' queue and looked at in order. The search
+ * stops at the first message that isn't coalescible since it may change
+ * what the TPM would answer, and a connection's command is only taken if
+ * none of that connection's commands is in front of it so that each
+ * connection still gets its responses in order. Commands are compared by
+ * their whole buffer like the response caches do.
+ * Returns the number of commands answered.
+ */
+static guint
+resource_manager_coalesce (ResourceManager *resmgr,
+                           Tpm2Command     *command,
+                           Tpm2Response    *response)
+{
+    GList       *link, *next, *taken = NULL;
+    GSList      *passed = NULL;
+    Tpm2Command *other;
+    Tpm2Response *copy;
+    Connection  *connection;
+    GObject     *obj;
+    command_timing_t timing = { 0, };
+    guint8      *buf;
+    guint32      size = tpm2_response_get_size (response);
+    guint        count = 0;
+
+    if (!coalescible (command)) {
+        return 0;
+    }
+    g_mutex_lock (&resmgr->in_flight_mutex);
+    while (g_queue_get_length (resmgr->staged) < RESOURCE_MANAGER_COALESCE_MAX) {
+        obj = message_queue_try_dequeue (resmgr->in_queue);
+        if (obj == NULL) {
+            break;
+        }
+        g_queue_push_tail (resmgr->staged, obj);
+    }
+    for (link = resmgr->staged->head; link != NULL; link = next) {
+        next = link->next;
+        if (!IS_TPM2_COMMAND (link->data) ||
+            !coalescible (TPM2_COMMAND (link->data)))
+        {
+            break;
+        }
+        other = TPM2_COMMAND (link->data);
+        connection = tpm2_command_get_connection (other);
+        if (g_slist_find (passed, connection) == NULL &&
+            tpm2_command_get_size (other) == tpm2_command_get_size (command) &&
+            memcmp (tpm2_command_get_buffer (other),
+                    tpm2_command_get_buffer (command),
+                    tpm2_command_get_size (command)) == 0)
+        {
+            taken = g_list_prepend (taken, other);
+            g_queue_delete_link (resmgr->staged, link);
+        } else {
+            /* only compared, the command in 'staged' holds a reference */
+            passed = g_slist_prepend (passed, connection);
+        }
+        g_object_unref (connection);
+    }
+    g_mutex_unlock (&resmgr->in_flight_mutex);
+    g_slist_free (passed);
+
+    taken = g_list_reverse (taken);
+    for (link = taken; link != NULL; link = link->next) {
+        other = TPM2_COMMAND (link->data);
+        connection = tpm2_command_get_connection (other);
+        g_debug ("%s: answering command from connection 0x%" PRIx64
+                 " with a copy of the response", __func__, connection->id);
+        buf = g_malloc (size);
+        memcpy (buf, tpm2_response_get_buffer (response), size);
+        copy = tpm2_response_new (connection,
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (other));
+        tpm2_response_set_request_tag (copy,
+                                       tpm2_command_get_request_tag (other));
+        if (resmgr->time_commands) {
+            timing.received = tpm2_command_get_timestamp (other);
+            timing.answered = g_get_monotonic_time ();
+            timing.queue_usec = timing.answered - timing.received;
+            timing.trace = *tpm2_command_get_trace_context (other);
+            tpm2_response_set_timing (copy, &timing);
+        }
+        metrics_count_command (resmgr->metrics, tpm2_command_get_code (other));
+        metrics_count (resmgr->metrics, METRICS_COMMAND_COALESCED);
+        connection_count_command (connection);
+        if (resmgr->pending_max != 0) {
+            connection_release_pending (connection);
+        }
+        sink_enqueue (resmgr->sink, G_OBJECT (copy));
+        g_object_unref (copy);
+        g_object_unref (connection);
+        ++count;
+    }
+    g_list_free_full (taken, g_object_unref);
+    return count;
+}
+/**
+ * This function is invoked in response to the receipt of a Tpm2Command.
+ * This is the place where we send the command buffer out to the TPM
+ * through the Tpm2 which will eventually get it to the TPM for us.
+ * The Tpm2 will send us back a Tpm2Response that we send back to
+ * the client by way of our Sink object. The flow is roughly:
+ * - Receive the Tpm2Command as a parameter
+ * - Load all virtualized objects required by the command.
+ * - Send the Tpm2Command out through the Tpm2.
+ * - Receive the response from the Tpm2.
+ * - Virtualize the new objects created by the command & referenced in the
+ *   response.
+ * - Enqueue the response back out to the processing pipeline through the
+ *   Sink object.
+ * - Keep the transient objects loaded for the command resident in the TPM
+ *   until another connection needs the object slots.
+ * Returns the response code sent to the client.
+ */
+TSS2_RC
+resource_manager_process_tpm2_command (ResourceManager   *resmgr,
+                                       Tpm2Command       *command)
+{
+    Connection    *connection;
+    Tpm2Response   *response;
+    TSS2_RC         rc = TSS2_RC_SUCCESS;
+    GSList         *transient_slist = NULL, *kept;
+    TPMA_CC         command_attrs;
+    gboolean        primary;
+    GBytes         *load_key = NULL;
+    UINT16          split;
+    command_timing_t timing = { 0, };
+    gint64          start, context_usec;
+    metrics_span_t  span;
+
+    metrics_span_begin (&span);
+    command_attrs = tpm2_command_get_attributes (command);
+    g_debug ("%s", __func__);
+    dump_command (command);
+    start = g_get_monotonic_time ();
+    timing.received = tpm2_command_get_timestamp (command);
+    timing.queue_usec = start - timing.received;
+    metrics_count_command (resmgr->metrics, tpm2_command_get_code (command));
+    metrics_observe (resmgr->metrics, METRICS_QUEUE_LATENCY, timing.queue_usec);
+    connection = tpm2_command_get_connection (command);
+    logging_set_command (connection->id,
+                         tpm2_command_get_code (command));
+    connection_count_command (connection);
+    if (resmgr->spill_candidates != NULL &&
+        !g_hash_table_contains (resmgr->spill_candidates, connection))
+    {
+        g_hash_table_add (resmgr->spill_candidates, g_object_ref (connection));
+    }
+    /* the client has given up on the command, don't spend TPM time on it */
+    if (tpm2_command_expired (command, start)) {
+        g_debug ("%s: command from connection 0x%" PRIx64 " expired %"
+                 PRId64 " usec ago", __func__, connection->id,
+                 start - tpm2_command_get_deadline (command));
+        metrics_count (resmgr->metrics, METRICS_COMMAND_EXPIRED);
+        response = tpm2_response_new_rc (connection, TSS2_RESMGR_RC_CANCELED);
+        goto send_response;
+    }
+    if (resmgr->kernel_rm_conf != NULL) {
+        response = resource_manager_kernel_rm_send (resmgr, command);
+        goto send_response;
+    }
+    if (resmgr->passthrough_manager != NULL) {
+        if (resmgr->passthrough != NULL && resmgr->passthrough != connection) {
+            resource_manager_passthrough_end (resmgr);
+        } else if (resmgr->passthrough == connection ||
+                   resource_manager_passthrough_begin (resmgr, connection))
+        {
+            resource_manager_set_in_flight (resmgr, connection);
+            response = send_command_handle_rc (resmgr, command);
+            resource_manager_set_in_flight (resmgr, NULL);
+            goto send_response;
+        }
+    }
+    /* If executing the command would exceed a per connection quota */
+    rc = resource_manager_quota_check (resmgr, command);
+    if (rc != TSS2_RC_SUCCESS) {
+        response = tpm2_response_new_rc (connection, rc);
+        goto send_response;
+    }
+    /* Do command-specific processing. */
+    response = command_special_processing (resmgr, command);
+    if (response != NULL) {
+        goto send_response;
+    }
+    /*
+     * Objects left loaded by another connection must make room for ours,
+     * but for those it asked to keep resident.
+     */
+    if (resmgr->resident_connection != connection) {
+        if (resmgr->resident_connection != NULL) {
+            g_debug ("%s: connection switch, evicting resident objects",
+                     __func__);
+            start = g_get_monotonic_time ();
+            kept = resource_manager_kept_transients (resmgr);
+            resource_manager_evict_transients (resmgr, kept);
+            g_slist_free (kept);
+            resource_manager_evict_sessions (resmgr, NULL);
+            timing.save_usec += g_get_monotonic_time () - start;
+            g_object_unref (resmgr->resident_connection);
+        }
+        resmgr->resident_connection = g_object_ref (connection);
+        if (IS_FAIR_QUEUE (resmgr->in_queue)) {
+            fair_queue_set_affinity (FAIR_QUEUE (resmgr->in_queue), connection);
+        }
+    }
+    /* A repeated Load needs neither its parent nor the blobs decrypted. */
+    start = g_get_monotonic_time ();
+    load_key = load_cache_key (resmgr, command);
+    response = load_key != NULL ?
+        load_cache_gen_response (resmgr, command, load_key) : NULL;
+    /* Load objects associated with the handles in the command handle area. */
+    if (response == NULL && tpm2_command_get_handle_count (command) > 0) {
+        resource_manager_load_handles (resmgr,
+                                       command,
+                                       &transient_slist);
+    }
+    /* Load objets associated with the authorizations in the command. */
+    if (response == NULL && tpm2_command_has_auths (command)) {
+        g_info ("%s, Processing auths for command", __func__);
+        auth_callback_data_t auth_callback_data = {
+            .resmgr = resmgr,
+            .command = command,
+        };
+        tpm2_command_foreach_auth (command,
+                                   resource_manager_load_auth_callback,
+                                   &auth_callback_data);
+    }
+    timing.load_usec += g_get_monotonic_time () - start;
+    /* Send command and create response object. */
+    resource_manager_set_in_flight (resmgr, connection);
+    primary = primary_cacheable (resmgr, command);
+    if (response == NULL && primary) {
+        response = primary_cache_gen_response (resmgr, command);
+    }
+    if (response == NULL) {
+        split = sequence_update_split_size (resmgr, command);
+        response = split != 0 ?
+            sequence_update_split (resmgr, command, split) :
+            send_command_handle_rc (resmgr, command);
+    }
+    rc = tpm2_response_get_code (response);
+    while (resource_manager_evict_for_rc (resmgr, rc, transient_slist, command)) {
+        g_object_unref (response);
+        response = send_command_handle_rc (resmgr, command);
+        rc = tpm2_response_get_code (response);
+    }
+    resource_manager_set_in_flight (resmgr, NULL);
+    if (tpm2_command_get_flags (command) & TPM2_COMMAND_FLAG_CHANGES_CAPS) {
+        g_debug ("%s: clearing GetCapability cache", __func__);
+        g_hash_table_remove_all (resmgr->cap_cache);
+    }
+    /*
+     * A TPM in failure mode answers GetTestResult differently and nothing
+     * but Startup after a reset gets it out.
+     */
+    if (tpm2_command_get_flags (command) & TPM2_COMMAND_FLAG_CHANGES_CAPS ||
+        rc == TPM2_RC_FAILURE)
+    {
+        g_debug ("%s: clearing query cache", __func__);
+        g_hash_table_remove_all (resmgr->query_cache);
+        resource_manager_publish_responses (resmgr);
+    } else if (query_cacheable (command)) {
+        query_cache_insert (resmgr, command, response);
+    }
+    if (tpm2_command_get_flags (command) & TPM2_COMMAND_FLAG_CHANGES_PUBLIC) {
+        g_debug ("%s: clearing ReadPublic cache", __func__);
+        g_hash_table_remove_all (resmgr->read_public_cache);
+    } else if (rc == TSS2_RC_SUCCESS && read_public_cacheable (command)) {
+        read_public_cache_insert (resmgr, command, response);
+    }
+    if (tpm2_command_get_flags (command) & TPM2_COMMAND_FLAG_CHANGES_NV) {
+        g_debug ("%s: clearing NV cache", __func__);
+        g_hash_table_remove_all (resmgr->nv_cache);
+        g_hash_table_remove_all (resmgr->nv_attrs);
+    } else if (rc == TSS2_RC_SUCCESS && nv_cacheable (resmgr, command)) {
+        nv_cache_insert (resmgr, command, response);
+    }
+    if (resmgr->primary_cache != NULL &&
+        tpm2_command_get_flags (command) & TPM2_COMMAND_FLAG_CHANGES_PRIMARY)
+    {
+        g_debug ("%s: clearing primary cache", __func__);
+        g_hash_table_remove_all (resmgr->primary_cache);
+    } else if (primary && rc == TSS2_RC_SUCCESS) {
+        primary_cache_insert (resmgr, command, response);
+    }
+    if (resmgr->load_cache != NULL &&
+        tpm2_command_get_flags (command) & (TPM2_COMMAND_FLAG_CHANGES_PRIMARY |
+                                            TPM2_COMMAND_FLAG_CHANGES_PUBLIC))
+    {
+        g_debug ("%s: clearing load cache", __func__);
+        g_hash_table_remove_all (resmgr->load_cache);
+    } else if (load_key != NULL && rc == TSS2_RC_SUCCESS) {
+        load_cache_insert (resmgr, load_key, response);
+    }
+    g_clear_pointer (&load_key, g_bytes_unref);
+    if (resmgr->pcr_cache != NULL) {
+        if (tpm2_command_get_flags (command) & TPM2_COMMAND_FLAG_CHANGES_PCRS) {
+            pcr_cache_invalidate (resmgr, command);
+        } else if (rc == TSS2_RC_SUCCESS &&
+                   tpm2_command_get_code (command) == TPM2_CC_PCR_Read &&
+                   !tpm2_command_has_auths (command))
+        {
+            response_cache_insert (resmgr->pcr_cache,
+                                   RESOURCE_MANAGER_PCR_CACHE_MAX,
+                                   command,
+                                   response);
+        }
+    }
+    if (resmgr->random_pool != NULL &&
+        tpm2_command_get_code (command) == TPM2_CC_Startup)
+    {
+        g_debug ("%s: wiping random pool", __func__);
+        random_pool_wipe (resmgr->random_pool);
+    }
+    dump_response (response);
+    /* transform virtualized handles in Tpm2Response if necessary */
+    resource_manager_create_context_mapping (resmgr,
+                                             response,
+                                             &transient_slist);
+send_response:
+    rc = tpm2_response_get_code (response);
+    logging_set_rc (rc);
+    if (rc != TSS2_RC_SUCCESS) {
+        flight_recorder_record (FLIGHT_EVENT_ERROR,
+                                connection->id,
+                                tpm2_command_get_code (command),
+                                rc);
+    }
+    if (resmgr->time_commands) {
+        timing.tpm_usec = tpm2_command_get_tpm_time (command);
+        timing.answered = g_get_monotonic_time ();
+        timing.trace = *tpm2_command_get_trace_context (command);
+        tpm2_response_set_timing (response, &timing);
+    }
+    tpm2_response_set_request_tag (response,
+                                   tpm2_command_get_request_tag (command));
+    /*
+     * Released before the client can see the response and send again. A
+     * batch is admitted as one command, the first command releases it.
+     */
+    if (resmgr->pending_max != 0 && !tpm2_command_is_batched (command)) {
+        connection_release_pending (connection);
+    }
+    sink_enqueue (resmgr->sink, G_OBJECT (response));
+    if (rc == TSS2_RC_SUCCESS && resmgr->kernel_rm_conf == NULL &&
+        resmgr->passthrough == NULL)
+    {
+        resource_manager_coalesce (resmgr, command, response);
+    }
+    g_object_unref (response);
+    /*
+     * Sessions are left loaded: they're saved when another connection
+     * sends a command or when the TPM runs out of session memory.
+     */
+    start = g_get_monotonic_time ();
+    post_process_loaded_transients (resmgr, &transient_slist, connection, command_attrs);
+    context_usec = timing.load_usec + timing.save_usec +
+        g_get_monotonic_time () - start;
+    connection_add_context_time (connection, context_usec);
+    metrics_account_usage (resmgr->metrics,
+                           connection,
+                           tpm2_command_get_tpm_time (command),
+                           context_usec);
+    resource_manager_quota_settle (resmgr, connection, FALSE);
+    arena_reset (&resmgr->arena);
+    g_object_unref (connection);
+    logging_clear_command ();
+    metrics_span_end (resmgr->metrics, METRICS_STAGE_VIRTUALIZE, &span);
+    return rc;
+}
+/*
+ * Answer the commands in the batch of 'command', from the one at 'index'
+ * on, with 'rc' without sending them to the TPM. 'command' itself is not
+ * answered.
+ */
+static void
+resource_manager_answer_batch (ResourceManager *resmgr,
+                               Tpm2Command     *command,
+                               guint            index,
+                               TSS2_RC          rc)
+{
+    GPtrArray *batch = tpm2_command_get_batch (command);
+    Connection *connection;
+    Tpm2Response *response;
+
+    if (batch == NULL) {
+        return;
+    }
+    connection = tpm2_command_get_connection (command);
+    for (; index < batch->len; ++index) {
+        response = tpm2_response_new_rc (connection, rc);
+        tpm2_response_set_request_tag (response,
+            tpm2_command_get_request_tag (g_ptr_array_index (batch, index)));
+        sink_enqueue (resmgr->sink, G_OBJECT (response));
+        g_object_unref (response);
+    }
+    g_object_unref (connection);
+}
+/*
+ * Process 'command' and then the commands in its batch, if any. Nothing
+ * else is taken from the in_queue until the batch is done, so the
+ * connection's objects and sessions stay loaded between the commands. If
+ * the batch asks to stop on error, the commands after the first one that
+ * doesn't succeed are answered with TSS2_RESMGR_RC_CANCELED.
+ */
+void
+resource_manager_process_batch (ResourceManager *resmgr,
+                                Tpm2Command     *command)
+{
+    GPtrArray *batch = tpm2_command_get_batch (command);
+    TSS2_RC rc;
+    guint i;
+
+    rc = resource_manager_process_tpm2_command (resmgr, command);
+    for (i = 0; batch != NULL && i < batch->len; ++i) {
+        if (rc != TSS2_RC_SUCCESS && tpm2_command_get_batch_stop (command)) {
+            g_debug ("%s: RC 0x%" PRIx32 ", skipping %u batched commands",
+                     __func__, rc, batch->len - i);
+            resource_manager_answer_batch (resmgr,
+                                           command,
+                                           i,
+                                           TSS2_RESMGR_RC_CANCELED);
+            return;
+        }
+        rc = resource_manager_process_tpm2_command (resmgr,
+            TPM2_COMMAND (g_ptr_array_index (batch, i)));
+    }
+}
+/*
+ * Apply the new values in 'tunables' that are the ResourceManager's. This
+ * runs on the ResourceManager thread between two commands, so a command
+ * sees either all of the old values or all of the new ones.
+ */
+static void
+resource_manager_apply_tunables (ResourceManager *resmgr,
+                                 Tunables        *tunables)
+{
+    FairQueue *queue = IS_FAIR_QUEUE (resmgr->in_queue) ?
+        FAIR_QUEUE (resmgr->in_queue) : NULL;
+    GHashTableIter iter;
+    gpointer uid, weight;
+    guint value;
+
+    if (tunables_get (tunables, TUNABLE_QUEUE_DEPTH, &value)) {
+        message_queue_set_max_length (resmgr->in_queue, value);
+    }
+    if (tunables_get (tunables, TUNABLE_MAX_IN_FLIGHT, &value)) {
+        resmgr->pending_max = value;
+    }
+    if (tunables_get (tunables, TUNABLE_MAX_CONNECTION_MEMORY, &value)) {
+        resmgr->connection_bytes_max = (gsize)value * 1024;
+    }
+    if (tunables_get (tunables, TUNABLE_MAX_MEMORY, &value)) {
+        resmgr->bytes_max = (gsize)value * 1024;
+    }
+    /* this thread is the consumer of the queue */
+    if (tunables_get (tunables, TUNABLE_QUEUE_SPIN, &value)) {
+        message_queue_set_spin (resmgr->in_queue, value);
+    }
+    if (tunables_get (tunables, TUNABLE_RANDOM_POOL, &value) &&
+        value != (resmgr->random_pool == NULL ? 0 : resmgr->random_pool->size) &&
+        !resource_manager_set_random_pool (resmgr, value))
+    {
+        g_warning ("%s: GetRandom pool disabled", __func__);
+    }
+    /* a cache that stays on keeps what it holds */
+    if (tunables_get (tunables, TUNABLE_PCR_CACHE, &value) &&
+        (value != 0) != (resmgr->pcr_cache != NULL))
+    {
+        resource_manager_set_pcr_cache (resmgr, value != 0);
+    }
+    if (tunables_get (tunables, TUNABLE_PRIMARY_CACHE, &value) &&
+        (value != 0) != (resmgr->primary_cache != NULL))
+    {
+        resource_manager_set_primary_cache (resmgr, value != 0);
+    }
+    if (tunables_get (tunables, TUNABLE_LOAD_CACHE, &value) &&
+        (value != 0) != (resmgr->load_cache != NULL))
+    {
+        resource_manager_set_load_cache (resmgr, value != 0);
+    }
+    if (queue == NULL) {
+        return;
+    }
+    if (tunables_get (tunables, TUNABLE_SCHEDULER, &value)) {
+        fair_queue_set_policy (queue,
+                               (FairQueuePolicy)value,
+                               resmgr->tpm2->durations);
+    }
+    if (tunables_get (tunables, TUNABLE_AFFINITY_BURST, &value)) {
+        fair_queue_set_affinity_burst (queue, value);
+    }
+    if (tunables_get (tunables, TUNABLE_LOCALITY_BURST, &value)) {
+        fair_queue_set_locality_burst (queue, value);
+    }
+    if (tunables->uid_weights != NULL) {
+        g_hash_table_iter_init (&iter, tunables->uid_weights);
+        while (g_hash_table_iter_next (&iter, &uid, &weight)) {
+            fair_queue_set_uid_weight (queue,
+                                       GPOINTER_TO_UINT (uid),
+                                       GPOINTER_TO_UINT (weight));
+        }
+    }
+}
+/*
+ * Return FALSE to terminate main thread.
+ */
+gboolean
+resource_manager_process_control (ResourceManager *resmgr,
+                                  ControlMessage *msg)
+{
+    ControlCode code = control_message_get_code (msg);
+    Connection *conn;
+
+    g_debug ("%s", __func__);
+    switch (code) {
+    case CHECK_CANCEL:
+        sink_enqueue (resmgr->sink, G_OBJECT (msg));
+        return FALSE;
+    case CONNECTION_REMOVED:
+        conn = CONNECTION (control_message_get_object (msg));
+        g_debug ("%s: received CONNECTION_REMOVED message for connection",
+                 __func__);
+        resource_manager_remove_connection (resmgr, conn);
+        metrics_observe (resmgr->metrics,
+                         METRICS_DISCONNECT_LATENCY,
+                         g_get_monotonic_time () -
+                         control_message_get_timestamp (msg));
+        sink_enqueue (resmgr->sink, G_OBJECT (msg));
+        return TRUE;
+    case TUNE:
+        resource_manager_apply_tunables (resmgr,
+            TUNABLES (control_message_get_object (msg)));
+        /* the ResponseSink applies the rest */
+        sink_enqueue (resmgr->sink, G_OBJECT (msg));
+        return TRUE;
+    case EVICT_IDLE:
+        /* only wakes the thread up, the eviction is done once idle */
+        return TRUE;
+    default:
+        g_warning ("%s: Unknown control code: %d ... ignoring",
+                   __func__, code);
+        return TRUE;
+    }
+}
+/*
+ * GCompareFunc used to find staged messages: returns 0 if 'data' is a
+ * Tpm2Command from 'connection'.
+ */
+static gint
+staged_command_compare (gconstpointer data,
+                        gconstpointer connection)
+{
+    Connection *owner;
+    gint        ret;
+
+    if (!IS_TPM2_COMMAND (data)) {
+        return 1;
+    }
+    owner = tpm2_command_get_connection (TPM2_COMMAND (data));
+    ret = (owner == connection) ? 0 : 1;
+    g_object_unref (owner);
+    return ret;
+}
+/*
+ * Called by the Tpm2 (see tpm2_set_overlap_func) while the TPM executes a
+ * command for the ResourceManager thread: once after the command is sent
+ * and, when the TCTI can be polled, every TPM2_POLL_INTERVAL until it
+ * completes. The TPM can only execute one
+ * command at a time, and the RM state a command is processed against
+ * depends on the outcome of the command before it, so the only work that
+ * can be done ahead of time is work that needs neither:
+ * - Messages are moved from the in_queue to the 'staged' queue so that
+ *   the next command is ready as soon as the response is in.
+ * - Commands that fail the per-connection quota check are answered
+ *   immediately. This is only done for connections that have no command
+ *   in the TPM or in front of them in the 'staged' queue, since those may
+ *   still change the outcome of the check.
+ */
+static void
+resource_manager_overlap (gpointer data)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (data);
+    Tpm2Response    *response;
+    Connection      *connection;
+    GObject         *obj;
+    TSS2_RC          rc;
+    gboolean         busy;
+
+    g_mutex_lock (&resmgr->in_flight_mutex);
+    while (g_queue_get_length (resmgr->staged) < RESOURCE_MANAGER_STAGED_MAX) {
+        obj = message_queue_try_dequeue (resmgr->in_queue);
+        if (obj == NULL) {
+            break;
+        }
+        if (!IS_TPM2_COMMAND (obj)) {
+            g_queue_push_tail (resmgr->staged, obj);
+            continue;
+        }
+        connection = tpm2_command_get_connection (TPM2_COMMAND (obj));
+        busy = (resmgr->in_flight == connection) ||
+            g_queue_find_custom (resmgr->staged,
+                                 connection,
+                                 staged_command_compare) != NULL;
+        rc = busy ? TSS2_RC_SUCCESS :
+            resource_manager_quota_check (resmgr, TPM2_COMMAND (obj));
+        if (rc == TSS2_RC_SUCCESS) {
+            g_queue_push_tail (resmgr->staged, obj);
+        } else {
+            g_debug ("%s: rejecting staged command, RC: 0x%" PRIx32,
+                     __func__, rc);
+            if (resmgr->pending_max != 0) {
+                connection_release_pending (connection);
+            }
+            response = tpm2_response_new_rc (connection, rc);
+            tpm2_response_set_request_tag (response,
+                tpm2_command_get_request_tag (TPM2_COMMAND (obj)));
+            sink_enqueue (resmgr->sink, G_OBJECT (response));
+            g_object_unref (response);
+            resource_manager_answer_batch (resmgr, TPM2_COMMAND (obj), 0, rc);
+            g_object_unref (obj);
+        }
+        g_object_unref (connection);
+    }
+    g_mutex_unlock (&resmgr->in_flight_mutex);
+}
+/*
+ * Take the next message for the ResourceManager thread: messages staged
+ * by resource_manager_overlap come first since they were taken from the
+ * in_queue ahead of everything still in it.
+ */
+static GObject*
+resource_manager_next_message (ResourceManager *resmgr,
+                               gboolean         block)
+{
+    GObject *obj;
+
+    g_mutex_lock (&resmgr->in_flight_mutex);
+    obj = g_queue_pop_head (resmgr->staged);
+    g_mutex_unlock (&resmgr->in_flight_mutex);
+    if (obj != NULL) {
+        return obj;
+    }
+    return block ? message_queue_dequeue (resmgr->in_queue) :
+        message_queue_try_dequeue (resmgr->in_queue);
+}
+/*
+ * Cancel the commands from 'connection'. This is called from the
+ * IpcFrontend thread when a client invokes Tss2_Tcti_Cancel:
+ * - Commands still in the input queue or staged by
+ *   resource_manager_overlap are removed and answered with
+ *   TPM2_RC_CANCELED.
+ * - If the TPM is executing a command for the connection, the cancel
+ *   request is passed down to the TCTI. The TPM responds to the command
+ *   with TPM2_RC_CANCELED if it was able to stop it.
+ * Returns the RC from the TCTI if the cancel request was passed down
+ * and failed, TSS2_RC_SUCCESS otherwise.
+ */
+TSS2_RC
+resource_manager_cancel (ResourceManager *resmgr,
+                         Connection      *connection)
+{
+    Tpm2Response *response;
+    GList *canceled = NULL, *link;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    if (IS_FAIR_QUEUE (resmgr->in_queue)) {
+        canceled = fair_queue_remove_connection (FAIR_QUEUE (resmgr->in_queue),
+                                                 connection);
+    }
+    g_mutex_lock (&resmgr->in_flight_mutex);
+    while ((link = g_queue_find_custom (resmgr->staged,
+                                        connection,
+                                        staged_command_compare))
+           != NULL)
+    {
+        canceled = g_list_prepend (canceled, link->data);
+        g_queue_delete_link (resmgr->staged, link);
+    }
+    g_mutex_unlock (&resmgr->in_flight_mutex);
+    for (link = canceled; link != NULL; link = link->next) {
+        g_debug ("%s: canceling queued command", __func__);
+        if (resmgr->pending_max != 0) {
+            connection_release_pending (connection);
+        }
+        response = tpm2_response_new_rc (connection, TPM2_RC_CANCELED);
+        tpm2_response_set_request_tag (response,
+            tpm2_command_get_request_tag (TPM2_COMMAND (link->data)));
+        sink_enqueue (resmgr->sink, G_OBJECT (response));
+        g_object_unref (response);
+        resource_manager_answer_batch (resmgr,
+                                       TPM2_COMMAND (link->data),
+                                       0,
+                                       TPM2_RC_CANCELED);
+    }
+    g_list_free_full (canceled, g_object_unref);
+
+    g_mutex_lock (&resmgr->in_flight_mutex);
+    if (resmgr->in_flight == connection) {
+        g_info ("%s: canceling command in the TPM", __func__);
+        rc = tpm2_cancel (resmgr->tpm2);
+    }
+    g_mutex_unlock (&resmgr->in_flight_mutex);
+
+    return rc;
+}
+/*
+ * Drop the commands from 'connection' staged by resource_manager_overlap
+ * or resource_manager_coalesce. This is called from the CommandSource
+ * thread when the connection is removed: the FairQueue drops the ones
+ * still queued when the CONNECTION_REMOVED message is queued, but staged
+ * commands are taken ahead of it. Nobody reads their responses so none
+ * are sent.
+ */
+static void
+resource_manager_purge_staged (ResourceManager *resmgr,
+                               Connection      *connection)
+{
+    GList *purged = NULL, *link;
+
+    g_mutex_lock (&resmgr->in_flight_mutex);
+    while ((link = g_queue_find_custom (resmgr->staged,
+                                        connection,
+                                        staged_command_compare))
+           != NULL)
+    {
+        purged = g_list_prepend (purged, link->data);
+        g_queue_delete_link (resmgr->staged, link);
+    }
+    g_mutex_unlock (&resmgr->in_flight_mutex);
+    if (purged == NULL) {
+        return;
+    }
+    g_debug ("%s: dropping %u staged commands from connection 0x%" PRIx64,
+             __func__, g_list_length (purged), connection->id);
+    for (link = purged; link != NULL; link = link->next) {
+        if (resmgr->pending_max != 0) {
+            connection_release_pending (connection);
+        }
+    }
+    g_list_free_full (purged, g_object_unref);
+}
+/*
+ * Give 'connection' an exclusive lease on the TPM: the in_queue serves
+ * only its commands for the next 'commands' commands or 'timeout'
+ * microseconds. A connection switch is what makes the ResourceManager
+ * save and flush the contexts of the previous connection, so none of the
+ * holder's objects or sessions are swapped out while the lease lasts.
+ * A 'commands' of 0 releases the lease. This is called from the
+ * IpcFrontend thread.
+ * Returns TSS2_RESMGR_RC_RETRY if another connection holds a lease.
+ */
+TSS2_RC
+resource_manager_lease (ResourceManager *resmgr,
+                        Connection      *connection,
+                        guint            commands,
+                        gint64           timeout)
+{
+    if (!IS_FAIR_QUEUE (resmgr->in_queue)) {
+        return TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+    }
+    if (commands == 0) {
+        fair_queue_release_lease (FAIR_QUEUE (resmgr->in_queue), connection);
+        return TSS2_RC_SUCCESS;
+    }
+    if (!fair_queue_acquire_lease (FAIR_QUEUE (resmgr->in_queue),
+                                   connection,
+                                   commands,
+                                   timeout)) {
+        g_debug ("%s: TPM is leased to another connection", __func__);
+        return TSS2_RESMGR_RC_RETRY;
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Have the ResourceManager thread apply 'tunables' once it's done with
+ * the commands before it in the queue. This is called from the
+ * IpcFrontend thread.
+ */
+void
+resource_manager_tune (ResourceManager *resmgr,
+                       Tunables        *tunables)
+{
+    ControlMessage *msg;
+
+    g_assert (resmgr != NULL);
+    g_assert (tunables != NULL);
+    msg = control_message_new_with_object (TUNE, G_OBJECT (tunables));
+    message_queue_enqueue (resmgr->in_queue, G_OBJECT (msg));
+    g_object_unref (msg);
+}
+/*
+ * Wake the ResourceManager thread up so it evicts the contexts that went
+ * cold since it last ran, see resource_manager_evict_idle. Nothing is
+ * sent while messages are waiting: the thread gets to it after them.
+ */
+void
+resource_manager_evict_idle_request (ResourceManager *resmgr)
+{
+    ControlMessage *msg;
+
+    g_assert (resmgr != NULL);
+    if (resmgr->evict_idle == 0 ||
+        message_queue_get_length (resmgr->in_queue) > 0)
+    {
+        return;
+    }
+    msg = control_message_new (EVICT_IDLE);
+    message_queue_enqueue (resmgr->in_queue, G_OBJECT (msg));
+    g_object_unref (msg);
+}
+/*
+ * Returns TRUE if there are no messages waiting to be processed.
+ */
+static gboolean
+resource_manager_is_idle (ResourceManager *resmgr)
+{
+    gboolean idle;
+
+    g_mutex_lock (&resmgr->in_flight_mutex);
+    idle = g_queue_is_empty (resmgr->staged);
+    g_mutex_unlock (&resmgr->in_flight_mutex);
+    return idle && message_queue_get_length (resmgr->in_queue) == 0;
+}
+/*
+ * Fill the random_pool with TPM2_GetRandom commands for as long as the
+ * pool has room and no other message is waiting: the TPM has nothing
+ * better to do.
+ */
+static void
+random_pool_refill (ResourceManager *resmgr)
+{
+    TPM2B_DIGEST random_bytes;
+    size_t space;
+    TSS2_RC rc;
+
+    while (resmgr->random_pool != NULL &&
+           (space = random_pool_space (resmgr->random_pool)) > 0 &&
+           resource_manager_is_idle (resmgr))
+    {
+        random_bytes.size = 0;
+        rc = tpm2_get_random (resmgr->tpm2,
+                              (UINT16)MIN (space, sizeof (random_bytes.buffer)),
+                              &random_bytes);
+        if (rc != TSS2_RC_SUCCESS || random_bytes.size == 0) {
+            break;
+        }
+        random_pool_fill (resmgr->random_pool,
+                          random_bytes.buffer,
+                          MIN (random_bytes.size, sizeof (random_bytes.buffer)));
+    }
+    secure_clear (&random_bytes, sizeof (random_bytes));
+}
+/*
+ * GHFunc and GFunc moving saved contexts to the context_store.
+ */
+static void
+spill_handle_map_entry (gpointer key,
+                        gpointer value,
+                        gpointer user_data)
+{
+    UNUSED_PARAM (key);
+    handle_map_entry_spill (HANDLE_MAP_ENTRY (value), CONTEXT_STORE (user_data));
+}
+static void
+spill_session_entry (gpointer data,
+                     gpointer user_data)
+{
+    session_entry_spill (SESSION_ENTRY (data), CONTEXT_STORE (user_data));
+}
+/*
+ * Move the saved contexts of connections that haven't sent a command for
+ * RESOURCE_MANAGER_SPILL_IDLE seconds to the context_store. They're read
+ * back when the connection uses them again. A connection is looked at
+ * again once it has sent another command.
+ * Returns the number of connections spilled.
+ */
+static guint
+resource_manager_spill_idle (ResourceManager *resmgr)
+{
+    GHashTableIter iter;
+    gpointer key;
+    Connection *connection;
+    HandleMap *map;
+    guint count = 0;
+
+    if (resmgr->context_store == NULL) {
+        return 0;
+    }
+    g_hash_table_iter_init (&iter, resmgr->spill_candidates);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        connection = CONNECTION (key);
+        if (connection == resmgr->resident_connection ||
+            connection_get_idle_time (connection) < RESOURCE_MANAGER_SPILL_IDLE)
+        {
+            continue;
+        }
+        map = connection_get_trans_map (connection);
+        handle_map_foreach (map, spill_handle_map_entry, resmgr->context_store);
+        g_object_unref (map);
+        session_list_foreach_connection (resmgr->session_list,
+                                         connection,
+                                         spill_session_entry,
+                                         resmgr->context_store);
+        g_hash_table_iter_remove (&iter);
+        ++count;
+    }
+    if (count > 0) {
+        g_debug ("%s: spilled %u connections, %zu bytes in the store",
+                 __func__, count, context_store_get_used (resmgr->context_store));
+        context_store_trim (resmgr->context_store);
+    }
+    return count;
+}
+/*
+ * Process a single message from the in_queue.
+ * Returns FALSE once the thread has been asked to stop.
+ */
+static gboolean
+resource_manager_process_message (ResourceManager *resmgr,
+                                  GObject         *obj)
+{
+    if (IS_TPM2_COMMAND (obj)) {
+        TABRMD_PROBE2 (rm_dequeue,
+                       TABRMD_PROBE_CONNECTION_ID (TPM2_COMMAND (obj)->connection),
+                       tpm2_command_get_code (TPM2_COMMAND (obj)));
+        flight_recorder_record (FLIGHT_EVENT_DEQUEUED,
+            TABRMD_PROBE_CONNECTION_ID (TPM2_COMMAND (obj)->connection),
+            tpm2_command_get_code (TPM2_COMMAND (obj)),
+            0);
+        resource_manager_process_batch (resmgr, TPM2_COMMAND (obj));
+    } else if (IS_CONTROL_MESSAGE (obj)) {
+        return resource_manager_process_control (resmgr, CONTROL_MESSAGE (obj));
+    }
+    return TRUE;
+}
+/*
+ * Build a CreatePrimary in 'hierarchy', with an empty password, for the
+ * storage key template of 'type' from the TCG TPM v2.0 Provisioning
+ * Guidance: an RSA 2048 or ECC NIST P256 restricted decryption key with
+ * an AES 128 CFB symmetric key, no PCRs and a zero unique field the size
+ * of the key.
+ */
+static Tpm2Command*
+primary_template_command_new (TPMI_RH_HIERARCHY hierarchy,
+                              TPMI_ALG_PUBLIC   type)
+{
+    TPMT_SYM_DEF_OBJECT symmetric = {
+        .algorithm = TPM2_ALG_AES,
+        .keyBits = { .aes = 128 },
+        .mode = { .aes = TPM2_ALG_CFB },
+    };
+    TPMT_PUBLIC public = {
+        .type = type,
+        .nameAlg = TPM2_ALG_SHA256,
+        .objectAttributes = TPMA_OBJECT_FIXEDTPM | TPMA_OBJECT_FIXEDPARENT |
+            TPMA_OBJECT_SENSITIVEDATAORIGIN | TPMA_OBJECT_USERWITHAUTH |
+            TPMA_OBJECT_NODA | TPMA_OBJECT_RESTRICTED | TPMA_OBJECT_DECRYPT,
+    };
+    guint8 *buf = g_malloc0 (TPM2_MAX_COMMAND_SIZE);
+    size_t offset = TPM_HEADER_SIZE, public_offset;
+    TSS2_RC rc;
+
+    switch (type) {
+    case TPM2_ALG_RSA:
+        public.parameters.rsaDetail.symmetric = symmetric;
+        public.parameters.rsaDetail.scheme.scheme = TPM2_ALG_NULL;
+        public.parameters.rsaDetail.keyBits = 2048;
+        public.unique.rsa.size = 256;
+        break;
+    case TPM2_ALG_ECC:
+        public.parameters.eccDetail.symmetric = symmetric;
+        public.parameters.eccDetail.scheme.scheme = TPM2_ALG_NULL;
+        public.parameters.eccDetail.curveID = TPM2_ECC_NIST_P256;
+        public.parameters.eccDetail.kdf.scheme = TPM2_ALG_NULL;
+        public.unique.ecc.x.size = 32;
+        public.unique.ecc.y.size = 32;
+        break;
+    default:
+        g_assert_not_reached ();
+    }
+    *(TPM2_HANDLE*)(buf + offset) = htobe32 (hierarchy);
+    offset += sizeof (TPM2_HANDLE);
+    /* a password session with an empty password */
+    *(UINT32*)(buf + offset) = htobe32 (sizeof (TPM2_HANDLE) +
+                                        2 * sizeof (UINT16) + sizeof (UINT8));
+    offset += sizeof (UINT32);
+    *(TPM2_HANDLE*)(buf + offset) = htobe32 (TPM2_RS_PW);
+    offset += sizeof (TPM2_HANDLE) + 2 * sizeof (UINT16) + sizeof (UINT8);
+    /* inSensitive with an empty userAuth and data */
+    *(UINT16*)(buf + offset) = htobe16 (2 * sizeof (UINT16));
+    offset += 3 * sizeof (UINT16);
+    public_offset = offset;
+    offset += sizeof (UINT16);
+    rc = Tss2_MU_TPMT_PUBLIC_Marshal (&public,
+                                      buf,
+                                      TPM2_MAX_COMMAND_SIZE,
+                                      &offset);
+    g_assert (rc == TSS2_RC_SUCCESS);
+    *(UINT16*)(buf + public_offset) =
+        htobe16 (offset - public_offset - sizeof (UINT16));
+    /* empty outsideInfo and creationPCR */
+    offset += sizeof (UINT16) + sizeof (UINT32);
+    *(TPM2_ST*)buf = htobe16 (TPM2_ST_SESSIONS);
+    *(UINT32*)(buf + 2) = htobe32 (offset);
+    *(TPM2_CC*)(buf + 6) = htobe32 (TPM2_CC_CreatePrimary);
+    return tpm2_command_new (NULL,
+                             buf,
+                             offset,
+                             (TPMA_CC)((1 << TPMA_CC_CHANDLES_SHIFT) |
+                                       TPMA_CC_RHANDLE |
+                                       TPM2_CC_CreatePrimary));
+}
+/*
+ * Create the primary object for the oldest template added with
+ * resource_manager_add_primary_template and keep it in the primary_cache.
+ * The object isn't left loaded. This is called by the ResourceManager
+ * thread when no message is waiting, for one template at a time so a
+ * client that shows up meanwhile waits for one CreatePrimary at most.
+ */
+static void
+resource_manager_create_template_primary (ResourceManager *resmgr)
+{
+    Tpm2Command *command = g_queue_pop_head (resmgr->primary_templates);
+    Tpm2Response *response;
+    TPM2_HANDLE handle;
+    GBytes *key;
+    gboolean cached;
+    TSS2_RC rc;
+
+    if (resmgr->primary_cache == NULL ||
+        g_hash_table_size (resmgr->primary_cache) >=
+        RESOURCE_MANAGER_PRIMARY_CACHE_MAX ||
+        resmgr->kernel_rm_conf != NULL ||
+        resmgr->passthrough != NULL)
+    {
+        g_object_unref (command);
+        return;
+    }
+    /* restored with the rest of the state */
+    key = primary_cache_key (command);
+    cached = g_hash_table_contains (resmgr->primary_cache, key);
+    g_bytes_unref (key);
+    if (cached) {
+        g_object_unref (command);
+        return;
+    }
+    response = send_command_handle_rc (resmgr, command);
+    rc = tpm2_response_get_code (response);
+    while (resource_manager_evict_for_rc (resmgr, rc, NULL, command)) {
+        g_object_unref (response);
+        response = send_command_handle_rc (resmgr, command);
+        rc = tpm2_response_get_code (response);
+    }
+    if (rc == TSS2_RC_SUCCESS && tpm2_response_has_handle (response)) {
+        handle = tpm2_response_get_handle (response);
+        primary_cache_insert (resmgr, command, response);
+        rc = tpm2_context_flush (resmgr->tpm2, handle);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("%s: failed to flush primary 0x%" PRIx32 ", RC: 0x%"
+                       PRIx32, __func__, handle, rc);
+        }
+        g_info ("%s: created primary in hierarchy 0x%" PRIx32, __func__,
+                tpm2_command_get_handle (command, 0));
+    } else {
+        g_warning ("%s: CreatePrimary in hierarchy 0x%" PRIx32 " failed, "
+                   "RC: 0x%" PRIx32, __func__,
+                   tpm2_command_get_handle (command, 0), rc);
+    }
+    g_object_unref (response);
+    g_object_unref (command);
+}
+/* the size of a password session with an empty password */
+#define WARM_UP_PW_SESSION_SIZE \
+    (sizeof (TPM2_HANDLE) + 2 * sizeof (UINT16) + sizeof (UINT8))
+/*
+ * Build a command for the warm_up queue, not sent by any connection: the
+ * 'handle_count' handles in 'handles', a password session with an empty
+ * password if 'password' is set, and the 'size' bytes of 'params'. The
+ * caches are keyed by the command bytes so these are laid out the way
+ * the TSS lays out the commands of clients.
+ */
+static Tpm2Command*
+warm_up_command_new (TPM2_CC            code,
+                     const TPM2_HANDLE *handles,
+                     guint              handle_count,
+                     gboolean           password,
+                     const guint8      *params,
+                     size_t             size)
+{
+    size_t total, offset = TPM_HEADER_SIZE;
+    guint8 *buf;
+    guint i;
+
+    total = TPM_HEADER_SIZE + handle_count * sizeof (TPM2_HANDLE) + size;
+    if (password) {
+        total += sizeof (UINT32) + WARM_UP_PW_SESSION_SIZE;
+    }
+    buf = g_malloc0 (total);
+    *(TPM2_ST*)buf = htobe16 (password ? TPM2_ST_SESSIONS : TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buf + 2) = htobe32 (total);
+    *(TPM2_CC*)(buf + 6) = htobe32 (code);
+    for (i = 0; i < handle_count; ++i) {
+        *(TPM2_HANDLE*)(buf + offset) = htobe32 (handles [i]);
+        offset += sizeof (TPM2_HANDLE);
+    }
+    if (password) {
+        *(UINT32*)(buf + offset) = htobe32 (WARM_UP_PW_SESSION_SIZE);
+        offset += sizeof (UINT32);
+        *(TPM2_HANDLE*)(buf + offset) = htobe32 (TPM2_RS_PW);
+        offset += WARM_UP_PW_SESSION_SIZE;
+    }
+    if (size > 0) {
+        memcpy (buf + offset, params, size);
+    }
+    return tpm2_command_new (NULL,
+                             buf,
+                             total,
+                             (TPMA_CC)((handle_count << TPMA_CC_CHANDLES_SHIFT) |
+                                       code));
+}
+static void
+warm_up_push_get_cap (ResourceManager *resmgr,
+                      TPM2_CAP         cap,
+                      UINT32           prop,
+                      UINT32           count)
+{
+    UINT32 params [3] = { htobe32 (cap), htobe32 (prop), htobe32 (count) };
+
+    g_queue_push_tail (resmgr->warm_up,
+                       warm_up_command_new (TPM2_CC_GetCapability,
+                                            NULL,
+                                            0,
+                                            FALSE,
+                                            (const guint8*)params,
+                                            sizeof (params)));
+}
+/*
+ * Queue a ReadPublic for each persistent handle in 'response', the
+ * response to a GetCapability for TPM2_CAP_HANDLES.
+ */
+static void
+warm_up_push_read_public (ResourceManager *resmgr,
+                          Tpm2Response    *response)
+{
+    TPMS_CAPABILITY_DATA cap_data = { .capability = 0 };
+    size_t offset = TPM_HEADER_SIZE + sizeof (TPMI_YES_NO);
+    TPM2_HANDLE handle;
+    UINT32 i;
+
+    if (Tss2_MU_TPMS_CAPABILITY_DATA_Unmarshal (tpm2_response_get_buffer (response),
+                                                tpm2_response_get_size (response),
+                                                &offset,
+                                                &cap_data) != TSS2_RC_SUCCESS ||
+        cap_data.capability != TPM2_CAP_HANDLES)
+    {
+        return;
+    }
+    for (i = 0; i < cap_data.data.handles.count; ++i) {
+        handle = cap_data.data.handles.handle [i];
+        if (handle >> TPM2_HR_SHIFT == TPM2_HT_PERSISTENT) {
+            g_queue_push_tail (resmgr->warm_up,
+                               warm_up_command_new (TPM2_CC_ReadPublic,
+                                                    &handle,
+                                                    1,
+                                                    FALSE,
+                                                    NULL,
+                                                    0));
+        }
+    }
+}
+/*
+ * Queue the NV_Read commands that read the whole of the index described
+ * by 'response', the response to an NV_ReadPublic, in chunks of
+ * nv_chunk_max bytes authorized by the index itself with an empty
+ * password, if the nv_cache would keep them. Only indices that aren't
+ * subject to dictionary attack protection are read: a failed empty
+ * password for any other index counts against the lockout of the whole
+ * TPM, on every start of the daemon.
+ */
+static void
+warm_up_push_nv_read (ResourceManager *resmgr,
+                      Tpm2Response    *response)
+{
+    TPM2B_NV_PUBLIC nv_public = { .size = 0 };
+    size_t offset = TPM_HEADER_SIZE;
+    TPM2_HANDLE handles [2];
+    UINT16 params [2], chunk_max, done, size;
+
+    if (Tss2_MU_TPM2B_NV_PUBLIC_Unmarshal (tpm2_response_get_buffer (response),
+                                           tpm2_response_get_size (response),
+                                           &offset,
+                                           &nv_public) != TSS2_RC_SUCCESS ||
+        !(nv_public.nvPublic.attributes & TPMA_NV_AUTHREAD) ||
+        !(nv_public.nvPublic.attributes & TPMA_NV_NO_DA) ||
+        !nv_attrs_cacheable (nv_public.nvPublic.attributes))
+    {
+        return;
+    }
+    handles [0] = handles [1] = nv_public.nvPublic.nvIndex;
+    chunk_max = nv_chunk_max (resmgr);
+    for (done = 0; done < nv_public.nvPublic.dataSize; done += size) {
+        size = MIN (chunk_max, nv_public.nvPublic.dataSize - done);
+        params [0] = htobe16 (size);
+        params [1] = htobe16 (done);
+        g_queue_push_tail (resmgr->warm_up,
+                           warm_up_command_new (TPM2_CC_NV_Read,
+                                                handles,
+                                                2,
+                                                TRUE,
+                                                (const guint8*)params,
+                                                sizeof (params)));
+    }
+}
+/*
+ * Drop the NV_Read commands still queued for 'index' once one of them
+ * failed: the rest would fail the same way.
+ */
+static void
+warm_up_drop_nv_read (ResourceManager *resmgr,
+                      TPM2_HANDLE      index)
+{
+    GList *link, *next;
+    Tpm2Command *command;
+
+    for (link = resmgr->warm_up->head; link != NULL; link = next) {
+        next = link->next;
+        command = TPM2_COMMAND (link->data);
+        if (tpm2_command_get_code (command) == TPM2_CC_NV_Read &&
+            tpm2_command_get_handle (command, 1) == index)
+        {
+            g_queue_delete_link (resmgr->warm_up, link);
+            g_object_unref (command);
+        }
     }
-    /* Send command and create response object. */
-    response = send_command_handle_rc (resmgr, command);
-    dump_response (response);
-    /* transform virtualized handles in Tpm2Response if necessary */
-    resource_manager_create_context_mapping (resmgr,
-                                             response,
-                                             &transient_slist);
-send_response:
-    sink_enqueue (resmgr->sink, G_OBJECT (response));
-    g_object_unref (response);
-    /* save contexts that were previously loaded */
-    session_list_foreach (resmgr->session_list,
-                          save_session_callback,
-                          resmgr);
-    post_process_loaded_transients (resmgr, &transient_slist, connection, command_attrs);
-    g_object_unref (connection);
-    return;
 }
 /*
- * Return FALSE to terminate main thread.
+ * Send the next command queued by resource_manager_warm_up and keep the
+ * response in the cache a client's identical command would be answered
+ * from. Some responses queue the commands that follow from them: the
+ * ReadPublic of each persistent handle and the NV_Read of each index.
+ * Like resource_manager_create_template_primary this is called when no
+ * message is waiting, for one command at a time.
  */
-gboolean
-resource_manager_process_control (ResourceManager *resmgr,
-                                  ControlMessage *msg)
+void
+resource_manager_warm_up_next (ResourceManager *resmgr)
 {
-    ControlCode code = control_message_get_code (msg);
-    Connection *conn;
+    Tpm2Command *command = g_queue_pop_head (resmgr->warm_up);
+    Tpm2Response *response;
+    TSS2_RC rc;
 
-    g_debug ("%s", __func__);
-    switch (code) {
-    case CHECK_CANCEL:
-        sink_enqueue (resmgr->sink, G_OBJECT (msg));
-        return FALSE;
-    case CONNECTION_REMOVED:
-        conn = CONNECTION (control_message_get_object (msg));
-        g_debug ("%s: received CONNECTION_REMOVED message for connection",
-                 __func__);
-        resource_manager_remove_connection (resmgr, conn);
-        sink_enqueue (resmgr->sink, G_OBJECT (msg));
-        return TRUE;
+    if (resmgr->kernel_rm_conf != NULL || resmgr->passthrough != NULL) {
+        g_object_unref (command);
+        return;
+    }
+    response = send_command_handle_rc (resmgr, command);
+    rc = tpm2_response_get_code (response);
+    while (resource_manager_evict_for_rc (resmgr, rc, NULL, command)) {
+        g_object_unref (response);
+        response = send_command_handle_rc (resmgr, command);
+        rc = tpm2_response_get_code (response);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        g_debug ("%s: command 0x%" PRIx32 " failed, RC: 0x%" PRIx32,
+                 __func__, tpm2_command_get_code (command), rc);
+        if (tpm2_command_get_code (command) == TPM2_CC_NV_Read) {
+            warm_up_drop_nv_read (resmgr, tpm2_command_get_handle (command, 1));
+        }
+        goto out;
+    }
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_GetCapability:
+        if (tpm2_command_get_cap (command) == TPM2_CAP_HANDLES) {
+            warm_up_push_read_public (resmgr, response);
+        } else if (get_cap_response_fixed (response) &&
+                   get_cap_post_process (resmgr, response) == TSS2_RC_SUCCESS)
+        {
+            get_cap_cache_insert (resmgr, command, response);
+        }
+        break;
+    case TPM2_CC_ReadPublic:
+        read_public_cache_insert (resmgr, command, response);
+        break;
+    case TPM2_CC_NV_ReadPublic:
+        nv_cache_insert (resmgr, command, response);
+        warm_up_push_nv_read (resmgr, response);
+        break;
+    case TPM2_CC_NV_Read:
+        if (nv_cacheable (resmgr, command)) {
+            nv_cache_insert (resmgr, command, response);
+        }
+        break;
     default:
-        g_warning ("%s: Unknown control code: %d ... ignoring",
-                   __func__, code);
-        return TRUE;
+        break;
     }
+    if (g_queue_is_empty (resmgr->warm_up)) {
+        g_info ("%s: caches warmed up", __func__);
+    }
+out:
+    g_object_unref (response);
+    g_object_unref (command);
 }
 /**
  * This function acts as a thread. It simply:
  * - Blocks on the in_queue. Then wakes up and
- * - Dequeues a message from the in_queue.
- * - Processes the message (depending on TYPE)
+ * - Drains the messages waiting, up to RESOURCE_MANAGER_DRAIN_MAX of
+ *   them, processing each one (depending on TYPE) to completion.
+ * - Drops expired abandoned sessions, flushes what closed connections
+ *   left in the TPM and evicts cold contexts if no other message is
+ *   waiting, and then spills the contexts of idle connections, regaps old
+ *   saved sessions and refills the random_pool if any of the messages was
+ *   a command.
+ * - Creates a primary for the next --primary-template, or else sends the
+ *   next warm-up command, if there is one and no message is waiting.
  * - Does it all over again.
+ * Messages are still taken one at a time so that the in_queue decides
+ * the order with everything that's queued at that point, and so that a
+ * cancel still finds the commands not processed yet.
  */
 gpointer
 resource_manager_thread (gpointer data)
 {
     ResourceManager *resmgr = RESOURCE_MANAGER (data);
     GObject         *obj = NULL;
-    gboolean done = FALSE;
+    gboolean done = FALSE, command, background;
+    guint count;
 
     g_debug ("resource_manager_thread start");
     while (!done) {
-        obj = message_queue_dequeue (resmgr->in_queue);
-        g_debug ("%s: message_queue_dequeue got obj", __func__);
+        background = !g_queue_is_empty (resmgr->primary_templates) ||
+            !g_queue_is_empty (resmgr->warm_up);
+        obj = resource_manager_next_message (resmgr, !background);
+        if (obj == NULL && !g_queue_is_empty (resmgr->primary_templates)) {
+            resource_manager_create_template_primary (resmgr);
+            continue;
+        }
+        if (obj == NULL && background) {
+            resource_manager_warm_up_next (resmgr);
+            continue;
+        }
         if (obj == NULL) {
             g_debug ("%s: dequeued a null object", __func__);
             break;
         }
-        if (IS_TPM2_COMMAND (obj)) {
-            resource_manager_process_tpm2_command (resmgr, TPM2_COMMAND (obj));
-        } else if (IS_CONTROL_MESSAGE (obj)) {
-            gboolean ret =
-                resource_manager_process_control (resmgr, CONTROL_MESSAGE (obj));
-            if (ret == FALSE) {
-                done = TRUE;
+        command = FALSE;
+        count = 0;
+        do {
+            command = command || IS_TPM2_COMMAND (obj);
+            done = !resource_manager_process_message (resmgr, obj);
+            g_object_unref (obj);
+            ++count;
+        } while (!done &&
+                 count < RESOURCE_MANAGER_DRAIN_MAX &&
+                 (obj = resource_manager_next_message (resmgr, FALSE)) != NULL);
+        g_debug ("%s: processed %u messages", __func__, count);
+        if (!done && resource_manager_is_idle (resmgr)) {
+            session_list_expire_abandoned (resmgr->session_list,
+                                           flush_session_callback,
+                                           resmgr);
+            resource_manager_flush_pending (resmgr);
+            resource_manager_evict_idle (resmgr);
+            if (command) {
+                resource_manager_spill_idle (resmgr);
+                regap_idle_sessions (resmgr);
+                random_pool_refill (resmgr);
             }
         }
-        g_object_unref (obj);
     }
 
     return NULL;
@@ -1449,6 +5163,22 @@ resource_manager_unblock (Thread *self)
     message_queue_enqueue (resmgr->in_queue, G_OBJECT (msg));
     g_object_unref (msg);
 }
+/*
+ * Returns TRUE if 'command' should be refused because the TPM is degraded
+ * and it's bulk work. It's only refused while other commands are queued:
+ * a TPM with nothing else to do may as well run it.
+ */
+static gboolean
+resource_manager_shed_bulk (ResourceManager *resmgr,
+                            Tpm2Command     *command)
+{
+    CommandDurations *durations = resmgr->tpm2->durations;
+
+    return durations != NULL &&
+        command_durations_is_degraded (durations) &&
+        message_queue_get_length (resmgr->in_queue) > 0 &&
+        command_durations_is_bulk (durations, tpm2_command_get_code (command));
+}
 /**
  * Implement the 'enqueue' function from the Sink interface. This is how
  * new messages / commands get into the Tpm2.
@@ -1458,9 +5188,62 @@ resource_manager_enqueue (Sink        *sink,
                           GObject     *obj)
 {
     ResourceManager *resmgr = RESOURCE_MANAGER (sink);
+    Tpm2Command *command;
+    Connection *connection;
+    Tpm2Response *response;
 
     g_debug ("%s", __func__);
-    message_queue_enqueue (resmgr->in_queue, obj);
+    /* commands refused upstream are answered without going to the TPM */
+    if (IS_TPM2_RESPONSE (obj)) {
+        metrics_count (resmgr->metrics, METRICS_COMMAND_REJECTED);
+        sink_enqueue (resmgr->sink, obj);
+        return;
+    }
+    if (!IS_TPM2_COMMAND (obj)) {
+        if (IS_CONTROL_MESSAGE (obj) &&
+            control_message_get_code (CONTROL_MESSAGE (obj)) == CONNECTION_REMOVED)
+        {
+            resource_manager_purge_staged (resmgr,
+                CONNECTION (control_message_get_object (CONTROL_MESSAGE (obj))));
+        }
+        message_queue_enqueue (resmgr->in_queue, obj);
+        return;
+    }
+    command = TPM2_COMMAND (obj);
+    connection = tpm2_command_get_connection (command);
+    if (resource_manager_over_memory (resmgr, connection, FALSE)) {
+        g_info ("%s: connection 0x%" PRIx64 " is over its memory limit",
+                __func__, connection->id);
+    } else if (resource_manager_shed_bulk (resmgr, command)) {
+        g_info ("%s: shedding bulk command 0x%" PRIx32 " from connection "
+                "0x%" PRIx64 " while the TPM is degraded", __func__,
+                tpm2_command_get_code (command), connection->id);
+        metrics_count (resmgr->metrics, METRICS_COMMAND_SHED);
+    } else if (resmgr->pending_max == 0) {
+        if (message_queue_try_enqueue (resmgr->in_queue, obj)) {
+            goto out;
+        }
+    } else if (connection_acquire_pending (connection, resmgr->pending_max)) {
+        if (message_queue_try_enqueue (resmgr->in_queue, obj)) {
+            goto out;
+        }
+        connection_release_pending (connection);
+    }
+    /*
+     * Shed the command rather than queue it: the client gets a response it
+     * can retry on right away instead of waiting behind the backlog.
+     */
+    g_debug ("%s: refusing command from connection 0x%" PRIx64,
+             __func__, connection->id);
+    metrics_count (resmgr->metrics, METRICS_COMMAND_REJECTED);
+    response = tpm2_response_new_rc (connection, TSS2_RESMGR_RC_RETRY);
+    tpm2_response_set_request_tag (response,
+                                   tpm2_command_get_request_tag (command));
+    sink_enqueue (resmgr->sink, G_OBJECT (response));
+    g_object_unref (response);
+    resource_manager_answer_batch (resmgr, command, 0, TSS2_RESMGR_RC_RETRY);
+out:
+    g_object_unref (connection);
 }
 /**
  * Implement the 'add_sink' function from the SourceInterface. This adds a
@@ -1511,6 +5294,7 @@ resource_manager_set_property (GObject        *object,
         }
         resmgr->tpm2 = g_value_get_object (value);
         g_object_ref (resmgr->tpm2);
+        tpm2_set_overlap_func (resmgr->tpm2, resource_manager_overlap, resmgr);
         break;
     case PROP_SESSION_LIST:
         resmgr->session_list = SESSION_LIST (g_value_dup_object (value));
@@ -1564,16 +5348,84 @@ resource_manager_dispose (GObject *obj)
         g_error ("%s: passed NULL parameter", __func__);
     if (thread->thread_id != 0)
         g_error ("%s: thread running, cancel thread first", __func__);
+    if (resmgr->staged != NULL) {
+        g_queue_free_full (resmgr->staged, g_object_unref);
+        resmgr->staged = NULL;
+    }
+    if (resmgr->primary_templates != NULL) {
+        g_queue_free_full (resmgr->primary_templates, g_object_unref);
+        resmgr->primary_templates = NULL;
+    }
+    if (resmgr->warm_up != NULL) {
+        g_queue_free_full (resmgr->warm_up, g_object_unref);
+        resmgr->warm_up = NULL;
+    }
     g_clear_object (&resmgr->in_queue);
     g_clear_object (&resmgr->sink);
+    if (resmgr->tpm2 != NULL) {
+        tpm2_set_overlap_func (resmgr->tpm2, NULL, NULL);
+    }
     g_clear_object (&resmgr->tpm2);
     g_clear_object (&resmgr->session_list);
+    g_slist_free_full (resmgr->resident_transients, g_object_unref);
+    resmgr->resident_transients = NULL;
+    g_clear_object (&resmgr->resident_connection);
+    g_clear_object (&resmgr->metrics);
+    g_clear_object (&resmgr->quota_pool);
+    g_clear_pointer (&resmgr->cap_cache, g_hash_table_unref);
+    g_clear_pointer (&resmgr->read_public_cache, g_hash_table_unref);
+    g_clear_pointer (&resmgr->nv_cache, g_hash_table_unref);
+    g_clear_pointer (&resmgr->nv_attrs, g_hash_table_unref);
+    g_clear_pointer (&resmgr->query_cache, g_hash_table_unref);
+    g_clear_object (&resmgr->response_page);
+    g_clear_pointer (&resmgr->pcr_cache, g_hash_table_unref);
+    g_clear_pointer (&resmgr->primary_cache, g_hash_table_unref);
+    g_clear_pointer (&resmgr->load_cache, g_hash_table_unref);
+    g_clear_pointer (&resmgr->flush_pending, g_array_unref);
+    g_clear_pointer (&resmgr->random_pool, random_pool_free);
+    g_clear_pointer (&resmgr->spill_candidates, g_hash_table_unref);
+    g_clear_object (&resmgr->context_store);
+    g_clear_object (&resmgr->passthrough);
+    g_clear_object (&resmgr->passthrough_manager);
+    g_clear_pointer (&resmgr->kernel_rm_conf, g_free);
     G_OBJECT_CLASS (resource_manager_parent_class)->dispose (obj);
 }
 static void
+resource_manager_finalize (GObject *obj)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (obj);
+
+    g_mutex_clear (&resmgr->in_flight_mutex);
+    arena_clear (&resmgr->arena);
+    G_OBJECT_CLASS (resource_manager_parent_class)->finalize (obj);
+}
+static void
 resource_manager_init (ResourceManager *manager)
 {
-    UNUSED_PARAM (manager);
+    g_mutex_init (&manager->in_flight_mutex);
+    arena_init (&manager->arena, ARENA_BLOCK_SIZE_DEFAULT);
+    manager->staged = g_queue_new ();
+    manager->primary_templates = g_queue_new ();
+    manager->warm_up = g_queue_new ();
+    manager->cap_cache = g_hash_table_new_full (g_bytes_hash,
+                                                g_bytes_equal,
+                                                (GDestroyNotify)g_bytes_unref,
+                                                (GDestroyNotify)g_bytes_unref);
+    manager->read_public_cache =
+        g_hash_table_new_full (g_direct_hash,
+                               g_direct_equal,
+                               NULL,
+                               (GDestroyNotify)g_bytes_unref);
+    manager->nv_cache = g_hash_table_new_full (g_bytes_hash,
+                                               g_bytes_equal,
+                                               (GDestroyNotify)g_bytes_unref,
+                                               (GDestroyNotify)g_bytes_unref);
+    manager->nv_attrs = g_hash_table_new (g_direct_hash, g_direct_equal);
+    manager->query_cache = g_hash_table_new_full (g_bytes_hash,
+                                                  g_bytes_equal,
+                                                  (GDestroyNotify)g_bytes_unref,
+                                                  (GDestroyNotify)g_bytes_unref);
+    manager->flush_pending = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE));
 }
 /**
  * GObject class initialization function. This function boils down to:
@@ -1590,6 +5442,7 @@ resource_manager_class_init (ResourceManagerClass *klass)
     if (resource_manager_parent_class == NULL)
         resource_manager_parent_class = g_type_class_peek_parent (klass);
     object_class->dispose = resource_manager_dispose;
+    object_class->finalize = resource_manager_finalize;
     object_class->get_property = resource_manager_get_property;
     object_class->set_property = resource_manager_set_property;
     thread_class->thread_run     = resource_manager_thread;
@@ -1643,13 +5496,18 @@ resource_manager_sink_interface_init (gpointer g_iface)
 }
 /*
  * A callback function implementing the PruneFunc type for use with the
- * session_list_prune_abaonded function.
+ * session_list_prune_abaonded function. The session is removed from the
+ * SessionList now and flushed from the TPM later.
  */
 gboolean
 flush_session_callback (SessionEntry *entry,
                         gpointer data)
 {
-    return flush_session (RESOURCE_MANAGER (data), entry);
+    ResourceManager *resmgr = RESOURCE_MANAGER (data);
+
+    resource_manager_defer_flush (resmgr, session_entry_get_handle (entry));
+    session_list_remove (resmgr->session_list, entry);
+    return TRUE;
 }
 /*
  * This structure is used to pass required data into the
@@ -1671,8 +5529,8 @@ typedef struct {
  * - change state to SESSION_ENTRY_SAVED_CLIENT_CLOSED
  * - "prune" other abandoned sessions
  * - add SessionEntry to queue of abandoned sessions
- * If session is in state SESSION_ENTRY_SAVED_RM:
- * - flush session from TPM
+ * If session is in state SESSION_ENTRY_SAVED_RM or SESSION_ENTRY_LOADED:
+ * - queue the session to be flushed from the TPM
  * - remove SessionEntry from session list
  * If session is in any other state
  * - panic
@@ -1687,7 +5545,6 @@ connection_close_session_callback (gpointer data,
     Connection *connection = callback_data->connection;
     ResourceManager *resource_manager = callback_data->resource_manager;
     TPM2_HANDLE handle;
-    TSS2_RC rc;
 
     g_debug ("%s", __func__);
     if (session_entry->connection != connection) {
@@ -1708,12 +5565,9 @@ connection_close_session_callback (gpointer data,
                                       resource_manager);
         break;
     case SESSION_ENTRY_SAVED_RM:
+    case SESSION_ENTRY_LOADED:
         g_debug ("%s: flushing.", __func__);
-        rc = tpm2_context_flush (resource_manager->tpm2,
-                                          handle);
-        if (rc != TSS2_RC_SUCCESS) {
-            g_warning ("%s: failed to flush context", __func__);
-        }
+        resource_manager_defer_flush (resource_manager, handle);
         session_list_remove (resource_manager->session_list,
                              session_entry);
         break;
@@ -1728,7 +5582,8 @@ connection_close_session_callback (gpointer data,
  * This function is invoked when a connection is removed from the
  * ConnectionManager. This is if how we know a connection has been closed.
  * When a connection is removed, we need to remove all associated sessions
- * from the TPM.
+ * and resident transient objects from the TPM. Only the bookkeeping is
+ * done here: the flushes are deferred (see resource_manager_defer_flush).
  */
 void
 resource_manager_remove_connection (ResourceManager *resource_manager,
@@ -1738,15 +5593,62 @@ resource_manager_remove_connection (ResourceManager *resource_manager,
         .connection = connection,
         .resource_manager = resource_manager,
     };
+    HandleMapEntry *entry, *owned;
+    HandleMap *map;
+    GSList *item, *next;
+    TPM2_HANDLE phandle;
+
+    /* the kernel flushes what was loaded through it once it's closed */
+    connection_set_tcti (connection, NULL);
+    if (resource_manager->passthrough == connection) {
+        g_info ("%s: flushing everything the passthrough connection left",
+                __func__);
+        tpm2_flush_all_context (resource_manager->tpm2);
+        g_clear_object (&resource_manager->passthrough);
+    }
+    /*
+     * Objects kept resident by their hint are left behind by other
+     * connections: only those in the connection's map are its own.
+     */
+    g_info ("%s: flushing resident transient objects", __func__);
+    map = connection_get_trans_map (connection);
+    for (item = resource_manager->resident_transients; item != NULL; item = next) {
+        next = item->next;
+        entry = HANDLE_MAP_ENTRY (item->data);
+        owned = handle_map_vlookup (map, handle_map_entry_get_vhandle (entry));
+        if (owned == entry) {
+            phandle = handle_map_entry_get_phandle (entry);
+            if (phandle != 0) {
+                resource_manager_defer_flush (resource_manager, phandle);
+                handle_map_entry_set_phandle (entry, 0);
+            }
+            resource_manager_drop_resident (resource_manager, entry, FALSE);
+        }
+        g_clear_object (&owned);
+    }
+    g_object_unref (map);
+    if (resource_manager->resident_connection == connection) {
+        g_clear_object (&resource_manager->resident_connection);
+        if (IS_FAIR_QUEUE (resource_manager->in_queue)) {
+            fair_queue_set_affinity (FAIR_QUEUE (resource_manager->in_queue),
+                                     NULL);
+        }
+    }
 
+    if (resource_manager->spill_candidates != NULL) {
+        g_hash_table_remove (resource_manager->spill_candidates, connection);
+    }
     g_info ("%s: flushing session contexts", __func__);
-    session_list_foreach (resource_manager->session_list,
-                          connection_close_session_callback,
-                          &connection_close_data);
+    session_list_foreach_connection (resource_manager->session_list,
+                                     connection,
+                                     connection_close_session_callback,
+                                     &connection_close_data);
+    resource_manager_quota_settle (resource_manager, connection, TRUE);
     g_debug ("%s: done", __func__);
 }
 /**
- * Create new ResourceManager object.
+ * Create new ResourceManager object. Commands are scheduled from the input
+ * queue fairly between connections (see FairQueue).
  */
 ResourceManager*
 resource_manager_new (Tpm2    *tpm2,
@@ -1754,10 +5656,601 @@ resource_manager_new (Tpm2    *tpm2,
 {
     if (tpm2 == NULL)
         g_error ("resource_manager_new passed NULL Tpm2");
-    MessageQueue *queue = message_queue_new ();
-    return RESOURCE_MANAGER (g_object_new (TYPE_RESOURCE_MANAGER,
-                                           "queue-in",        queue,
-                                           "tpm2", tpm2,
-                                           "session-list",    session_list,
-                                           NULL));
+    MessageQueue *queue = MESSAGE_QUEUE (fair_queue_new ());
+    ResourceManager *resmgr;
+    guint32 sessions_max;
+
+    resmgr = RESOURCE_MANAGER (g_object_new (TYPE_RESOURCE_MANAGER,
+                                             "queue-in",        queue,
+                                             "tpm2", tpm2,
+                                             "session-list",    session_list,
+                                             NULL));
+    if (tpm2_get_fixed_property (tpm2,
+                                 TPM2_PT_CONTEXT_GAP_MAX,
+                                 &resmgr->context_gap_max) != TSS2_RC_SUCCESS)
+    {
+        g_debug ("%s: no TPM2_PT_CONTEXT_GAP_MAX, sessions are only "
+                 "regapped after TPM2_RC_CONTEXT_GAP", __func__);
+        resmgr->context_gap_max = 0;
+    }
+    if (tpm2_get_fixed_property (tpm2,
+                                 TPM2_PT_ACTIVE_SESSIONS_MAX,
+                                 &sessions_max) == TSS2_RC_SUCCESS)
+    {
+        session_list_set_tpm_sessions_max (resmgr->session_list, sessions_max);
+    }
+    return resmgr;
+}
+/*
+ * Bound the number of commands waiting in the in_queue to 'queue_depth'
+ * and the number of commands each connection may have queued or executing
+ * to 'pending_max'. Commands past either limit are answered right away
+ * with TSS2_RESMGR_RC_RETRY. A limit of 0 disables it. This must be called
+ * before the ResourceManager thread is started.
+ */
+void
+resource_manager_set_admission (ResourceManager *resmgr,
+                                guint            queue_depth,
+                                guint            pending_max)
+{
+    g_assert (resmgr != NULL);
+    message_queue_set_max_length (resmgr->in_queue, queue_depth);
+    resmgr->pending_max = pending_max;
+}
+/*
+ * Bound the bytes of commands, responses and saved contexts held for a
+ * connection to 'connection_bytes_max' and for all connections to
+ * 'bytes_max'. Commands from a connection past either limit are answered
+ * with TSS2_RESMGR_RC_RETRY, and commands that would load an object or
+ * start a session with TSS2_RESMGR_RC_OUT_OF_MEMORY once its saved
+ * contexts push it past them. A limit of 0 disables it. This must be
+ * called before the ResourceManager thread is started.
+ */
+void
+resource_manager_set_memory_max (ResourceManager *resmgr,
+                                 gsize            connection_bytes_max,
+                                 gsize            bytes_max)
+{
+    g_assert (resmgr != NULL);
+    resmgr->connection_bytes_max = connection_bytes_max;
+    resmgr->bytes_max = bytes_max;
+}
+/*
+ * Answer small GetRandom commands from a pool of 'size' random bytes that's
+ * refilled while the TPM is idle. A 'size' of 0 disables the pool. This
+ * must be called before the ResourceManager thread is started or from it.
+ * Returns FALSE if the pool can't be created.
+ */
+gboolean
+resource_manager_set_random_pool (ResourceManager *resmgr,
+                                  size_t           size)
+{
+    g_assert (resmgr != NULL);
+    g_clear_pointer (&resmgr->random_pool, random_pool_free);
+    if (size == 0) {
+        return TRUE;
+    }
+    resmgr->random_pool = random_pool_new (size);
+    return resmgr->random_pool != NULL;
+}
+/*
+ * Answer PCR_Read commands without sessions from the responses to earlier
+ * ones until a command that changes the PCRs read goes through this
+ * ResourceManager. PCRs changed by other means, like a DRTM launch or
+ * another user of the TPM, aren't seen: the cache is off by default. This
+ * must be called before the ResourceManager thread is started or from it.
+ */
+void
+resource_manager_set_pcr_cache (ResourceManager *resmgr,
+                                gboolean         enabled)
+{
+    g_assert (resmgr != NULL);
+    g_clear_pointer (&resmgr->pcr_cache, g_hash_table_unref);
+    if (enabled) {
+        resmgr->pcr_cache =
+            g_hash_table_new_full (g_bytes_hash,
+                                   g_bytes_equal,
+                                   (GDestroyNotify)g_bytes_unref,
+                                   (GDestroyNotify)g_bytes_unref);
+    }
+}
+/*
+ * Create primary objects once: a CreatePrimary that repeats an earlier one
+ * with only password sessions and no creationPCR loads a saved copy of
+ * the object the first one created. The copies are dropped by commands
+ * that change a hierarchy's seed, auth or state when they go through this
+ * ResourceManager; changes made without going through it aren't seen, so
+ * the cache is off by default. This must be called before the
+ * ResourceManager thread is started or from it.
+ */
+void
+resource_manager_set_primary_cache (ResourceManager *resmgr,
+                                    gboolean         enabled)
+{
+    g_assert (resmgr != NULL);
+    g_clear_pointer (&resmgr->primary_cache, g_hash_table_unref);
+    if (enabled) {
+        resmgr->primary_cache =
+            g_hash_table_new_full (g_bytes_hash,
+                                   g_bytes_equal,
+                                   (GDestroyNotify)g_bytes_unref,
+                                   primary_cache_entry_free);
+    }
+}
+/*
+ * Have the ResourceManager thread create the primary object in
+ * 'hierarchy' for the storage key template of 'type', TPM2_ALG_RSA or
+ * TPM2_ALG_ECC, and keep it in the primary_cache once nothing else is
+ * waiting for the TPM. A client's CreatePrimary for the same template
+ * with an empty hierarchy password then only loads the saved object.
+ * This must be called before the ResourceManager thread is started.
+ */
+void
+resource_manager_add_primary_template (ResourceManager  *resmgr,
+                                       TPMI_RH_HIERARCHY hierarchy,
+                                       TPMI_ALG_PUBLIC   type)
+{
+    g_assert (resmgr != NULL);
+    g_queue_push_tail (resmgr->primary_templates,
+                       primary_template_command_new (hierarchy, type));
+}
+/*
+ * Have the ResourceManager thread fill the caches while nothing else is
+ * waiting for the TPM, after the --primary-template primaries, so the
+ * first clients don't pay for the misses: the capability sets clients
+ * ask for, the ReadPublic of every persistent object and the
+ * NV_ReadPublic of the 'nv_count' indices in 'nv_indices'. An index that
+ * can be read with its own empty password, isn't protected against
+ * dictionary attacks and can't change, like an EK certificate, is read as
+ * well. Commands are sent one at a time so a
+ * client waits for one of them at most.
+ * This must be called before the ResourceManager thread is started.
+ */
+void
+resource_manager_warm_up (ResourceManager   *resmgr,
+                          const TPM2_HANDLE *nv_indices,
+                          guint              nv_count)
+{
+    guint i;
+
+    g_assert (resmgr != NULL);
+    warm_up_push_get_cap (resmgr, TPM2_CAP_TPM_PROPERTIES, TPM2_PT_FIXED,
+                          TPM2_MAX_TPM_PROPERTIES);
+    warm_up_push_get_cap (resmgr, TPM2_CAP_ALGS, TPM2_ALG_FIRST,
+                          TPM2_MAX_CAP_ALGS);
+    warm_up_push_get_cap (resmgr, TPM2_CAP_COMMANDS, TPM2_CC_FIRST,
+                          TPM2_MAX_CAP_CC);
+    warm_up_push_get_cap (resmgr, TPM2_CAP_PP_COMMANDS, TPM2_CC_FIRST,
+                          TPM2_MAX_CAP_CC);
+    warm_up_push_get_cap (resmgr, TPM2_CAP_HANDLES, TPM2_PERSISTENT_FIRST,
+                          TPM2_MAX_CAP_HANDLES);
+    for (i = 0; i < nv_count; ++i) {
+        g_queue_push_tail (resmgr->warm_up,
+                           warm_up_command_new (TPM2_CC_NV_ReadPublic,
+                                                &nv_indices [i],
+                                                1,
+                                                FALSE,
+                                                NULL,
+                                                0));
+    }
+}
+/*
+ * Load key blobs once: a Load that repeats an earlier one under the same
+ * parent with only password sessions loads a saved copy of the object
+ * the first one loaded, without loading the parent. The copies are
+ * dropped by commands that change a hierarchy or a persistent object when
+ * they go through this ResourceManager; changes made without going
+ * through it aren't seen, so the cache is off by default. This must be
+ * called before the ResourceManager thread is started or from it.
+ */
+void
+resource_manager_set_load_cache (ResourceManager *resmgr,
+                                 gboolean         enabled)
+{
+    g_assert (resmgr != NULL);
+    g_clear_pointer (&resmgr->load_cache, g_hash_table_unref);
+    if (enabled) {
+        resmgr->load_cache =
+            g_hash_table_new_full (g_bytes_hash,
+                                   g_bytes_equal,
+                                   (GDestroyNotify)g_bytes_unref,
+                                   primary_cache_entry_free);
+    }
+}
+/*
+ * Move the saved contexts of idle connections to 'store'. Pass NULL to
+ * keep them all in memory. This must be called before the ResourceManager
+ * thread is started.
+ */
+void
+resource_manager_set_context_store (ResourceManager *resmgr,
+                                    ContextStore    *store)
+{
+    g_assert (resmgr != NULL);
+    g_clear_pointer (&resmgr->spill_candidates, g_hash_table_unref);
+    g_clear_object (&resmgr->context_store);
+    if (store != NULL) {
+        resmgr->context_store = g_object_ref (store);
+        resmgr->spill_candidates = g_hash_table_new_full (g_direct_hash,
+                                                          g_direct_equal,
+                                                          g_object_unref,
+                                                          NULL);
+    }
+}
+/*
+ * Publish the responses in the cap_cache and query_cache in the section of
+ * 'page' for 'tpm', the index of this ResourceManager's TPM. This must be
+ * called before the ResourceManager thread is started.
+ */
+void
+resource_manager_set_response_page (ResourceManager *resmgr,
+                                    ResponsePage    *page,
+                                    guint            tpm)
+{
+    g_assert (resmgr != NULL);
+    g_clear_object (&resmgr->response_page);
+    if (page != NULL) {
+        resmgr->response_page = g_object_ref (page);
+        resmgr->response_page_tpm = tpm;
+    }
+}
+/*
+ * Pass the commands of a connection that has the TPM to itself straight
+ * to the TPM, see resource_manager_passthrough_begin. 'manager' holds the
+ * connections of the daemon, NULL virtualizes every command. This must be
+ * called before the ResourceManager thread is started.
+ */
+void
+resource_manager_set_passthrough (ResourceManager   *resmgr,
+                                  ConnectionManager *manager)
+{
+    g_assert (resmgr != NULL);
+    g_clear_object (&resmgr->passthrough_manager);
+    if (manager != NULL) {
+        resmgr->passthrough_manager = g_object_ref (manager);
+    }
+}
+/*
+ * Leave virtualization to the kernel resource manager: each connection
+ * opens a Tcti of its own with 'conf', a device TCTI on /dev/tpmrm, and
+ * its commands are sent through it as they are, see
+ * resource_manager_kernel_rm_send. NULL virtualizes every command. This
+ * must be called before the ResourceManager thread is started.
+ */
+void
+resource_manager_set_kernel_rm (ResourceManager *resmgr,
+                                const gchar     *conf)
+{
+    g_assert (resmgr != NULL);
+    g_free (resmgr->kernel_rm_conf);
+    resmgr->kernel_rm_conf = g_strdup (conf);
+}
+/*
+ * Time the phases of each command and attach them to its response for the
+ * slow command log, see command_timing_t. This must be called before the
+ * ResourceManager thread is started.
+ */
+void
+resource_manager_set_time_commands (ResourceManager *resmgr,
+                                    gboolean         enabled)
+{
+    g_assert (resmgr != NULL);
+    resmgr->time_commands = enabled;
+}
+/*
+ * Let each connection keep up to 'count' of its transient objects resident
+ * with TABRMD_CC_RESIDENCY, 0 to refuse the hints that do. This must be
+ * called before the ResourceManager thread is started.
+ */
+void
+resource_manager_set_pinned_max (ResourceManager *resmgr,
+                                 guint            count)
+{
+    g_assert (resmgr != NULL);
+    resmgr->pinned_max = count;
+}
+/*
+ * Evict the contexts that go unused for 'window' milliseconds while the
+ * TPM is idle, 0 to only evict when the TPM runs out of room. This must
+ * be called before the ResourceManager thread is started.
+ */
+void
+resource_manager_set_evict_idle (ResourceManager *resmgr,
+                                 guint            window)
+{
+    g_assert (resmgr != NULL);
+    resmgr->evict_idle = window;
+}
+/*
+ * Record per command counts and queueing latencies in 'metrics'. Pass NULL
+ * to stop. This must be called before the ResourceManager thread is started.
+ */
+void
+resource_manager_set_metrics (ResourceManager *resmgr,
+                              Metrics         *metrics)
+{
+    g_assert (resmgr != NULL);
+    g_clear_object (&resmgr->metrics);
+    if (metrics != NULL) {
+        resmgr->metrics = g_object_ref (metrics);
+    }
+}
+/*
+ * Let connections borrow transient objects and sessions from 'pool' once
+ * they reach their limits. Pass NULL to stop. This must be called before
+ * the ResourceManager thread is started.
+ */
+void
+resource_manager_set_quota_pool (ResourceManager *resmgr,
+                                 QuotaPool       *pool)
+{
+    g_assert (resmgr != NULL);
+    g_clear_object (&resmgr->quota_pool);
+    if (pool != NULL) {
+        resmgr->quota_pool = g_object_ref (pool);
+    }
+}
+/*
+ * GFunc adding a SessionEntry to the GVariantBuilder of sessions for
+ * resource_manager_save_state. Sessions still loaded in the TPM couldn't
+ * be saved and are left out.
+ */
+static void
+save_state_session_callback (gpointer data,
+                       gpointer user_data)
+{
+    SessionEntry *entry = SESSION_ENTRY (data);
+    GVariantBuilder *builder = (GVariantBuilder*)user_data;
+    SessionEntryStateEnum state = session_entry_get_state (entry);
+    GBytes *context, *context_client;
+
+    context = session_entry_get_context (entry);
+    context_client = session_entry_get_context_client (entry);
+    if (state == SESSION_ENTRY_LOADED || context == NULL ||
+        context_client == NULL)
+    {
+        g_warning ("%s: session 0x%08" PRIx32 " isn't saved, leaving it out",
+                   __func__, session_entry_get_handle (entry));
+        return;
+    }
+    g_variant_builder_add (builder,
+                           "(tuu@ay@ay)",
+                           entry->connection != NULL ? entry->connection->id : 0,
+                           session_entry_get_handle (entry),
+                           (guint32)state,
+                           g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING,
+                                                     context,
+                                                     TRUE),
+                           g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING,
+                                                     context_client,
+                                                     TRUE));
+}
+/*
+ * Save the state a daemon restarted on the same TPM needs to carry on
+ * where this one stopped, see resource_manager_restore_state. The objects
+ * and sessions left loaded in the TPM are saved first so that everything
+ * the ResourceManager tracks is held as a saved context. This must only be
+ * called once the ResourceManager thread has stopped.
+ * Returns a floating GVariant of RESOURCE_MANAGER_STATE_TYPE or NULL if
+ * the TPM's clock can't be read.
+ */
+GVariant*
+resource_manager_save_state (ResourceManager *resmgr)
+{
+    GVariantBuilder primaries, sessions;
+    GHashTableIter iter;
+    gpointer key, value;
+    primary_cache_entry_t *primary;
+    TPMS_TIME_INFO time_info = { 0 };
+
+    g_assert (resmgr != NULL);
+    resource_manager_evict_transients (resmgr, NULL);
+    resource_manager_evict_sessions (resmgr, NULL);
+    resource_manager_flush_pending (resmgr);
+    if (tpm2_read_clock (resmgr->tpm2, &time_info) != TSS2_RC_SUCCESS) {
+        return NULL;
+    }
+    g_variant_builder_init (&primaries, G_VARIANT_TYPE ("a(ayayay)"));
+    if (resmgr->primary_cache != NULL) {
+        g_hash_table_iter_init (&iter, resmgr->primary_cache);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            primary = (primary_cache_entry_t*)value;
+            g_variant_builder_add (&primaries,
+                                   "(@ay@ay@ay)",
+                                   g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING,
+                                                             (GBytes*)key,
+                                                             TRUE),
+                                   g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING,
+                                                             primary->context,
+                                                             TRUE),
+                                   g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING,
+                                                             primary->response,
+                                                             TRUE));
+        }
+    }
+    g_variant_builder_init (&sessions, G_VARIANT_TYPE ("a(tuuayay)"));
+    session_list_foreach (resmgr->session_list,
+                          save_state_session_callback,
+                          &sessions);
+    g_debug ("%s: resetCount %" PRIu32 ", restartCount %" PRIu32, __func__,
+             time_info.clockInfo.resetCount, time_info.clockInfo.restartCount);
+    return g_variant_new (RESOURCE_MANAGER_STATE_TYPE,
+                          time_info.clockInfo.resetCount,
+                          time_info.clockInfo.restartCount,
+                          resmgr->context_counter,
+                          &primaries,
+                          &sessions);
+}
+/*
+ * Restore a primary_cache entry saved by resource_manager_save_state.
+ */
+static void
+resource_manager_restore_primary (ResourceManager *resmgr,
+                                  GVariant        *command,
+                                  GVariant        *context,
+                                  GVariant        *response)
+{
+    primary_cache_entry_t *entry;
+    GBytes *key;
+
+    if (resmgr->primary_cache == NULL ||
+        g_hash_table_size (resmgr->primary_cache) >=
+        RESOURCE_MANAGER_PRIMARY_CACHE_MAX)
+    {
+        return;
+    }
+    entry = g_new0 (primary_cache_entry_t, 1);
+    entry->context = context_blob_from_variant (context);
+    if (entry->context == NULL) {
+        g_free (entry);
+        return;
+    }
+    entry->response = g_variant_get_data_as_bytes (response);
+    key = g_variant_get_data_as_bytes (command);
+    if (g_hash_table_contains (resmgr->primary_cache, key)) {
+        g_bytes_unref (key);
+        primary_cache_entry_free (entry);
+        return;
+    }
+    g_hash_table_insert (resmgr->primary_cache, key, entry);
+}
+/*
+ * Restore a session saved by resource_manager_save_state. A session whose
+ * connection didn't survive the restart is handled like one of a closed
+ * connection: it's abandoned if the client saved it and flushed otherwise.
+ */
+static void
+resource_manager_restore_session (ResourceManager   *resmgr,
+                                  ConnectionManager *manager,
+                                  guint64            id,
+                                  TPM2_HANDLE        handle,
+                                  guint32            state,
+                                  GVariant          *context,
+                                  GVariant          *context_client)
+{
+    Connection *connection = NULL;
+    SessionEntry *entry;
+    gconstpointer buf, buf_client;
+    gsize size, size_client;
+    gboolean ret = FALSE;
+
+    buf = g_variant_get_fixed_array (context, &size, 1);
+    buf_client = g_variant_get_fixed_array (context_client, &size_client, 1);
+    if (size == 0 || size > SIZE_BUF_MAX ||
+        size_client == 0 || size_client > SIZE_BUF_MAX)
+    {
+        g_warning ("%s: bad context for session 0x%08" PRIx32,
+                   __func__, handle);
+        resource_manager_defer_flush (resmgr, handle);
+        return;
+    }
+    if (state == SESSION_ENTRY_SAVED_RM || state == SESSION_ENTRY_SAVED_CLIENT) {
+        connection = connection_manager_lookup_id (manager, id);
+    }
+    entry = session_entry_new (connection, handle);
+    /* the first context set is the client's */
+    session_entry_set_context (entry, (uint8_t*)buf_client, size_client);
+    session_entry_set_context (entry, (uint8_t*)buf, size);
+    if (connection != NULL) {
+        session_entry_set_state (entry, (SessionEntryStateEnum)state);
+        ret = session_list_insert (resmgr->session_list, entry);
+    } else if (state == SESSION_ENTRY_SAVED_CLIENT ||
+               state == SESSION_ENTRY_SAVED_CLIENT_CLOSED)
+    {
+        ret = session_list_insert_abandoned (resmgr->session_list, entry);
+    }
+    if (ret) {
+        resmgr->context_counter = MAX (resmgr->context_counter,
+                                       session_entry_get_sequence (entry));
+    } else {
+        g_debug ("%s: flushing session 0x%08" PRIx32, __func__, handle);
+        resource_manager_defer_flush (resmgr, handle);
+    }
+    g_clear_object (&entry);
+    g_clear_object (&connection);
+}
+/*
+ * Pick up the state saved by resource_manager_save_state before the
+ * daemon restarted. The connections restored with it must be in 'manager'
+ * already. The state is only good if the TPM hasn't been reset or
+ * restarted since: the saved contexts would no longer load. This must be
+ * called before the ResourceManager thread is started.
+ * Returns FALSE if the state wasn't restored.
+ */
+gboolean
+resource_manager_restore_state (ResourceManager   *resmgr,
+                                GVariant          *state,
+                                ConnectionManager *manager)
+{
+    GVariantIter *primaries, *sessions;
+    GVariant *command, *context, *context_client, *response;
+    TPMS_TIME_INFO time_info = { 0 };
+    guint32 reset_count, restart_count, handle, session_state;
+    guint64 context_counter, id;
+    guint count = 0;
+
+    g_assert (resmgr != NULL);
+    if (!g_variant_is_of_type (state,
+                               G_VARIANT_TYPE (RESOURCE_MANAGER_STATE_TYPE)))
+    {
+        g_warning ("%s: saved state has the wrong type: %s",
+                   __func__, g_variant_get_type_string (state));
+        return FALSE;
+    }
+    g_variant_get (state,
+                   RESOURCE_MANAGER_STATE_TYPE,
+                   &reset_count,
+                   &restart_count,
+                   &context_counter,
+                   &primaries,
+                   &sessions);
+    if (tpm2_read_clock (resmgr->tpm2, &time_info) != TSS2_RC_SUCCESS ||
+        time_info.clockInfo.resetCount != reset_count ||
+        time_info.clockInfo.restartCount != restart_count)
+    {
+        g_info ("%s: the TPM was reset or restarted, saved state is stale",
+                __func__);
+        g_variant_iter_free (primaries);
+        g_variant_iter_free (sessions);
+        return FALSE;
+    }
+    resmgr->context_counter = MAX (resmgr->context_counter, context_counter);
+    while (g_variant_iter_next (primaries,
+                                "(@ay@ay@ay)",
+                                &command,
+                                &context,
+                                &response))
+    {
+        resource_manager_restore_primary (resmgr, command, context, response);
+        g_variant_unref (command);
+        g_variant_unref (context);
+        g_variant_unref (response);
+    }
+    while (g_variant_iter_next (sessions,
+                                "(tuu@ay@ay)",
+                                &id,
+                                &handle,
+                                &session_state,
+                                &context,
+                                &context_client))
+    {
+        resource_manager_restore_session (resmgr,
+                                          manager,
+                                          id,
+                                          handle,
+                                          session_state,
+                                          context,
+                                          context_client);
+        g_variant_unref (context);
+        g_variant_unref (context_client);
+        ++count;
+    }
+    g_variant_iter_free (primaries);
+    g_variant_iter_free (sessions);
+    g_info ("%s: restored %u sessions and %u cached primaries", __func__,
+            count - resmgr->flush_pending->len,
+            resmgr->primary_cache != NULL ?
+            g_hash_table_size (resmgr->primary_cache) : 0);
+
+    return TRUE;
 }
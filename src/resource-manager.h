@@ -12,11 +12,18 @@
 #include <tss2/tss2_tpm2_types.h>
 
 #include "tpm2.h"
+#include "arena.h"
 #include "connection-manager.h"
+#include "context-store.h"
 #include "message-queue.h"
+#include "metrics.h"
+#include "quota-pool.h"
+#include "random-pool.h"
+#include "response-page.h"
 #include "session-list.h"
 #include "sink-interface.h"
 #include "thread.h"
+#include "tunables.h"
 
 G_BEGIN_DECLS
 
@@ -30,8 +37,163 @@ typedef struct _ResourceManager {
     MessageQueue     *in_queue;
     Sink             *sink;
     SessionList      *session_list;
+    /* transient objects left loaded in the TPM after the last command */
+    GSList           *resident_transients;
+    /* owner of the transients and sessions left loaded in the TPM */
+    Connection       *resident_connection;
+    /* objects and sessions of closed connections, not flushed yet */
+    GArray           *flush_pending;
+    /* logical clock used to order resident objects by last use */
+    guint64           use_clock;
+    /* connection whose command is being executed by the TPM */
+    GMutex            in_flight_mutex;
+    Connection       *in_flight;
+    /* messages taken from in_queue while the TPM executes a command */
+    GQueue           *staged;
+    /* optional, receives per command counts and queueing latencies */
+    Metrics          *metrics;
+    /* highest TPMS_CONTEXT sequence seen when saving a session */
+    guint64           context_counter;
+    /* TPM2_PT_CONTEXT_GAP_MAX, 0 if the TPM didn't report it */
+    guint32           context_gap_max;
+    /* commands a connection may have queued or executing, 0: no limit */
+    guint             pending_max;
+    /* bytes held for a connection and for all of them, 0: no limit */
+    gsize             connection_bytes_max;
+    gsize             bytes_max;
+    /* GetCapability command -> response for invariant capabilities */
+    GHashTable       *cap_cache;
+    /* persistent handle -> ReadPublic response */
+    GHashTable       *read_public_cache;
+    /* NV_ReadPublic and NV_Read command -> response */
+    GHashTable       *nv_cache;
+    /* NV index -> TPMA_NV from the last NV_ReadPublic response */
+    GHashTable       *nv_attrs;
+    /* TestParms, ECC_Parameters and GetTestResult command -> response */
+    GHashTable       *query_cache;
+    /* PCR_Read command -> response, NULL if disabled */
+    GHashTable       *pcr_cache;
+    /* CreatePrimary command -> saved primary, NULL if disabled */
+    GHashTable       *primary_cache;
+    /* CreatePrimary commands for the primary_cache not sent yet */
+    GQueue           *primary_templates;
+    /* commands that fill the caches, see resource_manager_warm_up */
+    GQueue           *warm_up;
+    /* where the cap_cache and query_cache are published, NULL if they aren't */
+    ResponsePage     *response_page;
+    guint             response_page_tpm;
+    /* parent and Load command -> saved object, NULL if disabled */
+    GHashTable       *load_cache;
+    /* random bytes for small GetRandom commands, NULL if disabled */
+    random_pool_t    *random_pool;
+    /* saved contexts of idle connections, NULL if disabled */
+    ContextStore     *context_store;
+    /* connections that sent a command since their contexts were spilled */
+    GHashTable       *spill_candidates;
+    /* temporaries of the command being processed, reset after each one */
+    arena_t           arena;
+    /*
+     * Set if commands may be passed through, to count the connections.
+     * 'passthrough' is the connection whose commands go to the TPM as
+     * they are, NULL while commands are virtualized.
+     */
+    ConnectionManager *passthrough_manager;
+    Connection       *passthrough;
+    /* attach a command_timing_t to each response, for the slow command log */
+    gboolean          time_commands;
+    /* headroom over the per connection limits, NULL if there's none */
+    QuotaPool        *quota_pool;
+    /* ms a context goes unused before it's evicted while idle, 0: never */
+    guint             evict_idle;
+    /* use_clock and monotonic time of the last idle eviction pass */
+    guint64           evict_mark;
+    gint64            evict_mark_time;
+    /* transient objects a connection may keep resident, see TABRMD_CC_RESIDENCY */
+    guint             pinned_max;
+    /*
+     * TCTI conf each connection opens its own Tcti with, NULL unless the
+     * kernel resource manager virtualizes, see resource_manager_set_kernel_rm.
+     */
+    gchar            *kernel_rm_conf;
 } ResourceManager;
 
+/* upper bound on the number of messages staged during a TPM command */
+#define RESOURCE_MANAGER_STAGED_MAX 4
+/*
+ * Upper bound on the number of messages looked at for commands identical
+ * to a read-only command that was just answered, see
+ * resource_manager_coalesce.
+ */
+#define RESOURCE_MANAGER_COALESCE_MAX 32
+/*
+ * The most messages the ResourceManager thread processes for a single
+ * wakeup before it goes back to the bookkeeping it does between batches.
+ */
+#define RESOURCE_MANAGER_DRAIN_MAX 32
+/*
+ * Saved sessions are regapped while idle once they fall behind the context
+ * counter by this fraction of TPM2_PT_CONTEXT_GAP_MAX.
+ */
+#define RESOURCE_MANAGER_REGAP_NUMERATOR   3
+#define RESOURCE_MANAGER_REGAP_DENOMINATOR 4
+/*
+ * Commands that get TPM2_RC_RETRY, TPM2_RC_YIELDED or TPM2_RC_TESTING are
+ * resent up to RESOURCE_MANAGER_RETRY_MAX times. The delay before each
+ * resend starts at RESOURCE_MANAGER_RETRY_DELAY_MIN microseconds and
+ * doubles up to RESOURCE_MANAGER_RETRY_DELAY_MAX.
+ */
+#define RESOURCE_MANAGER_RETRY_MAX       5
+#define RESOURCE_MANAGER_RETRY_DELAY_MIN 1000
+#define RESOURCE_MANAGER_RETRY_DELAY_MAX 64000
+/*
+ * Upper bound on the number of distinct GetCapability queries whose
+ * responses are kept in the cap_cache.
+ */
+#define RESOURCE_MANAGER_CAP_CACHE_MAX 64
+/*
+ * Upper bound on the number of persistent objects whose ReadPublic
+ * responses are kept in the read_public_cache.
+ */
+#define RESOURCE_MANAGER_READ_PUBLIC_CACHE_MAX 32
+/*
+ * Upper bound on the number of NV_ReadPublic and NV_Read responses kept
+ * in the nv_cache. An EK certificate takes a few NV_Read chunks.
+ */
+#define RESOURCE_MANAGER_NV_CACHE_MAX 64
+/*
+ * Upper bound on the number of TestParms, ECC_Parameters and
+ * GetTestResult responses kept in the query_cache.
+ */
+#define RESOURCE_MANAGER_QUERY_CACHE_MAX 32
+/*
+ * Upper bound on the number of distinct PCR selections whose PCR_Read
+ * responses are kept in the pcr_cache.
+ */
+#define RESOURCE_MANAGER_PCR_CACHE_MAX 32
+/*
+ * Upper bound on the number of distinct CreatePrimary commands whose
+ * primary objects are kept in the primary_cache.
+ */
+#define RESOURCE_MANAGER_PRIMARY_CACHE_MAX 8
+/*
+ * Upper bound on the number of distinct Load commands whose objects are
+ * kept in the load_cache.
+ */
+#define RESOURCE_MANAGER_LOAD_CACHE_MAX 32
+/*
+ * Seconds a connection must go without sending a command before the saved
+ * contexts of its objects and sessions are moved to the context_store.
+ */
+#define RESOURCE_MANAGER_SPILL_IDLE 10
+/*
+ * GVariant type of the state kept across a daemon restart by
+ * resource_manager_save_state: the TPM's resetCount and restartCount, the
+ * context_counter, the cached primaries (command, saved context and
+ * response) and the sessions (connection ID, handle, SessionEntryStateEnum,
+ * context and context_client).
+ */
+#define RESOURCE_MANAGER_STATE_TYPE "(uuta(ayayay)a(tuuayay))"
+
 #define TYPE_RESOURCE_MANAGER              (resource_manager_get_type ())
 #define RESOURCE_MANAGER(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_RESOURCE_MANAGER, ResourceManager))
 #define RESOURCE_MANAGER_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_RESOURCE_MANAGER, ResourceManagerClass))
@@ -42,8 +204,66 @@ typedef struct _ResourceManager {
 GType                 resource_manager_get_type       (void);
 ResourceManager*      resource_manager_new            (Tpm2 *tpm2,
                                                        SessionList  *session_list);
-void                  resource_manager_process_tpm2_command (ResourceManager   *resmgr,
+void                  resource_manager_set_admission  (ResourceManager *resmgr,
+                                                       guint            queue_depth,
+                                                       guint            pending_max);
+void                  resource_manager_set_memory_max (ResourceManager *resmgr,
+                                                       gsize            connection_bytes_max,
+                                                       gsize            bytes_max);
+void                  resource_manager_set_metrics    (ResourceManager *resmgr,
+                                                       Metrics         *metrics);
+void                  resource_manager_set_quota_pool (ResourceManager *resmgr,
+                                                       QuotaPool       *pool);
+gboolean              resource_manager_set_random_pool (ResourceManager *resmgr,
+                                                        size_t           size);
+void                  resource_manager_set_pcr_cache  (ResourceManager *resmgr,
+                                                       gboolean         enabled);
+void                  resource_manager_set_primary_cache (ResourceManager *resmgr,
+                                                          gboolean         enabled);
+void                  resource_manager_set_load_cache (ResourceManager *resmgr,
+                                                       gboolean         enabled);
+void                  resource_manager_add_primary_template (ResourceManager  *resmgr,
+                                                             TPMI_RH_HIERARCHY hierarchy,
+                                                             TPMI_ALG_PUBLIC   type);
+void                  resource_manager_warm_up        (ResourceManager   *resmgr,
+                                                       const TPM2_HANDLE *nv_indices,
+                                                       guint              nv_count);
+void                  resource_manager_warm_up_next   (ResourceManager   *resmgr);
+void                  resource_manager_set_response_page (ResourceManager *resmgr,
+                                                          ResponsePage    *page,
+                                                          guint            tpm);
+void                  resource_manager_set_context_store (ResourceManager *resmgr,
+                                                          ContextStore    *store);
+void                  resource_manager_set_passthrough (ResourceManager   *resmgr,
+                                                        ConnectionManager *manager);
+void                  resource_manager_set_kernel_rm  (ResourceManager *resmgr,
+                                                       const gchar     *conf);
+void                  resource_manager_set_time_commands (ResourceManager *resmgr,
+                                                          gboolean         enabled);
+void                  resource_manager_set_evict_idle (ResourceManager *resmgr,
+                                                       guint            window);
+void                  resource_manager_set_pinned_max (ResourceManager *resmgr,
+                                                       guint            count);
+Tpm2Response*         resource_manager_residency      (ResourceManager *resmgr,
+                                                       Tpm2Command     *command);
+Tpm2Response*         resource_manager_save_context_transient (ResourceManager *resmgr,
+                                                               Tpm2Command     *command);
+Tpm2Response*         resource_manager_nv_large       (ResourceManager *resmgr,
+                                                       Tpm2Command     *command);
+void                  resource_manager_evict_idle_request (ResourceManager *resmgr);
+guint                 resource_manager_evict_idle     (ResourceManager *resmgr);
+TSS2_RC               resource_manager_process_tpm2_command (ResourceManager   *resmgr,
                                                              Tpm2Command       *command);
+void                  resource_manager_process_batch (ResourceManager   *resmgr,
+                                                      Tpm2Command       *command);
+void                  resource_manager_tune           (ResourceManager *resmgr,
+                                                       Tunables        *tunables);
+TSS2_RC               resource_manager_lease          (ResourceManager *resmgr,
+                                                       Connection      *connection,
+                                                       guint            commands,
+                                                       gint64           timeout);
+void                  resource_manager_flushsave_contexts (ResourceManager     *resmgr,
+                                                           GSList              *entries);
 void                  resource_manager_flushsave_context (gpointer              entry,
                                                           gpointer              resmgr);
 TSS2_RC               resource_manager_load_handles    (ResourceManager *resmgr,
@@ -57,6 +277,27 @@ void                  resource_manager_enqueue           (Sink            *sink,
                                                           GObject         *obj);
 void                  resource_manager_remove_connection (ResourceManager *resource_manager,
                                                           Connection      *connection);
-TSS2_RC               get_cap_post_process (Tpm2Response *resp);
+gboolean              flush_session_callback             (SessionEntry    *entry,
+                                                          gpointer         data);
+guint                 resource_manager_evict_transients  (ResourceManager *resmgr,
+                                                          GSList          *keep);
+guint                 resource_manager_evict_sessions    (ResourceManager *resmgr,
+                                                          Tpm2Command     *command);
+gboolean              resource_manager_evict_lru_transient (ResourceManager *resmgr,
+                                                            GSList          *keep);
+gboolean              resource_manager_evict_lru_session (ResourceManager *resmgr,
+                                                          Tpm2Command     *command);
+gboolean              resource_manager_evict_for_rc      (ResourceManager *resmgr,
+                                                          TSS2_RC          rc,
+                                                          GSList          *keep,
+                                                          Tpm2Command     *command);
+TSS2_RC               resource_manager_cancel (ResourceManager *resmgr,
+                                               Connection      *connection);
+TSS2_RC               get_cap_post_process (ResourceManager *resmgr,
+                                            Tpm2Response    *resp);
+GVariant*             resource_manager_save_state (ResourceManager *resmgr);
+gboolean              resource_manager_restore_state (ResourceManager   *resmgr,
+                                                      GVariant          *state,
+                                                      ConnectionManager *manager);
 G_END_DECLS
 #endif /* RESOURCE_MANAGER_H */
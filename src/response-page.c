@@ -0,0 +1,274 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "response-page.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+G_DEFINE_TYPE (ResponsePage, response_page, G_TYPE_OBJECT);
+
+/*
+ * Empty every section before removing the page: a TCTI that mapped it
+ * keeps the mapping after the file is gone and must go back to asking
+ * the daemon.
+ */
+static void
+response_page_dispose (GObject *obj)
+{
+    ResponsePage *self = RESPONSE_PAGE (obj);
+    guint i;
+
+    if (self->page != NULL) {
+        for (i = 0; i < self->page->tpm_count; ++i) {
+            response_page_publish (self, i, NULL, 0);
+        }
+        munmap (self->page, sizeof (response_page_t));
+        self->page = NULL;
+        g_unlink (self->path);
+    }
+    g_clear_pointer (&self->path, g_free);
+    G_OBJECT_CLASS (response_page_parent_class)->dispose (obj);
+}
+static void
+response_page_init (ResponsePage *self)
+{
+    UNUSED_PARAM (self);
+}
+static void
+response_page_class_init (ResponsePageClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (response_page_parent_class == NULL)
+        response_page_parent_class = g_type_class_peek_parent (klass);
+    object_class->dispose = response_page_dispose;
+}
+/*
+ * Create an empty page at 'path' with a section for each of 'tpm_count'
+ * TPMs, replacing any file there. Unlike the stats page any user may read
+ * it: all it holds is what the TPM tells anyone who asks.
+ * Returns NULL if the page couldn't be created.
+ */
+ResponsePage*
+response_page_new (const gchar *path,
+                   guint        tpm_count,
+                   GError     **error)
+{
+    ResponsePage *page;
+    void *addr;
+    gint fd;
+
+    g_assert (path != NULL);
+    g_assert (tpm_count <= TABRMD_TPMS_MAX);
+    g_unlink (path);
+    fd = g_open (path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to create %s: %s", path, strerror (errno));
+        return NULL;
+    }
+    if (ftruncate (fd, sizeof (response_page_t)) == -1) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to size %s: %s", path, strerror (errno));
+        goto err_out;
+    }
+    addr = mmap (NULL, sizeof (response_page_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to map %s: %s", path, strerror (errno));
+        goto err_out;
+    }
+    close (fd);
+    page = RESPONSE_PAGE (g_object_new (TYPE_RESPONSE_PAGE, NULL));
+    page->page = (response_page_t*)addr;
+    page->path = g_strdup (path);
+    page->page->tpm_count = tpm_count;
+    page->page->version = RESPONSE_PAGE_VERSION;
+    /* readers check the magic last */
+    __atomic_store_n (&page->page->magic, RESPONSE_PAGE_MAGIC, __ATOMIC_RELEASE);
+    g_info ("publishing cached responses in %s", path);
+    return page;
+err_out:
+    close (fd);
+    g_unlink (path);
+    return NULL;
+}
+/*
+ * Replace the section for 'tpm' with the responses in 'caches', 'count'
+ * tables from GBytes of a command buffer to GBytes of the response to it.
+ * Responses that don't fit are left out: the daemon still answers them.
+ * Only the ResourceManager thread for 'tpm' may call this, TCTIs may be
+ * reading the section meanwhile.
+ */
+void
+response_page_publish (ResponsePage      *page,
+                       guint              tpm,
+                       GHashTable *const *caches,
+                       guint              count)
+{
+    response_page_tpm_t *section;
+    response_page_entry_t *entry;
+    GHashTableIter iter;
+    gpointer key, value;
+    gsize command_size, response_size;
+    guint i;
+
+    g_assert (page != NULL && page->page != NULL);
+    g_assert (tpm < page->page->tpm_count);
+    section = &page->page->tpms [tpm];
+    g_atomic_int_inc ((gint*)&section->seq);
+    section->entry_count = 0;
+    section->data_used = 0;
+    for (i = 0; i < count; ++i) {
+        g_hash_table_iter_init (&iter, caches [i]);
+        while (g_hash_table_iter_next (&iter, &key, &value) &&
+               section->entry_count < RESPONSE_PAGE_ENTRIES_MAX)
+        {
+            command_size = g_bytes_get_size (key);
+            response_size = g_bytes_get_size (value);
+            if (response_size < TPM_HEADER_SIZE ||
+                command_size + response_size >
+                RESPONSE_PAGE_DATA_SIZE - section->data_used)
+            {
+                continue;
+            }
+            entry = &section->entries [section->entry_count++];
+            entry->offset = section->data_used;
+            entry->command_size = (uint32_t)command_size;
+            entry->response_size = (uint32_t)response_size;
+            memcpy (&section->data [entry->offset],
+                    g_bytes_get_data (key, NULL),
+                    command_size);
+            memcpy (&section->data [entry->offset + command_size],
+                    g_bytes_get_data (value, NULL),
+                    response_size);
+            section->data_used += (uint32_t)(command_size + response_size);
+        }
+    }
+    g_atomic_int_inc ((gint*)&section->seq);
+}
+/*
+ * Map the page at 'path' read-only, for the TCTI. Release it with
+ * response_page_unmap.
+ */
+const response_page_t*
+response_page_map (const gchar *path,
+                   GError     **error)
+{
+    const response_page_t *page;
+    struct stat st;
+    void *addr;
+    gint fd;
+
+    fd = g_open (path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to open %s: %s", path, strerror (errno));
+        return NULL;
+    }
+    if (fstat (fd, &st) == -1 ||
+        st.st_size < (off_t)sizeof (response_page_t))
+    {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "%s isn't a tpm2-abrmd response page", path);
+        close (fd);
+        return NULL;
+    }
+    addr = mmap (NULL, sizeof (response_page_t), PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (addr == MAP_FAILED) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to map %s: %s", path, strerror (errno));
+        return NULL;
+    }
+    page = (const response_page_t*)addr;
+    if (__atomic_load_n (&page->magic, __ATOMIC_ACQUIRE) != RESPONSE_PAGE_MAGIC ||
+        page->version != RESPONSE_PAGE_VERSION)
+    {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "%s isn't a version %u tpm2-abrmd response page",
+                     path, RESPONSE_PAGE_VERSION);
+        response_page_unmap (page);
+        return NULL;
+    }
+    return page;
+}
+void
+response_page_unmap (const response_page_t *page)
+{
+    if (page != NULL) {
+        munmap ((void*)page, sizeof (response_page_t));
+    }
+}
+/*
+ * Look for 'command' in the section for 'tpm' and copy the response to it
+ * into 'response', a buffer of '*response_size' bytes. The section may be
+ * rewritten during the lookup: the entries are bounds checked before use
+ * and the result is only kept if 'seq' didn't change. This never waits for
+ * the writer, a caller that gets FALSE sends the command to the daemon.
+ * Returns TRUE and sets '*response_size' to the size of the response if
+ * the command was found.
+ */
+gboolean
+response_page_lookup (const response_page_t *page,
+                      guint                  tpm,
+                      const uint8_t         *command,
+                      size_t                 command_size,
+                      uint8_t               *response,
+                      size_t                *response_size)
+{
+    const response_page_tpm_t *section;
+    const response_page_entry_t *entry;
+    uint32_t seq, count, offset, size;
+    gboolean found;
+    guint i, retry;
+
+    if (page == NULL || tpm >= MIN (page->tpm_count, TABRMD_TPMS_MAX) ||
+        command_size == 0 || command_size > RESPONSE_PAGE_DATA_SIZE)
+    {
+        return FALSE;
+    }
+    section = &page->tpms [tpm];
+    for (retry = 0; retry < RESPONSE_PAGE_RETRIES; ++retry) {
+        seq = __atomic_load_n (&section->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        found = FALSE;
+        size = 0;
+        count = MIN (section->entry_count, RESPONSE_PAGE_ENTRIES_MAX);
+        for (i = 0; i < count; ++i) {
+            entry = &section->entries [i];
+            offset = entry->offset;
+            size = entry->response_size;
+            if (entry->command_size != command_size ||
+                offset > RESPONSE_PAGE_DATA_SIZE - command_size ||
+                size > RESPONSE_PAGE_DATA_SIZE - command_size - offset ||
+                size > *response_size ||
+                memcmp (&section->data [offset], command, command_size) != 0)
+            {
+                continue;
+            }
+            memcpy (response, &section->data [offset + command_size], size);
+            found = TRUE;
+            break;
+        }
+        /* the copy must be done before 'seq' is read again */
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        if (__atomic_load_n (&section->seq, __ATOMIC_RELAXED) == seq) {
+            if (found) {
+                *response_size = size;
+            }
+            return found;
+        }
+    }
+    return FALSE;
+}
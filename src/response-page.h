@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef RESPONSE_PAGE_H
+#define RESPONSE_PAGE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <stdint.h>
+
+#include "tabrmd-defaults.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Responses the ResourceManagers answer from their invariant caches,
+ * published in a file that the tabrmd TCTI maps read-only so that it can
+ * answer the same commands without a round trip to the daemon, see the
+ * 'response_page' TCTI conf key. Each TPM has a section of its own written
+ * only by the ResourceManager thread for that TPM. A section is guarded
+ * by a sequence count like the stats page: 'seq' is odd while the section
+ * is being written. Every write replaces the whole section with what the
+ * caches hold, so dropping a response from a cache drops it from the page
+ * too. Within a section each entry is a command buffer followed by the
+ * response to it in 'data'.
+ */
+#define RESPONSE_PAGE_MAGIC       0x50524d54 /* "TMRP" */
+#define RESPONSE_PAGE_VERSION     1
+#define RESPONSE_PAGE_ENTRIES_MAX 96
+#define RESPONSE_PAGE_DATA_SIZE   (64 * 1024)
+/* longest path the TCTI takes for the page */
+#define RESPONSE_PAGE_PATH_MAX    255
+/* attempts response_page_lookup makes to read a section consistently */
+#define RESPONSE_PAGE_RETRIES     16
+
+typedef struct {
+    /* offset in 'data' of the command, the response follows it */
+    uint32_t offset;
+    uint32_t command_size;
+    uint32_t response_size;
+    uint32_t reserved;
+} response_page_entry_t;
+
+typedef struct {
+    uint32_t seq;
+    uint32_t entry_count;
+    uint32_t data_used;
+    uint32_t reserved;
+    response_page_entry_t entries [RESPONSE_PAGE_ENTRIES_MAX];
+    uint8_t               data [RESPONSE_PAGE_DATA_SIZE];
+} response_page_tpm_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t tpm_count;
+    uint32_t reserved;
+    response_page_tpm_t tpms [TABRMD_TPMS_MAX];
+} response_page_t;
+
+typedef struct _ResponsePageClass {
+    GObjectClass      parent;
+} ResponsePageClass;
+
+typedef struct _ResponsePage {
+    GObject           parent_instance;
+    response_page_t  *page;
+    gchar            *path;
+} ResponsePage;
+
+#define TYPE_RESPONSE_PAGE              (response_page_get_type   ())
+#define RESPONSE_PAGE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_RESPONSE_PAGE, ResponsePage))
+#define RESPONSE_PAGE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_RESPONSE_PAGE, ResponsePageClass))
+#define IS_RESPONSE_PAGE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_RESPONSE_PAGE))
+#define IS_RESPONSE_PAGE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_RESPONSE_PAGE))
+#define RESPONSE_PAGE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_RESPONSE_PAGE, ResponsePageClass))
+
+GType                  response_page_get_type (void);
+ResponsePage*          response_page_new      (const gchar           *path,
+                                               guint                  tpm_count,
+                                               GError               **error);
+void                   response_page_publish  (ResponsePage          *page,
+                                               guint                  tpm,
+                                               GHashTable *const     *caches,
+                                               guint                  count);
+const response_page_t* response_page_map      (const gchar           *path,
+                                               GError               **error);
+void                   response_page_unmap    (const response_page_t *page);
+gboolean               response_page_lookup   (const response_page_t *page,
+                                               guint                  tpm,
+                                               const uint8_t         *command,
+                                               size_t                 command_size,
+                                               uint8_t               *response,
+                                               size_t                *response_size);
+
+G_END_DECLS
+#endif /* RESPONSE_PAGE_H */
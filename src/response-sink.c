@@ -7,15 +7,28 @@
 #include <glib.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <string.h>
 
 #include "connection.h"
+#include "flight-recorder.h"
+#include "logging.h"
 #include "sink-interface.h"
 #include "response-sink.h"
+#include "tabrmd-probes.h"
 #include "control-message.h"
 #include "tpm2-response.h"
+#include "tunables.h"
 #include "util.h"
 
-#define RESPONSE_SINK_TIMEOUT 1e6
+/*
+ * Responses that couldn't be written to a client without blocking. The
+ * head response has been written up to 'offset'.
+ */
+typedef struct {
+    Connection *connection;
+    GQueue     *responses;
+    guint32     offset;
+} response_sink_outbox_t;
 
 static void response_sink_sink_interface_init   (gpointer g_iface);
 
@@ -33,8 +46,102 @@ enum {
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+static void
+response_sink_outbox_free (gpointer data)
+{
+    response_sink_outbox_t *outbox = (response_sink_outbox_t*)data;
+
+    g_queue_free_full (outbox->responses, g_object_unref);
+    g_object_unref (outbox->connection);
+    g_free (outbox);
+}
+/*
+ * Write 'response' from the calling thread, see response_sink_set_direct.
+ * If the client's socket doesn't take all of it the rest is queued in the
+ * connection's outbox as usual and the thread is woken to poll for it.
+ */
+static void
+response_sink_write_direct (ResponseSink *sink,
+                            Tpm2Response *response)
+{
+    Connection *connection = tpm2_response_get_connection (response);
+    Connection *io = connection_get_io (connection);
+    gboolean queued;
+
+    g_mutex_lock (&sink->mutex);
+    queued = g_hash_table_contains (sink->outboxes, io);
+    response_sink_process_response (sink, response);
+    if (!queued && g_hash_table_contains (sink->outboxes, io)) {
+        message_queue_wakeup (sink->in_queue);
+    }
+    g_mutex_unlock (&sink->mutex);
+    g_object_unref (connection);
+}
+/*
+ * Return the ResponseSink that writes the responses for 'connection':
+ * 'sink' itself or one of its shards, see response_sink_set_shards. The
+ * channels of a connection share its shard since they share its socket.
+ */
+ResponseSink*
+response_sink_get_shard (ResponseSink *sink,
+                         Connection   *connection)
+{
+    guint64 index;
+
+    if (sink->shards == NULL) {
+        return sink;
+    }
+    index = connection_get_io (connection)->id % (sink->shards->len + 1);
+    return index == 0 ? sink : g_ptr_array_index (sink->shards, index - 1);
+}
+void response_sink_enqueue (Sink *self, GObject *obj);
+/*
+ * Hand 'obj' to the shard it's meant for: responses and CONNECTION_REMOVED
+ * go to the connection's shard, TUNE goes to every shard as well as to
+ * 'sink'. CHECK_CANCEL is for 'sink' alone, its thread stops the shards.
+ * Returns TRUE if 'obj' was handed to a shard and 'sink' has nothing more
+ * to do with it.
+ */
+static gboolean
+response_sink_route (ResponseSink *sink,
+                     GObject      *obj)
+{
+    Connection *connection = NULL;
+    ResponseSink *shard;
+    guint i;
+
+    if (IS_TPM2_RESPONSE (obj)) {
+        connection = tpm2_response_get_connection (TPM2_RESPONSE (obj));
+    } else if (IS_CONTROL_MESSAGE (obj)) {
+        switch (control_message_get_code (CONTROL_MESSAGE (obj))) {
+        case CONNECTION_REMOVED:
+            connection = CONNECTION (
+                g_object_ref (control_message_get_object (CONTROL_MESSAGE (obj))));
+            break;
+        case TUNE:
+            for (i = 0; i < sink->shards->len; ++i) {
+                response_sink_enqueue (SINK (g_ptr_array_index (sink->shards, i)),
+                                       obj);
+            }
+            return FALSE;
+        default:
+            return FALSE;
+        }
+    }
+    if (connection == NULL) {
+        return FALSE;
+    }
+    shard = response_sink_get_shard (sink, connection);
+    g_object_unref (connection);
+    if (shard == sink) {
+        return FALSE;
+    }
+    response_sink_enqueue (SINK (shard), obj);
+    return TRUE;
+}
 /**
- * enqueue function to implement Sink interface.
+ * enqueue function to implement Sink interface. The in_queue wakes the
+ * thread from g_poll, see message_queue_get_wakeup_fd.
  */
 void
 response_sink_enqueue (Sink            *self,
@@ -47,6 +154,13 @@ response_sink_enqueue (Sink            *self,
         g_error ("  passed NULL sink");
     if (obj == NULL)
         g_error ("  passed NULL object");
+    if (sink->shards != NULL && response_sink_route (sink, obj)) {
+        return;
+    }
+    if (sink->direct && IS_TPM2_RESPONSE (obj)) {
+        response_sink_write_direct (sink, TPM2_RESPONSE (obj));
+        return;
+    }
     message_queue_enqueue (sink->in_queue, obj);
 }
 /**
@@ -105,14 +219,32 @@ response_sink_dispose (GObject *obj)
     if (thread->thread_id != 0)
         g_error ("%s: thread running, cancel first", __func__);
     g_clear_object (&sink->in_queue);
+    g_clear_pointer (&sink->outboxes, g_hash_table_unref);
+    g_clear_object (&sink->trace);
+    g_clear_object (&sink->spans);
+    g_clear_object (&sink->metrics);
+    g_clear_pointer (&sink->shards, g_ptr_array_unref);
     G_OBJECT_CLASS (response_sink_parent_class)->dispose (obj);
 }
+static void
+response_sink_finalize (GObject *obj)
+{
+    ResponseSink *sink = RESPONSE_SINK (obj);
+
+    g_free (sink->frame);
+    g_mutex_clear (&sink->mutex);
+    G_OBJECT_CLASS (response_sink_parent_class)->finalize (obj);
+}
 void* response_sink_thread (void *data);
 static void
-response_sink_init (ResponseSink *response)
+response_sink_init (ResponseSink *sink)
 {
-    UNUSED_PARAM(response);
-    /* noop */
+    sink->outboxes = g_hash_table_new_full (g_direct_hash,
+                                            g_direct_equal,
+                                            NULL,
+                                            response_sink_outbox_free);
+    sink->max_pending = RESPONSE_SINK_MAX_PENDING;
+    g_mutex_init (&sink->mutex);
 }
 static void
 response_sink_unblock (Thread *self)
@@ -123,7 +255,7 @@ response_sink_unblock (Thread *self)
     if (sink == NULL)
         g_error ("%s: passed NULL sink", __func__);
     msg = control_message_new (CHECK_CANCEL);
-    message_queue_enqueue (sink->in_queue, G_OBJECT (msg));
+    response_sink_enqueue (SINK (sink), G_OBJECT (msg));
     g_object_unref (msg);
 }
 /**
@@ -141,6 +273,7 @@ response_sink_class_init (ResponseSinkClass *klass)
     if (response_sink_parent_class == NULL)
         response_sink_parent_class = g_type_class_peek_parent (klass);
     object_class->dispose = response_sink_dispose;
+    object_class->finalize = response_sink_finalize;
     object_class->get_property = response_sink_get_property;
     object_class->set_property = response_sink_set_property;
     thread_class->thread_run     = response_sink_thread;
@@ -176,31 +309,391 @@ response_sink_new ()
                                            NULL));
 }
 
+/*
+ * Drop the pending output for a client that isn't reading its responses
+ * and shut down its socket. The CommandSource sees EOF and removes the
+ * connection as though the client had closed it.
+ */
+static void
+response_sink_disconnect (ResponseSink *sink,
+                          Connection   *connection)
+{
+    GIOStream *iostream = connection_get_iostream (connection);
+    GSocket *socket;
+    GError *error = NULL;
+
+    g_hash_table_remove (sink->outboxes, connection_get_io (connection));
+    if (!G_IS_SOCKET_CONNECTION (iostream)) {
+        return;
+    }
+    socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (iostream));
+    if (!g_socket_shutdown (socket, TRUE, TRUE, &error)) {
+        g_warning ("%s: failed to shut down socket: %s",
+                   __func__, error->message);
+        g_error_free (error);
+    }
+}
+/*
+ * Return the number of bytes written to the client for a response: the
+ * response and, for a connection using the tagged transport, the request
+ * tag ahead of it.
+ */
+static guint32
+response_sink_frame_size (Connection   *connection,
+                          Tpm2Response *response)
+{
+    guint32 size = tpm2_response_get_size (response);
+
+    if (connection_get_tagged (connection)) {
+        size += TABRMD_REQUEST_TAG_SIZE;
+    }
+    return size;
+}
+/*
+ * Write what's left of a response from 'offset' on without blocking.
+ * 'offset' counts the request tag for a connection using the tagged
+ * transport. The tag and response are assembled in the scratch buffer so
+ * that they go out in a single write.
+ * Returns the number of bytes written or -1 on error.
+ */
+static ssize_t
+response_sink_write (ResponseSink  *sink,
+                     GOutputStream *ostream,
+                     Connection    *connection,
+                     Tpm2Response  *response,
+                     guint32        offset)
+{
+    guint32 size = tpm2_response_get_size (response);
+    guint8 *buffer = tpm2_response_get_buffer (response);
+    guint32 frame_size = response_sink_frame_size (connection, response);
+
+    if (!connection_get_tagged (connection)) {
+        return write_nonblocking (ostream, &buffer [offset], size - offset);
+    }
+    if (sink->frame_size < frame_size) {
+        sink->frame = g_realloc (sink->frame, frame_size);
+        sink->frame_size = frame_size;
+    }
+    *(guint32*)sink->frame = htobe32 (tpm2_response_get_request_tag (response));
+    memcpy (&sink->frame [TABRMD_REQUEST_TAG_SIZE], buffer, size);
+    return write_nonblocking (ostream,
+                              &sink->frame [offset],
+                              frame_size - offset);
+}
+/*
+ * Log the command answered by 'response' if it took 'slow_usec' or more
+ * from being read to its response being written, with where the time
+ * went. 'other' is the time the ResourceManager spent on the command
+ * outside of the phases it times. A response that doesn't go out in one
+ * write is logged when it's queued.
+ */
+static void
+response_sink_log_slow (ResponseSink *sink,
+                        Connection   *connection,
+                        Tpm2Response *response)
+{
+    const command_timing_t *timing = tpm2_response_get_timing (response);
+    gint64 now, total, other;
+
+    if (sink->slow_usec == 0 || timing->received == 0) {
+        return;
+    }
+    now = g_get_monotonic_time ();
+    total = now - timing->received;
+    if (total < sink->slow_usec) {
+        return;
+    }
+    other = timing->answered - timing->received - timing->queue_usec -
+        timing->load_usec - timing->save_usec - timing->tpm_usec;
+    g_warning ("slow command: connection 0x%" PRIx64 " pid %" PRIu32
+               " command 0x%08" PRIx32 " took %" PRId64 " us: queue %"
+               PRId64 ", loads %" PRId64 ", tpm %" PRId64 ", saves %"
+               PRId64 ", other %" PRId64 ", response write %" PRId64,
+               connection->id,
+               connection_get_pid (connection),
+               (guint32)(tpm2_response_get_attributes (response) &
+                         TPMA_CC_COMMANDINDEX_MASK),
+               total,
+               timing->queue_usec,
+               timing->load_usec,
+               timing->tpm_usec,
+               timing->save_usec,
+               MAX (other, 0),
+               now - timing->answered);
+}
+/*
+ * Write a response to the client without blocking. If the client's socket
+ * can't take all of it, the rest is queued in the connection's outbox and
+ * written by response_sink_flush_connection once the socket is writable.
+ * Responses for a connection with queued output go to the tail of the
+ * outbox so they're delivered in order. A client that lets more than
+ * 'max_pending' responses pile up is disconnected.
+ * For a connection using the shared memory transport the response is
+ * copied to the response slot and only the doorbell is written. A client
+ * has one command outstanding so the doorbell can't be left pending.
+ * For a connection using the tagged transport the request tag is written
+ * ahead of the response.
+ * The responses for the channels of a connection share its outbox so
+ * they don't interleave on the socket.
+ * Returns the number of bytes written immediately or -1 on error.
+ */
 ssize_t
-response_sink_process_response (Tpm2Response *response)
+response_sink_process_response (ResponseSink *sink,
+                                Tpm2Response *response)
 {
     ssize_t      written = 0;
     guint32      size    = tpm2_response_get_size (response);
     guint8      *buffer  = tpm2_response_get_buffer (response);
     Connection  *connection = tpm2_response_get_connection (response);
+    Connection  *io = connection_get_io (connection);
     GIOStream   *iostream = connection_get_iostream (connection);
     GOutputStream *ostream = g_io_stream_get_output_stream (iostream);
+    shm_transport_t *shm = connection_get_shm (connection);
+    const guint8 doorbell = SHM_TRANSPORT_DOORBELL;
+    response_sink_outbox_t *outbox;
+    metrics_span_t span;
 
-    g_debug ("%s: writing 0x%x bytes", __func__, size);
-    g_debug_bytes (buffer, size, 16, 4);
-    written = write_all (ostream, buffer, size);
+    metrics_span_begin (&span);
+    /* the response is out of the pipeline even if the write fails */
+    connection_answered (connection);
+    tabrmd_debug ("%s: writing 0x%x bytes", __func__, size);
+    tabrmd_debug_bytes (buffer, size, 16, 4);
+    TABRMD_PROBE3 (response_write,
+                   connection->id,
+                   tpm2_response_get_attributes (response) & TPMA_CC_COMMANDINDEX_MASK,
+                   size);
+    flight_recorder_record (FLIGHT_EVENT_WRITE,
+                            connection->id,
+                            tpm2_response_get_attributes (response) & TPMA_CC_COMMANDINDEX_MASK,
+                            tpm2_response_get_code (response));
+    trace_record (sink->trace, TRACE_RESPONSE, connection->id, buffer, size);
+    if (shm != NULL) {
+        if (shm_transport_put_response (shm, buffer, size) &&
+            write_nonblocking (ostream, &doorbell, 1) == 1)
+        {
+            written = size;
+        } else {
+            g_warning ("%s: failed to deliver response to connection 0x%"
+                       PRIx64 ", disconnecting", __func__, connection->id);
+            response_sink_disconnect (sink, connection);
+            written = -1;
+        }
+        goto out;
+    }
+    outbox = g_hash_table_lookup (sink->outboxes, io);
+    if (outbox == NULL) {
+        written = response_sink_write (sink, ostream, connection, response, 0);
+        if (written < 0 ||
+            (guint32)written == response_sink_frame_size (connection, response))
+        {
+            goto out;
+        }
+        outbox = g_new0 (response_sink_outbox_t, 1);
+        outbox->connection = g_object_ref (io);
+        outbox->responses = g_queue_new ();
+        outbox->offset = (guint32)written;
+        g_hash_table_insert (sink->outboxes, io, outbox);
+    }
+    g_debug ("%s: queueing response for connection 0x%" PRIx64,
+             __func__, connection->id);
+    g_queue_push_tail (outbox->responses, g_object_ref (response));
+    if (g_queue_get_length (outbox->responses) > sink->max_pending) {
+        g_warning ("%s: connection 0x%" PRIx64 " has more than %u responses "
+                   "pending, disconnecting", __func__, connection->id,
+                   sink->max_pending);
+        response_sink_disconnect (sink, connection);
+    }
+out:
+    response_sink_log_slow (sink, connection, response);
+    span_exporter_put (sink->spans,
+                       connection->id,
+                       tpm2_response_get_attributes (response) &
+                       TPMA_CC_COMMANDINDEX_MASK,
+                       tpm2_response_get_code (response),
+                       tpm2_response_get_timing (response),
+                       g_get_monotonic_time ());
     g_object_unref (connection);
+    metrics_span_end (sink->metrics, METRICS_STAGE_WRITE, &span);
 
     return written;
 }
+/*
+ * Write as much of a connection's queued output as its socket accepts.
+ * The outbox is freed once it's empty or if writing fails.
+ * Returns FALSE if writing failed and the queued output was dropped.
+ */
+gboolean
+response_sink_flush_connection (ResponseSink *sink,
+                                Connection   *connection)
+{
+    response_sink_outbox_t *outbox;
+    GOutputStream *ostream;
+    Tpm2Response *response;
+    ssize_t written;
+    guint32 size;
+
+    gboolean ret = TRUE;
+    metrics_span_t span;
+
+    connection = connection_get_io (connection);
+    outbox = g_hash_table_lookup (sink->outboxes, connection);
+    if (outbox == NULL) {
+        return TRUE;
+    }
+    metrics_span_begin (&span);
+    ostream = g_io_stream_get_output_stream (connection_get_iostream (connection));
+    while ((response = g_queue_peek_head (outbox->responses)) != NULL) {
+        size = response_sink_frame_size (connection, response);
+        written = response_sink_write (sink,
+                                       ostream,
+                                       connection,
+                                       response,
+                                       outbox->offset);
+        if (written < 0) {
+            g_hash_table_remove (sink->outboxes, connection);
+            ret = FALSE;
+            goto out;
+        }
+        outbox->offset += (guint32)written;
+        if (outbox->offset < size) {
+            goto out;
+        }
+        g_object_unref (g_queue_pop_head (outbox->responses));
+        outbox->offset = 0;
+    }
+    g_hash_table_remove (sink->outboxes, connection);
+out:
+    metrics_span_end (sink->metrics, METRICS_STAGE_WRITE, &span);
+    return ret;
+}
+/*
+ * With 'direct' set the thread that enqueues a response writes it to the
+ * client itself instead of handing it to the ResponseSink thread, which
+ * saves a thread hop and a wakeup per command. Responses a client's
+ * socket doesn't take at once still go to the connection's outbox and
+ * are written by the ResponseSink thread. While a connection has queued
+ * output, new responses go behind it so they're delivered in order. This
+ * must be set before the ResponseSink is shared with other threads.
+ */
+void
+response_sink_set_direct (ResponseSink *sink,
+                          gboolean      direct)
+{
+    g_assert (sink != NULL);
+    sink->direct = direct;
+}
+/*
+ * Log commands whose response was written 'usec' or more after the
+ * command was read, 0 to log none. The ResourceManager must time its
+ * commands for them to be logged, see resource_manager_set_time_commands.
+ * This must be set before the ResponseSink is shared with other threads.
+ */
+void
+response_sink_set_slow_threshold (ResponseSink *sink,
+                                  gint64        usec)
+{
+    g_assert (sink != NULL);
+    sink->slow_usec = MAX (usec, 0);
+}
+/*
+ * Record each response written to a client in 'trace'. This must be set
+ * before the ResponseSink is shared with other threads.
+ */
+void
+response_sink_set_trace (ResponseSink *sink,
+                         Trace        *trace)
+{
+    g_assert (sink != NULL);
+    g_clear_object (&sink->trace);
+    if (trace != NULL) {
+        sink->trace = g_object_ref (trace);
+    }
+}
+/*
+ * Hand the spans of the commands of traced clients to 'spans' as their
+ * responses are written. The ResourceManager must time its commands, see
+ * resource_manager_set_time_commands. This must be set before the
+ * ResponseSink is shared with other threads.
+ */
+void
+response_sink_set_spans (ResponseSink *sink,
+                         SpanExporter *spans)
+{
+    g_assert (sink != NULL);
+    g_clear_object (&sink->spans);
+    if (spans != NULL) {
+        sink->spans = g_object_ref (spans);
+    }
+}
+/*
+ * Account the time spent writing responses to 'metrics'. This must be set
+ * before the ResponseSink is shared with other threads.
+ */
+void
+response_sink_set_metrics (ResponseSink *sink,
+                           Metrics      *metrics)
+{
+    g_assert (sink != NULL);
+    g_clear_object (&sink->metrics);
+    if (metrics != NULL) {
+        sink->metrics = g_object_ref (metrics);
+    }
+}
+/*
+ * Spread the writing of responses over 'count' threads: 'sink' and
+ * 'count' - 1 shards it creates with the same settings. Connections are
+ * assigned to a shard by their id so each connection's responses are
+ * still written in order, by one thread. The shards' threads are started
+ * and stopped along with the thread of 'sink', with its scheduling
+ * settings. This must be called after the other setters and before the
+ * ResponseSink is shared with other threads.
+ */
+void
+response_sink_set_shards (ResponseSink *sink,
+                          guint         count)
+{
+    ResponseSink *shard;
+    guint i;
+
+    g_assert (sink != NULL);
+    g_assert (sink->shards == NULL);
+    if (count <= 1) {
+        return;
+    }
+    sink->shards = g_ptr_array_new_with_free_func (g_object_unref);
+    for (i = 1; i < count; ++i) {
+        shard = response_sink_new ();
+        message_queue_set_spin (shard->in_queue, sink->in_queue->spin_usec);
+        shard->max_pending = sink->max_pending;
+        response_sink_set_direct (shard, sink->direct);
+        shard->slow_usec = sink->slow_usec;
+        response_sink_set_trace (shard, sink->trace);
+        response_sink_set_spans (shard, sink->spans);
+        response_sink_set_metrics (shard, sink->metrics);
+        g_ptr_array_add (sink->shards, shard);
+    }
+}
+/*
+ * Return the number of responses queued for a connection. This isn't
+ * synchronized with the ResponseSink thread.
+ */
+guint
+response_sink_get_pending (ResponseSink *sink,
+                           Connection   *connection)
+{
+    response_sink_outbox_t *outbox;
+
+    outbox = g_hash_table_lookup (sink->outboxes, connection_get_io (connection));
+    return outbox == NULL ? 0 : g_queue_get_length (outbox->responses);
+}
 
 gboolean
 response_sink_process_control (ResponseSink *sink,
                                ControlMessage *msg)
 {
     ControlCode code = control_message_get_code (msg);
+    guint spin;
 
-    UNUSED_PARAM (sink);
     g_debug ("%s", __func__);
     switch (code) {
     case CHECK_CANCEL:
@@ -208,8 +701,19 @@ response_sink_process_control (ResponseSink *sink,
                  __func__);
         return FALSE;
     case CONNECTION_REMOVED:
-        g_debug ("%s: Received CONNECTION_REMOVED message, nothing to do.",
-                 __func__);
+        g_debug ("%s: Received CONNECTION_REMOVED message, dropping pending "
+                 "output.", __func__);
+        /* a channel has no outbox, its responses queue in its connection's */
+        g_hash_table_remove (sink->outboxes, control_message_get_object (msg));
+        return TRUE;
+    case TUNE:
+        /* this thread is the consumer of the queue */
+        if (tunables_get (TUNABLES (control_message_get_object (msg)),
+                          TUNABLE_QUEUE_SPIN,
+                          &spin))
+        {
+            message_queue_set_spin (sink->in_queue, spin);
+        }
         return TRUE;
     default:
         g_warning ("%s: Unknown control code: %d ... ignoring",
@@ -217,28 +721,120 @@ response_sink_process_control (ResponseSink *sink,
         return TRUE;
     }
 }
+/*
+ * Process everything in the input queue without blocking. The messages
+ * are taken in one batch: messages after a CHECK_CANCEL are dropped.
+ * Returns FALSE once a CHECK_CANCEL message has been processed.
+ */
+static gboolean
+response_sink_process_queue (ResponseSink *sink)
+{
+    GList *messages, *link;
+    GObject *obj;
+    gboolean ret = TRUE;
+
+    message_queue_clear_wakeup (sink->in_queue);
+    messages = message_queue_try_dequeue_all (sink->in_queue);
+    for (link = messages; ret && link != NULL; link = link->next) {
+        obj = G_OBJECT (link->data);
+        if (IS_TPM2_RESPONSE (obj)) {
+            response_sink_process_response (sink, TPM2_RESPONSE (obj));
+        } else if (IS_CONTROL_MESSAGE (obj)) {
+            ret = response_sink_process_control (sink, CONTROL_MESSAGE (obj));
+        }
+    }
+    g_list_free_full (messages, g_object_unref);
+    return ret;
+}
+/*
+ * Build the set of fds for g_poll: the in_queue wakeup fd followed by one entry
+ * per connection with pending output. 'connections' holds a reference to
+ * the connection for each entry after the first.
+ */
+static void
+response_sink_prepare_poll (ResponseSink *sink,
+                            GArray       *fds,
+                            GPtrArray    *connections)
+{
+    GHashTableIter iter;
+    gpointer key;
+    GPollFD pollfd = {
+        .fd = message_queue_get_wakeup_fd (sink->in_queue),
+        .events = G_IO_IN,
+    };
 
+    g_array_set_size (fds, 0);
+    g_ptr_array_set_size (connections, 0);
+    g_array_append_val (fds, pollfd);
+    g_hash_table_iter_init (&iter, sink->outboxes);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        pollfd.fd = connection_get_fd (CONNECTION (key));
+        if (pollfd.fd < 0) {
+            continue;
+        }
+        pollfd.events = G_IO_OUT;
+        g_array_append_val (fds, pollfd);
+        g_ptr_array_add (connections, g_object_ref (key));
+    }
+}
+/*
+ * The thread starts the shards' threads, then blocks in g_poll until a
+ * message is enqueued or a client with pending output can accept more of
+ * it, after spinning on the in_queue if message_queue_set_spin was called.
+ * Writes never block so one client that stops reading can't delay
+ * responses to the others. The mutex is held except in g_poll so that
+ * direct writes from other threads see a consistent set of outboxes. The
+ * shards are stopped once a CHECK_CANCEL message is processed.
+ */
 void*
 response_sink_thread (void *data)
 {
     ResponseSink *sink = RESPONSE_SINK (data);
-    GObject *obj;
+    GArray *fds = g_array_new (FALSE, TRUE, sizeof (GPollFD));
+    GPtrArray *connections = g_ptr_array_new_with_free_func (g_object_unref);
+    GPollFD *pollfd;
     gboolean done = FALSE;
+    Thread *shard;
+    guint i;
 
+    for (i = 0; sink->shards != NULL && i < sink->shards->len; ++i) {
+        shard = THREAD (g_ptr_array_index (sink->shards, i));
+        thread_set_sched (shard, &THREAD (sink)->sched);
+        if (thread_start (shard) != 0) {
+            g_error ("%s: failed to start shard %u", __func__, i + 1);
+        }
+    }
     while (!done) {
-        g_debug ("%s: blocking on input queue", __func__);
-        obj = message_queue_dequeue (sink->in_queue);
-        if (IS_TPM2_RESPONSE (obj)) {
-            response_sink_process_response (TPM2_RESPONSE (obj));
-        } else if (IS_CONTROL_MESSAGE (obj)) {
-            gboolean ret =
-                response_sink_process_control (sink, CONTROL_MESSAGE (obj));
-            if (ret == FALSE) {
-                done = TRUE;
+        g_mutex_lock (&sink->mutex);
+        response_sink_prepare_poll (sink, fds, connections);
+        g_mutex_unlock (&sink->mutex);
+        g_debug ("%s: polling %u fds", __func__, fds->len);
+        /* with a message waiting the outboxes are flushed on the next pass */
+        if (!message_queue_spin (sink->in_queue) &&
+            g_poll ((GPollFD*)fds->data, fds->len, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
             }
+            g_error ("%s: poll failed: %s", __func__, strerror (errno));
         }
-        g_object_unref (obj);
+        g_mutex_lock (&sink->mutex);
+        done = !response_sink_process_queue (sink);
+        for (i = 0; !done && i < connections->len; ++i) {
+            pollfd = &g_array_index (fds, GPollFD, i + 1);
+            if (pollfd->revents != 0) {
+                response_sink_flush_connection (sink,
+                                                g_ptr_array_index (connections, i));
+            }
+        }
+        g_mutex_unlock (&sink->mutex);
+    }
+    for (i = 0; sink->shards != NULL && i < sink->shards->len; ++i) {
+        shard = THREAD (g_ptr_array_index (sink->shards, i));
+        thread_cancel (shard);
+        thread_join (shard);
     }
+    g_ptr_array_unref (connections);
+    g_array_unref (fds);
 
     return NULL;
 }
@@ -10,8 +10,14 @@
 #include <glib-object.h>
 #include <pthread.h>
 
+#include "connection.h"
+#include "control-message.h"
 #include "message-queue.h"
+#include "metrics.h"
 #include "thread.h"
+#include "tpm2-response.h"
+#include "span-exporter.h"
+#include "trace.h"
 
 G_BEGIN_DECLS
 
@@ -27,8 +33,34 @@ typedef struct _ResponseSinkClass {
 typedef struct _ResponseSink {
     Thread             parent_instance;
     MessageQueue      *in_queue;
+    GHashTable        *outboxes;
+    guint              max_pending;
+    /*
+     * Write responses from the thread that enqueues them, see
+     * response_sink_set_direct. 'mutex' protects 'outboxes' and 'frame'.
+     */
+    gboolean           direct;
+    GMutex             mutex;
+    /* scratch buffer for the request tag and response of a tagged write */
+    guint8            *frame;
+    size_t             frame_size;
+    /* log commands that took at least this many usec, 0 to log none */
+    gint64             slow_usec;
+    /* records the responses written to clients, NULL unless --trace */
+    Trace             *trace;
+    /* spans of the commands of traced clients, NULL unless --span-file */
+    SpanExporter      *spans;
+    /* accounts the time spent writing responses, may be NULL */
+    Metrics           *metrics;
+    /* ResponseSinks sharing the writes, see response_sink_set_shards */
+    GPtrArray         *shards;
 } ResponseSink;
 
+/* responses a client may leave unread before it's disconnected */
+#define RESPONSE_SINK_MAX_PENDING 16
+/* most threads writing responses for one TPM */
+#define RESPONSE_SINK_SHARDS_MAX 16
+
 #define TYPE_RESPONSE_SINK              (response_sink_get_type ())
 #define RESPONSE_SINK(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_RESPONSE_SINK, ResponseSink))
 #define RESPONSE_SINK_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_RESPONSE_SINK, ResponseSinkClass))
@@ -38,6 +70,28 @@ typedef struct _ResponseSink {
 
 GType               response_sink_get_type    (void);
 ResponseSink*       response_sink_new         (void);
+ssize_t             response_sink_process_response (ResponseSink *sink,
+                                                    Tpm2Response *response);
+gboolean            response_sink_process_control  (ResponseSink   *sink,
+                                                    ControlMessage *msg);
+gboolean            response_sink_flush_connection (ResponseSink *sink,
+                                                    Connection   *connection);
+guint               response_sink_get_pending      (ResponseSink *sink,
+                                                    Connection   *connection);
+void                response_sink_set_direct       (ResponseSink *sink,
+                                                    gboolean      direct);
+void                response_sink_set_slow_threshold (ResponseSink *sink,
+                                                      gint64        usec);
+void                response_sink_set_trace        (ResponseSink *sink,
+                                                    Trace        *trace);
+void                response_sink_set_spans        (ResponseSink *sink,
+                                                    SpanExporter *spans);
+void                response_sink_set_metrics      (ResponseSink *sink,
+                                                    Metrics      *metrics);
+void                response_sink_set_shards       (ResponseSink *sink,
+                                                    guint         count);
+ResponseSink*       response_sink_get_shard        (ResponseSink *sink,
+                                                    Connection   *connection);
 
 G_END_DECLS
 #endif /* RESPONSE_SINK_H */
@@ -9,7 +9,9 @@
 
 #include <tss2/tss2_mu.h>
 
+#include "alloc-stats.h"
 #include "tpm2-header.h"
+#include "mem-account.h"
 #include "util.h"
 #include "session-entry.h"
 
@@ -24,6 +26,53 @@ enum {
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * Bring the bytes counted for the entry in line with its context blobs,
+ * 'context_client' only counts while it isn't shared with 'context'. This
+ * is called whenever either blob changes.
+ */
+static void
+session_entry_account (SessionEntry *entry)
+{
+    gsize bytes = 0;
+
+    if (entry->context != NULL) {
+        bytes += g_bytes_get_size (entry->context);
+    }
+    if (entry->context_client != NULL &&
+        entry->context_client != entry->context)
+    {
+        bytes += g_bytes_get_size (entry->context_client);
+    }
+    mem_account_add (MEM_ACCOUNT_CONTEXTS,
+                     (gssize)bytes - (gssize)entry->context_bytes);
+    entry->context_bytes = bytes;
+}
+/*
+ * Read a spilled context back from its store.
+ */
+static void
+session_entry_fault (SessionEntry *entry)
+{
+    if (entry->store == NULL) {
+        return;
+    }
+    entry->context = context_store_take (entry->store, &entry->spilled);
+    g_clear_object (&entry->store);
+    session_entry_account (entry);
+}
+/*
+ * Forget a spilled context that's been replaced or isn't needed anymore.
+ */
+static void
+session_entry_drop_spilled (SessionEntry *entry)
+{
+    if (entry->store == NULL) {
+        return;
+    }
+    context_store_drop (entry->store, &entry->spilled);
+    g_clear_object (&entry->store);
+}
 /*
  * GObject property getter.
  */
@@ -40,7 +89,8 @@ session_entry_get_property (GObject        *object,
         g_value_set_pointer (value, self->connection);
         break;
     case PROP_CONTEXT:
-        g_value_set_pointer (value, &self->context);
+        session_entry_fault (self);
+        g_value_set_boxed (value, self->context);
         break;
     case PROP_HANDLE:
         g_value_set_uint (value, session_entry_get_handle (self));
@@ -88,11 +138,10 @@ static void
 session_entry_init (SessionEntry *entry)
 {
     UNUSED_PARAM(entry);
-    /* noop */
+    ALLOC_STATS_ADD (ALLOC_STATS_SESSION_ENTRIES, sizeof (*entry));
 }
 /*
- * Deallocate all associated resources. All are static so we just chain
- * up to the parent like a good GObject.
+ * Deallocate all associated resources.
  */
 static void
 session_entry_dispose (GObject *object)
@@ -101,6 +150,10 @@ session_entry_dispose (GObject *object)
 
     g_debug ("%s", __func__);
     g_clear_object (&entry->connection);
+    g_clear_pointer (&entry->context, g_bytes_unref);
+    g_clear_pointer (&entry->context_client, g_bytes_unref);
+    session_entry_account (entry);
+    session_entry_drop_spilled (entry);
     G_OBJECT_CLASS (session_entry_parent_class)->dispose (object);
 }
 /*
@@ -123,10 +176,11 @@ session_entry_class_init (SessionEntryClass *klass)
                               "Associated Connection.",
                               G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
     obj_properties [PROP_CONTEXT] =
-        g_param_spec_pointer ("context",
-                              "TPMS_CONTEXT",
-                              "Context blob from TPM.",
-                              G_PARAM_READABLE);
+        g_param_spec_boxed ("context",
+                            "TPMS_CONTEXT",
+                            "Context blob from TPM.",
+                            G_TYPE_BYTES,
+                            G_PARAM_READABLE);
     obj_properties [PROP_HANDLE] =
         g_param_spec_uint ("handle",
                            "TPM2_HANDLE",
@@ -160,21 +214,22 @@ session_entry_new (Connection *connection,
                                         NULL));
 }
 /*
- * Access the 'context' member.
- * NOTE: This directly exposes memory from an object instance. The caller
- * must be sure to hold a reference to this object to keep it from being
- * garbage collected while the caller is accessing the context structure.
+ * Access the 'context' member. This is NULL until the context has been
+ * set. No reference is taken: the caller must hold a reference to the
+ * SessionEntry and not set its context while using the returned GBytes.
+ * A spilled context is read back first.
  * Further this object provides no thread safety ... yet.
  */
-size_buf_t*
+GBytes*
 session_entry_get_context (SessionEntry *entry)
 {
-    return &entry->context;
+    session_entry_fault (entry);
+    return entry->context;
 }
-size_buf_t*
+GBytes*
 session_entry_get_context_client (SessionEntry *entry)
 {
-    return &entry->context_client;
+    return entry->context_client;
 }
 /*
  * Access the Connection associated with this SessionEntry. The reference
@@ -218,29 +273,101 @@ session_entry_set_state (SessionEntry *entry,
     assert (entry != NULL);
     if (state == SESSION_ENTRY_SAVED_CLIENT_CLOSED) {
         g_clear_object (&entry->connection);
+        entry->abandoned_time = g_get_monotonic_time ();
     }
     entry->state = state;
 }
+/*
+ * Accessors for the 'last_use' member. This is a logical timestamp set by
+ * the ResourceManager each time the session is used by a command.
+ */
+guint64
+session_entry_get_last_use (SessionEntry *entry)
+{
+    return entry->last_use;
+}
+void
+session_entry_set_last_use (SessionEntry *entry,
+                            guint64       last_use)
+{
+    assert (entry != NULL);
+    entry->last_use = last_use;
+}
+/*
+ * Returns the monotonic time at which the session was abandoned, or 0 if
+ * it hasn't been.
+ */
+gint64
+session_entry_get_abandoned_time (SessionEntry *entry)
+{
+    return entry->state == SESSION_ENTRY_SAVED_CLIENT_CLOSED ?
+        entry->abandoned_time : 0;
+}
 /*
  * Set the contents of the 'context' blob. This blob holds the TPMS_CONTEXT
  * in its marshalled form (ready to be sent to the TPM in the body of a
- * ContextLoad command). We also copy this same blob to the 'context_client'
- * blob (the TPMS_CONTEXT that we expose to clients) if it has not yet been
- * initialized.
+ * ContextLoad command). It's only as large as the marshalled context. The
+ * same blob becomes the 'context_client' blob (the TPMS_CONTEXT that we
+ * expose to clients) if it has not yet been initialized.
  */
 void
 session_entry_set_context (SessionEntry *entry,
                            uint8_t *buf,
                            size_t size)
 {
+    UINT64 sequence;
+
     assert (entry != NULL && buf != NULL && size <= SIZE_BUF_MAX);
 
-    memcpy (entry->context.buf, buf, size);
-    entry->context.size = size;
-    if (entry->context_client.size == 0) {
-        memcpy (entry->context_client.buf, buf, size);
-        entry->context_client.size = size;
+    g_clear_pointer (&entry->context, g_bytes_unref);
+    session_entry_drop_spilled (entry);
+    entry->context = g_bytes_new (buf, size);
+    entry->sequence = 0;
+    if (Tss2_MU_UINT64_Unmarshal (buf, size, NULL, &sequence) == TSS2_RC_SUCCESS) {
+        entry->sequence = sequence;
+    }
+    if (entry->context_client == NULL) {
+        entry->context_client = g_bytes_ref (entry->context);
     }
+    session_entry_account (entry);
+}
+/*
+ * Return the 'sequence' from the saved TPMS_CONTEXT: the value of the
+ * TPM's context counter when the session was saved. Returns 0 if the
+ * session hasn't been saved.
+ */
+guint64
+session_entry_get_sequence (SessionEntry *entry)
+{
+    return entry->sequence;
+}
+/*
+ * Move the saved context to 'store' until it's needed again. The first
+ * context is shared with 'context_client' and compared against the
+ * contexts clients load, so it stays. Returns TRUE if it was spilled.
+ */
+gboolean
+session_entry_spill (SessionEntry *entry,
+                     ContextStore *store)
+{
+    if (entry->context == NULL ||
+        entry->context == entry->context_client ||
+        !context_store_put (store, entry->context, &entry->spilled))
+    {
+        return FALSE;
+    }
+    g_clear_pointer (&entry->context, g_bytes_unref);
+    session_entry_account (entry);
+    entry->store = g_object_ref (store);
+    return TRUE;
+}
+/*
+ * Returns the bytes of saved context the entry holds in memory.
+ */
+gsize
+session_entry_get_context_bytes (SessionEntry *entry)
+{
+    return entry->context_bytes;
 }
 /*
  * When the connection is set the previous connection, if there was one, must
@@ -335,6 +462,7 @@ session_entry_abandon (SessionEntry *entry)
 {
     g_clear_object (&entry->connection);
     entry->state = SESSION_ENTRY_SAVED_CLIENT_CLOSED;
+    entry->abandoned_time = g_get_monotonic_time ();
 }
 /*
  * This function is used to compare the context_client field the TPMS_CONTEXT
@@ -349,9 +477,17 @@ session_entry_compare_on_context_client (SessionEntry *entry,
                                          uint8_t *buf,
                                          size_t size)
 {
-    size_buf_t *size_buf = NULL;
+    GBytes *context_client;
+    gsize client_size;
+    gconstpointer client_buf;
 
-    g_assert (size <= SIZE_BUF_MAX);
-    size_buf = session_entry_get_context_client (entry);
-    return memcmp (size_buf->buf, buf, size);
+    context_client = session_entry_get_context_client (entry);
+    if (context_client == NULL) {
+        return -1;
+    }
+    client_buf = g_bytes_get_data (context_client, &client_size);
+    if (client_size != size) {
+        return client_size < size ? -1 : 1;
+    }
+    return memcmp (client_buf, buf, size);
 }
@@ -11,28 +11,43 @@
 #include <tss2/tss2_tpm2_types.h>
 
 #include "connection.h"
+#include "context-store.h"
 #include "session-entry-state-enum.h"
 
 G_BEGIN_DECLS
 
+/* upper bound on the size of a marshalled TPMS_CONTEXT */
 #define SIZE_BUF_MAX sizeof (TPMS_CONTEXT)
 
-typedef struct size_buf {
-    size_t size;
-    uint8_t buf [SIZE_BUF_MAX];
-} size_buf_t;
-
 typedef struct _SessionEntryClass {
     GObjectClass      parent;
 } SessionEntryClass;
 
+/*
+ * Like HandleMapEntry the fields read by the LRU and expiry scans come
+ * first, the context blobs after them.
+ */
 typedef struct _SessionEntry {
     GObject                parent_instance;
     Connection            *connection;
     SessionEntryStateEnum  state;
     TPM2_HANDLE            handle;
-    size_buf_t             context;
-    size_buf_t             context_client;
+    guint64                last_use;
+    /* monotonic time the session was abandoned by its connection */
+    gint64                 abandoned_time;
+    /*
+     * Marshalled TPMS_CONTEXT blobs, NULL until the session is first
+     * saved. 'context_client' shares the first 'context' blob.
+     */
+    GBytes                *context;
+    GBytes                *context_client;
+    /* holds 'context' while it's spilled, NULL otherwise */
+    ContextStore          *store;
+    context_store_ref_t    spilled;
+    /* TPM context counter from the saved 'context' */
+    guint64                sequence;
+    /* bytes of the context blobs counted in MEM_ACCOUNT_CONTEXTS */
+    gsize                  context_bytes;
 } SessionEntry;
 
 #define TYPE_SESSION_ENTRY              (session_entry_get_type   ())
@@ -45,10 +60,10 @@ typedef struct _SessionEntry {
 GType            session_entry_get_type        (void);
 SessionEntry*    session_entry_new             (Connection        *connection,
                                                 TPM2_HANDLE         handle);
-size_buf_t*      session_entry_get_context_client (SessionEntry *entry);
+GBytes*          session_entry_get_context_client (SessionEntry *entry);
 Connection*      session_entry_get_connection  (SessionEntry      *entry);
 TPM2_HANDLE       session_entry_get_handle      (SessionEntry      *entry);
-size_buf_t*      session_entry_get_context     (SessionEntry      *entry);
+GBytes*          session_entry_get_context     (SessionEntry      *entry);
 void             session_entry_set_context     (SessionEntry      *entry,
                                                 uint8_t           *buf,
                                                 size_t             size);
@@ -57,6 +72,14 @@ void             session_entry_set_connection  (SessionEntry      *entry,
                                                 Connection        *connection);
 void             session_entry_set_state       (SessionEntry      *entry,
                                                 SessionEntryStateEnum state);
+guint64          session_entry_get_sequence    (SessionEntry      *entry);
+guint64          session_entry_get_last_use    (SessionEntry      *entry);
+void             session_entry_set_last_use    (SessionEntry      *entry,
+                                                guint64            last_use);
+gint64           session_entry_get_abandoned_time (SessionEntry   *entry);
+gboolean         session_entry_spill           (SessionEntry      *entry,
+                                                ContextStore      *store);
+gsize            session_entry_get_context_bytes (SessionEntry    *entry);
 gint session_entry_compare (gconstpointer a,
                             gconstpointer b);
 gint session_entry_compare_on_connection (gconstpointer a,
@@ -7,6 +7,8 @@
 #include <string.h>
 #include <inttypes.h>
 
+#include <tss2/tss2_mu.h>
+
 #include "util.h"
 #include "session-list.h"
 
@@ -67,45 +69,56 @@ session_list_set_property (GObject        *object,
 }
 /*
  * Initialize object.
- * GQueue for 'abandoned_queue' must be explicitly created.
- * GList for 'session_entry_list' does not.
+ * GQueues for 'abandoned_queue', 'session_entry_queue' and 'loaded_queue'
+ * must be explicitly
+ * created as must the GHashTables indexing the SessionEntry objects by
+ * handle and by Connection.
  */
 static void
 session_list_init (SessionList     *list)
 {
     g_debug ("session_list_init");
     list->abandoned_queue = g_queue_new ();
-    list->session_entry_list = NULL;
+    list->session_entry_queue = g_queue_new ();
+    list->loaded_queue = g_queue_new ();
+    list->handle_table = g_hash_table_new (g_direct_hash, g_direct_equal);
+    list->connection_table =
+        g_hash_table_new_full (g_direct_hash,
+                               g_direct_equal,
+                               NULL,
+                               (GDestroyNotify)g_queue_free);
 }
 /*
- * GObject dispose function: unref all SessionEntry objects in the internal
- * GSList and unref the list itself. NULL the pointer to the internal list
- * as well.
+ * GObject dispose function: free the indexes, unref all SessionEntry objects
+ * in the internal GQueue and free the queue itself. NULL the pointers to
+ * the internal structures as well.
  */
 static void
 session_list_dispose (GObject *object)
 {
     SessionList *self = SESSION_LIST (object);
 
-    g_debug ("%s: SessionList with %" PRIu32 " entries", __func__,
-             g_list_length (self->session_entry_list));
-    g_queue_free (self->abandoned_queue);
-    self->abandoned_queue = NULL;
-    g_list_free_full (self->session_entry_list, g_object_unref);
-    self->session_entry_list = NULL;
+    if (self->session_entry_queue != NULL) {
+        g_debug ("%s: SessionList with %" PRIu32 " entries", __func__,
+                 g_queue_get_length (self->session_entry_queue));
+    }
+    g_clear_pointer (&self->abandoned_queue, g_queue_free);
+    g_clear_pointer (&self->loaded_queue, g_queue_free);
+    g_clear_pointer (&self->handle_table, g_hash_table_unref);
+    g_clear_pointer (&self->connection_table, g_hash_table_unref);
+    if (self->session_entry_queue != NULL) {
+        g_queue_free_full (self->session_entry_queue, g_object_unref);
+        self->session_entry_queue = NULL;
+    }
     G_OBJECT_CLASS (session_list_parent_class)->dispose (object);
 }
 /*
- * Deallocate all associated resources.
+ * Deallocate all associated resources. Everything is released in dispose.
  */
 static void
 session_list_finalize (GObject *object)
 {
-    SessionList *self = SESSION_LIST (object);
-
-    g_debug ("%s: SessionList with %" PRIu32 " entries", __func__,
-             g_list_length (self->session_entry_list));
-    g_list_free_full (self->session_entry_list, g_object_unref);
+    g_debug ("%s", __func__);
     G_OBJECT_CLASS (session_list_parent_class)->finalize (object);
 }
 /*
@@ -158,6 +171,55 @@ session_list_new (guint  max_per_conn,
                                        "max-per-connection", max_per_conn,
                                        NULL));
 }
+/*
+ * Add the SessionEntry to the GQueue of entries owned by 'connection'.
+ * SessionEntry objects that aren't associated with a connection (abandoned)
+ * aren't indexed.
+ */
+static void
+session_list_index_connection (SessionList  *list,
+                               SessionEntry *entry,
+                               Connection   *connection)
+{
+    GQueue *queue;
+
+    if (connection == NULL) {
+        return;
+    }
+    queue = g_hash_table_lookup (list->connection_table, connection);
+    if (queue == NULL) {
+        queue = g_queue_new ();
+        g_hash_table_insert (list->connection_table, connection, queue);
+    }
+    g_queue_push_tail (queue, entry);
+    connection_add_sessions (connection, 1);
+}
+/*
+ * Remove the SessionEntry from the GQueue of entries owned by 'connection'.
+ * The GQueue is freed when it becomes empty. Each connection owns at most
+ * 'max_per_connection' entries so the search is bounded.
+ */
+static void
+session_list_unindex_connection (SessionList  *list,
+                                 SessionEntry *entry,
+                                 Connection   *connection)
+{
+    GQueue *queue;
+
+    if (connection == NULL) {
+        return;
+    }
+    queue = g_hash_table_lookup (list->connection_table, connection);
+    if (queue == NULL) {
+        return;
+    }
+    if (g_queue_remove (queue, entry)) {
+        connection_add_sessions (connection, -1);
+    }
+    if (g_queue_is_empty (queue)) {
+        g_hash_table_remove (list->connection_table, connection);
+    }
+}
 /*
  * Insert GObject into the session list. We take a reference to the object
  * before we insert the object. When it is removed or if the SessionList
@@ -175,69 +237,99 @@ session_list_insert (SessionList      *list,
                     list->max_per_connection);
         return FALSE;
     }
+    if (g_hash_table_contains (list->handle_table,
+                               GUINT_TO_POINTER (entry->handle))) {
+        g_warning ("%s: SessionList already contains handle 0x%08" PRIx32,
+                   __func__, entry->handle);
+        return FALSE;
+    }
     g_object_ref (entry);
-    list->session_entry_list = g_list_append (list->session_entry_list,
-                                                 entry);
+    g_queue_push_tail (list->session_entry_queue, entry);
+    g_hash_table_insert (list->handle_table,
+                         GUINT_TO_POINTER (entry->handle),
+                         g_queue_peek_tail_link (list->session_entry_queue));
+    session_list_index_connection (list, entry, entry->connection);
+    if (entry->state == SESSION_ENTRY_LOADED) {
+        g_queue_push_tail (list->loaded_queue, entry);
+    }
 
     return TRUE;
 }
-static gboolean
-session_list_remove_custom (SessionList  *list,
-                            gconstpointer data,
-                            GCompareFunc  func)
+/*
+ * Remove the SessionEntry held in 'link' from the SessionList and all of
+ * its indexes then drop the reference held by the SessionList.
+ */
+static void
+session_list_remove_link (SessionList *list,
+                          GList       *link)
 {
-    GList       *list_entry;
-    SessionEntry *entry_data;
-
-    list_entry = g_list_find_custom (list->session_entry_list, data, func);
-    if (list_entry == NULL) {
-        return FALSE;
-    }
-    entry_data = SESSION_ENTRY (list_entry->data);
-    list->session_entry_list = g_list_remove_link (list->session_entry_list,
-                                                     list_entry);
-    g_object_unref (entry_data);
+    SessionEntry *entry = SESSION_ENTRY (link->data);
 
-    return TRUE;
+    g_hash_table_remove (list->handle_table, GUINT_TO_POINTER (entry->handle));
+    session_list_unindex_connection (list, entry, entry->connection);
+    g_queue_remove (list->abandoned_queue, entry);
+    g_queue_remove (list->loaded_queue, entry);
+    g_queue_delete_link (list->session_entry_queue, link);
+    g_object_unref (entry);
 }
 /*
- * Remove the entry from the GList. The SessionList assumes that since the
- * entry is in the container it must hold a reference to the object and so
- * upon successful removal 
+ * Remove the entry from the SessionList. The SessionList assumes that since
+ * the entry is in the container it must hold a reference to the object and
+ * so upon successful removal the reference is dropped.
  * Returns TRUE on success, FALSE on failure.
  */
 gboolean
 session_list_remove_handle (SessionList      *list,
                             TPM2_HANDLE        handle)
 {
-    return session_list_remove_custom (list,
-                                       &handle,
-                                       session_entry_compare_on_handle);
+    GList *link;
+
+    link = g_hash_table_lookup (list->handle_table, GUINT_TO_POINTER (handle));
+    if (link == NULL) {
+        return FALSE;
+    }
+    session_list_remove_link (list, link);
+
+    return TRUE;
 }
 /*
+ * Remove the oldest SessionEntry associated with the provided connection.
  * Returns TRUE on success, FALSE on failure.
  */
 gboolean
 session_list_remove_connection (SessionList      *list,
                                 Connection       *connection)
 {
-    return session_list_remove_custom (list,
-                                       connection,
-                                       session_entry_compare_on_connection);
+    GQueue *queue;
+    SessionEntry *entry;
+
+    queue = g_hash_table_lookup (list->connection_table, connection);
+    if (queue == NULL || g_queue_is_empty (queue)) {
+        return FALSE;
+    }
+    entry = SESSION_ENTRY (g_queue_peek_head (queue));
+    return session_list_remove_handle (list, entry->handle);
 }
 /*
- * This function is a thin wrapper around the g_list_remove function. Pass it
- * a SessionEntry. It will find it in the list and remove the associated entry
- * and then unref it (to account for the SessionList no longer holding a
- * reference).
+ * Pass this function a SessionEntry. It will find the entry through the
+ * handle index, remove it from the list and then unref it (to account for
+ * the SessionList no longer holding a reference).
  */
 void
 session_list_remove (SessionList   *list,
                      SessionEntry  *entry)
 {
+    GList *link;
+
     g_debug ("%s", __func__);
-    list->session_entry_list = g_list_remove (list->session_entry_list, entry);
-    g_object_unref (entry);
+    link = g_hash_table_lookup (list->handle_table,
+                                GUINT_TO_POINTER (entry->handle));
+    if (link == NULL || link->data != entry) {
+        g_warning ("%s: SessionEntry with handle 0x%08" PRIx32 " is not in "
+                   "the SessionList", __func__, entry->handle);
+        return;
+    }
+    session_list_remove_link (list, link);
 }
 
 /*
@@ -250,116 +342,99 @@ SessionEntry*
 session_list_lookup_handle (SessionList   *list,
                             TPM2_HANDLE     handle)
 {
-    GList *list_entry;
+    GList *link;
 
-    list_entry = g_list_find_custom (list->session_entry_list,
-                                      &handle,
-                                      session_entry_compare_on_handle);
-    if (list_entry != NULL) {
-        g_object_ref (list_entry->data);
-        return SESSION_ENTRY (list_entry->data);
+    link = g_hash_table_lookup (list->handle_table, GUINT_TO_POINTER (handle));
+    if (link != NULL) {
+        g_object_ref (link->data);
+        return SESSION_ENTRY (link->data);
     } else {
         return NULL;
     }
 }
 /*
- * This type is used as a container for passing a buffer and its size to the
- * 'session_list_compare_context' callback. This callback must have the
- * prototype defined as 'GCompareFunc' which forces us to pass only one
- * arbitrary parameter.
+ * Find the SessionEntry whose 'context_client' is the marshalled
+ * TPMS_CONTEXT in 'buf'. The savedHandle of a session's context is the
+ * session handle, so the context is only compared with the one entry in
+ * the handle_table. This function increases the reference count on the
+ * SessionEntry returned.
  */
-typedef struct size_buf_ptr {
-    uint8_t *buf;
-    size_t size;
-} size_buf_ptr_t;
-static gint
-session_list_compare_context (gconstpointer a,
-                              gconstpointer b)
-{
-    SessionEntry *entry = SESSION_ENTRY (a);
-    size_buf_ptr_t *size_buf_ptr = (size_buf_ptr_t*)b;
-
-    return session_entry_compare_on_context_client (entry,
-                                                    size_buf_ptr->buf,
-                                                    size_buf_ptr->size);
-}
 SessionEntry*
 session_list_lookup_context_client (SessionList *list,
                                     uint8_t *buf,
                                     size_t size)
 {
-    GList *list_entry;
-    size_buf_ptr_t size_buf_ptr = {
-        .size = size,
-        .buf = buf,
-    };
-
-    list_entry = g_list_find_custom (list->session_entry_list,
-                                     &size_buf_ptr,
-                                     session_list_compare_context);
-    if (list_entry != NULL) {
-        g_object_ref (list_entry->data);
-        return SESSION_ENTRY (list_entry->data);
-    } else {
+    GList *link;
+    size_t offset = sizeof (UINT64);
+    TPM2_HANDLE handle;
+
+    if (Tss2_MU_TPM2_HANDLE_Unmarshal (buf, size, &offset, &handle)
+        != TSS2_RC_SUCCESS)
+    {
+        return NULL;
+    }
+    link = g_hash_table_lookup (list->handle_table, GUINT_TO_POINTER (handle));
+    if (link == NULL ||
+        session_entry_compare_on_context_client (SESSION_ENTRY (link->data),
+                                                 buf,
+                                                 size) != 0)
+    {
         return NULL;
     }
+    g_object_ref (link->data);
+    return SESSION_ENTRY (link->data);
 }
 /*
  * Simple wrapper around the function that reports the number of entries in
- * the hash table.
+ * the queue.
  */
 guint
 session_list_size (SessionList *list)
 {
-    guint ret;
-
-    ret = g_list_length (list->session_entry_list);
-
-    return ret;
+    return g_queue_get_length (list->session_entry_queue);
 }
 /*
- * Structure used to hold data needed to count SessionEntry objects associated
- * with a given connection.
- */
-typedef struct {
-    Connection *connection;
-    size_t      count;
-} connection_count_data_t;
-/*
- * Callback function used to count the number of SessionEntry objects in the
- * list associated with a given connection.
+ * Returns the number of entries associated with the provided connection.
  */
-static void
-session_list_connection_counter (gpointer data,
-                                 gpointer user_data)
+size_t
+session_list_connection_count (SessionList *list,
+                               Connection  *connection)
 {
-    SessionEntry *entry = SESSION_ENTRY (data);
-    Connection *conn = session_entry_get_connection (entry);
-    connection_count_data_t *count_data = (connection_count_data_t*)user_data;
+    GQueue *queue;
 
-    if (count_data->connection == conn) {
-        ++count_data->count;
+    queue = g_hash_table_lookup (list->connection_table, connection);
+    if (queue == NULL) {
+        return 0;
     }
-    g_clear_object (&conn);
+    return g_queue_get_length (queue);
 }
 /*
- * Returns the number of entries associated with the provided connection.
+ * Returns the bytes of saved context held in memory by the entries
+ * associated with 'connection', or by all entries if 'connection' is NULL.
  */
-size_t
-session_list_connection_count (SessionList *list,
-                               Connection  *connection)
+gsize
+session_list_get_context_bytes (SessionList *list,
+                                Connection  *connection)
 {
-    connection_count_data_t count_data = {
-        .connection = connection,
-        .count = 0,
-    };
+    GQueue *queue = list->session_entry_queue;
+    GList *item;
+    gsize bytes = 0;
 
-    session_list_foreach (list, session_list_connection_counter, &count_data);
-    return count_data.count;
+    if (connection != NULL) {
+        queue = g_hash_table_lookup (list->connection_table, connection);
+        if (queue == NULL) {
+            return 0;
+        }
+    }
+    for (item = queue->head; item != NULL; item = item->next) {
+        bytes += session_entry_get_context_bytes (SESSION_ENTRY (item->data));
+    }
+    return bytes;
 }
 /*
  * Return false if the number of entries in the list is greater than or equal
- * to max_per_connection.
+ * to max_per_connection plus the sessions the connection borrowed from the
+ * QuotaPool.
  */
 gboolean
 session_list_is_full (SessionList *session_list,
@@ -370,7 +445,9 @@ session_list_is_full (SessionList *session_list,
 
     session_count = session_list_connection_count (session_list,
                                                    connection);
-    if (session_count >= session_list->max_per_connection) {
+    if (session_count >= session_list->max_per_connection +
+        connection_get_borrowed (connection, QUOTA_POOL_SESSIONS))
+    {
         g_info ("%s: Connection has exceeded session limit", __func__);
         ret = TRUE;
     } else {
@@ -385,10 +462,76 @@ session_list_foreach (SessionList *list,
                       GFunc        func,
                       gpointer     user_data)
 {
-    g_list_foreach (list->session_entry_list,
+    g_queue_foreach (list->session_entry_queue,
                      func,
                      user_data);
 }
+/*
+ * Note that 'entry', which must be in the SessionList, was loaded in the
+ * TPM so that session_list_foreach_loaded visits it.
+ */
+void
+session_list_mark_loaded (SessionList  *list,
+                          SessionEntry *entry)
+{
+    GList *link;
+
+    link = g_hash_table_lookup (list->handle_table,
+                                GUINT_TO_POINTER (entry->handle));
+    if (link == NULL || link->data != entry ||
+        g_queue_find (list->loaded_queue, entry) != NULL)
+    {
+        return;
+    }
+    g_queue_push_tail (list->loaded_queue, entry);
+}
+/*
+ * Invoke 'func' on each SessionEntry loaded in the TPM, without walking
+ * the sessions that aren't. Entries that were saved since they were
+ * marked loaded are dropped first. Like session_list_foreach_connection
+ * this iterates over a snapshot holding a reference to each entry.
+ */
+void
+session_list_foreach_loaded (SessionList *list,
+                             GFunc        func,
+                             gpointer     user_data)
+{
+    GList *link, *next, *snapshot = NULL;
+
+    for (link = list->loaded_queue->head; link != NULL; link = next) {
+        next = link->next;
+        if (SESSION_ENTRY (link->data)->state != SESSION_ENTRY_LOADED) {
+            g_queue_delete_link (list->loaded_queue, link);
+        } else {
+            snapshot = g_list_prepend (snapshot, g_object_ref (link->data));
+        }
+    }
+    snapshot = g_list_reverse (snapshot);
+    g_list_foreach (snapshot, func, user_data);
+    g_list_free_full (snapshot, g_object_unref);
+}
+/*
+ * Invoke 'func' on each SessionEntry associated with 'connection'. We
+ * iterate over a snapshot of the entries while holding a reference to each
+ * so that 'func' is free to remove, abandon or flush entries.
+ */
+void
+session_list_foreach_connection (SessionList *list,
+                                 Connection  *connection,
+                                 GFunc        func,
+                                 gpointer     user_data)
+{
+    GQueue *queue;
+    GList *snapshot;
+
+    queue = g_hash_table_lookup (list->connection_table, connection);
+    if (queue == NULL) {
+        return;
+    }
+    snapshot = g_list_copy_deep (queue->head, (GCopyFunc)g_object_ref, NULL);
+    g_list_foreach (snapshot, func, user_data);
+    g_list_free_full (snapshot, g_object_unref);
+}
 /*
  * Find the associated SessionEntry in the list.
  * Check that the SessionEntry has the same
@@ -412,6 +555,7 @@ session_list_abandon_handle (SessionList *list,
         g_clear_object (&entry);
         return FALSE;
     }
+    session_list_unindex_connection (list, entry, entry->connection);
     session_entry_abandon (entry);
     g_queue_push_head (list->abandoned_queue, entry);
     g_clear_object (&entry);
@@ -426,7 +570,7 @@ session_list_abandon_handle (SessionList *list,
  *   connection with the object.
  * - If the SessionEntry has been saved BY THE CLIENT then it will *not* be
  *   in the 'abandoned_queue'. In this case we find the SessionEntry in the
- *   'session_entry_list' and change the connection.
+ *   'session_entry_queue' and change the connection.
  */
 gboolean
 session_list_claim (SessionList *list,
@@ -441,21 +585,71 @@ session_list_claim (SessionList *list,
         g_debug ("%s: GQueue of abandoned sessions does not contain "
                  "SessionEntry", __func__);
         session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+        session_list_unindex_connection (list, entry, entry->connection);
         session_entry_set_connection (entry, connection);
+        session_list_index_connection (list, entry, connection);
         g_queue_remove (list->abandoned_queue, link->data);
+        session_list_mark_loaded (list, entry);
         return TRUE;
     }
-    link = g_list_find (list->session_entry_list, entry);
-    if (link != NULL) {
-        g_assert (link->data == entry);
+    link = g_hash_table_lookup (list->handle_table,
+                                GUINT_TO_POINTER (entry->handle));
+    if (link != NULL && link->data == entry) {
         g_debug ("%s: SessionEntry found in SessionList", __func__);
         session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+        session_list_unindex_connection (list, entry, entry->connection);
         session_entry_set_connection (entry, connection);
+        session_list_index_connection (list, entry, connection);
+        session_list_mark_loaded (list, entry);
     } else {
         return FALSE;
     }
     return TRUE;
 }
+/*
+ * The number of abandoned sessions that may be kept. That's 'max_abandoned'
+ * unless the TPM can't hold that many on top of the sessions that are
+ * still in use: abandoned sessions mustn't take the room of live ones.
+ */
+static guint
+session_list_abandoned_limit (SessionList *list)
+{
+    guint abandoned = g_queue_get_length (list->abandoned_queue);
+    guint live = g_queue_get_length (list->session_entry_queue) - abandoned;
+
+    if (list->tpm_sessions_max == 0) {
+        return list->max_abandoned;
+    }
+    if (live >= list->tpm_sessions_max) {
+        return 0;
+    }
+    return MIN (list->max_abandoned, list->tpm_sessions_max - live);
+}
+/*
+ * Insert a SessionEntry that was abandoned before the daemon restarted,
+ * one restored from a checkpoint. The entry has no connection: it's
+ * abandoned again and may be claimed like any other abandoned session.
+ * Returns FALSE if the SessionList already keeps as many abandoned
+ * sessions as it may.
+ */
+gboolean
+session_list_insert_abandoned (SessionList  *list,
+                               SessionEntry *entry)
+{
+    if (g_queue_get_length (list->abandoned_queue) >=
+        session_list_abandoned_limit (list))
+    {
+        g_debug ("%s: abandoned_queue is full", __func__);
+        return FALSE;
+    }
+    if (!session_list_insert (list, entry)) {
+        return FALSE;
+    }
+    session_entry_abandon (entry);
+    g_queue_push_head (list->abandoned_queue, entry);
+
+    return TRUE;
+}
 /*
  * Remove oldest from abandoned queue and call the caller provided function
  * on it.
@@ -468,7 +662,9 @@ session_list_prune_abandoned (SessionList *list,
     SessionEntry *entry = NULL;
     gboolean ret = FALSE;
 
-    if (g_queue_get_length (list->abandoned_queue) <= list->max_abandoned) {
+    if (g_queue_get_length (list->abandoned_queue) <=
+        session_list_abandoned_limit (list))
+    {
         g_debug ("%s: abandoned_queue has not exceeded 'max_abandoned', "
                  "nothing to do.", __func__);
         return TRUE;
@@ -483,3 +679,60 @@ session_list_prune_abandoned (SessionList *list,
     g_clear_object (&entry);
     return ret;
 }
+/*
+ * Call 'func' on each abandoned session that has been kept for longer
+ * than the abandoned timeout, and on the oldest ones past the limit. The
+ * abandoned_queue is ordered by the time sessions were abandoned so only
+ * its tail needs to be looked at. 'func' is expected to remove the session
+ * from the SessionList.
+ * Returns the number of sessions passed to 'func'.
+ */
+guint
+session_list_expire_abandoned (SessionList *list,
+                               PruneFunc    func,
+                               gpointer     data)
+{
+    SessionEntry *entry;
+    gint64 now = g_get_monotonic_time ();
+    guint count = 0;
+
+    while ((entry = g_queue_peek_tail (list->abandoned_queue)) != NULL) {
+        if (g_queue_get_length (list->abandoned_queue) <=
+                session_list_abandoned_limit (list) &&
+            (list->abandoned_timeout == 0 ||
+             now - session_entry_get_abandoned_time (entry) <
+                 list->abandoned_timeout))
+        {
+            break;
+        }
+        g_debug ("%s: expiring abandoned session 0x%08" PRIx32,
+                 __func__, session_entry_get_handle (entry));
+        g_queue_pop_tail (list->abandoned_queue);
+        g_object_ref (entry);
+        func (entry, data);
+        g_object_unref (entry);
+        ++count;
+    }
+    return count;
+}
+/*
+ * Set the number of sessions the TPM can track at once, from the TPM's
+ * TPM2_PT_ACTIVE_SESSIONS_MAX property. Fewer abandoned sessions are kept
+ * when the live ones need the room.
+ */
+void
+session_list_set_tpm_sessions_max (SessionList *list,
+                                   guint        max)
+{
+    list->tpm_sessions_max = max;
+}
+/*
+ * Abandoned sessions not claimed within 'seconds' are dropped by
+ * session_list_expire_abandoned. 0 keeps them until the limit is reached.
+ */
+void
+session_list_set_abandoned_timeout (SessionList *list,
+                                    guint        seconds)
+{
+    list->abandoned_timeout = (gint64)seconds * G_USEC_PER_SEC;
+}
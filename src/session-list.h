@@ -33,7 +33,21 @@ typedef struct _SessionList {
     GQueue             *abandoned_queue;
     guint               max_abandoned;
     guint               max_per_connection;
-    GList              *session_entry_list;
+    /* sessions the TPM can track at once, 0 if unknown */
+    guint               tpm_sessions_max;
+    /* microseconds an abandoned session is kept for, 0 for no limit */
+    gint64              abandoned_timeout;
+    /* all SessionEntry objects in insertion order, holds a reference */
+    GQueue             *session_entry_queue;
+    /* TPM2_HANDLE -> GList link in session_entry_queue */
+    GHashTable         *handle_table;
+    /* Connection* -> GQueue of SessionEntry objects owned by Connection */
+    GHashTable         *connection_table;
+    /*
+     * SessionEntry objects that were loaded in the TPM, no reference. The
+     * ones saved or flushed since are dropped by session_list_foreach_loaded.
+     */
+    GQueue             *loaded_queue;
 } SessionList;
 
 #define TYPE_SESSION_LIST              (session_list_get_type   ())
@@ -66,17 +80,37 @@ void           session_list_prettyprint       (SessionList      *list);
 void           session_list_foreach           (SessionList      *list,
                                                GFunc             func,
                                                gpointer          user_data);
+void           session_list_foreach_loaded    (SessionList      *list,
+                                               GFunc             func,
+                                               gpointer          user_data);
+void           session_list_mark_loaded       (SessionList      *list,
+                                               SessionEntry     *entry);
+void           session_list_foreach_connection (SessionList     *list,
+                                                Connection      *connection,
+                                                GFunc            func,
+                                                gpointer         user_data);
 size_t         session_list_connection_count  (SessionList      *list,
                                                Connection       *connection);
+gsize          session_list_get_context_bytes (SessionList      *list,
+                                               Connection       *connection);
 gboolean       session_list_abandon_handle    (SessionList      *list,
                                                Connection       *connection,
                                                TPM2_HANDLE       handle);
+gboolean       session_list_insert_abandoned  (SessionList      *list,
+                                               SessionEntry     *entry);
 gboolean       session_list_claim             (SessionList      *list,
                                                SessionEntry     *entry,
                                                Connection       *connection);
 gboolean       session_list_prune_abandoned   (SessionList      *list,
                                                PruneFunc         func,
                                                gpointer          data);
+guint          session_list_expire_abandoned  (SessionList      *list,
+                                               PruneFunc         func,
+                                               gpointer          data);
+void           session_list_set_tpm_sessions_max (SessionList   *list,
+                                                  guint          max);
+void           session_list_set_abandoned_timeout (SessionList  *list,
+                                                   guint         seconds);
 
 G_END_DECLS
 #endif /* SESSION_LIST_H */
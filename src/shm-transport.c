@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc-stats.h"
+#include "buffer-pool.h"
+#include "shm-transport.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+/*
+ * Create the shared region for a new connection. The daemon maps it and
+ * passes 'fd' to the client. The size is sealed so that the client can't
+ * truncate the file under the daemon's mapping.
+ * Returns NULL if the shared memory transport isn't available.
+ */
+shm_transport_t*
+shm_transport_create (int *fd)
+{
+#ifdef HAVE_MEMFD_CREATE
+    shm_transport_t *shm;
+
+    *fd = memfd_create ("tpm2-abrmd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (*fd == -1) {
+        g_warning ("%s: memfd_create failed: %s", __func__, strerror (errno));
+        return NULL;
+    }
+    if (ftruncate (*fd, sizeof (shm_transport_t)) == -1 ||
+        fcntl (*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+    {
+        g_warning ("%s: failed to size shared memory: %s",
+                   __func__, strerror (errno));
+        goto fail_out;
+    }
+    shm = shm_transport_map (*fd);
+    if (shm != NULL) {
+        return shm;
+    }
+fail_out:
+    close (*fd);
+    *fd = -1;
+    return NULL;
+#else
+    *fd = -1;
+    g_info ("%s: shared memory transport requires memfd_create", __func__);
+    return NULL;
+#endif
+}
+/*
+ * Map the shared region in 'fd'. The caller may close 'fd' afterwards.
+ */
+shm_transport_t*
+shm_transport_map (int fd)
+{
+    struct stat st;
+    void *addr;
+
+    if (fstat (fd, &st) == -1) {
+        g_warning ("%s: fstat failed: %s", __func__, strerror (errno));
+        return NULL;
+    }
+    if (st.st_size < (off_t)sizeof (shm_transport_t)) {
+        g_warning ("%s: shared memory is too small: %jd bytes",
+                   __func__, (intmax_t)st.st_size);
+        return NULL;
+    }
+    addr = mmap (NULL, sizeof (shm_transport_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        g_warning ("%s: mmap failed: %s", __func__, strerror (errno));
+        return NULL;
+    }
+    return (shm_transport_t*)addr;
+}
+void
+shm_transport_unmap (shm_transport_t *shm)
+{
+    if (shm != NULL) {
+        munmap (shm, sizeof (shm_transport_t));
+    }
+}
+/*
+ * Take the command from the shared command slot once the client has rung
+ * the doorbell. 'rbuf' holds the bytes read from the connection's socket.
+ * The command is copied out of shared memory before it's checked so that
+ * the client can't change it afterwards.
+ * Returns the command in a new buffer, or NULL when there's nothing to
+ * take. On NULL 'error' is set to 0 if the doorbell hasn't been rung and
+ * -1 if the client broke the protocol: the TCTI rings once and then waits
+ * for the response.
+ */
+uint8_t*
+shm_transport_take_command (shm_transport_t *shm,
+                            read_buffer_t   *rbuf,
+                            size_t          *buf_size,
+                            int             *error)
+{
+    uint32_t size;
+    uint8_t *buf;
+
+    *error = 0;
+    if (rbuf->len == 0) {
+        return NULL;
+    }
+    if (rbuf->len > 1 || rbuf->data [rbuf->start] != SHM_TRANSPORT_DOORBELL) {
+        g_warning ("%s: unexpected data from client", __func__);
+        *error = -1;
+        return NULL;
+    }
+    read_buffer_clear (rbuf);
+    size = shm->command_size;
+    if (size < TPM_HEADER_SIZE || size > SHM_TRANSPORT_SLOT_SIZE) {
+        g_warning ("%s: bad command size: %" PRIu32, __func__, size);
+        *error = -1;
+        return NULL;
+    }
+    buf = buffer_pool_alloc (size);
+    ALLOC_STATS_ADD (ALLOC_STATS_COMMAND_BUFFERS, size);
+    memcpy (buf, shm->command, size);
+    if (get_command_size (buf) != size) {
+        g_warning ("%s: command size 0x%" PRIx32 " doesn't match header",
+                   __func__, size);
+        buffer_pool_free (buf, size);
+        *error = -1;
+        return NULL;
+    }
+    *buf_size = size;
+    return buf;
+}
+/*
+ * Copy a response into the shared response slot. The caller rings the
+ * doorbell afterwards.
+ */
+gboolean
+shm_transport_put_response (shm_transport_t *shm,
+                            uint8_t const   *buf,
+                            size_t           size)
+{
+    if (size > SHM_TRANSPORT_SLOT_SIZE) {
+        g_warning ("%s: response of %zu bytes doesn't fit", __func__, size);
+        return FALSE;
+    }
+    memcpy (shm->response, buf, size);
+    shm->response_size = (uint32_t)size;
+    return TRUE;
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "util.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Shared memory transport between the tabrmd TCTI and the daemon. A TCTI
+ * has at most one command outstanding so the shared region holds a single
+ * command slot and a single response slot. The socket created for the
+ * connection remains: each side writes one SHM_TRANSPORT_DOORBELL byte to
+ * it once it has filled its slot. This gives one syscall per direction,
+ * keeps the socket usable for polling and still reports a closed
+ * connection as EOF.
+ */
+#define SHM_TRANSPORT_SLOT_SIZE UTIL_BUF_MAX
+#define SHM_TRANSPORT_DOORBELL  0x01
+
+typedef struct {
+    uint32_t command_size;
+    uint32_t response_size;
+    uint8_t  command [SHM_TRANSPORT_SLOT_SIZE];
+    uint8_t  response [SHM_TRANSPORT_SLOT_SIZE];
+} shm_transport_t;
+
+shm_transport_t*  shm_transport_create      (int              *fd);
+shm_transport_t*  shm_transport_map         (int               fd);
+void              shm_transport_unmap       (shm_transport_t  *shm);
+uint8_t*          shm_transport_take_command (shm_transport_t *shm,
+                                              read_buffer_t   *rbuf,
+                                              size_t          *buf_size,
+                                              int             *error);
+gboolean          shm_transport_put_response (shm_transport_t *shm,
+                                              uint8_t const   *buf,
+                                              size_t           size);
+
+G_END_DECLS
+#endif /* SHM_TRANSPORT_H */
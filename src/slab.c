@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#define SLAB_ROUND(size) \
+    (((size) + SLAB_ALIGN - 1) & ~((gsize)SLAB_ALIGN - 1))
+/* the objects of a slab follow its header */
+#define SLAB_OBJECTS(slab) \
+    ((guint8*)(slab) + SLAB_ROUND (sizeof (slab_t)))
+
+/*
+ * A free object holds the next free one in its first bytes, so objects
+ * are at least a pointer in size.
+ */
+static gsize
+slab_cache_object_size (slab_cache_t *cache)
+{
+    return SLAB_ROUND (MAX (cache->object_size, sizeof (gpointer)));
+}
+/*
+ * Chain a new slab on and put its objects on the free list, the first
+ * one on top. Called with the mutex held.
+ */
+static void
+slab_cache_grow (slab_cache_t *cache)
+{
+    gsize size = slab_cache_object_size (cache);
+    guint count = MAX (cache->objects_per_slab, 1);
+    slab_t *slab;
+    guint8 *object;
+    guint i;
+
+    slab = g_malloc (SLAB_ROUND (sizeof (slab_t)) + (gsize)count * size);
+    slab->next = cache->slabs;
+    cache->slabs = slab;
+    for (i = count; i > 0; --i) {
+        object = SLAB_OBJECTS (slab) + (gsize)(i - 1) * size;
+        *(gpointer*)object = cache->free_list;
+        cache->free_list = object;
+    }
+}
+/*
+ * Returns a zeroed object of the cache's size. Never returns NULL: like
+ * g_malloc this aborts if memory runs out.
+ */
+gpointer
+slab_cache_alloc0 (slab_cache_t *cache)
+{
+    gpointer object;
+
+    g_mutex_lock (&cache->mutex);
+    if (cache->free_list == NULL) {
+        slab_cache_grow (cache);
+    }
+    object = cache->free_list;
+    cache->free_list = *(gpointer*)object;
+    ++cache->in_use;
+    g_mutex_unlock (&cache->mutex);
+    return memset (object, 0, cache->object_size);
+}
+/*
+ * Put 'object', which must have come from slab_cache_alloc0 on the same
+ * cache, back on the free list. NULL is ignored.
+ */
+void
+slab_cache_free (slab_cache_t *cache,
+                 gpointer      object)
+{
+    if (object == NULL) {
+        return;
+    }
+    g_mutex_lock (&cache->mutex);
+    g_assert (cache->in_use > 0);
+    *(gpointer*)object = cache->free_list;
+    cache->free_list = object;
+    --cache->in_use;
+    g_mutex_unlock (&cache->mutex);
+}
+guint
+slab_cache_get_in_use (slab_cache_t *cache)
+{
+    guint in_use;
+
+    g_mutex_lock (&cache->mutex);
+    in_use = cache->in_use;
+    g_mutex_unlock (&cache->mutex);
+    return in_use;
+}
+/*
+ * Free the slabs. Every object taken from the cache must have been
+ * released.
+ */
+void
+slab_cache_clear (slab_cache_t *cache)
+{
+    slab_t *slab, *next;
+
+    g_mutex_lock (&cache->mutex);
+    g_assert (cache->in_use == 0);
+    for (slab = cache->slabs; slab != NULL; slab = next) {
+        next = slab->next;
+        g_free (slab);
+    }
+    cache->slabs = NULL;
+    cache->free_list = NULL;
+    g_mutex_unlock (&cache->mutex);
+}
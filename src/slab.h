@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* objects are aligned to this many bytes */
+#define SLAB_ALIGN            16
+/* objects carved out of each slab unless the cache asks otherwise */
+#define SLAB_OBJECTS_DEFAULT  64
+
+typedef struct _slab slab_t;
+struct _slab {
+    slab_t           *next;
+};
+
+/*
+ * A cache of fixed-size objects for the structures every connection
+ * allocates and frees. Objects are carved out of slabs of
+ * 'objects_per_slab' at a time and go on a free list when they're
+ * released, the last one freed being the next one handed out. Slabs are
+ * kept until slab_cache_clear so a steady churn of short-lived
+ * connections reuses the same few blocks of memory rather than spreading
+ * over the heap. A cache is shared by all threads, under 'mutex'. One
+ * defined with SLAB_CACHE_INIT needs no further set up.
+ */
+typedef struct {
+    GMutex            mutex;
+    gsize             object_size;
+    guint             objects_per_slab;
+    slab_t           *slabs;
+    gpointer          free_list;
+    guint             in_use;
+} slab_cache_t;
+
+#define SLAB_CACHE_INIT(size, count) \
+    { .object_size = (size), .objects_per_slab = (count), }
+
+gpointer    slab_cache_alloc0       (slab_cache_t  *cache);
+void        slab_cache_free         (slab_cache_t  *cache,
+                                     gpointer       object);
+guint       slab_cache_get_in_use   (slab_cache_t  *cache);
+void        slab_cache_clear        (slab_cache_t  *cache);
+
+G_END_DECLS
+#endif /* SLAB_H */
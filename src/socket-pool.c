@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "socket-pool.h"
+#include "util.h"
+
+/*
+ * Set up an empty pool that holds up to 'size' socket pairs, 0 disables
+ * the pool.
+ */
+void
+socket_pool_init (socket_pool_t *pool,
+                  guint          size)
+{
+    pool->pairs = g_array_sized_new (FALSE,
+                                     FALSE,
+                                     sizeof (socket_pool_pair_t),
+                                     size);
+    pool->size = size;
+}
+/*
+ * Close the socket pairs left in the pool and free it.
+ */
+void
+socket_pool_clear (socket_pool_t *pool)
+{
+    socket_pool_pair_t *pair;
+    guint i;
+
+    if (pool->pairs == NULL) {
+        return;
+    }
+    for (i = 0; i < pool->pairs->len; ++i) {
+        pair = &g_array_index (pool->pairs, socket_pool_pair_t, i);
+        close (pair->client_fd);
+        close (pair->server_fd);
+    }
+    g_clear_pointer (&pool->pairs, g_array_unref);
+}
+/*
+ * Create socket pairs until the pool is full. The pairs are created like
+ * those of create_connection_iostream: non-blocking and close-on-exec.
+ * Returns the number of pairs in the pool.
+ */
+guint
+socket_pool_fill (socket_pool_t *pool)
+{
+    socket_pool_pair_t pair;
+
+    while (pool->pairs->len < pool->size) {
+        if (create_socket_pair (&pair.client_fd,
+                                &pair.server_fd,
+                                SOCK_CLOEXEC | SOCK_NONBLOCK) == -1)
+        {
+            break;
+        }
+        g_array_append_val (pool->pairs, pair);
+    }
+    return pool->pairs->len;
+}
+/*
+ * Take a socket pair from the pool, the caller owns both fds. Returns
+ * FALSE if the pool is empty.
+ */
+gboolean
+socket_pool_take (socket_pool_t *pool,
+                  gint          *client_fd,
+                  gint          *server_fd)
+{
+    socket_pool_pair_t *pair;
+
+    if (pool->pairs->len == 0) {
+        return FALSE;
+    }
+    pair = &g_array_index (pool->pairs, socket_pool_pair_t, pool->pairs->len - 1);
+    *client_fd = pair->client_fd;
+    *server_fd = pair->server_fd;
+    g_array_set_size (pool->pairs, pool->pairs->len - 1);
+    return TRUE;
+}
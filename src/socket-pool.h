@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef SOCKET_POOL_H
+#define SOCKET_POOL_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* socket pairs kept ready for new connections by default */
+#define SOCKET_POOL_SIZE_DEFAULT 8
+
+typedef struct {
+    gint    client_fd;
+    gint    server_fd;
+} socket_pool_pair_t;
+
+/*
+ * Stream socket pairs created ahead of time so that a new connection
+ * doesn't wait on socketpair. The pool is refilled up to 'size' pairs by
+ * socket_pool_fill, typically from an idle callback once the connection
+ * has been handed out. There's no locking, a pool is used by one thread.
+ */
+typedef struct {
+    GArray *pairs;
+    guint   size;
+} socket_pool_t;
+
+void       socket_pool_init  (socket_pool_t *pool,
+                              guint          size);
+void       socket_pool_clear (socket_pool_t *pool);
+guint      socket_pool_fill  (socket_pool_t *pool);
+gboolean   socket_pool_take  (socket_pool_t *pool,
+                              gint          *client_fd,
+                              gint          *server_fd);
+
+G_END_DECLS
+#endif /* SOCKET_POOL_H */
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <gio/gunixsocketaddress.h>
+
+#include "socket-protocol.h"
+
+/*
+ * Create the socket address for 'address': a name in the abstract
+ * namespace when it starts with '@', a filesystem path otherwise. This is
+ * the notation systemd uses for ListenStream.
+ */
+GSocketAddress*
+socket_protocol_address_new (const gchar *address)
+{
+    if (address [0] == '@') {
+        return g_unix_socket_address_new_with_type (address + 1,
+                                                    -1,
+                                                    G_UNIX_SOCKET_ADDRESS_ABSTRACT);
+    }
+    return g_unix_socket_address_new (address);
+}
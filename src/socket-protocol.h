@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef SOCKET_PROTOCOL_H
+#define SOCKET_PROTOCOL_H
+
+#include <gio/gio.h>
+#include <stdint.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Protocol between the tabrmd TCTI and the daemon's UNIX socket frontend.
+ * The client connects, sends one request and reads one response. When
+ * CREATE_CONNECTION succeeds the socket becomes the connection and TPM
+ * buffers are exchanged over it like over the sockets handed out through
+ * D-Bus. Other requests are answered and the daemon closes the socket.
+ * Clients are identified by the peer credentials of the socket. Both ends
+ * are on the same host so fields are in host byte order.
+ */
+#define SOCKET_PROTOCOL_VERSION 1
+
+typedef enum {
+    SOCKET_PROTOCOL_CREATE_CONNECTION = 1,
+    SOCKET_PROTOCOL_CANCEL,
+    SOCKET_PROTOCOL_SET_LOCALITY,
+    SOCKET_PROTOCOL_LEASE,
+} socket_protocol_op_t;
+
+typedef struct {
+    uint32_t version;
+    uint32_t op;
+    /*
+     * CREATE_CONNECTION: TPM index and tabrmd_transport_t
+     * LEASE: command count, 0 to release, and timeout in milliseconds
+     */
+    uint32_t tpm;
+    uint32_t transport;
+    /* CANCEL, SET_LOCALITY and LEASE: connection ID and locality */
+    uint64_t id;
+    uint8_t  locality;
+    uint8_t  reserved [7];
+} socket_protocol_request_t;
+
+typedef struct {
+    /* TSS2_RC */
+    uint32_t rc;
+    /* CREATE_CONNECTION: TABRMD_FEATURE_* flags, 0 from older daemons */
+    uint32_t features;
+    /* CREATE_CONNECTION: the connection ID */
+    uint64_t id;
+} socket_protocol_response_t;
+
+GSocketAddress*   socket_protocol_address_new (const gchar *address);
+
+G_END_DECLS
+#endif /* SOCKET_PROTOCOL_H */
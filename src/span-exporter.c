@@ -0,0 +1,415 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "span-exporter.h"
+
+G_DEFINE_TYPE (SpanExporter, span_exporter, G_TYPE_OBJECT);
+
+/* SpanKind and StatusCode of the OpenTelemetry protocol */
+#define SPAN_KIND_INTERNAL   1
+#define SPAN_KIND_SERVER     2
+#define SPAN_STATUS_UNSET    0
+#define SPAN_STATUS_ERROR    2
+
+#define SPAN_ID_HEX_SIZE     (TRACE_CONTEXT_SPAN_ID_SIZE * 2 + 1)
+#define TRACE_ID_HEX_SIZE    (TRACE_CONTEXT_TRACE_ID_SIZE * 2 + 1)
+
+/*
+ * Put 'size' bytes from 'buf' in 'hex' as lower case hex digits, as the
+ * JSON encoding of the OpenTelemetry protocol has trace and span IDs.
+ */
+static void
+span_hex (const guint8 *buf,
+          size_t        size,
+          gchar        *hex)
+{
+    static const gchar digits [] = "0123456789abcdef";
+    size_t i;
+
+    for (i = 0; i < size; ++i) {
+        hex [i * 2] = digits [buf [i] >> 4];
+        hex [i * 2 + 1] = digits [buf [i] & 0xf];
+    }
+    hex [size * 2] = '\0';
+}
+/*
+ * Put a new random span ID in 'hex'. Only the exporter thread makes them.
+ */
+static void
+span_new_id (gchar *hex)
+{
+    guint32 id [2];
+
+    do {
+        id [0] = g_random_int ();
+        id [1] = g_random_int ();
+    } while (id [0] == 0 && id [1] == 0);
+    span_hex ((const guint8*)id, sizeof (id), hex);
+}
+/*
+ * Write a span from 'start' to 'end', monotonic time in usec. 'extra'
+ * is added to the span object as is, for the attributes and status.
+ */
+static void
+span_exporter_write_span (SpanExporter *self,
+                          const gchar  *trace_id,
+                          const gchar  *span_id,
+                          const gchar  *parent_id,
+                          const gchar  *name,
+                          gint          kind,
+                          gint64        start,
+                          gint64        end,
+                          const gchar  *extra)
+{
+    fprintf (self->file,
+             "{\"traceId\":\"%s\",\"spanId\":\"%s\",\"parentSpanId\":\"%s\","
+             "\"name\":\"%s\",\"kind\":%d,"
+             "\"startTimeUnixNano\":\"%" PRId64 "\","
+             "\"endTimeUnixNano\":\"%" PRId64 "\"%s}",
+             trace_id,
+             span_id,
+             parent_id,
+             name,
+             kind,
+             (start + self->realtime_offset) * 1000,
+             (MAX (end, start) + self->realtime_offset) * 1000,
+             extra != NULL ? extra : "");
+}
+/*
+ * Write a stage of the command in 'record' as a child of the command's
+ * span, preceded by a comma.
+ */
+static void
+span_exporter_write_stage (SpanExporter *self,
+                           const gchar  *trace_id,
+                           const gchar  *parent_id,
+                           const gchar  *name,
+                           gint64        start,
+                           gint64        end)
+{
+    gchar span_id [SPAN_ID_HEX_SIZE];
+
+    span_new_id (span_id);
+    fputc (',', self->file);
+    span_exporter_write_span (self,
+                              trace_id,
+                              span_id,
+                              parent_id,
+                              name,
+                              SPAN_KIND_INTERNAL,
+                              start,
+                              end,
+                              NULL);
+}
+/*
+ * Write 'record' as an ExportTraceServiceRequest on a line of its own:
+ * the span of the command and the spans of its stages.
+ */
+static void
+span_exporter_write_record (SpanExporter  *self,
+                            span_record_t *record)
+{
+    const command_timing_t *timing = &record->timing;
+    gchar trace_id [TRACE_ID_HEX_SIZE];
+    gchar client_id [SPAN_ID_HEX_SIZE];
+    gchar command_id [SPAN_ID_HEX_SIZE];
+    gchar *extra;
+    gint64 start, end;
+
+    span_hex (timing->trace.trace_id, sizeof (timing->trace.trace_id), trace_id);
+    span_hex (timing->trace.parent_id,
+              sizeof (timing->trace.parent_id),
+              client_id);
+    span_new_id (command_id);
+    extra = g_strdup_printf (",\"attributes\":["
+        "{\"key\":\"tpm2.command_code\",\"value\":{\"intValue\":\"%" PRIu32 "\"}},"
+        "{\"key\":\"tpm2.response_code\",\"value\":{\"intValue\":\"%" PRIu32 "\"}},"
+        "{\"key\":\"tabrmd.connection_id\",\"value\":{\"stringValue\":\"0x%" PRIx64 "\"}}],"
+        "\"status\":{\"code\":%d}",
+        record->command_code,
+        record->rc,
+        record->connection_id,
+        record->rc == TSS2_RC_SUCCESS ? SPAN_STATUS_UNSET : SPAN_STATUS_ERROR);
+    fputs ("{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+           "{\"key\":\"service.name\",\"value\":{\"stringValue\":\""
+           SPAN_EXPORTER_SERVICE "\"}}]},\"scopeSpans\":[{\"scope\":"
+           "{\"name\":\"" SPAN_EXPORTER_SERVICE "\"},\"spans\":[",
+           self->file);
+    span_exporter_write_span (self,
+                              trace_id,
+                              command_id,
+                              client_id,
+                              "TPM2 command",
+                              SPAN_KIND_SERVER,
+                              timing->received,
+                              record->written,
+                              extra);
+    g_free (extra);
+    start = timing->received;
+    end = MIN (start + timing->queue_usec, timing->answered);
+    span_exporter_write_stage (self, trace_id, command_id, "queue", start, end);
+    if (timing->load_usec > 0) {
+        start = end;
+        end = MIN (start + timing->load_usec, timing->answered);
+        span_exporter_write_stage (self, trace_id, command_id, "load", start, end);
+    }
+    start = end;
+    end = MIN (start + timing->tpm_usec, timing->answered);
+    span_exporter_write_stage (self, trace_id, command_id, "execute", start, end);
+    if (timing->save_usec > 0) {
+        start = end;
+        end = MIN (start + timing->save_usec, timing->answered);
+        span_exporter_write_stage (self, trace_id, command_id, "save", start, end);
+    }
+    span_exporter_write_stage (self,
+                               trace_id,
+                               command_id,
+                               "write",
+                               timing->answered,
+                               record->written);
+    fputs ("]}]}]}\n", self->file);
+    if (ferror (self->file)) {
+        g_warning ("%s: failed to write spans, stopping: %s",
+                   __func__, strerror (errno));
+        self->failed = TRUE;
+    }
+}
+/*
+ * Take the oldest span from the ring. Only the exporter thread takes
+ * spans. Returns NULL if there's none ready.
+ */
+static span_record_t*
+span_exporter_take (SpanExporter *self)
+{
+    guint tail = (guint)g_atomic_int_get (&self->tail);
+    gpointer *slot = (gpointer*)&self->ring [tail % SPAN_EXPORTER_RING_SIZE];
+    span_record_t *record;
+
+    record = g_atomic_pointer_get (slot);
+    if (record == NULL) {
+        return NULL;
+    }
+    g_atomic_pointer_set (slot, NULL);
+    g_atomic_int_set (&self->tail, (gint)(tail + 1));
+    return record;
+}
+static gboolean
+span_exporter_ready (SpanExporter *self)
+{
+    guint tail = (guint)g_atomic_int_get (&self->tail);
+
+    return g_atomic_pointer_get (&self->ring [tail % SPAN_EXPORTER_RING_SIZE]) != NULL;
+}
+/*
+ * GThreadFunc writing the spans from the ring until the SpanExporter is
+ * disposed. The file is flushed whenever the ring runs empty so that a
+ * collector tailing it gets the spans right away.
+ */
+static gpointer
+span_exporter_thread (gpointer user_data)
+{
+    SpanExporter *self = SPAN_EXPORTER (user_data);
+    span_record_t *record;
+    guint64 value;
+    gint dropped;
+
+    for (;;) {
+        while ((record = span_exporter_take (self)) != NULL) {
+            if (!self->failed) {
+                span_exporter_write_record (self, record);
+            }
+            g_free (record);
+        }
+        do {
+            dropped = g_atomic_int_get (&self->dropped);
+        } while (dropped != 0 &&
+                 !g_atomic_int_compare_and_exchange (&self->dropped,
+                                                     dropped,
+                                                     0));
+        if (dropped > 0) {
+            g_warning ("%d spans dropped", dropped);
+        }
+        if (!self->failed && fflush (self->file) != 0) {
+            g_warning ("%s: failed to write spans, stopping: %s",
+                       __func__, strerror (errno));
+            self->failed = TRUE;
+        }
+        if (g_atomic_int_get (&self->stop)) {
+            break;
+        }
+        /* a span put after this is seen or wakes us up */
+        g_atomic_int_set (&self->sleeping, TRUE);
+        if (span_exporter_ready (self)) {
+            g_atomic_int_set (&self->sleeping, FALSE);
+            continue;
+        }
+        if (TABRMD_ERRNO_EINTR_RETRY (read (self->wakeup_fd,
+                                            &value,
+                                            sizeof (value))) == -1)
+        {
+            g_atomic_int_set (&self->sleeping, FALSE);
+        }
+    }
+    return NULL;
+}
+static void
+span_exporter_dispose (GObject *obj)
+{
+    SpanExporter *self = SPAN_EXPORTER (obj);
+    guint64 value = 1;
+
+    if (self->thread != NULL) {
+        g_atomic_int_set (&self->stop, TRUE);
+        TABRMD_ERRNO_EINTR_RETRY (write (self->wakeup_fd,
+                                         &value,
+                                         sizeof (value)));
+        g_thread_join (self->thread);
+        self->thread = NULL;
+    }
+    G_OBJECT_CLASS (span_exporter_parent_class)->dispose (obj);
+}
+static void
+span_exporter_finalize (GObject *obj)
+{
+    SpanExporter *self = SPAN_EXPORTER (obj);
+    guint i;
+
+    for (i = 0; i < SPAN_EXPORTER_RING_SIZE; ++i) {
+        g_clear_pointer (&self->ring [i], g_free);
+    }
+    if (self->file != NULL && fclose (self->file) != 0) {
+        g_warning ("%s: failed to close span file: %s",
+                   __func__, strerror (errno));
+    }
+    if (self->wakeup_fd != -1) {
+        close (self->wakeup_fd);
+    }
+    G_OBJECT_CLASS (span_exporter_parent_class)->finalize (obj);
+}
+static void
+span_exporter_init (SpanExporter *self)
+{
+    self->wakeup_fd = -1;
+}
+static void
+span_exporter_class_init (SpanExporterClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (span_exporter_parent_class == NULL)
+        span_exporter_parent_class = g_type_class_peek_parent (klass);
+    object_class->dispose = span_exporter_dispose;
+    object_class->finalize = span_exporter_finalize;
+}
+/*
+ * Start writing spans to the file at 'path'. Spans are appended so that
+ * a collector can keep reading the file across restarts of the daemon.
+ * The caller owns the returned reference.
+ * Returns NULL if the file can't be opened or the exporter thread started.
+ */
+SpanExporter*
+span_exporter_new (const gchar *path,
+                   GError     **error)
+{
+    SpanExporter *exporter;
+    FILE *file;
+    gint fd;
+
+    g_assert (path != NULL);
+    fd = g_open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to open %s: %s", path, strerror (errno));
+        return NULL;
+    }
+    file = fdopen (fd, "a");
+    if (file == NULL) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to open %s: %s", path, strerror (errno));
+        close (fd);
+        return NULL;
+    }
+    setvbuf (file, NULL, _IOFBF, SPAN_EXPORTER_BUF_SIZE);
+    exporter = SPAN_EXPORTER (g_object_new (TYPE_SPAN_EXPORTER, NULL));
+    exporter->file = file;
+    exporter->realtime_offset = g_get_real_time () - g_get_monotonic_time ();
+    exporter->wakeup_fd = eventfd (0, EFD_CLOEXEC);
+    if (exporter->wakeup_fd == -1) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to create eventfd: %s", strerror (errno));
+        g_object_unref (exporter);
+        return NULL;
+    }
+    exporter->thread = g_thread_try_new ("tabrmd-spans",
+                                         span_exporter_thread,
+                                         exporter,
+                                         error);
+    if (exporter->thread == NULL) {
+        g_object_unref (exporter);
+        return NULL;
+    }
+    g_info ("writing spans to %s", path);
+    return exporter;
+}
+/*
+ * Hand the spans of a command answered with 'rc' to the exporter thread:
+ * 'timing' says where its time went and the trace it's part of, 'written'
+ * is when its response was written. Commands that aren't part of a
+ * sampled trace are skipped. This never blocks: if the ring is full the
+ * spans are dropped and counted. It may be called from any thread and
+ * accepts a NULL SpanExporter so that callers don't have to check.
+ * Returns FALSE if the spans were skipped or dropped.
+ */
+gboolean
+span_exporter_put (SpanExporter           *exporter,
+                   guint64                 connection_id,
+                   TPM2_CC                 command_code,
+                   TSS2_RC                 rc,
+                   const command_timing_t *timing,
+                   gint64                  written)
+{
+    static const guint8 zeros [TRACE_CONTEXT_TRACE_ID_SIZE] = { 0 };
+    span_record_t *record;
+    guint head, tail;
+    guint64 value = 1;
+
+    if (exporter == NULL || timing->received == 0 ||
+        (timing->trace.flags & TRACE_CONTEXT_FLAG_SAMPLED) == 0 ||
+        memcmp (timing->trace.trace_id, zeros, sizeof (zeros)) == 0)
+    {
+        return FALSE;
+    }
+    do {
+        head = (guint)g_atomic_int_get (&exporter->head);
+        tail = (guint)g_atomic_int_get (&exporter->tail);
+        if (head - tail >= SPAN_EXPORTER_RING_SIZE) {
+            g_atomic_int_inc (&exporter->dropped);
+            return FALSE;
+        }
+    } while (!g_atomic_int_compare_and_exchange (&exporter->head,
+                                                 (gint)head,
+                                                 (gint)(head + 1)));
+    record = g_new (span_record_t, 1);
+    record->connection_id = connection_id;
+    record->command_code = command_code;
+    record->rc = rc;
+    record->timing = *timing;
+    record->written = written;
+    g_atomic_pointer_set (&exporter->ring [head % SPAN_EXPORTER_RING_SIZE],
+                          record);
+    if (g_atomic_int_get (&exporter->sleeping) &&
+        g_atomic_int_compare_and_exchange (&exporter->sleeping, TRUE, FALSE))
+    {
+        TABRMD_ERRNO_EINTR_RETRY (write (exporter->wakeup_fd,
+                                         &value,
+                                         sizeof (value)));
+    }
+    return TRUE;
+}
@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef SPAN_EXPORTER_H
+#define SPAN_EXPORTER_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <stdio.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "util.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Spans for the commands of clients that attached a sampled W3C trace
+ * context, see TABRMD_CONTROL_SET_TRACE_CONTEXT, written to a file in the
+ * OpenTelemetry protocol's JSON encoding: each line is an
+ * ExportTraceServiceRequest, as read by the OpenTelemetry Collector's
+ * otlpjsonfile receiver. A command is a SERVER span, child of the client's
+ * span, with a span for each stage under it: queue, load, execute, save
+ * and write. The ResourceManager only times the load, execute and save
+ * stages, so their spans are laid out one after the other from the end of
+ * the queue span.
+ * Like PcapWriter callers hand spans to a ring and never wait: a thread
+ * encodes and writes them. Spans that don't fit are dropped and counted.
+ */
+#define SPAN_EXPORTER_RING_SIZE   1024
+/* stdio buffer for the span file */
+#define SPAN_EXPORTER_BUF_SIZE    (64 * 1024)
+#define SPAN_EXPORTER_SERVICE     "tpm2-abrmd"
+
+typedef struct {
+    guint64          connection_id;
+    TPM2_CC          command_code;
+    TSS2_RC          rc;
+    command_timing_t timing;
+    /* monotonic time in usec the response was written */
+    gint64           written;
+} span_record_t;
+
+typedef struct _SpanExporterClass {
+    GObjectClass      parent;
+} SpanExporterClass;
+
+typedef struct _SpanExporter {
+    GObject           parent_instance;
+    FILE             *file;
+    GThread          *thread;
+    /* usec to add to monotonic time to get the wall clock time */
+    gint64            realtime_offset;
+    /* spans handed to the exporter thread, see span_exporter_put */
+    span_record_t    *ring [SPAN_EXPORTER_RING_SIZE];
+    gint              head;
+    gint              tail;
+    gint              dropped;
+    gint              wakeup_fd;
+    gint              sleeping;
+    gint              stop;
+    /* set once a write failed, spans are discarded from then on */
+    gboolean          failed;
+} SpanExporter;
+
+#define TYPE_SPAN_EXPORTER              (span_exporter_get_type   ())
+#define SPAN_EXPORTER(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_SPAN_EXPORTER, SpanExporter))
+#define SPAN_EXPORTER_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_SPAN_EXPORTER, SpanExporterClass))
+#define IS_SPAN_EXPORTER(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_SPAN_EXPORTER))
+#define IS_SPAN_EXPORTER_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_SPAN_EXPORTER))
+#define SPAN_EXPORTER_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_SPAN_EXPORTER, SpanExporterClass))
+
+GType         span_exporter_get_type  (void);
+SpanExporter* span_exporter_new       (const gchar            *path,
+                                       GError                **error);
+gboolean      span_exporter_put       (SpanExporter           *exporter,
+                                       guint64                 connection_id,
+                                       TPM2_CC                 command_code,
+                                       TSS2_RC                 rc,
+                                       const command_timing_t *timing,
+                                       gint64                  written);
+
+G_END_DECLS
+#endif /* SPAN_EXPORTER_H */
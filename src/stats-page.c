@@ -0,0 +1,293 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "stats-page.h"
+#include "util.h"
+
+G_DEFINE_TYPE (StatsPage, stats_page, G_TYPE_OBJECT);
+
+/*
+ * Stop updating the page, then remove it so viewers don't show figures
+ * from a daemon that's gone.
+ */
+static void
+stats_page_dispose (GObject *obj)
+{
+    StatsPage *self = STATS_PAGE (obj);
+    guint i;
+
+    if (self->timeout_id != 0) {
+        g_source_remove (self->timeout_id);
+        self->timeout_id = 0;
+    }
+    if (self->page != NULL) {
+        munmap (self->page, sizeof (stats_page_t));
+        self->page = NULL;
+        g_unlink (self->path);
+    }
+    g_clear_pointer (&self->path, g_free);
+    for (i = 0; i < self->tpm_count; ++i) {
+        g_clear_object (&self->tpm2s [i]);
+        g_clear_object (&self->queues [i]);
+    }
+    self->tpm_count = 0;
+    g_clear_object (&self->connection_manager);
+    G_OBJECT_CLASS (stats_page_parent_class)->dispose (obj);
+}
+static void
+stats_page_init (StatsPage *self)
+{
+    UNUSED_PARAM (self);
+}
+static void
+stats_page_class_init (StatsPageClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (stats_page_parent_class == NULL)
+        stats_page_parent_class = g_type_class_peek_parent (klass);
+    object_class->dispose = stats_page_dispose;
+}
+/*
+ * Allocate a new StatsPage reporting on the connections in 'manager'.
+ * The caller owns the returned reference.
+ */
+StatsPage*
+stats_page_new (ConnectionManager *manager)
+{
+    StatsPage *stats;
+
+    g_assert (manager != NULL);
+    stats = STATS_PAGE (g_object_new (TYPE_STATS_PAGE, NULL));
+    stats->connection_manager = g_object_ref (manager);
+    return stats;
+}
+/*
+ * Report on the next TPM: 'tpm2' for its activity and 'queue' for the
+ * commands waiting for its ResourceManager. TPMs must be added in order,
+ * before stats_page_open.
+ */
+void
+stats_page_add_tpm (StatsPage    *stats,
+                    Tpm2         *tpm2,
+                    MessageQueue *queue)
+{
+    g_assert (stats != NULL);
+    g_assert (stats->page == NULL);
+    g_assert (stats->tpm_count < TABRMD_TPMS_MAX);
+    stats->tpm2s [stats->tpm_count] = g_object_ref (tpm2);
+    stats->queues [stats->tpm_count] = g_object_ref (queue);
+    ++stats->tpm_count;
+}
+typedef struct {
+    stats_page_t *page;
+    guint         tpm_count;
+} stats_page_fill_t;
+
+static void
+stats_page_fill_connection (gpointer data,
+                            gpointer user_data)
+{
+    Connection *connection = CONNECTION (data);
+    stats_page_fill_t *fill = (stats_page_fill_t*)user_data;
+    stats_page_connection_t *entry;
+    guint tpm = connection_get_tpm (connection);
+
+    ++fill->page->connections_total;
+    if (tpm < fill->tpm_count) {
+        ++fill->page->tpms [tpm].connections;
+    }
+    if (fill->page->connection_count >= STATS_PAGE_CONNECTIONS_MAX) {
+        return;
+    }
+    entry = &fill->page->connections [fill->page->connection_count++];
+    entry->id = connection->id;
+    entry->uid = connection_get_uid (connection);
+    entry->pid = connection_get_pid (connection);
+    entry->tpm = tpm;
+    entry->commands =
+        (guint64)(gsize)g_atomic_pointer_get (&connection->commands);
+    entry->tpm_usec =
+        (guint64)(gsize)g_atomic_pointer_get (&connection->tpm_usec);
+    entry->in_flight = (guint32)MAX (connection_get_in_flight (connection), 0);
+    entry->sessions =
+        (guint32)MAX (g_atomic_int_get (&connection->sessions), 0);
+    entry->objects = handle_map_get_count (connection->transient_handle_map);
+}
+/*
+ * Write the current figures to the page. Only one thread may call this,
+ * readers may be copying the page meanwhile.
+ */
+void
+stats_page_update (StatsPage *stats)
+{
+    stats_page_t *page = stats->page;
+    stats_page_fill_t fill = { .page = page, .tpm_count = stats->tpm_count };
+    stats_page_tpm_t *tpm;
+    guint64 commands, busy_usec, swaps;
+    guint i;
+
+    g_assert (page != NULL);
+    g_atomic_int_inc ((gint*)&page->seq);
+    page->tpm_count = stats->tpm_count;
+    page->connection_count = 0;
+    page->connections_total = 0;
+    for (i = 0; i < stats->tpm_count; ++i) {
+        tpm = &page->tpms [i];
+        tpm2_get_activity (stats->tpm2s [i], &commands, &busy_usec, &swaps);
+        tpm->commands = commands;
+        tpm->busy_usec = busy_usec;
+        tpm->context_swaps = swaps;
+        tpm->queue_depth = message_queue_get_length (stats->queues [i]);
+        tpm->connections = 0;
+    }
+    connection_manager_foreach (stats->connection_manager,
+                                stats_page_fill_connection,
+                                &fill);
+    page->updated_usec = g_get_monotonic_time ();
+    g_atomic_int_inc ((gint*)&page->seq);
+}
+static gboolean
+stats_page_timeout (gpointer user_data)
+{
+    stats_page_update (STATS_PAGE (user_data));
+    return G_SOURCE_CONTINUE;
+}
+/*
+ * Create the page at 'path', replacing any file there, and update it
+ * every STATS_PAGE_INTERVAL milliseconds from the default main context.
+ * The file may be read by the daemon's group.
+ */
+gboolean
+stats_page_open (StatsPage   *stats,
+                 const gchar *path,
+                 GError     **error)
+{
+    void *addr;
+    gint fd;
+
+    g_assert (stats != NULL);
+    g_assert (path != NULL);
+    g_assert (stats->page == NULL);
+    g_unlink (path);
+    fd = g_open (path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+    if (fd == -1) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to create %s: %s", path, strerror (errno));
+        return FALSE;
+    }
+    if (ftruncate (fd, sizeof (stats_page_t)) == -1) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to size %s: %s", path, strerror (errno));
+        goto err_out;
+    }
+    addr = mmap (NULL, sizeof (stats_page_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to map %s: %s", path, strerror (errno));
+        goto err_out;
+    }
+    close (fd);
+    stats->page = (stats_page_t*)addr;
+    stats->path = g_strdup (path);
+    stats->page->magic = STATS_PAGE_MAGIC;
+    stats->page->version = STATS_PAGE_VERSION;
+    stats_page_update (stats);
+    stats->timeout_id = g_timeout_add (STATS_PAGE_INTERVAL,
+                                       stats_page_timeout,
+                                       stats);
+    g_info ("publishing stats in %s", path);
+    return TRUE;
+err_out:
+    close (fd);
+    g_unlink (path);
+    return FALSE;
+}
+/*
+ * Map the page at 'path' read-only, for viewers. Release it with
+ * stats_page_unmap.
+ */
+const stats_page_t*
+stats_page_map (const gchar *path,
+                GError     **error)
+{
+    const stats_page_t *page;
+    struct stat st;
+    void *addr;
+    gint fd;
+
+    fd = g_open (path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to open %s: %s", path, strerror (errno));
+        return NULL;
+    }
+    if (fstat (fd, &st) == -1 || st.st_size < (off_t)sizeof (stats_page_t)) {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "%s isn't a tpm2-abrmd stats page", path);
+        close (fd);
+        return NULL;
+    }
+    addr = mmap (NULL, sizeof (stats_page_t), PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (addr == MAP_FAILED) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to map %s: %s", path, strerror (errno));
+        return NULL;
+    }
+    page = (const stats_page_t*)addr;
+    if (page->magic != STATS_PAGE_MAGIC ||
+        page->version != STATS_PAGE_VERSION)
+    {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "%s isn't a version %u tpm2-abrmd stats page",
+                     path, STATS_PAGE_VERSION);
+        stats_page_unmap (page);
+        return NULL;
+    }
+    return page;
+}
+void
+stats_page_unmap (const stats_page_t *page)
+{
+    if (page != NULL) {
+        munmap ((void*)page, sizeof (stats_page_t));
+    }
+}
+/*
+ * Copy 'page' to 'copy' without getting in the writer's way: retry while
+ * the writer is busy or changed the page during the copy.
+ * Returns FALSE if there was no consistent copy after STATS_PAGE_RETRIES
+ * attempts.
+ */
+gboolean
+stats_page_snapshot (const stats_page_t *page,
+                     stats_page_t       *copy)
+{
+    uint32_t seq;
+    guint i;
+
+    for (i = 0; i < STATS_PAGE_RETRIES; ++i) {
+        seq = __atomic_load_n (&page->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            g_usleep (100);
+            continue;
+        }
+        memcpy (copy, page, sizeof (*copy));
+        /* the copy must be done before 'seq' is read again */
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        if (__atomic_load_n (&page->seq, __ATOMIC_RELAXED) == seq) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef STATS_PAGE_H
+#define STATS_PAGE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <stdint.h>
+
+#include "connection-manager.h"
+#include "message-queue.h"
+#include "tabrmd-defaults.h"
+#include "tpm2.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Live statistics published in a file that viewers like tabrmd-top map
+ * read-only. The daemon rewrites the page from its own counters every
+ * STATS_PAGE_INTERVAL milliseconds whether or not anyone is reading, so
+ * readers never put load on the daemon. The main loop is the only writer.
+ * The page is guarded by a sequence count: 'seq' is odd while the page
+ * is being written. A reader copies the page and keeps the copy if 'seq'
+ * was even and the same before and after, see stats_page_snapshot.
+ * All counters are running totals, readers get rates by comparing two
+ * snapshots.
+ */
+#define STATS_PAGE_MAGIC           0x53524d54 /* "TMRS" */
+#define STATS_PAGE_VERSION         1
+#define STATS_PAGE_INTERVAL        500
+#define STATS_PAGE_CONNECTIONS_MAX 256
+/* attempts stats_page_snapshot makes to get a consistent copy */
+#define STATS_PAGE_RETRIES         100
+
+typedef struct {
+    uint64_t commands;
+    /* time the TPM spent executing commands */
+    uint64_t busy_usec;
+    /* contexts loaded into or saved from the TPM */
+    uint64_t context_swaps;
+    /* commands waiting for the ResourceManager */
+    uint32_t queue_depth;
+    uint32_t connections;
+} stats_page_tpm_t;
+
+typedef struct {
+    uint64_t id;
+    uint64_t commands;
+    uint64_t tpm_usec;
+    uint32_t uid;
+    uint32_t pid;
+    uint32_t tpm;
+    uint32_t in_flight;
+    uint32_t sessions;
+    uint32_t objects;
+} stats_page_connection_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    uint32_t tpm_count;
+    /* entries used in 'connections' and connections the daemon holds */
+    uint32_t connection_count;
+    uint32_t connections_total;
+    /* CLOCK_MONOTONIC time of the last update */
+    int64_t  updated_usec;
+    stats_page_tpm_t        tpms [TABRMD_TPMS_MAX];
+    stats_page_connection_t connections [STATS_PAGE_CONNECTIONS_MAX];
+} stats_page_t;
+
+typedef struct _StatsPageClass {
+    GObjectClass      parent;
+} StatsPageClass;
+
+typedef struct _StatsPage {
+    GObject            parent_instance;
+    ConnectionManager *connection_manager;
+    guint              tpm_count;
+    Tpm2              *tpm2s [TABRMD_TPMS_MAX];
+    MessageQueue      *queues [TABRMD_TPMS_MAX];
+    stats_page_t      *page;
+    gchar             *path;
+    guint              timeout_id;
+} StatsPage;
+
+#define TYPE_STATS_PAGE              (stats_page_get_type   ())
+#define STATS_PAGE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_STATS_PAGE, StatsPage))
+#define STATS_PAGE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_STATS_PAGE, StatsPageClass))
+#define IS_STATS_PAGE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_STATS_PAGE))
+#define IS_STATS_PAGE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_STATS_PAGE))
+#define STATS_PAGE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_STATS_PAGE, StatsPageClass))
+
+GType               stats_page_get_type  (void);
+StatsPage*          stats_page_new       (ConnectionManager  *manager);
+void                stats_page_add_tpm   (StatsPage          *stats,
+                                          Tpm2               *tpm2,
+                                          MessageQueue       *queue);
+gboolean            stats_page_open      (StatsPage          *stats,
+                                          const gchar        *path,
+                                          GError            **error);
+void                stats_page_update    (StatsPage          *stats);
+const stats_page_t* stats_page_map       (const gchar        *path,
+                                          GError            **error);
+void                stats_page_unmap     (const stats_page_t *page);
+gboolean            stats_page_snapshot  (const stats_page_t *page,
+                                          stats_page_t       *copy);
+
+G_END_DECLS
+#endif /* STATS_PAGE_H */
@@ -5,18 +5,55 @@
 #ifndef TABRMD_DEFAULTS_H
 #define TABRMD_DEFAULTS_H
 
+/* time an abandoned session is kept for, in seconds */
+#define TABRMD_ABANDONED_TIMEOUT_DEFAULT 300
+#define TABRMD_ABANDONED_TIMEOUT_MAX 86400
+/* channels a client may open on one connection, see TABRMD_CONTROL_SET_CHANNEL */
+#define TABRMD_CHANNELS_MAX_DEFAULT 16
+#define TABRMD_CHANNELS_MAX 255
 #define TABRMD_CONNECTIONS_MAX_DEFAULT 27
-#define TABRMD_CONNECTION_MAX 100
+#define TABRMD_CONNECTION_MAX 16384
+#define TABRMD_CREATE_CONNECTIONS_MAX 16U
 #define TABRMD_DBUS_NAME_DEFAULT "com.intel.tss2.Tabrmd"
 #define TABRMD_DBUS_TYPE_DEFAULT G_BUS_TYPE_SYSTEM
 #define TABRMD_DBUS_PATH "/com/intel/tss2/Tabrmd/Tcti"
 #define TABRMD_DBUS_METHOD_CREATE_CONNECTION "CreateConnection"
+#define TABRMD_DBUS_METHOD_CREATE_CONNECTION_ON_TPM "CreateConnectionOnTpm"
+#define TABRMD_DBUS_METHOD_CREATE_CONNECTION_SHM "CreateConnectionShm"
+#define TABRMD_DBUS_METHOD_CREATE_CONNECTION_TAGGED "CreateConnectionTagged"
+#define TABRMD_DBUS_METHOD_CREATE_CONNECTION_SEQPACKET "CreateConnectionSeqpacket"
+#define TABRMD_DBUS_METHOD_CREATE_CONNECTIONS "CreateConnections"
 #define TABRMD_DBUS_METHOD_CANCEL "Cancel"
+#define TABRMD_DBUS_METHOD_LEASE "Lease"
 #define TABRMD_ERROR tabrmd_error_quark ()
 #define TABRMD_ENTROPY_SRC_DEFAULT "/dev/urandom"
+/* file descriptors needed for everything but the client connections */
+#define TABRMD_FDS_RESERVED 64
+/* largest --slow-command threshold, in milliseconds */
+#define TABRMD_SLOW_COMMAND_MAX 3600000
+/* longest time a connection may be left unused, in seconds */
+#define TABRMD_IDLE_TIMEOUT_MAX 604800
+/* longest time between two canary probes, in seconds */
+#define TABRMD_CANARY_INTERVAL_MAX 3600
+/* longest a context may go unused before it's evicted while idle, in ms */
+#define TABRMD_EVICT_IDLE_MAX 3600000
+/* longest --tpm-timeout, in milliseconds */
+#define TABRMD_TPM_TIMEOUT_MAX 3600000
+/* longest lease on a TPM a client may hold, in milliseconds */
+#define TABRMD_LEASE_TIME_MAX_DEFAULT 1000
+#define TABRMD_LEASE_TIME_MAX 60000
+/* smallest memory limit in KiB: a command and response of UTIL_BUF_MAX */
+#define TABRMD_MEMORY_MIN_KIB 64
 #define TABRMD_SESSIONS_MAX_DEFAULT 4
 #define TABRMD_SESSIONS_MAX 64
+/* largest pools of objects and sessions shared past the per connection limits */
+#define TABRMD_SHARED_MAX 4096
+/* most transient objects a connection may keep resident in the TPM */
+#define TABRMD_PINNED_MAX 8
+/* size of sun_path in struct sockaddr_un */
+#define TABRMD_SOCKET_ADDRESS_MAX 108
 #define TABRMD_TCTI_CONF_DEFAULT "device:/dev/tpm0"
+#define TABRMD_TPMS_MAX 8
 #define TABRMD_TRANSIENT_MAX_DEFAULT 27
 #define TABRMD_TRANSIENT_MAX 100
 
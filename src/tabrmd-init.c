@@ -1,18 +1,27 @@
+#include <errno.h>
 #include <glib-unix.h>
 #include <glib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sysexits.h>
 
 #include <tss2/tss2_tctildr.h>
 
-#include <tss2/tss2_tctildr.h>
-
 #include "tpm2.h"
+#include "tpm2-cache.h"
+#include "buffer-pool.h"
+#include "checkpoint.h"
 #include "command-source.h"
+#include "fair-queue.h"
+#include "flight-recorder.h"
 #include "logging.h"
 #include "ipc-frontend.h"
 #include "ipc-frontend-dbus.h"
+#include "ipc-frontend-socket.h"
+#include "ipc-frontend-vtpm.h"
+#include "metrics.h"
 #include "random.h"
 #include "resource-manager.h"
 #include "response-sink.h"
@@ -46,6 +55,29 @@ signal_handler (gpointer user_data)
 
     return G_SOURCE_CONTINUE;
 }
+/*
+ * Handler for SIGUSR1: write the flight recorder to the --flight-dump
+ * file 'user_data', or log it if there's none.
+ */
+static gboolean
+flight_dump_handler (gpointer user_data)
+{
+    const gchar *path = (const gchar*)user_data;
+    GError *error = NULL;
+    gchar *text;
+
+    if (path == NULL) {
+        text = flight_recorder_format ();
+        g_message ("flight recorder:\n%s", text);
+        g_free (text);
+    } else if (!flight_recorder_dump (path, &error)) {
+        g_warning ("failed to write flight recorder: %s", error->message);
+        g_error_free (error);
+    } else {
+        g_message ("flight recorder written to %s", path);
+    }
+    return G_SOURCE_CONTINUE;
+}
 
 /*
  * This function is a callback invoked by the IpcFrontend object
@@ -64,30 +96,211 @@ on_ipc_frontend_disconnect (IpcFrontend *ipc_frontend,
     if (data->loop)
         main_loop_quit (data->loop);
 }
+/*
+ * GSourceFunc run by the main loop while --idle-timeout is set. It closes
+ * the connections that haven't been used for that long.
+ */
+static gboolean
+close_idle_connections (gpointer user_data)
+{
+    gmain_data_t *data = (gmain_data_t*)user_data;
+
+    connection_manager_close_idle (data->command_source->connection_manager,
+                                   data->options.idle_timeout);
+    return G_SOURCE_CONTINUE;
+}
+/*
+ * GSourceFunc run by the main loop while --evict-idle is set. It has each
+ * ResourceManager evict the contexts that went cold once it's idle.
+ */
+static gboolean
+evict_idle_contexts (gpointer user_data)
+{
+    gmain_data_t *data = (gmain_data_t*)user_data;
+    guint i;
+
+    for (i = 0; i < data->tpm_count; ++i) {
+        resource_manager_evict_idle_request (data->resource_managers [i]);
+    }
+    return G_SOURCE_CONTINUE;
+}
+/*
+ * This function is a callback invoked by the IpcFrontend object when a
+ * client asks for its outstanding commands to be canceled. The
+ * ResourceManager owns the queue of pending commands and knows what the
+ * TPM is working on so it does the work.
+ */
+guint
+on_ipc_frontend_cancel (IpcFrontend  *ipc_frontend,
+                        Connection   *connection,
+                        gmain_data_t *data)
+{
+    guint tpm = connection_get_tpm (connection);
+    UNUSED_PARAM (ipc_frontend);
+
+    if (tpm >= data->tpm_count || data->resource_managers [tpm] == NULL) {
+        return TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+    }
+    return resource_manager_cancel (data->resource_managers [tpm], connection);
+}
+/*
+ * Cancel requested in band with a control frame on the connection, see
+ * TABRMD_CONTROL_TAG. It's handled like one from the IpcFrontend.
+ */
+static TSS2_RC
+on_command_source_cancel (Connection *connection,
+                          gpointer    user_data)
+{
+    return on_ipc_frontend_cancel (NULL, connection, (gmain_data_t*)user_data);
+}
+/*
+ * This function is a callback invoked by the IpcFrontend object when a
+ * client asks for a lease on its TPM, or to release it when 'commands'
+ * is 0. The lease is cut to the --max-lease-time of the daemon.
+ */
+guint
+on_ipc_frontend_lease (IpcFrontend  *ipc_frontend,
+                       Connection   *connection,
+                       guint         commands,
+                       guint         timeout,
+                       gmain_data_t *data)
+{
+    guint tpm = connection_get_tpm (connection);
+    UNUSED_PARAM (ipc_frontend);
+
+    if (tpm >= data->tpm_count || data->resource_managers [tpm] == NULL) {
+        return TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+    }
+    if (commands != 0 && data->options.lease_time_max == 0) {
+        return TSS2_RESMGR_RC_NOT_PERMITTED;
+    }
+    timeout = MIN (timeout, data->options.lease_time_max);
+    return resource_manager_lease (data->resource_managers [tpm],
+                                   connection,
+                                   commands,
+                                   (gint64)timeout * G_TIME_SPAN_MILLISECOND);
+}
+/*
+ * Apply the Tunables sent with the Tune method. The rate limits and the
+ * quota pool are daemon wide and guarded by locks of their own, the rest
+ * is applied by each ResourceManager on its thread.
+ */
+static TSS2_RC
+on_ipc_frontend_tune (IpcFrontend  *ipc_frontend,
+                      Tunables     *tunables,
+                      gmain_data_t *data)
+{
+    GHashTableIter iter;
+    gpointer uid, rate;
+    guint i, value;
+    UNUSED_PARAM (ipc_frontend);
+
+    if (tunables_get (tunables, TUNABLE_RATE_LIMIT, &value)) {
+        command_source_set_rate_limit (data->command_source, value);
+    }
+    if (tunables->uid_rate_limits != NULL) {
+        g_hash_table_iter_init (&iter, tunables->uid_rate_limits);
+        while (g_hash_table_iter_next (&iter, &uid, &rate)) {
+            command_source_set_uid_rate_limit (data->command_source,
+                                               GPOINTER_TO_UINT (uid),
+                                               GPOINTER_TO_UINT (rate));
+        }
+    }
+    if (tunables_get (tunables, TUNABLE_SHARED_TRANSIENTS, &value)) {
+        quota_pool_set_headroom (data->quota_pool,
+                                 QUOTA_POOL_TRANSIENTS,
+                                 value);
+    }
+    if (tunables_get (tunables, TUNABLE_SHARED_SESSIONS, &value)) {
+        quota_pool_set_headroom (data->quota_pool,
+                                 QUOTA_POOL_SESSIONS,
+                                 value);
+    }
+    for (i = 0; i < data->tpm_count; ++i) {
+        if (data->resource_managers [i] != NULL) {
+            resource_manager_tune (data->resource_managers [i], tunables);
+        }
+    }
+    g_info ("%s: parameters changed", __func__);
+    return TSS2_RC_SUCCESS;
+}
+static void
+thread_stop (Thread *thread)
+{
+    if (thread->thread_id != 0) {
+        thread_cancel (thread);
+        thread_join (thread);
+    }
+}
 static void
 thread_cleanup (Thread **thread)
 {
-    thread_cancel (*thread);
-    thread_join (*thread);
+    thread_stop (*thread);
     g_clear_object (thread);
 }
+/*
+ * Stop the pipeline and write the checkpoint for --state-dir. The
+ * ResourceManagers must be idle to save their state.
+ */
+static void
+gmain_data_checkpoint (gmain_data_t *data)
+{
+    guint i;
+
+    thread_stop (THREAD (data->command_source));
+    for (i = 0; i < data->tpm_count; ++i) {
+        thread_stop (THREAD (data->resource_managers [i]));
+        thread_stop (THREAD (data->response_sinks [i]));
+    }
+    checkpoint_save (data->options.state_dir,
+                     data->command_source->connection_manager,
+                     data->resource_managers,
+                     data->tpm_count);
+}
 void
 gmain_data_cleanup (gmain_data_t *data)
 {
     g_debug ("%s", __func__);
     Thread* thread;
+    guint i;
 
+    for (i = 0; i < TABRMD_TPMS_MAX; ++i) {
+        g_clear_object (&data->canaries [i]);
+    }
+    /* stop serving metrics before the objects they come from go away */
+    g_clear_object (&data->metrics);
+    g_clear_object (&data->stats_page);
+    g_clear_object (&data->response_page);
+    g_clear_object (&data->quota_pool);
+    /* the trace is closed once the pipeline objects drop it too */
+    g_clear_object (&data->trace);
+    g_clear_object (&data->pcap);
+    g_clear_object (&data->spans);
+    if (data->options.state_dir != NULL && data->started &&
+        !data->options.passthrough && !data->options.kernel_rm)
+    {
+        gmain_data_checkpoint (data);
+    }
+    g_clear_pointer (&data->checkpoint, g_variant_unref);
     if (data->command_source != NULL) {
         thread = THREAD (data->command_source);
         thread_cleanup (&thread);
     }
-    if (data->resource_manager != NULL) {
-        thread = THREAD (data->resource_manager);
-        thread_cleanup (&thread);
+    for (i = 0; i < TABRMD_TPMS_MAX; ++i) {
+        if (data->resource_managers [i] != NULL) {
+            thread = THREAD (data->resource_managers [i]);
+            thread_cleanup (&thread);
+            data->resource_managers [i] = NULL;
+        }
+        if (data->response_sinks [i] != NULL) {
+            thread = THREAD (data->response_sinks [i]);
+            thread_cleanup (&thread);
+            data->response_sinks [i] = NULL;
+        }
     }
-    if (data->response_sink != NULL) {
-        thread = THREAD (data->response_sink);
-        thread_cleanup (&thread);
+    if (data->vtpm_frontend != NULL) {
+        ipc_frontend_disconnect (data->vtpm_frontend);
+        g_clear_object (&data->vtpm_frontend);
     }
     if (data->ipc_frontend != NULL) {
         ipc_frontend_disconnect (data->ipc_frontend);
@@ -99,28 +312,354 @@ gmain_data_cleanup (gmain_data_t *data)
     if (data->loop != NULL) {
         main_loop_quit (data->loop);
     }
-    if (data->tpm2) {
-        g_clear_object (&data->tpm2);
-    }
 
     tabrmd_options_free(&data->options);
 }
+/*
+ * Create the part of the TPM command processing pipeline that is specific
+ * to the TPM with index 'tpm': the Tpm2 for the TCTI context, the
+ * ResourceManager and the ResponseSink. The CommandAttrs describing the
+ * commands supported by the TPM are returned through 'command_attrs'.
+ * Each TPM is brought up on its own thread: this only touches the parts
+ * of 'data' for 'tpm'.
+ * Returns 0 on success or an exit code.
+ */
+static gint
+init_tpm (gmain_data_t      *data,
+          guint              tpm,
+          TSS2_TCTI_CONTEXT *tcti_ctx,
+          CommandAttrs     **command_attrs)
+{
+    SessionList *session_list;
+    Tpm2 *tpm2;
+    Tcti *tcti;
+    TSS2_RC rc;
+    gchar *cache_path;
+    CommandDurations *durations;
+    FairQueuePolicy policy;
+    gint ret;
+
+    tcti = tcti_new (tcti_ctx);
+    tpm2 = tpm2_new (tcti);
+    g_clear_object (&tcti);
+    tpm2_set_metrics (tpm2, data->metrics);
+    tpm2_set_pcap (tpm2, data->pcap, tpm);
+    tpm2_set_timeout (tpm2, data->options.tpm_timeout);
+    *command_attrs = command_attrs_new ();
+    if (data->options.cache_dir != NULL) {
+        cache_path = g_strdup_printf ("%s/tpm%u.cache",
+                                      data->options.cache_dir,
+                                      tpm);
+        rc = tpm2_cache_init_tpm (tpm2, *command_attrs, cache_path);
+        g_free (cache_path);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_critical ("failed to initialize Tpm2 %u: 0x%" PRIx32, tpm, rc);
+            g_clear_object (command_attrs);
+            g_clear_object (&tpm2);
+            return EX_UNAVAILABLE;
+        }
+    } else {
+        rc = tpm2_init_tpm (tpm2);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_critical ("failed to initialize Tpm2 %u: 0x%" PRIx32, tpm, rc);
+            g_clear_object (command_attrs);
+            g_clear_object (&tpm2);
+            return EX_UNAVAILABLE;
+        }
+        ret = command_attrs_init_tpm (*command_attrs, tpm2);
+        if (ret != 0) {
+            g_critical ("%s: failed to initialize CommandAttribute object", __func__);
+            g_clear_object (command_attrs);
+            g_clear_object (&tpm2);
+            return EX_UNAVAILABLE;
+        }
+    }
+    session_list = session_list_new (data->options.max_sessions,
+                                     SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    session_list_set_abandoned_timeout (session_list,
+                                        data->options.abandoned_timeout);
+    data->resource_managers [tpm] = resource_manager_new (tpm2,
+                                                          session_list);
+    g_clear_object (&session_list);
+    /*
+     * Flushing everything would take the saved sessions of the checkpoint
+     * with it.
+     */
+    if (!checkpoint_restore_tpm (data->checkpoint,
+                                 tpm,
+                                 data->resource_managers [tpm],
+                                 data->command_source->connection_manager) &&
+        data->options.flush_all)
+    {
+        tpm2_flush_all_context (tpm2);
+    }
+    /* kept with any scheduler: they also tell when the TPM is degraded */
+    if (data->options.scheduler == NULL ||
+        !parse_scheduler (data->options.scheduler, &policy))
+    {
+        policy = FAIR_QUEUE_POLICY_ROUND_ROBIN;
+    }
+    durations = command_durations_new ();
+    tpm2_set_command_durations (tpm2, durations);
+    fair_queue_set_policy (FAIR_QUEUE (data->resource_managers [tpm]->in_queue),
+                           policy,
+                           durations);
+    g_object_unref (durations);
+    g_clear_object (&tpm2);
+    resource_manager_set_metrics (data->resource_managers [tpm], data->metrics);
+    resource_manager_set_quota_pool (data->resource_managers [tpm],
+                                     data->quota_pool);
+    resource_manager_set_admission (data->resource_managers [tpm],
+                                    data->options.queue_depth,
+                                    data->options.max_in_flight);
+    resource_manager_set_memory_max (data->resource_managers [tpm],
+                                     (gsize)data->options.max_connection_memory * 1024,
+                                     (gsize)data->options.max_memory * 1024);
+    if (!resource_manager_set_random_pool (data->resource_managers [tpm],
+                                           data->options.random_pool))
+    {
+        g_warning ("%s: GetRandom pool disabled for TPM %u", __func__, tpm);
+    }
+    resource_manager_set_pcr_cache (data->resource_managers [tpm],
+                                    data->options.pcr_cache);
+    resource_manager_set_primary_cache (data->resource_managers [tpm],
+                                        data->options.primary_cache);
+    if (data->options.primary_templates != NULL) {
+        gchar **template_str;
+        TPMI_RH_HIERARCHY hierarchy;
+        TPMI_ALG_PUBLIC type;
+
+        for (template_str = data->options.primary_templates;
+             *template_str;
+             ++template_str)
+        {
+            if (parse_primary_template (*template_str, &hierarchy, &type)) {
+                resource_manager_add_primary_template (data->resource_managers [tpm],
+                                                       hierarchy,
+                                                       type);
+            }
+        }
+    }
+    if (data->options.warm_up) {
+        GArray *nv_indices = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE));
+        gchar **index_str;
+        guint32 nv_index;
+
+        for (index_str = data->options.warm_up_nv;
+             index_str != NULL && *index_str;
+             ++index_str)
+        {
+            if (parse_uint32 (*index_str, &nv_index)) {
+                g_array_append_val (nv_indices, nv_index);
+            }
+        }
+        resource_manager_warm_up (data->resource_managers [tpm],
+                                  (const TPM2_HANDLE*)nv_indices->data,
+                                  nv_indices->len);
+        g_array_free (nv_indices, TRUE);
+    }
+    resource_manager_set_load_cache (data->resource_managers [tpm],
+                                     data->options.load_cache);
+    resource_manager_set_time_commands (data->resource_managers [tpm],
+                                        data->options.slow_command != 0 ||
+                                        data->spans != NULL);
+    resource_manager_set_evict_idle (data->resource_managers [tpm],
+                                     data->options.evict_idle);
+    resource_manager_set_pinned_max (data->resource_managers [tpm],
+                                     data->options.max_pinned);
+    if (data->options.passthrough) {
+        resource_manager_set_passthrough (data->resource_managers [tpm],
+                                          data->command_source->connection_manager);
+    }
+    if (data->options.spill_dir != NULL) {
+        ContextStore *store = context_store_new (data->options.spill_dir,
+                                                 CONTEXT_STORE_SIZE_MAX_DEFAULT);
+
+        if (store == NULL) {
+            g_warning ("%s: saved contexts kept in memory for TPM %u",
+                       __func__, tpm);
+        }
+        resource_manager_set_context_store (data->resource_managers [tpm],
+                                            store);
+        g_clear_object (&store);
+    }
+    fair_queue_set_affinity_burst (
+        FAIR_QUEUE (data->resource_managers [tpm]->in_queue),
+        data->options.affinity_burst);
+    fair_queue_set_locality_burst (
+        FAIR_QUEUE (data->resource_managers [tpm]->in_queue),
+        data->options.locality_burst);
+    if (data->options.uid_weights != NULL) {
+        gchar **weight_str;
+        guint32 uid;
+        guint weight;
+
+        for (weight_str = data->options.uid_weights; *weight_str; ++weight_str) {
+            if (parse_uid_weight (*weight_str, &uid, &weight)) {
+                fair_queue_set_uid_weight (
+                    FAIR_QUEUE (data->resource_managers [tpm]->in_queue),
+                    uid,
+                    weight);
+            }
+        }
+    }
+    message_queue_set_spin (data->resource_managers [tpm]->in_queue,
+                            data->options.queue_spin);
+    data->response_sinks [tpm] = response_sink_new ();
+    message_queue_set_spin (data->response_sinks [tpm]->in_queue,
+                            data->options.queue_spin);
+    response_sink_set_direct (data->response_sinks [tpm],
+                              data->options.direct_write);
+    response_sink_set_slow_threshold (data->response_sinks [tpm],
+        (gint64)data->options.slow_command * G_TIME_SPAN_MILLISECOND);
+    response_sink_set_trace (data->response_sinks [tpm], data->trace);
+    response_sink_set_spans (data->response_sinks [tpm], data->spans);
+    response_sink_set_metrics (data->response_sinks [tpm], data->metrics);
+    response_sink_set_shards (data->response_sinks [tpm],
+                              data->options.response_threads);
+    source_add_sink (SOURCE (data->resource_managers [tpm]),
+                     SINK   (data->response_sinks [tpm]));
+
+    return 0;
+}
+/*
+ * What a thread bringing up one TPM works on, see init_tpm_thread_func.
+ */
+typedef struct {
+    gmain_data_t      *data;
+    guint              tpm;
+    const gchar       *tcti_conf;
+    CommandAttrs      *command_attrs;
+    gint               ret;
+} init_tpm_data_t;
+/*
+ * GThreadFunc loading the TCTI for a TPM and bringing the TPM up with
+ * init_tpm. The exit code is left in 'ret'.
+ */
+static gpointer
+init_tpm_thread_func (gpointer user_data)
+{
+    init_tpm_data_t *init = (init_tpm_data_t*)user_data;
+    TSS2_TCTI_CONTEXT *tcti_ctx = NULL;
+    TSS2_RC rc;
+
+    rc = Tss2_TctiLdr_Initialize (init->tcti_conf, &tcti_ctx);
+    if (rc != TSS2_RC_SUCCESS || tcti_ctx == NULL) {
+        g_critical ("%s: failed to create TCTI with conf \"%s\", got RC: 0x%x",
+                    __func__, init->tcti_conf, rc);
+        init->ret = EX_IOERR;
+        return NULL;
+    }
+    /* the Tcti owns the context */
+    init->ret = init_tpm (init->data,
+                          init->tpm,
+                          tcti_ctx,
+                          &init->command_attrs);
+    /* each connection opens the kernel resource manager on its own */
+    if (init->ret == 0 && init->data->options.kernel_rm) {
+        resource_manager_set_kernel_rm (
+            init->data->resource_managers [init->tpm],
+            init->tcti_conf);
+    }
+    return NULL;
+}
+/*
+ * Each client connection holds a file descriptor. Raise the soft limit on
+ * open files, up to the hard limit, so that 'max_connections' fit. A lower
+ * limit isn't fatal: connections over it are refused by accept.
+ */
+static void
+raise_fd_limit (guint max_connections)
+{
+    struct rlimit limit;
+    rlim_t needed = (rlim_t)max_connections + TABRMD_FDS_RESERVED;
+
+    if (getrlimit (RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur >= needed) {
+        return;
+    }
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ?
+        needed : MIN (needed, limit.rlim_max);
+    if (setrlimit (RLIMIT_NOFILE, &limit) == -1) {
+        g_warning ("%s: failed to raise RLIMIT_NOFILE: %s",
+                   __func__, strerror (errno));
+        return;
+    }
+    if (limit.rlim_cur < needed) {
+        g_warning ("%s: RLIMIT_NOFILE of %ju leaves room for fewer than %u "
+                   "connections", __func__, (uintmax_t)limit.rlim_cur,
+                   max_connections);
+    }
+}
+/*
+ * Collect the --thread-cpus and --thread-priority settings for each kind of
+ * thread in the pipeline and hand them to the threads before they start.
+ * The options have been checked by parse_opts. Reactor threads are started
+ * by the CommandSource thread and inherit its settings.
+ */
+static void
+set_thread_sched (gmain_data_t *data)
+{
+    const thread_sched_t init = THREAD_SCHED_INIT_DEFAULT;
+    thread_sched_t sched [TABRMD_THREAD_COUNT], tmp;
+    TabrmdThread thread;
+    gchar **str;
+    guint i;
+
+    for (i = 0; i < TABRMD_THREAD_COUNT; ++i) {
+        sched [i] = init;
+    }
+    for (str = data->options.thread_cpus; str != NULL && *str; ++str) {
+        tmp = init;
+        if (parse_thread_cpus (*str, &thread, &tmp)) {
+            CPU_OR (&sched [thread].cpus, &sched [thread].cpus, &tmp.cpus);
+        }
+    }
+    for (str = data->options.thread_priorities; str != NULL && *str; ++str) {
+        tmp = init;
+        if (parse_thread_priority (*str, &thread, &tmp)) {
+            sched [thread].policy = tmp.policy;
+            sched [thread].priority = tmp.priority;
+            sched [thread].nice = tmp.nice;
+        }
+    }
+    thread_set_sched (THREAD (data->command_source),
+                      &sched [TABRMD_THREAD_COMMAND_SOURCE]);
+    for (i = 0; i < data->tpm_count; ++i) {
+        thread_set_sched (THREAD (data->resource_managers [i]),
+                          &sched [TABRMD_THREAD_RESOURCE_MANAGER]);
+        thread_set_sched (THREAD (data->response_sinks [i]),
+                          &sched [TABRMD_THREAD_RESPONSE_SINK]);
+    }
+}
 /*
  * This function initializes and configures all of the long-lived objects
  * in the tabrmd system. It is invoked on a thread separate from the main
  * thread as a way to get the main thread listening for connections on
- * DBus as quickly as possible. Any incoming DBus requests will block
- * on the 'init_mutex' until this thread completes but they won't be
- * timing etc. This function does X things:
+ * DBus as quickly as possible. New connections are accepted before the
+ * TPM is initialized: the commands sent on them wait until the pipeline
+ * is started. Cancel and SetLocality requests block on the 'init_mutex'
+ * until this thread completes. This function does these things:
  * - Locks the init_mutex.
- * - Registers a handler for UNIX signals for SIGINT and SIGTERM.
+ * - Registers a handler for UNIX signals for SIGINT and SIGTERM, and one
+ *   dumping the flight recorder for SIGUSR1.
  * - Seeds the RNG state from an entropy source.
- * - Creates the ConnectionManager.
- * - Creates the TCTI instance used by the Tab.
- * - Creates an tpm2 and verify the current state of the TPM.
- * - Creates and wires up the objects that make up the TPM command
- *   processing pipeline.
- * - Starts all of the threads in the command processing pipeline.
+ * - Raises the limit on open files and creates the ConnectionManager.
+ * - Creates the Metrics.
+ * - Creates the CommandSource that routes commands from each connection
+ *   to the ResourceManager for its TPM.
+ * - Restores the connections from the --state-dir checkpoint.
+ * - Connects the IpcFrontend.
+ * - For each TPM at once, each on a thread of its own, creates the TCTI
+ *   instance from the --tcti and --extra-tcti options, creates a Tpm2,
+ *   verifies the current state of the TPM and creates the
+ *   ResourceManager and ResponseSink for it, restoring the state it had
+ *   in the checkpoint.
+ * - Creates the response page if --response-page was given.
+ * - Starts all of the threads in the command processing pipeline with the
+ *   --thread-cpus and --thread-priority settings, locking memory first if
+ *   --mlock was given.
+ * - Starts serving the metrics if --metrics-socket was given and
+ *   publishing the stats page if --stats-page was.
  * - Unlocks the init_mutex.
  */
 gpointer
@@ -128,27 +667,34 @@ init_thread_func (gpointer user_data)
 {
     gmain_data_t *data = (gmain_data_t*)user_data;
     gint ret;
-    TSS2_RC rc;
-    CommandAttrs *command_attrs;
+    guint i;
+    CommandAttrs *command_attrs [TABRMD_TPMS_MAX] = { NULL };
     ConnectionManager *connection_manager = NULL;
-    SessionList *session_list;
-    Tcti *tcti = NULL;
-    TSS2_TCTI_CONTEXT *tcti_ctx = NULL;
+    const gchar *tcti_confs [TABRMD_TPMS_MAX] = { NULL };
+    init_tpm_data_t inits [TABRMD_TPMS_MAX];
+    GThread *init_threads [TABRMD_TPMS_MAX] = { NULL };
+    GError *error = NULL;
 
     g_info ("init_thread_func start");
     g_mutex_lock (&data->init_mutex);
 
-    rc = Tss2_TctiLdr_Initialize (data->options.tcti_conf, &tcti_ctx);
-    if (rc != TSS2_RC_SUCCESS || tcti_ctx == NULL) {
-        g_critical ("%s: failed to create TCTI with conf \"%s\", got RC: 0x%x",
-                    __func__, data->options.tcti_conf, rc);
-        ret = EX_IOERR;
-        goto err_out;
+    tcti_confs [0] = data->options.tcti_conf;
+    data->tpm_count = 1;
+    for (i = 0;
+         data->options.extra_tcti_confs != NULL &&
+         data->options.extra_tcti_confs [i] != NULL &&
+         data->tpm_count < TABRMD_TPMS_MAX;
+         ++i)
+    {
+        tcti_confs [data->tpm_count++] = data->options.extra_tcti_confs [i];
     }
 
     /* Setup program signals */
     if (g_unix_signal_add(SIGINT, signal_handler, data->loop) <= 0 ||
-        g_unix_signal_add(SIGTERM, signal_handler, data->loop) <= 0)
+        g_unix_signal_add(SIGTERM, signal_handler, data->loop) <= 0 ||
+        g_unix_signal_add(SIGUSR1,
+                          flight_dump_handler,
+                          data->options.flight_dump) <= 0)
     {
         g_critical ("failed to setup signal handlers");
         ret = EX_OSERR;
@@ -164,86 +710,364 @@ init_thread_func (gpointer user_data)
         goto err_out;
     }
 
+    raise_fd_limit (data->options.max_connections);
+    /*
+     * Before the TPMs: the scratch buffer each one receives its responses
+     * into comes from the pool too. Buffers come from the heap if the pool
+     * can't be locked.
+     */
+    buffer_pool_init (BUFFER_POOL_SMALL_SLOTS, BUFFER_POOL_LARGE_SLOTS);
     connection_manager = connection_manager_new(data->options.max_connections);
-    /* setup IpcFrontend */
-    data->ipc_frontend =
-        IPC_FRONTEND (ipc_frontend_dbus_new (data->options.bus,
-                                             data->options.dbus_name,
-                                             connection_manager,
-                                             data->options.max_transients,
-                                             data->random));
+    /* counted always: the D-Bus GetStats method returns them too */
+    data->metrics = metrics_new ();
+    metrics_set_connection_manager (data->metrics, connection_manager);
+    if (data->options.trace != NULL) {
+        data->trace = trace_new (data->options.trace, &error);
+        if (data->trace == NULL) {
+            g_critical ("failed to start trace: %s", error->message);
+            g_clear_error (&error);
+            ret = EX_CANTCREAT;
+            goto err_out;
+        }
+    }
+    if (data->options.pcap != NULL) {
+        data->pcap = pcap_writer_new (data->options.pcap,
+                                      data->tpm_count,
+                                      &error);
+        if (data->pcap == NULL) {
+            g_critical ("failed to start capture: %s", error->message);
+            g_clear_error (&error);
+            ret = EX_CANTCREAT;
+            goto err_out;
+        }
+    }
+    if (data->options.span_file != NULL) {
+        data->spans = span_exporter_new (data->options.span_file, &error);
+        if (data->spans == NULL) {
+            g_critical ("failed to start spans: %s", error->message);
+            g_clear_error (&error);
+            ret = EX_CANTCREAT;
+            goto err_out;
+        }
+    }
+    /*
+     * The CommandSource is created before the IpcFrontend so that it's
+     * watching connections as soon as they're created. It doesn't read
+     * from them until its thread is started: until then commands wait in
+     * the connection's socket.
+     */
+    data->command_source =
+        command_source_new_with_reactors (connection_manager,
+                                          NULL,
+                                          data->options.reactors);
+    if (data->options.io_engine != NULL) {
+        CommandSourceEngine engine;
+
+        if (parse_io_engine (data->options.io_engine, &engine) &&
+            !command_source_set_engine (data->command_source, engine))
+        {
+            g_warning ("%s: falling back to epoll for client connections",
+                       __func__);
+        }
+    }
+    if (data->options.priority_commands != NULL) {
+        gchar **str;
+        guint32 value;
+
+        for (str = data->options.priority_commands; *str; ++str) {
+            if (parse_uint32 (*str, &value)) {
+                command_source_add_priority_command (data->command_source,
+                                                     value);
+            }
+        }
+    }
+    if (data->options.priority_uids != NULL) {
+        gchar **str;
+        guint32 value;
+
+        for (str = data->options.priority_uids; *str; ++str) {
+            if (parse_uint32 (*str, &value)) {
+                command_source_add_priority_uid (data->command_source, value);
+            }
+        }
+    }
+    if (data->options.locality_uids != NULL) {
+        gchar **str;
+        guint32 value;
+
+        for (str = data->options.locality_uids; *str; ++str) {
+            if (parse_uint32 (*str, &value)) {
+                connection_allow_locality_uid (value);
+            }
+        }
+    }
+    command_source_set_rate_limit (data->command_source,
+                                   data->options.rate_limit);
+    command_source_set_pause (data->command_source,
+                              data->options.pause_reads,
+                              data->options.pause_watermark);
+    command_source_set_max_channels (data->command_source,
+                                     data->options.max_channels);
+    command_source_set_cancel_func (data->command_source,
+                                    on_command_source_cancel,
+                                    data);
+    command_source_set_trace (data->command_source, data->trace);
+    command_source_set_metrics (data->command_source, data->metrics);
+    /* an idle connection is closed within a quarter of the timeout */
+    if (data->options.idle_timeout != 0) {
+        g_timeout_add_seconds (MAX (data->options.idle_timeout / 4, 1),
+                               close_idle_connections,
+                               data);
+    }
+    if (data->options.uid_rate_limits != NULL) {
+        gchar **str;
+        guint32 uid;
+        guint rate;
+
+        for (str = data->options.uid_rate_limits; *str; ++str) {
+            if (parse_uid_rate (*str, &uid, &rate)) {
+                command_source_set_uid_rate_limit (data->command_source,
+                                                   uid,
+                                                   rate);
+            }
+        }
+    }
+    /*
+     * Connections kept by the previous instance are back before new ones
+     * are accepted so their IDs aren't handed out again.
+     */
+    if (data->options.state_dir != NULL && !data->options.passthrough &&
+        !data->options.kernel_rm)
+    {
+        data->checkpoint = checkpoint_load (data->options.state_dir);
+        checkpoint_restore_connections (data->checkpoint,
+                                        connection_manager,
+                                        data->options.max_transients,
+                                        data->tpm_count);
+    }
+    /* setup IpcFrontend: the UNIX socket if one is configured, else D-Bus */
+    if (data->options.socket != NULL) {
+        data->ipc_frontend =
+            IPC_FRONTEND (ipc_frontend_socket_new (data->options.socket,
+                                                   connection_manager,
+                                                   data->options.max_transients,
+                                                   data->random));
+    } else {
+        data->ipc_frontend =
+            IPC_FRONTEND (ipc_frontend_dbus_new (data->options.bus,
+                                                 data->options.dbus_name,
+                                                 connection_manager,
+                                                 data->options.max_transients,
+                                                 data->random));
+    }
+    g_object_set (data->ipc_frontend,
+                  "tpm-count", data->tpm_count,
+                  "max-channels", data->options.max_channels,
+                  NULL);
+    if (IS_IPC_FRONTEND_DBUS (data->ipc_frontend)) {
+        g_object_set (data->ipc_frontend, "metrics", data->metrics, NULL);
+    }
     g_signal_connect (data->ipc_frontend,
                       "disconnected",
                       (GCallback) on_ipc_frontend_disconnect,
                       data);
+    g_signal_connect (data->ipc_frontend,
+                      "cancel",
+                      (GCallback) on_ipc_frontend_cancel,
+                      data);
+    g_signal_connect (data->ipc_frontend,
+                      "lease",
+                      (GCallback) on_ipc_frontend_lease,
+                      data);
+    g_signal_connect (data->ipc_frontend,
+                      "tune",
+                      (GCallback) on_ipc_frontend_tune,
+                      data);
     ipc_frontend_connect (data->ipc_frontend,
                           &data->init_mutex);
-
-    tcti = tcti_new (tcti_ctx);
-    data->tpm2 = tpm2_new (tcti);
-    g_clear_object (&tcti);
-    rc = tpm2_init_tpm (data->tpm2);
-    if (rc != TSS2_RC_SUCCESS) {
-        ret = EX_UNAVAILABLE;
-        g_critical ("failed to initialize Tpm2: 0x%" PRIx32, rc);
-        goto err_out;
-    }
-    if (data->options.flush_all) {
-        tpm2_flush_all_context (data->tpm2);
+    /* VMs get the first TPM, their data channels are Connections like any */
+    if (data->options.vtpm_socket != NULL) {
+        data->vtpm_frontend =
+            IPC_FRONTEND (ipc_frontend_vtpm_new (data->options.vtpm_socket,
+                                                 connection_manager,
+                                                 data->options.max_transients,
+                                                 data->random));
+        g_signal_connect (data->vtpm_frontend,
+                          "disconnected",
+                          (GCallback) on_ipc_frontend_disconnect,
+                          data);
+        g_signal_connect (data->vtpm_frontend,
+                          "cancel",
+                          (GCallback) on_ipc_frontend_cancel,
+                          data);
+        ipc_frontend_connect (data->vtpm_frontend,
+                              &data->init_mutex);
     }
+    g_clear_object (&connection_manager);
+
     /*
-     * Instantiate and the objects that make up the TPM command processing
-     * pipeline.
+     * Clients can connect now. Bring up the TPMs while they do: loading
+     * the TCTIs and initializing the TPM is most of the daemon's startup
+     * time. Each TPM is brought up on a thread of its own, the first one
+     * on this thread, so startup takes as long as the slowest TPM rather
+     * than all of them together. Instantiate the objects that make up
+     * the TPM command processing pipeline: one ResourceManager and
+     * ResponseSink per TPM.
      */
-    command_attrs = command_attrs_new ();
-    ret = command_attrs_init_tpm (command_attrs, data->tpm2);
+    /* kept without headroom too: the Tune method may add some */
+    data->quota_pool = quota_pool_new (data->options.shared_transients,
+                                       data->options.shared_sessions);
+    for (i = 0; i < data->tpm_count; ++i) {
+        inits [i].data = data;
+        inits [i].tpm = i;
+        inits [i].tcti_conf = tcti_confs [i];
+        inits [i].command_attrs = NULL;
+        inits [i].ret = 0;
+    }
+    for (i = 1; i < data->tpm_count; ++i) {
+        init_threads [i] = g_thread_try_new ("tabrmd-init-tpm",
+                                             init_tpm_thread_func,
+                                             &inits [i],
+                                             &error);
+        if (init_threads [i] == NULL) {
+            g_warning ("%s: bringing up TPM %u in turn: %s",
+                       __func__, i, error->message);
+            g_clear_error (&error);
+        }
+    }
+    init_tpm_thread_func (&inits [0]);
+    ret = 0;
+    for (i = 0; i < data->tpm_count; ++i) {
+        if (init_threads [i] != NULL) {
+            g_thread_join (init_threads [i]);
+        } else if (i > 0) {
+            init_tpm_thread_func (&inits [i]);
+        }
+        command_attrs [i] = inits [i].command_attrs;
+        if (ret == 0) {
+            ret = inits [i].ret;
+        }
+    }
     if (ret != 0) {
-        g_critical ("%s: failed to initialize CommandAttribute object", __func__);
-        ret = EX_UNAVAILABLE;
         goto err_out;
     }
+    if (data->metrics != NULL) {
+        for (i = 0; i < data->tpm_count; ++i) {
+            metrics_add_queue (data->metrics,
+                               "resource_manager",
+                               i,
+                               data->resource_managers [i]->in_queue);
+            metrics_add_queue (data->metrics,
+                               "response_sink",
+                               i,
+                               data->response_sinks [i]->in_queue);
+        }
+    }
+    if (data->options.stats_page != NULL) {
+        data->stats_page = stats_page_new (connection_manager);
+        for (i = 0; i < data->tpm_count; ++i) {
+            stats_page_add_tpm (data->stats_page,
+                                data->resource_managers [i]->tpm2,
+                                data->resource_managers [i]->in_queue);
+        }
+    }
+    if (data->options.response_page != NULL) {
+        data->response_page = response_page_new (data->options.response_page,
+                                                 data->tpm_count,
+                                                 &error);
+        if (data->response_page == NULL) {
+            g_critical ("failed to publish responses: %s", error->message);
+            g_clear_error (&error);
+            ret = EX_OSERR;
+            goto err_out;
+        }
+        for (i = 0; i < data->tpm_count; ++i) {
+            resource_manager_set_response_page (data->resource_managers [i],
+                                                data->response_page,
+                                                i);
+        }
+    }
 
-    data->command_source =
-        command_source_new (connection_manager, command_attrs);
-    g_object_unref (connection_manager);
-    session_list = session_list_new (data->options.max_sessions,
-                                     SESSION_LIST_MAX_ABANDONED_DEFAULT);
-    data->resource_manager = resource_manager_new (data->tpm2,
-                                                   session_list);
-    g_clear_object (&session_list);
-    data->response_sink = response_sink_new ();
-    g_object_unref (command_attrs);
-    g_clear_object (&data->tpm2);
+    command_source_set_command_attrs (data->command_source, command_attrs [0]);
     /*
      * Wire up the TPM command processing pipeline. TPM command buffers
-     * flow from the CommandSource, to the Tab then finally back to the
-     * caller through the ResponseSink.
+     * flow from the CommandSource, to the ResourceManager for the
+     * connection's TPM then finally back to the caller through the
+     * ResponseSink.
      */
     source_add_sink (SOURCE (data->command_source),
-                     SINK   (data->resource_manager));
-    source_add_sink (SOURCE (data->resource_manager),
-                     SINK   (data->response_sink));
+                     SINK   (data->resource_managers [0]));
+    for (i = 1; i < data->tpm_count; ++i) {
+        command_source_add_tpm (data->command_source,
+                                SINK (data->resource_managers [i]),
+                                command_attrs [i]);
+    }
+    for (i = 0; i < data->tpm_count; ++i) {
+        command_source_add_queue (data->command_source,
+                                  data->resource_managers [i]->in_queue);
+    }
     /*
      * Start the TPM command processing pipeline.
      */
+    set_thread_sched (data);
+    if (data->options.mlock && mlockall (MCL_CURRENT | MCL_FUTURE) == -1) {
+        g_warning ("failed to lock memory: %s", strerror (errno));
+    }
     ret = thread_start (THREAD (data->command_source));
     if (ret != 0) {
         g_critical ("failed to start connection_source");
         ret = EX_OSERR;
         goto err_out;
     }
-    ret = thread_start (THREAD (data->resource_manager));
-    if (ret != 0) {
-        g_critical ("failed to start ResourceManager: %s", strerror (errno));
+    for (i = 0; i < data->tpm_count; ++i) {
+        ret = thread_start (THREAD (data->resource_managers [i]));
+        if (ret != 0) {
+            g_critical ("failed to start ResourceManager: %s", strerror (errno));
+            ret = EX_OSERR;
+            goto err_out;
+        }
+        ret = thread_start (THREAD (data->response_sinks [i]));
+        if (ret != 0) {
+            g_critical ("failed to start response_source");
+            ret = EX_OSERR;
+            goto err_out;
+        }
+    }
+    data->started = TRUE;
+    g_clear_pointer (&data->checkpoint, g_variant_unref);
+    if (data->options.metrics_socket != NULL &&
+        !metrics_listen (data->metrics, data->options.metrics_socket, &error))
+    {
+        g_critical ("failed to serve metrics on %s: %s",
+                    data->options.metrics_socket, error->message);
+        g_clear_error (&error);
         ret = EX_OSERR;
         goto err_out;
     }
-    ret = thread_start (THREAD (data->response_sink));
-    if (ret != 0) {
-        g_critical ("failed to start response_source");
+    if (data->stats_page != NULL &&
+        !stats_page_open (data->stats_page, data->options.stats_page, &error))
+    {
+        g_critical ("failed to publish stats: %s", error->message);
+        g_clear_error (&error);
         ret = EX_OSERR;
         goto err_out;
     }
+    for (i = 0; i < data->tpm_count && data->options.canary_interval != 0; ++i) {
+        data->canaries [i] = canary_new (connection_manager,
+                                         data->metrics,
+                                         data->random,
+                                         i);
+        canary_start (data->canaries [i], data->options.canary_interval);
+    }
+    /* a context unused for the window is evicted within half of it more */
+    if (data->options.evict_idle != 0) {
+        g_timeout_add (MAX (data->options.evict_idle / 2, 1),
+                       evict_idle_contexts,
+                       data);
+    }
+    for (i = 0; i < data->tpm_count; ++i) {
+        g_clear_object (&command_attrs [i]);
+    }
 
     g_mutex_unlock (&data->init_mutex);
     g_info ("init_thread_func done");
@@ -251,6 +1075,10 @@ init_thread_func (gpointer user_data)
     return GINT_TO_POINTER (0);
 
 err_out:
+    for (i = 0; i < TABRMD_TPMS_MAX; ++i) {
+        g_clear_object (&command_attrs [i]);
+    }
+    g_clear_object (&connection_manager);
     g_mutex_unlock (&data->init_mutex);
     g_debug ("%s: calling gmain_data_cleanup", __func__);
     gmain_data_cleanup (data);
@@ -4,12 +4,21 @@
 #include <glib.h>
 
 #include "tpm2.h"
+#include "canary.h"
 #include "command-source.h"
 #include "ipc-frontend.h"
+#include "metrics.h"
+#include "pcap-writer.h"
+#include "span-exporter.h"
+#include "quota-pool.h"
 #include "random.h"
 #include "resource-manager.h"
 #include "response-sink.h"
+#include "response-page.h"
+#include "stats-page.h"
+#include "tabrmd-defaults.h"
 #include "tabrmd-options.h"
+#include "trace.h"
 
 /*
  * Structure to hold data that we pass to the gmain loop as 'user_data'.
@@ -19,14 +28,37 @@
 typedef struct gmain_data {
     tabrmd_options_t        options;
     GMainLoop              *loop;
-    Tpm2                   *tpm2;
-    ResourceManager        *resource_manager;
+    /* one ResourceManager and ResponseSink per TPM */
+    guint                   tpm_count;
+    ResourceManager        *resource_managers [TABRMD_TPMS_MAX];
     CommandSource          *command_source;
     Random                 *random;
-    ResponseSink           *response_sink;
+    ResponseSink           *response_sinks [TABRMD_TPMS_MAX];
     GMutex                  init_mutex;
     IpcFrontend            *ipc_frontend;
     gboolean                ipc_disconnected;
+    /* NULL unless --vtpm-socket was given */
+    IpcFrontend            *vtpm_frontend;
+    /* NULL unless --metrics-socket was given */
+    Metrics                *metrics;
+    /* NULL unless --stats-page was given */
+    StatsPage              *stats_page;
+    /* NULL unless --response-page was given */
+    ResponsePage           *response_page;
+    /* shared by the TPMs, see --shared-transients and --shared-sessions */
+    QuotaPool              *quota_pool;
+    /* one per TPM, NULL unless --canary-interval was given */
+    Canary                 *canaries [TABRMD_TPMS_MAX];
+    /* NULL unless --trace was given */
+    Trace                  *trace;
+    /* NULL unless --pcap was given */
+    PcapWriter             *pcap;
+    /* NULL unless --span-file was given */
+    SpanExporter           *spans;
+    /* checkpoint left by the previous instance, NULL if there's none */
+    GVariant               *checkpoint;
+    /* the threads of the pipeline were started */
+    gboolean                started;
 } gmain_data_t;
 
 gpointer
@@ -36,5 +68,15 @@ gmain_data_cleanup (gmain_data_t *data);
 void
 on_ipc_frontend_disconnect (IpcFrontend *ipc_frontend,
                             gmain_data_t *data);
+guint
+on_ipc_frontend_cancel (IpcFrontend  *ipc_frontend,
+                        Connection   *connection,
+                        gmain_data_t *data);
+guint
+on_ipc_frontend_lease (IpcFrontend  *ipc_frontend,
+                       Connection   *connection,
+                       guint         commands,
+                       guint         timeout,
+                       gmain_data_t *data);
 
 #endif /* TABRMD_INIT_H */
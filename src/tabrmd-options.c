@@ -7,8 +7,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "command-source.h"
+#include "fair-queue.h"
 #include "logging.h"
+#include "random-pool.h"
+#include "response-sink.h"
 #include "tabrmd-options.h"
+#include "token-bucket.h"
 #include "util.h"
 
 /* work around older glib versions missing this symbol */
@@ -56,8 +61,323 @@ tabrmd_options_free(tabrmd_options_t *opts)
     g_clear_pointer(&opts->dbus_name, g_free);
     g_clear_pointer(&opts->prng_seed_file, g_free);
     g_clear_pointer(&opts->tcti_conf, g_free);
+    g_clear_pointer(&opts->extra_tcti_confs, g_strfreev);
+    g_clear_pointer(&opts->uid_weights, g_strfreev);
+    g_clear_pointer(&opts->primary_templates, g_strfreev);
+    g_clear_pointer(&opts->warm_up_nv, g_strfreev);
+    g_clear_pointer(&opts->priority_commands, g_strfreev);
+    g_clear_pointer(&opts->priority_uids, g_strfreev);
+    g_clear_pointer(&opts->locality_uids, g_strfreev);
+    g_clear_pointer(&opts->uid_rate_limits, g_strfreev);
+    g_clear_pointer(&opts->scheduler, g_free);
+    g_clear_pointer(&opts->io_engine, g_free);
+    g_clear_pointer(&opts->metrics_socket, g_free);
+    g_clear_pointer(&opts->cache_dir, g_free);
+    g_clear_pointer(&opts->socket, g_free);
+    g_clear_pointer(&opts->vtpm_socket, g_free);
+    g_clear_pointer(&opts->spill_dir, g_free);
+    g_clear_pointer(&opts->state_dir, g_free);
+    g_clear_pointer(&opts->stats_page, g_free);
+    g_clear_pointer(&opts->response_page, g_free);
+    g_clear_pointer(&opts->flight_dump, g_free);
+    g_clear_pointer(&opts->trace, g_free);
+    g_clear_pointer(&opts->pcap, g_free);
+    g_clear_pointer(&opts->span_file, g_free);
+    g_clear_pointer(&opts->thread_cpus, g_strfreev);
+    g_clear_pointer(&opts->thread_priorities, g_strfreev);
+}
+/*
+ * Parse a 32 bit unsigned integer in decimal, hex (0x prefix) or octal
+ * (0 prefix).
+ * Returns TRUE on success, FALSE if the string is malformed.
+ */
+gboolean
+parse_uint32 (const gchar *str,
+              guint32     *value)
+{
+    gchar *end = NULL;
+    guint64 tmp;
+
+    g_assert (str && value);
+    tmp = g_ascii_strtoull (str, &end, 0);
+    if (end == str || *end != '\0' || tmp > G_MAXUINT32) {
+        return FALSE;
+    }
+    *value = (guint32)tmp;
+    return TRUE;
+}
+/*
+ * Parse a string of the form "UID:VALUE" with VALUE between 'min' and
+ * 'max'.
+ */
+static gboolean
+parse_uid_value (const gchar *str,
+                 guint32     *uid,
+                 guint       *number,
+                 guint        min,
+                 guint        max)
+{
+    gchar *end = NULL;
+    guint64 value;
+
+    g_assert (str && uid && number);
+    value = g_ascii_strtoull (str, &end, 10);
+    if (end == str || *end != ':' || value >= G_MAXUINT32) {
+        return FALSE;
+    }
+    *uid = (guint32)value;
+    str = end + 1;
+    value = g_ascii_strtoull (str, &end, 10);
+    if (end == str || *end != '\0' || value < min || value > max) {
+        return FALSE;
+    }
+    *number = (guint)value;
+    return TRUE;
+}
+/*
+ * Parse a scheduling weight of the form "UID:WEIGHT". The weight must be
+ * between 1 and FAIR_QUEUE_WEIGHT_MAX.
+ * Returns TRUE on success, FALSE if the string is malformed.
+ */
+gboolean
+parse_uid_weight (const gchar *str,
+                  guint32     *uid,
+                  guint       *weight)
+{
+    return parse_uid_value (str, uid, weight, 1, FAIR_QUEUE_WEIGHT_MAX);
+}
+/*
+ * Parse a rate limit of the form "UID:RATE". The rate is in commands per
+ * second and must be at most TOKEN_BUCKET_RATE_MAX. A rate of 0 exempts
+ * the UID from the default limit.
+ * Returns TRUE on success, FALSE if the string is malformed.
+ */
+gboolean
+parse_uid_rate (const gchar *str,
+                guint32     *uid,
+                guint       *rate)
+{
+    return parse_uid_value (str, uid, rate, 0, TOKEN_BUCKET_RATE_MAX);
+}
+/*
+ * Parse a primary template of the form "HIERARCHY:TYPE": "owner",
+ * "endorsement", "platform" or "null" and "rsa2048" or "ecc256".
+ * Returns TRUE on success, FALSE if either name is unknown.
+ */
+gboolean
+parse_primary_template (const gchar       *str,
+                        TPMI_RH_HIERARCHY *hierarchy,
+                        TPMI_ALG_PUBLIC   *type)
+{
+    const gchar *sep;
+    gsize len;
+
+    g_assert (str && hierarchy && type);
+    sep = strchr (str, ':');
+    if (sep == NULL) {
+        return FALSE;
+    }
+    len = sep - str;
+    if (len == strlen ("owner") && strncmp (str, "owner", len) == 0) {
+        *hierarchy = TPM2_RH_OWNER;
+    } else if (len == strlen ("endorsement") &&
+               strncmp (str, "endorsement", len) == 0) {
+        *hierarchy = TPM2_RH_ENDORSEMENT;
+    } else if (len == strlen ("platform") &&
+               strncmp (str, "platform", len) == 0) {
+        *hierarchy = TPM2_RH_PLATFORM;
+    } else if (len == strlen ("null") && strncmp (str, "null", len) == 0) {
+        *hierarchy = TPM2_RH_NULL;
+    } else {
+        return FALSE;
+    }
+    if (g_strcmp0 (sep + 1, "rsa2048") == 0) {
+        *type = TPM2_ALG_RSA;
+    } else if (g_strcmp0 (sep + 1, "ecc256") == 0) {
+        *type = TPM2_ALG_ECC;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * Parse the name of a FairQueuePolicy: "round-robin", "shortest-first" or
+ * "fifo".
+ * Returns TRUE on success, FALSE if the name is unknown.
+ */
+gboolean
+parse_scheduler (const gchar     *str,
+                 FairQueuePolicy *policy)
+{
+    g_assert (str && policy);
+    if (g_strcmp0 (str, "round-robin") == 0) {
+        *policy = FAIR_QUEUE_POLICY_ROUND_ROBIN;
+    } else if (g_strcmp0 (str, "shortest-first") == 0) {
+        *policy = FAIR_QUEUE_POLICY_SHORTEST_FIRST;
+    } else if (g_strcmp0 (str, "fifo") == 0) {
+        *policy = FAIR_QUEUE_POLICY_FIFO;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * Parse the name of a CommandSourceEngine: "epoll" or "io_uring". The
+ * latter is only known when the daemon is built with liburing.
+ * Returns TRUE on success, FALSE if the name is unknown.
+ */
+gboolean
+parse_io_engine (const gchar         *str,
+                 CommandSourceEngine *engine)
+{
+    g_assert (str && engine);
+    if (g_strcmp0 (str, "epoll") == 0) {
+        *engine = COMMAND_SOURCE_ENGINE_EPOLL;
+#ifdef HAVE_LIBURING
+    } else if (g_strcmp0 (str, "io_uring") == 0) {
+        *engine = COMMAND_SOURCE_ENGINE_IO_URING;
+#endif
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * A TCTI conf suits --kernel-rm if it's for the device TCTI on one of the
+ * kernel resource manager's /dev/tpmrm devices: each Tss2_TctiLdr_Initialize
+ * with it opens a device with a virtualized view of its own.
+ */
+static gboolean
+tcti_conf_is_kernel_rm (const gchar *conf)
+{
+    return conf != NULL &&
+        (g_str_has_prefix (conf, "device:/dev/tpmrm") ||
+         g_str_has_prefix (conf, "libtss2-tcti-device.so.0:/dev/tpmrm"));
+}
+/*
+ * Parse the thread name at the start of 'str': "command-source",
+ * "resource-manager" or "response-sink" followed by a ':'. '*rest' is set
+ * to what follows the ':'.
+ */
+static gboolean
+parse_thread_name (const gchar   *str,
+                   TabrmdThread  *thread,
+                   const gchar  **rest)
+{
+    static const gchar *names [TABRMD_THREAD_COUNT] = {
+        [TABRMD_THREAD_COMMAND_SOURCE]   = "command-source",
+        [TABRMD_THREAD_RESOURCE_MANAGER] = "resource-manager",
+        [TABRMD_THREAD_RESPONSE_SINK]    = "response-sink",
+    };
+    size_t len;
+    guint i;
+
+    for (i = 0; i < TABRMD_THREAD_COUNT; ++i) {
+        len = strlen (names [i]);
+        if (strncmp (str, names [i], len) == 0 && str [len] == ':') {
+            *thread = (TabrmdThread)i;
+            *rest = &str [len + 1];
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+/*
+ * Parse a CPU affinity of the form "THREAD:CPUS" where CPUS is a comma
+ * separated list of CPU numbers and ranges like "0,2-3". The CPUs are
+ * added to the 'cpus' set in 'sched'.
+ * Returns TRUE on success, FALSE if the string is malformed.
+ */
+gboolean
+parse_thread_cpus (const gchar    *str,
+                   TabrmdThread   *thread,
+                   thread_sched_t *sched)
+{
+    gchar *end = NULL;
+    guint64 first, last;
+
+    g_assert (str && thread && sched);
+    if (!parse_thread_name (str, thread, &str)) {
+        return FALSE;
+    }
+    do {
+        first = g_ascii_strtoull (str, &end, 10);
+        if (end == str || first >= CPU_SETSIZE) {
+            return FALSE;
+        }
+        last = first;
+        if (*end == '-') {
+            str = end + 1;
+            last = g_ascii_strtoull (str, &end, 10);
+            if (end == str || last >= CPU_SETSIZE || last < first) {
+                return FALSE;
+            }
+        }
+        for (; first <= last; ++first) {
+            CPU_SET (first, &sched->cpus);
+        }
+        str = end + 1;
+    } while (*end == ',');
+    return *end == '\0';
+}
+/*
+ * Parse a priority of the form "THREAD:fifo:PRIORITY" for the SCHED_FIFO
+ * real-time policy or "THREAD:nice:VALUE" for a nice value.
+ * Returns TRUE on success, FALSE if the string is malformed.
+ */
+gboolean
+parse_thread_priority (const gchar    *str,
+                       TabrmdThread   *thread,
+                       thread_sched_t *sched)
+{
+    gchar *end = NULL;
+    gint64 value;
+
+    g_assert (str && thread && sched);
+    if (!parse_thread_name (str, thread, &str)) {
+        return FALSE;
+    }
+    if (g_str_has_prefix (str, "fifo:")) {
+        value = g_ascii_strtoll (&str [5], &end, 10);
+        if (end == &str [5] || *end != '\0' ||
+            value < sched_get_priority_min (SCHED_FIFO) ||
+            value > sched_get_priority_max (SCHED_FIFO)) {
+            return FALSE;
+        }
+        sched->policy = SCHED_FIFO;
+        sched->priority = (gint)value;
+    } else if (g_str_has_prefix (str, "nice:")) {
+        value = g_ascii_strtoll (&str [5], &end, 10);
+        if (end == &str [5] || *end != '\0' || value < -20 || value > 19) {
+            return FALSE;
+        }
+        sched->policy = SCHED_OTHER;
+        sched->nice = (gint)value;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
 }
 
+/*
+ * Check that each string in the NULL terminated array 'strv' is a valid
+ * 32 bit unsigned integer. 'name' is the option used in error messages.
+ */
+static gboolean
+parse_uint32_array (gchar       **strv,
+                    const gchar  *name)
+{
+    guint32 value;
+
+    for (; strv != NULL && *strv != NULL; ++strv) {
+        if (!parse_uint32 (*strv, &value)) {
+            g_critical ("%s must be an unsigned 32 bit integer, got \"%s\"",
+                        name, *strv);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
 /**
  * This function parses the parameter argument vector and populates the
  * parameter 'options' structure with data needed to configure the tabrmd.
@@ -83,7 +403,7 @@ parse_opts (gint argc,
           "Name for daemon to \"own\" on the D-Bus",
           TABRMD_DBUS_NAME_DEFAULT },
         { "logger", 'l', 0, G_OPTION_ARG_STRING, &logger_name,
-          "The name of desired logger, stdout is default.", "[stdout|syslog]"},
+          "The name of desired logger, stdout is default.", "[stdout|syslog|journal]"},
         { "session", 's', 0, G_OPTION_ARG_NONE, &session_bus,
           "Connect to the session bus (system bus is default).", NULL },
         { "flush-all", 'f', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
@@ -106,6 +426,78 @@ parse_opts (gint argc,
         { "allow-root", 'o', 0, G_OPTION_ARG_NONE,
           &options->allow_root,
           "Allow the daemon to run as root, which is not recommended", NULL },
+        {
+            .long_name       = "weight",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_STRING_ARRAY,
+            .arg_data        = &options->uid_weights,
+            .description     = "Number of commands a client with the given UID may send each scheduling round. May be repeated.",
+            .arg_description = "uid:weight",
+        },
+        {
+            .long_name       = "priority-command",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_STRING_ARRAY,
+            .arg_data        = &options->priority_commands,
+            .description     = "Send commands with this command code to the TPM ahead of other queued commands. May be repeated.",
+            .arg_description = "command-code",
+        },
+        {
+            .long_name       = "priority-uid",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_STRING_ARRAY,
+            .arg_data        = &options->priority_uids,
+            .description     = "Send commands from clients with this UID to the TPM ahead of other queued commands. May be repeated.",
+            .arg_description = "uid",
+        },
+        {
+            .long_name       = "locality-uid",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_STRING_ARRAY,
+            .arg_data        = &options->locality_uids,
+            .description     = "Allow clients with this UID, besides root, to send commands at a locality above 0. May be repeated.",
+            .arg_description = "uid",
+        },
+        {
+            .long_name       = "reactors",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->reactors,
+            .description     = "Read client commands with this many epoll threads instead of the main loop.",
+            .arg_description = "count",
+        },
+        {
+            .long_name       = "io-engine",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_STRING,
+            .arg_data        = &options->io_engine,
+            .description     = "How the reactor threads read client commands. Implies one reactor if --reactors isn't set.",
+            .arg_description = "[epoll|io_uring]",
+        },
+        {
+            .long_name       = "pause-reads",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_NONE,
+            .arg_data        = &options->pause_reads,
+            .description     = "Stop reading a connection until the responses to its commands are out. Implies one reactor if --reactors isn't set.",
+            .arg_description = NULL,
+        },
+        {
+            .long_name       = "pause-watermark",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->pause_watermark,
+            .description     = "Stop reading a connection with commands in flight while this many commands are queued for its TPM. Implies one reactor if --reactors isn't set.",
+            .arg_description = "count",
+        },
         {
             .long_name       = "tcti",
             .short_name      = 't',
@@ -115,6 +507,438 @@ parse_opts (gint argc,
             .description     = "TCTI configuration string. See tpm2-abrmd (8) for search rules.",
             .arg_description = "tcti-conf",
         },
+        {
+            .long_name       = "extra-tcti",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_STRING_ARRAY,
+            .arg_data        = &options->extra_tcti_confs,
+            .description     = "TCTI configuration string for an additional TPM. May be repeated.",
+            .arg_description = "tcti-conf",
+        },
+        {
+            .long_name       = "metrics-socket",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_FILENAME,
+            .arg_data        = &options->metrics_socket,
+            .description     = "Serve metrics over HTTP on a UNIX socket at this path.",
+            .arg_description = "path",
+        },
+        {
+            .long_name       = "slow-command",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->slow_command,
+            .description     = "Log commands that take this many milliseconds or more, with the time spent in each phase. 0 to log none.",
+            .arg_description = "ms",
+        },
+        {
+            .long_name       = "tpm-timeout",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->tpm_timeout,
+            .description     = "Cancel commands the TPM hasn't answered after this many milliseconds, or longer for commands known to be slow. 0 to wait for as long as it takes.",
+            .arg_description = "ms",
+        },
+        {
+            .long_name       = "socket",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_FILENAME,
+            .arg_data        = &options->socket,
+            .description     = "Accept clients on a UNIX socket at this path, or with this name in the abstract namespace when prefixed with '@', instead of the D-Bus.",
+            .arg_description = "address",
+        },
+        {
+            .long_name       = "vtpm-socket",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_FILENAME,
+            .arg_data        = &options->vtpm_socket,
+            .description     = "Accept QEMU's TPM emulator backend on a UNIX socket at this path, or with this name in the abstract namespace when prefixed with '@'.",
+            .arg_description = "address",
+        },
+        {
+            .long_name       = "cache-dir",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_FILENAME,
+            .arg_data        = &options->cache_dir,
+            .description     = "Cache the TPM properties read at startup in this directory.",
+            .arg_description = "path",
+        },
+        {
+            .long_name       = "queue-depth",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->queue_depth,
+            .description     = "Refuse commands with TSS2_RESMGR_RC_RETRY once this many are queued for a TPM. 0 for no limit.",
+            .arg_description = "count",
+        },
+        {
+            .long_name       = "max-in-flight",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->max_in_flight,
+            .description     = "Refuse commands with TSS2_RESMGR_RC_RETRY from a connection that has this many queued or executing. 0 for no limit.",
+            .arg_description = "count",
+        },
+        {
+            .long_name       = "max-connection-memory",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->max_connection_memory,
+            .description     = "Refuse commands from a connection holding more than this many KiB of commands, responses and saved contexts. 0 for no limit.",
+            .arg_description = "KiB",
+        },
+        {
+            .long_name       = "max-memory",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->max_memory,
+            .description     = "Refuse commands while all connections hold more than this many KiB of commands, responses and saved contexts. 0 for no limit.",
+            .arg_description = "KiB",
+        },
+        {
+            .long_name       = "rate-limit",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->rate_limit,
+            .description     = "Refuse commands with TSS2_RESMGR_RC_RETRY from a UID that sends more than this many per second. 0 for no limit.",
+            .arg_description = "rate",
+        },
+        {
+            .long_name       = "uid-rate-limit",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_STRING_ARRAY,
+            .arg_data        = &options->uid_rate_limits,
+            .description     = "Rate limit in commands per second for clients with the given UID, 0 for none. May be repeated.",
+            .arg_description = "uid:rate",
+        },
+        {
+            .long_name       = "scheduler",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_STRING,
+            .arg_data        = &options->scheduler,
+            .description     = "How queued commands of the same priority are ordered, round-robin is the default.",
+            .arg_description = "[round-robin|shortest-first|fifo]",
+        },
+        {
+            .long_name       = "affinity-burst",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->affinity_burst,
+            .description     = "Serve up to this many commands in a row from the connection whose contexts are loaded while others wait. 0 to disable.",
+            .arg_description = "count",
+        },
+        {
+            .long_name       = "locality-burst",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->locality_burst,
+            .description     = "Serve up to this many commands in a row at the current locality while commands at another wait. 0 to disable.",
+            .arg_description = "count",
+        },
+        {
+            .long_name       = "max-lease-time",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->lease_time_max,
+            .description     = "Longest time in milliseconds a client may hold an exclusive lease on the TPM. 0 to refuse leases.",
+            .arg_description = "ms",
+        },
+        {
+            .long_name       = "direct-write",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_NONE,
+            .arg_data        = &options->direct_write,
+            .description     = "Write responses to clients from the resource manager thread when their sockets take them at once.",
+            .arg_description = NULL,
+        },
+        {
+            .long_name       = "response-threads",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->response_threads,
+            .description     = "Write responses to clients of each TPM with this many threads, each serving its own share of the connections.",
+            .arg_description = "count",
+        },
+        {
+            .long_name       = "random-pool",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->random_pool,
+            .description     = "Answer small GetRandom commands from a pool of this many bytes fetched from the TPM while it's idle. 0 to disable.",
+            .arg_description = "bytes",
+        },
+        {
+            .long_name       = "pcr-cache",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_NONE,
+            .arg_data        = &options->pcr_cache,
+            .description     = "Answer PCR_Read commands from earlier responses until a command sent through the daemon changes the PCRs.",
+            .arg_description = NULL,
+        },
+        {
+            .long_name       = "passthrough",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_NONE,
+            .arg_data        = &options->passthrough,
+            .description     = "Send the commands of a client that has the TPM to itself as they are, without virtualizing its objects and sessions.",
+            .arg_description = NULL,
+        },
+        {
+            .long_name       = "kernel-rm",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_NONE,
+            .arg_data        = &options->kernel_rm,
+            .description     = "Leave virtualization to the kernel resource manager: each client gets its own file descriptor on the /dev/tpmrm device of the TCTI.",
+            .arg_description = NULL,
+        },
+        {
+            .long_name       = "primary-cache",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_NONE,
+            .arg_data        = &options->primary_cache,
+            .description     = "Load a saved copy of the primary object created by an identical earlier CreatePrimary instead of creating it again.",
+            .arg_description = NULL,
+        },
+        {
+            .long_name       = "primary-template",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_STRING_ARRAY,
+            .arg_data        = &options->primary_templates,
+            .description     = "Create the primary for this storage key template while the TPM is idle after startup and keep it for --primary-cache. May be repeated.",
+            .arg_description = "owner|endorsement|platform|null:rsa2048|ecc256",
+        },
+        {
+            .long_name       = "warm-up",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_NONE,
+            .arg_data        = &options->warm_up,
+            .description     = "Fill the GetCapability, ReadPublic and NV caches while the TPM is idle after startup.",
+            .arg_description = NULL,
+        },
+        {
+            .long_name       = "warm-up-nv",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_STRING_ARRAY,
+            .arg_data        = &options->warm_up_nv,
+            .description     = "Read this NV index, such as an EK certificate, into the NV cache during --warm-up. May be repeated.",
+            .arg_description = "nv-index",
+        },
+        {
+            .long_name       = "load-cache",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_NONE,
+            .arg_data        = &options->load_cache,
+            .description     = "Load a saved copy of the object loaded by an identical earlier Load under the same parent instead of loading its blobs again.",
+            .arg_description = NULL,
+        },
+        {
+            .long_name       = "idle-timeout",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->idle_timeout,
+            .description     = "Close connections the client hasn't completed a command on for this many seconds, whether it's silent or sending a command too slowly. 0 to keep them open.",
+            .arg_description = "seconds",
+        },
+        {
+            .long_name       = "shared-transients",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->shared_transients,
+            .description     = "Transient objects connections at their max-transients may borrow between them. 0 for none.",
+            .arg_description = "count",
+        },
+        {
+            .long_name       = "shared-sessions",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->shared_sessions,
+            .description     = "Sessions connections at their max-sessions may borrow between them. 0 for none.",
+            .arg_description = "count",
+        },
+        {
+            .long_name       = "max-pinned",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->max_pinned,
+            .description     = "Transient objects a connection may ask to keep resident in the TPM. 0 for none.",
+            .arg_description = "count",
+        },
+        {
+            .long_name       = "max-channels",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->max_channels,
+            .description     = "Channels a client may open on one connection, each with its own objects and sessions. 0 for none.",
+            .arg_description = "count",
+        },
+        {
+            .long_name       = "canary-interval",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->canary_interval,
+            .description     = "Send a ReadClock to each TPM through the daemon every this many seconds and record its latency. 0 to send none.",
+            .arg_description = "seconds",
+        },
+        {
+            .long_name       = "evict-idle",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->evict_idle,
+            .description     = "Save and flush the objects and sessions left in the TPM once unused for this many milliseconds, while the TPM is idle. 0 to only evict when the TPM is full.",
+            .arg_description = "ms",
+        },
+        {
+            .long_name       = "abandoned-timeout",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->abandoned_timeout,
+            .description     = "Flush sessions left by closed connections that aren't claimed within this many seconds. 0 to keep them.",
+            .arg_description = "seconds",
+        },
+        {
+            .long_name       = "spill-dir",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_FILENAME,
+            .arg_data        = &options->spill_dir,
+            .description     = "Move the saved contexts of idle connections to a file in this directory.",
+            .arg_description = "path",
+        },
+        {
+            .long_name       = "state-dir",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_FILENAME,
+            .arg_data        = &options->state_dir,
+            .description     = "Keep connections, objects and sessions across a restart with a checkpoint in this directory.",
+            .arg_description = "path",
+        },
+        {
+            .long_name       = "stats-page",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_FILENAME,
+            .arg_data        = &options->stats_page,
+            .description     = "Publish live statistics for tabrmd-top in a shared memory file at this path.",
+            .arg_description = "path",
+        },
+        {
+            .long_name       = "response-page",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_FILENAME,
+            .arg_data        = &options->response_page,
+            .description     = "Publish the cached invariant responses for the TCTI to answer from in a shared memory file at this path.",
+            .arg_description = "path",
+        },
+        {
+            .long_name       = "flight-dump",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_FILENAME,
+            .arg_data        = &options->flight_dump,
+            .description     = "Write the last pipeline events to this file on SIGUSR1 instead of logging them.",
+            .arg_description = "path",
+        },
+        {
+            .long_name       = "thread-cpus",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_STRING_ARRAY,
+            .arg_data        = &options->thread_cpus,
+            .description     = "Run the command-source, resource-manager or response-sink threads on these CPUs only. May be repeated.",
+            .arg_description = "thread:cpus",
+        },
+        {
+            .long_name       = "thread-priority",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_STRING_ARRAY,
+            .arg_data        = &options->thread_priorities,
+            .description     = "Run the command-source, resource-manager or response-sink threads with a SCHED_FIFO priority or a nice value. May be repeated.",
+            .arg_description = "thread:[fifo|nice]:value",
+        },
+        {
+            .long_name       = "trace",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_FILENAME,
+            .arg_data        = &options->trace,
+            .description     = "Record every command and response with its connection and time in this file, for tabrmd-replay.",
+            .arg_description = "path",
+        },
+        {
+            .long_name       = "pcap",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_FILENAME,
+            .arg_data        = &options->pcap,
+            .description     = "Capture the commands sent to the TPMs and their responses in this pcapng file for Wireshark.",
+            .arg_description = "path",
+        },
+        {
+            .long_name       = "span-file",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_FILENAME,
+            .arg_data        = &options->span_file,
+            .description     = "Append OpenTelemetry spans for the commands of clients that set a sampled trace context to this file, in OTLP JSON.",
+            .arg_description = "path",
+        },
+        {
+            .long_name       = "mlock",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_NONE,
+            .arg_data        = &options->mlock,
+            .description     = "Lock the daemon's memory so the threads never wait for it to be paged in.",
+            .arg_description = NULL,
+        },
+        {
+            .long_name       = "queue-spin",
+            .short_name      = '\0',
+            .flags           = G_OPTION_FLAG_NONE,
+            .arg             = G_OPTION_ARG_INT,
+            .arg_data        = &options->queue_spin,
+            .description     = "Busy-wait up to this many microseconds for the next command or response before sleeping while the daemon is busy. 0 to always sleep.",
+            .arg_description = "usec",
+        },
         { NULL, '\0', 0, 0, NULL, NULL, NULL },
     };
 
@@ -169,6 +993,277 @@ parse_opts (gint argc,
                     TABRMD_TRANSIENT_MAX);
         goto error;
     }
+    if (options->shared_transients > TABRMD_SHARED_MAX) {
+        g_critical ("shared-transients must be between 0 and %d",
+                    TABRMD_SHARED_MAX);
+        goto error;
+    }
+    if (options->shared_sessions > TABRMD_SHARED_MAX) {
+        g_critical ("shared-sessions must be between 0 and %d",
+                    TABRMD_SHARED_MAX);
+        goto error;
+    }
+    if (options->max_pinned > TABRMD_PINNED_MAX) {
+        g_critical ("max-pinned must be between 0 and %d",
+                    TABRMD_PINNED_MAX);
+        goto error;
+    }
+    if (options->max_channels > TABRMD_CHANNELS_MAX) {
+        g_critical ("max-channels must be between 0 and %d",
+                    TABRMD_CHANNELS_MAX);
+        goto error;
+    }
+    if (options->response_threads < 1 ||
+        options->response_threads > RESPONSE_SINK_SHARDS_MAX) {
+        g_critical ("response-threads must be between 1 and %d",
+                    RESPONSE_SINK_SHARDS_MAX);
+        goto error;
+    }
+    if (options->reactors > COMMAND_SOURCE_REACTORS_MAX) {
+        g_critical ("reactors must be between 0 and %d",
+                    COMMAND_SOURCE_REACTORS_MAX);
+        goto error;
+    }
+    if (options->io_engine != NULL) {
+        CommandSourceEngine engine;
+
+        if (!parse_io_engine (options->io_engine, &engine)) {
+            g_critical ("Unknown or unsupported io-engine: %s, try --help",
+                        options->io_engine);
+            goto error;
+        }
+        if (engine != COMMAND_SOURCE_ENGINE_EPOLL && options->reactors == 0) {
+            options->reactors = 1;
+        }
+    }
+    /* only the reactors pause connections */
+    if ((options->pause_reads || options->pause_watermark != 0) &&
+        options->reactors == 0)
+    {
+        options->reactors = 1;
+    }
+    if (options->socket != NULL &&
+        (options->socket [0] == '\0' ||
+         strlen (options->socket) >= TABRMD_SOCKET_ADDRESS_MAX))
+    {
+        g_critical ("socket address must be between 1 and %d characters",
+                    TABRMD_SOCKET_ADDRESS_MAX - 1);
+        goto error;
+    }
+    if (options->vtpm_socket != NULL &&
+        (options->vtpm_socket [0] == '\0' ||
+         strlen (options->vtpm_socket) >= TABRMD_SOCKET_ADDRESS_MAX))
+    {
+        g_critical ("vTPM socket address must be between 1 and %d characters",
+                    TABRMD_SOCKET_ADDRESS_MAX - 1);
+        goto error;
+    }
+    if (options->extra_tcti_confs != NULL &&
+        g_strv_length (options->extra_tcti_confs) >= TABRMD_TPMS_MAX)
+    {
+        g_critical ("at most %d TPMs are supported", TABRMD_TPMS_MAX);
+        goto error;
+    }
+    if (options->kernel_rm) {
+        gchar **conf;
+
+        if (options->passthrough) {
+            g_critical ("kernel-rm and passthrough can't be used together");
+            goto error;
+        }
+        if (!tcti_conf_is_kernel_rm (options->tcti_conf)) {
+            g_critical ("kernel-rm needs a device TCTI on /dev/tpmrm, got "
+                        "\"%s\"", options->tcti_conf);
+            goto error;
+        }
+        for (conf = options->extra_tcti_confs; conf && *conf; ++conf) {
+            if (!tcti_conf_is_kernel_rm (*conf)) {
+                g_critical ("kernel-rm needs a device TCTI on /dev/tpmrm, "
+                            "got \"%s\"", *conf);
+                goto error;
+            }
+        }
+    }
+    if (options->primary_templates != NULL) {
+        gchar **template_str;
+        TPMI_RH_HIERARCHY hierarchy;
+        TPMI_ALG_PUBLIC type;
+
+        if (!options->primary_cache || options->kernel_rm) {
+            g_critical ("primary-template needs primary-cache and can't be "
+                        "used with kernel-rm");
+            goto error;
+        }
+        for (template_str = options->primary_templates;
+             *template_str;
+             ++template_str)
+        {
+            if (!parse_primary_template (*template_str, &hierarchy, &type)) {
+                g_critical ("primary template must be of the form "
+                            "hierarchy:type, got \"%s\", try --help",
+                            *template_str);
+                goto error;
+            }
+        }
+    }
+    if (options->warm_up_nv != NULL) {
+        gchar **index_str;
+        guint32 nv_index;
+
+        if (!options->warm_up) {
+            g_critical ("warm-up-nv needs warm-up");
+            goto error;
+        }
+        for (index_str = options->warm_up_nv; *index_str; ++index_str) {
+            if (!parse_uint32 (*index_str, &nv_index) ||
+                nv_index >> TPM2_HR_SHIFT != TPM2_HT_NV_INDEX)
+            {
+                g_critical ("warm-up-nv must be an NV index handle, got "
+                            "\"%s\"", *index_str);
+                goto error;
+            }
+        }
+    }
+    if (options->uid_weights != NULL) {
+        gchar **weight_str;
+        guint32 uid;
+        guint weight;
+
+        for (weight_str = options->uid_weights; *weight_str; ++weight_str) {
+            if (!parse_uid_weight (*weight_str, &uid, &weight)) {
+                g_critical ("weight must be of the form uid:weight with a "
+                            "weight between 1 and %d, got \"%s\"",
+                            FAIR_QUEUE_WEIGHT_MAX, *weight_str);
+                goto error;
+            }
+        }
+    }
+    if (options->scheduler != NULL) {
+        FairQueuePolicy policy;
+
+        if (!parse_scheduler (options->scheduler, &policy)) {
+            g_critical ("Unknown scheduler: %s, try --help",
+                        options->scheduler);
+            goto error;
+        }
+    }
+    if (options->affinity_burst > FAIR_QUEUE_AFFINITY_BURST_MAX) {
+        g_critical ("affinity-burst must be between 0 and %d",
+                    FAIR_QUEUE_AFFINITY_BURST_MAX);
+        goto error;
+    }
+    if (options->locality_burst > FAIR_QUEUE_LOCALITY_BURST_MAX) {
+        g_critical ("locality-burst must be between 0 and %d",
+                    FAIR_QUEUE_LOCALITY_BURST_MAX);
+        goto error;
+    }
+    if (options->lease_time_max > TABRMD_LEASE_TIME_MAX) {
+        g_critical ("max-lease-time must be between 0 and %d",
+                    TABRMD_LEASE_TIME_MAX);
+        goto error;
+    }
+    if (options->slow_command > TABRMD_SLOW_COMMAND_MAX) {
+        g_critical ("slow-command must be between 0 and %d",
+                    TABRMD_SLOW_COMMAND_MAX);
+        goto error;
+    }
+    if (options->tpm_timeout > TABRMD_TPM_TIMEOUT_MAX) {
+        g_critical ("tpm-timeout must be between 0 and %d",
+                    TABRMD_TPM_TIMEOUT_MAX);
+        goto error;
+    }
+    if (options->idle_timeout > TABRMD_IDLE_TIMEOUT_MAX) {
+        g_critical ("idle-timeout must be between 0 and %d",
+                    TABRMD_IDLE_TIMEOUT_MAX);
+        goto error;
+    }
+    if (options->canary_interval > TABRMD_CANARY_INTERVAL_MAX) {
+        g_critical ("canary-interval must be between 0 and %d",
+                    TABRMD_CANARY_INTERVAL_MAX);
+        goto error;
+    }
+    if (options->evict_idle > TABRMD_EVICT_IDLE_MAX) {
+        g_critical ("evict-idle must be between 0 and %d",
+                    TABRMD_EVICT_IDLE_MAX);
+        goto error;
+    }
+    if (options->abandoned_timeout > TABRMD_ABANDONED_TIMEOUT_MAX) {
+        g_critical ("abandoned-timeout must be between 0 and %d",
+                    TABRMD_ABANDONED_TIMEOUT_MAX);
+        goto error;
+    }
+    if (options->thread_cpus != NULL) {
+        thread_sched_t sched = THREAD_SCHED_INIT_DEFAULT;
+        TabrmdThread thread;
+        gchar **str;
+
+        for (str = options->thread_cpus; *str; ++str) {
+            if (!parse_thread_cpus (*str, &thread, &sched)) {
+                g_critical ("thread-cpus must be of the form thread:cpus "
+                            "with cpus like 0,2-3, got \"%s\"", *str);
+                goto error;
+            }
+        }
+    }
+    if (options->thread_priorities != NULL) {
+        thread_sched_t sched = THREAD_SCHED_INIT_DEFAULT;
+        TabrmdThread thread;
+        gchar **str;
+
+        for (str = options->thread_priorities; *str; ++str) {
+            if (!parse_thread_priority (*str, &thread, &sched)) {
+                g_critical ("thread-priority must be of the form "
+                            "thread:fifo:priority or thread:nice:value, "
+                            "got \"%s\"", *str);
+                goto error;
+            }
+        }
+    }
+    if (options->queue_spin > MESSAGE_QUEUE_SPIN_MAX) {
+        g_critical ("queue-spin must be between 0 and %d",
+                    MESSAGE_QUEUE_SPIN_MAX);
+        goto error;
+    }
+    if ((options->max_connection_memory != 0 &&
+         options->max_connection_memory < TABRMD_MEMORY_MIN_KIB) ||
+        (options->max_memory != 0 &&
+         options->max_memory < TABRMD_MEMORY_MIN_KIB))
+    {
+        g_critical ("max-connection-memory and max-memory must be 0 or at "
+                    "least %d KiB: a command and its response",
+                    TABRMD_MEMORY_MIN_KIB);
+        goto error;
+    }
+    if (options->random_pool > RANDOM_POOL_SIZE_MAX) {
+        g_critical ("random-pool must be between 0 and %d",
+                    RANDOM_POOL_SIZE_MAX);
+        goto error;
+    }
+    if (options->rate_limit > TOKEN_BUCKET_RATE_MAX) {
+        g_critical ("rate-limit must be between 0 and %d",
+                    TOKEN_BUCKET_RATE_MAX);
+        goto error;
+    }
+    if (options->uid_rate_limits != NULL) {
+        gchar **rate_str;
+        guint32 uid;
+        guint rate;
+
+        for (rate_str = options->uid_rate_limits; *rate_str; ++rate_str) {
+            if (!parse_uid_rate (*rate_str, &uid, &rate)) {
+                g_critical ("uid-rate-limit must be of the form uid:rate with "
+                            "a rate between 0 and %d, got \"%s\"",
+                            TOKEN_BUCKET_RATE_MAX, *rate_str);
+                goto error;
+            }
+        }
+    }
+    if (!parse_uint32_array (options->priority_commands, "priority-command") ||
+        !parse_uint32_array (options->priority_uids, "priority-uid") ||
+        !parse_uint32_array (options->locality_uids, "locality-uid"))
+    {
+        goto error;
+    }
     g_debug ("tcti_conf after: \"%s\"", options->tcti_conf);
     return TRUE;
 
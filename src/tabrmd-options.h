@@ -6,8 +6,12 @@
 #define TABRMD_OPTIONS_H
 
 #include <gio/gio.h>
+#include <tss2/tss2_tpm2_types.h>
 
+#include "command-source.h"
+#include "fair-queue.h"
 #include "tabrmd-defaults.h"
+#include "thread.h"
 
 #define TABRMD_OPTIONS_INIT_DEFAULT { \
     .bus = (GBusType)TABRMD_DBUS_TYPE_DEFAULT, \
@@ -15,22 +19,153 @@
     .max_connections = TABRMD_CONNECTIONS_MAX_DEFAULT, \
     .max_transients = TABRMD_TRANSIENT_MAX_DEFAULT, \
     .max_sessions = TABRMD_SESSIONS_MAX_DEFAULT, \
+    .shared_transients = 0, \
+    .shared_sessions = 0, \
+    .max_pinned = 0, \
+    .max_channels = TABRMD_CHANNELS_MAX_DEFAULT, \
     .dbus_name = NULL, \
     .prng_seed_file = NULL, \
     .allow_root = FALSE, \
     .tcti_conf = NULL, \
+    .extra_tcti_confs = NULL, \
+    .uid_weights = NULL, \
+    .priority_commands = NULL, \
+    .priority_uids = NULL, \
+    .locality_uids = NULL, \
+    .reactors = 0, \
+    .metrics_socket = NULL, \
+    .socket = NULL, \
+    .vtpm_socket = NULL, \
+    .cache_dir = NULL, \
+    .queue_depth = 0, \
+    .max_in_flight = 0, \
+    .max_connection_memory = 0, \
+    .max_memory = 0, \
+    .rate_limit = 0, \
+    .uid_rate_limits = NULL, \
+    .scheduler = NULL, \
+    .affinity_burst = 0, \
+    .locality_burst = FAIR_QUEUE_LOCALITY_BURST_DEFAULT, \
+    .lease_time_max = TABRMD_LEASE_TIME_MAX_DEFAULT, \
+    .direct_write = FALSE, \
+    .response_threads = 1, \
+    .random_pool = 0, \
+    .pcr_cache = FALSE, \
+    .primary_cache = FALSE, \
+    .primary_templates = NULL, \
+    .warm_up = FALSE, \
+    .warm_up_nv = NULL, \
+    .load_cache = FALSE, \
+    .idle_timeout = 0, \
+    .abandoned_timeout = TABRMD_ABANDONED_TIMEOUT_DEFAULT, \
+    .spill_dir = NULL, \
+    .state_dir = NULL, \
+    .thread_cpus = NULL, \
+    .thread_priorities = NULL, \
+    .mlock = FALSE, \
+    .queue_spin = 0, \
+    .io_engine = NULL, \
+    .pause_reads = FALSE, \
+    .pause_watermark = 0, \
+    .passthrough = FALSE, \
+    .kernel_rm = FALSE, \
+    .slow_command = 0, \
+    .canary_interval = 0, \
+    .evict_idle = 0, \
+    .stats_page = NULL, \
+    .response_page = NULL, \
+    .flight_dump = NULL, \
+    .trace = NULL, \
+    .pcap = NULL, \
+    .span_file = NULL, \
 }
 
+/* the kinds of threads in the command pipeline, for --thread-* options */
+typedef enum {
+    TABRMD_THREAD_COMMAND_SOURCE,
+    TABRMD_THREAD_RESOURCE_MANAGER,
+    TABRMD_THREAD_RESPONSE_SINK,
+    TABRMD_THREAD_COUNT,
+} TabrmdThread;
+
 typedef struct tabrmd_options {
     GBusType        bus;
     gboolean        flush_all;
     guint           max_connections;
     guint           max_transients;
     guint           max_sessions;
+    /* slots connections may borrow past max_transients and max_sessions */
+    guint           shared_transients;
+    guint           shared_sessions;
+    /* transient objects a connection may keep resident, see TABRMD_CC_RESIDENCY */
+    guint           max_pinned;
+    /* channels a connection may open besides its own, see TABRMD_CONTROL_SET_CHANNEL */
+    guint           max_channels;
     gchar          *dbus_name;
     gchar          *prng_seed_file;
     gboolean        allow_root;
     gchar          *tcti_conf;
+    gchar         **extra_tcti_confs;
+    gchar         **uid_weights;
+    gchar         **priority_commands;
+    gchar         **priority_uids;
+    gchar         **locality_uids;
+    guint           reactors;
+    gchar          *metrics_socket;
+    gchar          *socket;
+    gchar          *vtpm_socket;
+    gchar          *cache_dir;
+    guint           queue_depth;
+    guint           max_in_flight;
+    /* KiB held for a connection and for all of them, 0 for no limit */
+    guint           max_connection_memory;
+    guint           max_memory;
+    guint           rate_limit;
+    gchar         **uid_rate_limits;
+    gchar          *scheduler;
+    guint           affinity_burst;
+    guint           locality_burst;
+    guint           lease_time_max;
+    gboolean        direct_write;
+    /* threads writing responses for each TPM */
+    guint           response_threads;
+    guint           random_pool;
+    gboolean        pcr_cache;
+    gboolean        primary_cache;
+    gchar         **primary_templates;
+    gboolean        warm_up;
+    gchar         **warm_up_nv;
+    gboolean        load_cache;
+    guint           idle_timeout;
+    guint           abandoned_timeout;
+    gchar          *spill_dir;
+    gchar          *state_dir;
+    gchar         **thread_cpus;
+    gchar         **thread_priorities;
+    gboolean        mlock;
+    guint           queue_spin;
+    gchar          *io_engine;
+    gboolean        pause_reads;
+    guint           pause_watermark;
+    gboolean        passthrough;
+    gboolean        kernel_rm;
+    /* milliseconds, 0 to log no slow commands */
+    guint           slow_command;
+    /* milliseconds, 0 to wait on the TPM for as long as it takes */
+    guint           tpm_timeout;
+    /* seconds, 0 for no canary */
+    guint           canary_interval;
+    /* milliseconds, 0 to evict only when the TPM is full */
+    guint           evict_idle;
+    gchar          *stats_page;
+    /* file the invariant responses are published in, see ResponsePage */
+    gchar          *response_page;
+    /* file SIGUSR1 writes the flight recorder to, NULL to log it */
+    gchar          *flight_dump;
+    gchar          *trace;
+    gchar          *pcap;
+    /* file the spans of traced commands are appended to, see SpanExporter */
+    gchar          *span_file;
 } tabrmd_options_t;
 
 gboolean
@@ -41,4 +176,41 @@ parse_opts (gint argc,
 void
 tabrmd_options_free(tabrmd_options_t *opts);
 
+gboolean
+parse_uint32 (const gchar *str,
+              guint32     *value);
+
+gboolean
+parse_uid_weight (const gchar *str,
+                  guint32     *uid,
+                  guint       *weight);
+
+gboolean
+parse_uid_rate (const gchar *str,
+                guint32     *uid,
+                guint       *rate);
+
+gboolean
+parse_scheduler (const gchar     *str,
+                 FairQueuePolicy *policy);
+
+gboolean
+parse_primary_template (const gchar       *str,
+                        TPMI_RH_HIERARCHY *hierarchy,
+                        TPMI_ALG_PUBLIC   *type);
+
+gboolean
+parse_io_engine (const gchar         *str,
+                 CommandSourceEngine *engine);
+
+gboolean
+parse_thread_cpus (const gchar    *str,
+                   TabrmdThread   *thread,
+                   thread_sched_t *sched);
+
+gboolean
+parse_thread_priority (const gchar    *str,
+                       TabrmdThread   *thread,
+                       thread_sched_t *sched);
+
 #endif /* TABRMD_OPTIONS_H */
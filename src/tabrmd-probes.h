@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TABRMD_PROBES_H
+#define TABRMD_PROBES_H
+
+/*
+ * USDT static tracepoints in the 'tabrmd' provider. These are built only
+ * when configured with --enable-usdt and otherwise compile to nothing: the
+ * arguments aren't evaluated. With sdt.h an inactive probe is a single nop
+ * in the instruction stream.
+ *
+ * Probes that follow a command carry the connection id (0 for commands the
+ * ResourceManager sends on its own behalf) and the command code:
+ *   command_receive (id, cc, size)   CommandSource read a command
+ *   rm_dequeue (id, cc)              ResourceManager picked it up
+ *   tcti_transmit_start (id, cc)     around tcti_transmit in tpm2_transmit
+ *   tcti_transmit_done (id, cc, rc)
+ *   tcti_receive_start (id, cc)      around tcti_receive in tpm2_receive
+ *   tcti_receive_done (id, cc, rc)
+ *   response_write (id, cc, size)    ResponseSink writes the response
+ * Context operations are done by the ResourceManager thread for the
+ * command it last dequeued, so they're attributed to it by thread:
+ *   context_load_start (saved_handle)
+ *   context_load_done (handle, rc)
+ *   context_save_start (handle)
+ *   context_save_done (handle, rc)
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define TABRMD_PROBE1(name, a) \
+    DTRACE_PROBE1 (tabrmd, name, a)
+#define TABRMD_PROBE2(name, a, b) \
+    DTRACE_PROBE2 (tabrmd, name, a, b)
+#define TABRMD_PROBE3(name, a, b, c) \
+    DTRACE_PROBE3 (tabrmd, name, a, b, c)
+#else
+#define TABRMD_PROBE1(name, a) \
+    do { (void)sizeof (a); } while (0)
+#define TABRMD_PROBE2(name, a, b) \
+    do { (void)sizeof (a); (void)sizeof (b); } while (0)
+#define TABRMD_PROBE3(name, a, b, c) \
+    do { (void)sizeof (a); (void)sizeof (b); (void)sizeof (c); } while (0)
+#endif
+
+/* connection id for a probe, commands sent by the RM have no connection */
+#define TABRMD_PROBE_CONNECTION_ID(connection) \
+    ((connection) != NULL ? (connection)->id : 0)
+
+#endif /* TABRMD_PROBES_H */
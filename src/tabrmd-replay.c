@@ -0,0 +1,309 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Replay a trace recorded by tpm2-abrmd --trace against a TCTI. Each
+ * connection in the trace gets its own TCTI instance and thread and sends
+ * its commands in order, waiting for each response. Commands are sent at
+ * the times they were recorded or, with --fast, as fast as the TCTI
+ * answers. Response codes that differ from those in the trace are counted:
+ * replaying only reproduces the original responses if the TPM starts out
+ * in the same state.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include <tss2/tss2_tctildr.h>
+
+#include "tcti.h"
+#include "tpm2-header.h"
+#include "trace.h"
+#include "util.h"
+
+#define REPLAY_TCTI_DEFAULT "tabrmd"
+
+typedef struct {
+    gchar      *tcti_conf;
+    gboolean    fast;
+    gchar      *path;
+} replay_opts_t;
+
+typedef struct {
+    /* time the command was read, relative to the first record */
+    gint64      usec;
+    guint8     *buf;
+    guint32     size;
+    gboolean    has_response;
+    TSS2_RC     expected_rc;
+} replay_command_t;
+
+typedef struct {
+    guint64     id;
+    GPtrArray  *commands;
+    /* responses in the trace matched to commands so far */
+    guint       responses;
+    const replay_opts_t *opts;
+    gint64      start;
+    GThread    *thread;
+    /* results */
+    guint       sent;
+    guint       errors;
+    guint       mismatches;
+    gint64      latency_sum;
+    gint64      latency_max;
+} replay_connection_t;
+
+static void
+replay_command_free (gpointer data)
+{
+    replay_command_t *command = (replay_command_t*)data;
+
+    g_free (command->buf);
+    g_free (command);
+}
+static void
+replay_connection_free (gpointer data)
+{
+    replay_connection_t *connection = (replay_connection_t*)data;
+
+    g_ptr_array_unref (connection->commands);
+    g_free (connection);
+}
+static gboolean
+parse_replay_opts (gint           argc,
+                   gchar         *argv[],
+                   replay_opts_t *opts)
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    gboolean ret;
+
+    GOptionEntry entries[] = {
+        { "tcti", 't', 0, G_OPTION_ARG_STRING, &opts->tcti_conf,
+          "TCTI configuration string to replay against (default tabrmd).",
+          "tcti-conf" },
+        { "fast", 'f', 0, G_OPTION_ARG_NONE, &opts->fast,
+          "Send each command as soon as the previous response is in instead "
+          "of at its recorded time.", NULL },
+        { NULL },
+    };
+
+    ctx = g_option_context_new ("TRACE - replay a tpm2-abrmd trace");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    ret = g_option_context_parse (ctx, &argc, &argv, &err);
+    g_option_context_free (ctx);
+    if (!ret) {
+        fprintf (stderr, "%s\n", err->message);
+        g_error_free (err);
+        return FALSE;
+    }
+    if (argc != 2) {
+        fprintf (stderr, "a single trace file is required\n");
+        return FALSE;
+    }
+    opts->path = g_strdup (argv [1]);
+    if (opts->tcti_conf == NULL) {
+        opts->tcti_conf = g_strdup (REPLAY_TCTI_DEFAULT);
+    }
+    return TRUE;
+}
+/*
+ * Read the trace into 'connections', a GPtrArray of replay_connection_t
+ * in the order the connections first appear. Each response is matched
+ * to the oldest command of its connection that has none yet.
+ */
+static GPtrArray*
+replay_load (const gchar *path,
+             GError     **error)
+{
+    GPtrArray *connections;
+    GHashTable *by_id;
+    replay_connection_t *connection;
+    replay_command_t *command;
+    trace_header_t header;
+    trace_record_t record;
+    gint64 first = -1;
+    guint8 *buf;
+    FILE *file;
+
+    file = trace_open_read (path, &header, error);
+    if (file == NULL) {
+        return NULL;
+    }
+    connections = g_ptr_array_new_with_free_func (replay_connection_free);
+    by_id = g_hash_table_new (g_int64_hash, g_int64_equal);
+    while ((buf = trace_read_record (file, &record, error)) != NULL) {
+        if (first == -1) {
+            first = record.usec;
+        }
+        connection = g_hash_table_lookup (by_id, &record.connection_id);
+        if (connection == NULL) {
+            connection = g_new0 (replay_connection_t, 1);
+            connection->id = record.connection_id;
+            connection->commands =
+                g_ptr_array_new_with_free_func (replay_command_free);
+            g_hash_table_insert (by_id, &connection->id, connection);
+            g_ptr_array_add (connections, connection);
+        }
+        if (record.type == TRACE_COMMAND) {
+            command = g_new0 (replay_command_t, 1);
+            command->usec = record.usec - first;
+            command->buf = buf;
+            command->size = record.size;
+            g_ptr_array_add (connection->commands, command);
+            continue;
+        }
+        if (connection->responses < connection->commands->len &&
+            record.size >= TPM_HEADER_SIZE)
+        {
+            command = g_ptr_array_index (connection->commands,
+                                         connection->responses);
+            command->has_response = TRUE;
+            command->expected_rc = get_response_code (buf);
+            ++connection->responses;
+        }
+        g_free (buf);
+    }
+    g_hash_table_unref (by_id);
+    fclose (file);
+    if (error != NULL && *error != NULL) {
+        g_ptr_array_unref (connections);
+        return NULL;
+    }
+    return connections;
+}
+/*
+ * GThreadFunc replaying the commands of one connection over a TCTI of its
+ * own. A TCTI error ends the connection's replay.
+ */
+static gpointer
+replay_connection_func (gpointer user_data)
+{
+    replay_connection_t *connection = (replay_connection_t*)user_data;
+    guint8 *response = g_malloc (UTIL_BUF_MAX);
+    TSS2_TCTI_CONTEXT *tcti_ctx = NULL;
+    replay_command_t *command;
+    Tcti *tcti = NULL;
+    gint64 now, latency;
+    size_t size;
+    TSS2_RC rc;
+    guint i;
+
+    rc = Tss2_TctiLdr_Initialize (connection->opts->tcti_conf, &tcti_ctx);
+    if (rc != TSS2_RC_SUCCESS || tcti_ctx == NULL) {
+        g_warning ("connection 0x%" PRIx64 ": failed to create TCTI with "
+                   "conf \"%s\", got RC: 0x%" PRIx32, connection->id,
+                   connection->opts->tcti_conf, rc);
+        connection->errors = connection->commands->len;
+        goto out;
+    }
+    /* the Tcti owns the context */
+    tcti = tcti_new (tcti_ctx);
+    for (i = 0; i < connection->commands->len; ++i) {
+        command = g_ptr_array_index (connection->commands, i);
+        now = g_get_monotonic_time ();
+        if (!connection->opts->fast &&
+            now < connection->start + command->usec)
+        {
+            g_usleep (connection->start + command->usec - now);
+            now = g_get_monotonic_time ();
+        }
+        size = UTIL_BUF_MAX;
+        rc = tcti_transmit (tcti, command->size, command->buf);
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = tcti_receive (tcti, &size, response,
+                               TSS2_TCTI_TIMEOUT_BLOCK);
+        }
+        if (rc != TSS2_RC_SUCCESS || size < TPM_HEADER_SIZE) {
+            connection->errors += connection->commands->len - i;
+            break;
+        }
+        latency = g_get_monotonic_time () - now;
+        ++connection->sent;
+        connection->latency_sum += latency;
+        connection->latency_max = MAX (connection->latency_max, latency);
+        if (command->has_response &&
+            get_response_code (response) != command->expected_rc)
+        {
+            ++connection->mismatches;
+        }
+    }
+out:
+    g_clear_object (&tcti);
+    g_free (response);
+    return NULL;
+}
+int
+main (int   argc,
+      char *argv[])
+{
+    replay_opts_t opts = { 0 };
+    replay_connection_t *connection;
+    replay_command_t *last;
+    GPtrArray *connections;
+    GError *error = NULL;
+    guint64 sent = 0, errors = 0, mismatches = 0;
+    gint64 start, elapsed, traced = 0, latency_sum = 0, latency_max = 0;
+    gint ret = EX_OK;
+    guint i;
+
+    if (!parse_replay_opts (argc, argv, &opts)) {
+        return EX_USAGE;
+    }
+    connections = replay_load (opts.path, &error);
+    if (connections == NULL) {
+        fprintf (stderr, "%s\n", error->message);
+        g_clear_error (&error);
+        ret = EX_DATAERR;
+        goto out;
+    }
+    start = g_get_monotonic_time ();
+    for (i = 0; i < connections->len; ++i) {
+        connection = g_ptr_array_index (connections, i);
+        connection->opts = &opts;
+        connection->start = start;
+        connection->thread = g_thread_new ("replay",
+                                           replay_connection_func,
+                                           connection);
+    }
+    for (i = 0; i < connections->len; ++i) {
+        connection = g_ptr_array_index (connections, i);
+        g_thread_join (connection->thread);
+        sent += connection->sent;
+        errors += connection->errors;
+        mismatches += connection->mismatches;
+        latency_sum += connection->latency_sum;
+        latency_max = MAX (latency_max, connection->latency_max);
+        if (connection->commands->len > 0) {
+            last = g_ptr_array_index (connection->commands,
+                                      connection->commands->len - 1);
+            traced = MAX (traced, last->usec);
+        }
+    }
+    elapsed = g_get_monotonic_time () - start;
+    printf ("connections: %u\n", connections->len);
+    printf ("commands: %" PRIu64 " (errors %" PRIu64 ", response codes "
+            "differing from the trace %" PRIu64 ")\n",
+            sent, errors, mismatches);
+    printf ("elapsed: %.3f s (traced %.3f s)\n",
+            (gdouble)elapsed / G_USEC_PER_SEC,
+            (gdouble)traced / G_USEC_PER_SEC);
+    if (elapsed > 0) {
+        printf ("rate: %.1f commands/s\n",
+                (gdouble)sent * G_USEC_PER_SEC / (gdouble)elapsed);
+    }
+    if (sent > 0) {
+        printf ("latency: mean %" PRId64 " us, max %" PRId64 " us\n",
+                latency_sum / (gint64)sent, latency_max);
+    }
+    if (errors > 0) {
+        ret = EX_IOERR;
+    }
+    g_ptr_array_unref (connections);
+out:
+    g_free (opts.tcti_conf);
+    g_free (opts.path);
+    return ret;
+}
@@ -0,0 +1,228 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Live view of the stats page published by tpm2-abrmd --stats-page. The
+ * page is mapped read-only and copied once per refresh: the daemon isn't
+ * contacted and does no extra work however many viewers there are. Rates
+ * are computed between two copies using the daemon's update times.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include "stats-page.h"
+
+#define TOP_INTERVAL_DEFAULT 1
+/* seconds without an update before the page is mapped again */
+#define TOP_STALE_TIMEOUT    5
+
+typedef struct {
+    gchar      *path;
+    guint       interval;
+    guint       count;
+    gboolean    batch;
+} top_opts_t;
+
+/* a connection with its rates since the previous refresh */
+typedef struct {
+    const stats_page_connection_t *entry;
+    gdouble     commands_rate;
+    gdouble     tpm_share;
+} top_connection_t;
+
+static gboolean
+parse_top_opts (gint        argc,
+                gchar      *argv[],
+                top_opts_t *opts)
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    gboolean ret;
+
+    GOptionEntry entries[] = {
+        { "stats-page", 'p', 0, G_OPTION_ARG_FILENAME, &opts->path,
+          "Stats page published by tpm2-abrmd --stats-page.", "path" },
+        { "interval", 'd', 0, G_OPTION_ARG_INT, &opts->interval,
+          "Seconds between refreshes (default 1).", "seconds" },
+        { "count", 'n', 0, G_OPTION_ARG_INT, &opts->count,
+          "Stop after this many refreshes, 0 to run until interrupted.", "N" },
+        { "batch", 'b', 0, G_OPTION_ARG_NONE, &opts->batch,
+          "Print each refresh after the last instead of redrawing the screen.",
+          NULL },
+        { NULL },
+    };
+
+    ctx = g_option_context_new (" - live tpm2-abrmd statistics");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    ret = g_option_context_parse (ctx, &argc, &argv, &err);
+    g_option_context_free (ctx);
+    if (!ret) {
+        fprintf (stderr, "%s\n", err->message);
+        g_error_free (err);
+        return FALSE;
+    }
+    if (opts->path == NULL) {
+        fprintf (stderr, "--stats-page is required\n");
+        return FALSE;
+    }
+    if (opts->interval == 0 || opts->interval > 3600) {
+        fprintf (stderr, "--interval must be from 1 to 3600 seconds\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * Per second rate of a running total. A total that went backwards comes
+ * from a restarted daemon and gives no rate.
+ */
+static gdouble
+top_rate (guint64 now,
+          guint64 before,
+          gint64  usec)
+{
+    if (usec <= 0 || now < before) {
+        return 0;
+    }
+    return (gdouble)(now - before) * G_USEC_PER_SEC / (gdouble)usec;
+}
+static const stats_page_connection_t*
+top_find_connection (const stats_page_t *page,
+                     guint64             id)
+{
+    guint i;
+
+    for (i = 0; i < page->connection_count; ++i) {
+        if (page->connections [i].id == id) {
+            return &page->connections [i];
+        }
+    }
+    return NULL;
+}
+static gint
+top_connection_compare (gconstpointer a,
+                        gconstpointer b)
+{
+    const top_connection_t *conn_a = a, *conn_b = b;
+
+    if (conn_a->commands_rate != conn_b->commands_rate) {
+        return conn_a->commands_rate < conn_b->commands_rate ? 1 : -1;
+    }
+    return conn_a->entry->id < conn_b->entry->id ? -1 :
+        conn_a->entry->id > conn_b->entry->id;
+}
+static void
+top_print (const stats_page_t *now,
+           const stats_page_t *before,
+           gboolean            batch)
+{
+    gint64 usec = now->updated_usec - before->updated_usec;
+    const stats_page_connection_t *prev;
+    const stats_page_tpm_t *tpm, *tpm_before;
+    top_connection_t conns [STATS_PAGE_CONNECTIONS_MAX];
+    guint i;
+
+    if (!batch) {
+        printf ("\033[H\033[2J");
+    }
+    printf ("tpm2-abrmd: %" PRIu32 " connections", now->connections_total);
+    if (now->connection_count < now->connections_total) {
+        printf (" (%" PRIu32 " shown)", now->connection_count);
+    }
+    printf ("\n\n%-4s %10s %7s %7s %10s %7s\n",
+            "TPM", "CMD/S", "UTIL%", "QUEUE", "SWAPS/S", "CONNS");
+    for (i = 0; i < now->tpm_count && i < TABRMD_TPMS_MAX; ++i) {
+        tpm = &now->tpms [i];
+        tpm_before = &before->tpms [i];
+        printf ("%-4u %10.1f %7.1f %7" PRIu32 " %10.1f %7" PRIu32 "\n",
+                i,
+                top_rate (tpm->commands, tpm_before->commands, usec),
+                MIN (top_rate (tpm->busy_usec, tpm_before->busy_usec, usec)
+                     * 100 / G_USEC_PER_SEC, 100.0),
+                tpm->queue_depth,
+                top_rate (tpm->context_swaps, tpm_before->context_swaps, usec),
+                tpm->connections);
+    }
+    for (i = 0; i < now->connection_count && i < STATS_PAGE_CONNECTIONS_MAX; ++i) {
+        conns [i].entry = &now->connections [i];
+        prev = top_find_connection (before, conns [i].entry->id);
+        conns [i].commands_rate = top_rate (conns [i].entry->commands,
+                                            prev != NULL ? prev->commands : 0,
+                                            usec);
+        conns [i].tpm_share = top_rate (conns [i].entry->tpm_usec,
+                                        prev != NULL ? prev->tpm_usec : 0,
+                                        usec) * 100 / G_USEC_PER_SEC;
+    }
+    qsort (conns, i, sizeof (conns [0]), top_connection_compare);
+    printf ("\n%-18s %8s %8s %4s %10s %7s %9s %8s %7s\n",
+            "CONNECTION", "PID", "UID", "TPM", "CMD/S", "TPM%",
+            "IN-FLIGHT", "SESSIONS", "OBJECTS");
+    for (i = 0; i < now->connection_count && i < STATS_PAGE_CONNECTIONS_MAX; ++i) {
+        printf ("0x%016" PRIx64 " %8" PRIu32 " %8" PRIu32 " %4" PRIu32
+                " %10.1f %7.1f %9" PRIu32 " %8" PRIu32 " %7" PRIu32 "\n",
+                conns [i].entry->id, conns [i].entry->pid, conns [i].entry->uid,
+                conns [i].entry->tpm, conns [i].commands_rate,
+                conns [i].tpm_share, conns [i].entry->in_flight,
+                conns [i].entry->sessions, conns [i].entry->objects);
+    }
+    if (batch) {
+        printf ("\n");
+    }
+    fflush (stdout);
+}
+int
+main (int   argc,
+      char *argv[])
+{
+    top_opts_t opts = { .interval = TOP_INTERVAL_DEFAULT };
+    const stats_page_t *page = NULL;
+    stats_page_t *now, *before, *tmp;
+    GError *error = NULL;
+    gint ret = EX_OK;
+    guint i;
+
+    if (!parse_top_opts (argc, argv, &opts)) {
+        return EX_USAGE;
+    }
+    now = g_new0 (stats_page_t, 1);
+    before = g_new0 (stats_page_t, 1);
+    for (i = 0; opts.count == 0 || i <= opts.count; ++i) {
+        if (page == NULL) {
+            page = stats_page_map (opts.path, &error);
+            if (page == NULL) {
+                fprintf (stderr, "%s\n", error->message);
+                g_clear_error (&error);
+                ret = EX_UNAVAILABLE;
+                break;
+            }
+        }
+        if (!stats_page_snapshot (page, now)) {
+            fprintf (stderr, "no consistent copy of %s\n", opts.path);
+            ret = EX_TEMPFAIL;
+            break;
+        }
+        /* the first copy only gives the starting totals */
+        if (i > 0) {
+            top_print (now, before, opts.batch);
+        }
+        /* a restarted daemon publishes in a new file at the same path */
+        if (g_get_monotonic_time () - now->updated_usec >
+            TOP_STALE_TIMEOUT * G_USEC_PER_SEC)
+        {
+            stats_page_unmap (page);
+            page = NULL;
+        }
+        tmp = before;
+        before = now;
+        now = tmp;
+        if (opts.count == 0 || i < opts.count) {
+            g_usleep (opts.interval * G_USEC_PER_SEC);
+        }
+    }
+    stats_page_unmap (page);
+    g_free (now);
+    g_free (before);
+    g_free (opts.path);
+    return ret;
+}
@@ -13,6 +13,7 @@
 #include "tabrmd-options.h"
 #include "tabrmd-init.h"
 #include "tabrmd.h"
+#include "logging.h"
 #include "util.h"
 
 /*
@@ -66,5 +67,7 @@ main (int argc, char *argv[])
     }
 out:
     gmain_data_cleanup (&gmain_data);
+    /* write out what's left in the log ring */
+    logging_shutdown ();
     return ret;
 }
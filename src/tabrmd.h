@@ -17,6 +17,8 @@
 #define TSS2_RESMGR_RC_INTERNAL_ERROR (TSS2_RC)(TSS2_RESMGR_RC_LAYER | (1 << TSS2_LEVEL_IMPLEMENTATION_SPECIFIC_SHIFT))
 #define TSS2_RESMGR_RC_SAPI_INIT      (TSS2_RC)(TSS2_RESMGR_RC_LAYER | (2 << TSS2_LEVEL_IMPLEMENTATION_SPECIFIC_SHIFT))
 #define TSS2_RESMGR_RC_OUT_OF_MEMORY  (TSS2_RC)(TSS2_RESMGR_RC_LAYER | (3 << TSS2_LEVEL_IMPLEMENTATION_SPECIFIC_SHIFT))
+/* the TPM didn't answer within --tpm-timeout, even once canceled */
+#define TSS2_RESMGR_RC_TPM_TIMEOUT    (TSS2_RC)(TSS2_RESMGR_RC_LAYER | (4 << TSS2_LEVEL_IMPLEMENTATION_SPECIFIC_SHIFT))
 /* RCs in the RESMGR layer */
 #define TSS2_RESMGR_RC_BAD_VALUE       (TSS2_RC)(TSS2_RESMGR_RC_LAYER | TSS2_BASE_RC_BAD_VALUE)
 #define TSS2_RESMGR_RC_NOT_PERMITTED   (TSS2_RC)(TSS2_RESMGR_RC_LAYER | TSS2_BASE_RC_NOT_PERMITTED)
@@ -24,6 +26,10 @@
 #define TSS2_RESMGR_RC_GENERAL_FAILURE (TSS2_RC)(TSS2_RESMGR_RC_LAYER | TSS2_BASE_RC_GENERAL_FAILURE)
 #define TSS2_RESMGR_RC_OBJECT_MEMORY   (TSS2_RC)(TSS2_RESMGR_RC_LAYER | TPM2_RC_OBJECT_MEMORY)
 #define TSS2_RESMGR_RC_SESSION_MEMORY  (TSS2_RC)(TSS2_RESMGR_RC_LAYER | TPM2_RC_SESSION_MEMORY)
+/* the daemon is overloaded, the command may be sent again later */
+#define TSS2_RESMGR_RC_RETRY           (TSS2_RC)(TSS2_RESMGR_RC_LAYER | TPM2_RC_RETRY)
+/* the command was skipped after an earlier command in its batch failed */
+#define TSS2_RESMGR_RC_CANCELED        (TSS2_RC)(TSS2_RESMGR_RC_LAYER | TPM2_RC_CANCELED)
 
 GQuark  tabrmd_error_quark (void);
 
@@ -11,6 +11,9 @@
 #include <tss2/tss2_tcti.h>
 
 #include "tabrmd-defaults.h"
+#include "response-page.h"
+#include "shm-transport.h"
+#include "socket-protocol.h"
 #include "tabrmd-generated.h"
 #include "tpm2-header.h"
 #include "util.h"
@@ -20,28 +23,37 @@
 
 #define TSS2_TCTI_TABRMD_ID(context) \
     ((TSS2_TCTI_TABRMD_CONTEXT*)context)->id
-#define TSS2_TCTI_TABRMD_IOSTREAM(context) \
-    G_IO_STREAM (TSS2_TCTI_TABRMD_SOCK_CONNECT (context))
 #define TSS2_TCTI_TABRMD_PROXY(context) \
     ((TSS2_TCTI_TABRMD_CONTEXT*)context)->proxy
 #define TSS2_TCTI_TABRMD_HEADER(context) \
     ((TSS2_TCTI_TABRMD_CONTEXT*)context)->header
 #define TSS2_TCTI_TABRMD_STATE(context) \
     ((TSS2_TCTI_TABRMD_CONTEXT*)context)->state
+#define TSS2_TCTI_TABRMD_SHM(context) \
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->shm
+#define TSS2_TCTI_TABRMD_BLOCKING(context) \
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->blocking
+#define TSS2_TCTI_TABRMD_TAGGED(context) \
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->tagged
+#define TSS2_TCTI_TABRMD_PENDING(context) \
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->pending
+#define TSS2_TCTI_TABRMD_SOCKET_ADDRESS(context) \
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->socket_address
+#define TSS2_TCTI_TABRMD_CONTROL(context) \
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->control
+#define TSS2_TCTI_TABRMD_FEATURES(context) \
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->features
+#define TSS2_TCTI_TABRMD_RESPONSE_PAGE(context) \
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->response_page
 
 /*
- * Macros for accessing the internals of the I/O stream. These are helpers
- * for getting at the underlying GSocket and raw fds that we need to
- * implement polling etc.
+ * Macros for accessing the connection to the daemon. The GSocketConnection
+ * owns the socket, transmit and receive use the raw fd cached alongside it.
  */
-#define TSS2_TCTI_TABRMD_ISTREAM(context) \
-    g_io_stream_get_input_stream (TSS2_TCTI_TABRMD_IOSTREAM(context))
 #define TSS2_TCTI_TABRMD_SOCK_CONNECT(context) \
     ((TSS2_TCTI_TABRMD_CONTEXT*)context)->sock_connect
-#define TSS2_TCTI_TABRMD_SOCKET(context) \
-    g_socket_connection_get_socket (TSS2_TCTI_TABRMD_SOCK_CONNECT (context))
 #define TSS2_TCTI_TABRMD_FD(context) \
-    g_socket_get_fd (TSS2_TCTI_TABRMD_SOCKET (context))
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->fd
 
 /*
  * The elements in this enumeration represent the possible states that the
@@ -68,6 +80,12 @@
  *     setLocality: produces TSS2_TCTI_RC_BAD_SEQUENCE
  *   FINAL:
  *     all function calls produce TSS2_TCTI_RC_BAD_SEQUENCE
+ * A command answered from the response page moves the state machine to
+ * RECEIVE like any other, with the whole response already in the buffer.
+ * A context using the tagged transport stays in the TRANSMIT state. It
+ * counts the commands sent with Tss2_Tcti_Tabrmd_TransmitTagged that are
+ * waiting for Tss2_Tcti_Tabrmd_ReceiveTagged instead. The regular transmit
+ * and receive functions produce TSS2_TCTI_RC_BAD_SEQUENCE.
  */
 typedef enum {
     TABRMD_STATE_FINAL,
@@ -85,21 +103,55 @@ typedef struct {
     TSS2_TCTI_CONTEXT_COMMON_V1    common;
     guint64                        id;
     GSocketConnection             *sock_connect;
+    /* fd of the socket owned by 'sock_connect' */
+    gint                           fd;
     TctiTabrmd                    *proxy;
     tpm_header_t                   header;
     tcti_tabrmd_state_t            state;
     size_t                         index;
-    uint8_t                        header_buf [TPM_HEADER_SIZE];
+    /* the response is read into 'buf', 'index' bytes have been read */
+    uint8_t                        buf [UTIL_BUF_MAX];
+    /* the socket blocks in reads, no need to poll before reading */
+    gboolean                       blocking;
+    /* tagged transport: commands sent and not yet received */
+    gboolean                       tagged;
+    guint                          pending;
+    /* shared command and response slots, NULL for the socket transport */
+    shm_transport_t               *shm;
+    /* address of the daemon's UNIX socket frontend, NULL with D-Bus */
+    gchar                         *socket_address;
+    /* the daemon takes control frames on the socket, see TABRMD_CONTROL_TAG */
+    gboolean                       control;
+    /* TABRMD_FEATURE_* reported by the daemon */
+    guint32                        features;
+    /* responses published by the daemon for 'tpm', NULL if not mapped */
+    const response_page_t         *response_page;
+    guint32                        tpm;
+    /* the response in 'buf' is from 'response_page', not the socket */
+    gboolean                       local;
 } TSS2_TCTI_TABRMD_CONTEXT;
 
 #define TABRMD_CONF_INIT_DEFAULT { \
     .bus_name = TABRMD_DBUS_NAME_DEFAULT, \
     .bus_type = TABRMD_DBUS_TYPE_DEFAULT, \
+    .tpm = 0, \
+    .transport = TABRMD_TRANSPORT_SOCKET, \
+    .pool = 0, \
+    .socket = NULL, \
+    .response_page = NULL, \
 }
 
 typedef struct {
     const char *bus_name;
     GBusType bus_type;
+    guint32 tpm;
+    tabrmd_transport_t transport;
+    /* connections to request at once for the connection pool, 0 for none */
+    guint pool;
+    /* address of the daemon's UNIX socket frontend, NULL to use D-Bus */
+    const char *socket;
+    /* file the daemon publishes invariant responses in, NULL to not use it */
+    const char *response_page;
 } tabrmd_conf_t;
 
 /*
@@ -130,5 +182,9 @@ TSS2_RC tcti_tabrmd_read (TSS2_TCTI_TABRMD_CONTEXT *ctx,
                           uint8_t *buf,
                           size_t size,
                           int32_t timeout);
+TSS2_RC tcti_tabrmd_receive_shm (TSS2_TCTI_TABRMD_CONTEXT *ctx,
+                                 size_t *size,
+                                 uint8_t *response,
+                                 int32_t timeout);
 
 #endif /* TSS2TCTI_TABRMD_PRIV_H */
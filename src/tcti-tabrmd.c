@@ -11,23 +11,107 @@
 #include <inttypes.h>
 #include <poll.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include <tss2/tss2_tpm2_types.h>
 
+#include "logging.h"
 #include "tabrmd.h"
 #include "tss2-tcti-tabrmd.h"
 #include "tcti-tabrmd-priv.h"
 #include "tpm2-header.h"
 #include "util.h"
 
+/*
+ * Write 'size' bytes from 'buf' to the daemon. This blocks until all of
+ * them have been written. The write goes straight to the socket FD,
+ * MSG_NOSIGNAL keeps a daemon that went away from raising SIGPIPE.
+ */
+static TSS2_RC
+tcti_tabrmd_write (TSS2_TCTI_CONTEXT *context,
+                   const uint8_t     *buf,
+                   size_t             size)
+{
+    struct pollfd pollfd = {
+        .fd = TSS2_TCTI_TABRMD_FD (context),
+        .events = POLLOUT,
+    };
+    ssize_t written;
+    size_t written_total = 0;
+
+    tabrmd_debug ("%s: blocking write on fd %d", __func__, pollfd.fd);
+    while (written_total < size) {
+        written = TABRMD_ERRNO_EINTR_RETRY (send (pollfd.fd,
+                                                  &buf [written_total],
+                                                  size - written_total,
+                                                  MSG_NOSIGNAL));
+        if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (TABRMD_ERRNO_EINTR_RETRY (poll (&pollfd, 1, -1)) == -1) {
+                break;
+            }
+            continue;
+        }
+        if (written == -1) {
+            break;
+        }
+        written_total += (size_t)written;
+    }
+    if (written_total == size) {
+        return TSS2_RC_SUCCESS;
+    }
+    switch (errno) {
+    case EPIPE:
+    case ECONNRESET:
+        g_debug ("tss2_tcti_tabrmd_transmit: connection closed writing to "
+                 "socket");
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    default:
+        g_debug ("tss2_tcti_tabrmd_transmit: error writing to socket: %s",
+                 strerror (errno));
+        return TSS2_TCTI_RC_IO_ERROR;
+    }
+}
+/*
+ * Answer 'command' from the response page if the daemon published the
+ * response to it. The response is put in 'buf' as though it had been read
+ * from the socket for the next receive to return.
+ */
+static gboolean
+tcti_tabrmd_answer_local (TSS2_TCTI_TABRMD_CONTEXT *ctx,
+                          const uint8_t            *command,
+                          size_t                    size)
+{
+    size_t response_size = sizeof (ctx->buf);
+
+    if (ctx->response_page == NULL ||
+        !response_page_lookup (ctx->response_page,
+                               ctx->tpm,
+                               command,
+                               size,
+                               ctx->buf,
+                               &response_size) ||
+        get_response_size (ctx->buf) != response_size)
+    {
+        return FALSE;
+    }
+    ctx->header.tag  = get_response_tag  (ctx->buf);
+    ctx->header.size = get_response_size (ctx->buf);
+    ctx->header.code = get_response_code (ctx->buf);
+    ctx->index = response_size;
+    ctx->local = TRUE;
+    return TRUE;
+}
 TSS2_RC
 tss2_tcti_tabrmd_transmit (TSS2_TCTI_CONTEXT *context,
                            size_t             size,
                            const uint8_t      *command)
 {
-    ssize_t write_ret;
-    TSS2_RC tss2_ret = TSS2_RC_SUCCESS;
-    GOutputStream *ostream;
+    TSS2_RC tss2_ret;
+    shm_transport_t *shm;
+    const uint8_t doorbell = SHM_TRANSPORT_DOORBELL;
+    const uint8_t *buf = command;
+    size_t buf_size = size;
 
     g_debug ("tss2_tcti_tabrmd_transmit");
     if (context == NULL || command == NULL) {
@@ -40,35 +124,148 @@ tss2_tcti_tabrmd_transmit (TSS2_TCTI_CONTEXT *context,
         TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
         return TSS2_TCTI_RC_BAD_CONTEXT;
     }
-    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_TRANSMIT) {
+    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_TRANSMIT ||
+        TSS2_TCTI_TABRMD_TAGGED (context)) {
         return TSS2_TCTI_RC_BAD_SEQUENCE;
     }
-    g_debug_bytes (command, size, 16, 4);
-    ostream = g_io_stream_get_output_stream (TSS2_TCTI_TABRMD_IOSTREAM (context));
-    g_debug ("%s: blocking write on ostream", __func__);
-    write_ret = write_all (ostream, command, size);
-    /* should switch on possible errors to translate to TSS2 error codes */
-    switch (write_ret) {
-    case -1:
-        g_debug ("tss2_tcti_tabrmd_transmit: error writing to pipe: %s",
-                 strerror (errno));
-        tss2_ret = TSS2_TCTI_RC_IO_ERROR;
-        break;
-    case 0:
-        g_debug ("tss2_tcti_tabrmd_transmit: EOF returned writing to pipe");
-        tss2_ret = TSS2_TCTI_RC_NO_CONNECTION;
-        break;
-    default:
-        if (write_ret == (ssize_t) size) {
-            TSS2_TCTI_TABRMD_STATE (context) = TABRMD_STATE_RECEIVE;
-        } else {
-            g_debug ("tss2_tcti_tabrmd_transmit: short write");
-            tss2_ret = TSS2_TCTI_RC_GENERAL_FAILURE;
+    tabrmd_debug_bytes (command, size, 16, 4);
+    if (tcti_tabrmd_answer_local ((TSS2_TCTI_TABRMD_CONTEXT*)context,
+                                  command,
+                                  size))
+    {
+        g_debug ("%s: answered from the response page", __func__);
+        TSS2_TCTI_TABRMD_STATE (context) = TABRMD_STATE_RECEIVE;
+        return TSS2_RC_SUCCESS;
+    }
+    /* with shared memory only the doorbell goes over the socket */
+    shm = TSS2_TCTI_TABRMD_SHM (context);
+    if (shm != NULL) {
+        if (size > SHM_TRANSPORT_SLOT_SIZE) {
+            return TSS2_TCTI_RC_BAD_VALUE;
         }
-        break;
+        memcpy (shm->command, command, size);
+        shm->command_size = (uint32_t)size;
+        buf = &doorbell;
+        buf_size = 1;
+    }
+    tss2_ret = tcti_tabrmd_write (context, buf, buf_size);
+    if (tss2_ret == TSS2_RC_SUCCESS) {
+        TSS2_TCTI_TABRMD_STATE (context) = TABRMD_STATE_RECEIVE;
     }
     return tss2_ret;
 }
+/*
+ * Send a command on a connection using the tagged transport. The command
+ * is preceded by 'tag' in a single write. Any number of commands may be
+ * sent before their responses are received.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_TransmitTagged (TSS2_TCTI_CONTEXT *context,
+                                 uint32_t           tag,
+                                 size_t             size,
+                                 const uint8_t     *command)
+{
+    uint8_t *frame;
+    TSS2_RC rc;
+
+    g_debug ("%s: tag 0x%" PRIx32, __func__, tag);
+    if (context == NULL || command == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (size == 0 || size > UTIL_BUF_MAX - TABRMD_REQUEST_TAG_SIZE) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_TRANSMIT ||
+        !TSS2_TCTI_TABRMD_TAGGED (context)) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    tabrmd_debug_bytes (command, size, 16, 4);
+    frame = g_malloc (TABRMD_REQUEST_TAG_SIZE + size);
+    *(uint32_t*)frame = htobe32 (tag);
+    memcpy (&frame [TABRMD_REQUEST_TAG_SIZE], command, size);
+    rc = tcti_tabrmd_write (context, frame, TABRMD_REQUEST_TAG_SIZE + size);
+    g_free (frame);
+    if (rc == TSS2_RC_SUCCESS) {
+        ++TSS2_TCTI_TABRMD_PENDING (context);
+    }
+    return rc;
+}
+/*
+ * Send 'count' commands on a connection using the tagged transport as a
+ * single batch frame, see TABRMD_BATCH_TAG. The frame goes out in a
+ * single write. Each command counts as one pending response.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_SubmitBatch (TSS2_TCTI_CONTEXT    *context,
+                              uint32_t              flags,
+                              size_t                count,
+                              const uint32_t       *tags,
+                              const size_t         *sizes,
+                              const uint8_t *const *commands)
+{
+    uint8_t *frame;
+    size_t frame_size, offset, i;
+    uint32_t tag;
+    TSS2_RC rc;
+
+    g_debug ("%s: %zu commands", __func__, count);
+    if (context == NULL || tags == NULL || sizes == NULL || commands == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (count == 0 || (flags & ~TSS2_TCTI_TABRMD_BATCH_STOP_ON_ERROR) != 0) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    frame_size = TABRMD_REQUEST_TAG_SIZE + TPM_HEADER_SIZE;
+    for (i = 0; i < count; ++i) {
+        if (commands [i] == NULL) {
+            return TSS2_TCTI_RC_BAD_REFERENCE;
+        }
+        if (sizes [i] < TPM_HEADER_SIZE || sizes [i] > UTIL_BUF_MAX) {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        frame_size += TABRMD_REQUEST_TAG_SIZE + sizes [i];
+        if (frame_size > UTIL_BUF_MAX) {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+    }
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_TRANSMIT ||
+        !TSS2_TCTI_TABRMD_TAGGED (context)) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    frame = g_malloc0 (frame_size);
+    rc = tpm2_header_init (&frame [TABRMD_REQUEST_TAG_SIZE],
+                           frame_size - TABRMD_REQUEST_TAG_SIZE,
+                           TABRMD_BATCH_TAG,
+                           frame_size - TABRMD_REQUEST_TAG_SIZE,
+                           flags);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_free (frame);
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    }
+    offset = TABRMD_REQUEST_TAG_SIZE + TPM_HEADER_SIZE;
+    for (i = 0; i < count; ++i) {
+        tag = htobe32 (tags [i]);
+        memcpy (&frame [offset], &tag, sizeof (tag));
+        offset += TABRMD_REQUEST_TAG_SIZE;
+        memcpy (&frame [offset], commands [i], sizes [i]);
+        offset += sizes [i];
+    }
+    tabrmd_debug_bytes (frame, frame_size, 16, 4);
+    rc = tcti_tabrmd_write (context, frame, frame_size);
+    g_free (frame);
+    if (rc == TSS2_RC_SUCCESS) {
+        TSS2_TCTI_TABRMD_PENDING (context) += count;
+    }
+    return rc;
+}
 /*
  * This function maps errno values to TCTI RCs.
  */
@@ -86,6 +283,8 @@ errno_to_tcti_rc (int error_number)
 #endif
         return TSS2_TCTI_RC_TRY_AGAIN;
     case EIO:
+    case ECONNRESET:
+    case ENOTCONN:
         return TSS2_TCTI_RC_IO_ERROR;
     default:
         g_debug ("mapping errno %d with message \"%s\" to "
@@ -94,35 +293,6 @@ errno_to_tcti_rc (int error_number)
         return TSS2_TCTI_RC_GENERAL_FAILURE;
     }
 }
-/*
- * This function maps GError code values to TCTI RCs.
- */
-static TSS2_RC
-gerror_code_to_tcti_rc (int error_number)
-{
-    switch (error_number) {
-    case -1:
-        return TSS2_TCTI_RC_NO_CONNECTION;
-    case G_IO_ERROR_WOULD_BLOCK:
-        return TSS2_TCTI_RC_TRY_AGAIN;
-    case G_IO_ERROR_FAILED:
-    case G_IO_ERROR_HOST_UNREACHABLE:
-    case G_IO_ERROR_NETWORK_UNREACHABLE:
-#if G_IO_ERROR_BROKEN_PIPE != G_IO_ERROR_CONNECTION_CLOSED
-    case G_IO_ERROR_CONNECTION_CLOSED:
-#endif
-#if GLIB_MAJOR_VERSION == 2 && GLIB_MINOR_VERSION >= 44
-    case G_IO_ERROR_NOT_CONNECTED:
-#endif
-        return TSS2_TCTI_RC_IO_ERROR;
-    default:
-        g_debug ("mapping errno %d with message \"%s\" to "
-                 "TSS2_TCTI_RC_GENERAL_FAILURE",
-                 error_number, strerror (error_number));
-        return TSS2_TCTI_RC_GENERAL_FAILURE;
-    }
-}
-
 #if defined(__FreeBSD__)
 #ifndef POLLRDHUP
 #define POLLRDHUP 0x0
@@ -176,59 +346,123 @@ tcti_tabrmd_poll (int        fd,
     }
 }
 /*
- * Read as much of the requested data as possible into the provided buffer.
- * If the read would block, return TSS2_TCTI_RC_TRY_AGAIN (a short read will
- * write data into the buffer first).
+ * Read up to 'size' bytes into 'buf' at the current index and advance the
+ * index by the number of bytes read. The read returns as soon as any data
+ * is available. A blocking socket already waits for data in the read
+ * itself so the poll is skipped when the caller is willing to block.
+ * If the read would block, return TSS2_TCTI_RC_TRY_AGAIN.
  * If an error occurs map that to the appropriate TSS2_RC and return.
  */
-TSS2_RC
-tcti_tabrmd_read (TSS2_TCTI_TABRMD_CONTEXT *ctx,
+static TSS2_RC
+tcti_tabrmd_recv (TSS2_TCTI_TABRMD_CONTEXT *ctx,
                   uint8_t *buf,
                   size_t size,
                   int32_t timeout)
 {
-    GError *error = NULL;
     ssize_t num_read;
     int ret;
 
-    ret = tcti_tabrmd_poll (TSS2_TCTI_TABRMD_FD (ctx), timeout);
-    switch (ret) {
-    case -1:
-        return TSS2_TCTI_RC_TRY_AGAIN;
-    case 0:
-        break;
-    default:
-        return errno_to_tcti_rc (ret);
+    if (timeout != TSS2_TCTI_TIMEOUT_BLOCK || !TSS2_TCTI_TABRMD_BLOCKING (ctx)) {
+        ret = tcti_tabrmd_poll (TSS2_TCTI_TABRMD_FD (ctx), timeout);
+        switch (ret) {
+        case -1:
+            return TSS2_TCTI_RC_TRY_AGAIN;
+        case 0:
+            break;
+        default:
+            return errno_to_tcti_rc (ret);
+        }
     }
 
-    num_read = g_input_stream_read (TSS2_TCTI_TABRMD_ISTREAM (ctx),
-                                    (gchar*)&buf [ctx->index],
-                                    size,
-                                    NULL,
-                                    &error);
+    num_read = TABRMD_ERRNO_EINTR_RETRY (recv (TSS2_TCTI_TABRMD_FD (ctx),
+                                               &buf [ctx->index],
+                                               size,
+                                               0));
     switch (num_read) {
     case 0:
         g_debug ("read produced EOF");
         return TSS2_TCTI_RC_NO_CONNECTION;
     case -1:
-        g_assert (error != NULL);
-        g_warning ("%s: read on istream produced error: %s", __func__,
-                   error->message);
-        ret = error->code;
-        g_error_free (error);
-        return gerror_code_to_tcti_rc (ret);
+        ret = errno;
+        tabrmd_warning_ratelimited ("%s: read on fd %d produced error: %s",
+                                    __func__, TSS2_TCTI_TABRMD_FD (ctx),
+                                    strerror (ret));
+        return errno_to_tcti_rc (ret);
     default:
-        g_debug ("successfully read %zd bytes", num_read);
-        g_debug_bytes (&buf [ctx->index], num_read, 16, 4);
+        tabrmd_debug ("successfully read %zd bytes", num_read);
+        tabrmd_debug_bytes (&buf [ctx->index], num_read, 16, 4);
         /* Advance index by the number of bytes read. */
         ctx->index += num_read;
-        /* short read means try again */
-        if (size - num_read != 0) {
-            return TSS2_TCTI_RC_TRY_AGAIN;
-        } else {
-            return TSS2_RC_SUCCESS;
+        return TSS2_RC_SUCCESS;
+    }
+}
+/*
+ * Read as much of the requested data as possible into the provided buffer.
+ * If the read would block, return TSS2_TCTI_RC_TRY_AGAIN (a short read will
+ * write data into the buffer first).
+ * If an error occurs map that to the appropriate TSS2_RC and return.
+ */
+TSS2_RC
+tcti_tabrmd_read (TSS2_TCTI_TABRMD_CONTEXT *ctx,
+                  uint8_t *buf,
+                  size_t size,
+                  int32_t timeout)
+{
+    size_t index = ctx->index;
+    TSS2_RC rc;
+
+    rc = tcti_tabrmd_recv (ctx, buf, size, timeout);
+    /* short read means try again */
+    if (rc == TSS2_RC_SUCCESS && ctx->index - index != size) {
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    return rc;
+}
+/*
+ * Receive a response over the shared memory transport: wait for the
+ * doorbell and copy the response out of the shared response slot. The
+ * doorbell is kept in 'buf' so that a caller querying the size or
+ * passing a buffer that's too small can call again.
+ */
+TSS2_RC
+tcti_tabrmd_receive_shm (TSS2_TCTI_TABRMD_CONTEXT *ctx,
+                         size_t                   *size,
+                         uint8_t                  *response,
+                         int32_t                   timeout)
+{
+    shm_transport_t *shm = ctx->shm;
+    uint32_t response_size;
+    TSS2_RC rc;
+
+    if (ctx->index == 0) {
+        rc = tcti_tabrmd_read (ctx, ctx->buf, 1, timeout);
+        if (rc != TSS2_RC_SUCCESS) {
+            return rc;
+        }
+        response_size = shm->response_size;
+        if (ctx->buf [0] != SHM_TRANSPORT_DOORBELL ||
+            response_size < TPM_HEADER_SIZE ||
+            response_size > SHM_TRANSPORT_SLOT_SIZE ||
+            get_response_size (shm->response) != response_size)
+        {
+            ctx->index = 0;
+            ctx->state = TABRMD_STATE_TRANSMIT;
+            return TSS2_TCTI_RC_MALFORMED_RESPONSE;
         }
+        ctx->header.size = response_size;
+    }
+    if (response == NULL) {
+        *size = ctx->header.size;
+        return TSS2_RC_SUCCESS;
+    }
+    if (*size < ctx->header.size) {
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
     }
+    memcpy (response, shm->response, ctx->header.size);
+    *size = ctx->header.size;
+    ctx->index = 0;
+    ctx->state = TABRMD_STATE_TRANSMIT;
+    return TSS2_RC_SUCCESS;
 }
 /*
  * This is the receive function that is exposed to clients through the TCTI
@@ -267,52 +501,157 @@ tss2_tcti_tabrmd_receive (TSS2_TCTI_CONTEXT *context,
     if (response != NULL && *size < TPM_HEADER_SIZE) {
         return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
     }
-    /* make sure we've got the response header */
+    if (tabrmd_ctx->shm != NULL && !tabrmd_ctx->local) {
+        return tcti_tabrmd_receive_shm (tabrmd_ctx, size, response, timeout);
+    }
+    /*
+     * Read opportunistically into the context buffer: the whole response
+     * normally arrives with the header in a single read.
+     */
     if (tabrmd_ctx->index < TPM_HEADER_SIZE) {
-        rc = tcti_tabrmd_read (tabrmd_ctx,
-                               tabrmd_ctx->header_buf,
-                               TPM_HEADER_SIZE - tabrmd_ctx->index,
+        rc = tcti_tabrmd_recv (tabrmd_ctx,
+                               tabrmd_ctx->buf,
+                               sizeof (tabrmd_ctx->buf) - tabrmd_ctx->index,
                                timeout);
         if (rc != TSS2_RC_SUCCESS)
             return rc;
-        if (tabrmd_ctx->index == TPM_HEADER_SIZE) {
-            tabrmd_ctx->header.tag  = get_response_tag  (tabrmd_ctx->header_buf);
-            tabrmd_ctx->header.size = get_response_size (tabrmd_ctx->header_buf);
-            tabrmd_ctx->header.code = get_response_code (tabrmd_ctx->header_buf);
-            if (tabrmd_ctx->header.size < TPM_HEADER_SIZE) {
-                tabrmd_ctx->state = TABRMD_STATE_TRANSMIT;
-                return TSS2_TCTI_RC_MALFORMED_RESPONSE;
-            }
+        if (tabrmd_ctx->index < TPM_HEADER_SIZE)
+            return TSS2_TCTI_RC_TRY_AGAIN;
+        tabrmd_ctx->header.tag  = get_response_tag  (tabrmd_ctx->buf);
+        tabrmd_ctx->header.size = get_response_size (tabrmd_ctx->buf);
+        tabrmd_ctx->header.code = get_response_code (tabrmd_ctx->buf);
+        if (tabrmd_ctx->header.size < TPM_HEADER_SIZE ||
+            tabrmd_ctx->header.size > sizeof (tabrmd_ctx->buf) ||
+            tabrmd_ctx->header.size < tabrmd_ctx->index)
+        {
+            tabrmd_ctx->index = 0;
+            tabrmd_ctx->state = TABRMD_STATE_TRANSMIT;
+            return TSS2_TCTI_RC_MALFORMED_RESPONSE;
         }
     }
     /* if response is NULL, caller is querying size, we know size isn't NULL */
     if (response == NULL) {
         *size = tabrmd_ctx->header.size;
         return TSS2_RC_SUCCESS;
-    } else if (tabrmd_ctx->index == TPM_HEADER_SIZE) {
-        /* once we have the header and a buffer from the caller, copy */
-        memcpy (response, tabrmd_ctx->header_buf, TPM_HEADER_SIZE);
     }
     if (*size < tabrmd_ctx->header.size) {
         return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
     }
-    /* the whole response has been read already */
-    if (tabrmd_ctx->header.size == tabrmd_ctx->index) {
-        goto out;
-    }
-    rc = tcti_tabrmd_read (tabrmd_ctx,
-                           response,
-                           tabrmd_ctx->header.size - tabrmd_ctx->index,
-                           timeout);
-out:
-    if (rc == TSS2_RC_SUCCESS) {
-        /* We got all the bytes we asked for, reset the index & state: done */
-        *size = tabrmd_ctx->index;
-        tabrmd_ctx->index = 0;
-        tabrmd_ctx->state = TABRMD_STATE_TRANSMIT;
+    if (tabrmd_ctx->index < tabrmd_ctx->header.size) {
+        rc = tcti_tabrmd_read (tabrmd_ctx,
+                               tabrmd_ctx->buf,
+                               tabrmd_ctx->header.size - tabrmd_ctx->index,
+                               timeout);
+        if (rc != TSS2_RC_SUCCESS)
+            return rc;
     }
+    /* We got the whole response, copy it out & reset the index & state */
+    memcpy (response, tabrmd_ctx->buf, tabrmd_ctx->header.size);
+    *size = tabrmd_ctx->header.size;
+    tabrmd_ctx->index = 0;
+    tabrmd_ctx->local = FALSE;
+    tabrmd_ctx->state = TABRMD_STATE_TRANSMIT;
     return rc;
 }
+/*
+ * Return the size of the tagged response at the start of the receive
+ * buffer including its request tag, or 0 if the response header hasn't
+ * been read yet.
+ */
+static size_t
+tcti_tabrmd_tagged_frame_size (TSS2_TCTI_TABRMD_CONTEXT *ctx)
+{
+    if (ctx->index < TABRMD_REQUEST_TAG_SIZE + TPM_HEADER_SIZE) {
+        return 0;
+    }
+    return TABRMD_REQUEST_TAG_SIZE +
+        get_response_size (&ctx->buf [TABRMD_REQUEST_TAG_SIZE]);
+}
+/*
+ * Receive the next response on a connection using the tagged transport.
+ * Responses arrive in the order the daemon completes the commands, which
+ * isn't necessarily the order they were sent in: the tag passed to
+ * Tss2_Tcti_Tabrmd_TransmitTagged is returned through 'tag'.
+ * A single read may bring in more than one response. The responses after
+ * the first stay buffered and are returned by later calls without reading
+ * the socket, so callers must call this until it returns
+ * TSS2_TCTI_RC_TRY_AGAIN before they poll the socket.
+ * As with the regular receive function, a NULL 'response' returns the
+ * size of the next response.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_ReceiveTagged (TSS2_TCTI_CONTEXT *context,
+                                uint32_t          *tag,
+                                size_t            *size,
+                                uint8_t           *response,
+                                int32_t            timeout)
+{
+    TSS2_TCTI_TABRMD_CONTEXT *ctx = (TSS2_TCTI_TABRMD_CONTEXT*)context;
+    size_t frame_size, response_size;
+    TSS2_RC rc;
+
+    g_debug ("%s", __func__);
+    if (context == NULL || tag == NULL || size == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (response == NULL && *size != 0) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (ctx->state != TABRMD_STATE_TRANSMIT || !ctx->tagged ||
+        ctx->pending == 0) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    if (timeout < TSS2_TCTI_TIMEOUT_BLOCK) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    /* only go to the socket if there's no complete response buffered */
+    frame_size = tcti_tabrmd_tagged_frame_size (ctx);
+    if (frame_size == 0 ||
+        (frame_size <= sizeof (ctx->buf) && ctx->index < frame_size))
+    {
+        rc = tcti_tabrmd_recv (ctx,
+                               ctx->buf,
+                               sizeof (ctx->buf) - ctx->index,
+                               timeout);
+        if (rc != TSS2_RC_SUCCESS) {
+            return rc;
+        }
+        frame_size = tcti_tabrmd_tagged_frame_size (ctx);
+    }
+    if (frame_size == 0) {
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    if (frame_size < TABRMD_REQUEST_TAG_SIZE + TPM_HEADER_SIZE ||
+        frame_size > sizeof (ctx->buf))
+    {
+        /* there's no telling where the next response starts */
+        ctx->index = 0;
+        ctx->pending = 0;
+        return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    }
+    *tag = be32toh (*(uint32_t*)ctx->buf);
+    response_size = frame_size - TABRMD_REQUEST_TAG_SIZE;
+    if (response == NULL) {
+        *size = response_size;
+        return TSS2_RC_SUCCESS;
+    }
+    if (*size < response_size) {
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+    if (ctx->index < frame_size) {
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    memcpy (response, &ctx->buf [TABRMD_REQUEST_TAG_SIZE], response_size);
+    *size = response_size;
+    ctx->index -= frame_size;
+    memmove (ctx->buf, &ctx->buf [frame_size], ctx->index);
+    --ctx->pending;
+    return TSS2_RC_SUCCESS;
+}
 
 void
 tss2_tcti_tabrmd_finalize (TSS2_TCTI_CONTEXT *context)
@@ -324,7 +663,136 @@ tss2_tcti_tabrmd_finalize (TSS2_TCTI_CONTEXT *context)
     }
     TSS2_TCTI_TABRMD_STATE (context) = TABRMD_STATE_FINAL;
     g_clear_object (&TSS2_TCTI_TABRMD_SOCK_CONNECT (context));
+    TSS2_TCTI_TABRMD_FD (context) = -1;
     g_clear_object (&TSS2_TCTI_TABRMD_PROXY (context));
+    g_clear_pointer (&TSS2_TCTI_TABRMD_SHM (context), shm_transport_unmap);
+    g_clear_pointer (&TSS2_TCTI_TABRMD_SOCKET_ADDRESS (context), g_free);
+    g_clear_pointer (&TSS2_TCTI_TABRMD_RESPONSE_PAGE (context),
+                     response_page_unmap);
+}
+
+/*
+ * Connect to the daemon's UNIX socket frontend at 'address', send
+ * 'request' and read the response into 'response'.
+ * Returns the connected socket or NULL if the daemon couldn't be reached.
+ */
+static GSocket*
+tcti_tabrmd_socket_request (const gchar                     *address,
+                            const socket_protocol_request_t *request,
+                            socket_protocol_response_t      *response)
+{
+    GSocketAddress *sockaddr;
+    GSocket *sock;
+    GError *error = NULL;
+    gssize ret;
+    gsize done;
+
+    sock = g_socket_new (G_SOCKET_FAMILY_UNIX,
+                         G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_DEFAULT,
+                         &error);
+    if (sock == NULL) {
+        goto fail_out;
+    }
+    sockaddr = socket_protocol_address_new (address);
+    ret = g_socket_connect (sock, sockaddr, NULL, &error);
+    g_object_unref (sockaddr);
+    if (!ret) {
+        goto fail_out;
+    }
+    ret = g_socket_send (sock,
+                         (const gchar*)request,
+                         sizeof (*request),
+                         NULL,
+                         &error);
+    if (ret != (gssize)sizeof (*request)) {
+        goto fail_out;
+    }
+    for (done = 0; done < sizeof (*response); done += ret) {
+        ret = g_socket_receive (sock,
+                                (gchar*)response + done,
+                                sizeof (*response) - done,
+                                NULL,
+                                &error);
+        if (ret <= 0) {
+            goto fail_out;
+        }
+    }
+    return sock;
+fail_out:
+    g_warning ("Failed to send request to the daemon at %s: %s", address,
+               error != NULL ? error->message : "connection closed");
+    g_clear_error (&error);
+    g_clear_object (&sock);
+    return NULL;
+}
+/*
+ * Send a control frame for 'op' with the 'arg_size' bytes of 'arg' on the
+ * connection's socket, see TABRMD_CONTROL_TAG. It's written in one piece
+ * so that it can't be split by a command sent right after.
+ */
+static TSS2_RC
+tcti_tabrmd_control_frame (TSS2_TCTI_CONTEXT   *context,
+                           tabrmd_control_op_t  op,
+                           const uint8_t       *arg,
+                           size_t               arg_size)
+{
+    uint8_t frame [TABRMD_REQUEST_TAG_SIZE + TABRMD_CONTROL_SIZE_MAX] = { 0 };
+    uint8_t *control = frame;
+    size_t size = TPM_HEADER_SIZE + arg_size;
+    TSS2_RC rc;
+
+    g_assert (size <= TABRMD_CONTROL_SIZE_MAX);
+    if (TSS2_TCTI_TABRMD_TAGGED (context)) {
+        control = &frame [TABRMD_REQUEST_TAG_SIZE];
+    }
+    rc = tpm2_header_init (control,
+                           TPM_HEADER_SIZE + arg_size,
+                           TABRMD_CONTROL_TAG,
+                           TPM_HEADER_SIZE + arg_size,
+                           op);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    memcpy (&control [TPM_HEADER_SIZE], arg, arg_size);
+    if (TSS2_TCTI_TABRMD_TAGGED (context)) {
+        size += TABRMD_REQUEST_TAG_SIZE;
+    }
+    return tcti_tabrmd_write (context, frame, size);
+}
+/*
+ * Send a control frame for 'op' with its one byte argument.
+ */
+static TSS2_RC
+tcti_tabrmd_control (TSS2_TCTI_CONTEXT   *context,
+                     tabrmd_control_op_t  op,
+                     uint8_t              arg)
+{
+    return tcti_tabrmd_control_frame (context, op, &arg, sizeof (arg));
+}
+/*
+ * Send the Cancel, SetLocality or Lease 'request' for the context's
+ * connection to the daemon's UNIX socket frontend. The version and
+ * connection ID are filled in here.
+ * Returns the RC from the daemon.
+ */
+static TSS2_RC
+tcti_tabrmd_socket_call (TSS2_TCTI_CONTEXT         *context,
+                         socket_protocol_request_t *request)
+{
+    socket_protocol_response_t response = { 0 };
+    GSocket *sock;
+
+    request->version = SOCKET_PROTOCOL_VERSION;
+    request->id = TSS2_TCTI_TABRMD_ID (context);
+    sock = tcti_tabrmd_socket_request (TSS2_TCTI_TABRMD_SOCKET_ADDRESS (context),
+                                       request,
+                                       &response);
+    if (sock == NULL) {
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    }
+    g_object_unref (sock);
+    return response.rc;
 }
 
 TSS2_RC
@@ -337,80 +805,326 @@ tss2_tcti_tabrmd_cancel (TSS2_TCTI_CONTEXT *context)
     if (context == NULL) {
         return TSS2_TCTI_RC_BAD_CONTEXT;
     }
-    g_info("tss2_tcti_tabrmd_cancel: id 0x%" PRIx64,
-           TSS2_TCTI_TABRMD_ID (context));
-    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_RECEIVE) {
-        return TSS2_TCTI_RC_BAD_SEQUENCE;
-    }
-    cancel_ret = tcti_tabrmd_call_cancel_sync (
-                     TSS2_TCTI_TABRMD_PROXY (context),
-                     TSS2_TCTI_TABRMD_ID (context),
-                     &ret,
-                     NULL,
-                     &error);
-    if (cancel_ret == FALSE) {
-        g_warning ("cancel command failed with error code: 0x%" PRIx32
-                   ", messag: %s", error->code, error->message);
-        ret = error->code;
-        g_error_free (error);
+    g_info("tss2_tcti_tabrmd_cancel: id 0x%" PRIx64,
+           TSS2_TCTI_TABRMD_ID (context));
+    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_RECEIVE &&
+        TSS2_TCTI_TABRMD_PENDING (context) == 0) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    /* the daemon never saw the command, its response is already here */
+    if (((TSS2_TCTI_TABRMD_CONTEXT*)context)->local) {
+        return TSS2_RC_SUCCESS;
+    }
+    if (TSS2_TCTI_TABRMD_CONTROL (context)) {
+        return tcti_tabrmd_control (context, TABRMD_CONTROL_CANCEL, 0);
+    }
+    if (TSS2_TCTI_TABRMD_SOCKET_ADDRESS (context) != NULL) {
+        socket_protocol_request_t request = { .op = SOCKET_PROTOCOL_CANCEL };
+        return tcti_tabrmd_socket_call (context, &request);
+    }
+    cancel_ret = tcti_tabrmd_call_cancel_sync (
+                     TSS2_TCTI_TABRMD_PROXY (context),
+                     TSS2_TCTI_TABRMD_ID (context),
+                     &ret,
+                     NULL,
+                     &error);
+    if (cancel_ret == FALSE) {
+        g_warning ("cancel command failed with error code: 0x%" PRIx32
+                   ", messag: %s", error->code, error->message);
+        ret = error->code;
+        g_error_free (error);
+    }
+
+    return ret;
+}
+
+TSS2_RC
+tss2_tcti_tabrmd_get_poll_handles (TSS2_TCTI_CONTEXT     *context,
+                                   TSS2_TCTI_POLL_HANDLE *handles,
+                                   size_t                *num_handles)
+{
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (num_handles == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (handles != NULL && *num_handles < 1) {
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+    *num_handles = 1;
+    if (handles != NULL) {
+        handles [0].fd = TSS2_TCTI_TABRMD_FD (context);
+    }
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_RC
+tss2_tcti_tabrmd_set_locality (TSS2_TCTI_CONTEXT *context,
+                               guint8             locality)
+{
+    gboolean status;
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+    GError *error = NULL;
+
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    g_info ("tss2_tcti_tabrmd_set_locality: id 0x%" PRIx64,
+            TSS2_TCTI_TABRMD_ID (context));
+    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_TRANSMIT ||
+        TSS2_TCTI_TABRMD_PENDING (context) != 0) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    if (TSS2_TCTI_TABRMD_CONTROL (context)) {
+        return tcti_tabrmd_control (context,
+                                    TABRMD_CONTROL_SET_LOCALITY,
+                                    locality);
+    }
+    if (TSS2_TCTI_TABRMD_SOCKET_ADDRESS (context) != NULL) {
+        socket_protocol_request_t request = {
+            .op = SOCKET_PROTOCOL_SET_LOCALITY,
+            .locality = locality,
+        };
+        return tcti_tabrmd_socket_call (context, &request);
+    }
+    status = tcti_tabrmd_call_set_locality_sync (
+                 TSS2_TCTI_TABRMD_PROXY (context),
+                 TSS2_TCTI_TABRMD_ID (context),
+                 locality,
+                 &ret,
+                 NULL,
+                 &error);
+
+    if (status == FALSE) {
+        g_warning ("set locality command failed with error code: 0x%" PRIx32
+                   ", message: %s", error->code, error->message);
+        ret = error->code;
+        g_error_free (error);
+    }
+
+    return ret;
+}
+
+/*
+ * Send a Lease request for 'commands' commands to the daemon. A
+ * 'commands' of 0 releases the lease.
+ */
+static TSS2_RC
+tcti_tabrmd_lease (TSS2_TCTI_CONTEXT *context,
+                   uint32_t           commands,
+                   uint32_t           timeout)
+{
+    gboolean status;
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+    GError *error = NULL;
+
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    g_info ("%s: id 0x%" PRIx64 " commands %" PRIu32 " timeout %" PRIu32,
+            __func__, TSS2_TCTI_TABRMD_ID (context), commands, timeout);
+    if (TSS2_TCTI_TABRMD_SOCKET_ADDRESS (context) != NULL) {
+        socket_protocol_request_t request = {
+            .op = SOCKET_PROTOCOL_LEASE,
+            .tpm = commands,
+            .transport = timeout,
+        };
+        return tcti_tabrmd_socket_call (context, &request);
+    }
+    status = tcti_tabrmd_call_lease_sync (TSS2_TCTI_TABRMD_PROXY (context),
+                                          TSS2_TCTI_TABRMD_ID (context),
+                                          commands,
+                                          timeout,
+                                          &ret,
+                                          NULL,
+                                          &error);
+    if (status == FALSE) {
+        g_warning ("lease command failed with error code: 0x%" PRIx32
+                   ", message: %s", error->code, error->message);
+        ret = error->code;
+        g_error_free (error);
+    }
+
+    return ret;
+}
+/*
+ * Ask the daemon to serve only this connection's commands on its TPM
+ * for the next 'commands' commands or 'timeout' milliseconds, whichever
+ * ends first. The daemon cuts 'timeout' to its --max-lease-time.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_AcquireLease (TSS2_TCTI_CONTEXT *context,
+                               uint32_t           commands,
+                               uint32_t           timeout)
+{
+    if (commands == 0 || timeout == 0) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    return tcti_tabrmd_lease (context, commands, timeout);
+}
+/*
+ * Give up a lease taken with Tss2_Tcti_Tabrmd_AcquireLease before it
+ * runs out.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_ReleaseLease (TSS2_TCTI_CONTEXT *context)
+{
+    return tcti_tabrmd_lease (context, 0, 0);
+}
+/*
+ * Tell the daemon how long the caller waits for each command sent after
+ * this, see TABRMD_CONTROL_SET_TIMEOUT. The timeout is sent in band so it
+ * applies from the next command on, whatever is in flight.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_SetCommandTimeout (TSS2_TCTI_CONTEXT *context,
+                                    uint32_t           timeout)
+{
+    uint32_t timeout_be = GUINT32_TO_BE (timeout);
+
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (!TSS2_TCTI_TABRMD_CONTROL (context) ||
+        (TSS2_TCTI_TABRMD_FEATURES (context) & TABRMD_FEATURE_TIMEOUT) == 0)
+    {
+        return TSS2_TCTI_RC_NOT_IMPLEMENTED;
     }
-
-    return ret;
+    g_debug ("%s: id 0x%" PRIx64 " timeout %" PRIu32, __func__,
+             TSS2_TCTI_TABRMD_ID (context), timeout);
+    return tcti_tabrmd_control_frame (context,
+                                      TABRMD_CONTROL_SET_TIMEOUT,
+                                      (const uint8_t*)&timeout_be,
+                                      sizeof (timeout_be));
 }
+/*
+ * Decode the 2 * 'size' hex digits at 'hex' into 'buf'. Returns the bytes
+ * ORed together, so 0 if they're all zero, or -1 if a digit isn't hex.
+ */
+static gint
+tcti_tabrmd_hex_decode (const char *hex,
+                        uint8_t    *buf,
+                        size_t      size)
+{
+    gint high, low, any = 0;
+    size_t i;
 
+    for (i = 0; i < size; ++i) {
+        high = g_ascii_xdigit_value (hex [i * 2]);
+        low = g_ascii_xdigit_value (hex [i * 2 + 1]);
+        if (high == -1 || low == -1) {
+            return -1;
+        }
+        buf [i] = (uint8_t)(high << 4 | low);
+        any |= buf [i];
+    }
+    return any;
+}
+/*
+ * Make the commands sent after this part of the trace in 'traceparent', a
+ * W3C traceparent header of version 00, see TABRMD_CONTROL_SET_TRACE_CONTEXT:
+ * "00-" 32 hex digits of trace ID "-" 16 of parent ID "-" 2 of flags. IDs
+ * that are all zero are invalid. NULL ends the trace.
+ */
 TSS2_RC
-tss2_tcti_tabrmd_get_poll_handles (TSS2_TCTI_CONTEXT     *context,
-                                   TSS2_TCTI_POLL_HANDLE *handles,
-                                   size_t                *num_handles)
+Tss2_Tcti_Tabrmd_SetTraceParent (TSS2_TCTI_CONTEXT *context,
+                                 const char        *traceparent)
 {
+    uint8_t arg [TRACE_CONTEXT_SIZE] = { 0 };
+    uint8_t *parent_id = &arg [TRACE_CONTEXT_TRACE_ID_SIZE];
+    uint8_t *flags = &parent_id [TRACE_CONTEXT_SPAN_ID_SIZE];
+
     if (context == NULL) {
         return TSS2_TCTI_RC_BAD_CONTEXT;
     }
-    if (num_handles == NULL) {
-        return TSS2_TCTI_RC_BAD_REFERENCE;
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
     }
-    if (handles != NULL && *num_handles < 1) {
-        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    if (traceparent != NULL &&
+        (strlen (traceparent) != 55 ||
+         strncmp (traceparent, "00-", 3) != 0 ||
+         traceparent [35] != '-' ||
+         traceparent [52] != '-' ||
+         tcti_tabrmd_hex_decode (&traceparent [3],
+                                 arg,
+                                 TRACE_CONTEXT_TRACE_ID_SIZE) <= 0 ||
+         tcti_tabrmd_hex_decode (&traceparent [36],
+                                 parent_id,
+                                 TRACE_CONTEXT_SPAN_ID_SIZE) <= 0 ||
+         tcti_tabrmd_hex_decode (&traceparent [53], flags, 1) < 0))
+    {
+        return TSS2_TCTI_RC_BAD_VALUE;
     }
-    *num_handles = 1;
-    if (handles != NULL) {
-        handles [0].fd = TSS2_TCTI_TABRMD_FD (context);
+    if (!TSS2_TCTI_TABRMD_CONTROL (context) ||
+        (TSS2_TCTI_TABRMD_FEATURES (context) & TABRMD_FEATURE_TRACE_CONTEXT) == 0)
+    {
+        return TSS2_TCTI_RC_NOT_IMPLEMENTED;
     }
-    return TSS2_RC_SUCCESS;
+    g_debug ("%s: id 0x%" PRIx64 " traceparent %s", __func__,
+             TSS2_TCTI_TABRMD_ID (context),
+             traceparent != NULL ? traceparent : "none");
+    return tcti_tabrmd_control_frame (context,
+                                      TABRMD_CONTROL_SET_TRACE_CONTEXT,
+                                      arg,
+                                      sizeof (arg));
 }
-
-TSS2_RC
-tss2_tcti_tabrmd_set_locality (TSS2_TCTI_CONTEXT *context,
-                               guint8             locality)
+/*
+ * Send the TABRMD_CONTROL_SET_CHANNEL or TABRMD_CONTROL_CLOSE_CHANNEL
+ * control frame 'op' for 'channel' if the daemon supports channels.
+ */
+static TSS2_RC
+tcti_tabrmd_channel (TSS2_TCTI_CONTEXT   *context,
+                     tabrmd_control_op_t  op,
+                     uint8_t              channel)
 {
-    gboolean status;
-    TSS2_RC ret = TSS2_RC_SUCCESS;
-    GError *error = NULL;
-
     if (context == NULL) {
         return TSS2_TCTI_RC_BAD_CONTEXT;
     }
-    g_info ("tss2_tcti_tabrmd_set_locality: id 0x%" PRIx64,
-            TSS2_TCTI_TABRMD_ID (context));
-    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_TRANSMIT) {
-        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
     }
-    status = tcti_tabrmd_call_set_locality_sync (
-                 TSS2_TCTI_TABRMD_PROXY (context),
-                 TSS2_TCTI_TABRMD_ID (context),
-                 locality,
-                 &ret,
-                 NULL,
-                 &error);
-
-    if (status == FALSE) {
-        g_warning ("set locality command failed with error code: 0x%" PRIx32
-                   ", message: %s", error->code, error->message);
-        ret = error->code;
-        g_error_free (error);
+    if (!TSS2_TCTI_TABRMD_CONTROL (context) ||
+        (TSS2_TCTI_TABRMD_FEATURES (context) & TABRMD_FEATURE_CHANNELS) == 0)
+    {
+        return TSS2_TCTI_RC_NOT_IMPLEMENTED;
     }
-
-    return ret;
+    g_debug ("%s: id 0x%" PRIx64 " op %d channel %" PRIu8, __func__,
+             TSS2_TCTI_TABRMD_ID (context), op, channel);
+    return tcti_tabrmd_control (context, op, channel);
+}
+/*
+ * Send the commands after this to channel 'channel' of the connection,
+ * see TABRMD_CONTROL_SET_CHANNEL. Channel 0 is the connection itself.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_SetChannel (TSS2_TCTI_CONTEXT *context,
+                             uint8_t            channel)
+{
+    return tcti_tabrmd_channel (context, TABRMD_CONTROL_SET_CHANNEL, channel);
+}
+/*
+ * Close channel 'channel' of the connection, flushing its objects and
+ * sessions, see TABRMD_CONTROL_CLOSE_CHANNEL.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_CloseChannel (TSS2_TCTI_CONTEXT *context,
+                               uint8_t            channel)
+{
+    if (channel == 0) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    return tcti_tabrmd_channel (context, TABRMD_CONTROL_CLOSE_CHANNEL, channel);
 }
 
 /*
@@ -432,17 +1146,47 @@ init_tcti_data (TSS2_TCTI_CONTEXT *context)
     TSS2_TCTI_SET_LOCALITY (context)     = tss2_tcti_tabrmd_set_locality;
 }
 
+/*
+ * Call the CreateConnection method, or CreateConnectionOnTpm if the
+ * connection is for a TPM other than the first so that daemons without
+ * multi-TPM support still work with the default configuration. The other
+ * transports have a method of their own.
+ */
 static gboolean
 tcti_tabrmd_call_create_connection_sync_fdlist (TctiTabrmd     *proxy,
+                                                guint32         tpm,
+                                                tabrmd_transport_t transport,
                                                 guint64        *out_id,
                                                 GUnixFDList   **out_fd_list,
                                                 GCancellable   *cancellable,
                                                 GError        **error)
 {
-    GVariant *_ret;
+    GVariant *_ret, *params = NULL;
+    const gchar *method;
+
+    switch (transport) {
+    case TABRMD_TRANSPORT_SHM:
+        method = TABRMD_DBUS_METHOD_CREATE_CONNECTION_SHM;
+        break;
+    case TABRMD_TRANSPORT_TAGGED:
+        method = TABRMD_DBUS_METHOD_CREATE_CONNECTION_TAGGED;
+        break;
+    case TABRMD_TRANSPORT_SEQPACKET:
+        method = TABRMD_DBUS_METHOD_CREATE_CONNECTION_SEQPACKET;
+        break;
+    default:
+        method = TABRMD_DBUS_METHOD_CREATE_CONNECTION;
+        break;
+    }
+    if (tpm != 0 || transport != TABRMD_TRANSPORT_SOCKET) {
+        if (transport == TABRMD_TRANSPORT_SOCKET) {
+            method = TABRMD_DBUS_METHOD_CREATE_CONNECTION_ON_TPM;
+        }
+        params = g_variant_new ("(u)", tpm);
+    }
     _ret = g_dbus_proxy_call_with_unix_fd_list_sync (G_DBUS_PROXY (proxy),
-        "CreateConnection",
-        NULL,
+        method,
+        params,
         G_DBUS_CALL_FLAGS_NONE,
         -1,
         NULL,
@@ -512,11 +1256,98 @@ tabrmd_kv_callback (const key_value_t *key_value,
             return TSS2_TCTI_RC_BAD_VALUE;
         }
         return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "tpm") == 0) {
+        gchar *end = NULL;
+        guint64 value = g_ascii_strtoull (key_value->value, &end, 10);
+        if (end == key_value->value || *end != '\0' ||
+            value >= TABRMD_TPMS_MAX) {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        tabrmd_conf->tpm = (guint32)value;
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "transport") == 0) {
+        if (strcmp (key_value->value, "socket") == 0) {
+            tabrmd_conf->transport = TABRMD_TRANSPORT_SOCKET;
+        } else if (strcmp (key_value->value, "shm") == 0) {
+            tabrmd_conf->transport = TABRMD_TRANSPORT_SHM;
+        } else if (strcmp (key_value->value, "tagged") == 0) {
+            tabrmd_conf->transport = TABRMD_TRANSPORT_TAGGED;
+        } else if (strcmp (key_value->value, "seqpacket") == 0) {
+            tabrmd_conf->transport = TABRMD_TRANSPORT_SEQPACKET;
+        } else {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "pool") == 0) {
+        gchar *end = NULL;
+        guint64 value = g_ascii_strtoull (key_value->value, &end, 10);
+        if (end == key_value->value || *end != '\0' ||
+            value > TABRMD_CREATE_CONNECTIONS_MAX) {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        tabrmd_conf->pool = (guint)value;
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "socket") == 0) {
+        if (key_value->value [0] == '\0' ||
+            strlen (key_value->value) >= TABRMD_SOCKET_ADDRESS_MAX) {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        tabrmd_conf->socket = key_value->value;
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "response_page") == 0) {
+        if (key_value->value [0] == '\0' ||
+            strlen (key_value->value) > RESPONSE_PAGE_PATH_MAX) {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        tabrmd_conf->response_page = key_value->value;
+        return TSS2_RC_SUCCESS;
     } else {
         return TSS2_TCTI_RC_BAD_VALUE;
     }
 }
 
+/*
+ * Take a reference to 'sock' for the context and cache its FD. GIO is only
+ * used to set up the connection: transmit and receive use the FD directly.
+ * GSocket makes the FD non-blocking and emulates blocking I/O by polling,
+ * so the FD is put back in blocking mode to let reads on a blocking socket
+ * wait in the kernel.
+ */
+static void
+tcti_tabrmd_set_connection (TSS2_TCTI_CONTEXT *context,
+                            GSocket           *sock)
+{
+    gint fd = g_socket_get_fd (sock);
+    gint flags;
+
+    TSS2_TCTI_TABRMD_SOCK_CONNECT (context) = \
+        g_socket_connection_factory_create_connection (sock);
+    TSS2_TCTI_TABRMD_FD (context) = fd;
+    TSS2_TCTI_TABRMD_BLOCKING (context) = g_socket_get_blocking (sock);
+    if (TSS2_TCTI_TABRMD_BLOCKING (context)) {
+        flags = fcntl (fd, F_GETFL);
+        if (flags == -1 || fcntl (fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+            g_debug ("%s: failed to clear O_NONBLOCK on fd %d: %s",
+                     __func__, fd, strerror (errno));
+            TSS2_TCTI_TABRMD_BLOCKING (context) = FALSE;
+        }
+    }
+}
+/*
+ * Use the client side 'fd' of a connection created by the daemon for the
+ * context. The context takes ownership of 'fd'.
+ */
+static void
+tcti_tabrmd_set_socket (TSS2_TCTI_CONTEXT *context,
+                        gint               fd)
+{
+    GSocket *sock;
+
+    sock = g_socket_new_from_fd (fd, NULL);
+    tcti_tabrmd_set_connection (context, sock);
+    g_object_unref (sock);
+}
+
 /*
  * Establish a connection with the daemon. This includes calling the
  * CreateConnection dbus method, extracting the file descriptor used for
@@ -524,24 +1355,50 @@ tabrmd_kv_callback (const key_value_t *key_value,
  * ID used when sending commands over the dbus interface.
  *
  * The proxy object in the context structure must be created / valid before
- * calling this function.
+ * calling this function. The connection is served by the TPM with index
+ * 'tpm' and uses 'transport'. If the daemon doesn't provide the shared
+ * memory or SOCK_SEQPACKET transport, because it's older or can't set it
+ * up, the socket transport is used instead.
  */
 TSS2_RC
-tcti_tabrmd_connect (TSS2_TCTI_CONTEXT *context)
+tcti_tabrmd_connect (TSS2_TCTI_CONTEXT *context,
+                     guint32            tpm,
+                     tabrmd_transport_t transport)
 {
     GError *error = NULL;
-    GSocket *sock = NULL;
     GUnixFDList *fd_list = NULL;
-    gboolean call_ret;
+    gboolean call_ret = FALSE;
     guint64 id;
     TSS2_RC rc = TSS2_RC_SUCCESS;
+    gboolean shm;
 
     call_ret = tcti_tabrmd_call_create_connection_sync_fdlist (
         TSS2_TCTI_TABRMD_PROXY (context),
+        tpm,
+        transport,
         &id,
         &fd_list,
         NULL,
         &error);
+    if (call_ret == FALSE &&
+        (transport == TABRMD_TRANSPORT_SHM ||
+         transport == TABRMD_TRANSPORT_SEQPACKET))
+    {
+        g_info ("%s transport not available, using the socket: %s",
+                transport == TABRMD_TRANSPORT_SHM ? "Shared memory" :
+                "SOCK_SEQPACKET", error->message);
+        g_clear_error (&error);
+        transport = TABRMD_TRANSPORT_SOCKET;
+        call_ret = tcti_tabrmd_call_create_connection_sync_fdlist (
+            TSS2_TCTI_TABRMD_PROXY (context),
+            tpm,
+            transport,
+            &id,
+            &fd_list,
+            NULL,
+            &error);
+    }
+    shm = (transport == TABRMD_TRANSPORT_SHM);
     if (call_ret == FALSE) {
         g_warning ("Failed to create connection with service: %s",
                  error->message);
@@ -554,9 +1411,9 @@ tcti_tabrmd_connect (TSS2_TCTI_CONTEXT *context)
         goto out;
     }
     gint num_handles = g_unix_fd_list_get_length (fd_list);
-    if (num_handles != 1) {
-        g_critical ("CreateConnection expected to return 1 handles, received %d",
-                    num_handles);
+    if (num_handles != (shm ? 2 : 1)) {
+        g_critical ("CreateConnection expected to return %d handles, "
+                    "received %d", shm ? 2 : 1, num_handles);
         rc = TSS2_TCTI_RC_GENERAL_FAILURE;
         goto out;
     }
@@ -567,24 +1424,392 @@ tcti_tabrmd_connect (TSS2_TCTI_CONTEXT *context)
         rc = TSS2_TCTI_RC_GENERAL_FAILURE;
         goto out;
     }
-    sock = g_socket_new_from_fd (fd, NULL);
-    TSS2_TCTI_TABRMD_SOCK_CONNECT (context) = \
-        g_socket_connection_factory_create_connection (sock);
+    tcti_tabrmd_set_socket (context, fd);
+    TSS2_TCTI_TABRMD_TAGGED (context) = (transport == TABRMD_TRANSPORT_TAGGED);
     TSS2_TCTI_TABRMD_ID (context) = id;
+    if (shm) {
+        fd = g_unix_fd_list_get (fd_list, 1, &error);
+        if (fd == -1) {
+            g_critical ("unable to get shared memory handle from "
+                        "GUnixFDList: %s", error->message);
+            rc = TSS2_TCTI_RC_GENERAL_FAILURE;
+            goto out;
+        }
+        TSS2_TCTI_TABRMD_SHM (context) = shm_transport_map (fd);
+        close (fd);
+        if (TSS2_TCTI_TABRMD_SHM (context) == NULL) {
+            rc = TSS2_TCTI_RC_GENERAL_FAILURE;
+        }
+    }
 out:
     g_clear_error (&error);
-    g_clear_object (&sock);
     g_clear_object (&fd_list);
     return rc;
 }
 
+/*
+ * Establish a connection through the daemon's UNIX socket frontend at
+ * 'conf->socket' instead of D-Bus: the connected socket becomes the
+ * connection. The shared memory transport needs D-Bus to pass the shared
+ * memory and the connected socket is a stream socket, so both the shared
+ * memory and SOCK_SEQPACKET transports fall back to the socket transport.
+ */
+static TSS2_RC
+tcti_tabrmd_connect_socket (TSS2_TCTI_CONTEXT   *context,
+                            const tabrmd_conf_t *conf)
+{
+    socket_protocol_request_t request = {
+        .version = SOCKET_PROTOCOL_VERSION,
+        .op = SOCKET_PROTOCOL_CREATE_CONNECTION,
+        .tpm = conf->tpm,
+        .transport = conf->transport,
+    };
+    socket_protocol_response_t response = { 0 };
+    GSocket *sock;
+
+    if (conf->transport == TABRMD_TRANSPORT_SHM ||
+        conf->transport == TABRMD_TRANSPORT_SEQPACKET) {
+        g_info ("Transport not available over the socket frontend, using "
+                "the socket");
+        request.transport = TABRMD_TRANSPORT_SOCKET;
+    }
+    sock = tcti_tabrmd_socket_request (conf->socket, &request, &response);
+    if (sock == NULL) {
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    }
+    if (response.rc != TSS2_RC_SUCCESS) {
+        g_warning ("Failed to create connection with service: 0x%" PRIx32,
+                   response.rc);
+        g_object_unref (sock);
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    }
+    tcti_tabrmd_set_connection (context, sock);
+    TSS2_TCTI_TABRMD_TAGGED (context) =
+        (request.transport == TABRMD_TRANSPORT_TAGGED);
+    TSS2_TCTI_TABRMD_ID (context) = response.id;
+    TSS2_TCTI_TABRMD_SOCKET_ADDRESS (context) = g_strdup (conf->socket);
+    TSS2_TCTI_TABRMD_FEATURES (context) = response.features;
+    TSS2_TCTI_TABRMD_CONTROL (context) =
+        (response.features & TABRMD_FEATURE_CONTROL) != 0;
+    g_object_unref (sock);
+
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Idle connections created by CreateConnections and not yet used by a
+ * context. They're kept per process: a child inherits the FDs across fork
+ * but the daemon associates the connections with the parent, so the pool
+ * is dropped when the PID changes.
+ */
+typedef struct {
+    gchar   *bus_name;
+    GBusType bus_type;
+    guint32  tpm;
+    guint64  id;
+    gint     fd;
+} tcti_tabrmd_pooled_t;
+
+static GMutex tcti_tabrmd_pool_mutex;
+static GQueue tcti_tabrmd_pool = G_QUEUE_INIT;
+static pid_t  tcti_tabrmd_pool_pid;
+
+static void
+tcti_tabrmd_pooled_free (gpointer data)
+{
+    tcti_tabrmd_pooled_t *entry = (tcti_tabrmd_pooled_t*)data;
+
+    if (entry->fd != -1) {
+        close (entry->fd);
+    }
+    g_free (entry->bus_name);
+    g_free (entry);
+}
+/*
+ * Take the first pooled connection matching 'conf' from the pool. The
+ * caller must hold the pool mutex.
+ * Returns NULL if there's none.
+ */
+static tcti_tabrmd_pooled_t*
+tcti_tabrmd_pool_take (const tabrmd_conf_t *conf)
+{
+    tcti_tabrmd_pooled_t *entry;
+    GList *link;
+
+    if (tcti_tabrmd_pool_pid != getpid ()) {
+        g_queue_foreach (&tcti_tabrmd_pool,
+                         (GFunc)tcti_tabrmd_pooled_free,
+                         NULL);
+        g_queue_clear (&tcti_tabrmd_pool);
+        tcti_tabrmd_pool_pid = getpid ();
+    }
+    for (link = tcti_tabrmd_pool.head; link != NULL; link = link->next) {
+        entry = (tcti_tabrmd_pooled_t*)link->data;
+        if (entry->bus_type == conf->bus_type &&
+            entry->tpm == conf->tpm &&
+            strcmp (entry->bus_name, conf->bus_name) == 0)
+        {
+            g_queue_delete_link (&tcti_tabrmd_pool, link);
+            return entry;
+        }
+    }
+    return NULL;
+}
+/*
+ * Refill the pool with up to 'conf->pool' connections created by a single
+ * call to the CreateConnections method. The caller must hold the pool
+ * mutex.
+ * Returns FALSE if the call failed, e.g. because the daemon predates the
+ * method.
+ */
+static gboolean
+tcti_tabrmd_pool_fill (TSS2_TCTI_CONTEXT   *context,
+                       const tabrmd_conf_t *conf)
+{
+    tcti_tabrmd_pooled_t *entry;
+    GVariant *ret, *ids_variant;
+    GUnixFDList *fd_list = NULL;
+    GError *error = NULL;
+    const guint64 *ids;
+    gsize ids_count = 0, i;
+    gint fds_count = 0, fd;
+
+    ret = g_dbus_proxy_call_with_unix_fd_list_sync (
+        G_DBUS_PROXY (TSS2_TCTI_TABRMD_PROXY (context)),
+        TABRMD_DBUS_METHOD_CREATE_CONNECTIONS,
+        g_variant_new ("(uu)", conf->tpm, conf->pool),
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        &fd_list,
+        NULL,
+        &error);
+    if (ret == NULL) {
+        g_info ("Failed to fill connection pool: %s", error->message);
+        g_clear_error (&error);
+        return FALSE;
+    }
+    g_variant_get (ret, "(@at)", &ids_variant);
+    ids = g_variant_get_fixed_array (ids_variant, &ids_count, sizeof (guint64));
+    if (fd_list != NULL) {
+        fds_count = g_unix_fd_list_get_length (fd_list);
+    }
+    if (ids_count != (gsize)fds_count) {
+        g_warning ("CreateConnections returned %zu IDs and %d handles",
+                   ids_count, fds_count);
+    }
+    for (i = 0; i < ids_count && i < (gsize)fds_count; ++i) {
+        fd = g_unix_fd_list_get (fd_list, (gint)i, &error);
+        if (fd == -1) {
+            g_warning ("unable to get handle from GUnixFDList: %s",
+                       error->message);
+            g_clear_error (&error);
+            break;
+        }
+        entry = g_new0 (tcti_tabrmd_pooled_t, 1);
+        entry->bus_name = g_strdup (conf->bus_name);
+        entry->bus_type = conf->bus_type;
+        entry->tpm = conf->tpm;
+        entry->id = ids [i];
+        entry->fd = fd;
+        g_queue_push_tail (&tcti_tabrmd_pool, entry);
+    }
+    g_variant_unref (ids_variant);
+    g_variant_unref (ret);
+    g_clear_object (&fd_list);
+    return TRUE;
+}
+/*
+ * Establish a connection with the daemon using the connection pool: take
+ * an idle connection from the pool, refilling it first if it's empty. If
+ * the daemon doesn't provide the CreateConnections method a single
+ * connection is created with tcti_tabrmd_connect. Only the socket
+ * transport is pooled.
+ */
+static TSS2_RC
+tcti_tabrmd_connect_pooled (TSS2_TCTI_CONTEXT   *context,
+                            const tabrmd_conf_t *conf)
+{
+    tcti_tabrmd_pooled_t *entry;
+
+    g_mutex_lock (&tcti_tabrmd_pool_mutex);
+    entry = tcti_tabrmd_pool_take (conf);
+    if (entry == NULL && !tcti_tabrmd_pool_fill (context, conf)) {
+        g_mutex_unlock (&tcti_tabrmd_pool_mutex);
+        return tcti_tabrmd_connect (context,
+                                    conf->tpm,
+                                    TABRMD_TRANSPORT_SOCKET);
+    }
+    if (entry == NULL) {
+        entry = tcti_tabrmd_pool_take (conf);
+    }
+    g_mutex_unlock (&tcti_tabrmd_pool_mutex);
+    if (entry == NULL) {
+        g_warning ("CreateConnections returned no connection");
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    }
+    tcti_tabrmd_set_socket (context, entry->fd);
+    entry->fd = -1;
+    TSS2_TCTI_TABRMD_ID (context) = entry->id;
+    tcti_tabrmd_pooled_free (entry);
+
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Proxies for the daemon shared by the contexts of a process, one per bus
+ * type and name. The list only holds weak references: each context holds
+ * a reference to its proxy, which goes away with the last context using
+ * it. A child forked after the proxies were made doesn't use them or the
+ * D-Bus connection they go through: the daemon would see the parent's
+ * credentials. It gets its own connection to the bus instead.
+ */
+typedef struct {
+    gchar   *bus_name;
+    GBusType bus_type;
+    GWeakRef proxy;
+} tcti_tabrmd_shared_t;
+
+static GMutex   tcti_tabrmd_shared_mutex;
+static GQueue   tcti_tabrmd_shared = G_QUEUE_INIT;
+static pid_t    tcti_tabrmd_shared_pid;
+static gboolean tcti_tabrmd_forked;
+
+static void
+tcti_tabrmd_shared_free (gpointer data)
+{
+    tcti_tabrmd_shared_t *entry = (tcti_tabrmd_shared_t*)data;
+
+    g_weak_ref_clear (&entry->proxy);
+    g_free (entry->bus_name);
+    g_free (entry);
+}
+/*
+ * Create a proxy for the daemon at 'conf->bus_name'. In a forked child the
+ * proxy goes through a new connection to the bus rather than the one
+ * GLib shares in the process.
+ */
+static TctiTabrmd*
+tcti_tabrmd_proxy_new (const tabrmd_conf_t *conf,
+                       GError             **error)
+{
+    GDBusConnection *connection;
+    TctiTabrmd *proxy;
+    gchar *address;
+
+    if (!tcti_tabrmd_forked) {
+        return tcti_tabrmd_proxy_new_for_bus_sync (conf->bus_type,
+                                                   G_DBUS_PROXY_FLAGS_NONE,
+                                                   conf->bus_name,
+                                                   TABRMD_DBUS_PATH,
+                                                   NULL,
+                                                   error);
+    }
+    address = g_dbus_address_get_for_bus_sync (conf->bus_type, NULL, error);
+    if (address == NULL) {
+        return NULL;
+    }
+    connection = g_dbus_connection_new_for_address_sync (
+        address,
+        G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+        G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+        NULL,
+        NULL,
+        error);
+    g_free (address);
+    if (connection == NULL) {
+        return NULL;
+    }
+    proxy = tcti_tabrmd_proxy_new_sync (connection,
+                                        G_DBUS_PROXY_FLAGS_NONE,
+                                        conf->bus_name,
+                                        TABRMD_DBUS_PATH,
+                                        NULL,
+                                        error);
+    g_object_unref (connection);
+    return proxy;
+}
+/*
+ * Return a reference to the process' proxy for the daemon at
+ * 'conf->bus_name', creating it if no context uses one.
+ * Returns NULL and sets 'error' if the proxy can't be created.
+ */
+static TctiTabrmd*
+tcti_tabrmd_proxy_get (const tabrmd_conf_t *conf,
+                       GError             **error)
+{
+    tcti_tabrmd_shared_t *entry = NULL;
+    TctiTabrmd *proxy = NULL;
+    GList *link;
+
+    g_mutex_lock (&tcti_tabrmd_shared_mutex);
+    if (tcti_tabrmd_shared_pid != getpid ()) {
+        tcti_tabrmd_forked = (tcti_tabrmd_shared_pid != 0);
+        g_queue_foreach (&tcti_tabrmd_shared,
+                         (GFunc)tcti_tabrmd_shared_free,
+                         NULL);
+        g_queue_clear (&tcti_tabrmd_shared);
+        tcti_tabrmd_shared_pid = getpid ();
+    }
+    for (link = tcti_tabrmd_shared.head; link != NULL; link = link->next) {
+        entry = (tcti_tabrmd_shared_t*)link->data;
+        if (entry->bus_type == conf->bus_type &&
+            strcmp (entry->bus_name, conf->bus_name) == 0)
+        {
+            proxy = g_weak_ref_get (&entry->proxy);
+            break;
+        }
+        entry = NULL;
+    }
+    if (proxy == NULL) {
+        proxy = tcti_tabrmd_proxy_new (conf, error);
+    }
+    if (proxy != NULL && entry == NULL) {
+        entry = g_new0 (tcti_tabrmd_shared_t, 1);
+        entry->bus_name = g_strdup (conf->bus_name);
+        entry->bus_type = conf->bus_type;
+        g_weak_ref_init (&entry->proxy, NULL);
+        g_queue_push_tail (&tcti_tabrmd_shared, entry);
+    }
+    if (proxy != NULL) {
+        g_weak_ref_set (&entry->proxy, proxy);
+    }
+    g_mutex_unlock (&tcti_tabrmd_shared_mutex);
+    return proxy;
+}
+
+/*
+ * Map the response page given in the conf for transmit to answer from.
+ * A page that can't be mapped only costs the round trips it would have
+ * saved, so this doesn't fail the init.
+ */
+static void
+tcti_tabrmd_map_response_page (TSS2_TCTI_CONTEXT   *context,
+                               const tabrmd_conf_t *conf)
+{
+    TSS2_TCTI_TABRMD_CONTEXT *ctx = (TSS2_TCTI_TABRMD_CONTEXT*)context;
+    GError *error = NULL;
+
+    ctx->response_page = response_page_map (conf->response_page, &error);
+    if (ctx->response_page == NULL) {
+        g_info ("not answering from the response page: %s", error->message);
+        g_clear_error (&error);
+        return;
+    }
+    ctx->tpm = conf->tpm;
+}
 /*
  * The longest configuration string we'll take. Each dbus name can be 255
  * characters long (see dbus spec). The bus_types that we support are
  * 'system' or 'session' (255 + 7 = 262). 'bus_type=' and 'bus_name=' are
- * each another 9 characters for a total of 280.
+ * each another 9 characters for a total of 280. A 'tpm=' key with its one
+ * digit value and the separating commas add another 7 for 287,
+ * ',transport=socket' another 17 for 304 (the longest transport name),
+ * ',pool=16' another 8 for 312, ',socket=' with the longest UNIX socket
+ * address another 115 for 427 and ',response_page=' with the longest
+ * path taken for it another 270 for 697.
  */
-#define CONF_STRING_MAX 280
+#define CONF_STRING_MAX 697
 TSS2_RC
 Tss2_Tcti_Tabrmd_Init (TSS2_TCTI_CONTEXT *context,
                        size_t            *size,
@@ -623,19 +1848,37 @@ Tss2_Tcti_Tabrmd_Init (TSS2_TCTI_CONTEXT *context,
     /* Register dbus error mapping for tabrmd. Gets us RCs from Gerror codes */
     TABRMD_ERROR;
     init_tcti_data (context);
-    TSS2_TCTI_TABRMD_PROXY (context) =
-        tcti_tabrmd_proxy_new_for_bus_sync (tabrmd_conf.bus_type,
-                                            G_DBUS_PROXY_FLAGS_NONE,
-                                            tabrmd_conf.bus_name,
-                                            TABRMD_DBUS_PATH,
-                                            NULL,
-                                            &error);
+    if (tabrmd_conf.socket != NULL) {
+        rc = tcti_tabrmd_connect_socket (context, &tabrmd_conf);
+        goto connected;
+    }
+    TSS2_TCTI_TABRMD_PROXY (context) = tcti_tabrmd_proxy_get (&tabrmd_conf,
+                                                              &error);
     if (TSS2_TCTI_TABRMD_PROXY (context) == NULL) {
         g_critical ("failed to allocate dbus proxy object: %s", error->message);
         rc = TSS2_TCTI_RC_NO_CONNECTION;
         goto out;
     }
-    rc = tcti_tabrmd_connect (context);
+    if (tabrmd_conf.pool > 0 &&
+        tabrmd_conf.transport == TABRMD_TRANSPORT_SOCKET)
+    {
+        rc = tcti_tabrmd_connect_pooled (context, &tabrmd_conf);
+    } else {
+        rc = tcti_tabrmd_connect (context,
+                                  tabrmd_conf.tpm,
+                                  tabrmd_conf.transport);
+    }
+    /* the property was loaded with the proxy, this is no round trip */
+    if (rc == TSS2_RC_SUCCESS && TSS2_TCTI_TABRMD_SHM (context) == NULL) {
+        TSS2_TCTI_TABRMD_FEATURES (context) =
+            tcti_tabrmd_get_features (TSS2_TCTI_TABRMD_PROXY (context));
+        TSS2_TCTI_TABRMD_CONTROL (context) =
+            (TSS2_TCTI_TABRMD_FEATURES (context) & TABRMD_FEATURE_CONTROL) != 0;
+    }
+connected:
+    if (rc == TSS2_RC_SUCCESS && tabrmd_conf.response_page != NULL) {
+        tcti_tabrmd_map_response_page (context, &tabrmd_conf);
+    }
     if (rc == TSS2_RC_SUCCESS) {
         g_debug ("initialized tabrmd TCTI context with id: 0x%" PRIx64,
                  TSS2_TCTI_TABRMD_ID (context));
@@ -655,7 +1898,8 @@ static const TSS2_TCTI_INFO tss2_tcti_info = {
     .config_help = "This conf string is a series of key / value pairs " \
         "where keys and values are separated by the '=' character and " \
         "each pair is separated by the ',' character. Valid keys are " \
-        "\"bus_name\" and \"bus_type\".",
+        "\"bus_name\", \"bus_type\", \"tpm\", \"transport\", \"pool\", \"socket\" " \
+        "and \"response_page\".",
     .init = Tss2_Tcti_Tabrmd_Init,
 };
 
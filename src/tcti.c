@@ -117,8 +117,7 @@ tcti_peek_context (Tcti *self)
 }
 /**
  * The rest of these functions are just wrappers around the macros provided
- * by the TSS for calling the TCTI functions. There's no implementation for
- * 'getPollHandles' yet since I've got no need for it yet.
+ * by the TSS for calling the TCTI functions.
  */
 TSS2_RC
 tcti_transmit (Tcti      *self,
@@ -154,3 +153,49 @@ tcti_receive (Tcti      *self,
 
     return rc;
 }
+/*
+ * Many TCTIs don't implement 'getPollHandles' and return
+ * TSS2_TCTI_RC_NOT_IMPLEMENTED: that's not worth a warning.
+ */
+TSS2_RC
+tcti_get_poll_handles (Tcti                  *self,
+                       TSS2_TCTI_POLL_HANDLE *handles,
+                       size_t                *num_handles)
+{
+    TSS2_RC rc;
+
+    rc = Tss2_Tcti_GetPollHandles (self->tcti_context,
+                                   handles,
+                                   num_handles);
+    if (rc != TSS2_RC_SUCCESS && rc != TSS2_TCTI_RC_NOT_IMPLEMENTED) {
+        RC_WARN ("Tss2_Tcti_GetPollHandles", rc);
+    }
+
+    return rc;
+}
+TSS2_RC
+tcti_cancel (Tcti *self)
+{
+    TSS2_RC rc;
+
+    rc = Tss2_Tcti_Cancel (self->tcti_context);
+    if (rc != TSS2_RC_SUCCESS && rc != TSS2_TCTI_RC_NOT_IMPLEMENTED) {
+        RC_WARN ("Tss2_Tcti_Cancel", rc);
+    }
+
+    return rc;
+}
+TSS2_RC
+tcti_set_locality (Tcti    *self,
+                   uint8_t  locality)
+{
+    TSS2_RC rc;
+
+    rc = Tss2_Tcti_SetLocality (self->tcti_context,
+                                locality);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_Tcti_SetLocality", rc);
+    }
+
+    return rc;
+}
@@ -39,6 +39,9 @@ TSS2_RC             tcti_receive         (Tcti            *self,
                                           size_t          *size,
                                           uint8_t         *response,
                                           int32_t          timeout);
+TSS2_RC             tcti_get_poll_handles (Tcti                  *self,
+                                           TSS2_TCTI_POLL_HANDLE *handles,
+                                           size_t                *num_handles);
 TSS2_RC             tcti_cancel          (Tcti            *self);
 TSS2_RC             tcti_set_locality    (Tcti            *self,
                                           uint8_t          locality);
@@ -3,6 +3,11 @@
  * Copyright (c) 2017, Intel Corporation
  * All rights reserved.
  */
+#include <errno.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "util.h"
 #include "thread.h"
@@ -10,10 +15,11 @@
 G_DEFINE_ABSTRACT_TYPE (Thread, thread, G_TYPE_OBJECT);
 
 static void
-thread_init (Thread *iface)
+thread_init (Thread *self)
 {
-    UNUSED_PARAM(iface);
-/* noop, required by G_DEFINE_INTERFACE */
+    thread_sched_t sched = THREAD_SCHED_INIT_DEFAULT;
+
+    self->sched = sched;
 }
 static void
 thread_class_init (ThreadClass *klass)
@@ -21,6 +27,64 @@ thread_class_init (ThreadClass *klass)
     klass->thread_run = NULL;
 }
 
+/*
+ * Set how the thread is scheduled the next time it's started.
+ */
+void
+thread_set_sched (Thread               *self,
+                  const thread_sched_t *sched)
+{
+    self->sched = *sched;
+}
+/*
+ * Apply 'sched' to the calling thread. Failing to do so isn't fatal: the
+ * thread runs with the default scheduling, most often because the daemon
+ * lacks CAP_SYS_NICE.
+ */
+static void
+thread_apply_sched (Thread *self)
+{
+    struct sched_param param = { .sched_priority = self->sched.priority };
+    gint ret;
+
+    if (CPU_COUNT (&self->sched.cpus) > 0) {
+        ret = pthread_setaffinity_np (pthread_self (),
+                                      sizeof (self->sched.cpus),
+                                      &self->sched.cpus);
+        if (ret != 0) {
+            g_warning ("%s: failed to set CPU affinity: %s",
+                       __func__, strerror (ret));
+        }
+    }
+    if (self->sched.policy == SCHED_FIFO) {
+        ret = pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+        if (ret != 0) {
+            g_warning ("%s: failed to set SCHED_FIFO priority %d: %s",
+                       __func__, param.sched_priority, strerror (ret));
+        }
+    } else if (self->sched.nice != 0) {
+        /* on Linux the nice value of a thread is set through its TID */
+        if (setpriority (PRIO_PROCESS,
+                         (id_t)syscall (SYS_gettid),
+                         self->sched.nice) == -1) {
+            g_warning ("%s: failed to set nice value %d: %s",
+                       __func__, self->sched.nice, strerror (errno));
+        }
+    }
+}
+/*
+ * Entry point for all Threads: apply the scheduling settings, then run
+ * the subclass's thread_run function.
+ */
+static void*
+thread_main (void *data)
+{
+    Thread *self = THREAD (data);
+
+    thread_apply_sched (self);
+    return THREAD_GET_CLASS (self)->thread_run (self);
+}
+
 gint
 thread_start (Thread *self)
 {
@@ -30,7 +94,7 @@ thread_start (Thread *self)
     }
     return pthread_create (&self->thread_id,
                            NULL,
-                           THREAD_GET_CLASS (self)->thread_run,
+                           thread_main,
                            self);
 }
 
@@ -7,6 +7,8 @@
 #define THREAD_INTERFACE_H
 
 #include <glib-object.h>
+#include <pthread.h>
+#include <sched.h>
 
 G_BEGIN_DECLS
 
@@ -16,6 +18,21 @@ typedef struct _ThreadClass ThreadClass;
 typedef void* (*ThreadFunc)        (void *user_data);
 typedef void  (*ThreadUnblockFunc) (Thread *self);
 
+/*
+ * How a Thread is scheduled, applied by the thread itself when it starts.
+ * An empty 'cpus' set leaves the affinity alone. With a 'policy' of
+ * SCHED_FIFO the thread runs at real-time 'priority', otherwise 'nice'
+ * is applied to it alone.
+ */
+typedef struct {
+    cpu_set_t   cpus;
+    gint        policy;
+    gint        priority;
+    gint        nice;
+} thread_sched_t;
+
+#define THREAD_SCHED_INIT_DEFAULT { .policy = SCHED_OTHER, }
+
 struct _ThreadClass {
     GObjectClass      parent;
     ThreadFunc        thread_run;
@@ -25,6 +42,7 @@ struct _ThreadClass {
 struct _Thread {
     GObject     parent;
     pthread_t   thread_id;
+    thread_sched_t sched;
 };
 
 #define TYPE_THREAD             (thread_get_type ())
@@ -38,6 +56,8 @@ GType           thread_get_type     (void);
 void            thread_cancel       (Thread            *self);
 gint            thread_join         (Thread            *self);
 gint            thread_start        (Thread            *self);
+void            thread_set_sched    (Thread            *self,
+                                     const thread_sched_t *sched);
 
 G_END_DECLS
 #endif /* THREAD_INTERFACE_H */
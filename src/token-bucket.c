@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+
+#include "token-bucket.h"
+
+/*
+ * Start with a full bucket so that a client isn't limited before it has
+ * sent 'burst' commands.
+ */
+void
+token_bucket_init (token_bucket_t *bucket,
+                   guint           rate,
+                   guint           burst,
+                   gint64          now)
+{
+    g_assert (bucket != NULL);
+    g_assert (rate > 0 && burst > 0);
+    bucket->rate = rate;
+    bucket->capacity = (guint64)burst * TOKEN_BUCKET_UNIT;
+    bucket->tokens = bucket->capacity;
+    bucket->last = now;
+}
+/*
+ * Refill the bucket for the time elapsed since the last call and take a
+ * token from it.
+ * Returns FALSE if the bucket holds less than one token.
+ */
+gboolean
+token_bucket_take (token_bucket_t *bucket,
+                   gint64          now)
+{
+    guint64 elapsed, missing;
+
+    g_assert (bucket != NULL);
+    if (now > bucket->last) {
+        elapsed = (guint64)(now - bucket->last);
+        missing = bucket->capacity - bucket->tokens;
+        /* each usec adds 'rate' millionths of a token */
+        if (elapsed >= missing / bucket->rate) {
+            bucket->tokens = bucket->capacity;
+        } else {
+            bucket->tokens += elapsed * bucket->rate;
+        }
+        bucket->last = now;
+    }
+    if (bucket->tokens < TOKEN_BUCKET_UNIT) {
+        return FALSE;
+    }
+    bucket->tokens -= TOKEN_BUCKET_UNIT;
+    return TRUE;
+}
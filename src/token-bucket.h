@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* upper bound on a rate in tokens per second */
+#define TOKEN_BUCKET_RATE_MAX 100000
+/* tokens are counted in millionths so that refills are exact in usec */
+#define TOKEN_BUCKET_UNIT     G_USEC_PER_SEC
+
+/*
+ * A token bucket refilled at 'rate' tokens per second that holds at most
+ * 'burst' tokens. Times are in usec from g_get_monotonic_time. The bucket
+ * isn't locked: callers sharing one must serialize access to it.
+ */
+typedef struct {
+    guint64 tokens;
+    guint64 capacity;
+    guint   rate;
+    gint64  last;
+} token_bucket_t;
+
+void       token_bucket_init      (token_bucket_t *bucket,
+                                   guint           rate,
+                                   guint           burst,
+                                   gint64          now);
+gboolean   token_bucket_take      (token_bucket_t *bucket,
+                                   gint64          now);
+
+G_END_DECLS
+#endif /* TOKEN_BUCKET_H */
@@ -0,0 +1,190 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tabrmd.h"
+#include "tpm2-cache.h"
+#include "util.h"
+
+/*
+ * Fill in 'key' from the TPM properties in 'props'. Properties the TPM
+ * didn't report are left 0.
+ */
+static void
+tpm2_cache_key_from_properties (TPML_TAGGED_TPM_PROPERTY const *props,
+                                uint32_t                        key [])
+{
+    TPM2_PT property;
+    UINT32 i;
+
+    memset (key, 0, TPM2_CACHE_KEY_COUNT * sizeof (uint32_t));
+    for (i = 0; i < props->count && i < TPM2_MAX_TPM_PROPERTIES; ++i) {
+        property = props->tpmProperty [i].property;
+        if (property >= TPM2_CACHE_KEY_FIRST &&
+            property < TPM2_CACHE_KEY_FIRST + TPM2_CACHE_KEY_COUNT)
+        {
+            key [property - TPM2_CACHE_KEY_FIRST] = props->tpmProperty [i].value;
+        }
+    }
+}
+/*
+ * Map the cache at 'path' and check that it's one this daemon wrote.
+ * Returns NULL if there's no usable cache.
+ */
+tpm2_cache_t*
+tpm2_cache_map (const gchar *path)
+{
+    tpm2_cache_t *cache;
+    struct stat st;
+    void *addr;
+    int fd;
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            g_info ("%s: no cache at %s", __func__, path);
+        } else {
+            g_warning ("%s: failed to open %s: %s",
+                       __func__, path, strerror (errno));
+        }
+        return NULL;
+    }
+    if (fstat (fd, &st) == -1) {
+        g_warning ("%s: fstat failed: %s", __func__, strerror (errno));
+        close (fd);
+        return NULL;
+    }
+    if (st.st_size < (off_t)sizeof (tpm2_cache_t) ||
+        st.st_size > (off_t)(sizeof (tpm2_cache_t) +
+                             TPM2_MAX_CAP_CC * sizeof (TPMA_CC)))
+    {
+        g_warning ("%s: %s has a bad size: %jd bytes",
+                   __func__, path, (intmax_t)st.st_size);
+        close (fd);
+        return NULL;
+    }
+    addr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (addr == MAP_FAILED) {
+        g_warning ("%s: mmap failed: %s", __func__, strerror (errno));
+        return NULL;
+    }
+    cache = (tpm2_cache_t*)addr;
+    if (cache->magic != TPM2_CACHE_MAGIC ||
+        cache->version != TPM2_CACHE_VERSION ||
+        cache->size != (uint32_t)st.st_size ||
+        cache->command_count > TPM2_MAX_CAP_CC ||
+        cache->size != sizeof (tpm2_cache_t) +
+                       cache->command_count * sizeof (TPMA_CC) ||
+        cache->properties_fixed.capability != TPM2_CAP_TPM_PROPERTIES ||
+        cache->properties_fixed.data.tpmProperties.count == 0 ||
+        cache->properties_fixed.data.tpmProperties.count > TPM2_MAX_TPM_PROPERTIES)
+    {
+        g_warning ("%s: ignoring invalid cache %s", __func__, path);
+        munmap (addr, st.st_size);
+        return NULL;
+    }
+    return cache;
+}
+void
+tpm2_cache_unmap (tpm2_cache_t *cache)
+{
+    if (cache != NULL) {
+        munmap (cache, cache->size);
+    }
+}
+/*
+ * Write the cache for a TPM to 'path'. The file is replaced atomically so
+ * a daemon starting concurrently never maps a partial cache.
+ */
+gboolean
+tpm2_cache_save (const gchar                *path,
+                 TPMS_CAPABILITY_DATA const *properties_fixed,
+                 CommandAttrs               *command_attrs)
+{
+    tpm2_cache_t *cache;
+    GError *error = NULL;
+    gsize size;
+    gboolean ret;
+
+    size = sizeof (tpm2_cache_t) + command_attrs->count * sizeof (TPMA_CC);
+    cache = g_malloc0 (size);
+    cache->magic = TPM2_CACHE_MAGIC;
+    cache->version = TPM2_CACHE_VERSION;
+    cache->size = (uint32_t)size;
+    tpm2_cache_key_from_properties (&properties_fixed->data.tpmProperties,
+                                    cache->key);
+    cache->properties_fixed = *properties_fixed;
+    cache->command_count = command_attrs->count;
+    memcpy (cache->command_attrs,
+            command_attrs->command_attrs,
+            command_attrs->count * sizeof (TPMA_CC));
+    ret = g_file_set_contents (path, (const gchar*)cache, size, &error);
+    if (!ret) {
+        g_warning ("%s: failed to write %s: %s", __func__, path, error->message);
+        g_clear_error (&error);
+    }
+    g_free (cache);
+    return ret;
+}
+/*
+ * Initialize 'tpm2' and 'command_attrs' using the cache at 'path'. The
+ * cached properties are used if the TPM reports the same manufacturer,
+ * vendor and firmware as when the cache was written. Otherwise they're
+ * read from the TPM and the cache is rewritten.
+ */
+TSS2_RC
+tpm2_cache_init_tpm (Tpm2         *tpm2,
+                     CommandAttrs *command_attrs,
+                     const gchar  *path)
+{
+    TPML_TAGGED_TPM_PROPERTY props = { 0 };
+    uint32_t key [TPM2_CACHE_KEY_COUNT];
+    tpm2_cache_t *cache;
+    TSS2_RC rc;
+
+    cache = tpm2_cache_map (path);
+    if (cache != NULL) {
+        tpm2_set_properties_fixed (tpm2, &cache->properties_fixed);
+    }
+    rc = tpm2_init_tpm (tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        tpm2_cache_unmap (cache);
+        return rc;
+    }
+    if (cache != NULL) {
+        rc = tpm2_get_properties (tpm2,
+                                  TPM2_CACHE_KEY_FIRST,
+                                  TPM2_CACHE_KEY_COUNT,
+                                  &props);
+        tpm2_cache_key_from_properties (&props, key);
+        if (rc == TSS2_RC_SUCCESS &&
+            memcmp (key, cache->key, sizeof (key)) == 0)
+        {
+            g_info ("%s: using cached TPM properties from %s", __func__, path);
+            command_attrs_init_cached (command_attrs,
+                                       cache->command_count,
+                                       cache->command_attrs);
+            tpm2_cache_unmap (cache);
+            return TSS2_RC_SUCCESS;
+        }
+        g_info ("%s: cache %s is stale", __func__, path);
+        tpm2_cache_unmap (cache);
+        rc = tpm2_refresh_properties_fixed (tpm2);
+        if (rc != TSS2_RC_SUCCESS) {
+            return rc;
+        }
+    }
+    if (command_attrs_init_tpm (command_attrs, tpm2) != 0) {
+        g_critical ("%s: failed to initialize CommandAttribute object", __func__);
+        return TSS2_RESMGR_RC_INTERNAL_ERROR;
+    }
+    tpm2_cache_save (path, tpm2_get_properties_fixed (tpm2), command_attrs);
+    return TSS2_RC_SUCCESS;
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TPM2_CACHE_H
+#define TPM2_CACHE_H
+
+#include <glib.h>
+#include <stdint.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "command-attrs.h"
+#include "tpm2.h"
+
+G_BEGIN_DECLS
+
+/*
+ * On-disk cache of the fixed TPM properties and the TPMA_CCs read from a
+ * TPM at startup. The cache is keyed by the properties from
+ * TPM2_PT_MANUFACTURER through TPM2_PT_FIRMWARE_VERSION_2: the
+ * manufacturer, vendor strings, vendor TPM type and firmware version. A
+ * cache is used only if a single read of these properties from the TPM
+ * matches its key.
+ */
+#define TPM2_CACHE_MAGIC     0x43524254 /* "TBRC" */
+#define TPM2_CACHE_VERSION   1
+#define TPM2_CACHE_KEY_FIRST TPM2_PT_MANUFACTURER
+#define TPM2_CACHE_KEY_COUNT (TPM2_PT_FIRMWARE_VERSION_2 - TPM2_PT_MANUFACTURER + 1)
+
+typedef struct {
+    uint32_t              magic;
+    uint32_t              version;
+    /* size of the whole file */
+    uint32_t              size;
+    uint32_t              key [TPM2_CACHE_KEY_COUNT];
+    TPMS_CAPABILITY_DATA  properties_fixed;
+    uint32_t              command_count;
+    TPMA_CC               command_attrs [];
+} tpm2_cache_t;
+
+TSS2_RC        tpm2_cache_init_tpm (Tpm2          *tpm2,
+                                    CommandAttrs  *command_attrs,
+                                    const gchar   *path);
+tpm2_cache_t*  tpm2_cache_map      (const gchar   *path);
+void           tpm2_cache_unmap    (tpm2_cache_t  *cache);
+gboolean       tpm2_cache_save     (const gchar   *path,
+                                    TPMS_CAPABILITY_DATA const *properties_fixed,
+                                    CommandAttrs  *command_attrs);
+
+G_END_DECLS
+#endif /* TPM2_CACHE_H */
@@ -10,6 +10,8 @@
 #include <tss2/tss2_tpm2_types.h>
 #include <tss2/tss2_mu.h>
 
+#include "alloc-stats.h"
+#include "buffer-pool.h"
 #include "tpm2-command.h"
 #include "tpm2-header.h"
 #include "util.h"
@@ -41,20 +43,6 @@
 #define PROPERTY_COUNT_OFFSET PROPERTY_END_OFFSET
 #define PROPERTY_COUNT_END_OFFSET (PROPERTY_COUNT_OFFSET + sizeof (UINT32))
 #define PROPERTY_COUNT_GET(buffer) (*(UINT32*)(&buffer [PROPERTY_COUNT_OFFSET]))
-/*
- * Helper macros to aid in the access of various parts of the command
- * authorization area.
- */
-#define AUTH_AREA_OFFSET(cmd) \
-    (TPM_HEADER_SIZE + (tpm2_command_get_handle_count (cmd) * sizeof (TPM2_HANDLE)))
-#define AUTH_AREA_SIZE_OFFSET(cmd) AUTH_AREA_OFFSET (cmd)
-#define AUTH_AREA_SIZE_END_OFFSET(cmd) \
-    (AUTH_AREA_SIZE_OFFSET (cmd) + sizeof (UINT32))
-#define AUTH_AREA_GET_SIZE(cmd) \
-    (be32toh (*(UINT32*)(&cmd->buffer [AUTH_AREA_SIZE_OFFSET (cmd)])))
-#define AUTH_AREA_FIRST_OFFSET(cmd) (AUTH_AREA_SIZE_END_OFFSET (cmd))
-#define AUTH_AREA_END_OFFSET(cmd) \
-    (AUTH_AREA_FIRST_OFFSET (cmd) + AUTH_AREA_GET_SIZE (cmd))
 /*
  * Helper macros to aid in accessing parts of a session authorization. These
  * are the individual authorizations in the authorization area of the command.
@@ -100,6 +88,82 @@
 #define AUTH_AUTH_BUF_END_OFFSET(cmd, index) \
     (AUTH_AUTH_BUF_OFFSET(cmd, index) + AUTH_GET_AUTH_SIZE (cmd, index))
 
+/*
+ * TPM2_COMMAND_FLAG_* for each command code from TPM2_CC_FIRST, direct
+ * mapped like the CommandAttrs table. Codes outside of the table have no
+ * flags.
+ */
+#define COMMAND_FLAGS(cc) [cc - TPM2_CC_FIRST]
+static const guint8 command_flags [COMMAND_ATTRS_TABLE_SIZE] = {
+    COMMAND_FLAGS (TPM2_CC_CreatePrimary)     = TPM2_COMMAND_FLAG_LOADS_OBJECT,
+    COMMAND_FLAGS (TPM2_CC_Load)              = TPM2_COMMAND_FLAG_LOADS_OBJECT,
+    COMMAND_FLAGS (TPM2_CC_LoadExternal)      = TPM2_COMMAND_FLAG_LOADS_OBJECT,
+    COMMAND_FLAGS (TPM2_CC_StartAuthSession)  = TPM2_COMMAND_FLAG_CREATES_SESSION,
+    COMMAND_FLAGS (TPM2_CC_FlushContext)      = TPM2_COMMAND_FLAG_SPECIAL,
+    COMMAND_FLAGS (TPM2_CC_ContextSave)       = TPM2_COMMAND_FLAG_SPECIAL,
+    COMMAND_FLAGS (TPM2_CC_ContextLoad)       = TPM2_COMMAND_FLAG_SPECIAL,
+    COMMAND_FLAGS (TPM2_CC_GetCapability)     = TPM2_COMMAND_FLAG_SPECIAL,
+    COMMAND_FLAGS (TPM2_CC_GetRandom)         = TPM2_COMMAND_FLAG_SPECIAL,
+    COMMAND_FLAGS (TPM2_CC_ReadPublic)        = TPM2_COMMAND_FLAG_SPECIAL,
+    COMMAND_FLAGS (TPM2_CC_NV_Read)           = TPM2_COMMAND_FLAG_SPECIAL,
+    COMMAND_FLAGS (TPM2_CC_NV_ReadPublic)     = TPM2_COMMAND_FLAG_SPECIAL,
+    COMMAND_FLAGS (TPM2_CC_PCR_Read)          = TPM2_COMMAND_FLAG_SPECIAL,
+    COMMAND_FLAGS (TPM2_CC_TestParms)         = TPM2_COMMAND_FLAG_SPECIAL,
+    COMMAND_FLAGS (TPM2_CC_ECC_Parameters)    = TPM2_COMMAND_FLAG_SPECIAL,
+    COMMAND_FLAGS (TPM2_CC_GetTestResult)     = TPM2_COMMAND_FLAG_SPECIAL,
+    COMMAND_FLAGS (TPM2_CC_Startup)           = TPM2_COMMAND_FLAG_CHANGES_CAPS |
+                                                TPM2_COMMAND_FLAG_CHANGES_PUBLIC |
+                                                TPM2_COMMAND_FLAG_CHANGES_NV |
+                                                TPM2_COMMAND_FLAG_CHANGES_PCRS |
+                                                TPM2_COMMAND_FLAG_CHANGES_PRIMARY,
+    COMMAND_FLAGS (TPM2_CC_FieldUpgradeStart) = TPM2_COMMAND_FLAG_CHANGES_CAPS |
+                                                TPM2_COMMAND_FLAG_CHANGES_PUBLIC |
+                                                TPM2_COMMAND_FLAG_CHANGES_NV |
+                                                TPM2_COMMAND_FLAG_CHANGES_PRIMARY,
+    COMMAND_FLAGS (TPM2_CC_FieldUpgradeData)  = TPM2_COMMAND_FLAG_CHANGES_CAPS |
+                                                TPM2_COMMAND_FLAG_CHANGES_PUBLIC |
+                                                TPM2_COMMAND_FLAG_CHANGES_NV |
+                                                TPM2_COMMAND_FLAG_CHANGES_PRIMARY,
+    COMMAND_FLAGS (TPM2_CC_PP_Commands)       = TPM2_COMMAND_FLAG_CHANGES_CAPS,
+    COMMAND_FLAGS (TPM2_CC_SetAlgorithmSet)   = TPM2_COMMAND_FLAG_CHANGES_CAPS,
+    COMMAND_FLAGS (TPM2_CC_EvictControl)      = TPM2_COMMAND_FLAG_CHANGES_PUBLIC,
+    COMMAND_FLAGS (TPM2_CC_ObjectChangeAuth)  = TPM2_COMMAND_FLAG_CHANGES_PUBLIC,
+    COMMAND_FLAGS (TPM2_CC_Clear)             = TPM2_COMMAND_FLAG_CHANGES_PUBLIC |
+                                                TPM2_COMMAND_FLAG_CHANGES_NV |
+                                                TPM2_COMMAND_FLAG_CHANGES_PRIMARY,
+    COMMAND_FLAGS (TPM2_CC_ChangePPS)         = TPM2_COMMAND_FLAG_CHANGES_PUBLIC |
+                                                TPM2_COMMAND_FLAG_CHANGES_NV |
+                                                TPM2_COMMAND_FLAG_CHANGES_PRIMARY,
+    COMMAND_FLAGS (TPM2_CC_ChangeEPS)         = TPM2_COMMAND_FLAG_CHANGES_PUBLIC |
+                                                TPM2_COMMAND_FLAG_CHANGES_PRIMARY,
+    /*
+     * Hierarchy auth and enables, and the DA state, decide whether an
+     * NV_Read is authorized: the cached ones must go back to the TPM.
+     */
+    COMMAND_FLAGS (TPM2_CC_HierarchyControl)  = TPM2_COMMAND_FLAG_CHANGES_NV |
+                                                TPM2_COMMAND_FLAG_CHANGES_PRIMARY,
+    COMMAND_FLAGS (TPM2_CC_HierarchyChangeAuth) = TPM2_COMMAND_FLAG_CHANGES_NV |
+                                                TPM2_COMMAND_FLAG_CHANGES_PRIMARY,
+    COMMAND_FLAGS (TPM2_CC_DictionaryAttackLockReset) = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_DictionaryAttackParameters) = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_NV_DefineSpace)    = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_NV_UndefineSpace)  = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_NV_UndefineSpaceSpecial) = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_NV_Write)          = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_NV_Increment)      = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_NV_Extend)         = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_NV_SetBits)        = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_NV_WriteLock)      = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_NV_GlobalWriteLock) = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_NV_ReadLock)       = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_NV_ChangeAuth)     = TPM2_COMMAND_FLAG_CHANGES_NV,
+    COMMAND_FLAGS (TPM2_CC_PCR_Extend)        = TPM2_COMMAND_FLAG_CHANGES_PCRS,
+    COMMAND_FLAGS (TPM2_CC_PCR_Event)         = TPM2_COMMAND_FLAG_CHANGES_PCRS,
+    COMMAND_FLAGS (TPM2_CC_PCR_Reset)         = TPM2_COMMAND_FLAG_CHANGES_PCRS,
+    COMMAND_FLAGS (TPM2_CC_PCR_Allocate)      = TPM2_COMMAND_FLAG_CHANGES_PCRS,
+    COMMAND_FLAGS (TPM2_CC_EventSequenceComplete) = TPM2_COMMAND_FLAG_CHANGES_PCRS,
+};
+
 G_DEFINE_TYPE (Tpm2Command, tpm2_command, G_TYPE_OBJECT);
 
 enum {
@@ -111,6 +175,70 @@ enum {
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * Parse the layout of the command buffer into command->index. This is
+ * called whenever the buffer, its size or the attributes change, which in
+ * practice is once when the command is created. The auth area is walked
+ * here and nowhere else: each authorization must lie within the area and
+ * the authorizations must fill it exactly, otherwise auths_valid is FALSE
+ * and the params_offset is 0.
+ */
+static void
+tpm2_command_index (Tpm2Command *command)
+{
+    Tpm2CommandIndex *index = &command->index;
+    size_t offset, end;
+    TPM2_CC cc;
+
+    memset (index, 0, sizeof (*index));
+    index->handle_count = (guint8)((command->attributes & TPMA_CC_CHANDLES_MASK)
+                                   >> TPMA_CC_CHANDLES_SHIFT);
+    if (command->buffer == NULL || command->buffer_size < TPM_HEADER_SIZE) {
+        return;
+    }
+    cc = get_command_code (command->buffer);
+    if (cc >= TPM2_CC_FIRST && cc < TPM2_CC_FIRST + COMMAND_ATTRS_TABLE_SIZE) {
+        index->flags = command_flags [cc - TPM2_CC_FIRST];
+    } else if (cc == TABRMD_CC_RESIDENCY ||
+               cc == TABRMD_CC_NV_READ_LARGE ||
+               cc == TABRMD_CC_NV_WRITE_LARGE)
+    {
+        index->flags = TPM2_COMMAND_FLAG_SPECIAL;
+    }
+    if (get_command_tag (command->buffer) == TPM2_ST_NO_SESSIONS) {
+        index->auths_valid = TRUE;
+        index->params_offset = HANDLE_OFFSET (index->handle_count);
+        return;
+    }
+    index->auths_offset = HANDLE_OFFSET (index->handle_count);
+    if (index->auths_offset + sizeof (UINT32) > command->buffer_size) {
+        return;
+    }
+    index->auths_size =
+        be32toh (*(UINT32*)&command->buffer [index->auths_offset]);
+    offset = index->auths_offset + sizeof (UINT32);
+    end = offset + index->auths_size;
+    if (end > command->buffer_size) {
+        return;
+    }
+    while (offset < end) {
+        if (index->auth_count == TPM2_COMMAND_MAX_AUTHS ||
+            AUTH_NONCE_SIZE_END_OFFSET (offset) > end ||
+            AUTH_AUTH_SIZE_END_OFFSET (command, offset) > end)
+        {
+            index->auth_count = 0;
+            return;
+        }
+        index->auths [index->auth_count++] = offset;
+        offset = AUTH_AUTH_BUF_END_OFFSET (command, offset);
+    }
+    if (offset != end) {
+        index->auth_count = 0;
+        return;
+    }
+    index->auths_valid = TRUE;
+    index->params_offset = end;
+}
 /**
  * GObject property setter.
  */
@@ -125,6 +253,7 @@ tpm2_command_set_property (GObject        *object,
     switch (property_id) {
     case PROP_ATTRIBUTES:
         self->attributes = (TPMA_CC)g_value_get_uint (value);
+        tpm2_command_index (self);
         break;
     case PROP_BUFFER:
         if (self->buffer != NULL) {
@@ -132,9 +261,11 @@ tpm2_command_set_property (GObject        *object,
             break;
         }
         self->buffer = (guint8*)g_value_get_pointer (value);
+        tpm2_command_index (self);
         break;
     case PROP_BUFFER_SIZE:
         self->buffer_size = g_value_get_uint (value);
+        tpm2_command_index (self);
         break;
     case PROP_SESSION:
         if (self->connection != NULL) {
@@ -185,7 +316,14 @@ tpm2_command_dispose (GObject *obj)
 {
     Tpm2Command *cmd = TPM2_COMMAND (obj);
 
+    if (cmd->charged != 0) {
+        connection_charge (cmd->connection,
+                           MEM_ACCOUNT_COMMANDS,
+                           -(gssize)cmd->charged);
+        cmd->charged = 0;
+    }
     g_clear_object (&cmd->connection);
+    g_clear_pointer (&cmd->batch, g_ptr_array_unref);
     G_OBJECT_CLASS (tpm2_command_parent_class)->dispose (obj);
 }
 /**
@@ -198,18 +336,25 @@ tpm2_command_finalize (GObject *obj)
     Tpm2Command *cmd = TPM2_COMMAND (obj);
 
     g_debug ("tpm2_command_finalize");
-    g_clear_pointer (&cmd->buffer, g_free);
+    if (!cmd->buffer_borrowed) {
+        buffer_pool_free (cmd->buffer, cmd->buffer_size);
+        cmd->buffer = NULL;
+    }
     G_OBJECT_CLASS (tpm2_command_parent_class)->finalize (obj);
 }
 static void
 tpm2_command_init (Tpm2Command *command)
 {
-    UNUSED_PARAM(command);
-    /* noop */
+    ALLOC_STATS_ADD (ALLOC_STATS_MESSAGES, sizeof (*command));
+    command->timestamp = g_get_monotonic_time ();
 }
 /**
  * Boilerplate GObject initialization. Get a pointer to the parent class,
  * setup a finalize function.
+ * The properties aren't construct properties: g_object_new would then
+ * box a GValue and call the setter for each of them, defaults included,
+ * for every command. tpm2_command_new sets the fields directly and the
+ * setters refuse to replace a buffer or connection once set.
  */
 static void
 tpm2_command_class_init (Tpm2CommandClass *klass)
@@ -230,12 +375,12 @@ tpm2_command_class_init (Tpm2CommandClass *klass)
                            0,
                            UINT32_MAX,
                            0,
-                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
     obj_properties [PROP_BUFFER] =
         g_param_spec_pointer ("buffer",
                               "TPM2 command buffer",
                               "memory buffer holding a TPM2 command",
-                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+                              G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
     obj_properties [PROP_BUFFER_SIZE] =
         g_param_spec_uint ("buffer-size",
                            "sizeof command buffer",
@@ -243,19 +388,22 @@ tpm2_command_class_init (Tpm2CommandClass *klass)
                            0,
                            UTIL_BUF_MAX,
                            0,
-                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
     obj_properties [PROP_SESSION] =
         g_param_spec_object ("connection",
                              "Session object",
                              "The Connection object that sent the command",
                              TYPE_CONNECTION,
-                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
 }
 /**
- * Boilerplate constructor, but some GObject properties would be nice.
+ * Create a Tpm2Command that takes ownership of 'buffer' and a reference
+ * to 'connection'. This is the hot path for every command from a client
+ * so the fields are set directly instead of through the GObject
+ * properties, which remain for g_object_new and g_object_get callers.
  */
 Tpm2Command*
 tpm2_command_new (Connection     *connection,
@@ -263,19 +411,75 @@ tpm2_command_new (Connection     *connection,
                   size_t           size,
                   TPMA_CC          attributes)
 {
-    return TPM2_COMMAND (g_object_new (TYPE_TPM2_COMMAND,
-                                       "attributes", attributes,
-                                       "buffer",  buffer,
-                                       "buffer-size", size,
-                                       "connection", connection,
-                                       NULL));
+    Tpm2Command *command;
+
+    g_assert (size <= UTIL_BUF_MAX);
+    command = TPM2_COMMAND (g_object_new (TYPE_TPM2_COMMAND, NULL));
+    command->attributes = attributes;
+    command->buffer = buffer;
+    command->buffer_size = size;
+    if (connection != NULL) {
+        command->connection = g_object_ref (connection);
+        command->charged = size;
+        connection_charge (connection, MEM_ACCOUNT_COMMANDS, (gssize)size);
+    }
+    tpm2_command_index (command);
+    return command;
+}
+/*
+ * Create a Tpm2Command that uses 'buffer' without taking ownership of it.
+ * The caller must keep 'buffer' alive until the last reference to the
+ * command is dropped, typically because it comes from an arena that is
+ * reset once the command has been processed.
+ */
+Tpm2Command*
+tpm2_command_new_borrowed (Connection     *connection,
+                           guint8          *buffer,
+                           size_t           size,
+                           TPMA_CC          attributes)
+{
+    Tpm2Command *command;
+
+    command = tpm2_command_new (connection, buffer, size, attributes);
+    command->buffer_borrowed = TRUE;
+    return command;
+}
+/*
+ * Allocate 'size' zeroed bytes for a command buffer from 'arena', or from
+ * the heap if 'arena' is NULL.
+ */
+static uint8_t*
+tpm2_command_buffer_alloc (arena_t *arena,
+                           size_t   size)
+{
+    return arena == NULL ? g_malloc0 (size) : arena_alloc0 (arena, size);
+}
+/*
+ * Wrap 'buf' in a Tpm2Command that owns it unless it came from 'arena'.
+ */
+static Tpm2Command*
+tpm2_command_new_internal (arena_t *arena,
+                           uint8_t *buf,
+                           size_t   size,
+                           TPMA_CC  attributes)
+{
+    if (arena == NULL) {
+        return tpm2_command_new (NULL, buf, size, attributes);
+    }
+    return tpm2_command_new_borrowed (NULL, buf, size, attributes);
 }
 #define CONTEXT_SAVE_CMD_SIZE (TPM_HEADER_SIZE + sizeof (TPM2_HANDLE))
+/*
+ * Build a ContextSave command for 'handle'. With a non-NULL 'arena' the
+ * command buffer is taken from it and the command must be released before
+ * the arena is reset.
+ */
 Tpm2Command*
-tpm2_command_new_context_save (TPM2_HANDLE handle)
+tpm2_command_new_context_save (arena_t    *arena,
+                               TPM2_HANDLE handle)
 {
     TSS2_RC rc;
-    uint8_t *buf = g_malloc0 (CONTEXT_SAVE_CMD_SIZE);
+    uint8_t *buf = tpm2_command_buffer_alloc (arena, CONTEXT_SAVE_CMD_SIZE);
     size_t offset = TPM_HEADER_SIZE;
 
     rc = tpm2_header_init (buf,
@@ -294,20 +498,30 @@ tpm2_command_new_context_save (TPM2_HANDLE handle)
         goto err_out;
     }
     /* TPMA_CC here is hard coded to the appropriate value for ContextSave */
-    return tpm2_command_new (NULL, buf, CONTEXT_SAVE_CMD_SIZE, 0x02000162);
+    return tpm2_command_new_internal (arena,
+                                      buf,
+                                      CONTEXT_SAVE_CMD_SIZE,
+                                      0x02000162);
 
 err_out:
     g_warning ("%s: failed", __func__);
-    g_free (buf);
+    if (arena == NULL) {
+        g_free (buf);
+    }
     return NULL;
 }
+/*
+ * Build a ContextLoad command for the context blob 'buf'. 'arena' is used
+ * as in tpm2_command_new_context_save.
+ */
 Tpm2Command*
-tpm2_command_new_context_load (uint8_t *buf,
-                               size_t size)
+tpm2_command_new_context_load (arena_t    *arena,
+                               uint8_t    *buf,
+                               size_t      size)
 {
     TSS2_RC rc;
     UINT32 size_new = TPM_HEADER_SIZE + size;
-    uint8_t *buf_tmp = g_malloc0 (size_new);
+    uint8_t *buf_tmp = tpm2_command_buffer_alloc (arena, size_new);
 
     rc = tpm2_header_init (buf_tmp,
                            size_new,
@@ -315,12 +529,14 @@ tpm2_command_new_context_load (uint8_t *buf,
                            size_new,
                            TPM2_CC_ContextLoad);
     if (rc != TSS2_RC_SUCCESS) {
-        g_free (buf_tmp);
+        if (arena == NULL) {
+            g_free (buf_tmp);
+        }
         return NULL;
     }
     memcpy (&buf_tmp [TPM_HEADER_SIZE], buf, size);
     /* TPMA_CC here is hard coded to the appropriate value for ContextLoad */
-    return tpm2_command_new (NULL, buf_tmp, size_new, 0x10000161);
+    return tpm2_command_new_internal (arena, buf_tmp, size_new, 0x10000161);
 }
 /* Simple "getter" to expose the attributes associated with the command. */
 TPMA_CC
@@ -375,15 +591,11 @@ tpm2_command_get_connection (Tpm2Command *command)
 guint8
 tpm2_command_get_handle_count (Tpm2Command *command)
 {
-    g_debug ("tpm2_command_get_handle_count");
-    uint32_t tmp;
-
     if (command == NULL) {
         g_warning ("tpm2_command_get_handle_count received NULL parameter");
         return 0;
     }
-    tmp = tpm2_command_get_attributes (command);
-    return (guint8)((tmp & TPMA_CC_CHANDLES_MASK) >> TPMA_CC_CHANDLES_SHIFT);
+    return command->index.handle_count;
 }
 /*
  * Simple function to access handles in the provided Tpm2Command. The
@@ -408,6 +620,22 @@ tpm2_command_get_handle (Tpm2Command *command,
         return 0;
     }
 }
+/*
+ * Return the handle at the 0-based index as the client sent it: the one
+ * tpm2_command_set_handle replaced or, if it hasn't been replaced, the one
+ * in the command. Returns 0 if there's no such handle.
+ */
+TPM2_HANDLE
+tpm2_command_get_client_handle (Tpm2Command *command,
+                                guint8       handle_number)
+{
+    if (command != NULL && handle_number < TPM2_COMMAND_MAX_HANDLES &&
+        (command->handles_replaced & (1 << handle_number)))
+    {
+        return command->client_handles [handle_number];
+    }
+    return tpm2_command_get_handle (command, handle_number);
+}
 /*
  * Simple function to set a handle at the 0-based index into the Tpm2Command
  * handle area to the provided value. If the handle_number is past the bounds
@@ -426,6 +654,13 @@ tpm2_command_set_handle (Tpm2Command *command,
     real_count = tpm2_command_get_handle_count (command);
     end = HANDLE_END_OFFSET (handle_number);
     if (real_count > handle_number && end <= command->buffer_size) {
+        if (handle_number < TPM2_COMMAND_MAX_HANDLES &&
+            !(command->handles_replaced & (1 << handle_number)))
+        {
+            command->client_handles [handle_number] =
+                be32toh (HANDLE_GET (command->buffer, handle_number));
+            command->handles_replaced |= 1 << handle_number;
+        }
         HANDLE_GET (command->buffer, handle_number) = htobe32 (handle);
         return TRUE;
     } else {
@@ -468,6 +703,39 @@ tpm2_command_get_handles (Tpm2Command *command,
 
     return TRUE;
 }
+/*
+ * Returns TRUE if the provided handle appears in either the handle area or
+ * the authorization area of the command, FALSE otherwise.
+ */
+gboolean
+tpm2_command_references_handle (Tpm2Command *command,
+                                TPM2_HANDLE  handle)
+{
+    TPM2_HANDLE handles [TPM2_COMMAND_MAX_HANDLES] = { 0, };
+    size_t count = TPM2_COMMAND_MAX_HANDLES, i;
+
+    if (command == NULL) {
+        g_warning ("%s passed NULL parameter", __func__);
+        return FALSE;
+    }
+    if (tpm2_command_get_handles (command, handles, &count)) {
+        for (i = 0; i < count; ++i) {
+            if (handles [i] == handle) {
+                return TRUE;
+            }
+        }
+    }
+    if (!tpm2_command_has_auths (command) || !command->index.auths_valid) {
+        return FALSE;
+    }
+    for (i = 0; i < command->index.auth_count; ++i) {
+        if (AUTH_GET_HANDLE (command, command->index.auths [i]) == handle) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
 /*
  * This function is a work around. The handle in a command buffer for the
  * FlushContext command is not in the handle area and no handles are reported
@@ -596,8 +864,6 @@ tpm2_command_has_auths (Tpm2Command *command)
 UINT32
 tpm2_command_get_auths_size (Tpm2Command *command)
 {
-    size_t auth_size_end;
-
     if (command == NULL) {
         g_warning ("tpm2_command_get_auths_size passed NULL parameter");
         return 0;
@@ -606,16 +872,15 @@ tpm2_command_get_auths_size (Tpm2Command *command)
         g_warning ("%s: Tpm2Command has no auths", __func__);
         return 0;
     }
-    auth_size_end = AUTH_AREA_SIZE_END_OFFSET (command);
-    g_debug ("%s: auth_size_end: %zu", __func__, auth_size_end);
-    g_debug ("%s: buffer_size: %zu", __func__, command->buffer_size);
-    if (AUTH_AREA_SIZE_END_OFFSET (command) > command->buffer_size) {
+    if (command->index.auths_offset == 0 ||
+        command->index.auths_offset + sizeof (UINT32) > command->buffer_size)
+    {
         g_warning ("%s reading size of auth area would overrun command buffer."
                    " Returning 0", __func__);
         return 0;
     }
 
-    return AUTH_AREA_GET_SIZE (command);
+    return command->index.auths_size;
 }
 /*
  * This function extracts the authorization handle from the entry in the
@@ -653,6 +918,29 @@ tpm2_command_get_auth_attrs (Tpm2Command *command,
     }
     return AUTH_GET_SESSION_ATTRS (command, auth_offset);
 }
+/*
+ * Return the hmac, or password for a password session, of the entry in
+ * the auth area that begins at offset 'auth_offset' and set 'size' to its
+ * size. Returns NULL if it would overrun the command buffer.
+ */
+guint8*
+tpm2_command_get_auth_value (Tpm2Command *command,
+                             size_t       auth_offset,
+                             UINT16      *size)
+{
+    g_assert (command != NULL && size != NULL);
+    if (AUTH_NONCE_SIZE_END_OFFSET (auth_offset) > command->buffer_size ||
+        AUTH_SESSION_ATTRS_END_OFFSET (command, auth_offset) > command->buffer_size ||
+        AUTH_AUTH_SIZE_END_OFFSET (command, auth_offset) > command->buffer_size ||
+        AUTH_AUTH_BUF_END_OFFSET (command, auth_offset) > command->buffer_size)
+    {
+        g_warning ("%s attempt to access authorization overruns command "
+                   "buffer", __func__);
+        return NULL;
+    }
+    *size = AUTH_GET_AUTH_SIZE (command, auth_offset);
+    return &command->buffer [AUTH_AUTH_BUF_OFFSET (command, auth_offset)];
+}
 /*
  * The caller provided GFunc is invoked once for each authorization in the
  * command authorization area. The first parameter passed to 'func' is a
@@ -664,31 +952,227 @@ tpm2_command_foreach_auth (Tpm2Command *command,
                            GFunc        callback,
                            gpointer     user_data)
 {
-    size_t   offset;
+    size_t i;
 
     if (command == NULL || callback == NULL) {
         g_warning ("%s passed NULL parameter", __func__);
         return FALSE;
     }
 
-    if (AUTH_AREA_FIRST_OFFSET (command) > command->buffer_size) {
-        g_warning ("%s: auth area begins after end of buffer", __func__);
-        return FALSE;
-    }
-
-    if (AUTH_AREA_END_OFFSET (command) > command->buffer_size) {
-        g_warning ("%s: command buffer size insufficient to iterate all auths",
+    if (!command->index.auths_valid) {
+        g_warning ("%s: auth area is malformed or overruns the command buffer",
                    __func__);
         return FALSE;
     }
 
-    for (offset =  AUTH_AREA_FIRST_OFFSET (command);
-         offset <  AUTH_AREA_END_OFFSET (command);
-         offset = AUTH_AUTH_BUF_END_OFFSET   (command, offset))
-    {
-        size_t offset_tmp = offset;
+    for (i = 0; i < command->index.auth_count; ++i) {
+        size_t offset_tmp = command->index.auths [i];
         callback (&offset_tmp, user_data);
     }
 
     return TRUE;
 }
+/*
+ * Return the number of authorizations in the command auth area. This is 0
+ * if the auth area is malformed.
+ */
+guint8
+tpm2_command_get_auth_count (Tpm2Command *command)
+{
+    return command->index.auth_count;
+}
+/*
+ * Return the TPM2_COMMAND_FLAG_* for the command code of the command.
+ */
+guint8
+tpm2_command_get_flags (Tpm2Command *command)
+{
+    return command->index.flags;
+}
+/*
+ * Return the offset of the parameter area in the command buffer: the end
+ * of the handle area, or of the auth area if the command has one. This is
+ * 0 if the auth area is malformed.
+ */
+size_t
+tpm2_command_get_params_offset (Tpm2Command *command)
+{
+    return command->index.params_offset;
+}
+/*
+ * Check the framing of the command before it is passed on: the tag, the
+ * size in the header, a handle area large enough for the number of
+ * handles its attributes give the command code and, with sessions, a
+ * well formed auth area holding at least one authorization.
+ * Returns TSS2_RC_SUCCESS or the RC the command is answered with instead,
+ * the one the TPM would return.
+ */
+TSS2_RC
+tpm2_command_check (Tpm2Command *command)
+{
+    TPMI_ST_COMMAND_TAG tag;
+
+    if (command->buffer == NULL || command->buffer_size < TPM_HEADER_SIZE) {
+        return RM_RC (TPM2_RC_INSUFFICIENT);
+    }
+    tag = get_command_tag (command->buffer);
+    if (tag != TPM2_ST_NO_SESSIONS && tag != TPM2_ST_SESSIONS) {
+        return RM_RC (TPM2_RC_BAD_TAG);
+    }
+    if (get_command_size (command->buffer) != command->buffer_size) {
+        return RM_RC (TPM2_RC_COMMAND_SIZE);
+    }
+    if (HANDLE_OFFSET (command->index.handle_count) > command->buffer_size) {
+        return RM_RC (TPM2_RC_INSUFFICIENT);
+    }
+    if (tag == TPM2_ST_SESSIONS &&
+        (!command->index.auths_valid || command->index.auth_count == 0))
+    {
+        return RM_RC (TPM2_RC_AUTHSIZE);
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Accessors for the scheduling class of the command. New commands are
+ * TPM2_COMMAND_PRIORITY_NORMAL.
+ */
+Tpm2CommandPriority
+tpm2_command_get_priority (Tpm2Command *command)
+{
+    return command->priority;
+}
+void
+tpm2_command_set_priority (Tpm2Command         *command,
+                           Tpm2CommandPriority  priority)
+{
+    g_assert (priority < TPM2_COMMAND_PRIORITY_COUNT);
+    command->priority = priority;
+}
+/*
+ * Return the monotonic time, in microseconds, at which the command was
+ * created. This is roughly when it was read from the client.
+ */
+gint64
+tpm2_command_get_timestamp (Tpm2Command *command)
+{
+    return command->timestamp;
+}
+/*
+ * Accessors for the time the TPM spent executing the command. Each time
+ * the command is sent the Tpm2 adds the time it took.
+ */
+gint64
+tpm2_command_get_tpm_time (Tpm2Command *command)
+{
+    return command->tpm_usec;
+}
+void
+tpm2_command_add_tpm_time (Tpm2Command *command,
+                           gint64       usec)
+{
+    command->tpm_usec += MAX (usec, 0);
+}
+/*
+ * Accessors for the deadline of the command: the monotonic time in usec
+ * after which the client has stopped waiting for the response, 0 if the
+ * client waits for as long as it takes.
+ */
+gint64
+tpm2_command_get_deadline (Tpm2Command *command)
+{
+    return command->deadline;
+}
+void
+tpm2_command_set_deadline (Tpm2Command *command,
+                           gint64       deadline)
+{
+    command->deadline = deadline;
+}
+/*
+ * Returns TRUE if the command has a deadline that's passed at 'now'.
+ */
+gboolean
+tpm2_command_expired (Tpm2Command *command,
+                      gint64       now)
+{
+    return command->deadline != 0 && now > command->deadline;
+}
+/*
+ * Accessors for the W3C trace context the command is part of, see
+ * trace_context_t. It's all zero if the client set none.
+ */
+const trace_context_t*
+tpm2_command_get_trace_context (Tpm2Command *command)
+{
+    return &command->trace_context;
+}
+void
+tpm2_command_set_trace_context (Tpm2Command           *command,
+                                const trace_context_t *context)
+{
+    command->trace_context = *context;
+}
+/*
+ * Accessors for the tag the client sent with the command on a connection
+ * using the tagged transport. The response to the command carries the
+ * same tag.
+ */
+guint32
+tpm2_command_get_request_tag (Tpm2Command *command)
+{
+    return command->request_tag;
+}
+void
+tpm2_command_set_request_tag (Tpm2Command *command,
+                              guint32      tag)
+{
+    command->request_tag = tag;
+}
+/*
+ * Add 'next' to the commands sent in the same batch as 'command'. The
+ * batch holds a reference to 'next'. The ResourceManager processes the
+ * commands of a batch right after 'command', in the order they were
+ * added, without serving another connection in between.
+ */
+void
+tpm2_command_batch_append (Tpm2Command *command,
+                           Tpm2Command *next)
+{
+    if (command->batch == NULL) {
+        command->batch = g_ptr_array_new_with_free_func (g_object_unref);
+    }
+    next->batched = TRUE;
+    g_ptr_array_add (command->batch, g_object_ref (next));
+}
+/*
+ * Return the commands sent in the same batch after 'command', or NULL if
+ * there are none. The array is owned by 'command'.
+ */
+GPtrArray*
+tpm2_command_get_batch (Tpm2Command *command)
+{
+    return command->batch;
+}
+/*
+ * Accessors for the flag asking that the rest of the batch be skipped
+ * once a command in it doesn't succeed.
+ */
+gboolean
+tpm2_command_get_batch_stop (Tpm2Command *command)
+{
+    return command->batch_stop;
+}
+void
+tpm2_command_set_batch_stop (Tpm2Command *command,
+                             gboolean     stop)
+{
+    command->batch_stop = stop;
+}
+/*
+ * Returns TRUE if 'command' was added to another command's batch.
+ */
+gboolean
+tpm2_command_is_batched (Tpm2Command *command)
+{
+    return command->batched;
+}
@@ -9,6 +9,7 @@
 #include <glib-object.h>
 #include <tss2/tss2_tpm2_types.h>
 
+#include "arena.h"
 #include "connection.h"
 
 G_BEGIN_DECLS
@@ -17,12 +18,96 @@ typedef struct _Tpm2CommandClass {
     GObjectClass    parent;
 } Tpm2CommandClass;
 
+/*
+ * Scheduling class of a command. Commands in a higher class are sent to
+ * the TPM before queued commands in a lower class.
+ */
+typedef enum {
+    TPM2_COMMAND_PRIORITY_NORMAL = 0,
+    TPM2_COMMAND_PRIORITY_HIGH,
+} Tpm2CommandPriority;
+#define TPM2_COMMAND_PRIORITY_COUNT 2
+
+#define TPM2_COMMAND_MAX_HANDLES     3
+/* a command carries at most three sessions */
+#define TPM2_COMMAND_MAX_AUTHS       3
+
+/*
+ * Properties of a command code that the ResourceManager acts on, see
+ * tpm2_command_get_flags.
+ */
+/* the command loads a transient object */
+#define TPM2_COMMAND_FLAG_LOADS_OBJECT    (1 << 0)
+/* the command creates a session */
+#define TPM2_COMMAND_FLAG_CREATES_SESSION (1 << 1)
+/* the command may be handled by command_special_processing */
+#define TPM2_COMMAND_FLAG_SPECIAL         (1 << 2)
+/* the command may change what GetCapability reports for invariant caps */
+#define TPM2_COMMAND_FLAG_CHANGES_CAPS    (1 << 3)
+/* the command may change or remove the public area of a persistent object */
+#define TPM2_COMMAND_FLAG_CHANGES_PUBLIC  (1 << 4)
+/* the command may change the contents, attributes or auth of an NV index */
+#define TPM2_COMMAND_FLAG_CHANGES_NV      (1 << 5)
+/* the command may change PCR values, the one in handle 0 if it's a PCR */
+#define TPM2_COMMAND_FLAG_CHANGES_PCRS    (1 << 6)
+/* the command may change the primary objects a hierarchy creates */
+#define TPM2_COMMAND_FLAG_CHANGES_PRIMARY (1 << 7)
+
+/*
+ * Layout of the command buffer, parsed once when the buffer is set so
+ * that the accessors don't walk the buffer on every call. Offsets are
+ * from the start of the buffer.
+ */
+typedef struct {
+    guint8          handle_count;
+    guint8          auth_count;
+    /* TPM2_COMMAND_FLAG_* for the command code */
+    guint8          flags;
+    /* FALSE if the auth area is malformed or overruns the buffer */
+    gboolean        auths_valid;
+    /* offset of the auth area size field, 0 without auths */
+    size_t          auths_offset;
+    UINT32          auths_size;
+    /* offset of each authorization in the auth area */
+    size_t          auths [TPM2_COMMAND_MAX_AUTHS];
+    size_t          params_offset;
+} Tpm2CommandIndex;
+
 typedef struct _Tpm2Command {
     GObject         parent_instance;
     TPMA_CC         attributes;
     Connection     *connection;
     guint8         *buffer;
     size_t          buffer_size;
+    /* TRUE if 'buffer' belongs to the caller and isn't freed with us */
+    gboolean        buffer_borrowed;
+    /* bytes charged to 'connection' for the buffer */
+    gsize           charged;
+    Tpm2CommandPriority priority;
+    /* monotonic time (usec) at which the command was created */
+    gint64          timestamp;
+    /* usec the TPM spent executing the command, resends included */
+    gint64          tpm_usec;
+    /* monotonic time (usec) after which the client no longer waits, 0 if none */
+    gint64          deadline;
+    /* trace the command is part of, from its connection */
+    trace_context_t trace_context;
+    /* tag from a connection using the tagged transport, 0 otherwise */
+    guint32         request_tag;
+    /* commands sent in the same batch after this one, NULL if none */
+    GPtrArray      *batch;
+    /* skip the rest of the batch once a command doesn't succeed */
+    gboolean        batch_stop;
+    /* TRUE if the command is carried in another command's batch */
+    gboolean        batched;
+    Tpm2CommandIndex index;
+    /*
+     * Handles as the client sent them, kept when tpm2_command_set_handle
+     * first replaces them. Bit n of 'handles_replaced' is set once handle
+     * n has been replaced.
+     */
+    TPM2_HANDLE     client_handles [TPM2_COMMAND_MAX_HANDLES];
+    guint8          handles_replaced;
 } Tpm2Command;
 
 #include "command-attrs.h"
@@ -34,21 +119,28 @@ typedef struct _Tpm2Command {
 #define IS_TPM2_COMMAND_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_TPM2_COMMAND))
 #define TPM2_COMMAND_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_TPM2_COMMAND, Tpm2CommandClass))
 
-#define TPM2_COMMAND_MAX_HANDLES     3
-
 GType                 tpm2_command_get_type        (void);
 Tpm2Command*          tpm2_command_new             (Connection      *connection,
                                                     guint8           *buffer,
                                                     size_t            size,
                                                     TPMA_CC           attrs);
-Tpm2Command*          tpm2_command_new_context_save (TPM2_HANDLE);
-Tpm2Command*          tpm2_command_new_context_load (uint8_t *buf,
-                                                     size_t size);
+Tpm2Command*          tpm2_command_new_borrowed    (Connection      *connection,
+                                                    guint8           *buffer,
+                                                    size_t            size,
+                                                    TPMA_CC           attrs);
+Tpm2Command*          tpm2_command_new_context_save (arena_t    *arena,
+                                                     TPM2_HANDLE handle);
+Tpm2Command*          tpm2_command_new_context_load (arena_t    *arena,
+                                                     uint8_t    *buf,
+                                                     size_t      size);
 TPMA_CC               tpm2_command_get_attributes  (Tpm2Command      *command);
 TPMA_SESSION          tpm2_command_get_auth_attrs  (Tpm2Command      *command,
                                                     size_t            auth_offset);
 TPM2_HANDLE            tpm2_command_get_auth_handle (Tpm2Command      *command,
                                                     size_t            offset);
+guint8*               tpm2_command_get_auth_value  (Tpm2Command      *command,
+                                                    size_t            auth_offset,
+                                                    UINT16           *size);
 guint8*               tpm2_command_get_buffer      (Tpm2Command      *command);
 TPM2_CC                tpm2_command_get_code        (Tpm2Command      *command);
 guint8                tpm2_command_get_handle_count (Tpm2Command     *command);
@@ -57,6 +149,10 @@ TPM2_HANDLE            tpm2_command_get_handle      (Tpm2Command      *command,
 gboolean              tpm2_command_get_handles     (Tpm2Command      *command,
                                                     TPM2_HANDLE        handles[],
                                                     size_t           *count);
+TPM2_HANDLE            tpm2_command_get_client_handle (Tpm2Command    *command,
+                                                    guint8            handle_number);
+gboolean              tpm2_command_references_handle (Tpm2Command    *command,
+                                                    TPM2_HANDLE       handle);
 gboolean              tpm2_command_set_handle      (Tpm2Command      *command,
                                                     TPM2_HANDLE        handle,
                                                     guint8            handle_number);
@@ -73,6 +169,35 @@ UINT32                tpm2_command_get_auths_size  (Tpm2Command      *command);
 gboolean              tpm2_command_foreach_auth    (Tpm2Command      *command,
                                                     GFunc             func,
                                                     gpointer          user_data);
+guint8                tpm2_command_get_auth_count  (Tpm2Command      *command);
+guint8                tpm2_command_get_flags       (Tpm2Command      *command);
+size_t                tpm2_command_get_params_offset (Tpm2Command    *command);
+TSS2_RC               tpm2_command_check           (Tpm2Command      *command);
+Tpm2CommandPriority   tpm2_command_get_priority    (Tpm2Command      *command);
+void                  tpm2_command_set_priority    (Tpm2Command      *command,
+                                                    Tpm2CommandPriority priority);
+gint64                tpm2_command_get_timestamp   (Tpm2Command      *command);
+gint64                tpm2_command_get_tpm_time    (Tpm2Command      *command);
+void                  tpm2_command_add_tpm_time    (Tpm2Command      *command,
+                                                    gint64            usec);
+gint64                tpm2_command_get_deadline    (Tpm2Command      *command);
+void                  tpm2_command_set_deadline    (Tpm2Command      *command,
+                                                    gint64            deadline);
+gboolean              tpm2_command_expired         (Tpm2Command      *command,
+                                                    gint64            now);
+const trace_context_t* tpm2_command_get_trace_context (Tpm2Command   *command);
+void                  tpm2_command_set_trace_context (Tpm2Command      *command,
+                                                      const trace_context_t *context);
+guint32               tpm2_command_get_request_tag (Tpm2Command      *command);
+void                  tpm2_command_set_request_tag (Tpm2Command      *command,
+                                                    guint32           tag);
+void                  tpm2_command_batch_append    (Tpm2Command      *command,
+                                                    Tpm2Command      *next);
+GPtrArray*            tpm2_command_get_batch       (Tpm2Command      *command);
+gboolean              tpm2_command_get_batch_stop  (Tpm2Command      *command);
+void                  tpm2_command_set_batch_stop  (Tpm2Command      *command,
+                                                    gboolean          stop);
+gboolean              tpm2_command_is_batched      (Tpm2Command      *command);
 
 G_END_DECLS
 
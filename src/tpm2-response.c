@@ -10,6 +10,8 @@
 #include <tss2/tss2_tpm2_types.h>
 #include <tss2/tss2_mu.h>
 
+#include "alloc-stats.h"
+#include "buffer-pool.h"
 #include "tpm2-header.h"
 #include "tpm2-response.h"
 #include "util.h"
@@ -111,6 +113,12 @@ tpm2_response_dispose (GObject *obj)
 {
     Tpm2Response *self = TPM2_RESPONSE (obj);
 
+    if (self->charged != 0) {
+        connection_charge (self->connection,
+                           MEM_ACCOUNT_RESPONSES,
+                           -(gssize)self->charged);
+        self->charged = 0;
+    }
     g_clear_object (&self->connection);
     G_OBJECT_CLASS (tpm2_response_parent_class)->dispose (obj);
 }
@@ -124,18 +132,22 @@ tpm2_response_finalize (GObject *obj)
     Tpm2Response *self = TPM2_RESPONSE (obj);
 
     g_debug ("tpm2_response_finalize");
-    g_clear_pointer (&self->buffer, g_free);
+    buffer_pool_free (self->buffer, self->buffer_size);
+    self->buffer = NULL;
     G_OBJECT_CLASS (tpm2_response_parent_class)->finalize (obj);
 }
 static void
 tpm2_response_init (Tpm2Response *response)
 {
     UNUSED_PARAM(response);
-    /* noop */
+    ALLOC_STATS_ADD (ALLOC_STATS_MESSAGES, sizeof (*response));
 }
 /**
  * Boilerplate GObject initialization. Get a pointer to the parent class,
  * setup a finalize function.
+ * The properties aren't construct properties so that tpm2_response_new
+ * doesn't pay for a GValue and a setter call for each of them, see
+ * tpm2_command_class_init.
  */
 static void
 tpm2_response_class_init (Tpm2ResponseClass *klass)
@@ -156,12 +168,12 @@ tpm2_response_class_init (Tpm2ResponseClass *klass)
                            0,
                            UINT32_MAX,
                            0,
-                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
     obj_properties [PROP_BUFFER] =
         g_param_spec_pointer ("buffer",
                               "TPM2 response buffer",
                               "memory buffer holding a TPM2 response",
-                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+                              G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
     obj_properties [PROP_BUFFER_SIZE] =
         g_param_spec_uint ("buffer-size",
                            "sizeof command buffer",
@@ -169,19 +181,20 @@ tpm2_response_class_init (Tpm2ResponseClass *klass)
                            0,
                            UTIL_BUF_MAX,
                            0,
-                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
     obj_properties [PROP_SESSION] =
         g_param_spec_object ("connection",
                              "Connection object",
                              "The Connection object that sent the response",
                              TYPE_CONNECTION,
-                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
 }
 /**
- * Boilerplate constructor, but some GObject properties would be nice.
+ * Create a Tpm2Response that takes ownership of 'buffer' and a reference
+ * to 'connection'. The fields are set directly, see tpm2_command_new.
  */
 Tpm2Response*
 tpm2_response_new (Connection     *connection,
@@ -189,12 +202,21 @@ tpm2_response_new (Connection     *connection,
                    size_t           buffer_size,
                    TPMA_CC          attributes)
 {
-    return TPM2_RESPONSE (g_object_new (TYPE_TPM2_RESPONSE,
-                                        "attributes", attributes,
-                                       "buffer",  buffer,
-                                       "buffer-size", buffer_size,
-                                       "connection", connection,
-                                       NULL));
+    Tpm2Response *response;
+
+    g_assert (buffer_size <= UTIL_BUF_MAX);
+    response = TPM2_RESPONSE (g_object_new (TYPE_TPM2_RESPONSE, NULL));
+    response->attributes = attributes;
+    response->buffer = buffer;
+    response->buffer_size = buffer_size;
+    if (connection != NULL) {
+        response->connection = g_object_ref (connection);
+        response->charged = buffer_size;
+        connection_charge (connection,
+                           MEM_ACCOUNT_RESPONSES,
+                           (gssize)buffer_size);
+    }
+    return response;
 }
 
 void
@@ -275,26 +297,68 @@ tpm2_response_new_context_save (Connection *connection,
                                 SessionEntry *entry)
 {
     Tpm2Response *response = NULL;
-    size_buf_t *size_buf;
+    GBytes *context_client;
+    gconstpointer context_buf = NULL;
+    gsize size = 0;
     /* allocate buffer be large enough to hold TPM2_ContextSave response */
     uint8_t *buf;
     TSS2_RC rc;
 
-    size_buf = session_entry_get_context_client (entry);
-    buf = g_malloc0 (TPM_HEADER_SIZE + size_buf->size);
-    memcpy (&buf[TPM_HEADER_SIZE], size_buf->buf, size_buf->size);
+    context_client = session_entry_get_context_client (entry);
+    if (context_client != NULL) {
+        context_buf = g_bytes_get_data (context_client, &size);
+    }
+    buf = g_malloc0 (TPM_HEADER_SIZE + size);
+    if (size > 0) {
+        memcpy (&buf[TPM_HEADER_SIZE], context_buf, size);
+    }
     /* offset now has size of response */
     rc = tpm2_header_init (buf,
-                           TPM_HEADER_SIZE + size_buf->size,
+                           TPM_HEADER_SIZE + size,
                            TPM2_ST_NO_SESSIONS,
-                           TPM_HEADER_SIZE + size_buf->size,
+                           TPM_HEADER_SIZE + size,
                            TSS2_RC_SUCCESS);
     if (rc != TSS2_RC_SUCCESS) {
         g_warning ("%s: Failed to initialize header: 0x%" PRIx32,
                    __func__, rc);
         goto out;
     }
-    response = tpm2_response_new (connection, buf, TPM_HEADER_SIZE + size_buf->size, 0x02000162);
+    response = tpm2_response_new (connection, buf, TPM_HEADER_SIZE + size, 0x02000162);
+out:
+    if (response == NULL) {
+        g_free (buf);
+    }
+    return response;
+}
+/*
+ * Build the response to a TPM2_ContextSave from 'context', the marshalled
+ * context of a transient object the RM saved itself. It becomes the body
+ * of the response as it is.
+ */
+Tpm2Response*
+tpm2_response_new_context_save_transient (Connection *connection,
+                                          GBytes     *context)
+{
+    Tpm2Response *response = NULL;
+    gconstpointer context_buf;
+    gsize size;
+    uint8_t *buf;
+    TSS2_RC rc;
+
+    context_buf = g_bytes_get_data (context, &size);
+    buf = g_malloc0 (TPM_HEADER_SIZE + size);
+    memcpy (&buf[TPM_HEADER_SIZE], context_buf, size);
+    rc = tpm2_header_init (buf,
+                           TPM_HEADER_SIZE + size,
+                           TPM2_ST_NO_SESSIONS,
+                           TPM_HEADER_SIZE + size,
+                           TSS2_RC_SUCCESS);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: Failed to initialize header: 0x%" PRIx32,
+                   __func__, rc);
+        goto out;
+    }
+    response = tpm2_response_new (connection, buf, TPM_HEADER_SIZE + size, 0x02000162);
 out:
     if (response == NULL) {
         g_free (buf);
@@ -418,3 +482,34 @@ tpm2_response_get_handle_type (Tpm2Response *response)
      */
     return (TPM2_HT)(tpm2_response_get_handle (response) >> TPM2_HR_SHIFT);
 }
+/*
+ * Accessors for the tag of the command this is the response to. The
+ * ResponseSink writes it ahead of the response for a connection using the
+ * tagged transport.
+ */
+guint32
+tpm2_response_get_request_tag (Tpm2Response *response)
+{
+    return response->request_tag;
+}
+void
+tpm2_response_set_request_tag (Tpm2Response *response,
+                               guint32       tag)
+{
+    response->request_tag = tag;
+}
+/*
+ * Accessors for the timing of the command this responds to, see
+ * command_timing_t.
+ */
+const command_timing_t*
+tpm2_response_get_timing (Tpm2Response *response)
+{
+    return &response->timing;
+}
+void
+tpm2_response_set_timing (Tpm2Response           *response,
+                          const command_timing_t *timing)
+{
+    response->timing = *timing;
+}
@@ -25,6 +25,12 @@ typedef struct _Tpm2Response {
     guint8         *buffer;
     size_t          buffer_size;
     TPMA_CC         attributes;
+    /* tag of the command this responds to, see tpm2_command_get_request_tag */
+    guint32         request_tag;
+    /* bytes charged to 'connection' for the buffer */
+    gsize           charged;
+    /* set for the slow command log, 'received' is 0 otherwise */
+    command_timing_t timing;
 } Tpm2Response;
 
 #define TPM_RESPONSE_HEADER_SIZE (sizeof (TPM2_ST) + sizeof (UINT32) + sizeof (TPM2_RC))
@@ -47,6 +53,8 @@ Tpm2Response* tpm2_response_new_context_save (Connection *connection,
                                               SessionEntry *entry);
 Tpm2Response* tpm2_response_new_context_load (Connection *connection,
                                               SessionEntry *entry);
+Tpm2Response* tpm2_response_new_context_save_transient (Connection *connection,
+                                                        GBytes *context);
 TPMA_CC             tpm2_response_get_attributes (Tpm2Response   *response);
 guint8*             tpm2_response_get_buffer    (Tpm2Response    *response);
 TSS2_RC              tpm2_response_get_code      (Tpm2Response    *response);
@@ -58,6 +66,12 @@ TPM2_ST              tpm2_response_get_tag       (Tpm2Response    *response);
 Connection*         tpm2_response_get_connection (Tpm2Response    *response);
 void                tpm2_response_set_handle    (Tpm2Response    *response,
                                                  TPM2_HANDLE       handle);
+guint32             tpm2_response_get_request_tag (Tpm2Response  *response);
+void                tpm2_response_set_request_tag (Tpm2Response  *response,
+                                                 guint32          tag);
+const command_timing_t* tpm2_response_get_timing (Tpm2Response  *response);
+void                tpm2_response_set_timing    (Tpm2Response    *response,
+                                                 const command_timing_t *timing);
 
 G_END_DECLS
 
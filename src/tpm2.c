@@ -6,13 +6,18 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <string.h>
 #include <tss2/tss2_rc.h>
 
+#include "alloc-stats.h"
+#include "buffer-pool.h"
+#include "flight-recorder.h"
 #include "tabrmd.h"
 
 #include "tpm2.h"
+#include "tabrmd-probes.h"
 #include "tcti.h"
 #include "tpm2-command.h"
 #include "tpm2-response.h"
@@ -90,7 +95,14 @@ tpm2_dispose (GObject *obj)
         Tss2_Sys_Finalize (self->sapi_context);
     }
     g_clear_pointer (&self->sapi_context, g_free);
+    buffer_pool_free (self->response_buffer, self->response_buffer_size);
+    self->response_buffer = NULL;
+    self->response_buffer_size = 0;
     g_clear_object (&self->tcti);
+    g_clear_object (&self->metrics);
+    g_clear_object (&self->durations);
+    g_clear_object (&self->pcap);
+    g_clear_object (&self->stale_tcti);
     G_OBJECT_CLASS (tpm2_parent_class)->dispose (obj);
 }
 /*
@@ -275,18 +287,43 @@ tpm2_get_tpm_properties_fixed (TSS2_SYS_CONTEXT     *sapi_context,
                    capability_data->capability);
     return rc;
 }
+/*
+ * Build the index used to look up fixed properties without scanning the
+ * capability data. Properties outside of the TPM2_PT_FIXED group aren't
+ * indexed: their values may change and so they can't be cached.
+ */
+static void
+tpm2_index_properties_fixed (Tpm2 *tpm2)
+{
+    TPML_TAGGED_TPM_PROPERTY *props = &tpm2->properties_fixed.data.tpmProperties;
+    TPM2_PT property;
+    unsigned int i;
+
+    memset (tpm2->fixed_index, 0, sizeof (tpm2->fixed_index));
+    for (i = 0; i < props->count && i < G_MAXUINT8; ++i) {
+        property = props->tpmProperty [i].property;
+        if (property < TPM2_PT_FIXED ||
+            property >= TPM2_PT_FIXED + TPM2_PT_GROUP)
+        {
+            continue;
+        }
+        tpm2->fixed_index [property - TPM2_PT_FIXED] = i + 1;
+    }
+}
 /**
  * Query the TM for a specific tagged property from the collection of
  * fixed TPM properties. If the requested property is found then the
  * 'value' parameter will be set accordingly. If no such property exists
  * then TSS2_TABRMD_BAD_VALUE will be returned.
+ * The properties are cached by tpm2_init_tpm. Since they never change this
+ * function requires neither a round trip to the TPM nor the sapi_mutex.
  */
 TSS2_RC
 tpm2_get_fixed_property (Tpm2           *tpm2,
                                   TPM2_PT                  property,
                                   guint32                *value)
 {
-    unsigned int i;
+    guint8 index;
 
     assert (tpm2 != NULL);
     assert (value != NULL);
@@ -294,13 +331,200 @@ tpm2_get_fixed_property (Tpm2           *tpm2,
     if (tpm2->properties_fixed.data.tpmProperties.count == 0) {
         return TSS2_RESMGR_RC_INTERNAL_ERROR;
     }
-    for (i = 0; i < tpm2->properties_fixed.data.tpmProperties.count; ++i) {
-        if (tpm2->properties_fixed.data.tpmProperties.tpmProperty[i].property == property) {
-            *value = tpm2->properties_fixed.data.tpmProperties.tpmProperty[i].value;
-            return TSS2_RC_SUCCESS;
-        }
+    if (property < TPM2_PT_FIXED ||
+        property >= TPM2_PT_FIXED + TPM2_PT_GROUP)
+    {
+        return TSS2_RESMGR_RC_BAD_VALUE;
+    }
+    index = tpm2->fixed_index [property - TPM2_PT_FIXED];
+    if (index == 0) {
+        return TSS2_RESMGR_RC_BAD_VALUE;
+    }
+    *value = tpm2->properties_fixed.data.tpmProperties.tpmProperty [index - 1].value;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Use 'properties_fixed' in place of querying the TPM for its fixed
+ * properties: tpm2_init_tpm skips the query when they've been set. This
+ * must be called before tpm2_init_tpm.
+ */
+void
+tpm2_set_properties_fixed (Tpm2                       *tpm2,
+                           TPMS_CAPABILITY_DATA const *properties_fixed)
+{
+    assert (tpm2 != NULL);
+    assert (properties_fixed != NULL);
+
+    tpm2->properties_fixed = *properties_fixed;
+    tpm2_index_properties_fixed (tpm2);
+}
+/*
+ * Query the TPM for its fixed properties again, replacing those set by
+ * tpm2_set_properties_fixed.
+ */
+TSS2_RC
+tpm2_refresh_properties_fixed (Tpm2 *tpm2)
+{
+    TSS2_SYS_CONTEXT *sapi_context;
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+
+    sapi_context = tpm2_lock_sapi (tpm2);
+    rc = tpm2_get_tpm_properties_fixed (sapi_context, &tpm2->properties_fixed);
+    if (rc == TSS2_RC_SUCCESS) {
+        tpm2_index_properties_fixed (tpm2);
+    }
+    tpm2_unlock (tpm2);
+    return rc;
+}
+/*
+ * Read up to 'count' TPM properties starting at 'property' with a single
+ * GetCapability command.
+ */
+TSS2_RC
+tpm2_get_properties (Tpm2                     *tpm2,
+                     TPM2_PT                   property,
+                     UINT32                    count,
+                     TPML_TAGGED_TPM_PROPERTY *properties)
+{
+    TSS2_SYS_CONTEXT *sapi_context;
+    TPMS_CAPABILITY_DATA cap_data = { 0, };
+    TPMI_YES_NO more_data;
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+    assert (properties != NULL);
+
+    sapi_context = tpm2_lock_sapi (tpm2);
+    rc = Tss2_Sys_GetCapability (sapi_context,
+                                 NULL,
+                                 TPM2_CAP_TPM_PROPERTIES,
+                                 property,
+                                 count,
+                                 &more_data,
+                                 &cap_data,
+                                 NULL);
+    tpm2_unlock (tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_Sys_GetCapability", rc);
+        return rc;
+    }
+    *properties = cap_data.data.tpmProperties;
+    return rc;
+}
+/*
+ * Get up to 'requested' random bytes from the TPM. The TPM may return
+ * fewer than requested, at most TPM2_PT_MAX_DIGEST bytes.
+ */
+TSS2_RC
+tpm2_get_random (Tpm2         *tpm2,
+                 UINT16        requested,
+                 TPM2B_DIGEST *random_bytes)
+{
+    TSS2_SYS_CONTEXT *sapi_context;
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+    assert (random_bytes != NULL);
+
+    sapi_context = tpm2_lock_sapi (tpm2);
+    rc = Tss2_Sys_GetRandom (sapi_context,
+                             NULL,
+                             requested,
+                             random_bytes,
+                             NULL);
+    tpm2_unlock (tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_Sys_GetRandom", rc);
+    }
+    return rc;
+}
+/*
+ * Read 'size' bytes from 'offset' in the NV index 'nv_index', authorized
+ * by 'auth_handle' with the password 'auth'. 'size' must not exceed the
+ * TPM's TPM2_PT_NV_BUFFER_MAX.
+ */
+TSS2_RC
+tpm2_nv_read (Tpm2                *tpm2,
+              TPMI_RH_NV_AUTH      auth_handle,
+              TPMI_RH_NV_INDEX     nv_index,
+              TPM2B_AUTH const    *auth,
+              UINT16               size,
+              UINT16               offset,
+              TPM2B_MAX_NV_BUFFER *data)
+{
+    TSS2L_SYS_AUTH_COMMAND auths = {
+        .count = 1,
+        .auths = {{ .sessionHandle = TPM2_RS_PW, .hmac = *auth }},
+    };
+    TSS2_SYS_CONTEXT *sapi_context;
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+    assert (data != NULL);
+
+    sapi_context = tpm2_lock_sapi (tpm2);
+    rc = Tss2_Sys_NV_Read (sapi_context,
+                           auth_handle,
+                           nv_index,
+                           &auths,
+                           size,
+                           offset,
+                           data,
+                           NULL);
+    tpm2_unlock (tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_debug ("%s: Tss2_Sys_NV_Read failed: 0x%" PRIx32, __func__, rc);
     }
-    return TSS2_RESMGR_RC_BAD_VALUE;
+    return rc;
+}
+/*
+ * Write 'data' to the NV index 'nv_index' at 'offset', authorized by
+ * 'auth_handle' with the password 'auth'. 'data' must not exceed the
+ * TPM's TPM2_PT_NV_BUFFER_MAX.
+ */
+TSS2_RC
+tpm2_nv_write (Tpm2                      *tpm2,
+               TPMI_RH_NV_AUTH            auth_handle,
+               TPMI_RH_NV_INDEX           nv_index,
+               TPM2B_AUTH const          *auth,
+               TPM2B_MAX_NV_BUFFER const *data,
+               UINT16                     offset)
+{
+    TSS2L_SYS_AUTH_COMMAND auths = {
+        .count = 1,
+        .auths = {{ .sessionHandle = TPM2_RS_PW, .hmac = *auth }},
+    };
+    TSS2_SYS_CONTEXT *sapi_context;
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+    assert (data != NULL);
+
+    sapi_context = tpm2_lock_sapi (tpm2);
+    rc = Tss2_Sys_NV_Write (sapi_context,
+                            auth_handle,
+                            nv_index,
+                            &auths,
+                            data,
+                            offset,
+                            NULL);
+    tpm2_unlock (tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_debug ("%s: Tss2_Sys_NV_Write failed: 0x%" PRIx32, __func__, rc);
+    }
+    return rc;
+}
+/*
+ * Accessor for the fixed TPM properties cached by tpm2_init_tpm. The
+ * returned structure is owned by the Tpm2 object and must not be modified.
+ */
+TPMS_CAPABILITY_DATA*
+tpm2_get_properties_fixed (Tpm2 *tpm2)
+{
+    assert (tpm2 != NULL);
+    return &tpm2->properties_fixed;
 }
 /*
  * This function exposes the underlying SAPI context in the Tpm2.
@@ -330,14 +554,177 @@ tpm2_get_max_response (Tpm2 *tpm2,
                                              TPM2_PT_MAX_RESPONSE_SIZE,
                                              value);
 }
+/*
+ * Make sure the scratch response buffer can hold the largest response the
+ * TPM may send, returning that size through 'max_size'.
+ * The caller must hold the sapi_mutex.
+ */
+static TSS2_RC
+tpm2_response_buffer_reserve (Tpm2    *tpm2,
+                              guint32 *max_size)
+{
+    TSS2_RC rc;
+
+    rc = tpm2_get_max_response (tpm2, max_size);
+    if (rc != TSS2_RC_SUCCESS)
+        return rc;
+
+    if (tpm2->response_buffer_size < *max_size) {
+        buffer_pool_free (tpm2->response_buffer,
+                          tpm2->response_buffer_size);
+        tpm2->response_buffer = buffer_pool_try_alloc (*max_size);
+        ALLOC_STATS_ADD (ALLOC_STATS_RESPONSE_BUFFERS, *max_size);
+        if (tpm2->response_buffer == NULL) {
+            g_warning ("failed to allocate buffer for Tpm2Response: %s",
+                       strerror (errno));
+            tpm2->response_buffer_size = 0;
+            return RM_RC (TPM2_RC_MEMORY);
+        }
+        tpm2->response_buffer_size = *max_size;
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Return the milliseconds the TPM is given to execute a command with code
+ * 'command_code', TSS2_TCTI_TIMEOUT_BLOCK if there's no timeout. The
+ * timeout set by tpm2_set_timeout is stretched for commands whose
+ * baseline in the CommandDurations, if there is one, says they're slow.
+ */
+static gint32
+tpm2_command_timeout (Tpm2    *tpm2,
+                      TPM2_CC  command_code)
+{
+    gint64 timeout;
+
+    if (tpm2->timeout == 0) {
+        return TSS2_TCTI_TIMEOUT_BLOCK;
+    }
+    timeout = tpm2->timeout;
+    if (tpm2->durations != NULL) {
+        timeout = MAX (timeout,
+                       command_durations_baseline (tpm2->durations,
+                                                   command_code) *
+                       TPM2_TIMEOUT_BASELINE_FACTOR / G_TIME_SPAN_MILLISECOND);
+    }
+    return (gint32)MIN (timeout, G_MAXINT32);
+}
+/*
+ * Return the milliseconds left before the command last transmitted, with
+ * code 'command_code', times out: 0 once it has, TSS2_TCTI_TIMEOUT_BLOCK
+ * if there's no timeout. The caller must hold the lock.
+ */
+static gint32
+tpm2_time_left (Tpm2    *tpm2,
+                TPM2_CC  command_code)
+{
+    gint32 timeout;
+    gint64 elapsed;
+
+    timeout = tpm2_command_timeout (tpm2, command_code);
+    if (timeout == TSS2_TCTI_TIMEOUT_BLOCK) {
+        return timeout;
+    }
+    elapsed = (g_get_monotonic_time () - tpm2->transmit_time) /
+        G_TIME_SPAN_MILLISECOND;
+    return (gint32)CLAMP (timeout - elapsed, 0, timeout);
+}
+/*
+ * Receive the response to the command with code 'command_code' sent
+ * through 'tcti' into the response buffer. '*size' is the room in the
+ * buffer and becomes the size of the response.
+ * If the TPM hasn't answered when the command times out the command is
+ * canceled and the TPM gets TPM2_CANCEL_GRACE milliseconds more: what it
+ * answers then, most likely TPM2_RC_CANCELED, is returned as usual. If it
+ * still doesn't answer the command fails with TSS2_RESMGR_RC_TPM_TIMEOUT
+ * and the response is left for tpm2_drain_stale to collect. Each timeout
+ * is counted in the metrics.
+ * The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_receive_timed (Tpm2    *tpm2,
+                    Tcti    *tcti,
+                    TPM2_CC  command_code,
+                    size_t  *size)
+{
+    size_t max_size = *size;
+    TSS2_RC rc;
+
+    rc = tcti_receive (tcti,
+                       size,
+                       tpm2->response_buffer,
+                       tpm2_time_left (tpm2, command_code));
+    if (rc != TSS2_TCTI_RC_TRY_AGAIN || tpm2->timeout == 0) {
+        return rc;
+    }
+    g_warning ("%s: no response to command 0x%08" PRIx32 " in time, "
+               "canceling it", __func__, command_code);
+    metrics_count (tpm2->metrics, METRICS_TPM_TIMEOUT);
+    flight_recorder_record (FLIGHT_EVENT_ERROR,
+                            0,
+                            command_code,
+                            TSS2_RESMGR_RC_TPM_TIMEOUT);
+    tcti_cancel (tcti);
+    *size = max_size;
+    rc = tcti_receive (tcti, size, tpm2->response_buffer, TPM2_CANCEL_GRACE);
+    if (rc != TSS2_TCTI_RC_TRY_AGAIN) {
+        return rc;
+    }
+    g_warning ("%s: command 0x%08" PRIx32 " couldn't be canceled, "
+               "failing it", __func__, command_code);
+    g_clear_object (&tpm2->stale_tcti);
+    tpm2->stale_tcti = g_object_ref (tcti);
+    return TSS2_RESMGR_RC_TPM_TIMEOUT;
+}
+/*
+ * Collect the response still owed by the TPM for a command that timed
+ * out, see tpm2_receive_timed, before anything else is sent: the TCTI
+ * takes no other command until then. The TPM gets TPM2_CANCEL_GRACE
+ * milliseconds each time, so while it stays hung commands fail with
+ * TSS2_RESMGR_RC_TPM_TIMEOUT in bounded time rather than queue up.
+ * The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_drain_stale (Tpm2 *tpm2)
+{
+    guint32 max_size;
+    size_t size;
+    TSS2_RC rc;
+
+    if (tpm2->stale_tcti == NULL) {
+        return TSS2_RC_SUCCESS;
+    }
+    rc = tpm2_response_buffer_reserve (tpm2, &max_size);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    size = max_size;
+    rc = tcti_receive (tpm2->stale_tcti,
+                       &size,
+                       tpm2->response_buffer,
+                       TPM2_CANCEL_GRACE);
+    if (rc == TSS2_TCTI_RC_TRY_AGAIN) {
+        return TSS2_RESMGR_RC_TPM_TIMEOUT;
+    }
+    g_info ("%s: TPM answered the command that timed out, RC 0x%" PRIx32,
+            __func__, rc);
+    g_clear_object (&tpm2->stale_tcti);
+    return TSS2_RC_SUCCESS;
+}
 /*
  * Get a response buffer from the TPM. Return the TSS2_RC through the
  * 'rc' parameter. Returns a buffer (that must be freed by the caller)
  * containing the response from the TPM. Determine the size of the buffer
  * by reading the size field from the TPM command header.
+ * The response is received into a scratch buffer owned by the Tpm2 object
+ * that's allocated once with the maximum response size. Only the bytes
+ * actually received are copied into the buffer returned to the caller,
+ * and cleared from the scratch buffer once they are.
+ * The caller must hold the sapi_mutex.
  */
 static TSS2_RC
 tpm2_get_response (Tpm2 *tpm2,
+                            Tcti         *tcti,
+                            TPM2_CC       command_code,
                             uint8_t     **buffer,
                             size_t       *buffer_size)
 {
@@ -348,26 +735,349 @@ tpm2_get_response (Tpm2 *tpm2,
     assert (buffer != NULL);
     assert (buffer_size != NULL);
 
-    rc = tpm2_get_max_response (tpm2, &max_size);
+    rc = tpm2_response_buffer_reserve (tpm2, &max_size);
     if (rc != TSS2_RC_SUCCESS)
         return rc;
 
-    *buffer = calloc (1, max_size);
+    *buffer_size = max_size;
+    rc = tpm2_receive_timed (tpm2, tcti, command_code, buffer_size);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    *buffer = buffer_pool_try_alloc (*buffer_size);
+    ALLOC_STATS_ADD (ALLOC_STATS_RESPONSE_BUFFERS, *buffer_size);
     if (*buffer == NULL) {
         g_warning ("failed to allocate buffer for Tpm2Response: %s",
                    strerror (errno));
+        secure_clear (tpm2->response_buffer, *buffer_size);
         return RM_RC (TPM2_RC_MEMORY);
     }
-    *buffer_size = max_size;
-    rc = tcti_receive (tpm2->tcti, buffer_size, *buffer, TSS2_TCTI_TIMEOUT_BLOCK);
+    memcpy (*buffer, tpm2->response_buffer, *buffer_size);
+    secure_clear (tpm2->response_buffer, *buffer_size);
+
+    return rc;
+}
+/*
+ * Count a context load or save in the metrics and in the context swaps
+ * reported by tpm2_get_activity.
+ */
+static void
+tpm2_count_swap (Tpm2          *tpm2,
+                 MetricsCounter counter)
+{
+    metrics_count (tpm2->metrics, counter);
+    g_atomic_pointer_add (&tpm2->context_swaps, 1);
+}
+/*
+ * Context management commands sent through tpm2_send_command (sessions are
+ * saved and loaded this way) count toward the same metrics as the
+ * tpm2_context_* functions.
+ */
+static void
+tpm2_count_context_command (Tpm2   *tpm2,
+                            TPM2_CC command_code)
+{
+    switch (command_code) {
+    case TPM2_CC_ContextLoad:
+        tpm2_count_swap (tpm2, METRICS_CONTEXT_LOAD);
+        break;
+    case TPM2_CC_ContextSave:
+        tpm2_count_swap (tpm2, METRICS_CONTEXT_SAVE);
+        break;
+    case TPM2_CC_FlushContext:
+        metrics_count (tpm2->metrics, METRICS_CONTEXT_FLUSH);
+        break;
+    default:
+        break;
+    }
+}
+/*
+ * Report the TPM entering or leaving degraded mode, see CommandDurations.
+ */
+static void
+tpm2_health_changed (Tpm2 *tpm2)
+{
+    gint64 slowdown = command_durations_get_slowdown (tpm2->durations);
+    gboolean degraded = command_durations_is_degraded (tpm2->durations);
+
+    if (degraded) {
+        g_warning ("TPM commands take %" PRId64 ".%" PRId64 " times their "
+                   "baseline, entering degraded mode", slowdown / 1000,
+                   slowdown % 1000 / 100);
+    } else {
+        g_message ("TPM commands back to %" PRId64 ".%" PRId64 " times "
+                   "their baseline, leaving degraded mode", slowdown / 1000,
+                   slowdown % 1000 / 100);
+    }
+    metrics_set_degraded (tpm2->metrics, degraded);
+}
+/*
+ * Return the Tcti 'command' is sent through: the one of its connection
+ * if it has one, see connection_set_tcti, the TPM's otherwise.
+ */
+static Tcti*
+tpm2_command_tcti (Tpm2        *tpm2,
+                   Tpm2Command *command)
+{
+    if (command->connection != NULL &&
+        connection_get_tcti (command->connection) != NULL)
+    {
+        return connection_get_tcti (command->connection);
+    }
+    return tpm2->tcti;
+}
+/*
+ * Switch the TCTI to the locality of the connection that sent 'command'
+ * if it's at another one. Commands without a connection, like those the
+ * daemon sends on its own, go at whatever locality is current, as do
+ * those sent through a Tcti of the connection's own. Each switch is
+ * counted in the metrics. The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_switch_locality (Tpm2        *tpm2,
+                      Tpm2Command *command)
+{
+    guint8 locality;
+    TSS2_RC rc;
+
+    if (command->connection == NULL ||
+        connection_get_tcti (command->connection) != NULL)
+    {
+        return TSS2_RC_SUCCESS;
+    }
+    locality = connection_get_locality (command->connection);
+    if (locality == tpm2->locality) {
+        return TSS2_RC_SUCCESS;
+    }
+    /* checked by the frontends already, never pass on one that's invalid */
+    if (locality > TPM2_LOC_FOUR) {
+        return RM_RC (TPM2_RC_LOCALITY);
+    }
+    rc = tcti_set_locality (tpm2->tcti, locality);
     if (rc != TSS2_RC_SUCCESS) {
-        free (*buffer);
         return rc;
     }
-    *buffer = realloc (*buffer, *buffer_size);
+    g_debug ("%s: locality %" PRIu8 " -> %" PRIu8,
+             __func__, tpm2->locality, locality);
+    tpm2->locality = locality;
+    metrics_count (tpm2->metrics, METRICS_LOCALITY_SWITCH);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Send the command buffer to the TPM at the locality of its connection.
+ * A response still owed for a command that timed out is collected first.
+ * On success the Tpm2 lock is held until the response is collected by
+ * tpm2_receive. On failure the lock is released and the RC from the TCTI
+ * is returned.
+ */
+TSS2_RC
+tpm2_transmit (Tpm2        *tpm2,
+               Tpm2Command *command)
+{
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+    assert (command != NULL);
 
+    tpm2_lock (tpm2);
+    rc = tpm2_drain_stale (tpm2);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = tpm2_switch_locality (tpm2, command);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        tpm2_unlock (tpm2);
+        return rc;
+    }
+    TABRMD_PROBE2 (tcti_transmit_start,
+                   TABRMD_PROBE_CONNECTION_ID (command->connection),
+                   tpm2_command_get_code (command));
+    tpm2->transmit_time = g_get_monotonic_time ();
+    rc = tcti_transmit (tpm2_command_tcti (tpm2, command),
+                        tpm2_command_get_size (command),
+                        tpm2_command_get_buffer (command));
+    TABRMD_PROBE3 (tcti_transmit_done,
+                   TABRMD_PROBE_CONNECTION_ID (command->connection),
+                   tpm2_command_get_code (command),
+                   rc);
+    flight_recorder_record (FLIGHT_EVENT_TRANSMIT,
+                            TABRMD_PROBE_CONNECTION_ID (command->connection),
+                            tpm2_command_get_code (command),
+                            rc);
+    if (rc != TSS2_RC_SUCCESS) {
+        tpm2_unlock (tpm2);
+    }
     return rc;
 }
+/*
+ * Wait for the TPM to finish the command sent by tpm2_transmit while
+ * calling the overlap function. It's called once right away. Then, if
+ * 'tcti', the one the command went to, exposes poll handles, the wait is
+ * a poll on them that wakes every TPM2_POLL_INTERVAL milliseconds to call
+ * it again: messages that arrive while a slow command executes are
+ * handled without waiting for the TPM. The poll ends early if the
+ * command times out, see tpm2_set_timeout, for tpm2_receive to deal with.
+ * Otherwise tpm2_receive blocks in the TCTI as before.
+ * Poll handles are only ever waited on for input: some TCTIs also ask
+ * for POLLOUT, which is always ready.
+ * The caller must hold the lock.
+ */
+static void
+tpm2_overlap_wait (Tpm2    *tpm2,
+                   Tcti    *tcti,
+                   TPM2_CC  command_code)
+{
+    TSS2_TCTI_POLL_HANDLE handles [TPM2_POLL_HANDLES_MAX];
+    size_t count = TPM2_POLL_HANDLES_MAX, i;
+    TSS2_RC rc;
+    int ret;
+
+    if (tpm2->overlap_func == NULL) {
+        return;
+    }
+    tpm2->overlap_func (tpm2->overlap_data);
+    if (tpm2->poll_unsupported) {
+        return;
+    }
+    rc = tcti_get_poll_handles (tcti, handles, &count);
+    if (rc != TSS2_RC_SUCCESS || count == 0) {
+        g_debug ("%s: TCTI has no poll handles, RC: 0x%" PRIx32,
+                 __func__, rc);
+        tpm2->poll_unsupported = TRUE;
+        return;
+    }
+    for (i = 0; i < count; ++i) {
+        handles [i].events = POLLIN;
+        handles [i].revents = 0;
+    }
+    for (;;) {
+        ret = poll (handles, count, TPM2_POLL_INTERVAL);
+        if (ret > 0) {
+            return;
+        }
+        if (ret == 0) {
+            if (tpm2_time_left (tpm2, command_code) == 0) {
+                return;
+            }
+            tpm2->overlap_func (tpm2->overlap_data);
+        } else if (errno != EINTR) {
+            g_warning ("%s: poll failed: %s", __func__, strerror (errno));
+            tpm2->poll_unsupported = TRUE;
+            return;
+        }
+    }
+}
+/*
+ * Block on the response to the command sent by tpm2_transmit, release the
+ * Tpm2 lock and create the Tpm2Response. If the response can't be
+ * received the Tpm2Response holds the RC from the TCTI.
+ */
+Tpm2Response*
+tpm2_receive (Tpm2        *tpm2,
+              Tpm2Command *command,
+              TSS2_RC     *rc)
+{
+    Tpm2Response   *response = NULL;
+    Connection     *connection = NULL;
+    guint8         *buffer = NULL;
+    size_t          buffer_size = 0;
+
+    assert (tpm2 != NULL);
+    assert (command != NULL);
+    assert (rc != NULL);
+
+    TABRMD_PROBE2 (tcti_receive_start,
+                   TABRMD_PROBE_CONNECTION_ID (command->connection),
+                   tpm2_command_get_code (command));
+    *rc = tpm2_get_response (tpm2,
+                             tpm2_command_tcti (tpm2, command),
+                             tpm2_command_get_code (command),
+                             &buffer,
+                             &buffer_size);
+    TABRMD_PROBE3 (tcti_receive_done,
+                   TABRMD_PROBE_CONNECTION_ID (command->connection),
+                   tpm2_command_get_code (command),
+                   *rc);
+    flight_recorder_record (FLIGHT_EVENT_RECEIVE,
+                            TABRMD_PROBE_CONNECTION_ID (command->connection),
+                            tpm2_command_get_code (command),
+                            *rc);
+    tpm2_unlock (tpm2);
+    connection = tpm2_command_get_connection (command);
+    if (*rc == TSS2_RC_SUCCESS) {
+        response = tpm2_response_new (connection,
+                                      buffer,
+                                      buffer_size,
+                                      tpm2_command_get_attributes (command));
+    } else {
+        response = tpm2_response_new_rc (connection, *rc);
+    }
+    g_object_unref (connection);
+    return response;
+}
+/*
+ * Hand a command to the capture, if there is one, with the handles in
+ * its handle area as the client sent them and as sent to the TPM.
+ */
+static void
+tpm2_capture_command (Tpm2        *tpm2,
+                      Tpm2Command *command)
+{
+    guint64 id;
+    GString *comment;
+    guint8 i, count;
+
+    if (tpm2->pcap == NULL) {
+        return;
+    }
+    id = command->connection != NULL ? command->connection->id : 0;
+    comment = g_string_new (NULL);
+    g_string_printf (comment, "connection 0x%" PRIx64, id);
+    count = tpm2_command_get_handle_count (command);
+    if (count > 0) {
+        g_string_append (comment, " client handles");
+        for (i = 0; i < count; ++i) {
+            g_string_append_printf (comment, " 0x%08" PRIx32,
+                                    tpm2_command_get_client_handle (command, i));
+        }
+        g_string_append (comment, " physical handles");
+        for (i = 0; i < count; ++i) {
+            g_string_append_printf (comment, " 0x%08" PRIx32,
+                                    tpm2_command_get_handle (command, i));
+        }
+    }
+    pcap_writer_put (tpm2->pcap,
+                     tpm2->pcap_interface,
+                     id,
+                     FALSE,
+                     tpm2_command_get_buffer (command),
+                     tpm2_command_get_size (command),
+                     g_string_free (comment, FALSE));
+}
+/*
+ * Hand a response to the capture, if there is one. Handles in the
+ * response are still the physical ones at this point.
+ */
+static void
+tpm2_capture_response (Tpm2         *tpm2,
+                       Tpm2Command  *command,
+                       Tpm2Response *response,
+                       gint64        elapsed)
+{
+    guint64 id;
+
+    if (tpm2->pcap == NULL) {
+        return;
+    }
+    id = command->connection != NULL ? command->connection->id : 0;
+    pcap_writer_put (tpm2->pcap,
+                     tpm2->pcap_interface,
+                     id,
+                     TRUE,
+                     tpm2_response_get_buffer (response),
+                     tpm2_response_get_size (response),
+                     g_strdup_printf ("connection 0x%" PRIx64 " TPM time %"
+                                      PRId64 " us", id, elapsed));
+}
 /**
  * In the most simple case the caller will want to send just a single
  * command represented by a Tpm2Command object. The response is passed
@@ -375,52 +1085,181 @@ tpm2_get_response (Tpm2 *tpm2,
  * is returned through the 'rc' out parameter.
  * The caller MUST NOT hold the lock when calling. This function will take
  * the lock for itself.
+ * Between transmitting the command and receiving the response the
+ * overlap function, if one is set, is called with the lock held, see
+ * tpm2_overlap_wait.
  * Additionally this function *WILL ONLY* return a NULL Tpm2Response
  * pointer if it's unable to allocate memory for the object. In all other
  * error cases this function will create a Tpm2Response object with the
  * appropriate RC populated.
  */
-Tpm2Response*
-tpm2_send_command (Tpm2  *tpm2,
-                            Tpm2Command   *command,
-                            TSS2_RC       *rc)
+Tpm2Response*
+tpm2_send_command (Tpm2        *tpm2,
+                   Tpm2Command *command,
+                   TSS2_RC     *rc)
+{
+    Tpm2Response   *response = NULL;
+    Connection     *connection = NULL;
+    gint64          start, elapsed;
+    metrics_span_t  span;
+
+    g_debug (__func__);
+    assert (tpm2 != NULL);
+    assert (command != NULL);
+    assert (rc != NULL);
+
+    metrics_span_begin (&span);
+    start = g_get_monotonic_time ();
+    *rc = tpm2_transmit (tpm2, command);
+    if (*rc != TSS2_RC_SUCCESS) {
+        metrics_span_end (tpm2->metrics, METRICS_STAGE_TPM, &span);
+        connection = tpm2_command_get_connection (command);
+        response = tpm2_response_new_rc (connection, *rc);
+        g_object_unref (connection);
+        return response;
+    }
+    tpm2_capture_command (tpm2, command);
+    tpm2_overlap_wait (tpm2,
+                       tpm2_command_tcti (tpm2, command),
+                       tpm2_command_get_code (command));
+    response = tpm2_receive (tpm2, command, rc);
+    elapsed = g_get_monotonic_time () - start;
+    metrics_span_end (tpm2->metrics, METRICS_STAGE_TPM, &span);
+    metrics_observe (tpm2->metrics, METRICS_TPM_LATENCY, elapsed);
+    if (response != NULL) {
+        tpm2_capture_response (tpm2, command, response, elapsed);
+        metrics_observe_command (tpm2->metrics,
+                                 tpm2_command_get_code (command),
+                                 elapsed);
+        tpm2_command_add_tpm_time (command, elapsed);
+        g_atomic_pointer_add (&tpm2->commands, 1);
+        g_atomic_pointer_add (&tpm2->busy_usec, (gssize)MAX (elapsed, 0));
+        if (command->connection != NULL) {
+            connection_add_tpm_time (command->connection, elapsed);
+        }
+        if (command_durations_observe (tpm2->durations,
+                                       tpm2_command_get_code (command),
+                                       elapsed))
+        {
+            tpm2_health_changed (tpm2);
+        }
+    }
+    if (response != NULL &&
+        tpm2_response_get_code (response) == TSS2_RC_SUCCESS)
+    {
+        tpm2_count_context_command (tpm2, tpm2_command_get_code (command));
+    }
+    return response;
+}
+/*
+ * Get the running totals kept for this Tpm2: commands that got a response,
+ * the time the TPM spent on them and the contexts loaded or saved. It may
+ * be called from any thread.
+ */
+void
+tpm2_get_activity (Tpm2    *tpm2,
+                   guint64 *commands,
+                   guint64 *busy_usec,
+                   guint64 *context_swaps)
+{
+    assert (tpm2 != NULL);
+    *commands = (guint64)(gsize)g_atomic_pointer_get (&tpm2->commands);
+    *busy_usec = (guint64)(gsize)g_atomic_pointer_get (&tpm2->busy_usec);
+    *context_swaps = (guint64)(gsize)g_atomic_pointer_get (&tpm2->context_swaps);
+}
+/*
+ * Record the metrics to update from this Tpm2. Pass NULL to stop. This
+ * must be called before the Tpm2 is shared with other threads.
+ */
+void
+tpm2_set_metrics (Tpm2    *tpm2,
+                  Metrics *metrics)
+{
+    assert (tpm2 != NULL);
+    g_clear_object (&tpm2->metrics);
+    if (metrics != NULL) {
+        tpm2->metrics = g_object_ref (metrics);
+    }
+}
+/*
+ * Record the time each command takes in 'durations'. Pass NULL to stop.
+ * Transitions of 'durations' into and out of degraded mode are logged
+ * and reported in the metrics.
+ * This must be called before the Tpm2 is shared with other threads.
+ */
+void
+tpm2_set_command_durations (Tpm2             *tpm2,
+                            CommandDurations *durations)
+{
+    assert (tpm2 != NULL);
+    g_clear_object (&tpm2->durations);
+    if (durations != NULL) {
+        tpm2->durations = g_object_ref (durations);
+    }
+}
+/*
+ * Capture the commands sent through this Tpm2 and their responses in
+ * 'pcap' as interface 'interface'. Pass NULL to stop. This must be called
+ * before the Tpm2 is shared with other threads.
+ */
+void
+tpm2_set_pcap (Tpm2       *tpm2,
+               PcapWriter *pcap,
+               guint       interface)
+{
+    assert (tpm2 != NULL);
+    g_clear_object (&tpm2->pcap);
+    if (pcap != NULL) {
+        tpm2->pcap = g_object_ref (pcap);
+    }
+    tpm2->pcap_interface = interface;
+}
+/*
+ * Give the TPM 'timeout' milliseconds to answer each command, longer for
+ * commands the CommandDurations know to be slow, see tpm2_command_timeout.
+ * A command that runs past it is canceled and, if the TPM still doesn't
+ * answer, fails with TSS2_RESMGR_RC_TPM_TIMEOUT. 0 waits for as long as
+ * it takes. This must be called before the Tpm2 is shared with other
+ * threads.
+ */
+void
+tpm2_set_timeout (Tpm2  *tpm2,
+                  guint  timeout)
+{
+    assert (tpm2 != NULL);
+    tpm2->timeout = timeout;
+}
+/*
+ * Register the function tpm2_send_command calls while the TPM executes a
+ * command. Pass NULL to remove it.
+ */
+void
+tpm2_set_overlap_func (Tpm2            *tpm2,
+                       Tpm2OverlapFunc  func,
+                       gpointer         user_data)
+{
+    assert (tpm2 != NULL);
+    tpm2->overlap_func = func;
+    tpm2->overlap_data = user_data;
+}
+/*
+ * Ask the TCTI to cancel the command currently being processed by the TPM.
+ * This is called from outside of the thread sending commands while that
+ * thread is blocked waiting for a response, so it must not take the lock
+ * held by tpm2_send_command. Whether the TPM supports cancellation is up
+ * to the TCTI: many return TSS2_TCTI_RC_NOT_IMPLEMENTED.
+ */
+TSS2_RC
+tpm2_cancel (Tpm2 *tpm2)
 {
-    Tpm2Response   *response = NULL;
-    Connection     *connection = NULL;
-    guint8         *buffer = NULL;
-    size_t          buffer_size = 0;
+    TSS2_RC rc;
 
-    g_debug (__func__);
     assert (tpm2 != NULL);
-    assert (command != NULL);
-    assert (rc != NULL);
-
-    tpm2_lock (tpm2);
-    *rc = tcti_transmit (tpm2->tcti,
-                         tpm2_command_get_size (command),
-                         tpm2_command_get_buffer (command));
-    if (*rc != TSS2_RC_SUCCESS)
-        goto unlock_out;
-    *rc = tpm2_get_response (tpm2, &buffer, &buffer_size);
-    if (*rc != TSS2_RC_SUCCESS) {
-        goto unlock_out;
+    rc = tcti_cancel (tpm2->tcti);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_info ("%s: tcti_cancel failed with RC 0x%" PRIx32, __func__, rc);
     }
-    tpm2_unlock (tpm2);
-    connection = tpm2_command_get_connection (command);
-    response = tpm2_response_new (connection,
-                                  buffer,
-                                  buffer_size,
-                                  tpm2_command_get_attributes (command));
-    g_clear_object (&connection);
-    return response;
-
-unlock_out:
-    tpm2_unlock (tpm2);
-    if (!connection)
-        connection = tpm2_command_get_connection (command);
-    response = tpm2_response_new_rc (connection, *rc);
-    g_object_unref (connection);
-    return response;
+    return rc;
 }
 /**
  * Create new TPM access tpm2 (TPM2) object. This includes
@@ -464,14 +1303,176 @@ tpm2_init_tpm (Tpm2 *tpm2)
     rc = tpm2_send_tpm_startup (tpm2);
     if (rc != TSS2_RC_SUCCESS)
         goto out;
-    rc = tpm2_get_tpm_properties_fixed (tpm2->sapi_context,
-                                                 &tpm2->properties_fixed);
-    if (rc != TSS2_RC_SUCCESS)
-        goto out;
+    /* skip the query when tpm2_set_properties_fixed was called */
+    if (tpm2->properties_fixed.data.tpmProperties.count == 0) {
+        rc = tpm2_get_tpm_properties_fixed (tpm2->sapi_context,
+                                            &tpm2->properties_fixed);
+        if (rc != TSS2_RC_SUCCESS)
+            goto out;
+        tpm2_index_properties_fixed (tpm2);
+    }
     tpm2->initialized = true;
 out:
     return rc;
 }
+/*
+ * Fill the header of the command_buffer for a command without sessions
+ * of 'size' bytes. The Tpm2's own commands have a fixed layout, so they're
+ * built in place rather than through the SAPI.
+ * The caller must hold the lock.
+ */
+static void
+tpm2_template_header (Tpm2   *tpm2,
+                      UINT32  size,
+                      TPM2_CC code)
+{
+    *(TPM2_ST*)tpm2->command_buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(tpm2->command_buffer + sizeof (TPM2_ST)) = htobe32 (size);
+    *(TPM2_CC*)(tpm2->command_buffer + sizeof (TPM2_ST) + sizeof (UINT32)) =
+        htobe32 (code);
+}
+/*
+ * Build the command for 'code' with the single handle 'handle' and no
+ * parameters: a ContextSave or a FlushContext. Returns its size.
+ */
+static size_t
+tpm2_template_handle (Tpm2        *tpm2,
+                      TPM2_CC      code,
+                      TPM2_HANDLE  handle)
+{
+    size_t size = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE);
+
+    tpm2_template_header (tpm2, size, code);
+    *(TPM2_HANDLE*)(tpm2->command_buffer + TPM_HEADER_SIZE) = htobe32 (handle);
+    return size;
+}
+/*
+ * Build a ContextLoad with the marshalled TPMS_CONTEXT in 'context' as
+ * its parameter. Returns its size or 0 if the context doesn't fit.
+ */
+static size_t
+tpm2_template_context_load (Tpm2   *tpm2,
+                            GBytes *context)
+{
+    gconstpointer buf;
+    gsize size;
+
+    buf = g_bytes_get_data (context, &size);
+    if (size > TPM2_INTERNAL_COMMAND_SIZE - TPM_HEADER_SIZE) {
+        return 0;
+    }
+    tpm2_template_header (tpm2, TPM_HEADER_SIZE + size, TPM2_CC_ContextLoad);
+    memcpy (tpm2->command_buffer + TPM_HEADER_SIZE, buf, size);
+    return TPM_HEADER_SIZE + size;
+}
+/*
+ * Build a GetCapability for up to 'count' of the handles from 'first'.
+ * Returns its size.
+ */
+static size_t
+tpm2_template_get_handles (Tpm2        *tpm2,
+                           TPM2_HANDLE  first,
+                           UINT32       count)
+{
+    guint8 *params = tpm2->command_buffer + TPM_HEADER_SIZE;
+    size_t size = TPM_HEADER_SIZE + sizeof (TPM2_CAP) + 2 * sizeof (UINT32);
+
+    tpm2_template_header (tpm2, size, TPM2_CC_GetCapability);
+    *(TPM2_CAP*)params = htobe32 (TPM2_CAP_HANDLES);
+    *(UINT32*)(params + sizeof (TPM2_CAP)) = htobe32 (first);
+    *(UINT32*)(params + sizeof (TPM2_CAP) + sizeof (UINT32)) = htobe32 (count);
+    return size;
+}
+/*
+ * Send the 'size' bytes of the command built in the command_buffer to
+ * the TPM, at the current locality, and receive the response into the
+ * scratch response buffer. Returns the RC from the TCTI or else the one
+ * in the response header. On success '*response' points to the response
+ * and '*response_size' is its size: both stay valid until the lock is
+ * released. The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_execute_unlocked (Tpm2     *tpm2,
+                       size_t    size,
+                       uint8_t **response,
+                       size_t   *response_size)
+{
+    guint32 max_size;
+    TSS2_RC rc;
+
+    rc = tpm2_drain_stale (tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    rc = tpm2_response_buffer_reserve (tpm2, &max_size);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    tpm2->transmit_time = g_get_monotonic_time ();
+    rc = tcti_transmit (tpm2->tcti, size, tpm2->command_buffer);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    *response_size = max_size;
+    rc = tpm2_receive_timed (tpm2,
+                             tpm2->tcti,
+                             get_command_code (tpm2->command_buffer),
+                             response_size);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    if (*response_size < TPM_HEADER_SIZE) {
+        return RM_RC (TPM2_RC_INSUFFICIENT);
+    }
+    *response = tpm2->response_buffer;
+    return get_response_code (tpm2->response_buffer);
+}
+/*
+ * Get up to 'count' of the handles from 'first' that the TPM has in use.
+ * The response is read in place: moreData, the capability then the
+ * TPML_HANDLE. Handles past TPM2_MAX_CAP_HANDLES are dropped.
+ * The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_get_handles_page_unlocked (Tpm2        *tpm2,
+                                TPM2_HANDLE  first,
+                                UINT32       count,
+                                TPML_HANDLE *handles,
+                                TPMI_YES_NO *more_data)
+{
+    uint8_t *response, *list;
+    size_t size, offset = TPM_HEADER_SIZE + sizeof (TPMI_YES_NO) +
+        sizeof (TPM2_CAP);
+    UINT32 i, total;
+    TSS2_RC rc;
+
+    handles->count = 0;
+    *more_data = TPM2_NO;
+    rc = tpm2_execute_unlocked (tpm2,
+                                tpm2_template_get_handles (tpm2, first, count),
+                                &response,
+                                &size);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("TPM2_GetCapability", rc);
+        return rc;
+    }
+    if (size < offset + sizeof (UINT32)) {
+        RC_WARN ("TPM2_GetCapability", RM_RC (TPM2_RC_INSUFFICIENT));
+        return RM_RC (TPM2_RC_INSUFFICIENT);
+    }
+    *more_data = response [TPM_HEADER_SIZE];
+    total = be32toh (*(UINT32*)(response + offset));
+    list = response + offset + sizeof (UINT32);
+    for (i = 0;
+         i < total && i < TPM2_MAX_CAP_HANDLES &&
+         (size_t)(list - response) + (i + 1) * sizeof (TPM2_HANDLE) <= size;
+         ++i)
+    {
+        handles->handle [i] = be32toh (*(TPM2_HANDLE*)(list + i * sizeof (TPM2_HANDLE)));
+    }
+    handles->count = i;
+    return TSS2_RC_SUCCESS;
+}
 /*
  * Query the TPM for the current number of loaded transient objects.
  */
@@ -480,84 +1481,205 @@ tpm2_get_trans_object_count (Tpm2 *tpm2,
                                       uint32_t     *count)
 {
     TSS2_RC rc = TSS2_RC_SUCCESS;
-    TSS2_SYS_CONTEXT *sapi_context;
     TPMI_YES_NO more_data;
-    TPMS_CAPABILITY_DATA capability_data = { 0, };
+    TPML_HANDLE handles;
 
     assert (tpm2 != NULL);
     assert (count != NULL);
 
-    sapi_context = tpm2_lock_sapi (tpm2);
-    /*
-     * GCC gets confused by the TPM2_TRANSIENT_FIRST constant being used for
-     * the 4th parameter. It assumes that it's a signed type which causes
-     * -Wsign-conversion to complain. Casting to UINT32 is all we can do.
-     */
-    rc = Tss2_Sys_GetCapability (sapi_context,
-                                 NULL,
-                                 TPM2_CAP_HANDLES,
-                                 (UINT32)TPM2_TRANSIENT_FIRST,
-                                 TPM2_TRANSIENT_LAST - TPM2_TRANSIENT_FIRST,
-                                 &more_data,
-                                 &capability_data,
-                                 NULL);
-    if (rc != TSS2_RC_SUCCESS) {
-        RC_WARN ("Tss2_Sys_GetCapability", rc);
-        goto out;
+    tpm2_lock (tpm2);
+    rc = tpm2_get_handles_page_unlocked (tpm2,
+                                         TPM2_TRANSIENT_FIRST,
+                                         TPM2_TRANSIENT_LAST - TPM2_TRANSIENT_FIRST,
+                                         &handles,
+                                         &more_data);
+    if (rc == TSS2_RC_SUCCESS) {
+        *count = handles.count;
     }
-    *count = capability_data.data.handles.count;
-out:
     tpm2_unlock (tpm2);
     return rc;
 }
+/*
+ * Query the TPM for the handles from 'first' to 'last' it has in use.
+ * Only the handles that fit in a single TPML_HANDLE are returned.
+ */
 TSS2_RC
-tpm2_context_load (Tpm2 *tpm2,
-                            TPMS_CONTEXT *context,
-                            TPM2_HANDLE   *handle)
+tpm2_get_handles (Tpm2        *tpm2,
+                  TPM2_HANDLE  first,
+                  TPM2_HANDLE  last,
+                  TPML_HANDLE *handles)
 {
-    TSS2_RC           rc;
-    TSS2_SYS_CONTEXT *sapi_context;
+    TSS2_RC rc;
+    TPMI_YES_NO more_data;
+
+    assert (tpm2 != NULL);
+    assert (handles != NULL);
+
+    tpm2_lock (tpm2);
+    rc = tpm2_get_handles_page_unlocked (tpm2,
+                                         first,
+                                         last - first,
+                                         handles,
+                                         &more_data);
+    tpm2_unlock (tpm2);
+    return rc;
+}
+/*
+ * Load 'context', a marshalled TPMS_CONTEXT as kept by the
+ * ResourceManager, returning the handle the TPM assigned through
+ * 'handle'. The context goes to the TPM as it is, in the body of the
+ * ContextLoad command.
+ */
+TSS2_RC
+tpm2_context_load (Tpm2        *tpm2,
+                   GBytes      *context,
+                   TPM2_HANDLE *handle)
+{
+    TSS2_RC         rc;
+    uint8_t        *response;
+    size_t          size;
+    metrics_span_t  span;
 
     assert (tpm2 != NULL);
     assert (context != NULL);
     assert (handle != NULL);
 
-    sapi_context = tpm2_lock_sapi (tpm2);
-    rc = Tss2_Sys_ContextLoad (sapi_context, context, handle);
+    metrics_span_begin (&span);
+    tpm2_lock (tpm2);
+    TABRMD_PROBE1 (context_load_start, context_blob_saved_handle (context));
+    size = tpm2_template_context_load (tpm2, context);
+    if (size == 0) {
+        rc = RM_RC (TPM2_RC_SIZE);
+    } else {
+        rc = tpm2_execute_unlocked (tpm2, size, &response, &size);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        if (size < TPM_HEADER_SIZE + sizeof (TPM2_HANDLE)) {
+            rc = RM_RC (TPM2_RC_INSUFFICIENT);
+        } else {
+            *handle = be32toh (*(TPM2_HANDLE*)(response + TPM_HEADER_SIZE));
+        }
+    }
+    TABRMD_PROBE2 (context_load_done, *handle, rc);
+    flight_recorder_record (FLIGHT_EVENT_LOAD, 0, TPM2_CC_ContextLoad, rc);
     tpm2_unlock (tpm2);
+    metrics_span_end (tpm2->metrics, METRICS_STAGE_CONTEXT, &span);
     if (rc != TSS2_RC_SUCCESS) {
-        RC_WARN ("Tss2_Sys_ContextLoad", rc);
+        RC_WARN ("TPM2_ContextLoad", rc);
+    } else {
+        tpm2_count_swap (tpm2, METRICS_CONTEXT_LOAD);
     }
 
     return rc;
 }
+/*
+ * Save the context for 'handle'. The body of the response, the
+ * marshalled TPMS_CONTEXT, is copied as it is to a new GBytes returned
+ * through 'context' that the caller owns. The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_context_save_unlocked (Tpm2         *tpm2,
+                            TPM2_HANDLE   handle,
+                            GBytes      **context)
+{
+    uint8_t *response;
+    size_t size;
+    TSS2_RC rc;
+
+    TABRMD_PROBE1 (context_save_start, handle);
+    rc = tpm2_execute_unlocked (tpm2,
+                                tpm2_template_handle (tpm2,
+                                                      TPM2_CC_ContextSave,
+                                                      handle),
+                                &response,
+                                &size);
+    TABRMD_PROBE2 (context_save_done, handle, rc);
+    flight_recorder_record (FLIGHT_EVENT_SAVE, 0, TPM2_CC_ContextSave, rc);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("TPM2_ContextSave", rc);
+        return rc;
+    }
+    *context = g_bytes_new (&response [TPM_HEADER_SIZE],
+                            size - TPM_HEADER_SIZE);
+    tpm2_count_swap (tpm2, METRICS_CONTEXT_SAVE);
+    return rc;
+}
 /*
  * This function is a simple wrapper around the TPM2_ContextSave command.
  * It will save the context associated with the provided handle, returning
- * the TPMS_CONTEXT to the caller. The response code returned will be
- * TSS2_RC_SUCCESS or an RC indicating failure from the TPM.
+ * the marshalled TPMS_CONTEXT to the caller through 'context'. The
+ * response code returned will be TSS2_RC_SUCCESS or an RC indicating
+ * failure from the TPM.
  */
 TSS2_RC
-tpm2_context_save (Tpm2 *tpm2,
-                            TPM2_HANDLE    handle,
-                            TPMS_CONTEXT *context)
+tpm2_context_save (Tpm2         *tpm2,
+                   TPM2_HANDLE   handle,
+                   GBytes      **context)
 {
     TSS2_RC rc;
-    TSS2_SYS_CONTEXT *sapi_context;
+    metrics_span_t span;
 
     assert (tpm2 != NULL);
     assert (context != NULL);
 
     g_debug ("tpm2_context_save: handle 0x%08" PRIx32, handle);
+    metrics_span_begin (&span);
+    tpm2_lock (tpm2);
+    rc = tpm2_context_save_unlocked (tpm2, handle, context);
+    tpm2_unlock (tpm2);
+    metrics_span_end (tpm2->metrics, METRICS_STAGE_CONTEXT, &span);
+
+    return rc;
+}
+/*
+ * Read the TPM's clock. The resetCount and restartCount in the clockInfo
+ * tell whether saved contexts from before a daemon restart are still good.
+ */
+TSS2_RC
+tpm2_read_clock (Tpm2           *tpm2,
+                 TPMS_TIME_INFO *time_info)
+{
+    TSS2_RC rc;
+    TSS2_SYS_CONTEXT *sapi_context;
+
+    assert (tpm2 != NULL);
+    assert (time_info != NULL);
+
     sapi_context = tpm2_lock_sapi (tpm2);
-    rc = Tss2_Sys_ContextSave (sapi_context, handle, context);
+    rc = Tss2_Sys_ReadClock (sapi_context, NULL, time_info, NULL);
+    tpm2_unlock (tpm2);
     if (rc != TSS2_RC_SUCCESS) {
-        RC_WARN ("Tss2_Sys_ContextSave", rc);
+        RC_WARN ("Tss2_Sys_ReadClock", rc);
     }
-    tpm2_unlock (tpm2);
 
     return rc;
 }
+/*
+ * Flush the context for 'handle', counting it in the metrics. The caller
+ * must hold the lock.
+ */
+static TSS2_RC
+tpm2_context_flush_unlocked (Tpm2        *tpm2,
+                             TPM2_HANDLE  handle)
+{
+    uint8_t *response;
+    size_t size;
+    TSS2_RC rc;
+
+    g_debug ("tpm2_context_flush: handle 0x%08" PRIx32, handle);
+    rc = tpm2_execute_unlocked (tpm2,
+                                tpm2_template_handle (tpm2,
+                                                      TPM2_CC_FlushContext,
+                                                      handle),
+                                &response,
+                                &size);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("TPM2_FlushContext", rc);
+    } else {
+        metrics_count (tpm2->metrics, METRICS_CONTEXT_FLUSH);
+    }
+    return rc;
+}
 /*
  * This function is a simple wrapper around the TPM2_FlushContext command.
  */
@@ -566,117 +1688,250 @@ tpm2_context_flush (Tpm2 *tpm2,
                              TPM2_HANDLE    handle)
 {
     TSS2_RC rc;
-    TSS2_SYS_CONTEXT *sapi_context;
+    metrics_span_t span;
 
     assert (tpm2 != NULL);
 
-    g_debug ("tpm2_context_flush: handle 0x%08" PRIx32, handle);
-    sapi_context = tpm2_lock_sapi (tpm2);
-    rc = Tss2_Sys_FlushContext (sapi_context, handle);
-    if (rc != TSS2_RC_SUCCESS) {
-        RC_WARN ("Tss2_Sys_FlushContext", rc);
-    }
+    metrics_span_begin (&span);
+    tpm2_lock (tpm2);
+    rc = tpm2_context_flush_unlocked (tpm2, handle);
     tpm2_unlock (tpm2);
+    metrics_span_end (tpm2->metrics, METRICS_STAGE_CONTEXT, &span);
 
     return rc;
 }
-TSS2_RC
-tpm2_context_saveflush (Tpm2 *tpm2,
-                                 TPM2_HANDLE    handle,
-                                 TPMS_CONTEXT *context)
+/*
+ * Flush the contexts for 'count' handles, taking the lock once for all of
+ * them. A failure for one handle doesn't stop the others from being
+ * flushed.
+ * Returns the number of handles that were flushed.
+ */
+size_t
+tpm2_context_flush_batch (Tpm2              *tpm2,
+                          TPM2_HANDLE const  handles[],
+                          size_t             count)
 {
-    TSS2_RC           rc;
-    TSS2_SYS_CONTEXT *sapi_context;
+    metrics_span_t span;
+    size_t i, done = 0;
 
     assert (tpm2 != NULL);
-    assert (context != NULL);
+    assert (count == 0 || handles != NULL);
+
+    if (count == 0) {
+        return 0;
+    }
+    metrics_span_begin (&span);
+    tpm2_lock (tpm2);
+    for (i = 0; i < count; ++i) {
+        if (tpm2_context_flush_unlocked (tpm2, handles [i]) == TSS2_RC_SUCCESS) {
+            ++done;
+        }
+    }
+    tpm2_unlock (tpm2);
+    metrics_span_end (tpm2->metrics, METRICS_STAGE_CONTEXT, &span);
+    return done;
+}
+/*
+ * Save then flush the context for 'handle'. The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_context_saveflush_unlocked (Tpm2         *tpm2,
+                                 TPM2_HANDLE   handle,
+                                 GBytes      **context)
+{
+    TSS2_RC rc;
 
     g_debug ("tpm2_context_save: handle 0x%" PRIx32, handle);
-    sapi_context = tpm2_lock_sapi (tpm2);
-    rc = Tss2_Sys_ContextSave (sapi_context, handle, context);
+    rc = tpm2_context_save_unlocked (tpm2, handle, context);
     if (rc != TSS2_RC_SUCCESS) {
-        RC_WARN ("Tss2_Sys_ContextSave", rc);
-        goto out;
+        return rc;
     }
-    g_debug ("tpm2_context_flush: handle 0x%" PRIx32, handle);
-    rc = Tss2_Sys_FlushContext (sapi_context, handle);
+    rc = tpm2_context_flush_unlocked (tpm2, handle);
     if (rc != TSS2_RC_SUCCESS) {
-        RC_WARN ("Tss2_Sys_FlushContext", rc);
+        g_clear_pointer (context, g_bytes_unref);
     }
-out:
+    return rc;
+}
+TSS2_RC
+tpm2_context_saveflush (Tpm2         *tpm2,
+                        TPM2_HANDLE   handle,
+                        GBytes      **context)
+{
+    TSS2_RC           rc;
+    metrics_span_t    span;
+
+    assert (tpm2 != NULL);
+    assert (context != NULL);
+
+    metrics_span_begin (&span);
+    tpm2_lock (tpm2);
+    rc = tpm2_context_saveflush_unlocked (tpm2, handle, context);
     tpm2_unlock (tpm2);
+    metrics_span_end (tpm2->metrics, METRICS_STAGE_CONTEXT, &span);
     return rc;
 }
+/*
+ * Save then flush the contexts for 'count' handles, taking the lock once
+ * for all of them. The marshalled context for handles [i] is returned in
+ * contexts [i], owned by the caller, and the RC for it in rcs [i]. A
+ * failure for one handle doesn't stop the others from being processed:
+ * its contexts [i] is left NULL.
+ * Returns the number of handles that were saved and flushed.
+ */
+size_t
+tpm2_context_saveflush_batch (Tpm2              *tpm2,
+                              TPM2_HANDLE const  handles[],
+                              GBytes            *contexts[],
+                              TSS2_RC            rcs[],
+                              size_t             count)
+{
+    metrics_span_t span;
+    size_t i, done = 0;
+
+    assert (tpm2 != NULL);
+    assert (count == 0 || (handles != NULL && contexts != NULL && rcs != NULL));
+
+    if (count == 0) {
+        return 0;
+    }
+    metrics_span_begin (&span);
+    tpm2_lock (tpm2);
+    for (i = 0; i < count; ++i) {
+        contexts [i] = NULL;
+        rcs [i] = tpm2_context_saveflush_unlocked (tpm2,
+                                                   handles [i],
+                                                   &contexts [i]);
+        if (rcs [i] == TSS2_RC_SUCCESS) {
+            ++done;
+        }
+    }
+    tpm2_unlock (tpm2);
+    metrics_span_end (tpm2->metrics, METRICS_STAGE_CONTEXT, &span);
+    return done;
+}
+/*
+ * Append the handles in the range from 'first' to 'last' that the TPM
+ * reports to 'handles'. GetCapability is repeated for as long as the TPM
+ * has more to report. The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_get_handles_unlocked (Tpm2    *tpm2,
+                           TPM2_RH  first,
+                           TPM2_RH  last,
+                           GArray  *handles)
+{
+    TSS2_RC rc;
+    TPMI_YES_NO more_data;
+    TPML_HANDLE page;
+    TPM2_HANDLE handle;
+    size_t i;
+
+    do {
+        rc = tpm2_get_handles_page_unlocked (tpm2,
+                                             first,
+                                             last - first,
+                                             &page,
+                                             &more_data);
+        if (rc != TSS2_RC_SUCCESS) {
+            return rc;
+        }
+        for (i = 0; i < page.count; ++i) {
+            handle = page.handle [i];
+            if (handle < first || handle > last) {
+                return TSS2_RC_SUCCESS;
+            }
+            g_array_append_val (handles, handle);
+            first = handle + 1;
+        }
+    } while (more_data == TPM2_YES &&
+             page.count > 0 &&
+             first <= last);
+
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Flush the 'count' handles, ignoring failures: the goal is to flush as
+ * many as possible. The caller must hold the lock.
+ * Returns the number of handles flushed.
+ */
+static guint
+tpm2_flush_handles_unlocked (Tpm2              *tpm2,
+                             TPM2_HANDLE const  handles[],
+                             guint              count)
+{
+    guint i, done = 0;
+
+    for (i = 0; i < count; ++i) {
+        if (tpm2_context_flush_unlocked (tpm2, handles [i]) == TSS2_RC_SUCCESS) {
+            ++done;
+        }
+    }
+    return done;
+}
 /*
  * Flush all handles in a given range. This function will return an error if
  * we're unable to query for handles within the requested range. Failures to
  * flush handles returned will be ignored since our goal here is to flush as
- * many as possible.
+ * many as possible. The caller must hold the lock.
  */
 TSS2_RC
-tpm2_flush_all_unlocked (Tpm2     *tpm2,
-                                  TSS2_SYS_CONTEXT *sapi_context,
-                                  TPM2_RH            first,
-                                  TPM2_RH            last)
+tpm2_flush_all_unlocked (Tpm2    *tpm2,
+                         TPM2_RH  first,
+                         TPM2_RH  last)
 {
-    TSS2_RC rc = TSS2_RC_SUCCESS;
-    TPMI_YES_NO more_data;
-    TPMS_CAPABILITY_DATA capability_data = { 0, };
-    TPM2_HANDLE handle;
-    size_t i;
+    TSS2_RC rc;
+    GArray *handles;
 
     g_debug ("%s: first: 0x%08" PRIx32 ", last: 0x%08" PRIx32,
              __func__, first, last);
     assert (tpm2 != NULL);
-    assert (sapi_context != NULL);
 
-    rc = Tss2_Sys_GetCapability (sapi_context,
-                                 NULL,
-                                 TPM2_CAP_HANDLES,
-                                 first,
-                                 last - first,
-                                 &more_data,
-                                 &capability_data,
-                                 NULL);
-    if (rc != TSS2_RC_SUCCESS) {
-        RC_WARN ("Tss2_Sys_GetCapability", rc);
-        return rc;
-    }
-    g_debug ("%s: got %u handles", __func__, capability_data.data.handles.count);
-    for (i = 0; i < capability_data.data.handles.count; ++i) {
-        handle = capability_data.data.handles.handle [i];
-        g_debug ("%s: flushing context with handle: 0x%08" PRIx32, __func__,
-                 handle);
-        rc = Tss2_Sys_FlushContext (sapi_context, handle);
-        if (rc != TSS2_RC_SUCCESS) {
-            RC_WARN ("Tss2_Sys_FlushContext", rc);
-        }
+    handles = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE));
+    rc = tpm2_get_handles_unlocked (tpm2, first, last, handles);
+    if (rc == TSS2_RC_SUCCESS) {
+        g_debug ("%s: got %u handles", __func__, handles->len);
+        tpm2_flush_handles_unlocked (tpm2,
+                                     (TPM2_HANDLE*)handles->data,
+                                     handles->len);
     }
+    g_array_free (handles, TRUE);
 
-    return TSS2_RC_SUCCESS;
+    return rc;
 }
+/*
+ * Flush the sessions and transient objects left in the TPM. The handles
+ * in all three ranges are collected first, then flushed back to back
+ * under a single hold of the lock. A range the TPM can't be queried for
+ * is skipped.
+ */
 void
 tpm2_flush_all_context (Tpm2 *tpm2)
 {
-    TSS2_SYS_CONTEXT *sapi_context;
+    static const TPM2_RH ranges [][2] = {
+        { TPM2_ACTIVE_SESSION_FIRST, TPM2_ACTIVE_SESSION_LAST },
+        { TPM2_LOADED_SESSION_FIRST, TPM2_LOADED_SESSION_LAST },
+        { TPM2_TRANSIENT_FIRST, TPM2_TRANSIENT_LAST },
+    };
+    GArray *handles;
+    guint i, done;
 
     g_debug (__func__);
     assert (tpm2 != NULL);
 
-    sapi_context = tpm2_lock_sapi (tpm2);
-    tpm2_flush_all_unlocked (tpm2,
-                                      sapi_context,
-                                      TPM2_ACTIVE_SESSION_FIRST,
-                                      TPM2_ACTIVE_SESSION_LAST);
-    tpm2_flush_all_unlocked (tpm2,
-                                      sapi_context,
-                                      TPM2_LOADED_SESSION_FIRST,
-                                      TPM2_LOADED_SESSION_LAST);
-    tpm2_flush_all_unlocked (tpm2,
-                                      sapi_context,
-                                      TPM2_TRANSIENT_FIRST,
-                                      TPM2_TRANSIENT_LAST);
+    handles = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE));
+    tpm2_lock (tpm2);
+    for (i = 0; i < G_N_ELEMENTS (ranges); ++i) {
+        tpm2_get_handles_unlocked (tpm2,
+                                   ranges [i][0],
+                                   ranges [i][1],
+                                   handles);
+    }
+    done = tpm2_flush_handles_unlocked (tpm2,
+                                        (TPM2_HANDLE*)handles->data,
+                                        handles->len);
     tpm2_unlock (tpm2);
+    g_info ("%s: flushed %u of %u contexts", __func__, done, handles->len);
+    g_array_free (handles, TRUE);
 }
 
 TSS2_RC
@@ -11,11 +11,43 @@
 #include <pthread.h>
 #include <tss2/tss2_sys.h>
 
+#include "command-durations.h"
+#include "metrics.h"
+#include "pcap-writer.h"
 #include "tcti.h"
 #include "tpm2-response.h"
 
 G_BEGIN_DECLS
 
+/*
+ * Called by tpm2_send_command after a command has been transmitted and
+ * before its response is received, so that the caller can do work that
+ * doesn't need the TPM while the TPM executes the command. It may be
+ * called more than once for a command. The Tpm2 lock is held: the
+ * function must not call back into the Tpm2.
+ */
+typedef void (*Tpm2OverlapFunc) (gpointer user_data);
+/*
+ * When the TCTI exposes poll handles tpm2_send_command waits for the
+ * response by polling them, and calls the overlap function again each
+ * time TPM2_POLL_INTERVAL milliseconds pass without a response.
+ */
+#define TPM2_POLL_INTERVAL    5
+#define TPM2_POLL_HANDLES_MAX 4
+/*
+ * With a timeout set, see tpm2_set_timeout, a command is given the
+ * timeout or TPM2_TIMEOUT_BASELINE_FACTOR times its baseline duration,
+ * whichever is longer, to execute. Past that it's canceled and the TPM
+ * has TPM2_CANCEL_GRACE more milliseconds to answer.
+ */
+#define TPM2_TIMEOUT_BASELINE_FACTOR 10
+#define TPM2_CANCEL_GRACE 1000
+/*
+ * Room for the largest command the Tpm2 builds itself: a ContextLoad
+ * with a marshalled TPMS_CONTEXT.
+ */
+#define TPM2_INTERNAL_COMMAND_SIZE (TPM_HEADER_SIZE + sizeof (TPMS_CONTEXT))
+
 typedef struct _Tpm2Class {
     GObjectClass      parent;
 } Tpm2Class;
@@ -27,6 +59,48 @@ typedef struct _Tpm2 {
     Tcti                   *tcti;
     TPMS_CAPABILITY_DATA    properties_fixed;
     gboolean                initialized;
+    /*
+     * Index into properties_fixed for each property in the TPM2_PT_FIXED
+     * group: 0 means not reported by the TPM, otherwise index + 1.
+     */
+    guint8                  fixed_index [TPM2_PT_GROUP];
+    /* scratch buffer for TCTI receive, protected by sapi_mutex */
+    guint8                 *response_buffer;
+    size_t                  response_buffer_size;
+    /*
+     * ContextSave, ContextLoad, FlushContext and GetCapability for handles
+     * are built here, protected by sapi_mutex
+     */
+    guint8                  command_buffer [TPM2_INTERNAL_COMMAND_SIZE];
+    Tpm2OverlapFunc         overlap_func;
+    gpointer                overlap_data;
+    /* set once the TCTI has no usable poll handles, protected by sapi_mutex */
+    gboolean                poll_unsupported;
+    /* optional, receives TPM latencies and context operation counts */
+    Metrics                *metrics;
+    /*
+     * optional, receives the time each command took to execute and tracks
+     * their baselines for degraded mode
+     */
+    CommandDurations       *durations;
+    /* locality the TCTI sends commands at, protected by sapi_mutex */
+    guint8                  locality;
+    /* running totals for tpm2_get_activity, updated atomically */
+    gssize                  commands;
+    gssize                  busy_usec;
+    gssize                  context_swaps;
+    /* optional, receives the commands and responses as packets */
+    PcapWriter             *pcap;
+    guint                   pcap_interface;
+    /* milliseconds, 0 to wait for responses for as long as it takes */
+    guint                   timeout;
+    /* time the last command was transmitted, protected by sapi_mutex */
+    gint64                  transmit_time;
+    /*
+     * Tcti still owing the response to a command that timed out and
+     * couldn't be canceled, protected by sapi_mutex
+     */
+    Tcti                   *stale_tcti;
 } Tpm2;
 
 #include "tpm2-command.h"
@@ -46,24 +120,85 @@ void tpm2_unlock (Tpm2 *tpm2);
 Tpm2Response* tpm2_send_command (Tpm2 *tpm2,
                                  Tpm2Command *command,
                                  TSS2_RC *rc);
+TSS2_RC tpm2_transmit (Tpm2 *tpm2,
+                       Tpm2Command *command);
+Tpm2Response* tpm2_receive (Tpm2 *tpm2,
+                            Tpm2Command *command,
+                            TSS2_RC *rc);
+void tpm2_set_overlap_func (Tpm2 *tpm2,
+                            Tpm2OverlapFunc func,
+                            gpointer user_data);
+void tpm2_get_activity (Tpm2 *tpm2,
+                        guint64 *commands,
+                        guint64 *busy_usec,
+                        guint64 *context_swaps);
+void tpm2_set_metrics (Tpm2 *tpm2,
+                       Metrics *metrics);
+void tpm2_set_command_durations (Tpm2 *tpm2,
+                                 CommandDurations *durations);
+void tpm2_set_pcap (Tpm2 *tpm2,
+                    PcapWriter *pcap,
+                    guint interface);
+void tpm2_set_timeout (Tpm2 *tpm2,
+                       guint timeout);
 TSS2_RC tpm2_get_max_response (Tpm2 *tpm2, guint32 *value);
+TSS2_RC tpm2_get_fixed_property (Tpm2 *tpm2,
+                                 TPM2_PT property,
+                                 guint32 *value);
+TSS2_RC tpm2_get_random (Tpm2 *tpm2,
+                         UINT16 requested,
+                         TPM2B_DIGEST *random_bytes);
+TSS2_RC tpm2_nv_read (Tpm2 *tpm2,
+                      TPMI_RH_NV_AUTH auth_handle,
+                      TPMI_RH_NV_INDEX nv_index,
+                      TPM2B_AUTH const *auth,
+                      UINT16 size,
+                      UINT16 offset,
+                      TPM2B_MAX_NV_BUFFER *data);
+TSS2_RC tpm2_nv_write (Tpm2 *tpm2,
+                       TPMI_RH_NV_AUTH auth_handle,
+                       TPMI_RH_NV_INDEX nv_index,
+                       TPM2B_AUTH const *auth,
+                       TPM2B_MAX_NV_BUFFER const *data,
+                       UINT16 offset);
+TPMS_CAPABILITY_DATA* tpm2_get_properties_fixed (Tpm2 *tpm2);
+void tpm2_set_properties_fixed (Tpm2 *tpm2,
+                                TPMS_CAPABILITY_DATA const *properties_fixed);
+TSS2_RC tpm2_refresh_properties_fixed (Tpm2 *tpm2);
+TSS2_RC tpm2_get_properties (Tpm2 *tpm2,
+                             TPM2_PT property,
+                             UINT32 count,
+                             TPML_TAGGED_TPM_PROPERTY *properties);
 TSS2_SYS_CONTEXT* tpm2_lock_sapi (Tpm2 *tpm2);
 TSS2_RC tpm2_get_trans_object_count (Tpm2 *tpm2, uint32_t *count);
+TSS2_RC tpm2_get_handles (Tpm2 *tpm2,
+                          TPM2_HANDLE first,
+                          TPM2_HANDLE last,
+                          TPML_HANDLE *handles);
 TSS2_RC tpm2_context_load (Tpm2 *tpm2,
-                           TPMS_CONTEXT *context,
+                           GBytes *context,
                            TPM2_HANDLE *handle);
 TSS2_RC tpm2_context_flush (Tpm2 *tpm2, TPM2_HANDLE handle);
+size_t tpm2_context_flush_batch (Tpm2 *tpm2,
+                                 TPM2_HANDLE const handles[],
+                                 size_t count);
 TSS2_RC tpm2_context_saveflush (Tpm2 *tpm2,
                                 TPM2_HANDLE handle,
-                                TPMS_CONTEXT *context);
+                                GBytes **context);
+size_t tpm2_context_saveflush_batch (Tpm2 *tpm2,
+                                     TPM2_HANDLE const handles[],
+                                     GBytes *contexts[],
+                                     TSS2_RC rcs[],
+                                     size_t count);
 TSS2_RC tpm2_context_save (Tpm2 *tpm2,
                            TPM2_HANDLE handle,
-                           TPMS_CONTEXT *context);
+                           GBytes **context);
+TSS2_RC tpm2_read_clock (Tpm2 *tpm2, TPMS_TIME_INFO *time_info);
 void tpm2_flush_all_context (Tpm2 *tpm2);
 TSS2_RC tpm2_send_tpm_startup (Tpm2 *tpm2);
 TSS2_SYS_CONTEXT* sapi_context_init (Tcti *tcti);
+TSS2_RC tpm2_cancel (Tpm2 *tpm2);
 TSS2_RC tpm2_flush_all_unlocked (Tpm2 *tpm2,
-                                 TSS2_SYS_CONTEXT *sapi_context,
                                  TPM2_RH first,
                                  TPM2_RH last);
 TSS2_RC tpm2_get_command_attrs (Tpm2 *tpm2, UINT32 *count, TPMA_CC **attrs);
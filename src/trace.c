@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "util.h"
+
+G_DEFINE_TYPE (Trace, trace, G_TYPE_OBJECT);
+
+static void
+trace_finalize (GObject *obj)
+{
+    Trace *self = TRACE (obj);
+
+    if (self->file != NULL && fclose (self->file) != 0) {
+        g_warning ("%s: failed to close trace: %s", __func__, strerror (errno));
+    }
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (trace_parent_class)->finalize (obj);
+}
+static void
+trace_init (Trace *self)
+{
+    g_mutex_init (&self->mutex);
+}
+static void
+trace_class_init (TraceClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (trace_parent_class == NULL)
+        trace_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = trace_finalize;
+}
+/*
+ * Start a trace in a new file at 'path', replacing any file there. The
+ * trace holds what clients send, secrets included, so only the daemon's
+ * user may read it. The caller owns the returned reference.
+ * Returns NULL if the file can't be written.
+ */
+Trace*
+trace_new (const gchar *path,
+           GError     **error)
+{
+    trace_header_t header = { .version = TRACE_VERSION };
+    Trace *trace;
+    FILE *file;
+    gint fd;
+
+    g_assert (path != NULL);
+    fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to create %s: %s", path, strerror (errno));
+        return NULL;
+    }
+    file = fdopen (fd, "w");
+    if (file == NULL) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to open %s: %s", path, strerror (errno));
+        close (fd);
+        return NULL;
+    }
+    setvbuf (file, NULL, _IOFBF, TRACE_BUF_SIZE);
+    memcpy (header.magic, TRACE_MAGIC, sizeof (header.magic));
+    header.start_realtime = g_get_real_time ();
+    if (fwrite (&header, sizeof (header), 1, file) != 1) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to write %s: %s", path, strerror (errno));
+        fclose (file);
+        return NULL;
+    }
+    trace = TRACE (g_object_new (TYPE_TRACE, NULL));
+    trace->file = file;
+    trace->start_usec = g_get_monotonic_time ();
+    g_info ("tracing commands to %s", path);
+    return trace;
+}
+/*
+ * Append a command or response for the connection 'connection_id' to the
+ * trace. It may be called from any thread and accepts a NULL Trace so that
+ * callers don't have to check. A failed write stops the trace.
+ */
+void
+trace_record (Trace          *trace,
+              TraceRecordType type,
+              guint64         connection_id,
+              const guint8   *buf,
+              size_t          size)
+{
+    trace_record_t record = {
+        .type = (uint8_t)type,
+        .size = (uint32_t)size,
+        .connection_id = connection_id,
+    };
+
+    if (trace == NULL) {
+        return;
+    }
+    g_mutex_lock (&trace->mutex);
+    if (trace->failed) {
+        goto out;
+    }
+    record.usec = g_get_monotonic_time () - trace->start_usec;
+    if (fwrite (&record, sizeof (record), 1, trace->file) != 1 ||
+        fwrite (buf, 1, size, trace->file) != size)
+    {
+        g_warning ("%s: failed to write trace, stopping: %s",
+                   __func__, strerror (errno));
+        trace->failed = TRUE;
+    }
+out:
+    g_mutex_unlock (&trace->mutex);
+}
+/*
+ * Open the trace at 'path' for reading and check its header, which is
+ * returned in 'header'. Read the records with trace_read_record and close
+ * the file with fclose.
+ */
+FILE*
+trace_open_read (const gchar    *path,
+                 trace_header_t *header,
+                 GError        **error)
+{
+    FILE *file;
+
+    file = g_fopen (path, "rb");
+    if (file == NULL) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "failed to open %s: %s", path, strerror (errno));
+        return NULL;
+    }
+    if (fread (header, sizeof (*header), 1, file) != 1 ||
+        memcmp (header->magic, TRACE_MAGIC, sizeof (header->magic)) != 0 ||
+        header->version != TRACE_VERSION)
+    {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "%s isn't a version %u tpm2-abrmd trace",
+                     path, TRACE_VERSION);
+        fclose (file);
+        return NULL;
+    }
+    return file;
+}
+/*
+ * Read the next record from a trace. The command or response is returned
+ * in a new buffer of record->size bytes that the caller must g_free.
+ * Returns NULL at the end of the trace and also sets 'error' if the trace
+ * is truncated or malformed.
+ */
+guint8*
+trace_read_record (FILE           *file,
+                   trace_record_t *record,
+                   GError        **error)
+{
+    guint8 *buf;
+
+    if (fread (record, sizeof (*record), 1, file) != 1) {
+        if (ferror (file) || !feof (file)) {
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_IO,
+                         "failed to read trace record");
+        }
+        return NULL;
+    }
+    if ((record->type != TRACE_COMMAND && record->type != TRACE_RESPONSE) ||
+        record->size > UTIL_BUF_MAX)
+    {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "malformed trace record: type %u, size %u",
+                     record->type, record->size);
+        return NULL;
+    }
+    buf = g_malloc (MAX (record->size, 1));
+    if (fread (buf, 1, record->size, file) != record->size) {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "truncated trace record");
+        g_free (buf);
+        return NULL;
+    }
+    return buf;
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <stdint.h>
+#include <stdio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Record of the commands clients send and the responses they get, written
+ * with --trace and replayed by tabrmd-replay. The file is a trace_header_t
+ * followed by records, each a trace_record_t and 'size' bytes of command
+ * or response, in host byte order. Times are in microseconds since the
+ * trace was started. Commands are recorded as they're read from the
+ * client, responses as they're written back.
+ */
+#define TRACE_MAGIC    "TABRMDTR"
+#define TRACE_VERSION  1
+/* stdio buffer for the trace file */
+#define TRACE_BUF_SIZE (64 * 1024)
+
+typedef enum {
+    TRACE_COMMAND = 1,
+    TRACE_RESPONSE = 2,
+} TraceRecordType;
+
+typedef struct {
+    char     magic [8];
+    uint32_t version;
+    uint32_t reserved;
+    /* wall clock time the trace was started, usec since the epoch */
+    int64_t  start_realtime;
+} trace_header_t;
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  reserved [3];
+    uint32_t size;
+    uint64_t connection_id;
+    int64_t  usec;
+} trace_record_t;
+
+typedef struct _TraceClass {
+    GObjectClass      parent;
+} TraceClass;
+
+typedef struct _Trace {
+    GObject           parent_instance;
+    /* protects 'file' and 'failed', records come from several threads */
+    GMutex            mutex;
+    FILE             *file;
+    gint64            start_usec;
+    /* set once a write failed, nothing more is recorded */
+    gboolean          failed;
+} Trace;
+
+#define TYPE_TRACE              (trace_get_type   ())
+#define TRACE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_TRACE, Trace))
+#define TRACE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_TRACE, TraceClass))
+#define IS_TRACE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_TRACE))
+#define IS_TRACE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_TRACE))
+#define TRACE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_TRACE, TraceClass))
+
+GType      trace_get_type     (void);
+Trace*     trace_new          (const gchar      *path,
+                               GError          **error);
+void       trace_record       (Trace            *trace,
+                               TraceRecordType   type,
+                               guint64           connection_id,
+                               const guint8     *buf,
+                               size_t            size);
+FILE*      trace_open_read    (const gchar      *path,
+                               trace_header_t   *header,
+                               GError          **error);
+guint8*    trace_read_record  (FILE             *file,
+                               trace_record_t   *record,
+                               GError          **error);
+
+G_END_DECLS
+#endif /* TRACE_H */
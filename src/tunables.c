@@ -0,0 +1,216 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+
+#include <tss2/tss2_common.h>
+
+#include "fair-queue.h"
+#include "message-queue.h"
+#include "random-pool.h"
+#include "tabrmd-defaults.h"
+#include "tabrmd-options.h"
+#include "tabrmd.h"
+#include "token-bucket.h"
+#include "tunables.h"
+#include "util.h"
+
+G_DEFINE_TYPE (Tunables, tunables, G_TYPE_OBJECT);
+
+/*
+ * Name and GVariant type of each Tunable with the bounds of its value.
+ * The memory limits also take 0 below their minimum.
+ */
+static const struct {
+    const gchar *name;
+    const gchar *type;
+    guint        min;
+    guint        max;
+} tunable_info [TUNABLE_COUNT] = {
+    [TUNABLE_QUEUE_DEPTH]           = { "queue-depth", "u", 0, G_MAXUINT },
+    [TUNABLE_MAX_IN_FLIGHT]         = { "max-in-flight", "u", 0, G_MAXUINT },
+    [TUNABLE_MAX_CONNECTION_MEMORY] = { "max-connection-memory", "u",
+                                        TABRMD_MEMORY_MIN_KIB, G_MAXUINT },
+    [TUNABLE_MAX_MEMORY]            = { "max-memory", "u",
+                                        TABRMD_MEMORY_MIN_KIB, G_MAXUINT },
+    [TUNABLE_SCHEDULER]             = { "scheduler", "s", 0, 0 },
+    [TUNABLE_AFFINITY_BURST]        = { "affinity-burst", "u",
+                                        0, FAIR_QUEUE_AFFINITY_BURST_MAX },
+    [TUNABLE_LOCALITY_BURST]        = { "locality-burst", "u",
+                                        0, FAIR_QUEUE_LOCALITY_BURST_MAX },
+    [TUNABLE_QUEUE_SPIN]            = { "queue-spin", "u",
+                                        0, MESSAGE_QUEUE_SPIN_MAX },
+    [TUNABLE_RANDOM_POOL]           = { "random-pool", "u",
+                                        0, RANDOM_POOL_SIZE_MAX },
+    [TUNABLE_PCR_CACHE]             = { "pcr-cache", "b", 0, 1 },
+    [TUNABLE_PRIMARY_CACHE]         = { "primary-cache", "b", 0, 1 },
+    [TUNABLE_LOAD_CACHE]            = { "load-cache", "b", 0, 1 },
+    [TUNABLE_RATE_LIMIT]            = { "rate-limit", "u",
+                                        0, TOKEN_BUCKET_RATE_MAX },
+    [TUNABLE_SHARED_TRANSIENTS]     = { "shared-transients", "u",
+                                        0, TABRMD_SHARED_MAX },
+    [TUNABLE_SHARED_SESSIONS]       = { "shared-sessions", "u",
+                                        0, TABRMD_SHARED_MAX },
+};
+
+static void
+tunables_finalize (GObject *obj)
+{
+    Tunables *self = TUNABLES (obj);
+
+    g_clear_pointer (&self->uid_weights, g_hash_table_unref);
+    g_clear_pointer (&self->uid_rate_limits, g_hash_table_unref);
+    G_OBJECT_CLASS (tunables_parent_class)->finalize (obj);
+}
+static void
+tunables_init (Tunables *self)
+{
+    UNUSED_PARAM (self);
+}
+static void
+tunables_class_init (TunablesClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (tunables_parent_class == NULL)
+        tunables_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = tunables_finalize;
+}
+/*
+ * Parse an a{uu} of UIDs to values between 'min' and 'max' into a new
+ * GHashTable.
+ * Returns NULL if a value is out of bounds.
+ */
+static GHashTable*
+tunables_parse_uid_map (GVariant *map,
+                        guint     min,
+                        guint     max)
+{
+    GHashTable *table;
+    GVariantIter iter;
+    guint32 uid, value;
+
+    table = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_variant_iter_init (&iter, map);
+    while (g_variant_iter_next (&iter, "{uu}", &uid, &value)) {
+        if (value < min || value > max) {
+            g_hash_table_unref (table);
+            return NULL;
+        }
+        g_hash_table_insert (table,
+                             GUINT_TO_POINTER (uid),
+                             GUINT_TO_POINTER (value));
+    }
+    return table;
+}
+/*
+ * Take the value for the Tunable named 'name' from 'value'.
+ * Returns FALSE if there's no such Tunable or the value isn't valid.
+ */
+static gboolean
+tunables_parse_one (Tunables    *tunables,
+                    const gchar *name,
+                    GVariant    *value)
+{
+    FairQueuePolicy policy;
+    guint i, number;
+
+    if (g_strcmp0 (name, "uid-weights") == 0 &&
+        g_variant_is_of_type (value, G_VARIANT_TYPE ("a{uu}")))
+    {
+        g_clear_pointer (&tunables->uid_weights, g_hash_table_unref);
+        tunables->uid_weights =
+            tunables_parse_uid_map (value, 1, FAIR_QUEUE_WEIGHT_MAX);
+        return tunables->uid_weights != NULL;
+    }
+    if (g_strcmp0 (name, "uid-rate-limits") == 0 &&
+        g_variant_is_of_type (value, G_VARIANT_TYPE ("a{uu}")))
+    {
+        g_clear_pointer (&tunables->uid_rate_limits, g_hash_table_unref);
+        tunables->uid_rate_limits =
+            tunables_parse_uid_map (value, 0, TOKEN_BUCKET_RATE_MAX);
+        return tunables->uid_rate_limits != NULL;
+    }
+    for (i = 0; i < TUNABLE_COUNT; ++i) {
+        if (g_strcmp0 (name, tunable_info [i].name) == 0) {
+            break;
+        }
+    }
+    if (i == TUNABLE_COUNT ||
+        !g_variant_is_of_type (value, G_VARIANT_TYPE (tunable_info [i].type)))
+    {
+        return FALSE;
+    }
+    if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING)) {
+        if (!parse_scheduler (g_variant_get_string (value, NULL), &policy)) {
+            return FALSE;
+        }
+        number = policy;
+    } else if (g_variant_is_of_type (value, G_VARIANT_TYPE_BOOLEAN)) {
+        number = g_variant_get_boolean (value) ? 1 : 0;
+    } else {
+        number = g_variant_get_uint32 (value);
+        if ((number < tunable_info [i].min || number > tunable_info [i].max) &&
+            !(number == 0 && (i == TUNABLE_MAX_CONNECTION_MEMORY ||
+                              i == TUNABLE_MAX_MEMORY)))
+        {
+            return FALSE;
+        }
+    }
+    tunables->values [i] = number;
+    tunables->given |= 1U << i;
+    return TRUE;
+}
+/*
+ * Allocate a new Tunables from 'dict', an a{sv} of new values keyed by
+ * the name of the option that sets them at startup. --uid-weight and
+ * --uid-rate-limit are given as "uid-weights" and "uid-rate-limits",
+ * each an a{uu} of UIDs to values. The caller owns the returned reference.
+ * Returns NULL and sets 'error' if a name is unknown or a value is of the
+ * wrong type or out of bounds: none of the values are applied then.
+ */
+Tunables*
+tunables_new_from_variant (GVariant  *dict,
+                           GError   **error)
+{
+    Tunables *tunables;
+    GVariantIter iter;
+    const gchar *name;
+    GVariant *value;
+
+    g_assert (dict != NULL);
+    g_assert (g_variant_is_of_type (dict, G_VARIANT_TYPE_VARDICT));
+    tunables = TUNABLES (g_object_new (TYPE_TUNABLES, NULL));
+    g_variant_iter_init (&iter, dict);
+    while (g_variant_iter_next (&iter, "{&sv}", &name, &value)) {
+        if (!tunables_parse_one (tunables, name, value)) {
+            g_set_error (error,
+                         TABRMD_ERROR,
+                         TSS2_RESMGR_RC_BAD_VALUE,
+                         "Unknown parameter or bad value for \"%s\"",
+                         name);
+            g_variant_unref (value);
+            g_object_unref (tunables);
+            return NULL;
+        }
+        g_variant_unref (value);
+    }
+    return tunables;
+}
+/*
+ * Get the new value of 'tunable'.
+ * Returns FALSE if it wasn't given.
+ */
+gboolean
+tunables_get (Tunables *tunables,
+              Tunable   tunable,
+              guint    *value)
+{
+    g_assert (tunables != NULL);
+    g_assert (tunable < TUNABLE_COUNT);
+    if (!(tunables->given & (1U << tunable))) {
+        return FALSE;
+    }
+    if (value != NULL) {
+        *value = tunables->values [tunable];
+    }
+    return TRUE;
+}
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TUNABLES_H
+#define TUNABLES_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/*
+ * The parameters that may be changed while the daemon runs, each named
+ * like the option that sets it at startup. The caches and the scheduler
+ * are held as guints: 0 or 1 and a FairQueuePolicy.
+ */
+typedef enum {
+    TUNABLE_QUEUE_DEPTH = 0,
+    TUNABLE_MAX_IN_FLIGHT,
+    TUNABLE_MAX_CONNECTION_MEMORY,
+    TUNABLE_MAX_MEMORY,
+    TUNABLE_SCHEDULER,
+    TUNABLE_AFFINITY_BURST,
+    TUNABLE_LOCALITY_BURST,
+    TUNABLE_QUEUE_SPIN,
+    TUNABLE_RANDOM_POOL,
+    TUNABLE_PCR_CACHE,
+    TUNABLE_PRIMARY_CACHE,
+    TUNABLE_LOAD_CACHE,
+    TUNABLE_RATE_LIMIT,
+    TUNABLE_SHARED_TRANSIENTS,
+    TUNABLE_SHARED_SESSIONS,
+    TUNABLE_COUNT,
+} Tunable;
+
+typedef struct _TunablesClass {
+    GObjectClass      parent;
+} TunablesClass;
+
+/*
+ * A set of new values for some of the Tunables, checked against the
+ * same bounds as the options. 'uid_weights' and 'uid_rate_limits' map
+ * UIDs to their new --uid-weight and --uid-rate-limit, they're NULL if
+ * none were given. A Tunables isn't changed once it's created so the
+ * threads applying it can share it.
+ */
+typedef struct _Tunables {
+    GObject           parent_instance;
+    /* bit (1 << Tunable) set for each value given */
+    guint32           given;
+    guint             values [TUNABLE_COUNT];
+    GHashTable       *uid_weights;
+    GHashTable       *uid_rate_limits;
+} Tunables;
+
+#define TYPE_TUNABLES              (tunables_get_type   ())
+#define TUNABLES(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_TUNABLES, Tunables))
+#define TUNABLES_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_TUNABLES, TunablesClass))
+#define IS_TUNABLES(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_TUNABLES))
+#define IS_TUNABLES_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_TUNABLES))
+#define TUNABLES_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_TUNABLES, TunablesClass))
+
+GType        tunables_get_type      (void);
+Tunables*    tunables_new_from_variant (GVariant   *dict,
+                                        GError    **error);
+gboolean     tunables_get           (Tunables   *tunables,
+                                     Tunable     tunable,
+                                     guint      *value);
+
+G_END_DECLS
+#endif /* TUNABLES_H */
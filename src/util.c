@@ -14,8 +14,12 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <tss2/tss2_mu.h>
 #include <tss2/tss2_tpm2_types.h>
 
+#include "alloc-stats.h"
+#include "buffer-pool.h"
+#include "logging.h"
 #include "random.h"
 #include "util.h"
 #include "tpm2-header.h"
@@ -65,6 +69,25 @@ g_debug_bytes (uint8_t const *byte_array,
         }
     }
 }
+/*
+ * Clear 'size' bytes at 'buf' in a way the compiler can't drop as a dead
+ * store. Used on buffers that held TPM messages or random bytes before
+ * they're released or reused.
+ */
+void
+secure_clear (void   *buf,
+              size_t  size)
+{
+#ifdef HAVE_EXPLICIT_BZERO
+    explicit_bzero (buf, size);
+#else
+    volatile guint8 *p = buf;
+
+    while (size--) {
+        *p++ = 0;
+    }
+#endif
+}
 /** Write as many of the size bytes from buf to fd as possible.
  */
 ssize_t
@@ -101,6 +124,51 @@ write_all (GOutputStream *ostream,
 
     return (ssize_t)written_total;
 }
+/*
+ * Write as many of the size bytes from buf to ostream as it will accept
+ * without blocking. Streams that can't be polled fall back to write_all.
+ * Returns the number of bytes written (possibly 0) or -1 on error.
+ */
+ssize_t
+write_nonblocking (GOutputStream *ostream,
+                   const uint8_t *buf,
+                   const size_t   size)
+{
+    GPollableOutputStream *pollable;
+    ssize_t written = 0;
+    size_t written_total = 0;
+    GError *error = NULL;
+
+    if (!G_IS_POLLABLE_OUTPUT_STREAM (ostream) ||
+        !g_pollable_output_stream_can_poll (G_POLLABLE_OUTPUT_STREAM (ostream))) {
+        return write_all (ostream, buf, size);
+    }
+    pollable = G_POLLABLE_OUTPUT_STREAM (ostream);
+    while (written_total < size) {
+        written = g_pollable_output_stream_write_nonblocking (
+                      pollable,
+                      &buf [written_total],
+                      size - written_total,
+                      NULL,
+                      &error);
+        if (written < 0) {
+            g_assert (error != NULL);
+            if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+                g_debug ("%s: ostream would block after %zu bytes",
+                         __func__, written_total);
+                g_error_free (error);
+                break;
+            }
+            g_warning ("%s: failed to write to ostream: %s",
+                       __func__, error->message);
+            g_error_free (error);
+            return -1;
+        }
+        written_total += (size_t)written;
+    }
+
+    return (ssize_t)written_total;
+}
 /*
  * Read data from a GSocket.
  * Parameters:
@@ -130,15 +198,15 @@ read_data (GInputStream  *istream,
 
     g_assert (index != NULL);
     do {
-        g_debug ("%s: reading %zu bytes from istream", __func__,  bytes_left);
+        tabrmd_debug ("%s: reading %zu bytes from istream", __func__,  bytes_left);
         num_read = g_input_stream_read (istream,
                                         (gchar*)&buf [*index],
                                         bytes_left,
                                         NULL,
                                         &error);
         if (num_read > 0) {
-            g_debug ("successfully read %zd bytes", num_read);
-            g_debug_bytes ((uint8_t*)&buf [*index], num_read, 16, 4);
+            tabrmd_debug ("successfully read %zd bytes", num_read);
+            tabrmd_debug_bytes ((uint8_t*)&buf [*index], num_read, 16, 4);
             /* Advance index by the number of bytes read. */
             *index += num_read;
             bytes_left -= num_read;
@@ -147,8 +215,8 @@ read_data (GInputStream  *istream,
             return -1;
         } else { /* num_read < 0 */
             g_assert (error != NULL);
-            g_warning ("%s: read on istream produced error: %s", __func__,
-                       error->message);
+            tabrmd_warning_ratelimited ("%s: read on istream produced "
+                                        "error: %s", __func__, error->message);
             error_code = error->code;
             g_error_free (error);
             return error_code;
@@ -216,7 +284,7 @@ uint8_t*
 read_tpm_buffer_alloc (GInputStream *istream,
                        size_t       *buf_size)
 {
-    uint8_t *buf = NULL;
+    uint8_t *buf = NULL, *buf_tmp;
     size_t   size_tmp = TPM_HEADER_SIZE, index = 0;
     int ret = 0;
 
@@ -225,7 +293,13 @@ read_tpm_buffer_alloc (GInputStream *istream,
         return NULL;
     }
     do {
-        buf = g_realloc (buf, size_tmp);
+        buf_tmp = buffer_pool_alloc (size_tmp);
+        if (buf != NULL) {
+            memcpy (buf_tmp, buf, index);
+            buffer_pool_free (buf, index);
+        }
+        buf = buf_tmp;
+        ALLOC_STATS_ADD (ALLOC_STATS_COMMAND_BUFFERS, size_tmp);
         ret = read_tpm_buffer (istream, &index, buf, size_tmp);
         switch (ret) {
         case EPROTO:
@@ -249,11 +323,211 @@ read_tpm_buffer_alloc (GInputStream *istream,
     return buf;
 err_out:
     g_debug ("%s: err_out freeing buffer", __func__);
-    if (buf != NULL) {
-        g_free (buf);
-    }
+    buffer_pool_free (buf, index);
     return NULL;
 }
+/*
+ * Allocate the read buffer or move its pending data to the front so that
+ * a whole command of up to UTIL_BUF_MAX bytes always fits. The bytes the
+ * move leaves behind are cleared: a buffer holds nothing beyond the
+ * pending data it's released with.
+ */
+static void
+read_buffer_prepare (read_buffer_t *rbuf)
+{
+    if (rbuf->data == NULL) {
+        rbuf->data = buffer_pool_alloc (UTIL_BUF_MAX);
+        ALLOC_STATS_ADD (ALLOC_STATS_COMMAND_BUFFERS, UTIL_BUF_MAX);
+        rbuf->start = 0;
+    } else if (rbuf->start > 0) {
+        memmove (rbuf->data, &rbuf->data [rbuf->start], rbuf->len);
+        secure_clear (&rbuf->data [rbuf->len], rbuf->start);
+        rbuf->start = 0;
+    }
+}
+/*
+ * Read whatever the stream has available into the read buffer with a
+ * single read, without blocking on streams that can be polled. Pending
+ * data is moved to the front of the buffer first so that a whole command
+ * of up to UTIL_BUF_MAX bytes always fits.
+ * Returns:
+ *   -1: If the underlying read results in an EOF
+ *   0: If data was read or the stream had nothing to read.
+ *   errno: In the event of an error from the underlying read.
+ */
+int
+read_buffer_fill (GInputStream  *istream,
+                  read_buffer_t *rbuf)
+{
+    ssize_t num_read;
+    gint error_code;
+    GError *error = NULL;
+
+    read_buffer_prepare (rbuf);
+    if (rbuf->len == UTIL_BUF_MAX) {
+        return 0;
+    }
+    if (G_IS_POLLABLE_INPUT_STREAM (istream) &&
+        g_pollable_input_stream_can_poll (G_POLLABLE_INPUT_STREAM (istream))) {
+        num_read = g_pollable_input_stream_read_nonblocking (
+                       G_POLLABLE_INPUT_STREAM (istream),
+                       &rbuf->data [rbuf->len],
+                       UTIL_BUF_MAX - rbuf->len,
+                       NULL,
+                       &error);
+    } else {
+        num_read = g_input_stream_read (istream,
+                                        &rbuf->data [rbuf->len],
+                                        UTIL_BUF_MAX - rbuf->len,
+                                        NULL,
+                                        &error);
+    }
+    if (num_read > 0) {
+        tabrmd_debug ("%s: read %zd bytes", __func__, num_read);
+        rbuf->len += (size_t)num_read;
+        return 0;
+    } else if (num_read == 0) {
+        g_debug ("read produced EOF");
+        return -1;
+    }
+    g_assert (error != NULL);
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+        g_error_free (error);
+        return 0;
+    }
+    tabrmd_warning_ratelimited ("%s: read on istream produced error: %s",
+                                __func__, error->message);
+    error_code = error->code;
+    g_error_free (error);
+    return error_code;
+}
+/*
+ * Take the next complete TPM command buffer from the read buffer. When the
+ * read buffer holds exactly one command (the usual case for a client that
+ * waits for each response) its memory is handed to the caller without a
+ * copy. Otherwise the command is copied to a buffer of its own size.
+ * A read buffer left empty is freed so that an idle connection holds no
+ * buffer: a read_buffer_t wrapping memory of the caller owns that memory
+ * from then on and it must only be released with read_buffer_clear.
+ * Returns NULL if no complete command is buffered. *error is set to EPROTO
+ * if the command header holds a size outside of acceptable bounds and to 0
+ * otherwise.
+ */
+uint8_t*
+read_buffer_take (read_buffer_t *rbuf,
+                  size_t        *buf_size,
+                  int           *error)
+{
+    uint8_t *head, *buf;
+    uint32_t size;
+
+    *error = 0;
+    if (rbuf->len < TPM_HEADER_SIZE) {
+        return NULL;
+    }
+    head = &rbuf->data [rbuf->start];
+    size = get_command_size (head);
+    if (size < TPM_HEADER_SIZE || size > UTIL_BUF_MAX) {
+        g_warning ("%s: tpm buffer size is ouside of acceptable bounds: %"
+                   PRIu32, __func__, size);
+        *error = EPROTO;
+        return NULL;
+    }
+    if (rbuf->len < size) {
+        return NULL;
+    }
+    if (rbuf->start == 0 && rbuf->len == size) {
+        buf = rbuf->data;
+        rbuf->data = NULL;
+    } else {
+        buf = buffer_pool_alloc (size);
+        ALLOC_STATS_ADD (ALLOC_STATS_COMMAND_BUFFERS, size);
+        memcpy (buf, head, size);
+        rbuf->start += size;
+    }
+    rbuf->len -= size;
+    if (rbuf->len == 0) {
+        read_buffer_clear (rbuf);
+    }
+    g_debug ("%s: read TPM buffer of size: %" PRIu32, __func__, size);
+    g_debug_bytes (buf, size, 16, 4);
+    *buf_size = size;
+    return buf;
+}
+/*
+ * Append data read from the client by other means than read_buffer_fill.
+ * Returns the number of bytes appended, fewer than 'size' if the buffer
+ * fills up: the caller takes the complete commands and appends the rest.
+ */
+size_t
+read_buffer_append (read_buffer_t *rbuf,
+                    const uint8_t *data,
+                    size_t         size)
+{
+    read_buffer_prepare (rbuf);
+    size = MIN (size, UTIL_BUF_MAX - rbuf->len);
+    memcpy (&rbuf->data [rbuf->len], data, size);
+    rbuf->len += size;
+    return size;
+}
+/*
+ * Take the next command from a connection using the tagged transport: a
+ * big endian TABRMD_REQUEST_TAG_SIZE byte tag followed by the TPM command
+ * buffer. The tag is returned through 'tag', otherwise this behaves like
+ * read_buffer_take.
+ */
+uint8_t*
+read_buffer_take_tagged (read_buffer_t *rbuf,
+                         uint32_t      *tag,
+                         size_t        *buf_size,
+                         int           *error)
+{
+    uint8_t *head, *buf;
+    uint32_t size;
+
+    *error = 0;
+    if (rbuf->len < TABRMD_REQUEST_TAG_SIZE + TPM_HEADER_SIZE) {
+        return NULL;
+    }
+    head = &rbuf->data [rbuf->start];
+    size = get_command_size (&head [TABRMD_REQUEST_TAG_SIZE]);
+    if (size < TPM_HEADER_SIZE ||
+        size > UTIL_BUF_MAX - TABRMD_REQUEST_TAG_SIZE) {
+        g_warning ("%s: tpm buffer size is ouside of acceptable bounds: %"
+                   PRIu32, __func__, size);
+        *error = EPROTO;
+        return NULL;
+    }
+    if (rbuf->len < TABRMD_REQUEST_TAG_SIZE + size) {
+        return NULL;
+    }
+    *tag = be32toh (*(uint32_t*)head);
+    buf = buffer_pool_alloc (size);
+    ALLOC_STATS_ADD (ALLOC_STATS_COMMAND_BUFFERS, size);
+    memcpy (buf, &head [TABRMD_REQUEST_TAG_SIZE], size);
+    rbuf->start += TABRMD_REQUEST_TAG_SIZE + size;
+    rbuf->len -= TABRMD_REQUEST_TAG_SIZE + size;
+    if (rbuf->len == 0) {
+        read_buffer_clear (rbuf);
+    }
+    g_debug ("%s: read TPM buffer of size: %" PRIu32 " with tag: 0x%" PRIx32,
+             __func__, size, *tag);
+    *buf_size = size;
+    return buf;
+}
+/*
+ * Free the memory held by a read buffer and discard any pending data.
+ * Everything up to the end of the pending data is cleared, the commands
+ * already taken included.
+ */
+void
+read_buffer_clear (read_buffer_t *rbuf)
+{
+    buffer_pool_free (rbuf->data, rbuf->start + rbuf->len);
+    rbuf->data = NULL;
+    rbuf->start = 0;
+    rbuf->len = 0;
+}
 /*
  * Create a GSocket for use by the daemon for communicating with the client.
  * The client end of the socket is returned through the client_fd
@@ -262,16 +536,37 @@ err_out:
 GIOStream*
 create_connection_iostream (int *client_fd)
 {
-    GIOStream *iostream;
-    GSocket *sock;
+    return create_connection_iostream_type (client_fd, SOCK_STREAM);
+}
+/*
+ * Like create_connection_iostream with a socket of 'type', SOCK_STREAM or
+ * SOCK_SEQPACKET.
+ */
+GIOStream*
+create_connection_iostream_type (int *client_fd,
+                                 int  type)
+{
     int server_fd, ret;
 
-    ret = create_socket_pair (client_fd,
-                              &server_fd,
-                              SOCK_CLOEXEC | SOCK_NONBLOCK);
+    ret = create_socket_pair_type (client_fd,
+                                   &server_fd,
+                                   type,
+                                   SOCK_CLOEXEC | SOCK_NONBLOCK);
     if (ret == -1) {
         g_error ("CreateConnection failed to make fd pair %s", strerror (errno));
     }
+    return create_connection_iostream_fd (server_fd);
+}
+/*
+ * Wrap 'server_fd', the daemon end of a socket pair, in a GIOStream. The
+ * GIOStream owns the fd.
+ */
+GIOStream*
+create_connection_iostream_fd (int server_fd)
+{
+    GIOStream *iostream;
+    GSocket *sock;
+
     sock = g_socket_new_from_fd (server_fd, NULL);
     iostream = G_IO_STREAM (g_socket_connection_factory_create_connection (sock));
     g_object_unref (sock);
@@ -285,10 +580,21 @@ int
 create_socket_pair (int *fd_a,
                     int *fd_b,
                     int  flags)
+{
+    return create_socket_pair_type (fd_a, fd_b, SOCK_STREAM, flags);
+}
+/*
+ * Create a socket pair of 'type' and return the fds for both ends.
+ */
+int
+create_socket_pair_type (int *fd_a,
+                         int *fd_b,
+                         int  type,
+                         int  flags)
 {
     int ret, fds[2] = { 0, };
 
-    ret = socketpair (PF_LOCAL, SOCK_STREAM | flags, 0, fds);
+    ret = socketpair (PF_LOCAL, type | flags, 0, fds);
     if (ret == -1) {
         g_warning ("%s: failed to create socket pair with errno: %d",
                    __func__, errno);
@@ -375,3 +681,102 @@ parse_key_value_string (char *kv_str,
 out:
     return rc;
 }
+/*
+ * Returns TRUE if the 'size' bytes in 'buf' are exactly one marshalled
+ * TPMS_CONTEXT: the sequence, savedHandle and hierarchy then the
+ * contextBlob, a TPM2B that must end where the buffer does. Only the
+ * sizes are checked, the TPM checks the rest when the context is loaded.
+ */
+gboolean
+context_blob_valid (gconstpointer buf,
+                    gsize         size)
+{
+    size_t offset = TPMS_CONTEXT_BLOB_OFFSET;
+    UINT16 blob_size;
+
+    if (Tss2_MU_UINT16_Unmarshal (buf, size, &offset, &blob_size)
+        != TSS2_RC_SUCCESS)
+    {
+        return FALSE;
+    }
+    return size - offset == blob_size;
+}
+/*
+ * Return the savedHandle of the marshalled TPMS_CONTEXT in 'context', or
+ * 0 if there's none.
+ */
+TPM2_HANDLE
+context_blob_saved_handle (GBytes *context)
+{
+    gconstpointer buf;
+    gsize size;
+    size_t offset = TPMS_CONTEXT_SAVED_HANDLE_OFFSET;
+    TPM2_HANDLE handle;
+
+    if (context == NULL) {
+        return 0;
+    }
+    buf = g_bytes_get_data (context, &size);
+    if (Tss2_MU_TPM2_HANDLE_Unmarshal (buf, size, &offset, &handle)
+        != TSS2_RC_SUCCESS)
+    {
+        return 0;
+    }
+    return handle;
+}
+/*
+ * Get the marshalled TPMS_CONTEXT kept in a checkpoint as a GVariant byte
+ * array. Returns NULL if the array doesn't hold one.
+ */
+GBytes*
+context_blob_from_variant (GVariant *variant)
+{
+    gconstpointer buf;
+    gsize size;
+
+    buf = g_variant_get_fixed_array (variant, &size, 1);
+    if (!context_blob_valid (buf, size)) {
+        g_warning ("%s: byte array of %" G_GSIZE_FORMAT " bytes isn't a "
+                   "marshalled TPMS_CONTEXT", __func__, size);
+        return NULL;
+    }
+    return g_variant_get_data_as_bytes (variant);
+}
+/*
+ * Get the cgroup of process 'pid' from /proc/PID/cgroup: the unified
+ * hierarchy's if there is one, else systemd's named hierarchy. Under
+ * systemd the last component is the unit, like
+ * "/system.slice/foo.service". The caller owns the returned string.
+ * Returns NULL if the process is gone or in neither hierarchy.
+ */
+gchar*
+cgroup_from_pid (guint32 pid)
+{
+    gchar *path, *contents = NULL, **lines, **line, *cgroup = NULL;
+
+    if (pid == 0) {
+        return NULL;
+    }
+    path = g_strdup_printf ("/proc/%" PRIu32 "/cgroup", pid);
+    if (!g_file_get_contents (path, &contents, NULL, NULL)) {
+        g_debug ("%s: no cgroup for PID %" PRIu32, __func__, pid);
+        g_free (path);
+        return NULL;
+    }
+    g_free (path);
+    lines = g_strsplit (contents, "\n", -1);
+    g_free (contents);
+    for (line = lines; *line != NULL; ++line) {
+        if (g_str_has_prefix (*line, "0::")) {
+            g_free (cgroup);
+            cgroup = g_strdup (*line + strlen ("0::"));
+            break;
+        }
+        if (cgroup == NULL && strstr (*line, ":name=systemd:") != NULL) {
+            cgroup = g_strdup (strstr (*line, ":name=systemd:") +
+                               strlen (":name=systemd:"));
+        }
+    }
+    g_strfreev (lines);
+    return cgroup;
+}
@@ -48,8 +48,182 @@
 /* stop allocating at BUF_MAX */
 #define UTIL_BUF_MAX  8*UTIL_BUF_SIZE
 
+/*
+ * Bytes read from a client that haven't been handed out as complete TPM
+ * command buffers yet. The 'len' bytes of pending data begin at 'start'.
+ * 'data' is allocated by read_buffer_fill or read_buffer_append, holds up
+ * to UTIL_BUF_MAX bytes and is freed again once the pending data has been
+ * taken.
+ */
+typedef struct {
+    uint8_t *data;
+    size_t   start;
+    size_t   len;
+} read_buffer_t;
+
+/*
+ * W3C trace context a client attaches to its commands with
+ * TABRMD_CONTROL_SET_TRACE_CONTEXT, as in the binary form of the
+ * traceparent header: the trace ID, the ID of the client's span the
+ * commands are part of and the trace flags. An all zero trace ID means
+ * none.
+ */
+#define TRACE_CONTEXT_TRACE_ID_SIZE 16
+#define TRACE_CONTEXT_SPAN_ID_SIZE  8
+#define TRACE_CONTEXT_SIZE          (TRACE_CONTEXT_TRACE_ID_SIZE + \
+                                     TRACE_CONTEXT_SPAN_ID_SIZE + 1)
+#define TRACE_CONTEXT_FLAG_SAMPLED  0x01
+typedef struct {
+    uint8_t trace_id [TRACE_CONTEXT_TRACE_ID_SIZE];
+    uint8_t parent_id [TRACE_CONTEXT_SPAN_ID_SIZE];
+    uint8_t flags;
+} trace_context_t;
+
+/*
+ * Where the time went for a command, for the slow command log and the
+ * spans. 'received' is when the command was read from the client and
+ * 'answered' when the ResourceManager passed the response on, both
+ * monotonic time in usec. The rest are durations in usec: waiting for the
+ * ResourceManager, loading contexts, saving contexts to make room and in
+ * the TPM. 'trace' is the trace context the command came with.
+ */
+typedef struct {
+    gint64  received;
+    gint64  queue_usec;
+    gint64  load_usec;
+    gint64  save_usec;
+    gint64  tpm_usec;
+    gint64  answered;
+    trace_context_t trace;
+} command_timing_t;
+
+/*
+ * How commands and responses are exchanged between the TCTI and the
+ * daemon on a connection:
+ * - SOCKET: TPM buffers are written to the connection's socket.
+ * - SHM: TPM buffers are passed through shared memory, see shm-transport.h.
+ * - TAGGED: each TPM buffer on the socket is preceded by a big endian
+ *   TABRMD_REQUEST_TAG_SIZE byte tag chosen by the client. The response to
+ *   a command carries the command's tag, so a client can have more than
+ *   one command in flight.
+ * - SEQPACKET: like SOCKET over a SOCK_SEQPACKET socket. Each message holds
+ *   exactly one TPM buffer so a single read gets a whole command or
+ *   response.
+ */
+typedef enum {
+    TABRMD_TRANSPORT_SOCKET,
+    TABRMD_TRANSPORT_SHM,
+    TABRMD_TRANSPORT_TAGGED,
+    TABRMD_TRANSPORT_SEQPACKET,
+} tabrmd_transport_t;
+#define TABRMD_REQUEST_TAG_SIZE sizeof (uint32_t)
+/*
+ * A batch of commands on the tagged transport is sent as one frame. The
+ * request tag of the frame is ignored. It's followed by a header laid out
+ * like a TPM command header: TABRMD_BATCH_TAG, the size of the header and
+ * the commands, and the TSS2_TCTI_TABRMD_BATCH_* flags where the command
+ * code would be. Then come the commands, each preceded by its own request
+ * tag. The tag can't be mistaken for a TPM2_ST.
+ */
+#define TABRMD_BATCH_TAG 0xba7c
+/*
+ * A control frame asks the daemon to act on the connection in band,
+ * without a D-Bus or socket frontend call. It's laid out like a TPM
+ * command header with TABRMD_CONTROL_TAG, TABRMD_CONTROL_SIZE and a
+ * tabrmd_control_op_t where the command code would be, followed by one
+ * byte: the locality for TABRMD_CONTROL_SET_LOCALITY, 0 otherwise. On the
+ * tagged transport it's preceded by a request tag that's ignored. Control
+ * frames get no response: the daemon takes them in the order they arrive
+ * with the commands. Daemons that take them report TABRMD_FEATURE_CONTROL.
+ * TABRMD_CONTROL_SET_TIMEOUT is TABRMD_CONTROL_TIMEOUT_SIZE bytes long
+ * instead: the header is followed by a big endian UINT32 number of
+ * milliseconds. Each command the connection sends after it must be sent
+ * to the TPM within that time of being received or it's answered with
+ * TSS2_RESMGR_RC_CANCELED, 0 turns this off. Daemons that take it report
+ * TABRMD_FEATURE_TIMEOUT.
+ * TABRMD_CONTROL_SET_TRACE_CONTEXT is TABRMD_CONTROL_TRACE_CONTEXT_SIZE
+ * bytes long: the header is followed by a trace_context_t. The commands
+ * the connection sends after it are part of that trace, see
+ * SpanExporter. An all zero trace ID ends it. Daemons that take it report
+ * TABRMD_FEATURE_TRACE_CONTEXT.
+ * TABRMD_CONTROL_SET_CHANNEL makes the commands and control frames sent
+ * after it go to the channel in its byte, a logical connection of its own
+ * multiplexed on the socket: it has its own transient objects, sessions
+ * and limits. Channel 0 is the connection itself and the others are
+ * opened when first selected. TABRMD_CONTROL_CLOSE_CHANNEL flushes the
+ * objects and sessions of the channel in its byte like a connection being
+ * closed, its commands must all have been answered. Responses go out in
+ * the order they're ready: a client with commands in flight on several
+ * channels uses the tagged transport to match them. Daemons that take
+ * these report TABRMD_FEATURE_CHANNELS.
+ */
+#define TABRMD_CONTROL_TAG  0xc071
+#define TABRMD_CONTROL_SIZE (TPM_HEADER_SIZE + 1)
+#define TABRMD_CONTROL_TIMEOUT_SIZE (TPM_HEADER_SIZE + sizeof (UINT32))
+#define TABRMD_CONTROL_TRACE_CONTEXT_SIZE (TPM_HEADER_SIZE + TRACE_CONTEXT_SIZE)
+#define TABRMD_CONTROL_SIZE_MAX TABRMD_CONTROL_TRACE_CONTEXT_SIZE
+typedef enum {
+    TABRMD_CONTROL_SET_LOCALITY = 1,
+    TABRMD_CONTROL_CANCEL,
+    TABRMD_CONTROL_SET_TIMEOUT,
+    TABRMD_CONTROL_SET_TRACE_CONTEXT,
+    TABRMD_CONTROL_SET_CHANNEL,
+    TABRMD_CONTROL_CLOSE_CHANNEL,
+} tabrmd_control_op_t;
+/* features the daemon reports to the TCTI, see TABRMD_CONTROL_TAG */
+#define TABRMD_FEATURE_CONTROL       (1 << 0)
+#define TABRMD_FEATURE_TIMEOUT       (1 << 1)
+#define TABRMD_FEATURE_TRACE_CONTEXT (1 << 2)
+#define TABRMD_FEATURE_CHANNELS      (1 << 3)
+/*
+ * A vendor command a client sends like any other to give the daemon a
+ * residency hint for one of its transient objects: TPM2_ST_NO_SESSIONS,
+ * no handle area and as parameters the object's TPM2_HANDLE and a UINT8
+ * tabrmd_residency_t. The daemon answers it itself. The hints that keep
+ * an object resident count against the connection's --max-pinned.
+ */
+#define TABRMD_CC_RESIDENCY   ((TPM2_CC)0x20000ab0)
+#define TABRMD_RESIDENCY_SIZE (TPM_HEADER_SIZE + sizeof (TPM2_HANDLE) + sizeof (UINT8))
+typedef enum {
+    /* evicted when another connection needs the room, the default */
+    TABRMD_RESIDENCY_NORMAL = 0,
+    /* left resident for other connections' commands, evicted last */
+    TABRMD_RESIDENCY_HOT,
+    /* never evicted while the connection is open */
+    TABRMD_RESIDENCY_PINNED,
+    /* evicted before anything else, even when idle eviction isn't due */
+    TABRMD_RESIDENCY_EVICT_FIRST,
+} tabrmd_residency_t;
+/*
+ * Vendor commands a client sends like any other to read or write up to
+ * TABRMD_NV_LARGE_MAX bytes of an NV index at once. The daemon splits
+ * them into NV_Read or NV_Write commands of the TPM's
+ * TPM2_PT_NV_BUFFER_MAX sent back to back. Both are TPM2_ST_NO_SESSIONS
+ * with no handle area and as parameters the TPMI_RH_NV_AUTH, the
+ * TPMI_RH_NV_INDEX, the TPM2B_AUTH password of the auth handle and the
+ * UINT16 offset, followed for a read by the UINT16 number of bytes and
+ * for a write by the UINT16 number of bytes and the bytes. The password
+ * goes in a TPM2_RS_PW session with each command: HMAC and policy
+ * sessions can't be spread over several commands. A read is answered
+ * with the UINT16 number of bytes and the bytes, a write with the header
+ * only. A failing command's RC is returned as is and ends the split,
+ * the chunks of a write before it stay written.
+ */
+#define TABRMD_CC_NV_READ_LARGE  ((TPM2_CC)0x20000ab1)
+#define TABRMD_CC_NV_WRITE_LARGE ((TPM2_CC)0x20000ab2)
+/* leaves room for the header and the other parameters in UTIL_BUF_MAX */
+#define TABRMD_NV_LARGE_MAX      (UTIL_BUF_MAX - UTIL_BUF_SIZE)
+
 #define prop_str(val) val ? "set" : "clear"
 
+/*
+ * Offsets of the savedHandle and of the contextBlob in a marshalled
+ * TPMS_CONTEXT, after the UINT64 sequence and the hierarchy.
+ */
+#define TPMS_CONTEXT_SAVED_HANDLE_OFFSET sizeof (UINT64)
+#define TPMS_CONTEXT_BLOB_OFFSET \
+    (sizeof (UINT64) + sizeof (TPMI_DH_SAVED) + sizeof (TPMI_RH_HIERARCHY))
+
 /*
  * Print warning message for a given response code.
  * Parameters:
@@ -79,9 +253,14 @@ typedef TSS2_RC (*KeyValueFunc) (const key_value_t* key_value,
 #define TPMA_CC_RES(attrs)         (attrs.val & 0xc0000000)
 */
 
+void        secure_clear                    (void             *buf,
+                                             size_t            size);
 ssize_t     write_all                       (GOutputStream    *ostream,
                                              const uint8_t    *buf,
                                              const size_t      size);
+ssize_t     write_nonblocking               (GOutputStream    *ostream,
+                                             const uint8_t    *buf,
+                                             const size_t      size);
 int         read_data                       (GInputStream     *istream,
                                              size_t           *index,
                                              uint8_t          *buf,
@@ -90,6 +269,19 @@ int         read_tpm_buffer                 (GInputStream     *istream,
                                              size_t           *index,
                                              uint8_t          *buf,
                                              size_t            buf_size);
+int         read_buffer_fill                (GInputStream     *istream,
+                                             read_buffer_t    *rbuf);
+size_t      read_buffer_append              (read_buffer_t    *rbuf,
+                                             const uint8_t    *data,
+                                             size_t            size);
+uint8_t*    read_buffer_take                (read_buffer_t    *rbuf,
+                                             size_t           *buf_size,
+                                             int              *error);
+uint8_t*    read_buffer_take_tagged         (read_buffer_t    *rbuf,
+                                             uint32_t         *tag,
+                                             size_t           *buf_size,
+                                             int              *error);
+void        read_buffer_clear               (read_buffer_t    *rbuf);
 uint8_t*    read_tpm_buffer_alloc           (GInputStream     *istream,
                                              size_t           *buf_size);
 void        g_debug_bytes                   (uint8_t const    *byte_array,
@@ -97,12 +289,24 @@ void        g_debug_bytes                   (uint8_t const    *byte_array,
                                              size_t            width,
                                              size_t            indent);
 GIOStream*  create_connection_iostream      (int              *client_fd);
+GIOStream*  create_connection_iostream_type (int              *client_fd,
+                                             int               type);
+GIOStream*  create_connection_iostream_fd   (int               server_fd);
 int         create_socket_pair              (int              *fd_a,
                                              int              *fd_b,
                                              int               flags);
+int         create_socket_pair_type         (int              *fd_a,
+                                             int              *fd_b,
+                                             int               type,
+                                             int               flags);
 void        g_debug_tpma_cc                 (TPMA_CC           tpma_cc);
 TSS2_RC     parse_key_value_string (char *kv_str,
                                     KeyValueFunc callback,
                                     gpointer user_data);
+gboolean    context_blob_valid              (gconstpointer     buf,
+                                             gsize             size);
+TPM2_HANDLE context_blob_saved_handle       (GBytes           *context);
+GBytes*     context_blob_from_variant       (GVariant         *variant);
+gchar*      cgroup_from_pid                 (guint32           pid);
 
 #endif /* UTIL_H */
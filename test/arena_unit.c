@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "arena.h"
+#include "util.h"
+
+/*
+ * Allocations are aligned and don't overlap, and a reset hands out the
+ * same memory again without allocating another block.
+ */
+static void
+arena_alloc_reset_test (void **state)
+{
+    arena_t arena;
+    guint8 *first, *second;
+    UNUSED_PARAM (state);
+
+    arena_init (&arena, 256);
+    first = arena_alloc (&arena, 3);
+    second = arena_alloc0 (&arena, 10);
+    assert_int_equal ((uintptr_t)first % ARENA_ALIGN, 0);
+    assert_int_equal ((uintptr_t)second % ARENA_ALIGN, 0);
+    assert_true (second >= first + 3);
+    assert_int_equal (second [9], 0);
+    assert_int_equal (arena_get_size (&arena), 256);
+    arena_reset (&arena);
+    assert_ptr_equal (arena_alloc (&arena, 3), first);
+    assert_int_equal (arena_get_size (&arena), 256);
+    arena_clear (&arena);
+    assert_int_equal (arena_get_size (&arena), 0);
+}
+/*
+ * Running out of a block chains on another one, even for an allocation
+ * larger than a block. After the reset a single block holds it all.
+ */
+static void
+arena_overflow_test (void **state)
+{
+    arena_t arena;
+    UNUSED_PARAM (state);
+
+    arena_init (&arena, 256);
+    arena_alloc (&arena, 200);
+    arena_alloc (&arena, 200);
+    arena_alloc (&arena, 1024);
+    assert_int_equal (arena_get_size (&arena), 256 + 256 + 1024);
+    arena_reset (&arena);
+    assert_int_equal (arena_get_size (&arena), 0);
+    arena_alloc (&arena, 200);
+    assert_int_equal (arena_get_size (&arena), 256 + 256 + 1024);
+    arena_alloc (&arena, 1024);
+    arena_alloc (&arena, 200);
+    assert_int_equal (arena_get_size (&arena), 256 + 256 + 1024);
+    arena_clear (&arena);
+}
+/*
+ * A list built from arena links reads like any other GSList.
+ */
+static void
+arena_slist_test (void **state)
+{
+    arena_t arena;
+    GSList *list = NULL;
+    UNUSED_PARAM (state);
+
+    arena_init (&arena, ARENA_BLOCK_SIZE_DEFAULT);
+    list = arena_slist_prepend (&arena, list, GINT_TO_POINTER (1));
+    list = arena_slist_prepend (&arena, list, GINT_TO_POINTER (2));
+    assert_int_equal (g_slist_length (list), 2);
+    assert_int_equal (GPOINTER_TO_INT (list->data), 2);
+    assert_non_null (g_slist_find (list, GINT_TO_POINTER (1)));
+    arena_clear (&arena);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (arena_alloc_reset_test),
+        cmocka_unit_test (arena_overflow_test),
+        cmocka_unit_test (arena_slist_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
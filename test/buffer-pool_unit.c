@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "buffer-pool.h"
+#include "util.h"
+
+#define TEST_SMALL_SLOTS 2
+#define TEST_LARGE_SLOTS 1
+
+/*
+ * The pool isn't there if mlock is refused by RLIMIT_MEMLOCK, the tests
+ * needing it are skipped then.
+ */
+static int
+buffer_pool_setup (void **state)
+{
+    *state = GINT_TO_POINTER (buffer_pool_init (TEST_SMALL_SLOTS,
+                                                TEST_LARGE_SLOTS));
+    return 0;
+}
+static int
+buffer_pool_teardown (void **state)
+{
+    UNUSED_PARAM (state);
+    buffer_pool_fini ();
+    return 0;
+}
+/*
+ * A released slot is the next one handed out, with the bytes its last
+ * user wrote cleared.
+ */
+static void
+buffer_pool_reuse_test (void **state)
+{
+    uint8_t *buf, *buf_next;
+    size_t i;
+
+    if (!GPOINTER_TO_INT (*state)) {
+        skip ();
+    }
+    buf = buffer_pool_alloc (100);
+    assert_true (buffer_pool_contains (buf));
+    memset (buf, 0xa5, 100);
+    buffer_pool_free (buf, 100);
+
+    buf_next = buffer_pool_alloc (100);
+    assert_ptr_equal (buf_next, buf);
+    for (i = 0; i < BUFFER_POOL_SMALL; ++i) {
+        assert_int_equal (buf_next [i], 0);
+    }
+    buffer_pool_free (buf_next, 0);
+}
+/*
+ * Small buffers go to the large slots once the small ones are taken, and
+ * to the heap once those are. Buffers too big for the small slots only
+ * ever get a large one.
+ */
+static void
+buffer_pool_exhaust_test (void **state)
+{
+    uint8_t *small [TEST_SMALL_SLOTS + 2], *large;
+    size_t i;
+
+    if (!GPOINTER_TO_INT (*state)) {
+        skip ();
+    }
+    large = buffer_pool_alloc (BUFFER_POOL_SMALL + 1);
+    assert_true (buffer_pool_contains (large));
+    for (i = 0; i < TEST_SMALL_SLOTS; ++i) {
+        small [i] = buffer_pool_alloc (BUFFER_POOL_SMALL);
+        assert_true (buffer_pool_contains (small [i]));
+    }
+    small [i] = buffer_pool_alloc (16);
+    assert_false (buffer_pool_contains (small [i]));
+    buffer_pool_free (small [i], 16);
+
+    buffer_pool_free (large, BUFFER_POOL_SMALL + 1);
+    small [i] = buffer_pool_alloc (16);
+    assert_true (buffer_pool_contains (small [i]));
+    large = buffer_pool_try_alloc (BUFFER_POOL_LARGE);
+    assert_non_null (large);
+    assert_false (buffer_pool_contains (large));
+    buffer_pool_free (large, BUFFER_POOL_LARGE);
+
+    for (i = 0; i <= TEST_SMALL_SLOTS; ++i) {
+        buffer_pool_free (small [i], 16);
+    }
+}
+/*
+ * Without a pool buffers come from the heap and are released to it.
+ */
+static void
+buffer_pool_uninit_test (void **state)
+{
+    uint8_t *buf;
+
+    UNUSED_PARAM (state);
+    buf = buffer_pool_alloc (BUFFER_POOL_SMALL);
+    assert_non_null (buf);
+    assert_false (buffer_pool_contains (buf));
+    memset (buf, 0xa5, BUFFER_POOL_SMALL);
+    buffer_pool_free (buf, BUFFER_POOL_SMALL);
+    buffer_pool_free (NULL, 0);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (buffer_pool_reuse_test,
+                                         buffer_pool_setup,
+                                         buffer_pool_teardown),
+        cmocka_unit_test_setup_teardown (buffer_pool_exhaust_test,
+                                         buffer_pool_setup,
+                                         buffer_pool_teardown),
+        cmocka_unit_test (buffer_pool_uninit_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "checkpoint.h"
+#include "connection-manager.h"
+#include "util.h"
+
+typedef struct {
+    ConnectionManager  *manager;
+    gchar              *dir;
+    gchar              *path;
+} test_data_t;
+
+static int
+checkpoint_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+
+    /* no service manager: connections aren't kept */
+    g_unsetenv ("NOTIFY_SOCKET");
+    g_unsetenv ("LISTEN_PID");
+    data->manager = connection_manager_new (10);
+    data->dir = g_dir_make_tmp ("checkpoint-unit-XXXXXX", NULL);
+    assert_non_null (data->dir);
+    data->path = g_build_filename (data->dir, CHECKPOINT_FILE, NULL);
+
+    *state = data;
+    return 0;
+}
+static int
+checkpoint_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    g_unlink (data->path);
+    g_rmdir (data->dir);
+    g_free (data->path);
+    g_free (data->dir);
+    g_object_unref (data->manager);
+    g_free (data);
+    return 0;
+}
+/*
+ * Write 'size' bytes of 'contents' to the checkpoint file of the test
+ * with 'mode'.
+ */
+static void
+checkpoint_file_write (test_data_t *data,
+                       const gchar *contents,
+                       gssize       size,
+                       mode_t       mode)
+{
+    assert_true (g_file_set_contents (data->path, contents, size, NULL));
+    assert_int_equal (g_chmod (data->path, mode), 0);
+}
+/*
+ * A checkpoint is read back once: loading it removes the file.
+ */
+static void
+checkpoint_save_load_test (void **state)
+{
+    test_data_t *data = *state;
+    GVariant *checkpoint;
+    struct stat st;
+
+    assert_true (checkpoint_save (data->dir, data->manager, NULL, 0));
+    assert_int_equal (stat (data->path, &st), 0);
+    assert_int_equal (st.st_mode & 07777, 0600);
+    assert_int_equal (st.st_uid, geteuid ());
+    assert_true (g_file_test (data->path, G_FILE_TEST_EXISTS));
+    checkpoint = checkpoint_load (data->dir);
+    assert_non_null (checkpoint);
+    assert_false (g_file_test (data->path, G_FILE_TEST_EXISTS));
+    assert_false (checkpoint_restore_tpm (checkpoint, 0, NULL, data->manager));
+    assert_int_equal (checkpoint_restore_connections (checkpoint,
+                                                      data->manager,
+                                                      4,
+                                                      1),
+                      0);
+    g_variant_unref (checkpoint);
+    assert_null (checkpoint_load (data->dir));
+}
+static void
+checkpoint_load_invalid_test (void **state)
+{
+    test_data_t *data = *state;
+    GVariantBuilder tpms, connections;
+    GVariant *checkpoint;
+
+    checkpoint_file_write (data, "garbage", -1, 0600);
+    assert_null (checkpoint_load (data->dir));
+    assert_false (g_file_test (data->path, G_FILE_TEST_EXISTS));
+
+    /* a version this daemon doesn't know about */
+    g_variant_builder_init (&tpms,
+        G_VARIANT_TYPE ("a(u" RESOURCE_MANAGER_STATE_TYPE ")"));
+    g_variant_builder_init (&connections,
+                            G_VARIANT_TYPE ("a" CHECKPOINT_CONNECTION_TYPE));
+    checkpoint = g_variant_ref_sink (g_variant_new (CHECKPOINT_TYPE,
+                                                    (guint32)CHECKPOINT_VERSION + 1,
+                                                    &tpms,
+                                                    &connections));
+    checkpoint_file_write (data,
+                           g_variant_get_data (checkpoint),
+                           (gssize)g_variant_get_size (checkpoint),
+                           0600);
+    g_variant_unref (checkpoint);
+    assert_null (checkpoint_load (data->dir));
+}
+/*
+ * A checkpoint others may read or write isn't loaded, even if it's
+ * valid: the UIDs of the connections in it can't be trusted. It's
+ * removed all the same.
+ */
+static void
+checkpoint_load_mode_test (void **state)
+{
+    test_data_t *data = *state;
+    GVariant *checkpoint;
+    gchar *contents;
+    gsize size;
+
+    assert_true (checkpoint_save (data->dir, data->manager, NULL, 0));
+    assert_true (g_file_get_contents (data->path, &contents, &size, NULL));
+    checkpoint_file_write (data, contents, (gssize)size, 0644);
+    assert_null (checkpoint_load (data->dir));
+    assert_false (g_file_test (data->path, G_FILE_TEST_EXISTS));
+
+    checkpoint_file_write (data, contents, (gssize)size, 0600);
+    checkpoint = checkpoint_load (data->dir);
+    assert_non_null (checkpoint);
+    g_variant_unref (checkpoint);
+    g_free (contents);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (checkpoint_save_load_test,
+                                         checkpoint_setup,
+                                         checkpoint_teardown),
+        cmocka_unit_test_setup_teardown (checkpoint_load_invalid_test,
+                                         checkpoint_setup,
+                                         checkpoint_teardown),
+        cmocka_unit_test_setup_teardown (checkpoint_load_mode_test,
+                                         checkpoint_setup,
+                                         checkpoint_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -180,6 +180,36 @@ command_attrs_from_cc_fail_test (void **state)
                                        TPM2_CC_EvictControl);
     assert_int_equal (ret_attrs, 0);
 }
+/*
+ * Command codes outside of the direct-mapped table are found through the
+ * sorted fallback array.
+ */
+static void
+command_attrs_from_cc_vendor_test (void **state)
+{
+    test_data_t *data = *state;
+    gint         ret = -1;
+    TPMA_CC      command_attributes [3] = {
+        0x2fff + 0xff0000,
+        TPM2_CC_Startup + 0xff0000,
+        0x2001 + 0xff0000,
+    };
+
+    will_return (__wrap_tpm2_get_command_attrs, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_get_command_attrs, 3);
+    will_return (__wrap_tpm2_get_command_attrs, command_attributes);
+
+    ret = command_attrs_init_tpm (data->command_attrs, data->tpm2);
+    assert_int_equal (ret, 0);
+    assert_int_equal (command_attrs_from_cc (data->command_attrs, 0x2001),
+                      command_attributes [2]);
+    assert_int_equal (command_attrs_from_cc (data->command_attrs, 0x2fff),
+                      command_attributes [0]);
+    assert_int_equal (command_attrs_from_cc (data->command_attrs,
+                                             TPM2_CC_Startup),
+                      command_attributes [1]);
+    assert_int_equal (command_attrs_from_cc (data->command_attrs, 0x2002), 0);
+}
 gint
 main (void)
 {
@@ -196,6 +226,9 @@ main (void)
         cmocka_unit_test_setup_teardown (command_attrs_from_cc_success_test,
                                          command_attrs_init_tpm_setup,
                                          command_attrs_teardown),
+        cmocka_unit_test_setup_teardown (command_attrs_from_cc_vendor_test,
+                                         command_attrs_setup,
+                                         command_attrs_teardown),
         cmocka_unit_test_setup_teardown (command_attrs_from_cc_fail_test,
                                          command_attrs_init_tpm_setup,
                                          command_attrs_teardown),
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "command-durations.h"
+#include "util.h"
+
+static int
+command_durations_setup (void **state)
+{
+    *state = command_durations_new ();
+    return 0;
+}
+static int
+command_durations_teardown (void **state)
+{
+    g_object_unref (*state);
+    return 0;
+}
+/*
+ * Command codes that haven't been seen get the default estimate, the first
+ * sample replaces it.
+ */
+static void
+command_durations_first_sample_test (void **state)
+{
+    CommandDurations *durations = COMMAND_DURATIONS (*state);
+
+    assert_int_equal (command_durations_estimate (durations, TPM2_CC_Sign),
+                      COMMAND_DURATIONS_DEFAULT);
+    command_durations_observe (durations, TPM2_CC_Sign, 4000);
+    assert_int_equal (command_durations_estimate (durations, TPM2_CC_Sign),
+                      4000);
+    assert_int_equal (command_durations_estimate (durations, TPM2_CC_GetRandom),
+                      COMMAND_DURATIONS_DEFAULT);
+}
+/*
+ * Later samples move the estimate 1/COMMAND_DURATIONS_WEIGHT of the way
+ * toward them.
+ */
+static void
+command_durations_average_test (void **state)
+{
+    CommandDurations *durations = COMMAND_DURATIONS (*state);
+
+    command_durations_observe (durations, TPM2_CC_Sign, 1000);
+    command_durations_observe (durations, TPM2_CC_Sign,
+                               1000 + 8 * COMMAND_DURATIONS_WEIGHT);
+    assert_int_equal (command_durations_estimate (durations, TPM2_CC_Sign),
+                      1008);
+    command_durations_observe (NULL, TPM2_CC_Sign, 10);
+}
+/*
+ * Commands running well over their baseline put the TPM in degraded mode
+ * and it stays there until they're back near it. Each transition is
+ * reported once. The baseline barely moves meanwhile.
+ */
+static void
+command_durations_degraded_test (void **state)
+{
+    CommandDurations *durations = COMMAND_DURATIONS (*state);
+    guint i, changes = 0;
+
+    for (i = 0; i < COMMAND_DURATIONS_BASELINE_SAMPLES; ++i) {
+        assert_false (command_durations_observe (durations, TPM2_CC_Sign, 1000));
+    }
+    assert_int_equal (command_durations_baseline (durations, TPM2_CC_Sign),
+                      1000);
+    assert_false (command_durations_is_degraded (durations));
+    for (i = 0; i < 32; ++i) {
+        changes += command_durations_observe (durations, TPM2_CC_Sign, 10000);
+    }
+    assert_int_equal (changes, 1);
+    assert_true (command_durations_is_degraded (durations));
+    assert_true (command_durations_get_slowdown (durations) >=
+                 COMMAND_DURATIONS_DEGRADED_ENTER);
+    assert_true (command_durations_baseline (durations, TPM2_CC_Sign) < 3000);
+    for (i = 0; i < 64; ++i) {
+        changes += command_durations_observe (durations, TPM2_CC_Sign, 1000);
+    }
+    assert_int_equal (changes, 2);
+    assert_false (command_durations_is_degraded (durations));
+}
+/*
+ * Bulk work is told apart by the baseline of its command code, those with
+ * no samples aren't bulk.
+ */
+static void
+command_durations_bulk_test (void **state)
+{
+    CommandDurations *durations = COMMAND_DURATIONS (*state);
+
+    command_durations_observe (durations, TPM2_CC_CreatePrimary,
+                               2 * G_USEC_PER_SEC);
+    command_durations_observe (durations, TPM2_CC_GetRandom, 300);
+    assert_true (command_durations_is_bulk (durations, TPM2_CC_CreatePrimary));
+    assert_false (command_durations_is_bulk (durations, TPM2_CC_GetRandom));
+    assert_false (command_durations_is_bulk (durations, TPM2_CC_Sign));
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (command_durations_first_sample_test,
+                                         command_durations_setup,
+                                         command_durations_teardown),
+        cmocka_unit_test_setup_teardown (command_durations_average_test,
+                                         command_durations_setup,
+                                         command_durations_teardown),
+        cmocka_unit_test_setup_teardown (command_durations_degraded_test,
+                                         command_durations_setup,
+                                         command_durations_teardown),
+        cmocka_unit_test_setup_teardown (command_durations_bulk_test,
+                                         command_durations_setup,
+                                         command_durations_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -23,6 +23,7 @@
 #include "source-interface.h"
 #include "command-attrs.h"
 #include "command-source.h"
+#include "control-message.h"
 #include "tabrmd-defaults.h"
 #include "tpm2-command.h"
 #include "util.h"
@@ -45,15 +46,6 @@ __wrap_command_attrs_from_cc (CommandAttrs *attrs,
     UNUSED_PARAM(command_code);
     return (TPMA_CC)mock_type (UINT32);
 }
-Connection*
-__wrap_connection_manager_lookup_istream (ConnectionManager *manager,
-                                          GInputStream      *istream)
-{
-    UNUSED_PARAM(manager);
-    UNUSED_PARAM(istream);
-    g_debug ("%s", __func__);
-    return CONNECTION (mock_ptr_type (GObject*));
-}
 gint
 __wrap_connection_manager_remove      (ConnectionManager  *manager,
                                        Connection         *connection)
@@ -62,21 +54,28 @@ __wrap_connection_manager_remove      (ConnectionManager  *manager,
     UNUSED_PARAM(connection);
     return mock_type (int);
 }
-uint8_t*
-__wrap_read_tpm_buffer_alloc (GSocket   *socket,
-                              size_t    *buf_size)
+/*
+ * Mock 'read_buffer_fill': append the mock data to the read buffer as
+ * though that's what the client had sent, and return the mock return code.
+ */
+int
+__wrap_read_buffer_fill (GInputStream  *istream,
+                         read_buffer_t *rbuf)
 {
     uint8_t *buf_src = mock_type (uint8_t*);
-    uint8_t *buf_dst = NULL;
     size_t   size = mock_type (size_t);
-    UNUSED_PARAM(socket);
+    UNUSED_PARAM(istream);
 
     g_debug ("%s", __func__);
-    buf_dst = g_malloc0 (size);
-    memcpy (buf_dst, buf_src, size);
-    *buf_size = size;
+    if (rbuf->data == NULL) {
+        rbuf->data = g_malloc0 (UTIL_BUF_MAX);
+    }
+    if (size > 0) {
+        memcpy (&rbuf->data [rbuf->start + rbuf->len], buf_src, size);
+        rbuf->len += size;
+    }
 
-    return buf_dst;
+    return mock_type (int);
 }
 void
 __wrap_sink_enqueue (Sink     *sink,
@@ -270,7 +269,10 @@ command_source_on_io_ready_success_test (void **state)
     HandleMap   *handle_map;
     Connection *connection;
     Tpm2Command *command_out;
+    source_data_t *source_data;
+    GInputStream *istream;
     gint client_fd;
+    gboolean ret;
     guint8 data_in [] = { 0x80, 0x01, 0x0,  0x0,  0x0,  0x17,
                           0x0,  0x0,  0x01, 0x7a, 0x0,  0x0,
                           0x0,  0x06, 0x0,  0x0,  0x01, 0x0,
@@ -281,23 +283,431 @@ command_source_on_io_ready_success_test (void **state)
     connection = connection_new (iostream, 0, handle_map);
     g_object_unref (handle_map);
     g_object_unref (iostream);
+    istream = g_io_stream_get_input_stream (connection->iostream);
         /* prime wraps */
-    will_return (__wrap_connection_manager_lookup_istream, connection);
+    will_return (__wrap_g_source_set_callback, &source_data);
 
     /* setup read of tpm buffer */
-    will_return (__wrap_read_tpm_buffer_alloc, data_in);
-    will_return (__wrap_read_tpm_buffer_alloc, sizeof (data_in));
+    will_return (__wrap_read_buffer_fill, data_in);
+    will_return (__wrap_read_buffer_fill, sizeof (data_in));
+    will_return (__wrap_read_buffer_fill, 0);
     /* setup query for command attributes */
     will_return (__wrap_command_attrs_from_cc, 0);
 
     will_return (__wrap_sink_enqueue, &command_out);
 
-    command_source_on_input_ready (NULL, data->source);
+    command_source_on_new_connection (data->manager, connection, data->source);
+    ret = command_source_on_input_ready (istream, source_data);
+    assert_int_equal (ret, G_SOURCE_CONTINUE);
 
     assert_memory_equal (tpm2_command_get_buffer (command_out),
                          data_in,
                          sizeof (data_in));
+    assert_int_equal (connection->read_buffer.len, 0);
+    g_object_unref (command_out);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * A batch frame on a connection using the tagged transport reaches the
+ * sink as a single command carrying the rest of the batch.
+ */
+static void
+command_source_on_io_ready_batch_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    Tpm2Command *command_out, *next;
+    source_data_t *source_data;
+    GInputStream *istream;
+    gint client_fd;
+    gboolean ret;
+    guint8 data_in [] = { 0x00, 0x00, 0x00, 0x00,
+                          0xba, 0x7c, 0x00, 0x00, 0x00, 0x26,
+                          0x00, 0x00, 0x00, 0x01,
+                          0x00, 0x00, 0x00, 0x05,
+                          0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                          0x00, 0x00, 0x01, 0x7b,
+                          0x00, 0x00, 0x00, 0x06,
+                          0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                          0x00, 0x00, 0x01, 0x7e };
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    connection_set_tagged (connection, TRUE);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    istream = g_io_stream_get_input_stream (connection->iostream);
+    will_return (__wrap_g_source_set_callback, &source_data);
+    will_return (__wrap_read_buffer_fill, data_in);
+    will_return (__wrap_read_buffer_fill, sizeof (data_in));
+    will_return (__wrap_read_buffer_fill, 0);
+    will_return_count (__wrap_command_attrs_from_cc, 0, 2);
+    will_return (__wrap_sink_enqueue, &command_out);
+
+    command_source_on_new_connection (data->manager, connection, data->source);
+    ret = command_source_on_input_ready (istream, source_data);
+    assert_int_equal (ret, G_SOURCE_CONTINUE);
+
+    assert_int_equal (tpm2_command_get_request_tag (command_out), 5);
+    assert_int_equal (tpm2_command_get_code (command_out), TPM2_CC_GetRandom);
+    assert_true (tpm2_command_get_batch_stop (command_out));
+    assert_int_equal (tpm2_command_get_batch (command_out)->len, 1);
+    next = g_ptr_array_index (tpm2_command_get_batch (command_out), 0);
+    assert_int_equal (tpm2_command_get_request_tag (next), 6);
+    assert_int_equal (tpm2_command_get_code (next), TPM2_CC_PCR_Read);
+    assert_true (tpm2_command_is_batched (next));
+    assert_int_equal (connection->read_buffer.len, 0);
+    g_object_unref (command_out);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * Cancel function for command_source_on_io_ready_control_test: counts
+ * the cancels it's called for.
+ */
+static TSS2_RC
+control_test_cancel (Connection *connection,
+                     gpointer    user_data)
+{
+    UNUSED_PARAM(connection);
+    ++*(guint*)user_data;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Control frames set the connection's locality and cancel its commands
+ * in band. They're taken in order with the commands, don't reach the sink
+ * and don't count as commands in flight.
+ */
+static void
+command_source_on_io_ready_control_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    Tpm2Command *command_out;
+    source_data_t *source_data;
+    GInputStream *istream;
+    gint client_fd;
+    guint cancels = 0;
+    gboolean ret;
+    guint8 data_in [] = { 0xc0, 0x71, 0x00, 0x00, 0x00, 0x0b,
+                          0x00, 0x00, 0x00, 0x01, 0x03,
+                          0x80, 0x01, 0x0,  0x0,  0x0,  0x17,
+                          0x0,  0x0,  0x01, 0x7a, 0x0,  0x0,
+                          0x0,  0x06, 0x0,  0x0,  0x01, 0x0,
+                          0x0,  0x0,  0x0,  0x7f, 0x0a,
+                          0xc0, 0x71, 0x00, 0x00, 0x00, 0x0b,
+                          0x00, 0x00, 0x00, 0x02, 0x00 };
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    /* root may use any locality */
+    connection_set_uid (connection, 0);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    istream = g_io_stream_get_input_stream (connection->iostream);
+    command_source_set_cancel_func (data->source, control_test_cancel, &cancels);
+    will_return (__wrap_g_source_set_callback, &source_data);
+    will_return (__wrap_read_buffer_fill, data_in);
+    will_return (__wrap_read_buffer_fill, sizeof (data_in));
+    will_return (__wrap_read_buffer_fill, 0);
+    will_return (__wrap_command_attrs_from_cc, 0);
+    will_return (__wrap_sink_enqueue, &command_out);
+
+    command_source_on_new_connection (data->manager, connection, data->source);
+    ret = command_source_on_input_ready (istream, source_data);
+    assert_int_equal (ret, G_SOURCE_CONTINUE);
+
+    assert_int_equal (connection_get_locality (connection), 3);
+    assert_int_equal (cancels, 1);
+    assert_int_equal (tpm2_command_get_code (command_out), TPM2_CC_GetCapability);
+    assert_int_equal (connection_get_in_flight (connection), 1);
+    assert_int_equal (connection->read_buffer.len, 0);
+    g_object_unref (command_out);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * A client that may not use the locality it asks for in a SET_LOCALITY
+ * control frame is closed like one sending a malformed frame, its
+ * locality unchanged.
+ */
+#define LOCALITY_UID 1001
+static void
+command_source_on_io_ready_locality_refused_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    ControlMessage *msg;
+    source_data_t *source_data;
+    gint client_fd;
+    gboolean ret;
+    guint8 data_in [] = { 0xc0, 0x71, 0x00, 0x00, 0x00, 0x0b,
+                          0x00, 0x00, 0x00, 0x01, 0x04 };
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    connection_set_uid (connection, LOCALITY_UID);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    will_return (__wrap_g_source_set_callback, &source_data);
+    will_return (__wrap_read_buffer_fill, data_in);
+    will_return (__wrap_read_buffer_fill, sizeof (data_in));
+    will_return (__wrap_read_buffer_fill, 0);
+    will_return (__wrap_connection_manager_remove, TRUE);
+    will_return (__wrap_sink_enqueue, &msg);
+
+    command_source_on_new_connection (data->manager, connection, data->source);
+    ret = command_source_on_input_ready (g_io_stream_get_input_stream (connection->iostream),
+                                         source_data);
+    assert_int_equal (ret, G_SOURCE_REMOVE);
+    assert_int_equal (control_message_get_code (msg), CONNECTION_REMOVED);
+    assert_int_equal (connection_get_locality (connection), 0);
+    g_object_unref (msg);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * A SET_CHANNEL control frame opens a channel and sends the commands
+ * after it there: a Connection of its own on the same socket whose
+ * commands count as in flight on the connection too. Once they're
+ * answered CLOSE_CHANNEL lets the sink know the channel is gone.
+ */
+static void
+command_source_on_io_ready_channel_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection, *channel;
+    Tpm2Command *command_out;
+    ControlMessage *msg;
+    source_data_t *source_data;
+    GInputStream *istream;
+    gint client_fd;
+    gboolean ret;
+    guint8 data_in [] = { 0xc0, 0x71, 0x00, 0x00, 0x00, 0x0b,
+                          0x00, 0x00, 0x00, 0x05, 0x02,
+                          0x80, 0x01, 0x0,  0x0,  0x0,  0x17,
+                          0x0,  0x0,  0x01, 0x7a, 0x0,  0x0,
+                          0x0,  0x06, 0x0,  0x0,  0x01, 0x0,
+                          0x0,  0x0,  0x0,  0x7f, 0x0a };
+    guint8 close_in [] = { 0xc0, 0x71, 0x00, 0x00, 0x00, 0x0b,
+                           0x00, 0x00, 0x00, 0x05, 0x00,
+                           0xc0, 0x71, 0x00, 0x00, 0x00, 0x0b,
+                           0x00, 0x00, 0x00, 0x06, 0x02 };
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0x17, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    istream = g_io_stream_get_input_stream (connection->iostream);
+    command_source_set_max_channels (data->source, 1);
+    will_return (__wrap_g_source_set_callback, &source_data);
+    will_return (__wrap_read_buffer_fill, data_in);
+    will_return (__wrap_read_buffer_fill, sizeof (data_in));
+    will_return (__wrap_read_buffer_fill, 0);
+    will_return (__wrap_command_attrs_from_cc, 0);
+    will_return (__wrap_sink_enqueue, &command_out);
+
+    command_source_on_new_connection (data->manager, connection, data->source);
+    ret = command_source_on_input_ready (istream, source_data);
+    assert_int_equal (ret, G_SOURCE_CONTINUE);
+
+    channel = tpm2_command_get_connection (command_out);
+    assert_ptr_equal (connection_lookup_channel (connection, 2), channel);
+    assert_ptr_equal (connection_get_io (channel), connection);
+    assert_int_equal (connection_get_channel (channel), 2);
+    assert_int_not_equal (channel->id, connection->id);
+    assert_int_equal (connection_get_in_flight (channel), 1);
+    assert_int_equal (connection_get_in_flight (connection), 1);
+    connection_answered (channel);
+    assert_int_equal (connection_get_in_flight (connection), 0);
+
+    will_return (__wrap_read_buffer_fill, close_in);
+    will_return (__wrap_read_buffer_fill, sizeof (close_in));
+    will_return (__wrap_read_buffer_fill, 0);
+    will_return (__wrap_sink_enqueue, &msg);
+    ret = command_source_on_input_ready (istream, source_data);
+    assert_int_equal (ret, G_SOURCE_CONTINUE);
+
+    assert_int_equal (control_message_get_code (msg), CONNECTION_REMOVED);
+    assert_ptr_equal (control_message_get_object (msg), G_OBJECT (channel));
+    assert_int_equal (connection_get_channel_count (connection), 0);
+    assert_ptr_equal (connection_get_current (connection), connection);
+    g_object_unref (msg);
+    g_object_unref (channel);
+    g_object_unref (command_out);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * A connection may not open channels past the CommandSource's
+ * max_channels, none by default: it's closed like one sending a
+ * malformed frame.
+ */
+static void
+command_source_on_io_ready_channel_max_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    ControlMessage *msg;
+    source_data_t *source_data;
+    gint client_fd;
+    gboolean ret;
+    guint8 data_in [] = { 0xc0, 0x71, 0x00, 0x00, 0x00, 0x0b,
+                          0x00, 0x00, 0x00, 0x05, 0x01 };
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    will_return (__wrap_g_source_set_callback, &source_data);
+    will_return (__wrap_read_buffer_fill, data_in);
+    will_return (__wrap_read_buffer_fill, sizeof (data_in));
+    will_return (__wrap_read_buffer_fill, 0);
+    will_return (__wrap_connection_manager_remove, TRUE);
+    will_return (__wrap_sink_enqueue, &msg);
+
+    command_source_on_new_connection (data->manager, connection, data->source);
+    ret = command_source_on_input_ready (g_io_stream_get_input_stream (connection->iostream),
+                                         source_data);
+    assert_int_equal (ret, G_SOURCE_REMOVE);
+    assert_int_equal (control_message_get_code (msg), CONNECTION_REMOVED);
+    assert_ptr_equal (control_message_get_object (msg), G_OBJECT (connection));
+    assert_int_equal (connection_get_channel_count (connection), 0);
+    g_object_unref (msg);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * A single read may return one and a half commands: the complete command
+ * goes to the sink and the partial one waits in the connection's read
+ * buffer until the rest of it is read.
+ */
+static void
+command_source_on_io_ready_partial_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    Tpm2Command *command_out [2];
+    source_data_t *source_data;
+    GInputStream *istream;
+    gint client_fd;
+    guint8 data_in [] = { 0x80, 0x01, 0x0,  0x0,  0x0,  0x17,
+                          0x0,  0x0,  0x01, 0x7a, 0x0,  0x0,
+                          0x0,  0x06, 0x0,  0x0,  0x01, 0x0,
+                          0x0,  0x0,  0x0,  0x7f, 0x0a,
+                          0x80, 0x01, 0x0,  0x0,  0x0,  0x17,
+                          0x0,  0x0,  0x01, 0x7a, 0x0,  0x0,
+                          0x0,  0x06, 0x0,  0x0,  0x01, 0x0,
+                          0x0,  0x0,  0x0,  0x7f, 0x0a };
+    size_t first = sizeof (data_in) / 2 + 4;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    istream = g_io_stream_get_input_stream (connection->iostream);
+    will_return (__wrap_g_source_set_callback, &source_data);
+    command_source_on_new_connection (data->manager, connection, data->source);
+
+    will_return (__wrap_read_buffer_fill, data_in);
+    will_return (__wrap_read_buffer_fill, first);
+    will_return (__wrap_read_buffer_fill, 0);
+    will_return (__wrap_command_attrs_from_cc, 0);
+    will_return (__wrap_sink_enqueue, &command_out [0]);
+    assert_int_equal (command_source_on_input_ready (istream, source_data),
+                      G_SOURCE_CONTINUE);
+    assert_int_equal (connection->read_buffer.len,
+                      first - sizeof (data_in) / 2);
+
+    will_return (__wrap_read_buffer_fill, &data_in [first]);
+    will_return (__wrap_read_buffer_fill, sizeof (data_in) - first);
+    will_return (__wrap_read_buffer_fill, 0);
+    will_return (__wrap_command_attrs_from_cc, 0);
+    will_return (__wrap_sink_enqueue, &command_out [1]);
+    assert_int_equal (command_source_on_input_ready (istream, source_data),
+                      G_SOURCE_CONTINUE);
+    assert_int_equal (connection->read_buffer.len, 0);
+
+    assert_memory_equal (tpm2_command_get_buffer (command_out [0]),
+                         data_in,
+                         sizeof (data_in) / 2);
+    assert_memory_equal (tpm2_command_get_buffer (command_out [1]),
+                         &data_in [sizeof (data_in) / 2],
+                         sizeof (data_in) / 2);
+    g_object_unref (command_out [0]);
+    g_object_unref (command_out [1]);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * Bytes of a command that isn't complete yet don't count as activity: a
+ * client trickling in a command stays idle until the command completes.
+ */
+static void
+command_source_on_io_ready_trickle_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    Tpm2Command *command_out;
+    source_data_t *source_data;
+    GInputStream *istream;
+    gint client_fd;
+    guint8 data_in [] = { 0x80, 0x01, 0x0,  0x0,  0x0,  0x17,
+                          0x0,  0x0,  0x01, 0x7a, 0x0,  0x0,
+                          0x0,  0x06, 0x0,  0x0,  0x01, 0x0,
+                          0x0,  0x0,  0x0,  0x7f, 0x0a };
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    istream = g_io_stream_get_input_stream (connection->iostream);
+    will_return (__wrap_g_source_set_callback, &source_data);
+    command_source_on_new_connection (data->manager, connection, data->source);
+    connection->last_active =
+        (gint)(g_get_monotonic_time () / G_USEC_PER_SEC) - 100;
+
+    will_return (__wrap_read_buffer_fill, data_in);
+    will_return (__wrap_read_buffer_fill, TPM_HEADER_SIZE);
+    will_return (__wrap_read_buffer_fill, 0);
+    assert_int_equal (command_source_on_input_ready (istream, source_data),
+                      G_SOURCE_CONTINUE);
+    assert_true (connection_get_idle_time (connection) >= 100);
+
+    will_return (__wrap_read_buffer_fill, &data_in [TPM_HEADER_SIZE]);
+    will_return (__wrap_read_buffer_fill, sizeof (data_in) - TPM_HEADER_SIZE);
+    will_return (__wrap_read_buffer_fill, 0);
+    will_return (__wrap_command_attrs_from_cc, 0);
+    will_return (__wrap_sink_enqueue, &command_out);
+    assert_int_equal (command_source_on_input_ready (istream, source_data),
+                      G_SOURCE_CONTINUE);
+    assert_true (connection_get_idle_time (connection) < 100);
+
     g_object_unref (command_out);
+    g_object_unref (connection);
+    close (client_fd);
 }
 /*
  * This tests the CommandSource on_io_ready function for situations where
@@ -326,9 +736,9 @@ command_source_on_io_ready_eof_test (void **state)
     g_object_unref (iostream);
         /* prime wraps */
     will_return (__wrap_g_source_set_callback, &source_data);
-    will_return (__wrap_connection_manager_lookup_istream, connection);
-    will_return (__wrap_read_tpm_buffer_alloc, NULL);
-    will_return (__wrap_read_tpm_buffer_alloc, 0);
+    will_return (__wrap_read_buffer_fill, NULL);
+    will_return (__wrap_read_buffer_fill, 0);
+    will_return (__wrap_read_buffer_fill, -1);
     will_return (__wrap_sink_enqueue, &msg);
     will_return (__wrap_connection_manager_remove, TRUE);
 
@@ -338,8 +748,171 @@ command_source_on_io_ready_eof_test (void **state)
     hash_table_size = g_hash_table_size (data->source->istream_to_source_data_map);
     assert_int_equal (hash_table_size, 0);
     g_object_unref (msg);
+    g_object_unref (connection);
 }
 /* command_source_connection_test end */
+/*
+ * Commands from a connection for a TPM that the CommandSource has no Sink
+ * for must not be read: the connection is closed and removed instead.
+ */
+static void
+command_source_on_io_ready_no_tpm_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    source_data_t *source_data;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    ControlMessage *msg;
+    gint client_fd;
+    gboolean ret;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    connection_set_tpm (connection, 1);
+    will_return (__wrap_g_source_set_callback, &source_data);
+    will_return (__wrap_sink_enqueue, &msg);
+    will_return (__wrap_connection_manager_remove, TRUE);
+
+    command_source_on_new_connection (data->manager, connection, data->source);
+    ret = command_source_on_input_ready (g_io_stream_get_input_stream (connection->iostream), source_data);
+    assert_int_equal (ret, G_SOURCE_REMOVE);
+    assert_int_equal (control_message_get_code (msg), CONNECTION_REMOVED);
+    g_object_unref (msg);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * Check that commands are classified by command code and by the UID of the
+ * client that sent them.
+ */
+#define CLASSIFY_UID 1000
+static void
+command_source_classify_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    Tpm2Command *command;
+    guint8 *buf;
+    gint client_fd;
+    guint8 cmd_buf [] = { 0x80, 0x01, 0x0,  0x0,  0x0,  0x17,
+                          0x0,  0x0,  0x01, 0x7a, 0x0,  0x0,
+                          0x0,  0x06, 0x0,  0x0,  0x01, 0x0,
+                          0x0,  0x0,  0x0,  0x7f, 0x0a };
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    buf = g_malloc0 (sizeof (cmd_buf));
+    memcpy (buf, cmd_buf, sizeof (cmd_buf));
+    command = tpm2_command_new (connection, buf, sizeof (cmd_buf), 0);
+
+    assert_int_equal (command_source_classify (data->source, command),
+                      TPM2_COMMAND_PRIORITY_NORMAL);
+    command_source_add_priority_uid (data->source, CLASSIFY_UID);
+    assert_int_equal (command_source_classify (data->source, command),
+                      TPM2_COMMAND_PRIORITY_NORMAL);
+    connection_set_uid (connection, CLASSIFY_UID);
+    assert_int_equal (command_source_classify (data->source, command),
+                      TPM2_COMMAND_PRIORITY_HIGH);
+    connection_set_uid (connection, CONNECTION_UID_UNKNOWN);
+    command_source_add_priority_command (data->source,
+                                         TPM2_CC_GetCapability);
+    assert_int_equal (command_source_classify (data->source, command),
+                      TPM2_COMMAND_PRIORITY_HIGH);
+
+    g_object_unref (command);
+    g_object_unref (connection);
+    close (client_fd);
+/*
+ * With a limit of 2 commands per second two commands from a UID are
+ * admitted right away and the third is refused. A UID with its own limit
+ * of 0 isn't limited.
+ */
+static void
+command_source_admit_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    gint client_fd, i;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+
+    assert_true (command_source_admit (data->source, connection));
+    command_source_set_rate_limit (data->source, 2);
+    connection_set_uid (connection, CLASSIFY_UID);
+    assert_true (command_source_admit (data->source, connection));
+    assert_true (command_source_admit (data->source, connection));
+    assert_false (command_source_admit (data->source, connection));
+    command_source_set_uid_rate_limit (data->source, CLASSIFY_UID + 1, 0);
+    connection_set_uid (connection, CLASSIFY_UID + 1);
+    for (i = 0; i < 10; ++i) {
+        assert_true (command_source_admit (data->source, connection));
+    }
+
+    g_object_unref (connection);
+    close (client_fd);
+}
+}
+/*
+ * With reactors, new connections are spread across them round robin and
+ * watched with epoll instead of a GSource.
+ */
+static void
+command_source_reactor_add_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    CommandSource *source;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection [3];
+    gint client_fd [3];
+    gint ret;
+    guint i;
+
+    source = command_source_new_with_reactors (data->manager,
+                                               data->command_attrs,
+                                               2);
+    for (i = 0; i < G_N_ELEMENTS (connection); ++i) {
+        handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+        iostream = create_connection_iostream (&client_fd [i]);
+        connection [i] = connection_new (iostream, i, handle_map);
+        g_object_unref (handle_map);
+        g_object_unref (iostream);
+        ret = command_source_on_new_connection (data->manager,
+                                                connection [i],
+                                                source);
+        assert_int_equal (ret, 0);
+    }
+    assert_int_equal (g_hash_table_size (source->istream_to_source_data_map), 0);
+    assert_int_equal (g_hash_table_size (source->reactors [0].entries), 2);
+    assert_int_equal (g_hash_table_size (source->reactors [1].entries), 1);
+
+    ret = thread_start (THREAD (source));
+    assert_int_equal (ret, 0);
+    thread_cancel (THREAD (source));
+    ret = thread_join (THREAD (source));
+    assert_int_equal (ret, 0);
+
+    g_object_unref (source);
+    for (i = 0; i < G_N_ELEMENTS (connection); ++i) {
+        g_object_unref (connection [i]);
+        close (client_fd [i]);
+    }
+}
 int
 main (void)
 {
@@ -356,9 +929,42 @@ main (void)
         cmocka_unit_test_setup_teardown (command_source_on_io_ready_success_test,
                                          command_source_connection_setup,
                                          command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_batch_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_control_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_locality_refused_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_channel_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_channel_max_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_partial_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_trickle_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
         cmocka_unit_test_setup_teardown (command_source_on_io_ready_eof_test,
                                          command_source_connection_setup,
                                          command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_no_tpm_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_classify_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_admit_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_reactor_add_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
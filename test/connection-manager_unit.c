@@ -133,6 +133,83 @@ connection_manager_remove_test (void **state)
     ret_bool = connection_manager_remove (manager, connection);
     assert_true (ret_bool);
 }
+/*
+ * Only the connection that has been idle for longer than the timeout is
+ * shut down: its client reads EOF.
+ */
+static void
+connection_manager_close_idle_test (void **state)
+{
+    ConnectionManager *manager = CONNECTION_MANAGER (*state);
+    Connection *idle, *active;
+    GIOStream *iostream;
+    HandleMap *handle_map;
+    gint idle_fd, active_fd;
+    guint8 byte;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&idle_fd);
+    idle = connection_new (iostream, 5, handle_map);
+    g_object_unref (iostream);
+    iostream = create_connection_iostream (&active_fd);
+    active = connection_new (iostream, 6, handle_map);
+    g_object_unref (iostream);
+    g_object_unref (handle_map);
+    assert_int_equal (connection_manager_insert (manager, idle), 0);
+    assert_int_equal (connection_manager_insert (manager, active), 0);
+
+    idle->last_active -= 100;
+    assert_true (connection_get_idle_time (idle) >= 100);
+    assert_int_equal (connection_manager_close_idle (manager, 60), 1);
+    assert_int_equal (read (idle_fd, &byte, sizeof (byte)), 0);
+
+    connection_manager_remove (manager, idle);
+    connection_manager_remove (manager, active);
+    g_object_unref (idle);
+    g_object_unref (active);
+    close (idle_fd);
+    close (active_fd);
+}
+static void
+connection_manager_foreach_count (gpointer data,
+                                  gpointer user_data)
+{
+    assert_true (IS_CONNECTION (data));
+    ++*(guint*)user_data;
+}
+/*
+ * connection_manager_foreach visits each connection once.
+ */
+static void
+connection_manager_foreach_test (void **state)
+{
+    ConnectionManager *manager = CONNECTION_MANAGER (*state);
+    Connection *connections [3];
+    GIOStream *iostream;
+    HandleMap *handle_map;
+    gint client_fds [3];
+    guint i, count = 0;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    for (i = 0; i < G_N_ELEMENTS (connections); ++i) {
+        iostream = create_connection_iostream (&client_fds [i]);
+        connections [i] = connection_new (iostream, i + 1, handle_map);
+        g_object_unref (iostream);
+        assert_int_equal (connection_manager_insert (manager,
+                                                     connections [i]), 0);
+    }
+    g_object_unref (handle_map);
+    connection_manager_foreach (manager,
+                                connection_manager_foreach_count,
+                                &count);
+    assert_int_equal (count, G_N_ELEMENTS (connections));
+
+    for (i = 0; i < G_N_ELEMENTS (connections); ++i) {
+        connection_manager_remove (manager, connections [i]);
+        g_object_unref (connections [i]);
+        close (client_fds [i]);
+    }
+}
 
 int
 main(void)
@@ -151,6 +228,12 @@ main(void)
         cmocka_unit_test_setup_teardown (connection_manager_remove_test,
                                          connection_manager_setup,
                                          connection_manager_teardown),
+        cmocka_unit_test_setup_teardown (connection_manager_close_idle_test,
+                                         connection_manager_setup,
+                                         connection_manager_teardown),
+        cmocka_unit_test_setup_teardown (connection_manager_foreach_test,
+                                         connection_manager_setup,
+                                         connection_manager_teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -128,6 +128,144 @@ connection_key_id_test (void **state)
     assert_int_equal (connection->id, *key);
 }
 
+/*
+ * A connection may have at most 'max' pending commands. Releasing one
+ * makes room for the next.
+ */
+static void
+connection_pending_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+
+    assert_true (connection_acquire_pending (data->connection, 2));
+    assert_true (connection_acquire_pending (data->connection, 2));
+    assert_false (connection_acquire_pending (data->connection, 2));
+    connection_release_pending (data->connection);
+    assert_true (connection_acquire_pending (data->connection, 2));
+}
+
+static void
+connection_resume_cb (gpointer user_data)
+{
+    ++*(guint*)user_data;
+}
+/*
+ * A connection can only be paused with commands in flight and is resumed
+ * once the last of them is answered.
+ */
+static void
+connection_pause_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+    guint resumed = 0;
+
+    connection_set_resume_func (data->connection,
+                                connection_resume_cb,
+                                &resumed);
+    assert_false (connection_pause (data->connection));
+    connection_add_in_flight (data->connection, 2);
+    assert_true (connection_pause (data->connection));
+    connection_answered (data->connection);
+    assert_int_equal (resumed, 0);
+    connection_answered (data->connection);
+    assert_int_equal (resumed, 1);
+    assert_int_equal (connection_get_in_flight (data->connection), 0);
+    /* answering without a pause doesn't resume */
+    connection_add_in_flight (data->connection, 1);
+    connection_answered (data->connection);
+    assert_int_equal (resumed, 1);
+}
+
+/*
+ * connection_get_stats reports what was counted for the connection.
+ */
+static void
+connection_get_stats_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+    GVariant *stats;
+    guint64 value64;
+    guint32 value32;
+
+    connection_count_command (data->connection);
+    connection_count_command (data->connection);
+    connection_add_tpm_time (data->connection, 1500);
+    connection_add_tpm_time (data->connection, -10);
+    connection_add_context_time (data->connection, 300);
+    connection_add_sessions (data->connection, 2);
+    connection_add_sessions (data->connection, -1);
+    stats = g_variant_ref_sink (connection_get_stats (data->connection));
+    assert_true (g_variant_lookup (stats, "commands", "t", &value64));
+    assert_int_equal (value64, 2);
+    assert_true (g_variant_lookup (stats, "tpm_time_usec", "t", &value64));
+    assert_int_equal (value64, 1500);
+    assert_true (g_variant_lookup (stats, "context_time_usec", "t", &value64));
+    assert_int_equal (value64, 300);
+    assert_true (g_variant_lookup (stats, "sessions", "u", &value32));
+    assert_int_equal (value32, 1);
+    assert_true (g_variant_lookup (stats, "objects", "u", &value32));
+    assert_int_equal (value32, 0);
+    assert_true (g_variant_lookup (stats, "bytes_queued", "t", &value64));
+    assert_int_equal (value64, 0);
+    g_variant_unref (stats);
+}
+/*
+ * A channel takes the settings of its connection but has its own id and
+ * HandleMap. Pausing and resuming go by the commands in flight on the
+ * connection, its channels' included. Taking the channels leaves the
+ * connection with none.
+ */
+static void
+connection_channel_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+    Connection *channel;
+    HandleMap *handle_map, *channel_map;
+    GList *channels;
+    guint resumed = 0;
+
+    connection_set_locality (data->connection, 3);
+    connection_set_tagged (data->connection, TRUE);
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    channel = connection_new_channel (data->connection, 7, handle_map);
+    connection_add_channel (data->connection, channel);
+    connection_set_current (data->connection, channel);
+    assert_ptr_equal (connection_get_current (data->connection), channel);
+    assert_ptr_equal (connection_lookup_channel (data->connection, 7), channel);
+    assert_null (connection_lookup_channel (data->connection, 6));
+    assert_ptr_equal (connection_get_io (channel), data->connection);
+    assert_ptr_equal (connection_get_io (data->connection), data->connection);
+    assert_int_equal (connection_get_channel (channel), 7);
+    assert_int_not_equal (channel->id, data->connection->id);
+    assert_int_equal (connection_get_locality (channel), 3);
+    assert_true (connection_get_tagged (channel));
+    assert_ptr_equal (connection_get_iostream (channel),
+                      connection_get_iostream (data->connection));
+    channel_map = connection_get_trans_map (channel);
+    assert_ptr_equal (channel_map, handle_map);
+    g_object_unref (channel_map);
+    g_object_unref (handle_map);
+
+    connection_set_resume_func (data->connection,
+                                connection_resume_cb,
+                                &resumed);
+    connection_add_in_flight (channel, 1);
+    assert_int_equal (connection_get_in_flight (data->connection), 1);
+    assert_true (connection_pause (data->connection));
+    connection_answered (channel);
+    assert_int_equal (connection_get_in_flight (channel), 0);
+    assert_int_equal (resumed, 1);
+
+    channels = connection_take_channels (data->connection);
+    assert_int_equal (g_list_length (channels), 1);
+    assert_ptr_equal (channels->data, channel);
+    assert_int_equal (connection_get_channel_count (data->connection), 0);
+    assert_ptr_equal (connection_get_current (data->connection),
+                      data->connection);
+    g_list_free_full (channels, g_object_unref);
+    g_object_unref (channel);
+}
+
 /* connection_client_to_server_test begin
  * This test creates a connection and communicates with it as though the pipes
  * that are created as part of connection setup.
@@ -162,6 +300,32 @@ connection_server_to_client_test (void **state)
     assert_int_equal (ret, strlen ("test"));
 }
 /* connection_server_to_client_test end */
+/*
+ * Localities above 0 are for root and the UIDs allowed to use them, those
+ * above TPM2_LOC_FOUR for nobody.
+ */
+#define LOCALITY_UID 1001
+static void
+connection_locality_permitted_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+    Connection *connection = data->connection;
+
+    connection_set_uid (connection, LOCALITY_UID);
+    assert_true (connection_locality_permitted (connection, TPM2_LOC_ZERO));
+    assert_false (connection_locality_permitted (connection, TPM2_LOC_THREE));
+    connection_allow_locality_uid (LOCALITY_UID);
+    assert_true (connection_locality_permitted (connection, TPM2_LOC_THREE));
+    assert_false (connection_locality_permitted (connection,
+                                                 TPM2_LOC_FOUR + 1));
+    connection_set_uid (connection, LOCALITY_UID + 1);
+    assert_false (connection_locality_permitted (connection, TPM2_LOC_ONE));
+    connection_set_uid (connection, CONNECTION_UID_UNKNOWN);
+    assert_false (connection_locality_permitted (connection, TPM2_LOC_ONE));
+    connection_set_uid (connection, 0);
+    assert_true (connection_locality_permitted (connection, TPM2_LOC_FOUR));
+    assert_false (connection_locality_permitted (connection, 0xff));
+}
 
 int
 main(void)
@@ -174,12 +338,27 @@ main(void)
         cmocka_unit_test_setup_teardown (connection_key_id_test,
                                          connection_setup,
                                          connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_pending_test,
+                                         connection_setup,
+                                         connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_pause_test,
+                                         connection_setup,
+                                         connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_get_stats_test,
+                                         connection_setup,
+                                         connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_channel_test,
+                                         connection_setup,
+                                         connection_teardown),
         cmocka_unit_test_setup_teardown (connection_client_to_server_test,
                                          connection_setup,
                                          connection_teardown),
         cmocka_unit_test_setup_teardown (connection_server_to_client_test,
                                          connection_setup,
                                          connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_locality_permitted_test,
+                                         connection_setup,
+                                         connection_teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "context-store.h"
+
+/* two pages: enough to run out of room */
+#define TEST_STORE_SIZE (2 * CONTEXT_STORE_PAGE_SIZE)
+
+static int
+context_store_setup (void **state)
+{
+    *state = context_store_new (g_get_tmp_dir (), TEST_STORE_SIZE);
+    assert_non_null (*state);
+    return 0;
+}
+static int
+context_store_teardown (void **state)
+{
+    g_object_unref (*state);
+    return 0;
+}
+/*
+ * Build a GBytes of 'size' bytes all set to 'value'.
+ */
+static GBytes*
+blob_new (gsize  size,
+          guint8 value)
+{
+    guint8 *buf = g_malloc (size);
+
+    memset (buf, value, size);
+    return g_bytes_new_take (buf, size);
+}
+/*
+ * A context put in the store comes back the same, even after the pages
+ * have been trimmed, and its blocks are free again once taken.
+ */
+static void
+context_store_put_take_test (void **state)
+{
+    ContextStore *store = *state;
+    context_store_ref_t ref = { 0 };
+    GBytes *blob, *out;
+
+    blob = blob_new (100, 0xa5);
+    assert_true (context_store_put (store, blob, &ref));
+    assert_int_equal (ref.size, 100);
+    assert_int_equal (context_store_get_used (store),
+                      2 * CONTEXT_STORE_BLOCK_SIZE);
+    context_store_trim (store);
+    out = context_store_take (store, &ref);
+    assert_non_null (out);
+    assert_true (g_bytes_equal (blob, out));
+    assert_int_equal (ref.size, 0);
+    assert_int_equal (context_store_get_used (store), 0);
+    assert_null (context_store_take (store, &ref));
+    g_bytes_unref (out);
+    g_bytes_unref (blob);
+}
+/*
+ * A context that doesn't fit in what's left of a page starts on the next
+ * one, and a later small context fills the gap it left.
+ */
+static void
+context_store_page_packing_test (void **state)
+{
+    ContextStore *store = *state;
+    context_store_ref_t first = { 0 }, second = { 0 }, third = { 0 };
+    GBytes *blob;
+
+    blob = blob_new (CONTEXT_STORE_PAGE_SIZE - 2 * CONTEXT_STORE_BLOCK_SIZE, 1);
+    assert_true (context_store_put (store, blob, &first));
+    g_bytes_unref (blob);
+    blob = blob_new (3 * CONTEXT_STORE_BLOCK_SIZE, 2);
+    assert_true (context_store_put (store, blob, &second));
+    g_bytes_unref (blob);
+    assert_int_equal (first.block, 0);
+    assert_int_equal (second.block, CONTEXT_STORE_PAGE_BLOCKS);
+    blob = blob_new (CONTEXT_STORE_BLOCK_SIZE, 3);
+    assert_true (context_store_put (store, blob, &third));
+    g_bytes_unref (blob);
+    assert_int_equal (third.block, CONTEXT_STORE_PAGE_BLOCKS - 2);
+    context_store_drop (store, &first);
+    context_store_drop (store, &second);
+    context_store_drop (store, &third);
+    assert_int_equal (context_store_get_used (store), 0);
+}
+/*
+ * The store doesn't grow past its maximum size: the caller keeps what
+ * doesn't fit.
+ */
+static void
+context_store_full_test (void **state)
+{
+    ContextStore *store = *state;
+    context_store_ref_t refs [3] = { 0 };
+    GBytes *blob;
+
+    blob = blob_new (CONTEXT_STORE_PAGE_SIZE, 4);
+    assert_true (context_store_put (store, blob, &refs [0]));
+    assert_true (context_store_put (store, blob, &refs [1]));
+    assert_false (context_store_put (store, blob, &refs [2]));
+    assert_int_equal (refs [2].size, 0);
+    context_store_drop (store, &refs [0]);
+    assert_true (context_store_put (store, blob, &refs [2]));
+    assert_int_equal (refs [2].block, 0);
+    context_store_drop (store, &refs [1]);
+    context_store_drop (store, &refs [2]);
+    g_bytes_unref (blob);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (context_store_put_take_test,
+                                         context_store_setup,
+                                         context_store_teardown),
+        cmocka_unit_test_setup_teardown (context_store_page_packing_test,
+                                         context_store_setup,
+                                         context_store_teardown),
+        cmocka_unit_test_setup_teardown (context_store_full_test,
+                                         context_store_setup,
+                                         context_store_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,553 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "connection.h"
+#include "control-message.h"
+#include "fair-queue.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define TEST_CONNECTIONS 2
+#define TEST_UID 1000
+
+typedef struct {
+    FairQueue  *queue;
+    Connection *connections [TEST_CONNECTIONS];
+    gint        client_fds [TEST_CONNECTIONS];
+} test_data_t;
+
+static int
+fair_queue_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    size_t i;
+
+    data->queue = fair_queue_new ();
+    for (i = 0; i < TEST_CONNECTIONS; ++i) {
+        handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+        iostream = create_connection_iostream (&data->client_fds [i]);
+        data->connections [i] = connection_new (iostream, i, handle_map);
+        g_object_unref (handle_map);
+        g_object_unref (iostream);
+    }
+    *state = data;
+    return 0;
+}
+static int
+fair_queue_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    size_t i;
+
+    g_clear_object (&data->queue);
+    for (i = 0; i < TEST_CONNECTIONS; ++i) {
+        g_clear_object (&data->connections [i]);
+        close (data->client_fds [i]);
+    }
+    free (data);
+    return 0;
+}
+/*
+ * Enqueue a Tpm2Command with command code 'cc' for the provided connection
+ * as though it had been read 'age' usec ago.
+ */
+static void
+enqueue_command_aged (FairQueue          *queue,
+                      Connection         *connection,
+                      TPM2_CC             cc,
+                      Tpm2CommandPriority priority,
+                      gint64              age)
+{
+    Tpm2Command *command;
+    guint8 *buffer = g_malloc0 (TPM_HEADER_SIZE);
+
+    tpm2_header_init (buffer, TPM_HEADER_SIZE, TPM2_ST_NO_SESSIONS,
+                      TPM_HEADER_SIZE, cc);
+    command = tpm2_command_new (connection, buffer, TPM_HEADER_SIZE, 0);
+    tpm2_command_set_priority (command, priority);
+    command->timestamp -= age;
+    message_queue_enqueue (MESSAGE_QUEUE (queue), G_OBJECT (command));
+    g_object_unref (command);
+}
+static void
+enqueue_command_priority (FairQueue          *queue,
+                          Connection         *connection,
+                          TPM2_CC             cc,
+                          Tpm2CommandPriority priority)
+{
+    enqueue_command_aged (queue, connection, cc, priority, 0);
+}
+static void
+enqueue_command (FairQueue  *queue,
+                 Connection *connection,
+                 TPM2_CC     cc)
+{
+    enqueue_command_priority (queue, connection, cc,
+                              TPM2_COMMAND_PRIORITY_NORMAL);
+}
+/*
+ * Dequeue a Tpm2Command and check that it came from the expected
+ * connection.
+ */
+static void
+dequeue_expect (FairQueue  *queue,
+                Connection *connection)
+{
+    GObject *obj;
+
+    obj = message_queue_dequeue (MESSAGE_QUEUE (queue));
+    assert_true (IS_TPM2_COMMAND (obj));
+    assert_ptr_equal (TPM2_COMMAND (obj)->connection, connection);
+    g_object_unref (obj);
+}
+/*
+ * A connection with a backlog of commands doesn't delay a connection that
+ * enqueues later: the two are served alternately.
+ */
+static void
+fair_queue_round_robin_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *bulk = data->connections [0];
+    Connection *interactive = data->connections [1];
+
+    enqueue_command (data->queue, bulk, TPM2_CC_PCR_Extend);
+    enqueue_command (data->queue, bulk, TPM2_CC_PCR_Extend);
+    enqueue_command (data->queue, bulk, TPM2_CC_PCR_Extend);
+    enqueue_command (data->queue, interactive, TPM2_CC_Sign);
+    enqueue_command (data->queue, interactive, TPM2_CC_Sign);
+
+    dequeue_expect (data->queue, bulk);
+    dequeue_expect (data->queue, interactive);
+    dequeue_expect (data->queue, bulk);
+    dequeue_expect (data->queue, interactive);
+    dequeue_expect (data->queue, bulk);
+}
+/*
+ * Under the shortest first policy the commands expected to finish quickly
+ * go ahead of the slow ones queued before them.
+ */
+static void
+fair_queue_shortest_first_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    CommandDurations *durations = command_durations_new ();
+    Connection *bulk = data->connections [0];
+    Connection *interactive = data->connections [1];
+
+    command_durations_observe (durations, TPM2_CC_CreatePrimary, 2 * G_USEC_PER_SEC);
+    command_durations_observe (durations, TPM2_CC_GetRandom, 300);
+    fair_queue_set_policy (data->queue,
+                           FAIR_QUEUE_POLICY_SHORTEST_FIRST,
+                           durations);
+    g_object_unref (durations);
+    enqueue_command (data->queue, bulk, TPM2_CC_CreatePrimary);
+    enqueue_command (data->queue, bulk, TPM2_CC_CreatePrimary);
+    enqueue_command (data->queue, interactive, TPM2_CC_GetRandom);
+    enqueue_command (data->queue, interactive, TPM2_CC_GetRandom);
+
+    dequeue_expect (data->queue, interactive);
+    dequeue_expect (data->queue, interactive);
+    dequeue_expect (data->queue, bulk);
+    dequeue_expect (data->queue, bulk);
+}
+/*
+ * A slow command that has waited longer than its expected duration goes
+ * ahead of a fast one that was just queued.
+ */
+static void
+fair_queue_shortest_first_aging_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    CommandDurations *durations = command_durations_new ();
+    Connection *bulk = data->connections [0];
+    Connection *interactive = data->connections [1];
+
+    command_durations_observe (durations, TPM2_CC_CreatePrimary, 2 * G_USEC_PER_SEC);
+    command_durations_observe (durations, TPM2_CC_GetRandom, 300);
+    fair_queue_set_policy (data->queue,
+                           FAIR_QUEUE_POLICY_SHORTEST_FIRST,
+                           durations);
+    g_object_unref (durations);
+    enqueue_command (data->queue, interactive, TPM2_CC_GetRandom);
+    enqueue_command_aged (data->queue, bulk, TPM2_CC_CreatePrimary,
+                          TPM2_COMMAND_PRIORITY_NORMAL, 3 * G_USEC_PER_SEC);
+
+    dequeue_expect (data->queue, bulk);
+    dequeue_expect (data->queue, interactive);
+}
+/*
+ * Under the round robin policy the short commands still go first while
+ * the durations report the TPM degraded.
+ */
+static void
+fair_queue_degraded_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    CommandDurations *durations = command_durations_new ();
+    Connection *bulk = data->connections [0];
+    Connection *interactive = data->connections [1];
+    guint i;
+
+    command_durations_observe (durations, TPM2_CC_CreatePrimary, 2 * G_USEC_PER_SEC);
+    for (i = 0; i < COMMAND_DURATIONS_BASELINE_SAMPLES; ++i) {
+        command_durations_observe (durations, TPM2_CC_GetRandom, 300);
+    }
+    fair_queue_set_policy (data->queue,
+                           FAIR_QUEUE_POLICY_ROUND_ROBIN,
+                           durations);
+    enqueue_command (data->queue, bulk, TPM2_CC_CreatePrimary);
+    enqueue_command (data->queue, interactive, TPM2_CC_GetRandom);
+    dequeue_expect (data->queue, bulk);
+    dequeue_expect (data->queue, interactive);
+
+    while (!command_durations_is_degraded (durations)) {
+        command_durations_observe (durations, TPM2_CC_GetRandom, 3000);
+    }
+    g_object_unref (durations);
+    enqueue_command (data->queue, bulk, TPM2_CC_CreatePrimary);
+    enqueue_command (data->queue, bulk, TPM2_CC_CreatePrimary);
+    enqueue_command (data->queue, interactive, TPM2_CC_GetRandom);
+    enqueue_command (data->queue, interactive, TPM2_CC_GetRandom);
+
+    dequeue_expect (data->queue, interactive);
+    dequeue_expect (data->queue, interactive);
+    dequeue_expect (data->queue, bulk);
+    dequeue_expect (data->queue, bulk);
+}
+/*
+ * Under the FIFO policy commands go out in the order they were read,
+ * ignoring the weights, the affinity and the locality.
+ */
+static void
+fair_queue_fifo_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *first = data->connections [0];
+    Connection *second = data->connections [1];
+
+    fair_queue_set_policy (data->queue, FAIR_QUEUE_POLICY_FIFO, NULL);
+    connection_set_uid (first, TEST_UID);
+    fair_queue_set_uid_weight (data->queue, TEST_UID, 4);
+    fair_queue_set_affinity_burst (data->queue, 4);
+    fair_queue_set_affinity (data->queue, second);
+    connection_set_locality (first, 3);
+    enqueue_command_aged (data->queue, first, TPM2_CC_Sign,
+                          TPM2_COMMAND_PRIORITY_NORMAL, 400);
+    enqueue_command_aged (data->queue, second, TPM2_CC_Sign,
+                          TPM2_COMMAND_PRIORITY_NORMAL, 300);
+    enqueue_command_aged (data->queue, second, TPM2_CC_Sign,
+                          TPM2_COMMAND_PRIORITY_NORMAL, 200);
+    enqueue_command_aged (data->queue, first, TPM2_CC_Sign,
+                          TPM2_COMMAND_PRIORITY_NORMAL, 100);
+
+    dequeue_expect (data->queue, first);
+    dequeue_expect (data->queue, second);
+    dequeue_expect (data->queue, second);
+    dequeue_expect (data->queue, first);
+    fair_queue_set_affinity (data->queue, NULL);
+}
+/*
+ * The connection with affinity is served ahead of a connection that
+ * queued first, but only 'burst' times in a row.
+ */
+static void
+fair_queue_affinity_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *resident = data->connections [0];
+    Connection *other = data->connections [1];
+
+    fair_queue_set_affinity_burst (data->queue, 2);
+    fair_queue_set_affinity (data->queue, resident);
+    enqueue_command (data->queue, other, TPM2_CC_Sign);
+    enqueue_command (data->queue, other, TPM2_CC_Sign);
+    enqueue_command (data->queue, resident, TPM2_CC_Sign);
+    enqueue_command (data->queue, resident, TPM2_CC_Sign);
+    enqueue_command (data->queue, resident, TPM2_CC_Sign);
+
+    dequeue_expect (data->queue, resident);
+    dequeue_expect (data->queue, resident);
+    dequeue_expect (data->queue, other);
+    dequeue_expect (data->queue, resident);
+    dequeue_expect (data->queue, other);
+    fair_queue_set_affinity (data->queue, NULL);
+}
+/*
+ * Commands at the locality the TPM is at go ahead of commands at another
+ * locality queued first, but only 'burst' times in a row. Once switched
+ * the queue stays at the new locality in the same way.
+ */
+static void
+fair_queue_locality_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *current = data->connections [0];
+    Connection *other = data->connections [1];
+
+    fair_queue_set_locality_burst (data->queue, 2);
+    connection_set_locality (other, 3);
+    enqueue_command (data->queue, other, TPM2_CC_Sign);
+    enqueue_command (data->queue, other, TPM2_CC_Sign);
+    enqueue_command (data->queue, other, TPM2_CC_Sign);
+    enqueue_command (data->queue, current, TPM2_CC_Sign);
+    enqueue_command (data->queue, current, TPM2_CC_Sign);
+    enqueue_command (data->queue, current, TPM2_CC_Sign);
+
+    dequeue_expect (data->queue, current);
+    dequeue_expect (data->queue, current);
+    dequeue_expect (data->queue, other);
+    dequeue_expect (data->queue, other);
+    dequeue_expect (data->queue, other);
+    dequeue_expect (data->queue, current);
+}
+/*
+ * While a connection holds a lease only its commands are served. The
+ * lease ends once its commands are used up or it's released, and another
+ * connection can't take one until then.
+ */
+static void
+fair_queue_lease_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *holder = data->connections [0];
+    Connection *other = data->connections [1];
+    gint64 timeout = 10 * G_TIME_SPAN_SECOND;
+
+    enqueue_command (data->queue, other, TPM2_CC_Sign);
+    enqueue_command (data->queue, other, TPM2_CC_Sign);
+    enqueue_command (data->queue, holder, TPM2_CC_Sign);
+    enqueue_command (data->queue, holder, TPM2_CC_Sign);
+    enqueue_command (data->queue, holder, TPM2_CC_Sign);
+    enqueue_command (data->queue, holder, TPM2_CC_Sign);
+
+    assert_true (fair_queue_acquire_lease (data->queue, holder, 2, timeout));
+    assert_false (fair_queue_acquire_lease (data->queue, other, 2, timeout));
+    dequeue_expect (data->queue, holder);
+    dequeue_expect (data->queue, holder);
+    dequeue_expect (data->queue, other);
+
+    assert_true (fair_queue_acquire_lease (data->queue, holder, 10, timeout));
+    dequeue_expect (data->queue, holder);
+    fair_queue_release_lease (data->queue, holder);
+    assert_true (fair_queue_acquire_lease (data->queue, other, 10, timeout));
+    dequeue_expect (data->queue, other);
+    fair_queue_release_lease (data->queue, other);
+    dequeue_expect (data->queue, holder);
+}
+static gint64 test_clock_usec;
+
+static gint64
+test_clock (void)
+{
+    return test_clock_usec;
+}
+/*
+ * Leases run out by the clock the queue was given, not the monotonic
+ * time.
+ */
+static void
+fair_queue_lease_clock_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *holder = data->connections [0];
+    Connection *other = data->connections [1];
+
+    test_clock_usec = 0;
+    fair_queue_set_clock (data->queue, test_clock);
+    enqueue_command (data->queue, other, TPM2_CC_Sign);
+    enqueue_command (data->queue, holder, TPM2_CC_Sign);
+    enqueue_command (data->queue, holder, TPM2_CC_Sign);
+
+    assert_true (fair_queue_acquire_lease (data->queue, holder, 10, 1000));
+    dequeue_expect (data->queue, holder);
+    assert_false (fair_queue_acquire_lease (data->queue, other, 10, 1000));
+    test_clock_usec = 1000;
+    assert_true (fair_queue_acquire_lease (data->queue, other, 10, 1000));
+    dequeue_expect (data->queue, other);
+    fair_queue_release_lease (data->queue, other);
+    dequeue_expect (data->queue, holder);
+}
+/*
+ * A connection owned by a UID with weight 2 sends two commands each round.
+ */
+static void
+fair_queue_weight_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *heavy = data->connections [0];
+    Connection *light = data->connections [1];
+    size_t i;
+
+    connection_set_uid (heavy, TEST_UID);
+    fair_queue_set_uid_weight (data->queue, TEST_UID, 2);
+    assert_int_equal (fair_queue_get_weight (data->queue, heavy), 2);
+    assert_int_equal (fair_queue_get_weight (data->queue, light),
+                      FAIR_QUEUE_WEIGHT_DEFAULT);
+    for (i = 0; i < 4; ++i) {
+        enqueue_command (data->queue, heavy, TPM2_CC_GetRandom);
+        enqueue_command (data->queue, light, TPM2_CC_GetRandom);
+    }
+
+    dequeue_expect (data->queue, heavy);
+    dequeue_expect (data->queue, heavy);
+    dequeue_expect (data->queue, light);
+    dequeue_expect (data->queue, heavy);
+    dequeue_expect (data->queue, heavy);
+    dequeue_expect (data->queue, light);
+    dequeue_expect (data->queue, light);
+    dequeue_expect (data->queue, light);
+}
+/*
+ * Control messages are delivered before queued commands, and a
+ * CONNECTION_REMOVED message drops commands queued for the connection.
+ */
+static void
+fair_queue_connection_removed_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ControlMessage *msg;
+    GObject *obj;
+
+    enqueue_command (data->queue, data->connections [0], TPM2_CC_PCR_Extend);
+    enqueue_command (data->queue, data->connections [0], TPM2_CC_PCR_Extend);
+    enqueue_command (data->queue, data->connections [1], TPM2_CC_Sign);
+    msg = control_message_new_with_object (CONNECTION_REMOVED,
+                                           G_OBJECT (data->connections [0]));
+    message_queue_enqueue (MESSAGE_QUEUE (data->queue), G_OBJECT (msg));
+    g_object_unref (msg);
+
+    obj = message_queue_dequeue (MESSAGE_QUEUE (data->queue));
+    assert_true (IS_CONTROL_MESSAGE (obj));
+    g_object_unref (obj);
+    dequeue_expect (data->queue, data->connections [1]);
+    assert_null (g_hash_table_lookup (data->queue->flows [TPM2_COMMAND_PRIORITY_NORMAL],
+                                      data->connections [0]));
+}
+/*
+ * High priority commands are served ahead of queued normal priority
+ * commands.
+ */
+static void
+fair_queue_priority_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *bulk = data->connections [0];
+    Connection *signer = data->connections [1];
+
+    enqueue_command (data->queue, bulk, TPM2_CC_CreatePrimary);
+    enqueue_command (data->queue, bulk, TPM2_CC_CreatePrimary);
+    enqueue_command_priority (data->queue, signer, TPM2_CC_Sign,
+                              TPM2_COMMAND_PRIORITY_HIGH);
+
+    dequeue_expect (data->queue, signer);
+    dequeue_expect (data->queue, bulk);
+    dequeue_expect (data->queue, bulk);
+}
+/*
+ * A stream of high priority commands can't starve normal priority ones.
+ */
+static void
+fair_queue_priority_burst_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *bulk = data->connections [0];
+    Connection *signer = data->connections [1];
+    size_t i;
+
+    enqueue_command (data->queue, bulk, TPM2_CC_CreatePrimary);
+    for (i = 0; i < FAIR_QUEUE_PRIORITY_BURST + 1; ++i) {
+        enqueue_command_priority (data->queue, signer, TPM2_CC_Sign,
+                                  TPM2_COMMAND_PRIORITY_HIGH);
+    }
+    for (i = 0; i < FAIR_QUEUE_PRIORITY_BURST; ++i) {
+        dequeue_expect (data->queue, signer);
+    }
+    dequeue_expect (data->queue, bulk);
+    dequeue_expect (data->queue, signer);
+}
+/*
+ * fair_queue_remove_connection returns the commands queued for the
+ * connection in order and leaves other connections' commands alone. The
+ * queue length follows.
+ */
+static void
+fair_queue_remove_connection_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    GList *removed;
+
+    enqueue_command (data->queue, data->connections [0], TPM2_CC_PCR_Extend);
+    enqueue_command (data->queue, data->connections [1], TPM2_CC_Sign);
+    enqueue_command (data->queue, data->connections [0], TPM2_CC_GetRandom);
+    assert_int_equal (message_queue_get_length (MESSAGE_QUEUE (data->queue)), 3);
+
+    removed = fair_queue_remove_connection (data->queue,
+                                            data->connections [0]);
+    assert_int_equal (g_list_length (removed), 2);
+    assert_int_equal (message_queue_get_length (MESSAGE_QUEUE (data->queue)), 1);
+    assert_int_equal (tpm2_command_get_code (TPM2_COMMAND (removed->data)),
+                      TPM2_CC_PCR_Extend);
+    assert_int_equal (tpm2_command_get_code (TPM2_COMMAND (removed->next->data)),
+                      TPM2_CC_GetRandom);
+    g_list_free_full (removed, g_object_unref);
+    dequeue_expect (data->queue, data->connections [1]);
+    assert_int_equal (message_queue_get_length (MESSAGE_QUEUE (data->queue)), 0);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (fair_queue_round_robin_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_shortest_first_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_shortest_first_aging_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_degraded_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_fifo_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_affinity_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_locality_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_lease_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_lease_clock_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_weight_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_priority_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_priority_burst_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_remove_connection_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_connection_removed_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
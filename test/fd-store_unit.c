@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "fd-store.h"
+#include "util.h"
+
+typedef struct {
+    gchar    *dir;
+    gchar    *path;
+    gint      sock;
+} test_data_t;
+
+/*
+ * Stand in for the service manager: a datagram socket bound to a path in
+ * a temporary directory that NOTIFY_SOCKET points to.
+ */
+static int
+fd_store_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    data->dir = g_dir_make_tmp ("fd-store-unit-XXXXXX", NULL);
+    assert_non_null (data->dir);
+    data->path = g_build_filename (data->dir, "notify", NULL);
+    assert_true (strlen (data->path) < sizeof (addr.sun_path));
+    strcpy (addr.sun_path, data->path);
+    data->sock = socket (AF_UNIX, SOCK_DGRAM, 0);
+    assert_int_not_equal (data->sock, -1);
+    assert_int_equal (bind (data->sock, (struct sockaddr*)&addr, sizeof (addr)),
+                      0);
+    g_setenv ("NOTIFY_SOCKET", data->path, TRUE);
+
+    *state = data;
+    return 0;
+}
+static int
+fd_store_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    g_unsetenv ("NOTIFY_SOCKET");
+    g_unsetenv ("LISTEN_PID");
+    g_unsetenv ("LISTEN_FDS");
+    g_unsetenv ("LISTEN_FDNAMES");
+    close (data->sock);
+    g_unlink (data->path);
+    g_rmdir (data->dir);
+    g_free (data->path);
+    g_free (data->dir);
+    g_free (data);
+    return 0;
+}
+/*
+ * Receive a notification on the socket standing in for the service
+ * manager. Returns the fd that came with it, -1 if there was none.
+ */
+static gint
+receive_notify (gint   sock,
+                gchar *buf,
+                size_t size)
+{
+    union {
+        struct cmsghdr cmsg;
+        guint8 buf [CMSG_SPACE (sizeof (gint))];
+    } control;
+    struct iovec iov = { .iov_base = buf, .iov_len = size - 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof (control.buf),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+    gint fd = -1;
+
+    ret = recvmsg (sock, &msg, 0);
+    assert_true (ret > 0);
+    buf [ret] = '\0';
+    cmsg = CMSG_FIRSTHDR (&msg);
+    if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy (&fd, CMSG_DATA (cmsg), sizeof (gint));
+    }
+    return fd;
+}
+static void
+fd_store_available_test (void **state)
+{
+    UNUSED_PARAM (state);
+
+    assert_true (fd_store_available ());
+    g_unsetenv ("NOTIFY_SOCKET");
+    assert_false (fd_store_available ());
+    g_setenv ("NOTIFY_SOCKET", "relative", TRUE);
+    assert_false (fd_store_available ());
+}
+/*
+ * fd_store_add sends the fd along with its name, fd_store_remove only
+ * the name.
+ */
+static void
+fd_store_add_remove_test (void **state)
+{
+    test_data_t *data = *state;
+    gchar buf [256];
+    gint fds [2], fd;
+
+    assert_int_equal (pipe (fds), 0);
+    assert_true (fd_store_add ("connection-1", fds [1]));
+    fd = receive_notify (data->sock, buf, sizeof (buf));
+    assert_string_equal (buf, "FDSTORE=1\nFDNAME=connection-1");
+    assert_int_not_equal (fd, -1);
+    assert_int_equal (write (fd, "x", 1), 1);
+    assert_int_equal (read (fds [0], buf, 1), 1);
+    close (fd);
+
+    assert_true (fd_store_remove ("connection-1"));
+    fd = receive_notify (data->sock, buf, sizeof (buf));
+    assert_string_equal (buf, "FDSTOREREMOVE=1\nFDNAME=connection-1");
+    assert_int_equal (fd, -1);
+    close (fds [0]);
+    close (fds [1]);
+}
+static void
+fd_store_add_no_socket_test (void **state)
+{
+    UNUSED_PARAM (state);
+
+    g_unsetenv ("NOTIFY_SOCKET");
+    assert_false (fd_store_add ("connection-1", STDIN_FILENO));
+}
+/*
+ * Names are taken from LISTEN_FDNAMES, fds it doesn't name are "unknown".
+ * Nothing is passed to a process other than LISTEN_PID.
+ */
+static void
+fd_store_listen_fds_test (void **state)
+{
+    gchar **names, *pid;
+    UNUSED_PARAM (state);
+
+    pid = g_strdup_printf ("%d", (gint)getpid ());
+    g_setenv ("LISTEN_PID", pid, TRUE);
+    g_setenv ("LISTEN_FDS", "2", TRUE);
+    g_setenv ("LISTEN_FDNAMES", "tabrmd.socket", TRUE);
+    assert_int_equal (fd_store_listen_fds (&names), 2);
+    assert_string_equal (names [0], "tabrmd.socket");
+    assert_string_equal (names [1], "unknown");
+    assert_null (names [2]);
+    g_strfreev (names);
+
+    g_setenv ("LISTEN_PID", "1", TRUE);
+    assert_int_equal (fd_store_listen_fds (&names), 0);
+    assert_null (names);
+    g_free (pid);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (fd_store_available_test,
+                                         fd_store_setup,
+                                         fd_store_teardown),
+        cmocka_unit_test_setup_teardown (fd_store_add_remove_test,
+                                         fd_store_setup,
+                                         fd_store_teardown),
+        cmocka_unit_test_setup_teardown (fd_store_add_no_socket_test,
+                                         fd_store_setup,
+                                         fd_store_teardown),
+        cmocka_unit_test_setup_teardown (fd_store_listen_fds_test,
+                                         fd_store_setup,
+                                         fd_store_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
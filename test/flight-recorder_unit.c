@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "flight-recorder.h"
+#include "util.h"
+
+/*
+ * Events come out oldest first with what they were recorded with.
+ */
+static void
+flight_recorder_snapshot_test (void **state)
+{
+    flight_record_t *records = g_new (flight_record_t, FLIGHT_RECORDER_SIZE);
+    guint count;
+    UNUSED_PARAM (state);
+
+    flight_recorder_record (FLIGHT_EVENT_RECEIVED, 5, 0x17f, 0);
+    flight_recorder_record (FLIGHT_EVENT_ERROR, 5, 0x17f, 0x101);
+    count = flight_recorder_snapshot (records);
+    assert_true (count >= 2);
+    assert_int_equal (records [count - 2].event, FLIGHT_EVENT_RECEIVED);
+    assert_int_equal (records [count - 1].event, FLIGHT_EVENT_ERROR);
+    assert_int_equal (records [count - 1].connection_id, 5);
+    assert_int_equal (records [count - 1].command_code, 0x17f);
+    assert_int_equal (records [count - 1].rc, 0x101);
+    assert_true (records [count - 2].usec <= records [count - 1].usec);
+    g_free (records);
+}
+/*
+ * Once the ring is full the oldest events are overwritten.
+ */
+static void
+flight_recorder_wrap_test (void **state)
+{
+    flight_record_t *records = g_new (flight_record_t, FLIGHT_RECORDER_SIZE);
+    guint count, i;
+    UNUSED_PARAM (state);
+
+    for (i = 0; i < FLIGHT_RECORDER_SIZE + 10; ++i) {
+        flight_recorder_record (FLIGHT_EVENT_TRANSMIT, i, 0x144, 0);
+    }
+    count = flight_recorder_snapshot (records);
+    assert_int_equal (count, FLIGHT_RECORDER_SIZE);
+    assert_int_equal (records [0].connection_id, 10);
+    assert_int_equal (records [count - 1].connection_id,
+                      FLIGHT_RECORDER_SIZE + 9);
+    g_free (records);
+}
+/*
+ * The dump has a line for each event with its name and fields.
+ */
+static void
+flight_recorder_dump_test (void **state)
+{
+    gchar *path, *text = NULL;
+    GError *error = NULL;
+    gint fd;
+    UNUSED_PARAM (state);
+
+    fd = g_file_open_tmp ("flight-recorder-XXXXXX", &path, NULL);
+    assert_true (fd >= 0);
+    close (fd);
+    flight_recorder_record (FLIGHT_EVENT_SAVE, 0, 0x162, 0x902);
+    assert_true (flight_recorder_dump (path, &error));
+    assert_null (error);
+    assert_true (g_file_get_contents (path, &text, NULL, NULL));
+    assert_true (g_str_has_prefix (text, "# now "));
+    assert_non_null (strstr (text, "save     connection=0x0 cc=0x00000162 "
+                                   "rc=0x00000902\n"));
+    g_free (text);
+    g_unlink (path);
+    g_free (path);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (flight_recorder_snapshot_test),
+        cmocka_unit_test (flight_recorder_wrap_test),
+        cmocka_unit_test (flight_recorder_dump_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -85,6 +85,85 @@ handle_map_entry_get_vhandle_test (void **state)
     assert_int_equal (VHANDLE,
                       handle_map_entry_get_vhandle (data->handle_map_entry));
 }
+/*
+ * The 'last_use' timestamp starts at 0 and returns whatever was last set.
+ */
+static void
+handle_map_entry_last_use_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_int_equal (0, handle_map_entry_get_last_use (data->handle_map_entry));
+    handle_map_entry_set_last_use (data->handle_map_entry, 42);
+    assert_int_equal (42, handle_map_entry_get_last_use (data->handle_map_entry));
+}
+/*
+ * The blob from a ContextSave response is kept as it is: the same bytes
+ * come back without being copied. Before one is saved there's none. A
+ * sequence object's context isn't reusable.
+ */
+static void
+handle_map_entry_context_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 buf [] = {
+        0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, /* sequence */
+        0x80, 0x00, 0x00, 0x01,                         /* savedHandle */
+        0x40, 0x00, 0x00, 0x01,                         /* hierarchy */
+        0x00, 0x04, 0xde, 0xad, 0xbe, 0xef,             /* contextBlob */
+    };
+    GBytes *context;
+
+    assert_null (handle_map_entry_get_context (data->handle_map_entry));
+    context = g_bytes_new (buf, sizeof (buf));
+    handle_map_entry_set_context (data->handle_map_entry, context);
+    assert_ptr_equal (handle_map_entry_get_context (data->handle_map_entry),
+                      context);
+    assert_int_equal (context_blob_saved_handle (context), 0x80000001);
+    assert_true (handle_map_entry_context_reusable (data->handle_map_entry));
+    g_bytes_unref (context);
+
+    buf [11] = 0x02;
+    context = g_bytes_new (buf, sizeof (buf));
+    handle_map_entry_set_context (data->handle_map_entry, context);
+    g_bytes_unref (context);
+    assert_false (handle_map_entry_context_reusable (data->handle_map_entry));
+}
+/*
+ * A spilled context is read back from the store when it's next needed
+ * and is reusable as before.
+ */
+static void
+handle_map_entry_spill_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry = data->handle_map_entry;
+    ContextStore *store;
+    guint8 buf [] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, /* sequence */
+        0x80, 0x00, 0x00, 0x01,                         /* savedHandle */
+        0x40, 0x00, 0x00, 0x01,                         /* hierarchy */
+        0x00, 0x04, 0xde, 0xad, 0xbe, 0xef,             /* contextBlob */
+    };
+    GBytes *context;
+
+    store = context_store_new (g_get_tmp_dir (), CONTEXT_STORE_PAGE_SIZE);
+    assert_non_null (store);
+    assert_false (handle_map_entry_spill (entry, store));
+    context = g_bytes_new (buf, sizeof (buf));
+    handle_map_entry_set_context (entry, context);
+    g_bytes_unref (context);
+    assert_true (handle_map_entry_spill (entry, store));
+    assert_null (entry->context);
+    assert_true (handle_map_entry_context_reusable (entry));
+    assert_int_not_equal (context_store_get_used (store), 0);
+    context = handle_map_entry_get_context (entry);
+    assert_non_null (context);
+    assert_int_equal (context_store_get_used (store), 0);
+    assert_int_equal (g_bytes_get_size (context), sizeof (buf));
+    assert_memory_equal (g_bytes_get_data (context, NULL), buf, sizeof (buf));
+    g_object_unref (store);
+}
 
 gint
 main (void)
@@ -99,6 +178,15 @@ main (void)
         cmocka_unit_test_setup_teardown (handle_map_entry_get_vhandle_test,
                                          handle_map_entry_setup,
                                          handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_last_use_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_context_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_spill_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
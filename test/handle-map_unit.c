@@ -135,6 +135,173 @@ handle_map_next_vhandle_test (void **state)
     handle2 = handle_map_next_vhandle (data->map);
     assert_true (handle2 != handle1);
 }
+/*
+ * A removed vhandle's slot is handed out again but with a new generation,
+ * so the stale handle no longer finds an entry. Slots still in use are
+ * skipped.
+ */
+static void
+handle_map_next_vhandle_reuse_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    TPM2_HANDLE first, second, reused;
+
+    first = handle_map_next_vhandle (data->map);
+    entry = handle_map_entry_new (0, first);
+    handle_map_insert (data->map, first, entry);
+    g_object_unref (entry);
+    second = handle_map_next_vhandle (data->map);
+    assert_int_not_equal (first & HANDLE_MAP_SLOT_MASK,
+                          second & HANDLE_MAP_SLOT_MASK);
+    assert_int_equal (first >> TPM2_HR_SHIFT, TPM2_HT_TRANSIENT);
+
+    assert_true (handle_map_remove (data->map, first));
+    reused = handle_map_next_vhandle (data->map);
+    assert_int_equal (reused & HANDLE_MAP_SLOT_MASK,
+                      first & HANDLE_MAP_SLOT_MASK);
+    assert_int_not_equal (reused, first);
+    entry = handle_map_entry_new (0, reused);
+    handle_map_insert (data->map, reused, entry);
+    g_object_unref (entry);
+    assert_null (handle_map_vlookup (data->map, first));
+}
+/*
+ * A vhandle restored from a checkpoint keeps its slot: the next vhandle
+ * handed out is in another slot. A vhandle of another handle type or in a
+ * slot that's in use isn't restored.
+ */
+static void
+handle_map_restore_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry, *entry_out;
+    TPM2_HANDLE vhandle, next;
+
+    vhandle = (TPM2_HANDLE)TPM2_HT_TRANSIENT << TPM2_HR_SHIFT |
+        5 << HANDLE_MAP_SLOT_BITS;
+    entry = handle_map_entry_new (0, vhandle);
+    assert_true (handle_map_restore (data->map, vhandle, entry));
+    entry_out = handle_map_vlookup (data->map, vhandle);
+    assert_ptr_equal (entry_out, entry);
+    g_object_unref (entry_out);
+    next = handle_map_next_vhandle (data->map);
+    assert_int_not_equal (next & HANDLE_MAP_SLOT_MASK, 0);
+    next = vhandle + (1 << HANDLE_MAP_SLOT_BITS);
+    assert_false (handle_map_restore (data->map, next, entry));
+    assert_false (handle_map_restore (data->map, VHANDLE, entry));
+    g_object_unref (entry);
+}
+/*
+ * vhandles are copied out in ascending order starting at the first one
+ * no smaller than 'start', whatever order they were inserted in.
+ */
+static void
+handle_map_copy_vhandles_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPM2_HANDLE inserted [] = {
+        TPM2_HR_TRANSIENT + 0x300,
+        TPM2_HR_TRANSIENT + 0x100,
+        TPM2_HR_TRANSIENT + 0x500,
+        TPM2_HR_TRANSIENT + 0x200,
+        TPM2_HR_TRANSIENT + 0x400,
+        TPM2_HR_TRANSIENT + 0x600,
+    };
+    TPM2_HANDLE vhandles [G_N_ELEMENTS (inserted)] = { 0 };
+    HandleMapEntry *entry;
+    gboolean more_data;
+    guint i, count;
+
+    count = handle_map_copy_vhandles (data->map, 0, vhandles, 1, &more_data);
+    assert_int_equal (count, 0);
+    assert_false (more_data);
+    for (i = 0; i < G_N_ELEMENTS (inserted); ++i) {
+        entry = handle_map_entry_new (0, inserted [i]);
+        handle_map_insert (data->map, inserted [i], entry);
+        g_object_unref (entry);
+    }
+    handle_map_remove (data->map, TPM2_HR_TRANSIENT + 0x400);
+
+    count = handle_map_copy_vhandles (data->map,
+                                      TPM2_HR_TRANSIENT + 0x150,
+                                      vhandles,
+                                      3,
+                                      &more_data);
+    assert_int_equal (count, 3);
+    assert_true (more_data);
+    assert_int_equal (vhandles [0], TPM2_HR_TRANSIENT + 0x200);
+    assert_int_equal (vhandles [1], TPM2_HR_TRANSIENT + 0x300);
+    assert_int_equal (vhandles [2], TPM2_HR_TRANSIENT + 0x500);
+
+    count = handle_map_copy_vhandles (data->map,
+                                      TPM2_HR_TRANSIENT + 0x500,
+                                      vhandles,
+                                      G_N_ELEMENTS (vhandles),
+                                      &more_data);
+    assert_int_equal (count, 2);
+    assert_false (more_data);
+    assert_int_equal (vhandles [1], TPM2_HR_TRANSIENT + 0x600);
+}
+/*
+ * handle_map_foreach callback counting the entries in 'user_data'.
+ */
+static void
+handle_map_count_callback (gpointer key,
+                           gpointer value,
+                           gpointer user_data)
+{
+    HandleMapEntry *entry = HANDLE_MAP_ENTRY (value);
+
+    assert_int_equal (GPOINTER_TO_INT (key),
+                      handle_map_entry_get_vhandle (entry));
+    ++*(guint*)user_data;
+}
+/*
+ * Fill the inline arrays, remove an entry from the middle and then grow
+ * the map past HANDLE_MAP_INLINE_MAX so that it moves to the hash table.
+ * Every entry remains reachable through lookup, foreach and get_keys.
+ */
+static void
+handle_map_promote_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    TPM2_HANDLE vhandles [HANDLE_MAP_INLINE_MAX + 2];
+    GList *keys;
+    guint i, count = 0;
+
+    for (i = 0; i < HANDLE_MAP_INLINE_MAX; ++i) {
+        vhandles [i] = handle_map_next_vhandle (data->map);
+        entry = handle_map_entry_new (0, vhandles [i]);
+        assert_true (handle_map_insert (data->map, vhandles [i], entry));
+        g_object_unref (entry);
+    }
+    assert_null (data->map->vhandle_to_entry_table);
+    assert_true (handle_map_remove (data->map, vhandles [1]));
+    assert_false (handle_map_remove (data->map, vhandles [1]));
+    assert_null (handle_map_vlookup (data->map, vhandles [1]));
+    vhandles [1] = vhandles [HANDLE_MAP_INLINE_MAX - 1];
+    for (i = HANDLE_MAP_INLINE_MAX - 1; i < HANDLE_MAP_INLINE_MAX + 2; ++i) {
+        vhandles [i] = handle_map_next_vhandle (data->map);
+        entry = handle_map_entry_new (0, vhandles [i]);
+        assert_true (handle_map_insert (data->map, vhandles [i], entry));
+        g_object_unref (entry);
+    }
+    assert_non_null (data->map->vhandle_to_entry_table);
+    assert_int_equal (handle_map_size (data->map), HANDLE_MAP_INLINE_MAX + 2);
+    for (i = 0; i < HANDLE_MAP_INLINE_MAX + 2; ++i) {
+        entry = handle_map_vlookup (data->map, vhandles [i]);
+        assert_non_null (entry);
+        assert_int_equal (handle_map_entry_get_vhandle (entry), vhandles [i]);
+        g_object_unref (entry);
+    }
+    handle_map_foreach (data->map, handle_map_count_callback, &count);
+    assert_int_equal (count, HANDLE_MAP_INLINE_MAX + 2);
+    keys = handle_map_get_keys (data->map);
+    assert_int_equal (g_list_length (keys), HANDLE_MAP_INLINE_MAX + 2);
+    g_list_free (keys);
+}
 int
 main(void)
 {
@@ -154,6 +321,18 @@ main(void)
         cmocka_unit_test_setup_teardown (handle_map_next_vhandle_test,
                                          handle_map_setup_with_entry,
                                          handle_map_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_next_vhandle_reuse_test,
+                                         handle_map_setup_base,
+                                         handle_map_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_restore_test,
+                                         handle_map_setup_base,
+                                         handle_map_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_copy_vhandles_test,
+                                         handle_map_setup_base,
+                                         handle_map_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_promote_test,
+                                         handle_map_setup_base,
+                                         handle_map_teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <sys/resource.h>
+
+#include "bench-util.h"
+
+/*
+ * GCompareFunc ordering gint64 latencies, for g_array_sort.
+ */
+gint
+bench_latency_compare (gconstpointer a,
+                       gconstpointer b)
+{
+    gint64 lat_a = *(const gint64*)a, lat_b = *(const gint64*)b;
+
+    return lat_a < lat_b ? -1 : lat_a > lat_b;
+}
+/*
+ * Return the latency in msec at quantile 'q' of the sorted array.
+ */
+gdouble
+bench_latency_quantile (GArray  *sorted,
+                        gdouble  q)
+{
+    guint index;
+
+    if (sorted->len == 0) {
+        return 0.0;
+    }
+    index = (guint)(q * sorted->len);
+    if (index >= sorted->len) {
+        index = sorted->len - 1;
+    }
+    return g_array_index (sorted, gint64, index) / 1000.0;
+}
+/*
+ * Raise the soft limit on open files as far as the hard limit allows and
+ * return how many connections fit once 'reserved' descriptors are set
+ * aside: each one keeps a socket open.
+ */
+guint
+bench_connections_max (guint reserved)
+{
+    struct rlimit limit;
+
+    if (getrlimit (RLIMIT_NOFILE, &limit) == -1) {
+        return 0;
+    }
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit (RLIMIT_NOFILE, &limit);
+    getrlimit (RLIMIT_NOFILE, &limit);
+    return limit.rlim_cur > reserved ?
+        (guint)MIN (limit.rlim_cur - reserved, G_MAXUINT) : 0;
+}
@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <glib.h>
+
+/*
+ * Helpers shared by the benchmarks: the latency quantiles they report
+ * from a GArray of gint64 latencies in usec, and the number of
+ * connections the open files limit leaves room for.
+ */
+gint        bench_latency_compare    (gconstpointer  a,
+                                      gconstpointer  b);
+gdouble     bench_latency_quantile   (GArray        *sorted,
+                                      gdouble        q);
+guint       bench_connections_max    (guint          reserved);
+
+#endif /* BENCH_UTIL_H */
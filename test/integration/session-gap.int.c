@@ -6,7 +6,10 @@
 #include <tss2/tss2_sys.h>
 
 #include "common.h"
+#include "context-util.h"
+#include "tabrmd-defaults.h"
 #include "test.h"
+#include "test-options.h"
 #define PRIxHANDLE "08" PRIx32
 #define PRIxRC PRIx32
 
@@ -14,6 +17,118 @@
 
 #define MS_SIMULATOR_GAP_MAX UINT8_MAX
 
+/*
+ * The stress phase: sessions held by this connection, and so regapped,
+ * while other connections churn through sessions for this many gap
+ * windows. A cycle taking this many times the median is counted as a
+ * latency spike, most of them are regaps.
+ */
+#define STRESS_LONG_LIVED (TABRMD_SESSIONS_MAX_DEFAULT - 2)
+#define STRESS_CHURNERS 2
+#define STRESS_WINDOWS 4
+#define STRESS_SPIKE_FACTOR 10
+
+static gint
+compare_gint64 (gconstpointer a,
+                gconstpointer b)
+{
+    gint64 x = *(const gint64*)a, y = *(const gint64*)b;
+
+    return x < y ? -1 : x > y;
+}
+/*
+ * Keep sessions saved on this connection, along with 'session_handle',
+ * while STRESS_CHURNERS other connections start, save and flush sessions
+ * for STRESS_WINDOWS gap windows, so TPM2_RC_CONTEXT_GAP comes up again
+ * and again and the ResourceManager regaps the long lived sessions each
+ * time. The latency of the churn cycles is reported: the cycles that hit
+ * a regap stand out as spikes, the daemon's metrics have the number of
+ * regaps and the time they took. The long lived sessions must all still
+ * be usable at the end.
+ */
+static void
+session_gap_stress (TSS2_SYS_CONTEXT     *sapi_context,
+                    TPMI_SH_AUTH_SESSION  session_handle,
+                    UINT32                gap_max)
+{
+    test_opts_t opts = TEST_OPTS_DEFAULT_INIT;
+    TSS2_SYS_CONTEXT *churners [STRESS_CHURNERS];
+    TPMI_SH_AUTH_SESSION long_lived [STRESS_LONG_LIVED + 1];
+    TPMI_SH_AUTH_SESSION handle;
+    TPMS_CONTEXT context;
+    GArray *latencies;
+    gint64 start, median, p99, max;
+    guint cycles = STRESS_WINDOWS * gap_max, spikes = 0, i;
+    TSS2_RC rc;
+
+    get_test_opts_from_env (&opts);
+    if (sanity_check_test_opts (&opts) != 0) {
+        g_error ("%s: bad test options", __func__);
+    }
+    long_lived [0] = session_handle;
+    for (i = 1; i <= STRESS_LONG_LIVED; ++i) {
+        rc = start_auth_session (sapi_context, &long_lived [i]);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_error ("%s: Tss2_Sys_StartAuthSession failed: 0x%" PRIxRC,
+                     __func__, rc);
+        }
+    }
+    for (i = 0; i < STRESS_CHURNERS; ++i) {
+        churners [i] = sapi_init_from_opts (&opts);
+        if (churners [i] == NULL) {
+            g_error ("%s: failed to create SAPI context", __func__);
+        }
+    }
+    g_info ("%s: %u sessions held while %u connections churn through %u "
+            "sessions", __func__, STRESS_LONG_LIVED + 1, STRESS_CHURNERS,
+            cycles);
+    latencies = g_array_sized_new (FALSE, FALSE, sizeof (gint64), cycles);
+    for (i = 0; i < cycles; ++i) {
+        start = g_get_monotonic_time ();
+        rc = start_auth_session (churners [i % STRESS_CHURNERS], &handle);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_error ("%s: Tss2_Sys_StartAuthSession failed in cycle %u: 0x%"
+                     PRIxRC, __func__, i, rc);
+        }
+        rc = Tss2_Sys_ContextSave (churners [i % STRESS_CHURNERS], handle,
+                                   &context);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_error ("%s: Tss2_Sys_ContextSave failed in cycle %u: 0x%"
+                     PRIxRC, __func__, i, rc);
+        }
+        rc = Tss2_Sys_FlushContext (churners [i % STRESS_CHURNERS], handle);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_error ("%s: Tss2_Sys_FlushContext failed in cycle %u: 0x%"
+                     PRIxRC, __func__, i, rc);
+        }
+        start = g_get_monotonic_time () - start;
+        g_array_append_val (latencies, start);
+    }
+    g_array_sort (latencies, compare_gint64);
+    median = g_array_index (latencies, gint64, cycles / 2);
+    p99 = g_array_index (latencies, gint64, cycles * 99 / 100);
+    max = g_array_index (latencies, gint64, cycles - 1);
+    for (i = 0; i < cycles; ++i) {
+        if (g_array_index (latencies, gint64, i) > STRESS_SPIKE_FACTOR * median) {
+            ++spikes;
+        }
+    }
+    g_info ("%s: cycle latency median %" PRId64 " us, p99 %" PRId64 " us, "
+            "max %" PRId64 " us, %u spikes over %u cycles, gap windows "
+            "crossed: %u", __func__, median, p99, max, spikes, cycles,
+            STRESS_WINDOWS);
+    g_array_unref (latencies);
+    for (i = 0; i < STRESS_CHURNERS; ++i) {
+        sapi_teardown_full (churners [i]);
+    }
+    for (i = 0; i <= STRESS_LONG_LIVED; ++i) {
+        rc = Tss2_Sys_PolicyRestart (sapi_context, long_lived [i], NULL, NULL);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_error ("%s: long lived session 0x%" PRIxHANDLE " unusable after "
+                     "the churn: 0x%" PRIxRC, __func__, long_lived [i], rc);
+        }
+    }
+}
 /*
  * This test exercises the resource manager's handling of the session gap
  * mechanism. Currently the RM does not 'virtualize' the GetCapability
@@ -32,6 +147,9 @@
  * this case we cannot use the GAP_MAX property returned by the RM and
  * must assume GAP_MAX to be UINT8_MAX. This test will then become invalid
  * if / when the MS simulator changes the size of their GAP counter.
+ *
+ * Against the RM the test goes on to the stress phase in
+ * session_gap_stress.
  */
 int
 test_invoke (TSS2_SYS_CONTEXT *sapi_context)
@@ -41,6 +159,7 @@ test_invoke (TSS2_SYS_CONTEXT *sapi_context)
     TPMS_CONTEXT context = { 0 }, context_tmp = { 0 };
     UINT32 gap_max = 0;
     UINT64 initial_sequence = 0, last_sequence = 0;
+    gboolean resmgr = FALSE;
 
     rc = get_context_gap_max (sapi_context, &gap_max);
     if (rc != TSS2_RC_SUCCESS) {
@@ -53,6 +172,7 @@ test_invoke (TSS2_SYS_CONTEXT *sapi_context)
                    "gap handling, assuming GAP value is same used by MS "
                    "smiulator: 0x%" PRIx32, __func__, MS_SIMULATOR_GAP_MAX);
         gap_max = MS_SIMULATOR_GAP_MAX;
+        resmgr = TRUE;
     }
     g_info ("%s: Starting unbound, unsalted auth session", __func__);
     rc = start_auth_session (sapi_context, &session_handle);
@@ -109,6 +229,10 @@ test_invoke (TSS2_SYS_CONTEXT *sapi_context)
     g_info("%s: success: last_sequence - initial_sequence: 0x%"
            PRIx64 ", gap_max - 1: 0x%" PRIx32, __func__,
            last_sequence - initial_sequence, gap_max - 1);
+    /* without the RM the TPM would fail the churn with the GAP RC */
+    if (resmgr) {
+        session_gap_stress (sapi_context, session_handle, gap_max);
+    }
 
     return 0;
 }
@@ -0,0 +1,503 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Load generator for tpm2-abrmd. Each of N threads opens its own
+ * connection and sends a weighted random mix of commands, recording the
+ * latency of each. The same workload can then be run against another TCTI
+ * (typically the TPM directly) to measure the overhead of the broker.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tss2/tss2_sys.h>
+
+#include "bench-util.h"
+#include "common.h"
+#include "context-util.h"
+#include "tpm2-struct-init.h"
+
+#define BENCH_CONNECTIONS_DEFAULT 4
+#define BENCH_ITERATIONS_DEFAULT  1000
+#define BENCH_MIX_DEFAULT         "getrandom=1,sign=1,session=1,pcr-extend=1"
+/* resettable PCR for the PCR_Extend workload */
+#define BENCH_PCR                 16
+
+typedef enum {
+    BENCH_OP_GETRANDOM = 0,
+    BENCH_OP_SIGN,
+    BENCH_OP_SESSION,
+    BENCH_OP_PCR_EXTEND,
+    BENCH_OP_COUNT,
+} bench_op_t;
+
+static const char *bench_op_names [BENCH_OP_COUNT] = {
+    [BENCH_OP_GETRANDOM]  = "getrandom",
+    [BENCH_OP_SIGN]       = "sign",
+    [BENCH_OP_SESSION]    = "session",
+    [BENCH_OP_PCR_EXTEND] = "pcr-extend",
+};
+
+typedef struct {
+    guint       connections;
+    guint       iterations;
+    gchar      *mix;
+    gchar      *tabrmd_conf;
+    gchar      *direct;
+    guint       weights [BENCH_OP_COUNT];
+    guint       weight_total;
+} bench_opts_t;
+
+/* a run of the workload against one TCTI */
+typedef struct {
+    const char *name;
+    test_opts_t tcti_opts;
+    /* latencies in usec per operation, GArray of gint64 */
+    GArray     *latencies [BENCH_OP_COUNT];
+    guint       errors;
+    gint64      elapsed;
+    /* start gate so that all connections begin together */
+    GMutex      mutex;
+    GCond       cond;
+    gboolean    go;
+} bench_run_t;
+
+typedef struct {
+    bench_opts_t *opts;
+    bench_run_t  *run;
+    guint         index;
+    GArray       *latencies [BENCH_OP_COUNT];
+    guint         errors;
+} bench_worker_t;
+
+/*
+ * Parse the command mix: a comma separated list of op=weight pairs.
+ */
+static gboolean
+bench_parse_mix (bench_opts_t *opts)
+{
+    gchar **pairs, **pair, *value, *end;
+    guint64 weight;
+    guint op;
+    gboolean ret = TRUE;
+
+    opts->weight_total = 0;
+    pairs = g_strsplit (opts->mix, ",", -1);
+    for (pair = pairs; *pair != NULL && ret; ++pair) {
+        value = strchr (*pair, '=');
+        if (value == NULL) {
+            value = "1";
+        } else {
+            *value++ = '\0';
+        }
+        weight = g_ascii_strtoull (value, &end, 10);
+        if (*end != '\0' || weight > G_MAXUINT16) {
+            fprintf (stderr, "bad weight \"%s\" for \"%s\"\n", value, *pair);
+            ret = FALSE;
+            break;
+        }
+        for (op = 0; op < BENCH_OP_COUNT; ++op) {
+            if (g_strcmp0 (*pair, bench_op_names [op]) == 0) {
+                break;
+            }
+        }
+        if (op == BENCH_OP_COUNT) {
+            fprintf (stderr, "unknown command \"%s\" in mix\n", *pair);
+            ret = FALSE;
+            break;
+        }
+        opts->weights [op] = (guint)weight;
+        opts->weight_total += (guint)weight;
+    }
+    g_strfreev (pairs);
+    if (ret && opts->weight_total == 0) {
+        fprintf (stderr, "command mix has no weight\n");
+        ret = FALSE;
+    }
+    return ret;
+}
+static gboolean
+bench_parse_opts (gint          argc,
+                  gchar        *argv[],
+                  bench_opts_t *opts)
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    gboolean ret;
+    GOptionEntry entries[] = {
+        { "connections", 'c', 0, G_OPTION_ARG_INT, &opts->connections,
+          "Number of concurrent connections (default 4).", "N" },
+        { "iterations", 'n', 0, G_OPTION_ARG_INT, &opts->iterations,
+          "Commands sent on each connection (default 1000).", "N" },
+        { "mix", 'm', 0, G_OPTION_ARG_STRING, &opts->mix,
+          "Command mix as command=weight pairs separated by commas. "
+          "Commands: getrandom, sign, session, pcr-extend. "
+          "Default: " BENCH_MIX_DEFAULT, "mix" },
+        { "tabrmd-conf", 't', 0, G_OPTION_ARG_STRING, &opts->tabrmd_conf,
+          "Configuration string for Tss2_Tcti_Tabrmd_Init.", "conf" },
+        { "direct", 'd', 0, G_OPTION_ARG_STRING, &opts->direct,
+          "Also run the workload on this TCTI (name[:conf], e.g. "
+          "device:/dev/tpmrm0) and report the difference.", "tcti" },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+
+    ctx = g_option_context_new (" - tpm2-abrmd load generator");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    ret = g_option_context_parse (ctx, &argc, &argv, &err);
+    g_option_context_free (ctx);
+    if (!ret) {
+        fprintf (stderr, "%s\n", err->message);
+        g_error_free (err);
+        return FALSE;
+    }
+    if (opts->connections == 0 || opts->iterations == 0) {
+        fprintf (stderr, "connections and iterations must be positive\n");
+        return FALSE;
+    }
+    if (opts->mix == NULL) {
+        opts->mix = g_strdup (BENCH_MIX_DEFAULT);
+    }
+    return bench_parse_mix (opts);
+}
+/*
+ * Pick the next operation at random according to the weights.
+ */
+static bench_op_t
+bench_pick_op (bench_opts_t *opts,
+               GRand        *rand)
+{
+    guint32 pick = g_rand_int_range (rand, 0, (gint32)opts->weight_total);
+    guint op;
+
+    for (op = 0; op < BENCH_OP_COUNT - 1; ++op) {
+        if (pick < opts->weights [op]) {
+            break;
+        }
+        pick -= opts->weights [op];
+    }
+    return (bench_op_t)op;
+}
+/*
+ * Create the signing key used by the 'sign' workload on this connection.
+ */
+static TSS2_RC
+bench_load_key (TSS2_SYS_CONTEXT *sapi,
+                TPM2_HANDLE      *key)
+{
+    TPM2B_PRIVATE out_private = TPM2B_PRIVATE_STATIC_INIT;
+    TPM2B_PUBLIC out_public = { 0 };
+    TPM2_HANDLE parent;
+    TSS2_RC rc;
+
+    rc = create_primary (sapi, &parent);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    rc = create_key (sapi, parent, &out_private, &out_public);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = load_key (sapi, parent, key, &out_private, &out_public);
+    }
+    Tss2_Sys_FlushContext (sapi, parent);
+    return rc;
+}
+static TSS2_RC
+bench_getrandom (TSS2_SYS_CONTEXT *sapi)
+{
+    TPM2B_DIGEST random_bytes = TPM2B_DIGEST_STATIC_INIT;
+
+    return Tss2_Sys_GetRandom (sapi, NULL, 32, &random_bytes, NULL);
+}
+static TSS2_RC
+bench_sign (TSS2_SYS_CONTEXT *sapi,
+            TPM2_HANDLE       key)
+{
+    TSS2L_SYS_AUTH_COMMAND cmd_auths = {
+        .count = 1,
+        .auths = {{ .sessionHandle = TPM2_RS_PW, }},
+    };
+    TPM2B_DIGEST digest = { .size = TPM2_SHA256_DIGEST_SIZE, };
+    TPMT_SIG_SCHEME scheme = {
+        .scheme = TPM2_ALG_RSASSA,
+        .details.rsassa.hashAlg = TPM2_ALG_SHA256,
+    };
+    TPMT_TK_HASHCHECK validation = {
+        .tag = TPM2_ST_HASHCHECK,
+        .hierarchy = TPM2_RH_NULL,
+    };
+    TPMT_SIGNATURE signature = { 0 };
+
+    return Tss2_Sys_Sign (sapi, key, &cmd_auths, &digest, &scheme,
+                          &validation, &signature, NULL);
+}
+static TSS2_RC
+bench_session (TSS2_SYS_CONTEXT *sapi)
+{
+    TPMI_SH_AUTH_SESSION session;
+    TSS2_RC rc;
+
+    rc = start_auth_session_hmac (sapi, &session);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    return Tss2_Sys_FlushContext (sapi, session);
+}
+static TSS2_RC
+bench_pcr_extend (TSS2_SYS_CONTEXT *sapi)
+{
+    TSS2L_SYS_AUTH_COMMAND cmd_auths = {
+        .count = 1,
+        .auths = {{ .sessionHandle = TPM2_RS_PW, }},
+    };
+    TPML_DIGEST_VALUES digests = {
+        .count = 1,
+        .digests = {{ .hashAlg = TPM2_ALG_SHA256, }},
+    };
+
+    return Tss2_Sys_PCR_Extend (sapi, BENCH_PCR, &cmd_auths, &digests, NULL);
+}
+/*
+ * Thread function for one connection: set up, wait for the start gate,
+ * then send 'iterations' commands.
+ */
+static gpointer
+bench_worker_thread (gpointer data)
+{
+    bench_worker_t *worker = (bench_worker_t*)data;
+    bench_opts_t *opts = worker->opts;
+    bench_run_t *run = worker->run;
+    TSS2_SYS_CONTEXT *sapi;
+    TPM2_HANDLE key = 0;
+    GRand *rand = g_rand_new_with_seed (worker->index);
+    bench_op_t op;
+    gint64 start, latency;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    guint i;
+
+    sapi = sapi_init_from_opts (&run->tcti_opts);
+    if (sapi == NULL) {
+        fprintf (stderr, "%s: connection %u failed\n", run->name,
+                 worker->index);
+        worker->errors = opts->iterations;
+    } else if (opts->weights [BENCH_OP_SIGN] > 0 &&
+               bench_load_key (sapi, &key) != TSS2_RC_SUCCESS)
+    {
+        fprintf (stderr, "%s: connection %u failed to load signing key\n",
+                 run->name, worker->index);
+        worker->errors = opts->iterations;
+        sapi_teardown_full (sapi);
+        sapi = NULL;
+    }
+    g_mutex_lock (&run->mutex);
+    while (!run->go) {
+        g_cond_wait (&run->cond, &run->mutex);
+    }
+    g_mutex_unlock (&run->mutex);
+    for (i = 0; sapi != NULL && i < opts->iterations; ++i) {
+        op = bench_pick_op (opts, rand);
+        start = g_get_monotonic_time ();
+        switch (op) {
+        case BENCH_OP_GETRANDOM:
+            rc = TSS2_RETRY_EXP (bench_getrandom (sapi));
+            break;
+        case BENCH_OP_SIGN:
+            rc = TSS2_RETRY_EXP (bench_sign (sapi, key));
+            break;
+        case BENCH_OP_SESSION:
+            rc = TSS2_RETRY_EXP (bench_session (sapi));
+            break;
+        case BENCH_OP_PCR_EXTEND:
+            rc = TSS2_RETRY_EXP (bench_pcr_extend (sapi));
+            break;
+        default:
+            g_assert_not_reached ();
+        }
+        latency = g_get_monotonic_time () - start;
+        if (rc != TSS2_RC_SUCCESS) {
+            g_debug ("%s: %s failed: 0x%" PRIx32, run->name,
+                     bench_op_names [op], rc);
+            ++worker->errors;
+            continue;
+        }
+        g_array_append_val (worker->latencies [op], latency);
+    }
+    if (sapi != NULL) {
+        if (key != 0) {
+            Tss2_Sys_FlushContext (sapi, key);
+        }
+        sapi_teardown_full (sapi);
+    }
+    g_rand_free (rand);
+    return NULL;
+}
+/*
+ * Split a TCTI name[:conf] string into the test options used by
+ * sapi_init_from_opts. A NULL string selects the tabrmd TCTI.
+ */
+static void
+bench_tcti_opts (test_opts_t *tcti_opts,
+                 gchar       *tcti,
+                 const char  *tabrmd_conf)
+{
+    gchar *sep;
+
+    tcti_opts->tcti_retries = 1;
+    if (tcti == NULL) {
+        tcti_opts->tcti_filename = NULL;
+        tcti_opts->tcti_conf = tabrmd_conf;
+        return;
+    }
+    sep = strchr (tcti, ':');
+    if (sep != NULL) {
+        *sep = '\0';
+        tcti_opts->tcti_conf = sep + 1;
+    } else {
+        tcti_opts->tcti_conf = NULL;
+    }
+    tcti_opts->tcti_filename = tcti;
+}
+static void
+bench_run (bench_opts_t *opts,
+           bench_run_t  *run)
+{
+    bench_worker_t *workers = g_new0 (bench_worker_t, opts->connections);
+    GThread **threads = g_new0 (GThread*, opts->connections);
+    gint64 start;
+    guint i, op;
+
+    g_mutex_init (&run->mutex);
+    g_cond_init (&run->cond);
+    for (op = 0; op < BENCH_OP_COUNT; ++op) {
+        run->latencies [op] = g_array_new (FALSE, FALSE, sizeof (gint64));
+    }
+    for (i = 0; i < opts->connections; ++i) {
+        workers [i].opts = opts;
+        workers [i].run = run;
+        workers [i].index = i;
+        for (op = 0; op < BENCH_OP_COUNT; ++op) {
+            workers [i].latencies [op] =
+                g_array_sized_new (FALSE, FALSE, sizeof (gint64),
+                                   opts->iterations);
+        }
+        threads [i] = g_thread_new ("bench", bench_worker_thread, &workers [i]);
+    }
+    /* let connections finish their setup before starting the clock */
+    g_usleep (G_USEC_PER_SEC / 2);
+    g_mutex_lock (&run->mutex);
+    run->go = TRUE;
+    start = g_get_monotonic_time ();
+    g_cond_broadcast (&run->cond);
+    g_mutex_unlock (&run->mutex);
+    for (i = 0; i < opts->connections; ++i) {
+        g_thread_join (threads [i]);
+    }
+    run->elapsed = g_get_monotonic_time () - start;
+    for (i = 0; i < opts->connections; ++i) {
+        run->errors += workers [i].errors;
+        for (op = 0; op < BENCH_OP_COUNT; ++op) {
+            g_array_append_vals (run->latencies [op],
+                                 workers [i].latencies [op]->data,
+                                 workers [i].latencies [op]->len);
+            g_array_free (workers [i].latencies [op], TRUE);
+        }
+    }
+    g_free (threads);
+    g_free (workers);
+    g_cond_clear (&run->cond);
+    g_mutex_clear (&run->mutex);
+}
+static void
+bench_print_row (const char *name,
+                 const char *op,
+                 GArray     *sorted,
+                 gint64      elapsed)
+{
+    printf ("%-8s %-11s %9u %10.1f %9.3f %9.3f %9.3f\n",
+            name, op, sorted->len,
+            sorted->len * (gdouble)G_USEC_PER_SEC / MAX (elapsed, 1),
+            bench_latency_quantile (sorted, 0.5),
+            bench_latency_quantile (sorted, 0.99),
+            bench_latency_quantile (sorted, 0.999));
+}
+/*
+ * Print throughput and latency quantiles per command and for the whole
+ * run. The sorted latencies for the whole run are returned through 'all'.
+ */
+static void
+bench_report (bench_run_t *run,
+              GArray     **all)
+{
+    guint op;
+
+    *all = g_array_new (FALSE, FALSE, sizeof (gint64));
+    for (op = 0; op < BENCH_OP_COUNT; ++op) {
+        if (run->latencies [op]->len == 0) {
+            continue;
+        }
+        g_array_sort (run->latencies [op], bench_latency_compare);
+        bench_print_row (run->name, bench_op_names [op],
+                         run->latencies [op], run->elapsed);
+        g_array_append_vals (*all, run->latencies [op]->data,
+                             run->latencies [op]->len);
+    }
+    g_array_sort (*all, bench_latency_compare);
+    bench_print_row (run->name, "all", *all, run->elapsed);
+    if (run->errors > 0) {
+        printf ("%-8s %u commands failed\n", run->name, run->errors);
+    }
+}
+static void
+bench_run_free (bench_run_t *run)
+{
+    guint op;
+
+    for (op = 0; op < BENCH_OP_COUNT; ++op) {
+        g_array_free (run->latencies [op], TRUE);
+    }
+}
+int
+main (int   argc,
+      char *argv[])
+{
+    bench_opts_t opts = {
+        .connections = BENCH_CONNECTIONS_DEFAULT,
+        .iterations = BENCH_ITERATIONS_DEFAULT,
+    };
+    bench_run_t tabrmd = { .name = "tabrmd", }, direct = { .name = "direct", };
+    GArray *tabrmd_all, *direct_all;
+    gdouble tabrmd_rate, direct_rate;
+
+    if (!bench_parse_opts (argc, argv, &opts)) {
+        return 2;
+    }
+    bench_tcti_opts (&tabrmd.tcti_opts, NULL, opts.tabrmd_conf);
+    printf ("%u connections, %u commands each, mix %s\n",
+            opts.connections, opts.iterations, opts.mix);
+    printf ("%-8s %-11s %9s %10s %9s %9s %9s\n",
+            "target", "command", "count", "ops/s",
+            "p50 ms", "p99 ms", "p999 ms");
+    bench_run (&opts, &tabrmd);
+    bench_report (&tabrmd, &tabrmd_all);
+    if (opts.direct != NULL) {
+        bench_tcti_opts (&direct.tcti_opts, opts.direct, NULL);
+        bench_run (&opts, &direct);
+        bench_report (&direct, &direct_all);
+        tabrmd_rate = tabrmd_all->len / (gdouble)MAX (tabrmd.elapsed, 1);
+        direct_rate = direct_all->len / (gdouble)MAX (direct.elapsed, 1);
+        printf ("overhead: p50 %+.3f ms, p99 %+.3f ms, throughput %+.1f%%\n",
+                bench_latency_quantile (tabrmd_all, 0.5) -
+                    bench_latency_quantile (direct_all, 0.5),
+                bench_latency_quantile (tabrmd_all, 0.99) -
+                    bench_latency_quantile (direct_all, 0.99),
+                direct_rate > 0 ?
+                    (tabrmd_rate - direct_rate) * 100.0 / direct_rate : 0.0);
+        g_array_free (direct_all, TRUE);
+        bench_run_free (&direct);
+    }
+    g_array_free (tabrmd_all, TRUE);
+    bench_run_free (&tabrmd);
+    g_free (opts.mix);
+    g_free (opts.tabrmd_conf);
+    g_free (opts.direct);
+    return tabrmd.errors + direct.errors > 0 ? 1 : 0;
+}
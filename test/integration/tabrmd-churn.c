@@ -0,0 +1,336 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Connection churn generator for tpm2-abrmd. Each of N threads repeatedly
+ * creates a connection, sends it one GetRandom and finalizes it, the way
+ * a short lived tpm2-tools command does. The rate of these cycles and the
+ * latency of each step are reported. Given the daemon's --metrics-socket
+ * the time the daemon spent in each step of setting up and tearing down
+ * the connections is reported too.
+ */
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tss2/tss2_tcti.h>
+
+#include "bench-util.h"
+#include "context-util.h"
+
+#define CHURN_CHURNERS_DEFAULT 1
+#define CHURN_CYCLES_DEFAULT   1000
+#define CHURN_RESPONSE_MAX     64
+
+/* the client side steps of a cycle */
+typedef enum {
+    CHURN_STEP_CONNECT = 0,
+    CHURN_STEP_COMMAND,
+    CHURN_STEP_FINALIZE,
+    CHURN_STEP_CYCLE,
+    CHURN_STEP_COUNT,
+} churn_step_t;
+
+static const char *churn_step_names [CHURN_STEP_COUNT] = {
+    [CHURN_STEP_CONNECT]  = "connect",
+    [CHURN_STEP_COMMAND]  = "first command",
+    [CHURN_STEP_FINALIZE] = "finalize",
+    [CHURN_STEP_CYCLE]    = "cycle",
+};
+/* the daemon's histograms for the steps of a connection's life */
+static const struct {
+    const char *name;
+    const char *metric;
+} churn_daemon_steps [] = {
+    { "dbus CreateConnection", "tabrmd_connect_duration_seconds" },
+    { "  pid lookup", "tabrmd_connect_pid_lookup_duration_seconds" },
+    { "  connection_manager_insert", "tabrmd_connect_insert_duration_seconds" },
+    { "    command_source_on_new_connection", "tabrmd_connect_watch_duration_seconds" },
+    { "teardown CONNECTION_REMOVED", "tabrmd_disconnect_duration_seconds" },
+};
+
+/* TPM2_GetRandom for 8 bytes */
+static const guint8 get_random [] = {
+    0x80, 0x01, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x01, 0x7b, 0x00, 0x08,
+};
+
+typedef struct {
+    guint       churners;
+    guint       cycles;
+    gchar      *tabrmd_conf;
+    gchar      *metrics_socket;
+} churn_opts_t;
+
+typedef struct {
+    churn_opts_t *opts;
+    guint         index;
+    /* latencies in usec per step, GArray of gint64 */
+    GArray       *latencies [CHURN_STEP_COUNT];
+    guint         errors;
+} churn_worker_t;
+
+/* count and sum of a daemon histogram */
+typedef struct {
+    gdouble count;
+    gdouble sum;
+} churn_histogram_t;
+
+static gboolean
+churn_parse_opts (gint          argc,
+                  gchar        *argv[],
+                  churn_opts_t *opts)
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    gboolean ret;
+    GOptionEntry entries[] = {
+        { "churners", 'c', 0, G_OPTION_ARG_INT, &opts->churners,
+          "Number of threads creating connections in parallel (default 1).",
+          "N" },
+        { "cycles", 'n', 0, G_OPTION_ARG_INT, &opts->cycles,
+          "Connections created by each thread (default 1000).", "N" },
+        { "tabrmd-conf", 't', 0, G_OPTION_ARG_STRING, &opts->tabrmd_conf,
+          "Configuration string for Tss2_Tcti_Tabrmd_Init.", "conf" },
+        { "metrics-socket", 'm', 0, G_OPTION_ARG_FILENAME,
+          &opts->metrics_socket,
+          "The daemon's --metrics-socket, to report the time it spent in "
+          "each step.", "path" },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+
+    ctx = g_option_context_new (" - tpm2-abrmd connection churn generator");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    ret = g_option_context_parse (ctx, &argc, &argv, &err);
+    g_option_context_free (ctx);
+    if (!ret) {
+        fprintf (stderr, "%s\n", err->message);
+        g_error_free (err);
+        return FALSE;
+    }
+    if (opts->churners == 0 || opts->cycles == 0) {
+        fprintf (stderr, "churners and cycles must be positive\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * One cycle: create a connection, send it a GetRandom, wait for the
+ * response and finalize the connection. The time of each step is added
+ * to the worker's latencies.
+ */
+static gboolean
+churn_cycle (churn_worker_t *worker,
+             test_opts_t    *tcti_opts)
+{
+    TSS2_TCTI_CONTEXT *tcti;
+    guint8 response [CHURN_RESPONSE_MAX];
+    size_t size = sizeof (response);
+    gint64 start, connected, answered, finalized;
+    gint64 steps [CHURN_STEP_COUNT];
+    guint step;
+    TSS2_RC rc;
+
+    start = g_get_monotonic_time ();
+    tcti = tcti_init_from_opts (tcti_opts);
+    if (tcti == NULL) {
+        return FALSE;
+    }
+    connected = g_get_monotonic_time ();
+    rc = Tss2_Tcti_Transmit (tcti, sizeof (get_random), get_random);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_Tcti_Receive (tcti, &size, response,
+                                TSS2_TCTI_TIMEOUT_BLOCK);
+    }
+    answered = g_get_monotonic_time ();
+    tcti_free_from_opts (tcti_opts, &tcti);
+    finalized = g_get_monotonic_time ();
+    if (rc != TSS2_RC_SUCCESS) {
+        g_debug ("churner %u: GetRandom failed: 0x%" PRIx32,
+                 worker->index, rc);
+        return FALSE;
+    }
+    steps [CHURN_STEP_CONNECT] = connected - start;
+    steps [CHURN_STEP_COMMAND] = answered - connected;
+    steps [CHURN_STEP_FINALIZE] = finalized - answered;
+    steps [CHURN_STEP_CYCLE] = finalized - start;
+    for (step = 0; step < CHURN_STEP_COUNT; ++step) {
+        g_array_append_val (worker->latencies [step], steps [step]);
+    }
+    return TRUE;
+}
+static gpointer
+churn_worker_thread (gpointer data)
+{
+    churn_worker_t *worker = (churn_worker_t*)data;
+    test_opts_t tcti_opts = {
+        .tcti_filename = NULL,
+        .tcti_conf = worker->opts->tabrmd_conf,
+        .tcti_retries = 1,
+    };
+    guint i;
+
+    for (i = 0; i < worker->opts->cycles; ++i) {
+        if (!churn_cycle (worker, &tcti_opts)) {
+            ++worker->errors;
+        }
+    }
+    return NULL;
+}
+/*
+ * Read the count and sum of each of the daemon's connection histograms
+ * from its metrics socket. Returns FALSE if the metrics can't be read.
+ */
+static gboolean
+churn_read_metrics (const gchar       *path,
+                    churn_histogram_t  hists [])
+{
+    GSocketClient *client = g_socket_client_new ();
+    GSocketAddress *address = g_unix_socket_address_new (path);
+    GSocketConnection *connection;
+    GDataInputStream *input;
+    GError *error = NULL;
+    const gchar *request = "GET /metrics HTTP/1.0\r\n\r\n";
+    gchar *line, *name;
+    gdouble *field;
+    gsize i, length;
+
+    memset (hists, 0, G_N_ELEMENTS (churn_daemon_steps) * sizeof (*hists));
+    connection = g_socket_client_connect (client,
+                                          G_SOCKET_CONNECTABLE (address),
+                                          NULL,
+                                          &error);
+    g_object_unref (address);
+    g_object_unref (client);
+    if (connection == NULL) {
+        fprintf (stderr, "failed to connect to %s: %s\n", path,
+                 error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+    if (!g_output_stream_write_all (
+            g_io_stream_get_output_stream (G_IO_STREAM (connection)),
+            request, strlen (request), NULL, NULL, &error))
+    {
+        fprintf (stderr, "failed to request metrics: %s\n", error->message);
+        g_error_free (error);
+        g_object_unref (connection);
+        return FALSE;
+    }
+    input = g_data_input_stream_new (
+        g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+    g_data_input_stream_set_newline_type (input,
+                                          G_DATA_STREAM_NEWLINE_TYPE_ANY);
+    while ((line = g_data_input_stream_read_line (input, &length,
+                                                  NULL, NULL)) != NULL) {
+        for (i = 0; i < G_N_ELEMENTS (churn_daemon_steps); ++i) {
+            if (!g_str_has_prefix (line, churn_daemon_steps [i].metric)) {
+                continue;
+            }
+            name = line + strlen (churn_daemon_steps [i].metric);
+            if (g_str_has_prefix (name, "_count ")) {
+                field = &hists [i].count;
+            } else if (g_str_has_prefix (name, "_sum ")) {
+                field = &hists [i].sum;
+            } else {
+                continue;
+            }
+            *field = g_ascii_strtod (strchr (name, ' ') + 1, NULL);
+        }
+        g_free (line);
+    }
+    g_object_unref (input);
+    g_object_unref (connection);
+    return TRUE;
+}
+int
+main (int   argc,
+      char *argv[])
+{
+    churn_opts_t opts = {
+        .churners = CHURN_CHURNERS_DEFAULT,
+        .cycles = CHURN_CYCLES_DEFAULT,
+    };
+    churn_worker_t *workers;
+    GThread **threads;
+    GArray *latencies [CHURN_STEP_COUNT];
+    churn_histogram_t before [G_N_ELEMENTS (churn_daemon_steps)];
+    churn_histogram_t after [G_N_ELEMENTS (churn_daemon_steps)];
+    gboolean have_metrics = FALSE;
+    gint64 start, elapsed;
+    guint i, step, errors = 0;
+
+    if (!churn_parse_opts (argc, argv, &opts)) {
+        return 2;
+    }
+    if (opts.metrics_socket != NULL) {
+        have_metrics = churn_read_metrics (opts.metrics_socket, before);
+    }
+    workers = g_new0 (churn_worker_t, opts.churners);
+    threads = g_new0 (GThread*, opts.churners);
+    start = g_get_monotonic_time ();
+    for (i = 0; i < opts.churners; ++i) {
+        workers [i].opts = &opts;
+        workers [i].index = i;
+        for (step = 0; step < CHURN_STEP_COUNT; ++step) {
+            workers [i].latencies [step] =
+                g_array_sized_new (FALSE, FALSE, sizeof (gint64), opts.cycles);
+        }
+        threads [i] = g_thread_new ("churn", churn_worker_thread, &workers [i]);
+    }
+    for (i = 0; i < opts.churners; ++i) {
+        g_thread_join (threads [i]);
+    }
+    elapsed = g_get_monotonic_time () - start;
+
+    for (step = 0; step < CHURN_STEP_COUNT; ++step) {
+        latencies [step] = g_array_new (FALSE, FALSE, sizeof (gint64));
+        for (i = 0; i < opts.churners; ++i) {
+            g_array_append_vals (latencies [step],
+                                 workers [i].latencies [step]->data,
+                                 workers [i].latencies [step]->len);
+        }
+        g_array_sort (latencies [step], bench_latency_compare);
+    }
+    for (i = 0; i < opts.churners; ++i) {
+        errors += workers [i].errors;
+        for (step = 0; step < CHURN_STEP_COUNT; ++step) {
+            g_array_free (workers [i].latencies [step], TRUE);
+        }
+    }
+    printf ("%u churners, %u cycles each: %.1f cycles/s, %u failed\n",
+            opts.churners, opts.cycles,
+            latencies [CHURN_STEP_CYCLE]->len * (gdouble)G_USEC_PER_SEC /
+                MAX (elapsed, 1),
+            errors);
+    printf ("%-36s %9s %9s %9s %9s\n",
+            "client step", "p50 ms", "p90 ms", "p99 ms", "p999 ms");
+    for (step = 0; step < CHURN_STEP_COUNT; ++step) {
+        printf ("%-36s %9.3f %9.3f %9.3f %9.3f\n",
+                churn_step_names [step],
+                bench_latency_quantile (latencies [step], 0.5),
+                bench_latency_quantile (latencies [step], 0.9),
+                bench_latency_quantile (latencies [step], 0.99),
+                bench_latency_quantile (latencies [step], 0.999));
+        g_array_free (latencies [step], TRUE);
+    }
+    if (have_metrics && churn_read_metrics (opts.metrics_socket, after)) {
+        printf ("%-36s %9s %9s\n", "daemon step", "count", "mean ms");
+        for (i = 0; i < G_N_ELEMENTS (churn_daemon_steps); ++i) {
+            gdouble count = after [i].count - before [i].count;
+
+            printf ("%-36s %9.0f %9.3f\n",
+                    churn_daemon_steps [i].name,
+                    count,
+                    count > 0 ?
+                        (after [i].sum - before [i].sum) * 1000.0 / count :
+                        0.0);
+        }
+    }
+    g_free (threads);
+    g_free (workers);
+    g_free (opts.tabrmd_conf);
+    g_free (opts.metrics_socket);
+    return errors > 0 ? 1 : 0;
+}
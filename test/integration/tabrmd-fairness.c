@@ -0,0 +1,394 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Fairness and starvation stress for the tpm2-abrmd scheduler. Three kinds
+ * of client share the daemon for a fixed time:
+ * - bulk clients send Sign commands on their own key back to back,
+ * - interactive clients send a GetRandom and then wait for a while,
+ * - long clients create a primary key and flush it over and over.
+ * The share of the commands each client got through, Jain's fairness index
+ * over the clients of each kind and the tail latency of each kind are
+ * reported so that scheduler policies can be compared.
+ *
+ * The commands are built by hand with no authorization so this is meant to
+ * be run against the daemon loaded with the TCTI from test/tcti-bench.c,
+ * which only models how long each command takes.
+ */
+#include <endian.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tss2/tss2_tcti.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "bench-util.h"
+#include "context-util.h"
+#include "tpm2-header.h"
+
+#define FAIR_BULK_DEFAULT        2
+#define FAIR_INTERACTIVE_DEFAULT 4
+#define FAIR_LONG_DEFAULT        1
+#define FAIR_DURATION_DEFAULT    10
+#define FAIR_THINK_DEFAULT       50
+#define FAIR_BUF_SIZE            128
+
+typedef enum {
+    FAIR_BULK = 0,
+    FAIR_INTERACTIVE,
+    FAIR_LONG,
+    FAIR_KIND_COUNT,
+} fair_kind_t;
+
+static const char *fair_kind_names [FAIR_KIND_COUNT] = {
+    [FAIR_BULK]        = "bulk",
+    [FAIR_INTERACTIVE] = "interactive",
+    [FAIR_LONG]        = "long",
+};
+
+typedef struct {
+    guint       counts [FAIR_KIND_COUNT];
+    guint       duration;
+    guint       think;
+    gchar      *tabrmd_conf;
+} fair_opts_t;
+
+/* state shared by the clients of a run */
+typedef struct {
+    fair_opts_t *opts;
+    /* start gate so that all clients begin together */
+    GMutex       mutex;
+    GCond        cond;
+    gboolean     go;
+    gint         stop;
+} fair_run_t;
+
+typedef struct {
+    fair_run_t  *run;
+    fair_kind_t  kind;
+    guint        index;
+    /* latencies in usec of the commands that succeeded, GArray of gint64 */
+    GArray      *latencies;
+    guint        errors;
+} fair_client_t;
+
+static gboolean
+fair_parse_opts (gint         argc,
+                 gchar       *argv[],
+                 fair_opts_t *opts)
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    gboolean ret;
+    GOptionEntry entries[] = {
+        { "bulk", 'b', 0, G_OPTION_ARG_INT, &opts->counts [FAIR_BULK],
+          "Clients sending Sign commands back to back (default 2).", "N" },
+        { "interactive", 'i', 0, G_OPTION_ARG_INT,
+          &opts->counts [FAIR_INTERACTIVE],
+          "Clients sending a GetRandom every --think msec (default 4).", "N" },
+        { "long", 'l', 0, G_OPTION_ARG_INT, &opts->counts [FAIR_LONG],
+          "Clients creating and flushing primary keys (default 1).", "N" },
+        { "duration", 'd', 0, G_OPTION_ARG_INT, &opts->duration,
+          "Seconds to run for (default 10).", "SECONDS" },
+        { "think", 'k', 0, G_OPTION_ARG_INT, &opts->think,
+          "Time interactive clients wait between commands (default 50).",
+          "MSEC" },
+        { "tabrmd-conf", 't', 0, G_OPTION_ARG_STRING, &opts->tabrmd_conf,
+          "Configuration string for Tss2_Tcti_Tabrmd_Init.", "conf" },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+
+    ctx = g_option_context_new (" - tpm2-abrmd scheduler fairness stress");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    ret = g_option_context_parse (ctx, &argc, &argv, &err);
+    g_option_context_free (ctx);
+    if (!ret) {
+        fprintf (stderr, "%s\n", err->message);
+        g_error_free (err);
+        return FALSE;
+    }
+    if (opts->duration == 0 ||
+        opts->counts [FAIR_BULK] + opts->counts [FAIR_INTERACTIVE] +
+        opts->counts [FAIR_LONG] == 0)
+    {
+        fprintf (stderr, "need a duration and at least one client\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * Build a command with no sessions in 'buf' followed by 'value', a handle
+ * or a parameter, of 'value_size' bytes: 0, 2 or 4. Returns its size.
+ */
+static size_t
+fair_command (guint8  *buf,
+              TPM2_CC  code,
+              guint32  value,
+              size_t   value_size)
+{
+    size_t size = TPM_HEADER_SIZE + value_size;
+
+    *(TPM2_ST*)buf = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buf + 2) = htobe32 (size);
+    *(TPM2_CC*)(buf + 6) = htobe32 (code);
+    if (value_size == sizeof (guint16)) {
+        *(guint16*)(buf + TPM_HEADER_SIZE) = htobe16 ((guint16)value);
+    } else if (value_size == sizeof (guint32)) {
+        *(guint32*)(buf + TPM_HEADER_SIZE) = htobe32 (value);
+    }
+    return size;
+}
+/*
+ * Send a command and wait for its response. Returns the response code and,
+ * if the response has one, its handle in 'handle'. The latency of a
+ * successful command is recorded if 'record' is set.
+ */
+static TSS2_RC
+fair_send (fair_client_t     *client,
+           TSS2_TCTI_CONTEXT *tcti,
+           const guint8      *command,
+           size_t             size,
+           TPM2_HANDLE       *handle,
+           gboolean           record)
+{
+    guint8 response [FAIR_BUF_SIZE];
+    size_t response_size = sizeof (response);
+    gint64 start, latency;
+    TSS2_RC rc;
+
+    start = g_get_monotonic_time ();
+    rc = Tss2_Tcti_Transmit (tcti, size, command);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_Tcti_Receive (tcti, &response_size, response,
+                                TSS2_TCTI_TIMEOUT_BLOCK);
+    }
+    latency = g_get_monotonic_time () - start;
+    if (rc == TSS2_RC_SUCCESS && response_size >= TPM_HEADER_SIZE) {
+        rc = be32toh (*(TSS2_RC*)(response + 6));
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        ++client->errors;
+        return rc;
+    }
+    if (handle != NULL && response_size >= TPM_HEADER_SIZE + 4) {
+        *handle = be32toh (*(TPM2_HANDLE*)(response + TPM_HEADER_SIZE));
+    }
+    if (record) {
+        g_array_append_val (client->latencies, latency);
+    }
+    return rc;
+}
+static gpointer
+fair_client_thread (gpointer data)
+{
+    fair_client_t *client = (fair_client_t*)data;
+    fair_run_t *run = client->run;
+    test_opts_t tcti_opts = {
+        .tcti_filename = NULL,
+        .tcti_conf = run->opts->tabrmd_conf,
+        .tcti_retries = 1,
+    };
+    TSS2_TCTI_CONTEXT *tcti;
+    guint8 command [FAIR_BUF_SIZE];
+    TPM2_HANDLE key = 0, primary;
+    size_t size;
+
+    tcti = tcti_init_from_opts (&tcti_opts);
+    if (tcti == NULL) {
+        fprintf (stderr, "%s client %u failed to connect\n",
+                 fair_kind_names [client->kind], client->index);
+        ++client->errors;
+    } else if (client->kind == FAIR_BULK) {
+        size = fair_command (command, TPM2_CC_LoadExternal, 0, 0);
+        fair_send (client, tcti, command, size, &key, FALSE);
+    }
+    g_mutex_lock (&run->mutex);
+    while (!run->go) {
+        g_cond_wait (&run->cond, &run->mutex);
+    }
+    g_mutex_unlock (&run->mutex);
+    while (tcti != NULL && !g_atomic_int_get (&run->stop)) {
+        switch (client->kind) {
+        case FAIR_BULK:
+            size = fair_command (command, TPM2_CC_Sign, key, sizeof (key));
+            fair_send (client, tcti, command, size, NULL, TRUE);
+            break;
+        case FAIR_INTERACTIVE:
+            /* 16 bytesRequested */
+            size = fair_command (command, TPM2_CC_GetRandom, 16,
+                                 sizeof (guint16));
+            fair_send (client, tcti, command, size, NULL, TRUE);
+            g_usleep (run->opts->think * 1000);
+            break;
+        case FAIR_LONG:
+            size = fair_command (command, TPM2_CC_CreatePrimary,
+                                 TPM2_RH_OWNER, sizeof (TPM2_HANDLE));
+            if (fair_send (client, tcti, command, size, &primary, TRUE) ==
+                TSS2_RC_SUCCESS)
+            {
+                size = fair_command (command, TPM2_CC_FlushContext,
+                                     primary, sizeof (primary));
+                fair_send (client, tcti, command, size, NULL, FALSE);
+            }
+            break;
+        default:
+            g_assert_not_reached ();
+        }
+    }
+    if (tcti != NULL) {
+        if (key != 0) {
+            size = fair_command (command, TPM2_CC_FlushContext, key, sizeof (key));
+            fair_send (client, tcti, command, size, NULL, FALSE);
+        }
+        tcti_free_from_opts (&tcti_opts, &tcti);
+    }
+    return NULL;
+}
+/*
+ * Jain's fairness index of 'count' throughputs: 1 when they're all equal,
+ * 1 / count when a single client gets everything.
+ */
+static gdouble
+jain_index (const gdouble *values,
+            guint          count)
+{
+    gdouble sum = 0.0, sum_squares = 0.0;
+    guint i;
+
+    for (i = 0; i < count; ++i) {
+        sum += values [i];
+        sum_squares += values [i] * values [i];
+    }
+    return sum_squares > 0.0 ? sum * sum / (count * sum_squares) : 1.0;
+}
+static void
+fair_print_row (const char *name,
+                guint       commands,
+                guint       total,
+                gdouble     seconds,
+                GArray     *sorted)
+{
+    printf ("%-16s %9u %7.1f %9.1f %9.3f %9.3f %9.3f\n",
+            name, commands,
+            total > 0 ? commands * 100.0 / total : 0.0,
+            commands / seconds,
+            bench_latency_quantile (sorted, 0.5),
+            bench_latency_quantile (sorted, 0.99),
+            bench_latency_quantile (sorted, 0.999));
+}
+int
+main (int   argc,
+      char *argv[])
+{
+    fair_opts_t opts = {
+        .counts = {
+            [FAIR_BULK] = FAIR_BULK_DEFAULT,
+            [FAIR_INTERACTIVE] = FAIR_INTERACTIVE_DEFAULT,
+            [FAIR_LONG] = FAIR_LONG_DEFAULT,
+        },
+        .duration = FAIR_DURATION_DEFAULT,
+        .think = FAIR_THINK_DEFAULT,
+    };
+    fair_run_t run = { 0 };
+    fair_client_t *clients;
+    GThread **threads;
+    GArray *kind_latencies [FAIR_KIND_COUNT];
+    gdouble *rates;
+    guint kind_commands [FAIR_KIND_COUNT] = { 0 };
+    guint client_count, total = 0, errors = 0, kind, first, i, j;
+    gdouble seconds;
+    gchar name [32];
+    gint64 start;
+
+    if (!fair_parse_opts (argc, argv, &opts)) {
+        return 2;
+    }
+    client_count = opts.counts [FAIR_BULK] + opts.counts [FAIR_INTERACTIVE] +
+        opts.counts [FAIR_LONG];
+    clients = g_new0 (fair_client_t, client_count);
+    threads = g_new0 (GThread*, client_count);
+    rates = g_new0 (gdouble, client_count);
+    run.opts = &opts;
+    g_mutex_init (&run.mutex);
+    g_cond_init (&run.cond);
+    for (kind = 0, i = 0; kind < FAIR_KIND_COUNT; ++kind) {
+        for (j = 0; j < opts.counts [kind]; ++j, ++i) {
+            clients [i].run = &run;
+            clients [i].kind = (fair_kind_t)kind;
+            clients [i].index = j;
+            clients [i].latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+            threads [i] = g_thread_new ("fair", fair_client_thread, &clients [i]);
+        }
+    }
+    /* let clients connect and load their keys before starting the clock */
+    g_usleep (G_USEC_PER_SEC / 2);
+    g_mutex_lock (&run.mutex);
+    run.go = TRUE;
+    start = g_get_monotonic_time ();
+    g_cond_broadcast (&run.cond);
+    g_mutex_unlock (&run.mutex);
+    g_usleep ((gulong)opts.duration * G_USEC_PER_SEC);
+    g_atomic_int_set (&run.stop, TRUE);
+    for (i = 0; i < client_count; ++i) {
+        g_thread_join (threads [i]);
+    }
+    seconds = (g_get_monotonic_time () - start) / (gdouble)G_USEC_PER_SEC;
+
+    for (i = 0; i < client_count; ++i) {
+        total += clients [i].latencies->len;
+        errors += clients [i].errors;
+    }
+    printf ("%u bulk, %u interactive and %u long clients for %.1f s\n",
+            opts.counts [FAIR_BULK], opts.counts [FAIR_INTERACTIVE],
+            opts.counts [FAIR_LONG], seconds);
+    printf ("%-16s %9s %7s %9s %9s %9s %9s\n",
+            "client", "commands", "share%", "ops/s",
+            "p50 ms", "p99 ms", "p999 ms");
+    for (kind = 0; kind < FAIR_KIND_COUNT; ++kind) {
+        kind_latencies [kind] = g_array_new (FALSE, FALSE, sizeof (gint64));
+    }
+    for (i = 0; i < client_count; ++i) {
+        kind = clients [i].kind;
+        g_array_sort (clients [i].latencies, bench_latency_compare);
+        g_snprintf (name, sizeof (name), "%s %u",
+                    fair_kind_names [kind], clients [i].index);
+        fair_print_row (name, clients [i].latencies->len, total, seconds,
+                        clients [i].latencies);
+        rates [i] = clients [i].latencies->len / seconds;
+        kind_commands [kind] += clients [i].latencies->len;
+        g_array_append_vals (kind_latencies [kind],
+                             clients [i].latencies->data,
+                             clients [i].latencies->len);
+    }
+    for (kind = 0; kind < FAIR_KIND_COUNT; ++kind) {
+        g_array_sort (kind_latencies [kind], bench_latency_compare);
+        g_snprintf (name, sizeof (name), "all %s", fair_kind_names [kind]);
+        fair_print_row (name, kind_commands [kind], total, seconds,
+                        kind_latencies [kind]);
+        g_array_free (kind_latencies [kind], TRUE);
+    }
+    printf ("Jain's fairness index:");
+    for (kind = 0, first = 0; kind < FAIR_KIND_COUNT; ++kind) {
+        if (opts.counts [kind] > 0) {
+            printf (" %s %.3f", fair_kind_names [kind],
+                    jain_index (&rates [first], opts.counts [kind]));
+        }
+        first += opts.counts [kind];
+    }
+    printf ("\n");
+    if (errors > 0) {
+        printf ("%u commands failed\n", errors);
+    }
+
+    for (i = 0; i < client_count; ++i) {
+        g_array_free (clients [i].latencies, TRUE);
+    }
+    g_cond_clear (&run.cond);
+    g_mutex_clear (&run.mutex);
+    g_free (rates);
+    g_free (threads);
+    g_free (clients);
+    g_free (opts.tabrmd_conf);
+    return errors > 0 ? 1 : 0;
+}
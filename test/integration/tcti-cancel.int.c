@@ -27,6 +27,8 @@ test_invoke (TSS2_SYS_CONTEXT *sapi_context)
         0x00, 0x01, 0x00, 0x00, 0x00, 0x40
     };
     size_t cmd_buffer_size = sizeof (cmd_buffer);
+    uint8_t resp_buffer [TPM2_MAX_COMMAND_SIZE] = { 0 };
+    size_t resp_buffer_size = sizeof (resp_buffer);
 
     rc = Tss2_Sys_GetTctiContext (sapi_context, &tcti_context);
     if (rc != TSS2_RC_SUCCESS || tcti_context == NULL) {
@@ -41,13 +43,23 @@ test_invoke (TSS2_SYS_CONTEXT *sapi_context)
     }
     g_info ("invoking tss2_tcti_tabrmd_cancel");
     rc = Tss2_Tcti_Cancel (tcti_context);
-    if (rc == TSS2_RESMGR_RC_NOT_IMPLEMENTED) {
-        g_warning ("Tss2_Tcti_Cancel failed as expected: 0x%" PRIx32,
-                   rc);
-        return 0;
-    } else {
+    /* the TCTI used by the daemon may not support cancellation */
+    if (rc != TSS2_RC_SUCCESS && rc != TSS2_TCTI_RC_NOT_IMPLEMENTED) {
         g_critical ("Tss2_Tcti_Cancel returned unexpected rc: 0x%"
                     PRIx32, rc);
         return 1;
     }
+    /*
+     * The command either completed before the cancel request arrived or
+     * it was canceled. Either way we must get a response.
+     */
+    rc = Tss2_Tcti_Receive (tcti_context,
+                            &resp_buffer_size,
+                            resp_buffer,
+                            TSS2_TCTI_TIMEOUT_BLOCK);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_critical ("Tss2_Tcti_Receive failed after cancel: 0x%" PRIx32, rc);
+        return 1;
+    }
+    return 0;
 }
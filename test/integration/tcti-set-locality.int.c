@@ -5,6 +5,7 @@
  */
 #include <glib.h>
 #include <inttypes.h>
+#include <unistd.h>
 
 #include "tabrmd.h"
 #include "tss2-tcti-tabrmd.h"
@@ -14,7 +15,32 @@
 #define ENV_NUM_KEYS "TABRMD_TEST_NUM_KEYS"
 
 /*
- * This is a test program to exercise the TCTI set locality command.
+ * Call Tss2_Tcti_SetLocality for 'locality' and check that it returns
+ * 'expected'. Returns 0 if it does.
+ */
+static int
+set_locality_expect (TSS2_TCTI_CONTEXT *tcti_context,
+                     uint8_t            locality,
+                     TSS2_RC            expected)
+{
+    TSS2_RC rc;
+
+    g_info ("invoking tss2_tcti_tabrmd_set_locality for locality %" PRIu8,
+            locality);
+    rc = Tss2_Tcti_SetLocality (tcti_context, locality);
+    if (rc != expected) {
+        g_critical ("tss2_tcti_tabrmd_set_locality for locality %" PRIu8
+                    " returned rc 0x%" PRIx32 ", expected 0x%" PRIx32,
+                    locality, rc, expected);
+        return 1;
+    }
+    return 0;
+}
+/*
+ * This is a test program to exercise the TCTI set locality command. A
+ * locality above 4 is always refused. The daemon is started without
+ * --locality-uid, so locality 1 is only granted when the test runs as
+ * root and refused otherwise. Locality 0 is always granted.
  */
 int
 test_invoke (TSS2_SYS_CONTEXT *sapi_context)
@@ -27,15 +53,18 @@ test_invoke (TSS2_SYS_CONTEXT *sapi_context)
         g_critical ("Tss2_Sys_GetTctiContext failed: 0x%" PRIx32, rc);
         return 1;
     }
-    g_info ("invoking tss2_tcti_tabrmd_set_locality");
-    rc = Tss2_Tcti_SetLocality (tcti_context, 1);
-    if (rc == TSS2_RESMGR_RC_NOT_IMPLEMENTED) {
-        g_info ("tss2_tcti_tabrmd_set_locality failed as expected: 0x%" PRIx32,
-                rc);
-        return 0;
-    } else {
-        g_critical ("tss2_tcti_tabrmd_set_locality returned unexpected rc: 0x%"
-                    PRIx32, rc);
+    if (set_locality_expect (tcti_context,
+                             TPM2_LOC_FOUR + 1,
+                             TSS2_RESMGR_RC_NOT_PERMITTED) != 0 ||
+        set_locality_expect (tcti_context,
+                             1,
+                             geteuid () == 0 ?
+                                 TSS2_RC_SUCCESS :
+                                 TSS2_RESMGR_RC_NOT_PERMITTED) != 0 ||
+        set_locality_expect (tcti_context, 0, TSS2_RC_SUCCESS) != 0)
+    {
         return 1;
     }
+    g_info ("tss2_tcti_tabrmd_set_locality behaved as expected");
+    return 0;
 }
@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ipc-frontend-socket.h"
+#include "socket-protocol.h"
+#include "tabrmd.h"
+#include "util.h"
+
+typedef struct {
+    IpcFrontendSocket *frontend;
+    ConnectionManager *connection_manager;
+    gchar             *address;
+} test_data_t;
+
+static int
+ipc_frontend_socket_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+    Random *random = NULL;
+    gint ret = 0;
+
+    random = random_new ();
+    ret = random_seed_from_file (random, "/dev/urandom");
+    assert_int_equal (ret, 0);
+
+    data->connection_manager = connection_manager_new (10);
+    data->address = g_strdup_printf ("@tabrmd-socket-unit-%d", getpid ());
+    data->frontend = ipc_frontend_socket_new (data->address,
+                                              data->connection_manager,
+                                              100,
+                                              random);
+    assert_non_null (data->frontend);
+    ipc_frontend_connect (IPC_FRONTEND (data->frontend), NULL);
+    assert_non_null (data->frontend->service);
+    g_object_unref (random);
+    *state = data;
+    return 0;
+}
+
+static int
+ipc_frontend_socket_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    g_object_unref (data->frontend);
+    g_object_unref (data->connection_manager);
+    g_free (data->address);
+    g_free (data);
+    return 0;
+}
+/*
+ * Send 'request' to the frontend the way the TCTI does and dispatch the
+ * default GMainContext until the response arrives.
+ * Returns the client socket.
+ */
+static GSocket*
+send_request (test_data_t                     *data,
+              const socket_protocol_request_t *request,
+              socket_protocol_response_t      *response)
+{
+    GSocketAddress *address;
+    GSocket *sock;
+    gssize ret;
+
+    sock = g_socket_new (G_SOCKET_FAMILY_UNIX,
+                         G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_DEFAULT,
+                         NULL);
+    assert_non_null (sock);
+    address = socket_protocol_address_new (data->address);
+    assert_true (g_socket_connect (sock, address, NULL, NULL));
+    g_object_unref (address);
+    ret = g_socket_send (sock,
+                         (const gchar*)request,
+                         sizeof (*request),
+                         NULL,
+                         NULL);
+    assert_int_equal (ret, sizeof (*request));
+    while (!g_socket_condition_check (sock, G_IO_IN)) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    ret = g_socket_receive (sock,
+                            (gchar*)response,
+                            sizeof (*response),
+                            NULL,
+                            NULL);
+    assert_int_equal (ret, sizeof (*response));
+    return sock;
+}
+/*
+ * Ensure that the object system identifies the IpcFrontendSocket as both
+ * the abstract base type and the derived type.
+ */
+static void
+ipc_frontend_socket_type_test (void **state)
+{
+    test_data_t *data = *state;
+
+    assert_true (IS_IPC_FRONTEND (data->frontend));
+    assert_true (IS_IPC_FRONTEND_SOCKET (data->frontend));
+}
+/*
+ * Create a connection through the socket. The connection's ID is mixed
+ * with our PID from the socket's peer credentials. A cancel for it reaches
+ * the 'cancel' signal, which nobody handles here.
+ */
+static void
+ipc_frontend_socket_create_connection_test (void **state)
+{
+    test_data_t *data = *state;
+    socket_protocol_request_t request = {
+        .version = SOCKET_PROTOCOL_VERSION,
+        .op = SOCKET_PROTOCOL_CREATE_CONNECTION,
+        .tpm = 0,
+        .transport = TABRMD_TRANSPORT_SOCKET,
+    };
+    socket_protocol_response_t response = { 0 };
+    Connection *connection;
+    GSocket *sock, *control;
+
+    sock = send_request (data, &request, &response);
+    assert_int_equal (response.rc, TSS2_RC_SUCCESS);
+    assert_int_equal (connection_manager_size (data->connection_manager), 1);
+    connection = connection_manager_lookup_id (data->connection_manager,
+                                               response.id ^ getpid ());
+    assert_non_null (connection);
+    g_object_unref (connection);
+
+    request.op = SOCKET_PROTOCOL_CANCEL;
+    request.id = response.id;
+    control = send_request (data, &request, &response);
+    assert_int_equal (response.rc, TSS2_RESMGR_RC_NOT_IMPLEMENTED);
+    g_object_unref (control);
+    g_object_unref (sock);
+}
+/*
+ * Requests for a TPM the daemon doesn't have and to cancel a connection
+ * that doesn't exist are refused.
+ */
+static void
+ipc_frontend_socket_not_permitted_test (void **state)
+{
+    test_data_t *data = *state;
+    socket_protocol_request_t request = {
+        .version = SOCKET_PROTOCOL_VERSION,
+        .op = SOCKET_PROTOCOL_CREATE_CONNECTION,
+        .tpm = 1,
+        .transport = TABRMD_TRANSPORT_SOCKET,
+    };
+    socket_protocol_response_t response = { 0 };
+    GSocket *sock;
+
+    sock = send_request (data, &request, &response);
+    assert_int_equal (response.rc, TSS2_RESMGR_RC_NOT_PERMITTED);
+    g_object_unref (sock);
+    assert_int_equal (connection_manager_size (data->connection_manager), 0);
+
+    request.op = SOCKET_PROTOCOL_CANCEL;
+    request.id = 0x1234;
+    sock = send_request (data, &request, &response);
+    assert_int_equal (response.rc, TSS2_RESMGR_RC_NOT_PERMITTED);
+    g_object_unref (sock);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (ipc_frontend_socket_type_test,
+                                         ipc_frontend_socket_setup,
+                                         ipc_frontend_socket_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_socket_create_connection_test,
+                                         ipc_frontend_socket_setup,
+                                         ipc_frontend_socket_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_socket_not_permitted_test,
+                                         ipc_frontend_socket_setup,
+                                         ipc_frontend_socket_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,212 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ipc-frontend-vtpm.h"
+#include "util.h"
+
+typedef struct {
+    IpcFrontendVtpm   *frontend;
+    ConnectionManager *connection_manager;
+    /* QEMU's end of the control channel */
+    gint               qemu_fd;
+} test_data_t;
+
+static int
+ipc_frontend_vtpm_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+    GIOStream *control;
+    Random *random;
+    gint fd;
+
+    random = random_new ();
+    assert_int_equal (random_seed_from_file (random, "/dev/urandom"), 0);
+    data->connection_manager = connection_manager_new (10);
+    data->frontend = ipc_frontend_vtpm_new ("@tabrmd-vtpm-unit",
+                                            data->connection_manager,
+                                            100,
+                                            random);
+    assert_int_equal (create_socket_pair (&data->qemu_fd, &fd, 0), 0);
+    control = create_connection_iostream_fd (fd);
+    ipc_frontend_vtpm_add_vm (data->frontend,
+                              G_SOCKET_CONNECTION (control),
+                              1000,
+                              getpid ());
+    g_object_unref (control);
+    g_object_unref (random);
+    *state = data;
+    return 0;
+}
+static int
+ipc_frontend_vtpm_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    close (data->qemu_fd);
+    g_object_unref (data->frontend);
+    g_object_unref (data->connection_manager);
+    g_free (data);
+    return 0;
+}
+/*
+ * Send control command 'cmd' with 'request', passing 'fd' along unless
+ * it's -1, then dispatch the default GMainContext until 'size' bytes of
+ * response are in.
+ */
+static void
+control_command (test_data_t *data,
+                 guint32      cmd,
+                 const void  *request,
+                 size_t       request_size,
+                 gint         fd,
+                 void        *response,
+                 size_t       size)
+{
+    union {
+        struct cmsghdr header;
+        guint8         buf [CMSG_SPACE (sizeof (gint))];
+    } control;
+    struct pollfd pollfd = { .fd = data->qemu_fd, .events = POLLIN };
+    guint8 buf [sizeof (guint32) + 16];
+    struct cmsghdr *cmsg;
+    struct msghdr msg = { 0 };
+    struct iovec iov;
+
+    cmd = GUINT32_TO_BE (cmd);
+    memcpy (buf, &cmd, sizeof (cmd));
+    if (request_size > 0) {
+        memcpy (&buf [sizeof (cmd)], request, request_size);
+    }
+    iov.iov_base = buf;
+    iov.iov_len = sizeof (cmd) + request_size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd != -1) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof (control.buf);
+        cmsg = CMSG_FIRSTHDR (&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN (sizeof (fd));
+        memcpy (CMSG_DATA (cmsg), &fd, sizeof (fd));
+    }
+    assert_int_equal (sendmsg (data->qemu_fd, &msg, 0), iov.iov_len);
+    while (poll (&pollfd, 1, 0) == 0) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    assert_int_equal (read (data->qemu_fd, response, size), size);
+}
+/*
+ * The capabilities come back as a big endian uint64 with no result.
+ */
+static void
+ipc_frontend_vtpm_get_capability_test (void **state)
+{
+    test_data_t *data = *state;
+    guint64 caps;
+
+    control_command (data, VTPM_CMD_GET_CAPABILITY, NULL, 0, -1,
+                     &caps, sizeof (caps));
+    assert_int_equal (GUINT64_FROM_BE (caps), VTPM_CAPABILITIES);
+}
+/*
+ * A locality above 4 is refused, one above 0 too unless the UID of the
+ * VM's QEMU may use it.
+ */
+static void
+ipc_frontend_vtpm_set_locality_test (void **state)
+{
+    test_data_t *data = *state;
+    guint8 locality [4] = { 5, 0, 0, 0 };
+    guint32 result;
+
+    control_command (data, VTPM_CMD_SET_LOCALITY, locality, sizeof (locality),
+                     -1, &result, sizeof (result));
+    assert_int_equal (GUINT32_FROM_BE (result), VTPM_RESULT_BAD_PARAMETER);
+    locality [0] = 3;
+    control_command (data, VTPM_CMD_SET_LOCALITY, locality, sizeof (locality),
+                     -1, &result, sizeof (result));
+    assert_int_equal (GUINT32_FROM_BE (result), VTPM_RESULT_BAD_LOCALITY);
+    connection_allow_locality_uid (1000);
+    control_command (data, VTPM_CMD_SET_LOCALITY, locality, sizeof (locality),
+                     -1, &result, sizeof (result));
+    assert_int_equal (GUINT32_FROM_BE (result), VTPM_RESULT_SUCCESS);
+}
+/*
+ * A control command that comes in parts doesn't hold up the main loop:
+ * it's answered once the rest of it is in.
+ */
+static void
+ipc_frontend_vtpm_partial_command_test (void **state)
+{
+    test_data_t *data = *state;
+    struct pollfd pollfd = { .fd = data->qemu_fd, .events = POLLIN };
+    guint32 cmd = GUINT32_TO_BE (VTPM_CMD_SET_BUFFERSIZE);
+    guint32 request = GUINT32_TO_BE (VTPM_BUFFER_SIZE_MIN);
+    guint32 response [4];
+
+    assert_int_equal (write (data->qemu_fd, &cmd, sizeof (cmd)), sizeof (cmd));
+    while (g_main_context_iteration (NULL, FALSE)) {
+        ;
+    }
+    assert_int_equal (poll (&pollfd, 1, 0), 0);
+    assert_int_equal (write (data->qemu_fd, &request, sizeof (request)),
+                      sizeof (request));
+    while (poll (&pollfd, 1, 0) == 0) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    assert_int_equal (read (data->qemu_fd, response, sizeof (response)),
+                      sizeof (response));
+    assert_int_equal (GUINT32_FROM_BE (response [0]), VTPM_RESULT_SUCCESS);
+    assert_int_equal (GUINT32_FROM_BE (response [1]), VTPM_BUFFER_SIZE_MIN);
+}
+/*
+ * The data channel passed with SET_DATAFD becomes a Connection, a second
+ * one is refused.
+ */
+static void
+ipc_frontend_vtpm_set_datafd_test (void **state)
+{
+    test_data_t *data = *state;
+    gint data_fds [2];
+    guint32 result;
+
+    assert_int_equal (create_socket_pair (&data_fds [0], &data_fds [1], 0), 0);
+    control_command (data, VTPM_CMD_SET_DATAFD, NULL, 0, data_fds [1],
+                     &result, sizeof (result));
+    assert_int_equal (GUINT32_FROM_BE (result), VTPM_RESULT_SUCCESS);
+    assert_int_equal (connection_manager_size (data->connection_manager), 1);
+    control_command (data, VTPM_CMD_SET_DATAFD, NULL, 0, data_fds [1],
+                     &result, sizeof (result));
+    assert_int_equal (GUINT32_FROM_BE (result), VTPM_RESULT_FAIL);
+    assert_int_equal (connection_manager_size (data->connection_manager), 1);
+    close (data_fds [0]);
+    close (data_fds [1]);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (ipc_frontend_vtpm_get_capability_test,
+                                         ipc_frontend_vtpm_setup,
+                                         ipc_frontend_vtpm_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_vtpm_set_locality_test,
+                                         ipc_frontend_vtpm_setup,
+                                         ipc_frontend_vtpm_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_vtpm_partial_command_test,
+                                         ipc_frontend_vtpm_setup,
+                                         ipc_frontend_vtpm_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_vtpm_set_datafd_test,
+                                         ipc_frontend_vtpm_setup,
+                                         ipc_frontend_vtpm_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
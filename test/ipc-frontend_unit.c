@@ -13,6 +13,7 @@
 #include "util.h"
 #include "handle-map.h"
 #include "ipc-frontend.h"
+#include "tabrmd.h"
 /*
  * Begin definition of TestIpcFrontend.
  * This is a GObject that derives from the IpcFrontend abstract base class.
@@ -196,6 +197,45 @@ ipc_frontend_disconnect_test (void **state)
     ipc_frontend_disconnect (ipc_frontend);
     assert_false (test_ipc_frontend->connected);
 }
+/*
+ * Without a handler for the 'cancel' signal cancellation isn't supported.
+ */
+static void
+ipc_frontend_cancel_no_handler_test (void **state)
+{
+    assert_int_equal (ipc_frontend_cancel_invoke (IPC_FRONTEND (*state), NULL),
+                      TSS2_RESMGR_RC_NOT_IMPLEMENTED);
+}
+/*
+ * This callback is used by ipc_frontend_cancel_test. It returns the RC
+ * provided through the user data.
+ */
+static guint
+ipc_frontend_on_cancel (IpcFrontend *ipc_frontend,
+                        Connection  *connection,
+                        TSS2_RC     *rc)
+{
+    UNUSED_PARAM(ipc_frontend);
+    UNUSED_PARAM(connection);
+
+    return *rc;
+}
+/*
+ * The RC returned by the 'cancel' handler is returned by
+ * ipc_frontend_cancel_invoke.
+ */
+static void
+ipc_frontend_cancel_test (void **state)
+{
+    IpcFrontend *ipc_frontend = IPC_FRONTEND (*state);
+    TSS2_RC rc = TSS2_TCTI_RC_NOT_IMPLEMENTED;
+
+    g_signal_connect (ipc_frontend,
+                      "cancel",
+                      (GCallback) ipc_frontend_on_cancel,
+                      &rc);
+    assert_int_equal (ipc_frontend_cancel_invoke (ipc_frontend, NULL), rc);
+}
 
 gint
 main (void)
@@ -213,6 +253,12 @@ main (void)
         cmocka_unit_test_setup_teardown (ipc_frontend_disconnect_test,
                                          ipc_frontend_setup,
                                          ipc_frontend_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_cancel_no_handler_test,
+                                         ipc_frontend_setup,
+                                         ipc_frontend_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_cancel_test,
+                                         ipc_frontend_setup,
+                                         ipc_frontend_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
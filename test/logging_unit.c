@@ -59,6 +59,47 @@ logging_get_enabled_log_levels_foo_test (void **state)
     assert_int_equal (levels, LOG_LEVEL_DEFAULT);
 }
 
+/*
+ * The first check decides from G_MESSAGES_DEBUG, later checks don't look
+ * at the environment again.
+ */
+static void
+logging_debug_check_all_test (void **state)
+{
+    UNUSED_PARAM(state);
+
+    logging_debug_state = LOGGING_DEBUG_UNKNOWN;
+    will_return (__wrap_getenv, env_str_all);
+    assert_true (tabrmd_debug_enabled ());
+    assert_true (tabrmd_debug_enabled ());
+    assert_int_equal (logging_debug_state, LOGGING_DEBUG_ON);
+}
+static void
+logging_debug_check_default_test (void **state)
+{
+    UNUSED_PARAM(state);
+
+    logging_debug_state = LOGGING_DEBUG_UNKNOWN;
+    will_return (__wrap_getenv, NULL);
+    assert_false (tabrmd_debug_enabled ());
+    assert_false (tabrmd_debug_enabled ());
+    assert_int_equal (logging_debug_state, LOGGING_DEBUG_OFF);
+}
+/*
+ * logging_set_debug_enabled overrides the environment.
+ */
+static void
+logging_set_debug_enabled_test (void **state)
+{
+    UNUSED_PARAM(state);
+
+    logging_debug_state = LOGGING_DEBUG_UNKNOWN;
+    logging_set_debug_enabled (TRUE);
+    assert_true (tabrmd_debug_enabled ());
+    logging_set_debug_enabled (FALSE);
+    assert_false (tabrmd_debug_enabled ());
+}
+
 static void
 logging_set_logger_foo_test (void **state)
 {
@@ -79,6 +120,89 @@ logging_set_logger_syslog_test (void **state)
     UNUSED_PARAM(state);
     will_return (__wrap_getenv, NULL);
     assert_int_equal (set_logger ("syslog"), 0);
+    logging_shutdown ();
+}
+/*
+ * Only LOGGING_RATELIMIT_BURST messages get through in an interval, the
+ * rest are counted and reported once the interval is over.
+ */
+static void
+logging_ratelimit_check_test (void **state)
+{
+    logging_ratelimit_t limit = { 0 };
+    guint i, suppressed;
+    UNUSED_PARAM(state);
+
+    for (i = 0; i < LOGGING_RATELIMIT_BURST; ++i) {
+        assert_true (logging_ratelimit_check (&limit, &suppressed));
+    }
+    assert_false (logging_ratelimit_check (&limit, &suppressed));
+    assert_false (logging_ratelimit_check (&limit, &suppressed));
+    assert_int_equal (suppressed, 0);
+    /* pretend the interval is over */
+    limit.window -= 1;
+    assert_true (logging_ratelimit_check (&limit, &suppressed));
+    assert_int_equal (suppressed, 2);
+    assert_true (logging_ratelimit_check (&limit, &suppressed));
+    assert_int_equal (suppressed, 0);
+}
+/*
+ * Records come out of the ring in the order they were put in. Once it's
+ * full records are dropped and counted.
+ */
+static void
+logging_ring_put_take_test (void **state)
+{
+    logging_ring_t *ring = g_new0 (logging_ring_t, 1);
+    logging_record_t record;
+    gchar *message;
+    guint i;
+    UNUSED_PARAM(state);
+
+    assert_false (logging_ring_take (ring, &record));
+    for (i = 0; i < LOGGING_RING_SIZE; ++i) {
+        message = g_strdup_printf ("message %u", i);
+        assert_true (logging_ring_put (ring, G_LOG_LEVEL_INFO, "domain", message));
+        g_free (message);
+    }
+    assert_false (logging_ring_put (ring, G_LOG_LEVEL_INFO, "domain", "lost"));
+    assert_int_equal (logging_ring_take_dropped (ring), 1);
+    assert_int_equal (logging_ring_take_dropped (ring), 0);
+    for (i = 0; i < LOGGING_RING_SIZE; ++i) {
+        message = g_strdup_printf ("message %u", i);
+        assert_true (logging_ring_take (ring, &record));
+        assert_string_equal (record.message, message);
+        assert_string_equal (record.domain, "domain");
+        assert_int_equal (record.level, G_LOG_LEVEL_INFO);
+        assert_false (record.has_command);
+        g_free (message);
+    }
+    assert_false (logging_ring_take (ring, &record));
+    g_free (ring);
+}
+/*
+ * Records carry the command set for the thread that logs them.
+ */
+static void
+logging_ring_command_test (void **state)
+{
+    logging_ring_t *ring = g_new0 (logging_ring_t, 1);
+    logging_record_t record;
+    UNUSED_PARAM(state);
+
+    logging_set_command (0x42, 0x17b);
+    logging_set_rc (0x101);
+    assert_true (logging_ring_put (ring, G_LOG_LEVEL_WARNING, NULL, "foo"));
+    logging_clear_command ();
+    assert_true (logging_ring_put (ring, G_LOG_LEVEL_WARNING, NULL, "bar"));
+    assert_true (logging_ring_take (ring, &record));
+    assert_true (record.has_command);
+    assert_int_equal (record.connection_id, 0x42);
+    assert_int_equal (record.command_code, 0x17b);
+    assert_int_equal (record.rc, 0x101);
+    assert_true (logging_ring_take (ring, &record));
+    assert_false (record.has_command);
+    g_free (ring);
 }
 
 void
@@ -177,9 +301,15 @@ main (void)
         cmocka_unit_test (logging_get_enabled_log_levels_default_test),
         cmocka_unit_test (logging_get_enabled_log_levels_all_test),
         cmocka_unit_test (logging_get_enabled_log_levels_foo_test),
+        cmocka_unit_test (logging_debug_check_all_test),
+        cmocka_unit_test (logging_debug_check_default_test),
+        cmocka_unit_test (logging_set_debug_enabled_test),
         cmocka_unit_test (logging_set_logger_foo_test),
         cmocka_unit_test (logging_set_logger_stdout_test),
         cmocka_unit_test (logging_set_logger_syslog_test),
+        cmocka_unit_test (logging_ratelimit_check_test),
+        cmocka_unit_test (logging_ring_put_take_test),
+        cmocka_unit_test (logging_ring_command_test),
         cmocka_unit_test (logging_syslog_log_handler_fatal_test),
         cmocka_unit_test (logging_syslog_log_handler_error_test),
         cmocka_unit_test (logging_syslog_log_handler_critical_test),
@@ -0,0 +1,285 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Memory footprint of the broker's per client state at its limits:
+ * every connection the ConnectionManager takes, each holding as many
+ * transient objects and sessions as it may, all of them saved. The RSS,
+ * heap in use and number of allocations are reported for the connections
+ * alone and then per object and per session, at the default limits and
+ * at raised ones.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tss2/tss2_mu.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "connection.h"
+#include "connection-manager.h"
+#include "handle-map.h"
+#include "integration/bench-util.h"
+#include "mem-account.h"
+#include "session-entry.h"
+#include "session-list.h"
+#include "tabrmd-defaults.h"
+#include "util.h"
+
+/*
+ * Sizes of the context blobs a TPM returns from ContextSave, roughly what
+ * a dTPM gives for a 2048 bit RSA key and for an HMAC session.
+ */
+#define MEMORY_BENCH_OBJECT_BLOB  900
+#define MEMORY_BENCH_SESSION_BLOB 180
+/*
+ * The raised connection count: the per connection figures scale linearly
+ * so there's no need to fill the 16384 connections the daemon allows.
+ */
+#define MEMORY_BENCH_CONNECTIONS_RAISED 512
+
+typedef struct {
+    const gchar *name;
+    guint        connections;
+    guint        transients;
+    guint        sessions;
+} memory_bench_limits_t;
+
+typedef struct {
+    gsize   rss;
+    gsize   heap;
+    guint64 allocations;
+} memory_sample_t;
+
+/*
+ * Allocations are counted by interposing malloc and friends, which needs
+ * glibc's __libc_* entry points.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static guint64 allocations;
+
+void*
+malloc (size_t size)
+{
+    ++allocations;
+    return __libc_malloc (size);
+}
+void*
+calloc (size_t count,
+        size_t size)
+{
+    ++allocations;
+    return __libc_calloc (count, size);
+}
+void*
+realloc (void  *ptr,
+         size_t size)
+{
+    ++allocations;
+    return __libc_realloc (ptr, size);
+}
+#endif
+
+/*
+ * Resident set size from /proc/self/statm and the bytes malloc has handed
+ * out and not had back.
+ */
+static void
+memory_sample (memory_sample_t *sample)
+{
+    gchar *statm = NULL;
+    gulong size = 0, resident = 0;
+
+    if (g_file_get_contents ("/proc/self/statm", &statm, NULL, NULL)) {
+        sscanf (statm, "%lu %lu", &size, &resident);
+        g_free (statm);
+    }
+    sample->rss = resident * (gsize)sysconf (_SC_PAGESIZE);
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ (2, 33)
+    sample->heap = mallinfo2 ().uordblks;
+#else
+    sample->heap = (guint)mallinfo ().uordblks;
+#endif
+    sample->allocations = allocations;
+#else
+    sample->heap = 0;
+    sample->allocations = 0;
+#endif
+}
+static void
+memory_report (const gchar           *name,
+               guint                  count,
+               const memory_sample_t *before,
+               const memory_sample_t *after)
+{
+    gdouble n = MAX (count, 1);
+
+    printf ("%-22s %7u %12.1f %12.1f %10.1f\n",
+            name,
+            count,
+            ((gdouble)after->rss - before->rss) / n,
+            ((gdouble)after->heap - before->heap) / n,
+            ((gdouble)after->allocations - before->allocations) / n);
+}
+/*
+ * A saved context with a 'blob_size' byte blob.
+ */
+static void
+memory_context_init (TPMS_CONTEXT *context,
+                     TPM2_HANDLE   handle,
+                     guint64       sequence,
+                     UINT16        blob_size)
+{
+    memset (context, 0, sizeof (*context));
+    context->sequence = sequence;
+    context->savedHandle = handle;
+    context->hierarchy = TPM2_RH_OWNER;
+    context->contextBlob.size = blob_size;
+    memset (context->contextBlob.buffer, 0xa5, blob_size);
+}
+static void
+memory_bench_run (const memory_bench_limits_t *limits)
+{
+    ConnectionManager *manager;
+    SessionList *session_list;
+    Connection **connections;
+    HandleMap *map;
+    HandleMapEntry *entry;
+    SessionEntry *session;
+    GIOStream *iostream;
+    TPMS_CONTEXT context;
+    guint8 buf [sizeof (TPMS_CONTEXT)];
+    GBytes *bytes;
+    memory_sample_t start, connected, objects, sessions, freed;
+    TPM2_HANDLE vhandle;
+    guint64 sequence = 1;
+    size_t size;
+    gint client_fd;
+    guint i, j;
+
+    printf ("%s: %u connections, %u transients and %u sessions each\n",
+            limits->name, limits->connections, limits->transients,
+            limits->sessions);
+    memory_sample (&start);
+    manager = connection_manager_new (limits->connections);
+    session_list = session_list_new (limits->sessions,
+                                     SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    connections = g_new0 (Connection*, limits->connections);
+    for (i = 0; i < limits->connections; ++i) {
+        map = handle_map_new (TPM2_HT_TRANSIENT, limits->transients);
+        iostream = create_connection_iostream (&client_fd);
+        connections [i] = connection_new (iostream, i, map);
+        connection_manager_insert (manager, connections [i]);
+        g_object_unref (iostream);
+        g_object_unref (map);
+        close (client_fd);
+    }
+    memory_sample (&connected);
+
+    for (i = 0; i < limits->connections; ++i) {
+        map = connection_get_trans_map (connections [i]);
+        for (j = 0; j < limits->transients; ++j) {
+            vhandle = handle_map_next_vhandle (map);
+            entry = handle_map_entry_new (0, vhandle);
+            memory_context_init (&context, TPM2_TRANSIENT_FIRST + j,
+                                 sequence++, MEMORY_BENCH_OBJECT_BLOB);
+            size = 0;
+            if (Tss2_MU_TPMS_CONTEXT_Marshal (&context, buf, sizeof (buf),
+                                              &size) != TSS2_RC_SUCCESS)
+            {
+                g_error ("%s: failed to marshal TPMS_CONTEXT", __func__);
+            }
+            bytes = g_bytes_new (buf, size);
+            handle_map_entry_set_context (entry, bytes);
+            g_bytes_unref (bytes);
+            handle_map_insert (map, vhandle, entry);
+            g_object_unref (entry);
+        }
+        g_object_unref (map);
+    }
+    memory_sample (&objects);
+
+    for (i = 0; i < limits->connections; ++i) {
+        for (j = 0; j < limits->sessions; ++j) {
+            session = session_entry_new (connections [i],
+                                         TPM2_HMAC_SESSION_FIRST +
+                                         i * limits->sessions + j);
+            memory_context_init (&context,
+                                 session_entry_get_handle (session),
+                                 sequence++, MEMORY_BENCH_SESSION_BLOB);
+            size = 0;
+            if (Tss2_MU_TPMS_CONTEXT_Marshal (&context, buf, sizeof (buf),
+                                              &size) != TSS2_RC_SUCCESS)
+            {
+                g_error ("%s: failed to marshal TPMS_CONTEXT", __func__);
+            }
+            session_entry_set_context (session, buf, size);
+            session_list_insert (session_list, session);
+            g_object_unref (session);
+        }
+    }
+    memory_sample (&sessions);
+
+    printf ("%-22s %7s %12s %12s %10s\n",
+            "", "n", "rss B/n", "heap B/n", "allocs/n");
+    memory_report ("connection", limits->connections, &start, &connected);
+    memory_report ("transient object",
+                   limits->connections * limits->transients,
+                   &connected, &objects);
+    memory_report ("session", limits->connections * limits->sessions,
+                   &objects, &sessions);
+    memory_report ("full connection", limits->connections, &start, &sessions);
+    printf ("%-22s %7s %12" G_GSIZE_FORMAT " B\n",
+            "contexts in memory", "", mem_account_get (MEM_ACCOUNT_CONTEXTS));
+
+    for (i = 0; i < limits->connections; ++i) {
+        while (session_list_remove_connection (session_list, connections [i]));
+        connection_manager_remove (manager, connections [i]);
+        g_object_unref (connections [i]);
+    }
+    g_free (connections);
+    g_object_unref (session_list);
+    g_object_unref (manager);
+    memory_sample (&freed);
+    printf ("%-22s %7s %12.0f %12.0f B\n\n", "left after teardown", "",
+            (gdouble)freed.rss - start.rss, (gdouble)freed.heap - start.heap);
+}
+int
+main (void)
+{
+    memory_bench_limits_t limits [] = {
+        {
+            .name = "defaults",
+            .connections = TABRMD_CONNECTIONS_MAX_DEFAULT,
+            .transients = TABRMD_TRANSIENT_MAX_DEFAULT,
+            .sessions = TABRMD_SESSIONS_MAX_DEFAULT,
+        },
+        {
+            .name = "raised",
+            .connections = MEMORY_BENCH_CONNECTIONS_RAISED,
+            .transients = TABRMD_TRANSIENT_MAX,
+            .sessions = TABRMD_SESSIONS_MAX,
+        },
+    };
+    guint connections_max = bench_connections_max (TABRMD_FDS_RESERVED);
+    size_t i;
+
+    /* count GSList and GQueue nodes as the allocations they are */
+    g_setenv ("G_SLICE", "always-malloc", TRUE);
+    for (i = 0; i < G_N_ELEMENTS (limits); ++i) {
+        if (limits [i].connections > connections_max) {
+            printf ("%s: %u connections need more fds than the %u available\n",
+                    limits [i].name, limits [i].connections, connections_max);
+            limits [i].connections = connections_max;
+        }
+        memory_bench_run (&limits [i]);
+    }
+    return 0;
+}
@@ -4,6 +4,7 @@
  * All rights reserved.
  */
 #include <glib.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdlib.h>
 
@@ -110,6 +111,73 @@ message_queue_dequeue_order_test (void **state)
     g_object_unref (obj_1);
     g_object_unref (obj_2);
 }
+/*
+ * try_dequeue returns NULL from an empty queue instead of blocking.
+ */
+static void
+message_queue_try_dequeue_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msg = control_message_new (CHECK_CANCEL);
+    GObject *obj;
+
+    assert_null (message_queue_try_dequeue (data->queue));
+    message_queue_enqueue (data->queue, G_OBJECT (msg));
+    obj = message_queue_try_dequeue (data->queue);
+    assert_ptr_equal (obj, msg);
+    assert_null (message_queue_try_dequeue (data->queue));
+    g_object_unref (obj);
+    g_object_unref (msg);
+}
+/*
+ * try_enqueue refuses messages once the queue holds max_length of them
+ * and accepts them again when there's room.
+ */
+static void
+message_queue_try_enqueue_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msg = control_message_new (CHECK_CANCEL);
+    GObject *obj;
+
+    message_queue_set_max_length (data->queue, 2);
+    assert_true (message_queue_try_enqueue (data->queue, G_OBJECT (msg)));
+    assert_true (message_queue_try_enqueue (data->queue, G_OBJECT (msg)));
+    assert_false (message_queue_try_enqueue (data->queue, G_OBJECT (msg)));
+    assert_int_equal (message_queue_get_length (data->queue), 2);
+    obj = message_queue_try_dequeue (data->queue);
+    g_object_unref (obj);
+    assert_true (message_queue_try_enqueue (data->queue, G_OBJECT (msg)));
+    g_object_unref (msg);
+}
+/*
+ * Spinning finds a waiting message, gives up on an empty queue after the
+ * budget and is skipped once the last message took too long to arrive.
+ */
+static void
+message_queue_spin_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msg = control_message_new (CHECK_CANCEL);
+    GObject *obj;
+
+    assert_false (message_queue_spin (data->queue));
+    message_queue_set_spin (data->queue, 50);
+    assert_false (message_queue_spin (data->queue));
+    message_queue_enqueue (data->queue, G_OBJECT (msg));
+    assert_true (message_queue_spin (data->queue));
+    obj = message_queue_dequeue (data->queue);
+    assert_ptr_equal (obj, msg);
+    g_object_unref (obj);
+    /* the queue looks idle: block at once even with a message waiting */
+    data->queue->last_wait = 50 * MESSAGE_QUEUE_SPIN_IDLE_FACTOR + 1;
+    message_queue_enqueue (data->queue, G_OBJECT (msg));
+    assert_false (message_queue_spin (data->queue));
+    obj = message_queue_dequeue (data->queue);
+    assert_ptr_equal (obj, msg);
+    g_object_unref (obj);
+    g_object_unref (msg);
+}
 /*
  * This function is used in the thread_unblock_test function as the thread
  * that blocks on the MessageQueue waiting for a message.
@@ -145,6 +213,131 @@ message_queue_thread_unblock_test (void **state)
     ret = pthread_join (thread_id, NULL);
     assert_int_equal (ret, 0);
 }
+/*
+ * try_dequeue_all takes every waiting message in FIFO order.
+ */
+static void
+message_queue_try_dequeue_all_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msgs [3];
+    GList *messages, *link;
+    size_t i;
+
+    assert_null (message_queue_try_dequeue_all (data->queue));
+    for (i = 0; i < G_N_ELEMENTS (msgs); ++i) {
+        msgs [i] = control_message_new (CHECK_CANCEL);
+        message_queue_enqueue (data->queue, G_OBJECT (msgs [i]));
+    }
+    messages = message_queue_try_dequeue_all (data->queue);
+    assert_int_equal (g_list_length (messages), G_N_ELEMENTS (msgs));
+    for (i = 0, link = messages; link != NULL; ++i, link = link->next) {
+        assert_ptr_equal (link->data, msgs [i]);
+    }
+    assert_int_equal (message_queue_get_length (data->queue), 0);
+    assert_null (message_queue_try_dequeue (data->queue));
+    g_list_free_full (messages, g_object_unref);
+    for (i = 0; i < G_N_ELEMENTS (msgs); ++i) {
+        g_object_unref (msgs [i]);
+    }
+}
+static gboolean
+wakeup_fd_readable (MessageQueue *queue)
+{
+    struct pollfd pollfd = {
+        .fd = message_queue_get_wakeup_fd (queue),
+        .events = POLLIN,
+    };
+
+    return poll (&pollfd, 1, 0) == 1;
+}
+/*
+ * The wakeup fd becomes readable when a message is enqueued and stays
+ * quiet once it has been cleared.
+ */
+static void
+message_queue_wakeup_fd_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msg = control_message_new (CHECK_CANCEL);
+    GObject *obj;
+
+    assert_false (wakeup_fd_readable (data->queue));
+    message_queue_enqueue (data->queue, G_OBJECT (msg));
+    assert_true (wakeup_fd_readable (data->queue));
+    message_queue_clear_wakeup (data->queue);
+    assert_false (wakeup_fd_readable (data->queue));
+    obj = message_queue_try_dequeue (data->queue);
+    assert_ptr_equal (obj, msg);
+    g_object_unref (obj);
+    g_object_unref (msg);
+}
+
+#define PRODUCER_COUNT    4
+#define PRODUCER_MESSAGES 1000
+typedef struct {
+    MessageQueue   *queue;
+    ControlMessage *msgs [PRODUCER_MESSAGES];
+} producer_data_t;
+static void*
+producer_func (void *arg)
+{
+    producer_data_t *producer = (producer_data_t*)arg;
+    size_t i;
+
+    for (i = 0; i < PRODUCER_MESSAGES; ++i) {
+        message_queue_enqueue (producer->queue, G_OBJECT (producer->msgs [i]));
+    }
+    return NULL;
+}
+/*
+ * Several threads enqueue at once while the consumer blocks on the queue:
+ * every message is delivered once and each producer's messages arrive in
+ * the order it enqueued them.
+ */
+static void
+message_queue_producers_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    producer_data_t producers [PRODUCER_COUNT];
+    pthread_t thread_ids [PRODUCER_COUNT];
+    size_t next [PRODUCER_COUNT] = { 0 };
+    size_t i, j;
+    GObject *obj;
+
+    for (i = 0; i < PRODUCER_COUNT; ++i) {
+        producers [i].queue = data->queue;
+        for (j = 0; j < PRODUCER_MESSAGES; ++j) {
+            producers [i].msgs [j] = control_message_new (CHECK_CANCEL);
+        }
+    }
+    for (i = 0; i < PRODUCER_COUNT; ++i) {
+        assert_int_equal (pthread_create (&thread_ids [i],
+                                          NULL,
+                                          producer_func,
+                                          &producers [i]),
+                          0);
+    }
+    for (j = 0; j < PRODUCER_COUNT * PRODUCER_MESSAGES; ++j) {
+        obj = message_queue_dequeue (data->queue);
+        for (i = 0; i < PRODUCER_COUNT; ++i) {
+            if (next [i] < PRODUCER_MESSAGES &&
+                obj == G_OBJECT (producers [i].msgs [next [i]])) {
+                ++next [i];
+                break;
+            }
+        }
+        assert_true (i < PRODUCER_COUNT);
+        g_object_unref (obj);
+    }
+    for (i = 0; i < PRODUCER_COUNT; ++i) {
+        pthread_join (thread_ids [i], NULL);
+        for (j = 0; j < PRODUCER_MESSAGES; ++j) {
+            g_object_unref (producers [i].msgs [j]);
+        }
+    }
+    assert_null (message_queue_try_dequeue (data->queue));
+}
 
 int
 main(void)
@@ -157,9 +350,27 @@ main(void)
         cmocka_unit_test_setup_teardown (message_queue_dequeue_order_test,
                                          message_queue_setup,
                                          message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_try_dequeue_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_try_enqueue_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
         cmocka_unit_test_setup_teardown (message_queue_thread_unblock_test,
                                          message_queue_setup,
                                          message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_spin_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_try_dequeue_all_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_wakeup_fd_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_producers_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
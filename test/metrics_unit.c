@@ -0,0 +1,347 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "control-message.h"
+#include "metrics.h"
+#include "message-queue.h"
+#include "util.h"
+
+static int
+metrics_setup (void **state)
+{
+    *state = metrics_new ();
+    return 0;
+}
+static int
+metrics_teardown (void **state)
+{
+    g_object_unref (*state);
+    return 0;
+}
+/*
+ * Check that 'line' appears as a whole line in the exposition text.
+ */
+static void
+assert_has_line (const gchar *text,
+                 const gchar *line)
+{
+    gchar *needle = g_strdup_printf ("\n%s\n", line);
+
+    if (strstr (text, needle) == NULL) {
+        fail_msg ("missing line \"%s\" in:\n%s", line, text);
+    }
+    g_free (needle);
+}
+/*
+ * A new Metrics object reports zero for every counter and histogram.
+ */
+static void
+metrics_format_empty_test (void **state)
+{
+    Metrics *metrics = METRICS (*state);
+    gchar *text;
+
+    text = metrics_format (metrics);
+    assert_has_line (text, "# TYPE tabrmd_context_loads_total counter");
+    assert_has_line (text, "tabrmd_context_loads_total 0");
+    assert_has_line (text, "tabrmd_context_gap_regaps_total 0");
+    assert_has_line (text, "tabrmd_tpm_command_duration_seconds_count 0");
+    assert_has_line (text, "tabrmd_queue_duration_seconds_sum 0.000000");
+    assert_has_line (text, "tabrmd_connect_duration_seconds_count 0");
+    assert_has_line (text, "tabrmd_canary_failures_total 0");
+    assert_has_line (text, "tabrmd_canary_duration_seconds_count 0");
+    assert_null (strstr (text, "tabrmd_connections "));
+    assert_has_line (text, "tabrmd_tpms_degraded 0");
+    assert_has_line (text, "# TYPE tabrmd_memory_bytes gauge");
+    assert_has_line (text, "tabrmd_memory_bytes{kind=\"contexts\"} 0");
+    g_free (text);
+}
+/*
+ * Counters and per command code counts are reported, command codes in
+ * ascending order.
+ */
+static void
+metrics_format_counters_test (void **state)
+{
+    Metrics *metrics = METRICS (*state);
+    gchar *text, *sign, *extend;
+
+    metrics_count (metrics, METRICS_CONTEXT_SAVE);
+    metrics_count (metrics, METRICS_CONTEXT_SAVE);
+    metrics_count (metrics, METRICS_CONTEXT_GAP_REGAP);
+    metrics_count_command (metrics, TPM2_CC_Sign);
+    metrics_count_command (metrics, TPM2_CC_PCR_Extend);
+    metrics_count_command (metrics, TPM2_CC_PCR_Extend);
+
+    text = metrics_format (metrics);
+    assert_has_line (text, "tabrmd_context_saves_total 2");
+    assert_has_line (text, "tabrmd_context_flushes_total 0");
+    assert_has_line (text, "tabrmd_context_gap_regaps_total 1");
+    assert_has_line (text, "tabrmd_commands_total{command_code=\"0x00000182\"} 2");
+    assert_has_line (text, "tabrmd_commands_total{command_code=\"0x0000015d\"} 1");
+    sign = strstr (text, "command_code=\"0x0000015d\"");
+    extend = strstr (text, "command_code=\"0x00000182\"");
+    assert_true (sign < extend);
+    g_free (text);
+}
+/*
+ * Histogram buckets are cumulative and the sum is reported in seconds.
+ */
+/*
+ * metrics_get_stats returns the same counters keyed by their short names.
+ */
+static void
+metrics_get_stats_test (void **state)
+{
+    Metrics *metrics = METRICS (*state);
+    GVariant *stats, *commands;
+    guint64 value;
+    guint32 code;
+
+    metrics_count (metrics, METRICS_CONTEXT_LOAD);
+    metrics_count (metrics, METRICS_CACHE_HIT);
+    metrics_count (metrics, METRICS_CACHE_HIT);
+    metrics_count_command (metrics, TPM2_CC_PCR_Extend);
+
+    stats = g_variant_ref_sink (metrics_get_stats (metrics));
+    assert_true (g_variant_lookup (stats, "context_loads", "t", &value));
+    assert_int_equal (value, 1);
+    assert_true (g_variant_lookup (stats, "cache_hits", "t", &value));
+    assert_int_equal (value, 2);
+    assert_true (g_variant_lookup (stats, "cache_misses", "t", &value));
+    assert_int_equal (value, 0);
+    assert_false (g_variant_lookup (stats, "connections", "u", NULL));
+    commands = g_variant_lookup_value (stats, "commands", G_VARIANT_TYPE ("a{ut}"));
+    assert_non_null (commands);
+    assert_int_equal (g_variant_n_children (commands), 1);
+    g_variant_get_child (commands, 0, "{ut}", &code, &value);
+    assert_int_equal (code, TPM2_CC_PCR_Extend);
+    assert_int_equal (value, 1);
+    g_variant_unref (commands);
+    g_variant_unref (stats);
+}
+static void
+metrics_format_histogram_test (void **state)
+{
+    Metrics *metrics = METRICS (*state);
+    gchar *text;
+
+    metrics_observe (metrics, METRICS_TPM_LATENCY, 50);
+    metrics_observe (metrics, METRICS_TPM_LATENCY, 2000);
+    metrics_observe (metrics, METRICS_TPM_LATENCY, 20 * G_USEC_PER_SEC);
+
+    text = metrics_format (metrics);
+    assert_has_line (text, "tabrmd_tpm_command_duration_seconds_bucket{le=\"0.0001\"} 1");
+    assert_has_line (text, "tabrmd_tpm_command_duration_seconds_bucket{le=\"0.001\"} 1");
+    assert_has_line (text, "tabrmd_tpm_command_duration_seconds_bucket{le=\"0.005\"} 2");
+    assert_has_line (text, "tabrmd_tpm_command_duration_seconds_bucket{le=\"5\"} 2");
+    assert_has_line (text, "tabrmd_tpm_command_duration_seconds_bucket{le=\"+Inf\"} 3");
+    assert_has_line (text, "tabrmd_tpm_command_duration_seconds_sum 20.002050");
+    assert_has_line (text, "tabrmd_tpm_command_duration_seconds_count 3");
+    assert_has_line (text, "tabrmd_queue_duration_seconds_count 0");
+    g_free (text);
+}
+/*
+ * Each command code gets its own duration histogram, labeled with the
+ * command code.
+ */
+static void
+metrics_format_command_histogram_test (void **state)
+{
+    Metrics *metrics = METRICS (*state);
+    gchar *text;
+
+    metrics_observe_command (metrics, TPM2_CC_GetRandom, 300);
+    metrics_observe_command (metrics, TPM2_CC_CreatePrimary, 2 * G_USEC_PER_SEC);
+
+    text = metrics_format (metrics);
+    assert_has_line (text, "tabrmd_command_code_duration_seconds_bucket{command_code=\"0x0000017b\",le=\"0.0005\"} 1");
+    assert_has_line (text, "tabrmd_command_code_duration_seconds_bucket{command_code=\"0x00000131\",le=\"1\"} 0");
+    assert_has_line (text, "tabrmd_command_code_duration_seconds_sum{command_code=\"0x00000131\"} 2.000000");
+    assert_has_line (text, "tabrmd_command_code_duration_seconds_count{command_code=\"0x0000017b\"} 1");
+    g_free (text);
+}
+/*
+ * Registered queues and the ConnectionManager are sampled when the metrics
+ * are formatted.
+ */
+static void
+metrics_format_gauges_test (void **state)
+{
+    Metrics *metrics = METRICS (*state);
+    MessageQueue *queue = message_queue_new ();
+    ConnectionManager *manager = connection_manager_new (10);
+    ControlMessage *msg;
+    gchar *text;
+
+    metrics_add_queue (metrics, "response_sink", 1, queue);
+    metrics_set_connection_manager (metrics, manager);
+    msg = control_message_new (CHECK_CANCEL);
+    message_queue_enqueue (queue, G_OBJECT (msg));
+    message_queue_enqueue (queue, G_OBJECT (msg));
+    g_object_unref (msg);
+
+    text = metrics_format (metrics);
+    assert_has_line (text, "tabrmd_queue_depth{queue=\"response_sink\",tpm=\"1\"} 2");
+    assert_has_line (text, "tabrmd_connections 0");
+    g_free (text);
+    g_object_unref (queue);
+    g_object_unref (manager);
+}
+/*
+ * Usage is totalled for the UID and cgroup of each connection, those
+ * without a cgroup only count for their UID.
+ */
+static void
+metrics_account_usage_test (void **state)
+{
+    Metrics *metrics = METRICS (*state);
+    HandleMap *map = handle_map_new (TPM2_HT_TRANSIENT, 10);
+    GIOStream *iostream;
+    Connection *connection;
+    GVariant *stats, *usage;
+    guint64 commands, tpm_usec, context_usec;
+    const gchar *cgroup;
+    guint32 uid;
+    gint fd;
+
+    iostream = create_connection_iostream (&fd);
+    connection = connection_new (iostream, 1, map);
+    connection_set_uid (connection, 1000);
+    connection->cgroup = g_strdup ("/system.slice/foo.service");
+    metrics_account_usage (metrics, connection, 100, 20);
+    metrics_account_usage (metrics, connection, 50, -1);
+    g_clear_pointer (&connection->cgroup, g_free);
+    metrics_account_usage (metrics, connection, 10, 0);
+
+    stats = g_variant_ref_sink (metrics_get_stats (metrics));
+    usage = g_variant_lookup_value (stats, "uids", G_VARIANT_TYPE ("a{u(ttt)}"));
+    assert_non_null (usage);
+    assert_int_equal (g_variant_n_children (usage), 1);
+    g_variant_get_child (usage, 0, "{u(ttt)}",
+                         &uid, &commands, &tpm_usec, &context_usec);
+    assert_int_equal (uid, 1000);
+    assert_int_equal (commands, 3);
+    assert_int_equal (tpm_usec, 160);
+    assert_int_equal (context_usec, 20);
+    g_variant_unref (usage);
+    usage = g_variant_lookup_value (stats, "cgroups", G_VARIANT_TYPE ("a{s(ttt)}"));
+    assert_non_null (usage);
+    assert_int_equal (g_variant_n_children (usage), 1);
+    g_variant_get_child (usage, 0, "{&s(ttt)}",
+                         &cgroup, &commands, &tpm_usec, &context_usec);
+    assert_string_equal (cgroup, "/system.slice/foo.service");
+    assert_int_equal (commands, 2);
+    assert_int_equal (tpm_usec, 150);
+    assert_int_equal (context_usec, 20);
+    g_variant_unref (usage);
+    g_variant_unref (stats);
+    g_object_unref (connection);
+    g_object_unref (iostream);
+    g_object_unref (map);
+    close (fd);
+}
+/*
+ * A stage's time excludes the stages nested in it: the outer span is
+ * charged only for the busy loop around the inner one.
+ */
+static void
+metrics_span_nested_test (void **state)
+{
+    Metrics *metrics = METRICS (*state);
+    metrics_span_t outer, inner;
+    GVariant *stats, *stages;
+    const gchar *name;
+    guint64 count;
+    guint64 cpu [METRICS_STAGE_COUNT] = { 0, };
+    guint64 wall [METRICS_STAGE_COUNT] = { 0, };
+    gint64 start;
+    gsize i;
+    gchar *text;
+
+    metrics_span_begin (&outer);
+    start = g_get_monotonic_time ();
+    while (g_get_monotonic_time () - start < 2000);
+    metrics_span_begin (&inner);
+    g_usleep (20000);
+    metrics_span_end (metrics, METRICS_STAGE_TPM, &inner);
+    metrics_span_end (metrics, METRICS_STAGE_VIRTUALIZE, &outer);
+
+    stats = g_variant_ref_sink (metrics_get_stats (metrics));
+    stages = g_variant_lookup_value (stats, "stages", G_VARIANT_TYPE ("a(sttt)"));
+    assert_non_null (stages);
+    assert_int_equal (g_variant_n_children (stages), METRICS_STAGE_COUNT);
+    for (i = 0; i < METRICS_STAGE_COUNT; ++i) {
+        g_variant_get_child (stages, i, "(&sttt)", &name, &count, &cpu [i], &wall [i]);
+        assert_int_equal (count, i == METRICS_STAGE_TPM ||
+                                 i == METRICS_STAGE_VIRTUALIZE ? 1 : 0);
+    }
+    assert_true (wall [METRICS_STAGE_TPM] >= 20000);
+    assert_true (wall [METRICS_STAGE_VIRTUALIZE] >= 2000);
+    assert_true (wall [METRICS_STAGE_VIRTUALIZE] < 20000);
+    /* sleeping takes next to no CPU */
+    assert_true (cpu [METRICS_STAGE_TPM] < wall [METRICS_STAGE_TPM]);
+    g_variant_unref (stages);
+    g_variant_unref (stats);
+
+    text = metrics_format (metrics);
+    assert_has_line (text, "tabrmd_stage_runs_total{stage=\"tpm\"} 1");
+    assert_has_line (text, "tabrmd_stage_runs_total{stage=\"response_sink\"} 0");
+    assert_has_line (text, "tabrmd_stage_cpu_seconds_total{stage=\"context\"} 0.000000");
+    g_free (text);
+}
+/*
+ * Recording functions do nothing when passed a NULL Metrics.
+ */
+static void
+metrics_null_test (void **state)
+{
+    metrics_span_t span;
+
+    (void)state;
+    metrics_count (NULL, METRICS_CONTEXT_LOAD);
+    metrics_count_command (NULL, TPM2_CC_Sign);
+    metrics_observe (NULL, METRICS_QUEUE_LATENCY, 10);
+    metrics_observe_command (NULL, TPM2_CC_Sign, 10);
+    metrics_account_usage (NULL, NULL, 10, 10);
+    metrics_span_begin (&span);
+    metrics_span_end (NULL, METRICS_STAGE_READ, &span);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (metrics_format_empty_test,
+                                         metrics_setup,
+                                         metrics_teardown),
+        cmocka_unit_test_setup_teardown (metrics_format_counters_test,
+                                         metrics_setup,
+                                         metrics_teardown),
+        cmocka_unit_test_setup_teardown (metrics_get_stats_test,
+                                         metrics_setup,
+                                         metrics_teardown),
+        cmocka_unit_test_setup_teardown (metrics_format_histogram_test,
+                                         metrics_setup,
+                                         metrics_teardown),
+        cmocka_unit_test_setup_teardown (metrics_format_command_histogram_test,
+                                         metrics_setup,
+                                         metrics_teardown),
+        cmocka_unit_test_setup_teardown (metrics_format_gauges_test,
+                                         metrics_setup,
+                                         metrics_teardown),
+        cmocka_unit_test_setup_teardown (metrics_span_nested_test,
+                                         metrics_setup,
+                                         metrics_teardown),
+        cmocka_unit_test_setup_teardown (metrics_account_usage_test,
+                                         metrics_setup,
+                                         metrics_teardown),
+        cmocka_unit_test (metrics_null_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
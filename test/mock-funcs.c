@@ -30,86 +30,34 @@ __wrap_poll (struct pollfd *fds,
     }
 }
 /*
- * The mock functions for the g_socket_* stuff are required to test the
- * tcti_tabrmd_read function. They are used to extract the GInputStream
- * from the GSocketConnection stored in the TCTI context structure.
- *
- * These mock functions are written to mock the implementation only when
- * passed known values used in this module. It will call the 'real'
- * if passed a real glib object.
+ * The mock function for recv is required to test the tcti_tabrmd_read
+ * function. It mocks the implementation only when passed the TEST_FD used
+ * in this module and calls the 'real' recv for any other fd.
  */
-GSocket* __real_g_socket_connection_get_socket (GSocketConnection *connection);
-GSocket*
-__wrap_g_socket_connection_get_socket (GSocketConnection *connection)
+ssize_t
+__real_recv (int sockfd,
+             void *buf,
+             size_t len,
+             int flags);
+ssize_t
+__wrap_recv (int sockfd,
+             void *buf,
+             size_t len,
+             int flags)
 {
-    g_debug ("%s: 0x%" PRIxPTR, __func__, (uintptr_t)connection);
-    if (connection != TEST_CONNECTION) {
-        return __real_g_socket_connection_get_socket (connection);
-    } else {
-        return mock_type (GSocket*);
-    }
-}
-int __real_g_socket_get_fd (GSocket *socket);
-int
-__wrap_g_socket_get_fd (GSocket *socket)
-{
-    g_debug ("%s: 0x%" PRIxPTR, __func__, (uintptr_t)socket);
-    if (socket != TEST_SOCKET) {
-        return __real_g_socket_get_fd (socket);
-    } else {
-        return mock_type (int);
-    }
-}
-GInputStream* __real_g_io_stream_get_input_stream (GIOStream *stream);
-GInputStream*
-__wrap_g_io_stream_get_input_stream (GIOStream *stream)
-{
-    g_debug ("%s iostream: 0x%" PRIxPTR, __func__, (uintptr_t)stream);
-    if (stream != (GIOStream*)TEST_CONNECTION) {
-        return __real_g_io_stream_get_input_stream (stream);
-    } else {
-        return mock_type (GInputStream*);
-    }
-}
-/*
- * The mock functions for the GInputStream reading function is required to
- * test the  * tcti_tabrmd_read function. This is almost exactly like a
- * mock function the 'read' system call but handles the glib stuff too.
- *
- * This mock function is  written to mock the implementation only when
- * passed known values used in this module. It will call the 'real'
- * if passed a real glib object.
- */
-gssize
-__real_g_input_stream_read (GInputStream *stream,
-                            void *buffer,
-                            gsize count,
-                            GCancellable *cancellable,
-                            GError **error);
-gssize
-__wrap_g_input_stream_read (GInputStream *stream,
-                            void *buffer,
-                            gsize count,
-                            GCancellable *cancellable,
-                            GError **error)
-{
-    gssize resp_size;
+    ssize_t resp_size;
     uint8_t *resp;
 
-    g_debug ("%s stream: 0x%" PRIxPTR, __func__, (uintptr_t)stream);
-    if (stream != (GInputStream*)TEST_CONNECTION) {
-        return __real_g_input_stream_read (stream,
-                                           buffer,
-                                           count,
-                                           cancellable,
-                                           error);
+    g_debug ("%s fd: %d", __func__, sockfd);
+    if (sockfd != TEST_FD) {
+        return __real_recv (sockfd, buf, len, flags);
     } else {
-        resp_size = mock_type (gssize);
+        resp_size = mock_type (ssize_t);
         if (resp_size > 0) {
             resp = mock_type (uint8_t*);
-            memcpy (buffer, resp, resp_size);
+            memcpy (buf, resp, resp_size);
         } else if (resp_size == -1) {
-            *error = mock_type (GError*);
+            errno = mock_type (int);
         }
         return resp_size;
     }
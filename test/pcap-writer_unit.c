@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "pcap-writer.h"
+#include "util.h"
+
+/* section header and two interface descriptions named "tpmN" */
+#define SHB_SIZE 28
+#define IDB_SIZE 32
+#define EPB_DATA 28
+
+typedef struct {
+    gchar    *dir;
+    gchar    *path;
+} test_data_t;
+
+static int
+pcap_writer_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+
+    data->dir = g_dir_make_tmp ("pcap-writer-unit-XXXXXX", NULL);
+    assert_non_null (data->dir);
+    data->path = g_build_filename (data->dir, "capture.pcapng", NULL);
+
+    *state = data;
+    return 0;
+}
+static int
+pcap_writer_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    g_unlink (data->path);
+    g_rmdir (data->dir);
+    g_free (data->path);
+    g_free (data->dir);
+    g_free (data);
+    return 0;
+}
+static guint32
+get_u32 (const guint8 *buf)
+{
+    guint32 value;
+
+    memcpy (&value, buf, sizeof (value));
+    return value;
+}
+static guint16
+get_be16 (const guint8 *buf)
+{
+    return (guint16)(buf [0] << 8 | buf [1]);
+}
+static guint32
+get_be32 (const guint8 *buf)
+{
+    return (guint32)buf [0] << 24 | (guint32)buf [1] << 16 |
+        (guint32)buf [2] << 8 | buf [3];
+}
+/*
+ * A command and its response are written, once the PcapWriter is
+ * released, as IPv4 packets on the interface of their TPM: a TCP segment
+ * from the connection's port to the TPM port with the command's comment
+ * and one back whose sequence number follows on from the command's ack.
+ */
+static void
+pcap_writer_write_test (void **state)
+{
+    test_data_t *data = *state;
+    const guint8 command [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x01, 0x7b };
+    const guint8 response [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00 };
+    const gchar *comment = "connection 0x7";
+    GError *error = NULL;
+    PcapWriter *writer;
+    guint8 *buf, *epb;
+    gsize size;
+    guint32 length;
+
+    writer = pcap_writer_new (data->path, 2, &error);
+    assert_non_null (writer);
+    assert_true (pcap_writer_put (writer, 1, 7, FALSE, command,
+                                  sizeof (command), g_strdup (comment)));
+    assert_true (pcap_writer_put (writer, 1, 7, TRUE, response,
+                                  sizeof (response), NULL));
+    g_object_unref (writer);
+
+    assert_true (g_file_get_contents (data->path, (gchar**)&buf, &size, NULL));
+    assert_int_equal (get_u32 (buf), PCAP_BLOCK_SHB);
+    assert_int_equal (get_u32 (&buf [8]), PCAP_BYTE_ORDER);
+    assert_int_equal (get_u32 (&buf [SHB_SIZE]), PCAP_BLOCK_IDB);
+    assert_int_equal (get_u32 (&buf [SHB_SIZE + 4]), IDB_SIZE);
+    assert_int_equal (buf [SHB_SIZE + 8], PCAP_LINKTYPE_IPV4);
+    assert_memory_equal (&buf [SHB_SIZE + 20], "\x02\x00\x04\x00tpm0", 8);
+    /* the command */
+    epb = &buf [SHB_SIZE + 2 * IDB_SIZE];
+    assert_int_equal (get_u32 (epb), PCAP_BLOCK_EPB);
+    length = get_u32 (&epb [4]);
+    assert_int_equal (get_u32 (&epb [8]), 1);
+    assert_int_equal (get_u32 (&epb [20]),
+                      PCAP_HEADERS_SIZE + sizeof (command));
+    assert_int_equal (epb [EPB_DATA], 0x45);
+    assert_int_equal (get_be16 (&epb [EPB_DATA + 20]), PCAP_CLIENT_PORT + 7);
+    assert_int_equal (get_be16 (&epb [EPB_DATA + 22]), PCAP_TPM_PORT);
+    assert_memory_equal (&epb [EPB_DATA + PCAP_HEADERS_SIZE],
+                         command,
+                         sizeof (command));
+    assert_non_null (g_strstr_len ((gchar*)epb, length, comment));
+    assert_int_equal (get_u32 (&epb [length - 4]), length);
+    /* the response */
+    epb += length;
+    assert_int_equal (get_u32 (epb), PCAP_BLOCK_EPB);
+    assert_int_equal (get_be16 (&epb [EPB_DATA + 20]), PCAP_TPM_PORT);
+    assert_int_equal (get_be32 (&epb [EPB_DATA + 28]), sizeof (command));
+    assert_memory_equal (&epb [EPB_DATA + PCAP_HEADERS_SIZE],
+                         response,
+                         sizeof (response));
+    length = get_u32 (&epb [4]);
+    assert_int_equal ((gsize)(epb + length - buf), size);
+    g_free (buf);
+}
+/*
+ * Putting packets accepts a NULL PcapWriter so callers needn't check.
+ */
+static void
+pcap_writer_put_null_test (void **state)
+{
+    const guint8 command [] = { 0x80, 0x01 };
+    UNUSED_PARAM (state);
+
+    assert_false (pcap_writer_put (NULL, 0, 1, FALSE, command,
+                                   sizeof (command), g_strdup ("comment")));
+}
+static void
+pcap_writer_new_fail_test (void **state)
+{
+    test_data_t *data = *state;
+    GError *error = NULL;
+    gchar *path;
+
+    path = g_build_filename (data->dir, "missing", "capture.pcapng", NULL);
+    assert_null (pcap_writer_new (path, 1, &error));
+    assert_non_null (error);
+    g_clear_error (&error);
+    g_free (path);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (pcap_writer_write_test,
+                                         pcap_writer_setup,
+                                         pcap_writer_teardown),
+        cmocka_unit_test_setup_teardown (pcap_writer_put_null_test,
+                                         pcap_writer_setup,
+                                         pcap_writer_teardown),
+        cmocka_unit_test_setup_teardown (pcap_writer_new_fail_test,
+                                         pcap_writer_setup,
+                                         pcap_writer_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
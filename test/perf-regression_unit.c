@@ -0,0 +1,754 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Checks on the amount of work the broker does, run by 'make check'
+ * against the mock TCTI. Where resource-manager_bench reports times,
+ * these assert counts: TPM round trips, context loads / saves / flushes
+ * and heap allocations. Timing is only used to compare the same
+ * operation at two sizes and with generous bounds, so a lookup that
+ * turns into a scan fails while a loaded machine doesn't.
+ */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "command-attrs.h"
+#include "connection.h"
+#include "handle-map.h"
+#include "message-queue.h"
+#include "resource-manager.h"
+#include "session-entry.h"
+#include "session-list.h"
+#include "sink-interface.h"
+#include "tcti.h"
+#include "tcti-mock.h"
+#include "tpm2.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "tpm2-response.h"
+#include "util.h"
+
+/* physical handles handed out by the wrapped tpm2_context_load */
+#define PERF_PHANDLE_FIRST 0x80000000
+/* first vhandle allocated by a new HandleMap */
+#define PERF_VHANDLE_FIRST (TPM2_HR_TRANSIENT + 0xff)
+#define PERF_COMMANDS      100
+#define PERF_ITERATIONS    20000
+#define PERF_REPEAT        5
+/*
+ * The larger structure may be this much slower per operation than the
+ * smaller one, 16 times its size, before the check fails.
+ */
+#define PERF_SCALE_FACTOR  4.0
+#define PERF_IDLE_CONNECTIONS 200
+
+/*
+ * Allocations are counted by interposing malloc and friends, which
+ * needs glibc's __libc_* entry points and doesn't mix with ASan.
+ */
+#if defined (__GLIBC__) && !defined (__SANITIZE_ADDRESS__)
+#define PERF_COUNT_ALLOCATIONS 1
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+/* only the test's own thread is counted */
+static __thread gboolean counting;
+static __thread guint64 allocations;
+
+void*
+malloc (size_t size)
+{
+    if (counting) {
+        ++allocations;
+    }
+    return __libc_malloc (size);
+}
+void*
+calloc (size_t count,
+        size_t size)
+{
+    if (counting) {
+        ++allocations;
+    }
+    return __libc_calloc (count, size);
+}
+void*
+realloc (void  *ptr,
+         size_t size)
+{
+    if (counting) {
+        ++allocations;
+    }
+    return __libc_realloc (ptr, size);
+}
+static void
+allocations_start (void)
+{
+    allocations = 0;
+    counting = TRUE;
+}
+static guint64
+allocations_stop (void)
+{
+    counting = FALSE;
+    return allocations;
+}
+#else
+#define PERF_COUNT_ALLOCATIONS 0
+static void
+allocations_start (void)
+{
+}
+static guint64
+allocations_stop (void)
+{
+    return 0;
+}
+#endif
+
+typedef struct {
+    Tpm2            *tpm2;
+    ResourceManager *resmgr;
+    SessionList     *session_list;
+} test_data_t;
+
+/* calls made to the wrapped Tpm2 functions */
+typedef struct {
+    guint send_command;
+    guint load;
+    guint save;
+    guint flush;
+} tpm_calls_t;
+
+static tpm_calls_t calls;
+static TPM2_HANDLE next_phandle = PERF_PHANDLE_FIRST;
+
+/*
+ * The TPM answers every command immediately with TPM2_RC_SUCCESS and no
+ * response parameters.
+ */
+Tpm2Response*
+__wrap_tpm2_send_command (Tpm2        *tpm2,
+                          Tpm2Command *command,
+                          TSS2_RC     *rc)
+{
+    Connection *connection = tpm2_command_get_connection (command);
+    Tpm2Response *response;
+
+    UNUSED_PARAM (tpm2);
+    ++calls.send_command;
+    *rc = TSS2_RC_SUCCESS;
+    response = tpm2_response_new_rc (connection, TSS2_RC_SUCCESS);
+    g_object_unref (connection);
+    return response;
+}
+void
+__wrap_sink_enqueue (Sink    *self,
+                     GObject *obj)
+{
+    UNUSED_PARAM (self);
+    UNUSED_PARAM (obj);
+}
+/*
+ * The marshalled TPMS_CONTEXT of a transient object with an empty blob,
+ * handed out by the wrapped saves.
+ */
+static const guint8 saved_context [] = {
+    0, 0, 0, 0, 0, 0, 0, 0,  /* sequence */
+    0x80, 0, 0, 0,           /* savedHandle */
+    0x40, 0, 0, 0x01,        /* hierarchy */
+    0, 0,                    /* contextBlob */
+};
+static GBytes*
+saved_context_new (void)
+{
+    return g_bytes_new_static (saved_context, sizeof (saved_context));
+}
+TSS2_RC
+__wrap_tpm2_context_load (Tpm2         *tpm2,
+                          GBytes       *context,
+                          TPM2_HANDLE  *handle)
+{
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (context);
+    ++calls.load;
+    *handle = next_phandle++;
+    return TSS2_RC_SUCCESS;
+}
+TSS2_RC
+__wrap_tpm2_context_save (Tpm2         *tpm2,
+                          TPM2_HANDLE   handle,
+                          GBytes      **context)
+{
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (handle);
+    *context = saved_context_new ();
+    ++calls.save;
+    return TSS2_RC_SUCCESS;
+}
+TSS2_RC
+__wrap_tpm2_context_flush (Tpm2        *tpm2,
+                           TPM2_HANDLE  handle)
+{
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (handle);
+    ++calls.flush;
+    return TSS2_RC_SUCCESS;
+}
+size_t
+__wrap_tpm2_context_flush_batch (Tpm2              *tpm2,
+                                 TPM2_HANDLE const  handles[],
+                                 size_t             count)
+{
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (handles);
+    calls.flush += count;
+    return count;
+}
+TSS2_RC
+__wrap_tpm2_context_saveflush (Tpm2         *tpm2,
+                               TPM2_HANDLE   handle,
+                               GBytes      **context)
+{
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (handle);
+    *context = saved_context_new ();
+    ++calls.save;
+    ++calls.flush;
+    return TSS2_RC_SUCCESS;
+}
+size_t
+__wrap_tpm2_context_saveflush_batch (Tpm2 *tpm2,
+                                     TPM2_HANDLE const handles[],
+                                     GBytes *contexts[],
+                                     TSS2_RC rcs[],
+                                     size_t count)
+{
+    size_t i;
+
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (handles);
+    for (i = 0; i < count; ++i) {
+        contexts [i] = saved_context_new ();
+        rcs [i] = TSS2_RC_SUCCESS;
+    }
+    calls.save += count;
+    calls.flush += count;
+    return count;
+}
+static int
+perf_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+    TSS2_TCTI_CONTEXT *context;
+    Tcti *tcti;
+
+    context = tcti_mock_init_full ();
+    tcti = tcti_new (context);
+    data->tpm2 = tpm2_new (tcti);
+    g_object_unref (tcti);
+    data->session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_MAX,
+                                           SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    data->resmgr = resource_manager_new (data->tpm2, data->session_list);
+    memset (&calls, 0, sizeof (calls));
+
+    *state = data;
+    return 0;
+}
+static int
+perf_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    g_clear_object (&data->resmgr);
+    g_clear_object (&data->session_list);
+    g_clear_object (&data->tpm2);
+    g_free (data);
+    return 0;
+}
+/*
+ * Create a Connection with a transient HandleMap holding 'count' entries.
+ * The entries have no physical handle so their first use loads their
+ * saved context.
+ */
+static Connection*
+perf_connection_new (guint64 id,
+                     guint   count)
+{
+    Connection *connection;
+    HandleMap *map;
+    HandleMapEntry *entry;
+    GIOStream *iostream;
+    GBytes *context;
+    TPM2_HANDLE vhandle;
+    gint client_fd;
+    guint i;
+
+    map = handle_map_new (TPM2_HT_TRANSIENT, MAX (count, 1));
+    context = saved_context_new ();
+    for (i = 0; i < count; ++i) {
+        vhandle = handle_map_next_vhandle (map);
+        entry = handle_map_entry_new (0, vhandle);
+        handle_map_entry_set_context (entry, context);
+        handle_map_insert (map, vhandle, entry);
+        g_object_unref (entry);
+    }
+    g_bytes_unref (context);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, id, map);
+    g_object_unref (iostream);
+    g_object_unref (map);
+    close (client_fd);
+    return connection;
+}
+/*
+ * Build a command with no sessions and the provided handles. The TPM2_CC
+ * must have 'count' handles in its handle area.
+ */
+static Tpm2Command*
+perf_command_new (Connection  *connection,
+                  TPM2_CC      code,
+                  TPM2_HANDLE  handles[],
+                  guint8       count)
+{
+    size_t size = TPM_HEADER_SIZE + count * sizeof (TPM2_HANDLE);
+    guint8 *buffer = g_malloc0 (size);
+    TPMA_CC attrs = code | ((TPMA_CC)count << TPMA_CC_CHANDLES_SHIFT);
+    Tpm2Command *command;
+    guint8 i;
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (size);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (code);
+    command = tpm2_command_new (connection, buffer, size, attrs);
+    for (i = 0; i < count; ++i) {
+        tpm2_command_set_handle (command, handles [i], i);
+    }
+    return command;
+}
+/*
+ * Send a Certify naming the connection's two transient objects through
+ * the ResourceManager.
+ */
+static void
+perf_certify (test_data_t *data,
+              Connection  *connection)
+{
+    TPM2_HANDLE handles [2] = {
+        PERF_VHANDLE_FIRST, PERF_VHANDLE_FIRST + 1,
+    };
+    Tpm2Command *command;
+
+    command = perf_command_new (connection, TPM2_CC_Certify, handles, 2);
+    resource_manager_process_tpm2_command (data->resmgr, command);
+    g_object_unref (command);
+}
+/*
+ * Heap allocations made while sending 'count' Certify commands.
+ */
+static guint64
+perf_certify_allocations (test_data_t *data,
+                          Connection  *connection,
+                          guint        count)
+{
+    guint i;
+
+    allocations_start ();
+    for (i = 0; i < count; ++i) {
+        perf_certify (data, connection);
+    }
+    return allocations_stop ();
+}
+/*
+ * Smallest time, in microseconds, taken by 'func' over PERF_REPEAT runs.
+ */
+static gint64
+perf_time_min (void (*func) (gpointer),
+               gpointer user_data)
+{
+    gint64 start, elapsed, best = G_MAXINT64;
+    guint i;
+
+    for (i = 0; i < PERF_REPEAT; ++i) {
+        start = g_get_monotonic_time ();
+        func (user_data);
+        elapsed = g_get_monotonic_time () - start;
+        best = MIN (best, elapsed);
+    }
+    return MAX (best, 1);
+}
+/*
+ * Once a connection's objects are loaded, repeating a command on them
+ * from the same connection costs one TPM round trip and no context
+ * management. Taking turns with another connection does evict and
+ * reload them, which shows the counters see the context management.
+ */
+static void
+perf_resident_object_test (void **state)
+{
+    test_data_t *data = *state;
+    Connection *connection, *other;
+
+    connection = perf_connection_new (1, 2);
+    other = perf_connection_new (2, 2);
+    perf_certify (data, connection);
+    assert_int_equal (calls.send_command, 1);
+    assert_int_equal (calls.load, 2);
+
+    memset (&calls, 0, sizeof (calls));
+    perf_certify (data, connection);
+    perf_certify (data, connection);
+    assert_int_equal (calls.send_command, 2);
+    assert_int_equal (calls.load, 0);
+    assert_int_equal (calls.save, 0);
+    assert_int_equal (calls.flush, 0);
+
+    memset (&calls, 0, sizeof (calls));
+    perf_certify (data, other);
+    perf_certify (data, connection);
+    assert_int_equal (calls.send_command, 2);
+    assert_true (calls.load >= 2);
+
+    resource_manager_remove_connection (data->resmgr, other);
+    resource_manager_remove_connection (data->resmgr, connection);
+    g_object_unref (other);
+    g_object_unref (connection);
+}
+/*
+ * The allocations made by a command don't depend on how many commands
+ * came before it, nor on how many idle connections hold sessions.
+ */
+static void
+perf_command_allocations_test (void **state)
+{
+    test_data_t *data = *state;
+    Connection *connection;
+    Connection *idle [PERF_IDLE_CONNECTIONS];
+    SessionEntry *entry;
+    guint64 first, second, busy;
+    guint i;
+
+    if (!PERF_COUNT_ALLOCATIONS) {
+        skip ();
+    }
+    connection = perf_connection_new (1, 2);
+    /* the first command loads the objects and warms up GLib's caches */
+    perf_certify_allocations (data, connection, PERF_COMMANDS);
+    first = perf_certify_allocations (data, connection, PERF_COMMANDS);
+    second = perf_certify_allocations (data, connection, 10 * PERF_COMMANDS);
+    assert_true (first > 0);
+    assert_true (second <= 10 * first);
+
+    for (i = 0; i < PERF_IDLE_CONNECTIONS; ++i) {
+        idle [i] = perf_connection_new (i + 2, 1);
+        entry = session_entry_new (idle [i], TPM2_HMAC_SESSION_FIRST + i);
+        session_list_insert (data->session_list, entry);
+        g_object_unref (entry);
+    }
+    busy = perf_certify_allocations (data, connection, PERF_COMMANDS);
+    assert_true (busy <= first);
+
+    for (i = 0; i < PERF_IDLE_CONNECTIONS; ++i) {
+        session_list_remove_connection (data->session_list, idle [i]);
+        g_object_unref (idle [i]);
+    }
+    resource_manager_remove_connection (data->resmgr, connection);
+    g_object_unref (connection);
+}
+/*
+ * Extracting the handles from a command and finding the attributes of
+ * its command code don't touch the heap.
+ */
+static void
+perf_command_parse_test (void **state)
+{
+    Connection *connection;
+    CommandAttrs *attrs;
+    TPM2_HANDLE handles [TPM2_COMMAND_MAX_HANDLES] = {
+        PERF_VHANDLE_FIRST, PERF_VHANDLE_FIRST + 1,
+    };
+    const TPMA_CC cached [] = {
+        TPM2_CC_Certify | (2 << TPMA_CC_CHANDLES_SHIFT),
+        TPM2_CC_HMAC | (1 << TPMA_CC_CHANDLES_SHIFT),
+        TPM2_CC_Load | (1 << TPMA_CC_CHANDLES_SHIFT) | TPMA_CC_RHANDLE,
+    };
+    Tpm2Command *command;
+    TPMA_CC found = 0;
+    size_t count = 0;
+    guint64 made;
+    guint i;
+    UNUSED_PARAM (state);
+
+    if (!PERF_COUNT_ALLOCATIONS) {
+        skip ();
+    }
+    connection = perf_connection_new (1, 0);
+    command = perf_command_new (connection, TPM2_CC_Certify, handles, 2);
+    attrs = command_attrs_new ();
+    command_attrs_init_cached (attrs, G_N_ELEMENTS (cached), cached);
+
+    allocations_start ();
+    for (i = 0; i < PERF_ITERATIONS; ++i) {
+        count = TPM2_COMMAND_MAX_HANDLES;
+        tpm2_command_get_handles (command, handles, &count);
+        found = command_attrs_from_cc (attrs, TPM2_CC_Load);
+    }
+    made = allocations_stop ();
+    assert_int_equal (made, 0);
+    assert_int_equal (count, 2);
+    assert_int_equal (found & TPMA_CC_COMMANDINDEX_MASK, TPM2_CC_Load);
+
+    g_object_unref (attrs);
+    g_object_unref (command);
+    g_object_unref (connection);
+}
+typedef struct {
+    SessionList  *list;
+    Connection  **connections;
+    guint         connection_count;
+    guint         total;
+} session_scale_t;
+
+#define PERF_SESSIONS_PER_CONNECTION 4
+
+static void
+session_scale_init (session_scale_t *scale,
+                    guint            connection_count)
+{
+    SessionEntry *entry;
+    guint i, j;
+
+    scale->list = session_list_new (PERF_SESSIONS_PER_CONNECTION,
+                                    SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    scale->connections = g_new0 (Connection*, connection_count);
+    scale->connection_count = connection_count;
+    scale->total = connection_count * PERF_SESSIONS_PER_CONNECTION;
+    for (i = 0; i < connection_count; ++i) {
+        scale->connections [i] = perf_connection_new (i, 0);
+        for (j = 0; j < PERF_SESSIONS_PER_CONNECTION; ++j) {
+            entry = session_entry_new (scale->connections [i],
+                                       TPM2_HMAC_SESSION_FIRST +
+                                       i * PERF_SESSIONS_PER_CONNECTION + j);
+            session_list_insert (scale->list, entry);
+            g_object_unref (entry);
+        }
+    }
+}
+static void
+session_scale_fini (session_scale_t *scale)
+{
+    guint i;
+
+    g_object_unref (scale->list);
+    for (i = 0; i < scale->connection_count; ++i) {
+        g_object_unref (scale->connections [i]);
+    }
+    g_free (scale->connections);
+}
+static void
+session_scale_lookup (gpointer user_data)
+{
+    session_scale_t *scale = user_data;
+    SessionEntry *entry;
+    guint i;
+
+    for (i = 0; i < PERF_ITERATIONS; ++i) {
+        entry = session_list_lookup_handle (scale->list,
+                                            TPM2_HMAC_SESSION_FIRST +
+                                            i % scale->total);
+        g_object_unref (entry);
+    }
+}
+/*
+ * Remove the sessions of the last connection and add them back.
+ */
+static void
+session_scale_remove (gpointer user_data)
+{
+    session_scale_t *scale = user_data;
+    guint last = scale->connection_count - 1;
+    SessionEntry *entry;
+    guint i, j;
+
+    for (i = 0; i < PERF_ITERATIONS / PERF_SESSIONS_PER_CONNECTION; ++i) {
+        while (session_list_remove_connection (scale->list,
+                                               scale->connections [last]));
+        for (j = 0; j < PERF_SESSIONS_PER_CONNECTION; ++j) {
+            entry = session_entry_new (scale->connections [last],
+                                       TPM2_HMAC_SESSION_FIRST +
+                                       last * PERF_SESSIONS_PER_CONNECTION + j);
+            session_list_insert (scale->list, entry);
+            g_object_unref (entry);
+        }
+    }
+}
+/*
+ * Looking up a session by handle and removing a connection's sessions
+ * cost the same with 16 times as many sessions in the list, and lookups
+ * don't allocate.
+ */
+static void
+perf_session_list_scale_test (void **state)
+{
+    session_scale_t small, large;
+    gint64 small_usec, large_usec;
+    guint64 made;
+    UNUSED_PARAM (state);
+
+    session_scale_init (&small, 16);
+    session_scale_init (&large, 256);
+
+    allocations_start ();
+    session_scale_lookup (&large);
+    made = allocations_stop ();
+    assert_int_equal (made, 0);
+    assert_int_equal (session_list_connection_count (large.list,
+                                                     large.connections [0]),
+                      PERF_SESSIONS_PER_CONNECTION);
+
+    small_usec = perf_time_min (session_scale_lookup, &small);
+    large_usec = perf_time_min (session_scale_lookup, &large);
+    assert_true (large_usec <= small_usec * PERF_SCALE_FACTOR);
+    small_usec = perf_time_min (session_scale_remove, &small);
+    large_usec = perf_time_min (session_scale_remove, &large);
+    assert_true (large_usec <= small_usec * PERF_SCALE_FACTOR);
+
+    session_scale_fini (&large);
+    session_scale_fini (&small);
+}
+typedef struct {
+    HandleMap *map;
+    guint      count;
+} map_scale_t;
+
+static void
+map_scale_init (map_scale_t *scale,
+                guint        count)
+{
+    HandleMapEntry *entry;
+    TPM2_HANDLE vhandle;
+    guint i;
+
+    scale->map = handle_map_new (TPM2_HT_TRANSIENT, count);
+    scale->count = count;
+    for (i = 0; i < count; ++i) {
+        vhandle = handle_map_next_vhandle (scale->map);
+        entry = handle_map_entry_new (PERF_PHANDLE_FIRST + i, vhandle);
+        handle_map_insert (scale->map, vhandle, entry);
+        g_object_unref (entry);
+    }
+}
+static void
+map_scale_lookup (gpointer user_data)
+{
+    map_scale_t *scale = user_data;
+    HandleMapEntry *entry;
+    guint i;
+
+    for (i = 0; i < PERF_ITERATIONS; ++i) {
+        entry = handle_map_vlookup (scale->map,
+                                    PERF_VHANDLE_FIRST + i % scale->count);
+        g_object_unref (entry);
+    }
+}
+/*
+ * Looking up a vhandle costs the same in a map 16 times larger and
+ * doesn't allocate.
+ */
+static void
+perf_handle_map_scale_test (void **state)
+{
+    map_scale_t small, large;
+    gint64 small_usec, large_usec;
+    guint64 made;
+    UNUSED_PARAM (state);
+
+    map_scale_init (&small, 64);
+    map_scale_init (&large, 1024);
+    assert_int_equal (handle_map_size (large.map), 1024);
+
+    allocations_start ();
+    map_scale_lookup (&large);
+    made = allocations_stop ();
+    assert_int_equal (made, 0);
+
+    small_usec = perf_time_min (map_scale_lookup, &small);
+    large_usec = perf_time_min (map_scale_lookup, &large);
+    assert_true (large_usec <= small_usec * PERF_SCALE_FACTOR);
+
+    g_object_unref (large.map);
+    g_object_unref (small.map);
+}
+/*
+ * Heap allocations made by PERF_ITERATIONS enqueue / dequeue round trips
+ * through a MessageQueue already holding 'depth' - 1 messages.
+ */
+static guint64
+message_queue_round_trips (guint depth)
+{
+    MessageQueue *queue = message_queue_new ();
+    GObject *message = g_object_new (G_TYPE_OBJECT, NULL);
+    GObject *obj;
+    guint64 made;
+    guint i;
+
+    for (i = 1; i < depth; ++i) {
+        message_queue_enqueue (queue, message);
+    }
+    allocations_start ();
+    for (i = 0; i < PERF_ITERATIONS; ++i) {
+        message_queue_enqueue (queue, message);
+        obj = message_queue_try_dequeue (queue);
+        g_object_unref (obj);
+    }
+    made = allocations_stop ();
+    assert_int_equal (message_queue_get_length (queue), depth - 1);
+
+    g_object_unref (queue);
+    g_object_unref (message);
+    return made;
+}
+/*
+ * A round trip through the MessageQueue makes a fixed number of
+ * allocations however deep the queue is.
+ */
+static void
+perf_message_queue_test (void **state)
+{
+    guint64 shallow, deep;
+    UNUSED_PARAM (state);
+
+    if (!PERF_COUNT_ALLOCATIONS) {
+        skip ();
+    }
+    shallow = message_queue_round_trips (1);
+    deep = message_queue_round_trips (1000);
+    assert_true (shallow <= 2 * PERF_ITERATIONS);
+    assert_true (deep <= shallow);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (perf_resident_object_test,
+                                         perf_setup,
+                                         perf_teardown),
+        cmocka_unit_test_setup_teardown (perf_command_allocations_test,
+                                         perf_setup,
+                                         perf_teardown),
+        cmocka_unit_test (perf_command_parse_test),
+        cmocka_unit_test (perf_session_list_scale_test),
+        cmocka_unit_test (perf_handle_map_scale_test),
+        cmocka_unit_test (perf_message_queue_test),
+    };
+
+    /* count GSList and GQueue nodes as the allocations they are */
+    g_setenv ("G_SLICE", "always-malloc", TRUE);
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "quota-pool.h"
+
+static int
+quota_pool_setup (void **state)
+{
+    *state = quota_pool_new (8, 0);
+    return 0;
+}
+static int
+quota_pool_teardown (void **state)
+{
+    g_clear_object ((QuotaPool**)state);
+    return 0;
+}
+/*
+ * A lone connection gets half of the headroom, the next one half of what
+ * it leaves and so on until the pool is dry.
+ */
+static void
+quota_pool_borrow_share_test (void **state)
+{
+    QuotaPool *pool = QUOTA_POOL (*state);
+    guint held;
+
+    for (held = 0; quota_pool_borrow (pool, QUOTA_POOL_TRANSIENTS, held); ++held);
+    assert_int_equal (held, 4);
+    for (held = 0; quota_pool_borrow (pool, QUOTA_POOL_TRANSIENTS, held); ++held);
+    assert_int_equal (held, 2);
+    for (held = 0; quota_pool_borrow (pool, QUOTA_POOL_TRANSIENTS, held); ++held);
+    assert_int_equal (held, 1);
+    assert_true (quota_pool_borrow (pool, QUOTA_POOL_TRANSIENTS, 0));
+    assert_int_equal (quota_pool_get_borrowed (pool, QUOTA_POOL_TRANSIENTS), 8);
+    assert_false (quota_pool_borrow (pool, QUOTA_POOL_TRANSIENTS, 0));
+}
+/*
+ * Slots given back can be borrowed again, an empty pool lends nothing.
+ */
+static void
+quota_pool_return_test (void **state)
+{
+    QuotaPool *pool = QUOTA_POOL (*state);
+
+    assert_false (quota_pool_borrow (pool, QUOTA_POOL_SESSIONS, 0));
+    assert_true (quota_pool_borrow (pool, QUOTA_POOL_TRANSIENTS, 0));
+    assert_true (quota_pool_borrow (pool, QUOTA_POOL_TRANSIENTS, 1));
+    quota_pool_return (pool, QUOTA_POOL_TRANSIENTS, 2);
+    assert_int_equal (quota_pool_get_borrowed (pool, QUOTA_POOL_TRANSIENTS), 0);
+    assert_true (quota_pool_borrow (pool, QUOTA_POOL_TRANSIENTS, 0));
+    assert_int_equal (quota_pool_get_borrowed (pool, QUOTA_POOL_TRANSIENTS), 1);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (quota_pool_borrow_share_test,
+                                         quota_pool_setup,
+                                         quota_pool_teardown),
+        cmocka_unit_test_setup_teardown (quota_pool_return_test,
+                                         quota_pool_setup,
+                                         quota_pool_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "random-pool.h"
+
+#define TEST_POOL_SIZE 64
+
+/*
+ * The pool is NULL if mlock is refused by RLIMIT_MEMLOCK, the tests are
+ * skipped then.
+ */
+static int
+random_pool_setup (void **state)
+{
+    *state = random_pool_new (TEST_POOL_SIZE);
+    return 0;
+}
+static int
+random_pool_teardown (void **state)
+{
+    random_pool_free (*state);
+    return 0;
+}
+/*
+ * The pool takes no more than its size. Bytes filled come back out and
+ * each of them only once.
+ */
+static void
+random_pool_fill_take_test (void **state)
+{
+    random_pool_t *pool = *state;
+    guint8 bytes [TEST_POOL_SIZE + 8], out [TEST_POOL_SIZE] = { 0 };
+    size_t i;
+
+    if (pool == NULL) {
+        skip ();
+    }
+    for (i = 0; i < sizeof (bytes); ++i) {
+        bytes [i] = (guint8)(i + 1);
+    }
+    assert_int_equal (random_pool_space (pool), TEST_POOL_SIZE);
+    assert_int_equal (random_pool_fill (pool, bytes, sizeof (bytes)),
+                      TEST_POOL_SIZE);
+    assert_int_equal (random_pool_space (pool), 0);
+
+    assert_true (random_pool_take (pool, out, 16));
+    assert_memory_equal (out, &bytes [TEST_POOL_SIZE - 16], 16);
+    assert_true (random_pool_take (pool, out, TEST_POOL_SIZE - 16));
+    assert_memory_equal (out, bytes, TEST_POOL_SIZE - 16);
+    assert_false (random_pool_take (pool, out, 1));
+    /* the bytes handed out are gone from the pool's memory */
+    for (i = 0; i < TEST_POOL_SIZE; ++i) {
+        assert_int_equal (pool->data [i], 0);
+    }
+}
+/*
+ * A take for more than the pool holds fails and leaves the pool alone. A
+ * wipe empties it.
+ */
+static void
+random_pool_short_wipe_test (void **state)
+{
+    random_pool_t *pool = *state;
+    guint8 bytes [8] = { 1, 2, 3, 4, 5, 6, 7, 8 }, out [16];
+
+    if (pool == NULL) {
+        skip ();
+    }
+    random_pool_fill (pool, bytes, sizeof (bytes));
+    assert_false (random_pool_take (pool, out, sizeof (out)));
+    assert_int_equal (pool->len, sizeof (bytes));
+    random_pool_wipe (pool);
+    assert_int_equal (random_pool_space (pool), TEST_POOL_SIZE);
+    assert_false (random_pool_take (pool, out, 1));
+}
+/*
+ * A child process never gets the bytes the parent filled the pool with.
+ */
+static void
+random_pool_fork_test (void **state)
+{
+    random_pool_t *pool = *state;
+    guint8 bytes [8] = { 1, 2, 3, 4, 5, 6, 7, 8 }, out [8];
+    pid_t pid;
+    int status;
+
+    if (pool == NULL) {
+        skip ();
+    }
+    random_pool_fill (pool, bytes, sizeof (bytes));
+    pid = fork ();
+    assert_true (pid != -1);
+    if (pid == 0) {
+        _exit (random_pool_take (pool, out, 1) ? 1 : 0);
+    }
+    assert_int_equal (waitpid (pid, &status, 0), pid);
+    assert_true (WIFEXITED (status));
+    assert_int_equal (WEXITSTATUS (status), 0);
+    assert_true (random_pool_take (pool, out, sizeof (out)));
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (random_pool_fill_take_test,
+                                         random_pool_setup,
+                                         random_pool_teardown),
+        cmocka_unit_test_setup_teardown (random_pool_short_wipe_test,
+                                         random_pool_setup,
+                                         random_pool_teardown),
+        cmocka_unit_test_setup_teardown (random_pool_fork_test,
+                                         random_pool_setup,
+                                         random_pool_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,498 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Microbenchmarks for the CPU cost of the ResourceManager. The Tpm2 is
+ * backed by the mock TCTI and the functions that would talk to the TPM
+ * are wrapped to succeed immediately, so only the broker's own work is
+ * timed: command parsing, handle virtualization, the GetCapability handle
+ * path, SessionList operations and the cost of a command as the number
+ * of idle connections grows.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "connection.h"
+#include "connection-manager.h"
+#include "handle-map.h"
+#include "integration/bench-util.h"
+#include "resource-manager.h"
+#include "session-entry.h"
+#include "session-list.h"
+#include "sink-interface.h"
+#include "tabrmd-defaults.h"
+#include "tcti.h"
+#include "tcti-mock.h"
+#include "tpm2.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "tpm2-response.h"
+#include "util.h"
+
+#define BENCH_ITERATIONS 100000
+/* physical handles handed out by the wrapped tpm2_context_load */
+#define BENCH_PHANDLE_FIRST 0x80000000
+/* first vhandle allocated by a new HandleMap */
+#define BENCH_VHANDLE_FIRST (TPM2_HR_TRANSIENT + 0xff)
+
+typedef struct {
+    Tpm2            *tpm2;
+    ResourceManager *resmgr;
+    SessionList     *session_list;
+} bench_data_t;
+
+static TPM2_HANDLE next_phandle = BENCH_PHANDLE_FIRST;
+
+/*
+ * The TPM answers every command immediately with TPM2_RC_SUCCESS and no
+ * response parameters.
+ */
+Tpm2Response*
+__wrap_tpm2_send_command (Tpm2        *tpm2,
+                          Tpm2Command *command,
+                          TSS2_RC     *rc)
+{
+    Connection *connection = tpm2_command_get_connection (command);
+    Tpm2Response *response;
+
+    UNUSED_PARAM (tpm2);
+    *rc = TSS2_RC_SUCCESS;
+    response = tpm2_response_new_rc (connection, TSS2_RC_SUCCESS);
+    g_object_unref (connection);
+    return response;
+}
+/*
+ * Responses are discarded, the ResourceManager drops its own reference.
+ */
+void
+__wrap_sink_enqueue (Sink    *self,
+                     GObject *obj)
+{
+    UNUSED_PARAM (self);
+    UNUSED_PARAM (obj);
+}
+/*
+ * The marshalled TPMS_CONTEXT of a transient object with an empty blob,
+ * handed out by the wrapped saves.
+ */
+static const guint8 saved_context [] = {
+    0, 0, 0, 0, 0, 0, 0, 0,  /* sequence */
+    0x80, 0, 0, 0,           /* savedHandle */
+    0x40, 0, 0, 0x01,        /* hierarchy */
+    0, 0,                    /* contextBlob */
+};
+static GBytes*
+saved_context_new (void)
+{
+    return g_bytes_new_static (saved_context, sizeof (saved_context));
+}
+TSS2_RC
+__wrap_tpm2_context_load (Tpm2         *tpm2,
+                          GBytes       *context,
+                          TPM2_HANDLE  *handle)
+{
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (context);
+    *handle = next_phandle++;
+    return TSS2_RC_SUCCESS;
+}
+TSS2_RC
+__wrap_tpm2_context_flush (Tpm2        *tpm2,
+                           TPM2_HANDLE  handle)
+{
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (handle);
+    return TSS2_RC_SUCCESS;
+}
+TSS2_RC
+__wrap_tpm2_context_saveflush (Tpm2         *tpm2,
+                               TPM2_HANDLE   handle,
+                               GBytes      **context)
+{
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (handle);
+    *context = saved_context_new ();
+    return TSS2_RC_SUCCESS;
+}
+size_t
+__wrap_tpm2_context_saveflush_batch (Tpm2 *tpm2,
+                                     TPM2_HANDLE const handles[],
+                                     GBytes *contexts[],
+                                     TSS2_RC rcs[],
+                                     size_t count)
+{
+    size_t i;
+
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (handles);
+    for (i = 0; i < count; ++i) {
+        contexts [i] = saved_context_new ();
+        rcs [i] = TSS2_RC_SUCCESS;
+    }
+    return count;
+}
+static void
+bench_init (bench_data_t *data)
+{
+    TSS2_TCTI_CONTEXT *context;
+    Tcti *tcti;
+
+    context = tcti_mock_init_full ();
+    tcti = tcti_new (context);
+    data->tpm2 = tpm2_new (tcti);
+    g_object_unref (tcti);
+    data->session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_MAX,
+                                           SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    data->resmgr = resource_manager_new (data->tpm2, data->session_list);
+}
+static void
+bench_fini (bench_data_t *data)
+{
+    g_clear_object (&data->resmgr);
+    g_clear_object (&data->session_list);
+    g_clear_object (&data->tpm2);
+}
+static void
+bench_report (const gchar *name,
+              guint        param,
+              guint        iterations,
+              gint64       usec)
+{
+    printf ("%-28s %6u %12.1f ns/op\n",
+            name, param, usec * 1000.0 / iterations);
+}
+/*
+ * Create a Connection with a transient HandleMap holding 'count' entries.
+ * The entries have no physical handle so their first use loads their
+ * saved context.
+ */
+static Connection*
+bench_connection_new (guint64 id,
+                      guint   count)
+{
+    Connection *connection;
+    HandleMap *map;
+    HandleMapEntry *entry;
+    GIOStream *iostream;
+    GBytes *context;
+    TPM2_HANDLE vhandle;
+    gint client_fd;
+    guint i;
+
+    map = handle_map_new (TPM2_HT_TRANSIENT, MAX (count, 1));
+    context = saved_context_new ();
+    for (i = 0; i < count; ++i) {
+        vhandle = handle_map_next_vhandle (map);
+        entry = handle_map_entry_new (0, vhandle);
+        handle_map_entry_set_context (entry, context);
+        handle_map_insert (map, vhandle, entry);
+        g_object_unref (entry);
+    }
+    g_bytes_unref (context);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, id, map);
+    g_object_unref (iostream);
+    g_object_unref (map);
+    close (client_fd);
+    return connection;
+}
+/*
+ * Build a command with no sessions and the provided handles. The TPM2_CC
+ * must have 'count' handles in its handle area.
+ */
+static Tpm2Command*
+bench_command_new (Connection  *connection,
+                   TPM2_CC      code,
+                   TPM2_HANDLE  handles[],
+                   guint8       count)
+{
+    size_t size = TPM_HEADER_SIZE + count * sizeof (TPM2_HANDLE);
+    guint8 *buffer = g_malloc0 (size);
+    TPMA_CC attrs = code | ((TPMA_CC)count << TPMA_CC_CHANDLES_SHIFT);
+    Tpm2Command *command;
+    guint8 i;
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (size);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (code);
+    command = tpm2_command_new (connection, buffer, size, attrs);
+    for (i = 0; i < count; ++i) {
+        tpm2_command_set_handle (command, handles [i], i);
+    }
+    return command;
+}
+/*
+ * Cost of extracting the handles from a command.
+ */
+static void
+bench_command_get_handles (void)
+{
+    Connection *connection = bench_connection_new (1, 0);
+    TPM2_HANDLE handles [TPM2_COMMAND_MAX_HANDLES] = {
+        BENCH_VHANDLE_FIRST, BENCH_VHANDLE_FIRST + 1,
+    };
+    Tpm2Command *command;
+    size_t count;
+    gint64 start;
+    guint i;
+
+    command = bench_command_new (connection, TPM2_CC_Certify, handles, 2);
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        count = TPM2_COMMAND_MAX_HANDLES;
+        tpm2_command_get_handles (command, handles, &count);
+    }
+    bench_report ("tpm2_command_get_handles", 2, BENCH_ITERATIONS,
+                  g_get_monotonic_time () - start);
+    g_object_unref (command);
+    g_object_unref (connection);
+}
+/*
+ * Cost of mapping a virtual handle to a remembered physical handle.
+ */
+static void
+bench_virt_to_phys (bench_data_t *data)
+{
+    Connection *connection = bench_connection_new (1, 1);
+    HandleMap *map = connection_get_trans_map (connection);
+    TPM2_HANDLE handle = BENCH_VHANDLE_FIRST;
+    HandleMapEntry *entry;
+    Tpm2Command *command;
+    gint64 start;
+    guint i;
+
+    command = bench_command_new (connection, TPM2_CC_HMAC, &handle, 1);
+    entry = handle_map_vlookup (map, handle);
+    handle_map_entry_set_phandle (entry, BENCH_PHANDLE_FIRST);
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        resource_manager_virt_to_phys (data->resmgr, command, entry, 0);
+    }
+    bench_report ("resource_manager_virt_to_phys", 1, BENCH_ITERATIONS,
+                  g_get_monotonic_time () - start);
+    g_object_unref (entry);
+    g_object_unref (command);
+    g_object_unref (map);
+    g_object_unref (connection);
+}
+/*
+ * Full command path for a command with two transient handles. With one
+ * connection the objects stay loaded after the first command. With two
+ * connections taking turns every command evicts and reloads them.
+ */
+static void
+bench_process_command (bench_data_t *data,
+                       guint         connection_count)
+{
+    Connection *connections [2];
+    TPM2_HANDLE handles [2];
+    Tpm2Command *command;
+    gint64 start;
+    guint i;
+
+    for (i = 0; i < connection_count; ++i) {
+        connections [i] = bench_connection_new (i, 2);
+    }
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        handles [0] = BENCH_VHANDLE_FIRST;
+        handles [1] = BENCH_VHANDLE_FIRST + 1;
+        command = bench_command_new (connections [i % connection_count],
+                                     TPM2_CC_Certify,
+                                     handles,
+                                     2);
+        resource_manager_process_tpm2_command (data->resmgr, command);
+        g_object_unref (command);
+    }
+    bench_report (connection_count == 1 ?
+                      "process_command resident" : "process_command switch",
+                  connection_count, BENCH_ITERATIONS,
+                  g_get_monotonic_time () - start);
+    for (i = 0; i < connection_count; ++i) {
+        resource_manager_remove_connection (data->resmgr, connections [i]);
+        g_object_unref (connections [i]);
+    }
+}
+/*
+ * GetCapability for transient handles is answered from the HandleMap:
+ * the vhandles are copied from its sorted index into a response.
+ */
+static void
+bench_get_cap_handles (bench_data_t *data,
+                       guint         count)
+{
+    Connection *connection = bench_connection_new (1, count);
+    size_t size = TPM_HEADER_SIZE + 3 * sizeof (UINT32);
+    Tpm2Command *command;
+    guint8 *buffer;
+    gint64 start;
+    guint i;
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        buffer = g_malloc0 (size);
+        *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+        *(UINT32*)(buffer + 2) = htobe32 (size);
+        *(TPM2_CC*)(buffer + 6) = htobe32 (TPM2_CC_GetCapability);
+        *(TPM2_CAP*)(buffer + TPM_HEADER_SIZE) = htobe32 (TPM2_CAP_HANDLES);
+        *(UINT32*)(buffer + TPM_HEADER_SIZE + 4) = htobe32 (TPM2_TRANSIENT_FIRST);
+        *(UINT32*)(buffer + TPM_HEADER_SIZE + 8) = htobe32 (TPM2_MAX_CAP_HANDLES);
+        command = tpm2_command_new (connection, buffer, size,
+                                    TPM2_CC_GetCapability);
+        resource_manager_process_tpm2_command (data->resmgr, command);
+        g_object_unref (command);
+    }
+    bench_report ("get_cap handles", count, BENCH_ITERATIONS,
+                  g_get_monotonic_time () - start);
+    resource_manager_remove_connection (data->resmgr, connection);
+    g_object_unref (connection);
+}
+/*
+ * SessionList lookups, per connection queries and connection removal with
+ * 'connection_count' connections each owning 'per_connection' sessions.
+ */
+static void
+bench_session_list (guint connection_count,
+                    guint per_connection)
+{
+    SessionList *list;
+    Connection **connections = g_new0 (Connection*, connection_count);
+    SessionEntry *entry;
+    guint total = connection_count * per_connection;
+    gint64 start;
+    guint i, j;
+
+    list = session_list_new (per_connection, SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    for (i = 0; i < connection_count; ++i) {
+        connections [i] = bench_connection_new (i, 0);
+        for (j = 0; j < per_connection; ++j) {
+            entry = session_entry_new (connections [i],
+                                       TPM2_HMAC_SESSION_FIRST + i * per_connection + j);
+            session_list_insert (list, entry);
+            g_object_unref (entry);
+        }
+    }
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        entry = session_list_lookup_handle (list,
+                                            TPM2_HMAC_SESSION_FIRST + i % total);
+        g_object_unref (entry);
+    }
+    bench_report ("session_list_lookup_handle", total, BENCH_ITERATIONS,
+                  g_get_monotonic_time () - start);
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        session_list_connection_count (list, connections [i % connection_count]);
+    }
+    bench_report ("session_list_connection_count", total, BENCH_ITERATIONS,
+                  g_get_monotonic_time () - start);
+    /* remove and re-add one connection's sessions */
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_ITERATIONS / per_connection; ++i) {
+        session_list_remove_connection (list, connections [0]);
+        for (j = 0; j < per_connection; ++j) {
+            entry = session_entry_new (connections [0],
+                                       TPM2_HMAC_SESSION_FIRST + j);
+            session_list_insert (list, entry);
+            g_object_unref (entry);
+        }
+    }
+    bench_report ("session_list_remove_connection", total,
+                  BENCH_ITERATIONS / per_connection,
+                  g_get_monotonic_time () - start);
+    g_object_unref (list);
+    for (i = 0; i < connection_count; ++i) {
+        g_object_unref (connections [i]);
+    }
+    g_free (connections);
+}
+/*
+ * Cost of the connection lookup and of a command from one connection
+ * while 'count' connections, each owning a transient object and a
+ * session, sit idle alongside it. Both should stay flat as 'count' grows.
+ */
+static void
+bench_idle_connections (bench_data_t *data,
+                        guint         count)
+{
+    ConnectionManager *manager = connection_manager_new (count);
+    Connection **connections = g_new0 (Connection*, count);
+    Connection *connection;
+    SessionEntry *entry;
+    TPM2_HANDLE handle;
+    Tpm2Command *command;
+    gint64 start;
+    guint i;
+
+    for (i = 0; i < count; ++i) {
+        connections [i] = bench_connection_new (i, 1);
+        connection_manager_insert (manager, connections [i]);
+        entry = session_entry_new (connections [i], TPM2_HMAC_SESSION_FIRST + i);
+        session_list_insert (data->session_list, entry);
+        g_object_unref (entry);
+    }
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        connection = connection_manager_lookup_id (manager, i % count);
+        g_object_unref (connection);
+    }
+    bench_report ("connection_manager_lookup_id", count, BENCH_ITERATIONS,
+                  g_get_monotonic_time () - start);
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        handle = BENCH_VHANDLE_FIRST;
+        command = bench_command_new (connections [0], TPM2_CC_HMAC, &handle, 1);
+        resource_manager_process_tpm2_command (data->resmgr, command);
+        g_object_unref (command);
+    }
+    bench_report ("process_command idle", count, BENCH_ITERATIONS,
+                  g_get_monotonic_time () - start);
+    for (i = 0; i < count; ++i) {
+        session_list_remove_connection (data->session_list, connections [i]);
+        resource_manager_remove_connection (data->resmgr, connections [i]);
+        connection_manager_remove (manager, connections [i]);
+        g_object_unref (connections [i]);
+    }
+    g_free (connections);
+    g_object_unref (manager);
+}
+int
+main (void)
+{
+    bench_data_t data = { 0 };
+    static const guint handle_counts [] = { 1, 8, 27, 64 };
+    static const guint connection_counts [] = { 1, 8, 64, 256 };
+    static const guint session_counts [] = { 1, 4, 16 };
+    static const guint idle_counts [] = { 1, 100, 1000, 10000 };
+    guint connections_max = bench_connections_max (TABRMD_FDS_RESERVED);
+    size_t i, j;
+
+    bench_init (&data);
+    printf ("%-28s %6s %12s\n", "benchmark", "n", "time");
+    bench_command_get_handles ();
+    bench_virt_to_phys (&data);
+    bench_process_command (&data, 1);
+    bench_process_command (&data, 2);
+    for (i = 0; i < G_N_ELEMENTS (handle_counts); ++i) {
+        bench_get_cap_handles (&data, handle_counts [i]);
+    }
+    for (i = 0; i < G_N_ELEMENTS (connection_counts); ++i) {
+        for (j = 0; j < G_N_ELEMENTS (session_counts); ++j) {
+            bench_session_list (connection_counts [i], session_counts [j]);
+        }
+    }
+    for (i = 0; i < G_N_ELEMENTS (idle_counts); ++i) {
+        if (idle_counts [i] > connections_max) {
+            printf ("%-28s %6u %12s\n", "process_command idle",
+                    idle_counts [i], "no fds");
+            continue;
+        }
+        bench_idle_connections (&data, idle_counts [i]);
+    }
+    bench_fini (&data);
+    return 0;
+}
@@ -19,6 +19,7 @@
 #include "resource-manager.h"
 #include "sink-interface.h"
 #include "source-interface.h"
+#include "tabrmd.h"
 #include "tcti.h"
 #include "tcti-mock.h"
 #include "tpm2-command.h"
@@ -31,6 +32,7 @@ typedef struct test_data {
     Connection      *connection;
     Tpm2Command     *command;
     Tpm2Response    *response;
+    TSS2_RC          response_rc;
     gint             client_fd;
     TPM2_HANDLE       vhandles [2];
     TPMA_CC         command_attrs;
@@ -77,16 +79,98 @@ __wrap_sink_enqueue (Sink      *self,
     UNUSED_PARAM(self);
     test_data_t *data = mock_ptr_type (test_data_t*);
     data->response = TPM2_RESPONSE (obj);
+    data->response_rc = tpm2_response_get_code (data->response);
+}
+/*
+ * Marshal 'context' into the GBytes the Tpm2 hands out for a saved
+ * context.
+ */
+static GBytes*
+context_bytes_new (TPMS_CONTEXT const *context)
+{
+    uint8_t buf [sizeof (TPMS_CONTEXT)];
+    size_t size = 0;
+
+    assert_int_equal (Tss2_MU_TPMS_CONTEXT_Marshal (context,
+                                                    buf,
+                                                    sizeof (buf),
+                                                    &size),
+                      TSS2_RC_SUCCESS);
+    return g_bytes_new (buf, size);
+}
+/*
+ * A saved transient object's context.
+ */
+static GBytes*
+context_bytes_transient_new (void)
+{
+    TPMS_CONTEXT context = {
+        .savedHandle = 0x80000000,
+        .hierarchy = TPM2_RH_OWNER,
+    };
+
+    return context_bytes_new (&context);
 }
 TSS2_RC
 __wrap_tpm2_context_saveflush (Tpm2 *broker,
                                         TPM2_HANDLE    handle,
-                                        TPMS_CONTEXT *context)
+                                        GBytes       **context)
 {
+    TSS2_RC rc = mock_type (TSS2_RC);
     UNUSED_PARAM(broker);
     UNUSED_PARAM(handle);
-    UNUSED_PARAM(context);
-   return mock_type (TSS2_RC);
+
+    if (rc == TSS2_RC_SUCCESS) {
+        *context = context_bytes_transient_new ();
+    }
+    return rc;
+}
+/*
+ * The batch version pops one RC per handle, as though each handle had
+ * been passed to tpm2_context_saveflush.
+ */
+size_t
+__wrap_tpm2_context_saveflush_batch (Tpm2 *tpm2,
+                                     TPM2_HANDLE const handles[],
+                                     GBytes *contexts[],
+                                     TSS2_RC rcs[],
+                                     size_t count)
+{
+    size_t i, done = 0;
+
+    for (i = 0; i < count; ++i) {
+        contexts [i] = NULL;
+        rcs [i] = __wrap_tpm2_context_saveflush (tpm2, handles [i], &contexts [i]);
+        if (rcs [i] == TSS2_RC_SUCCESS) {
+            ++done;
+        }
+    }
+    return done;
+}
+TSS2_RC
+__wrap_tpm2_context_flush (Tpm2        *tpm2,
+                           TPM2_HANDLE  handle)
+{
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (handle);
+    return mock_type (TSS2_RC);
+}
+/*
+ * Like the saveflush batch this pops one RC for each handle.
+ */
+size_t
+__wrap_tpm2_context_flush_batch (Tpm2              *tpm2,
+                                 TPM2_HANDLE const  handles[],
+                                 size_t             count)
+{
+    size_t i, done = 0;
+
+    for (i = 0; i < count; ++i) {
+        if (__wrap_tpm2_context_flush (tpm2, handles [i]) == TSS2_RC_SUCCESS) {
+            ++done;
+        }
+    }
+    return done;
 }
 /*
  * Wrap call to tpm2_context_load. Pops two parameters off the
@@ -96,19 +180,93 @@ __wrap_tpm2_context_saveflush (Tpm2 *broker,
  */
 TSS2_RC
 __wrap_tpm2_context_load (Tpm2 *tpm2,
-                                   TPMS_CONTEXT *context,
+                                   GBytes       *context,
                                    TPM2_HANDLE   *handle)
 {
     TSS2_RC    rc      = mock_type (TSS2_RC);
     TPM2_HANDLE phandle = mock_type (TPM2_HANDLE);
     UNUSED_PARAM(tpm2);
-    UNUSED_PARAM(context);
 
+    assert_non_null (context);
     assert_non_null (handle);
     *handle = phandle;
 
     return rc;
 }
+TSS2_RC
+__wrap_tpm2_context_save (Tpm2 *tpm2,
+                          TPM2_HANDLE handle,
+                          GBytes **context)
+{
+    TSS2_RC rc = mock_type (TSS2_RC);
+    UNUSED_PARAM(tpm2);
+    UNUSED_PARAM(handle);
+
+    if (rc == TSS2_RC_SUCCESS) {
+        *context = context_bytes_transient_new ();
+    }
+    return rc;
+}
+/*
+ * Mock the TPM's clock: pops the resetCount, the restartCount and the RC.
+ */
+TSS2_RC
+__wrap_tpm2_read_clock (Tpm2           *tpm2,
+                        TPMS_TIME_INFO *time_info)
+{
+    UNUSED_PARAM (tpm2);
+    time_info->clockInfo.resetCount = mock_type (UINT32);
+    time_info->clockInfo.restartCount = mock_type (UINT32);
+    return mock_type (TSS2_RC);
+}
+/*
+ * Mock NV_Read: checks the size and offset, fills the bytes read with
+ * their offset in the index and pops the RC.
+ */
+TSS2_RC
+__wrap_tpm2_nv_read (Tpm2                *tpm2,
+                     TPMI_RH_NV_AUTH      auth_handle,
+                     TPMI_RH_NV_INDEX     nv_index,
+                     TPM2B_AUTH const    *auth,
+                     UINT16               size,
+                     UINT16               offset,
+                     TPM2B_MAX_NV_BUFFER *data)
+{
+    UINT16 i;
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (auth_handle);
+    UNUSED_PARAM (nv_index);
+    UNUSED_PARAM (auth);
+
+    check_expected (size);
+    check_expected (offset);
+    data->size = size;
+    for (i = 0; i < size; ++i) {
+        data->buffer [i] = (BYTE)(offset + i);
+    }
+    return mock_type (TSS2_RC);
+}
+/*
+ * Mock NV_Write: checks the size and offset and pops the RC.
+ */
+TSS2_RC
+__wrap_tpm2_nv_write (Tpm2                      *tpm2,
+                      TPMI_RH_NV_AUTH            auth_handle,
+                      TPMI_RH_NV_INDEX           nv_index,
+                      TPM2B_AUTH const          *auth,
+                      TPM2B_MAX_NV_BUFFER const *data,
+                      UINT16                     offset)
+{
+    UINT16 size = data->size;
+    UNUSED_PARAM (tpm2);
+    UNUSED_PARAM (auth_handle);
+    UNUSED_PARAM (nv_index);
+    UNUSED_PARAM (auth);
+
+    check_expected (size);
+    check_expected (offset);
+    return mock_type (TSS2_RC);
+}
 static int
 resource_manager_setup (void **state)
 {
@@ -235,6 +393,33 @@ resource_manager_sink_enqueue_test (void **state)
     assert_int_equal (data->command, command_out);
     assert_int_equal (1, 1);
 }
+/*
+ * With at most one pending command per connection the second command is
+ * answered through the sink instead of being queued. Once the first is
+ * canceled the connection may queue another one.
+ */
+static void
+resource_manager_enqueue_pending_max_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 *buffer;
+
+    resource_manager_set_admission (data->resource_manager, 0, 1);
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    resource_manager_enqueue (SINK (data->resource_manager), G_OBJECT (data->command));
+    assert_int_equal (message_queue_get_length (data->resource_manager->in_queue), 1);
+
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_enqueue (SINK (data->resource_manager), G_OBJECT (data->command));
+    assert_non_null (data->response);
+    assert_int_equal (message_queue_get_length (data->resource_manager->in_queue), 1);
+
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_cancel (data->resource_manager, data->connection);
+    resource_manager_enqueue (SINK (data->resource_manager), G_OBJECT (data->command));
+    assert_int_equal (message_queue_get_length (data->resource_manager->in_queue), 1);
+}
 /**
  * A test: exercise the resource_manager_process_tpm2_command function.
  * This function is normally invoked by the ResourceManager internal
@@ -274,6 +459,151 @@ resource_manager_process_tpm2_command_success_test (void **state)
     assert_int_equal (data->response, response);
     g_object_unref (response);
 }
+/*
+ * A TPM2_RC_RETRY response isn't returned to the client: the command is
+ * resent and the client gets the response to the second attempt.
+ */
+static void
+resource_manager_process_tpm2_command_retry_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *retry, *response;
+    guint8 *buffer;
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    retry = tpm2_response_new_rc (data->connection, TPM2_RC_RETRY);
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, retry);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    g_object_unref (response);
+}
+/*
+ * A connection that has the TPM to itself has its commands passed through:
+ * the handles in the command aren't looked up in its HandleMap.
+ */
+static void
+resource_manager_passthrough_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ConnectionManager *manager = connection_manager_new (2);
+    Tpm2Response *response;
+
+    connection_manager_insert (manager, data->connection);
+    resource_manager_set_passthrough (data->resource_manager, manager);
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    assert_ptr_equal (data->resource_manager->passthrough, data->connection);
+    assert_int_equal (tpm2_command_get_handle (data->command, 0),
+                      data->vhandles [0]);
+    assert_int_equal (tpm2_command_get_handle (data->command, 1),
+                      data->vhandles [1]);
+    g_object_unref (response);
+    g_object_unref (manager);
+}
+/*
+ * With the kernel resource manager virtualizing, the command goes as it
+ * is through the Tcti of its connection.
+ */
+static void
+resource_manager_kernel_rm_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    Tcti *tcti;
+
+    tcti = tcti_new (tcti_mock_init_full ());
+    connection_set_tcti (data->connection, tcti);
+    resource_manager_set_kernel_rm (data->resource_manager,
+                                    "device:/dev/tpmrm0");
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    assert_ptr_equal (connection_get_tcti (data->connection), tcti);
+    assert_int_equal (tpm2_command_get_handle (data->command, 0),
+                      data->vhandles [0]);
+    assert_int_equal (tpm2_command_get_handle (data->command, 1),
+                      data->vhandles [1]);
+    g_object_unref (response);
+    g_object_unref (tcti);
+}
+/*
+ * The commands of a batch are processed one after the other. With
+ * stop-on-error the command after a failed one isn't sent to the TPM.
+ */
+static void
+resource_manager_process_batch_stop_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *next;
+    Tpm2Response *response;
+
+    data->command = tpm2_command_new (data->connection,
+                                      calloc (1, TPM_HEADER_SIZE),
+                                      TPM_HEADER_SIZE,
+                                      (TPMA_CC){ 0, });
+    next = tpm2_command_new (data->connection,
+                             calloc (1, TPM_HEADER_SIZE),
+                             TPM_HEADER_SIZE,
+                             (TPMA_CC){ 0, });
+    tpm2_command_set_request_tag (next, 7);
+    tpm2_command_batch_append (data->command, next);
+    g_object_unref (next);
+    tpm2_command_set_batch_stop (data->command, TRUE);
+    assert_true (tpm2_command_is_batched (next));
+    response = tpm2_response_new_rc (data->connection, TPM2_RC_HANDLE);
+
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_batch (data->resource_manager, data->command);
+    assert_int_equal (data->response_rc, TSS2_RESMGR_RC_CANCELED);
+}
+/*
+ * A command whose deadline has passed is answered with
+ * TSS2_RESMGR_RC_CANCELED without being sent to the TPM: the mock for
+ * tpm2_send_command would fail the test if it were called.
+ */
+static void
+resource_manager_process_expired_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_RC rc;
+
+    data->command = tpm2_command_new (data->connection,
+                                      calloc (1, TPM_HEADER_SIZE),
+                                      TPM_HEADER_SIZE,
+                                      (TPMA_CC){ 0, });
+    tpm2_command_set_deadline (data->command,
+                               tpm2_command_get_timestamp (data->command) - 1);
+    will_return (__wrap_sink_enqueue, data);
+    rc = resource_manager_process_tpm2_command (data->resource_manager,
+                                                data->command);
+    assert_int_equal (rc, TSS2_RESMGR_RC_CANCELED);
+    assert_int_equal (data->response_rc, TSS2_RESMGR_RC_CANCELED);
+}
 static void
 resource_manager_flushsave_context_test (void **state)
 {
@@ -287,6 +617,40 @@ resource_manager_flushsave_context_test (void **state)
     assert_int_equal (handle_map_entry_get_phandle (entry), 0);
     g_object_unref (entry);
 }
+/*
+ * Once an object has been saved its context is reused: evicting it again
+ * after it's been reloaded only flushes it. Sequence objects are saved
+ * every time.
+ */
+static void
+resource_manager_flushsave_context_reuse_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    TPMS_CONTEXT context = { .savedHandle = 0x80000000 };
+    TPM2_HANDLE vhandle = TPM2_HR_TRANSIENT + 0x1, phandle = TPM2_HR_TRANSIENT + 0x2;
+    GBytes *bytes;
+
+    entry = handle_map_entry_new (phandle, vhandle);
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    resource_manager_flushsave_context (entry, data->resource_manager);
+    assert_true (handle_map_entry_context_reusable (entry));
+    handle_map_entry_set_phandle (entry, phandle);
+    will_return (__wrap_tpm2_context_flush, TSS2_RC_SUCCESS);
+    resource_manager_flushsave_context (entry, data->resource_manager);
+    assert_int_equal (handle_map_entry_get_phandle (entry), 0);
+
+    context.savedHandle = HANDLE_MAP_ENTRY_SAVED_SEQUENCE;
+    bytes = context_bytes_new (&context);
+    handle_map_entry_set_context (entry, bytes);
+    g_bytes_unref (bytes);
+    handle_map_entry_set_phandle (entry, phandle);
+    assert_false (handle_map_entry_context_reusable (entry));
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    resource_manager_flushsave_context (entry, data->resource_manager);
+    assert_int_equal (handle_map_entry_get_phandle (entry), 0);
+    g_object_unref (entry);
+}
 
 static void
 resource_manager_flushsave_context_same_entries_test (void **state)
@@ -345,87 +709,622 @@ resource_manager_flushsave_context_fail_test (void **state)
     g_object_unref (entry);
 }
 /*
+ * Make two HandleMapEntry objects resident in the ResourceManager and evict
+ * them. Both should be saved / flushed and the resident list should be
+ * emptied.
  */
 static void
-resource_manager_virt_to_phys_test (void **state)
+resource_manager_evict_transients_test (void **state)
 {
-    test_data_t    *data = (test_data_t*)*state;
-    HandleMapEntry *entry;
-    TPM2_HANDLE      phandle = TPM2_HR_TRANSIENT + 0x1, vhandle = 0;
-    TPM2_HANDLE      handle_ret = 0;
-    TSS2_RC         rc = TSS2_RC_SUCCESS;
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry *entry1, *entry2;
+    guint count;
 
-    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
-    will_return (__wrap_tpm2_context_load, phandle);
-    /* and the rest of it */
+    entry1 = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x2,
+                                   TPM2_HR_TRANSIENT + 0x1);
+    entry2 = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x4,
+                                   TPM2_HR_TRANSIENT + 0x3);
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry1));
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry2));
+    resmgr->resident_connection = g_object_ref (data->connection);
 
-    /* create & populate HandleMap for transient handle */
-    vhandle = tpm2_command_get_handle (data->command, 0);
-    entry = handle_map_entry_new (0, vhandle);
-    /* function under test, */
-    rc = resource_manager_virt_to_phys (data->resource_manager,
-                                        data->command,
-                                        entry,
-                                        0);
-    g_object_unref (entry);
-    handle_ret = tpm2_command_get_handle (data->command, 0);
-    assert_int_equal (rc, TSS2_RC_SUCCESS);
-    assert_int_equal (phandle, handle_ret);
+    will_return_count (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS, 2);
+    count = resource_manager_evict_transients (resmgr, NULL);
+    assert_int_equal (count, 2);
+    assert_null (resmgr->resident_transients);
+    assert_int_equal (handle_map_entry_get_phandle (entry1), 0);
+    assert_int_equal (handle_map_entry_get_phandle (entry2), 0);
+    g_object_unref (entry1);
+    g_object_unref (entry2);
+}
+/*
+ * Entries in the 'keep' list are in use by the current command and must
+ * not be evicted.
+ */
+static void
+resource_manager_evict_transients_keep_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry *entry1, *entry2;
+    GSList *keep = NULL;
+    guint count;
 
+    entry1 = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x2,
+                                   TPM2_HR_TRANSIENT + 0x1);
+    entry2 = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x4,
+                                   TPM2_HR_TRANSIENT + 0x3);
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry1));
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry2));
+    resmgr->resident_connection = g_object_ref (data->connection);
+    keep = g_slist_prepend (keep, entry1);
+
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    count = resource_manager_evict_transients (resmgr, keep);
+    assert_int_equal (count, 1);
+    assert_int_equal (g_slist_length (resmgr->resident_transients), 1);
+    assert_ptr_equal (resmgr->resident_transients->data, entry1);
+    assert_ptr_equal (resmgr->resident_connection, data->connection);
+    assert_int_equal (handle_map_entry_get_phandle (entry1),
+                      TPM2_HR_TRANSIENT + 0x2);
+    assert_int_equal (handle_map_entry_get_phandle (entry2), 0);
+    g_slist_free (keep);
+    g_object_unref (entry1);
+    g_object_unref (entry2);
 }
 /*
+ * Evicting the least recently used transient object should save / flush
+ * only the entry with the oldest 'last_use' timestamp.
  */
 static void
-resource_manager_load_handles_test(void **state)
+resource_manager_evict_lru_transient_test (void **state)
 {
-    test_data_t    *data = (test_data_t*)*state;
-    HandleMapEntry *entry;
-    GSList         *entry_slist;
-    HandleMap      *map;
-    TPM2_HANDLE      phandles [3] = {
-        TPM2_HR_TRANSIENT + 0xeb,
-        TPM2_HR_TRANSIENT + 0xbe,
-        0
-    };
-    TPM2_HANDLE      vhandles [3] = { 0, 0, 0 };
-    TPM2_HANDLE      handle_ret;
-    TSS2_RC         rc = TSS2_RC_SUCCESS;
-    size_t          handle_count = 2, i;
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry *entry1, *entry2;
+    gboolean ret;
 
-    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
-    will_return (__wrap_tpm2_context_load, phandles [0]);
-    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
-    will_return (__wrap_tpm2_context_load, phandles [1]);
+    entry1 = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x2,
+                                   TPM2_HR_TRANSIENT + 0x1);
+    entry2 = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x4,
+                                   TPM2_HR_TRANSIENT + 0x3);
+    handle_map_entry_set_last_use (entry1, 2);
+    handle_map_entry_set_last_use (entry2, 1);
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry1));
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry2));
 
-    tpm2_command_get_handles (data->command, vhandles, &handle_count);
-    map = connection_get_trans_map (data->connection);
-    if (handle_count > 2) {
-        assert (FALSE);
-    }
-    for (i = 0; i < handle_count; ++i) {
-        entry = handle_map_entry_new (0, vhandles [i]);
-        handle_map_insert (map, vhandles [i], entry);
-        g_object_unref (entry);
-    }
-    rc = resource_manager_load_handles (data->resource_manager,
-                                        data->command,
-                                        &entry_slist);
-    assert_int_equal (rc, TSS2_RC_SUCCESS);
-    assert_true (handle_count <= 2);
-    for (i = 0; i < handle_count; ++i) {
-        handle_ret = tpm2_command_get_handle (data->command, i);
-        assert_int_equal (phandles [i], handle_ret);
-    }
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    ret = resource_manager_evict_lru_transient (resmgr, NULL);
+    assert_true (ret);
+    assert_int_equal (g_slist_length (resmgr->resident_transients), 1);
+    assert_ptr_equal (resmgr->resident_transients->data, entry1);
+    assert_int_equal (handle_map_entry_get_phandle (entry2), 0);
+    g_object_unref (entry1);
+    g_object_unref (entry2);
 }
 /*
- * This setup function calls the 'resource_manager_setup' function to create
- * the ResourceManager object etc. It then creates a Tpm2Response object
- * approprite for use in testing the 'get_cap_post_process' function.
+ * A resident transient object the TPM fails to save stays loaded and on
+ * the resident list so a later eviction can try again, whether it's
+ * evicted with the others or on its own.
  */
-int
-resource_manager_setup_getcap (void **state)
+static void
+resource_manager_evict_transients_fail_test (void **state)
 {
-    int setup_ret;
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry *entry1, *entry2;
+
+    entry1 = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x2,
+                                   TPM2_HR_TRANSIENT + 0x1);
+    entry2 = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x4,
+                                   TPM2_HR_TRANSIENT + 0x3);
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry1));
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry2));
+
+    /* entry2 is first on the list and fails */
+    will_return (__wrap_tpm2_context_saveflush, TPM2_RC_INITIALIZE);
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    assert_int_equal (resource_manager_evict_transients (resmgr, NULL), 1);
+    assert_int_equal (g_slist_length (resmgr->resident_transients), 1);
+    assert_ptr_equal (resmgr->resident_transients->data, entry2);
+    assert_int_equal (handle_map_entry_get_phandle (entry2),
+                      TPM2_HR_TRANSIENT + 0x4);
+
+    will_return (__wrap_tpm2_context_saveflush, TPM2_RC_INITIALIZE);
+    assert_false (resource_manager_evict_lru_transient (resmgr, NULL));
+    assert_int_equal (g_slist_length (resmgr->resident_transients), 1);
+    assert_int_equal (handle_map_entry_get_phandle (entry2),
+                      TPM2_HR_TRANSIENT + 0x4);
+
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    assert_true (resource_manager_evict_lru_transient (resmgr, NULL));
+    assert_null (resmgr->resident_transients);
+    g_object_unref (entry1);
+    g_object_unref (entry2);
+}
+/*
+ * Build a TABRMD_CC_RESIDENCY command from 'connection' hinting
+ * 'residency' for 'vhandle'.
+ */
+static Tpm2Command*
+residency_command_new (Connection  *connection,
+                       TPM2_HANDLE  vhandle,
+                       guint8       residency)
+{
+    guint8 *buffer = calloc (1, TABRMD_RESIDENCY_SIZE);
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)&buffer [2] = htobe32 (TABRMD_RESIDENCY_SIZE);
+    *(TPM2_CC*)&buffer [6] = htobe32 (TABRMD_CC_RESIDENCY);
+    *(TPM2_HANDLE*)&buffer [TPM_HEADER_SIZE] = htobe32 (vhandle);
+    buffer [TPM_HEADER_SIZE + sizeof (TPM2_HANDLE)] = residency;
+    return tpm2_command_new (connection,
+                             buffer,
+                             TABRMD_RESIDENCY_SIZE,
+                             (TPMA_CC){ 0, });
+}
+/*
+ * Residency hints are taken for the connection's own objects, the ones
+ * that keep an object resident only up to the pinned_max.
+ */
+static void
+resource_manager_residency_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry1, *entry2;
+    Tpm2Command *command;
+    Tpm2Response *response;
+    HandleMap *map;
+
+    entry1 = handle_map_entry_new (0, TPM2_HR_TRANSIENT + 0x1);
+    entry2 = handle_map_entry_new (0, TPM2_HR_TRANSIENT + 0x2);
+    map = connection_get_trans_map (data->connection);
+    handle_map_insert (map, TPM2_HR_TRANSIENT + 0x1, entry1);
+    handle_map_insert (map, TPM2_HR_TRANSIENT + 0x2, entry2);
+    g_object_unref (map);
+    resource_manager_set_pinned_max (data->resource_manager, 1);
+
+    command = residency_command_new (data->connection,
+                                     TPM2_HR_TRANSIENT + 0x1,
+                                     TABRMD_RESIDENCY_PINNED);
+    assert_true (tpm2_command_get_flags (command) & TPM2_COMMAND_FLAG_SPECIAL);
+    response = resource_manager_residency (data->resource_manager, command);
+    assert_int_equal (tpm2_response_get_code (response), TSS2_RC_SUCCESS);
+    assert_int_equal (handle_map_entry_get_residency (entry1),
+                      TABRMD_RESIDENCY_PINNED);
+    g_object_unref (response);
+    g_object_unref (command);
+
+    command = residency_command_new (data->connection,
+                                     TPM2_HR_TRANSIENT + 0x2,
+                                     TABRMD_RESIDENCY_HOT);
+    response = resource_manager_residency (data->resource_manager, command);
+    assert_int_equal (tpm2_response_get_code (response),
+                      TSS2_RESMGR_RC_OBJECT_MEMORY);
+    assert_int_equal (handle_map_entry_get_residency (entry2),
+                      TABRMD_RESIDENCY_NORMAL);
+    g_object_unref (response);
+    g_object_unref (command);
+
+    command = residency_command_new (data->connection,
+                                     TPM2_HR_TRANSIENT + 0x3,
+                                     TABRMD_RESIDENCY_EVICT_FIRST);
+    response = resource_manager_residency (data->resource_manager, command);
+    assert_int_not_equal (tpm2_response_get_code (response), TSS2_RC_SUCCESS);
+    g_object_unref (response);
+    g_object_unref (command);
+    g_object_unref (entry1);
+    g_object_unref (entry2);
+}
+/*
+ * Build a TPM2_ContextSave command from 'connection' for 'handle'.
+ */
+static Tpm2Command*
+context_save_command_new (Connection  *connection,
+                          TPM2_HANDLE  handle)
+{
+    size_t size = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE);
+    guint8 *buffer = calloc (1, size);
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)&buffer [2] = htobe32 (size);
+    *(TPM2_CC*)&buffer [6] = htobe32 (TPM2_CC_ContextSave);
+    *(TPM2_HANDLE*)&buffer [TPM_HEADER_SIZE] = htobe32 (handle);
+    return tpm2_command_new (connection, buffer, size, (TPMA_CC){ 0, });
+}
+/*
+ * ContextSave of a transient object the RM holds a saved context for is
+ * answered with that context, no command goes to the TPM. Objects with
+ * no context or a sequence object's are left to the TPM.
+ */
+static void
+resource_manager_save_context_transient_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPMS_CONTEXT context = {
+        .sequence = 0x1234,
+        .savedHandle = 0x80000000,
+        .hierarchy = TPM2_RH_OWNER,
+        .contextBlob = { .size = 4, .buffer = { 1, 2, 3, 4 } },
+    }, returned = { 0, };
+    TPM2_HANDLE vhandle = TPM2_HR_TRANSIENT + 0x1;
+    HandleMapEntry *entry;
+    Tpm2Command *command;
+    Tpm2Response *response;
+    HandleMap *map;
+    GBytes *bytes;
+
+    entry = handle_map_entry_new (0, vhandle);
+    map = connection_get_trans_map (data->connection);
+    handle_map_insert (map, vhandle, entry);
+    g_object_unref (map);
+    command = context_save_command_new (data->connection, vhandle);
+    assert_null (resource_manager_save_context_transient (data->resource_manager,
+                                                          command));
+
+    bytes = context_bytes_new (&context);
+    handle_map_entry_set_context (entry, bytes);
+    g_bytes_unref (bytes);
+    response = resource_manager_save_context_transient (data->resource_manager,
+                                                        command);
+    assert_non_null (response);
+    assert_int_equal (tpm2_response_get_code (response), TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPMS_CONTEXT_Unmarshal (tpm2_response_get_buffer (response),
+                                                      tpm2_response_get_size (response),
+                                                      &(size_t){ TPM_HEADER_SIZE },
+                                                      &returned),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (returned.sequence, context.sequence);
+    assert_int_equal (returned.savedHandle, context.savedHandle);
+    assert_int_equal (returned.hierarchy, context.hierarchy);
+    assert_int_equal (returned.contextBlob.size, context.contextBlob.size);
+    assert_memory_equal (returned.contextBlob.buffer,
+                         context.contextBlob.buffer,
+                         context.contextBlob.size);
+    g_object_unref (response);
+
+    context.savedHandle = HANDLE_MAP_ENTRY_SAVED_SEQUENCE;
+    bytes = context_bytes_new (&context);
+    handle_map_entry_set_context (entry, bytes);
+    g_bytes_unref (bytes);
+    assert_null (resource_manager_save_context_transient (data->resource_manager,
+                                                          command));
+    g_object_unref (command);
+    g_object_unref (entry);
+}
+/*
+ * Build a TABRMD_CC_NV_READ_LARGE or TABRMD_CC_NV_WRITE_LARGE command
+ * from 'connection' for 'length' bytes at 'offset' with an empty password.
+ */
+static Tpm2Command*
+nv_large_command_new (Connection *connection,
+                      TPM2_CC     command_code,
+                      UINT16      offset,
+                      UINT16      length)
+{
+    size_t size = TPM_HEADER_SIZE + 2 * sizeof (TPM2_HANDLE) +
+        3 * sizeof (UINT16);
+    guint8 *buffer;
+
+    if (command_code == TABRMD_CC_NV_WRITE_LARGE) {
+        size += length;
+    }
+    buffer = calloc (1, size);
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)&buffer [2] = htobe32 (size);
+    *(TPM2_CC*)&buffer [6] = htobe32 (command_code);
+    *(TPM2_HANDLE*)&buffer [TPM_HEADER_SIZE] = htobe32 (TPM2_RH_OWNER);
+    *(TPM2_HANDLE*)&buffer [TPM_HEADER_SIZE + 4] = htobe32 (TPM2_NV_INDEX_FIRST);
+    /* the empty TPM2B_AUTH is left zeroed */
+    *(UINT16*)&buffer [TPM_HEADER_SIZE + 10] = htobe16 (offset);
+    *(UINT16*)&buffer [TPM_HEADER_SIZE + 12] = htobe16 (length);
+    return tpm2_command_new (connection, buffer, size, (TPMA_CC){ 0, });
+}
+/*
+ * A large NV read is split into reads of TPM2_MAX_NV_BUFFER_SIZE, the TPM
+ * reporting no TPM2_PT_NV_BUFFER_MAX, and the bytes are put back together
+ * in the response.
+ */
+static void
+resource_manager_nv_read_large_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    Tpm2Response *response;
+    guint8 *buffer;
+    UINT16 i, length = 2 * TPM2_MAX_NV_BUFFER_SIZE + 100;
+
+    command = nv_large_command_new (data->connection,
+                                    TABRMD_CC_NV_READ_LARGE,
+                                    10,
+                                    length);
+    assert_true (tpm2_command_get_flags (command) & TPM2_COMMAND_FLAG_SPECIAL);
+    for (i = 0; i < 3; ++i) {
+        expect_value (__wrap_tpm2_nv_read, size,
+                      i < 2 ? TPM2_MAX_NV_BUFFER_SIZE : 100);
+        expect_value (__wrap_tpm2_nv_read, offset,
+                      10 + i * TPM2_MAX_NV_BUFFER_SIZE);
+        will_return (__wrap_tpm2_nv_read, TSS2_RC_SUCCESS);
+    }
+    response = resource_manager_nv_large (data->resource_manager, command);
+    assert_int_equal (tpm2_response_get_code (response), TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_response_get_size (response),
+                      TPM_HEADER_SIZE + sizeof (UINT16) + length);
+    buffer = tpm2_response_get_buffer (response);
+    assert_int_equal (be16toh (*(UINT16*)&buffer [TPM_HEADER_SIZE]), length);
+    for (i = 0; i < length; ++i) {
+        assert_int_equal (buffer [TPM_HEADER_SIZE + sizeof (UINT16) + i],
+                          (guint8)(10 + i));
+    }
+    g_object_unref (response);
+    g_object_unref (command);
+}
+/*
+ * A large NV write stops at the first write that fails and returns its RC.
+ */
+static void
+resource_manager_nv_write_large_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    Tpm2Response *response;
+
+    command = nv_large_command_new (data->connection,
+                                    TABRMD_CC_NV_WRITE_LARGE,
+                                    0,
+                                    3 * TPM2_MAX_NV_BUFFER_SIZE);
+    expect_value (__wrap_tpm2_nv_write, size, TPM2_MAX_NV_BUFFER_SIZE);
+    expect_value (__wrap_tpm2_nv_write, offset, 0);
+    will_return (__wrap_tpm2_nv_write, TSS2_RC_SUCCESS);
+    expect_value (__wrap_tpm2_nv_write, size, TPM2_MAX_NV_BUFFER_SIZE);
+    expect_value (__wrap_tpm2_nv_write, offset, TPM2_MAX_NV_BUFFER_SIZE);
+    will_return (__wrap_tpm2_nv_write, TPM2_RC_NV_LOCKED);
+    response = resource_manager_nv_large (data->resource_manager, command);
+    assert_int_equal (tpm2_response_get_code (response), TPM2_RC_NV_LOCKED);
+    g_object_unref (response);
+    g_object_unref (command);
+
+    command = nv_large_command_new (data->connection,
+                                    TABRMD_CC_NV_WRITE_LARGE,
+                                    G_MAXUINT16,
+                                    2);
+    response = resource_manager_nv_large (data->resource_manager, command);
+    assert_int_not_equal (tpm2_response_get_code (response), TSS2_RC_SUCCESS);
+    g_object_unref (response);
+    g_object_unref (command);
+}
+/*
+ * A pinned object is never the one evicted, an evict-first one goes
+ * before a less recently used object.
+ */
+static void
+resource_manager_evict_lru_residency_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry *pinned, *normal, *first;
+
+    pinned = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x2,
+                                   TPM2_HR_TRANSIENT + 0x1);
+    normal = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x4,
+                                   TPM2_HR_TRANSIENT + 0x3);
+    first = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x6,
+                                  TPM2_HR_TRANSIENT + 0x5);
+    handle_map_entry_set_last_use (pinned, 1);
+    handle_map_entry_set_last_use (normal, 2);
+    handle_map_entry_set_last_use (first, 3);
+    handle_map_entry_set_residency (pinned, TABRMD_RESIDENCY_PINNED);
+    handle_map_entry_set_residency (first, TABRMD_RESIDENCY_EVICT_FIRST);
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (pinned));
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (normal));
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (first));
+
+    will_return_count (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS, 2);
+    assert_true (resource_manager_evict_lru_transient (resmgr, NULL));
+    assert_int_equal (handle_map_entry_get_phandle (first), 0);
+    assert_true (resource_manager_evict_lru_transient (resmgr, NULL));
+    assert_int_equal (handle_map_entry_get_phandle (normal), 0);
+    assert_false (resource_manager_evict_lru_transient (resmgr, NULL));
+    assert_int_equal (g_slist_length (resmgr->resident_transients), 1);
+    assert_ptr_equal (resmgr->resident_transients->data, pinned);
+    g_object_unref (pinned);
+    g_object_unref (normal);
+    g_object_unref (first);
+}
+/*
+ * An idle eviction pass only takes the resident transient objects not
+ * used since the previous pass, and the next one isn't due right away.
+ */
+static void
+resource_manager_evict_idle_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry *entry1, *entry2;
+
+    entry1 = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x2,
+                                   TPM2_HR_TRANSIENT + 0x1);
+    entry2 = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x4,
+                                   TPM2_HR_TRANSIENT + 0x3);
+    handle_map_entry_set_last_use (entry1, 1);
+    handle_map_entry_set_last_use (entry2, 3);
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry1));
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry2));
+    resmgr->use_clock = 3;
+    resmgr->evict_mark = 2;
+    resource_manager_set_evict_idle (resmgr, 1000);
+
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    assert_int_equal (resource_manager_evict_idle (resmgr), 1);
+    assert_int_equal (g_slist_length (resmgr->resident_transients), 1);
+    assert_ptr_equal (resmgr->resident_transients->data, entry2);
+    assert_int_equal (handle_map_entry_get_phandle (entry1), 0);
+    assert_int_equal (resmgr->evict_mark, 3);
+    assert_int_equal (resource_manager_evict_idle (resmgr), 0);
+    g_object_unref (entry1);
+    g_object_unref (entry2);
+}
+/*
+ * TPM2_RC_MEMORY evicts the least recently used context whatever its kind,
+ * here the older of two transient objects with no sessions loaded. RCs
+ * that aren't about TPM memory evict nothing.
+ */
+static void
+resource_manager_evict_for_rc_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry *entry1, *entry2;
+
+    entry1 = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x2,
+                                   TPM2_HR_TRANSIENT + 0x1);
+    entry2 = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x4,
+                                   TPM2_HR_TRANSIENT + 0x3);
+    handle_map_entry_set_last_use (entry1, 1);
+    handle_map_entry_set_last_use (entry2, 2);
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry1));
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry2));
+
+    assert_false (resource_manager_evict_for_rc (resmgr, TPM2_RC_FAILURE,
+                                                 NULL, NULL));
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    assert_true (resource_manager_evict_for_rc (resmgr, TPM2_RC_MEMORY,
+                                                NULL, NULL));
+    assert_int_equal (g_slist_length (resmgr->resident_transients), 1);
+    assert_ptr_equal (resmgr->resident_transients->data, entry2);
+    assert_int_equal (handle_map_entry_get_phandle (entry1), 0);
+    g_object_unref (entry1);
+    g_object_unref (entry2);
+}
+/*
+ * When every resident object is in use by the current command there's
+ * nothing to evict.
+ */
+static void
+resource_manager_evict_lru_transient_none_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry *entry;
+    GSList *keep = NULL;
+
+    entry = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x2,
+                                  TPM2_HR_TRANSIENT + 0x1);
+    resmgr->resident_transients =
+        g_slist_prepend (resmgr->resident_transients, g_object_ref (entry));
+    keep = g_slist_prepend (keep, entry);
+
+    assert_false (resource_manager_evict_lru_transient (resmgr, keep));
+    assert_int_equal (g_slist_length (resmgr->resident_transients), 1);
+    g_slist_free (keep);
+    g_object_unref (entry);
+}
+/*
+ */
+static void
+resource_manager_virt_to_phys_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    TPM2_HANDLE      phandle = TPM2_HR_TRANSIENT + 0x1, vhandle = 0;
+    TPM2_HANDLE      handle_ret = 0;
+    TSS2_RC         rc = TSS2_RC_SUCCESS;
+    GBytes         *context;
+
+    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_load, phandle);
+    /* and the rest of it */
+
+    /* create & populate HandleMap for transient handle */
+    vhandle = tpm2_command_get_handle (data->command, 0);
+    entry = handle_map_entry_new (0, vhandle);
+    context = context_bytes_transient_new ();
+    handle_map_entry_set_context (entry, context);
+    g_bytes_unref (context);
+    /* function under test, */
+    rc = resource_manager_virt_to_phys (data->resource_manager,
+                                        data->command,
+                                        entry,
+                                        0);
+    g_object_unref (entry);
+    handle_ret = tpm2_command_get_handle (data->command, 0);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (phandle, handle_ret);
+
+}
+/*
+ */
+static void
+resource_manager_load_handles_test(void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    GSList         *entry_slist;
+    HandleMap      *map;
+    TPM2_HANDLE      phandles [3] = {
+        TPM2_HR_TRANSIENT + 0xeb,
+        TPM2_HR_TRANSIENT + 0xbe,
+        0
+    };
+    TPM2_HANDLE      vhandles [3] = { 0, 0, 0 };
+    TPM2_HANDLE      handle_ret;
+    TSS2_RC         rc = TSS2_RC_SUCCESS;
+    size_t          handle_count = 2, i;
+    GBytes         *context;
+
+    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_load, phandles [0]);
+    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_load, phandles [1]);
+
+    tpm2_command_get_handles (data->command, vhandles, &handle_count);
+    map = connection_get_trans_map (data->connection);
+    if (handle_count > 2) {
+        assert (FALSE);
+    }
+    context = context_bytes_transient_new ();
+    for (i = 0; i < handle_count; ++i) {
+        entry = handle_map_entry_new (0, vhandles [i]);
+        handle_map_entry_set_context (entry, context);
+        handle_map_insert (map, vhandles [i], entry);
+        g_object_unref (entry);
+    }
+    g_bytes_unref (context);
+    rc = resource_manager_load_handles (data->resource_manager,
+                                        data->command,
+                                        &entry_slist);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_true (handle_count <= 2);
+    for (i = 0; i < handle_count; ++i) {
+        handle_ret = tpm2_command_get_handle (data->command, i);
+        assert_int_equal (phandles [i], handle_ret);
+    }
+}
+/*
+ * This setup function calls the 'resource_manager_setup' function to create
+ * the ResourceManager object etc. It then creates a Tpm2Response object
+ * approprite for use in testing the 'get_cap_post_process' function.
+ */
+int
+resource_manager_setup_getcap (void **state)
+{
+    int setup_ret;
     test_data_t *data = NULL;
     size_t offset = 0, buf_size = 0;
     uint8_t *buf = NULL;
@@ -522,7 +1421,7 @@ resource_manager_getcap_gap_max_test (void **state)
     assert_int_equal (cap_data.data.tpmProperties.tpmProperty [0].value, UINT8_MAX);
     offset = TPM_HEADER_SIZE;
     /* execute function under test */
-    rc = get_cap_post_process (data->response);
+    rc = get_cap_post_process (data->resource_manager, data->response);
     assert_int_equal (rc, TSS2_RC_SUCCESS);
     rc = Tss2_MU_BYTE_Unmarshal (buf, buf_size, &offset, &yes_no);
     assert_int_equal (rc, TSS2_RC_SUCCESS);
@@ -534,36 +1433,1236 @@ resource_manager_getcap_gap_max_test (void **state)
     /* verify property was modified by the RM */
     assert_int_equal (cap_data.data.tpmProperties.tpmProperty [0].value, UINT32_MAX);
 }
-int
-main (void)
+/*
+ * Build a GetCapability command for TPM2_PT_CONTEXT_GAP_MAX, a property
+ * from the TPM2_PT_FIXED group.
+ */
+static Tpm2Command*
+getcap_fixed_command_new (Connection *connection)
 {
-    const struct CMUnitTest tests[] = {
-        cmocka_unit_test_setup_teardown (resource_manager_type_test,
-                                         resource_manager_setup,
-                                         resource_manager_teardown),
-        cmocka_unit_test_setup_teardown (resource_manager_sink_enqueue_test,
-                                         resource_manager_setup,
-                                         resource_manager_teardown),
-        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_success_test,
-                                         resource_manager_setup,
-                                         resource_manager_teardown),
-        cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_test,
-                                         resource_manager_setup,
-                                         resource_manager_teardown),
-        cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_same_entries_test,
-                                         resource_manager_setup,
-                                         resource_manager_teardown),
-        cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_fail_test,
-                                         resource_manager_setup,
-                                         resource_manager_teardown),
-        cmocka_unit_test_setup_teardown (resource_manager_virt_to_phys_test,
-                                         resource_manager_setup_two_transient_handles,
-                                         resource_manager_teardown),
-        cmocka_unit_test_setup_teardown (resource_manager_load_handles_test,
-                                         resource_manager_setup_two_transient_handles,
-                                         resource_manager_teardown),
-        cmocka_unit_test_setup_teardown (resource_manager_getcap_gap_max_test,
-                                         resource_manager_setup_getcap,
+    size_t size = TPM_HEADER_SIZE + 3 * sizeof (UINT32);
+    guint8 *buffer = g_malloc0 (size);
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (size);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (TPM2_CC_GetCapability);
+    *(TPM2_CAP*)(buffer + TPM_HEADER_SIZE) = htobe32 (TPM2_CAP_TPM_PROPERTIES);
+    *(UINT32*)(buffer + TPM_HEADER_SIZE + 4) = htobe32 (TPM2_PT_CONTEXT_GAP_MAX);
+    *(UINT32*)(buffer + TPM_HEADER_SIZE + 8) = htobe32 (1);
+    return tpm2_command_new (connection, buffer, size, TPM2_CC_GetCapability);
+}
+/*
+ * The response to a GetCapability for fixed properties is kept: the same
+ * query is answered again without a TPM round trip. The wrapped
+ * tpm2_send_command would fail the test if it were called a second time.
+ */
+void
+resource_manager_getcap_cache_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response = data->response;
+    Tpm2Command *command;
+
+    g_object_ref (response);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    command = getcap_fixed_command_new (data->connection);
+    resource_manager_process_tpm2_command (data->resource_manager, command);
+    g_object_unref (command);
+    assert_int_equal (data->response, response);
+    assert_int_equal (g_hash_table_size (data->resource_manager->cap_cache), 1);
+
+    data->response_rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+    will_return (__wrap_sink_enqueue, data);
+    command = getcap_fixed_command_new (data->connection);
+    resource_manager_process_tpm2_command (data->resource_manager, command);
+    g_object_unref (command);
+    assert_int_equal (data->response_rc, TSS2_RC_SUCCESS);
+    g_object_unref (response);
+}
+/*
+ * Build a GetCapability command for up to 'count' handles from 'first'.
+ */
+static Tpm2Command*
+getcap_handles_command_new (Connection  *connection,
+                            TPM2_HANDLE  first,
+                            UINT32       count)
+{
+    size_t size = TPM_HEADER_SIZE + 3 * sizeof (UINT32);
+    guint8 *buffer = g_malloc0 (size);
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (size);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (TPM2_CC_GetCapability);
+    *(TPM2_CAP*)(buffer + TPM_HEADER_SIZE) = htobe32 (TPM2_CAP_HANDLES);
+    *(UINT32*)(buffer + TPM_HEADER_SIZE + 4) = htobe32 (first);
+    *(UINT32*)(buffer + TPM_HEADER_SIZE + 8) = htobe32 (count);
+    return tpm2_command_new (connection, buffer, size, TPM2_CC_GetCapability);
+}
+static void
+session_insert (ResourceManager       *resmgr,
+                Connection            *connection,
+                TPM2_HANDLE            handle,
+                SessionEntryStateEnum  state)
+{
+    SessionEntry *entry;
+
+    entry = session_entry_new (connection, handle);
+    session_entry_set_state (entry, state);
+    session_list_insert (resmgr->session_list, entry);
+    g_object_unref (entry);
+}
+/*
+ * Unmarshal the TPMI_YES_NO and TPMS_CAPABILITY_DATA from the response the
+ * wrapped sink_enqueue kept.
+ */
+static TPMI_YES_NO
+getcap_response_unmarshal (test_data_t          *data,
+                           TPMS_CAPABILITY_DATA *cap_data)
+{
+    size_t offset = TPM_HEADER_SIZE;
+    TPMI_YES_NO more_data = TPM2_NO;
+    TSS2_RC rc;
+
+    rc = Tss2_MU_BYTE_Unmarshal (tpm2_response_get_buffer (data->response),
+                                 tpm2_response_get_size (data->response),
+                                 &offset,
+                                 &more_data);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    rc = Tss2_MU_TPMS_CAPABILITY_DATA_Unmarshal (tpm2_response_get_buffer (data->response),
+                                                 tpm2_response_get_size (data->response),
+                                                 &offset,
+                                                 cap_data);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    return more_data;
+}
+/*
+ * GetCapability for the loaded and saved session ranges lists the sessions
+ * of the connection that sent it, ordered by index, without asking the
+ * TPM: the wrapped tpm2_send_command would fail the test if it were
+ * called. The session of the other connection isn't listed.
+ */
+void
+resource_manager_getcap_sessions_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    TPMS_CAPABILITY_DATA cap_data = { .capability = 0 };
+    Tpm2Command *command;
+    Connection *connection;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    gint client_fd;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 11, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+
+    session_insert (resmgr, data->connection, 0x03000002, SESSION_ENTRY_SAVED_RM);
+    session_insert (resmgr, data->connection, 0x02000001, SESSION_ENTRY_LOADED);
+    session_insert (resmgr, data->connection, 0x02000003, SESSION_ENTRY_SAVED_CLIENT);
+    session_insert (resmgr, connection, 0x02000000, SESSION_ENTRY_LOADED);
+
+    will_return (__wrap_sink_enqueue, data);
+    command = getcap_handles_command_new (data->connection, 0x02000000, 1);
+    resource_manager_process_tpm2_command (resmgr, command);
+    g_object_unref (command);
+    assert_int_equal (data->response_rc, TSS2_RC_SUCCESS);
+    assert_int_equal (getcap_response_unmarshal (data, &cap_data), TPM2_YES);
+    assert_int_equal (cap_data.data.handles.count, 1);
+    assert_int_equal (cap_data.data.handles.handle [0], 0x02000001);
+
+    will_return (__wrap_sink_enqueue, data);
+    command = getcap_handles_command_new (data->connection, 0x02000002, 8);
+    resource_manager_process_tpm2_command (resmgr, command);
+    g_object_unref (command);
+    assert_int_equal (getcap_response_unmarshal (data, &cap_data), TPM2_NO);
+    assert_int_equal (cap_data.data.handles.count, 1);
+    assert_int_equal (cap_data.data.handles.handle [0], 0x03000002);
+
+    will_return (__wrap_sink_enqueue, data);
+    command = getcap_handles_command_new (data->connection, 0x03000000, 8);
+    resource_manager_process_tpm2_command (resmgr, command);
+    g_object_unref (command);
+    assert_int_equal (getcap_response_unmarshal (data, &cap_data), TPM2_NO);
+    assert_int_equal (cap_data.data.handles.count, 1);
+    assert_int_equal (cap_data.data.handles.handle [0], 0x02000003);
+
+    session_list_remove_connection (resmgr->session_list, connection);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * Resource availability properties from the TPM are replaced with what the
+ * connection may still use: an empty transient map and no sessions leave
+ * the whole per connection quota available.
+ */
+void
+resource_manager_getcap_avail_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    uint8_t *buf = g_malloc0 (TPM2_MAX_RESPONSE_SIZE);
+    size_t offset = TPM_HEADER_SIZE;
+    Tpm2Response *response;
+    TSS2_RC rc;
+    TPMS_CAPABILITY_DATA cap_data = {
+        .capability = TPM2_CAP_TPM_PROPERTIES,
+        .data = {
+            .tpmProperties = {
+                .count = 3,
+                .tpmProperty = {
+                    { .property = TPM2_PT_ACTIVE_SESSIONS_MAX, .value = 64 },
+                    { .property = TPM2_PT_HR_TRANSIENT_AVAIL, .value = 3 },
+                    { .property = TPM2_PT_HR_LOADED_AVAIL, .value = 3 },
+                }
+            }
+        }
+    };
+
+    rc = Tss2_MU_BYTE_Marshal (TPM2_NO, buf, TPM2_MAX_RESPONSE_SIZE, &offset);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    rc = Tss2_MU_TPMS_CAPABILITY_DATA_Marshal (&cap_data,
+                                               buf,
+                                               TPM2_MAX_RESPONSE_SIZE,
+                                               &offset);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    rc = tpm2_header_init (buf,
+                           TPM2_MAX_RESPONSE_SIZE,
+                           TPM2_ST_NO_SESSIONS,
+                           offset,
+                           TSS2_RC_SUCCESS);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    response = tpm2_response_new (data->connection,
+                                  buf,
+                                  offset,
+                                  TPM2_CC_GetCapability);
+
+    rc = get_cap_post_process (data->resource_manager, response);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    offset = TPM_HEADER_SIZE + sizeof (TPMI_YES_NO);
+    rc = Tss2_MU_TPMS_CAPABILITY_DATA_Unmarshal (buf,
+                                                 tpm2_response_get_size (response),
+                                                 &offset,
+                                                 &cap_data);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (cap_data.data.tpmProperties.tpmProperty [0].value,
+                      SESSION_LIST_MAX_ENTRIES_DEFAULT);
+    assert_int_equal (cap_data.data.tpmProperties.tpmProperty [1].value,
+                      MAX_ENTRIES_DEFAULT + 1);
+    assert_int_equal (cap_data.data.tpmProperties.tpmProperty [2].value,
+                      SESSION_LIST_MAX_ENTRIES_DEFAULT);
+    g_object_unref (response);
+}
+/*
+ * With a random pool a small GetRandom is answered from it: the wrapped
+ * tpm2_send_command would fail the test if it were called.
+ */
+void
+resource_manager_get_random_pool_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    size_t size = TPM_HEADER_SIZE + sizeof (UINT16);
+    guint8 *buffer = g_malloc0 (size), bytes [32] = { 0 };
+    random_pool_t *pool;
+    Tpm2Command *command;
+
+    if (!resource_manager_set_random_pool (data->resource_manager,
+                                           sizeof (bytes)))
+    {
+        g_free (buffer);
+        skip ();
+    }
+    pool = data->resource_manager->random_pool;
+    random_pool_fill (pool, bytes, sizeof (bytes));
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (size);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (TPM2_CC_GetRandom);
+    *(UINT16*)(buffer + TPM_HEADER_SIZE) = htobe16 (16);
+    command = tpm2_command_new (data->connection, buffer, size, 0);
+
+    data->response_rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager, command);
+    assert_int_equal (data->response_rc, TSS2_RC_SUCCESS);
+    assert_int_equal (pool->len, sizeof (bytes) - 16);
+    g_object_unref (command);
+}
+/*
+ * Build a ReadPublic command for the persistent object 0x81000001.
+ */
+static Tpm2Command*
+read_public_command_new (Connection *connection)
+{
+    size_t size = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE);
+    guint8 *buffer = g_malloc0 (size);
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (size);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (TPM2_CC_ReadPublic);
+    *(TPM2_HANDLE*)(buffer + TPM_HEADER_SIZE) = htobe32 (0x81000001);
+    return tpm2_command_new (connection,
+                             buffer,
+                             size,
+                             (TPMA_CC)(1 << TPMA_CC_CHANDLES_SHIFT));
+}
+/*
+ * The response to a ReadPublic for a persistent object is kept and the
+ * next ReadPublic for the object is answered without a TPM round trip.
+ */
+void
+resource_manager_read_public_cache_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    Tpm2Command *command;
+
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    command = read_public_command_new (data->connection);
+    resource_manager_process_tpm2_command (data->resource_manager, command);
+    g_object_unref (command);
+    assert_int_equal (data->response, response);
+    assert_int_equal (g_hash_table_size (data->resource_manager->read_public_cache), 1);
+
+    data->response_rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+    will_return (__wrap_sink_enqueue, data);
+    command = read_public_command_new (data->connection);
+    resource_manager_process_tpm2_command (data->resource_manager, command);
+    g_object_unref (command);
+    assert_int_equal (data->response_rc, TSS2_RC_SUCCESS);
+    g_object_unref (response);
+}
+#define TEST_NV_INDEX 0x01c00002
+/*
+ * Build an NV_ReadPublic command for TEST_NV_INDEX.
+ */
+static Tpm2Command*
+nv_read_public_command_new (Connection *connection)
+{
+    size_t size = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE);
+    guint8 *buffer = g_malloc0 (size);
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (size);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (TPM2_CC_NV_ReadPublic);
+    *(TPM2_HANDLE*)(buffer + TPM_HEADER_SIZE) = htobe32 (TEST_NV_INDEX);
+    return tpm2_command_new (connection,
+                             buffer,
+                             size,
+                             (TPMA_CC)(1 << TPMA_CC_CHANDLES_SHIFT));
+}
+/*
+ * Build an NV_Read of the first 32 bytes of TEST_NV_INDEX authorized with
+ * the empty password of the index.
+ */
+static Tpm2Command*
+nv_read_command_new (Connection *connection)
+{
+    size_t size = TPM_HEADER_SIZE + 2 * sizeof (TPM2_HANDLE) +
+        sizeof (UINT32) + 9 + 2 * sizeof (UINT16);
+    guint8 *buffer = g_malloc0 (size);
+    size_t offset = TPM_HEADER_SIZE;
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (size);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (TPM2_CC_NV_Read);
+    *(TPM2_HANDLE*)(buffer + offset) = htobe32 (TEST_NV_INDEX);
+    offset += sizeof (TPM2_HANDLE);
+    *(TPM2_HANDLE*)(buffer + offset) = htobe32 (TEST_NV_INDEX);
+    offset += sizeof (TPM2_HANDLE);
+    *(UINT32*)(buffer + offset) = htobe32 (9);
+    offset += sizeof (UINT32);
+    *(TPM2_HANDLE*)(buffer + offset) = htobe32 (TPM2_RS_PW);
+    /* empty nonce, attributes and empty hmac are left 0 */
+    offset += 9;
+    *(UINT16*)(buffer + offset) = htobe16 (32);
+    return tpm2_command_new (connection,
+                             buffer,
+                             size,
+                             (TPMA_CC)(2 << TPMA_CC_CHANDLES_SHIFT));
+}
+/*
+ * Send 'command' through the ResourceManager and have the wrapped
+ * tpm2_send_command answer it with 'response'.
+ */
+static void
+process_with_response (test_data_t  *data,
+               Tpm2Command  *command,
+               Tpm2Response *response)
+{
+    g_object_ref (response);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager, command);
+    g_object_unref (command);
+    assert_int_equal (data->response, response);
+}
+/*
+ * Send an NV_ReadPublic showing that TEST_NV_INDEX may only be written by
+ * the platform, then an NV_Read of it: both end up in the NV cache.
+ */
+static void
+nv_cache_prime (test_data_t *data)
+{
+    Tpm2Response *response;
+    size_t offset = TPM_HEADER_SIZE;
+    guint8 *buf = g_malloc0 (TPM2_MAX_RESPONSE_SIZE);
+    TSS2_RC rc;
+    TPM2B_NV_PUBLIC nv_public = {
+        .nvPublic = {
+            .nvIndex = TEST_NV_INDEX,
+            .nameAlg = TPM2_ALG_SHA256,
+            .attributes = TPMA_NV_PPWRITE | TPMA_NV_AUTHREAD |
+                TPMA_NV_PLATFORMCREATE | TPMA_NV_WRITTEN,
+            .dataSize = 32,
+        },
+    };
+
+    rc = Tss2_MU_TPM2B_NV_PUBLIC_Marshal (&nv_public,
+                                          buf,
+                                          TPM2_MAX_RESPONSE_SIZE,
+                                          &offset);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    rc = tpm2_header_init (buf,
+                           TPM2_MAX_RESPONSE_SIZE,
+                           TPM2_ST_NO_SESSIONS,
+                           offset,
+                           TSS2_RC_SUCCESS);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    response = tpm2_response_new (data->connection,
+                                  buf,
+                                  offset,
+                                  TPM2_CC_NV_ReadPublic);
+    process_with_response (data, nv_read_public_command_new (data->connection), response);
+    g_object_unref (response);
+    assert_int_equal (g_hash_table_size (data->resource_manager->nv_attrs), 1);
+
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    process_with_response (data, nv_read_command_new (data->connection), response);
+    g_object_unref (response);
+    assert_int_equal (g_hash_table_size (data->resource_manager->nv_cache), 2);
+}
+/*
+ * Once NV_ReadPublic has shown that an index may only be written by the
+ * platform, a password authorized NV_Read of it is answered from the
+ * cache the second time. The wrapped tpm2_send_command would fail the
+ * test if it were called for it.
+ */
+void
+resource_manager_nv_cache_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+
+    nv_cache_prime (data);
+    data->response_rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+    will_return (__wrap_sink_enqueue, data);
+    command = nv_read_command_new (data->connection);
+    resource_manager_process_tpm2_command (data->resource_manager, command);
+    g_object_unref (command);
+    assert_int_equal (data->response_rc, TSS2_RC_SUCCESS);
+}
+/*
+ * Build the response to an NV_ReadPublic of TEST_NV_INDEX, an index
+ * only the platform may write with 'attributes' added and 'size' bytes
+ * of data.
+ */
+static Tpm2Response*
+nv_read_public_response_new (TPMA_NV attributes,
+                             UINT16  size)
+{
+    size_t offset = TPM_HEADER_SIZE;
+    guint8 *buf = g_malloc0 (TPM2_MAX_RESPONSE_SIZE);
+    TPM2B_NV_PUBLIC nv_public = {
+        .nvPublic = {
+            .nvIndex = TEST_NV_INDEX,
+            .nameAlg = TPM2_ALG_SHA256,
+            .attributes = TPMA_NV_PPWRITE | TPMA_NV_PLATFORMCREATE |
+                TPMA_NV_WRITTEN | attributes,
+            .dataSize = size,
+        },
+    };
+
+    assert_int_equal (Tss2_MU_TPM2B_NV_PUBLIC_Marshal (&nv_public,
+                                                       buf,
+                                                       TPM2_MAX_RESPONSE_SIZE,
+                                                       &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buf,
+                                        TPM2_MAX_RESPONSE_SIZE,
+                                        TPM2_ST_NO_SESSIONS,
+                                        offset,
+                                        TSS2_RC_SUCCESS),
+                      TSS2_RC_SUCCESS);
+    return tpm2_response_new (NULL, buf, offset, TPM2_CC_NV_ReadPublic);
+}
+/*
+ * Have the wrapped tpm2_send_command answer the next warm-up command with
+ * 'response' and send it.
+ */
+static void
+warm_up_next_with_response (test_data_t  *data,
+                            Tpm2Response *response)
+{
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    resource_manager_warm_up_next (data->resource_manager);
+}
+/*
+ * Queue the warm-up of TEST_NV_INDEX and fail the GetCapability commands
+ * queued ahead of its NV_ReadPublic, which is then next.
+ */
+static void
+warm_up_nv_start (test_data_t *data)
+{
+    const TPM2_HANDLE index = TEST_NV_INDEX;
+
+    resource_manager_warm_up (data->resource_manager, &index, 1);
+    while (g_queue_get_length (data->resource_manager->warm_up) > 1) {
+        warm_up_next_with_response (data,
+                                    tpm2_response_new_rc (NULL,
+                                                          TPM2_RC_FAILURE));
+    }
+}
+/*
+ * An AUTHREAD index that's subject to dictionary attack protection isn't
+ * read with an empty password during the warm-up: each failure would
+ * count towards a lockout. The wrapped tpm2_send_command would fail the
+ * test if an NV_Read were sent.
+ */
+static void
+resource_manager_warm_up_nv_da_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    warm_up_nv_start (data);
+    warm_up_next_with_response (data,
+                                nv_read_public_response_new (TPMA_NV_AUTHREAD,
+                                                             32));
+    assert_true (g_queue_is_empty (data->resource_manager->warm_up));
+}
+/*
+ * An AUTHREAD index with TPMA_NV_NO_DA is read in chunks, and the chunks
+ * left are dropped once the first one fails.
+ */
+static void
+resource_manager_warm_up_nv_no_da_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    warm_up_nv_start (data);
+    warm_up_next_with_response (data,
+        nv_read_public_response_new (TPMA_NV_AUTHREAD | TPMA_NV_NO_DA,
+                                     3 * TPM2_MAX_NV_BUFFER_SIZE));
+    assert_true (g_queue_get_length (data->resource_manager->warm_up) >= 3);
+    warm_up_next_with_response (data,
+                                tpm2_response_new_rc (NULL,
+                                                      TPM2_RC_AUTH_FAIL));
+    assert_true (g_queue_is_empty (data->resource_manager->warm_up));
+}
+/*
+ * Build a GetTestResult command, it has no parameters.
+ */
+static Tpm2Command*
+get_test_result_command_new (Connection *connection)
+{
+    guint8 *buffer = g_malloc0 (TPM_HEADER_SIZE);
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (TPM_HEADER_SIZE);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (TPM2_CC_GetTestResult);
+    return tpm2_command_new (connection,
+                             buffer,
+                             TPM_HEADER_SIZE,
+                             TPM2_CC_GetTestResult);
+}
+/*
+ * Build a GetTestResult response with an empty outData and 'result'.
+ */
+static Tpm2Response*
+get_test_result_response_new (Connection *connection,
+                              TPM2_RC     result)
+{
+    size_t size = TPM_HEADER_SIZE + sizeof (UINT16) + sizeof (UINT32);
+    guint8 *buffer = g_malloc0 (size);
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (size);
+    *(UINT32*)(buffer + TPM_HEADER_SIZE + sizeof (UINT16)) = htobe32 (result);
+    return tpm2_response_new (connection,
+                              buffer,
+                              size,
+                              TPM2_CC_GetTestResult);
+}
+/*
+ * GetTestResult is only answered from the query_cache once the self test
+ * has passed. The wrapped tpm2_send_command would fail the test if it
+ * were called for the last command.
+ */
+void
+resource_manager_query_cache_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    Tpm2Command *command;
+
+    response = get_test_result_response_new (data->connection, TPM2_RC_TESTING);
+    process_with_response (data, get_test_result_command_new (data->connection), response);
+    g_object_unref (response);
+    assert_int_equal (g_hash_table_size (data->resource_manager->query_cache), 0);
+
+    response = get_test_result_response_new (data->connection, TPM2_RC_SUCCESS);
+    process_with_response (data, get_test_result_command_new (data->connection), response);
+    g_object_unref (response);
+    assert_int_equal (g_hash_table_size (data->resource_manager->query_cache), 1);
+
+    data->response_rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+    will_return (__wrap_sink_enqueue, data);
+    command = get_test_result_command_new (data->connection);
+    resource_manager_process_tpm2_command (data->resource_manager, command);
+    g_object_unref (command);
+    assert_int_equal (data->response_rc, TSS2_RC_SUCCESS);
+}
+/*
+ * Build a command with 'code' whose parameters are a TPML_PCR_SELECTION for
+ * 'pcr' in the SHA256 bank, preceded by a handle area with 'pcr' when
+ * 'handle' is set.
+ */
+static Tpm2Command*
+pcr_command_new (Connection *connection,
+                 TPM2_CC     code,
+                 guint       pcr,
+                 gboolean    handle)
+{
+    guint8 *buffer = g_malloc0 (TPM2_MAX_COMMAND_SIZE);
+    size_t offset = TPM_HEADER_SIZE;
+    TPML_PCR_SELECTION selection = {
+        .count = 1,
+        .pcrSelections = {
+            { .hash = TPM2_ALG_SHA256, .sizeofSelect = 3, },
+        },
+    };
+
+    selection.pcrSelections [0].pcrSelect [pcr / 8] = 1 << (pcr % 8);
+    if (handle) {
+        *(TPM2_HANDLE*)(buffer + offset) = htobe32 (pcr);
+        offset += sizeof (TPM2_HANDLE);
+    }
+    assert_int_equal (Tss2_MU_TPML_PCR_SELECTION_Marshal (&selection,
+                                                          buffer,
+                                                          TPM2_MAX_COMMAND_SIZE,
+                                                          &offset),
+                      TSS2_RC_SUCCESS);
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (offset);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (code);
+    return tpm2_command_new (connection,
+                             buffer,
+                             offset,
+                             (TPMA_CC)((handle ? 1 : 0) << TPMA_CC_CHANDLES_SHIFT));
+}
+/*
+ * A PCR_Read is answered from the pcr_cache once it has been sent to the
+ * TPM. A PCR_Extend drops the responses that read the extended PCR and
+ * keeps the others.
+ */
+void
+resource_manager_pcr_cache_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    Tpm2Response *response;
+    Tpm2Command *command;
+
+    resource_manager_set_pcr_cache (resmgr, TRUE);
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    process_with_response (data, pcr_command_new (data->connection, TPM2_CC_PCR_Read, 7, FALSE), response);
+    process_with_response (data, pcr_command_new (data->connection, TPM2_CC_PCR_Read, 16, FALSE), response);
+    assert_int_equal (g_hash_table_size (resmgr->pcr_cache), 2);
+
+    data->response_rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+    will_return (__wrap_sink_enqueue, data);
+    command = pcr_command_new (data->connection, TPM2_CC_PCR_Read, 7, FALSE);
+    resource_manager_process_tpm2_command (resmgr, command);
+    g_object_unref (command);
+    assert_int_equal (data->response_rc, TSS2_RC_SUCCESS);
+
+    process_with_response (data, pcr_command_new (data->connection, TPM2_CC_PCR_Extend, 16, TRUE), response);
+    assert_int_equal (g_hash_table_size (resmgr->pcr_cache), 1);
+    g_object_unref (response);
+}
+/*
+ * A PCR_Read queued by another connection behind an identical one is
+ * answered with a copy of its response without going to the TPM. Commands
+ * that differ, and those behind them from the same connection, stay
+ * queued in order.
+ */
+void
+resource_manager_coalesce_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    Tpm2Response *response;
+    Tpm2Command *command, *queued [3];
+    Connection *connection;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    gint client_fd;
+    guint i;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 11, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+
+    queued [0] = pcr_command_new (data->connection, TPM2_CC_PCR_Read, 16, FALSE);
+    queued [1] = pcr_command_new (data->connection, TPM2_CC_PCR_Read, 7, FALSE);
+    queued [2] = pcr_command_new (connection, TPM2_CC_PCR_Read, 7, FALSE);
+    for (i = 0; i < G_N_ELEMENTS (queued); ++i) {
+        resource_manager_enqueue (SINK (resmgr), G_OBJECT (queued [i]));
+        g_object_unref (queued [i]);
+    }
+
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    will_return (__wrap_sink_enqueue, data);
+    command = pcr_command_new (data->connection, TPM2_CC_PCR_Read, 7, FALSE);
+    resource_manager_process_tpm2_command (resmgr, command);
+    g_object_unref (command);
+
+    /* the last response passed on is the copy */
+    assert_ptr_not_equal (data->response, response);
+    assert_int_equal (data->response_rc, TSS2_RC_SUCCESS);
+    assert_int_equal (message_queue_get_length (resmgr->in_queue), 0);
+    assert_int_equal (g_queue_get_length (resmgr->staged), 2);
+    command = TPM2_COMMAND (g_queue_peek_tail (resmgr->staged));
+    assert_ptr_equal (command->connection, data->connection);
+    g_object_unref (connection);
+}
+/*
+ * Commands staged for a connection are dropped as soon as its removal is
+ * queued instead of being sent to the TPM ahead of it. Other connections'
+ * staged commands stay.
+ */
+static void
+resource_manager_purge_staged_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    ControlMessage *msg;
+    Tpm2Command *command;
+    Connection *connection;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    gint client_fd;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 11, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+
+    g_queue_push_tail (resmgr->staged,
+        pcr_command_new (data->connection, TPM2_CC_PCR_Read, 16, FALSE));
+    g_queue_push_tail (resmgr->staged,
+        pcr_command_new (connection, TPM2_CC_PCR_Read, 7, FALSE));
+    g_queue_push_tail (resmgr->staged,
+        pcr_command_new (data->connection, TPM2_CC_PCR_Read, 7, FALSE));
+    msg = control_message_new_with_object (CONNECTION_REMOVED,
+                                           G_OBJECT (data->connection));
+    resource_manager_enqueue (SINK (resmgr), G_OBJECT (msg));
+    g_object_unref (msg);
+
+    assert_int_equal (g_queue_get_length (resmgr->staged), 1);
+    command = TPM2_COMMAND (g_queue_peek_head (resmgr->staged));
+    assert_ptr_equal (command->connection, connection);
+    assert_int_equal (message_queue_get_length (resmgr->in_queue), 1);
+    g_object_unref (connection);
+}
+/*
+ * Build a command with 'code' for the owner hierarchy with a password
+ * session, shaped like a CreatePrimary with empty parameters.
+ */
+static Tpm2Command*
+owner_command_new (Connection *connection,
+                   TPM2_CC     code)
+{
+    size_t size = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE) + sizeof (UINT32) +
+        9 + 3 * sizeof (UINT16) + sizeof (UINT32);
+    guint8 *buffer = g_malloc0 (size);
+    size_t offset = TPM_HEADER_SIZE;
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (size);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (code);
+    *(TPM2_HANDLE*)(buffer + offset) = htobe32 (TPM2_RH_OWNER);
+    offset += sizeof (TPM2_HANDLE);
+    *(UINT32*)(buffer + offset) = htobe32 (9);
+    offset += sizeof (UINT32);
+    *(TPM2_HANDLE*)(buffer + offset) = htobe32 (TPM2_RS_PW);
+    /* the rest of the session and the parameters are left 0 */
+    return tpm2_command_new (connection,
+                             buffer,
+                             size,
+                             (TPMA_CC)((1 << TPMA_CC_CHANDLES_SHIFT) |
+                                       TPMA_CC_RHANDLE));
+}
+/*
+ * Return a response to a CreatePrimary with 'phandle' in its handle area.
+ */
+static Tpm2Response*
+create_primary_response_new (Connection  *connection,
+                             TPM2_HANDLE  phandle)
+{
+    size_t size = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE);
+    guint8 *buffer = g_malloc0 (size);
+
+    assert_int_equal (tpm2_header_init (buffer,
+                                        size,
+                                        TPM2_ST_NO_SESSIONS,
+                                        size,
+                                        TSS2_RC_SUCCESS),
+                      TSS2_RC_SUCCESS);
+    *(TPM2_HANDLE*)(buffer + TPM_HEADER_SIZE) = htobe32 (phandle);
+    return tpm2_response_new (connection,
+                              buffer,
+                              size,
+                              (TPMA_CC)TPMA_CC_RHANDLE);
+}
+/*
+ * Build a Load under the persistent 'parent' with a password session.
+ */
+static Tpm2Command*
+load_command_new (Connection  *connection,
+                  TPM2_HANDLE  parent)
+{
+    Tpm2Command *command = owner_command_new (connection, TPM2_CC_Load);
+
+    tpm2_command_set_handle (command, parent, 0);
+    return command;
+}
+/*
+ * The object loaded by the first Load is saved. The second one loads it
+ * in place of going to the TPM, a Load under another parent doesn't. An
+ * EvictControl drops it.
+ */
+void
+resource_manager_load_cache_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    Tpm2Response *response;
+    Tpm2Command *command;
+
+    resource_manager_set_load_cache (resmgr, TRUE);
+    response = create_primary_response_new (data->connection, 0x80000000);
+    will_return (__wrap_tpm2_context_save, TSS2_RC_SUCCESS);
+    process_with_response (data,
+                           load_command_new (data->connection, 0x81000001),
+                           response);
+    g_object_unref (response);
+    assert_int_equal (g_hash_table_size (resmgr->load_cache), 1);
+
+    data->response_rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_load, 0x80000001);
+    will_return (__wrap_sink_enqueue, data);
+    command = load_command_new (data->connection, 0x81000001);
+    resource_manager_process_tpm2_command (resmgr, command);
+    g_object_unref (command);
+    assert_int_equal (data->response_rc, TSS2_RC_SUCCESS);
+
+    response = create_primary_response_new (data->connection, 0x80000002);
+    will_return (__wrap_tpm2_context_save, TSS2_RC_SUCCESS);
+    process_with_response (data,
+                           load_command_new (data->connection, 0x81000002),
+                           response);
+    g_object_unref (response);
+    assert_int_equal (g_hash_table_size (resmgr->load_cache), 2);
+
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    process_with_response (data,
+                           owner_command_new (data->connection,
+                                              TPM2_CC_EvictControl),
+                           response);
+    g_object_unref (response);
+    assert_int_equal (g_hash_table_size (resmgr->load_cache), 0);
+}
+/*
+ * The primary created by the first CreatePrimary is saved. The second one
+ * loads it in place of going to the TPM: the wrapped tpm2_send_command
+ * would fail the test if it were called. So does a third one with other
+ * session attributes. One sent at another locality goes to the TPM. A
+ * HierarchyChangeAuth drops them.
+ */
+void
+resource_manager_primary_cache_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    Tpm2Response *response;
+    Tpm2Command *command;
+
+    resource_manager_set_primary_cache (resmgr, TRUE);
+    response = create_primary_response_new (data->connection, 0x80000000);
+    will_return (__wrap_tpm2_context_save, TSS2_RC_SUCCESS);
+    process_with_response (data,
+                           owner_command_new (data->connection,
+                                              TPM2_CC_CreatePrimary),
+                           response);
+    g_object_unref (response);
+    assert_int_equal (g_hash_table_size (resmgr->primary_cache), 1);
+
+    data->response_rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_load, 0x80000001);
+    will_return (__wrap_sink_enqueue, data);
+    command = owner_command_new (data->connection, TPM2_CC_CreatePrimary);
+    resource_manager_process_tpm2_command (resmgr, command);
+    g_object_unref (command);
+    assert_int_equal (data->response_rc, TSS2_RC_SUCCESS);
+
+    /* the attributes of the password session don't matter */
+    data->response_rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_load, 0x80000002);
+    will_return (__wrap_sink_enqueue, data);
+    command = owner_command_new (data->connection, TPM2_CC_CreatePrimary);
+    tpm2_command_get_buffer (command) [TPM_HEADER_SIZE + sizeof (TPM2_HANDLE) +
+                                       sizeof (UINT32) + sizeof (TPM2_HANDLE) +
+                                       sizeof (UINT16)] =
+        TPMA_SESSION_CONTINUESESSION;
+    resource_manager_process_tpm2_command (resmgr, command);
+    g_object_unref (command);
+    assert_int_equal (data->response_rc, TSS2_RC_SUCCESS);
+
+    /* the creationData covers the locality */
+    connection_set_locality (data->connection, TPM2_LOC_THREE);
+    response = create_primary_response_new (data->connection, 0x80000003);
+    will_return (__wrap_tpm2_context_save, TSS2_RC_SUCCESS);
+    process_with_response (data,
+                           owner_command_new (data->connection,
+                                              TPM2_CC_CreatePrimary),
+                           response);
+    g_object_unref (response);
+    assert_int_equal (g_hash_table_size (resmgr->primary_cache), 2);
+    connection_set_locality (data->connection, TPM2_LOC_ZERO);
+
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    process_with_response (data,
+                           owner_command_new (data->connection,
+                                              TPM2_CC_HierarchyChangeAuth),
+                           response);
+    g_object_unref (response);
+    assert_int_equal (g_hash_table_size (resmgr->primary_cache), 0);
+}
+/*
+ * A HierarchyChangeAuth clears the NV cache: the next NV_Read goes to the
+ * TPM, which checks the password and counts a wrong one towards the DA
+ * lockout.
+ */
+void
+resource_manager_nv_cache_change_auth_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+
+    nv_cache_prime (data);
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    process_with_response (data,
+                           owner_command_new (data->connection,
+                                              TPM2_CC_HierarchyChangeAuth),
+                           response);
+    g_object_unref (response);
+    assert_int_equal (g_hash_table_size (data->resource_manager->nv_cache), 0);
+
+    response = tpm2_response_new_rc (data->connection, TPM2_RC_AUTH_FAIL);
+    process_with_response (data, nv_read_command_new (data->connection), response);
+    g_object_unref (response);
+    assert_int_equal (g_hash_table_size (data->resource_manager->nv_cache), 0);
+}
+/*
+ * A password authorized SequenceUpdate of 2500 bytes is sent to the TPM
+ * as updates of 1024, 1024 and 452 bytes: the TPM in this test doesn't
+ * report TPM2_PT_INPUT_BUFFER. The client gets the last response.
+ */
+void
+resource_manager_sequence_update_split_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    size_t size = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE) + sizeof (UINT32) +
+        9 + sizeof (UINT16) + 2500;
+    guint8 *buffer = g_malloc0 (size);
+    size_t offset = TPM_HEADER_SIZE;
+    Tpm2Response *response;
+    Tpm2Command *command;
+    guint i;
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 (size);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (TPM2_CC_SequenceUpdate);
+    *(TPM2_HANDLE*)(buffer + offset) = htobe32 (0x80000010);
+    offset += sizeof (TPM2_HANDLE);
+    *(UINT32*)(buffer + offset) = htobe32 (9);
+    offset += sizeof (UINT32);
+    *(TPM2_HANDLE*)(buffer + offset) = htobe32 (TPM2_RS_PW);
+    offset += 9;
+    *(UINT16*)(buffer + offset) = htobe16 (2500);
+    command = tpm2_command_new (data->connection,
+                                buffer,
+                                size,
+                                (TPMA_CC)(1 << TPMA_CC_CHANDLES_SHIFT));
+
+    for (i = 0; i < 2; ++i) {
+        will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+        will_return (__wrap_tpm2_send_command,
+                     tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS));
+    }
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    process_with_response (data, command, response);
+    g_object_unref (response);
+    assert_int_equal (data->response_rc, TSS2_RC_SUCCESS);
+}
+/*
+ * Closing a connection doesn't flush its loaded session: the wrapped
+ * tpm2_context_flush would fail the test if it were called. The session
+ * is flushed once the TPM needs room for another one.
+ */
+void
+resource_manager_remove_connection_deferred_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    SessionEntry *entry;
+
+    entry = session_entry_new (data->connection, 0x02000000);
+    session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+    session_list_insert (resmgr->session_list, entry);
+    g_object_unref (entry);
+    resource_manager_remove_connection (resmgr, data->connection);
+    assert_int_equal (session_list_size (resmgr->session_list), 0);
+    assert_int_equal (resmgr->flush_pending->len, 1);
+
+    will_return (__wrap_tpm2_context_flush, TSS2_RC_SUCCESS);
+    assert_true (resource_manager_evict_lru_session (resmgr, NULL));
+    assert_int_equal (resmgr->flush_pending->len, 0);
+    assert_false (resource_manager_evict_lru_session (resmgr, NULL));
+}
+/*
+ * A session saved by the ResourceManager is carried over to a new one on
+ * the same TPM along with its connection. The state of a TPM that has
+ * been restarted since is refused.
+ */
+void
+resource_manager_save_restore_state_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr;
+    ConnectionManager *manager;
+    SessionList *session_list;
+    SessionEntry *entry;
+    GVariant *saved;
+    TPMS_CONTEXT context = {
+        .sequence = 5,
+        .savedHandle = 0x02000000,
+        .hierarchy = TPM2_RH_OWNER,
+        .contextBlob = { .size = 4, },
+    };
+    uint8_t buf [sizeof (TPMS_CONTEXT)];
+    size_t size = 0;
+
+    assert_int_equal (Tss2_MU_TPMS_CONTEXT_Marshal (&context,
+                                                    buf,
+                                                    sizeof (buf),
+                                                    &size),
+                      TSS2_RC_SUCCESS);
+    entry = session_entry_new (data->connection, 0x02000000);
+    session_entry_set_context (entry, buf, size);
+    session_entry_set_state (entry, SESSION_ENTRY_SAVED_RM);
+    session_list_insert (data->resource_manager->session_list, entry);
+    g_object_unref (entry);
+
+    will_return (__wrap_tpm2_read_clock, 1);
+    will_return (__wrap_tpm2_read_clock, 2);
+    will_return (__wrap_tpm2_read_clock, TSS2_RC_SUCCESS);
+    saved = g_variant_ref_sink (resource_manager_save_state (data->resource_manager));
+    assert_non_null (saved);
+
+    manager = connection_manager_new (10);
+    connection_manager_insert (manager, data->connection);
+    session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT,
+                                     SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    resmgr = resource_manager_new (data->tpm2, session_list);
+    will_return (__wrap_tpm2_read_clock, 1);
+    will_return (__wrap_tpm2_read_clock, 3);
+    will_return (__wrap_tpm2_read_clock, TSS2_RC_SUCCESS);
+    assert_false (resource_manager_restore_state (resmgr, saved, manager));
+    assert_int_equal (session_list_size (session_list), 0);
+
+    will_return (__wrap_tpm2_read_clock, 1);
+    will_return (__wrap_tpm2_read_clock, 2);
+    will_return (__wrap_tpm2_read_clock, TSS2_RC_SUCCESS);
+    assert_true (resource_manager_restore_state (resmgr, saved, manager));
+    assert_int_equal (session_list_size (session_list), 1);
+    assert_int_equal (resmgr->context_counter, 5);
+    assert_int_equal (resmgr->flush_pending->len, 0);
+
+    g_variant_unref (saved);
+    g_object_unref (resmgr);
+    g_object_unref (session_list);
+    g_object_unref (manager);
+}
+int
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (resource_manager_type_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_sink_enqueue_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_enqueue_pending_max_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_success_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_retry_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_batch_stop_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_expired_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_reuse_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_same_entries_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_fail_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_transients_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_transients_keep_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_lru_transient_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_transients_fail_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_idle_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_residency_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_save_context_transient_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_nv_read_large_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_nv_write_large_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_lru_residency_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_for_rc_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_lru_transient_none_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_virt_to_phys_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_load_handles_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_passthrough_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_kernel_rm_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_getcap_gap_max_test,
+                                         resource_manager_setup_getcap,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_getcap_cache_test,
+                                         resource_manager_setup_getcap,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_getcap_avail_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_getcap_sessions_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_get_random_pool_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_read_public_cache_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_nv_cache_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_warm_up_nv_da_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_warm_up_nv_no_da_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_query_cache_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_pcr_cache_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_coalesce_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_purge_staged_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_primary_cache_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_nv_cache_change_auth_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_load_cache_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_sequence_update_split_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_remove_connection_deferred_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_save_restore_state_test,
+                                         resource_manager_setup,
                                          resource_manager_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
@@ -0,0 +1,246 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "response-page.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+typedef struct {
+    ResponsePage *page;
+    GHashTable   *cache;
+    gchar        *dir;
+    gchar        *path;
+} test_data_t;
+
+/* a GetCapability for TPM2_PT_MANUFACTURER and the response to it */
+static const uint8_t get_cap_command [] = {
+    0x80, 0x01, 0x00, 0x00, 0x00, 0x16, 0x00, 0x00, 0x01, 0x7a,
+    0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x01, 0x05, 0x00, 0x00,
+    0x00, 0x01,
+};
+static const uint8_t get_cap_response [] = {
+    0x80, 0x01, 0x00, 0x00, 0x00, 0x1b, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x01, 0x00,
+    0x00, 0x01, 0x05, 0x49, 0x42, 0x4d, 0x00,
+};
+/* a GetTestResult and the response to it once the self test passed */
+static const uint8_t get_test_result_command [] = {
+    0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x01, 0x7c,
+};
+static const uint8_t get_test_result_response [] = {
+    0x80, 0x01, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static int
+response_page_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+
+    data->dir = g_dir_make_tmp ("response-page-unit-XXXXXX", NULL);
+    assert_non_null (data->dir);
+    data->path = g_build_filename (data->dir, "responses", NULL);
+    data->page = response_page_new (data->path, 2, NULL);
+    assert_non_null (data->page);
+    data->cache = g_hash_table_new_full (g_bytes_hash,
+                                         g_bytes_equal,
+                                         (GDestroyNotify)g_bytes_unref,
+                                         (GDestroyNotify)g_bytes_unref);
+    g_hash_table_insert (data->cache,
+                         g_bytes_new_static (get_cap_command,
+                                             sizeof (get_cap_command)),
+                         g_bytes_new_static (get_cap_response,
+                                             sizeof (get_cap_response)));
+
+    *state = data;
+    return 0;
+}
+static int
+response_page_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    g_clear_object (&data->page);
+    g_hash_table_unref (data->cache);
+    g_unlink (data->path);
+    g_rmdir (data->dir);
+    g_free (data->path);
+    g_free (data->dir);
+    g_free (data);
+    return 0;
+}
+/*
+ * A reader finds the responses in the caches published for its TPM, and
+ * only those.
+ */
+static void
+response_page_publish_lookup_test (void **state)
+{
+    test_data_t *data = *state;
+    const response_page_t *page;
+    GHashTable *query_cache;
+    GHashTable *caches [2];
+    uint8_t response [UTIL_BUF_MAX];
+    size_t size;
+
+    query_cache = g_hash_table_new_full (g_bytes_hash,
+                                         g_bytes_equal,
+                                         (GDestroyNotify)g_bytes_unref,
+                                         (GDestroyNotify)g_bytes_unref);
+    g_hash_table_insert (query_cache,
+                         g_bytes_new_static (get_test_result_command,
+                                             sizeof (get_test_result_command)),
+                         g_bytes_new_static (get_test_result_response,
+                                             sizeof (get_test_result_response)));
+    caches [0] = data->cache;
+    caches [1] = query_cache;
+    response_page_publish (data->page, 1, caches, G_N_ELEMENTS (caches));
+    g_hash_table_unref (query_cache);
+
+    page = response_page_map (data->path, NULL);
+    assert_non_null (page);
+    assert_int_equal (page->tpm_count, 2);
+    assert_int_equal (page->tpms [1].entry_count, 2);
+    assert_int_equal (page->tpms [1].seq % 2, 0);
+
+    size = sizeof (response);
+    assert_true (response_page_lookup (page, 1,
+                                       get_cap_command,
+                                       sizeof (get_cap_command),
+                                       response,
+                                       &size));
+    assert_int_equal (size, sizeof (get_cap_response));
+    assert_memory_equal (response, get_cap_response, size);
+    size = sizeof (response);
+    assert_true (response_page_lookup (page, 1,
+                                       get_test_result_command,
+                                       sizeof (get_test_result_command),
+                                       response,
+                                       &size));
+    assert_int_equal (size, sizeof (get_test_result_response));
+    assert_memory_equal (response, get_test_result_response, size);
+    /* the other TPM published nothing */
+    size = sizeof (response);
+    assert_false (response_page_lookup (page, 0,
+                                        get_cap_command,
+                                        sizeof (get_cap_command),
+                                        response,
+                                        &size));
+    assert_false (response_page_lookup (page, 2,
+                                        get_cap_command,
+                                        sizeof (get_cap_command),
+                                        response,
+                                        &size));
+    /* a prefix of a published command isn't the command */
+    assert_false (response_page_lookup (page, 1,
+                                        get_cap_command,
+                                        sizeof (get_cap_command) - 1,
+                                        response,
+                                        &size));
+    /* the response must fit the caller's buffer */
+    size = sizeof (get_cap_response) - 1;
+    assert_false (response_page_lookup (page, 1,
+                                        get_cap_command,
+                                        sizeof (get_cap_command),
+                                        response,
+                                        &size));
+    assert_int_equal (size, sizeof (get_cap_response) - 1);
+    response_page_unmap (page);
+}
+/*
+ * A response dropped from the caches is gone from the page after the
+ * next publish, and a reader still mapping the page of a daemon that
+ * went away finds nothing in it.
+ */
+static void
+response_page_drop_test (void **state)
+{
+    test_data_t *data = *state;
+    const response_page_t *page;
+    uint8_t response [UTIL_BUF_MAX];
+    size_t size = sizeof (response);
+
+    response_page_publish (data->page, 0, &data->cache, 1);
+    page = response_page_map (data->path, NULL);
+    assert_non_null (page);
+    assert_true (response_page_lookup (page, 0,
+                                       get_cap_command,
+                                       sizeof (get_cap_command),
+                                       response,
+                                       &size));
+
+    g_hash_table_remove_all (data->cache);
+    response_page_publish (data->page, 0, &data->cache, 1);
+    size = sizeof (response);
+    assert_false (response_page_lookup (page, 0,
+                                        get_cap_command,
+                                        sizeof (get_cap_command),
+                                        response,
+                                        &size));
+
+    g_hash_table_insert (data->cache,
+                         g_bytes_new_static (get_cap_command,
+                                             sizeof (get_cap_command)),
+                         g_bytes_new_static (get_cap_response,
+                                             sizeof (get_cap_response)));
+    response_page_publish (data->page, 0, &data->cache, 1);
+    g_clear_object (&data->page);
+    assert_false (g_file_test (data->path, G_FILE_TEST_EXISTS));
+    assert_false (response_page_lookup (page, 0,
+                                        get_cap_command,
+                                        sizeof (get_cap_command),
+                                        response,
+                                        &size));
+    response_page_unmap (page);
+}
+/*
+ * Files that aren't response pages aren't mapped.
+ */
+static void
+response_page_map_invalid_test (void **state)
+{
+    test_data_t *data = *state;
+    const response_page_t *page;
+    GError *error = NULL;
+    gchar *path = g_build_filename (data->dir, "short", NULL);
+
+    assert_true (g_file_set_contents (path, "TMRP", -1, NULL));
+    page = response_page_map (path, &error);
+    assert_null (page);
+    assert_true (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_INVAL));
+    g_clear_error (&error);
+    g_unlink (path);
+    g_free (path);
+
+    page = response_page_map (data->path, &error);
+    assert_non_null (page);
+    response_page_unmap (page);
+    g_clear_object (&data->page);
+    page = response_page_map (data->path, &error);
+    assert_null (page);
+    assert_true (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT));
+    g_clear_error (&error);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (response_page_publish_lookup_test,
+                                         response_page_setup,
+                                         response_page_teardown),
+        cmocka_unit_test_setup_teardown (response_page_drop_test,
+                                         response_page_setup,
+                                         response_page_teardown),
+        cmocka_unit_test_setup_teardown (response_page_map_invalid_test,
+                                         response_page_setup,
+                                         response_page_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -3,14 +3,30 @@
  * Copyright (c) 2017, Intel Corporation
  * All rights reserved.
  */
+#include <errno.h>
 #include <glib.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <setjmp.h>
 #include <cmocka.h>
 
+#include "handle-map.h"
 #include "util.h"
 #include "response-sink.h"
+#include "sink-interface.h"
+#include "tpm2-header.h"
+
+#define RESPONSE_SIZE 4096
+/* enough 4k responses to fill any socket buffer */
+#define RESPONSE_COUNT_MAX 1024
+
+typedef struct {
+    ResponseSink *sink;
+    Connection   *connection;
+    gint          client_fd;
+} test_data_t;
 
 /**
  * Test to allocate and destroy a ResponseSink.
@@ -26,11 +42,290 @@ response_sink_allocate_test (void **state)
     g_object_unref (sink);
 }
 
+static int
+response_sink_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+    HandleMap *handle_map;
+    GIOStream *iostream;
+
+    data->sink = response_sink_new ();
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&data->client_fd);
+    data->connection = connection_new (iostream, 0, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    *state = data;
+    return 0;
+}
+static int
+response_sink_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_object_unref (data->sink);
+    g_object_unref (data->connection);
+    close (data->client_fd);
+    g_free (data);
+    return 0;
+}
+static Tpm2Response*
+response_new (Connection *connection)
+{
+    guint8 *buffer = g_malloc0 (RESPONSE_SIZE);
+
+    set_response_tag (buffer, TPM2_ST_NO_SESSIONS);
+    set_response_size (buffer, RESPONSE_SIZE);
+    set_response_code (buffer, TSS2_RC_SUCCESS);
+    return tpm2_response_new (connection, buffer, RESPONSE_SIZE, (TPMA_CC){ 0 });
+}
+/*
+ * Read everything the client socket has buffered. The client fd is
+ * non-blocking so this stops at EAGAIN.
+ */
+static void
+client_drain (gint fd)
+{
+    guint8 buf [RESPONSE_SIZE];
+
+    while (read (fd, buf, sizeof (buf)) > 0);
+}
+/*
+ * Fill the client's socket until a response can't be written and is
+ * queued. Returns the number of responses processed.
+ */
+static guint
+fill_socket (test_data_t *data)
+{
+    Tpm2Response *response;
+    guint i;
+
+    for (i = 0; i < RESPONSE_COUNT_MAX; ++i) {
+        response = response_new (data->connection);
+        response_sink_process_response (data->sink, response);
+        g_object_unref (response);
+        if (response_sink_get_pending (data->sink, data->connection) > 0) {
+            return i + 1;
+        }
+    }
+    return i;
+}
+/*
+ * A client that's reading gets the whole response and nothing is queued.
+ */
+static void
+response_sink_process_response_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    guint8 buf [RESPONSE_SIZE];
+    ssize_t ret;
+
+    response = response_new (data->connection);
+    ret = response_sink_process_response (data->sink, response);
+    assert_int_equal (ret, RESPONSE_SIZE);
+    assert_int_equal (response_sink_get_pending (data->sink, data->connection), 0);
+    ret = read (data->client_fd, buf, sizeof (buf));
+    assert_int_equal (ret, RESPONSE_SIZE);
+    assert_memory_equal (buf, tpm2_response_get_buffer (response), RESPONSE_SIZE);
+    g_object_unref (response);
+}
+/*
+ * On a connection using the tagged transport the tag of the command goes
+ * ahead of the response.
+ */
+static void
+response_sink_process_response_tagged_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    guint8 buf [TABRMD_REQUEST_TAG_SIZE + RESPONSE_SIZE];
+    ssize_t ret;
+
+    connection_set_tagged (data->connection, TRUE);
+    response = response_new (data->connection);
+    tpm2_response_set_request_tag (response, 0xdeadbeef);
+    ret = response_sink_process_response (data->sink, response);
+    assert_int_equal (ret, sizeof (buf));
+    ret = read (data->client_fd, buf, sizeof (buf));
+    assert_int_equal (ret, sizeof (buf));
+    assert_int_equal (be32toh (*(guint32*)buf), 0xdeadbeef);
+    assert_memory_equal (&buf [TABRMD_REQUEST_TAG_SIZE],
+                         tpm2_response_get_buffer (response),
+                         RESPONSE_SIZE);
+    g_object_unref (response);
+}
+/*
+ * Once the client's socket is full responses are queued, and they're
+ * written when the client reads and the connection is flushed.
+ */
+static void
+response_sink_pending_flush_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+
+    assert_true (fill_socket (data) < RESPONSE_COUNT_MAX);
+    assert_int_equal (response_sink_get_pending (data->sink, data->connection), 1);
+    /* with output pending, new responses go to the tail of the outbox */
+    response = response_new (data->connection);
+    assert_int_equal (response_sink_process_response (data->sink, response), 0);
+    g_object_unref (response);
+    assert_int_equal (response_sink_get_pending (data->sink, data->connection), 2);
+
+    client_drain (data->client_fd);
+    assert_true (response_sink_flush_connection (data->sink, data->connection));
+    assert_int_equal (response_sink_get_pending (data->sink, data->connection), 0);
+}
+/*
+ * A client that leaves more than max_pending responses unread is
+ * disconnected: its pending output is dropped and it reads EOF.
+ */
+static void
+response_sink_disconnect_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    guint i;
+    ssize_t ret;
+    guint8 buf [RESPONSE_SIZE];
+
+    assert_true (fill_socket (data) < RESPONSE_COUNT_MAX);
+    for (i = 0; i < data->sink->max_pending; ++i) {
+        response = response_new (data->connection);
+        response_sink_process_response (data->sink, response);
+        g_object_unref (response);
+    }
+    assert_int_equal (response_sink_get_pending (data->sink, data->connection), 0);
+    do {
+        ret = read (data->client_fd, buf, sizeof (buf));
+    } while (ret > 0);
+    assert_int_equal (ret, 0);
+}
+/*
+ * CONNECTION_REMOVED drops whatever output was queued for the connection.
+ */
+static void
+response_sink_connection_removed_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ControlMessage *msg;
+
+    assert_true (fill_socket (data) < RESPONSE_COUNT_MAX);
+    msg = control_message_new_with_object (CONNECTION_REMOVED,
+                                           G_OBJECT (data->connection));
+    assert_true (response_sink_process_control (data->sink, msg));
+    g_object_unref (msg);
+    assert_int_equal (response_sink_get_pending (data->sink, data->connection), 0);
+}
+/*
+ * With direct writes a response is written to the client by the thread
+ * that enqueues it. Once the socket is full the rest goes to the outbox
+ * and the ResponseSink thread is woken to write it.
+ */
+static void
+response_sink_direct_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    struct pollfd pollfd = {
+        .fd = message_queue_get_wakeup_fd (data->sink->in_queue),
+        .events = POLLIN,
+    };
+    Tpm2Response *response;
+    guint8 buf [RESPONSE_SIZE];
+    guint i;
+
+    response_sink_set_direct (data->sink, TRUE);
+    response = response_new (data->connection);
+    sink_enqueue (SINK (data->sink), G_OBJECT (response));
+    g_object_unref (response);
+    assert_int_equal (message_queue_get_length (data->sink->in_queue), 0);
+    assert_int_equal (read (data->client_fd, buf, sizeof (buf)), RESPONSE_SIZE);
+    assert_int_equal (poll (&pollfd, 1, 0), 0);
+
+    for (i = 0; i < RESPONSE_COUNT_MAX &&
+         response_sink_get_pending (data->sink, data->connection) == 0; ++i) {
+        response = response_new (data->connection);
+        sink_enqueue (SINK (data->sink), G_OBJECT (response));
+        g_object_unref (response);
+    }
+    assert_true (i < RESPONSE_COUNT_MAX);
+    assert_int_equal (message_queue_get_length (data->sink->in_queue), 0);
+    assert_int_equal (poll (&pollfd, 1, 0), 1);
+}
+/*
+ * With shards the responses for a connection and its CONNECTION_REMOVED
+ * go to the queue of the shard its id picks, the connection with id 0 is
+ * served by the ResponseSink itself.
+ */
+static void
+response_sink_shards_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResponseSink *shard;
+    Connection *connection;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    Tpm2Response *response;
+    ControlMessage *msg;
+    gint client_fd;
+
+    response_sink_set_shards (data->sink, 2);
+    assert_ptr_equal (response_sink_get_shard (data->sink, data->connection),
+                      data->sink);
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 1, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    shard = response_sink_get_shard (data->sink, connection);
+    assert_ptr_not_equal (shard, data->sink);
+
+    response = response_new (connection);
+    sink_enqueue (SINK (data->sink), G_OBJECT (response));
+    g_object_unref (response);
+    msg = control_message_new_with_object (CONNECTION_REMOVED,
+                                           G_OBJECT (connection));
+    sink_enqueue (SINK (data->sink), G_OBJECT (msg));
+    g_object_unref (msg);
+    assert_int_equal (message_queue_get_length (shard->in_queue), 2);
+    assert_int_equal (message_queue_get_length (data->sink->in_queue), 0);
+
+    response = response_new (data->connection);
+    sink_enqueue (SINK (data->sink), G_OBJECT (response));
+    g_object_unref (response);
+    assert_int_equal (message_queue_get_length (shard->in_queue), 2);
+    assert_int_equal (message_queue_get_length (data->sink->in_queue), 1);
+    g_object_unref (connection);
+    close (client_fd);
+}
+
 int
 main (void)
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test (response_sink_allocate_test),
+        cmocka_unit_test_setup_teardown (response_sink_process_response_test,
+                                         response_sink_setup,
+                                         response_sink_teardown),
+        cmocka_unit_test_setup_teardown (response_sink_process_response_tagged_test,
+                                         response_sink_setup,
+                                         response_sink_teardown),
+        cmocka_unit_test_setup_teardown (response_sink_pending_flush_test,
+                                         response_sink_setup,
+                                         response_sink_teardown),
+        cmocka_unit_test_setup_teardown (response_sink_disconnect_test,
+                                         response_sink_setup,
+                                         response_sink_teardown),
+        cmocka_unit_test_setup_teardown (response_sink_connection_removed_test,
+                                         response_sink_setup,
+                                         response_sink_teardown),
+        cmocka_unit_test_setup_teardown (response_sink_direct_test,
+                                         response_sink_setup,
+                                         response_sink_teardown),
+        cmocka_unit_test_setup_teardown (response_sink_shards_test,
+                                         response_sink_setup,
+                                         response_sink_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
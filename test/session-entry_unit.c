@@ -77,14 +77,57 @@ session_entry_type_test (void **state)
     assert_true (IS_SESSION_ENTRY (data->session_entry));
 }
 
+/*
+ * There's no context until one is set. The first context set is shared
+ * with the client context, later ones replace only the context.
+ */
 static void
 session_entry_get_context_test (void **state)
 {
     test_data_t *data = (test_data_t*)*state;
-    size_buf_t *size_buf;
+    uint8_t first [] = { 0x01, 0x02, 0x03 }, second [] = { 0x04, 0x05 };
+    GBytes *context, *context_client;
+    gsize size;
 
-    size_buf = session_entry_get_context (data->session_entry);
-    assert_non_null (size_buf);
+    assert_null (session_entry_get_context (data->session_entry));
+    assert_null (session_entry_get_context_client (data->session_entry));
+    session_entry_set_context (data->session_entry, first, sizeof (first));
+    context = session_entry_get_context (data->session_entry);
+    assert_non_null (context);
+    assert_ptr_equal (context,
+                      session_entry_get_context_client (data->session_entry));
+    assert_memory_equal (g_bytes_get_data (context, &size), first, sizeof (first));
+    assert_int_equal (size, sizeof (first));
+
+    session_entry_set_context (data->session_entry, second, sizeof (second));
+    context = session_entry_get_context (data->session_entry);
+    context_client = session_entry_get_context_client (data->session_entry);
+    assert_int_equal (g_bytes_get_size (context), sizeof (second));
+    assert_int_equal (g_bytes_get_size (context_client), sizeof (first));
+    assert_int_equal (session_entry_compare_on_context_client (data->session_entry,
+                                                               first,
+                                                               sizeof (first)),
+                      0);
+    assert_int_not_equal (session_entry_compare_on_context_client (data->session_entry,
+                                                                   first,
+                                                                   sizeof (first) - 1),
+                          0);
+}
+/*
+ * The sequence is the first field of the saved context. There's no
+ * sequence before a context is saved.
+ */
+static void
+session_entry_get_sequence_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    uint8_t context [] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x40, 0x00,
+    };
+
+    assert_int_equal (session_entry_get_sequence (data->session_entry), 0);
+    session_entry_set_context (data->session_entry, context, sizeof (context));
+    assert_int_equal (session_entry_get_sequence (data->session_entry), 0x102);
 }
 
 static void
@@ -118,6 +161,9 @@ main (void)
         cmocka_unit_test_setup_teardown (session_entry_get_context_test,
                                          session_entry_setup,
                                          session_entry_teardown),
+        cmocka_unit_test_setup_teardown (session_entry_get_sequence_test,
+                                         session_entry_setup,
+                                         session_entry_teardown),
         cmocka_unit_test_setup_teardown (session_entry_get_connection_test,
                                          session_entry_setup,
                                          session_entry_teardown),
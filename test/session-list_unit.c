@@ -9,11 +9,13 @@
 #include <inttypes.h>
 #include <sys/socket.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <setjmp.h>
 #include <cmocka.h>
 
 
+#include <tss2/tss2_mu.h>
 #include <tss2/tss2_tpm2_types.h>
 
 #include "mock-io-stream.h"
@@ -270,6 +272,38 @@ session_list_claim_abandoned_test (void **state)
     g_clear_object (&entry);
 }
 
+/*
+ * A session restored from a checkpoint without a connection goes to the
+ * abandoned queue and can be claimed. Only SESSION_LIST_MAX_ABANDONED_DEFAULT
+ * of them are taken.
+ */
+static void
+session_list_insert_abandoned_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *conn = NULL;
+    SessionEntry *entry = NULL;
+    guint i;
+
+    for (i = 0; i < SESSION_LIST_MAX_ABANDONED_DEFAULT; ++i) {
+        entry = session_entry_new (NULL, CLAIM_HANDLE + i);
+        assert_true (session_list_insert_abandoned (data->session_list,
+                                                    entry));
+        assert_int_equal (session_entry_get_state (entry),
+                          SESSION_ENTRY_SAVED_CLIENT_CLOSED);
+        g_clear_object (&entry);
+    }
+    entry = session_entry_new (NULL, CLAIM_HANDLE + i);
+    assert_false (session_list_insert_abandoned (data->session_list, entry));
+    g_clear_object (&entry);
+
+    entry = session_list_lookup_handle (data->session_list, CLAIM_HANDLE);
+    conn = test_connection_new (CLAIM_CONNECTION_ID_1);
+    assert_true (session_list_claim (data->session_list, entry, conn));
+    g_clear_object (&entry);
+    g_clear_object (&conn);
+}
+
 static void
 session_list_claim_saved_test (void **state)
 {
@@ -290,6 +324,108 @@ session_list_claim_saved_test (void **state)
     assert_true (session_entry_get_state (entry) == SESSION_ENTRY_LOADED);
     g_clear_object (&entry);
 }
+/*
+ * A context blob from a client is found through the savedHandle it
+ * carries: the blob must also match the context_client of that session.
+ */
+#define LOOKUP_CONTEXT_ID 0x1
+#define LOOKUP_CONTEXT_HANDLE (TPM2_HMAC_SESSION_FIRST + 3)
+static void
+session_list_lookup_context_client_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *conn = NULL;
+    SessionEntry *entry = NULL, *found = NULL;
+    uint8_t buf [32] = { 0 };
+    size_t offset = sizeof (UINT64);
+
+    assert_int_equal (Tss2_MU_TPM2_HANDLE_Marshal (LOOKUP_CONTEXT_HANDLE,
+                                                   buf,
+                                                   sizeof (buf),
+                                                   &offset),
+                      TSS2_RC_SUCCESS);
+    memset (&buf [offset], 0x5a, sizeof (buf) - offset);
+    conn = test_connection_new (LOOKUP_CONTEXT_ID);
+    entry = session_entry_new (conn, LOOKUP_CONTEXT_HANDLE);
+    session_entry_set_context (entry, buf, sizeof (buf));
+    session_list_insert (data->session_list, entry);
+
+    found = session_list_lookup_context_client (data->session_list,
+                                                buf,
+                                                sizeof (buf));
+    assert_ptr_equal (found, entry);
+    g_clear_object (&found);
+    /* same savedHandle, different blob */
+    buf [sizeof (buf) - 1] ^= 0xff;
+    assert_null (session_list_lookup_context_client (data->session_list,
+                                                     buf,
+                                                     sizeof (buf)));
+    /* too short to hold a savedHandle */
+    assert_null (session_list_lookup_context_client (data->session_list,
+                                                     buf,
+                                                     sizeof (UINT64)));
+    g_clear_object (&conn);
+    g_clear_object (&entry);
+}
+/*
+ * PruneFunc for session_list_expire_abandoned.
+ */
+static gboolean
+remove_session_callback (SessionEntry *entry,
+                         gpointer      data)
+{
+    session_list_remove (SESSION_LIST (data), entry);
+    return TRUE;
+}
+#define EXPIRE_HANDLE_0 0x02000000
+#define EXPIRE_HANDLE_1 0x02000001
+#define EXPIRE_HANDLE_2 0x02000002
+/*
+ * Of two abandoned sessions only the one abandoned for longer than the
+ * timeout expires. The other one goes once the TPM has no room left for
+ * it next to the session still in use.
+ */
+static void
+session_list_expire_abandoned_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    SessionList *list = data->session_list;
+    Connection *conn;
+    SessionEntry *entry;
+    TPM2_HANDLE handles [] = { EXPIRE_HANDLE_0, EXPIRE_HANDLE_1 };
+    guint i;
+
+    conn = test_connection_new (CLAIM_CONNECTION_ID_0);
+    for (i = 0; i < G_N_ELEMENTS (handles); ++i) {
+        entry = session_entry_new (conn, handles [i]);
+        session_list_insert (list, entry);
+        g_object_unref (entry);
+        assert_true (session_list_abandon_handle (list, conn, handles [i]));
+    }
+    entry = session_entry_new (conn, EXPIRE_HANDLE_2);
+    session_list_insert (list, entry);
+    g_object_unref (entry);
+    g_clear_object (&conn);
+
+    session_list_set_abandoned_timeout (list, 60);
+    assert_int_equal (session_list_expire_abandoned (list,
+                                                     remove_session_callback,
+                                                     list), 0);
+    entry = session_list_lookup_handle (list, EXPIRE_HANDLE_0);
+    entry->abandoned_time -= 120 * G_USEC_PER_SEC;
+    g_object_unref (entry);
+    assert_int_equal (session_list_expire_abandoned (list,
+                                                     remove_session_callback,
+                                                     list), 1);
+    assert_null (session_list_lookup_handle (list, EXPIRE_HANDLE_0));
+    assert_int_equal (session_list_size (list), 2);
+
+    session_list_set_tpm_sessions_max (list, 1);
+    assert_int_equal (session_list_expire_abandoned (list,
+                                                     remove_session_callback,
+                                                     list), 1);
+    assert_int_equal (session_list_size (list), 1);
+}
 
 static void
 session_list_claim_fail_test (void **state)
@@ -307,6 +443,166 @@ session_list_claim_fail_test (void **state)
     g_clear_object (&entry);
 }
 
+/*
+ * Insert entries for two connections and check that the per-connection
+ * counts track insert, claim and removal.
+ */
+#define COUNT_HANDLE_1 0x02000001
+#define COUNT_HANDLE_2 0x02000002
+#define COUNT_HANDLE_3 0x02000003
+static void
+session_list_connection_count_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *conn_0 = NULL, *conn_1 = NULL;
+    SessionEntry *entry = NULL;
+
+    conn_0 = test_connection_new (CLAIM_CONNECTION_ID_0);
+    conn_1 = test_connection_new (CLAIM_CONNECTION_ID_1);
+    entry = session_entry_new (conn_0, COUNT_HANDLE_1);
+    assert_true (session_list_insert (data->session_list, entry));
+    g_clear_object (&entry);
+    entry = session_entry_new (conn_0, COUNT_HANDLE_2);
+    assert_true (session_list_insert (data->session_list, entry));
+    g_clear_object (&entry);
+    entry = session_entry_new (conn_1, COUNT_HANDLE_3);
+    assert_true (session_list_insert (data->session_list, entry));
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn_0), 2);
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn_1), 1);
+
+    session_entry_set_state (entry, SESSION_ENTRY_SAVED_CLIENT);
+    assert_true (session_list_claim (data->session_list, entry, conn_0));
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn_0), 3);
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn_1), 0);
+    g_clear_object (&entry);
+
+    assert_true (session_list_remove_handle (data->session_list,
+                                             COUNT_HANDLE_1));
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn_0), 2);
+    assert_null (session_list_lookup_handle (data->session_list,
+                                             COUNT_HANDLE_1));
+    assert_int_equal (session_list_size (data->session_list), 2);
+    g_clear_object (&conn_0);
+    g_clear_object (&conn_1);
+}
+/*
+ * Inserting a second SessionEntry with a handle already in the list fails.
+ */
+static void
+session_list_insert_duplicate_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *conn = NULL;
+    SessionEntry *entry = NULL;
+
+    session_list_insert_test (state);
+    conn = test_connection_new (INSERT_TEST_ID);
+    entry = session_entry_new (conn, INSERT_TEST_HANDLE);
+    assert_false (session_list_insert (data->session_list, entry));
+    assert_int_equal (session_list_size (data->session_list), 1);
+    g_clear_object (&conn);
+    g_clear_object (&entry);
+}
+/*
+ * Callback for session_list_foreach_connection_test: remove each entry
+ * from the SessionList while iterating.
+ */
+static void
+session_list_remove_callback (gpointer data,
+                              gpointer user_data)
+{
+    session_list_remove (SESSION_LIST (user_data), SESSION_ENTRY (data));
+}
+static void
+session_list_foreach_connection_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *conn_0 = NULL, *conn_1 = NULL;
+    SessionEntry *entry = NULL;
+
+    conn_0 = test_connection_new (CLAIM_CONNECTION_ID_0);
+    conn_1 = test_connection_new (CLAIM_CONNECTION_ID_1);
+    entry = session_entry_new (conn_0, COUNT_HANDLE_1);
+    session_list_insert (data->session_list, entry);
+    g_clear_object (&entry);
+    entry = session_entry_new (conn_1, COUNT_HANDLE_2);
+    session_list_insert (data->session_list, entry);
+    g_clear_object (&entry);
+    entry = session_entry_new (conn_0, COUNT_HANDLE_3);
+    session_list_insert (data->session_list, entry);
+    g_clear_object (&entry);
+
+    session_list_foreach_connection (data->session_list,
+                                     conn_0,
+                                     session_list_remove_callback,
+                                     data->session_list);
+    assert_int_equal (session_list_size (data->session_list), 1);
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn_0), 0);
+    entry = session_list_lookup_handle (data->session_list, COUNT_HANDLE_2);
+    assert_non_null (entry);
+    g_clear_object (&entry);
+    g_clear_object (&conn_0);
+    g_clear_object (&conn_1);
+}
+/*
+ * Callback for session_list_foreach_loaded_test: count the entries.
+ */
+static void
+session_list_count_callback (gpointer data,
+                             gpointer user_data)
+{
+    UNUSED_PARAM (data);
+    ++*(guint*)user_data;
+}
+/*
+ * Only the sessions loaded in the TPM are visited: those inserted or
+ * marked loaded, until they're saved or removed.
+ */
+static void
+session_list_foreach_loaded_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *conn = NULL;
+    SessionEntry *entries [3];
+    guint i, count;
+
+    conn = test_connection_new (CLAIM_CONNECTION_ID_0);
+    entries [0] = session_entry_new (conn, COUNT_HANDLE_1);
+    session_entry_set_state (entries [0], SESSION_ENTRY_LOADED);
+    entries [1] = session_entry_new (conn, COUNT_HANDLE_2);
+    session_entry_set_state (entries [1], SESSION_ENTRY_SAVED_RM);
+    entries [2] = session_entry_new (conn, COUNT_HANDLE_3);
+    session_entry_set_state (entries [2], SESSION_ENTRY_SAVED_RM);
+    for (i = 0; i < 3; ++i) {
+        session_list_insert (data->session_list, entries [i]);
+    }
+    session_entry_set_state (entries [1], SESSION_ENTRY_LOADED);
+    session_list_mark_loaded (data->session_list, entries [1]);
+    session_list_mark_loaded (data->session_list, entries [1]);
+
+    count = 0;
+    session_list_foreach_loaded (data->session_list,
+                                 session_list_count_callback,
+                                 &count);
+    assert_int_equal (count, 2);
+    session_entry_set_state (entries [0], SESSION_ENTRY_SAVED_RM);
+    session_list_remove (data->session_list, entries [1]);
+    count = 0;
+    session_list_foreach_loaded (data->session_list,
+                                 session_list_count_callback,
+                                 &count);
+    assert_int_equal (count, 0);
+    for (i = 0; i < 3; ++i) {
+        g_object_unref (entries [i]);
+    }
+    g_clear_object (&conn);
+}
 gint
 main (void)
 {
@@ -335,15 +631,36 @@ main (void)
         cmocka_unit_test_setup_teardown (session_list_abandon_handle_test,
                                          session_list_setup,
                                          session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_connection_count_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_insert_duplicate_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_foreach_connection_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_foreach_loaded_test,
+                                         session_list_setup,
+                                         session_list_teardown),
         cmocka_unit_test_setup_teardown (session_list_claim_abandoned_test,
                                          session_list_setup,
                                          session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_insert_abandoned_test,
+                                         session_list_setup,
+                                         session_list_teardown),
         cmocka_unit_test_setup_teardown (session_list_claim_saved_test,
                                          session_list_setup,
                                          session_list_teardown),
         cmocka_unit_test_setup_teardown (session_list_claim_fail_test,
                                          session_list_setup,
                                          session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_expire_abandoned_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_lookup_context_client_test,
+                                         session_list_setup,
+                                         session_list_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "slab.h"
+#include "util.h"
+
+/*
+ * Objects are aligned, zeroed and don't overlap, and the last one freed
+ * is the next one handed out, cleared again.
+ */
+static void
+slab_cache_reuse_test (void **state)
+{
+    slab_cache_t cache = SLAB_CACHE_INIT (24, 4);
+    guint8 *first, *second;
+    UNUSED_PARAM (state);
+
+    first = slab_cache_alloc0 (&cache);
+    second = slab_cache_alloc0 (&cache);
+    assert_int_equal ((uintptr_t)first % SLAB_ALIGN, 0);
+    assert_int_equal ((uintptr_t)second % SLAB_ALIGN, 0);
+    assert_true (second >= first + 24 || first >= second + 24);
+    assert_int_equal (slab_cache_get_in_use (&cache), 2);
+    memset (first, 0xa5, 24);
+    slab_cache_free (&cache, first);
+    assert_ptr_equal (slab_cache_alloc0 (&cache), first);
+    assert_int_equal (first [0], 0);
+    assert_int_equal (first [23], 0);
+    slab_cache_free (&cache, first);
+    slab_cache_free (&cache, second);
+    slab_cache_free (&cache, NULL);
+    assert_int_equal (slab_cache_get_in_use (&cache), 0);
+    slab_cache_clear (&cache);
+}
+/*
+ * Running out of a slab chains on another one, the objects of both stay
+ * valid.
+ */
+static void
+slab_cache_grow_test (void **state)
+{
+    slab_cache_t cache = SLAB_CACHE_INIT (sizeof (guint64), 2);
+    guint64 *objects [5];
+    guint i;
+    UNUSED_PARAM (state);
+
+    for (i = 0; i < G_N_ELEMENTS (objects); ++i) {
+        objects [i] = slab_cache_alloc0 (&cache);
+        *objects [i] = i;
+    }
+    assert_int_equal (slab_cache_get_in_use (&cache), G_N_ELEMENTS (objects));
+    for (i = 0; i < G_N_ELEMENTS (objects); ++i) {
+        assert_int_equal (*objects [i], i);
+        slab_cache_free (&cache, objects [i]);
+    }
+    slab_cache_clear (&cache);
+    assert_null (cache.slabs);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (slab_cache_reuse_test),
+        cmocka_unit_test (slab_cache_grow_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
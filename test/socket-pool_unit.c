@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <fcntl.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "socket-pool.h"
+#include "util.h"
+
+/*
+ * A filled pool hands out as many connected, non-blocking pairs as it
+ * holds and is empty afterwards.
+ */
+static void
+socket_pool_take_test (void **state)
+{
+    socket_pool_t pool;
+    gint client_fd, server_fd;
+    guint8 byte = 0x5a, out = 0;
+    guint i;
+    UNUSED_PARAM (state);
+
+    socket_pool_init (&pool, 2);
+    assert_false (socket_pool_take (&pool, &client_fd, &server_fd));
+    assert_int_equal (socket_pool_fill (&pool), 2);
+    for (i = 0; i < 2; ++i) {
+        assert_true (socket_pool_take (&pool, &client_fd, &server_fd));
+        assert_true (fcntl (server_fd, F_GETFL) & O_NONBLOCK);
+        assert_int_equal (write (client_fd, &byte, 1), 1);
+        assert_int_equal (read (server_fd, &out, 1), 1);
+        assert_int_equal (out, byte);
+        close (client_fd);
+        close (server_fd);
+    }
+    assert_false (socket_pool_take (&pool, &client_fd, &server_fd));
+    socket_pool_clear (&pool);
+}
+/*
+ * A pool of size 0 never holds anything.
+ */
+static void
+socket_pool_disabled_test (void **state)
+{
+    socket_pool_t pool;
+    gint client_fd, server_fd;
+    UNUSED_PARAM (state);
+
+    socket_pool_init (&pool, 0);
+    assert_int_equal (socket_pool_fill (&pool), 0);
+    assert_false (socket_pool_take (&pool, &client_fd, &server_fd));
+    socket_pool_clear (&pool);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (socket_pool_take_test),
+        cmocka_unit_test (socket_pool_disabled_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
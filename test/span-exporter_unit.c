@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "span-exporter.h"
+#include "util.h"
+
+typedef struct {
+    gchar    *dir;
+    gchar    *path;
+} test_data_t;
+
+static int
+span_exporter_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+
+    data->dir = g_dir_make_tmp ("span-exporter-unit-XXXXXX", NULL);
+    assert_non_null (data->dir);
+    data->path = g_build_filename (data->dir, "spans.json", NULL);
+
+    *state = data;
+    return 0;
+}
+static int
+span_exporter_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    g_unlink (data->path);
+    g_rmdir (data->dir);
+    g_free (data->path);
+    g_free (data->dir);
+    g_free (data);
+    return 0;
+}
+/*
+ * Timing of a command in a sampled trace with ID 0x01 0x02 ... and parent
+ * span ID 0xa0 0xa1 ...
+ */
+static void
+timing_init (command_timing_t *timing)
+{
+    guint i;
+
+    memset (timing, 0, sizeof (*timing));
+    for (i = 0; i < TRACE_CONTEXT_TRACE_ID_SIZE; ++i) {
+        timing->trace.trace_id [i] = (uint8_t)(i + 1);
+    }
+    for (i = 0; i < TRACE_CONTEXT_SPAN_ID_SIZE; ++i) {
+        timing->trace.parent_id [i] = (uint8_t)(0xa0 + i);
+    }
+    timing->trace.flags = TRACE_CONTEXT_FLAG_SAMPLED;
+    timing->received = 1000;
+    timing->queue_usec = 100;
+    timing->load_usec = 50;
+    timing->tpm_usec = 500;
+    timing->answered = 2000;
+}
+/*
+ * A command in a sampled trace is written as a line with its span, child
+ * of the client's, and a span per stage.
+ */
+static void
+span_exporter_put_test (void **state)
+{
+    test_data_t *data = *state;
+    SpanExporter *exporter;
+    command_timing_t timing;
+    gchar *text = NULL;
+
+    exporter = span_exporter_new (data->path, NULL);
+    assert_non_null (exporter);
+    timing_init (&timing);
+    assert_true (span_exporter_put (exporter, 5, 0x17b, 0, &timing, 2100));
+    g_object_unref (exporter);
+
+    assert_true (g_file_get_contents (data->path, &text, NULL, NULL));
+    assert_true (g_str_has_prefix (text, "{\"resourceSpans\":"));
+    assert_true (g_str_has_suffix (text, "]}]}]}\n"));
+    assert_non_null (strstr (text, "\"traceId\":\"0102030405060708090a0b0c0d0e0f10\""));
+    assert_non_null (strstr (text, "\"parentSpanId\":\"a0a1a2a3a4a5a6a7\""));
+    assert_non_null (strstr (text, "\"name\":\"TPM2 command\""));
+    assert_non_null (strstr (text, "\"intValue\":\"379\""));
+    assert_non_null (strstr (text, "\"name\":\"queue\""));
+    assert_non_null (strstr (text, "\"name\":\"load\""));
+    assert_non_null (strstr (text, "\"name\":\"execute\""));
+    assert_non_null (strstr (text, "\"name\":\"write\""));
+    /* no time was spent saving contexts */
+    assert_null (strstr (text, "\"name\":\"save\""));
+    g_free (text);
+}
+/*
+ * Commands that aren't part of a sampled trace get no spans.
+ */
+static void
+span_exporter_unsampled_test (void **state)
+{
+    test_data_t *data = *state;
+    SpanExporter *exporter;
+    command_timing_t timing;
+    gchar *text = NULL;
+
+    exporter = span_exporter_new (data->path, NULL);
+    assert_non_null (exporter);
+    timing_init (&timing);
+    timing.trace.flags = 0;
+    assert_false (span_exporter_put (exporter, 5, 0x17b, 0, &timing, 2100));
+    memset (&timing.trace, 0, sizeof (timing.trace));
+    assert_false (span_exporter_put (exporter, 5, 0x17b, 0, &timing, 2100));
+    assert_false (span_exporter_put (NULL, 5, 0x17b, 0, &timing, 2100));
+    g_object_unref (exporter);
+
+    assert_true (g_file_get_contents (data->path, &text, NULL, NULL));
+    assert_string_equal (text, "");
+    g_free (text);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (span_exporter_put_test,
+                                         span_exporter_setup,
+                                         span_exporter_teardown),
+        cmocka_unit_test_setup_teardown (span_exporter_unsampled_test,
+                                         span_exporter_setup,
+                                         span_exporter_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "connection.h"
+#include "connection-manager.h"
+#include "stats-page.h"
+#include "tabrmd-defaults.h"
+#include "util.h"
+
+typedef struct {
+    ConnectionManager  *manager;
+    StatsPage          *stats;
+    gchar              *dir;
+    gchar              *path;
+} test_data_t;
+
+static int
+stats_page_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+
+    data->manager = connection_manager_new (TABRMD_CONNECTIONS_MAX_DEFAULT);
+    data->stats = stats_page_new (data->manager);
+    data->dir = g_dir_make_tmp ("stats-page-unit-XXXXXX", NULL);
+    assert_non_null (data->dir);
+    data->path = g_build_filename (data->dir, "stats", NULL);
+
+    *state = data;
+    return 0;
+}
+static int
+stats_page_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    g_clear_object (&data->stats);
+    g_unlink (data->path);
+    g_rmdir (data->dir);
+    g_free (data->path);
+    g_free (data->dir);
+    g_object_unref (data->manager);
+    g_free (data);
+    return 0;
+}
+/*
+ * A reader sees the connections as of the last update and the page is
+ * removed along with the StatsPage.
+ */
+static void
+stats_page_open_update_test (void **state)
+{
+    test_data_t *data = *state;
+    const stats_page_t *page;
+    stats_page_t *copy = g_new0 (stats_page_t, 1);
+    Connection *connection;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    GError *error = NULL;
+    gint client_fd;
+
+    assert_true (stats_page_open (data->stats, data->path, &error));
+    page = stats_page_map (data->path, &error);
+    assert_non_null (page);
+    assert_true (stats_page_snapshot (page, copy));
+    assert_int_equal (copy->seq % 2, 0);
+    assert_int_equal (copy->tpm_count, 0);
+    assert_int_equal (copy->connections_total, 0);
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, 27);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 5, handle_map);
+    connection_set_pid (connection, 1234);
+    connection_count_command (connection);
+    connection_add_tpm_time (connection, 300);
+    assert_int_equal (connection_manager_insert (data->manager, connection), 0);
+    stats_page_update (data->stats);
+
+    assert_true (stats_page_snapshot (page, copy));
+    assert_int_equal (copy->connections_total, 1);
+    assert_int_equal (copy->connection_count, 1);
+    assert_int_equal (copy->connections [0].id, 5);
+    assert_int_equal (copy->connections [0].pid, 1234);
+    assert_int_equal (copy->connections [0].commands, 1);
+    assert_int_equal (copy->connections [0].tpm_usec, 300);
+
+    g_clear_object (&data->stats);
+    assert_false (g_file_test (data->path, G_FILE_TEST_EXISTS));
+    stats_page_unmap (page);
+    connection_manager_remove (data->manager, connection);
+    g_object_unref (connection);
+    g_object_unref (iostream);
+    g_object_unref (handle_map);
+    close (client_fd);
+    g_free (copy);
+}
+/*
+ * A page the writer is in the middle of updating can't be copied.
+ */
+static void
+stats_page_snapshot_busy_test (void **state)
+{
+    stats_page_t *page = g_new0 (stats_page_t, 1);
+    stats_page_t *copy = g_new0 (stats_page_t, 1);
+    UNUSED_PARAM (state);
+
+    page->seq = 3;
+    assert_false (stats_page_snapshot (page, copy));
+    page->seq = 4;
+    page->connections_total = 7;
+    assert_true (stats_page_snapshot (page, copy));
+    assert_int_equal (copy->connections_total, 7);
+    g_free (page);
+    g_free (copy);
+}
+static void
+stats_page_map_invalid_test (void **state)
+{
+    test_data_t *data = *state;
+    GError *error = NULL;
+
+    assert_null (stats_page_map (data->path, &error));
+    g_clear_error (&error);
+    assert_true (g_file_set_contents (data->path, "garbage", -1, NULL));
+    assert_null (stats_page_map (data->path, &error));
+    assert_non_null (error);
+    g_clear_error (&error);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (stats_page_open_update_test,
+                                         stats_page_setup,
+                                         stats_page_teardown),
+        cmocka_unit_test_setup_teardown (stats_page_snapshot_busy_test,
+                                         stats_page_setup,
+                                         stats_page_teardown),
+        cmocka_unit_test_setup_teardown (stats_page_map_invalid_test,
+                                         stats_page_setup,
+                                         stats_page_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
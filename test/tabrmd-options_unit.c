@@ -187,6 +187,151 @@ tcti_conf_parse_opts_success (void **state)
     assert_true (parse_opts (argc, argv, &options));
     tabrmd_options_free (&options);
 }
+/*
+ * Check the parsing of "uid:weight" strings handed to the --weight option.
+ */
+static void
+parse_uid_weight_success_test (void **state)
+{
+    UNUSED_PARAM (state);
+    guint32 uid = 0;
+    guint weight = 0;
+
+    assert_true (parse_uid_weight ("1000:4", &uid, &weight));
+    assert_int_equal (uid, 1000);
+    assert_int_equal (weight, 4);
+}
+static void
+parse_uid_weight_fail_test (void **state)
+{
+    UNUSED_PARAM (state);
+    guint32 uid = 0;
+    guint weight = 0;
+
+    assert_false (parse_uid_weight ("1000", &uid, &weight));
+    assert_false (parse_uid_weight ("1000:", &uid, &weight));
+    assert_false (parse_uid_weight (":4", &uid, &weight));
+    assert_false (parse_uid_weight ("1000:0", &uid, &weight));
+    assert_false (parse_uid_weight ("1000:4x", &uid, &weight));
+    assert_false (parse_uid_weight ("1000:1001", &uid, &weight));
+}
+/*
+ * A rate of 0 is accepted, it exempts the UID from the default limit.
+ */
+static void
+parse_uid_rate_test (void **state)
+{
+    UNUSED_PARAM (state);
+    guint32 uid = 0;
+    guint rate = 1;
+
+    assert_true (parse_uid_rate ("1000:0", &uid, &rate));
+    assert_int_equal (uid, 1000);
+    assert_int_equal (rate, 0);
+    assert_true (parse_uid_rate ("0:50", &uid, &rate));
+    assert_int_equal (rate, 50);
+    assert_false (parse_uid_rate ("1000", &uid, &rate));
+    assert_false (parse_uid_rate ("1000:100001", &uid, &rate));
+}
+static void
+parse_scheduler_test (void **state)
+{
+    UNUSED_PARAM (state);
+    FairQueuePolicy policy;
+
+    assert_true (parse_scheduler ("shortest-first", &policy));
+    assert_int_equal (policy, FAIR_QUEUE_POLICY_SHORTEST_FIRST);
+    assert_true (parse_scheduler ("round-robin", &policy));
+    assert_int_equal (policy, FAIR_QUEUE_POLICY_ROUND_ROBIN);
+    assert_true (parse_scheduler ("fifo", &policy));
+    assert_int_equal (policy, FAIR_QUEUE_POLICY_FIFO);
+    assert_false (parse_scheduler ("lifo", &policy));
+}
+static void
+parse_primary_template_test (void **state)
+{
+    UNUSED_PARAM (state);
+    TPMI_RH_HIERARCHY hierarchy = 0;
+    TPMI_ALG_PUBLIC type = 0;
+
+    assert_true (parse_primary_template ("owner:rsa2048", &hierarchy, &type));
+    assert_int_equal (hierarchy, TPM2_RH_OWNER);
+    assert_int_equal (type, TPM2_ALG_RSA);
+    assert_true (parse_primary_template ("endorsement:ecc256", &hierarchy, &type));
+    assert_int_equal (hierarchy, TPM2_RH_ENDORSEMENT);
+    assert_int_equal (type, TPM2_ALG_ECC);
+    assert_false (parse_primary_template ("owner", &hierarchy, &type));
+    assert_false (parse_primary_template ("ownerx:rsa2048", &hierarchy, &type));
+    assert_false (parse_primary_template ("owner:rsa1024", &hierarchy, &type));
+}
+static void
+parse_io_engine_test (void **state)
+{
+    UNUSED_PARAM (state);
+    CommandSourceEngine engine = COMMAND_SOURCE_ENGINE_IO_URING;
+
+    assert_true (parse_io_engine ("epoll", &engine));
+    assert_int_equal (engine, COMMAND_SOURCE_ENGINE_EPOLL);
+#ifdef HAVE_LIBURING
+    assert_true (parse_io_engine ("io_uring", &engine));
+    assert_int_equal (engine, COMMAND_SOURCE_ENGINE_IO_URING);
+#else
+    assert_false (parse_io_engine ("io_uring", &engine));
+#endif
+    assert_false (parse_io_engine ("select", &engine));
+}
+static void
+parse_thread_cpus_test (void **state)
+{
+    UNUSED_PARAM (state);
+    thread_sched_t sched = THREAD_SCHED_INIT_DEFAULT;
+    TabrmdThread thread;
+
+    assert_true (parse_thread_cpus ("resource-manager:0,2-3", &thread, &sched));
+    assert_int_equal (thread, TABRMD_THREAD_RESOURCE_MANAGER);
+    assert_int_equal (CPU_COUNT (&sched.cpus), 3);
+    assert_true (CPU_ISSET (0, &sched.cpus));
+    assert_false (CPU_ISSET (1, &sched.cpus));
+    assert_true (CPU_ISSET (3, &sched.cpus));
+    assert_false (parse_thread_cpus ("resource-manager:", &thread, &sched));
+    assert_false (parse_thread_cpus ("resource-manager:3-2", &thread, &sched));
+    assert_false (parse_thread_cpus ("resource-manager:1,", &thread, &sched));
+    assert_false (parse_thread_cpus ("tpm:1", &thread, &sched));
+}
+static void
+parse_thread_priority_test (void **state)
+{
+    UNUSED_PARAM (state);
+    thread_sched_t sched = THREAD_SCHED_INIT_DEFAULT;
+    TabrmdThread thread;
+
+    assert_true (parse_thread_priority ("command-source:nice:-5", &thread, &sched));
+    assert_int_equal (thread, TABRMD_THREAD_COMMAND_SOURCE);
+    assert_int_equal (sched.policy, SCHED_OTHER);
+    assert_int_equal (sched.nice, -5);
+    assert_true (parse_thread_priority ("response-sink:fifo:10", &thread, &sched));
+    assert_int_equal (thread, TABRMD_THREAD_RESPONSE_SINK);
+    assert_int_equal (sched.policy, SCHED_FIFO);
+    assert_int_equal (sched.priority, 10);
+    assert_false (parse_thread_priority ("response-sink:nice:20", &thread, &sched));
+    assert_false (parse_thread_priority ("response-sink:fifo:0", &thread, &sched));
+    assert_false (parse_thread_priority ("response-sink:rr:10", &thread, &sched));
+    assert_false (parse_thread_priority ("response-sink", &thread, &sched));
+}
+static void
+parse_uint32_test (void **state)
+{
+    UNUSED_PARAM (state);
+    guint32 value = 0;
+
+    assert_true (parse_uint32 ("0x15d", &value));
+    assert_int_equal (value, 0x15d);
+    assert_true (parse_uint32 ("1000", &value));
+    assert_int_equal (value, 1000);
+    assert_false (parse_uint32 ("", &value));
+    assert_false (parse_uint32 ("0x1ffffffff", &value));
+    assert_false (parse_uint32 ("12ab", &value));
+}
 
 int
 main (void)
@@ -198,6 +343,15 @@ main (void)
         cmocka_unit_test (tcti_conf_parse_opts_max_sessions_fail),
         cmocka_unit_test (tcti_conf_parse_opts_max_transient_fail),
         cmocka_unit_test (tcti_conf_parse_opts_success),
+        cmocka_unit_test (parse_uid_weight_success_test),
+        cmocka_unit_test (parse_uid_rate_test),
+        cmocka_unit_test (parse_scheduler_test),
+        cmocka_unit_test (parse_primary_template_test),
+        cmocka_unit_test (parse_io_engine_test),
+        cmocka_unit_test (parse_uid_weight_fail_test),
+        cmocka_unit_test (parse_uint32_test),
+        cmocka_unit_test (parse_thread_cpus_test),
+        cmocka_unit_test (parse_thread_priority_test),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -0,0 +1,586 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Simulate the schedulers on a trace recorded by tpm2-abrmd --trace. The
+ * commands of the trace go through the daemon's own FairQueue and
+ * ResourceManager, with the emulated TPM from test/tcti-bench.c behind
+ * them, but in virtual time: the TPM's latencies are added to a clock
+ * instead of being waited for, so a trace of hours runs in seconds and
+ * two runs with the same seed give the same results.
+ *
+ * Each connection of the trace sends its commands in order, each at the
+ * time it was recorded or, if that has passed, once the response to the
+ * previous one is in. With --fast every command is sent as soon as the
+ * previous response is in, keeping the TPM saturated. The trace is run
+ * once for each scheduler given with --scheduler, each time against a
+ * fresh TPM, and a line is printed for each with:
+ * - the commands answered and how many of those failed: a trace only
+ *   replays cleanly if the TPM starts out in the state it was recorded in
+ * - the virtual time the run took and the commands answered per second
+ * - the median, 99th percentile and maximum time from sending a command
+ *   to its response
+ * - the contexts the ResourceManager saved and loaded
+ * - Jain's fairness index of the slowdowns of the connections, where a
+ *   connection's slowdown is the time its commands took from sending to
+ *   response over the time the TPM spent on them: 1 when all connections
+ *   are slowed down alike, 1/n when one of n connections takes it all.
+ *
+ * Built with 'make check', e.g.
+ *   test/tabrmd-sim --scheduler=round-robin,fifo --tcti=profile=ftpm trace
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "command-attrs.h"
+#include "command-durations.h"
+#include "connection.h"
+#include "fair-queue.h"
+#include "handle-map.h"
+#include "resource-manager.h"
+#include "session-list.h"
+#include "sink-interface.h"
+#include "tabrmd-defaults.h"
+#include "tabrmd-options.h"
+#include "tcti.h"
+#include "tcti-bench.h"
+#include "tpm2.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "tpm2-response.h"
+#include "trace.h"
+#include "util.h"
+
+#define SIM_SCHEDULERS_DEFAULT "round-robin,shortest-first,fifo"
+#define SIM_SEED_DEFAULT 1
+
+typedef struct {
+    gchar      *schedulers;
+    gchar      *tcti_conf;
+    gint        seed;
+    gboolean    fast;
+    gchar      *path;
+} sim_opts_t;
+
+typedef struct {
+    /* time the command was read, relative to the first record */
+    gint64      usec;
+    guint8     *buf;
+    guint32     size;
+} sim_command_t;
+
+typedef struct {
+    guint64     id;
+    GPtrArray  *commands;
+    /* state of the current run */
+    Connection *connection;
+    guint       next;
+    /* virtual time the next command is sent */
+    gint64      ready;
+    /* command waiting for its response, not referenced */
+    Tpm2Command *in_flight;
+    gint64      sent_at;
+    gint64      latency_sum;
+    gint64      service_sum;
+} sim_connection_t;
+
+typedef struct {
+    const sim_opts_t *opts;
+    GPtrArray  *connections;
+    guint       commands;
+    /* state of the current run */
+    TCTI_BENCH_CONTEXT *bench;
+    /* virtual time of the start of the trace */
+    gint64      base;
+    GHashTable *by_connection;
+    GArray     *latencies;
+    guint       failed;
+} sim_t;
+
+typedef struct {
+    guint       answered;
+    guint       failed;
+    gint64      elapsed;
+    gint64      p50;
+    gint64      p99;
+    gint64      max;
+    guint64     swaps;
+    gdouble     fairness;
+} sim_result_t;
+
+/*
+ * The run in progress, for the sink and the clock of the FairQueue.
+ */
+static sim_t *sim_current;
+
+static void
+sim_command_free (gpointer data)
+{
+    sim_command_t *command = (sim_command_t*)data;
+
+    g_free (command->buf);
+    g_free (command);
+}
+static void
+sim_connection_free (gpointer data)
+{
+    sim_connection_t *connection = (sim_connection_t*)data;
+
+    g_ptr_array_unref (connection->commands);
+    g_free (connection);
+}
+static gboolean
+parse_sim_opts (gint        argc,
+                gchar      *argv[],
+                sim_opts_t *opts)
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    gboolean ret;
+
+    GOptionEntry entries[] = {
+        { "scheduler", 's', 0, G_OPTION_ARG_STRING, &opts->schedulers,
+          "Comma separated schedulers to simulate (default "
+          SIM_SCHEDULERS_DEFAULT ").", "scheduler[,scheduler]" },
+        { "tcti", 't', 0, G_OPTION_ARG_STRING, &opts->tcti_conf,
+          "Configuration of the emulated TPM, see test/tcti-bench.c.",
+          "conf" },
+        { "seed", 'S', 0, G_OPTION_ARG_INT, &opts->seed,
+          "Seed of the TPM latencies (default 1).", "seed" },
+        { "fast", 'f', 0, G_OPTION_ARG_NONE, &opts->fast,
+          "Send each command as soon as the previous response is in instead "
+          "of at its recorded time.", NULL },
+        { NULL },
+    };
+
+    opts->seed = SIM_SEED_DEFAULT;
+    ctx = g_option_context_new ("TRACE - simulate the schedulers on a "
+                                "tpm2-abrmd trace");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    ret = g_option_context_parse (ctx, &argc, &argv, &err);
+    g_option_context_free (ctx);
+    if (!ret) {
+        fprintf (stderr, "%s\n", err->message);
+        g_error_free (err);
+        return FALSE;
+    }
+    if (argc != 2) {
+        fprintf (stderr, "a single trace file is required\n");
+        return FALSE;
+    }
+    if (opts->seed < 0) {
+        fprintf (stderr, "the seed can't be negative\n");
+        return FALSE;
+    }
+    opts->path = g_strdup (argv [1]);
+    if (opts->schedulers == NULL) {
+        opts->schedulers = g_strdup (SIM_SCHEDULERS_DEFAULT);
+    }
+    return TRUE;
+}
+/*
+ * Read the commands of the trace at 'path' into 'sim->connections', a
+ * GPtrArray of sim_connection_t in the order the connections first
+ * appear. Responses are skipped, the simulated TPM gives its own.
+ */
+static gboolean
+sim_load (sim_t       *sim,
+          const gchar *path,
+          GError     **error)
+{
+    GHashTable *by_id;
+    sim_connection_t *connection;
+    sim_command_t *command;
+    trace_header_t header;
+    trace_record_t record;
+    gint64 first = -1;
+    guint8 *buf;
+    FILE *file;
+
+    file = trace_open_read (path, &header, error);
+    if (file == NULL) {
+        return FALSE;
+    }
+    sim->connections = g_ptr_array_new_with_free_func (sim_connection_free);
+    by_id = g_hash_table_new (g_int64_hash, g_int64_equal);
+    while ((buf = trace_read_record (file, &record, error)) != NULL) {
+        if (first == -1) {
+            first = record.usec;
+        }
+        if (record.type != TRACE_COMMAND || record.size < TPM_HEADER_SIZE) {
+            g_free (buf);
+            continue;
+        }
+        connection = g_hash_table_lookup (by_id, &record.connection_id);
+        if (connection == NULL) {
+            connection = g_new0 (sim_connection_t, 1);
+            connection->id = record.connection_id;
+            connection->commands =
+                g_ptr_array_new_with_free_func (sim_command_free);
+            g_hash_table_insert (by_id, &connection->id, connection);
+            g_ptr_array_add (sim->connections, connection);
+        }
+        command = g_new0 (sim_command_t, 1);
+        command->usec = record.usec - first;
+        command->buf = buf;
+        command->size = record.size;
+        g_ptr_array_add (connection->commands, command);
+        ++sim->commands;
+    }
+    g_hash_table_unref (by_id);
+    fclose (file);
+    return error == NULL || *error == NULL;
+}
+/*
+ * FairQueueClock reading the virtual time of the emulated TPM.
+ */
+static gint64
+sim_clock (void)
+{
+    return sim_current->bench->virtual_usec;
+}
+/*
+ * Schedule the next command of 'connection' once the response to the
+ * previous one is in at 'now'.
+ */
+static void
+sim_connection_advance (sim_t            *sim,
+                        sim_connection_t *connection,
+                        gint64            now)
+{
+    sim_command_t *command;
+
+    connection->in_flight = NULL;
+    if (++connection->next >= connection->commands->len) {
+        return;
+    }
+    command = g_ptr_array_index (connection->commands, connection->next);
+    connection->ready = sim->opts->fast ? now :
+        MAX (sim->base + command->usec, now);
+}
+/*
+ * The ResourceManager sends its responses here: they complete the command
+ * their connection has in flight. Other messages are dropped, the
+ * ResourceManager drops its own reference.
+ */
+void
+__wrap_sink_enqueue (Sink    *self,
+                     GObject *obj)
+{
+    sim_t *sim = sim_current;
+    sim_connection_t *connection;
+    Tpm2Response *response;
+    gint64 latency;
+
+    UNUSED_PARAM (self);
+    if (sim == NULL || !IS_TPM2_RESPONSE (obj)) {
+        return;
+    }
+    response = TPM2_RESPONSE (obj);
+    connection = g_hash_table_lookup (sim->by_connection,
+                                      response->connection);
+    if (connection == NULL || connection->in_flight == NULL) {
+        return;
+    }
+    latency = sim->bench->virtual_usec - connection->sent_at;
+    connection->latency_sum += latency;
+    g_array_append_val (sim->latencies, latency);
+    if (tpm2_response_get_code (response) != TSS2_RC_SUCCESS) {
+        ++sim->failed;
+    }
+    sim_connection_advance (sim, connection, sim->bench->virtual_usec);
+}
+/*
+ * Enqueue the next command of 'connection' as though it had been read at
+ * its ready time.
+ */
+static void
+sim_send (sim_t            *sim,
+          ResourceManager  *resmgr,
+          CommandAttrs     *attrs,
+          sim_connection_t *connection)
+{
+    sim_command_t *sim_command;
+    Tpm2Command *command;
+    guint8 *buf;
+
+    sim_command = g_ptr_array_index (connection->commands, connection->next);
+    buf = g_malloc (sim_command->size);
+    memcpy (buf, sim_command->buf, sim_command->size);
+    command = tpm2_command_new (connection->connection,
+                                buf,
+                                sim_command->size,
+                                command_attrs_from_cc (attrs,
+                                                       get_command_code (buf)));
+    command->timestamp = connection->ready;
+    connection->in_flight = command;
+    connection->sent_at = connection->ready;
+    message_queue_enqueue (resmgr->in_queue, G_OBJECT (command));
+    g_object_unref (command);
+}
+static int
+sim_compare_latency (gconstpointer a,
+                     gconstpointer b)
+{
+    gint64 first = *(const gint64*)a, second = *(const gint64*)b;
+
+    return first < second ? -1 : first > second;
+}
+static void
+sim_summarize (sim_t        *sim,
+               sim_result_t *result)
+{
+    sim_connection_t *connection;
+    gdouble slowdown, sum = 0, squares = 0;
+    guint i, n = 0, count = sim->latencies->len;
+
+    result->answered = count;
+    result->failed = sim->failed;
+    if (count > 0) {
+        g_array_sort (sim->latencies, sim_compare_latency);
+        result->p50 = g_array_index (sim->latencies, gint64, count / 2);
+        result->p99 = g_array_index (sim->latencies, gint64,
+                                     MIN (count - 1, count * 99 / 100));
+        result->max = g_array_index (sim->latencies, gint64, count - 1);
+    }
+    for (i = 0; i < sim->connections->len; ++i) {
+        connection = g_ptr_array_index (sim->connections, i);
+        if (connection->latency_sum == 0) {
+            continue;
+        }
+        slowdown = (gdouble)connection->latency_sum /
+            (gdouble)MAX (connection->service_sum, 1);
+        sum += slowdown;
+        squares += slowdown * slowdown;
+        ++n;
+    }
+    result->fairness = n > 0 ? sum * sum / (n * squares) : 1.0;
+}
+/*
+ * Run the trace through a ResourceManager scheduling with 'policy' and an
+ * emulated TPM in virtual time.
+ */
+static gboolean
+sim_run (sim_t           *sim,
+         FairQueuePolicy  policy,
+         sim_result_t    *result)
+{
+    TSS2_TCTI_CONTEXT *context;
+    CommandDurations *durations;
+    CommandAttrs *attrs = NULL;
+    SessionList *session_list = NULL;
+    ResourceManager *resmgr = NULL;
+    sim_connection_t *connection;
+    GIOStream *iostream;
+    HandleMap *map;
+    GObject *obj;
+    Tcti *tcti;
+    Tpm2 *tpm2;
+    gchar *conf;
+    size_t size = 0;
+    gint64 now, next, service;
+    guint64 commands, busy_usec, swaps_before, swaps;
+    gboolean ret = FALSE;
+    gint client_fd;
+    guint i;
+    TSS2_RC rc;
+
+    conf = g_strdup_printf ("seed=%d,%s,clock=virtual", sim->opts->seed,
+                            sim->opts->tcti_conf != NULL ?
+                            sim->opts->tcti_conf : "");
+    Tss2_Tcti_Bench_Init (NULL, &size, NULL);
+    context = calloc (1, size);
+    rc = Tss2_Tcti_Bench_Init (context, &size, conf);
+    g_free (conf);
+    if (rc != TSS2_RC_SUCCESS) {
+        fprintf (stderr, "invalid TPM configuration, see test/tcti-bench.c\n");
+        free (context);
+        return FALSE;
+    }
+    sim->bench = (TCTI_BENCH_CONTEXT*)context;
+    /* the Tcti owns the context */
+    tcti = tcti_new (context);
+    tpm2 = tpm2_new (tcti);
+    g_object_unref (tcti);
+    rc = tpm2_init_tpm (tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        fprintf (stderr, "failed to initialize the emulated TPM: 0x%" PRIx32
+                 "\n", rc);
+        goto out;
+    }
+    attrs = command_attrs_new ();
+    if (command_attrs_init_tpm (attrs, tpm2) != 0) {
+        fprintf (stderr, "failed to get the commands of the emulated TPM\n");
+        goto out;
+    }
+    session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT,
+                                     SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    resmgr = resource_manager_new (tpm2, session_list);
+    /*
+     * The Tpm2 would record the real time the emulated TPM takes, next to
+     * nothing, so the estimates are fed the virtual time instead.
+     */
+    durations = command_durations_new ();
+    fair_queue_set_policy (FAIR_QUEUE (resmgr->in_queue), policy, durations);
+    fair_queue_set_clock (FAIR_QUEUE (resmgr->in_queue), sim_clock);
+
+    sim->by_connection = g_hash_table_new (g_direct_hash, g_direct_equal);
+    sim->latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+    sim->failed = 0;
+    sim_current = sim;
+    sim->base = sim->bench->virtual_usec;
+    for (i = 0; i < sim->connections->len; ++i) {
+        connection = g_ptr_array_index (sim->connections, i);
+        map = handle_map_new (TPM2_HT_TRANSIENT, TABRMD_TRANSIENT_MAX_DEFAULT);
+        iostream = create_connection_iostream (&client_fd);
+        connection->connection = connection_new (iostream, connection->id, map);
+        g_object_unref (iostream);
+        g_object_unref (map);
+        close (client_fd);
+        g_hash_table_insert (sim->by_connection,
+                             connection->connection,
+                             connection);
+        connection->next = 0;
+        connection->ready = sim->base + (sim->opts->fast ? 0 :
+            ((sim_command_t*)g_ptr_array_index (connection->commands, 0))->usec);
+        connection->in_flight = NULL;
+        connection->latency_sum = 0;
+        connection->service_sum = 0;
+    }
+    tpm2_get_activity (tpm2, &commands, &busy_usec, &swaps_before);
+
+    for (;;) {
+        now = sim->bench->virtual_usec;
+        next = G_MAXINT64;
+        for (i = 0; i < sim->connections->len; ++i) {
+            connection = g_ptr_array_index (sim->connections, i);
+            if (connection->in_flight != NULL ||
+                connection->next >= connection->commands->len)
+            {
+                continue;
+            }
+            if (connection->ready <= now) {
+                sim_send (sim, resmgr, attrs, connection);
+            } else {
+                next = MIN (next, connection->ready);
+            }
+        }
+        obj = message_queue_try_dequeue (resmgr->in_queue);
+        if (obj == NULL) {
+            if (next == G_MAXINT64) {
+                break;
+            }
+            /* the TPM is idle until the next command is sent */
+            sim->bench->virtual_usec = next;
+            continue;
+        }
+        if (!IS_TPM2_COMMAND (obj)) {
+            g_object_unref (obj);
+            continue;
+        }
+        resource_manager_process_tpm2_command (resmgr, TPM2_COMMAND (obj));
+        service = sim->bench->virtual_usec - now;
+        command_durations_observe (durations,
+                                   tpm2_command_get_code (TPM2_COMMAND (obj)),
+                                   service);
+        connection = g_hash_table_lookup (sim->by_connection,
+                                          TPM2_COMMAND (obj)->connection);
+        connection->service_sum += service;
+        /* no response: count it as failed and go on with the next one */
+        if (connection->in_flight == TPM2_COMMAND (obj)) {
+            ++sim->failed;
+            sim_connection_advance (sim, connection, sim->bench->virtual_usec);
+        }
+        g_object_unref (obj);
+    }
+
+    tpm2_get_activity (tpm2, &commands, &busy_usec, &swaps);
+    result->swaps = swaps - swaps_before;
+    result->elapsed = sim->bench->virtual_usec - sim->base;
+    sim_summarize (sim, result);
+    for (i = 0; i < sim->connections->len; ++i) {
+        connection = g_ptr_array_index (sim->connections, i);
+        resource_manager_remove_connection (resmgr, connection->connection);
+        g_clear_object (&connection->connection);
+    }
+    sim_current = NULL;
+    g_clear_pointer (&sim->by_connection, g_hash_table_unref);
+    g_clear_pointer (&sim->latencies, g_array_unref);
+    g_object_unref (durations);
+    ret = TRUE;
+out:
+    g_clear_object (&resmgr);
+    g_clear_object (&session_list);
+    g_clear_object (&attrs);
+    g_clear_object (&tpm2);
+    sim->bench = NULL;
+    return ret;
+}
+int
+main (int   argc,
+      char *argv[])
+{
+    sim_opts_t opts = { 0 };
+    sim_t sim = { .opts = &opts };
+    sim_result_t result;
+    FairQueuePolicy policy;
+    GError *error = NULL;
+    gchar **schedulers = NULL, **scheduler;
+    gint ret = EX_OK;
+
+    if (!parse_sim_opts (argc, argv, &opts)) {
+        return EX_USAGE;
+    }
+    schedulers = g_strsplit (opts.schedulers, ",", -1);
+    for (scheduler = schedulers; *scheduler != NULL; ++scheduler) {
+        if (!parse_scheduler (*scheduler, &policy)) {
+            fprintf (stderr, "unknown scheduler: %s\n", *scheduler);
+            ret = EX_USAGE;
+            goto out;
+        }
+    }
+    if (!sim_load (&sim, opts.path, &error)) {
+        fprintf (stderr, "%s\n", error->message);
+        g_clear_error (&error);
+        ret = EX_DATAERR;
+        goto out;
+    }
+    printf ("connections: %u, commands: %u\n",
+            sim.connections->len, sim.commands);
+    printf ("%-16s %9s %7s %10s %10s %9s %9s %9s %7s %8s\n",
+            "scheduler", "commands", "failed", "elapsed s", "commands/s",
+            "p50 ms", "p99 ms", "max ms", "swaps", "fairness");
+    for (scheduler = schedulers; *scheduler != NULL; ++scheduler) {
+        parse_scheduler (*scheduler, &policy);
+        memset (&result, 0, sizeof (result));
+        if (!sim_run (&sim, policy, &result)) {
+            ret = EX_SOFTWARE;
+            break;
+        }
+        printf ("%-16s %9u %7u %10.3f %10.1f %9.3f %9.3f %9.3f %7" PRIu64
+                " %8.3f\n",
+                *scheduler,
+                result.answered,
+                result.failed,
+                (gdouble)result.elapsed / G_USEC_PER_SEC,
+                result.elapsed > 0 ? (gdouble)result.answered *
+                    G_USEC_PER_SEC / (gdouble)result.elapsed : 0.0,
+                (gdouble)result.p50 / 1000,
+                (gdouble)result.p99 / 1000,
+                (gdouble)result.max / 1000,
+                result.swaps,
+                result.fairness);
+    }
+out:
+    g_strfreev (schedulers);
+    g_clear_pointer (&sim.connections, g_ptr_array_unref);
+    g_free (opts.schedulers);
+    g_free (opts.tcti_conf);
+    g_free (opts.path);
+    return ret;
+}
@@ -0,0 +1,1140 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * A TCTI emulating a TPM for benchmarks. Commands succeed without doing
+ * anything but take as long as they would on a real TPM: each command's
+ * latency is drawn from a log-normal distribution around a median taken
+ * from a profile of discrete (dtpm) or firmware (ftpm) TPM timings. The
+ * TPM has a limited number of object and session slots: loading more
+ * fails with TPM2_RC_OBJECT_MEMORY or TPM2_RC_SESSION_MEMORY, so the
+ * resource manager has to swap contexts as it would with a real TPM.
+ * Handles that aren't loaded are rejected with TPM2_RC_REFERENCE_*.
+ *
+ * The responses hold the parameters the daemon reads itself (capabilities,
+ * contexts, handles, random bytes and the clock), other commands return
+ * no parameters. Drive it with tabrmd-replay or raw commands rather than
+ * through the SAPI or ESAPI.
+ *
+ * The conf string is a comma separated list of key=value pairs:
+ *   profile=dtpm|ftpm        latency profile, default dtpm
+ *   profile-file=PATH        medians overriding the profile, one command
+ *                            per line: "<command code> <usec> [<sigma>]"
+ *   scale=FACTOR             multiply latencies, 0 for none, default 1
+ *   objects=N                transient object slots, default 3
+ *   sessions=N               loaded session slots, default 3
+ *   seed=N                   seed of the latency distribution
+ *   clock=real|virtual       with virtual, responses are ready at once and
+ *                            latencies add up in 'virtual_usec' instead,
+ *                            for simulators keeping their own time
+ *
+ * Build with 'make check' and load with --tcti naming the library, e.g.
+ *   tpm2-abrmd --tcti=test/.libs/libtss2-tcti-bench.so:profile=ftpm
+ */
+#include <endian.h>
+#include <errno.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <tss2/tss2_tcti.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tcti-bench.h"
+#include "util.h"
+
+#define BENCH_HEADER_SIZE 10
+#define BENCH_OBJECT_FIRST TPM2_TRANSIENT_FIRST
+#define BENCH_HMAC_FIRST TPM2_HMAC_SESSION_FIRST
+#define BENCH_POLICY_FIRST TPM2_POLICY_SESSION_FIRST
+#define BENCH_HANDLE_TYPE(handle) ((handle) >> TPM2_HR_SHIFT)
+#define BENCH_IS_SESSION(handle) \
+    (BENCH_HANDLE_TYPE (handle) == TPM2_HT_HMAC_SESSION || \
+     BENCH_HANDLE_TYPE (handle) == TPM2_HT_POLICY_SESSION)
+/* savedHandle of a saved object context */
+#define BENCH_SAVED_OBJECT 0x80000000
+#define BENCH_CONTEXT_BLOB_SIZE 16
+#define BENCH_NONCE_SIZE 32
+#define BENCH_MAX_CAP_CC 128
+#define BENCH_SESSION_CONTINUE 0x01
+
+/*
+ * The commands the emulated TPM implements: their handle counts, whether
+ * they return a handle or flush the objects they're given, and the median
+ * latency in microseconds on a discrete and a firmware TPM with the sigma
+ * of the log-normal distribution around it. Key generation varies widely
+ * with the algorithm and the number of prime candidates tried, hence its
+ * large sigma.
+ */
+#define CMD(name, handles, rhandle, flushed, dtpm, ftpm, sigma) \
+    { TPM2_CC_##name, handles, rhandle, flushed, dtpm, ftpm, sigma }
+static const tcti_bench_command_t tcti_bench_commands [] = {
+    CMD (NV_UndefineSpaceSpecial,     2, 0, 0,  30000,  5000, 0.3),
+    CMD (EvictControl,                2, 0, 0,  40000,  6000, 0.3),
+    CMD (HierarchyControl,            1, 0, 0,  10000,  1000, 0.3),
+    CMD (NV_UndefineSpace,            2, 0, 0,  30000,  5000, 0.3),
+    CMD (Clear,                       1, 0, 0, 200000, 50000, 0.3),
+    CMD (ClearControl,                1, 0, 0,  10000,  1000, 0.3),
+    CMD (HierarchyChangeAuth,         1, 0, 0,  15000,  2000, 0.3),
+    CMD (NV_DefineSpace,              1, 0, 0,  30000,  5000, 0.3),
+    CMD (CreatePrimary,               1, 1, 0, 400000, 60000, 0.8),
+    CMD (NV_GlobalWriteLock,          1, 0, 0,  10000,  1000, 0.3),
+    CMD (NV_Increment,                2, 0, 0,  20000,  3000, 0.3),
+    CMD (NV_SetBits,                  2, 0, 0,  20000,  3000, 0.3),
+    CMD (NV_Extend,                   2, 0, 0,  25000,  3000, 0.3),
+    CMD (NV_Write,                    2, 0, 0,  25000,  3000, 0.3),
+    CMD (NV_WriteLock,                2, 0, 0,  15000,  2000, 0.3),
+    CMD (DictionaryAttackLockReset,   1, 0, 0,  10000,  1000, 0.3),
+    CMD (DictionaryAttackParameters,  1, 0, 0,  10000,  1000, 0.3),
+    CMD (NV_ChangeAuth,               1, 0, 0,  20000,  3000, 0.3),
+    CMD (PCR_Event,                   1, 0, 0,   5000,   400, 0.25),
+    CMD (PCR_Reset,                   1, 0, 0,   4000,   300, 0.25),
+    CMD (SequenceComplete,            1, 0, 1,   4000,   300, 0.25),
+    CMD (SetCommandCodeAuditStatus,   1, 0, 0,  10000,  1000, 0.3),
+    CMD (IncrementalSelfTest,         0, 0, 0,  50000, 10000, 0.3),
+    CMD (SelfTest,                    0, 0, 0, 500000,100000, 0.3),
+    CMD (Startup,                     0, 0, 0,  20000,  2000, 0.3),
+    CMD (Shutdown,                    0, 0, 0,  20000,  2000, 0.3),
+    CMD (StirRandom,                  0, 0, 0,   3000,   200, 0.25),
+    CMD (ActivateCredential,          2, 0, 0, 150000,  9000, 0.3),
+    CMD (Certify,                     2, 0, 0, 130000,  9000, 0.3),
+    CMD (PolicyNV,                    3, 0, 0,  10000,   800, 0.25),
+    CMD (CertifyCreation,             2, 0, 0, 130000,  9000, 0.3),
+    CMD (Duplicate,                   2, 0, 0,  40000,  3000, 0.3),
+    CMD (GetTime,                     2, 0, 0, 130000,  9000, 0.3),
+    CMD (GetSessionAuditDigest,       3, 0, 0, 130000,  9000, 0.3),
+    CMD (NV_Read,                     2, 0, 0,   8000,   600, 0.25),
+    CMD (NV_ReadLock,                 2, 0, 0,  15000,  2000, 0.3),
+    CMD (ObjectChangeAuth,            2, 0, 0,  20000,  1500, 0.3),
+    CMD (PolicySecret,                2, 0, 0,   8000,   600, 0.25),
+    CMD (Rewrap,                      2, 0, 0,  40000,  3000, 0.3),
+    CMD (Create,                      1, 0, 0, 300000, 40000, 0.8),
+    CMD (ECDH_ZGen,                   1, 0, 0,  60000,  5000, 0.3),
+    CMD (HMAC,                        1, 0, 0,   5000,   400, 0.25),
+    CMD (Import,                      1, 0, 0,  40000,  3000, 0.3),
+    CMD (Load,                        1, 1, 0,  25000,  1500, 0.3),
+    CMD (Quote,                       1, 0, 0, 130000,  9000, 0.3),
+    CMD (RSA_Decrypt,                 1, 0, 0, 150000,  9000, 0.3),
+    CMD (HMAC_Start,                  1, 1, 0,   5000,   400, 0.25),
+    CMD (SequenceUpdate,              1, 0, 0,   3000,   200, 0.25),
+    CMD (Sign,                        1, 0, 0, 120000,  8000, 0.3),
+    CMD (Unseal,                      1, 0, 0,   8000,   500, 0.25),
+    CMD (PolicySigned,                2, 0, 0,  20000,  2000, 0.3),
+    CMD (ContextLoad,                 0, 1, 0,   9000,   500, 0.25),
+    CMD (ContextSave,                 1, 0, 0,   6000,   400, 0.25),
+    CMD (ECDH_KeyGen,                 1, 0, 0,  60000,  5000, 0.3),
+    CMD (EncryptDecrypt,              1, 0, 0,   6000,   500, 0.25),
+    CMD (FlushContext,                0, 0, 0,   2000,   150, 0.25),
+    CMD (LoadExternal,                0, 1, 0,  12000,   800, 0.3),
+    CMD (MakeCredential,              1, 0, 0,  12000,  1000, 0.3),
+    CMD (NV_ReadPublic,               1, 0, 0,   3000,   200, 0.25),
+    CMD (PolicyAuthorize,             1, 0, 0,   3000,   200, 0.25),
+    CMD (PolicyAuthValue,             1, 0, 0,   2000,   150, 0.25),
+    CMD (PolicyCommandCode,           1, 0, 0,   2000,   150, 0.25),
+    CMD (PolicyCounterTimer,          1, 0, 0,   3000,   200, 0.25),
+    CMD (PolicyCpHash,                1, 0, 0,   2000,   150, 0.25),
+    CMD (PolicyLocality,              1, 0, 0,   2000,   150, 0.25),
+    CMD (PolicyNameHash,              1, 0, 0,   2000,   150, 0.25),
+    CMD (PolicyOR,                    1, 0, 0,   3000,   200, 0.25),
+    CMD (PolicyTicket,                1, 0, 0,   3000,   200, 0.25),
+    CMD (ReadPublic,                  1, 0, 0,   3000,   200, 0.25),
+    CMD (RSA_Encrypt,                 1, 0, 0,  10000,   800, 0.3),
+    CMD (StartAuthSession,            2, 1, 0,  30000,  2000, 0.3),
+    CMD (VerifySignature,             1, 0, 0,  15000,  1500, 0.3),
+    CMD (ECC_Parameters,              0, 0, 0,   2000,   150, 0.25),
+    CMD (GetCapability,               0, 0, 0,   2000,   150, 0.25),
+    CMD (GetRandom,                   0, 0, 0,   3000,   200, 0.25),
+    CMD (GetTestResult,               0, 0, 0,   2000,   150, 0.25),
+    CMD (Hash,                        0, 0, 0,   4000,   300, 0.25),
+    CMD (PCR_Read,                    0, 0, 0,   2000,   150, 0.25),
+    CMD (PolicyPCR,                   1, 0, 0,   3000,   200, 0.25),
+    CMD (PolicyRestart,               1, 0, 0,   2000,   150, 0.25),
+    CMD (ReadClock,                   0, 0, 0,   2000,   150, 0.25),
+    CMD (PCR_Extend,                  1, 0, 0,   4000,   300, 0.25),
+    CMD (NV_Certify,                  3, 0, 0, 130000,  9000, 0.3),
+    CMD (EventSequenceComplete,       2, 0, 1,   5000,   400, 0.25),
+    CMD (HashSequenceStart,           0, 1, 0,   3000,   200, 0.25),
+    CMD (PolicyPhysicalPresence,      1, 0, 0,   2000,   150, 0.25),
+    CMD (PolicyDuplicationSelect,     1, 0, 0,   2000,   150, 0.25),
+    CMD (PolicyGetDigest,             1, 0, 0,   2000,   150, 0.25),
+    CMD (TestParms,                   0, 0, 0,   2000,   150, 0.25),
+    CMD (Commit,                      1, 0, 0,  60000,  5000, 0.3),
+    CMD (PolicyPassword,              1, 0, 0,   2000,   150, 0.25),
+    CMD (ZGen_2Phase,                 1, 0, 0,  60000,  5000, 0.3),
+    CMD (EC_Ephemeral,                0, 0, 0,  60000,  5000, 0.3),
+    CMD (PolicyNvWritten,             1, 0, 0,   2000,   150, 0.25),
+    CMD (PolicyTemplate,              1, 0, 0,   2000,   150, 0.25),
+    CMD (CreateLoaded,                1, 1, 0, 400000, 60000, 0.8),
+    CMD (PolicyAuthorizeNV,           3, 0, 0,  10000,   800, 0.25),
+    CMD (EncryptDecrypt2,             1, 0, 0,   6000,   500, 0.25),
+};
+#undef CMD
+
+/* commands the emulated TPM doesn't implement take this long to fail */
+#define BENCH_UNKNOWN_USEC 1000
+
+static inline guint16
+bench_get16 (const guint8 *buf)
+{
+    return (guint16)(buf [0] << 8 | buf [1]);
+}
+static inline guint32
+bench_get32 (const guint8 *buf)
+{
+    return (guint32)buf [0] << 24 | (guint32)buf [1] << 16 |
+        (guint32)buf [2] << 8 | buf [3];
+}
+static const tcti_bench_command_t*
+bench_lookup (TPM2_CC  cc,
+              guint   *index)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (tcti_bench_commands); ++i) {
+        if (tcti_bench_commands [i].cc == cc) {
+            *index = i;
+            return &tcti_bench_commands [i];
+        }
+    }
+    return NULL;
+}
+/*
+ * Response building: commands write their handle and parameters with the
+ * bench_put functions, bench_finish_response adds the header and the
+ * session area. Writes past the buffer are dropped and reported as
+ * TPM2_RC_SIZE.
+ */
+static void
+bench_put (TCTI_BENCH_CONTEXT *bench,
+           gconstpointer       buf,
+           size_t              size)
+{
+    if (bench->response_size + size > sizeof (bench->response)) {
+        bench->overflow = TRUE;
+        return;
+    }
+    memcpy (&bench->response [bench->response_size], buf, size);
+    bench->response_size += size;
+}
+static void
+bench_put8 (TCTI_BENCH_CONTEXT *bench,
+            guint8              value)
+{
+    bench_put (bench, &value, sizeof (value));
+}
+static void
+bench_put16 (TCTI_BENCH_CONTEXT *bench,
+             guint16             value)
+{
+    value = htobe16 (value);
+    bench_put (bench, &value, sizeof (value));
+}
+static void
+bench_put32 (TCTI_BENCH_CONTEXT *bench,
+             guint32             value)
+{
+    value = htobe32 (value);
+    bench_put (bench, &value, sizeof (value));
+}
+static void
+bench_put64 (TCTI_BENCH_CONTEXT *bench,
+             guint64             value)
+{
+    value = htobe64 (value);
+    bench_put (bench, &value, sizeof (value));
+}
+/*
+ * Objects occupy the slot their handle is the offset of. Returns the
+ * handle of a free slot or 0 if they're all taken.
+ */
+static TPM2_HANDLE
+bench_object_alloc (TCTI_BENCH_CONTEXT *bench)
+{
+    guint i;
+
+    for (i = 0; i < bench->objects; ++i) {
+        if (!bench->object_loaded [i]) {
+            bench->object_loaded [i] = TRUE;
+            return BENCH_OBJECT_FIRST + i;
+        }
+    }
+    return 0;
+}
+static gboolean
+bench_object_is_loaded (TCTI_BENCH_CONTEXT *bench,
+                        TPM2_HANDLE         handle)
+{
+    guint i = handle - BENCH_OBJECT_FIRST;
+
+    return BENCH_HANDLE_TYPE (handle) == TPM2_HT_TRANSIENT &&
+        i < bench->objects && bench->object_loaded [i];
+}
+/*
+ * Sessions are active from StartAuthSession to FlushContext and loaded
+ * unless their context was saved. Both HMAC and policy sessions take their
+ * handle from the slot they're in.
+ */
+static tcti_bench_session_t*
+bench_session_find (TCTI_BENCH_CONTEXT *bench,
+                    TPM2_HANDLE         handle)
+{
+    guint i = handle & TPM2_HR_HANDLE_MASK;
+
+    if (!BENCH_IS_SESSION (handle) || i >= TCTI_BENCH_ACTIVE_MAX ||
+        bench->sessions [i].handle != handle)
+    {
+        return NULL;
+    }
+    return &bench->sessions [i];
+}
+static gboolean
+bench_session_is_loaded (TCTI_BENCH_CONTEXT *bench,
+                         TPM2_HANDLE         handle)
+{
+    tcti_bench_session_t *session = bench_session_find (bench, handle);
+
+    return session != NULL && session->loaded;
+}
+static TSS2_RC
+bench_session_load (TCTI_BENCH_CONTEXT   *bench,
+                    tcti_bench_session_t *session)
+{
+    if (bench->sessions_loaded >= bench->loaded_max) {
+        return TPM2_RC_SESSION_MEMORY;
+    }
+    session->loaded = TRUE;
+    ++bench->sessions_loaded;
+    return TSS2_RC_SUCCESS;
+}
+static void
+bench_session_flush (TCTI_BENCH_CONTEXT   *bench,
+                     tcti_bench_session_t *session)
+{
+    if (session->loaded) {
+        --bench->sessions_loaded;
+    }
+    session->handle = 0;
+    session->loaded = FALSE;
+}
+static gboolean
+bench_handle_is_loaded (TCTI_BENCH_CONTEXT *bench,
+                        TPM2_HANDLE         handle)
+{
+    switch (BENCH_HANDLE_TYPE (handle)) {
+    case TPM2_HT_TRANSIENT:
+        return bench_object_is_loaded (bench, handle);
+    case TPM2_HT_HMAC_SESSION:
+    case TPM2_HT_POLICY_SESSION:
+        return bench_session_is_loaded (bench, handle);
+    default:
+        /* permanent, persistent, NV and PCR handles always exist */
+        return TRUE;
+    }
+}
+static TSS2_RC
+bench_start_auth_session (TCTI_BENCH_CONTEXT *bench,
+                          const guint8       *params,
+                          size_t              size)
+{
+    tcti_bench_session_t *session = NULL;
+    guint16 nonce_size, salt_size;
+    TPM2_SE type;
+    TSS2_RC rc;
+    guint i;
+
+    if (size < 2 || size < 2u + bench_get16 (params) + 2) {
+        return TPM2_RC_INSUFFICIENT;
+    }
+    nonce_size = bench_get16 (params);
+    salt_size = bench_get16 (&params [2 + nonce_size]);
+    if (size < 4u + nonce_size + salt_size + 1) {
+        return TPM2_RC_INSUFFICIENT;
+    }
+    type = params [4 + nonce_size + salt_size];
+    for (i = 0; i < TCTI_BENCH_ACTIVE_MAX; ++i) {
+        if (bench->sessions [i].handle == 0) {
+            session = &bench->sessions [i];
+            break;
+        }
+    }
+    if (session == NULL) {
+        return TPM2_RC_SESSION_HANDLES;
+    }
+    rc = bench_session_load (bench, session);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    session->handle = (type == TPM2_SE_HMAC ? BENCH_HMAC_FIRST :
+                       BENCH_POLICY_FIRST) + i;
+    bench_put32 (bench, session->handle);
+    bench_put16 (bench, BENCH_NONCE_SIZE);
+    for (i = 0; i < BENCH_NONCE_SIZE; ++i) {
+        bench_put8 (bench, (guint8)g_rand_int (bench->rand));
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Saving an object's context leaves it loaded, saving a session's unloads
+ * it. The blob only records the handle: it's never checked.
+ */
+static TSS2_RC
+bench_context_save (TCTI_BENCH_CONTEXT *bench,
+                    TPM2_HANDLE         handle)
+{
+    tcti_bench_session_t *session;
+    guint8 blob [BENCH_CONTEXT_BLOB_SIZE] = { 0 };
+    TPM2_HANDLE saved;
+
+    if (BENCH_IS_SESSION (handle)) {
+        session = bench_session_find (bench, handle);
+        session->loaded = FALSE;
+        --bench->sessions_loaded;
+        saved = handle;
+    } else if (BENCH_HANDLE_TYPE (handle) == TPM2_HT_TRANSIENT) {
+        saved = BENCH_SAVED_OBJECT;
+    } else {
+        return TPM2_RC_TYPE | TPM2_RC_H | TPM2_RC_1;
+    }
+    memcpy (blob, &handle, sizeof (handle));
+    bench_put64 (bench, ++bench->context_sequence);
+    bench_put32 (bench, saved);
+    bench_put32 (bench, TPM2_RH_NULL);
+    bench_put16 (bench, sizeof (blob));
+    bench_put (bench, blob, sizeof (blob));
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+bench_context_load (TCTI_BENCH_CONTEXT *bench,
+                    const guint8       *params,
+                    size_t              size)
+{
+    tcti_bench_session_t *session;
+    TPM2_HANDLE saved, handle;
+    TSS2_RC rc;
+
+    if (size < 18) {
+        return TPM2_RC_INSUFFICIENT;
+    }
+    saved = bench_get32 (&params [8]);
+    if (BENCH_IS_SESSION (saved)) {
+        session = bench_session_find (bench, saved);
+        if (session == NULL || session->loaded) {
+            return TPM2_RC_HANDLE | TPM2_RC_P | TPM2_RC_1;
+        }
+        rc = bench_session_load (bench, session);
+        if (rc != TSS2_RC_SUCCESS) {
+            return rc;
+        }
+        handle = saved;
+    } else {
+        handle = bench_object_alloc (bench);
+        if (handle == 0) {
+            return TPM2_RC_OBJECT_MEMORY;
+        }
+    }
+    bench_put32 (bench, handle);
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+bench_flush_context (TCTI_BENCH_CONTEXT *bench,
+                     const guint8       *params,
+                     size_t              size)
+{
+    tcti_bench_session_t *session;
+    TPM2_HANDLE handle;
+
+    if (size < 4) {
+        return TPM2_RC_INSUFFICIENT;
+    }
+    handle = bench_get32 (params);
+    if (bench_object_is_loaded (bench, handle)) {
+        bench->object_loaded [handle - BENCH_OBJECT_FIRST] = FALSE;
+        return TSS2_RC_SUCCESS;
+    }
+    session = bench_session_find (bench, handle);
+    if (session != NULL) {
+        bench_session_flush (bench, session);
+        return TSS2_RC_SUCCESS;
+    }
+    return TPM2_RC_HANDLE | TPM2_RC_P | TPM2_RC_1;
+}
+/*
+ * The property values reported by GetCapability, in ascending order.
+ */
+static void
+bench_get_properties (TCTI_BENCH_CONTEXT *bench,
+                      TPM2_PT             first,
+                      guint32             count)
+{
+    guint objects_loaded = 0, sessions_active = 0, i;
+    const struct {
+        TPM2_PT property;
+        guint32 value;
+    } properties [] = {
+        { TPM2_PT_FAMILY_INDICATOR, 0x322e3000 },
+        { TPM2_PT_LEVEL, 0 },
+        { TPM2_PT_REVISION, 138 },
+        { TPM2_PT_MANUFACTURER, 0x42454e43 },
+        { TPM2_PT_INPUT_BUFFER, 1024 },
+        { TPM2_PT_HR_TRANSIENT_MIN, bench->objects },
+        { TPM2_PT_HR_PERSISTENT_MIN, 7 },
+        { TPM2_PT_HR_LOADED_MIN, bench->loaded_max },
+        { TPM2_PT_ACTIVE_SESSIONS_MAX, TCTI_BENCH_ACTIVE_MAX },
+        { TPM2_PT_PCR_COUNT, 24 },
+        { TPM2_PT_CONTEXT_GAP_MAX, 0xffff },
+        { TPM2_PT_MAX_COMMAND_SIZE, TCTI_BENCH_BUF_SIZE },
+        { TPM2_PT_MAX_RESPONSE_SIZE, TCTI_BENCH_BUF_SIZE },
+        { TPM2_PT_MAX_DIGEST, 64 },
+        { TPM2_PT_TOTAL_COMMANDS, G_N_ELEMENTS (tcti_bench_commands) },
+        { TPM2_PT_HR_LOADED, bench->sessions_loaded },
+        { TPM2_PT_HR_LOADED_AVAIL, bench->loaded_max - bench->sessions_loaded },
+        { TPM2_PT_HR_ACTIVE, 0 },
+        { TPM2_PT_HR_ACTIVE_AVAIL, 0 },
+        { TPM2_PT_HR_TRANSIENT_AVAIL, 0 },
+    };
+    guint32 values [G_N_ELEMENTS (properties)];
+    guint32 found = 0;
+
+    for (i = 0; i < bench->objects; ++i) {
+        objects_loaded += bench->object_loaded [i] ? 1 : 0;
+    }
+    for (i = 0; i < TCTI_BENCH_ACTIVE_MAX; ++i) {
+        sessions_active += bench->sessions [i].handle != 0 ? 1 : 0;
+    }
+    for (i = 0; i < G_N_ELEMENTS (properties); ++i) {
+        switch (properties [i].property) {
+        case TPM2_PT_HR_ACTIVE:
+            values [i] = sessions_active;
+            break;
+        case TPM2_PT_HR_ACTIVE_AVAIL:
+            values [i] = TCTI_BENCH_ACTIVE_MAX - sessions_active;
+            break;
+        case TPM2_PT_HR_TRANSIENT_AVAIL:
+            values [i] = bench->objects - objects_loaded;
+            break;
+        default:
+            values [i] = properties [i].value;
+        }
+    }
+    for (i = 0; i < G_N_ELEMENTS (properties); ++i) {
+        found += properties [i].property >= first ? 1 : 0;
+    }
+    bench_put32 (bench, MIN (found, count));
+    for (i = 0; i < G_N_ELEMENTS (properties) && count > 0; ++i) {
+        if (properties [i].property >= first) {
+            bench_put32 (bench, properties [i].property);
+            bench_put32 (bench, values [i]);
+            --count;
+        }
+    }
+}
+static TSS2_RC
+bench_get_capability (TCTI_BENCH_CONTEXT *bench,
+                      const guint8       *params,
+                      size_t              size)
+{
+    TPM2_CAP capability;
+    guint32 property, count, found = 0, i;
+    TPM2_HANDLE handles [TCTI_BENCH_OBJECTS_MAX + TCTI_BENCH_ACTIVE_MAX];
+    gsize more_offset;
+    TPM2_HANDLE handle;
+    TPMA_CC attrs;
+
+    if (size < 12) {
+        return TPM2_RC_INSUFFICIENT;
+    }
+    capability = bench_get32 (params);
+    property = bench_get32 (&params [4]);
+    count = bench_get32 (&params [8]);
+    more_offset = bench->response_size;
+    bench_put8 (bench, TPM2_NO);
+    bench_put32 (bench, capability);
+    switch (capability) {
+    case TPM2_CAP_COMMANDS:
+        count = MIN (count, BENCH_MAX_CAP_CC);
+        for (i = 0; i < G_N_ELEMENTS (tcti_bench_commands); ++i) {
+            found += tcti_bench_commands [i].cc >= property ? 1 : 0;
+        }
+        bench_put32 (bench, MIN (found, count));
+        for (i = 0; i < G_N_ELEMENTS (tcti_bench_commands) && count > 0; ++i) {
+            if (tcti_bench_commands [i].cc < property) {
+                continue;
+            }
+            attrs = tcti_bench_commands [i].cc |
+                (tcti_bench_commands [i].handles << TPMA_CC_CHANDLES_SHIFT);
+            attrs |= tcti_bench_commands [i].rhandle ? TPMA_CC_RHANDLE : 0;
+            attrs |= tcti_bench_commands [i].flushed ? TPMA_CC_FLUSHED : 0;
+            bench_put32 (bench, attrs);
+            --count;
+            --found;
+        }
+        break;
+    case TPM2_CAP_TPM_PROPERTIES:
+        bench_get_properties (bench, property, count);
+        break;
+    case TPM2_CAP_HANDLES:
+        /* the handles of the type asked for, in ascending order */
+        for (i = 0; i < bench->objects; ++i) {
+            handle = BENCH_OBJECT_FIRST + i;
+            if (bench->object_loaded [i] && handle >= property &&
+                BENCH_HANDLE_TYPE (handle) == BENCH_HANDLE_TYPE (property))
+            {
+                handles [found++] = handle;
+            }
+        }
+        for (i = 0; i < TCTI_BENCH_ACTIVE_MAX; ++i) {
+            handle = bench->sessions [i].handle;
+            if (handle != 0 && handle >= property &&
+                BENCH_HANDLE_TYPE (handle) == BENCH_HANDLE_TYPE (property))
+            {
+                handles [found++] = handle;
+            }
+        }
+        bench_put32 (bench, MIN (found, count));
+        for (i = 0; i < found && i < count; ++i) {
+            bench_put32 (bench, handles [i]);
+        }
+        found = found > count ? found - count : 0;
+        break;
+    default:
+        /* an empty list for the capabilities nobody here asks about */
+        bench_put32 (bench, 0);
+        found = 0;
+        break;
+    }
+    if (found > 0 && more_offset < sizeof (bench->response)) {
+        bench->response [more_offset] = TPM2_YES;
+    }
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+bench_get_random (TCTI_BENCH_CONTEXT *bench,
+                  const guint8       *params,
+                  size_t              size)
+{
+    guint16 requested, i;
+
+    if (size < 2) {
+        return TPM2_RC_INSUFFICIENT;
+    }
+    requested = MIN (bench_get16 (params), 64);
+    bench_put16 (bench, requested);
+    for (i = 0; i < requested; ++i) {
+        bench_put8 (bench, (guint8)g_rand_int (bench->rand));
+    }
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+bench_read_clock (TCTI_BENCH_CONTEXT *bench)
+{
+    gint64 usec = bench->virtual_clock ? bench->virtual_usec :
+        g_get_monotonic_time () - bench->start;
+    guint64 ms = (guint64)usec / 1000;
+
+    bench_put64 (bench, ms);
+    bench_put64 (bench, ms);
+    bench_put32 (bench, 0);
+    bench_put32 (bench, 0);
+    bench_put8 (bench, TPM2_YES);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Carry out the command: check its handles and sessions are loaded, update
+ * the slots and write the response handle and parameters. Returns the
+ * response code.
+ */
+static TSS2_RC
+bench_execute (TCTI_BENCH_CONTEXT         *bench,
+               const tcti_bench_command_t *command,
+               const guint8               *buf,
+               size_t                      size)
+{
+    TPM2_ST tag = bench_get16 (buf);
+    TPM2_HANDLE handles [3], session;
+    const guint8 *params, *auth, *auth_end;
+    guint32 auth_size;
+    guint16 nonce_size, hmac_size;
+    size_t offset = BENCH_HEADER_SIZE + 4 * command->handles;
+    guint i;
+
+    if (size < offset) {
+        return TPM2_RC_COMMAND_SIZE;
+    }
+    for (i = 0; i < command->handles; ++i) {
+        handles [i] = bench_get32 (&buf [BENCH_HEADER_SIZE + 4 * i]);
+        if (!bench_handle_is_loaded (bench, handles [i])) {
+            return TPM2_RC_REFERENCE_H0 + i;
+        }
+    }
+    bench->auth_count = 0;
+    if (tag == TPM2_ST_SESSIONS) {
+        if (size < offset + 4) {
+            return TPM2_RC_AUTHSIZE;
+        }
+        auth_size = bench_get32 (&buf [offset]);
+        offset += 4;
+        if (size < offset + auth_size) {
+            return TPM2_RC_AUTHSIZE;
+        }
+        auth = &buf [offset];
+        auth_end = auth + auth_size;
+        while (auth < auth_end && bench->auth_count < TCTI_BENCH_AUTH_MAX) {
+            if (auth_end - auth < 9) {
+                return TPM2_RC_AUTHSIZE;
+            }
+            session = bench_get32 (auth);
+            nonce_size = bench_get16 (&auth [4]);
+            if (auth_end - auth < 9 + nonce_size) {
+                return TPM2_RC_AUTHSIZE;
+            }
+            hmac_size = bench_get16 (&auth [7 + nonce_size]);
+            if (auth_end - auth < 9 + nonce_size + hmac_size) {
+                return TPM2_RC_AUTHSIZE;
+            }
+            if (session != TPM2_RS_PW &&
+                !bench_session_is_loaded (bench, session))
+            {
+                return TPM2_RC_REFERENCE_S0 + bench->auth_count;
+            }
+            bench->auth_handles [bench->auth_count] = session;
+            bench->auth_attrs [bench->auth_count] = auth [6 + nonce_size];
+            ++bench->auth_count;
+            auth += 9 + nonce_size + hmac_size;
+        }
+        offset += auth_size;
+    }
+    params = &buf [offset];
+    size -= offset;
+    switch (command->cc) {
+    case TPM2_CC_StartAuthSession:
+        return bench_start_auth_session (bench, params, size);
+    case TPM2_CC_ContextSave:
+        return bench_context_save (bench, handles [0]);
+    case TPM2_CC_ContextLoad:
+        return bench_context_load (bench, params, size);
+    case TPM2_CC_FlushContext:
+        return bench_flush_context (bench, params, size);
+    case TPM2_CC_GetCapability:
+        return bench_get_capability (bench, params, size);
+    case TPM2_CC_GetRandom:
+        return bench_get_random (bench, params, size);
+    case TPM2_CC_ReadClock:
+        return bench_read_clock (bench);
+    default:
+        break;
+    }
+    if (command->rhandle) {
+        session = bench_object_alloc (bench);
+        if (session == 0) {
+            return TPM2_RC_OBJECT_MEMORY;
+        }
+        bench_put32 (bench, session);
+    }
+    if (command->flushed) {
+        for (i = 0; i < command->handles; ++i) {
+            if (bench_object_is_loaded (bench, handles [i])) {
+                bench->object_loaded [handles [i] - BENCH_OBJECT_FIRST] = FALSE;
+            }
+        }
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Put the header and, for commands with sessions, the parameter size and
+ * an empty authorization per session around the handle and parameters in
+ * the response buffer. Sessions without continueSession are flushed, as
+ * the TPM does.
+ */
+static void
+bench_finish_response (TCTI_BENCH_CONTEXT         *bench,
+                       const tcti_bench_command_t *command,
+                       TPM2_ST                     tag,
+                       TSS2_RC                     rc)
+{
+    tcti_bench_session_t *session;
+    guint8 body [TCTI_BENCH_BUF_SIZE];
+    size_t body_size, handle_size;
+    guint32 size;
+    guint i;
+
+    if (rc != TSS2_RC_SUCCESS || bench->overflow) {
+        bench->response_size = 0;
+        bench->overflow = FALSE;
+        bench_put16 (bench, TPM2_ST_NO_SESSIONS);
+        bench_put32 (bench, BENCH_HEADER_SIZE);
+        bench_put32 (bench, rc != TSS2_RC_SUCCESS ? rc : TPM2_RC_SIZE);
+        return;
+    }
+    body_size = bench->response_size;
+    memcpy (body, bench->response, body_size);
+    handle_size = command != NULL && command->rhandle ? 4 : 0;
+    bench->response_size = 0;
+    bench_put16 (bench, tag);
+    bench_put32 (bench, 0);
+    bench_put32 (bench, TSS2_RC_SUCCESS);
+    bench_put (bench, body, handle_size);
+    if (tag == TPM2_ST_SESSIONS) {
+        bench_put32 (bench, (guint32)(body_size - handle_size));
+    }
+    bench_put (bench, &body [handle_size], body_size - handle_size);
+    for (i = 0; tag == TPM2_ST_SESSIONS && i < bench->auth_count; ++i) {
+        bench_put16 (bench, 0);
+        bench_put8 (bench, bench->auth_attrs [i]);
+        bench_put16 (bench, 0);
+        if (!(bench->auth_attrs [i] & BENCH_SESSION_CONTINUE)) {
+            session = bench_session_find (bench, bench->auth_handles [i]);
+            if (session != NULL) {
+                bench_session_flush (bench, session);
+            }
+        }
+    }
+    if (bench->overflow) {
+        bench_finish_response (bench, command, tag, TPM2_RC_SIZE);
+        return;
+    }
+    size = htobe32 ((guint32)bench->response_size);
+    memcpy (&bench->response [2], &size, sizeof (size));
+}
+/*
+ * Draw the time a command takes from a log-normal distribution around its
+ * median, using the Box-Muller transform for the normal variate.
+ */
+static gint64
+bench_latency (TCTI_BENCH_CONTEXT *bench,
+               guint               index,
+               gboolean            known)
+{
+    gdouble median, sigma, u1, u2, normal;
+
+    if (!known) {
+        return (gint64)(BENCH_UNKNOWN_USEC * bench->scale);
+    }
+    median = bench->median [index];
+    sigma = bench->sigma [index];
+    u1 = 1.0 - g_rand_double (bench->rand);
+    u2 = g_rand_double (bench->rand);
+    normal = sqrt (-2.0 * log (u1)) * cos (2.0 * G_PI * u2);
+    return (gint64)(median * exp (sigma * normal) * bench->scale);
+}
+static TSS2_RC
+tcti_bench_transmit (TSS2_TCTI_CONTEXT *context,
+                     size_t             size,
+                     const uint8_t     *command)
+{
+    TCTI_BENCH_CONTEXT *bench = (TCTI_BENCH_CONTEXT*)context;
+    const tcti_bench_command_t *entry = NULL;
+    struct itimerspec timer = { 0 };
+    guint index = 0;
+    gint64 latency;
+    TSS2_RC rc;
+
+    if (bench == NULL || command == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (bench->state != TCTI_BENCH_SEND) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    if (size < BENCH_HEADER_SIZE || size > TCTI_BENCH_BUF_SIZE ||
+        bench_get32 (&command [2]) != size)
+    {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    bench->response_size = 0;
+    bench->overflow = FALSE;
+    bench->auth_count = 0;
+    entry = bench_lookup (bench_get32 (&command [6]), &index);
+    if (entry == NULL) {
+        rc = TPM2_RC_COMMAND_CODE;
+    } else {
+        rc = bench_execute (bench, entry, command, size);
+    }
+    bench_finish_response (bench, entry, bench_get16 (command), rc);
+    latency = bench_latency (bench, index, entry != NULL);
+    /* a zero timer would be disarmed, the response is ready right away */
+    latency = MAX (latency, 0);
+    if (bench->virtual_clock) {
+        bench->virtual_usec += latency;
+        latency = 0;
+    }
+    timer.it_value.tv_sec = latency / G_USEC_PER_SEC;
+    timer.it_value.tv_nsec = (latency % G_USEC_PER_SEC) * 1000 + 1;
+    if (timerfd_settime (bench->timer_fd, 0, &timer, NULL) != 0) {
+        return TSS2_TCTI_RC_IO_ERROR;
+    }
+    bench->state = TCTI_BENCH_RECEIVE;
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+tcti_bench_receive (TSS2_TCTI_CONTEXT *context,
+                    size_t            *size,
+                    uint8_t           *response,
+                    int32_t            timeout)
+{
+    TCTI_BENCH_CONTEXT *bench = (TCTI_BENCH_CONTEXT*)context;
+    struct pollfd pollfd;
+    guint64 expirations;
+    gint ret;
+
+    if (bench == NULL || size == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (bench->state != TCTI_BENCH_RECEIVE) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    if (response == NULL) {
+        *size = bench->response_size;
+        return TSS2_RC_SUCCESS;
+    }
+    if (*size < bench->response_size) {
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+    pollfd.fd = bench->timer_fd;
+    pollfd.events = POLLIN;
+    ret = TABRMD_ERRNO_EINTR_RETRY (poll (&pollfd, 1, timeout));
+    if (ret == -1) {
+        return TSS2_TCTI_RC_IO_ERROR;
+    }
+    if (ret == 0) {
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    if (read (bench->timer_fd, &expirations, sizeof (expirations)) == -1) {
+        return TSS2_TCTI_RC_IO_ERROR;
+    }
+    memcpy (response, bench->response, bench->response_size);
+    *size = bench->response_size;
+    bench->state = TCTI_BENCH_SEND;
+    return TSS2_RC_SUCCESS;
+}
+static void
+tcti_bench_finalize (TSS2_TCTI_CONTEXT *context)
+{
+    TCTI_BENCH_CONTEXT *bench = (TCTI_BENCH_CONTEXT*)context;
+
+    if (bench == NULL) {
+        return;
+    }
+    if (bench->timer_fd != -1) {
+        close (bench->timer_fd);
+        bench->timer_fd = -1;
+    }
+    g_clear_pointer (&bench->rand, g_rand_free);
+    g_clear_pointer (&bench->median, g_free);
+    g_clear_pointer (&bench->sigma, g_free);
+}
+static TSS2_RC
+tcti_bench_cancel (TSS2_TCTI_CONTEXT *context)
+{
+    UNUSED_PARAM (context);
+    return TSS2_TCTI_RC_NOT_IMPLEMENTED;
+}
+/*
+ * The timer armed when a command is sent is readable once its response
+ * is due.
+ */
+static TSS2_RC
+tcti_bench_get_poll_handles (TSS2_TCTI_CONTEXT     *context,
+                             TSS2_TCTI_POLL_HANDLE *handles,
+                             size_t                *num_handles)
+{
+    TCTI_BENCH_CONTEXT *bench = (TCTI_BENCH_CONTEXT*)context;
+
+    if (bench == NULL || num_handles == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (handles != NULL) {
+        if (*num_handles < 1) {
+            return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+        }
+        handles [0].fd = bench->timer_fd;
+        handles [0].events = POLLIN;
+    }
+    *num_handles = 1;
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+tcti_bench_set_locality (TSS2_TCTI_CONTEXT *context,
+                         uint8_t            locality)
+{
+    TCTI_BENCH_CONTEXT *bench = (TCTI_BENCH_CONTEXT*)context;
+
+    if (bench == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    bench->locality = locality;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Override the medians of the profile with those in the file at 'path'.
+ * Lines hold a command code, a median in microseconds and optionally a
+ * sigma; empty lines and lines starting with '#' are skipped.
+ */
+static gboolean
+bench_load_profile (TCTI_BENCH_CONTEXT *bench,
+                    const gchar        *path)
+{
+    gchar line [256];
+    guint64 cc, usec;
+    gdouble sigma;
+    guint index;
+    gint fields;
+    FILE *file;
+
+    file = fopen (path, "r");
+    if (file == NULL) {
+        g_warning ("failed to open latency profile %s: %s",
+                   path, strerror (errno));
+        return FALSE;
+    }
+    while (fgets (line, sizeof (line), file) != NULL) {
+        g_strstrip (line);
+        if (line [0] == '\0' || line [0] == '#') {
+            continue;
+        }
+        fields = sscanf (line, "%" SCNi64 " %" SCNu64 " %lf",
+                         &cc, &usec, &sigma);
+        if (fields < 2 || bench_lookup ((TPM2_CC)cc, &index) == NULL) {
+            g_warning ("%s: ignoring line \"%s\"", path, line);
+            continue;
+        }
+        bench->median [index] = (gdouble)usec;
+        if (fields == 3) {
+            bench->sigma [index] = sigma;
+        }
+    }
+    fclose (file);
+    return TRUE;
+}
+/*
+ * Apply the key=value pairs of the conf string. Returns FALSE if one is
+ * unknown or invalid.
+ */
+static gboolean
+bench_parse_conf (TCTI_BENCH_CONTEXT *bench,
+                  const char         *conf)
+{
+    gchar **pairs, **pair, *value, *end;
+    const gchar *profile = "dtpm", *profile_file = NULL;
+    gboolean ret = TRUE;
+    guint64 number;
+    guint i;
+
+    pairs = g_strsplit (conf != NULL ? conf : "", ",", -1);
+    for (pair = pairs; *pair != NULL && ret; ++pair) {
+        if (**pair == '\0') {
+            continue;
+        }
+        value = strchr (*pair, '=');
+        if (value == NULL) {
+            ret = FALSE;
+            break;
+        }
+        *value++ = '\0';
+        if (g_strcmp0 (*pair, "profile") == 0) {
+            profile = value;
+            ret = g_strcmp0 (value, "dtpm") == 0 ||
+                g_strcmp0 (value, "ftpm") == 0;
+        } else if (g_strcmp0 (*pair, "profile-file") == 0) {
+            profile_file = value;
+        } else if (g_strcmp0 (*pair, "scale") == 0) {
+            bench->scale = g_ascii_strtod (value, &end);
+            ret = *end == '\0' && end != value && bench->scale >= 0;
+        } else if (g_strcmp0 (*pair, "objects") == 0) {
+            ret = g_ascii_string_to_unsigned (value, 10, 1,
+                                              TCTI_BENCH_OBJECTS_MAX,
+                                              &number, NULL);
+            bench->objects = (guint)number;
+        } else if (g_strcmp0 (*pair, "sessions") == 0) {
+            ret = g_ascii_string_to_unsigned (value, 10, 1,
+                                              TCTI_BENCH_ACTIVE_MAX,
+                                              &number, NULL);
+            bench->loaded_max = (guint)number;
+        } else if (g_strcmp0 (*pair, "clock") == 0) {
+            bench->virtual_clock = g_strcmp0 (value, "virtual") == 0;
+            ret = bench->virtual_clock || g_strcmp0 (value, "real") == 0;
+        } else if (g_strcmp0 (*pair, "seed") == 0) {
+            ret = g_ascii_string_to_unsigned (value, 10, 0, G_MAXUINT32,
+                                              &number, NULL);
+            g_rand_set_seed (bench->rand, (guint32)number);
+        } else {
+            ret = FALSE;
+        }
+        if (!ret) {
+            g_warning ("invalid bench TCTI option \"%s\"", *pair);
+        }
+    }
+    if (ret) {
+        for (i = 0; i < G_N_ELEMENTS (tcti_bench_commands); ++i) {
+            bench->median [i] = g_strcmp0 (profile, "ftpm") == 0 ?
+                tcti_bench_commands [i].ftpm_usec :
+                tcti_bench_commands [i].dtpm_usec;
+            bench->sigma [i] = tcti_bench_commands [i].sigma;
+        }
+        if (profile_file != NULL) {
+            ret = bench_load_profile (bench, profile_file);
+        }
+    }
+    g_strfreev (pairs);
+    return ret;
+}
+TSS2_RC
+Tss2_Tcti_Bench_Init (TSS2_TCTI_CONTEXT *context,
+                      size_t            *size,
+                      const char        *conf)
+{
+    TCTI_BENCH_CONTEXT *bench = (TCTI_BENCH_CONTEXT*)context;
+
+    if (size == NULL) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    if (context == NULL) {
+        *size = sizeof (TCTI_BENCH_CONTEXT);
+        return TSS2_RC_SUCCESS;
+    }
+    if (*size < sizeof (TCTI_BENCH_CONTEXT)) {
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+    memset (bench, 0, sizeof (*bench));
+    TSS2_TCTI_MAGIC (bench) = TCTI_BENCH_MAGIC;
+    TSS2_TCTI_VERSION (bench) = 2;
+    TSS2_TCTI_TRANSMIT (bench) = tcti_bench_transmit;
+    TSS2_TCTI_RECEIVE (bench) = tcti_bench_receive;
+    TSS2_TCTI_FINALIZE (bench) = tcti_bench_finalize;
+    TSS2_TCTI_CANCEL (bench) = tcti_bench_cancel;
+    TSS2_TCTI_GET_POLL_HANDLES (bench) = tcti_bench_get_poll_handles;
+    TSS2_TCTI_SET_LOCALITY (bench) = tcti_bench_set_locality;
+    bench->state = TCTI_BENCH_SEND;
+    bench->objects = TCTI_BENCH_OBJECTS_DEFAULT;
+    bench->loaded_max = TCTI_BENCH_SESSIONS_DEFAULT;
+    bench->scale = 1.0;
+    bench->start = g_get_monotonic_time ();
+    bench->rand = g_rand_new ();
+    bench->median = g_new0 (gdouble, G_N_ELEMENTS (tcti_bench_commands));
+    bench->sigma = g_new0 (gdouble, G_N_ELEMENTS (tcti_bench_commands));
+    bench->timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (bench->timer_fd == -1 || !bench_parse_conf (bench, conf)) {
+        tcti_bench_finalize (context);
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    return TSS2_RC_SUCCESS;
+}
+
+static const TSS2_TCTI_INFO tss2_tcti_info = {
+    .version = 2,
+    .name = "tcti-bench",
+    .description = "TCTI emulating TPM latencies and slots for benchmarks.",
+    .config_help = "A series of key=value pairs separated by ','. Valid " \
+        "keys are \"profile\" (dtpm or ftpm), \"profile-file\", \"scale\", " \
+        "\"objects\", \"sessions\", \"seed\" and \"clock\" (real or " \
+        "virtual).",
+    .init = Tss2_Tcti_Bench_Init,
+};
+
+const TSS2_TCTI_INFO*
+Tss2_Tcti_Info (void)
+{
+    return &tss2_tcti_info;
+}
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TCTI_BENCH_H
+#define TCTI_BENCH_H
+
+#include <glib.h>
+#include <tss2/tss2_tcti.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#define TCTI_BENCH_MAGIC            0x42454e4348544354ULL
+#define TCTI_BENCH_BUF_SIZE         4096
+#define TCTI_BENCH_OBJECTS_DEFAULT  3
+#define TCTI_BENCH_OBJECTS_MAX      64
+#define TCTI_BENCH_SESSIONS_DEFAULT 3
+/* sessions that may be active, loaded or saved, at once */
+#define TCTI_BENCH_ACTIVE_MAX       64
+#define TCTI_BENCH_AUTH_MAX         3
+
+typedef enum {
+    TCTI_BENCH_SEND,
+    TCTI_BENCH_RECEIVE,
+} tcti_bench_state_t;
+
+typedef struct {
+    TPM2_CC     cc;
+    guint8      handles;
+    gboolean    rhandle;
+    gboolean    flushed;
+    guint32     dtpm_usec;
+    guint32     ftpm_usec;
+    gdouble     sigma;
+} tcti_bench_command_t;
+
+typedef struct {
+    /* 0 if the slot is free */
+    TPM2_HANDLE handle;
+    gboolean    loaded;
+} tcti_bench_session_t;
+
+/*
+ * Normally this structure would not be exposed in a TCTI's header. The
+ * unit tests look at the slots to check what the TCTI did.
+ */
+typedef struct {
+    TSS2_TCTI_CONTEXT_COMMON_V2 v2;
+    tcti_bench_state_t state;
+    gint        timer_fd;
+    GRand      *rand;
+    gint64      start;
+    /*
+     * With clock=virtual the TPM's time in usec: the latencies of the
+     * commands so far, plus any idle time the caller adds.
+     */
+    gboolean    virtual_clock;
+    gint64      virtual_usec;
+    guint8      locality;
+    /* latency model, indexed like the command table */
+    gdouble     scale;
+    gdouble    *median;
+    gdouble    *sigma;
+    /* object and session slots */
+    guint       objects;
+    gboolean    object_loaded [TCTI_BENCH_OBJECTS_MAX];
+    guint       loaded_max;
+    guint       sessions_loaded;
+    tcti_bench_session_t sessions [TCTI_BENCH_ACTIVE_MAX];
+    guint64     context_sequence;
+    /* sessions in the authorization area of the command */
+    guint       auth_count;
+    TPM2_HANDLE auth_handles [TCTI_BENCH_AUTH_MAX];
+    guint8      auth_attrs [TCTI_BENCH_AUTH_MAX];
+    /* the response to the last command */
+    guint8      response [TCTI_BENCH_BUF_SIZE];
+    size_t      response_size;
+    gboolean    overflow;
+} TCTI_BENCH_CONTEXT;
+
+TSS2_RC
+Tss2_Tcti_Bench_Init (TSS2_TCTI_CONTEXT *context,
+                      size_t *size,
+                      const char *conf);
+
+#endif /* TCTI_BENCH_H */
@@ -0,0 +1,276 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <tss2/tss2_tcti.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tcti-bench.h"
+#include "util.h"
+
+#define COMMAND_HEADER(size, cc) \
+    0x80, 0x01, 0x00, 0x00, 0x00, (size), \
+    ((cc) >> 24) & 0xff, ((cc) >> 16) & 0xff, ((cc) >> 8) & 0xff, (cc) & 0xff
+#define HANDLE_BYTES(handle) \
+    ((handle) >> 24) & 0xff, ((handle) >> 16) & 0xff, \
+    ((handle) >> 8) & 0xff, (handle) & 0xff
+
+static const guint8 load_external [] = {
+    COMMAND_HEADER (10, TPM2_CC_LoadExternal),
+};
+static const guint8 start_auth_session [] = {
+    COMMAND_HEADER (27, TPM2_CC_StartAuthSession),
+    HANDLE_BYTES (TPM2_RH_NULL), HANDLE_BYTES (TPM2_RH_NULL),
+    0x00, 0x00, 0x00, 0x00, TPM2_SE_HMAC,
+    0x00, 0x10, 0x00, 0x0b,
+};
+
+typedef struct {
+    TSS2_TCTI_CONTEXT *context;
+    guint8             response [TCTI_BENCH_BUF_SIZE];
+    size_t             size;
+} test_data_t;
+
+static int
+tcti_bench_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+    size_t size = 0;
+
+    assert_int_equal (Tss2_Tcti_Bench_Init (NULL, &size, NULL),
+                      TSS2_RC_SUCCESS);
+    data->context = g_malloc0 (size);
+    assert_int_equal (Tss2_Tcti_Bench_Init (data->context,
+                                            &size,
+                                            "scale=0,objects=2,sessions=1"),
+                      TSS2_RC_SUCCESS);
+    *state = data;
+    return 0;
+}
+static int
+tcti_bench_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    Tss2_Tcti_Finalize (data->context);
+    g_free (data->context);
+    g_free (data);
+    return 0;
+}
+/*
+ * Send a command and wait for its response. Returns the response code
+ * and, if it has one, the handle of the response in 'handle'.
+ */
+static TSS2_RC
+send_command (test_data_t  *data,
+              const guint8 *command,
+              size_t        size,
+              TPM2_HANDLE  *handle)
+{
+    data->size = sizeof (data->response);
+    assert_int_equal (Tss2_Tcti_Transmit (data->context, size, command),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Receive (data->context,
+                                         &data->size,
+                                         data->response,
+                                         TSS2_TCTI_TIMEOUT_BLOCK),
+                      TSS2_RC_SUCCESS);
+    assert_true (data->size >= 10);
+    if (handle != NULL && data->size >= 14) {
+        *handle = (TPM2_HANDLE)data->response [10] << 24 |
+            (TPM2_HANDLE)data->response [11] << 16 |
+            (TPM2_HANDLE)data->response [12] << 8 | data->response [13];
+    }
+    return (TSS2_RC)data->response [6] << 24 |
+        (TSS2_RC)data->response [7] << 16 |
+        (TSS2_RC)data->response [8] << 8 | data->response [9];
+}
+/*
+ * Objects take the lowest free slot until they run out, flushing one
+ * frees its slot.
+ */
+static void
+tcti_bench_object_memory_test (void **state)
+{
+    test_data_t *data = *state;
+    TPM2_HANDLE handle = 0;
+    const guint8 flush [] = {
+        COMMAND_HEADER (14, TPM2_CC_FlushContext),
+        HANDLE_BYTES (TPM2_TRANSIENT_FIRST),
+    };
+
+    assert_int_equal (send_command (data, load_external,
+                                    sizeof (load_external), &handle),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (handle, TPM2_TRANSIENT_FIRST);
+    assert_int_equal (send_command (data, load_external,
+                                    sizeof (load_external), &handle),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (handle, TPM2_TRANSIENT_FIRST + 1);
+    assert_int_equal (send_command (data, load_external,
+                                    sizeof (load_external), NULL),
+                      TPM2_RC_OBJECT_MEMORY);
+    assert_int_equal (send_command (data, flush, sizeof (flush), NULL),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (send_command (data, load_external,
+                                    sizeof (load_external), &handle),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (handle, TPM2_TRANSIENT_FIRST);
+}
+/*
+ * With one session slot a second session can only be started once the
+ * first one's context is saved, which then can't be loaded again.
+ */
+static void
+tcti_bench_session_memory_test (void **state)
+{
+    test_data_t *data = *state;
+    TPM2_HANDLE handle = 0;
+    guint8 context_load [TCTI_BENCH_BUF_SIZE];
+    const guint8 context_save [] = {
+        COMMAND_HEADER (14, TPM2_CC_ContextSave),
+        HANDLE_BYTES (TPM2_HMAC_SESSION_FIRST),
+    };
+    size_t size;
+
+    assert_int_equal (send_command (data, start_auth_session,
+                                    sizeof (start_auth_session), &handle),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (handle, TPM2_HMAC_SESSION_FIRST);
+    assert_int_equal (send_command (data, start_auth_session,
+                                    sizeof (start_auth_session), NULL),
+                      TPM2_RC_SESSION_MEMORY);
+    assert_int_equal (send_command (data, context_save,
+                                    sizeof (context_save), NULL),
+                      TSS2_RC_SUCCESS);
+    /* the ContextLoad command carries the saved context */
+    size = data->size;
+    memcpy (context_load, data->response, size);
+    context_load [8] = (TPM2_CC_ContextLoad >> 8) & 0xff;
+    context_load [9] = TPM2_CC_ContextLoad & 0xff;
+    assert_int_equal (send_command (data, start_auth_session,
+                                    sizeof (start_auth_session), &handle),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (handle, TPM2_HMAC_SESSION_FIRST + 1);
+    assert_int_equal (send_command (data, context_load, size, NULL),
+                      TPM2_RC_SESSION_MEMORY);
+}
+/*
+ * Commands naming an object that isn't loaded are rejected.
+ */
+static void
+tcti_bench_reference_test (void **state)
+{
+    test_data_t *data = *state;
+    const guint8 read_public [] = {
+        COMMAND_HEADER (14, TPM2_CC_ReadPublic),
+        HANDLE_BYTES (TPM2_TRANSIENT_FIRST + 1),
+    };
+
+    assert_int_equal (send_command (data, read_public,
+                                    sizeof (read_public), NULL),
+                      TPM2_RC_REFERENCE_H0);
+}
+/*
+ * The command attributes report the handles the resource manager needs
+ * to virtualize.
+ */
+static void
+tcti_bench_get_capability_test (void **state)
+{
+    test_data_t *data = *state;
+    const guint8 get_capability [] = {
+        COMMAND_HEADER (22, TPM2_CC_GetCapability),
+        HANDLE_BYTES (TPM2_CAP_COMMANDS),
+        HANDLE_BYTES (TPM2_CC_Load),
+        HANDLE_BYTES (1),
+    };
+    TPMA_CC attrs;
+
+    assert_int_equal (send_command (data, get_capability,
+                                    sizeof (get_capability), NULL),
+                      TSS2_RC_SUCCESS);
+    /* moreData, capability and count precede the attributes */
+    assert_int_equal (data->response [10], TPM2_YES);
+    assert_int_equal (data->response [18], 1);
+    attrs = (TPMA_CC)data->response [19] << 24 |
+        (TPMA_CC)data->response [20] << 16 |
+        (TPMA_CC)data->response [21] << 8 | data->response [22];
+    assert_int_equal (attrs & TPMA_CC_COMMANDINDEX_MASK, TPM2_CC_Load);
+    assert_int_equal ((attrs & TPMA_CC_CHANDLES_MASK) >>
+                      TPMA_CC_CHANDLES_SHIFT, 1);
+    assert_true (attrs & TPMA_CC_RHANDLE);
+}
+/*
+ * With a virtual clock the response is ready at once and the latency of
+ * the command is added to the TPM's time instead.
+ */
+static void
+tcti_bench_virtual_clock_test (void **state)
+{
+    test_data_t data = { 0 };
+    TCTI_BENCH_CONTEXT *bench;
+    size_t size = 0;
+    UNUSED_PARAM (state);
+
+    Tss2_Tcti_Bench_Init (NULL, &size, NULL);
+    data.context = g_malloc0 (size);
+    assert_int_equal (Tss2_Tcti_Bench_Init (data.context,
+                                            &size,
+                                            "clock=virtual,profile=dtpm"),
+                      TSS2_RC_SUCCESS);
+    bench = (TCTI_BENCH_CONTEXT*)data.context;
+    assert_int_equal (bench->virtual_usec, 0);
+    assert_int_equal (send_command (&data, load_external,
+                                    sizeof (load_external), NULL),
+                      TSS2_RC_SUCCESS);
+    /* a LoadExternal takes milliseconds on a discrete TPM */
+    assert_true (bench->virtual_usec > 1000);
+    Tss2_Tcti_Finalize (data.context);
+    g_free (data.context);
+}
+static void
+tcti_bench_bad_conf_test (void **state)
+{
+    guint8 context [sizeof (TCTI_BENCH_CONTEXT)];
+    size_t size = sizeof (context);
+    UNUSED_PARAM (state);
+
+    assert_int_equal (Tss2_Tcti_Bench_Init ((TSS2_TCTI_CONTEXT*)context,
+                                            &size,
+                                            "profile=tpm1.2"),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (Tss2_Tcti_Bench_Init ((TSS2_TCTI_CONTEXT*)context,
+                                            &size,
+                                            "objects=0"),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (Tss2_Tcti_Bench_Init ((TSS2_TCTI_CONTEXT*)context,
+                                            &size,
+                                            "clock=simulated"),
+                      TSS2_TCTI_RC_BAD_VALUE);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (tcti_bench_object_memory_test,
+                                         tcti_bench_setup,
+                                         tcti_bench_teardown),
+        cmocka_unit_test_setup_teardown (tcti_bench_session_memory_test,
+                                         tcti_bench_setup,
+                                         tcti_bench_teardown),
+        cmocka_unit_test_setup_teardown (tcti_bench_reference_test,
+                                         tcti_bench_setup,
+                                         tcti_bench_teardown),
+        cmocka_unit_test_setup_teardown (tcti_bench_get_capability_test,
+                                         tcti_bench_setup,
+                                         tcti_bench_teardown),
+        cmocka_unit_test (tcti_bench_virtual_clock_test),
+        cmocka_unit_test (tcti_bench_bad_conf_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -21,6 +21,7 @@
 #include <tss2/tss2_tpm2_types.h>
 
 #include "tcti-tabrmd-priv.h"
+#include "tss2-tcti-tabrmd.h"
 #include "mock-funcs.h"
 
 /*
@@ -126,7 +127,7 @@ tcti_tabrmd_setup (void **state)
 
     tcti_ctx = calloc (1, sizeof (TSS2_TCTI_TABRMD_CONTEXT));
     tcti_ctx->state = TABRMD_STATE_RECEIVE;
-    tcti_ctx->sock_connect = TEST_CONNECTION;
+    tcti_ctx->fd = TEST_FD;
     tcti_ctx->index = 0;
     tcti_ctx->state = TABRMD_STATE_TRANSMIT;
     common_ctx = (TSS2_TCTI_CONTEXT_COMMON_V1*)tcti_ctx;
@@ -162,6 +163,40 @@ tcti_tabrmd_teardown (void **state)
     free (*state);
     return 0;
 }
+/*
+ * Setup and teardown for a context using the shared memory transport. The
+ * shared memory is plain heap memory here.
+ */
+static int
+tcti_tabrmd_receive_shm_setup (void **state)
+{
+    TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx;
+
+    tcti_tabrmd_receive_setup (state);
+    tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
+    tcti_ctx->shm = g_new0 (shm_transport_t, 1);
+    return 0;
+}
+static int
+tcti_tabrmd_receive_shm_teardown (void **state)
+{
+    TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
+
+    g_free (tcti_ctx->shm);
+    return tcti_tabrmd_teardown (state);
+}
+/*
+ * Prime the mock stack for reading the doorbell from the socket.
+ */
+static void
+tcti_tabrmd_will_read_doorbell (uint8_t *doorbell)
+{
+    will_return (__wrap_poll, POLLIN);
+    will_return (__wrap_poll, 0);
+    will_return (__wrap_poll, 1);
+    will_return (__wrap_recv, 1);
+    will_return (__wrap_recv, doorbell);
+}
 /*
  * This test ensures that a call to tcti_tabrmd_read that causes poll to
  * timeout will return the appropriate RC.
@@ -175,9 +210,6 @@ tcti_tabrmd_read_poll_timeout (void **state)
     uint32_t timeout = TSS2_TCTI_TIMEOUT_BLOCK;
     TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
 
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
-
     /* prime mock stack for poll, will return 0 indicating timeout */
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 0);
@@ -199,9 +231,6 @@ tcti_tabrmd_read_poll_fail (void **state)
     uint32_t timeout = TSS2_TCTI_TIMEOUT_BLOCK;
     TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
 
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
-
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, EINVAL);
     will_return (__wrap_poll, -1);
@@ -211,7 +240,7 @@ tcti_tabrmd_read_poll_fail (void **state)
 }
 /*
  * This test ensures that a call to tcti_tabrmd_read that causes
- * g_input_stream_read to return EOF will return the appropriate RC.
+ * recv to return EOF will return the appropriate RC.
  */
 static void
 tcti_tabrmd_read_eof (void **state)
@@ -222,26 +251,20 @@ tcti_tabrmd_read_eof (void **state)
     uint32_t timeout = TSS2_TCTI_TIMEOUT_BLOCK;
     TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
 
-    /* mock stack required to extract the fd from the GSocketConnection */
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
-
     /* prime mock stack for poll to indicate data is ready */
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
 
-    /* mock stack required to extract GIStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    /* cause g_input_stream_read to return 0 indicating EOF */
-    will_return (__wrap_g_input_stream_read, 0);
+    /* cause recv to return 0 indicating EOF */
+    will_return (__wrap_recv, 0);
 
     ret = tcti_tabrmd_read (tcti_ctx, resp, resp_size, timeout);
     assert_int_equal (ret, TSS2_TCTI_RC_NO_CONNECTION);
 }
 /*
  * This test ensures that a call to tcti_tabrmd_read that causes
- * g_input_stream_read to indicate that it would block, returns the
+ * recv to indicate that it would block, returns the
  * appropriate RC.
  */
 static void
@@ -252,28 +275,21 @@ tcti_tabrmd_read_block_error (void **state)
     size_t resp_size = sizeof (resp);
     uint32_t timeout = TSS2_TCTI_TIMEOUT_BLOCK;
     TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
-    GError* error;
-
-    /* mock stack required to extract the fd from the GSocketConnection */
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
 
     /* prime mock stack for poll to indicate data is ready */
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
 
-    /* mock stack required to extract GIStream & read data */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    error = g_error_new (1, G_IO_ERROR_WOULD_BLOCK, __func__);
-    will_return (__wrap_g_input_stream_read, -1);
-    will_return (__wrap_g_input_stream_read, error);
+    /* mock stack required to read data */
+    will_return (__wrap_recv, -1);
+    will_return (__wrap_recv, EAGAIN);
 
     ret = tcti_tabrmd_read (tcti_ctx, resp, resp_size, timeout);
     assert_int_equal (ret, TSS2_TCTI_RC_TRY_AGAIN);
 }
 /*
- * This test forces the call to 'g_input_stream_read' to read fewer bytes
+ * This test forces the call to 'recv' to read fewer bytes
  * than requested by the caller (the 'tcti_tabrmd_read' in this case). This
  * is a "short read" and should return an RC telling the caller to retry.
  */
@@ -287,19 +303,14 @@ tcti_tabrmd_read_short (void **state)
     TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
     uint8_t buf [sizeof (resp)] = { 0, };
 
-    /* mock stack required to extract the fd from the GSocketConnection */
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
-
     /* prime mock stack for poll to indicate data is ready */
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
 
-    /* mock stack required to extract GIStream & read data */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, read_size);
-    will_return (__wrap_g_input_stream_read, buf);
+    /* mock stack required to read data */
+    will_return (__wrap_recv, read_size);
+    will_return (__wrap_recv, buf);
 
     ret = tcti_tabrmd_read (tcti_ctx, resp, resp_size, timeout);
     assert_int_equal (ret, TSS2_TCTI_RC_TRY_AGAIN);
@@ -318,14 +329,10 @@ tcti_tabrmd_read_success (void **state)
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
-    /* mock stack required to extract the fd from the GSocketConnection */
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
 
-    /* mock stack required to extract GIStream & read data */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, resp_size);
-    will_return (__wrap_g_input_stream_read, buf);
+    /* mock stack required to read data */
+    will_return (__wrap_recv, resp_size);
+    will_return (__wrap_recv, buf);
 
     ret = tcti_tabrmd_read (tcti_ctx, resp, resp_size, timeout);
     assert_int_equal (ret, TSS2_RC_SUCCESS);
@@ -442,10 +449,6 @@ tcti_tabrmd_receive_header_fail (void **state)
     TSS2_TCTI_CONTEXT *ctx = (TSS2_TCTI_CONTEXT*)*state;
     size_t size = 0;
 
-    /* mock stack required to extract the fd from the GSocketConnection */
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
-
     /* prime mock stack for poll, will return 0 indicating timeout */
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, EINVAL);
@@ -471,17 +474,13 @@ tcti_tabrmd_receive_header_lt_expected (void **state)
     };
     size_t size = 0;
 
-    /* mock stack required to extract the fd from the GSocketConnection */
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
     /* prime mock stack for poll to indicate data is ready */
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
     /* mock stack required to get 10 bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, TPM_HEADER_SIZE);
-    will_return (__wrap_g_input_stream_read, buf);
+    will_return (__wrap_recv, TPM_HEADER_SIZE);
+    will_return (__wrap_recv, buf);
 
     rc = tss2_tcti_tabrmd_receive (ctx, &size, NULL, TSS2_TCTI_TIMEOUT_BLOCK);
     assert_int_equal (rc, TSS2_TCTI_RC_MALFORMED_RESPONSE);
@@ -504,17 +503,13 @@ tcti_tabrmd_receive_get_size (void **state)
     };
     size_t size = 0;
 
-    /* mock stack required to extract the fd from the GSocketConnection */
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
     /* prime mock stack for poll to indicate data is ready */
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
     /* mock stack required to get 10 bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, TPM_HEADER_SIZE);
-    will_return (__wrap_g_input_stream_read, buf);
+    will_return (__wrap_recv, TPM_HEADER_SIZE);
+    will_return (__wrap_recv, buf);
 
     rc = tss2_tcti_tabrmd_receive (ctx, &size, NULL, TSS2_TCTI_TIMEOUT_BLOCK);
     assert_int_equal (rc, TSS2_RC_SUCCESS);
@@ -537,17 +532,13 @@ tcti_tabrmd_receive_header_only (void **state)
         0x00, 0x00, 0x00, 0x00,
     };
 
-    /* mock stack required to extract the fd from the GSocketConnection */
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
     /* prime mock stack for poll to indicate data is ready */
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
     /* mock stack required to get 10 bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, TPM_HEADER_SIZE);
-    will_return (__wrap_g_input_stream_read, buf);
+    will_return (__wrap_recv, TPM_HEADER_SIZE);
+    will_return (__wrap_recv, buf);
 
     rc = tss2_tcti_tabrmd_receive (ctx, &resp_size, resp, TSS2_TCTI_TIMEOUT_BLOCK);
     assert_int_equal (rc, TSS2_RC_SUCCESS);
@@ -573,32 +564,24 @@ tcti_tabrmd_receive_header_only_retry (void **state)
         0x00, 0x00, 0x00, 0x00,
     };
 
-    /* mock stack required to extract the fd from the GSocketConnection */
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
     /* prime mock stack for poll to indicate data is ready */
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
     /* mock stack required to get first bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, FIRST_READ_SIZE);
-    will_return (__wrap_g_input_stream_read, buf);
+    will_return (__wrap_recv, FIRST_READ_SIZE);
+    will_return (__wrap_recv, buf);
 
     rc = tss2_tcti_tabrmd_receive (ctx, &resp_size, resp, TSS2_TCTI_TIMEOUT_BLOCK);
     assert_int_equal (rc, TSS2_TCTI_RC_TRY_AGAIN);
 
-    /* mock stack required to extract the fd from the GSocketConnection */
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
     /* prime mock stack for poll to indicate data is ready */
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
     /* mock stack required to get first bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, SECOND_READ_SIZE);
-    will_return (__wrap_g_input_stream_read, &buf[FIRST_READ_SIZE]);
+    will_return (__wrap_recv, SECOND_READ_SIZE);
+    will_return (__wrap_recv, &buf[FIRST_READ_SIZE]);
 
     rc = tss2_tcti_tabrmd_receive (ctx, &resp_size, resp, TSS2_TCTI_TIMEOUT_BLOCK);
     assert_int_equal (rc, TSS2_RC_SUCCESS);
@@ -623,17 +606,13 @@ tcti_tabrmd_receive_partial_reads (void **state)
     uint8_t resp [sizeof (buf)] = { 0, };
     size_t resp_size = 0;
 
-    /* mock stack required to extract the fd from the GSocketConnection */
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
     /* prime mock stack for poll to indicate data is ready */
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
     /* mock stack required to get 10 bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, TPM_HEADER_SIZE);
-    will_return (__wrap_g_input_stream_read, buf);
+    will_return (__wrap_recv, TPM_HEADER_SIZE);
+    will_return (__wrap_recv, buf);
 
     rc = tss2_tcti_tabrmd_receive (ctx,
                                    &resp_size,
@@ -642,17 +621,13 @@ tcti_tabrmd_receive_partial_reads (void **state)
     assert_int_equal (rc, TSS2_RC_SUCCESS);
     assert_int_equal (resp_size, sizeof (buf));
 
-    /* mock stack required to extract the fd from the GSocketConnection */
-    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
-    will_return (__wrap_g_socket_get_fd, TEST_FD);
     /* prime mock stack for poll to indicate data is ready */
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
     /* mock stack required to get 10 bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, 4);
-    will_return (__wrap_g_input_stream_read, &buf[TPM_HEADER_SIZE]);
+    will_return (__wrap_recv, 4);
+    will_return (__wrap_recv, &buf[TPM_HEADER_SIZE]);
 
     rc = tss2_tcti_tabrmd_receive (ctx,
                                    &resp_size,
@@ -662,6 +637,262 @@ tcti_tabrmd_receive_partial_reads (void **state)
     assert_memory_equal (buf, resp, sizeof (buf));
 }
 
+/*
+ * On a blocking socket with TSS2_TCTI_TIMEOUT_BLOCK the poll is skipped and
+ * the whole response comes back from a single read, even when the caller
+ * queries the size first.
+ */
+static void
+tcti_tabrmd_receive_blocking_single_read (void **state)
+{
+    TSS2_RC rc;
+    TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
+    uint8_t buf [] = {
+        0x80, 0x02,
+        0x00, 0x00, 0x00, 0x0e,
+        0xde, 0xad, 0xbe, 0xef,
+        0xca, 0xfe, 0xd0, 0x0d,
+    };
+    uint8_t resp [sizeof (buf)] = { 0, };
+    size_t resp_size = 0;
+
+    tcti_ctx->blocking = TRUE;
+    /* no poll: the only call is the read returning the whole response */
+    will_return (__wrap_recv, sizeof (buf));
+    will_return (__wrap_recv, buf);
+
+    rc = tss2_tcti_tabrmd_receive ((TSS2_TCTI_CONTEXT*)tcti_ctx,
+                                   &resp_size,
+                                   NULL,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (resp_size, sizeof (buf));
+    rc = tss2_tcti_tabrmd_receive ((TSS2_TCTI_CONTEXT*)tcti_ctx,
+                                   &resp_size,
+                                   resp,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (resp_size, sizeof (buf));
+    assert_memory_equal (buf, resp, sizeof (buf));
+    assert_int_equal (tcti_ctx->index, 0);
+    assert_int_equal (tcti_ctx->state, TABRMD_STATE_TRANSMIT);
+}
+/*
+ * A read that returns more data than the size in the response header is
+ * a malformed response.
+ */
+static void
+tcti_tabrmd_receive_trailing_data (void **state)
+{
+    TSS2_RC rc;
+    TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
+    uint8_t buf [] = {
+        0x80, 0x02,
+        0x00, 0x00, 0x00, 0x0a,
+        0x00, 0x00, 0x00, 0x00,
+        0xde, 0xad,
+    };
+    size_t size = 0;
+
+    tcti_ctx->blocking = TRUE;
+    will_return (__wrap_recv, sizeof (buf));
+    will_return (__wrap_recv, buf);
+
+    rc = tss2_tcti_tabrmd_receive ((TSS2_TCTI_CONTEXT*)tcti_ctx,
+                                   &size,
+                                   NULL,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_TCTI_RC_MALFORMED_RESPONSE);
+    assert_int_equal (tcti_ctx->index, 0);
+    assert_int_equal (tcti_ctx->state, TABRMD_STATE_TRANSMIT);
+}/*
+ * Two tagged responses arriving in a single read are returned by two calls
+ * with their tags, the second without reading the socket again.
+ */
+static void
+tcti_tabrmd_receive_tagged_two (void **state)
+{
+    TSS2_RC rc;
+    TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
+    uint8_t buf [] = {
+        0x00, 0x00, 0x00, 0x02,
+        0x80, 0x01,
+        0x00, 0x00, 0x00, 0x0a,
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x01,
+        0x80, 0x01,
+        0x00, 0x00, 0x00, 0x0c,
+        0x00, 0x00, 0x00, 0x00,
+        0xca, 0xfe,
+    };
+    uint8_t resp [TPM2_MAX_RESPONSE_SIZE] = { 0, };
+    size_t size = sizeof (resp);
+    uint32_t tag = 0;
+
+    tcti_ctx->state = TABRMD_STATE_TRANSMIT;
+    tcti_ctx->tagged = TRUE;
+    tcti_ctx->blocking = TRUE;
+    tcti_ctx->pending = 2;
+    will_return (__wrap_recv, sizeof (buf));
+    will_return (__wrap_recv, buf);
+
+    rc = Tss2_Tcti_Tabrmd_ReceiveTagged ((TSS2_TCTI_CONTEXT*)tcti_ctx,
+                                         &tag,
+                                         &size,
+                                         resp,
+                                         TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (tag, 2);
+    assert_int_equal (size, TPM_HEADER_SIZE);
+    assert_memory_equal (resp, &buf [4], TPM_HEADER_SIZE);
+    size = sizeof (resp);
+    rc = Tss2_Tcti_Tabrmd_ReceiveTagged ((TSS2_TCTI_CONTEXT*)tcti_ctx,
+                                         &tag,
+                                         &size,
+                                         resp,
+                                         TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (tag, 1);
+    assert_int_equal (size, TPM_HEADER_SIZE + 2);
+    assert_memory_equal (resp, &buf [18], TPM_HEADER_SIZE + 2);
+    assert_int_equal (tcti_ctx->index, 0);
+    assert_int_equal (tcti_ctx->pending, 0);
+    /* nothing more is expected */
+    rc = Tss2_Tcti_Tabrmd_ReceiveTagged ((TSS2_TCTI_CONTEXT*)tcti_ctx,
+                                         &tag,
+                                         &size,
+                                         resp,
+                                         TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_SEQUENCE);
+}
+
+/*
+ * With the shared memory transport the doorbell is read from the socket
+ * once. The size can then be queried and the response copied out of the
+ * response slot without reading the socket again.
+ */
+static void
+tcti_tabrmd_receive_shm_success (void **state)
+{
+    TSS2_RC rc;
+    TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
+    uint8_t doorbell = SHM_TRANSPORT_DOORBELL;
+    uint8_t expected [TPM_HEADER_SIZE + 2] = {
+        0x80, 0x01,
+        0x00, 0x00, 0x00, 0x0c,
+        0x00, 0x00, 0x00, 0x00,
+        0xde, 0xad,
+    };
+    uint8_t resp [TPM2_MAX_RESPONSE_SIZE] = { 0, };
+    size_t size = 0;
+
+    memcpy (tcti_ctx->shm->response, expected, sizeof (expected));
+    tcti_ctx->shm->response_size = sizeof (expected);
+    tcti_tabrmd_will_read_doorbell (&doorbell);
+
+    rc = tss2_tcti_tabrmd_receive ((TSS2_TCTI_CONTEXT*)tcti_ctx,
+                                   &size,
+                                   NULL,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (size, sizeof (expected));
+    size = sizeof (resp);
+    rc = tss2_tcti_tabrmd_receive ((TSS2_TCTI_CONTEXT*)tcti_ctx,
+                                   &size,
+                                   resp,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (size, sizeof (expected));
+    assert_memory_equal (resp, expected, sizeof (expected));
+    assert_int_equal (tcti_ctx->state, TABRMD_STATE_TRANSMIT);
+    assert_int_equal (tcti_ctx->index, 0);
+}
+/*
+ * A response slot whose size doesn't match the response header is
+ * reported as a malformed response.
+ */
+static void
+tcti_tabrmd_receive_shm_malformed (void **state)
+{
+    TSS2_RC rc;
+    TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
+    uint8_t doorbell = SHM_TRANSPORT_DOORBELL;
+    uint8_t header [TPM_HEADER_SIZE] = {
+        0x80, 0x01,
+        0x00, 0x00, 0x00, 0x0c,
+        0x00, 0x00, 0x00, 0x00,
+    };
+    uint8_t resp [TPM2_MAX_RESPONSE_SIZE] = { 0, };
+    size_t size = sizeof (resp);
+
+    memcpy (tcti_ctx->shm->response, header, sizeof (header));
+    tcti_ctx->shm->response_size = sizeof (header);
+    tcti_tabrmd_will_read_doorbell (&doorbell);
+
+    rc = tss2_tcti_tabrmd_receive ((TSS2_TCTI_CONTEXT*)tcti_ctx,
+                                   &size,
+                                   resp,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_TCTI_RC_MALFORMED_RESPONSE);
+    assert_int_equal (tcti_ctx->state, TABRMD_STATE_TRANSMIT);
+}
+/*
+ * A command published in the response page is answered by transmit
+ * without touching the socket or the shared memory slots, and the next
+ * receive returns the response.
+ */
+static void
+tcti_tabrmd_transmit_response_page (void **state)
+{
+    TSS2_RC rc;
+    TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
+    response_page_t *page = g_new0 (response_page_t, 1);
+    response_page_tpm_t *section = &page->tpms [0];
+    uint8_t command [TPM_HEADER_SIZE] = {
+        0x80, 0x01,
+        0x00, 0x00, 0x00, 0x0a,
+        0x00, 0x00, 0x01, 0x7c,
+    };
+    uint8_t expected [TPM_HEADER_SIZE + 2] = {
+        0x80, 0x01,
+        0x00, 0x00, 0x00, 0x0c,
+        0x00, 0x00, 0x00, 0x00,
+        0xbe, 0xef,
+    };
+    uint8_t resp [TPM2_MAX_RESPONSE_SIZE] = { 0, };
+    size_t size = sizeof (resp);
+
+    page->magic = RESPONSE_PAGE_MAGIC;
+    page->version = RESPONSE_PAGE_VERSION;
+    page->tpm_count = 1;
+    section->entry_count = 1;
+    section->entries [0].command_size = sizeof (command);
+    section->entries [0].response_size = sizeof (expected);
+    memcpy (section->data, command, sizeof (command));
+    memcpy (&section->data [sizeof (command)], expected, sizeof (expected));
+    section->data_used = sizeof (command) + sizeof (expected);
+    tcti_ctx->response_page = page;
+    tcti_ctx->state = TABRMD_STATE_TRANSMIT;
+
+    rc = tss2_tcti_tabrmd_transmit ((TSS2_TCTI_CONTEXT*)tcti_ctx,
+                                    sizeof (command),
+                                    command);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (tcti_ctx->state, TABRMD_STATE_RECEIVE);
+    assert_int_equal (tcti_ctx->shm->command_size, 0);
+    rc = tss2_tcti_tabrmd_receive ((TSS2_TCTI_CONTEXT*)tcti_ctx,
+                                   &size,
+                                   resp,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (size, sizeof (expected));
+    assert_memory_equal (resp, expected, sizeof (expected));
+    assert_int_equal (tcti_ctx->state, TABRMD_STATE_TRANSMIT);
+    assert_false (tcti_ctx->local);
+
+    tcti_ctx->response_page = NULL;
+    g_free (page);
+}
 int
 main (void)
 {
@@ -724,6 +955,24 @@ main (void)
         cmocka_unit_test_setup_teardown (tcti_tabrmd_receive_partial_reads,
                                          tcti_tabrmd_receive_setup,
                                          tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_receive_blocking_single_read,
+                                         tcti_tabrmd_receive_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_receive_trailing_data,
+                                         tcti_tabrmd_receive_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_receive_tagged_two,
+                                         tcti_tabrmd_receive_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_receive_shm_success,
+                                         tcti_tabrmd_receive_shm_setup,
+                                         tcti_tabrmd_receive_shm_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_receive_shm_malformed,
+                                         tcti_tabrmd_receive_shm_setup,
+                                         tcti_tabrmd_receive_shm_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_transmit_response_page,
+                                         tcti_tabrmd_receive_shm_setup,
+                                         tcti_tabrmd_receive_shm_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -0,0 +1,388 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Microbenchmarks for the per call cost of the tabrmd TCTI's transmit and
+ * receive functions. There's no daemon: the context is connected to one
+ * end of a socketpair and the benchmark answers each command on the other
+ * end itself before it calls receive, so the TCTI never waits. The time,
+ * system calls and allocations are reported per call for receives that
+ * block, that poll with a zero timeout, that get the response in two
+ * parts and for the shared memory transport. These are the baseline the
+ * client side transport work is measured against.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__FreeBSD__)
+#include <sys/poll.h>
+#else
+#include <poll.h>
+#endif
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "shm-transport.h"
+#include "tcti-tabrmd-priv.h"
+#include "tpm2-header.h"
+#include "tss2-tcti-tabrmd.h"
+#include "util.h"
+
+#define BENCH_ITERATIONS 100000
+
+typedef struct {
+    TSS2_TCTI_TABRMD_CONTEXT *context;
+    /* the daemon's end of the connection */
+    gint                      server_fd;
+    uint8_t                   command [TPM_HEADER_SIZE];
+    uint8_t                   response [UTIL_BUF_MAX];
+} bench_data_t;
+
+typedef struct {
+    guint64 nsec;
+    guint64 syscalls;
+    guint64 allocations;
+} bench_sample_t;
+
+/*
+ * The system calls the TCTI makes on the socket are counted by wrapping
+ * them. The responder uses read and write so its own aren't counted.
+ */
+static guint64 syscalls;
+
+int __real_poll (struct pollfd *fds, nfds_t nfds, int timeout);
+ssize_t __real_recv (int sockfd, void *buf, size_t len, int flags);
+ssize_t __real_send (int sockfd, const void *buf, size_t len, int flags);
+
+int
+__wrap_poll (struct pollfd *fds,
+             nfds_t         nfds,
+             int            timeout)
+{
+    ++syscalls;
+    return __real_poll (fds, nfds, timeout);
+}
+ssize_t
+__wrap_recv (int     sockfd,
+             void   *buf,
+             size_t  len,
+             int     flags)
+{
+    ++syscalls;
+    return __real_recv (sockfd, buf, len, flags);
+}
+ssize_t
+__wrap_send (int         sockfd,
+             const void *buf,
+             size_t      len,
+             int         flags)
+{
+    ++syscalls;
+    return __real_send (sockfd, buf, len, flags);
+}
+/*
+ * Allocations are counted by interposing malloc and friends, which needs
+ * glibc's __libc_* entry points.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static guint64 allocations;
+
+void*
+malloc (size_t size)
+{
+    ++allocations;
+    return __libc_malloc (size);
+}
+void*
+calloc (size_t count,
+        size_t size)
+{
+    ++allocations;
+    return __libc_calloc (count, size);
+}
+void*
+realloc (void  *ptr,
+         size_t size)
+{
+    ++allocations;
+    return __libc_realloc (ptr, size);
+}
+#else
+static guint64 allocations;
+#endif
+
+/*
+ * Calls are timed one at a time and the responder's work left out, so the
+ * clock needs better than the usec g_get_monotonic_time gives.
+ */
+static guint64
+bench_now (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (guint64)now.tv_sec * G_GUINT64_CONSTANT (1000000000) +
+        (guint64)now.tv_nsec;
+}
+static void
+bench_start (bench_sample_t *sample)
+{
+    sample->syscalls = syscalls;
+    sample->allocations = allocations;
+    sample->nsec = bench_now ();
+}
+/*
+ * Add the cost of the call since bench_start to 'total'.
+ */
+static void
+bench_stop (const bench_sample_t *start,
+            bench_sample_t       *total)
+{
+    guint64 now = bench_now ();
+
+    total->nsec += now - start->nsec;
+    total->syscalls += syscalls - start->syscalls;
+    total->allocations += allocations - start->allocations;
+}
+static void
+bench_report (const gchar          *name,
+              size_t                size,
+              guint                 iterations,
+              const bench_sample_t *total)
+{
+    printf ("%-28s %6zu %12.1f %10.2f %10.2f\n",
+            name,
+            size,
+            (gdouble)total->nsec / iterations,
+            (gdouble)total->syscalls / iterations,
+            (gdouble)total->allocations / iterations);
+}
+/*
+ * A context connected to one end of a socketpair, as Tss2_Tcti_Tabrmd_Init
+ * leaves it minus the GSocketConnection. With 'blocking' FALSE the socket
+ * is left non-blocking the way GSocket sets it up.
+ */
+static void
+bench_init (bench_data_t *data,
+            gboolean      blocking)
+{
+    TSS2_TCTI_CONTEXT_COMMON_V1 *common;
+    gint fds [2];
+
+    if (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds) == -1) {
+        g_error ("socketpair: %s", strerror (errno));
+    }
+    if (!blocking) {
+        fcntl (fds [0], F_SETFL, fcntl (fds [0], F_GETFL) | O_NONBLOCK);
+    }
+    data->context = g_new0 (TSS2_TCTI_TABRMD_CONTEXT, 1);
+    data->context->fd = fds [0];
+    data->context->blocking = blocking;
+    data->context->state = TABRMD_STATE_TRANSMIT;
+    common = (TSS2_TCTI_CONTEXT_COMMON_V1*)data->context;
+    common->magic = TSS2_TCTI_TABRMD_MAGIC;
+    common->version = TSS2_TCTI_TABRMD_VERSION;
+    data->server_fd = fds [1];
+    tpm2_header_init (data->command, sizeof (data->command),
+                      TPM2_ST_NO_SESSIONS, TPM_HEADER_SIZE, TPM2_CC_Startup);
+}
+static void
+bench_fini (bench_data_t *data)
+{
+    close (data->context->fd);
+    close (data->server_fd);
+    g_free (data->context->shm);
+    g_clear_pointer (&data->context, g_free);
+}
+/*
+ * The responder's side: read 'size' bytes from the TCTI and write 'size'
+ * bytes back.
+ */
+static void
+bench_server_read (bench_data_t *data,
+                   size_t        size)
+{
+    uint8_t buf [UTIL_BUF_MAX];
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < size) {
+        ret = read (data->server_fd, &buf [done], size - done);
+        if (ret <= 0) {
+            g_error ("%s: read: %s", __func__, strerror (errno));
+        }
+        done += (size_t)ret;
+    }
+}
+static void
+bench_server_write (bench_data_t  *data,
+                    const uint8_t *buf,
+                    size_t         size)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < size) {
+        ret = write (data->server_fd, &buf [done], size - done);
+        if (ret <= 0) {
+            g_error ("%s: write: %s", __func__, strerror (errno));
+        }
+        done += (size_t)ret;
+    }
+}
+/*
+ * A successful response 'size' bytes long.
+ */
+static void
+bench_response_init (bench_data_t *data,
+                     size_t        size)
+{
+    memset (data->response, 0, size);
+    set_response_tag (data->response, TPM2_ST_NO_SESSIONS);
+    set_response_size (data->response, (UINT32)size);
+    set_response_code (data->response, TSS2_RC_SUCCESS);
+}
+static void
+bench_check (const gchar *name,
+             TSS2_RC      rc)
+{
+    if (rc != TSS2_RC_SUCCESS) {
+        g_error ("%s: unexpected RC 0x%" PRIx32, name, rc);
+    }
+}
+/*
+ * Time transmit alone, then receive alone with the whole response waiting
+ * on the socket. With 'split' the response is written in two parts and
+ * receive is called for each: the first gets the header and returns
+ * TSS2_TCTI_RC_TRY_AGAIN, which only makes sense with a zero timeout.
+ */
+static void
+bench_transmit_receive (const gchar *name,
+                        gboolean     blocking,
+                        int32_t      timeout,
+                        gboolean     split,
+                        size_t       size)
+{
+    TSS2_TCTI_CONTEXT *context;
+    bench_data_t data = { 0 };
+    bench_sample_t start, transmit = { 0 }, receive = { 0 };
+    uint8_t response [UTIL_BUF_MAX];
+    size_t response_size;
+    gchar *label;
+    guint i;
+    TSS2_RC rc;
+
+    bench_init (&data, blocking);
+    bench_response_init (&data, size);
+    context = (TSS2_TCTI_CONTEXT*)data.context;
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        bench_start (&start);
+        rc = tss2_tcti_tabrmd_transmit (context, sizeof (data.command),
+                                        data.command);
+        bench_stop (&start, &transmit);
+        bench_check (name, rc);
+        bench_server_read (&data, sizeof (data.command));
+        if (split) {
+            bench_server_write (&data, data.response, TPM_HEADER_SIZE);
+            response_size = sizeof (response);
+            bench_start (&start);
+            rc = tss2_tcti_tabrmd_receive (context, &response_size, response,
+                                           timeout);
+            bench_stop (&start, &receive);
+            if (rc != TSS2_TCTI_RC_TRY_AGAIN) {
+                bench_check (name, rc);
+            }
+            bench_server_write (&data, &data.response [TPM_HEADER_SIZE],
+                                size - TPM_HEADER_SIZE);
+        } else {
+            bench_server_write (&data, data.response, size);
+        }
+        response_size = sizeof (response);
+        bench_start (&start);
+        rc = tss2_tcti_tabrmd_receive (context, &response_size, response,
+                                       timeout);
+        bench_stop (&start, &receive);
+        bench_check (name, rc);
+    }
+    label = g_strdup_printf ("transmit %s", name);
+    bench_report (label, sizeof (data.command), BENCH_ITERATIONS, &transmit);
+    g_free (label);
+    label = g_strdup_printf ("receive %s", name);
+    bench_report (label, size, BENCH_ITERATIONS, &receive);
+    g_free (label);
+    bench_fini (&data);
+}
+/*
+ * The same over the shared memory transport: the slots are plain heap
+ * memory and only the doorbell goes over the socket.
+ */
+static void
+bench_transmit_receive_shm (int32_t timeout,
+                            size_t  size)
+{
+    TSS2_TCTI_CONTEXT *context;
+    bench_data_t data = { 0 };
+    bench_sample_t start, transmit = { 0 }, receive = { 0 };
+    const uint8_t doorbell = SHM_TRANSPORT_DOORBELL;
+    uint8_t response [UTIL_BUF_MAX];
+    size_t response_size;
+    guint i;
+    TSS2_RC rc;
+
+    bench_init (&data, TRUE);
+    bench_response_init (&data, size);
+    data.context->shm = g_new0 (shm_transport_t, 1);
+    context = (TSS2_TCTI_CONTEXT*)data.context;
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        bench_start (&start);
+        rc = tss2_tcti_tabrmd_transmit (context, sizeof (data.command),
+                                        data.command);
+        bench_stop (&start, &transmit);
+        bench_check ("shm", rc);
+        bench_server_read (&data, sizeof (doorbell));
+        memcpy (data.context->shm->response, data.response, size);
+        data.context->shm->response_size = (uint32_t)size;
+        bench_server_write (&data, &doorbell, sizeof (doorbell));
+        response_size = sizeof (response);
+        bench_start (&start);
+        rc = tss2_tcti_tabrmd_receive (context, &response_size, response,
+                                       timeout);
+        bench_stop (&start, &receive);
+        bench_check ("shm", rc);
+    }
+    bench_report ("transmit shm", sizeof (data.command), BENCH_ITERATIONS,
+                  &transmit);
+    bench_report ("receive shm", size, BENCH_ITERATIONS, &receive);
+    bench_fini (&data);
+}
+int
+main (void)
+{
+    static const size_t sizes [] = { TPM_HEADER_SIZE, 1024, 4096 };
+    size_t i;
+
+    printf ("%-28s %6s %12s %10s %10s\n",
+            "benchmark", "bytes", "ns/op", "syscalls", "allocs");
+    for (i = 0; i < G_N_ELEMENTS (sizes); ++i) {
+        bench_transmit_receive ("block", TRUE, TSS2_TCTI_TIMEOUT_BLOCK,
+                                FALSE, sizes [i]);
+        bench_transmit_receive ("block nonblocking fd", FALSE,
+                                TSS2_TCTI_TIMEOUT_BLOCK, FALSE, sizes [i]);
+        bench_transmit_receive ("timeout 0", TRUE, 0, FALSE, sizes [i]);
+        if (sizes [i] > TPM_HEADER_SIZE) {
+            bench_transmit_receive ("timeout 0 partial", TRUE, 0, TRUE,
+                                    sizes [i]);
+        }
+        bench_transmit_receive_shm (TSS2_TCTI_TIMEOUT_BLOCK, sizes [i]);
+    }
+    return 0;
+}
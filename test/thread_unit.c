@@ -164,6 +164,37 @@ test_thread_lifecycle_test (void **state)
     assert_true (test_thread->canceled);
     assert_true (test_thread->cleaned_up);
 }
+/*
+ * A CPU affinity set with thread_set_sched is applied to the thread when
+ * it starts. The CPU used is one the test already runs on.
+ */
+static void
+test_thread_sched_test (void **state)
+{
+    Thread *thread = THREAD (*state);
+    TestThread *test_thread = TEST_THREAD (*state);
+    thread_sched_t sched = THREAD_SCHED_INIT_DEFAULT;
+    cpu_set_t allowed, cpus;
+    gint cpu;
+
+    assert_int_equal (sched_getaffinity (0, sizeof (allowed), &allowed), 0);
+    for (cpu = 0; !CPU_ISSET (cpu, &allowed); ++cpu);
+    CPU_SET (cpu, &sched.cpus);
+    thread_set_sched (thread, &sched);
+
+    assert_int_equal (thread_start (thread), 0);
+    while (!g_atomic_int_get (&test_thread->running)) {
+        sched_yield ();
+    }
+    assert_int_equal (pthread_getaffinity_np (thread->thread_id,
+                                              sizeof (cpus),
+                                              &cpus),
+                      0);
+    thread_cancel (thread);
+    assert_int_equal (thread_join (thread), 0);
+    assert_int_equal (CPU_COUNT (&cpus), 1);
+    assert_true (CPU_ISSET (cpu, &cpus));
+}
 int
 main (void)
 {
@@ -174,6 +205,9 @@ main (void)
         cmocka_unit_test_setup_teardown (test_thread_lifecycle_test,
                                          test_thread_setup,
                                          test_thread_teardown),
+        cmocka_unit_test_setup_teardown (test_thread_sched_test,
+                                         test_thread_setup,
+                                         test_thread_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
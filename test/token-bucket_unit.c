@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "token-bucket.h"
+#include "util.h"
+
+/*
+ * A new bucket is full: 'burst' tokens can be taken at once, the next one
+ * has to wait for the refill.
+ */
+static void
+token_bucket_burst_test (void **state)
+{
+    token_bucket_t bucket;
+    guint i;
+    UNUSED_PARAM (state);
+
+    token_bucket_init (&bucket, 10, 3, 0);
+    for (i = 0; i < 3; ++i) {
+        assert_true (token_bucket_take (&bucket, 0));
+    }
+    assert_false (token_bucket_take (&bucket, 0));
+}
+/*
+ * At 10 tokens per second a token is added every 100ms.
+ */
+static void
+token_bucket_refill_test (void **state)
+{
+    token_bucket_t bucket;
+    UNUSED_PARAM (state);
+
+    token_bucket_init (&bucket, 10, 1, 0);
+    assert_true (token_bucket_take (&bucket, 0));
+    assert_false (token_bucket_take (&bucket, 99999));
+    assert_true (token_bucket_take (&bucket, 100000));
+    assert_false (token_bucket_take (&bucket, 100000));
+}
+/*
+ * A long idle period refills the bucket up to its capacity and no more.
+ */
+static void
+token_bucket_capacity_test (void **state)
+{
+    token_bucket_t bucket;
+    UNUSED_PARAM (state);
+
+    token_bucket_init (&bucket, 1000, 2, 0);
+    assert_true (token_bucket_take (&bucket, 0));
+    assert_true (token_bucket_take (&bucket, 0));
+    assert_true (token_bucket_take (&bucket, 60 * G_USEC_PER_SEC));
+    assert_true (token_bucket_take (&bucket, 60 * G_USEC_PER_SEC));
+    assert_false (token_bucket_take (&bucket, 60 * G_USEC_PER_SEC));
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (token_bucket_burst_test),
+        cmocka_unit_test (token_bucket_refill_test),
+        cmocka_unit_test (token_bucket_capacity_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
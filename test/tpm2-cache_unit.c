@@ -0,0 +1,289 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "command-attrs.h"
+#include "tcti.h"
+#include "tcti-mock.h"
+#include "tpm2.h"
+#include "tpm2-cache.h"
+#include "util.h"
+
+#define FIRMWARE_VERSION 0x00010002
+
+typedef struct {
+    Tpm2                 *tpm2;
+    CommandAttrs         *command_attrs;
+    gchar                *dir;
+    gchar                *path;
+    TPMS_CAPABILITY_DATA  properties_fixed;
+} test_data_t;
+
+static TPMA_CC command_attributes [] = {
+    TPM2_CC_HierarchyControl + 0xff0000,
+    TPM2_CC_ChangePPS + 0xff0000,
+    0x20000001,
+};
+
+TSS2_RC
+__wrap_tpm2_init_tpm (Tpm2 *tpm2)
+{
+    UNUSED_PARAM (tpm2);
+    return mock_type (TSS2_RC);
+}
+/*
+ * Return the properties passed with will_return: the TPMS_CAPABILITY_DATA
+ * and a firmware version to report in place of the one it holds.
+ */
+TSS2_RC
+__wrap_tpm2_get_properties (Tpm2                     *tpm2,
+                            TPM2_PT                   property,
+                            UINT32                    count,
+                            TPML_TAGGED_TPM_PROPERTY *properties)
+{
+    TPMS_CAPABILITY_DATA *cap_data;
+    guint32 firmware;
+    UINT32 i;
+    UNUSED_PARAM (tpm2);
+
+    assert_int_equal (property, TPM2_CACHE_KEY_FIRST);
+    assert_int_equal (count, TPM2_CACHE_KEY_COUNT);
+    cap_data = mock_ptr_type (TPMS_CAPABILITY_DATA*);
+    firmware = mock_type (guint32);
+    *properties = cap_data->data.tpmProperties;
+    for (i = 0; i < properties->count; ++i) {
+        if (properties->tpmProperty [i].property == TPM2_PT_FIRMWARE_VERSION_1) {
+            properties->tpmProperty [i].value = firmware;
+        }
+    }
+    return TSS2_RC_SUCCESS;
+}
+TSS2_RC
+__wrap_tpm2_refresh_properties_fixed (Tpm2 *tpm2)
+{
+    TPMS_CAPABILITY_DATA *cap_data = mock_ptr_type (TPMS_CAPABILITY_DATA*);
+
+    tpm2_set_properties_fixed (tpm2, cap_data);
+    return TSS2_RC_SUCCESS;
+}
+gint
+__wrap_command_attrs_init_tpm (CommandAttrs *attrs,
+                               Tpm2         *tpm2)
+{
+    UNUSED_PARAM (tpm2);
+
+    command_attrs_init_cached (attrs,
+                               G_N_ELEMENTS (command_attributes),
+                               command_attributes);
+    return mock_type (gint);
+}
+
+static void
+set_property (TPMS_CAPABILITY_DATA *cap_data,
+              TPM2_PT               property,
+              guint32               value)
+{
+    TPML_TAGGED_TPM_PROPERTY *props = &cap_data->data.tpmProperties;
+
+    props->tpmProperty [props->count].property = property;
+    props->tpmProperty [props->count].value = value;
+    ++props->count;
+}
+static int
+tpm2_cache_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+    TSS2_TCTI_CONTEXT *context;
+    Tcti *tcti;
+
+    context = tcti_mock_init_full ();
+    assert_non_null (context);
+    tcti = tcti_new (context);
+    data->tpm2 = tpm2_new (tcti);
+    g_clear_object (&tcti);
+    data->command_attrs = command_attrs_new ();
+    data->dir = g_dir_make_tmp ("tpm2-cache-unit-XXXXXX", NULL);
+    assert_non_null (data->dir);
+    data->path = g_build_filename (data->dir, "tpm0.cache", NULL);
+    data->properties_fixed.capability = TPM2_CAP_TPM_PROPERTIES;
+    set_property (&data->properties_fixed, TPM2_PT_MANUFACTURER, 0x494e5443);
+    set_property (&data->properties_fixed, TPM2_PT_VENDOR_STRING_1, 0x534c4239);
+    set_property (&data->properties_fixed, TPM2_PT_FIRMWARE_VERSION_1, FIRMWARE_VERSION);
+    set_property (&data->properties_fixed, TPM2_PT_MAX_RESPONSE_SIZE, 4096);
+
+    *state = data;
+    return 0;
+}
+static int
+tpm2_cache_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    g_unlink (data->path);
+    g_rmdir (data->dir);
+    g_free (data->path);
+    g_free (data->dir);
+    g_object_unref (data->command_attrs);
+    g_object_unref (data->tpm2);
+    g_free (data);
+    return 0;
+}
+/*
+ * Write a cache and map it again: everything written comes back and the
+ * key is taken from the fixed properties.
+ */
+static void
+tpm2_cache_save_map_test (void **state)
+{
+    test_data_t *data = *state;
+    tpm2_cache_t *cache;
+
+    command_attrs_init_cached (data->command_attrs,
+                               G_N_ELEMENTS (command_attributes),
+                               command_attributes);
+    assert_true (tpm2_cache_save (data->path,
+                                  &data->properties_fixed,
+                                  data->command_attrs));
+    cache = tpm2_cache_map (data->path);
+    assert_non_null (cache);
+    assert_int_equal (cache->command_count, G_N_ELEMENTS (command_attributes));
+    assert_memory_equal (cache->command_attrs,
+                         command_attributes,
+                         sizeof (command_attributes));
+    assert_memory_equal (&cache->properties_fixed,
+                         &data->properties_fixed,
+                         sizeof (data->properties_fixed));
+    assert_int_equal (cache->key [TPM2_PT_MANUFACTURER - TPM2_CACHE_KEY_FIRST],
+                      0x494e5443);
+    assert_int_equal (cache->key [TPM2_PT_FIRMWARE_VERSION_1 - TPM2_CACHE_KEY_FIRST],
+                      FIRMWARE_VERSION);
+    assert_int_equal (cache->key [TPM2_PT_FIRMWARE_VERSION_2 - TPM2_CACHE_KEY_FIRST],
+                      0);
+    tpm2_cache_unmap (cache);
+}
+/*
+ * A missing cache or one this daemon didn't write isn't mapped.
+ */
+static void
+tpm2_cache_map_invalid_test (void **state)
+{
+    test_data_t *data = *state;
+    gchar junk [sizeof (tpm2_cache_t)] = { 0 };
+
+    assert_null (tpm2_cache_map (data->path));
+    assert_true (g_file_set_contents (data->path, junk, sizeof (junk), NULL));
+    assert_null (tpm2_cache_map (data->path));
+}
+/*
+ * With a cache for the same firmware the TPMA_CCs and fixed properties
+ * come from the cache: command_attrs_init_tpm isn't called.
+ */
+static void
+tpm2_cache_init_tpm_hit_test (void **state)
+{
+    test_data_t *data = *state;
+    CommandAttrs *attrs = command_attrs_new ();
+    guint32 value = 0;
+    TSS2_RC rc;
+
+    command_attrs_init_cached (attrs,
+                               G_N_ELEMENTS (command_attributes),
+                               command_attributes);
+    assert_true (tpm2_cache_save (data->path, &data->properties_fixed, attrs));
+    g_object_unref (attrs);
+
+    will_return (__wrap_tpm2_init_tpm, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_get_properties, &data->properties_fixed);
+    will_return (__wrap_tpm2_get_properties, FIRMWARE_VERSION);
+    rc = tpm2_cache_init_tpm (data->tpm2, data->command_attrs, data->path);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (data->command_attrs->count,
+                      G_N_ELEMENTS (command_attributes));
+    assert_int_equal (command_attrs_from_cc (data->command_attrs, 0x0001),
+                      command_attributes [2]);
+    rc = tpm2_get_fixed_property (data->tpm2, TPM2_PT_MAX_RESPONSE_SIZE, &value);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (value, 4096);
+}
+/*
+ * After a firmware update the properties are read from the TPM again and
+ * the cache is rewritten with the new key.
+ */
+static void
+tpm2_cache_init_tpm_stale_test (void **state)
+{
+    test_data_t *data = *state;
+    TPMS_CAPABILITY_DATA updated = data->properties_fixed;
+    CommandAttrs *attrs = command_attrs_new ();
+    tpm2_cache_t *cache;
+    TSS2_RC rc;
+
+    command_attrs_init_cached (attrs, 1, command_attributes);
+    assert_true (tpm2_cache_save (data->path, &data->properties_fixed, attrs));
+    g_object_unref (attrs);
+    updated.data.tpmProperties.tpmProperty [2].value = FIRMWARE_VERSION + 1;
+
+    will_return (__wrap_tpm2_init_tpm, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_get_properties, &data->properties_fixed);
+    will_return (__wrap_tpm2_get_properties, FIRMWARE_VERSION + 1);
+    will_return (__wrap_tpm2_refresh_properties_fixed, &updated);
+    will_return (__wrap_command_attrs_init_tpm, 0);
+    rc = tpm2_cache_init_tpm (data->tpm2, data->command_attrs, data->path);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (data->command_attrs->count,
+                      G_N_ELEMENTS (command_attributes));
+
+    cache = tpm2_cache_map (data->path);
+    assert_non_null (cache);
+    assert_int_equal (cache->command_count, G_N_ELEMENTS (command_attributes));
+    assert_int_equal (cache->key [TPM2_PT_FIRMWARE_VERSION_1 - TPM2_CACHE_KEY_FIRST],
+                      FIRMWARE_VERSION + 1);
+    tpm2_cache_unmap (cache);
+}
+/*
+ * Without a cache the TPM is queried and the cache created.
+ */
+static void
+tpm2_cache_init_tpm_miss_test (void **state)
+{
+    test_data_t *data = *state;
+    tpm2_cache_t *cache;
+    TSS2_RC rc;
+
+    /* stands in for the properties tpm2_init_tpm reads from the TPM */
+    tpm2_set_properties_fixed (data->tpm2, &data->properties_fixed);
+    will_return (__wrap_tpm2_init_tpm, TSS2_RC_SUCCESS);
+    will_return (__wrap_command_attrs_init_tpm, 0);
+    rc = tpm2_cache_init_tpm (data->tpm2, data->command_attrs, data->path);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    cache = tpm2_cache_map (data->path);
+    assert_non_null (cache);
+    tpm2_cache_unmap (cache);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (tpm2_cache_save_map_test,
+                                         tpm2_cache_setup,
+                                         tpm2_cache_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_cache_map_invalid_test,
+                                         tpm2_cache_setup,
+                                         tpm2_cache_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_cache_init_tpm_hit_test,
+                                         tpm2_cache_setup,
+                                         tpm2_cache_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_cache_init_tpm_stale_test,
+                                         tpm2_cache_setup,
+                                         tpm2_cache_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_cache_init_tpm_miss_test,
+                                         tpm2_cache_setup,
+                                         tpm2_cache_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
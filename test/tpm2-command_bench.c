@@ -0,0 +1,372 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Microbenchmarks for the command parser over a corpus with a command
+ * buffer for each command the TPM reports, with no sessions and with one
+ * to three. The TPM is the emulated one from test/tcti-bench.c, queried
+ * through command_attrs_init_tpm like the daemon queries a real one. For
+ * each command the time spent creating and indexing the Tpm2Command, in
+ * the handle and authorization accessors and in resource_manager_virt_to_phys
+ * for each of its handles is reported, so a command with a slow path
+ * stands out from the rest.
+ */
+#include <endian.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "command-attrs.h"
+#include "connection.h"
+#include "handle-map.h"
+#include "resource-manager.h"
+#include "session-list.h"
+#include "tcti.h"
+#include "tcti-bench.h"
+#include "tpm2.h"
+#include "tpm2-command.h"
+#include "util.h"
+
+#define BENCH_ITERATIONS 10000
+/* the corpus has commands with 0 up to this many sessions */
+#define BENCH_AUTHS_MAX 3
+/* nonces and HMACs are SHA256 sized, as most sessions are */
+#define BENCH_DIGEST_SIZE 32
+#define BENCH_SESSION_ATTRS 0x01
+
+typedef struct {
+    TPMA_CC attrs;
+    guint8  auths;
+    size_t  size;
+    guint8  buffer [UTIL_BUF_MAX];
+} corpus_command_t;
+
+typedef struct {
+    Tpm2            *tpm2;
+    ResourceManager *resmgr;
+    SessionList     *session_list;
+    CommandAttrs    *command_attrs;
+    Connection      *connection;
+    /* vhandles of the connection's transient objects */
+    TPM2_HANDLE      vhandles [TPM2_COMMAND_MAX_HANDLES];
+    corpus_command_t *corpus;
+    guint            corpus_size;
+} bench_data_t;
+
+typedef struct {
+    gint64 create;
+    gint64 access;
+    gint64 virt_to_phys;
+} bench_result_t;
+
+static inline guint8*
+corpus_put16 (guint8 *buf,
+              UINT16  value)
+{
+    *(UINT16*)buf = htobe16 (value);
+    return buf + sizeof (value);
+}
+static inline guint8*
+corpus_put32 (guint8 *buf,
+              UINT32  value)
+{
+    *(UINT32*)buf = htobe32 (value);
+    return buf + sizeof (value);
+}
+static guint8*
+corpus_put_tpm2b (guint8 *buf,
+                  UINT16  size,
+                  guint8  fill)
+{
+    buf = corpus_put16 (buf, size);
+    memset (buf, fill, size);
+    return buf + size;
+}
+/*
+ * Marshal the command 'attrs' with 'auths' HMAC sessions into 'command'.
+ * Every handle in the handle area is one of the connection's transient
+ * objects: that's the case that costs the ResourceManager the most.
+ */
+static void
+corpus_command_init (corpus_command_t  *command,
+                     TPMA_CC            attrs,
+                     guint8             auths,
+                     const TPM2_HANDLE  vhandles[])
+{
+    guint8 handles = (attrs & TPMA_CC_CHANDLES) >> TPMA_CC_CHANDLES_SHIFT;
+    guint8 *buf, *auths_size;
+    guint8 i;
+
+    command->attrs = attrs;
+    command->auths = auths;
+    buf = corpus_put16 (command->buffer,
+                        auths > 0 ? TPM2_ST_SESSIONS : TPM2_ST_NO_SESSIONS);
+    /* the size is filled in once the command is complete */
+    buf = corpus_put32 (buf, 0);
+    buf = corpus_put32 (buf, attrs & (TPMA_CC_COMMANDINDEX | TPMA_CC_V));
+    for (i = 0; i < handles; ++i) {
+        buf = corpus_put32 (buf, vhandles [i]);
+    }
+    if (auths > 0) {
+        auths_size = buf;
+        buf += sizeof (UINT32);
+        for (i = 0; i < auths; ++i) {
+            buf = corpus_put32 (buf, TPM2_HMAC_SESSION_FIRST + i);
+            buf = corpus_put_tpm2b (buf, BENCH_DIGEST_SIZE, 0xa0 + i);
+            *buf++ = BENCH_SESSION_ATTRS;
+            buf = corpus_put_tpm2b (buf, BENCH_DIGEST_SIZE, 0xb0 + i);
+        }
+        corpus_put32 (auths_size,
+                      (UINT32)(buf - auths_size - sizeof (UINT32)));
+    }
+    /* parameters: a digest sized TPM2B and a couple of scalars */
+    buf = corpus_put_tpm2b (buf, BENCH_DIGEST_SIZE, 0xc0);
+    buf = corpus_put32 (buf, 0);
+    buf = corpus_put32 (buf, 0);
+    command->size = (size_t)(buf - command->buffer);
+    corpus_put32 (&command->buffer [sizeof (TPM2_ST)], (UINT32)command->size);
+}
+/*
+ * A corpus entry for each command the TPM reports and each number of
+ * sessions.
+ */
+static void
+corpus_init (bench_data_t *data)
+{
+    TPMA_CC attrs;
+    guint8 auths;
+    guint i, j = 0;
+
+    data->corpus_size = data->command_attrs->count * (BENCH_AUTHS_MAX + 1);
+    data->corpus = g_new0 (corpus_command_t, data->corpus_size);
+    for (i = 0; i < data->command_attrs->count; ++i) {
+        attrs = data->command_attrs->command_attrs [i];
+        for (auths = 0; auths <= BENCH_AUTHS_MAX; ++auths) {
+            corpus_command_init (&data->corpus [j++], attrs, auths,
+                                 data->vhandles);
+        }
+    }
+}
+/*
+ * The ResourceManager over the emulated TPM with its latencies scaled to
+ * nothing, and a connection with an object for every handle a command may
+ * have. The objects' physical handles are remembered and the same as
+ * their virtual ones so that resource_manager_virt_to_phys leaves the
+ * corpus untouched.
+ */
+static void
+bench_init (bench_data_t *data)
+{
+    TSS2_TCTI_CONTEXT *context;
+    HandleMap *map;
+    HandleMapEntry *entry;
+    GIOStream *iostream;
+    Tcti *tcti;
+    size_t size = 0;
+    gint client_fd;
+    guint i;
+    TSS2_RC rc;
+
+    Tss2_Tcti_Bench_Init (NULL, &size, NULL);
+    context = calloc (1, size);
+    rc = Tss2_Tcti_Bench_Init (context, &size, "scale=0");
+    if (rc != TSS2_RC_SUCCESS) {
+        g_error ("Tss2_Tcti_Bench_Init failed: 0x%" PRIx32, rc);
+    }
+    tcti = tcti_new (context);
+    data->tpm2 = tpm2_new (tcti);
+    g_object_unref (tcti);
+    rc = tpm2_init_tpm (data->tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_error ("tpm2_init_tpm failed: 0x%" PRIx32, rc);
+    }
+    data->command_attrs = command_attrs_new ();
+    if (command_attrs_init_tpm (data->command_attrs, data->tpm2) != 0) {
+        g_error ("command_attrs_init_tpm failed");
+    }
+    data->session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT,
+                                           SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    data->resmgr = resource_manager_new (data->tpm2, data->session_list);
+
+    map = handle_map_new (TPM2_HT_TRANSIENT, TPM2_COMMAND_MAX_HANDLES);
+    for (i = 0; i < TPM2_COMMAND_MAX_HANDLES; ++i) {
+        data->vhandles [i] = handle_map_next_vhandle (map);
+        entry = handle_map_entry_new (data->vhandles [i], data->vhandles [i]);
+        handle_map_insert (map, data->vhandles [i], entry);
+        g_object_unref (entry);
+    }
+    iostream = create_connection_iostream (&client_fd);
+    data->connection = connection_new (iostream, 1, map);
+    g_object_unref (iostream);
+    g_object_unref (map);
+    close (client_fd);
+    corpus_init (data);
+}
+static void
+bench_fini (bench_data_t *data)
+{
+    g_clear_pointer (&data->corpus, g_free);
+    g_clear_object (&data->connection);
+    g_clear_object (&data->resmgr);
+    g_clear_object (&data->session_list);
+    g_clear_object (&data->command_attrs);
+    g_clear_object (&data->tpm2);
+}
+/*
+ * Read each authorization the way the ResourceManager does when it looks
+ * for sessions and password authorizations.
+ */
+static void
+bench_auth_callback (gpointer auth_offset_ptr,
+                     gpointer user_data)
+{
+    size_t auth_offset = *(size_t*)auth_offset_ptr;
+    Tpm2Command *command = TPM2_COMMAND (user_data);
+    volatile TPM2_HANDLE handle;
+    volatile TPMA_SESSION attrs;
+    UINT16 size;
+
+    handle = tpm2_command_get_auth_handle (command, auth_offset);
+    attrs = tpm2_command_get_auth_attrs (command, auth_offset);
+    tpm2_command_get_auth_value (command, auth_offset, &size);
+    UNUSED_PARAM (handle);
+    UNUSED_PARAM (attrs);
+}
+static void
+bench_access (Tpm2Command *command)
+{
+    TPM2_HANDLE handles [TPM2_COMMAND_MAX_HANDLES];
+    size_t count = TPM2_COMMAND_MAX_HANDLES;
+    volatile TPM2_CC code;
+    volatile size_t offset;
+
+    code = tpm2_command_get_code (command);
+    tpm2_command_get_handles (command, handles, &count);
+    if (tpm2_command_has_auths (command)) {
+        tpm2_command_foreach_auth (command, bench_auth_callback, command);
+    }
+    offset = tpm2_command_get_params_offset (command);
+    UNUSED_PARAM (code);
+    UNUSED_PARAM (offset);
+}
+static void
+bench_virt_to_phys (bench_data_t *data,
+                    Tpm2Command  *command)
+{
+    HandleMap *map = connection_get_trans_map (data->connection);
+    HandleMapEntry *entry;
+    guint8 i, count = tpm2_command_get_handle_count (command);
+
+    for (i = 0; i < count; ++i) {
+        entry = handle_map_vlookup (map, tpm2_command_get_handle (command, i));
+        resource_manager_virt_to_phys (data->resmgr, command, entry, i);
+        g_object_unref (entry);
+    }
+    g_object_unref (map);
+}
+/*
+ * Time the three stages for one corpus entry.
+ */
+static void
+bench_command (bench_data_t           *data,
+               const corpus_command_t *corpus,
+               bench_result_t         *result)
+{
+    Tpm2Command *command;
+    gint64 start;
+    guint i;
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        command = tpm2_command_new_borrowed (data->connection,
+                                             (guint8*)corpus->buffer,
+                                             corpus->size,
+                                             corpus->attrs);
+        g_object_unref (command);
+    }
+    result->create = g_get_monotonic_time () - start;
+    command = tpm2_command_new_borrowed (data->connection,
+                                         (guint8*)corpus->buffer,
+                                         corpus->size,
+                                         corpus->attrs);
+    if (tpm2_command_get_auth_count (command) != corpus->auths) {
+        g_error ("corpus command 0x%" PRIx32 " with %u sessions misparsed",
+                 tpm2_command_get_code (command), corpus->auths);
+    }
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        bench_access (command);
+    }
+    result->access = g_get_monotonic_time () - start;
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_ITERATIONS; ++i) {
+        bench_virt_to_phys (data, command);
+    }
+    result->virt_to_phys = g_get_monotonic_time () - start;
+    g_object_unref (command);
+}
+static gdouble
+bench_nsec (gint64 usec)
+{
+    return usec * 1000.0 / BENCH_ITERATIONS;
+}
+/*
+ * A line per command and number of sessions, then the mean over the
+ * corpus and the slowest command for each stage.
+ */
+int
+main (void)
+{
+    bench_data_t data = { 0 };
+    bench_result_t result, total = { 0 }, slowest = { 0 };
+    TPM2_CC slowest_cc [3] = { 0 };
+    corpus_command_t *corpus;
+    TPM2_CC code;
+    guint i;
+
+    bench_init (&data);
+    printf ("%-10s %7s %5s %12s %12s %12s\n", "command", "handles", "auths",
+            "create ns", "access ns", "v2p ns");
+    for (i = 0; i < data.corpus_size; ++i) {
+        corpus = &data.corpus [i];
+        code = corpus->attrs & (TPMA_CC_COMMANDINDEX | TPMA_CC_V);
+        bench_command (&data, corpus, &result);
+        printf ("0x%08" PRIx32 " %7u %5u %12.1f %12.1f %12.1f\n",
+                code,
+                (corpus->attrs & TPMA_CC_CHANDLES) >> TPMA_CC_CHANDLES_SHIFT,
+                corpus->auths,
+                bench_nsec (result.create),
+                bench_nsec (result.access),
+                bench_nsec (result.virt_to_phys));
+        total.create += result.create;
+        total.access += result.access;
+        total.virt_to_phys += result.virt_to_phys;
+        if (result.create > slowest.create) {
+            slowest.create = result.create;
+            slowest_cc [0] = code;
+        }
+        if (result.access > slowest.access) {
+            slowest.access = result.access;
+            slowest_cc [1] = code;
+        }
+        if (result.virt_to_phys > slowest.virt_to_phys) {
+            slowest.virt_to_phys = result.virt_to_phys;
+            slowest_cc [2] = code;
+        }
+    }
+    printf ("%-10s %7s %5u %12.1f %12.1f %12.1f\n", "mean", "", data.corpus_size,
+            bench_nsec (total.create) / data.corpus_size,
+            bench_nsec (total.access) / data.corpus_size,
+            bench_nsec (total.virt_to_phys) / data.corpus_size);
+    printf ("%-10s %7s %5s %12.1f %12.1f %12.1f\n", "slowest", "", "",
+            bench_nsec (slowest.create),
+            bench_nsec (slowest.access),
+            bench_nsec (slowest.virt_to_phys));
+    printf ("%-10s %7s %5s   0x%08" PRIx32 "   0x%08" PRIx32 "   0x%08" PRIx32
+            "\n", "", "", "", slowest_cc [0], slowest_cc [1], slowest_cc [2]);
+    bench_fini (&data);
+    return 0;
+}
@@ -260,6 +260,43 @@ tpm2_command_type_test (void **state)
     assert_true (G_IS_OBJECT (data->command));
     assert_true (IS_TPM2_COMMAND (data->command));
 }
+/*
+ * tpm2_command_new sets the fields directly. The GObject properties must
+ * still report them, and g_object_new with the properties must build the
+ * same command.
+ */
+static void
+tpm2_command_properties_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    Connection *connection = NULL;
+    gpointer buffer = NULL;
+    guint size = 0, attributes = 1;
+
+    g_object_get (data->command,
+                  "attributes", &attributes,
+                  "buffer", &buffer,
+                  "buffer-size", &size,
+                  "connection", &connection,
+                  NULL);
+    assert_int_equal (attributes, 0);
+    assert_ptr_equal (buffer, data->buffer);
+    assert_int_equal (size, data->buffer_size);
+    assert_ptr_equal (connection, data->connection);
+    g_object_unref (connection);
+
+    command = TPM2_COMMAND (g_object_new (TYPE_TPM2_COMMAND,
+                                          "attributes", 2 << 25,
+                                          "buffer", g_malloc0 (TPM_HEADER_SIZE),
+                                          "buffer-size", TPM_HEADER_SIZE,
+                                          "connection", data->connection,
+                                          NULL));
+    assert_int_equal (tpm2_command_get_attributes (command), 2 << 25);
+    assert_int_equal (command->buffer_size, TPM_HEADER_SIZE);
+    assert_ptr_equal (command->connection, data->connection);
+    g_object_unref (command);
+}
 
 static void
 tpm2_command_get_connection_test (void **state)
@@ -268,7 +305,46 @@ tpm2_command_get_connection_test (void **state)
 
     assert_int_equal (data->connection, tpm2_command_get_connection (data->command));
 }
+/*
+ * The buffer of a command is counted against its connection until the
+ * command is released, whether or not the command owns the buffer.
+ */
+static void
+tpm2_command_charge_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *borrowed;
+    gsize commands = mem_account_get (MEM_ACCOUNT_COMMANDS);
+
+    assert_int_equal (connection_get_bytes (data->connection),
+                      data->buffer_size);
+    borrowed = tpm2_command_new_borrowed (data->connection,
+                                          data->buffer,
+                                          data->buffer_size,
+                                          0);
+    assert_int_equal (connection_get_bytes (data->connection),
+                      2 * data->buffer_size);
+    assert_int_equal (mem_account_get (MEM_ACCOUNT_COMMANDS),
+                      commands + data->buffer_size);
+    g_object_unref (borrowed);
+    assert_int_equal (connection_get_bytes (data->connection),
+                      data->buffer_size);
+    assert_int_equal (mem_account_get (MEM_ACCOUNT_COMMANDS), commands);
+}
 
+/*
+ * TPM time accumulates across calls, negative spans are ignored.
+ */
+static void
+tpm2_command_tpm_time_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_int_equal (tpm2_command_get_tpm_time (data->command), 0);
+    tpm2_command_add_tpm_time (data->command, 100);
+    tpm2_command_add_tpm_time (data->command, -5);
+    assert_int_equal (tpm2_command_get_tpm_time (data->command), 100);
+}
 static void
 tpm2_command_get_buffer_test (void **state)
 {
@@ -424,6 +500,24 @@ tpm2_command_set_handle_second_test (void **state)
     handle_out = tpm2_command_get_handle (data->command, 1);
     assert_int_equal (handle_out, handle_in);
 }
+/*
+ * The handle the client sent is kept when it's first replaced.
+ */
+static void
+tpm2_command_get_client_handle_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPM2_HANDLE   handle_client;
+
+    handle_client = tpm2_command_get_handle (data->command, 0);
+    assert_int_equal (tpm2_command_get_client_handle (data->command, 0),
+                      handle_client);
+    assert_true (tpm2_command_set_handle (data->command, 0x80000001, 0));
+    assert_true (tpm2_command_set_handle (data->command, 0x80000002, 0));
+    assert_int_equal (tpm2_command_get_client_handle (data->command, 0),
+                      handle_client);
+    assert_int_equal (tpm2_command_get_handle (data->command, 0), 0x80000002);
+}
 static void
 tpm2_command_set_handle_fail_test (void **state)
 {
@@ -510,6 +604,149 @@ tpm2_command_foreach_auth_test (void **state)
                                tpm2_command_foreach_auth_callback,
                                &callback_state);
 }
+/*
+ * Handles from both the handle area and the authorization area are
+ * referenced by the command.
+ */
+static void
+tpm2_command_references_handle_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (tpm2_command_references_handle (data->command, 0x01500020));
+    assert_true (tpm2_command_references_handle (data->command, 0x02000000));
+    assert_true (tpm2_command_references_handle (data->command, 0x02000001));
+    assert_false (tpm2_command_references_handle (data->command, 0x02000002));
+}
+/*
+ * The layout of the command is parsed when it's created: two handles, two
+ * authorizations and the parameters after the 0x92 byte auth area.
+ */
+static void
+tpm2_command_index_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_int_equal (tpm2_command_get_handle_count (data->command), 2);
+    assert_int_equal (tpm2_command_get_auth_count (data->command), 2);
+    assert_int_equal (tpm2_command_get_params_offset (data->command),
+                      TPM_HEADER_SIZE + 2 * sizeof (TPM2_HANDLE) +
+                      sizeof (UINT32) + 0x92);
+}
+/*
+ * An auth area whose size doesn't match the authorizations in it is
+ * malformed: the authorizations aren't iterated.
+ */
+static void
+tpm2_command_index_malformed_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    callback_auth_state_t callback_state = {
+        .handles_count = 0,
+    };
+    guint8 *buffer;
+
+    buffer = g_malloc (sizeof (cmd_with_auths));
+    memcpy (buffer, cmd_with_auths, sizeof (cmd_with_auths));
+    /* one byte short of the two authorizations */
+    buffer [21] = 0x91;
+    command = tpm2_command_new (data->connection,
+                                buffer,
+                                sizeof (cmd_with_auths),
+                                2 << 25);
+    callback_state.command = command;
+    assert_int_equal (tpm2_command_get_auth_count (command), 0);
+    assert_int_equal (tpm2_command_get_params_offset (command), 0);
+    assert_false (tpm2_command_foreach_auth (command,
+                                             tpm2_command_foreach_auth_callback,
+                                             &callback_state));
+    assert_false (tpm2_command_references_handle (command, 0x02000000));
+    g_object_unref (command);
+}
+/*
+ * Create a command from a copy of 'cmd_with_auths' with the size in the
+ * header fixed up, byte 'offset' set to 'value' and check it.
+ */
+static TSS2_RC
+tpm2_command_check_auths (Connection *connection,
+                          size_t      offset,
+                          guint8      value)
+{
+    Tpm2Command *command;
+    guint8 *buffer;
+    TSS2_RC rc;
+
+    buffer = g_malloc (sizeof (cmd_with_auths));
+    memcpy (buffer, cmd_with_auths, sizeof (cmd_with_auths));
+    buffer [5] = sizeof (cmd_with_auths);
+    buffer [offset] = value;
+    command = tpm2_command_new (connection,
+                                buffer,
+                                sizeof (cmd_with_auths),
+                                2 << 25);
+    rc = tpm2_command_check (command);
+    g_object_unref (command);
+    return rc;
+}
+/*
+ * A command is only passed on if its tag is known, its size matches the
+ * header, and its handle and auth areas fit the command.
+ */
+static void
+tpm2_command_check_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_int_equal (tpm2_command_check (data->command),
+                      RM_RC (TPM2_RC_COMMAND_SIZE));
+    assert_int_equal (tpm2_command_check_auths (data->connection, 5,
+                                                sizeof (cmd_with_auths)),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_command_check_auths (data->connection, 1, 0x03),
+                      RM_RC (TPM2_RC_BAD_TAG));
+    /* one byte short of the two authorizations */
+    assert_int_equal (tpm2_command_check_auths (data->connection, 21, 0x91),
+                      RM_RC (TPM2_RC_AUTHSIZE));
+    /* an empty auth area */
+    assert_int_equal (tpm2_command_check_auths (data->connection, 21, 0x00),
+                      RM_RC (TPM2_RC_AUTHSIZE));
+}
+/*
+ * A command too short for the handles its command code takes is refused.
+ */
+static void
+tpm2_command_check_handles_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_int_equal (tpm2_command_check (data->command),
+                      RM_RC (TPM2_RC_INSUFFICIENT));
+}
+/*
+ * The flags for a command come from its command code: NV_Write has none,
+ * FlushContext must go through command_special_processing.
+ */
+static void
+tpm2_command_flags_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    guint8 *buffer;
+
+    assert_int_equal (tpm2_command_get_flags (data->command), 0);
+    buffer = g_malloc (sizeof (cmd_buf_context_flush_no_handle));
+    memcpy (buffer,
+            cmd_buf_context_flush_no_handle,
+            sizeof (cmd_buf_context_flush_no_handle));
+    command = tpm2_command_new (data->connection,
+                                buffer,
+                                sizeof (cmd_buf_context_flush_no_handle),
+                                0);
+    assert_int_equal (tpm2_command_get_flags (command),
+                      TPM2_COMMAND_FLAG_SPECIAL);
+    g_object_unref (command);
+}
 static void
 tpm2_command_flush_context_handle_test (void **state)
 {
@@ -615,9 +852,18 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_command_type_test,
                                          tpm2_command_setup,
                                          tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_properties_test,
+                                         tpm2_command_setup,
+                                         tpm2_command_teardown),
         cmocka_unit_test_setup_teardown (tpm2_command_get_connection_test,
                                          tpm2_command_setup,
                                          tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_charge_test,
+                                         tpm2_command_setup,
+                                         tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_tpm_time_test,
+                                         tpm2_command_setup,
+                                         tpm2_command_teardown),
         cmocka_unit_test_setup_teardown (tpm2_command_get_buffer_test,
                                          tpm2_command_setup,
                                          tpm2_command_teardown),
@@ -651,6 +897,9 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_command_set_handle_second_test,
                                          tpm2_command_setup_two_handles,
                                          tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_get_client_handle_test,
+                                         tpm2_command_setup_two_handles,
+                                         tpm2_command_teardown),
         cmocka_unit_test_setup_teardown (tpm2_command_set_handle_fail_test,
                                          tpm2_command_setup_two_handles,
                                          tpm2_command_teardown),
@@ -660,6 +909,24 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_command_foreach_auth_test,
                                          tpm2_command_setup_with_auths,
                                          tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_references_handle_test,
+                                         tpm2_command_setup_with_auths,
+                                         tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_index_test,
+                                         tpm2_command_setup_with_auths,
+                                         tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_index_malformed_test,
+                                         tpm2_command_setup_with_auths,
+                                         tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_check_test,
+                                         tpm2_command_setup_with_auths,
+                                         tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_check_handles_test,
+                                         tpm2_command_setup_two_handles_not_three,
+                                         tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_flags_test,
+                                         tpm2_command_setup_with_auths,
+                                         tpm2_command_teardown),
         cmocka_unit_test_setup_teardown (tpm2_command_flush_context_handle_test,
                                          tpm2_command_setup_flush_context_no_handle,
                                          tpm2_command_teardown),
@@ -5,11 +5,14 @@
  */
 #include <glib.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <setjmp.h>
 #include <cmocka.h>
 
+#include "tabrmd.h"
 #include "tpm2.h"
 #include "tpm2-header.h"
 #include "tpm2-response.h"
@@ -43,36 +46,17 @@ typedef struct test_data {
 } test_data_t;
 
 TSS2_RC
-__wrap_Tss2_Sys_FlushContext (TSS2_SYS_CONTEXT *sysContext,
-                              TPM2_HANDLE handle)
+__wrap_Tss2_Sys_ReadClock (TSS2_SYS_CONTEXT *sysContext,
+                           TSS2L_SYS_AUTH_COMMAND const *cmdAuthsArray,
+                           TPMS_TIME_INFO *currentTime,
+                           TSS2L_SYS_AUTH_RESPONSE *rspAuthsArray)
 {
     UNUSED_PARAM (sysContext);
-    UNUSED_PARAM (handle);
-
-    return mock_type (TSS2_RC);
-}
-
-TSS2_RC
-__wrap_Tss2_Sys_ContextSave (TSS2_SYS_CONTEXT *sysContext,
-                             TPM2_HANDLE handle,
-                             TPMS_CONTEXT *context)
-{
-    UNUSED_PARAM (sysContext);
-    UNUSED_PARAM (handle);
-    UNUSED_PARAM (context);
-
-    return mock_type (TSS2_RC);
-}
-
-TSS2_RC
-__wrap_Tss2_Sys_ContextLoad (TSS2_SYS_CONTEXT *sysContext,
-                             TPMS_CONTEXT *context,
-                             TPM2_HANDLE *handle)
-{
-    UNUSED_PARAM (sysContext);
-    UNUSED_PARAM (context);
-    UNUSED_PARAM (handle);
+    UNUSED_PARAM (cmdAuthsArray);
+    UNUSED_PARAM (rspAuthsArray);
 
+    currentTime->clockInfo.resetCount = mock_type (UINT32);
+    currentTime->clockInfo.restartCount = mock_type (UINT32);
     return mock_type (TSS2_RC);
 }
 TSS2_RC
@@ -128,7 +112,6 @@ __wrap_Tss2_Sys_GetCapability (TSS2_SYS_CONTEXT         *sysContext,
     UNUSED_PARAM(rspAuthsArray);
 
     TPML_TAGGED_TPM_PROPERTY *tpmProperties;
-    TPML_HANDLE *handles;
     TSS2_RC rc;
 
     rc = mock_type (TSS2_RC);
@@ -144,13 +127,6 @@ __wrap_Tss2_Sys_GetCapability (TSS2_SYS_CONTEXT         *sysContext,
                 tpmProperties,
                 sizeof (*tpmProperties));
         break;
-    case TPM2_CAP_HANDLES:
-        capabilityData->capability = TPM2_CAP_HANDLES;
-        handles = mock_type (TPML_HANDLE*);
-        memcpy (&capabilityData->data.handles,
-                handles,
-                sizeof (*handles));
-        break;
     default:
         g_error ("%s does not understand this capability type", __func__);
     }
@@ -328,6 +304,30 @@ tpm2_get_max_response_test (void **state)
                       TSS2_RC_SUCCESS);
     assert_int_equal (value, MAX_RESPONSE_VALUE);
 }
+/*
+ * Properties from the fixed group that the TPM didn't report, and
+ * properties outside of the fixed group, can't be read from the cache.
+ */
+static void
+tpm2_get_fixed_property_bad_value_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint32 value = 0;
+
+    assert_int_equal (tpm2_get_fixed_property (data->tpm2,
+                                               TPM2_PT_MAX_COMMAND_SIZE,
+                                               &value),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (value, MAX_COMMAND_VALUE);
+    assert_int_equal (tpm2_get_fixed_property (data->tpm2,
+                                               TPM2_PT_MANUFACTURER,
+                                               &value),
+                      TSS2_RESMGR_RC_BAD_VALUE);
+    assert_int_equal (tpm2_get_fixed_property (data->tpm2,
+                                               TPM2_PT_HR_LOADED,
+                                               &value),
+                      TSS2_RESMGR_RC_BAD_VALUE);
+}
 
 static void*
 lock_thread (void *param)
@@ -446,15 +446,215 @@ tpm2_send_command_success (void **state)
     assert_int_equal (connection, data->connection);
     g_object_unref (connection);
 }
+/*
+ * A command the TPM doesn't answer in time, even once canceled, fails
+ * with TSS2_RESMGR_RC_TPM_TIMEOUT. The next command isn't sent until the
+ * response owed for it comes in.
+ */
+static void
+tpm2_send_command_timeout_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    uint8_t buf [TPM_RESPONSE_HEADER_SIZE] = { 0 };
+    TSS2_RC rc;
+
+    response_buffer_set_rc (buf, TSS2_RC_SUCCESS);
+    tpm2_set_timeout (data->tpm2, 10);
+    will_return (tcti_mock_transmit, TSS2_RC_SUCCESS);
+    will_return_count (tcti_mock_receive, NULL, 2);
+    will_return_count (tcti_mock_receive, 0, 2);
+    will_return_count (tcti_mock_receive, TSS2_TCTI_RC_TRY_AGAIN, 2);
+    data->response = tpm2_send_command (data->tpm2, data->command, &rc);
+    assert_int_equal (rc, TSS2_RESMGR_RC_TPM_TIMEOUT);
+    assert_int_equal (tpm2_response_get_code (data->response),
+                      TSS2_RESMGR_RC_TPM_TIMEOUT);
+    g_clear_object (&data->response);
+    /* still no response: this one fails without being sent */
+    will_return (tcti_mock_receive, NULL);
+    will_return (tcti_mock_receive, 0);
+    will_return (tcti_mock_receive, TSS2_TCTI_RC_TRY_AGAIN);
+    data->response = tpm2_send_command (data->tpm2, data->command, &rc);
+    assert_int_equal (rc, TSS2_RESMGR_RC_TPM_TIMEOUT);
+    g_clear_object (&data->response);
+    /* the stale response comes in, then this one is sent */
+    will_return (tcti_mock_receive, buf);
+    will_return (tcti_mock_receive, sizeof (buf));
+    will_return (tcti_mock_receive, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_transmit, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_receive, buf);
+    will_return (tcti_mock_receive, sizeof (buf));
+    will_return (tcti_mock_receive, TSS2_RC_SUCCESS);
+    data->response = tpm2_send_command (data->tpm2, data->command, &rc);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+}
+static void
+tpm2_overlap_func_count (gpointer user_data)
+{
+    guint *count = (guint*)user_data;
+    (*count)++;
+}
+/*
+ * The overlap function must be called once between transmitting the
+ * command and receiving the response, and not at all if the command
+ * couldn't be transmitted.
+ */
+static void
+tpm2_send_command_overlap_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_RC rc;
+    guint count = 0;
+    uint8_t buf [TPM_RESPONSE_HEADER_SIZE] = { 0 };
+
+    response_buffer_set_rc (buf, TSS2_RC_SUCCESS);
+    tpm2_set_overlap_func (data->tpm2, tpm2_overlap_func_count, &count);
+
+    will_return (tcti_mock_transmit, 99);
+    data->response = tpm2_send_command (data->tpm2, data->command, &rc);
+    assert_int_equal (rc, 99);
+    assert_int_equal (count, 0);
+    g_clear_object (&data->response);
+
+    will_return (tcti_mock_transmit, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_receive, buf);
+    will_return (tcti_mock_receive, sizeof (buf));
+    will_return (tcti_mock_receive, TSS2_RC_SUCCESS);
+    data->response = tpm2_send_command (data->tpm2, data->command, &rc);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (count, 1);
+    tpm2_set_overlap_func (data->tpm2, NULL, NULL);
+}
+/*
+ * A TCTI with poll handles: the test holds the write end of 'poll_pipe'
+ * and makes the response ready by writing to it.
+ */
+static int poll_pipe [2] = { -1, -1 };
+static TSS2_RC
+tcti_mock_get_poll_handles (TSS2_TCTI_CONTEXT     *context,
+                            TSS2_TCTI_POLL_HANDLE *handles,
+                            size_t                *num_handles)
+{
+    UNUSED_PARAM (context);
+    *num_handles = 1;
+    if (handles != NULL) {
+        handles [0].fd = poll_pipe [0];
+        handles [0].events = POLLIN | POLLOUT;
+    }
+    return TSS2_RC_SUCCESS;
+}
+static void*
+poll_pipe_thread (void *arg)
+{
+    UNUSED_PARAM (arg);
+    g_usleep (4 * TPM2_POLL_INTERVAL * G_TIME_SPAN_MILLISECOND);
+    assert_int_equal (write (poll_pipe [1], "", 1), 1);
+    return NULL;
+}
+/*
+ * When the TCTI can be polled the overlap function is called again each
+ * TPM2_POLL_INTERVAL until the response is ready.
+ */
+static void
+tpm2_send_command_overlap_poll_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_TCTI_CONTEXT *context = tcti_peek_context (data->tpm2->tcti);
+    TSS2_RC rc;
+    guint count = 0;
+    uint8_t buf [TPM_RESPONSE_HEADER_SIZE] = { 0 };
+    pthread_t thread_id;
+
+    assert_int_equal (pipe (poll_pipe), 0);
+    TSS2_TCTI_GET_POLL_HANDLES (context) = tcti_mock_get_poll_handles;
+    response_buffer_set_rc (buf, TSS2_RC_SUCCESS);
+    tpm2_set_overlap_func (data->tpm2, tpm2_overlap_func_count, &count);
+
+    assert_int_equal (pthread_create (&thread_id, NULL, poll_pipe_thread, NULL),
+                      0);
+    will_return (tcti_mock_transmit, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_receive, buf);
+    will_return (tcti_mock_receive, sizeof (buf));
+    will_return (tcti_mock_receive, TSS2_RC_SUCCESS);
+    data->response = tpm2_send_command (data->tpm2, data->command, &rc);
+    pthread_join (thread_id, NULL);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_true (count > 1);
+    tpm2_set_overlap_func (data->tpm2, NULL, NULL);
+    TSS2_TCTI_GET_POLL_HANDLES (context) = NULL;
+    close (poll_pipe [0]);
+    close (poll_pipe [1]);
+}
+
+/*
+ * Have the mock TCTI answer the next command with a response carrying
+ * 'rc' and the 'size' bytes of 'body'. The response is built in 'buf',
+ * which must stay around until it's received.
+ */
+static void
+will_return_response (uint8_t    *buf,
+                      TSS2_RC     rc,
+                      const void *body,
+                      size_t      size)
+{
+    assert_int_equal (tpm2_header_init (buf,
+                                        TPM_HEADER_SIZE + size,
+                                        TPM2_ST_NO_SESSIONS,
+                                        TPM_HEADER_SIZE + size,
+                                        rc),
+                      TSS2_RC_SUCCESS);
+    if (size > 0) {
+        memcpy (&buf [TPM_HEADER_SIZE], body, size);
+    }
+    will_return (tcti_mock_transmit, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_receive, buf);
+    will_return (tcti_mock_receive, TPM_HEADER_SIZE + size);
+    will_return (tcti_mock_receive, TSS2_RC_SUCCESS);
+}
+/*
+ * Have the mock TCTI answer the next command with a GetCapability
+ * response listing the handles in 'handles'. The response is built in
+ * 'buf', which must have room for TPM_HEADER_SIZE + HANDLES_BODY_SIZE (n)
+ * bytes.
+ */
+#define HANDLES_BODY_SIZE(n) \
+    (sizeof (TPMI_YES_NO) + sizeof (TPM2_CAP) + sizeof (UINT32) + \
+     (n) * sizeof (TPM2_HANDLE))
+static void
+will_return_handles (uint8_t           *buf,
+                     TPML_HANDLE const *handles)
+{
+    uint8_t body [HANDLES_BODY_SIZE (TPM2_MAX_CAP_HANDLES)] = { TPM2_NO, };
+    UINT32 i;
+
+    *(TPM2_CAP*)&body [sizeof (TPMI_YES_NO)] = htobe32 (TPM2_CAP_HANDLES);
+    *(UINT32*)&body [sizeof (TPMI_YES_NO) + sizeof (TPM2_CAP)] =
+        htobe32 (handles->count);
+    for (i = 0; i < handles->count; ++i) {
+        *(TPM2_HANDLE*)&body [HANDLES_BODY_SIZE (i)] =
+            htobe32 (handles->handle [i]);
+    }
+    will_return_response (buf,
+                          TSS2_RC_SUCCESS,
+                          body,
+                          HANDLES_BODY_SIZE (handles->count));
+}
+/* a marshalled TPMS_CONTEXT as a ContextSave response carries it */
+static const uint8_t context_blob [] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x05, /* sequence */
+    0x80, 0x00, 0x00, 0x00,                         /* savedHandle */
+    0x40, 0x00, 0x00, 0x01,                         /* hierarchy */
+    0x00, 0x02, 0xab, 0xcd,                         /* contextBlob */
+};
 
 static void
 tpm2_get_trans_object_count_caps_fail (void **state)
 {
     TSS2_RC rc;
     uint32_t count = 0;
+    uint8_t buf [TPM_HEADER_SIZE];
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_GetCapability, TPM2_RC_DISABLED);
+    will_return_response (buf, TPM2_RC_DISABLED, NULL, 0);
     rc = tpm2_get_trans_object_count (data->tpm2, &count);
     assert_int_equal (rc, TPM2_RC_DISABLED);
 }
@@ -469,13 +669,61 @@ tpm2_get_trans_object_count_success (void **state)
         .count = 2,
        .handle = { 555, 444 },
     };
+    uint8_t buf [TPM_HEADER_SIZE + HANDLES_BODY_SIZE (2)];
 
-    will_return (__wrap_Tss2_Sys_GetCapability, TPM2_RC_SUCCESS);
-    will_return (__wrap_Tss2_Sys_GetCapability, &handle);
+    will_return_handles (buf, &handle);
     rc = tpm2_get_trans_object_count (data->tpm2, &count);
     assert_int_equal (rc, TPM2_RC_SUCCESS);
     assert_int_equal (count, handle.count);
 }
+/*
+ * The handles in the response are read back in order.
+ */
+static void
+tpm2_get_handles_test (void **state)
+{
+    TPML_HANDLE handles = { 0, };
+    TPML_HANDLE response = {
+        .count = 2,
+        .handle = { TPM2_TRANSIENT_FIRST, TPM2_TRANSIENT_FIRST + 2 },
+    };
+    uint8_t buf [TPM_HEADER_SIZE + HANDLES_BODY_SIZE (2)];
+    test_data_t *data = (test_data_t*)*state;
+
+    will_return_handles (buf, &response);
+    assert_int_equal (tpm2_get_handles (data->tpm2,
+                                        TPM2_TRANSIENT_FIRST,
+                                        TPM2_TRANSIENT_LAST,
+                                        &handles),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (handles.count, 2);
+    assert_int_equal (handles.handle [0], TPM2_TRANSIENT_FIRST);
+    assert_int_equal (handles.handle [1], TPM2_TRANSIENT_FIRST + 2);
+}
+/*
+ * A response that ends before the count of handles it claims only yields
+ * the handles it holds.
+ */
+static void
+tpm2_get_handles_short_test (void **state)
+{
+    TPML_HANDLE handles = { 0, };
+    uint8_t body [HANDLES_BODY_SIZE (1)] = { TPM2_NO, };
+    uint8_t buf [TPM_HEADER_SIZE + HANDLES_BODY_SIZE (1)];
+    test_data_t *data = (test_data_t*)*state;
+
+    *(TPM2_CAP*)&body [sizeof (TPMI_YES_NO)] = htobe32 (TPM2_CAP_HANDLES);
+    *(UINT32*)&body [sizeof (TPMI_YES_NO) + sizeof (TPM2_CAP)] = htobe32 (2);
+    *(TPM2_HANDLE*)&body [HANDLES_BODY_SIZE (0)] = htobe32 (TPM2_TRANSIENT_FIRST);
+    will_return_response (buf, TSS2_RC_SUCCESS, body, sizeof (body));
+    assert_int_equal (tpm2_get_handles (data->tpm2,
+                                        TPM2_TRANSIENT_FIRST,
+                                        TPM2_TRANSIENT_LAST,
+                                        &handles),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (handles.count, 1);
+    assert_int_equal (handles.handle [0], TPM2_TRANSIENT_FIRST);
+}
 
 static void
 tpm2_sapi_context_init_fail (void **state)
@@ -496,39 +744,73 @@ static void
 tpm2_context_load_test (void **state)
 {
     TSS2_RC rc;
-    TPMS_CONTEXT context = { 0, };
+    GBytes *context;
     TPM2_HANDLE handle = 0;
+    uint8_t handle_out [] = { 0x80, 0x00, 0x00, 0x01 };
+    uint8_t buf [TPM_HEADER_SIZE + sizeof (handle_out)];
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_ContextLoad, TSS2_RC_SUCCESS);
-    rc = tpm2_context_load (data->tpm2, &context, &handle);
+    context = g_bytes_new_static (context_blob, sizeof (context_blob));
+    will_return_response (buf, TSS2_RC_SUCCESS, handle_out, sizeof (handle_out));
+    rc = tpm2_context_load (data->tpm2, context, &handle);
     assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (handle, 0x80000001);
+    g_bytes_unref (context);
 }
 
 static void
 tpm2_context_load_fail (void **state)
 {
     TSS2_RC rc;
-    TPMS_CONTEXT context = { 0, };
+    GBytes *context;
     TPM2_HANDLE handle = 0;
+    uint8_t buf [TPM_HEADER_SIZE];
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_ContextLoad, TPM2_RC_FAILURE);
-    rc = tpm2_context_load (data->tpm2, &context, &handle);
+    context = g_bytes_new_static (context_blob, sizeof (context_blob));
+    will_return_response (buf, TPM2_RC_FAILURE, NULL, 0);
+    rc = tpm2_context_load (data->tpm2, context, &handle);
     assert_int_equal (rc, TPM2_RC_FAILURE);
+    g_bytes_unref (context);
 }
-
+/*
+ * The body of the ContextSave response is handed back as it is.
+ */
 static void
 tpm2_context_save_test (void **state)
 {
     TSS2_RC rc;
-    TPMS_CONTEXT context = { 0, };
-    TPM2_HANDLE handle = 0;
+    GBytes *context = NULL;
+    TPM2_HANDLE handle = 0x80000000;
+    uint8_t buf [TPM_HEADER_SIZE + sizeof (context_blob)];
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_ContextSave, TPM2_RC_SUCCESS);
+    will_return_response (buf, TPM2_RC_SUCCESS, context_blob,
+                          sizeof (context_blob));
     rc = tpm2_context_save (data->tpm2, handle, &context);
     assert_int_equal (rc, TPM2_RC_SUCCESS);
+    assert_non_null (context);
+    assert_int_equal (g_bytes_get_size (context), sizeof (context_blob));
+    assert_memory_equal (g_bytes_get_data (context, NULL),
+                         context_blob,
+                         sizeof (context_blob));
+    g_bytes_unref (context);
+}
+
+static void
+tpm2_read_clock_test (void **state)
+{
+    TSS2_RC rc;
+    TPMS_TIME_INFO time_info = { 0, };
+    test_data_t *data = (test_data_t*)*state;
+
+    will_return (__wrap_Tss2_Sys_ReadClock, 3);
+    will_return (__wrap_Tss2_Sys_ReadClock, 5);
+    will_return (__wrap_Tss2_Sys_ReadClock, TPM2_RC_SUCCESS);
+    rc = tpm2_read_clock (data->tpm2, &time_info);
+    assert_int_equal (rc, TPM2_RC_SUCCESS);
+    assert_int_equal (time_info.clockInfo.resetCount, 3);
+    assert_int_equal (time_info.clockInfo.restartCount, 5);
 }
 
 static void
@@ -536,52 +818,118 @@ tpm2_context_flush_fail (void **state)
 {
     TSS2_RC rc;
     TPM2_HANDLE handle = 0;
+    uint8_t buf [TPM_HEADER_SIZE];
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_FlushContext, TPM2_RC_FAILURE);
+    will_return_response (buf, TPM2_RC_FAILURE, NULL, 0);
     rc = tpm2_context_flush (data->tpm2, handle);
     assert_int_equal (rc, TPM2_RC_FAILURE);
 }
+/*
+ * The FlushContext is built in place: a header without sessions and the
+ * handle.
+ */
+static void
+tpm2_context_flush_template_test (void **state)
+{
+    uint8_t buf [TPM_HEADER_SIZE];
+    uint8_t const expected [] = {
+        0x80, 0x01,             /* TPM2_ST_NO_SESSIONS */
+        0x00, 0x00, 0x00, 0x0e, /* size */
+        0x00, 0x00, 0x01, 0x65, /* TPM2_CC_FlushContext */
+        0x80, 0x00, 0x00, 0x02, /* handle */
+    };
+    test_data_t *data = (test_data_t*)*state;
+
+    will_return_response (buf, TPM2_RC_SUCCESS, NULL, 0);
+    assert_int_equal (tpm2_context_flush (data->tpm2, 0x80000002),
+                      TPM2_RC_SUCCESS);
+    assert_memory_equal (data->tpm2->command_buffer,
+                         expected,
+                         sizeof (expected));
+}
 
 static void
 tpm2_context_saveflush_save_fail (void **state)
 {
     TSS2_RC rc;
-    TPMS_CONTEXT context = { 0, };
+    GBytes *context = NULL;
     TPM2_HANDLE handle = 0;
+    uint8_t buf [TPM_HEADER_SIZE];
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_ContextSave, TPM2_RC_FAILURE);
+    will_return_response (buf, TPM2_RC_FAILURE, NULL, 0);
     rc = tpm2_context_saveflush (data->tpm2, handle, &context);
     assert_int_equal (rc, TPM2_RC_FAILURE);
+    assert_null (context);
 }
 
 static void
 tpm2_context_saveflush_flush_fail (void **state)
 {
     TSS2_RC rc;
-    TPMS_CONTEXT context = { 0, };
+    GBytes *context = NULL;
     TPM2_HANDLE handle = 0;
+    uint8_t buf [TPM_HEADER_SIZE + sizeof (context_blob)];
+    uint8_t flush_buf [TPM_HEADER_SIZE];
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_ContextSave, TPM2_RC_SUCCESS);
-    will_return (__wrap_Tss2_Sys_FlushContext, TPM2_RC_FAILURE);
+    will_return_response (buf, TPM2_RC_SUCCESS, context_blob,
+                          sizeof (context_blob));
+    will_return_response (flush_buf, TPM2_RC_FAILURE, NULL, 0);
     rc = tpm2_context_saveflush (data->tpm2, handle, &context);
     assert_int_equal (rc, TPM2_RC_FAILURE);
+    assert_null (context);
+}
+
+/*
+ * A failure to save one context in a batch must not stop the rest of the
+ * batch from being saved and flushed.
+ */
+static void
+tpm2_context_saveflush_batch_test (void **state)
+{
+    GBytes *contexts [3];
+    TPM2_HANDLE handles [3] = { 0x80000000, 0x80000001, 0x80000002 };
+    TSS2_RC rcs [3];
+    uint8_t bufs [3][TPM_HEADER_SIZE + sizeof (context_blob)];
+    uint8_t flush_bufs [2][TPM_HEADER_SIZE];
+    test_data_t *data = (test_data_t*)*state;
+
+    will_return_response (bufs [0], TPM2_RC_SUCCESS, context_blob,
+                          sizeof (context_blob));
+    will_return_response (flush_bufs [0], TPM2_RC_SUCCESS, NULL, 0);
+    will_return_response (bufs [1], TPM2_RC_FAILURE, NULL, 0);
+    will_return_response (bufs [2], TPM2_RC_SUCCESS, context_blob,
+                          sizeof (context_blob));
+    will_return_response (flush_bufs [1], TPM2_RC_SUCCESS, NULL, 0);
+    assert_int_equal (tpm2_context_saveflush_batch (data->tpm2,
+                                                    handles,
+                                                    contexts,
+                                                    rcs,
+                                                    3),
+                      2);
+    assert_int_equal (rcs [0], TSS2_RC_SUCCESS);
+    assert_int_equal (rcs [1], TPM2_RC_FAILURE);
+    assert_int_equal (rcs [2], TSS2_RC_SUCCESS);
+    assert_non_null (contexts [0]);
+    assert_null (contexts [1]);
+    assert_non_null (contexts [2]);
+    g_bytes_unref (contexts [0]);
+    g_bytes_unref (contexts [2]);
 }
 
 static void
 tpm2_flush_all_unlocked_getcap_fail (void **state)
 {
     TSS2_RC rc;
-    TSS2_SYS_CONTEXT *sys_ctx = (TSS2_SYS_CONTEXT*)0x1;
+    uint8_t buf [TPM_HEADER_SIZE];
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_GetCapability, TPM2_RC_FAILURE);
+    will_return_response (buf, TPM2_RC_FAILURE, NULL, 0);
     rc = tpm2_flush_all_unlocked (data->tpm2,
-                                           sys_ctx,
-                                           TPM2_ACTIVE_SESSION_FIRST,
-                                           TPM2_ACTIVE_SESSION_LAST);
+                                  TPM2_ACTIVE_SESSION_FIRST,
+                                  TPM2_ACTIVE_SESSION_LAST);
     assert_int_equal (rc, TPM2_RC_FAILURE);
 }
 
@@ -589,23 +937,53 @@ static void
 tpm2_flush_all_unlocked_flush_fail (void **state)
 {
     TSS2_RC rc;
-    TSS2_SYS_CONTEXT *sys_ctx = (TSS2_SYS_CONTEXT*)0x1;
     test_data_t *data = (test_data_t*)*state;
     TPML_HANDLE handle = {
         .count = 1,
-       .handle = { 555 },
+       .handle = { TPM2_ACTIVE_SESSION_FIRST },
     };
+    uint8_t buf [TPM_HEADER_SIZE + HANDLES_BODY_SIZE (1)];
+    uint8_t flush_buf [TPM_HEADER_SIZE];
 
-    will_return (__wrap_Tss2_Sys_GetCapability, TPM2_RC_SUCCESS);
-    will_return (__wrap_Tss2_Sys_GetCapability, &handle);
-    will_return (__wrap_Tss2_Sys_FlushContext, TPM2_RC_FAILURE);
+    will_return_handles (buf, &handle);
+    will_return_response (flush_buf, TPM2_RC_FAILURE, NULL, 0);
     rc = tpm2_flush_all_unlocked (data->tpm2,
-                                           sys_ctx,
-                                           TPM2_ACTIVE_SESSION_FIRST,
-                                           TPM2_ACTIVE_SESSION_LAST);
+                                  TPM2_ACTIVE_SESSION_FIRST,
+                                  TPM2_ACTIVE_SESSION_LAST);
     assert_int_equal (rc, TPM2_RC_SUCCESS);
 }
 
+/*
+ * The handles of all three ranges are queried before the first flush and
+ * failures to flush don't stop the others.
+ */
+static void
+tpm2_flush_all_context_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPML_HANDLE active = {
+        .count = 1,
+        .handle = { TPM2_ACTIVE_SESSION_FIRST },
+    };
+    TPML_HANDLE loaded = { .count = 0, };
+    TPML_HANDLE transient = {
+        .count = 2,
+        .handle = { TPM2_TRANSIENT_FIRST, TPM2_TRANSIENT_FIRST + 1 },
+    };
+    uint8_t active_buf [TPM_HEADER_SIZE + HANDLES_BODY_SIZE (1)];
+    uint8_t loaded_buf [TPM_HEADER_SIZE + HANDLES_BODY_SIZE (0)];
+    uint8_t transient_buf [TPM_HEADER_SIZE + HANDLES_BODY_SIZE (2)];
+    uint8_t flush_bufs [3][TPM_HEADER_SIZE];
+
+    will_return_handles (active_buf, &active);
+    will_return_handles (loaded_buf, &loaded);
+    will_return_handles (transient_buf, &transient);
+    will_return_response (flush_bufs [0], TPM2_RC_SUCCESS, NULL, 0);
+    will_return_response (flush_bufs [1], TPM2_RC_FAILURE, NULL, 0);
+    will_return_response (flush_bufs [2], TPM2_RC_SUCCESS, NULL, 0);
+    tpm2_flush_all_context (data->tpm2);
+}
+
 int
 main (void)
 {
@@ -628,6 +1006,9 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_get_max_response_test,
                                          tpm2_setup_with_init,
                                          tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_get_fixed_property_bad_value_test,
+                                         tpm2_setup_with_init,
+                                         tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_lock_test,
                                          tpm2_setup_with_init,
                                          tpm2_teardown),
@@ -640,12 +1021,27 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_send_command_success,
                                          tpm2_setup_with_command,
                                          tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_send_command_timeout_test,
+                                         tpm2_setup_with_command,
+                                         tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_send_command_overlap_test,
+                                         tpm2_setup_with_command,
+                                         tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_send_command_overlap_poll_test,
+                                         tpm2_setup_with_command,
+                                         tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_get_trans_object_count_caps_fail,
                                          tpm2_setup_with_command,
                                          tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_get_trans_object_count_success,
                                          tpm2_setup_with_command,
                                          tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_get_handles_test,
+                                         tpm2_setup_with_init,
+                                         tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_get_handles_short_test,
+                                         tpm2_setup_with_init,
+                                         tpm2_teardown),
         cmocka_unit_test (tpm2_sapi_context_init_fail),
         cmocka_unit_test_setup_teardown (tpm2_context_load_test,
                                          tpm2_setup_with_init,
@@ -656,21 +1052,33 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_context_save_test,
                                          tpm2_setup_with_init,
                                          tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_read_clock_test,
+                                         tpm2_setup_with_init,
+                                         tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_context_flush_fail,
                                          tpm2_setup_with_init,
                                          tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_context_flush_template_test,
+                                         tpm2_setup_with_init,
+                                         tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_context_saveflush_save_fail,
                                          tpm2_setup_with_init,
                                          tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_context_saveflush_flush_fail,
                                          tpm2_setup_with_init,
                                          tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_context_saveflush_batch_test,
+                                         tpm2_setup_with_init,
+                                         tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_flush_all_unlocked_getcap_fail,
                                          tpm2_setup_with_init,
                                          tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_flush_all_unlocked_flush_fail,
                                          tpm2_setup_with_init,
                                          tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_flush_all_context_test,
+                                         tpm2_setup_with_init,
+                                         tpm2_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
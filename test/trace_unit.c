@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "trace.h"
+#include "util.h"
+
+typedef struct {
+    gchar    *dir;
+    gchar    *path;
+} test_data_t;
+
+static int
+trace_setup (void **state)
+{
+    test_data_t *data = g_new0 (test_data_t, 1);
+
+    data->dir = g_dir_make_tmp ("trace-unit-XXXXXX", NULL);
+    assert_non_null (data->dir);
+    data->path = g_build_filename (data->dir, "trace", NULL);
+
+    *state = data;
+    return 0;
+}
+static int
+trace_teardown (void **state)
+{
+    test_data_t *data = *state;
+
+    g_unlink (data->path);
+    g_rmdir (data->dir);
+    g_free (data->path);
+    g_free (data->dir);
+    g_free (data);
+    return 0;
+}
+/*
+ * Records are read back in the order they were written, with their
+ * connection IDs and increasing times. The file is complete once the
+ * Trace is released.
+ */
+static void
+trace_write_read_test (void **state)
+{
+    test_data_t *data = *state;
+    const guint8 command [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x01, 0x7b };
+    const guint8 response [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00 };
+    trace_header_t header;
+    trace_record_t record;
+    GError *error = NULL;
+    Trace *trace;
+    guint8 *buf;
+    FILE *file;
+
+    trace = trace_new (data->path, &error);
+    assert_non_null (trace);
+    trace_record (trace, TRACE_COMMAND, 7, command, sizeof (command));
+    trace_record (trace, TRACE_RESPONSE, 7, response, sizeof (response));
+    g_object_unref (trace);
+
+    file = trace_open_read (data->path, &header, &error);
+    assert_non_null (file);
+    assert_int_equal (header.version, TRACE_VERSION);
+    buf = trace_read_record (file, &record, &error);
+    assert_non_null (buf);
+    assert_int_equal (record.type, TRACE_COMMAND);
+    assert_int_equal (record.connection_id, 7);
+    assert_int_equal (record.size, sizeof (command));
+    assert_memory_equal (buf, command, sizeof (command));
+    g_free (buf);
+    buf = trace_read_record (file, &record, &error);
+    assert_non_null (buf);
+    assert_int_equal (record.type, TRACE_RESPONSE);
+    assert_memory_equal (buf, response, sizeof (response));
+    g_free (buf);
+    assert_null (trace_read_record (file, &record, &error));
+    assert_null (error);
+    fclose (file);
+}
+/*
+ * Recording accepts a NULL Trace so callers needn't check.
+ */
+static void
+trace_record_null_test (void **state)
+{
+    const guint8 command [] = { 0x80, 0x01 };
+    UNUSED_PARAM (state);
+
+    trace_record (NULL, TRACE_COMMAND, 1, command, sizeof (command));
+}
+static void
+trace_open_read_invalid_test (void **state)
+{
+    test_data_t *data = *state;
+    trace_header_t header;
+    GError *error = NULL;
+
+    assert_null (trace_open_read (data->path, &header, &error));
+    g_clear_error (&error);
+    assert_true (g_file_set_contents (data->path,
+                                      "garbage that isn't a trace header",
+                                      -1,
+                                      NULL));
+    assert_null (trace_open_read (data->path, &header, &error));
+    assert_non_null (error);
+    g_clear_error (&error);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (trace_write_read_test,
+                                         trace_setup,
+                                         trace_teardown),
+        cmocka_unit_test_setup_teardown (trace_record_null_test,
+                                         trace_setup,
+                                         trace_teardown),
+        cmocka_unit_test_setup_teardown (trace_open_read_invalid_test,
+                                         trace_setup,
+                                         trace_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
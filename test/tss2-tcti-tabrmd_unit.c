@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 #include <setjmp.h>
 #include <cmocka.h>
@@ -199,6 +200,81 @@ tcti_tabrmd_kv_callback_bad_key_test (void **state)
     rc = tabrmd_kv_callback (&key_value, &conf);
     assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
 }
+/*
+ * Ensure that the key "tpm" with a TPM index sets the 'tpm' field of the
+ * conf structure.
+ */
+static void
+tcti_tabrmd_kv_callback_tpm_good_test (void **state)
+{
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    key_value_t key_value = {
+        .key = "tpm",
+        .value = "2",
+    };
+    TSS2_RC rc;
+    UNUSED_PARAM(state);
+
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (conf.tpm, 2);
+}
+/*
+ * Ensure that a "tpm" value that isn't a number or is out of range returns
+ * the BAD_VALUE RC.
+ */
+static void
+tcti_tabrmd_kv_callback_tpm_bad_test (void **state)
+{
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    key_value_t key_value = {
+        .key = "tpm",
+        .value = "foo",
+    };
+    TSS2_RC rc;
+    UNUSED_PARAM(state);
+
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    key_value.value = "8";
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (conf.tpm, 0);
+}
+/*
+ * Ensure that the "transport" key selects the transport and that unknown
+ * transports return the BAD_VALUE RC.
+ */
+static void
+tcti_tabrmd_kv_callback_transport_test (void **state)
+{
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    key_value_t key_value = {
+        .key = "transport",
+        .value = "shm",
+    };
+    TSS2_RC rc;
+    UNUSED_PARAM(state);
+
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (conf.transport, TABRMD_TRANSPORT_SHM);
+    key_value.value = "socket";
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (conf.transport, TABRMD_TRANSPORT_SOCKET);
+    key_value.value = "tagged";
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (conf.transport, TABRMD_TRANSPORT_TAGGED);
+    key_value.value = "seqpacket";
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (conf.transport, TABRMD_TRANSPORT_SEQPACKET);
+    key_value.value = "pipe";
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+}
 /*
  * Ensure that a common config string selecting the session bus with
  * a user supplied name is parsed correctly.
@@ -364,6 +440,30 @@ tcti_tabrmd_proxy_new_fail (void **state)
     rc = Tss2_Tcti_Tabrmd_Init ((TSS2_TCTI_CONTEXT*)buf, &size, NULL);
     assert_int_equal (rc, TSS2_TCTI_RC_NO_CONNECTION);
 }
+/*
+ * Build the response to a CreateConnections call: the mocked connection
+ * count followed by the FD and ID of each connection.
+ */
+static GVariant*
+create_connections_response (GUnixFDList **out_fd_list)
+{
+    guint64 ids [2];
+    gint fds [2];
+    gint count, i;
+
+    count = mock_type (gint);
+    assert_true (count > 0 && count <= 2);
+    for (i = 0; i < count; ++i) {
+        fds [i] = mock_type (gint);
+        ids [i] = mock_type (guint64);
+    }
+    *out_fd_list = g_unix_fd_list_new_from_array (fds, count);
+    return g_variant_new ("(@at)",
+                          g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64,
+                                                     ids,
+                                                     count,
+                                                     sizeof (guint64)));
+}
 /*
  * This is a mock function to control return values from the connection
  * creation logic that invokes the DBus "CreateConnection" function exposed
@@ -386,7 +486,6 @@ __wrap_g_dbus_proxy_call_with_unix_fd_list_sync (
     gint client_fd;
     guint64 id;
     UNUSED_PARAM(proxy);
-    UNUSED_PARAM(method_name);
     UNUSED_PARAM(parameters);
     UNUSED_PARAM(flags);
     UNUSED_PARAM(timeout_msec);
@@ -395,6 +494,9 @@ __wrap_g_dbus_proxy_call_with_unix_fd_list_sync (
     UNUSED_PARAM(cancellable);
     UNUSED_PARAM(error);
 
+    if (strcmp (method_name, TABRMD_DBUS_METHOD_CREATE_CONNECTIONS) == 0) {
+        return create_connections_response (out_fd_list);
+    }
     client_fd = mock_type (gint);
     id = mock_type (guint64);
     *out_fd_list = g_unix_fd_list_new_from_array (&client_fd, 1);
@@ -447,6 +549,16 @@ __wrap_tcti_tabrmd_call_set_locality_sync (
     *out_return_code = mock_type (guint);
     return mock_type (gboolean);
 }
+/*
+ * The Features property of the mock proxy: the daemon takes no control
+ * frames, the tests that need them turn them on in the context.
+ */
+guint
+__wrap_tcti_tabrmd_get_features (TctiTabrmd *object)
+{
+    UNUSED_PARAM(object);
+    return 0;
+}
 /*
  * Structure to hold data relevant to tabrmd TCTI unit tests.
  */
@@ -630,6 +742,61 @@ tcti_tabrmd_transmit_success_test (void **state)
                       TABRMD_STATE_RECEIVE);
     assert_memory_equal (command_in, command_out, size);
 }
+/*
+ * A batch of two commands goes out as a single frame: an ignored request
+ * tag, the batch header with the flags, then each command with its tag.
+ * Both commands are counted as pending.
+ */
+static void
+tcti_tabrmd_submit_batch_test (void **state)
+{
+    data_t *data = *state;
+    uint8_t first [] = { 0x80, 0x01,
+                         0x00, 0x00, 0x00, 0x0a,
+                         0x00, 0x00, 0x01, 0x7b };
+    uint8_t second [] = { 0x80, 0x01,
+                          0x00, 0x00, 0x00, 0x0c,
+                          0x00, 0x00, 0x01, 0x7e,
+                          0x01, 0x02 };
+    uint8_t frame_expected [] = { 0x00, 0x00, 0x00, 0x00,
+                                  0xba, 0x7c,
+                                  0x00, 0x00, 0x00, 0x28,
+                                  0x00, 0x00, 0x00, 0x01,
+                                  0x00, 0x00, 0x00, 0x05,
+                                  0x80, 0x01,
+                                  0x00, 0x00, 0x00, 0x0a,
+                                  0x00, 0x00, 0x01, 0x7b,
+                                  0x00, 0x00, 0x00, 0x06,
+                                  0x80, 0x01,
+                                  0x00, 0x00, 0x00, 0x0c,
+                                  0x00, 0x00, 0x01, 0x7e,
+                                  0x01, 0x02 };
+    uint8_t frame [sizeof (frame_expected)] = { 0 };
+    const uint8_t *commands [] = { first, second };
+    size_t sizes [] = { sizeof (first), sizeof (second) };
+    uint32_t tags [] = { 5, 6 };
+    TSS2_RC rc;
+    ssize_t ret;
+
+    rc = Tss2_Tcti_Tabrmd_SubmitBatch (data->context,
+                                       TSS2_TCTI_TABRMD_BATCH_STOP_ON_ERROR,
+                                       2, tags, sizes, commands);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_SEQUENCE);
+    TSS2_TCTI_TABRMD_TAGGED (data->context) = TRUE;
+    rc = Tss2_Tcti_Tabrmd_SubmitBatch (data->context, 0x2, 2,
+                                       tags, sizes, commands);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    rc = Tss2_Tcti_Tabrmd_SubmitBatch (data->context,
+                                       TSS2_TCTI_TABRMD_BATCH_STOP_ON_ERROR,
+                                       2, tags, sizes, commands);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    ret = read (data->server_fd, frame, sizeof (frame));
+    assert_int_equal (ret, sizeof (frame));
+    assert_memory_equal (frame, frame_expected, sizeof (frame));
+    assert_int_equal (TSS2_TCTI_TABRMD_PENDING (data->context), 2);
+    assert_int_equal (TSS2_TCTI_TABRMD_STATE (data->context),
+                      TABRMD_STATE_TRANSMIT);
+}
 /*
  * This test ensures that the magic value in the context structure is checked
  * before the transmit function executes and that the RC is what we expect.
@@ -846,6 +1013,128 @@ tcti_tabrmd_set_locality_test (void **state)
     rc = tss2_tcti_tabrmd_set_locality (data->context, locality);
     assert_int_equal (rc, TSS2_RC_SUCCESS);
 }
+/*
+ * When the daemon takes control frames the locality is sent on the
+ * connection's socket instead of through D-Bus: the mock for the D-Bus
+ * call would fail the test if it were called.
+ */
+static void
+tcti_tabrmd_set_locality_control_test (void **state)
+{
+    data_t *data = *state;
+    uint8_t frame [TABRMD_CONTROL_SIZE + 1] = { 0 };
+    TSS2_RC rc;
+
+    TSS2_TCTI_TABRMD_CONTROL (data->context) = TRUE;
+    rc = tss2_tcti_tabrmd_set_locality (data->context, 3);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (read (data->server_fd, frame, sizeof (frame)),
+                      TABRMD_CONTROL_SIZE);
+    assert_int_equal (get_command_tag (frame), TABRMD_CONTROL_TAG);
+    assert_int_equal (get_command_size (frame), TABRMD_CONTROL_SIZE);
+    assert_int_equal (get_command_code (frame), TABRMD_CONTROL_SET_LOCALITY);
+    assert_int_equal (frame [TPM_HEADER_SIZE], 3);
+}
+/*
+ * The command timeout is sent in a control frame with a big endian UINT32
+ * once the daemon reports it takes it.
+ */
+static void
+tcti_tabrmd_set_command_timeout_test (void **state)
+{
+    data_t *data = *state;
+    uint8_t frame [TABRMD_CONTROL_TIMEOUT_SIZE + 1] = { 0 };
+    uint32_t timeout;
+    TSS2_RC rc;
+
+    TSS2_TCTI_TABRMD_CONTROL (data->context) = TRUE;
+    rc = Tss2_Tcti_Tabrmd_SetCommandTimeout (data->context, 2500);
+    assert_int_equal (rc, TSS2_TCTI_RC_NOT_IMPLEMENTED);
+    TSS2_TCTI_TABRMD_FEATURES (data->context) =
+        TABRMD_FEATURE_CONTROL | TABRMD_FEATURE_TIMEOUT;
+    rc = Tss2_Tcti_Tabrmd_SetCommandTimeout (data->context, 2500);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (read (data->server_fd, frame, sizeof (frame)),
+                      TABRMD_CONTROL_TIMEOUT_SIZE);
+    assert_int_equal (get_command_tag (frame), TABRMD_CONTROL_TAG);
+    assert_int_equal (get_command_size (frame), TABRMD_CONTROL_TIMEOUT_SIZE);
+    assert_int_equal (get_command_code (frame), TABRMD_CONTROL_SET_TIMEOUT);
+    memcpy (&timeout, &frame [TPM_HEADER_SIZE], sizeof (timeout));
+    assert_int_equal (GUINT32_FROM_BE (timeout), 2500);
+}
+/*
+ * A traceparent header is sent in binary in a control frame once the
+ * daemon reports it takes it. Malformed headers are refused.
+ */
+static void
+tcti_tabrmd_set_trace_parent_test (void **state)
+{
+    data_t *data = *state;
+    uint8_t frame [TABRMD_CONTROL_TRACE_CONTEXT_SIZE + 1] = { 0 };
+    const char *traceparent =
+        "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01";
+    TSS2_RC rc;
+
+    TSS2_TCTI_TABRMD_CONTROL (data->context) = TRUE;
+    rc = Tss2_Tcti_Tabrmd_SetTraceParent (data->context, traceparent);
+    assert_int_equal (rc, TSS2_TCTI_RC_NOT_IMPLEMENTED);
+    TSS2_TCTI_TABRMD_FEATURES (data->context) =
+        TABRMD_FEATURE_CONTROL | TABRMD_FEATURE_TRACE_CONTEXT;
+    rc = Tss2_Tcti_Tabrmd_SetTraceParent (data->context,
+        "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7");
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    rc = Tss2_Tcti_Tabrmd_SetTraceParent (data->context,
+        "00-00000000000000000000000000000000-00f067aa0ba902b7-01");
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    rc = Tss2_Tcti_Tabrmd_SetTraceParent (data->context,
+        "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902bz-01");
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    rc = Tss2_Tcti_Tabrmd_SetTraceParent (data->context, traceparent);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (read (data->server_fd, frame, sizeof (frame)),
+                      TABRMD_CONTROL_TRACE_CONTEXT_SIZE);
+    assert_int_equal (get_command_tag (frame), TABRMD_CONTROL_TAG);
+    assert_int_equal (get_command_code (frame),
+                      TABRMD_CONTROL_SET_TRACE_CONTEXT);
+    assert_int_equal (frame [TPM_HEADER_SIZE], 0x4b);
+    assert_int_equal (frame [TPM_HEADER_SIZE + 15], 0x36);
+    assert_int_equal (frame [TPM_HEADER_SIZE + 16], 0x00);
+    assert_int_equal (frame [TPM_HEADER_SIZE + 23], 0xb7);
+    assert_int_equal (frame [TPM_HEADER_SIZE + 24], TRACE_CONTEXT_FLAG_SAMPLED);
+}
+/*
+ * Channels are selected and closed with control frames carrying the
+ * channel once the daemon reports it supports them. Channel 0 is the
+ * connection itself and can't be closed.
+ */
+static void
+tcti_tabrmd_channel_test (void **state)
+{
+    data_t *data = *state;
+    uint8_t frame [TABRMD_CONTROL_SIZE + 1] = { 0 };
+    TSS2_RC rc;
+
+    TSS2_TCTI_TABRMD_CONTROL (data->context) = TRUE;
+    rc = Tss2_Tcti_Tabrmd_SetChannel (data->context, 4);
+    assert_int_equal (rc, TSS2_TCTI_RC_NOT_IMPLEMENTED);
+    TSS2_TCTI_TABRMD_FEATURES (data->context) =
+        TABRMD_FEATURE_CONTROL | TABRMD_FEATURE_CHANNELS;
+    rc = Tss2_Tcti_Tabrmd_SetChannel (data->context, 4);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (read (data->server_fd, frame, sizeof (frame)),
+                      TABRMD_CONTROL_SIZE);
+    assert_int_equal (get_command_tag (frame), TABRMD_CONTROL_TAG);
+    assert_int_equal (get_command_code (frame), TABRMD_CONTROL_SET_CHANNEL);
+    assert_int_equal (frame [TPM_HEADER_SIZE], 4);
+    rc = Tss2_Tcti_Tabrmd_CloseChannel (data->context, 0);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    rc = Tss2_Tcti_Tabrmd_CloseChannel (data->context, 4);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (read (data->server_fd, frame, sizeof (frame)),
+                      TABRMD_CONTROL_SIZE);
+    assert_int_equal (get_command_code (frame), TABRMD_CONTROL_CLOSE_CHANNEL);
+    assert_int_equal (frame [TPM_HEADER_SIZE], 4);
+}
 /*
  * This test invokes the set_locality function with the context in the RECEIVE
  * state. This should produce a BAD_SEQUENCE error.
@@ -861,6 +1150,147 @@ tcti_tabrmd_set_locality_bad_sequence_test (void **state)
     rc = tss2_tcti_tabrmd_set_locality (data->context, locality);
     assert_int_equal (rc, TSS2_TCTI_RC_BAD_SEQUENCE);
 }
+/*
+ * Initialize two contexts with a pool of 2 connections. The first Init
+ * fills the pool with a single CreateConnections call and the second takes
+ * the remaining connection without calling the daemon: the mock would
+ * fail the test if it were called again.
+ */
+static void
+tcti_tabrmd_init_pool_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context [2];
+    TctiTabrmdProxy *proxy [2];
+    size_t tcti_size = 0;
+    gint fds [2][2];
+    TSS2_RC rc;
+    size_t i;
+    UNUSED_PARAM(state);
+
+    rc = Tss2_Tcti_Tabrmd_Init (NULL, &tcti_size, NULL);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    for (i = 0; i < 2; ++i) {
+        context [i] = calloc (1, tcti_size);
+        proxy [i] = calloc (1, sizeof (TctiTabrmdProxy));
+        assert_int_equal (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds [i]), 0);
+    }
+    will_return (__wrap_tcti_tabrmd_proxy_new_for_bus_sync, proxy [0]);
+    will_return (__wrap_g_dbus_proxy_call_with_unix_fd_list_sync, 2);
+    will_return (__wrap_g_dbus_proxy_call_with_unix_fd_list_sync, fds [0][0]);
+    will_return (__wrap_g_dbus_proxy_call_with_unix_fd_list_sync, 11);
+    will_return (__wrap_g_dbus_proxy_call_with_unix_fd_list_sync, fds [1][0]);
+    will_return (__wrap_g_dbus_proxy_call_with_unix_fd_list_sync, 22);
+    rc = Tss2_Tcti_Tabrmd_Init (context [0],
+                                &tcti_size,
+                                "bus_type=session,pool=2");
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (TSS2_TCTI_TABRMD_ID (context [0]), 11);
+
+    will_return (__wrap_tcti_tabrmd_proxy_new_for_bus_sync, proxy [1]);
+    rc = Tss2_Tcti_Tabrmd_Init (context [1],
+                                &tcti_size,
+                                "bus_type=session,pool=2");
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (TSS2_TCTI_TABRMD_ID (context [1]), 22);
+
+    for (i = 0; i < 2; ++i) {
+        tss2_tcti_tabrmd_finalize (context [i]);
+        close (fds [i][1]);
+        free (context [i]);
+        free (proxy [i]);
+    }
+}
+/*
+ * Two contexts for the same daemon share a proxy: the second Init doesn't
+ * create one, the mock would fail the test if it were called. The proxy
+ * goes away with the last context.
+ */
+static void
+tcti_tabrmd_init_shared_proxy_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context [2];
+    GObject *proxy = g_object_new (G_TYPE_OBJECT, NULL);
+    size_t tcti_size = 0;
+    gint fds [2][2];
+    TSS2_RC rc;
+    size_t i;
+    UNUSED_PARAM(state);
+
+    rc = Tss2_Tcti_Tabrmd_Init (NULL, &tcti_size, NULL);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    g_object_add_weak_pointer (proxy, (gpointer*)&proxy);
+    will_return (__wrap_tcti_tabrmd_proxy_new_for_bus_sync, proxy);
+    for (i = 0; i < 2; ++i) {
+        context [i] = calloc (1, tcti_size);
+        assert_int_equal (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds [i]), 0);
+        will_return (__wrap_g_dbus_proxy_call_with_unix_fd_list_sync,
+                     fds [i][0]);
+        will_return (__wrap_g_dbus_proxy_call_with_unix_fd_list_sync, i + 1);
+        rc = Tss2_Tcti_Tabrmd_Init (context [i], &tcti_size, "bus_type=session");
+        assert_int_equal (rc, TSS2_RC_SUCCESS);
+    }
+    assert_ptr_equal (TSS2_TCTI_TABRMD_PROXY (context [0]), proxy);
+    assert_ptr_equal (TSS2_TCTI_TABRMD_PROXY (context [1]), proxy);
+
+    for (i = 0; i < 2; ++i) {
+        tss2_tcti_tabrmd_finalize (context [i]);
+        close (fds [i][1]);
+        free (context [i]);
+    }
+    assert_null (proxy);
+}
+/*
+ * Ensure that the "pool" key sets the pool size and that sizes over the
+ * daemon's limit return the BAD_VALUE RC.
+ */
+static void
+tcti_tabrmd_kv_callback_pool_test (void **state)
+{
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    key_value_t key_value = {
+        .key = "pool",
+        .value = "4",
+    };
+    TSS2_RC rc;
+    UNUSED_PARAM(state);
+
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (conf.pool, 4);
+    key_value.value = "17";
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (conf.pool, 4);
+}
+/*
+ * Ensure that the "socket" key sets the socket address and that empty or
+ * too long addresses return the BAD_VALUE RC.
+ */
+static void
+tcti_tabrmd_kv_callback_socket_test (void **state)
+{
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    gchar long_address [TABRMD_SOCKET_ADDRESS_MAX + 1];
+    key_value_t key_value = {
+        .key = "socket",
+        .value = "@tabrmd",
+    };
+    TSS2_RC rc;
+    UNUSED_PARAM(state);
+
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_string_equal (conf.socket, "@tabrmd");
+    key_value.value = "";
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    memset (long_address, 'a', TABRMD_SOCKET_ADDRESS_MAX);
+    long_address [TABRMD_SOCKET_ADDRESS_MAX] = '\0';
+    key_value.value = long_address;
+    rc = tabrmd_kv_callback (&key_value, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    assert_string_equal (conf.socket, "@tabrmd");
+}
 int
 main (void)
 {
@@ -880,6 +1310,13 @@ main (void)
         cmocka_unit_test (tcti_tabrmd_kv_callback_type_good_test),
         cmocka_unit_test (tcti_tabrmd_kv_callback_type_bad_test),
         cmocka_unit_test (tcti_tabrmd_kv_callback_bad_key_test),
+        cmocka_unit_test (tcti_tabrmd_kv_callback_tpm_good_test),
+        cmocka_unit_test (tcti_tabrmd_kv_callback_tpm_bad_test),
+        cmocka_unit_test (tcti_tabrmd_kv_callback_transport_test),
+        cmocka_unit_test (tcti_tabrmd_kv_callback_pool_test),
+        cmocka_unit_test (tcti_tabrmd_kv_callback_socket_test),
+        cmocka_unit_test (tcti_tabrmd_init_pool_test),
+        cmocka_unit_test (tcti_tabrmd_init_shared_proxy_test),
         cmocka_unit_test (tcti_tabrmd_conf_parse_named_session_test),
         cmocka_unit_test (tcti_tabrmd_conf_parse_named_system_test),
         cmocka_unit_test (tcti_tabrmd_conf_parse_bad_type_test),
@@ -900,6 +1337,9 @@ main (void)
         cmocka_unit_test_setup_teardown (tcti_tabrmd_transmit_success_test,
                                          tcti_tabrmd_setup,
                                          tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_submit_batch_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
         cmocka_unit_test_setup_teardown (tcti_tabrmd_transmit_bad_magic_test,
                                          tcti_tabrmd_setup,
                                          tcti_tabrmd_teardown),
@@ -933,6 +1373,18 @@ main (void)
         cmocka_unit_test_setup_teardown (tcti_tabrmd_set_locality_test,
                                          tcti_tabrmd_setup,
                                          tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_set_locality_control_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_set_command_timeout_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_set_trace_parent_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_channel_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
         cmocka_unit_test_setup_teardown (tcti_tabrmd_set_locality_bad_sequence_test,
                                          tcti_tabrmd_receive_setup,
                                          tcti_tabrmd_teardown),
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "fair-queue.h"
+#include "tunables.h"
+#include "util.h"
+
+/*
+ * Values of each type come out as given, the ones not given aren't set.
+ */
+static void
+tunables_new_from_variant_test (void **state)
+{
+    GVariantBuilder builder, weights;
+    Tunables *tunables;
+    GError *error = NULL;
+    guint value;
+    UNUSED_PARAM (state);
+
+    g_variant_builder_init (&weights, G_VARIANT_TYPE ("a{uu}"));
+    g_variant_builder_add (&weights, "{uu}", 1000, 4);
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder, "{sv}", "queue-depth",
+                           g_variant_new_uint32 (32));
+    g_variant_builder_add (&builder, "{sv}", "max-memory",
+                           g_variant_new_uint32 (0));
+    g_variant_builder_add (&builder, "{sv}", "scheduler",
+                           g_variant_new_string ("shortest-first"));
+    g_variant_builder_add (&builder, "{sv}", "pcr-cache",
+                           g_variant_new_boolean (TRUE));
+    g_variant_builder_add (&builder, "{sv}", "uid-weights",
+                           g_variant_builder_end (&weights));
+    tunables = tunables_new_from_variant (g_variant_builder_end (&builder),
+                                          &error);
+    assert_non_null (tunables);
+    assert_null (error);
+    assert_true (tunables_get (tunables, TUNABLE_QUEUE_DEPTH, &value));
+    assert_int_equal (value, 32);
+    assert_true (tunables_get (tunables, TUNABLE_MAX_MEMORY, &value));
+    assert_int_equal (value, 0);
+    assert_true (tunables_get (tunables, TUNABLE_SCHEDULER, &value));
+    assert_int_equal (value, FAIR_QUEUE_POLICY_SHORTEST_FIRST);
+    assert_true (tunables_get (tunables, TUNABLE_PCR_CACHE, &value));
+    assert_int_equal (value, 1);
+    assert_false (tunables_get (tunables, TUNABLE_RATE_LIMIT, &value));
+    assert_null (tunables->uid_rate_limits);
+    assert_int_equal (GPOINTER_TO_UINT (g_hash_table_lookup (tunables->uid_weights,
+                                                             GUINT_TO_POINTER (1000))),
+                      4);
+    g_object_unref (tunables);
+}
+/*
+ * One bad entry, be it an unknown name, the wrong type or a value out of
+ * bounds, refuses the lot.
+ */
+static void
+tunables_new_from_variant_bad_test (void **state)
+{
+    const gchar *names [] = { "no-such-option", "queue-spin", "max-memory" };
+    GVariant *values [3];
+    GVariantBuilder builder;
+    GError *error = NULL;
+    size_t i;
+    UNUSED_PARAM (state);
+
+    values [0] = g_variant_new_uint32 (1);
+    values [1] = g_variant_new_uint32 (G_MAXUINT32);
+    values [2] = g_variant_new_string ("1024");
+    for (i = 0; i < G_N_ELEMENTS (names); ++i) {
+        g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+        g_variant_builder_add (&builder, "{sv}", "queue-depth",
+                               g_variant_new_uint32 (32));
+        g_variant_builder_add (&builder, "{sv}", names [i], values [i]);
+        assert_null (tunables_new_from_variant (g_variant_builder_end (&builder),
+                                                &error));
+        assert_non_null (error);
+        g_clear_error (&error);
+    }
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (tunables_new_from_variant_test),
+        cmocka_unit_test (tunables_new_from_variant_bad_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
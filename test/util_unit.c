@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include <setjmp.h>
 #include <cmocka.h>
@@ -211,6 +213,31 @@ create_socket_pair_success_test (void **state)
     close (client_fd);
 }
 
+/*
+ * Each write to a SOCK_SEQPACKET socket pair is read back as a message of
+ * its own, even when both are pending.
+ */
+static void
+create_socket_pair_seqpacket_test (void **state)
+{
+    int ret, client_fd, server_fd;
+    uint8_t buf [16] = { 0 };
+    UNUSED_PARAM(state);
+
+    ret = create_socket_pair_type (&client_fd,
+                                   &server_fd,
+                                   SOCK_SEQPACKET,
+                                   SOCK_CLOEXEC);
+    assert_int_equal (ret, 0);
+    assert_int_equal (write (client_fd, "abc", 3), 3);
+    assert_int_equal (write (client_fd, "defgh", 5), 5);
+    assert_int_equal (read (server_fd, buf, sizeof (buf)), 3);
+    assert_memory_equal (buf, "abc", 3);
+    assert_int_equal (read (server_fd, buf, sizeof (buf)), 5);
+    assert_memory_equal (buf, "defgh", 5);
+    close (client_fd);
+    close (server_fd);
+}
 /*
  * Simple call to read wrapper function. Returns exactly what we ask for.
  * We check to be sure return value is 0, the index variable is updated
@@ -669,7 +696,225 @@ read_tpm_buf_alloc_eof_test (void **state)
     assert_null (buf);
 }
 
-gint
+/*
+ * Build a read buffer holding 'count' copies of a 16 byte command.
+ */
+#define READ_BUFFER_CMD_SIZE 16
+static void
+read_buffer_prime (read_buffer_t *rbuf,
+                   size_t         count)
+{
+    size_t i;
+
+    rbuf->data = g_malloc0 (UTIL_BUF_MAX);
+    rbuf->start = 0;
+    rbuf->len = 0;
+    for (i = 0; i < count; ++i) {
+        set_response_tag (&rbuf->data [rbuf->len], TPM2_ST_NO_SESSIONS);
+        set_response_size (&rbuf->data [rbuf->len], READ_BUFFER_CMD_SIZE);
+        rbuf->data [rbuf->len + READ_BUFFER_CMD_SIZE - 1] = (uint8_t)i;
+        rbuf->len += READ_BUFFER_CMD_SIZE;
+    }
+}
+/*
+ * A buffer holding exactly one command is handed over without a copy.
+ */
+static void
+read_buffer_take_one_test (void **state)
+{
+    read_buffer_t rbuf;
+    uint8_t *data, *buf;
+    size_t buf_size = 0;
+    int error;
+    UNUSED_PARAM(state);
+
+    read_buffer_prime (&rbuf, 1);
+    data = rbuf.data;
+    buf = read_buffer_take (&rbuf, &buf_size, &error);
+    assert_ptr_equal (buf, data);
+    assert_int_equal (buf_size, READ_BUFFER_CMD_SIZE);
+    assert_int_equal (error, 0);
+    assert_null (rbuf.data);
+    assert_int_equal (rbuf.len, 0);
+    g_free (buf);
+}
+/*
+ * Several buffered commands are taken in order.
+ */
+static void
+read_buffer_take_two_test (void **state)
+{
+    read_buffer_t rbuf;
+    uint8_t *buf;
+    size_t buf_size = 0;
+    int error;
+    UNUSED_PARAM(state);
+
+    read_buffer_prime (&rbuf, 2);
+    buf = read_buffer_take (&rbuf, &buf_size, &error);
+    assert_non_null (buf);
+    assert_int_equal (buf [READ_BUFFER_CMD_SIZE - 1], 0);
+    g_free (buf);
+    buf = read_buffer_take (&rbuf, &buf_size, &error);
+    assert_non_null (buf);
+    assert_int_equal (buf [READ_BUFFER_CMD_SIZE - 1], 1);
+    g_free (buf);
+    assert_null (read_buffer_take (&rbuf, &buf_size, &error));
+    assert_int_equal (error, 0);
+    read_buffer_clear (&rbuf);
+}
+/*
+ * A partial header or body stays in the buffer.
+ */
+static void
+read_buffer_take_partial_test (void **state)
+{
+    read_buffer_t rbuf;
+    size_t buf_size = 0;
+    int error;
+    UNUSED_PARAM(state);
+
+    read_buffer_prime (&rbuf, 1);
+    rbuf.len = TPM_HEADER_SIZE - 1;
+    assert_null (read_buffer_take (&rbuf, &buf_size, &error));
+    assert_int_equal (error, 0);
+    rbuf.len = READ_BUFFER_CMD_SIZE - 1;
+    assert_null (read_buffer_take (&rbuf, &buf_size, &error));
+    assert_int_equal (error, 0);
+    assert_int_equal (rbuf.len, READ_BUFFER_CMD_SIZE - 1);
+    read_buffer_clear (&rbuf);
+}
+/*
+ * A header with a size larger than UTIL_BUF_MAX is a protocol error.
+ */
+static void
+read_buffer_take_too_big_test (void **state)
+{
+    read_buffer_t rbuf;
+    size_t buf_size = 0;
+    int error;
+    UNUSED_PARAM(state);
+
+    read_buffer_prime (&rbuf, 1);
+    set_response_size (rbuf.data, UTIL_BUF_MAX + 1);
+    assert_null (read_buffer_take (&rbuf, &buf_size, &error));
+    assert_int_equal (error, EPROTO);
+    read_buffer_clear (&rbuf);
+}
+/*
+ * Tagged commands are taken with their tags, and a partial tagged command
+ * stays in the buffer.
+ */
+static void
+read_buffer_take_tagged_test (void **state)
+{
+    read_buffer_t rbuf = { 0, };
+    uint8_t *buf;
+    size_t buf_size = 0, i;
+    uint32_t tag = 0;
+    int error;
+    UNUSED_PARAM(state);
+
+    rbuf.data = g_malloc0 (UTIL_BUF_MAX);
+    for (i = 0; i < 2; ++i) {
+        *(uint32_t*)&rbuf.data [rbuf.len] = htobe32 (0x100 + i);
+        rbuf.len += TABRMD_REQUEST_TAG_SIZE;
+        set_response_tag (&rbuf.data [rbuf.len], TPM2_ST_NO_SESSIONS);
+        set_response_size (&rbuf.data [rbuf.len], READ_BUFFER_CMD_SIZE);
+        rbuf.len += READ_BUFFER_CMD_SIZE;
+    }
+    rbuf.len -= 1;
+    buf = read_buffer_take_tagged (&rbuf, &tag, &buf_size, &error);
+    assert_non_null (buf);
+    assert_int_equal (tag, 0x100);
+    assert_int_equal (buf_size, READ_BUFFER_CMD_SIZE);
+    assert_int_equal (get_command_size (buf), READ_BUFFER_CMD_SIZE);
+    g_free (buf);
+    assert_null (read_buffer_take_tagged (&rbuf, &tag, &buf_size, &error));
+    assert_int_equal (error, 0);
+    rbuf.len += 1;
+    buf = read_buffer_take_tagged (&rbuf, &tag, &buf_size, &error);
+    assert_non_null (buf);
+    assert_int_equal (tag, 0x101);
+    assert_int_equal (rbuf.len, 0);
+    /* drained: the memory is released already, clearing is a no-op */
+    assert_null (rbuf.data);
+    g_free (buf);
+    read_buffer_clear (&rbuf);
+}
+/*
+ * read_buffer_fill gets everything the client has written in one read and
+ * reports EOF once the client is gone.
+ */
+static void
+read_buffer_fill_test (void **state)
+{
+    read_buffer_t rbuf = { 0, };
+    read_buffer_t expected;
+    GIOStream *iostream;
+    GInputStream *istream;
+    gint client_fd;
+    UNUSED_PARAM(state);
+
+    read_buffer_prime (&expected, 3);
+    iostream = create_connection_iostream (&client_fd);
+    istream = g_io_stream_get_input_stream (iostream);
+    assert_int_equal (write (client_fd, expected.data, expected.len),
+                      expected.len);
+    assert_int_equal (read_buffer_fill (istream, &rbuf), 0);
+    assert_int_equal (rbuf.len, expected.len);
+    assert_memory_equal (rbuf.data, expected.data, expected.len);
+    /* nothing more to read doesn't block */
+    assert_int_equal (read_buffer_fill (istream, &rbuf), 0);
+    assert_int_equal (rbuf.len, expected.len);
+    close (client_fd);
+    assert_int_equal (read_buffer_fill (istream, &rbuf), -1);
+
+    read_buffer_clear (&rbuf);
+    read_buffer_clear (&expected);
+    g_object_unref (iostream);
+}
+
+/*
+ * A byte array holding a marshalled TPMS_CONTEXT comes back as it is, one
+ * whose contextBlob doesn't end where the array does is refused.
+ */
+static void
+context_blob_from_variant_test (void **state)
+{
+    guint8 buf [] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, /* sequence */
+        0x80, 0x00, 0x00, 0x01,                         /* savedHandle */
+        0x40, 0x00, 0x00, 0x01,                         /* hierarchy */
+        0x00, 0x04, 0x01, 0x02, 0x03, 0x04,             /* contextBlob */
+    };
+    GVariant *variant;
+    GBytes *context;
+    UNUSED_PARAM (state);
+
+    variant = g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, buf,
+                                         sizeof (buf), 1);
+    g_variant_ref_sink (variant);
+    context = context_blob_from_variant (variant);
+    assert_non_null (context);
+    assert_int_equal (g_bytes_get_size (context), sizeof (buf));
+    assert_memory_equal (g_bytes_get_data (context, NULL), buf, sizeof (buf));
+    assert_int_equal (context_blob_saved_handle (context), 0x80000001);
+    g_bytes_unref (context);
+    g_variant_unref (variant);
+
+    variant = g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, buf,
+                                         sizeof (buf) - 1, 1);
+    g_variant_ref_sink (variant);
+    assert_null (context_blob_from_variant (variant));
+    g_variant_unref (variant);
+
+    variant = g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, buf, 1, 1);
+    g_variant_ref_sink (variant);
+    assert_null (context_blob_from_variant (variant));
+    g_variant_unref (variant);
+}
+int
 main (void)
 {
     const struct CMUnitTest tests[] = {
@@ -679,6 +924,7 @@ main (void)
         cmocka_unit_test (write_error),
         cmocka_unit_test (write_zero),
         cmocka_unit_test (create_socket_pair_success_test),
+        cmocka_unit_test (create_socket_pair_seqpacket_test),
         /* read_data tests */
         cmocka_unit_test_setup_teardown (read_data_success_test,
                                          read_data_setup,
@@ -733,6 +979,14 @@ main (void)
         cmocka_unit_test_setup_teardown (read_tpm_buf_alloc_eof_test,
                                          read_data_setup,
                                          read_data_teardown),
+        /* read_buffer tests */
+        cmocka_unit_test (read_buffer_take_one_test),
+        cmocka_unit_test (read_buffer_take_two_test),
+        cmocka_unit_test (read_buffer_take_partial_test),
+        cmocka_unit_test (read_buffer_take_tagged_test),
+        cmocka_unit_test (read_buffer_take_too_big_test),
+        cmocka_unit_test (read_buffer_fill_test),
+        cmocka_unit_test (context_blob_from_variant_test),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }